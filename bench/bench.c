@@ -0,0 +1,307 @@
+/* Microbenchmarks for the data processing kernels used during installation.
+ *
+ * Each benchmark is run repeatedly and the best run is reported, to reduce
+ * the influence of other system activity. The input data is generated from a
+ * fixed seed, so the results are comparable between runs and machines. The
+ * results are printed as JSON to stdout.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <locale.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "checksum.h"
+#include "crypt.h"
+#include "hash_index.h"
+#include "utils.h"
+#include "verity_hash.h"
+
+#define BENCH_SEED 0x72617563
+
+static gint size_mib = 64;
+static gint repeat = 3;
+static gint max_chunks_log2 = 23;
+static gchar *filter = NULL;
+
+static gchar *tmpdir = NULL;
+static GString *results = NULL;
+
+static void fill_random(guint8 *data, gsize size, guint32 seed)
+{
+	g_autoptr(GRand) rand = g_rand_new_with_seed(seed);
+
+	for (gsize i = 0; i < size / sizeof(guint32); i++) {
+		guint32 value = g_rand_int(rand);
+		memcpy(data + i * sizeof(guint32), &value, sizeof(value));
+	}
+}
+
+static gchar *write_input_file(const gchar *name, gsize size)
+{
+	g_autofree gchar *path = g_build_filename(tmpdir, name, NULL);
+	g_autofree guint8 *data = g_malloc(size);
+	g_autoptr(GError) error = NULL;
+
+	fill_random(data, size, BENCH_SEED);
+	if (!g_file_set_contents(path, (const gchar *)data, size, &error))
+		g_error("Failed to write %s: %s", path, error->message);
+
+	return g_steal_pointer(&path);
+}
+
+static gboolean bench_enabled(const gchar *name)
+{
+	return !filter || g_str_has_prefix(name, filter);
+}
+
+static void report(const gchar *name, const gchar *unit, gdouble value, guint64 param)
+{
+	if (results->len)
+		g_string_append(results, ",\n");
+	g_string_append_printf(results,
+			"    {\"name\": \"%s\", \"param\": %"G_GUINT64_FORMAT ", \"unit\": \"%s\", \"value\": %.3f}",
+			name, param, unit, value);
+	g_printerr("%-24s %12"G_GUINT64_FORMAT " %12.3f %s\n", name, param, value, unit);
+}
+
+static gdouble mb_per_s(guint64 bytes, gint64 usec)
+{
+	return (gdouble)bytes / MAX(usec, 1);
+}
+
+static void bench_hash_chunks(void)
+{
+	gsize size = (gsize)size_mib * 1024 * 1024;
+	guint32 count = size / R_HASH_INDEX_CHUNK_SIZE;
+	g_autofree guint8 *data = g_malloc(size);
+	g_autofree guint8 *hashes = g_malloc((gsize)count * 32);
+	gint64 best = G_MAXINT64;
+
+	fill_random(data, size, BENCH_SEED);
+
+	for (gint i = 0; i < repeat; i++) {
+		gint64 start = g_get_monotonic_time();
+		r_hash_index_hash_chunks(data, count, hashes);
+		best = MIN(best, g_get_monotonic_time() - start);
+	}
+	report("hash_chunks", "MB/s", mb_per_s(size, best), size);
+
+	/* zero chunks are detected instead of hashed */
+	memset(data, 0, size);
+	best = G_MAXINT64;
+	for (gint i = 0; i < repeat; i++) {
+		gint64 start = g_get_monotonic_time();
+		r_hash_index_hash_chunks(data, count, hashes);
+		best = MIN(best, g_get_monotonic_time() - start);
+	}
+	report("hash_chunks_zero", "MB/s", mb_per_s(size, best), size);
+}
+
+static void bench_lookup_one(guint32 count)
+{
+	gsize hashes_size = (gsize)count * 32;
+	guint8 *hashes_data = g_malloc(hashes_size);
+	g_autoptr(GBytes) hashes = NULL;
+	g_autofree gchar *data_path = g_build_filename(tmpdir, "lookup.img", NULL);
+	g_auto(filedesc) data_fd = -1;
+	g_autoptr(GRand) rand = g_rand_new_with_seed(BENCH_SEED);
+	const guint32 queries = 1000000;
+	const guint32 missing_count = 65536;
+	g_autofree guint8 *missing = g_malloc((gsize)missing_count * 32);
+	gint64 best_build = G_MAXINT64, best_hit = G_MAXINT64, best_miss = G_MAXINT64;
+
+	/* the hashes only need to be uniformly distributed */
+	fill_random(hashes_data, hashes_size, BENCH_SEED);
+	fill_random(missing, (gsize)missing_count * 32, ~BENCH_SEED);
+	hashes = g_bytes_new_take(hashes_data, hashes_size);
+
+	/* the index only needs the size of the data, so a sparse file is used */
+	data_fd = g_open(data_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (data_fd < 0 || ftruncate(data_fd, (off_t)count * R_HASH_INDEX_CHUNK_SIZE) != 0)
+		g_error("Failed to create %s: %s", data_path, g_strerror(errno));
+	g_unlink(data_path);
+
+	for (gint i = 0; i < repeat; i++) {
+		g_autoptr(RaucHashIndex) idx = NULL;
+		g_autoptr(GError) error = NULL;
+		gint64 start, end;
+		guint32 number;
+
+		start = g_get_monotonic_time();
+		idx = r_hash_index_new_from_hashes("bench", data_fd, hashes, &error);
+		end = g_get_monotonic_time();
+		if (!idx)
+			g_error("Failed to build index: %s", error->message);
+		best_build = MIN(best_build, end - start);
+
+		start = g_get_monotonic_time();
+		for (guint32 q = 0; q < queries; q++) {
+			guint32 chunk = g_rand_int_range(rand, 0, count);
+			if (!r_hash_index_find_chunk(idx, hashes_data + (gsize)chunk * 32, &number, NULL))
+				g_error("Failed to find chunk %"G_GUINT32_FORMAT, chunk);
+		}
+		best_hit = MIN(best_hit, g_get_monotonic_time() - start);
+
+		start = g_get_monotonic_time();
+		for (guint32 q = 0; q < queries; q++)
+			(void)r_hash_index_find_chunk(idx, missing + (gsize)(q % missing_count) * 32, &number, NULL);
+		best_miss = MIN(best_miss, g_get_monotonic_time() - start);
+	}
+
+	report("lookup_build", "ns/chunk", best_build * 1000.0 / count, count);
+	report("lookup_query_hit", "ns/op", best_hit * 1000.0 / queries, count);
+	report("lookup_query_miss", "ns/op", best_miss * 1000.0 / queries, count);
+}
+
+static void bench_lookup(void)
+{
+	for (gint bits = 16; bits <= max_chunks_log2; bits++)
+		bench_lookup_one(1U << bits);
+}
+
+static void bench_verity(void)
+{
+	gsize size = (gsize)size_mib * 1024 * 1024;
+	g_autofree gchar *path = write_input_file("verity.img", size);
+	const guint8 salt[32] = {0};
+	gint64 best = G_MAXINT64;
+
+	for (gint i = 0; i < repeat; i++) {
+		g_auto(filedesc) fd = g_open(path, O_RDWR | O_CLOEXEC, 0);
+		guint8 root_hash[32];
+		guint64 combined_blocks;
+		gint64 start;
+
+		if (fd < 0 || ftruncate(fd, size) != 0)
+			g_error("Failed to open %s: %s", path, g_strerror(errno));
+
+		start = g_get_monotonic_time();
+		if (r_verity_hash_create(fd, size / 4096, &combined_blocks, root_hash, salt) != 0)
+			g_error("Failed to create verity hash tree");
+		best = MIN(best, g_get_monotonic_time() - start);
+	}
+	report("verity_create", "MB/s", mb_per_s(size, best), size);
+
+	g_unlink(path);
+}
+
+static void bench_crypt(void)
+{
+	gsize size = (gsize)size_mib * 1024 * 1024;
+	g_autofree gchar *in = write_input_file("crypt.img", size);
+	g_autofree gchar *out = g_build_filename(tmpdir, "crypt.enc", NULL);
+	guint8 key[32];
+	gint64 best = G_MAXINT64;
+
+	fill_random(key, sizeof(key), BENCH_SEED);
+
+	for (gint i = 0; i < repeat; i++) {
+		g_autoptr(GError) error = NULL;
+		gint64 start;
+
+		g_unlink(out);
+		start = g_get_monotonic_time();
+		if (!r_crypt_encrypt(in, out, key, &error))
+			g_error("Failed to encrypt: %s", error->message);
+		best = MIN(best, g_get_monotonic_time() - start);
+	}
+	report("crypt_encrypt", "MB/s", mb_per_s(size, best), size);
+
+	g_unlink(out);
+	g_unlink(in);
+}
+
+static void bench_checksum(void)
+{
+	gsize size = (gsize)size_mib * 1024 * 1024;
+	g_autofree gchar *path = write_input_file("checksum.img", size);
+	gint64 best = G_MAXINT64;
+
+	for (gint i = 0; i < repeat; i++) {
+		RaucChecksum checksum = {.type = G_CHECKSUM_SHA256};
+		g_autoptr(GError) error = NULL;
+		gint64 start;
+
+		start = g_get_monotonic_time();
+		if (!compute_checksum(&checksum, path, &error))
+			g_error("Failed to compute checksum: %s", error->message);
+		best = MIN(best, g_get_monotonic_time() - start);
+		g_free(checksum.digest);
+	}
+	report("checksum_sha256", "MB/s", mb_per_s(size, best), size);
+
+	g_unlink(path);
+}
+
+static const struct {
+	const gchar *name;
+	void (*func)(void);
+} benchmarks[] = {
+	{"hash_chunks", bench_hash_chunks},
+	{"lookup", bench_lookup},
+	{"verity", bench_verity},
+	{"crypt", bench_crypt},
+	{"checksum", bench_checksum},
+};
+
+int main(int argc, char *argv[])
+{
+	GOptionEntry entries[] = {
+		{"size", 's', 0, G_OPTION_ARG_INT, &size_mib, "input size for throughput benchmarks in MiB (default 64)", "MIB"},
+		{"repeat", 'r', 0, G_OPTION_ARG_INT, &repeat, "number of runs per benchmark (default 3)", "N"},
+		{"max-chunks-log2", 0, 0, G_OPTION_ARG_INT, &max_chunks_log2, "largest index for lookup benchmarks as power of two (default 23)", "BITS"},
+		{"filter", 'f', 0, G_OPTION_ARG_STRING, &filter, "only run benchmarks starting with PREFIX", "PREFIX"},
+		{0}
+	};
+	g_autoptr(GOptionContext) context = NULL;
+	g_autoptr(GError) error = NULL;
+	struct utsname uts;
+
+	setlocale(LC_ALL, "C");
+
+	context = g_option_context_new("- RAUC microbenchmarks");
+	g_option_context_add_main_entries(context, entries, NULL);
+	if (!g_option_context_parse(context, &argc, &argv, &error)) {
+		g_printerr("%s\n", error->message);
+		return 1;
+	}
+	if (size_mib <= 0 || repeat <= 0 || max_chunks_log2 < 16 || max_chunks_log2 > 26) {
+		g_printerr("Invalid arguments\n");
+		return 1;
+	}
+
+	tmpdir = g_dir_make_tmp("rauc-bench-XXXXXX", &error);
+	if (!tmpdir) {
+		g_printerr("%s\n", error->message);
+		return 1;
+	}
+
+	results = g_string_new(NULL);
+	for (guint i = 0; i < G_N_ELEMENTS(benchmarks); i++) {
+		if (bench_enabled(benchmarks[i].name))
+			benchmarks[i].func();
+	}
+
+	if (uname(&uts) != 0)
+		g_strlcpy(uts.machine, "unknown", sizeof(uts.machine));
+
+	g_print("{\n"
+			"  \"version\": \"%s\",\n"
+			"  \"machine\": \"%s\",\n"
+			"  \"repeat\": %d,\n"
+			"  \"results\": [\n%s\n  ]\n"
+			"}\n",
+			PACKAGE_VERSION, uts.machine, repeat, results->str);
+
+	g_string_free(results, TRUE);
+	g_rmdir(tmpdir);
+	g_free(tmpdir);
+
+	return 0;
+}
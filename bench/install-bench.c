@@ -0,0 +1,1023 @@
+/* End-to-end installation benchmark.
+ *
+ * Generates a pair of images (the old one installed on both slots, the new
+ * one in the bundle) where a controlled fraction of the 4 KiB chunks is
+ * changed, zeroed or moved, builds a signed bundle and installs it with
+ * do_install_bundle(), either from a local file or by streaming from an HTTP
+ * server. For each run, the wall time, CPU time, peak RSS and the bytes read
+ * and written (per process and per block device) are reported as JSON.
+ *
+ * For streaming, network emulation profiles (RTT, bandwidth and packet loss)
+ * can be applied with netem on the loopback interface, and the NBD read
+ * request and HTTP download size distributions of the streaming subprocess
+ * are reported as well.
+ *
+ * This needs to run as root, as the bundle is mounted and the slots may be
+ * loop or null_blk devices. Use the qemu-test environment when developing.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <locale.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#include <gio/gio.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "bundle.h"
+#include "context.h"
+#include "install.h"
+#include "nbd.h"
+#include "stats.h"
+#include "utils.h"
+
+#define CHUNK_SIZE 4096
+#define COPY_BUFFER_SIZE (1024*1024)
+
+static gint size_mib = 64;
+static gdouble changed_frac = 0.1;
+static gdouble zero_frac = 0.0;
+static gdouble moved_frac = 0.0;
+static gchar *image_variant = NULL;
+static gboolean adaptive = FALSE;
+static gchar *slot_variant = NULL;
+static gchar *url = NULL;
+static gchar *url_dir = NULL;
+static gint repeat = 3;
+static gboolean drop_caches = FALSE;
+static gchar **netem_profiles = NULL;
+static gchar *netem_dev = NULL;
+static gchar *keyring = NULL;
+static gchar *cert = NULL;
+static gchar *key = NULL;
+
+typedef struct {
+	gchar *file; /* backing file, or NULL */
+	gchar *device; /* path used in the system.conf */
+	gboolean loop; /* whether device is a loop device for file */
+} BenchSlot;
+
+typedef struct {
+	const gchar *name;
+	const gchar *rtt;
+	const gchar *rate;
+	const gchar *loss;
+} NetemProfile;
+
+static const NetemProfile netem_presets[] = {
+	{"ethernet", "1ms", "1gbit", "0%"},
+	{"lte", "60ms", "20mbit", "0.1%"},
+	{"satellite", "600ms", "10mbit", "0.5%"},
+};
+
+typedef struct {
+	gchar *name;
+	guint64 read_sectors;
+	guint64 write_sectors;
+} BenchDevice;
+
+/* splitmix64, which is fast and good enough for incompressible test data */
+static guint64 next_random(guint64 *state)
+{
+	guint64 z = (*state += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static void fill_chunk(guint8 *chunk, guint64 seed)
+{
+	guint64 state = seed;
+
+	for (gsize i = 0; i < CHUNK_SIZE; i += sizeof(guint64)) {
+		guint64 value = next_random(&state);
+		memcpy(chunk + i, &value, sizeof(value));
+	}
+}
+
+static gboolean write_images(const gchar *old_path, const gchar *new_path, guint64 size, GError **error)
+{
+	GError *ierror = NULL;
+	g_auto(filedesc) old_fd = -1;
+	g_auto(filedesc) new_fd = -1;
+	g_autofree guint8 *old_chunk = g_malloc(CHUNK_SIZE);
+	g_autofree guint8 *new_chunk = g_malloc(CHUNK_SIZE);
+	guint64 chunks = size / CHUNK_SIZE;
+	guint64 state = 0x72617563;
+
+	old_fd = g_open(old_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	new_fd = g_open(new_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (old_fd < 0 || new_fd < 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to create images: %s", g_strerror(err));
+		return FALSE;
+	}
+
+	for (guint64 i = 0; i < chunks; i++) {
+		gdouble r = (next_random(&state) >> 11) * (1.0 / 9007199254740992.0);
+
+		fill_chunk(old_chunk, i);
+
+		if (r < zero_frac)
+			memset(new_chunk, 0, CHUNK_SIZE);
+		else if (r < zero_frac + changed_frac)
+			fill_chunk(new_chunk, i + chunks);
+		else if (r < zero_frac + changed_frac + moved_frac)
+			fill_chunk(new_chunk, next_random(&state) % chunks);
+		else
+			memcpy(new_chunk, old_chunk, CHUNK_SIZE);
+
+		if (!r_write_exact(old_fd, old_chunk, CHUNK_SIZE, &ierror) ||
+		    !r_write_exact(new_fd, new_chunk, CHUNK_SIZE, &ierror)) {
+			g_propagate_prefixed_error(error, ierror, "Failed to write images: ");
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static gboolean run_command(GPtrArray *args, gchar **output, GError **error)
+{
+	g_autoptr(GSubprocessLauncher) launcher = NULL;
+	g_autoptr(GSubprocess) sproc = NULL;
+	GError *ierror = NULL;
+
+	g_ptr_array_add(args, NULL);
+
+	launcher = g_subprocess_launcher_new(output ? G_SUBPROCESS_FLAGS_STDOUT_PIPE : G_SUBPROCESS_FLAGS_NONE);
+	/* make mkfs.ext4 output reproducible */
+	g_subprocess_launcher_setenv(launcher, "E2FSPROGS_FAKE_TIME", "1", TRUE);
+
+	sproc = r_subprocess_launcher_spawnv(launcher, args, &ierror);
+	if (!sproc) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	if (!g_subprocess_communicate_utf8(sproc, NULL, NULL, output, NULL, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	if (!g_subprocess_get_if_exited(sproc) || g_subprocess_get_exit_status(sproc) != 0) {
+		g_set_error(error, G_SPAWN_ERROR, G_SPAWN_ERROR_FAILED,
+				"%s failed", (const gchar *)args->pdata[0]);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Wraps the data as a file in an ext4 filesystem. Unchanged data is stored
+ * in the same blocks, as the filesystem is created deterministically. */
+static gboolean wrap_ext4(const gchar *tmpdir, const gchar *raw_path, const gchar *ext4_path, guint64 size, GError **error)
+{
+	g_autofree gchar *root = g_build_filename(tmpdir, "ext4-root", NULL);
+	g_autofree gchar *data = g_build_filename(root, "data", NULL);
+	g_autoptr(GPtrArray) args = g_ptr_array_new_with_free_func(g_free);
+	guint64 fs_size = (size + size / 8 + 16 * 1024 * 1024) / CHUNK_SIZE * CHUNK_SIZE;
+	gboolean res;
+
+	if (g_mkdir(root, 0755) != 0 || link(raw_path, data) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to prepare ext4 contents: %s", g_strerror(err));
+		return FALSE;
+	}
+
+	g_ptr_array_add(args, g_strdup("mkfs.ext4"));
+	g_ptr_array_add(args, g_strdup("-q"));
+	g_ptr_array_add(args, g_strdup("-F"));
+	g_ptr_array_add(args, g_strdup("-b"));
+	g_ptr_array_add(args, g_strdup("4096"));
+	g_ptr_array_add(args, g_strdup("-U"));
+	g_ptr_array_add(args, g_strdup("clear"));
+	g_ptr_array_add(args, g_strdup("-E"));
+	g_ptr_array_add(args, g_strdup("hash_seed=72617563-6265-6e63-6800-000000000000,root_owner=0:0"));
+	g_ptr_array_add(args, g_strdup("-d"));
+	g_ptr_array_add(args, g_strdup(root));
+	g_ptr_array_add(args, g_strdup(ext4_path));
+	g_ptr_array_add(args, g_strdup_printf("%"G_GUINT64_FORMAT "k", fs_size / 1024));
+	res = run_command(args, NULL, error);
+
+	g_unlink(data);
+	g_rmdir(root);
+
+	return res;
+}
+
+static gboolean copy_file(const gchar *src, const gchar *dst, GError **error)
+{
+	GError *ierror = NULL;
+	g_auto(filedesc) in_fd = g_open(src, O_RDONLY | O_CLOEXEC, 0);
+	g_auto(filedesc) out_fd = g_open(dst, O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+	g_autofree guint8 *buf = g_malloc(COPY_BUFFER_SIZE);
+
+	if (in_fd < 0 || out_fd < 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to open %s or %s: %s", src, dst, g_strerror(err));
+		return FALSE;
+	}
+
+	while (TRUE) {
+		ssize_t len = TEMP_FAILURE_RETRY(read(in_fd, buf, COPY_BUFFER_SIZE));
+		if (len < 0) {
+			int err = errno;
+			g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+					"Failed to read %s: %s", src, g_strerror(err));
+			return FALSE;
+		}
+		if (len == 0)
+			break;
+		if (!r_write_exact(out_fd, buf, len, &ierror)) {
+			g_propagate_prefixed_error(error, ierror, "Failed to write %s: ", dst);
+			return FALSE;
+		}
+	}
+
+	if (fsync(out_fd) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to sync %s: %s", dst, g_strerror(err));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean slot_setup(BenchSlot *slot, const gchar *tmpdir, guint index, const gchar *image, GError **error)
+{
+	GError *ierror = NULL;
+
+	if (g_strcmp0(slot_variant, "nullblk") == 0) {
+		/* null_blk devices must be created beforehand (modprobe null_blk nr_devices=2) */
+		slot->device = g_strdup_printf("/dev/nullb%u", index);
+		if (!g_file_test(slot->device, G_FILE_TEST_EXISTS)) {
+			g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_NOENT,
+					"%s does not exist (load null_blk with nr_devices=2)", slot->device);
+			return FALSE;
+		}
+		return TRUE;
+	}
+
+	slot->file = g_strdup_printf("%s/slot-%u.img", tmpdir, index);
+	if (!copy_file(image, slot->file, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	if (g_strcmp0(slot_variant, "loop") == 0) {
+		g_autoptr(GPtrArray) args = g_ptr_array_new_with_free_func(g_free);
+		g_autofree gchar *output = NULL;
+
+		g_ptr_array_add(args, g_strdup("losetup"));
+		g_ptr_array_add(args, g_strdup("--find"));
+		g_ptr_array_add(args, g_strdup("--show"));
+		g_ptr_array_add(args, g_strdup(slot->file));
+		if (!run_command(args, &output, &ierror)) {
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
+		slot->device = g_strstrip(g_steal_pointer(&output));
+		slot->loop = TRUE;
+	} else {
+		slot->device = g_strdup(slot->file);
+	}
+
+	return TRUE;
+}
+
+/* Restores the old image, so that each run starts from the same state. */
+static gboolean slot_reset(BenchSlot *slot, const gchar *image, GError **error)
+{
+	if (!slot->file)
+		return TRUE;
+
+	return copy_file(image, slot->device, error);
+}
+
+static void slot_clear(BenchSlot *slot)
+{
+	if (slot->loop) {
+		g_autoptr(GPtrArray) args = g_ptr_array_new_with_free_func(g_free);
+		g_autoptr(GError) ierror = NULL;
+
+		g_ptr_array_add(args, g_strdup("losetup"));
+		g_ptr_array_add(args, g_strdup("-d"));
+		g_ptr_array_add(args, g_strdup(slot->device));
+		if (!run_command(args, NULL, &ierror))
+			g_warning("Failed to detach %s: %s", slot->device, ierror->message);
+	}
+	if (slot->file)
+		g_unlink(slot->file);
+	g_clear_pointer(&slot->file, g_free);
+	g_clear_pointer(&slot->device, g_free);
+}
+
+/* Returns the name of the block device containing path (or path itself, if
+ * it is a block device), or NULL. */
+static gchar *block_device_name(const gchar *path)
+{
+	g_autofree gchar *sys_path = NULL;
+	g_autofree gchar *target = NULL;
+	struct stat st;
+	dev_t dev;
+
+	if (g_stat(path, &st) != 0)
+		return NULL;
+	dev = S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev;
+	if (major(dev) == 0)
+		return NULL;
+
+	sys_path = g_strdup_printf("/sys/dev/block/%u:%u", major(dev), minor(dev));
+	target = g_file_read_link(sys_path, NULL);
+	if (!target)
+		return NULL;
+
+	return g_path_get_basename(target);
+}
+
+static void device_add(GPtrArray *devices, const gchar *path)
+{
+	g_autofree gchar *name = block_device_name(path);
+
+	if (!name)
+		return;
+
+	for (guint i = 0; i < devices->len; i++) {
+		BenchDevice *device = g_ptr_array_index(devices, i);
+		if (g_strcmp0(device->name, name) == 0)
+			return;
+	}
+
+	{
+		BenchDevice *device = g_new0(BenchDevice, 1);
+		device->name = g_steal_pointer(&name);
+		g_ptr_array_add(devices, device);
+	}
+}
+
+static void device_free(gpointer data)
+{
+	BenchDevice *device = data;
+
+	g_free(device->name);
+	g_free(device);
+}
+
+static gboolean device_read_stat(const gchar *name, guint64 *read_sectors, guint64 *write_sectors)
+{
+	g_autofree gchar *path = g_strdup_printf("/sys/class/block/%s/stat", name);
+	g_autofree gchar *contents = NULL;
+	guint64 fields[7];
+
+	if (!g_file_get_contents(path, &contents, NULL, NULL))
+		return FALSE;
+
+	/* see Documentation/block/stat.rst */
+	if (sscanf(contents, "%"G_GUINT64_FORMAT " %"G_GUINT64_FORMAT " %"G_GUINT64_FORMAT " %"G_GUINT64_FORMAT
+			" %"G_GUINT64_FORMAT " %"G_GUINT64_FORMAT " %"G_GUINT64_FORMAT,
+			&fields[0], &fields[1], &fields[2], &fields[3],
+			&fields[4], &fields[5], &fields[6]) != 7)
+		return FALSE;
+
+	*read_sectors = fields[2];
+	*write_sectors = fields[6];
+	return TRUE;
+}
+
+static void devices_snapshot(GPtrArray *devices)
+{
+	for (guint i = 0; i < devices->len; i++) {
+		BenchDevice *device = g_ptr_array_index(devices, i);
+		device_read_stat(device->name, &device->read_sectors, &device->write_sectors);
+	}
+}
+
+static void proc_io_read(guint64 *read_bytes, guint64 *write_bytes)
+{
+	g_autofree gchar *contents = NULL;
+	g_auto(GStrv) lines = NULL;
+
+	*read_bytes = 0;
+	*write_bytes = 0;
+
+	if (!g_file_get_contents("/proc/self/io", &contents, NULL, NULL))
+		return;
+
+	lines = g_strsplit(contents, "\n", -1);
+	for (gchar **line = lines; *line; line++) {
+		if (g_str_has_prefix(*line, "read_bytes: "))
+			*read_bytes = g_ascii_strtoull(*line + strlen("read_bytes: "), NULL, 10);
+		else if (g_str_has_prefix(*line, "write_bytes: "))
+			*write_bytes = g_ascii_strtoull(*line + strlen("write_bytes: "), NULL, 10);
+	}
+}
+
+/*
+ * Writes a value to a file in /proc or /sys. g_file_set_contents() can't be
+ * used for these, as it replaces the file via a temporary one.
+ */
+static gboolean write_proc_file(const gchar *path, const gchar *value, GError **error)
+{
+	g_auto(filedesc) fd = -1;
+
+	fd = g_open(path, O_WRONLY | O_CLOEXEC, 0);
+	if (fd < 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to open %s: %s", path, g_strerror(err));
+		return FALSE;
+	}
+
+	return r_write_exact(fd, (const guint8 *)value, strlen(value), error);
+}
+
+/* Resets the peak RSS, so that the setup is not included. */
+static void peak_rss_reset(void)
+{
+	g_autoptr(GError) ierror = NULL;
+
+	if (!write_proc_file("/proc/self/clear_refs", "5", &ierror))
+		g_debug("Failed to reset peak RSS: %s", ierror->message);
+}
+
+static guint64 peak_rss_kib(void)
+{
+	g_autofree gchar *contents = NULL;
+	const gchar *line;
+
+	if (!g_file_get_contents("/proc/self/status", &contents, NULL, NULL))
+		return 0;
+
+	line = strstr(contents, "VmHWM:");
+	if (!line)
+		return 0;
+
+	return g_ascii_strtoull(line + strlen("VmHWM:"), NULL, 10);
+}
+
+static gdouble timeval_s(const struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1000000.0;
+}
+
+/* Parses a preset name or 'rtt=<time>,rate=<rate>,loss=<percent>' (with
+ * values in tc syntax) split at ',' into parts. The profile refers to strings
+ * in parts. */
+static gboolean netem_parse(const gchar *spec, gchar **parts, NetemProfile *profile, GError **error)
+{
+	for (guint i = 0; i < G_N_ELEMENTS(netem_presets); i++) {
+		if (g_strcmp0(spec, netem_presets[i].name) == 0) {
+			*profile = netem_presets[i];
+			return TRUE;
+		}
+	}
+
+	*profile = (NetemProfile){.name = spec};
+	for (gchar **part = parts; *part; part++) {
+		if (g_str_has_prefix(*part, "rtt="))
+			profile->rtt = *part + strlen("rtt=");
+		else if (g_str_has_prefix(*part, "rate="))
+			profile->rate = *part + strlen("rate=");
+		else if (g_str_has_prefix(*part, "loss="))
+			profile->loss = *part + strlen("loss=");
+		else {
+			g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+					"Invalid netem profile '%s'", spec);
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static gboolean netem_apply(const NetemProfile *profile, GError **error)
+{
+	g_autoptr(GPtrArray) args = g_ptr_array_new_with_free_func(g_free);
+
+	g_ptr_array_add(args, g_strdup("tc"));
+	g_ptr_array_add(args, g_strdup("qdisc"));
+	g_ptr_array_add(args, g_strdup("replace"));
+	g_ptr_array_add(args, g_strdup("dev"));
+	g_ptr_array_add(args, g_strdup(netem_dev));
+	g_ptr_array_add(args, g_strdup("root"));
+	g_ptr_array_add(args, g_strdup("netem"));
+	if (profile->rtt) {
+		g_autofree gchar *rtt = g_strdup(profile->rtt);
+		gchar *unit = NULL;
+		gdouble value = g_ascii_strtod(rtt, &unit);
+
+		/* requests and responses both pass the qdisc on the loopback
+		 * interface, so each direction gets half of the RTT */
+		g_ptr_array_add(args, g_strdup("delay"));
+		g_ptr_array_add(args, g_strdup_printf("%g%s", value / 2, unit));
+	}
+	if (profile->rate) {
+		g_ptr_array_add(args, g_strdup("rate"));
+		g_ptr_array_add(args, g_strdup(profile->rate));
+	}
+	if (profile->loss) {
+		g_ptr_array_add(args, g_strdup("loss"));
+		g_ptr_array_add(args, g_strdup(profile->loss));
+	}
+
+	return run_command(args, NULL, error);
+}
+
+static void netem_remove(void)
+{
+	g_autoptr(GPtrArray) args = g_ptr_array_new_with_free_func(g_free);
+	g_autoptr(GError) ierror = NULL;
+
+	g_ptr_array_add(args, g_strdup("tc"));
+	g_ptr_array_add(args, g_strdup("qdisc"));
+	g_ptr_array_add(args, g_strdup("del"));
+	g_ptr_array_add(args, g_strdup("dev"));
+	g_ptr_array_add(args, g_strdup(netem_dev));
+	g_ptr_array_add(args, g_strdup("root"));
+	if (!run_command(args, NULL, &ierror))
+		g_warning("Failed to remove netem qdisc: %s", ierror->message);
+}
+
+/* Runs the streaming subprocess, saving the statistics to the file given by
+ * RAUC_BENCH_NBD_STATS. */
+static int run_nbd_server(void)
+{
+	g_autoptr(GError) ierror = NULL;
+	g_autoptr(GVariant) report = NULL;
+	g_autofree gchar *text = NULL;
+	const gchar *stats_path = g_getenv("RAUC_BENCH_NBD_STATS");
+	guint connections = MAX(1, g_ascii_strtoull(g_getenv("RAUC_NBD_SERVER"), NULL, 10));
+	gboolean res;
+
+	r_stats_report_begin();
+	res = r_nbd_run_server(RAUC_SOCKET_FD, connections, &ierror);
+	report = g_variant_ref_sink(r_stats_report_end());
+
+	if (!res) {
+		g_message("nbd server failed: %s", ierror ? ierror->message : "unknown error");
+		return 1;
+	}
+
+	text = g_variant_print(report, TRUE);
+	if (stats_path && !g_file_set_contents(stats_path, text, -1, &ierror)) {
+		g_message("Failed to save nbd statistics: %s", ierror->message);
+		return 1;
+	}
+
+	return 0;
+}
+
+static void append_nbd_stats(GString *runs, GVariant *report, const gchar *key, const gchar *label)
+{
+	g_autoptr(GVariant) entry = g_variant_lookup_value(report, label, G_VARIANT_TYPE_VARDICT);
+	GVariantDict dict;
+	const gchar *fields[] = {"sum", "min", "max", "avg", "p50", "p90", "p99"};
+	guint64 count = 0;
+
+	if (!entry) {
+		g_string_append_printf(runs, "\"%s\": {\"count\": 0}", key);
+		return;
+	}
+
+	g_variant_dict_init(&dict, entry);
+	g_variant_dict_lookup(&dict, "count", "t", &count);
+	g_string_append_printf(runs, "\"%s\": {\"count\": %"G_GUINT64_FORMAT, key, count);
+	for (guint i = 0; i < G_N_ELEMENTS(fields); i++) {
+		gdouble value;
+
+		if (g_variant_dict_lookup(&dict, fields[i], "d", &value))
+			g_string_append_printf(runs, ", \"%s\": %.0f", fields[i], value);
+	}
+	g_string_append(runs, "}");
+	g_variant_dict_clear(&dict);
+}
+
+static gboolean install_notify(gpointer data)
+{
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean run_install(const gchar *name, const gchar *profile, const gchar *nbd_stats, GPtrArray *devices, GString *runs, GError **error)
+{
+	GError *ierror = NULL;
+	RaucInstallArgs *args = NULL;
+	struct rusage self_before, self_after, children_before, children_after;
+	guint64 read_before, write_before, read_after, write_after;
+	g_autoptr(GPtrArray) devices_before = g_ptr_array_new_with_free_func(device_free);
+	gint64 start, end;
+	gboolean res;
+
+	if (drop_caches) {
+		sync();
+		if (!write_proc_file("/proc/sys/vm/drop_caches", "3", &ierror)) {
+			g_propagate_prefixed_error(error, ierror, "Failed to drop caches: ");
+			return FALSE;
+		}
+	}
+
+	if (!determine_slot_states(&ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	for (guint i = 0; i < devices->len; i++) {
+		BenchDevice *device = g_new0(BenchDevice, 1);
+		device->name = g_strdup(((BenchDevice *)g_ptr_array_index(devices, i))->name);
+		g_ptr_array_add(devices_before, device);
+	}
+	devices_snapshot(devices_before);
+	proc_io_read(&read_before, &write_before);
+	peak_rss_reset();
+	getrusage(RUSAGE_SELF, &self_before);
+	getrusage(RUSAGE_CHILDREN, &children_before);
+
+	g_unlink(nbd_stats);
+	g_assert(g_setenv("RAUC_BENCH_NBD_STATS", nbd_stats, TRUE));
+
+	args = install_args_new();
+	args->name = g_strdup(name);
+	args->notify = install_notify;
+
+	start = g_get_monotonic_time();
+	res = do_install_bundle(args, &ierror);
+	/* include writeback of the slot data */
+	sync();
+	end = g_get_monotonic_time();
+
+	getrusage(RUSAGE_SELF, &self_after);
+	getrusage(RUSAGE_CHILDREN, &children_after);
+	proc_io_read(&read_after, &write_after);
+	devices_snapshot(devices);
+
+	while (!g_queue_is_empty(&args->status_messages))
+		g_free(g_queue_pop_head(&args->status_messages));
+	args->status_result = 0;
+	install_args_free(args);
+
+	if (!res) {
+		g_propagate_prefixed_error(error, ierror, "Installation failed: ");
+		return FALSE;
+	}
+
+	if (runs->len)
+		g_string_append(runs, ",\n");
+	g_string_append_printf(runs,
+			"    {\"profile\": \"%s\", \"wall_s\": %.3f, \"user_s\": %.3f, \"sys_s\": %.3f, "
+			"\"children_user_s\": %.3f, \"children_sys_s\": %.3f, "
+			"\"peak_rss_kib\": %"G_GUINT64_FORMAT ", "
+			"\"read_bytes\": %"G_GUINT64_FORMAT ", \"write_bytes\": %"G_GUINT64_FORMAT ", "
+			"\"devices\": {",
+			profile, (end - start) / 1000000.0,
+			timeval_s(&self_after.ru_utime) - timeval_s(&self_before.ru_utime),
+			timeval_s(&self_after.ru_stime) - timeval_s(&self_before.ru_stime),
+			timeval_s(&children_after.ru_utime) - timeval_s(&children_before.ru_utime),
+			timeval_s(&children_after.ru_stime) - timeval_s(&children_before.ru_stime),
+			peak_rss_kib(),
+			read_after - read_before, write_after - write_before);
+	for (guint i = 0; i < devices->len; i++) {
+		BenchDevice *after = g_ptr_array_index(devices, i);
+		BenchDevice *before = g_ptr_array_index(devices_before, i);
+
+		g_string_append_printf(runs,
+				"%s\"%s\": {\"read_bytes\": %"G_GUINT64_FORMAT ", \"write_bytes\": %"G_GUINT64_FORMAT "}",
+				i ? ", " : "", after->name,
+				(after->read_sectors - before->read_sectors) * 512,
+				(after->write_sectors - before->write_sectors) * 512);
+	}
+	g_string_append(runs, "}");
+
+	if (url) {
+		g_autofree gchar *text = NULL;
+		g_autoptr(GVariant) report = NULL;
+		g_autoptr(GVariant) download = NULL;
+		gdouble downloaded = 0;
+
+		if (!g_file_get_contents(nbd_stats, &text, NULL, &ierror)) {
+			g_propagate_prefixed_error(error, ierror, "Failed to load nbd statistics: ");
+			return FALSE;
+		}
+		report = g_variant_parse(G_VARIANT_TYPE_VARDICT, text, NULL, NULL, &ierror);
+		if (!report) {
+			g_propagate_prefixed_error(error, ierror, "Failed to parse nbd statistics: ");
+			return FALSE;
+		}
+
+		g_string_append(runs, ", \"nbd\": {");
+		append_nbd_stats(runs, report, "read_size", "nbd read size");
+		g_string_append(runs, ", ");
+		append_nbd_stats(runs, report, "download_size", "nbd dl_size");
+		download = g_variant_lookup_value(report, "nbd dl_size", G_VARIANT_TYPE_VARDICT);
+		if (download)
+			g_variant_lookup(download, "sum", "d", &downloaded);
+		g_string_append_printf(runs, ", \"throughput_bytes_per_s\": %.0f}",
+				downloaded * G_USEC_PER_SEC / MAX(end - start, 1));
+	}
+	g_string_append(runs, "}");
+
+	g_printerr("run (%s): %.3f s\n", profile, (end - start) / 1000000.0);
+
+	return TRUE;
+}
+
+static gboolean write_configs(const gchar *tmpdir, const BenchSlot *slots, const gchar *image_name, GError **error)
+{
+	const gchar *slot_type = g_strcmp0(image_variant, "ext4") == 0 ? "ext4" : "raw";
+	g_autofree gchar *system_conf = NULL;
+	g_autofree gchar *manifest = NULL;
+	g_autofree gchar *path = NULL;
+
+	system_conf = g_strdup_printf(
+			"[system]\n"
+			"compatible=rauc-bench\n"
+			"bootloader=noop\n"
+			"data-directory=%s/data\n"
+			"\n"
+			"[keyring]\n"
+			"path=%s\n"
+			"\n"
+			"[slot.rootfs.0]\n"
+			"device=%s\n"
+			"type=%s\n"
+			"bootname=A\n"
+			"\n"
+			"[slot.rootfs.1]\n"
+			"device=%s\n"
+			"type=%s\n"
+			"bootname=B\n",
+			tmpdir, keyring, slots[0].device, slot_type, slots[1].device, slot_type);
+	path = g_build_filename(tmpdir, "system.conf", NULL);
+	if (!g_file_set_contents(path, system_conf, -1, error))
+		return FALSE;
+	g_clear_pointer(&path, g_free);
+
+	manifest = g_strdup_printf(
+			"[update]\n"
+			"compatible=rauc-bench\n"
+			"version=1\n"
+			"\n"
+			"[bundle]\n"
+			"format=verity\n"
+			"\n"
+			"[image.rootfs]\n"
+			"filename=%s\n"
+			"%s",
+			image_name, adaptive ? "adaptive=block-hash-index\n" : "");
+	path = g_build_filename(tmpdir, "content", "manifest.raucm", NULL);
+	if (!g_file_set_contents(path, manifest, -1, error))
+		return FALSE;
+
+	return TRUE;
+}
+
+static gboolean run_benchmark(const gchar *tmpdir, GError **error)
+{
+	GError *ierror = NULL;
+	guint64 size = (guint64)size_mib * 1024 * 1024;
+	const gchar *image_name = g_strcmp0(image_variant, "ext4") == 0 ? "rootfs.ext4" : "rootfs.img";
+	g_autofree gchar *content = g_build_filename(tmpdir, "content", NULL);
+	g_autofree gchar *old_raw = g_build_filename(tmpdir, "old.img", NULL);
+	g_autofree gchar *new_raw = g_build_filename(tmpdir, "new.img", NULL);
+	g_autofree gchar *old_image = NULL;
+	g_autofree gchar *new_image = NULL;
+	g_autofree gchar *bundle = NULL;
+	g_autofree gchar *name = NULL;
+	g_autofree gchar *data_dir = g_build_filename(tmpdir, "data", NULL);
+	g_autoptr(GPtrArray) devices = g_ptr_array_new_with_free_func(device_free);
+	g_autoptr(GString) runs = g_string_new(NULL);
+	g_autofree gchar *nbd_stats = g_build_filename(tmpdir, "nbd-stats", NULL);
+	BenchSlot slots[2] = {0};
+	gboolean netem_active = FALSE;
+	gboolean res = FALSE;
+
+	if (g_mkdir(content, 0755) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to create %s: %s", content, g_strerror(err));
+		return FALSE;
+	}
+
+	g_printerr("generating images\n");
+	if (!write_images(old_raw, new_raw, size, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+	new_image = g_build_filename(content, image_name, NULL);
+	if (g_strcmp0(image_variant, "ext4") == 0) {
+		old_image = g_build_filename(tmpdir, "old.ext4", NULL);
+		if (!wrap_ext4(tmpdir, old_raw, old_image, size, &ierror) ||
+		    !wrap_ext4(tmpdir, new_raw, new_image, size, &ierror)) {
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
+		g_unlink(old_raw);
+		g_unlink(new_raw);
+	} else {
+		old_image = g_steal_pointer(&old_raw);
+		if (g_rename(new_raw, new_image) != 0) {
+			int err = errno;
+			g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+					"Failed to move image: %s", g_strerror(err));
+			return FALSE;
+		}
+	}
+
+	g_printerr("setting up slots\n");
+	for (guint i = 0; i < G_N_ELEMENTS(slots); i++) {
+		if (!slot_setup(&slots[i], tmpdir, i, old_image, &ierror)) {
+			g_propagate_error(error, ierror);
+			goto out;
+		}
+	}
+
+	if (!write_configs(tmpdir, slots, image_name, &ierror)) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
+
+	r_context_conf()->configpath = g_build_filename(tmpdir, "system.conf", NULL);
+	r_context_conf()->mountprefix = g_build_filename(tmpdir, "mount", NULL);
+	g_mkdir(r_context_conf()->mountprefix, 0755);
+	r_context_conf()->certpath = g_strdup(cert);
+	r_context_conf()->keypath = g_strdup(key);
+	r_context_conf()->bootslot = g_strdup("A");
+	r_context();
+
+	g_printerr("creating bundle\n");
+	if (url)
+		bundle = g_build_filename(url_dir, "rauc-install-bench.raucb", NULL);
+	else
+		bundle = g_build_filename(tmpdir, "bundle.raucb", NULL);
+	if (!create_bundle(bundle, content, &ierror)) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
+	name = url ? g_strdup_printf("%s/rauc-install-bench.raucb", url) : g_strdup(bundle);
+
+	device_add(devices, bundle);
+	for (guint i = 0; i < G_N_ELEMENTS(slots); i++)
+		device_add(devices, slots[i].device);
+
+	for (guint p = 0; p < MAX(1, g_strv_length(netem_profiles)); p++) {
+		g_auto(GStrv) parts = NULL;
+		NetemProfile profile = {.name = "none"};
+
+		if (netem_profiles) {
+			parts = g_strsplit(netem_profiles[p], ",", -1);
+			if (!netem_parse(netem_profiles[p], parts, &profile, &ierror)) {
+				g_propagate_error(error, ierror);
+				goto out;
+			}
+			g_printerr("applying netem profile %s\n", profile.name);
+			if (!netem_apply(&profile, &ierror)) {
+				g_propagate_prefixed_error(error, ierror, "Failed to apply netem profile: ");
+				goto out;
+			}
+			netem_active = TRUE;
+		}
+
+		for (gint i = 0; i < repeat; i++) {
+			/* start without stored hash indices and slot status */
+			if (g_file_test(data_dir, G_FILE_TEST_IS_DIR) && !rm_tree(data_dir, &ierror)) {
+				g_propagate_error(error, ierror);
+				goto out;
+			}
+			if (i > 0 && !slot_reset(&slots[1], old_image, &ierror)) {
+				g_propagate_error(error, ierror);
+				goto out;
+			}
+			if (!run_install(name, profile.name, nbd_stats, devices, runs, &ierror)) {
+				g_propagate_error(error, ierror);
+				goto out;
+			}
+		}
+
+		if (netem_active) {
+			netem_remove();
+			netem_active = FALSE;
+		}
+	}
+
+	g_print("{\n"
+			"  \"version\": \"%s\",\n"
+			"  \"config\": {\"size\": %"G_GUINT64_FORMAT ", \"changed\": %.3f, \"zero\": %.3f, \"moved\": %.3f, "
+			"\"image\": \"%s\", \"adaptive\": %s, \"slot\": \"%s\", \"streaming\": %s, \"drop_caches\": %s},\n"
+			"  \"runs\": [\n%s\n  ]\n"
+			"}\n",
+			PACKAGE_VERSION, size, changed_frac, zero_frac, moved_frac,
+			image_variant, adaptive ? "true" : "false", slot_variant,
+			url ? "true" : "false", drop_caches ? "true" : "false", runs->str);
+
+	res = TRUE;
+
+out:
+	if (netem_active)
+		netem_remove();
+	if (url && bundle)
+		g_unlink(bundle);
+	for (guint i = 0; i < G_N_ELEMENTS(slots); i++)
+		slot_clear(&slots[i]);
+	return res;
+}
+
+int main(int argc, char *argv[])
+{
+	GOptionEntry entries[] = {
+		{"size", 's', 0, G_OPTION_ARG_INT, &size_mib, "image data size in MiB (default 64)", "MIB"},
+		{"changed", 0, 0, G_OPTION_ARG_DOUBLE, &changed_frac, "fraction of changed chunks (default 0.1)", "FRACTION"},
+		{"zero", 0, 0, G_OPTION_ARG_DOUBLE, &zero_frac, "fraction of zeroed chunks (default 0)", "FRACTION"},
+		{"moved", 0, 0, G_OPTION_ARG_DOUBLE, &moved_frac, "fraction of chunks moved to a different offset (default 0)", "FRACTION"},
+		{"image", 'i', 0, G_OPTION_ARG_STRING, &image_variant, "image type: raw (default) or ext4", "TYPE"},
+		{"adaptive", 'a', 0, G_OPTION_ARG_NONE, &adaptive, "enable adaptive updates (block-hash-index)", NULL},
+		{"slot", 0, 0, G_OPTION_ARG_STRING, &slot_variant, "slot type: file (default), loop or nullblk", "TYPE"},
+		{"url", 0, 0, G_OPTION_ARG_STRING, &url, "stream the bundle from this base URL (e.g. http://127.0.0.1/test)", "URL"},
+		{"url-dir", 0, 0, G_OPTION_ARG_FILENAME, &url_dir, "directory served at the base URL (default: test/ of the source tree)", "DIR"},
+		{"repeat", 'r', 0, G_OPTION_ARG_INT, &repeat, "number of installations (default 3)", "N"},
+		{"drop-caches", 0, 0, G_OPTION_ARG_NONE, &drop_caches, "drop the page cache before each installation", NULL},
+		{"netem", 0, 0, G_OPTION_ARG_STRING_ARRAY, &netem_profiles, "network emulation profile for streaming: ethernet, lte, satellite or rtt=TIME,rate=RATE,loss=PERCENT (repeatable)", "PROFILE"},
+		{"netem-dev", 0, 0, G_OPTION_ARG_STRING, &netem_dev, "network interface for --netem (default lo)", "DEV"},
+		{"keyring", 0, 0, G_OPTION_ARG_FILENAME, &keyring, "keyring (default: test CA)", "PEMFILE"},
+		{"cert", 0, 0, G_OPTION_ARG_FILENAME, &cert, "signing certificate (default: test certificate)", "PEMFILE"},
+		{"key", 0, 0, G_OPTION_ARG_FILENAME, &key, "signing key (default: test key)", "PEMFILE"},
+		{0}
+	};
+	g_autoptr(GOptionContext) context = NULL;
+	g_autoptr(GError) error = NULL;
+	g_autofree gchar *tmpdir = NULL;
+	gboolean res;
+
+	/* the streaming subprocess is started by executing /proc/self/exe */
+	if (ENABLE_STREAMING && g_getenv("RAUC_NBD_SERVER"))
+		return run_nbd_server();
+
+	setlocale(LC_ALL, "C");
+	g_assert(g_setenv("GIO_USE_VFS", "local", TRUE));
+
+	context = g_option_context_new("- RAUC installation benchmark");
+	g_option_context_add_main_entries(context, entries, NULL);
+	if (!g_option_context_parse(context, &argc, &argv, &error)) {
+		g_printerr("%s\n", error->message);
+		return 1;
+	}
+
+	if (!image_variant)
+		image_variant = g_strdup("raw");
+	if (!slot_variant)
+		slot_variant = g_strdup("file");
+	if (!url_dir)
+		url_dir = g_build_filename(BENCH_SOURCE_DIR, "test", NULL);
+	if (!keyring)
+		keyring = g_build_filename(BENCH_SOURCE_DIR, "test/openssl-ca/dev-ca.pem", NULL);
+	if (!cert)
+		cert = g_build_filename(BENCH_SOURCE_DIR, "test/openssl-ca/dev/autobuilder-1.cert.pem", NULL);
+	if (!key)
+		key = g_build_filename(BENCH_SOURCE_DIR, "test/openssl-ca/dev/private/autobuilder-1.pem", NULL);
+
+	if (size_mib <= 0 || repeat <= 0 ||
+	    changed_frac < 0 || zero_frac < 0 || moved_frac < 0 ||
+	    changed_frac + zero_frac + moved_frac > 1.0) {
+		g_printerr("Invalid size, repeat count or chunk fractions\n");
+		return 1;
+	}
+	if (!g_strv_contains((const gchar *const[]){"raw", "ext4", NULL}, image_variant) ||
+	    !g_strv_contains((const gchar *const[]){"file", "loop", "nullblk", NULL}, slot_variant)) {
+		g_printerr("Invalid image or slot type\n");
+		return 1;
+	}
+	if (url && !ENABLE_STREAMING) {
+		g_printerr("Streaming support is disabled\n");
+		return 1;
+	}
+	if (netem_profiles && !url) {
+		g_printerr("Network emulation requires --url\n");
+		return 1;
+	}
+	if (!netem_dev)
+		netem_dev = g_strdup("lo");
+
+	tmpdir = g_dir_make_tmp("rauc-install-bench-XXXXXX", &error);
+	if (!tmpdir) {
+		g_printerr("%s\n", error->message);
+		return 1;
+	}
+
+	res = run_benchmark(tmpdir, &error);
+	if (!res)
+		g_printerr("%s\n", error->message);
+
+	r_context_clean();
+	if (!rm_tree(tmpdir, NULL))
+		g_printerr("Failed to remove %s\n", tmpdir);
+
+	return res ? 0 : 1;
+}
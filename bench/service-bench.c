@@ -0,0 +1,719 @@
+/* D-Bus service load and latency benchmark.
+ *
+ * Starts 'rauc service' on a private session bus and measures the latency of
+ * D-Bus calls (GetSlotStatus, GetPrimary, InspectBundle and reading all
+ * properties) issued by concurrent clients. This is done first while the
+ * service is idle and then while it repeatedly installs a generated bundle.
+ * For each phase, the number of calls and errors, the latency distribution
+ * per method and the CPU time used by the service process are reported as
+ * JSON.
+ *
+ * The installation phase mounts the bundle and therefore needs to run as
+ * root. Use the qemu-test environment when developing.
+ */
+
+#include <errno.h>
+#include <locale.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <gio/gio.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "bundle.h"
+#include "context.h"
+#include "utils.h"
+
+#define BENCH_SEED 0x72617563
+#define BUS_NAME "de.pengutronix.rauc"
+#define INSTALLER_INTERFACE "de.pengutronix.rauc.Installer"
+/* timeout for a single call, so that a hanging service shows up as errors */
+#define CALL_TIMEOUT_MS 10000
+#define SERVICE_START_TIMEOUT_S 10
+#define INSTALL_TIMEOUT_S 600
+
+typedef enum {
+	BENCH_GET_SLOT_STATUS,
+	BENCH_GET_PRIMARY,
+	BENCH_INSPECT_BUNDLE,
+	BENCH_PROPERTIES,
+	BENCH_N_METHODS
+} BenchMethod;
+
+static const gchar *method_names[BENCH_N_METHODS] = {
+	"GetSlotStatus",
+	"GetPrimary",
+	"InspectBundle",
+	"Properties",
+};
+
+static gint clients = 4;
+static gint duration_s = 5;
+static gint interval_ms = 0;
+static gint size_mib = 64;
+static gchar *methods = NULL;
+static gchar *rauc_path = NULL;
+static gboolean skip_install = FALSE;
+static gchar *keyring = NULL;
+static gchar *cert = NULL;
+static gchar *key = NULL;
+
+static BenchMethod enabled_methods[BENCH_N_METHODS];
+static guint n_enabled_methods = 0;
+static gchar *bundle_path = NULL;
+static gint stop_clients = FALSE;
+
+typedef struct {
+	GDBusConnection *connection;
+	GThread *thread;
+	guint index;
+	GArray *latencies[BENCH_N_METHODS]; /* gint64 in usec, successful calls */
+	guint errors[BENCH_N_METHODS];
+} BenchClient;
+
+typedef struct {
+	GMainLoop *loop;
+	gint result;
+	gboolean completed;
+} InstallState;
+
+static gboolean parse_methods(GError **error)
+{
+	g_auto(GStrv) names = NULL;
+
+	if (!methods) {
+		for (guint i = 0; i < BENCH_N_METHODS; i++)
+			enabled_methods[n_enabled_methods++] = i;
+		return TRUE;
+	}
+
+	names = g_strsplit(methods, ",", -1);
+	for (gchar **name = names; *name; name++) {
+		guint i;
+
+		for (i = 0; i < BENCH_N_METHODS; i++) {
+			if (g_strcmp0(*name, method_names[i]) == 0)
+				break;
+		}
+		if (i == BENCH_N_METHODS) {
+			g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+					"Unknown method '%s'", *name);
+			return FALSE;
+		}
+		if (n_enabled_methods == BENCH_N_METHODS) {
+			g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+					"Too many methods");
+			return FALSE;
+		}
+		enabled_methods[n_enabled_methods++] = i;
+	}
+
+	if (!n_enabled_methods) {
+		g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+				"No methods selected");
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean write_image(const gchar *path, guint64 size, GError **error)
+{
+	g_autoptr(GRand) rand = g_rand_new_with_seed(BENCH_SEED);
+	g_autofree guint32 *block = g_malloc(1024 * 1024);
+	g_autoptr(GFile) file = g_file_new_for_path(path);
+	g_autoptr(GFileOutputStream) stream = NULL;
+
+	stream = g_file_replace(file, NULL, FALSE, G_FILE_CREATE_NONE, NULL, error);
+	if (!stream)
+		return FALSE;
+
+	for (guint64 pos = 0; pos < size; pos += 1024 * 1024) {
+		for (guint i = 0; i < 1024 * 1024 / sizeof(guint32); i++)
+			block[i] = g_rand_int(rand);
+		if (!g_output_stream_write_all(G_OUTPUT_STREAM(stream), block, MIN(size - pos, 1024 * 1024), NULL, NULL, error))
+			return FALSE;
+	}
+
+	return g_output_stream_close(G_OUTPUT_STREAM(stream), NULL, error);
+}
+
+static gboolean write_configs(const gchar *tmpdir, GError **error)
+{
+	g_autofree gchar *system_conf = NULL;
+	g_autofree gchar *manifest = NULL;
+	g_autofree gchar *path = NULL;
+
+	system_conf = g_strdup_printf(
+			"[system]\n"
+			"compatible=rauc-bench\n"
+			"bootloader=noop\n"
+			"data-directory=%s/data\n"
+			"\n"
+			"[keyring]\n"
+			"path=%s\n"
+			"\n"
+			"[slot.rootfs.0]\n"
+			"device=%s/slot-0.img\n"
+			"type=raw\n"
+			"bootname=A\n"
+			"\n"
+			"[slot.rootfs.1]\n"
+			"device=%s/slot-1.img\n"
+			"type=raw\n"
+			"bootname=B\n",
+			tmpdir, keyring, tmpdir, tmpdir);
+	path = g_build_filename(tmpdir, "system.conf", NULL);
+	if (!g_file_set_contents(path, system_conf, -1, error))
+		return FALSE;
+	g_clear_pointer(&path, g_free);
+
+	for (guint i = 0; i < 2; i++) {
+		path = g_strdup_printf("%s/slot-%u.img", tmpdir, i);
+		if (!g_file_set_contents(path, "", 0, error))
+			return FALSE;
+		g_clear_pointer(&path, g_free);
+	}
+
+	manifest = g_strdup(
+			"[update]\n"
+			"compatible=rauc-bench\n"
+			"version=1\n"
+			"\n"
+			"[bundle]\n"
+			"format=verity\n"
+			"\n"
+			"[image.rootfs]\n"
+			"filename=rootfs.img\n");
+	path = g_build_filename(tmpdir, "content", "manifest.raucm", NULL);
+	if (!g_file_set_contents(path, manifest, -1, error))
+		return FALSE;
+
+	return TRUE;
+}
+
+static gboolean create_test_bundle(const gchar *tmpdir, GError **error)
+{
+	GError *ierror = NULL;
+	g_autofree gchar *content = g_build_filename(tmpdir, "content", NULL);
+	g_autofree gchar *image = g_build_filename(content, "rootfs.img", NULL);
+
+	if (g_mkdir(content, 0755) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to create %s: %s", content, g_strerror(err));
+		return FALSE;
+	}
+
+	if (!write_configs(tmpdir, &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Failed to write configuration: ");
+		return FALSE;
+	}
+
+	if (!write_image(image, (guint64)size_mib * 1024 * 1024, &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Failed to write image: ");
+		return FALSE;
+	}
+
+	r_context_conf()->configpath = g_build_filename(tmpdir, "system.conf", NULL);
+	r_context_conf()->certpath = g_strdup(cert);
+	r_context_conf()->keypath = g_strdup(key);
+	r_context_conf()->bootslot = g_strdup("A");
+	r_context();
+
+	bundle_path = g_build_filename(tmpdir, "bundle.raucb", NULL);
+	if (!create_bundle(bundle_path, content, &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Failed to create bundle: ");
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static GSubprocess *start_service(const gchar *tmpdir, GError **error)
+{
+	g_autoptr(GSubprocessLauncher) launcher = NULL;
+	g_autoptr(GPtrArray) args = g_ptr_array_new_with_free_func(g_free);
+	g_autofree gchar *mountprefix = g_build_filename(tmpdir, "mount", NULL);
+
+	g_mkdir(mountprefix, 0755);
+
+	g_ptr_array_add(args, g_strdup(rauc_path));
+	g_ptr_array_add(args, g_strdup_printf("--conf=%s/system.conf", tmpdir));
+	g_ptr_array_add(args, g_strdup_printf("--mount=%s", mountprefix));
+	g_ptr_array_add(args, g_strdup("--override-boot-slot=A"));
+	g_ptr_array_add(args, g_strdup("service"));
+	g_ptr_array_add(args, NULL);
+
+	launcher = g_subprocess_launcher_new(G_SUBPROCESS_FLAGS_STDERR_SILENCE);
+	/* DBUS_SESSION_BUS_ADDRESS is inherited from the GTestDBus instance */
+	g_subprocess_launcher_setenv(launcher, "DBUS_STARTER_BUS_TYPE", "session", TRUE);
+
+	return r_subprocess_launcher_spawnv(launcher, args, error);
+}
+
+static gboolean wait_for_service(GDBusConnection *connection, GSubprocess *service, GError **error)
+{
+	gint64 deadline = g_get_monotonic_time() + SERVICE_START_TIMEOUT_S * G_USEC_PER_SEC;
+
+	while (g_get_monotonic_time() < deadline) {
+		g_autoptr(GVariant) ret = NULL;
+		gboolean has_owner = FALSE;
+
+		if (g_subprocess_get_identifier(service) == NULL) {
+			g_set_error(error, G_SPAWN_ERROR, G_SPAWN_ERROR_FAILED,
+					"rauc service exited during startup");
+			return FALSE;
+		}
+
+		ret = g_dbus_connection_call_sync(connection, "org.freedesktop.DBus", "/org/freedesktop/DBus",
+				"org.freedesktop.DBus", "NameHasOwner", g_variant_new("(s)", BUS_NAME),
+				G_VARIANT_TYPE("(b)"), G_DBUS_CALL_FLAGS_NONE, -1, NULL, error);
+		if (!ret)
+			return FALSE;
+		g_variant_get(ret, "(b)", &has_owner);
+		if (has_owner)
+			return TRUE;
+
+		g_usleep(50 * 1000);
+	}
+
+	g_set_error(error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT,
+			"rauc service did not acquire %s", BUS_NAME);
+	return FALSE;
+}
+
+/* Returns the CPU time (user and system) used by the process in seconds. */
+static gdouble process_cpu_s(GSubprocess *process)
+{
+	const gchar *pid = g_subprocess_get_identifier(process);
+	g_autofree gchar *path = NULL;
+	g_autofree gchar *contents = NULL;
+	g_auto(GStrv) fields = NULL;
+	const gchar *rest;
+	guint64 ticks;
+
+	if (!pid)
+		return 0;
+
+	path = g_strdup_printf("/proc/%s/stat", pid);
+	if (!g_file_get_contents(path, &contents, NULL, NULL))
+		return 0;
+
+	/* the command name may contain spaces, so start after it */
+	rest = strrchr(contents, ')');
+	if (!rest)
+		return 0;
+
+	/* fields[0] is field 3 (state), utime and stime are fields 14 and 15 */
+	fields = g_strsplit(rest + 2, " ", 14);
+	if (g_strv_length(fields) < 14)
+		return 0;
+
+	ticks = g_ascii_strtoull(fields[11], NULL, 10) + g_ascii_strtoull(fields[12], NULL, 10);
+
+	return (gdouble)ticks / sysconf(_SC_CLK_TCK);
+}
+
+static GVariant *call_method(GDBusConnection *connection, BenchMethod method, GError **error)
+{
+	switch (method) {
+		case BENCH_GET_SLOT_STATUS:
+			return g_dbus_connection_call_sync(connection, BUS_NAME, "/", INSTALLER_INTERFACE,
+					"GetSlotStatus", NULL, G_VARIANT_TYPE("(a(sa{sv}))"),
+					G_DBUS_CALL_FLAGS_NONE, CALL_TIMEOUT_MS, NULL, error);
+		case BENCH_GET_PRIMARY:
+			return g_dbus_connection_call_sync(connection, BUS_NAME, "/", INSTALLER_INTERFACE,
+					"GetPrimary", NULL, G_VARIANT_TYPE("(s)"),
+					G_DBUS_CALL_FLAGS_NONE, CALL_TIMEOUT_MS, NULL, error);
+		case BENCH_INSPECT_BUNDLE:
+			return g_dbus_connection_call_sync(connection, BUS_NAME, "/", INSTALLER_INTERFACE,
+					"InspectBundle", g_variant_new("(s@a{sv})", bundle_path,
+					g_variant_new_array(G_VARIANT_TYPE("{sv}"), NULL, 0)),
+					G_VARIANT_TYPE("(a{sv})"),
+					G_DBUS_CALL_FLAGS_NONE, CALL_TIMEOUT_MS, NULL, error);
+		case BENCH_PROPERTIES:
+			return g_dbus_connection_call_sync(connection, BUS_NAME, "/", "org.freedesktop.DBus.Properties",
+					"GetAll", g_variant_new("(s)", INSTALLER_INTERFACE), G_VARIANT_TYPE("(a{sv})"),
+					G_DBUS_CALL_FLAGS_NONE, CALL_TIMEOUT_MS, NULL, error);
+		default:
+			g_assert_not_reached();
+	}
+}
+
+static gpointer client_thread(gpointer data)
+{
+	BenchClient *client = data;
+	/* start each client at a different method */
+	guint next = client->index;
+
+	while (!g_atomic_int_get(&stop_clients)) {
+		BenchMethod method = enabled_methods[next++ % n_enabled_methods];
+		g_autoptr(GVariant) ret = NULL;
+		g_autoptr(GError) ierror = NULL;
+		gint64 start, latency;
+
+		start = g_get_monotonic_time();
+		ret = call_method(client->connection, method, &ierror);
+		latency = g_get_monotonic_time() - start;
+
+		if (ret) {
+			g_array_append_val(client->latencies[method], latency);
+		} else {
+			g_debug("%s failed: %s", method_names[method], ierror->message);
+			client->errors[method]++;
+		}
+
+		if (interval_ms > 0)
+			g_usleep(interval_ms * 1000);
+	}
+
+	return NULL;
+}
+
+static gint compare_gint64(gconstpointer a, gconstpointer b)
+{
+	gint64 x = *(const gint64 *)a;
+	gint64 y = *(const gint64 *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Returns the nearest-rank percentile of sorted latencies in milliseconds. */
+static gdouble percentile_ms(GArray *sorted, guint percent)
+{
+	guint index;
+
+	if (!sorted->len)
+		return 0;
+
+	index = MIN(sorted->len - 1, ((guint64)sorted->len * percent + 99) / 100 - 1);
+
+	return g_array_index(sorted, gint64, index) / 1000.0;
+}
+
+static void append_method_stats(GString *out, const gchar *phase, BenchMethod method, BenchClient *bench_clients)
+{
+	g_autoptr(GArray) all = g_array_new(FALSE, FALSE, sizeof(gint64));
+	guint errors = 0;
+	gdouble sum = 0;
+
+	for (gint i = 0; i < clients; i++) {
+		GArray *latencies = bench_clients[i].latencies[method];
+
+		g_array_append_vals(all, latencies->data, latencies->len);
+		errors += bench_clients[i].errors[method];
+	}
+	g_array_sort(all, compare_gint64);
+	for (guint i = 0; i < all->len; i++)
+		sum += g_array_index(all, gint64, i);
+
+	g_string_append_printf(out,
+			"\"%s\": {\"calls\": %u, \"errors\": %u, \"mean_ms\": %.3f, "
+			"\"p50_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f}",
+			method_names[method], all->len, errors,
+			all->len ? sum / all->len / 1000.0 : 0.0,
+			percentile_ms(all, 50), percentile_ms(all, 99), percentile_ms(all, 100));
+	g_printerr("%-8s %-14s %8u calls %6u errors  p50 %8.3f ms  p99 %8.3f ms\n",
+			phase, method_names[method], all->len, errors,
+			percentile_ms(all, 50), percentile_ms(all, 99));
+}
+
+static void on_completed(GDBusConnection *connection, const gchar *sender_name,
+		const gchar *object_path, const gchar *interface_name,
+		const gchar *signal_name, GVariant *parameters, gpointer data)
+{
+	InstallState *state = data;
+
+	g_variant_get(parameters, "(i)", &state->result);
+	state->completed = TRUE;
+	g_main_loop_quit(state->loop);
+}
+
+static gboolean on_install_timeout(gpointer data)
+{
+	InstallState *state = data;
+
+	g_main_loop_quit(state->loop);
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Installs the bundle via D-Bus and waits for the Completed signal. */
+static gboolean run_install(GDBusConnection *connection, GError **error)
+{
+	g_autoptr(GVariant) ret = NULL;
+	InstallState state = {0};
+	guint subscription;
+	guint timeout;
+
+	state.loop = g_main_loop_new(NULL, FALSE);
+	subscription = g_dbus_connection_signal_subscribe(connection, BUS_NAME, INSTALLER_INTERFACE,
+			"Completed", "/", NULL, G_DBUS_SIGNAL_FLAGS_NONE, on_completed, &state, NULL);
+
+	ret = g_dbus_connection_call_sync(connection, BUS_NAME, "/", INSTALLER_INTERFACE,
+			"InstallBundle", g_variant_new("(s@a{sv})", bundle_path,
+			g_variant_new_array(G_VARIANT_TYPE("{sv}"), NULL, 0)),
+			NULL, G_DBUS_CALL_FLAGS_NONE, CALL_TIMEOUT_MS, NULL, error);
+	if (ret) {
+		timeout = g_timeout_add_seconds(INSTALL_TIMEOUT_S, on_install_timeout, &state);
+		g_main_loop_run(state.loop);
+		if (state.completed)
+			g_source_remove(timeout);
+	}
+
+	g_dbus_connection_signal_unsubscribe(connection, subscription);
+	g_main_loop_unref(state.loop);
+
+	if (!ret)
+		return FALSE;
+
+	if (!state.completed) {
+		g_set_error(error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT, "Installation did not complete");
+		return FALSE;
+	}
+	if (state.result != 0) {
+		g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+				"Installation failed with result %d", state.result);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Runs the clients for the duration of a phase. During the 'install' phase,
+ * installations are started back-to-back until the duration has elapsed (at
+ * least one is always completed). */
+static gboolean run_phase(const gchar *phase, gboolean install, GDBusConnection *control,
+		BenchClient *bench_clients, GSubprocess *service, GString *results, GError **error)
+{
+	GError *ierror = NULL;
+	gint64 start, end, deadline;
+	gdouble cpu_before, cpu_after;
+	guint installs = 0;
+	gboolean res = TRUE;
+
+	for (gint i = 0; i < clients; i++) {
+		for (guint m = 0; m < BENCH_N_METHODS; m++) {
+			g_array_set_size(bench_clients[i].latencies[m], 0);
+			bench_clients[i].errors[m] = 0;
+		}
+	}
+
+	g_printerr("running %s phase\n", phase);
+	g_atomic_int_set(&stop_clients, FALSE);
+	cpu_before = process_cpu_s(service);
+	start = g_get_monotonic_time();
+	deadline = start + (gint64)duration_s * G_USEC_PER_SEC;
+
+	for (gint i = 0; i < clients; i++)
+		bench_clients[i].thread = g_thread_new("bench-client", client_thread, &bench_clients[i]);
+
+	if (install) {
+		do {
+			if (!run_install(control, &ierror)) {
+				g_propagate_error(error, ierror);
+				res = FALSE;
+				break;
+			}
+			installs++;
+		} while (g_get_monotonic_time() < deadline);
+	} else {
+		g_usleep(duration_s * G_USEC_PER_SEC);
+	}
+
+	g_atomic_int_set(&stop_clients, TRUE);
+	for (gint i = 0; i < clients; i++)
+		g_thread_join(g_steal_pointer(&bench_clients[i].thread));
+	end = g_get_monotonic_time();
+	cpu_after = process_cpu_s(service);
+
+	if (!res)
+		return FALSE;
+
+	if (results->len)
+		g_string_append(results, ",\n");
+	g_string_append_printf(results,
+			"    {\"name\": \"%s\", \"wall_s\": %.3f, \"installs\": %u, "
+			"\"service_cpu_s\": %.3f, \"service_cpu_percent\": %.1f, \"methods\": {",
+			phase, (end - start) / 1000000.0, installs,
+			cpu_after - cpu_before,
+			(cpu_after - cpu_before) * 100.0 * G_USEC_PER_SEC / MAX(end - start, 1));
+	for (guint m = 0; m < n_enabled_methods; m++) {
+		if (m)
+			g_string_append(results, ", ");
+		append_method_stats(results, phase, enabled_methods[m], bench_clients);
+	}
+	g_string_append(results, "}}");
+
+	g_printerr("%-8s service CPU %.3f s (%.1f %%)\n", phase, cpu_after - cpu_before,
+			(cpu_after - cpu_before) * 100.0 * G_USEC_PER_SEC / MAX(end - start, 1));
+
+	return TRUE;
+}
+
+static gboolean run_benchmark(const gchar *tmpdir, GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(GTestDBus) bus = NULL;
+	g_autoptr(GSubprocess) service = NULL;
+	g_autoptr(GDBusConnection) control = NULL;
+	g_autoptr(GString) results = g_string_new(NULL);
+	g_autoptr(GString) method_list = g_string_new(NULL);
+	BenchClient *bench_clients = g_new0(BenchClient, clients);
+	gboolean res = FALSE;
+
+	g_printerr("creating bundle\n");
+	if (!create_test_bundle(tmpdir, &ierror)) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
+
+	bus = g_test_dbus_new(G_TEST_DBUS_NONE);
+	g_test_dbus_up(bus);
+
+	g_printerr("starting service\n");
+	service = start_service(tmpdir, &ierror);
+	if (!service) {
+		g_propagate_prefixed_error(error, ierror, "Failed to start rauc service: ");
+		goto out;
+	}
+
+	control = g_dbus_connection_new_for_address_sync(g_test_dbus_get_bus_address(bus),
+			G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT | G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+			NULL, NULL, &ierror);
+	if (!control) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
+
+	if (!wait_for_service(control, service, &ierror)) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
+
+	/* each client uses its own connection, as separate processes would */
+	for (gint i = 0; i < clients; i++) {
+		bench_clients[i].index = i;
+		for (guint m = 0; m < BENCH_N_METHODS; m++)
+			bench_clients[i].latencies[m] = g_array_new(FALSE, FALSE, sizeof(gint64));
+		bench_clients[i].connection = g_dbus_connection_new_for_address_sync(g_test_dbus_get_bus_address(bus),
+				G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT | G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+				NULL, NULL, &ierror);
+		if (!bench_clients[i].connection) {
+			g_propagate_error(error, ierror);
+			goto out;
+		}
+	}
+
+	if (!run_phase("idle", FALSE, control, bench_clients, service, results, &ierror)) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
+
+	if (skip_install) {
+		g_printerr("skipping install phase\n");
+	} else if (geteuid() != 0) {
+		g_printerr("skipping install phase (mounting the bundle requires root)\n");
+	} else if (!run_phase("install", TRUE, control, bench_clients, service, results, &ierror)) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
+
+	for (guint m = 0; m < n_enabled_methods; m++)
+		g_string_append_printf(method_list, "%s\"%s\"", m ? ", " : "", method_names[enabled_methods[m]]);
+
+	g_print("{\n"
+			"  \"version\": \"%s\",\n"
+			"  \"config\": {\"clients\": %d, \"duration_s\": %d, \"interval_ms\": %d, "
+			"\"size\": %"G_GUINT64_FORMAT ", \"methods\": [%s]},\n"
+			"  \"phases\": [\n%s\n  ]\n"
+			"}\n",
+			PACKAGE_VERSION, clients, duration_s, interval_ms,
+			(guint64)size_mib * 1024 * 1024, method_list->str, results->str);
+
+	res = TRUE;
+
+out:
+	for (gint i = 0; i < clients; i++) {
+		g_clear_object(&bench_clients[i].connection);
+		for (guint m = 0; m < BENCH_N_METHODS; m++)
+			g_clear_pointer(&bench_clients[i].latencies[m], g_array_unref);
+	}
+	g_free(bench_clients);
+	g_clear_object(&control);
+	if (service) {
+		g_subprocess_send_signal(service, SIGTERM);
+		g_subprocess_wait(service, NULL, NULL);
+	}
+	if (bus)
+		g_test_dbus_down(bus);
+	return res;
+}
+
+int main(int argc, char *argv[])
+{
+	GOptionEntry entries[] = {
+		{"clients", 'c', 0, G_OPTION_ARG_INT, &clients, "number of concurrent clients (default 4)", "N"},
+		{"duration", 'd', 0, G_OPTION_ARG_INT, &duration_s, "duration of each phase in seconds (default 5)", "SECONDS"},
+		{"interval", 0, 0, G_OPTION_ARG_INT, &interval_ms, "delay between the calls of each client (default 0)", "MS"},
+		{"methods", 'm', 0, G_OPTION_ARG_STRING, &methods, "comma-separated list of GetSlotStatus, GetPrimary, InspectBundle and Properties (default all)", "LIST"},
+		{"size", 's', 0, G_OPTION_ARG_INT, &size_mib, "image size in MiB for the install phase (default 64)", "MIB"},
+		{"no-install", 0, 0, G_OPTION_ARG_NONE, &skip_install, "only run the idle phase", NULL},
+		{"rauc", 0, 0, G_OPTION_ARG_FILENAME, &rauc_path, "rauc binary (default: from the build directory)", "PATH"},
+		{"keyring", 0, 0, G_OPTION_ARG_FILENAME, &keyring, "keyring (default: test CA)", "PEMFILE"},
+		{"cert", 0, 0, G_OPTION_ARG_FILENAME, &cert, "signing certificate (default: test certificate)", "PEMFILE"},
+		{"key", 0, 0, G_OPTION_ARG_FILENAME, &key, "signing key (default: test key)", "PEMFILE"},
+		{0}
+	};
+	g_autoptr(GOptionContext) context = NULL;
+	g_autoptr(GError) error = NULL;
+	g_autofree gchar *tmpdir = NULL;
+	gboolean res;
+
+	setlocale(LC_ALL, "C");
+	g_assert(g_setenv("GIO_USE_VFS", "local", TRUE));
+
+	context = g_option_context_new("- RAUC D-Bus service benchmark");
+	g_option_context_add_main_entries(context, entries, NULL);
+	if (!g_option_context_parse(context, &argc, &argv, &error)) {
+		g_printerr("%s\n", error->message);
+		return 1;
+	}
+
+	if (clients <= 0 || duration_s <= 0 || interval_ms < 0 || size_mib <= 0) {
+		g_printerr("Invalid client count, duration, interval or size\n");
+		return 1;
+	}
+	if (!parse_methods(&error)) {
+		g_printerr("%s\n", error->message);
+		return 1;
+	}
+	if (!rauc_path)
+		rauc_path = g_strdup(BENCH_RAUC_PATH);
+	if (!keyring)
+		keyring = g_build_filename(BENCH_SOURCE_DIR, "test/openssl-ca/dev-ca.pem", NULL);
+	if (!cert)
+		cert = g_build_filename(BENCH_SOURCE_DIR, "test/openssl-ca/dev/autobuilder-1.cert.pem", NULL);
+	if (!key)
+		key = g_build_filename(BENCH_SOURCE_DIR, "test/openssl-ca/dev/private/autobuilder-1.pem", NULL);
+
+	tmpdir = g_dir_make_tmp("rauc-service-bench-XXXXXX", &error);
+	if (!tmpdir) {
+		g_printerr("%s\n", error->message);
+		return 1;
+	}
+
+	res = run_benchmark(tmpdir, &error);
+	if (!res)
+		g_printerr("%s\n", error->message);
+
+	r_context_clean();
+	if (!rm_tree(tmpdir, NULL))
+		g_printerr("Failed to remove %s\n", tmpdir);
+
+	return res ? 0 : 1;
+}
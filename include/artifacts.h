@@ -63,7 +63,13 @@ typedef struct _RArtifactRepo {
 	/** runtime information for different repo types */
 	union {
 		struct {
+			/* object names mapped to the number of referencing artifacts */
 			GHashTable *local_store_objects;
+			/* artifact directory names included in the reference counts, NULL if unknown */
+			GHashTable *accounted;
+			/* objects which may have become unreferenced */
+			GHashTable *prune_candidates;
+			gboolean index_clean; /* whether the stored object index matches local_store_objects */
 		} composefs;
 	};
 } RArtifactRepo;
@@ -24,7 +24,9 @@ G_GNUC_WARN_UNUSED_RESULT;
  * Remove unreferenced artifacts and inconsistent data such as partial
  * downloads.
  *
- * This also removes unused objects from the object store.
+ * This also removes unused objects from the object store. The references of
+ * each object are counted persistently, so that only the images of artifacts
+ * which were added since the last prune need to be read.
  *
  * @param repo RArtifactRepo to prune
  * @param error a GError, or NULL
@@ -34,6 +36,31 @@ G_GNUC_WARN_UNUSED_RESULT;
 gboolean r_composefs_artifact_repo_prune(RArtifactRepo *repo, GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
 
+/**
+ * Drop the object references of an artifact which is about to be removed.
+ *
+ * The objects which are no longer referenced by any artifact are removed by
+ * the next r_composefs_artifact_repo_prune().
+ *
+ * @param artifact RArtifact to release
+ */
+void r_composefs_artifact_release(const RArtifact *artifact);
+
+/**
+ * Persist the composefs specific state of the repo.
+ *
+ * This writes the object store index, which allows
+ * r_composefs_artifact_repo_prepare() to skip scanning unchanged object
+ * directories.
+ *
+ * @param repo RArtifactRepo to commit
+ * @param error a GError, or NULL
+ *
+ * @return TRUE if the commit was successful, otherwise FALSE
+ */
+gboolean r_composefs_artifact_repo_commit(RArtifactRepo *repo, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
 /**
  * Install a composefs artifact from the bundle into the repo.
  *
@@ -61,6 +88,17 @@ static inline gboolean r_composefs_artifact_repo_prune(RArtifactRepo *repo, GErr
 	return FALSE;
 }
 
+static inline void r_composefs_artifact_release(const RArtifact *artifact)
+{
+	g_error("composefs support not enabled at compile time");
+}
+
+static inline gboolean r_composefs_artifact_repo_commit(RArtifactRepo *repo, GError **error)
+{
+	g_error("composefs support not enabled at compile time");
+	return FALSE;
+}
+
 static inline gboolean r_composefs_artifact_install(const RArtifact *artifact, const RaucImage *image, const gchar *name, GError **error)
 {
 	g_error("composefs support not enabled at compile time");
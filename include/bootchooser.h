@@ -43,6 +43,66 @@ G_GNUC_WARN_UNUSED_RESULT;
 gchar *r_boot_get_current_bootname(RaucConfig *config, const gchar *cmdline, GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
 
+/**
+ * Starts collecting bootloader changes of the calling thread.
+ *
+ * Until r_boot_commit() or r_boot_abort() is called, the grub, barebox and
+ * U-Boot backends collect the changes of r_boot_set_state() and
+ * r_boot_set_primary() instead of writing them, so they can be applied
+ * together with a single tool invocation or environment write. The
+ * collected changes are visible to r_boot_get_state() and
+ * r_boot_get_primary() in the same thread. Other backends apply changes
+ * immediately.
+ *
+ * Transactions can't be nested.
+ */
+void r_boot_begin(void);
+
+/**
+ * Checks whether the calling thread is collecting bootloader changes.
+ *
+ * @return TRUE if r_boot_begin() was called by this thread
+ */
+gboolean r_boot_in_transaction(void)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Applies the bootloader changes collected since r_boot_begin().
+ *
+ * The transaction is finished even if applying the changes failed.
+ *
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE if successful, FALSE if failed
+ */
+gboolean r_boot_commit(GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Discards the bootloader changes collected since r_boot_begin().
+ */
+void r_boot_abort(void);
+
+/**
+ * Adds a 'key=value' pair to the changes collected by a backend, replacing
+ * an earlier change of the same key.
+ *
+ * @param pending array of 'key=value' strings
+ * @param pair 'key=value' string to add
+ */
+void r_boot_pending_set(GPtrArray *pending, const gchar *pair);
+
+/**
+ * Looks up a key in the changes collected by a backend.
+ *
+ * @param pending array of 'key=value' strings, or NULL
+ * @param key key to look up
+ *
+ * @return the pending value, or NULL if the key was not changed
+ */
+const gchar *r_boot_pending_get(const GPtrArray *pending, const gchar *key)
+G_GNUC_WARN_UNUSED_RESULT;
+
 /**
  * Mark slot as good or bad.
  *
@@ -66,6 +126,24 @@ G_GNUC_WARN_UNUSED_RESULT;
 gboolean r_boot_set_primary(RaucSlot *slot, GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
 
+/**
+ * Get bootloader state of multiple slots at once.
+ *
+ * This is only supported by backends which can query all slots with a single
+ * request (currently barebox and persistent custom backends). Otherwise,
+ * R_BOOTCHOOSER_ERROR_NOT_SUPPORTED is returned and r_boot_get_state() must
+ * be used for each slot.
+ *
+ * @param slots slots (with a bootname) to get the boot state from
+ * @param good return location for slots->len slot states,
+ *             TRUE means 'good', FALSE means 'bad'
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE if successful, FALSE if failed
+ */
+gboolean r_boot_get_states(GPtrArray *slots, gboolean *good, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
 /**
  * Get primary boot slot.
  *
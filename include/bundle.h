@@ -30,11 +30,15 @@ typedef struct {
 	gboolean tls_no_verify;
 	GStrv http_headers;
 	GPtrArray *http_info_headers;
+	GStrv mirrors; /* additional URLs of the same bundle, in order of preference */
+	guint64 rate_limit; /* maximum download rate in bytes per second (0 for no limit) */
 } RaucBundleAccessArgs;
 
 typedef struct {
 	gchar *path;
 	gchar *origpath;
+	/* temporary directory of a downloaded bundle, or NULL */
+	gchar *download_dir;
 	gchar *storepath;
 
 	RaucNBDDevice *nbd_dev;
@@ -86,6 +90,27 @@ typedef enum {
 gboolean create_bundle(const gchar *bundlename, const gchar *contentdir, GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
 
+/**
+ * Create several bundles described by a batch file.
+ *
+ * The batch file contains [bundle.<name>] sections with the 'input'
+ * directory, the 'output' bundle and optionally a 'signer', which refers to a
+ * [signer.<name>] section with 'cert', 'key' and 'intermediate' entries.
+ * Bundles without a signer use the cert and key from the context.
+ *
+ * The payload of each input directory is built once (concurrently for
+ * different inputs) and shared by all bundles using it. The signatures are
+ * created afterwards with each key loaded only once. On error, all outputs
+ * are removed.
+ *
+ * @param batchfile path of the batch file
+ * @param error Return location for a GError
+ *
+ * @return TRUE on success, FALSE if an error occurred
+ */
+gboolean create_bundle_batch(const gchar *batchfile, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
 /**
  * Check a bundle.
  *
@@ -107,6 +132,34 @@ G_GNUC_WARN_UNUSED_RESULT;
 gboolean check_bundle(const gchar *bundlename, RaucBundle **bundle, CheckBundleParams params, RaucBundleAccessArgs *access_args, GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
 
+/**
+ * Prepares a bundle file descriptor passed by a client for check_bundle().
+ *
+ * Regular files (including memfds) are used directly. Pipes and sockets are
+ * read into a sealed memfd, as the bundle needs random access (the signature
+ * is stored at its end), but should not be written to disk first.
+ *
+ * The bundle can be accessed using the path returned by r_bundle_fd_path().
+ *
+ * @param fd file descriptor passed by the client (is not closed)
+ * @param max_size maximum size accepted from pipes and sockets
+ * @param error Return location for a GError
+ *
+ * @return a new read-only file descriptor for the bundle, -1 on error
+ */
+gint r_bundle_open_fd(gint fd, guint64 max_size, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Returns a path which can be used to open the bundle file descriptor
+ * returned by r_bundle_open_fd().
+ *
+ * @param fd bundle file descriptor
+ *
+ * @return newly allocated path
+ */
+gchar *r_bundle_fd_path(gint fd);
+
 /**
  * Check the bundle payload, if needed and possible.
  *
@@ -127,6 +180,23 @@ G_GNUC_WARN_UNUSED_RESULT;
 gboolean check_bundle_payload(RaucBundle *bundle, GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
 
+/**
+ * Stages a remote bundle for a later installation.
+ *
+ * The bundle signature is checked and the full payload is read through the
+ * streaming cache (which must be configured) and verified against the
+ * dm-verity hash tree. A later installation of the same bundle then reads the
+ * payload from the cache instead of downloading it again.
+ *
+ * @param bundlename URL of the bundle to stage
+ * @param access_args optional arguments for accessing the bundle, or NULL
+ * @param error Return location for a GError
+ *
+ * @return TRUE on success, FALSE if an error occurred
+ */
+gboolean stage_bundle(const gchar *bundlename, RaucBundleAccessArgs *access_args, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
 /**
  * Resign a bundle.
  *
@@ -288,6 +358,24 @@ G_DEFINE_AUTOPTR_CLEANUP_FUNC(RaucBundle, free_bundle);
 GPtrArray *assemble_info_headers(const gchar *transaction)
 G_GNUC_WARN_UNUSED_RESULT;
 
+/**
+ * Returns the content of the mksquashfs sort file for the streaming layout.
+ *
+ * mksquashfs places files with a higher priority first. The small files
+ * needed before any image data (manifest, hooks, handler and the adaptive
+ * indices) are placed at the start of the payload, followed by the data of
+ * each image (and its chunk-pack) in manifest order, so that installing from
+ * a streamed bundle results in fewer, larger and mostly sequential requests.
+ * Files which are missing in the workdir are skipped.
+ *
+ * @param manifest manifest of the bundle
+ * @param workdir directory containing the bundle contents
+ *
+ * @return newly allocated sort file content ("<path> <priority>" lines)
+ */
+gchar *streaming_sort_order(const RaucManifest *manifest, const gchar *workdir)
+G_GNUC_WARN_UNUSED_RESULT;
+
 /**
  * Frees the memory pointed to by the RaucBundleAccessArgs, but not the
  * structure itself.
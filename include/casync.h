@@ -0,0 +1,73 @@
+#pragma once
+
+#include <glib.h>
+
+#define R_CASYNC_ERROR r_casync_error_quark()
+GQuark r_casync_error_quark(void);
+
+typedef enum {
+	R_CASYNC_ERROR_FAILED,
+	R_CASYNC_ERROR_INVALID_INDEX,
+	R_CASYNC_ERROR_UNSUPPORTED,
+	R_CASYNC_ERROR_FETCH,
+	R_CASYNC_ERROR_CORRUPT_CHUNK,
+} RCasyncError;
+
+#define R_CASYNC_CHUNK_ID_LEN 32
+
+typedef struct {
+	guint64 offset; /* in the blob */
+	guint32 size;
+	guint8 id[R_CASYNC_CHUNK_ID_LEN];
+} RCasyncChunk;
+
+typedef struct {
+	guint64 feature_flags;
+	guint64 chunk_size_max;
+	guint64 size; /* of the blob */
+	GArray *chunks; /* RCasyncChunk, ordered by offset */
+	GHashTable *lookup; /* chunk ID -> first RCasyncChunk with this ID */
+} RCasyncIndex;
+
+/**
+ * Loads a casync blob index (.caibx) file.
+ *
+ * @param filename path of the index file
+ * @param error return location for a GError, or NULL
+ *
+ * @return a new RCasyncIndex, or NULL on error
+ */
+RCasyncIndex *r_casync_index_load(const gchar *filename, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Frees a casync index.
+ *
+ * @param index RCasyncIndex to free
+ */
+void r_casync_index_free(RCasyncIndex *index);
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(RCasyncIndex, r_casync_index_free);
+
+/**
+ * Reconstructs the blob described by a casync index.
+ *
+ * Chunks contained in the seed index are read from seed_fd and verified.
+ * All other chunks are fetched from the chunk store, which can be a local
+ * directory or an HTTP(S) URL. Remote chunks are downloaded in parallel
+ * (multiplexed over HTTP/2 if supported by the server), and decompression and
+ * verification happen in worker threads.
+ *
+ * The blob is written sequentially to out_fd, so that it can also be used for
+ * UBI volumes.
+ *
+ * @param index index of the blob to extract
+ * @param store path or URL of the chunk store
+ * @param seed_fd file descriptor of the seed, or -1
+ * @param seed_index index describing the content of seed_fd, or NULL
+ * @param out_fd file descriptor to write the blob to
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE if an error occurred
+ */
+gboolean r_casync_extract_blob(const RCasyncIndex *index, const gchar *store, int seed_fd, const RCasyncIndex *seed_index, int out_fd, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
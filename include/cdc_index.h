@@ -0,0 +1,162 @@
+#pragma once
+
+#include <glib.h>
+
+#include "config_file.h"
+#include "slot.h"
+#include "stats.h"
+
+#define R_CDC_INDEX_ERROR r_cdc_index_error_quark()
+GQuark r_cdc_index_error_quark(void);
+
+typedef enum {
+	R_CDC_INDEX_ERROR_FORMAT,
+	R_CDC_INDEX_ERROR_NOT_FOUND,
+} RCdcIndexErrorError;
+
+/* chunk size limits of the content-defined chunker */
+#define R_CDC_INDEX_MIN_SIZE (2*1024)
+#define R_CDC_INDEX_AVG_SIZE (8*1024)
+#define R_CDC_INDEX_MAX_SIZE (64*1024)
+
+typedef struct {
+	guint64 offset; /* in the indexed data */
+	guint32 size;
+	guint32 next; /* next chunk with the same hash, or G_MAXUINT32 */
+	guint8 hash[32];
+} RaucCdcChunk;
+
+typedef struct {
+	gchar *label; /* label for debugging */
+	int data_fd; /* file descriptor of the indexed data */
+	GArray *chunks; /* RaucCdcChunk, ordered by offset */
+	GHashTable *lookup; /* hash -> number of the first chunk with this hash + 1 */
+	guint64 invalid_below; /* chunks starting before this offset are not used */
+	RaucStats *match_stats; /* how many searches were successful */
+	gboolean skip_hash_check; /* whether to skip the hash check (for bundle payload protected by verity) */
+} RaucCdcIndex;
+
+/**
+ * Finds the end of the next content-defined chunk.
+ *
+ * This uses FastCDC with a gear rolling hash and normalized chunking. The
+ * hash is not evaluated for the first R_CDC_INDEX_MIN_SIZE bytes, as no cut
+ * point is allowed there.
+ *
+ * @param data pointer to the data starting at the current chunk
+ * @param len number of bytes available, which must be at least
+ *        R_CDC_INDEX_MAX_SIZE unless the end of the data is reached
+ *
+ * @return the size of the next chunk
+ */
+gsize r_cdc_next_chunk(const guint8 *data, gsize len);
+
+/**
+ * Creates a content-defined chunk index for a given open file descriptor.
+ *
+ * If an existing index file is provided via 'index_filename', this will be
+ * used instead of chunking the data.
+ *
+ * @param label label for the index (used for debugging/identification)
+ * @param data_fd open file descriptor of the data to index, owned by the index on success
+ * @param index_filename name of existing index file to use instead, or NULL
+ * @param error return location for a GError, or NULL
+ *
+ * @return a newly allocated RaucCdcIndex or NULL on error
+ */
+RaucCdcIndex *r_cdc_index_open(const gchar *label, int data_fd, const gchar *index_filename, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Creates a content-defined chunk index for the given slot.
+ *
+ * Loads a previously stored `cdc-hash-index` file from the latest slot's
+ * hash directory or falls back to chunking the slot device.
+ *
+ * @param label label for the index (used for debugging/identification)
+ * @param slot slot to open the index for
+ * @param flags flags for g_open() call
+ * @param error return location for a GError, or NULL
+ *
+ * @return a newly allocated RaucCdcIndex or NULL on error
+ */
+RaucCdcIndex *r_cdc_index_open_slot(const gchar *label, const RaucSlot *slot, int flags, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Creates a content-defined chunk index for the given image.
+ *
+ * Loads the `<image>.cdc-hash-index` file from the bundle.
+ *
+ * @param label label for the index (used for debugging/identification)
+ * @param image image to open the index for
+ * @param error return location for a GError, or NULL
+ *
+ * @return a newly allocated RaucCdcIndex or NULL on error
+ */
+RaucCdcIndex *r_cdc_index_open_image(const gchar *label, const RaucImage *image, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Exports the index to a file.
+ *
+ * @param idx RaucCdcIndex to export
+ * @param index_filename name of exported file
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE on failure
+ */
+gboolean r_cdc_index_export(const RaucCdcIndex *idx, const gchar *index_filename, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Exports the index to the slot data dir in an image-checksum specific file.
+ *
+ * @param idx RaucCdcIndex to export
+ * @param slot slot to write data for
+ * @param checksum image checksum to write for
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE on failure
+ */
+gboolean r_cdc_index_export_slot(const RaucCdcIndex *idx, const RaucSlot *slot, const RaucChecksum *checksum, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Searches for a chunk in the index and reads its data.
+ *
+ * Only chunks starting at or after idx->invalid_below are used. Unless
+ * skip_hash_check is set, the data is verified against the hash.
+ *
+ * @param idx RaucCdcIndex to obtain the chunk from
+ * @param hash hash to find
+ * @param size size of the chunk
+ * @param data return location for size bytes of data
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE if the chunk was found (and the data is reliable), FALSE if not found
+ */
+gboolean r_cdc_index_get_chunk(const RaucCdcIndex *idx, const guint8 *hash, guint32 size, guint8 *data, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Checks whether the data at a given offset is the given chunk.
+ *
+ * This is used to detect chunks which are already in place. The data is
+ * always read and verified, as a stored index may be outdated.
+ *
+ * @param idx RaucCdcIndex to check
+ * @param chunk expected chunk
+ * @param buf scratch buffer of at least chunk->size bytes
+ *
+ * @return TRUE if the chunk is already in place, FALSE otherwise
+ */
+gboolean r_cdc_index_has_chunk_at(const RaucCdcIndex *idx, const RaucCdcChunk *chunk, guint8 *buf);
+
+/**
+ * Frees the index.
+ *
+ * @param idx RaucCdcIndex to free
+ */
+void r_cdc_index_free(RaucCdcIndex *idx);
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(RaucCdcIndex, r_cdc_index_free);
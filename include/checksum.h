@@ -31,6 +31,25 @@ typedef struct {
 gboolean compute_checksum(RaucChecksum *checksum, const gchar *filename, GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
 
+/**
+ * Updates RaucChecksum and calculates the chunk hashes in the same pass.
+ *
+ * This works like compute_checksum(), but additionally calculates the SHA256
+ * hashes of all R_HASH_INDEX_CHUNK_SIZE chunks as used by the block hash
+ * index, so that the file only needs to be read once.
+ *
+ * If the file size is not a multiple of the chunk size, no chunk hashes are
+ * returned.
+ *
+ * @param checksum RaucChecksum to update
+ * @param filename name of file to calculate checksum for
+ * @param chunk_hashes return location for the chunk hashes (left NULL if not available)
+ * @param error return location for a GError, or NULL
+ * @return TRUE on success, FALSE if an error occurred
+ */
+gboolean compute_checksum_with_chunk_hashes(RaucChecksum *checksum, const gchar *filename, GBytes **chunk_hashes, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
 /**
  * Verifies provided file checksum.
  *
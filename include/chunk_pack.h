@@ -0,0 +1,92 @@
+#pragma once
+
+#include <glib.h>
+
+#include "manifest.h"
+
+#define R_CHUNK_PACK_ERROR r_chunk_pack_error_quark()
+GQuark r_chunk_pack_error_quark(void);
+
+typedef enum {
+	R_CHUNK_PACK_ERROR_FORMAT,
+	R_CHUNK_PACK_ERROR_NOT_FOUND,
+	R_CHUNK_PACK_ERROR_CORRUPT,
+} RChunkPackErrorError;
+
+/* number of consecutive block-hash-index chunks compressed together */
+#define R_CHUNK_PACK_GROUP_CHUNKS 16
+
+typedef struct {
+	int fd; /* file descriptor of the pack */
+	guint32 chunk_count; /* number of chunks in the image */
+	guint32 group_count;
+	guint64 *offsets; /* group_count + 1 offsets of the compressed groups in the pack */
+
+	/* most recently decompressed group */
+	guint32 cached_group;
+	guint8 *cached_data;
+} RaucChunkPack;
+
+/**
+ * Creates a chunk pack for an image.
+ *
+ * The image is split into groups of R_CHUNK_PACK_GROUP_CHUNKS chunks of
+ * R_HASH_INDEX_CHUNK_SIZE bytes, which are compressed individually with zstd.
+ *
+ * @param imagepath path of the image
+ * @param packpath path of the chunk pack to create
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE on failure
+ */
+gboolean r_chunk_pack_create(const gchar *imagepath, const gchar *packpath, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Opens the `<image>.chunk-pack` file of an image in the bundle.
+ *
+ * @param image image to open the chunk pack for
+ * @param error return location for a GError, or NULL
+ *
+ * @return a newly allocated RaucChunkPack or NULL on error
+ */
+RaucChunkPack *r_chunk_pack_open_image(const RaucImage *image, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Reads consecutive chunks from the pack.
+ *
+ * Only the groups containing the chunks are read and decompressed. The last
+ * group is kept, so that sequential reads decompress each group once.
+ *
+ * @param pack RaucChunkPack to read from
+ * @param first first chunk to read
+ * @param count number of chunks to read
+ * @param data return location for count*R_HASH_INDEX_CHUNK_SIZE bytes
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE on failure
+ */
+gboolean r_chunk_pack_read(RaucChunkPack *pack, guint32 first, guint32 count, guint8 *data, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Returns the range of the pack file which contains the given chunks.
+ *
+ * This is used to prefetch the compressed data.
+ *
+ * @param pack RaucChunkPack
+ * @param first first chunk
+ * @param count number of chunks
+ * @param offset return location for the offset in the pack file
+ * @param size return location for the size of the range
+ */
+void r_chunk_pack_get_range(const RaucChunkPack *pack, guint32 first, guint32 count, off_t *offset, off_t *size);
+
+/**
+ * Frees the chunk pack.
+ *
+ * @param pack RaucChunkPack to free
+ */
+void r_chunk_pack_free(RaucChunkPack *pack);
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(RaucChunkPack, r_chunk_pack_free);
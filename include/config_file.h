@@ -3,8 +3,10 @@
 #include <glib.h>
 
 #include "checksum.h"
+#include "dm.h"
 #include "manifest.h"
 #include "slot.h"
+#include "utils.h"
 
 /* Default maximum downloadable bundle size (8 MiB) */
 #define DEFAULT_MAX_BUNDLE_DOWNLOAD_SIZE 8*1024*1024
@@ -38,6 +40,13 @@ typedef enum {
 	R_CONFIG_SYS_VARIANT_NAME,
 } RConfigSysVariant;
 
+/* Scheduling settings for installations from a [priority.<name>] section */
+typedef struct {
+	const gchar *name; /* interned */
+	RaucThreadPriority thread; /* for the installation threads and their subprocesses */
+	guint64 rate_limit; /* maximum write and download rate in bytes per second (0 disables) */
+} RaucInstallPriority;
+
 /* System configuration */
 typedef struct {
 	gchar *system_compatible;
@@ -50,8 +59,14 @@ typedef struct {
 	gint boot_default_attempts;
 	gint boot_attempts_primary;
 	gchar *grubenv_path;
+	/* fw_env.config for native U-Boot environment access */
+	gchar *uboot_env_config;
 	gchar *custom_bootloader_backend;
+	/* run the custom backend as a co-process handling multiple requests */
+	gboolean custom_bootloader_persistent;
 	gboolean efi_use_bootnext;
+	/* efivarfs mount point for native EFI variable access */
+	gchar *efivarfs_path;
 	/** prevent fallback after successfully booting into primary slot */
 	gboolean prevent_late_fallback;
 	/* maximum filesize to download in bytes */
@@ -78,6 +93,20 @@ typedef struct {
 	guint bundle_formats_mask;
 	/* enable complete read before mount */
 	gboolean perform_pre_check;
+	/* optional parameters for the dm-verity/dm-crypt bundle targets */
+	RaucDMProfile dm_profile;
+	/* start writeback and drop cached data after this many bytes (0 disables) */
+	guint64 write_behind_size;
+	/* budget for large allocations, see memory.h (0 disables) */
+	guint64 memory_limit;
+	/* maximum number of slots to install in parallel */
+	gint install_concurrency;
+	/* name of the default install priority (NULL for none) */
+	gchar *install_priority;
+	/* RaucInstallPriority by name */
+	GHashTable *install_priorities;
+	/* build missing slot hash indexes in the service after mark-good */
+	gboolean background_hash_index;
 
 	gchar *autoinstall_path;
 	gchar *preinstall_handler;
@@ -92,6 +121,10 @@ typedef struct {
 	gchar *streaming_tls_cert;
 	gchar *streaming_tls_key;
 	gchar *streaming_tls_ca;
+	gchar *streaming_cache_directory;
+	gchar *streaming_tls_session_cache;
+	guint64 streaming_cache_size;
+	gint streaming_connections;
 
 	/* encryption */
 	gchar *encryption_key;
@@ -104,6 +137,11 @@ typedef struct {
 	/* flag to ensure slot states were determined */
 	gboolean slot_states_determined;
 	gchar *file_checksum;
+	/* identity of the config file when loaded, to avoid rehashing it when unchanged */
+	guint64 file_dev;
+	guint64 file_ino;
+	guint64 file_size;
+	gint64 file_mtime_ns;
 
 	GHashTable *artifact_repos;
 } RaucConfig;
@@ -187,6 +225,7 @@ G_DEFINE_AUTOPTR_CLEANUP_FUNC(RaucConfig, free_config);
  * Checks if the current file checksum of the system config matches the one currently loaded.
  *
  * Prints a warning if the checksums of the config file does not match the one
- * recorded during config parsing.
+ * recorded during config parsing. The file is only read and hashed again if
+ * its inode, size or modification time changed since it was loaded.
  */
 void r_config_file_modified_check(void);
@@ -14,6 +14,9 @@ typedef void (*progress_callback) (gint percentage, const gchar *message,
 typedef struct {
 	/* The bundle currently mounted by RAUC */
 	RaucBundle *mounted_bundle;
+	/* Slot hook environment cached for slot_hook_env_bundle */
+	gchar **slot_hook_env;
+	RaucBundle *slot_hook_env_bundle;
 } RContextInstallationInfo;
 
 typedef enum {
@@ -44,6 +47,7 @@ typedef struct {
 
 	GList *progress; /* List of RaucProgressStep used as sub step stack (most recent first) */
 	progress_callback progress_callback;
+	GVariantBuilder *step_report; /* completed steps, see r_context_begin_step_report() */
 
 	/* signing data */
 	gchar *certpath;
@@ -53,6 +57,12 @@ typedef struct {
 	gchar *signing_keyringpath;
 	gchar *encryption_key;
 	gchar *mksquashfs_args;
+	gint mksquashfs_processors; /* 0 uses the mksquashfs default */
+	gchar *mksquashfs_block_size;
+	gchar *mksquashfs_comp; /* compressor with optional level (COMP[:LEVEL]) */
+	gchar *bundle_cache_dir; /* build cache for data derived from images */
+	gchar *bundle_delta_base; /* bundle to create delta images against */
+	gchar *bundle_layout; /* payload layout ("default" or "streaming") */
 	gchar *casync_args;
 	gchar **recipients;
 	gchar **intermediatepaths;
@@ -91,8 +101,25 @@ typedef struct {
 	gfloat percent_total;
 	gfloat percent_done;
 	gint last_explicit_percent;
+
+	gint64 start_time; /* monotonic time when the step was started */
+
+	/* byte-based progress, see r_context_set_step_bytes() */
+	goffset bytes_done;
+	goffset bytes_total; /* 0 if the step is not byte-based */
+	gdouble rate; /* smoothed throughput in bytes per second */
+	gint64 rate_time; /* monotonic time of the last rate update */
+	goffset rate_bytes; /* bytes_done at rate_time */
 } RaucProgressStep;
 
+typedef struct {
+	const gchar *step; /* name of the innermost byte-based step */
+	goffset done;
+	goffset total;
+	gdouble rate; /* smoothed throughput in bytes per second, 0 if unknown */
+	gdouble eta; /* estimated seconds until the step is done, negative if unknown */
+} RaucProgressBytes;
+
 /**
  * Starts a new progress step at the current nesting level.
  *
@@ -163,6 +190,58 @@ void r_context_end_step(const gchar *name, gboolean success);
  */
 void r_context_set_step_percentage(const gchar *name, gint percentage);
 
+/**
+ * Sets the number of bytes processed by the given step.
+ *
+ * The percentage of the step is derived from the bytes. Additionally, the
+ * throughput is smoothed and the remaining time estimated, so that progress
+ * callbacks can query them with r_context_get_progress_bytes().
+ *
+ * In contrast to r_context_set_step_percentage(), progress is sent even if
+ * the percentage did not change, so that stalled steps can be detected.
+ * Callers need to limit the update rate (see R_COPY_PROGRESS_INTERVAL).
+ *
+ * @param name identifying the step. Must be a step with no explicit substeps.
+ * @param done bytes processed so far
+ * @param total total number of bytes to process
+ */
+void r_context_set_step_bytes(const gchar *name, goffset done, goffset total);
+
+/**
+ * Returns the byte-based progress of the innermost byte-based step.
+ *
+ * This is intended to be called from the progress callback.
+ *
+ * @param bytes return location for the progress
+ *
+ * @return TRUE if a byte-based step is active, FALSE otherwise
+ */
+gboolean r_context_get_progress_bytes(RaucProgressBytes *bytes);
+
+/**
+ * Ignores the progress steps of the calling thread.
+ *
+ * This is used for operations which run concurrently with an installation
+ * (such as inspecting a bundle), so that they don't disturb its progress.
+ *
+ * @param muted whether to ignore the steps of the calling thread
+ */
+void r_context_set_progress_muted(gboolean muted);
+
+/**
+ * Checks whether the calling thread reports progress within a step.
+ *
+ * Threads whose steps are ignored (see r_context_set_progress_muted()) never
+ * have a current step, so they don't access the progress of an installation
+ * running concurrently.
+ *
+ * @param name name the current step must have, or NULL for any step
+ *
+ * @return TRUE if the calling thread may update the current step, FALSE
+ *         otherwise
+ */
+gboolean r_context_in_progress_step(const gchar *name);
+
 /**
  * Frees the memory allocated by the RaucProgressStep.
  *
@@ -172,6 +251,25 @@ void r_context_free_progress_step(RaucProgressStep *step);
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC(RaucProgressStep, r_context_free_progress_step);
 
+/**
+ * Starts recording the duration of all progress steps.
+ *
+ * Each step which ends until r_context_end_step_report() is added to the
+ * report, so nested steps are listed before their parent step.
+ */
+void r_context_begin_step_report(void);
+
+/**
+ * Stops recording progress steps.
+ *
+ * Each entry of the report contains the 'name' and 'description' (both ``s``)
+ * of the step, its nesting 'depth' (``i``, 1 for the root step), the
+ * 'duration' in seconds (``d``) and whether it was successful (``b``).
+ *
+ * @return a new floating GVariant of type 'aa{sv}'
+ */
+GVariant *r_context_end_step_report(void);
+
 /**
  * Callback to register for progress updates.
  *
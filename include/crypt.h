@@ -2,6 +2,8 @@
 
 #include <glib.h>
 
+#include "verity_hash.h"
+
 #define R_CRYPT_ERROR r_crypt_error_quark()
 GQuark r_crypt_error_quark(void);
 
@@ -23,6 +25,25 @@ typedef enum {
  */
 gboolean r_crypt_encrypt(const gchar *in, const gchar *out, const guint8 *key, GError **error);
 
+/**
+ * Encrypts an image in place.
+ *
+ * Creates the same result as r_crypt_encrypt() without an intermediate file,
+ * as each sector is encrypted independently. If an error occurs, the image
+ * is left partially encrypted.
+ *
+ * If verity is given, the encrypted data is added to it while it is written,
+ * so that the hash tree can be created without reading the image again.
+ *
+ * @param path image to encrypt
+ * @param key AES key to use for encryption
+ * @param verity verity tree for the encrypted image, or NULL
+ * @param error Return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE on error
+ */
+gboolean r_crypt_encrypt_in_place(const gchar *path, const guint8 *key, RaucVerityTree *verity, GError **error);
+
 /**
  * Decrypts AES-encrypted image.
  *
@@ -7,8 +7,18 @@ typedef enum _RaucDMType {
 	RAUC_DM_CRYPT,
 } RaucDMType;
 
+/* Sets of optional target parameters, trading latency and CPU usage. */
+typedef enum _RaucDMProfile {
+	RAUC_DM_PROFILE_AUTO, /* selected by a short benchmark */
+	RAUC_DM_PROFILE_DEFAULT, /* no optional parameters */
+	RAUC_DM_PROFILE_LOW_LATENCY, /* process data in the I/O completion context */
+	RAUC_DM_PROFILE_LOW_CPU, /* like low-latency, and verify blocks only once */
+} RaucDMProfile;
+
 typedef struct _RaucDM {
 	RaucDMType type;
+	RaucDMProfile profile;
+	gchar **options; /* optional target parameters (NULL for none) */
 
 	/* common variables */
 	gchar *uuid;
@@ -49,10 +59,45 @@ void r_dm_free(RaucDM *dm_verity);
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC(RaucDM, r_dm_free);
 
+/**
+ * Parses the name of a dm target profile.
+ *
+ * @param str name ("auto", "default", "low-latency" or "low-cpu")
+ * @param profile return location for the profile
+ *
+ * @return TRUE if the name is valid, FALSE otherwise
+ */
+gboolean r_dm_parse_profile(const gchar *str, RaucDMProfile *profile);
+
+/**
+ * Returns the name of a dm target profile.
+ *
+ * @param profile profile
+ *
+ * @return the name of the profile
+ */
+const gchar *r_dm_profile_to_str(RaucDMProfile profile);
+
+/**
+ * Selects the optional target parameters for a profile.
+ *
+ * For RAUC_DM_PROFILE_AUTO, the hash or cipher throughput of this system is
+ * measured once per process. Fast systems process the data directly in the
+ * I/O completion context, slower ones use the kernel workqueues, so that
+ * several CPUs can be used. The chosen profile is logged.
+ *
+ * @param dm struct to configure
+ * @param profile profile to use
+ */
+void r_dm_set_profile(RaucDM *dm, RaucDMProfile profile);
+
 /**
  * Configure a dm-verity target in the kernel using the provided parameters and
  * return the resulting device name in the struct.
  *
+ * If the kernel does not support the optional parameters, the target is
+ * configured without them.
+ *
  * @param dm_verity struct with configuration
  * @param error Return location for a GError
  *
@@ -70,3 +115,21 @@ gboolean r_dm_setup(RaucDM *dm_verity, GError **error);
  * @return TRUE on success, FALSE if an error occurred
  */
 gboolean r_dm_remove(RaucDM *dm_verity, gboolean deferred, GError **error);
+
+/**
+ * Finds an active dm-verity device which uses lower_dev as its data device.
+ *
+ * This is used to detect slots which are protected by dm-verity (for example
+ * a read-only root filesystem), so that data read from the returned device is
+ * known to be authenticated by the kernel.
+ *
+ * @param lower_dev path of the (slot) block device
+ * @param data_size return location for the size of the data protected by the
+ *        verity device
+ * @param error Return location for a GError
+ *
+ * @return the path of the verity device, or NULL if there is none (without
+ *         setting error) or if an error occurred
+ */
+gchar *r_dm_find_verity_device(const gchar *lower_dev, guint64 *data_size, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
@@ -42,6 +42,8 @@
 #define R_EVENT_LOG_TYPE_SERVICE "service"
 /* Event log type for slot updates */
 #define R_EVENT_LOG_TYPE_WRITE_SLOT "writeslot"
+/* Event log type for the performance report of an installation */
+#define R_EVENT_LOG_TYPE_PERFORMANCE "performance"
 
 typedef struct _REventLogger REventLogger;
 
@@ -64,14 +66,47 @@ typedef struct _REventLogger {
 	REventLogFormat format;
 	goffset maxsize;
 	guint maxfiles;
+	gboolean index;
 	/* runtime information */
 	gboolean configured;
 	gboolean broken;
 	goffset filesize;
 	GFileOutputStream *logstream;
+	GOutputStream *indexstream;
 	void (*writer)(REventLogger* logger, const GLogField *fields, gsize n_fields);
 } REventLogger;
 
+/**
+ * Entry of the index file written next to an event log file.
+ *
+ * The index file '<filename>.idx' contains one fixed-size entry per logged
+ * event, in the order they were written. Integers are stored in big-endian
+ * byte order.
+ */
+typedef struct {
+	guint64 timestamp; /* seconds since the epoch (UTC) */
+	guint64 offset; /* position of the event in the log file */
+	guint32 length; /* length of the event in the log file */
+	gchar type[12]; /* RAUC_EVENT_TYPE, NUL-padded */
+	guint8 transaction_id[16]; /* TRANSACTION_ID as binary UUID, or zero */
+	guint8 boot_id[16]; /* BOOT_ID as binary UUID, or zero */
+} REventLogIndexEntry;
+
+G_STATIC_ASSERT(sizeof(REventLogIndexEntry) == 64);
+
+typedef struct {
+	/* only return events of this type (or NULL for all) */
+	const gchar *type;
+	/* only return events with this transaction ID (or NULL for all) */
+	const gchar *transaction_id;
+	/* only return events with this boot ID (or NULL for all) */
+	const gchar *boot_id;
+	/* only return events logged at or after this time (0 for no limit) */
+	gint64 since;
+	/* only return events logged at or before this time (0 for no limit) */
+	gint64 until;
+} REventLogQuery;
+
 /**
  * Returns log level to use for "PRIORITY" field of structured log array
  *
@@ -122,6 +157,26 @@ GLogWriterOutput r_event_log_writer(GLogLevelFlags log_level, const GLogField *f
  */
 void r_event_log_setup_logger(REventLogger *logger);
 
+/**
+ * Queries the events logged by an indexed logger.
+ *
+ * The log file and all of its rotation files are searched, using the index
+ * files written by loggers with 'index' enabled. As the index is sorted by
+ * time, the time range is found by binary search. Only the index entries in
+ * that range are checked against the other criteria, and only the matching
+ * events are read from the log files.
+ *
+ * Log files without an index file are skipped.
+ *
+ * @param logger logger to query
+ * @param query criteria for the events to return
+ * @param error return location for a GError, or NULL
+ *
+ * @return array of the matching formatted events (oldest first), or NULL on error
+ */
+GPtrArray *r_event_log_query(const REventLogger *logger, const REventLogQuery *query, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
 /**
  * Frees event logging structure.
  *
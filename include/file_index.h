@@ -0,0 +1,134 @@
+#pragma once
+
+#include <glib.h>
+
+#define R_FILE_INDEX_ERROR r_file_index_error_quark()
+GQuark r_file_index_error_quark(void);
+
+typedef enum {
+	R_FILE_INDEX_ERROR_FORMAT,
+	R_FILE_INDEX_ERROR_UNSUPPORTED,
+	R_FILE_INDEX_ERROR_FAILED,
+} RFileIndexError;
+
+/* entry types, using the tar type flags */
+#define R_FILE_ENTRY_REGULAR '0'
+#define R_FILE_ENTRY_HARDLINK '1'
+#define R_FILE_ENTRY_SYMLINK '2'
+#define R_FILE_ENTRY_CHARDEV '3'
+#define R_FILE_ENTRY_BLOCKDEV '4'
+#define R_FILE_ENTRY_DIRECTORY '5'
+#define R_FILE_ENTRY_FIFO '6'
+
+typedef struct {
+	gchar *name; /* member name in the archive */
+	gchar *path; /* normalized name, without leading './' or trailing '/', empty for the archive root */
+	gchar type; /* R_FILE_ENTRY_* */
+	guint32 mode; /* permission bits */
+	guint32 uid;
+	guint32 gid;
+	gint64 mtime; /* in seconds */
+	goffset size; /* size of regular files, 0 otherwise */
+	gchar *digest; /* SHA-256 of regular files, NULL otherwise */
+	gchar *xattrs; /* SHA-256 over the extended attributes, NULL if there are none */
+	gchar *link; /* target of links, device numbers ("major,minor") of devices, NULL otherwise */
+} RaucFileEntry;
+
+typedef struct {
+	GPtrArray *entries; /* RaucFileEntry, in archive order */
+	GHashTable *by_path; /* path -> RaucFileEntry */
+} RaucFileIndex;
+
+typedef struct {
+	GPtrArray *removed; /* old entries to remove, children before their parents */
+	GPtrArray *changed; /* new entries to extract, in archive order */
+	GPtrArray *updated; /* new entries with unchanged content, but different metadata */
+	GPtrArray *kept; /* old entries with unchanged content (including the updated ones) */
+	goffset changed_size; /* sum of the sizes of changed regular files */
+} RaucFileIndexDiff;
+
+/**
+ * Creates a file index for a tar archive.
+ *
+ * Compressed archives are decompressed using the tool corresponding to the
+ * file name suffix (as known by tar). ustar, GNU and pax headers are
+ * supported, but GNU sparse files are not.
+ *
+ * The archive root ('./') is included, so that its ownership and permissions
+ * are restored as well. Extended attributes are taken from the pax records
+ * written by GNU tar with --xattrs.
+ *
+ * @param filename tar archive to index
+ * @param error return location for a GError, or NULL
+ *
+ * @return a newly allocated RaucFileIndex or NULL on error
+ */
+RaucFileIndex *r_file_index_from_tar(const gchar *filename, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Loads a file index written by r_file_index_save().
+ *
+ * @param filename index file to load
+ * @param error return location for a GError, or NULL
+ *
+ * @return a newly allocated RaucFileIndex or NULL on error
+ */
+RaucFileIndex *r_file_index_load(const gchar *filename, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Writes a file index to a file.
+ *
+ * @param index RaucFileIndex to write
+ * @param filename name of the index file
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE on failure
+ */
+gboolean r_file_index_save(const RaucFileIndex *index, const gchar *filename, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Compares the file index of the installed archive with the one of a new
+ * archive.
+ *
+ * An entry is changed if its type, content or extended attributes differ or
+ * if it is a hard link to a changed entry. If only the ownership, permissions or modification time
+ * differ, the entry is updated instead, which doesn't require extracting it.
+ * Old entries which are missing in the new index or have a different type
+ * need to be removed before extracting the changed ones. The archive root is
+ * never removed.
+ *
+ * @param old index of the installed archive
+ * @param new index of the new archive
+ *
+ * @return a newly allocated RaucFileIndexDiff, referencing the entries of
+ *         both indexes
+ */
+RaucFileIndexDiff *r_file_index_diff(const RaucFileIndex *old, const RaucFileIndex *new);
+
+/**
+ * Checks that an entry of an installed archive is still present in a
+ * directory.
+ *
+ * This only uses lstat() and readlink(), so that it is cheap enough to
+ * check all unchanged entries before updating the directory in place. For
+ * regular files, the size and modification time (with a tolerance of two
+ * seconds for vfat) are compared, the content is not read. Ownership and
+ * permissions are not compared, as not all filesystems store them.
+ *
+ * @param entry entry to check
+ * @param root directory the archive was extracted to
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE if the entry is present, FALSE otherwise
+ */
+gboolean r_file_entry_check(const RaucFileEntry *entry, const gchar *root, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+void r_file_index_free(RaucFileIndex *index);
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(RaucFileIndex, r_file_index_free);
+
+void r_file_index_diff_free(RaucFileIndexDiff *diff);
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(RaucFileIndexDiff, r_file_index_diff_free);
@@ -4,36 +4,50 @@
 
 #include "update_handler.h"
 
+typedef struct _RGptSwitch RGptSwitch;
+
 /**
- * Get the address and size of the inactive boot partition
- * if a partition exists in the defined region.
+ * Reads and validates the GPT of a device for switching the boot partition.
+ *
+ * The partition table is read once and kept in memory until the switch is
+ * done by r_gpt_switch_activate(). The boot partition must point to one half
+ * of the defined region, the other half is the inactive one.
  *
  * @param device dev path (/dev/sdX)
- * @param partition will contain the inactive boot partition (start & size)
  * @param region_start start address of the region, where bootpartitions are
  * are inside
  * @param region_size size of the region, where bootpartitions are are inside
  * @param error return location for a GError, or NULL
  *
- * @return True if succeeded, False if failed
+ * @return a new RGptSwitch, or NULL on error
  */
-gboolean r_gpt_switch_get_inactive_partition(const gchar *device,
-		struct boot_switch_partition *partition,
+RGptSwitch *r_gpt_switch_open(const gchar *device,
 		guint64 region_start, guint64 region_size,
 		GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
 
 /**
- * Set the boot partition in the GPT to point to the partition at address and
- * size in partition.
+ * Get the address and size of the inactive boot partition.
  *
- * @param device dev path (/dev/sdX)
- * @param partition updated boot partition (start & size)
+ * @param sw RGptSwitch from r_gpt_switch_open()
+ *
+ * @return the inactive boot partition (start & size), owned by sw
+ */
+const struct boot_switch_partition *r_gpt_switch_get_inactive(const RGptSwitch *sw);
+
+/**
+ * Set the boot partition in the GPT to point to the inactive partition.
+ *
+ * Fails if the primary GPT header was changed since r_gpt_switch_open().
+ * The partition table is re-read by the kernel once after writing.
+ *
+ * @param sw RGptSwitch from r_gpt_switch_open()
  * @param error return location for a GError, or NULL
  *
  * @return True if succeeded, False if failed
  */
-gboolean r_gpt_switch_set_boot_partition(const gchar *device,
-		const struct boot_switch_partition *partition,
-		GError **error)
+gboolean r_gpt_switch_activate(RGptSwitch *sw, GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
+
+void r_gpt_switch_free(RGptSwitch *sw);
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(RGptSwitch, r_gpt_switch_free);
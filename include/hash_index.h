@@ -1,5 +1,6 @@
 #pragma once
 
+#include <gio/gio.h>
 #include <glib.h>
 
 #include "config_file.h"
@@ -13,25 +14,57 @@ typedef enum {
 	R_HASH_INDEX_ERROR_SIZE,
 	R_HASH_INDEX_ERROR_NOT_FOUND,
 	R_HASH_INDEX_ERROR_MODIFIED,
+	R_HASH_INDEX_ERROR_MEMORY,
 } RHashIndexErrorError;
 
+/* size of a single chunk in the hash index */
+#define R_HASH_INDEX_CHUNK_SIZE 4096
+
+/* length of the hash prefixes in a block-hash-prefix file */
+#define R_HASH_INDEX_PREFIX_LEN 8
+
 typedef struct {
-	guint8 data[4096];
+	guint8 data[R_HASH_INDEX_CHUNK_SIZE];
 	guint8 hash[32];
+	guint32 number; /* chunk number at which the data was found */
 } RaucHashIndexChunk;
 
+typedef struct {
+	guint32 tag; /* hash bits following the bucket bits */
+	guint32 chunk; /* chunk number */
+} RaucHashIndexEntry;
+
 typedef struct {
 	gchar *label; /* label for debugging */
 	int data_fd; /* file descriptor of the indexed data */
 	guint32 count; /* number of chunks */
 	GBytes *hashes; /* either GBytes in memory or GMappedFile */
-	guint32 *lookup; /* chunk numbers sorted by chunk hash */
+	GBytes *lookup_data; /* bucket directory followed by lookup entries */
+	guint bucket_bits; /* number of hash prefix bits used to select the bucket */
+	const guint32 *buckets; /* first lookup entry per bucket (2^bucket_bits + 1 entries) */
+	const RaucHashIndexEntry *lookup; /* chunk numbers sorted by hash prefix and chunk number */
 	guint32 invalid_below; /* for old index of target */
 	guint32 invalid_from; /* for new index of target */
 	RaucStats *match_stats; /* how many searches were successful */
 	gboolean skip_hash_check; /* whether to skip the hash check (for bundle payload protected by verity) */
+	gboolean hashes_calculated; /* whether the hashes were calculated from data_fd when opening */
+	gboolean hashes_incomplete; /* whether some hashes are placeholders (see r_hash_index_open_prefixes()) */
+	guint64 reserved_memory; /* memory reserved from the budget for calculated hashes and lookup */
 } RaucHashIndex;
 
+/**
+ * Calculates the SHA256 hashes of consecutive chunks.
+ *
+ * A digest context is kept per thread and reused for all chunks, so this can
+ * be called concurrently from multiple threads. OpenSSL selects the
+ * implementation using the CPU's SHA extensions (if available).
+ *
+ * @param data pointer to count*R_HASH_INDEX_CHUNK_SIZE bytes of data
+ * @param count number of chunks to hash
+ * @param hashes return location for count*32 bytes of hashes
+ */
+void r_hash_index_hash_chunks(const guint8 *data, guint32 count, guint8 *hashes);
+
 /**
  * Creates a hash index for a given open file descriptor.
  *
@@ -48,6 +81,39 @@ typedef struct {
 RaucHashIndex *r_hash_index_open(const gchar *label, int data_fd, const gchar *hashes_filename, GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
 
+/**
+ * Opens a stored hash index file without the indexed data.
+ *
+ * As no data is available (data_fd is -1), only r_hash_index_find_chunk() can
+ * be used with this index. This is used to compare images with the index of
+ * an image from a previous bundle.
+ *
+ * @param label label for hash index (used for debugging/identification)
+ * @param hashes_filename name of the hash index file
+ * @param error return location for a GError, or NULL
+ *
+ * @return a newly allocated RaucHashIndex or NULL on error
+ */
+RaucHashIndex *r_hash_index_open_file(const gchar *label, const gchar *hashes_filename, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Creates a hash index for a given open file descriptor from precalculated
+ * chunk hashes.
+ *
+ * This is used when the hashes were already calculated together with the
+ * checksum (see compute_checksum_with_chunk_hashes()).
+ *
+ * @param label label for hash index (used for debugging/identification)
+ * @param data_fd open file descriptor of the hashed file
+ * @param hashes SHA256 hashes of all chunks of data_fd
+ * @param error return location for a GError, or NULL
+ *
+ * @return a newly allocated RaucHashIndex or NULL on error
+ */
+RaucHashIndex *r_hash_index_new_from_hashes(const gchar *label, int data_fd, GBytes *hashes, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
 /**
  * Reuses a previously opened hash index with a new file descriptor.
  *
@@ -96,6 +162,32 @@ G_GNUC_WARN_UNUSED_RESULT;
 RaucHashIndex *r_hash_index_open_image(const gchar *label, const RaucImage *image, GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
 
+/**
+ * Creates a hash index for an image from a compact file of hash prefixes.
+ *
+ * Only the full hashes which are needed to reuse chunks are loaded: Chunks
+ * whose hash prefix is found in one of the candidate indexes (or matches the
+ * zero chunk) are resolved by reading the page of the full hash index file
+ * containing them. All other chunks can only be read from the image itself,
+ * so they get a placeholder hash which does not match any real chunk and
+ * hashes_incomplete is set.
+ *
+ * As chunks are only reused by their full hash, a prefix collision can only
+ * cause an additional page to be read. When streaming, this avoids
+ * downloading the complete index before the update can be planned.
+ *
+ * @param label label for hash index (used for debugging/identification)
+ * @param data_fd open file descriptor of the image
+ * @param prefix_filename name of the hash prefix file
+ * @param hashes_filename name of the full hash index file
+ * @param candidates GPtrArray of RaucHashIndex with the locally available chunks
+ * @param error return location for a GError, or NULL
+ *
+ * @return a newly allocated RaucHashIndex or NULL on error
+ */
+RaucHashIndex *r_hash_index_open_prefixes(const gchar *label, int data_fd, const gchar *prefix_filename, const gchar *hashes_filename, const GPtrArray *candidates, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
 /**
  * Exports raw hash index to file
  *
@@ -108,6 +200,18 @@ G_GNUC_WARN_UNUSED_RESULT;
 gboolean r_hash_index_export(const RaucHashIndex *idx, const gchar *hashes_filename, GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
 
+/**
+ * Exports the first R_HASH_INDEX_PREFIX_LEN bytes of each hash to a file.
+ *
+ * @param idx RaucHashIndex to export
+ * @param prefix_filename name of exported file
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE on failure
+ */
+gboolean r_hash_index_export_prefixes(const RaucHashIndex *idx, const gchar *prefix_filename, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
 /**
  * Exports (writes) raw hash index to slot data dir in an image-checksum specific file.
  *
@@ -121,11 +225,53 @@ G_GNUC_WARN_UNUSED_RESULT;
 gboolean r_hash_index_export_slot(const RaucHashIndex *idx, const RaucSlot *slot, const RaucChecksum *checksum, GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
 
+/**
+ * Builds and stores the hash index for a slot.
+ *
+ * This is intended to run in the background while the slot content doesn't
+ * change. The chunk hashes are appended to a `block-hash-index.partial` file
+ * in the slot's checksum data directory as they are calculated, so a cancelled
+ * or interrupted run continues where it stopped. When complete, the index is
+ * stored as `block-hash-index` (including the lookup table) and the partial
+ * file is removed.
+ *
+ * If checksum has no digest, the SHA256 checksum of the slot content is
+ * calculated in the same pass and stored in checksum, so the index is stored
+ * for this checksum instead of 'unknown'.
+ *
+ * @param slot slot to build the hash index for (requires a data directory)
+ * @param checksum checksum of the slot content, or one without digest
+ * @param cancellable a GCancellable, or NULL
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE on failure
+ */
+gboolean r_hash_index_build_slot(const RaucSlot *slot, RaucChecksum *checksum, GCancellable *cancellable, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Search for hash in given hash index without reading the data.
+ *
+ * This uses the same rules as r_hash_index_get_chunk() to select the chunk,
+ * but only looks at the hashes in the index. As the data is not verified, the
+ * caller needs to check it when reading the chunk later.
+ *
+ * @param idx RaucHashIndex to search
+ * @param hash hash to find
+ * @param number return location for the chunk number
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE if a chunk with this hash is in the valid range, FALSE if not
+ */
+gboolean r_hash_index_find_chunk(const RaucHashIndex *idx, const guint8 *hash, guint32 *number, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
 /**
  * Search for hash in given hash index.
  *
  * If the hash is found in the provided index, the function returns TRUE and
- * the data inside the provided chunk is reliable.
+ * the data inside the provided chunk is reliable. The chunk number at which
+ * it was found is stored in chunk->number.
  *
  * If the hash is not found, the function returns FALSE and the reason can be
  * obtained from error.
@@ -140,6 +286,70 @@ G_GNUC_WARN_UNUSED_RESULT;
 gboolean r_hash_index_get_chunk(const RaucHashIndex *idx, const guint8 *hash, RaucHashIndexChunk *chunk, GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
 
+/**
+ * Check whether the chunk at a given position has the given hash.
+ *
+ * This is used to detect chunks which are already in place, so that they
+ * don't need to be written again. In contrast to r_hash_index_get_chunk(),
+ * the data is not returned.
+ *
+ * When the hashes were calculated from the data when opening the index (or
+ * the hash check is disabled), only the hash in the index is compared, so the
+ * caller must ensure that this chunk was not modified since then. Otherwise,
+ * the stored index could be outdated and the data is read and verified.
+ *
+ * @param idx RaucHashIndex to check
+ * @param number chunk number to check
+ * @param hash expected hash
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE if the chunk at this position has the given hash, FALSE otherwise
+ */
+gboolean r_hash_index_has_chunk_at(const RaucHashIndex *idx, guint32 number, const guint8 *hash, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/* number of chunks checked with a single read by r_hash_index_count_chunks_at() */
+#define R_HASH_INDEX_CHECK_BLOCK_CHUNKS 64
+
+/**
+ * Counts the consecutive chunks starting at a position, which have the
+ * expected hashes.
+ *
+ * This is equivalent to calling r_hash_index_has_chunk_at() for each chunk
+ * until the first mismatch, but first compares the hashes in the index for
+ * the whole range and then reads and verifies the data (if required) in
+ * blocks of R_HASH_INDEX_CHECK_BLOCK_CHUNKS chunks. This replaces many small
+ * reads of unchanged regions with few larger ones. The chunk size and the
+ * index format are unchanged, so the index size and lookups are not reduced.
+ *
+ * @param idx RaucHashIndex to check
+ * @param first first chunk number to check
+ * @param count maximum number of chunks to check
+ * @param hashes expected hashes of the count chunks
+ * @param error return location for a GError, or NULL (set on read errors)
+ *
+ * @return number of consecutive matching chunks
+ */
+guint32 r_hash_index_count_chunks_at(const RaucHashIndex *idx, guint32 first, guint32 count, const guint8 (*hashes)[32], GError **error);
+
+/**
+ * Verifies data against all hashes of the index.
+ *
+ * The data is read in large blocks by several threads in parallel, which
+ * also hash and compare the chunks. The file descriptor may be opened with
+ * O_DIRECT to read from the device instead of the page cache.
+ *
+ * @param idx RaucHashIndex with the expected hashes
+ * @param fd file descriptor of the data to verify
+ * @param mismatches return location for a sorted GArray of the numbers
+ *        (guint32) of chunks which differ, empty if all chunks match
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE if the data was compared, FALSE on read errors
+ */
+gboolean r_hash_index_verify_data(const RaucHashIndex *idx, int fd, GArray **mismatches, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
 /**
  * Frees the hash index.
  *
@@ -148,4 +358,63 @@ G_GNUC_WARN_UNUSED_RESULT;
 void r_hash_index_free(RaucHashIndex *idx);
 G_DEFINE_AUTOPTR_CLEANUP_FUNC(RaucHashIndex, r_hash_index_free);
 
+typedef struct {
+	guint64 prefix; /* first 8 bytes of the hash as big-endian integer */
+	guint32 source; /* position of the source in the set */
+	guint32 chunk; /* chunk number in the source */
+} RaucHashIndexSetEntry;
+
+typedef struct {
+	guint n_sources;
+	const RaucHashIndex **sources; /* not owned */
+	const guint8 **hashes; /* hash array of each source */
+	guint32 count; /* number of entries */
+	guint bucket_bits; /* number of hash prefix bits used to select the bucket */
+	guint32 *buckets; /* first entry per bucket (2^bucket_bits + 1 entries) */
+	RaucHashIndexSetEntry *entries; /* sorted by prefix, source and chunk */
+	guint64 reserved_memory;
+} RaucHashIndexSet;
+
+/**
+ * Creates a merged lookup table over several hash indexes.
+ *
+ * This allows finding a chunk in the first source containing it with a single
+ * search instead of one per source. The valid ranges (invalid_below and
+ * invalid_from) of the sources are checked on each lookup, so they can still
+ * be changed afterwards. The sources must stay alive as long as the set.
+ *
+ * @param sources GPtrArray of RaucHashIndex, in the order they should be used
+ * @param error return location for a GError, or NULL
+ *
+ * @return a newly allocated RaucHashIndexSet or NULL on error
+ */
+RaucHashIndexSet *r_hash_index_set_new(GPtrArray *sources, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Search for hash in all sources of the set without reading the data.
+ *
+ * This returns the same chunk as calling r_hash_index_find_chunk() for each
+ * source in order, but a miss doesn't need any allocation, so it is suitable
+ * for the per-chunk loop.
+ *
+ * @param set RaucHashIndexSet to search
+ * @param hash hash to find
+ * @param source return location for the position of the source
+ * @param number return location for the chunk number in the source
+ *
+ * @return TRUE if a chunk with this hash is in the valid range of a source,
+ *         FALSE if not
+ */
+gboolean r_hash_index_set_find(const RaucHashIndexSet *set, const guint8 *hash, guint *source, guint32 *number)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Frees the merged lookup table.
+ *
+ * @param set RaucHashIndexSet to free
+ */
+void r_hash_index_set_free(RaucHashIndexSet *set);
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(RaucHashIndexSet, r_hash_index_set_free);
+
 #define R_HASH_INDEX_ZERO_CHUNK "\xad\x7f\xac\xb2\x58\x6f\xc6\xe9\x66\xc0\x4\xd7\xd1\xd1\x6b\x2\x4f\x58\x5\xff\x7c\xb4\x7c\x7a\x85\xda\xbd\x8b\x48\x89\x2c\xa7"
@@ -24,6 +24,7 @@ typedef enum {
 
 typedef struct {
 	gchar *name;
+	gint bundle_fd; /* bundle passed by a client, -1 if name is a path or URL */
 	GSourceFunc notify;
 	GSourceFunc cleanup;
 	GMutex status_mutex;
@@ -35,6 +36,7 @@ typedef struct {
 	gboolean ignore_version_limit;
 	gchar *require_manifest_hash;
 	gchar *transaction;
+	gchar *priority; /* name of a [priority.<name>] section, or NULL for the default */
 	RaucBundleAccessArgs access_args;
 } RaucInstallArgs;
 
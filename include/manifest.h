@@ -32,9 +32,14 @@ typedef struct {
 	gchar* filename;
 	SlotHooks hooks;
 	GStrv adaptive;
+	/* SHA256 digest of the base image for delta images, which contain only
+	 * the chunks missing from the base (NULL for complete images) */
+	gchar *delta_base;
 	GStrv convert;
 	/* String array of converted filenames. Not NULL-terminated! */
 	GPtrArray* converted;
+	/* chunk hashes calculated together with the checksum (only during bundle creation) */
+	GBytes *chunk_hashes;
 } RaucImage;
 
 typedef enum {
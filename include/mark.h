@@ -43,6 +43,19 @@ G_GNUC_WARN_UNUSED_RESULT;
 gboolean r_mark_bad(RaucSlot *slot, GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
 
+/**
+ * Marks the slots matching an identifier as 'good', 'bad' or 'active'.
+ *
+ * All bootloader changes are applied together (see r_boot_begin()). The
+ * event log and slot status are only updated after this succeeded.
+ *
+ * @param state 'good', 'bad' or 'active'
+ * @param slot_identifier 'booted', 'other' or a slot name
+ * @param slot_name return location for the names of the marked slots, or NULL
+ * @param message return location for a message describing the result
+ *
+ * @return TRUE on success and FALSE on error
+ */
 gboolean mark_run(const gchar *state,
 		const gchar *slot_identifier,
 		gchar **slot_name,
@@ -4,36 +4,51 @@
 
 #include "update_handler.h"
 
+typedef struct _RMbrSwitch RMbrSwitch;
+
 /**
- * Get the address and size of the inactive boot partition
- * if a partition exists in the defined region.
+ * Reads and validates the master boot record of a device for switching the
+ * boot partition.
+ *
+ * The MBR and the disk geometry are read once and kept in memory until the
+ * switch is done by r_mbr_switch_activate(). The boot partition must point
+ * to one half of the defined region, the other half is the inactive one.
  *
  * @param device dev path (/dev/mmcblkX)
- * @param partition will contain the inactive boot partition (start & size)
  * @param region_start start address of the region, where bootpartitions are
  * are inside
  * @param region_size size of the region, where bootpartitions are are inside
  * @param error return location for a GError, or NULL
  *
- * @return True if succeeded, False if failed
+ * @return a new RMbrSwitch, or NULL on error
  */
-gboolean r_mbr_switch_get_inactive_partition(const gchar *device,
-		struct boot_switch_partition *partition,
+RMbrSwitch *r_mbr_switch_open(const gchar *device,
 		guint64 region_start, guint64 region_size,
 		GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
 
 /**
- * Set the boot partition in master boot record to point to the
- * partition at address and size in partition.
+ * Get the address and size of the inactive boot partition.
  *
- * @param device dev path (/dev/mmcblkX)
- * @param partition updated boot partition (start & size)
+ * @param sw RMbrSwitch from r_mbr_switch_open()
+ *
+ * @return the inactive boot partition (start & size), owned by sw
+ */
+const struct boot_switch_partition *r_mbr_switch_get_inactive(const RMbrSwitch *sw);
+
+/**
+ * Set the boot partition in master boot record to point to the inactive
+ * partition.
+ *
+ * Fails if the MBR was changed since r_mbr_switch_open().
+ *
+ * @param sw RMbrSwitch from r_mbr_switch_open()
  * @param error return location for a GError, or NULL
  *
  * @return True if succeeded, False if failed
  */
-gboolean r_mbr_switch_set_boot_partition(const gchar *device,
-		const struct boot_switch_partition *partition,
-		GError **error)
+gboolean r_mbr_switch_activate(RMbrSwitch *sw, GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
+
+void r_mbr_switch_free(RMbrSwitch *sw);
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(RMbrSwitch, r_mbr_switch_free);
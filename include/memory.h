@@ -0,0 +1,69 @@
+#pragma once
+
+#include <glib.h>
+
+/*
+ * Global memory budget for large allocations.
+ *
+ * Subsystems which allocate proportionally to the image or bundle size
+ * reserve that memory before allocating it. If the reservation would exceed
+ * the limit set by the 'memory-limit' system config option, they fall back to
+ * a strategy with bounded memory usage instead (or skip optional work).
+ */
+
+/**
+ * Sets the memory limit for r_memory_reserve().
+ *
+ * @param limit maximum number of reserved bytes, or 0 for no limit
+ */
+void r_memory_set_limit(guint64 limit);
+
+/**
+ * Returns the memory limit set by r_memory_set_limit().
+ *
+ * @return maximum number of reserved bytes, or 0 for no limit
+ */
+guint64 r_memory_get_limit(void);
+
+/**
+ * Reserves memory from the global budget.
+ *
+ * @param size number of bytes to reserve
+ * @param what description of the allocation for logging
+ *
+ * @return TRUE if the memory was reserved, FALSE if it would exceed the limit
+ */
+gboolean r_memory_reserve(guint64 size, const gchar *what)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Returns memory reserved with r_memory_reserve() to the budget.
+ *
+ * @param size number of bytes to release
+ */
+void r_memory_release(guint64 size);
+
+/**
+ * Returns the highest amount of memory reserved at the same time.
+ *
+ * @param reset whether to reset the peak to the currently reserved amount
+ *
+ * @return peak number of reserved bytes
+ */
+guint64 r_memory_get_reserved_peak(gboolean reset);
+
+/**
+ * Resets the peak values to the current usage.
+ *
+ * This resets both the reserved peak and the peak RSS of the process (via
+ * /proc/self/clear_refs), so that the peaks of a single installation can be
+ * reported by a long-running service.
+ */
+void r_memory_reset_peak(void);
+
+/**
+ * Returns the peak resident set size (VmHWM) of the process.
+ *
+ * @return peak RSS in bytes, or 0 if it is not available
+ */
+guint64 r_memory_get_peak_rss(void);
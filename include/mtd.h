@@ -0,0 +1,61 @@
+#pragma once
+
+#include <glib.h>
+
+#define R_MTD_ERROR r_mtd_error_quark()
+GQuark r_mtd_error_quark(void);
+
+typedef enum {
+	R_MTD_ERROR_FAILED,
+	R_MTD_ERROR_IOCTL,
+	R_MTD_ERROR_NO_SPACE,
+	R_MTD_ERROR_VERIFY,
+} RMtdError;
+
+typedef struct {
+	/* number of erase blocks erased */
+	guint erased;
+	/* number of erase blocks written */
+	guint written;
+	/* number of erase blocks which already had the expected content */
+	guint unchanged;
+	/* number of bad erase blocks skipped */
+	guint bad;
+} RMtdWriteStats;
+
+/**
+ * Writes an image to a raw NAND or NOR MTD device.
+ *
+ * The image is written erase block by erase block, skipping bad blocks (like
+ * nandwrite). The remainder of the device is left erased. Erase blocks which
+ * already contain the expected data are neither erased nor written. On NOR
+ * flash, blocks which are already erased are not erased again. Each written
+ * block is read back and compared (like flashcp).
+ *
+ * The last page containing image data is padded with 0xFF, the remaining
+ * pages of its erase block are left erased.
+ *
+ * @param device path of the MTD character device (/dev/mtdX)
+ * @param image path of the image to write
+ * @param stats return location for the block statistics, or NULL
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE if an error occurred
+ */
+gboolean r_mtd_write_image(const gchar *device, const gchar *image, RMtdWriteStats *stats, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Erases all good erase blocks of a MTD device.
+ *
+ * On bit-writeable (NOR) flash, erase blocks which are already erased are
+ * skipped. On NAND, all good erase blocks are erased.
+ *
+ * @param device path of the MTD character device (/dev/mtdX)
+ * @param stats return location for the block statistics, or NULL
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE if an error occurred
+ */
+gboolean r_mtd_erase(const gchar *device, RMtdWriteStats *stats, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
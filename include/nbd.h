@@ -6,6 +6,15 @@
 /* FD used to pass the open NBD socket to the server process */
 #define RAUC_SOCKET_FD 3
 
+/* Size of the suffix range requested when configuring the server. This
+ * contains the signature of typical bundles, so that opening a bundle needs
+ * a single request. */
+#define RAUC_NBD_TAIL_SIZE 65536
+
+/* Upper limit for the data kept in memory by the server for prefetch
+ * requests. */
+#define RAUC_NBD_PREFETCH_MAX (64*1024*1024)
+
 #define R_NBD_ERROR r_nbd_error_quark()
 GQuark r_nbd_error_quark(void);
 
@@ -22,6 +31,7 @@ typedef enum {
 
 typedef struct {
 	gint sock;
+	GArray *extra_socks; /* additional sockets (gint) for parallel requests */
 	guint32 index;
 	gboolean index_valid;
 	gchar *dev;
@@ -30,16 +40,23 @@ typedef struct {
 
 typedef struct {
 	gint sock; /* client side socket */
+	GArray *extra_socks; /* client side sockets (gint) for additional connections */
 	GSubprocess *sproc;
 
 	/* configuration */
+	guint connections; /* number of connections to the server (default 1) */
 	gchar *url;
+	GStrv mirrors; /* additional URLs of the same bundle (optional) */
 	gchar *tls_cert; /* local file or PKCS#11 URI */
 	gchar *tls_key; /* local file or PKCS#11 URI */
 	gchar *tls_ca; /* local file */
 	gboolean tls_no_verify;
 	GStrv headers; /* array of strings such as 'Foo: bar' */
 	GPtrArray *info_headers; /* array of strings such as 'Foo: bar' */
+	gchar *cache_dir; /* directory for the block cache (optional) */
+	guint64 cache_size; /* size limit for the block cache (0 for no limit) */
+	guint64 rate_limit; /* maximum download rate in bytes per second (0 for no limit) */
+	gchar *tls_session_cache; /* file for persisting TLS sessions (optional) */
 
 	/* discovered information */
 	guint64 data_size; /* bundle size */
@@ -47,6 +64,8 @@ typedef struct {
 	guint64 current_time; /* date header from server */
 	guint64 modified_time; /* last-modified header from server */
 	gchar *etag; /* etag received from the server */
+	GBytes *tail; /* data at the end of the bundle, received during configuration */
+	guint64 tail_offset; /* offset of tail in the bundle */
 } RaucNBDServer;
 
 RaucNBDDevice *r_nbd_new_device(void);
@@ -78,9 +97,43 @@ gboolean r_nbd_setup_device(RaucNBDDevice *nbd_dev, GError **error);
  */
 gboolean r_nbd_remove_device(RaucNBDDevice *nbd_dev, GError **error);
 
-gboolean r_nbd_run_server(gint sock, GError **error);
+/**
+ * Serve NBD requests from the given sockets until the client disconnects.
+ *
+ * The configuration is received on the first socket. Additional connections
+ * use the consecutive file descriptors and are served by separate threads.
+ *
+ * @param sock first socket
+ * @param connections total number of sockets starting at sock
+ * @param error Return location for a GError
+ *
+ * @return TRUE on success, FALSE if an error occurred
+ */
+gboolean r_nbd_run_server(gint sock, guint connections, GError **error);
 
 gboolean r_nbd_start_server(RaucNBDServer *nbd_srv, GError **error);
 gboolean r_nbd_stop_server(RaucNBDServer *nbd_srv, GError **error);
 
 gboolean r_nbd_read(gint sock, guint8 *data, size_t size, off_t offset, GError **error);
+
+typedef struct {
+	guint64 offset;
+	guint32 size;
+} RaucNBDRange;
+
+/**
+ * Requests the server to download ranges of the bundle and keep them in
+ * memory for the remaining lifetime of the server.
+ *
+ * All requests are sent before waiting for the replies, so the server
+ * downloads the ranges in parallel. This must be called before the socket is
+ * passed to the kernel. The total size is limited to RAUC_NBD_PREFETCH_MAX.
+ *
+ * @param sock client side socket
+ * @param ranges ranges to download
+ * @param count number of ranges
+ * @param error Return location for a GError
+ *
+ * @return TRUE on success, FALSE if an error occurred
+ */
+gboolean r_nbd_prefetch(gint sock, const RaucNBDRange *ranges, guint count, GError **error);
@@ -3,17 +3,78 @@
 #include <glib.h>
 
 #if ENABLE_NETWORK
+#include <curl/curl.h>
+
 /**
  * Network initialization routine.
  *
  * Sets up libcurl.
  *
+ * This is done lazily on first use by download_file(), as initializing the
+ * TLS backend is expensive. Further calls return the result of the first one.
+ *
  * @param error return location for a GError, or NULL
  *
  * @return TRUE if succeeded, FALSE if failed
  */
 gboolean network_init(GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Returns the curl share handle used by all downloads in this process.
+ *
+ * DNS lookups and TLS sessions are shared, so that later transfers to the
+ * same server can skip the lookup and the full TLS handshake.
+ *
+ * @return the CURLSH handle, owned by this module
+ */
+CURLSH *r_network_get_share(void);
+
+/**
+ * Returns the session cache file to use for the current user.
+ *
+ * Root uses the configured path as is, other users (such as the sandboxed
+ * streaming server) append their uid, so that each privilege level has its
+ * own file.
+ *
+ * @param path configured path of the session cache file
+ *
+ * @return newly allocated path of the file for the current effective uid
+ */
+gchar *r_network_tls_session_path(const gchar *path);
+
+/**
+ * Imports the TLS sessions stored in a session cache file.
+ *
+ * The file for the current user is selected by r_network_tls_session_path().
+ * It is ignored unless it is a regular file owned by and only writable by the
+ * current user. Expired sessions are skipped. A missing file is not an error.
+ * If libcurl does not support importing sessions, this does nothing.
+ *
+ * @param share curl share handle to import the sessions into
+ * @param path configured path of the session cache file
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE if the file could not be read
+ */
+gboolean r_network_load_tls_sessions(CURLSH *share, const gchar *path, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Stores the TLS sessions of a share handle in a session cache file.
+ *
+ * The file for the current user (see r_network_tls_session_path()) is
+ * replaced atomically and is only accessible by that user. Sessions are kept
+ * for at most one day.
+ *
+ * @param share curl share handle to export the sessions from
+ * @param path configured path of the session cache file
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE otherwise
+ */
+gboolean r_network_save_tls_sessions(CURLSH *share, const gchar *path, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
 #else
 static inline gboolean network_init(GError **error)
 {
@@ -23,3 +84,30 @@ static inline gboolean network_init(GError **error)
 
 gboolean download_file(const gchar *target, const gchar *url, goffset limit, GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Downloads a file which is available from several servers.
+ *
+ * The mirrors are probed and only used if they serve the same file (same
+ * size and, if sent by both servers, the same ETag and Last-Modified
+ * header). If the servers support range requests, the chunks are spread
+ * across the mirrors according to their throughput, and failing mirrors are
+ * skipped without restarting the download. Otherwise, the download restarts
+ * from the next mirror if one fails.
+ *
+ * The progress of a download with range requests is recorded in
+ * '<target>.state'. If a download is interrupted, calling this again with the
+ * same target only fetches the missing chunks, as long as the server reports
+ * the same file (same size and ETag or Last-Modified header). The state file
+ * is removed when the download is complete.
+ *
+ * @param target path of the file to create (or to resume)
+ * @param url URL of the file
+ * @param mirrors NULL-terminated array of additional URLs, or NULL
+ * @param limit maximum size of the file (0 for no limit)
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE otherwise
+ */
+gboolean download_file_with_mirrors(const gchar *target, const gchar *url, const gchar *const *mirrors, goffset limit, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
@@ -58,6 +58,11 @@ typedef enum {
  *
  * Sets up OpenSSL (libcrypto).
  *
+ * This is done lazily on first use by the functions loading keys and
+ * certificates or setting up an X509_STORE, so that commands which don't
+ * need OpenSSL don't pay for loading its configuration. Further calls return
+ * the result of the first one.
+ *
  * @param error return location for a GError, or NULL
  *
  * @return TRUE if succeeded, FALSE if failed
@@ -65,6 +70,17 @@ typedef enum {
 gboolean signature_init(GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
 
+/**
+ * Enables or disables caching of loaded keys and certificates.
+ *
+ * While enabled, keys and certificates are kept by their file name or PKCS#11
+ * URL, so that signing many bundles loads each key only once and uses a
+ * single PKCS#11 session. Disabling the cache releases all cached objects.
+ *
+ * @param enabled TRUE to enable the cache
+ */
+void signature_set_key_cache(gboolean enabled);
+
 /**
  * Prepare an OpenSSL X509_STORE for signature verification.
  *
@@ -80,6 +96,27 @@ G_GNUC_WARN_UNUSED_RESULT;
 X509_STORE* setup_x509_store(const gchar *capath, const gchar *cadir, GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
 
+/**
+ * Get the OpenSSL X509_STORE for the configured keyring.
+ *
+ * In contrast to setup_x509_store(), the store is kept and reused by later
+ * calls, so that long-running processes (such as the service) don't need to
+ * reload the keyring and CRLs for each bundle. It is rebuilt when the keyring
+ * configuration or any of the keyring files change (detected via their inode,
+ * size and modification time).
+ *
+ * As the store is shared, it must not be modified by the caller. If
+ * 'use-bundle-signing-time' is enabled, a new store is returned each time,
+ * as the verification time is set on the store.
+ *
+ * @param error return location for a GError, or NULL
+ *
+ * @return new reference to the X509_STORE (free with X509_STORE_free()), NULL
+ * if failed
+ */
+X509_STORE* get_cached_x509_store(GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
 /**
  * Sign content with provided certificate and private key
  *
@@ -162,8 +199,7 @@ G_GNUC_WARN_UNUSED_RESULT;
 /**
  * Verify detached and inline signatures.
  *
- * This function is only used by the tests and internally for cms_verify_fd and
- * cms_verify_sig.
+ * This function is only used by the tests and internally for cms_verify_sig.
  *
  * @param content content to verify against signature, or NULL (for inline signature)
  * @param sig signature used to verify
@@ -180,6 +216,9 @@ G_GNUC_WARN_UNUSED_RESULT;
 /**
  * Verify detached signature for given file.
  *
+ * The content is read in bounded chunks instead of mapping the whole file,
+ * and already hashed data is dropped from the page cache.
+ *
  * @param fd file descriptor to verify against signature
  * @param sig signature used to verify
  * @param limit size of content to use, 0 if all should be included
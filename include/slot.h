@@ -24,6 +24,8 @@ typedef struct {
 	guint32 installed_count;
 	gchar *activated_timestamp;
 	guint32 activated_count;
+	gchar *verity_root_hash;
+	gchar *verity_salt;
 } RaucSlotStatus;
 
 typedef struct _RaucSlot {
@@ -47,6 +49,8 @@ typedef struct _RaucSlot {
 	gboolean readonly;
 	/** flag indicating if slot skipping optimization should be used */
 	gboolean install_same;
+	/** flag indicating if the slot content should be compared to the image before skipping */
+	gboolean check_same_content;
 	/** extra mount options for this slot */
 	gchar *extra_mount_opts;
 	/** flag indicating to resize after writing (only for ext4) */
@@ -57,6 +61,12 @@ typedef struct _RaucSlot {
 	guint64 region_size;
 	/** limit the writable size of the boot partition (for boot-emmc) */
 	guint64 size_limit;
+	/** flag indicating to read back and verify the slot after writing */
+	gboolean verify_after_write;
+	/** flag indicating to create a dm-verity hash tree while writing */
+	gboolean verity_hash;
+	/** device for the dm-verity hash tree, NULL to append it to the data */
+	gchar *verity_hash_device;
 
 	/** current state of the slot (runtime) */
 	SlotState state;
@@ -167,6 +177,22 @@ G_GNUC_WARN_UNUSED_RESULT;
 RaucSlot* r_slot_get_parent_root(RaucSlot *slot)
 G_GNUC_WARN_UNUSED_RESULT;
 
+/**
+ * Returns an identifier for the physical device backing the given slot.
+ *
+ * The slot device is resolved via sysfs to the underlying whole device, so
+ * that partitions on the same disk (or volumes of the same UBI device) return
+ * the same identifier. For slots backed by a regular file, the device
+ * containing the file is used. If the device cannot be resolved, the slot
+ * device path itself is returned.
+ *
+ * @param slot slot to find the physical device for
+ *
+ * @return newly allocated identifier (sysfs path or device path)
+ */
+gchar *r_slot_get_physical_device(const RaucSlot *slot)
+G_GNUC_WARN_UNUSED_RESULT;
+
 /**
  * Moves a data directory to a name with a different digest.
  *
@@ -2,18 +2,119 @@
 
 #include <glib.h>
 
+/* Each power of two is split into 2^R_HISTOGRAM_SUB_BITS linear buckets,
+ * which limits the relative error of a bucket to 1/16. */
+#define R_HISTOGRAM_SUB_BITS 4
+/* Values below 2^R_HISTOGRAM_MIN_EXP (~1e-6) are collected in the first
+ * bucket, values from 2^R_HISTOGRAM_MAX_EXP (~1.8e13) in the last one. */
+#define R_HISTOGRAM_MIN_EXP (-20)
+#define R_HISTOGRAM_MAX_EXP 44
+#define R_HISTOGRAM_BUCKETS (((R_HISTOGRAM_MAX_EXP - R_HISTOGRAM_MIN_EXP) << R_HISTOGRAM_SUB_BITS) + 2)
+
+/**
+ * Log-linear histogram of values.
+ *
+ * All counters are updated atomically, so values can be added from multiple
+ * threads without locking. Queries while values are being added return a
+ * consistent result for each bucket, but not necessarily for the whole
+ * histogram.
+ */
+typedef struct {
+	gchar *label;
+	gint count; /* total number of values */
+	gint min_bucket, max_bucket; /* lowest and highest non-empty bucket */
+	gint buckets[R_HISTOGRAM_BUCKETS];
+} RaucHistogram;
+
 typedef struct {
 	gchar *label;
 	gdouble values[64];
 	guint64 count, next;
 	gdouble sum;
 	gdouble min, max;
+	RaucHistogram *histogram; /* distribution of all values */
+	GMutex lock; /* protects against r_stats_get_live() */
+	gboolean unlisted; /* neither live nor part of a report */
 } RaucStats;
 
+/**
+ * Creates a new RaucStats.
+ *
+ * Until it is freed, it is included in r_stats_get_live().
+ *
+ * @param label label for the statistics
+ *
+ * @return a newly allocated RaucStats
+ */
 RaucStats *r_stats_new(const gchar *label);
 
+/**
+ * Creates a new RaucStats which is kept separate from all others.
+ *
+ * It is neither included in r_stats_get_live() nor merged into an active
+ * report when it is freed. This is useful for values which are unrelated to
+ * an installation, such as the latency of D-Bus requests handled during one.
+ *
+ * @param label label for the statistics
+ *
+ * @return a newly allocated RaucStats
+ */
+RaucStats *r_stats_new_unlisted(const gchar *label);
+
 void r_stats_add(RaucStats *stats, gdouble value);
 
+/**
+ * Returns a snapshot of all RaucStats which currently exist.
+ *
+ * This can be called from any thread, while others add values.
+ *
+ * The result is a dict from the label (with a ' #n' suffix for duplicates) to
+ * a dict with the 'count', and if that is non-zero also the 'sum', 'min',
+ * 'max', 'avg', 'p50', 'p90' and 'p99' values.
+ *
+ * @return a new floating GVariant of type 'a{sv}'
+ */
+GVariant *r_stats_get_live(void);
+
+/**
+ * Returns a snapshot of a single RaucStats.
+ *
+ * This can be called from any thread, while others add values.
+ *
+ * @param stats RaucStats to serialize
+ *
+ * @return a new floating GVariant of type 'a{sv}' in the same format as the
+ *         values of r_stats_get_live()
+ */
+GVariant *r_stats_to_variant(RaucStats *stats);
+
+/**
+ * Starts collecting all RaucStats when they are freed.
+ *
+ * Until r_stats_report_end(), the values of each freed RaucStats are merged
+ * with those of earlier ones with the same label.
+ */
+void r_stats_report_begin(void);
+
+/**
+ * Adds a single value to the report.
+ *
+ * This is useful for values which are only recorded once per occurrence,
+ * such as the size of an image. Does nothing if no report is active.
+ *
+ * @param label label of the report entry
+ * @param value value to add
+ */
+void r_stats_report_add(const gchar *label, gdouble value);
+
+/**
+ * Stops collecting freed RaucStats.
+ *
+ * @return a new floating GVariant of type 'a{sv}' in the same format as
+ *         r_stats_get_live(), with one entry per label
+ */
+GVariant *r_stats_report_end(void);
+
 gdouble r_stats_get_avg(const RaucStats *stats);
 
 gdouble r_stats_get_recent_avg(const RaucStats *stats);
@@ -23,6 +124,76 @@ void r_stats_show(const RaucStats *stats, const gchar *prefix);
 void r_stats_free(RaucStats *stats);
 G_DEFINE_AUTOPTR_CLEANUP_FUNC(RaucStats, r_stats_free);
 
+/**
+ * Creates a new, empty histogram.
+ *
+ * @param label label for the histogram
+ *
+ * @return a newly allocated RaucHistogram
+ */
+RaucHistogram *r_histogram_new(const gchar *label);
+
+/**
+ * Adds a value to the histogram.
+ *
+ * This is thread-safe and lock-free.
+ *
+ * @param hist RaucHistogram to add to
+ * @param value value to add
+ */
+void r_histogram_add(RaucHistogram *hist, gdouble value);
+
+/**
+ * Adds all values of another histogram.
+ *
+ * This can be used to combine per-thread histograms. Only dest may be
+ * modified concurrently.
+ *
+ * @param dest RaucHistogram to add to
+ * @param src RaucHistogram to add
+ */
+void r_histogram_merge(RaucHistogram *dest, const RaucHistogram *src);
+
+/**
+ * Returns the number of values in the histogram.
+ *
+ * @param hist RaucHistogram to query
+ *
+ * @return the number of values
+ */
+guint64 r_histogram_get_count(const RaucHistogram *hist);
+
+/**
+ * Returns the value below which the given percentage of values fall.
+ *
+ * As the values are not stored individually, the upper bound of the bucket
+ * containing the percentile is returned, which is at most 1/16 above the
+ * exact value.
+ *
+ * @param hist RaucHistogram to query
+ * @param percentile percentile in the range 0 to 100
+ *
+ * @return the percentile value, or 0.0 for an empty histogram
+ */
+gdouble r_histogram_get_percentile(const RaucHistogram *hist, gdouble percentile);
+
+/**
+ * Serializes the non-empty buckets of the histogram.
+ *
+ * The GVariant has the type '(sa(ddu))', containing the label and the lower
+ * bound, upper bound and number of values of each non-empty bucket in
+ * ascending order. Use g_variant_print() to obtain a text representation
+ * which can be parsed again with g_variant_parse().
+ *
+ * @param hist RaucHistogram to serialize
+ *
+ * @return a new floating GVariant
+ */
+GVariant *r_histogram_serialize(const RaucHistogram *hist);
+
+void r_histogram_free(RaucHistogram *hist);
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(RaucHistogram, r_histogram_free);
+
 /* additional functions for testing */
 void r_test_stats_start(void);
 void r_test_stats_stop(void);
@@ -60,6 +60,46 @@ void r_slot_status_load(RaucSlot *dest_slot);
 gboolean r_slot_status_save(RaucSlot *dest_slot, GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
 
+/**
+ * Start coalescing updates of the global status file.
+ *
+ * Until the matching r_slot_status_end_batch(), r_slot_status_save() and
+ * r_system_status_save() only update an in-memory copy of the global status
+ * file. It is written (atomically and synced) only at the explicit commit
+ * points r_slot_status_commit() and r_slot_status_end_batch(), and only if
+ * its content actually changed.
+ *
+ * Batches can be nested. The per-slot status files are not affected.
+ */
+void r_slot_status_begin_batch(void);
+
+/**
+ * Write pending updates of the global status file.
+ *
+ * This must be called before any action that relies on the status being
+ * persisted, such as the 'pending' status before writing a slot.
+ * Does nothing if there are no pending updates.
+ *
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE if the status file is up to date, FALSE otherwise
+ */
+gboolean r_slot_status_commit(GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * End coalescing updates of the global status file.
+ *
+ * When leaving the outermost batch, pending updates are written and the
+ * in-memory copy is dropped.
+ *
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE if the status file is up to date, FALSE otherwise
+ */
+gboolean r_slot_status_end_batch(GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
 typedef struct {
 	gchar *boot_id;
 } RSystemStatus;
@@ -0,0 +1,33 @@
+#pragma once
+
+/*
+ * Static tracing probes (USDT) for hot paths.
+ *
+ * When built with '-Dtracing=enabled', each R_TRACE*() invocation expands to
+ * a SystemTap SDT probe in the 'rauc' provider, which can be attached to with
+ * tools like bpftrace, perf or stap. An unattached probe costs a single nop
+ * instruction. Otherwise, the macros expand to nothing, so that arguments are
+ * not evaluated.
+ *
+ * See the 'Tracing' section in the documentation for the list of probes.
+ */
+
+#if ENABLE_TRACING
+
+#include <sys/sdt.h>
+
+#define R_TRACE(probe) DTRACE_PROBE(rauc, probe)
+#define R_TRACE1(probe, a1) DTRACE_PROBE1(rauc, probe, a1)
+#define R_TRACE2(probe, a1, a2) DTRACE_PROBE2(rauc, probe, a1, a2)
+#define R_TRACE3(probe, a1, a2, a3) DTRACE_PROBE3(rauc, probe, a1, a2, a3)
+#define R_TRACE4(probe, a1, a2, a3, a4) DTRACE_PROBE4(rauc, probe, a1, a2, a3, a4)
+
+#else
+
+#define R_TRACE(probe) do {} while (0)
+#define R_TRACE1(probe, a1) do {} while (0)
+#define R_TRACE2(probe, a1, a2) do {} while (0)
+#define R_TRACE3(probe, a1, a2, a3) do {} while (0)
+#define R_TRACE4(probe, a1, a2, a3, a4) do {} while (0)
+
+#endif
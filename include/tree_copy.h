@@ -0,0 +1,60 @@
+#pragma once
+
+#include <glib.h>
+
+/**
+ * Copies a directory tree, preserving its metadata.
+ *
+ * Like 'cp -a', this preserves file types, permissions, ownership (if
+ * permitted), timestamps, hardlinks and extended attributes.
+ *
+ * Directories, symlinks and special files are created by the calling thread
+ * while walking the tree, and the regular files are copied concurrently by a
+ * thread pool. The file data is shared via reflinks if supported by the
+ * filesystem. Otherwise, the files are preallocated and copied using
+ * copy_file_range().
+ *
+ * If a previous version of the tree is given, the files listed in 'unchanged'
+ * are reused from it: if their mode, ownership, modification time and
+ * extended attributes match as well, they are hardlinked, otherwise a new file sharing the data via a
+ * reflink is created. Files which cannot be reused are copied normally. As
+ * hardlinked files are shared between both trees, they must not be modified
+ * in place.
+ *
+ * @param src path of the directory to copy
+ * @param dst path of the copy, which must not exist yet
+ * @param ref path of a previous version of the tree, or NULL
+ * @param unchanged set of relative paths with unchanged contents, or NULL
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE if an error occurred
+ */
+gboolean r_tree_copy(const gchar *src, const gchar *dst, const gchar *ref, GHashTable *unchanged, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Calculates the SHA256 digests of all regular files in a directory tree and
+ * stores them in a file.
+ *
+ * Files which are not readable are skipped.
+ *
+ * @param root path of the directory tree
+ * @param filename name of the file to write
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE if an error occurred
+ */
+gboolean r_tree_digests_create(const gchar *root, const gchar *filename, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Loads the file digests written by r_tree_digests_create().
+ *
+ * @param filename name of the file to read
+ * @param error return location for a GError, or NULL
+ *
+ * @return a new hash table mapping relative paths to hex digests, or NULL on
+ * error
+ */
+GHashTable *r_tree_digests_load(const gchar *filename, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
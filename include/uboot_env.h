@@ -0,0 +1,94 @@
+#pragma once
+
+#include <glib.h>
+
+#define R_UBOOT_ENV_ERROR r_uboot_env_error_quark()
+GQuark r_uboot_env_error_quark(void);
+
+typedef enum {
+	R_UBOOT_ENV_ERROR_CONFIG,
+	R_UBOOT_ENV_ERROR_NOT_SUPPORTED,
+	R_UBOOT_ENV_ERROR_INVALID,
+	R_UBOOT_ENV_ERROR_NOT_FOUND,
+	R_UBOOT_ENV_ERROR_TOO_LARGE,
+} RUbootEnvError;
+
+typedef struct _RUbootEnv RUbootEnv;
+
+/**
+ * Reads the U-Boot environment described by a fw_env.config file.
+ *
+ * This supports the same configuration format as the fw_printenv/fw_setenv
+ * tools, with one (single) or two (redundant) lines of
+ * '<device> <offset> <size> [<sector size> [<sectors>]]'. Only block devices
+ * and regular files are supported, as MTD and UBI devices would need to be
+ * erased before writing.
+ *
+ * For a redundant environment, both copies are read once and the valid one
+ * with the newer flags counter is used.
+ *
+ * @param config_path path of the fw_env.config file
+ * @param error return location for a GError, or NULL
+ *
+ * @return a new RUbootEnv, or NULL on error
+ */
+RUbootEnv *r_uboot_env_open(const gchar *config_path, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Looks up a variable in the environment.
+ *
+ * If the variable is not set, R_UBOOT_ENV_ERROR_NOT_FOUND is returned.
+ *
+ * @param env RUbootEnv to use
+ * @param key name of the variable
+ * @param error return location for a GError, or NULL
+ *
+ * @return the value (owned by env), or NULL if the variable is not set
+ */
+const gchar *r_uboot_env_get(const RUbootEnv *env, const gchar *key, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Sets a variable in the in-memory environment.
+ *
+ * The change is only written by r_uboot_env_commit().
+ *
+ * @param env RUbootEnv to modify
+ * @param key name of the variable
+ * @param value new value
+ */
+void r_uboot_env_set(RUbootEnv *env, const gchar *key, const gchar *value);
+
+/**
+ * Writes the modified environment back to the device.
+ *
+ * For a redundant environment, the copy which was not used is overwritten
+ * with an incremented flags counter, so the previous copy stays valid until
+ * the write completed. Nothing is written if no variable was changed.
+ *
+ * @param env RUbootEnv to write
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE if an error occurred
+ */
+gboolean r_uboot_env_commit(RUbootEnv *env, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Calculates the CRC32 used for the environment header.
+ *
+ * @param data data to checksum
+ * @param len length of data
+ *
+ * @return the CRC32 (as used by zlib) of data
+ */
+guint32 r_uboot_env_crc32(const guint8 *data, gsize len);
+
+/**
+ * Frees the environment.
+ *
+ * @param env RUbootEnv to free
+ */
+void r_uboot_env_free(RUbootEnv *env);
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(RUbootEnv, r_uboot_env_free);
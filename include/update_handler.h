@@ -21,6 +21,44 @@ G_GNUC_WARN_UNUSED_RESULT;
 img_to_slot_handler get_update_handler(RaucImage *mfimage, RaucSlot  *dest_slot, GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
 
+/**
+ * Returns whether the handler writes the image to the slot by copying the
+ * image file as it is, so that r_write_image_to_devs() can be used instead.
+ *
+ * This is the case for the raw handler, unless the image is a casync index,
+ * a delta image, uses slot hooks or can be installed adaptively.
+ *
+ * @param handler handler selected by get_update_handler()
+ * @param image image to install
+ * @param slot target slot
+ *
+ * @return TRUE if the image would be copied as is, FALSE otherwise
+ */
+gboolean r_update_handler_is_raw_copy(img_to_slot_handler handler, const RaucImage *image, const RaucSlot *slot);
+
+/**
+ * Writes an image to the devices of multiple slots, reading it only once.
+ *
+ * See r_copy_fd_fan_out(). The devices are written concurrently and each one
+ * is synced on its own. The result for each slot is returned separately, so
+ * that a failing device doesn't affect the others.
+ *
+ * @param image image to write
+ * @param slots target RaucSlots
+ * @param slot_errors array of slots->len GError pointers (initialized to
+ *        NULL), set for each slot which failed
+ * @param slot_written array of slots->len counters (initialized to -1), set
+ *        to the amount of data written to each slot's device
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE if the image was read, FALSE if reading it failed for all
+ *         slots. In that case, error is set and slot_errors still contains
+ *         the errors of the slots which failed before reading (e.g. when
+ *         opening the device), while the other entries are left NULL.
+ */
+gboolean r_write_image_to_devs(RaucImage *image, GPtrArray *slots, GError **slot_errors, goffset *slot_written, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
 struct boot_switch_partition {
 	guint64 start;          /* address in bytes */
 	guint64 size;           /* size in bytes */
@@ -5,6 +5,8 @@
 #include <gio/gunixoutputstream.h>
 #include <glib.h>
 
+#include "verity_hash.h"
+
 /* These functions can be used by slot and artifact update handlers. */
 
 /**
@@ -49,6 +51,159 @@ G_GNUC_WARN_UNUSED_RESULT;
 GUnixInputStream* r_open_unix_input_stream(const gchar *filename, int *fd, GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
 
+/* minimum interval between two progress updates while copying an image */
+#define R_COPY_PROGRESS_INTERVAL (G_USEC_PER_SEC / 10)
+
+/**
+ * Progress of a copy running in a worker thread.
+ *
+ * See r_copy_image_progress_redirect().
+ */
+typedef struct {
+	GMutex lock; /* protects done and total */
+	goffset done;
+	goffset total;
+} RaucCopyProgress;
+
+/**
+ * Updates the byte progress of the 'copy_image' step, limited by time.
+ *
+ * As updating the progress can emit D-Bus signals, updates within
+ * R_COPY_PROGRESS_INTERVAL after the previous one are skipped, except for
+ * the final one. Nothing is done outside of a progress context.
+ *
+ * @param last_update time of the last update, initialized to 0 by the caller
+ * @param done amount of data copied so far
+ * @param total total amount of data to copy
+ */
+void r_copy_image_progress(gint64 *last_update, goffset done, goffset total);
+
+/**
+ * Redirects the copy progress of the calling thread.
+ *
+ * While set, r_copy_image_progress() stores the progress in the given
+ * RaucCopyProgress instead of updating the 'copy_image' step. This allows
+ * running slot handlers in worker threads, as the progress context may only
+ * be used from the installation thread.
+ *
+ * @param progress location to store the progress in, or NULL to disable
+ */
+void r_copy_image_progress_redirect(RaucCopyProgress *progress);
+
+/**
+ * Sets the verity hash tree to collect the copied data in.
+ *
+ * While set for the calling thread, image copies add the data written to
+ * the target to the tree (see r_verity_tree_add()), so that it doesn't need
+ * to be read again. Copies which don't pass the data through userspace leave
+ * it to r_verity_tree_fill().
+ *
+ * @param tree RaucVerityTree, or NULL to disable
+ */
+void r_copy_set_verity_tree(RaucVerityTree *tree);
+
+/**
+ * Returns the verity hash tree set for the calling thread, or NULL.
+ */
+RaucVerityTree *r_copy_get_verity_tree(void);
+
+/**
+ * Sets the counter for the data written to the target.
+ *
+ * While set for the calling thread, image copies add the number of bytes
+ * they actually write to the target. Data which is skipped because the
+ * target already contains it, and ranges which are zeroed without writing
+ * data, are not counted. The counter must be initialized to -1 by the
+ * caller, so that it stays negative if nothing was counted (for example,
+ * when an external program wrote the target).
+ *
+ * @param counter location of the counter, or NULL to disable
+ */
+void r_copy_set_written_counter(goffset *counter);
+
+/**
+ * Adds to the counter set by r_copy_set_written_counter() for the calling
+ * thread, if any.
+ *
+ * Copies which write from helper threads add their total from the calling
+ * thread once the helpers have finished.
+ *
+ * @param len amount of data written to the target
+ */
+void r_copy_count_written(goffset len);
+
+/**
+ * Limits the combined rate of all image copies.
+ *
+ * The limit is shared by all threads, so that concurrent slot handlers don't
+ * multiply it.
+ *
+ * @param rate maximum rate in bytes per second, or 0 for no limit
+ */
+void r_copy_set_rate_limit(guint64 rate);
+
+/**
+ * Accounts for data written by an image copy and waits if the rate limit set
+ * by r_copy_set_rate_limit() is exceeded.
+ *
+ * Copy implementations should call this for each written block.
+ *
+ * @param len amount of data written
+ */
+void r_copy_throttle(gsize len);
+
+/**
+ * Copies data between file descriptors using writes of a fixed block size,
+ * while generating progress updates.
+ *
+ * This is used for targets which benefit from aligned writes, such as UBI
+ * volumes, where each write should cover complete LEBs. Only the final write
+ * may be shorter.
+ *
+ * @param in_fd file descriptor to read from
+ * @param out_fd file descriptor to write to
+ * @param size expected size of the data to copy
+ * @param block_size size of each write
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE if copying was successful, FALSE otherwise
+ */
+gboolean r_copy_fd_with_block_size(int in_fd, int out_fd, goffset size, gsize block_size, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Copies data from one file descriptor to multiple ones, reading it only once.
+ *
+ * Each block read is passed to one writer thread per target, so that the
+ * targets are written concurrently and reading continues while the slowest
+ * one is still busy with the previous blocks. A target which fails is
+ * skipped for the rest of the copy, without affecting the others. Blocks
+ * containing only zeros are zeroed in the target if possible, as done for a
+ * single copy.
+ *
+ * The block size is a multiple of the write sizes of all targets which are
+ * block devices. If a target doesn't start on a boundary of its device (after
+ * adding the partition offset), the first block is shortened so that the
+ * following writes are aligned for all targets, if possible.
+ *
+ * Data is not added to a verity hash tree set by r_copy_set_verity_tree().
+ *
+ * @param in_fd file descriptor to read from
+ * @param out_fds file descriptors to write to
+ * @param n_out number of file descriptors in out_fds (at least 1)
+ * @param size expected size of the data to copy
+ * @param out_errors array of n_out GError pointers (initialized to NULL),
+ *        set for each target which failed
+ * @param out_written array of n_out counters, set to the amount of data
+ *        written to each target (see r_copy_set_written_counter())
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE if the input was read successfully (even if targets failed),
+ *         FALSE if reading failed
+ */
+gboolean r_copy_fd_fan_out(int in_fd, const int *out_fds, guint n_out, goffset size, GError **out_errors, goffset *out_written, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
 /**
  * Copies data from an input stream to an output stream, while generating
  * progress updates.
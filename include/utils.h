@@ -2,6 +2,7 @@
 
 #include <gio/gio.h>
 #include <glib.h>
+#include <sys/uio.h>
 
 #define R_UTILS_ERROR r_utils_error_quark()
 
@@ -13,6 +14,7 @@ typedef enum {
 	R_UTILS_ERROR_INVALID_ENV_KEY,
 	R_UTILS_ERROR_SEMVER_PARSE,
 	R_UTILS_ERROR_OPEN_FILE,
+	R_UTILS_ERROR_NOT_SUPPORTED,
 } RUtilsError;
 
 #define BIT(nr) (1UL << (nr))
@@ -200,6 +202,23 @@ gboolean copy_file(const gchar *srcprefix, const gchar *srcfile,
 		const gchar *dstprefix, const gchar *dstfile, GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
 
+/**
+ * Copies the remaining data from one file descriptor to another.
+ *
+ * If supported by the filesystem, the data is shared via a reflink
+ * (FICLONE). Otherwise, copy_file_range() is used, so that the data doesn't
+ * pass through userspace. If that is not possible either (e.g. across
+ * filesystems on older kernels), it falls back to read() and write().
+ *
+ * @param in_fd file descriptor to copy from
+ * @param out_fd file descriptor to copy to (should be empty)
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE if an error occurred
+ */
+gboolean r_copy_fd_data(int in_fd, int out_fd, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
 /**
  * Recursively delete directory contents.
  *
@@ -326,6 +345,19 @@ G_GNUC_WARN_UNUSED_RESULT;
 gboolean r_write_exact(const int fd, const guint8 *data, size_t size, GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
 
+/**
+ * Writes all buffers described by iov, using as few syscalls as possible.
+ *
+ * @param fd file descriptor to write to
+ * @param iov array of buffers (modified to track partial writes)
+ * @param iovcnt number of elements in iov
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE otherwise
+ */
+gboolean r_writev_exact(const int fd, struct iovec *iov, int iovcnt, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
 gboolean r_pread_exact(const int fd, guint8 *data, size_t size, off_t offset, GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
 
@@ -335,12 +367,111 @@ G_GNUC_WARN_UNUSED_RESULT;
 gboolean r_pwrite_lazy(const int fd, const guint8 *data, size_t size, off_t offset, GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
 
+/**
+ * Checks whether a buffer contains only zero bytes.
+ *
+ * The buffer is checked in blocks of 64 bytes using word-wise operations
+ * (which the compiler can vectorize), stopping at the first block with
+ * non-zero data.
+ *
+ * @param data buffer to check
+ * @param len length of the buffer
+ *
+ * @return TRUE if all bytes are 0x00
+ */
+gboolean r_buffer_is_zero(const guint8 *data, gsize len);
+
+/**
+ * Checks whether a buffer contains only erased bytes.
+ *
+ * Like r_buffer_is_zero(), but accepts both 0x00 and 0xFF bytes (in any
+ * combination), as used for erased flash areas.
+ *
+ * @param data buffer to check
+ * @param len length of the buffer
+ *
+ * @return TRUE if all bytes are either 0x00 or 0xFF
+ */
+gboolean r_buffer_is_erased(const guint8 *data, gsize len);
+
+/**
+ * Zeroes a range without writing data buffers.
+ *
+ * For block devices, BLKZEROOUT is used, which allows the kernel to use
+ * WRITE ZEROES or equivalent commands. For regular files, a hole is punched
+ * and the file is extended if the range ends after its current end.
+ *
+ * If the fd or the underlying device doesn't support this,
+ * R_UTILS_ERROR_NOT_SUPPORTED is returned and the caller must write zeros
+ * instead. The range is unmodified in this case.
+ *
+ * @param fd file descriptor to modify
+ * @param offset start of the range
+ * @param size size of the range
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE otherwise
+ */
+gboolean r_zero_range(const int fd, off_t offset, off_t size, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
 guint get_sectorsize(gint fd)
 G_GNUC_WARN_UNUSED_RESULT;
 
 goffset get_device_size(gint fd, GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
 
+/* upper limit for RaucBlockTopology.write_size */
+#define R_BLOCK_WRITE_SIZE_MAX (16*1024*1024)
+
+typedef struct {
+	guint32 logical_block_size; /* logical sector size */
+	guint32 minimum_io_size; /* queue/minimum_io_size */
+	guint32 optimal_io_size; /* queue/optimal_io_size, 0 if not reported */
+	guint32 discard_granularity; /* queue/discard_granularity, 0 if not supported */
+	guint32 erase_size; /* device/preferred_erase_size (MMC/SD), 0 if unknown */
+	guint64 offset; /* start of the partition on the whole device in bytes */
+	guint32 write_size; /* preferred size and alignment of writes */
+} RaucBlockTopology;
+
+/**
+ * Probes the I/O topology of a block device from sysfs.
+ *
+ * For partitions, the attributes of the whole device are used together with
+ * the start of the partition, so that writes can be aligned relative to the
+ * physical medium.
+ *
+ * write_size is the largest of the reported optimal I/O size, erase size and
+ * discard granularity (limited to R_BLOCK_WRITE_SIZE_MAX), but at least the
+ * minimum I/O size.
+ *
+ * @param fd file descriptor of the block device
+ * @param topology return location for the probed values
+ *
+ * @return TRUE if fd is a block device, FALSE otherwise
+ */
+gboolean r_block_topology_probe(gint fd, RaucBlockTopology *topology);
+
+/**
+ * Returns the number of bytes from an offset in the device (or partition) to
+ * the next multiple of write_size on the whole device.
+ *
+ * @param topology probed topology
+ * @param offset offset in the device or partition
+ *
+ * @return number of bytes to the next boundary, 0 if offset is aligned
+ */
+guint64 r_block_topology_to_boundary(const RaucBlockTopology *topology, guint64 offset);
+
+/**
+ * Returns a description of the probed topology for the log.
+ *
+ * @param topology probed topology
+ *
+ * @return newly allocated string
+ */
+gchar *r_block_topology_to_string(const RaucBlockTopology *topology);
+
 /**
  * Replaces a string pointer with a newly allocated copy of the source string.
  *
@@ -387,6 +518,25 @@ G_GNUC_WARN_UNUSED_RESULT;
 gboolean r_syncfs(const gchar *path, GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
 
+/**
+ * Atomically replaces a file with the given contents.
+ *
+ * The contents are written to a temporary file in the same directory, which
+ * is synced and then renamed over the destination. Finally, the directory is
+ * synced as well, so that the new contents are durable when this returns.
+ * In contrast to g_file_set_contents(), the data is always synced, regardless
+ * of whether the destination existed before.
+ *
+ * @param filename name of the file to replace
+ * @param contents data to write
+ * @param length length of contents
+ * @param error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE if an error occurred
+ */
+gboolean r_file_set_contents_durable(const gchar *filename, const gchar *contents, gsize length, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
 /**
  * Create a temporary directory for the fakeroot environment file.
  *
@@ -490,3 +640,84 @@ gchar *r_format_duration(gint64 total_seconds);
  */
 gchar *r_regex_match_simple(const gchar *pattern, const gchar *string)
 G_GNUC_WARN_UNUSED_RESULT;
+
+/* I/O scheduling classes as used by ioprio_set() */
+#define R_IOPRIO_CLASS_NONE 0
+#define R_IOPRIO_CLASS_RT 1
+#define R_IOPRIO_CLASS_BE 2
+#define R_IOPRIO_CLASS_IDLE 3
+
+typedef struct {
+	gint nice; /* CPU priority (-20 to 19) */
+	gint io_class; /* I/O scheduling class (R_IOPRIO_CLASS_*) */
+	gint io_level; /* priority within the I/O class (0 to 7) */
+} RaucThreadPriority;
+
+/**
+ * Gets the CPU and I/O scheduling priority of the calling thread.
+ *
+ * @param[out] priority return location for the priority
+ * @param[out] error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE otherwise
+ */
+gboolean r_get_thread_priority(RaucThreadPriority *priority, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+/**
+ * Sets the CPU and I/O scheduling priority of the calling thread.
+ *
+ * Only the calling thread is affected, but processes spawned by it inherit
+ * the priority.
+ *
+ * @param priority priority to set
+ * @param[out] error return location for a GError, or NULL
+ *
+ * @return TRUE on success, FALSE otherwise
+ */
+gboolean r_set_thread_priority(const RaucThreadPriority *priority, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+typedef struct {
+	GMutex lock;
+	guint64 rate; /* bytes per second, 0 for no limit */
+	gdouble tokens; /* available bytes, negative while in debt */
+	gint64 last_refill; /* monotonic time of the last refill */
+} RaucTokenBucket;
+
+/**
+ * Initializes a token bucket for limiting a data rate.
+ *
+ * The bucket holds up to one second of data, so short bursts are allowed.
+ *
+ * @param bucket bucket to initialize
+ * @param rate maximum rate in bytes per second, or 0 for no limit
+ */
+void r_token_bucket_init(RaucTokenBucket *bucket, guint64 rate);
+
+/**
+ * Changes the rate of an initialized token bucket.
+ *
+ * @param bucket bucket to change
+ * @param rate maximum rate in bytes per second, or 0 for no limit
+ */
+void r_token_bucket_set_rate(RaucTokenBucket *bucket, guint64 rate);
+
+/**
+ * Takes tokens for the given amount of data from the bucket.
+ *
+ * If not enough tokens are available, this sleeps until they would have
+ * been refilled. It can be called from multiple threads, which then share
+ * the rate.
+ *
+ * @param bucket bucket to take tokens from
+ * @param bytes amount of data
+ */
+void r_token_bucket_consume(RaucTokenBucket *bucket, guint64 bytes);
+
+/**
+ * Frees the resources of a token bucket.
+ *
+ * @param bucket bucket to clear
+ */
+void r_token_bucket_clear(RaucTokenBucket *bucket);
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <glib.h>
 #include <stdlib.h>
 #include <stdint.h>
 
@@ -36,3 +37,76 @@ int r_verity_hash_verify(
 		uint64_t data_blocks,
 		uint8_t *root_hash,
 		const uint8_t *salt);
+
+/**
+ * Incrementally built dm-verity hash tree.
+ *
+ * The digests of the data blocks are collected while the data is written, so
+ * that the tree can be created without reading the data again. Only the
+ * (much smaller) upper levels are calculated at the end.
+ */
+typedef struct _RaucVerityTree RaucVerityTree;
+
+/**
+ * Creates an empty verity hash tree.
+ *
+ * @param data_blocks number of data blocks (of size 4096 bytes)
+ * @param salt salt of 32 bytes used for all hashes
+ *
+ * @return a newly allocated RaucVerityTree or NULL on error
+ */
+RaucVerityTree *r_verity_tree_new(uint64_t data_blocks, const uint8_t *salt);
+
+/**
+ * Hashes data blocks written at the given offset.
+ *
+ * Only complete blocks at aligned offsets are hashed, other data is ignored
+ * and must be read by r_verity_tree_fill() later.
+ *
+ * This can be called concurrently from multiple threads, as long as the
+ * ranges don't overlap.
+ *
+ * @param tree RaucVerityTree
+ * @param offset offset of the data in the data device
+ * @param data data written
+ * @param size size of the data
+ *
+ * @return 0 on success, error code otherwise
+ */
+int r_verity_tree_add(RaucVerityTree *tree, uint64_t offset, const uint8_t *data, size_t size);
+
+/**
+ * Reads and hashes all data blocks which were not added yet.
+ *
+ * @param tree RaucVerityTree
+ * @param fd file descriptor (FD) of the data device
+ * @param read_blocks return location for the number of blocks read, or NULL
+ *
+ * @return 0 on success, error code otherwise
+ */
+int r_verity_tree_fill(RaucVerityTree *tree, int fd, uint64_t *read_blocks);
+
+/**
+ * Writes the hash tree and calculates the root hash.
+ *
+ * The layout is the same as created by r_verity_hash_create() or by
+ * 'veritysetup format --no-superblock' with the given hash offset.
+ *
+ * @param tree RaucVerityTree with all data blocks hashed
+ * @param fd file descriptor (FD) of the hash device
+ * @param hash_offset offset of the hash tree in the hash device (in bytes)
+ * @param hash_blocks return location for the size of the hash tree (of size 4096 bytes), or NULL
+ * @param root_hash return location for the root hash (32 bytes)
+ *
+ * @return 0 on success, error code otherwise
+ */
+int r_verity_tree_write(RaucVerityTree *tree, int fd, uint64_t hash_offset,
+		uint64_t *hash_blocks, uint8_t *root_hash);
+
+/**
+ * Frees the verity hash tree.
+ *
+ * @param tree RaucVerityTree to free
+ */
+void r_verity_tree_free(RaucVerityTree *tree);
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(RaucVerityTree, r_verity_tree_free);
@@ -1,5 +1,6 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <string.h>
 
 #include "artifacts.h"
 
@@ -7,6 +8,7 @@
 #include "context.h"
 #include "glib/gstdio.h"
 #include "slot.h"
+#include "tree_copy.h"
 #include "update_utils.h"
 #include "utils.h"
 
@@ -76,6 +78,8 @@ void r_artifact_repo_free(gpointer value)
 
 	if (g_strcmp0(repo->type, "composefs") == 0) {
 		g_clear_pointer(&repo->composefs.local_store_objects, g_hash_table_destroy);
+		g_clear_pointer(&repo->composefs.accounted, g_hash_table_destroy);
+		g_clear_pointer(&repo->composefs.prune_candidates, g_hash_table_destroy);
 	}
 
 	g_free(repo->description);
@@ -432,6 +436,18 @@ gboolean r_artifact_repo_prune(RArtifactRepo *repo, GError **error)
 		if (g_strcmp0(repo->type, "composefs") == 0) {
 			if (g_strcmp0(name, ".rauc-cfs-store") == 0)
 				continue;
+			if (g_strcmp0(name, ".rauc-cfs-index") == 0)
+				continue;
+		} else if (g_strcmp0(repo->type, "trees") == 0) {
+			/* file digests of installed artifacts */
+			if (g_str_has_suffix(name, ".digests")) {
+				g_autofree gchar *artifact_name = g_strndup(name, strlen(name) - strlen(".digests"));
+				g_autofree gchar *artifact_path = g_build_filename(repo->path, artifact_name, NULL);
+
+				if (g_regex_match(artifact_regex, artifact_name, 0, NULL) &&
+				    g_file_test(artifact_path, G_FILE_TEST_IS_DIR))
+					continue;
+			}
 		}
 
 		g_message("Removing unexpected data in artifact repo: %s", full_name);
@@ -472,11 +488,25 @@ gboolean r_artifact_repo_prune(RArtifactRepo *repo, GError **error)
 					artifact->name, artifact->checksum.digest, repo->name
 					);
 
+			if (g_strcmp0(repo->type, "composefs") == 0)
+				r_composefs_artifact_release(artifact);
+
 			if (!rm_tree(artifact->path, &ierror)) {
 				g_propagate_error(error, ierror);
 				return FALSE;
 			}
 
+			if (g_strcmp0(repo->type, "trees") == 0) {
+				g_autofree gchar *digests_path = g_strconcat(artifact->path, ".digests", NULL);
+
+				if (g_unlink(digests_path) == -1 && errno != ENOENT) {
+					int err = errno;
+					g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+							"Failed to remove file digests '%s': %s", digests_path, g_strerror(err));
+					return FALSE;
+				}
+			}
+
 			g_hash_table_iter_remove(&inner_iter);
 		}
 
@@ -568,6 +598,13 @@ gboolean r_artifact_repo_commit(RArtifactRepo *repo, GError **error)
 
 	/* TODO save additional meta-data for artifacts and instances here? */
 
+	if (g_strcmp0(repo->type, "composefs") == 0) {
+		if (!r_composefs_artifact_repo_commit(repo, &ierror)) {
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
+	}
+
 	if (!r_syncfs(repo->path, &ierror)) {
 		g_propagate_error(error, ierror);
 		return FALSE;
@@ -788,27 +825,118 @@ static gboolean tree_artifact_install_tar(const RArtifact *artifact, const RaucI
 	return TRUE;
 }
 
+/* Find an installed version of the artifact with file digests, preferring referenced ones. */
+static const RArtifact *tree_artifact_find_previous(const RArtifact *artifact)
+{
+	const RArtifact *previous = NULL;
+	GHashTable *inner = g_hash_table_lookup(artifact->repo->artifacts, artifact->name);
+	GHashTableIter iter;
+	const RArtifact *candidate = NULL;
+
+	if (!inner)
+		return NULL;
+
+	g_hash_table_iter_init(&iter, inner);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer*)&candidate)) {
+		g_autofree gchar *digests_path = g_strconcat(candidate->path, ".digests", NULL);
+
+		if (candidate == artifact)
+			continue;
+		if (!g_file_test(candidate->path, G_FILE_TEST_IS_DIR) ||
+		    !g_file_test(digests_path, G_FILE_TEST_IS_REGULAR))
+			continue;
+
+		if (!previous || (!previous->references->len && candidate->references->len))
+			previous = candidate;
+	}
+
+	return previous;
+}
+
+/* Collect the paths of files with the same digest in both versions. */
+static GHashTable *tree_artifact_get_unchanged(const gchar *digests_path, const RArtifact *previous, GError **error)
+{
+	GError *ierror = NULL;
+	g_autofree gchar *previous_digests_path = g_strconcat(previous->path, ".digests", NULL);
+	g_autoptr(GHashTable) digests = NULL;
+	g_autoptr(GHashTable) previous_digests = NULL;
+	g_autoptr(GHashTable) unchanged = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	GHashTableIter iter;
+	const gchar *path, *digest;
+
+	digests = r_tree_digests_load(digests_path, &ierror);
+	if (!digests) {
+		g_propagate_error(error, ierror);
+		return NULL;
+	}
+	previous_digests = r_tree_digests_load(previous_digests_path, &ierror);
+	if (!previous_digests) {
+		g_propagate_error(error, ierror);
+		return NULL;
+	}
+
+	g_hash_table_iter_init(&iter, digests);
+	while (g_hash_table_iter_next(&iter, (gpointer*)&path, (gpointer*)&digest)) {
+		if (g_strcmp0(digest, g_hash_table_lookup(previous_digests, path)) == 0)
+			g_hash_table_add(unchanged, g_strdup(path));
+	}
+
+	g_debug("Found %u of %u files unchanged since artifact '%s' with hash '%s'",
+			g_hash_table_size(unchanged), g_hash_table_size(digests),
+			previous->name, previous->checksum.digest);
+
+	return g_steal_pointer(&unchanged);
+}
+
 /* also used by composefs for the metadata */
 gboolean r_tree_artifact_install_extracted(const RArtifact *artifact, const RaucImage *image, const gchar *name, GError **error)
 {
 	GError *ierror = NULL;
+	g_autofree gchar *digests_path = NULL;
+	g_autofree gchar *digests = NULL;
+	gsize digests_len = 0;
+	g_autoptr(GHashTable) unchanged = NULL;
+	const RArtifact *previous = NULL;
 
 	g_return_val_if_fail(artifact, FALSE);
 	g_return_val_if_fail(image, FALSE);
 	g_return_val_if_fail(name, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
-	g_autoptr(GPtrArray) args = g_ptr_array_new_full(5, g_free);
-	g_ptr_array_add(args, g_strdup("cp"));
-	g_ptr_array_add(args, g_strdup("-a"));
-	g_ptr_array_add(args, g_strdup(name));
-	g_ptr_array_add(args, g_strdup(artifact->path_tmp));
-	g_ptr_array_add(args, NULL);
+	/* the bundle contains file digests for trees converted using tar-extract */
+	digests_path = g_strconcat(name, ".digests", NULL);
+	if (!g_file_get_contents(digests_path, &digests, &digests_len, &ierror)) {
+		if (!g_error_matches(ierror, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+			g_message("Failed to read file digests, copying all files: %s", ierror->message);
+		g_clear_error(&ierror);
+	}
 
-	if (!r_subprocess_runv(args, G_SUBPROCESS_FLAGS_NONE, &ierror)) {
-		g_propagate_prefixed_error(error, ierror, "Failed to copy tree (cp -a): ");
+	if (digests)
+		previous = tree_artifact_find_previous(artifact);
+	if (previous) {
+		unchanged = tree_artifact_get_unchanged(digests_path, previous, &ierror);
+		if (!unchanged) {
+			g_message("Failed to compare file digests, copying all files: %s", ierror->message);
+			g_clear_error(&ierror);
+			previous = NULL;
+		}
+	}
+
+	if (!r_tree_copy(name, artifact->path_tmp, previous ? previous->path : NULL, unchanged, &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Failed to copy tree: ");
 		return FALSE;
 	}
+
+	/* keep the digests for the next update, synced together with the tree */
+	if (digests) {
+		g_autofree gchar *artifact_digests_path = g_strconcat(artifact->path, ".digests", NULL);
+
+		if (!g_file_set_contents(artifact_digests_path, digests, digests_len, &ierror)) {
+			g_propagate_prefixed_error(error, ierror, "Failed to store file digests: ");
+			return FALSE;
+		}
+	}
+
 	return TRUE;
 }
 
@@ -1,6 +1,8 @@
 #include <asm-generic/errno-base.h>
 #include <errno.h>
 #include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
 
@@ -8,8 +10,53 @@
 #include <libcomposefs/lcfs-writer.h>
 
 #include "artifacts_composefs.h"
+#include "stats.h"
 #include "utils.h"
 
+/*
+ * The object store index caches the names of the objects per fan-out
+ * directory, together with the directory's mtime at the time the index was
+ * written. For each object, it also stores the number of referencing
+ * artifacts, counting only the listed artifact directories. It is stored as a
+ * serialized GVariant:
+ *
+ * (uasa(stasau))
+ *   version
+ *   [artifact directory names included in the reference counts]
+ *   [(fan-out directory name, mtime in ns, [object file names], [reference counts])]
+ */
+#define COMPOSEFS_INDEX_FILENAME ".rauc-cfs-index"
+#define COMPOSEFS_INDEX_FORMAT "(uasa(stasau))"
+#define COMPOSEFS_INDEX_VERSION 2
+
+/* maximum number of threads used to import objects into the local store */
+#define COMPOSEFS_IMPORT_MAX_THREADS 8
+
+typedef struct {
+	const gchar *src_store; /* object store in the bundle */
+	const gchar *dst_store; /* local object store */
+} ComposefsImportContext;
+
+/* all missing objects in a single fan-out directory of the object store */
+typedef struct {
+	gchar *subdir;
+	GPtrArray *names; /* object file names in subdir */
+	guint done; /* number of names which were imported successfully */
+	gboolean res;
+	GError *error;
+} ComposefsImportJob;
+
+static void composefs_import_job_free(ComposefsImportJob *job)
+{
+	if (!job)
+		return;
+
+	g_free(job->subdir);
+	g_clear_pointer(&job->names, g_ptr_array_unref);
+	g_clear_error(&job->error);
+	g_free(job);
+}
+
 static gint strcmp0_p(gconstpointer a, gconstpointer b)
 {
 	const gchar *str1 = *((gchar **) a);
@@ -82,17 +129,197 @@ static gboolean composefs_objects_from_image(GHashTable *objects, const gchar *i
 	return TRUE;
 }
 
+static gboolean get_mtime_ns(const gchar *path, guint64 *mtime, GError **error)
+{
+	struct stat st;
+
+	if (stat(path, &st) == -1) {
+		int err = errno;
+		g_set_error(error,
+				G_FILE_ERROR,
+				g_file_error_from_errno(err),
+				"Failed to stat '%s': %s", path, g_strerror(err));
+		return FALSE;
+	}
+
+	if (!S_ISDIR(st.st_mode)) {
+		g_set_error(error,
+				G_FILE_ERROR,
+				G_FILE_ERROR_NOTDIR,
+				"'%s' is not a directory", path);
+		return FALSE;
+	}
+
+	*mtime = (guint64)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+
+	return TRUE;
+}
+
+/*
+ * Loads the object store index of the repo.
+ *
+ * The file is mapped into memory. As the index is just a cache, any problem
+ * is only logged and the store is scanned instead.
+ *
+ * @param repo RArtifactRepo to load the index for
+ * @param accounted return location for a new set of the artifact directory
+ *        names included in the reference counts
+ *
+ * @return a new GHashTable mapping fan-out directory names to their (stasau)
+ *         GVariant entries, or NULL if the index is missing or invalid
+ */
+static GHashTable *composefs_index_load(const RArtifactRepo *repo, GHashTable **accounted)
+{
+	g_autoptr(GError) ierror = NULL;
+	g_autofree gchar *index_path = g_build_filename(repo->path, COMPOSEFS_INDEX_FILENAME, NULL);
+	g_autoptr(GMappedFile) mapped = NULL;
+	g_autoptr(GBytes) bytes = NULL;
+	g_autoptr(GVariant) index = NULL;
+	g_autoptr(GVariant) dirs = NULL;
+	g_autoptr(GVariantIter) artifacts = NULL;
+	g_autoptr(GHashTable) result = NULL;
+	const gchar *artifact_name;
+	guint32 version = 0;
+
+	mapped = g_mapped_file_new(index_path, FALSE, &ierror);
+	if (!mapped) {
+		if (!g_error_matches(ierror, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+			g_message("Failed to load composefs object index of repo '%s': %s", repo->name, ierror->message);
+		return NULL;
+	}
+
+	bytes = g_mapped_file_get_bytes(mapped);
+	index = g_variant_new_from_bytes(G_VARIANT_TYPE(COMPOSEFS_INDEX_FORMAT), bytes, FALSE);
+	g_variant_get_child(index, 0, "u", &version);
+	if (version != COMPOSEFS_INDEX_VERSION) {
+		g_message("Ignoring composefs object index of repo '%s' with unsupported version %"G_GUINT32_FORMAT,
+				repo->name, version);
+		return NULL;
+	}
+	g_variant_get(index, "(uas@a(stasau))", NULL, &artifacts, &dirs);
+
+	result = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)g_variant_unref);
+	for (gsize i = 0; i < g_variant_n_children(dirs); i++) {
+		GVariant *entry = g_variant_get_child_value(dirs, i);
+		const gchar *dir_name = NULL;
+
+		/* the key points into the entry, which is kept as the value */
+		g_variant_get_child(entry, 0, "&s", &dir_name);
+		g_hash_table_replace(result, (gpointer)dir_name, entry);
+	}
+
+	*accounted = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	while (g_variant_iter_next(artifacts, "&s", &artifact_name))
+		g_hash_table_add(*accounted, g_strdup(artifact_name));
+
+	return g_steal_pointer(&result);
+}
+
+/*
+ * Writes the object store index for the current list of local objects.
+ *
+ * This must only be called when the list matches the contents of the object
+ * store, as the current directory mtimes are recorded. If the reference counts
+ * are unknown, they are stored as zero for an empty set of artifacts.
+ */
+static gboolean composefs_index_save(const RArtifactRepo *repo, GError **error)
+{
+	GError *ierror = NULL;
+	g_autofree gchar *index_path = g_build_filename(repo->path, COMPOSEFS_INDEX_FILENAME, NULL);
+	g_autofree gchar *object_store_path = g_build_filename(repo->path, ".rauc-cfs-store", NULL);
+	g_autoptr(GPtrArray) objects_sorted = get_objects_sorted(repo->composefs.local_store_objects);
+	g_auto(GVariantBuilder) builder = G_VARIANT_BUILDER_INIT(G_VARIANT_TYPE(COMPOSEFS_INDEX_FORMAT));
+	g_autoptr(GVariant) index = NULL;
+	GHashTable *accounted = repo->composefs.accounted;
+	guint end;
+
+	if (repo->composefs.index_clean)
+		return TRUE;
+
+	g_variant_builder_add(&builder, "u", COMPOSEFS_INDEX_VERSION);
+
+	g_variant_builder_open(&builder, G_VARIANT_TYPE("as"));
+	if (accounted) {
+		g_autoptr(GPtrArray) accounted_sorted = get_objects_sorted(accounted);
+
+		for (guint i = 0; i < accounted_sorted->len; i++)
+			g_variant_builder_add(&builder, "s", accounted_sorted->pdata[i]);
+	}
+	g_variant_builder_close(&builder); /* as */
+
+	g_variant_builder_open(&builder, G_VARIANT_TYPE("a(stasau)"));
+	/* as the objects are sorted, each fan-out directory is a consecutive range */
+	for (guint start = 0; start < objects_sorted->len; start = end) {
+		const gchar *object_name = objects_sorted->pdata[start];
+		const gchar *sep = strchr(object_name, '/');
+		g_autofree gchar *dir_name = NULL;
+		g_autofree gchar *dir_path = NULL;
+		guint64 mtime = 0;
+
+		/* only objects in fan-out directories are loaded from the store */
+		g_assert(sep != NULL);
+
+		dir_name = g_strndup(object_name, sep - object_name + 1);
+		for (end = start + 1; end < objects_sorted->len; end++) {
+			if (!g_str_has_prefix(objects_sorted->pdata[end], dir_name))
+				break;
+		}
+		dir_name[sep - object_name] = '\0';
+
+		dir_path = g_build_filename(object_store_path, dir_name, NULL);
+		if (!get_mtime_ns(dir_path, &mtime, &ierror)) {
+			g_propagate_prefixed_error(error, ierror, "Failed to update composefs object index: ");
+			return FALSE;
+		}
+
+		g_variant_builder_open(&builder, G_VARIANT_TYPE("(stasau)"));
+		g_variant_builder_add(&builder, "s", dir_name);
+		g_variant_builder_add(&builder, "t", mtime);
+		g_variant_builder_open(&builder, G_VARIANT_TYPE("as"));
+		for (guint i = start; i < end; i++)
+			g_variant_builder_add(&builder, "s", (const gchar *)objects_sorted->pdata[i] + (sep - object_name) + 1);
+		g_variant_builder_close(&builder); /* as */
+		g_variant_builder_open(&builder, G_VARIANT_TYPE("au"));
+		for (guint i = start; i < end; i++) {
+			gpointer refs = g_hash_table_lookup(repo->composefs.local_store_objects, objects_sorted->pdata[i]);
+
+			g_variant_builder_add(&builder, "u", accounted ? GPOINTER_TO_UINT(refs) : 0);
+		}
+		g_variant_builder_close(&builder); /* au */
+		g_variant_builder_close(&builder); /* (stasau) */
+	}
+	g_variant_builder_close(&builder); /* a(stasau) */
+	index = g_variant_ref_sink(g_variant_builder_end(&builder));
+
+	if (!r_file_set_contents_durable(index_path, g_variant_get_data(index), g_variant_get_size(index), &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Failed to update composefs object index: ");
+		return FALSE;
+	}
+
+	g_debug("Saved composefs object index with %u objects for repo '%s'", objects_sorted->len, repo->name);
+	repo->composefs.index_clean = TRUE;
+
+	return TRUE;
+}
+
 gboolean r_composefs_artifact_repo_prepare(RArtifactRepo *repo, GError **error)
 {
 	GError *ierror = NULL;
+	g_autoptr(GHashTable) index = NULL;
+	g_autoptr(GHashTable) accounted = NULL;
+	guint indexed = 0;
+	guint rescanned = 0;
+	gboolean changed = FALSE;
 
 	g_return_val_if_fail(repo, FALSE);
 	g_return_val_if_fail(g_strcmp0(repo->type, "composefs") == 0, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
-	if (repo->composefs.local_store_objects)
-		g_hash_table_destroy(repo->composefs.local_store_objects);
+	g_clear_pointer(&repo->composefs.local_store_objects, g_hash_table_destroy);
+	g_clear_pointer(&repo->composefs.accounted, g_hash_table_destroy);
+	g_clear_pointer(&repo->composefs.prune_candidates, g_hash_table_destroy);
 	repo->composefs.local_store_objects = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	repo->composefs.prune_candidates = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
 
 	g_autofree gchar *object_store_path = g_build_filename(repo->path, ".rauc-cfs-store", NULL);
 	if (g_mkdir_with_parents(object_store_path, 0700) != 0) {
@@ -113,6 +340,9 @@ gboolean r_composefs_artifact_repo_prepare(RArtifactRepo *repo, GError **error)
 		return FALSE;
 	}
 
+	index = composefs_index_load(repo, &accounted);
+	repo->composefs.index_clean = FALSE;
+
 	/* Walk nested dirs to find objects like
 	 * a8/a6f5cb65e83a3404096a90d97be401503380f64440d5ee3fd4c41b7a776ebd */
 	const gchar *entry_name;
@@ -120,13 +350,42 @@ gboolean r_composefs_artifact_repo_prepare(RArtifactRepo *repo, GError **error)
 		g_autofree gchar *full_inner_path = g_build_filename(object_store_path, entry_name, NULL);
 		g_autoptr(GDir) inner_dir = NULL;
 		const gchar *inner_entry_name;
+		GVariant *cached;
+		guint64 mtime = 0;
+		guint found;
 
 		/* we look for directories */
-		if (!g_file_test(full_inner_path, G_FILE_TEST_IS_DIR)) {
+		if (!get_mtime_ns(full_inner_path, &mtime, NULL)) {
 			g_message("Unexpected data in artifact repo: %s", full_inner_path);
 			continue;
 		}
 
+		/* use the indexed objects if the directory is unchanged */
+		cached = index ? g_hash_table_lookup(index, entry_name) : NULL;
+		if (cached) {
+			g_autoptr(GVariant) names = NULL;
+			g_autoptr(GVariant) refs_variant = NULL;
+			const guint32 *refs;
+			gsize n_refs = 0;
+			guint64 cached_mtime = 0;
+
+			g_variant_get(cached, "(&st@as@au)", NULL, &cached_mtime, &names, &refs_variant);
+			refs = g_variant_get_fixed_array(refs_variant, &n_refs, sizeof(guint32));
+			if (cached_mtime == mtime && n_refs == g_variant_n_children(names)) {
+				for (gsize i = 0; i < n_refs; i++) {
+					const gchar *name = NULL;
+
+					g_variant_get_child(names, i, "&s", &name);
+					g_hash_table_insert(repo->composefs.local_store_objects,
+							g_strdup_printf("%s/%s", entry_name, name), GUINT_TO_POINTER(refs[i]));
+				}
+				indexed++;
+				continue;
+			}
+		}
+
+		rescanned++;
+		found = 0;
 		inner_dir = g_dir_open(full_inner_path, 0, &ierror);
 		if (inner_dir == NULL) {
 			g_propagate_error(error, ierror);
@@ -143,7 +402,29 @@ gboolean r_composefs_artifact_repo_prepare(RArtifactRepo *repo, GError **error)
 				continue;
 			}
 
-			g_hash_table_add(repo->composefs.local_store_objects, g_steal_pointer(&object_name));
+			g_hash_table_insert(repo->composefs.local_store_objects, g_steal_pointer(&object_name), GUINT_TO_POINTER(0));
+			found++;
+		}
+
+		/* empty directories are not part of the index */
+		if (cached || found)
+			changed = TRUE;
+	}
+
+	/* the index can be kept if it describes exactly what we found */
+	repo->composefs.index_clean = index && !changed && indexed == g_hash_table_size(index);
+
+	if (repo->composefs.index_clean) {
+		/* the reference counts are still valid */
+		GHashTableIter iter;
+		const gchar *object_name;
+		gpointer refs;
+
+		repo->composefs.accounted = g_steal_pointer(&accounted);
+		g_hash_table_iter_init(&iter, repo->composefs.local_store_objects);
+		while (g_hash_table_iter_next(&iter, (gpointer*)&object_name, &refs)) {
+			if (!GPOINTER_TO_UINT(refs))
+				g_hash_table_add(repo->composefs.prune_candidates, g_strdup(object_name));
 		}
 	}
 
@@ -151,21 +432,155 @@ gboolean r_composefs_artifact_repo_prepare(RArtifactRepo *repo, GError **error)
 			g_hash_table_size(repo->composefs.local_store_objects),
 			repo->name
 			);
+	g_debug("Scanned %u changed or unindexed object directories in composefs repo '%s'",
+			rescanned, repo->name);
+
+	return TRUE;
+}
+
+static gchar *artifact_key(const RArtifact *artifact)
+{
+	return g_path_get_basename(artifact->path);
+}
+
+/*
+ * Adds the references of an artifact's image to the reference counts.
+ *
+ * Referenced objects which are missing from the local store are counted in
+ * 'missing'.
+ */
+static gboolean composefs_account_artifact(RArtifactRepo *repo, const RArtifact *artifact, guint *missing, GError **error)
+{
+	GError *ierror = NULL;
+	g_autofree gchar *image_path = g_build_filename(artifact->path, "image.cfs", NULL);
+	g_autoptr(GHashTable) image_objects = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	GHashTableIter iter;
+	const gchar *object_name = NULL;
+
+	if (!composefs_objects_from_image(image_objects, image_path, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	g_hash_table_iter_init(&iter, image_objects);
+	while (g_hash_table_iter_next(&iter, (gpointer*)&object_name, NULL)) {
+		gchar *key = NULL;
+		gpointer refs = NULL;
+
+		if (!g_hash_table_lookup_extended(repo->composefs.local_store_objects, object_name, (gpointer*)&key, &refs)) {
+			g_debug("Failed to find required object '%s' in local composefs object store of repo '%s'",
+					object_name, repo->name);
+			(*missing)++;
+			continue;
+		}
+
+		g_hash_table_insert(repo->composefs.local_store_objects, g_strdup(key), GUINT_TO_POINTER(GPOINTER_TO_UINT(refs) + 1));
+	}
+
+	g_hash_table_add(repo->composefs.accounted, artifact_key(artifact));
+	repo->composefs.index_clean = FALSE;
 
 	return TRUE;
 }
 
+void r_composefs_artifact_release(const RArtifact *artifact)
+{
+	g_autoptr(GError) ierror = NULL;
+	RArtifactRepo *repo;
+	g_autofree gchar *key = NULL;
+	g_autofree gchar *image_path = NULL;
+	g_autoptr(GHashTable) image_objects = NULL;
+	GHashTableIter iter;
+	const gchar *object_name = NULL;
+
+	g_return_if_fail(artifact);
+	g_return_if_fail(artifact->repo);
+
+	repo = artifact->repo;
+	key = artifact_key(artifact);
+	if (!repo->composefs.accounted || !g_hash_table_contains(repo->composefs.accounted, key))
+		return;
+
+	image_path = g_build_filename(artifact->path, "image.cfs", NULL);
+	image_objects = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	if (!composefs_objects_from_image(image_objects, image_path, &ierror)) {
+		/* the next prune will count all references again */
+		g_message("Failed to release composefs objects of '%s': %s", artifact->path, ierror->message);
+		g_clear_pointer(&repo->composefs.accounted, g_hash_table_destroy);
+		repo->composefs.index_clean = FALSE;
+		return;
+	}
+
+	g_hash_table_iter_init(&iter, image_objects);
+	while (g_hash_table_iter_next(&iter, (gpointer*)&object_name, NULL)) {
+		gchar *existing = NULL;
+		gpointer refs = NULL;
+		guint count;
+
+		if (!g_hash_table_lookup_extended(repo->composefs.local_store_objects, object_name, (gpointer*)&existing, &refs))
+			continue;
+
+		count = GPOINTER_TO_UINT(refs);
+		if (count)
+			count--;
+		g_hash_table_insert(repo->composefs.local_store_objects, g_strdup(existing), GUINT_TO_POINTER(count));
+		if (!count)
+			g_hash_table_add(repo->composefs.prune_candidates, g_strdup(object_name));
+	}
+
+	g_hash_table_remove(repo->composefs.accounted, key);
+	repo->composefs.index_clean = FALSE;
+}
+
 gboolean r_composefs_artifact_repo_prune(RArtifactRepo *repo, GError **error)
 {
 	GError *ierror = NULL;
+	GHashTableIter iter;
+	GHashTable *inner = NULL;
+	guint present = 0;
+	guint read_images = 0;
+	guint missing = 0;
 
 	g_return_val_if_fail(repo, FALSE);
 	g_return_val_if_fail(g_strcmp0(repo->type, "composefs") == 0, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
-	g_autoptr(GHashTable) required_objects = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
-	GHashTableIter iter;
-	GHashTable *inner = NULL;
+	/* all accounted artifacts must still exist, otherwise their references would leak */
+	if (repo->composefs.accounted) {
+		g_hash_table_iter_init(&iter, repo->artifacts);
+		while (g_hash_table_iter_next(&iter, NULL, (gpointer*)&inner)) {
+			GHashTableIter inner_iter;
+			RArtifact *artifact = NULL;
+
+			g_hash_table_iter_init(&inner_iter, inner);
+			while (g_hash_table_iter_next(&inner_iter, NULL, (gpointer*)&artifact)) {
+				g_autofree gchar *key = artifact_key(artifact);
+
+				if (g_hash_table_contains(repo->composefs.accounted, key))
+					present++;
+			}
+		}
+
+		if (present != g_hash_table_size(repo->composefs.accounted)) {
+			g_message("Recounting composefs object references of repo '%s'", repo->name);
+			g_clear_pointer(&repo->composefs.accounted, g_hash_table_destroy);
+		}
+	}
+
+	/* start from zero if the reference counts are unknown */
+	if (!repo->composefs.accounted) {
+		const gchar *object_name = NULL;
+
+		repo->composefs.accounted = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+		g_hash_table_iter_init(&iter, repo->composefs.local_store_objects);
+		while (g_hash_table_iter_next(&iter, (gpointer*)&object_name, NULL)) {
+			g_hash_table_iter_replace(&iter, GUINT_TO_POINTER(0));
+			g_hash_table_add(repo->composefs.prune_candidates, g_strdup(object_name));
+		}
+		repo->composefs.index_clean = FALSE;
+	}
+
+	/* only images of new artifacts need to be read */
 	g_hash_table_iter_init(&iter, repo->artifacts);
 	while (g_hash_table_iter_next(&iter, NULL, (gpointer*)&inner)) {
 		GHashTableIter inner_iter;
@@ -173,37 +588,33 @@ gboolean r_composefs_artifact_repo_prune(RArtifactRepo *repo, GError **error)
 
 		g_hash_table_iter_init(&inner_iter, inner);
 		while (g_hash_table_iter_next(&inner_iter, NULL, (gpointer*)&artifact)) {
-			g_autofree const gchar *image_path = g_build_filename(artifact->path, "image.cfs", NULL);
-			if (!composefs_objects_from_image(required_objects, image_path, &ierror)) {
+			g_autofree gchar *key = artifact_key(artifact);
+
+			if (g_hash_table_contains(repo->composefs.accounted, key))
+				continue;
+
+			if (!composefs_account_artifact(repo, artifact, &missing, &ierror)) {
 				g_propagate_error(error, ierror);
 				return FALSE;
 			}
+			read_images++;
 		}
 	}
-
-	/* remove missing objects */
-	guint missing = 0;
-	const gchar *object_name = NULL;
-	g_hash_table_iter_init(&iter, required_objects);
-	while (g_hash_table_iter_next(&iter, (gpointer*)&object_name, NULL)) {
-		if (g_hash_table_contains(repo->composefs.local_store_objects, object_name))
-			continue;
-
-		g_debug("Failed to find required object '%s' in local composefs object store of repo '%s'",
-				object_name, repo->name);
-		g_hash_table_iter_remove(&iter);
-		missing++;
-	}
 	if (missing)
 		g_warning("Failed to find %d required objects in local composefs object store of repo '%s'",
 				missing, repo->name);
 
 	/* remove unused objects */
 	guint removed = 0;
+	const gchar *object_name = NULL;
 	g_autofree gchar *object_store_path = g_build_filename(repo->path, ".rauc-cfs-store", NULL);
-	g_hash_table_iter_init(&iter, repo->composefs.local_store_objects);
+	g_hash_table_iter_init(&iter, repo->composefs.prune_candidates);
 	while (g_hash_table_iter_next(&iter, (gpointer*)&object_name, NULL)) {
-		if (g_hash_table_contains(required_objects, object_name))
+		gpointer refs = NULL;
+
+		if (!g_hash_table_lookup_extended(repo->composefs.local_store_objects, object_name, NULL, &refs))
+			continue;
+		if (GPOINTER_TO_UINT(refs))
 			continue;
 
 		g_autofree gchar *object_path = g_build_filename(object_store_path, object_name, NULL);
@@ -217,11 +628,20 @@ gboolean r_composefs_artifact_repo_prune(RArtifactRepo *repo, GError **error)
 			return FALSE;
 		}
 
-		g_hash_table_iter_remove(&iter);
+		g_hash_table_remove(repo->composefs.local_store_objects, object_name);
+		repo->composefs.index_clean = FALSE;
 		removed++;
 	}
-	g_info("Removed %d unused objects in local composefs object store of repo '%s'",
-			removed, repo->name);
+	g_hash_table_remove_all(repo->composefs.prune_candidates);
+	g_info("Removed %d unused objects in local composefs object store of repo '%s' (read %u images)",
+			removed, repo->name, read_images);
+
+	/* Objects which are missing now could be imported again later, so
+	 * their references need to be counted again next time. */
+	if (missing) {
+		g_clear_pointer(&repo->composefs.accounted, g_hash_table_destroy);
+		repo->composefs.index_clean = FALSE;
+	}
 
 	/* remove empty directories */
 	g_autoptr(GDir) dir = g_dir_open(object_store_path, 0, &ierror);
@@ -249,6 +669,248 @@ gboolean r_composefs_artifact_repo_prune(RArtifactRepo *repo, GError **error)
 		}
 	}
 
+	if (!composefs_index_save(repo, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+gboolean r_composefs_artifact_repo_commit(RArtifactRepo *repo, GError **error)
+{
+	GError *ierror = NULL;
+
+	g_return_val_if_fail(repo, FALSE);
+	g_return_val_if_fail(g_strcmp0(repo->type, "composefs") == 0, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (!composefs_index_save(repo, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Copies a single object between two open fan-out directories.
+ *
+ * The data is synced, but the directory entry is only synced by the caller
+ * after all objects in the directory are copied.
+ */
+static gboolean composefs_import_object(int src_dir_fd, int dst_dir_fd, const gchar *name, GError **error)
+{
+	GError *ierror = NULL;
+	g_auto(filedesc) in_fd = -1;
+	g_auto(filedesc) out_fd = -1;
+	struct stat st;
+
+	in_fd = openat(src_dir_fd, name, O_RDONLY | O_CLOEXEC);
+	if (in_fd == -1 || fstat(in_fd, &st) == -1) {
+		int err = errno;
+		g_set_error(error,
+				G_FILE_ERROR,
+				g_file_error_from_errno(err),
+				"Failed to open: %s", g_strerror(err));
+		return FALSE;
+	}
+
+	out_fd = openat(dst_dir_fd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st.st_mode & 07777);
+	if (out_fd == -1) {
+		int err = errno;
+		g_set_error(error,
+				G_FILE_ERROR,
+				g_file_error_from_errno(err),
+				"Failed to create: %s", g_strerror(err));
+		return FALSE;
+	}
+
+	if (!r_copy_fd_data(in_fd, out_fd, &ierror)) {
+		g_propagate_error(error, ierror);
+		goto out_unlink;
+	}
+
+	if (fsync(out_fd) == -1) {
+		int err = errno;
+		g_set_error(error,
+				G_FILE_ERROR,
+				g_file_error_from_errno(err),
+				"Failed to sync: %s", g_strerror(err));
+		goto out_unlink;
+	}
+
+	return TRUE;
+
+out_unlink:
+	/* don't leave an incomplete object in the store */
+	unlinkat(dst_dir_fd, name, 0);
+	return FALSE;
+}
+
+static gboolean composefs_import_objects(const ComposefsImportContext *ctx, ComposefsImportJob *job, GError **error)
+{
+	GError *ierror = NULL;
+	g_autofree gchar *src_dir = g_build_filename(ctx->src_store, job->subdir, NULL);
+	g_autofree gchar *dst_dir = g_build_filename(ctx->dst_store, job->subdir, NULL);
+	g_auto(filedesc) src_dir_fd = -1;
+	g_auto(filedesc) dst_dir_fd = -1;
+
+	if (g_mkdir_with_parents(dst_dir, 0700) != 0) {
+		int err = errno;
+		g_set_error(error,
+				G_FILE_ERROR,
+				g_file_error_from_errno(err),
+				"Failed to create composefs object store subdir '%s': %s",
+				dst_dir, g_strerror(err));
+		return FALSE;
+	}
+
+	src_dir_fd = g_open(src_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0);
+	if (src_dir_fd == -1) {
+		int err = errno;
+		g_set_error(error,
+				G_FILE_ERROR,
+				g_file_error_from_errno(err),
+				"Failed to open '%s': %s", src_dir, g_strerror(err));
+		return FALSE;
+	}
+
+	dst_dir_fd = g_open(dst_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0);
+	if (dst_dir_fd == -1) {
+		int err = errno;
+		g_set_error(error,
+				G_FILE_ERROR,
+				g_file_error_from_errno(err),
+				"Failed to open '%s': %s", dst_dir, g_strerror(err));
+		return FALSE;
+	}
+
+	for (guint i = 0; i < job->names->len; i++) {
+		const gchar *name = job->names->pdata[i];
+
+		if (!composefs_import_object(src_dir_fd, dst_dir_fd, name, &ierror)) {
+			g_propagate_prefixed_error(error, ierror, "Failed to copy composefs object '%s/%s' from bundle to local store: ",
+					job->subdir, name);
+			return FALSE;
+		}
+		job->done++;
+	}
+
+	/* a single sync makes all new entries in this directory durable */
+	if (fsync(dst_dir_fd) == -1) {
+		int err = errno;
+		g_set_error(error,
+				G_FILE_ERROR,
+				g_file_error_from_errno(err),
+				"Failed to sync '%s': %s", dst_dir, g_strerror(err));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void composefs_import_worker(gpointer data, gpointer user_data)
+{
+	ComposefsImportJob *job = data;
+	const ComposefsImportContext *ctx = user_data;
+
+	job->res = composefs_import_objects(ctx, job, &job->error);
+}
+
+/*
+ * Copies the given objects from the bundle to the local object store.
+ *
+ * The objects are grouped by their fan-out directory and the groups are
+ * imported concurrently by a bounded thread pool. Successfully imported
+ * objects are added to the repo's list of local objects, even if others
+ * failed.
+ */
+static gboolean composefs_import(RArtifactRepo *repo, const gchar *src_store, GPtrArray *objects_sorted, GError **error)
+{
+	GError *ierror = NULL;
+	g_autofree gchar *dst_store = g_build_filename(repo->path, ".rauc-cfs-store", NULL);
+	g_autoptr(GPtrArray) jobs = g_ptr_array_new_with_free_func((GDestroyNotify)composefs_import_job_free);
+	ComposefsImportContext ctx = {
+		.src_store = src_store,
+		.dst_store = dst_store,
+	};
+	ComposefsImportJob *job = NULL;
+	GThreadPool *pool = NULL;
+	guint n_threads;
+	gint64 start_time;
+	gint64 duration;
+
+	if (!objects_sorted->len)
+		return TRUE;
+
+	repo->composefs.index_clean = FALSE;
+
+	/* as the objects are sorted, each fan-out directory is a consecutive range */
+	for (guint i = 0; i < objects_sorted->len; i++) {
+		const gchar *object_name = objects_sorted->pdata[i];
+		const gchar *sep = strrchr(object_name, '/');
+		g_autofree gchar *subdir = sep ? g_strndup(object_name, sep - object_name) : g_strdup(".");
+
+		if (!job || g_strcmp0(job->subdir, subdir) != 0) {
+			job = g_new0(ComposefsImportJob, 1);
+			job->subdir = g_steal_pointer(&subdir);
+			job->names = g_ptr_array_new();
+			g_ptr_array_add(jobs, job);
+		}
+		g_ptr_array_add(job->names, (gpointer)(sep ? sep + 1 : object_name));
+	}
+
+	start_time = g_get_monotonic_time();
+
+	n_threads = MIN(CLAMP(g_get_num_processors(), 1, COMPOSEFS_IMPORT_MAX_THREADS), jobs->len);
+	pool = g_thread_pool_new(composefs_import_worker, &ctx, n_threads, FALSE, &ierror);
+	if (!pool) {
+		g_propagate_prefixed_error(error, ierror, "Failed to create composefs import thread pool: ");
+		return FALSE;
+	}
+
+	for (guint i = 0; i < jobs->len; i++) {
+		if (!g_thread_pool_push(pool, jobs->pdata[i], &ierror)) {
+			/* fall back to importing in this thread */
+			g_debug("Failed to queue composefs import job: %s", ierror->message);
+			g_clear_error(&ierror);
+			composefs_import_worker(jobs->pdata[i], &ctx);
+		}
+	}
+
+	/* wait for all queued jobs to finish */
+	g_thread_pool_free(pool, FALSE, TRUE);
+
+	duration = MAX(g_get_monotonic_time() - start_time, 1);
+
+	for (guint i = 0; i < jobs->len; i++) {
+		job = jobs->pdata[i];
+
+		/* the directory entries of a failed job may not be durable, but the objects exist */
+		for (guint j = 0; j < job->done; j++) {
+			gchar *object_name = g_build_filename(job->subdir, job->names->pdata[j], NULL);
+
+			/* references are counted when pruning */
+			g_hash_table_add(repo->composefs.prune_candidates, g_strdup(object_name));
+			g_hash_table_insert(repo->composefs.local_store_objects, object_name, GUINT_TO_POINTER(0));
+		}
+	}
+
+	for (guint i = 0; i < jobs->len; i++) {
+		job = jobs->pdata[i];
+
+		if (!job->res) {
+			g_propagate_error(error, g_steal_pointer(&job->error));
+			return FALSE;
+		}
+	}
+
+	g_message("Imported %u composefs objects using %u threads in %.2f seconds (%.0f objects/s)",
+			objects_sorted->len, n_threads, (gdouble)duration / G_USEC_PER_SEC,
+			(gdouble)objects_sorted->len * G_USEC_PER_SEC / duration);
+	r_stats_report_add("composefs import [objects/s]", (gdouble)objects_sorted->len * G_USEC_PER_SEC / duration);
+
 	return TRUE;
 }
 
@@ -295,30 +957,12 @@ gboolean r_composefs_artifact_install(const RArtifact *artifact, const RaucImage
 	g_message("Need to get %d new composefs objects from bundle", g_hash_table_size(image_objects));
 
 	/* copy missing objects */
-	g_autofree const gchar *local_object_store_path = g_build_filename(artifact->repo->path, ".rauc-cfs-store", NULL);
 	g_autofree const gchar *bundle_path = g_path_get_dirname(name);
 	g_autofree const gchar *bundle_object_store_path = g_build_filename(bundle_path, ".rauc-cfs-store", NULL);
 	g_autoptr(GPtrArray) image_objects_sorted = get_objects_sorted(image_objects);
-	for (guint i = 0; i < image_objects_sorted->len; i++) {
-		const gchar *object_name = image_objects_sorted->pdata[i];
-		g_autofree const gchar *object_subdir = g_path_get_dirname(object_name);
-		g_autofree const gchar *local_object_store_subdir_path = g_build_filename(local_object_store_path, object_subdir, NULL);
-		if (g_mkdir_with_parents(local_object_store_subdir_path, 0700) != 0) {
-			int err = errno;
-			g_set_error(
-					error,
-					G_FILE_ERROR,
-					g_file_error_from_errno(err),
-					"Failed to create composefs object store subdir '%s': %s",
-					local_object_store_subdir_path,
-					g_strerror(err));
-			return FALSE;
-		}
-		if (!copy_file(bundle_object_store_path, object_name, local_object_store_path, object_name, &ierror)) {
-			g_propagate_prefixed_error(error, ierror, "Failed to copy composefs object from bundle to local store: ");
-			return FALSE;
-		}
-		g_hash_table_add(artifact->repo->composefs.local_store_objects, g_strdup(object_name));
+	if (!composefs_import(artifact->repo, bundle_object_store_path, image_objects_sorted, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
 	}
 
 	return TRUE;
@@ -1,3 +1,5 @@
+#include <string.h>
+
 #include "bootchooser.h"
 #include "bootloaders/barebox.h"
 #include "bootloaders/custom.h"
@@ -115,6 +117,108 @@ gboolean r_boot_get_state(RaucSlot *slot, gboolean *good, GError **error)
 }
 
 /* Set slot status values */
+/* thread which collects bootloader changes, or NULL */
+static GThread *transaction_thread = NULL;
+
+void r_boot_begin(void)
+{
+	g_return_if_fail(g_atomic_pointer_get(&transaction_thread) == NULL);
+
+	g_atomic_pointer_set(&transaction_thread, g_thread_self());
+}
+
+gboolean r_boot_in_transaction(void)
+{
+	return g_atomic_pointer_get(&transaction_thread) == g_thread_self();
+}
+
+gboolean r_boot_commit(GError **error)
+{
+	gboolean res = TRUE;
+	GError *ierror = NULL;
+
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+	g_return_val_if_fail(r_boot_in_transaction(), FALSE);
+
+	/* the backends write their changes directly again */
+	g_atomic_pointer_set(&transaction_thread, NULL);
+
+	if (g_strcmp0(r_context()->config->system_bootloader, "barebox") == 0) {
+		res = r_barebox_commit(&ierror);
+	} else if (g_strcmp0(r_context()->config->system_bootloader, "grub") == 0) {
+		res = r_grub_commit(&ierror);
+	} else if (g_strcmp0(r_context()->config->system_bootloader, "uboot") == 0) {
+		res = r_uboot_commit(&ierror);
+	}
+
+	if (!res) {
+		g_propagate_prefixed_error(
+				error,
+				ierror,
+				"%s backend: ", r_context()->config->system_bootloader);
+	}
+
+	return res;
+}
+
+void r_boot_abort(void)
+{
+	g_return_if_fail(r_boot_in_transaction());
+
+	g_atomic_pointer_set(&transaction_thread, NULL);
+
+	if (g_strcmp0(r_context()->config->system_bootloader, "barebox") == 0) {
+		r_barebox_discard();
+	} else if (g_strcmp0(r_context()->config->system_bootloader, "grub") == 0) {
+		r_grub_discard();
+	} else if (g_strcmp0(r_context()->config->system_bootloader, "uboot") == 0) {
+		r_uboot_discard();
+	}
+}
+
+void r_boot_pending_set(GPtrArray *pending, const gchar *pair)
+{
+	const gchar *sep;
+
+	g_return_if_fail(pending);
+	g_return_if_fail(pair);
+
+	sep = strchr(pair, '=');
+	g_return_if_fail(sep);
+
+	/* a later change of the same variable replaces the earlier one */
+	for (guint i = 0; i < pending->len; i++) {
+		const gchar *existing = g_ptr_array_index(pending, i);
+
+		if (strncmp(existing, pair, sep - pair + 1) == 0) {
+			g_ptr_array_remove_index(pending, i);
+			break;
+		}
+	}
+
+	g_ptr_array_add(pending, g_strdup(pair));
+}
+
+const gchar *r_boot_pending_get(const GPtrArray *pending, const gchar *key)
+{
+	gsize key_len;
+
+	g_return_val_if_fail(key, NULL);
+
+	if (!pending)
+		return NULL;
+
+	key_len = strlen(key);
+	for (guint i = 0; i < pending->len; i++) {
+		const gchar *pair = g_ptr_array_index(pending, i);
+
+		if (strncmp(pair, key, key_len) == 0 && pair[key_len] == '=')
+			return pair + key_len + 1;
+	}
+
+	return NULL;
+}
+
 gboolean r_boot_set_state(RaucSlot *slot, gboolean good, GError **error)
 {
 	gboolean res = FALSE;
@@ -155,6 +259,39 @@ gboolean r_boot_set_state(RaucSlot *slot, gboolean good, GError **error)
 	return res;
 }
 
+gboolean r_boot_get_states(GPtrArray *slots, gboolean *good, GError **error)
+{
+	gboolean res = FALSE;
+	GError *ierror = NULL;
+
+	g_return_val_if_fail(slots, FALSE);
+	g_return_val_if_fail(good, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (g_strcmp0(r_context()->config->system_bootloader, "barebox") == 0) {
+		res = r_barebox_get_states(slots, good, &ierror);
+	} else if (g_strcmp0(r_context()->config->system_bootloader, "custom") == 0 &&
+	           r_context()->config->custom_bootloader_persistent) {
+		res = r_custom_get_states(slots, good, &ierror);
+	} else {
+		g_set_error(
+				error,
+				R_BOOTCHOOSER_ERROR,
+				R_BOOTCHOOSER_ERROR_NOT_SUPPORTED,
+				"Obtaining multiple states from bootloader '%s' not supported", r_context()->config->system_bootloader);
+		return FALSE;
+	}
+
+	if (!res) {
+		g_propagate_prefixed_error(
+				error,
+				ierror,
+				"%s backend: ", r_context()->config->system_bootloader);
+	}
+
+	return res;
+}
+
 /* Get slot marked as primary one */
 RaucSlot *r_boot_get_primary(GError **error)
 {
@@ -18,6 +18,9 @@ typedef struct {
 
 #define BOOTSTATE_PREFIX "bootstate"
 
+/* changes collected during a bootchooser transaction */
+static GPtrArray *pending_pairs = NULL;
+
 gchar *r_barebox_get_current_bootname(const gchar *cmdline, GError **error)
 {
 	g_return_val_if_fail(cmdline, NULL);
@@ -28,17 +31,19 @@ gchar *r_barebox_get_current_bootname(const gchar *cmdline, GError **error)
 			cmdline);
 }
 
-static gboolean barebox_state_get(const gchar *bootname, BareboxSlotState *bb_state, GError **error)
+/* Queries the state of multiple slots with a single barebox-state call. */
+static gboolean barebox_state_get_multiple(const gchar *const *bootnames, guint count, BareboxSlotState *bb_states, GError **error)
 {
 	g_autoptr(GSubprocess) sub = NULL;
 	GError *ierror = NULL;
 	GInputStream *instream;
 	g_autoptr(GDataInputStream) datainstream = NULL;
-	guint64 result[2] = {};
-	g_autoptr(GPtrArray) args = g_ptr_array_new_full(6, g_free);
+	g_autofree guint64 *result = NULL;
+	g_autoptr(GPtrArray) args = g_ptr_array_new_full(4 * count + 6, g_free);
 
-	g_return_val_if_fail(bootname, FALSE);
-	g_return_val_if_fail(bb_state, FALSE);
+	g_return_val_if_fail(bootnames, FALSE);
+	g_return_val_if_fail(count > 0, FALSE);
+	g_return_val_if_fail(bb_states, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
 	g_ptr_array_add(args, g_strdup(BAREBOX_STATE_NAME));
@@ -46,10 +51,12 @@ static gboolean barebox_state_get(const gchar *bootname, BareboxSlotState *bb_st
 		g_ptr_array_add(args, g_strdup("-n"));
 		g_ptr_array_add(args, g_strdup(r_context()->config->system_bb_statename));
 	}
-	g_ptr_array_add(args, g_strdup("-g"));
-	g_ptr_array_add(args, g_strdup_printf(BOOTSTATE_PREFIX ".%s.priority", bootname));
-	g_ptr_array_add(args, g_strdup("-g"));
-	g_ptr_array_add(args, g_strdup_printf(BOOTSTATE_PREFIX ".%s.remaining_attempts", bootname));
+	for (guint i = 0; i < count; i++) {
+		g_ptr_array_add(args, g_strdup("-g"));
+		g_ptr_array_add(args, g_strdup_printf(BOOTSTATE_PREFIX ".%s.priority", bootnames[i]));
+		g_ptr_array_add(args, g_strdup("-g"));
+		g_ptr_array_add(args, g_strdup_printf(BOOTSTATE_PREFIX ".%s.remaining_attempts", bootnames[i]));
+	}
 	if (r_context()->config->system_bb_dtbpath) {
 		g_ptr_array_add(args, g_strdup("-i"));
 		g_ptr_array_add(args, g_strdup(r_context()->config->system_bb_dtbpath));
@@ -68,7 +75,9 @@ static gboolean barebox_state_get(const gchar *bootname, BareboxSlotState *bb_st
 	instream = g_subprocess_get_stdout_pipe(sub);
 	datainstream = g_data_input_stream_new(instream);
 
-	for (int i = 0; i < 2; i++) {
+	/* the values are printed in the order of the -g arguments */
+	result = g_new0(guint64, 2 * count);
+	for (guint i = 0; i < 2 * count; i++) {
 		gchar *endptr = NULL;
 		g_autofree gchar *outline = g_data_input_stream_read_line(datainstream, NULL, NULL, &ierror);
 		if (!outline) {
@@ -114,14 +123,70 @@ static gboolean barebox_state_get(const gchar *bootname, BareboxSlotState *bb_st
 		return FALSE;
 	}
 
-	bb_state->prio = result[0];
-	bb_state->attempts = result[1];
+	for (guint i = 0; i < count; i++) {
+		bb_states[i].prio = result[2 * i];
+		bb_states[i].attempts = result[2 * i + 1];
+
+		if (r_boot_in_transaction()) {
+			g_autofree gchar *prio_key = g_strdup_printf(BOOTSTATE_PREFIX ".%s.priority", bootnames[i]);
+			g_autofree gchar *attempts_key = g_strdup_printf(BOOTSTATE_PREFIX ".%s.remaining_attempts", bootnames[i]);
+			const gchar *pending;
+
+			pending = r_boot_pending_get(pending_pairs, prio_key);
+			if (pending)
+				bb_states[i].prio = g_ascii_strtoull(pending, NULL, 10);
+			pending = r_boot_pending_get(pending_pairs, attempts_key);
+			if (pending)
+				bb_states[i].attempts = g_ascii_strtoull(pending, NULL, 10);
+		}
+	}
 
 	return TRUE;
 }
 
+static gboolean barebox_state_get(const gchar *bootname, BareboxSlotState *bb_state, GError **error)
+{
+	g_return_val_if_fail(bootname, FALSE);
+
+	return barebox_state_get_multiple(&bootname, 1, bb_state, error);
+}
+
+/* Returns the slots with a bootname, which are handled by barebox bootchooser. */
+static GPtrArray *get_boot_slots(void)
+{
+	GPtrArray *slots = g_ptr_array_new();
+	GHashTableIter iter;
+	RaucSlot *slot;
+
+	g_hash_table_iter_init(&iter, r_context()->config->slots);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer*) &slot)) {
+		if (slot->bootname)
+			g_ptr_array_add(slots, slot);
+	}
+
+	return slots;
+}
+
+/* Queries the state of the given slots with a single barebox-state call. */
+static BareboxSlotState *barebox_state_get_slots(GPtrArray *slots, GError **error)
+{
+	g_autofree const gchar **bootnames = g_new0(const gchar *, slots->len + 1);
+	g_autofree BareboxSlotState *bb_states = g_new0(BareboxSlotState, slots->len);
+
+	if (slots->len == 0)
+		return g_steal_pointer(&bb_states);
+
+	for (guint i = 0; i < slots->len; i++)
+		bootnames[i] = ((RaucSlot *)slots->pdata[i])->bootname;
+
+	if (!barebox_state_get_multiple(bootnames, slots->len, bb_states, error))
+		return NULL;
+
+	return g_steal_pointer(&bb_states);
+}
+
 /* names: list of gchar, values: list of gint */
-static gboolean barebox_state_set(GPtrArray *pairs, GError **error)
+static gboolean barebox_state_write(GPtrArray *pairs, GError **error)
 {
 	g_autoptr(GSubprocess) sub = NULL;
 	GError *ierror = NULL;
@@ -167,6 +232,39 @@ static gboolean barebox_state_set(GPtrArray *pairs, GError **error)
 	return TRUE;
 }
 
+static gboolean barebox_state_set(GPtrArray *pairs, GError **error)
+{
+	g_return_val_if_fail(pairs, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (!r_boot_in_transaction())
+		return barebox_state_write(pairs, error);
+
+	if (!pending_pairs)
+		pending_pairs = g_ptr_array_new_with_free_func(g_free);
+	for (guint i = 0; i < pairs->len; i++)
+		r_boot_pending_set(pending_pairs, pairs->pdata[i]);
+
+	return TRUE;
+}
+
+gboolean r_barebox_commit(GError **error)
+{
+	g_autoptr(GPtrArray) pairs = g_steal_pointer(&pending_pairs);
+
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (!pairs)
+		return TRUE;
+
+	return barebox_state_write(pairs, error);
+}
+
+void r_barebox_discard(void)
+{
+	g_clear_pointer(&pending_pairs, g_ptr_array_unref);
+}
+
 /* Set slot status values */
 gboolean r_barebox_set_state(RaucSlot *slot, gboolean good, GError **error)
 {
@@ -202,31 +300,26 @@ gboolean r_barebox_set_state(RaucSlot *slot, gboolean good, GError **error)
 /* Get slot marked as primary one */
 RaucSlot *r_barebox_get_primary(GError **error)
 {
-	RaucSlot *slot;
-	GHashTableIter iter;
+	g_autoptr(GPtrArray) slots = get_boot_slots();
+	g_autofree BareboxSlotState *states = NULL;
 	RaucSlot *primary = NULL;
 	guint32 top_prio = 0;
 	GError *ierror = NULL;
 
-	g_hash_table_iter_init(&iter, r_context()->config->slots);
-	while (g_hash_table_iter_next(&iter, NULL, (gpointer*) &slot)) {
-		BareboxSlotState state;
-
-		if (!slot->bootname)
-			continue;
-
-		if (!barebox_state_get(slot->bootname, &state, &ierror)) {
-			g_propagate_error(error, ierror);
-			return NULL;
-		}
+	states = barebox_state_get_slots(slots, &ierror);
+	if (!states) {
+		g_propagate_error(error, ierror);
+		return NULL;
+	}
 
-		if (state.attempts == 0)
+	for (guint i = 0; i < slots->len; i++) {
+		if (states[i].attempts == 0)
 			continue;
 
 		/* We search for the slot with highest priority */
-		if (state.prio > top_prio) {
-			primary = slot;
-			top_prio = state.prio;
+		if (states[i].prio > top_prio) {
+			primary = slots->pdata[i];
+			top_prio = states[i].prio;
 		}
 	}
 
@@ -261,36 +354,55 @@ gboolean r_barebox_get_state(RaucSlot *slot, gboolean *good, GError **error)
 	return TRUE;
 }
 
+gboolean r_barebox_get_states(GPtrArray *slots, gboolean *good, GError **error)
+{
+	g_autofree BareboxSlotState *states = NULL;
+	GError *ierror = NULL;
+
+	g_return_val_if_fail(slots, FALSE);
+	g_return_val_if_fail(good, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	states = barebox_state_get_slots(slots, &ierror);
+	if (!states) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	/* same rules as in r_barebox_get_state() */
+	for (guint i = 0; i < slots->len; i++)
+		good[i] = states[i].prio > 0 && states[i].attempts > 0;
+
+	return TRUE;
+}
+
 /* Set slot as primary boot slot */
 gboolean r_barebox_set_primary(RaucSlot *slot, GError **error)
 {
 	g_autoptr(GPtrArray) pairs = g_ptr_array_new_full(10, g_free);
+	g_autoptr(GPtrArray) slots = get_boot_slots();
+	g_autofree BareboxSlotState *states = NULL;
 	GError *ierror = NULL;
-	g_autoptr(GList) slots = NULL;
 	int attempts;
 
 	g_return_val_if_fail(slot, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
+	states = barebox_state_get_slots(slots, &ierror);
+	if (!states) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
 	/* Iterate over class members */
-	slots = g_hash_table_get_values(r_context()->config->slots);
-	for (GList *l = slots; l != NULL; l = l->next) {
-		RaucSlot *s = l->data;
+	for (guint i = 0; i < slots->len; i++) {
+		RaucSlot *s = slots->pdata[i];
 		int prio;
-		BareboxSlotState bb_state;
-
-		if (!s->bootname)
-			continue;
-
-		if (!barebox_state_get(s->bootname, &bb_state, &ierror)) {
-			g_propagate_error(error, ierror);
-			return FALSE;
-		}
 
 		if (s == slot) {
 			prio = BAREBOX_STATE_PRIORITY_PRIMARY;
 		} else {
-			if (bb_state.prio == 0)
+			if (states[i].prio == 0)
 				prio = 0;
 			else
 				prio = BAREBOX_STATE_DEFAULT_PRIORITY;
@@ -18,3 +18,11 @@ G_GNUC_WARN_UNUSED_RESULT;
 
 gboolean r_barebox_get_state(RaucSlot* slot, gboolean *good, GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
+
+gboolean r_barebox_get_states(GPtrArray *slots, gboolean *good, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+gboolean r_barebox_commit(GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+void r_barebox_discard(void);
@@ -1,8 +1,178 @@
+#include <string.h>
+
 #include "custom.h"
 #include "bootchooser.h"
 #include "context.h"
 #include "utils.h"
 
+/* Co-process used when bootloader-custom-backend-persistent is enabled */
+static struct {
+	GMutex lock;
+	gchar *backend_name;
+	GSubprocess *sub;
+	GDataInputStream *in;
+} helper;
+
+static void custom_helper_stop(void)
+{
+	g_clear_object(&helper.in);
+	if (helper.sub) {
+		g_subprocess_force_exit(helper.sub);
+		g_clear_object(&helper.sub);
+	}
+	g_clear_pointer(&helper.backend_name, g_free);
+}
+
+static gboolean custom_helper_start(const gchar *backend_name, GError **error)
+{
+	GError *ierror = NULL;
+
+	if (helper.sub && g_strcmp0(helper.backend_name, backend_name) == 0)
+		return TRUE;
+
+	custom_helper_stop();
+
+	helper.sub = g_subprocess_new(G_SUBPROCESS_FLAGS_STDIN_PIPE | G_SUBPROCESS_FLAGS_STDOUT_PIPE,
+			&ierror, backend_name, "serve", NULL);
+	if (!helper.sub) {
+		g_propagate_prefixed_error(
+				error,
+				ierror,
+				"Failed to start %s: ", backend_name);
+		return FALSE;
+	}
+
+	helper.in = g_data_input_stream_new(g_subprocess_get_stdout_pipe(helper.sub));
+	g_data_input_stream_set_newline_type(helper.in, G_DATA_STREAM_NEWLINE_TYPE_LF);
+	helper.backend_name = g_strdup(backend_name);
+
+	g_debug("Started persistent custom backend %s", backend_name);
+
+	return TRUE;
+}
+
+/* Sends a batch of requests to the persistent custom backend.
+ *
+ * All requests are written at once, then one response line per request is
+ * read. A response is either 'ok [<value>]' or 'error <message>'.
+ *
+ * @param backend_name path of the custom backend
+ * @param requests request lines (without newline)
+ * @param values return location for the values of all successful responses
+ * @param error Return location for a GError
+ */
+static gboolean custom_helper_run(const gchar *backend_name, GPtrArray *requests, GPtrArray **values, GError **error)
+{
+	g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&helper.lock);
+	g_autoptr(GString) batch = g_string_new(NULL);
+	g_autoptr(GPtrArray) results = g_ptr_array_new_with_free_func(g_free);
+	GError *ierror = NULL;
+	GError *response_error = NULL;
+
+	g_return_val_if_fail(requests, FALSE);
+	g_return_val_if_fail(values && *values == NULL, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	for (guint i = 0; i < requests->len; i++) {
+		const gchar *request = g_ptr_array_index(requests, i);
+
+		if (strchr(request, '\n')) {
+			g_set_error(
+					error,
+					R_BOOTCHOOSER_ERROR,
+					R_BOOTCHOOSER_ERROR_FAILED,
+					"Invalid request for %s: '%s'", backend_name, request);
+			return FALSE;
+		}
+		g_string_append(batch, request);
+		g_string_append_c(batch, '\n');
+	}
+
+	if (!custom_helper_start(backend_name, error))
+		return FALSE;
+
+	if (!g_output_stream_write_all(g_subprocess_get_stdin_pipe(helper.sub), batch->str, batch->len, NULL, NULL, &ierror)) {
+		custom_helper_stop();
+		g_propagate_prefixed_error(
+				error,
+				ierror,
+				"Failed to send request to %s: ", backend_name);
+		return FALSE;
+	}
+
+	for (guint i = 0; i < requests->len; i++) {
+		g_autofree gchar *line = g_data_input_stream_read_line(helper.in, NULL, NULL, &ierror);
+
+		if (!line) {
+			custom_helper_stop();
+			if (ierror) {
+				g_propagate_prefixed_error(
+						error,
+						ierror,
+						"Failed to read response from %s: ", backend_name);
+			} else {
+				g_set_error(
+						error,
+						G_SPAWN_ERROR,
+						G_SPAWN_ERROR_FAILED,
+						"%s exited unexpectedly", backend_name);
+			}
+			g_clear_error(&response_error);
+			return FALSE;
+		}
+
+		if (g_strcmp0(line, "ok") == 0) {
+			g_ptr_array_add(results, g_strdup(""));
+		} else if (g_str_has_prefix(line, "ok ")) {
+			g_ptr_array_add(results, g_strstrip(g_strdup(line + 3)));
+		} else if (g_str_has_prefix(line, "error")) {
+			/* keep reading to stay in sync with the remaining responses */
+			if (!response_error)
+				response_error = g_error_new(
+						R_BOOTCHOOSER_ERROR,
+						R_BOOTCHOOSER_ERROR_FAILED,
+						"%s failed for '%s': %s", backend_name,
+						(const gchar *)g_ptr_array_index(requests, i),
+						g_strstrip(line + strlen("error")));
+			g_ptr_array_add(results, g_strdup(""));
+		} else {
+			custom_helper_stop();
+			g_set_error(
+					error,
+					R_BOOTCHOOSER_ERROR,
+					R_BOOTCHOOSER_ERROR_PARSE_FAILED,
+					"Invalid response from %s: '%s'", backend_name, line);
+			g_clear_error(&response_error);
+			return FALSE;
+		}
+	}
+
+	if (response_error) {
+		g_propagate_error(error, response_error);
+		return FALSE;
+	}
+
+	*values = g_steal_pointer(&results);
+
+	return TRUE;
+}
+
+/* Runs a single request on the persistent custom backend */
+static gboolean custom_helper_request(const gchar *backend_name, const gchar *cmd, const gchar *bootname, const gchar *arg, gchar **ret_str, GError **error)
+{
+	g_autoptr(GPtrArray) requests = g_ptr_array_new_with_free_func(g_free);
+	g_autoptr(GPtrArray) values = NULL;
+
+	g_ptr_array_add(requests, g_strjoin(" ", cmd, bootname, arg, NULL));
+	if (!custom_helper_run(backend_name, requests, &values, error))
+		return FALSE;
+
+	if (ret_str)
+		*ret_str = g_strdup(g_ptr_array_index(values, 0));
+
+	return TRUE;
+}
+
 /* Wrapper for get commands accessing custom script
  *
  * @param cmd What to input as command to the custom backend. Mandatory.
@@ -25,6 +195,9 @@ static gboolean custom_backend_get(const gchar *cmd, const gchar *bootname, gcha
 	g_return_val_if_fail(ret_str && *ret_str == NULL, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
+	if (r_context()->config->custom_bootloader_persistent)
+		return custom_helper_request(backend_name, cmd, bootname, NULL, ret_str, error);
+
 	if (bootname)
 		sub = g_subprocess_new(G_SUBPROCESS_FLAGS_STDOUT_PIPE, &ierror, backend_name, cmd, bootname, NULL);
 	else
@@ -93,6 +266,9 @@ static gboolean custom_backend_set(const gchar *cmd, const gchar *bootname, cons
 	g_return_val_if_fail(bootname, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
+	if (r_context()->config->custom_bootloader_persistent)
+		return custom_helper_request(backend_name, cmd, bootname, arg, NULL, error);
+
 	if (arg)
 		sub = g_subprocess_new(G_SUBPROCESS_FLAGS_NONE, &ierror, backend_name, cmd, bootname, arg, NULL);
 	else
@@ -129,6 +305,14 @@ gchar *r_custom_get_current_bootname(RaucConfig *config, GError **error)
 	GInputStream *instream;
 	int res;
 
+	if (config->custom_bootloader_persistent) {
+		if (!custom_helper_request(config->custom_bootloader_backend, "get-current", NULL, NULL, &outline, &ierror)) {
+			g_propagate_error(error, ierror);
+			return NULL;
+		}
+		goto out;
+	}
+
 	args_array = g_ptr_array_new();
 	g_ptr_array_add(args_array, config->custom_bootloader_backend);
 	g_ptr_array_add(args_array, (gchar *)("get-current"));
@@ -166,6 +350,8 @@ gchar *r_custom_get_current_bootname(RaucConfig *config, GError **error)
 				config->custom_bootloader_backend);
 		return NULL;
 	}
+
+out:
 	if (!outline || *outline == 0) {
 		g_set_error(
 				error,
@@ -229,6 +415,63 @@ RaucSlot *r_custom_get_primary(GError **error)
 	return primary;
 }
 
+static gboolean custom_parse_state(const gchar *str, gboolean *good, GError **error)
+{
+	if (g_strcmp0(str, "good") == 0) {
+		*good = TRUE;
+	} else if (g_strcmp0(str, "bad") == 0) {
+		*good = FALSE;
+	} else {
+		g_set_error(
+				error,
+				R_BOOTCHOOSER_ERROR,
+				R_BOOTCHOOSER_ERROR_FAILED,
+				"Obtained string does not match \"good\" or \"bad\": '%s'", str);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Get state of multiple slots with one batch of requests */
+gboolean r_custom_get_states(GPtrArray *slots, gboolean *good, GError **error)
+{
+	g_autoptr(GPtrArray) requests = g_ptr_array_new_with_free_func(g_free);
+	g_autoptr(GPtrArray) values = NULL;
+	GError *ierror = NULL;
+
+	g_return_val_if_fail(slots, FALSE);
+	g_return_val_if_fail(good, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (!r_context()->config->custom_bootloader_persistent) {
+		g_set_error(
+				error,
+				R_BOOTCHOOSER_ERROR,
+				R_BOOTCHOOSER_ERROR_NOT_SUPPORTED,
+				"Obtaining multiple states requires a persistent custom backend");
+		return FALSE;
+	}
+
+	for (guint i = 0; i < slots->len; i++) {
+		RaucSlot *slot = g_ptr_array_index(slots, i);
+
+		g_ptr_array_add(requests, g_strjoin(" ", "get-state", slot->bootname, NULL));
+	}
+
+	if (!custom_helper_run(r_context()->config->custom_bootloader_backend, requests, &values, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	for (guint i = 0; i < slots->len; i++) {
+		if (!custom_parse_state(g_ptr_array_index(values, i), &good[i], error))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
 /* Get state of given slot */
 gboolean r_custom_get_state(RaucSlot *slot, gboolean *good, GError **error)
 {
@@ -243,20 +486,7 @@ gboolean r_custom_get_state(RaucSlot *slot, gboolean *good, GError **error)
 		return FALSE;
 	}
 
-	if (g_strcmp0(ret_str, "good") == 0) {
-		*good = TRUE;
-	} else if (g_strcmp0(ret_str, "bad") == 0) {
-		*good = FALSE;
-	} else {
-		g_set_error(
-				error,
-				R_BOOTCHOOSER_ERROR,
-				R_BOOTCHOOSER_ERROR_FAILED,
-				"Obtained string does not match \"good\" or \"bad\": '%s'", ret_str);
-		return FALSE;
-	}
-
-	return TRUE;
+	return custom_parse_state(ret_str, good, error);
 }
 
 /* Set slot as primary boot slot */
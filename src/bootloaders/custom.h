@@ -19,3 +19,6 @@ G_GNUC_WARN_UNUSED_RESULT;
 
 gboolean r_custom_get_state(RaucSlot* slot, gboolean *good, GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
+
+gboolean r_custom_get_states(GPtrArray *slots, gboolean *good, GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
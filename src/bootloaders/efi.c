@@ -1,3 +1,11 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+
 #include "efi.h"
 #include "bootchooser.h"
 #include "context.h"
@@ -5,6 +13,12 @@
 
 #define EFIBOOTMGR_NAME "efibootmgr"
 
+/* vendor GUID of the Boot#### and Boot* variables */
+#define EFI_GLOBAL_GUID "8be4df61-93ca-11d2-aa0d-00e098032b8c"
+/* NON_VOLATILE | BOOTSERVICE_ACCESS | RUNTIME_ACCESS */
+#define EFI_VARIABLE_DEFAULT_ATTRIBUTES 0x7
+#define EFI_LOAD_OPTION_ACTIVE 0x1
+
 typedef struct {
 	gchar *num;
 	gchar *name;
@@ -23,6 +37,136 @@ static void efi_bootentry_free(efi_bootentry *entry)
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC(efi_bootentry, efi_bootentry_free);
 
+/* Reads an EFI global variable from efivarfs, where each file starts with the
+ * 32 bit attributes, followed by the variable data. */
+static GBytes *efivar_read(const gchar *efivarfs, const gchar *name, guint32 *attributes, GError **error)
+{
+	g_autofree gchar *path = g_strdup_printf("%s/%s-" EFI_GLOBAL_GUID, efivarfs, name);
+	g_autofree gchar *contents = NULL;
+	gsize length = 0;
+	guint32 attr;
+
+	if (!g_file_get_contents(path, &contents, &length, error))
+		return NULL;
+
+	if (length < sizeof(attr)) {
+		g_set_error(error,
+				R_BOOTCHOOSER_ERROR,
+				R_BOOTCHOOSER_ERROR_PARSE_FAILED,
+				"EFI variable %s is too short", name);
+		return NULL;
+	}
+
+	memcpy(&attr, contents, sizeof(attr));
+	if (attributes)
+		*attributes = GUINT32_FROM_LE(attr);
+
+	return g_bytes_new(contents + sizeof(attr), length - sizeof(attr));
+}
+
+/* Writes an EFI global variable via efivarfs, keeping the attributes of an
+ * existing variable. The kernel marks most variables as immutable, so this
+ * flag is cleared during the write. */
+static gboolean efivar_write(const gchar *efivarfs, const gchar *name, const guint8 *data, gsize len, GError **error)
+{
+	g_autofree gchar *path = g_strdup_printf("%s/%s-" EFI_GLOBAL_GUID, efivarfs, name);
+	g_autoptr(GBytes) existing = NULL;
+	g_autofree guint8 *buf = NULL;
+	g_auto(filedesc) ro_fd = -1;
+	g_auto(filedesc) fd = -1;
+	guint32 attributes = EFI_VARIABLE_DEFAULT_ATTRIBUTES;
+	int flags = 0;
+	gboolean restore_flags = FALSE;
+	gboolean res = FALSE;
+	GError *ierror = NULL;
+	struct stat st;
+	ssize_t ret;
+
+	existing = efivar_read(efivarfs, name, &attributes, &ierror);
+	if (!existing) {
+		if (!g_error_matches(ierror, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
+		g_clear_error(&ierror);
+		attributes = EFI_VARIABLE_DEFAULT_ATTRIBUTES;
+	} else {
+		ro_fd = g_open(path, O_RDONLY | O_CLOEXEC, 0);
+		if (ro_fd >= 0 && ioctl(ro_fd, FS_IOC_GETFLAGS, &flags) == 0 && (flags & FS_IMMUTABLE_FL)) {
+			int mutable_flags = flags & ~FS_IMMUTABLE_FL;
+
+			if (ioctl(ro_fd, FS_IOC_SETFLAGS, &mutable_flags) < 0) {
+				int err = errno;
+				g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+						"Failed to make EFI variable %s writable: %s", name, g_strerror(err));
+				return FALSE;
+			}
+			restore_flags = TRUE;
+		}
+	}
+
+	/* efivarfs requires the attributes and data in a single write */
+	buf = g_malloc(sizeof(attributes) + len);
+	attributes = GUINT32_TO_LE(attributes);
+	memcpy(buf, &attributes, sizeof(attributes));
+	memcpy(buf + sizeof(attributes), data, len);
+
+	fd = g_open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to open EFI variable %s: %s", name, g_strerror(err));
+		goto out;
+	}
+
+	ret = TEMP_FAILURE_RETRY(write(fd, buf, sizeof(attributes) + len));
+	if (ret < 0 || (gsize)ret != sizeof(attributes) + len) {
+		int err = ret < 0 ? errno : EIO;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to write EFI variable %s: %s", name, g_strerror(err));
+		goto out;
+	}
+
+	/* efivarfs replaces the variable, but a plain file might be longer */
+	if (fstat(fd, &st) == 0 && st.st_size > ret && ftruncate(fd, ret) < 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to truncate EFI variable %s: %s", name, g_strerror(err));
+		goto out;
+	}
+
+	res = TRUE;
+
+out:
+	if (restore_flags)
+		ioctl(ro_fd, FS_IOC_SETFLAGS, &flags);
+
+	return res;
+}
+
+/* Reads a 16 bit boot number variable (BootNext, BootCurrent) as string. */
+static gchar *efivar_read_bootnum(const gchar *efivarfs, const gchar *name, GError **error)
+{
+	g_autoptr(GBytes) value = NULL;
+	const guint8 *data;
+	gsize len;
+
+	value = efivar_read(efivarfs, name, NULL, error);
+	if (!value)
+		return NULL;
+
+	data = g_bytes_get_data(value, &len);
+	if (len != 2) {
+		g_set_error(error,
+				R_BOOTCHOOSER_ERROR,
+				R_BOOTCHOOSER_ERROR_PARSE_FAILED,
+				"EFI variable %s has invalid size %"G_GSIZE_FORMAT, name, len);
+		return NULL;
+	}
+
+	return g_strdup_printf("%04X", data[0] | (data[1] << 8));
+}
+
 static gboolean efi_bootorder_set(gchar *order, GError **error)
 {
 	g_autoptr(GSubprocess) sub = NULL;
@@ -31,6 +175,18 @@ static gboolean efi_bootorder_set(gchar *order, GError **error)
 	g_return_val_if_fail(order, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
+	if (r_context()->config->efivarfs_path) {
+		g_auto(GStrv) nums = g_strsplit(order, ",", -1);
+		g_autoptr(GByteArray) data = g_byte_array_new();
+
+		for (gchar **num = nums; *num && **num; num++) {
+			guint16 value = GUINT16_TO_LE(g_ascii_strtoull(*num, NULL, 16));
+			g_byte_array_append(data, (const guint8 *)&value, sizeof(value));
+		}
+
+		return efivar_write(r_context()->config->efivarfs_path, "BootOrder", data->data, data->len, error);
+	}
+
 	sub = r_subprocess_new(G_SUBPROCESS_FLAGS_NONE, &ierror, EFIBOOTMGR_NAME,
 			"--bootorder", order, NULL);
 
@@ -61,6 +217,12 @@ static gboolean efi_set_bootnext(gchar *bootnumber, GError **error)
 	g_return_val_if_fail(bootnumber, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
+	if (r_context()->config->efivarfs_path) {
+		guint16 value = GUINT16_TO_LE(g_ascii_strtoull(bootnumber, NULL, 16));
+
+		return efivar_write(r_context()->config->efivarfs_path, "BootNext", (const guint8 *)&value, sizeof(value), error);
+	}
+
 	sub = r_subprocess_new(G_SUBPROCESS_FLAGS_NONE, &ierror, EFIBOOTMGR_NAME,
 			"--bootnext", bootnumber, NULL);
 
@@ -101,6 +263,154 @@ static efi_bootentry *get_efi_entry_by_bootnum(GList *entries, const gchar *boot
 	return found_entry;
 }
 
+/* Parses the description from an EFI_LOAD_OPTION, which starts with 32 bit
+ * attributes and the 16 bit length of the device path, followed by a
+ * NUL-terminated UCS-2 string. */
+static efi_bootentry *efi_bootentry_parse(const gchar *num, GBytes *value, GError **error)
+{
+	g_autoptr(efi_bootentry) entry = g_new0(efi_bootentry, 1);
+	g_autofree gunichar2 *description = NULL;
+	const guint8 *data;
+	gsize len, chars = 0;
+	guint32 attributes;
+
+	data = g_bytes_get_data(value, &len);
+	if (len < 6) {
+		g_set_error(error,
+				R_BOOTCHOOSER_ERROR,
+				R_BOOTCHOOSER_ERROR_PARSE_FAILED,
+				"EFI boot entry %s is too short", num);
+		return NULL;
+	}
+
+	memcpy(&attributes, data, sizeof(attributes));
+	data += 6;
+	len -= 6;
+
+	/* copy to ensure alignment */
+	description = g_new0(gunichar2, len / 2 + 1);
+	for (; chars < len / 2; chars++) {
+		description[chars] = data[2 * chars] | (data[2 * chars + 1] << 8);
+		if (description[chars] == 0)
+			break;
+	}
+
+	entry->name = g_utf16_to_utf8(description, chars, NULL, NULL, NULL);
+	if (!entry->name) {
+		g_set_error(error,
+				R_BOOTCHOOSER_ERROR,
+				R_BOOTCHOOSER_ERROR_PARSE_FAILED,
+				"EFI boot entry %s has an invalid description", num);
+		return NULL;
+	}
+	entry->num = g_strdup(num);
+	entry->active = (GUINT32_FROM_LE(attributes) & EFI_LOAD_OPTION_ACTIVE) != 0;
+
+	return g_steal_pointer(&entry);
+}
+
+static gint efi_bootentry_compare(gconstpointer a, gconstpointer b)
+{
+	return g_strcmp0(((const efi_bootentry *)a)->num, ((const efi_bootentry *)b)->num);
+}
+
+/* Same as efi_bootorder_get(), but reads the variables directly from efivarfs
+ * instead of parsing the output of efibootmgr. */
+static gboolean efivarfs_bootorder_get(const gchar *efivarfs, GList **bootorder_entries, GList **all_entries, efi_bootentry **bootnext, efi_bootentry **bootcurrent, GError **error)
+{
+	g_autoptr(GDir) dir = NULL;
+	g_autolist(efi_bootentry) entries = NULL;
+	g_autoptr(GList) returnorder = NULL;
+	g_autoptr(GBytes) order = NULL;
+	const gchar *filename;
+	const guint8 *data;
+	gsize len;
+	GError *ierror = NULL;
+
+	dir = g_dir_open(efivarfs, 0, &ierror);
+	if (!dir) {
+		g_propagate_prefixed_error(error, ierror, "Failed to open efivarfs: ");
+		return FALSE;
+	}
+
+	/* Obtain mapping of efi boot numbers to bootnames */
+	while ((filename = g_dir_read_name(dir))) {
+		g_autofree gchar *num = NULL;
+		g_autofree gchar *name = NULL;
+		g_autoptr(GBytes) value = NULL;
+		efi_bootentry *entry;
+
+		if (strlen(filename) != strlen("Boot0000-" EFI_GLOBAL_GUID) ||
+		    !g_str_has_prefix(filename, "Boot") ||
+		    !g_str_has_suffix(filename, "-" EFI_GLOBAL_GUID))
+			continue;
+
+		num = g_strndup(filename + 4, 4);
+		if (!g_ascii_isxdigit(num[0]) || !g_ascii_isxdigit(num[1]) ||
+		    !g_ascii_isxdigit(num[2]) || !g_ascii_isxdigit(num[3]))
+			continue;
+
+		name = g_strndup(filename, 8);
+		value = efivar_read(efivarfs, name, NULL, &ierror);
+		if (!value) {
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
+
+		entry = efi_bootentry_parse(num, value, &ierror);
+		if (!entry) {
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
+
+		entries = g_list_prepend(entries, entry);
+		g_debug("Detected EFI boot entry %s: %s", entry->num, entry->name);
+	}
+	if (!entries) {
+		g_set_error(
+				error,
+				R_BOOTCHOOSER_ERROR,
+				R_BOOTCHOOSER_ERROR_FAILED,
+				"No EFI boot entries found");
+		return FALSE;
+	}
+	entries = g_list_sort(entries, efi_bootentry_compare);
+
+	/* Obtain bootnext */
+	if (bootnext) {
+		g_autofree gchar *num = efivar_read_bootnum(efivarfs, "BootNext", NULL);
+		if (num)
+			*bootnext = get_efi_entry_by_bootnum(entries, num);
+	}
+
+	/* Obtain bootorder */
+	order = efivar_read(efivarfs, "BootOrder", NULL, &ierror);
+	if (!order) {
+		g_propagate_prefixed_error(error, ierror, "unable to obtain boot order: ");
+		return FALSE;
+	}
+	data = g_bytes_get_data(order, &len);
+	for (gsize i = 0; i + 1 < len; i += 2) {
+		g_autofree gchar *num = g_strdup_printf("%04X", data[i] | (data[i + 1] << 8));
+		efi_bootentry *bentry = get_efi_entry_by_bootnum(entries, num);
+		if (bentry)
+			returnorder = g_list_append(returnorder, bentry);
+	}
+
+	/* Obtain boot current */
+	if (bootcurrent) {
+		g_autofree gchar *num = efivar_read_bootnum(efivarfs, "BootCurrent", NULL);
+		if (num)
+			*bootcurrent = get_efi_entry_by_bootnum(entries, num);
+	}
+
+	if (bootorder_entries)
+		*bootorder_entries = g_steal_pointer(&returnorder);
+	*all_entries = g_steal_pointer(&entries);
+
+	return TRUE;
+}
+
 /* Parses output of efibootmgr and returns information obtained.
  *
  * Note that this function can return two lists, pointing to the same elements.
@@ -115,7 +425,7 @@ static efi_bootentry *get_efi_entry_by_bootnum(GList *entries, const gchar *boot
  *        'BootNext' (if any)
  * @param error Return location for a GError
  */
-static gboolean efi_bootorder_get(GList **bootorder_entries, GList **all_entries, efi_bootentry **bootnext, efi_bootentry **bootcurrent, GError **error)
+static gboolean efi_bootorder_get(const gchar *efivarfs, GList **bootorder_entries, GList **all_entries, efi_bootentry **bootnext, efi_bootentry **bootcurrent, GError **error)
 {
 	g_autoptr(GSubprocess) sub = NULL;
 	GError *ierror = NULL;
@@ -136,6 +446,9 @@ static gboolean efi_bootorder_get(GList **bootorder_entries, GList **all_entries
 	g_return_val_if_fail(bootcurrent == NULL || *bootcurrent == NULL, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
+	if (efivarfs)
+		return efivarfs_bootorder_get(efivarfs, bootorder_entries, all_entries, bootnext, bootcurrent, error);
+
 	sub = r_subprocess_new(G_SUBPROCESS_FLAGS_STDOUT_PIPE, &ierror,
 			EFIBOOTMGR_NAME, NULL);
 	if (!sub) {
@@ -276,7 +589,7 @@ static gboolean efi_set_temp_primary(RaucSlot *slot, GError **error)
 	GError *ierror = NULL;
 	efi_bootentry *efi_slot_entry = NULL;
 
-	if (!efi_bootorder_get(NULL, &entries, NULL, NULL, &ierror)) {
+	if (!efi_bootorder_get(r_context()->config->efivarfs_path, NULL, &entries, NULL, NULL, &ierror)) {
 		g_propagate_error(error, ierror);
 		return FALSE;
 	}
@@ -321,7 +634,7 @@ static gboolean efi_modify_persistent_bootorder(RaucSlot *slot, gboolean prepend
 	g_return_val_if_fail(slot, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
-	if (!efi_bootorder_get(&entries, &all_entries, NULL, NULL, &ierror)) {
+	if (!efi_bootorder_get(r_context()->config->efivarfs_path, &entries, &all_entries, NULL, NULL, &ierror)) {
 		g_propagate_error(error, ierror);
 		return FALSE;
 	}
@@ -367,7 +680,7 @@ static gboolean efi_modify_persistent_bootorder(RaucSlot *slot, gboolean prepend
 
 	order = g_strjoinv(",", (gchar**)bootorder->pdata);
 
-	if (!efi_bootorder_set(order, NULL)) {
+	if (!efi_bootorder_set(order, &ierror)) {
 		g_propagate_prefixed_error(error, ierror, "Modifying bootorder failed: ");
 		return FALSE;
 	}
@@ -402,7 +715,7 @@ RaucSlot *r_efi_get_primary(GError **error)
 
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
-	if (!efi_bootorder_get(&bootorder_entries, &all_entries, &bootnext, NULL, &ierror)) {
+	if (!efi_bootorder_get(r_context()->config->efivarfs_path, &bootorder_entries, &all_entries, &bootnext, NULL, &ierror)) {
 		g_propagate_error(error, ierror);
 		return NULL;
 	}
@@ -478,7 +791,7 @@ gboolean r_efi_get_state(RaucSlot *slot, gboolean *good, GError **error)
 	g_return_val_if_fail(good, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
-	if (!efi_bootorder_get(&bootorder_entries, &all_entries, NULL, NULL, &ierror)) {
+	if (!efi_bootorder_get(r_context()->config->efivarfs_path, &bootorder_entries, &all_entries, NULL, NULL, &ierror)) {
 		g_propagate_error(error, ierror);
 		return FALSE;
 	}
@@ -505,11 +818,19 @@ gchar *r_efi_get_current_bootname(RaucConfig *config, GError **error)
 	RaucSlot *slot = NULL;
 	GHashTableIter iter;
 
-	if (!efi_bootorder_get(NULL, &all_entries, NULL, &bootcurrent, &ierror)) {
+	if (!efi_bootorder_get(config->efivarfs_path, NULL, &all_entries, NULL, &bootcurrent, &ierror)) {
 		g_propagate_error(error, ierror);
 		return NULL;
 	}
 
+	if (!bootcurrent) {
+		g_set_error(error,
+				R_BOOTCHOOSER_ERROR,
+				R_BOOTCHOOSER_ERROR_FAILED,
+				"Unable to obtain current EFI bootentry");
+		return NULL;
+	}
+
 	g_hash_table_iter_init(&iter, config->slots);
 	while (g_hash_table_iter_next(&iter, NULL, (gpointer*) &slot)) {
 		if (g_strcmp0(slot->bootname, bootcurrent->name) == 0) {
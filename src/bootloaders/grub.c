@@ -5,6 +5,9 @@
 
 #define GRUB_EDITENV "grub-editenv"
 
+/* changes collected during a bootchooser transaction */
+static GPtrArray *pending_pairs = NULL;
+
 static gboolean grub_env_get(const gchar *key, GString **value, GError **error)
 {
 	g_autoptr(GPtrArray) sub_args = NULL;
@@ -20,6 +23,14 @@ static gboolean grub_env_get(const gchar *key, GString **value, GError **error)
 	g_return_val_if_fail(value && *value == NULL, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
+	if (r_boot_in_transaction()) {
+		const gchar *pending = r_boot_pending_get(pending_pairs, key);
+		if (pending) {
+			*value = g_string_new(pending);
+			return TRUE;
+		}
+	}
+
 	sub_args = g_ptr_array_new_full(4, g_free);
 	g_ptr_array_add(sub_args, g_strdup(GRUB_EDITENV));
 	if (r_context()->config->grubenv_path) {
@@ -91,7 +102,7 @@ static gboolean grub_env_get(const gchar *key, GString **value, GError **error)
 	return FALSE;
 }
 
-static gboolean grub_env_set(GPtrArray *pairs, GError **error)
+static gboolean grub_env_write(GPtrArray *pairs, GError **error)
 {
 	g_autoptr(GSubprocess) sub = NULL;
 	GError *ierror = NULL;
@@ -134,6 +145,39 @@ out:
 	return res;
 }
 
+static gboolean grub_env_set(GPtrArray *pairs, GError **error)
+{
+	g_return_val_if_fail(pairs, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (!r_boot_in_transaction())
+		return grub_env_write(pairs, error);
+
+	if (!pending_pairs)
+		pending_pairs = g_ptr_array_new_with_free_func(g_free);
+	for (guint i = 0; i < pairs->len; i++)
+		r_boot_pending_set(pending_pairs, pairs->pdata[i]);
+
+	return TRUE;
+}
+
+gboolean r_grub_commit(GError **error)
+{
+	g_autoptr(GPtrArray) pairs = g_steal_pointer(&pending_pairs);
+
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (!pairs)
+		return TRUE;
+
+	return grub_env_write(pairs, error);
+}
+
+void r_grub_discard(void)
+{
+	g_clear_pointer(&pending_pairs, g_ptr_array_unref);
+}
+
 /* We assume bootstate to be good if slot is listed in 'ORDER', its
  * _TRY=0 and _OK=1 */
 gboolean r_grub_get_state(RaucSlot *slot, gboolean *good, GError **error)
@@ -15,3 +15,8 @@ G_GNUC_WARN_UNUSED_RESULT;
 
 gboolean r_grub_get_state(RaucSlot* slot, gboolean *good, GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
+
+gboolean r_grub_commit(GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+void r_grub_discard(void);
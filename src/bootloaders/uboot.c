@@ -1,6 +1,7 @@
 #include "uboot.h"
 #include "bootchooser.h"
 #include "context.h"
+#include "uboot_env.h"
 #include "utils.h"
 
 #define UBOOT_FWSETENV_NAME "fw_setenv"
@@ -8,7 +9,70 @@
 #define UBOOT_DEFAULT_ATTEMPTS  3
 #define UBOOT_ATTEMPTS_PRIMARY  3
 
-static gboolean uboot_env_get(const gchar *key, GString **value, GError **error)
+/* environment kept open during a bootchooser transaction */
+static RUbootEnv *transaction_env = NULL;
+
+/* Frees the environment unless it belongs to the transaction. */
+static void uboot_env_release(RUbootEnv *env)
+{
+	if (env && env != transaction_env)
+		r_uboot_env_free(env);
+}
+typedef RUbootEnv UbootEnvRef;
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(UbootEnvRef, uboot_env_release);
+
+/* Reads the environment once if native access is configured. Otherwise, env
+ * is set to NULL and each access runs fw_printenv/fw_setenv. */
+static gboolean uboot_env_open(RUbootEnv **env, GError **error)
+{
+	g_return_val_if_fail(env && *env == NULL, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (!r_context()->config->uboot_env_config)
+		return TRUE;
+
+	if (r_boot_in_transaction()) {
+		if (!transaction_env) {
+			transaction_env = r_uboot_env_open(r_context()->config->uboot_env_config, error);
+			if (!transaction_env)
+				return FALSE;
+		}
+		*env = transaction_env;
+		return TRUE;
+	}
+
+	*env = r_uboot_env_open(r_context()->config->uboot_env_config, error);
+
+	return *env != NULL;
+}
+
+/* Changes to the transaction environment are written by r_uboot_commit(). */
+static gboolean uboot_env_commit(RUbootEnv *env, GError **error)
+{
+	if (!env || env == transaction_env)
+		return TRUE;
+
+	return r_uboot_env_commit(env, error);
+}
+
+gboolean r_uboot_commit(GError **error)
+{
+	g_autoptr(RUbootEnv) env = g_steal_pointer(&transaction_env);
+
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (!env)
+		return TRUE;
+
+	return r_uboot_env_commit(env, error);
+}
+
+void r_uboot_discard(void)
+{
+	g_clear_pointer(&transaction_env, r_uboot_env_free);
+}
+
+static gboolean uboot_env_get(RUbootEnv *env, const gchar *key, GString **value, GError **error)
 {
 	g_autoptr(GSubprocess) sub = NULL;
 	GError *ierror = NULL;
@@ -22,6 +86,14 @@ static gboolean uboot_env_get(const gchar *key, GString **value, GError **error)
 	g_return_val_if_fail(value && *value == NULL, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
+	if (env) {
+		const gchar *native_value = r_uboot_env_get(env, key, error);
+		if (!native_value)
+			return FALSE;
+		*value = g_string_new(native_value);
+		return TRUE;
+	}
+
 	sub = r_subprocess_new(G_SUBPROCESS_FLAGS_STDOUT_PIPE, &ierror,
 			UBOOT_FWPRINTENV_NAME, key, NULL);
 	if (!sub) {
@@ -68,7 +140,8 @@ static gboolean uboot_env_get(const gchar *key, GString **value, GError **error)
 	return TRUE;
 }
 
-static gboolean uboot_env_set(const gchar *key, const gchar *value, GError **error)
+/* With native access, the change is only written by uboot_env_commit(). */
+static gboolean uboot_env_set(RUbootEnv *env, const gchar *key, const gchar *value, GError **error)
 {
 	g_autoptr(GSubprocess) sub = NULL;
 	GError *ierror = NULL;
@@ -77,6 +150,11 @@ static gboolean uboot_env_set(const gchar *key, const gchar *value, GError **err
 	g_return_val_if_fail(value, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
+	if (env) {
+		r_uboot_env_set(env, key, value);
+		return TRUE;
+	}
+
 	sub = r_subprocess_new(G_SUBPROCESS_FLAGS_NONE, &ierror, UBOOT_FWSETENV_NAME,
 			key, value, NULL);
 	if (!sub) {
@@ -106,6 +184,7 @@ gboolean r_uboot_get_state(RaucSlot *slot, gboolean *good, GError **error)
 	g_autoptr(GString) attempts = NULL;
 	g_auto(GStrv) bootnames = NULL;
 	g_autofree gchar *key = NULL;
+	g_autoptr(UbootEnvRef) env = NULL;
 	GError *ierror = NULL;
 	gboolean found = FALSE;
 
@@ -113,7 +192,12 @@ gboolean r_uboot_get_state(RaucSlot *slot, gboolean *good, GError **error)
 	g_return_val_if_fail(good, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
-	if (!uboot_env_get("BOOT_ORDER", &order, &ierror)) {
+	if (!uboot_env_open(&env, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	if (!uboot_env_get(env, "BOOT_ORDER", &order, &ierror)) {
 		g_propagate_error(error, ierror);
 		return FALSE;
 	}
@@ -133,7 +217,7 @@ gboolean r_uboot_get_state(RaucSlot *slot, gboolean *good, GError **error)
 
 	/* Check remaining attempts */
 	key = g_strdup_printf("BOOT_%s_LEFT", slot->bootname);
-	if (!uboot_env_get(key, &attempts, &ierror)) {
+	if (!uboot_env_get(env, key, &attempts, &ierror)) {
 		g_propagate_error(error, ierror);
 		return FALSE;
 	}
@@ -146,6 +230,7 @@ gboolean r_uboot_get_state(RaucSlot *slot, gboolean *good, GError **error)
 gboolean r_uboot_set_state(RaucSlot *slot, gboolean good, GError **error)
 {
 	GError *ierror = NULL;
+	g_autoptr(UbootEnvRef) env = NULL;
 	g_autofree gchar *key = NULL;
 	g_autofree gchar *val = NULL;
 	gint attempts = 0;
@@ -153,13 +238,18 @@ gboolean r_uboot_set_state(RaucSlot *slot, gboolean good, GError **error)
 	g_return_val_if_fail(slot, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
+	if (!uboot_env_open(&env, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
 	if (!good) {
 		g_autoptr(GString) order_current = NULL;
 		g_autoptr(GPtrArray) order_new = NULL;
 		g_auto(GStrv) bootnames = NULL;
 		g_autofree gchar *order = NULL;
 
-		if (!uboot_env_get("BOOT_ORDER", &order_current, &ierror)) {
+		if (!uboot_env_get(env, "BOOT_ORDER", &order_current, &ierror)) {
 			g_message("Unable to obtain BOOT_ORDER: %s", ierror->message);
 			g_clear_error(&ierror);
 			goto set_left;
@@ -182,7 +272,7 @@ gboolean r_uboot_set_state(RaucSlot *slot, gboolean good, GError **error)
 		g_ptr_array_add(order_new, NULL);
 
 		order = g_strjoinv(" ", (gchar**) order_new->pdata);
-		if (!uboot_env_set("BOOT_ORDER", order, &ierror)) {
+		if (!uboot_env_set(env, "BOOT_ORDER", order, &ierror)) {
 			g_propagate_error(error, ierror);
 			return FALSE;
 		}
@@ -200,7 +290,12 @@ set_left:
 
 	val = g_strdup_printf("%x", attempts);
 
-	if (!uboot_env_set(key, val, &ierror)) {
+	if (!uboot_env_set(env, key, val, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	if (!uboot_env_commit(env, &ierror)) {
 		g_propagate_error(error, ierror);
 		return FALSE;
 	}
@@ -213,6 +308,7 @@ RaucSlot *r_uboot_get_primary(GError **error)
 {
 	g_autoptr(GString) order = NULL;
 	g_auto(GStrv) bootnames = NULL;
+	g_autoptr(UbootEnvRef) env = NULL;
 	GError *ierror = NULL;
 	RaucSlot *primary = NULL;
 	RaucSlot *slot;
@@ -220,7 +316,12 @@ RaucSlot *r_uboot_get_primary(GError **error)
 
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
-	if (!uboot_env_get("BOOT_ORDER", &order, &ierror)) {
+	if (!uboot_env_open(&env, &ierror)) {
+		g_propagate_error(error, ierror);
+		return NULL;
+	}
+
+	if (!uboot_env_get(env, "BOOT_ORDER", &order, &ierror)) {
 		g_propagate_error(error, ierror);
 		return NULL;
 	}
@@ -239,7 +340,7 @@ RaucSlot *r_uboot_get_primary(GError **error)
 
 			/* Check that > 0 attempts left */
 			key = g_strdup_printf("BOOT_%s_LEFT", slot->bootname);
-			if (!uboot_env_get(key, &attempts, &ierror)) {
+			if (!uboot_env_get(env, key, &attempts, &ierror)) {
 				g_propagate_error(error, ierror);
 				return NULL;
 			}
@@ -272,6 +373,7 @@ gboolean r_uboot_set_primary(RaucSlot *slot, GError **error)
 	g_autoptr(GString) order_new = NULL;
 	g_autoptr(GString) order_current = NULL;
 	g_auto(GStrv) bootnames = NULL;
+	g_autoptr(UbootEnvRef) env = NULL;
 	GError *ierror = NULL;
 	g_autofree gchar *key = NULL;
 	g_autofree gchar *val = NULL;
@@ -280,10 +382,15 @@ gboolean r_uboot_set_primary(RaucSlot *slot, GError **error)
 	g_return_val_if_fail(slot, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
+	if (!uboot_env_open(&env, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
 	/* Add updated slot as first entry in new boot order */
 	order_new = g_string_new(slot->bootname);
 
-	if (!uboot_env_get("BOOT_ORDER", &order_current, &ierror)) {
+	if (!uboot_env_get(env, "BOOT_ORDER", &order_current, &ierror)) {
 		g_message("Unable to obtain BOOT_ORDER (%s), using defaults", ierror->message);
 		g_clear_error(&ierror);
 
@@ -313,11 +420,16 @@ gboolean r_uboot_set_primary(RaucSlot *slot, GError **error)
 
 	val = g_strdup_printf("%x", attempts);
 
-	if (!uboot_env_set(key, val, &ierror)) {
+	if (!uboot_env_set(env, key, val, &ierror)) {
 		g_propagate_error(error, ierror);
 		return FALSE;
 	}
-	if (!uboot_env_set("BOOT_ORDER", order_new->str, &ierror)) {
+	if (!uboot_env_set(env, "BOOT_ORDER", order_new->str, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	if (!uboot_env_commit(env, &ierror)) {
 		g_propagate_error(error, ierror);
 		return FALSE;
 	}
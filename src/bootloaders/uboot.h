@@ -15,3 +15,8 @@ G_GNUC_WARN_UNUSED_RESULT;
 
 gboolean r_uboot_get_state(RaucSlot* slot, gboolean *good, GError **error)
 G_GNUC_WARN_UNUSED_RESULT;
+
+gboolean r_uboot_commit(GError **error)
+G_GNUC_WARN_UNUSED_RESULT;
+
+void r_uboot_discard(void);
@@ -7,6 +7,7 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/vfs.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 
@@ -25,7 +26,11 @@
 #include "dm.h"
 #include "verity_hash.h"
 #include "nbd.h"
+#include "cdc_index.h"
+#include "chunk_pack.h"
+#include "file_index.h"
 #include "hash_index.h"
+#include "tree_copy.h"
 
 /* from statfs(2) man page, as linux/magic.h may not have all of them */
 #ifndef AFS_SUPER_MAGIC
@@ -105,7 +110,52 @@ r_bundle_error_quark(void)
 	return g_quark_from_static_string("r-bundle-error-quark");
 }
 
-static gboolean mksquashfs(const gchar *bundlename, const gchar *contentdir, gboolean keep_metadata, const gchar *fakeroot, GError **error)
+/**
+ * Adds the mksquashfs arguments for the tuning options from the context.
+ */
+static gboolean add_mksquashfs_tuning_args(GPtrArray *args, GError **error)
+{
+	if (r_context()->mksquashfs_processors < 0) {
+		g_set_error(error, R_BUNDLE_ERROR, R_BUNDLE_ERROR_PAYLOAD,
+				"Invalid number of mksquashfs processors: %d", r_context()->mksquashfs_processors);
+		return FALSE;
+	} else if (r_context()->mksquashfs_processors > 0) {
+		g_ptr_array_add(args, g_strdup("-processors"));
+		g_ptr_array_add(args, g_strdup_printf("%d", r_context()->mksquashfs_processors));
+	}
+
+	if (r_context()->mksquashfs_block_size) {
+		g_ptr_array_add(args, g_strdup("-b"));
+		g_ptr_array_add(args, g_strdup(r_context()->mksquashfs_block_size));
+	}
+
+	if (r_context()->mksquashfs_comp) {
+		g_auto(GStrv) comp = g_strsplit(r_context()->mksquashfs_comp, ":", 2);
+		guint64 level = 0;
+
+		if (!comp[0] || !comp[0][0]) {
+			g_set_error(error, R_BUNDLE_ERROR, R_BUNDLE_ERROR_PAYLOAD,
+					"Invalid mksquashfs compressor: '%s'", r_context()->mksquashfs_comp);
+			return FALSE;
+		}
+		g_ptr_array_add(args, g_strdup("-comp"));
+		g_ptr_array_add(args, g_strdup(comp[0]));
+
+		if (comp[1]) {
+			if (!g_ascii_string_to_unsigned(comp[1], 10, 1, G_MAXINT, &level, NULL)) {
+				g_set_error(error, R_BUNDLE_ERROR, R_BUNDLE_ERROR_PAYLOAD,
+						"Invalid mksquashfs compression level: '%s'", comp[1]);
+				return FALSE;
+			}
+			g_ptr_array_add(args, g_strdup("-Xcompression-level"));
+			g_ptr_array_add(args, g_strdup_printf("%"G_GUINT64_FORMAT, level));
+		}
+	}
+
+	return TRUE;
+}
+
+static gboolean mksquashfs(const gchar *bundlename, const gchar *contentdir, gboolean keep_metadata, const gchar *fakeroot, const gchar *sortfile, GError **error)
 {
 	GError *ierror = NULL;
 	gboolean res = FALSE;
@@ -134,6 +184,18 @@ static gboolean mksquashfs(const gchar *bundlename, const gchar *contentdir, gbo
 		g_ptr_array_add(args, g_strdup("-no-xattrs"));
 	}
 	g_ptr_array_add(args, g_strdup("-quiet"));
+	if (sortfile) {
+		/* keep the data of each file in contiguous blocks */
+		g_ptr_array_add(args, g_strdup("-no-fragments"));
+		g_ptr_array_add(args, g_strdup("-sort"));
+		g_ptr_array_add(args, g_strdup(sortfile));
+	}
+
+	res = add_mksquashfs_tuning_args(args, &ierror);
+	if (!res) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
 
 	if (r_context()->mksquashfs_args != NULL) {
 		g_auto(GStrv) mksquashfs_argvp = NULL;
@@ -395,1044 +457,2366 @@ static gboolean image_is_archive(RaucImage* image)
 	return FALSE;
 }
 
-static gboolean generate_adaptive_data(RaucManifest *manifest, const gchar *dir, GError **error)
-{
-	GError *ierror = NULL;
+/* maximum number of images for which adaptive data is generated concurrently */
+#define ADAPTIVE_DATA_MAX_THREADS 4
 
-	g_return_val_if_fail(manifest, FALSE);
-	g_return_val_if_fail(dir, FALSE);
-	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+/**
+ * Returns the number of chunks in the index which contain only zeros.
+ */
+static guint32 count_zero_chunks(const RaucHashIndex *index)
+{
+	const guint8 *hashes = g_bytes_get_data(index->hashes, NULL);
+	guint32 zero_chunks = 0;
 
-	for (GList *elem = manifest->images; elem != NULL; elem = elem->next) {
-		RaucImage *image = elem->data;
-		g_autofree gchar *imagepath = g_build_filename(dir, image->filename, NULL);
+	for (guint32 i = 0; i < index->count; i++) {
+		if (memcmp(&hashes[(gsize)i * 32], R_HASH_INDEX_ZERO_CHUNK, 32) == 0)
+			zero_chunks++;
+	}
 
-		if (!image->adaptive)
-			continue;
+	return zero_chunks;
+}
 
-		for (gchar **method = image->adaptive; *method != NULL; method++) {
-			if (g_str_equal(*method, "block-hash-index")) {
-				/* Use a filename of bundle/<image-name>.block-hash-index. */
-				g_autofree gchar *indexname = g_strconcat(image->filename, ".block-hash-index", NULL);
-				g_autofree gchar *indexpath = g_build_filename(dir, indexname, NULL);
-				g_autoptr(RaucHashIndex) index = NULL;
-				g_auto(filedesc) fd = -1;
+/**
+ * Returns the path of a file derived from an image in the build cache.
+ *
+ * The key consists of the image digest, the suffix of the derived file and
+ * the RAUC version (which determines the format and parameters of the
+ * generated data).
+ *
+ * @return path in the cache or NULL if no cache directory is set
+ */
+static gchar *get_build_cache_path(const RaucImage *image, const gchar *suffix)
+{
+	const gchar *cache_dir = r_context()->bundle_cache_dir;
+	g_autofree gchar *name = NULL;
 
-				if (image_is_archive(image)) {
-					g_warning("Generating block hash index requires a block device image but %s looks like an archive", image->filename);
-				}
+	if (!cache_dir || !image->checksum.digest)
+		return NULL;
 
-				fd = g_open(imagepath, O_RDONLY | O_CLOEXEC);
-				if (fd < 0) {
-					int err = errno;
-					g_set_error(
-							error,
-							G_IO_ERROR,
-							g_io_error_from_errno(err),
-							"Failed to open image: %s", image->filename);
-					return FALSE;
-				}
+	name = g_strdup_printf("%s%s-%s", image->checksum.digest, suffix, PACKAGE_VERSION);
+	return g_build_filename(cache_dir, name, NULL);
+}
 
-				index = r_hash_index_open("image", fd, NULL, &ierror);
-				if (!index) {
-					g_propagate_prefixed_error(
-							error,
-							ierror,
-							"Failed to generate hash index for %s: ", image->filename);
-					return FALSE;
-				}
+/**
+ * Places a file derived from an image into the bundle, if it is found in the
+ * build cache.
+ *
+ * @return TRUE if the file was restored from the cache, FALSE otherwise
+ */
+static gboolean restore_from_build_cache(const RaucImage *image, const gchar *suffix, const gchar *path)
+{
+	GError *ierror = NULL;
+	g_autofree gchar *cache_path = get_build_cache_path(image, suffix);
 
-				if (!r_hash_index_export(index, indexpath, &ierror)) {
-					g_propagate_prefixed_error(
-							error,
-							ierror,
-							"Failed to write hash index for %s: ", image->filename);
-					return FALSE;
-				}
+	if (!cache_path || !g_file_test(cache_path, G_FILE_TEST_IS_REGULAR))
+		return FALSE;
 
-				g_debug("Created block-hash-index for image %s", image->filename);
-			} else if (g_str_equal(*method, "adaptive-test-method")) {
-				g_debug("Ignoring adaptive-test-method for image %s", image->filename);
-			} else {
-				g_set_error(
-						error,
-						R_BUNDLE_ERROR,
-						R_BUNDLE_ERROR_PAYLOAD,
-						"Unsupported adaptive method: %s", *method);
-				return FALSE;
-			}
-		}
+	/* the cache is usually on the same file system */
+	if (link(cache_path, path) != 0 &&
+	    !copy_file(cache_path, NULL, path, NULL, &ierror)) {
+		g_warning("Failed to use cached %s for %s: %s", suffix, image->filename, ierror->message);
+		g_clear_error(&ierror);
+		g_unlink(path);
+		return FALSE;
 	}
 
+	g_message("Using cached %s for image %s", suffix, image->filename);
 	return TRUE;
 }
 
-static gchar *convert_tar_extract(RaucImage *image, const gchar *dir, const gchar *fakeroot, GError **error)
+/**
+ * Stores a file derived from an image in the build cache.
+ *
+ * The file is copied to a temporary name and then renamed, so that
+ * concurrent builds never see incomplete files. Errors only cause a warning.
+ */
+static void store_in_build_cache(const RaucImage *image, const gchar *suffix, const gchar *path)
 {
 	GError *ierror = NULL;
+	g_autofree gchar *cache_path = get_build_cache_path(image, suffix);
+	g_autofree gchar *tmp_path = NULL;
 
-	g_return_val_if_fail(image, NULL);
-	g_return_val_if_fail(dir, NULL);
-	g_return_val_if_fail(error == NULL || *error == NULL, NULL);
+	if (!cache_path)
+		return;
 
-	g_autofree gchar *file_path = g_build_filename(dir, image->filename, NULL);
-	g_autofree gchar *converted = g_strdup_printf("%s.extracted", image->filename);
-	g_autofree gchar *converted_path = g_build_filename(dir, converted, NULL);
+	tmp_path = g_strdup_printf("%s.tmp-%08x", cache_path, g_random_int());
+	if (link(path, tmp_path) != 0 &&
+	    !copy_file(path, NULL, tmp_path, NULL, &ierror)) {
+		g_warning("Failed to store %s for %s in build cache: %s", suffix, image->filename, ierror->message);
+		g_clear_error(&ierror);
+		return;
+	}
 
-	if (g_mkdir(converted_path, S_IRWXU)) {
+	if (g_rename(tmp_path, cache_path) != 0) {
 		int err = errno;
-		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
-				"failed to create directory '%s': %s", converted_path, g_strerror(err));
-		return NULL;
+		g_warning("Failed to store %s for %s in build cache: %s", suffix, image->filename, g_strerror(err));
+		g_unlink(tmp_path);
 	}
+}
 
-	g_autoptr(GPtrArray) args = g_ptr_array_new_full(10, g_free);
-	r_fakeroot_add_args(args, fakeroot);
+/**
+ * Generates the adaptive data for a single image.
+ *
+ * For the block-hash-index, the chunk hashes calculated together with the
+ * image checksum are used, so that the image is only read once.
+ */
+static gboolean generate_adaptive_image(RaucImage *image, const gchar *dir, GError **error)
+{
+	GError *ierror = NULL;
+	g_autofree gchar *imagepath = g_build_filename(dir, image->filename, NULL);
 
-	g_ptr_array_add(args, g_strdup("tar"));
-	g_ptr_array_add(args, g_strdup("--numeric-owner"));
-	// TODO add support for --acl --selinux --xattrs via fakeroot or pseudo
-	g_ptr_array_add(args, g_strdup("-xf"));
-	g_ptr_array_add(args, g_strdup(file_path));
-	g_ptr_array_add(args, g_strdup("-C"));
-	g_ptr_array_add(args, g_strdup(converted_path));
-	g_ptr_array_add(args, NULL);
+	for (gchar **method = image->adaptive; *method != NULL; method++) {
+		if (g_str_equal(*method, "block-hash-index")) {
+			/* Use a filename of bundle/<image-name>.block-hash-index. */
+			g_autofree gchar *indexname = g_strconcat(image->filename, ".block-hash-index", NULL);
+			g_autofree gchar *indexpath = g_build_filename(dir, indexname, NULL);
+			g_autoptr(RaucHashIndex) index = NULL;
+			g_auto(filedesc) fd = -1;
 
-	if (!r_subprocess_runv(args, G_SUBPROCESS_FLAGS_NONE, &ierror)) {
-		g_propagate_prefixed_error(error, ierror, "failed to run tar extract: ");
-		return NULL;
-	}
+			if (restore_from_build_cache(image, ".block-hash-index", indexpath))
+				continue;
 
-	return g_steal_pointer(&converted);
-}
+			if (image_is_archive(image)) {
+				g_warning("Generating block hash index requires a block device image but %s looks like an archive", image->filename);
+			}
 
-#if ENABLE_COMPOSEFS == 1
-static gchar *convert_composefs(RaucImage *image, const gchar *dir, const gchar *tar_extracted_path, const gchar *fakeroot, GError **error)
-{
-	GError *ierror = NULL;
-	g_autoptr(GPtrArray) args = g_ptr_array_new_full(10, g_free);
+			fd = g_open(imagepath, O_RDONLY | O_CLOEXEC);
+			if (fd < 0) {
+				int err = errno;
+				g_set_error(
+						error,
+						G_IO_ERROR,
+						g_io_error_from_errno(err),
+						"Failed to open image: %s", image->filename);
+				return FALSE;
+			}
 
-	g_return_val_if_fail(image, NULL);
-	g_return_val_if_fail(dir, NULL);
-	g_return_val_if_fail(tar_extracted_path, NULL);
-	g_return_val_if_fail(error == NULL || *error == NULL, NULL);
+			if (image->chunk_hashes)
+				index = r_hash_index_new_from_hashes("image", fd, image->chunk_hashes, &ierror);
+			else
+				index = r_hash_index_open("image", fd, NULL, &ierror);
+			if (!index) {
+				g_propagate_prefixed_error(
+						error,
+						ierror,
+						"Failed to generate hash index for %s: ", image->filename);
+				return FALSE;
+			}
 
-	g_autofree gchar *converted = g_strdup_printf("%s.cfs", image->filename);
-	g_autofree gchar *converted_path = g_build_filename(dir, converted, NULL);
-	g_autofree gchar *converted_image_path = g_build_filename(converted_path, "image.cfs", NULL);
-	g_autofree gchar *store_path = g_build_filename(dir, ".rauc-cfs-store", NULL);
+			if (!r_hash_index_export(index, indexpath, &ierror)) {
+				g_propagate_prefixed_error(
+						error,
+						ierror,
+						"Failed to write hash index for %s: ", image->filename);
+				return FALSE;
+			}
 
-	/* Create a directory in the bundle so we can keep additional metadata, like
-	 * a signature over the image digest.
-	 */
-	if (g_mkdir(converted_path, S_IRWXU)) {
-		int err = errno;
-		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
-				"failed to create directory '%s': %s", converted_path, g_strerror(err));
-		return NULL;
-	}
+			g_message("Created block-hash-index for image %s (%"G_GUINT32_FORMAT " chunks, %"G_GUINT32_FORMAT " zero chunks)",
+					image->filename, index->count, count_zero_chunks(index));
 
-	if (g_mkdir_with_parents(store_path, S_IRWXU)) {
-		int err = errno;
-		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
-				"failed to create directory '%s': %s", store_path, g_strerror(err));
-		return NULL;
-	}
+			store_in_build_cache(image, ".block-hash-index", indexpath);
+		} else if (g_str_equal(*method, "cdc-hash-index")) {
+			/* Use a filename of bundle/<image-name>.cdc-hash-index. */
+			g_autofree gchar *indexname = g_strconcat(image->filename, ".cdc-hash-index", NULL);
+			g_autofree gchar *indexpath = g_build_filename(dir, indexname, NULL);
+			g_autoptr(RaucCdcIndex) index = NULL;
+			g_auto(filedesc) fd = -1;
 
-	r_fakeroot_add_args(args, fakeroot);
+			if (restore_from_build_cache(image, ".cdc-hash-index", indexpath))
+				continue;
 
-	g_ptr_array_add(args, g_strdup("mkcomposefs"));
-	g_ptr_array_add(args, g_strdup_printf("--digest-store=%s", store_path));
-	/* TODO mkcomposefs fails to read xattrs from broken symlinks under pseudo. */
-	g_ptr_array_add(args, g_strdup("--skip-xattrs"));
-	g_ptr_array_add(args, g_strdup(tar_extracted_path));
-	g_ptr_array_add(args, g_strdup(converted_image_path));
-	g_ptr_array_add(args, NULL);
+			if (image_is_archive(image)) {
+				g_warning("Generating content-defined chunk index requires a block device image but %s looks like an archive", image->filename);
+			}
 
-	if (!r_subprocess_runv(args, G_SUBPROCESS_FLAGS_NONE, &ierror)) {
-		g_propagate_prefixed_error(error, ierror, "failed to run mkcomposefs: ");
-		return NULL;
-	}
+			fd = g_open(imagepath, O_RDONLY | O_CLOEXEC);
+			if (fd < 0) {
+				int err = errno;
+				g_set_error(
+						error,
+						G_IO_ERROR,
+						g_io_error_from_errno(err),
+						"Failed to open image: %s", image->filename);
+				return FALSE;
+			}
 
-	return g_steal_pointer(&converted);
-}
-#endif
+			index = r_cdc_index_open("image", fd, NULL, &ierror);
+			if (!index) {
+				g_propagate_prefixed_error(
+						error,
+						ierror,
+						"Failed to generate content-defined chunk index for %s: ", image->filename);
+				return FALSE;
+			}
+			fd = -1; /* belongs to index now */
 
-static gboolean convert_images(RaucManifest *manifest, const gchar *dir, const gchar *fakeroot, GError **error)
-{
-	GError *ierror = NULL;
+			if (!r_cdc_index_export(index, indexpath, &ierror)) {
+				g_propagate_prefixed_error(
+						error,
+						ierror,
+						"Failed to write content-defined chunk index for %s: ", image->filename);
+				return FALSE;
+			}
 
-	g_return_val_if_fail(manifest, FALSE);
-	g_return_val_if_fail(dir, FALSE);
-	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+			g_message("Created cdc-hash-index for image %s (%u chunks)",
+					image->filename, index->chunks->len);
 
-	for (GList *elem = manifest->images; elem != NULL; elem = elem->next) {
-		RaucImage *image = elem->data;
+			store_in_build_cache(image, ".cdc-hash-index", indexpath);
+		} else if (g_str_equal(*method, "chunk-pack")) {
+			/* Use a filename of bundle/<image-name>.chunk-pack. */
+			g_autofree gchar *packname = g_strconcat(image->filename, ".chunk-pack", NULL);
+			g_autofree gchar *packpath = g_build_filename(dir, packname, NULL);
 
-		if (image->converted && image->converted->len == 0) {
-			g_set_error(
-					error,
-					R_BUNDLE_ERROR,
-					R_BUNDLE_ERROR_PAYLOAD,
-					"Manifest already contains converted images for '%s'", image->slotclass);
-			return FALSE;
-		}
+			if (!g_strv_contains((const gchar * const *)image->adaptive, "block-hash-index")) {
+				g_set_error(
+						error,
+						R_BUNDLE_ERROR,
+						R_BUNDLE_ERROR_PAYLOAD,
+						"Adaptive method chunk-pack for %s requires block-hash-index", image->filename);
+				return FALSE;
+			}
 
-		if (!image->convert)
-			continue;
+#if ENABLE_CASYNC_NATIVE == 1
+			if (restore_from_build_cache(image, ".chunk-pack", packpath))
+				continue;
 
-		g_autofree gchar *tar_extracted = NULL;
-		g_autofree gchar *tar_extracted_path = NULL;
-		/* extract tar early if we need it for other outputs */
-		if (g_strv_contains((const gchar * const *)image->convert, "tar-extract") ||
-		    g_strv_contains((const gchar * const *)image->convert, "composefs")) {
-			g_debug("extracting tar artifact image '%s'", image->filename);
-			tar_extracted = convert_tar_extract(image, dir, fakeroot, &ierror);
-			if (!tar_extracted) {
-				g_propagate_error(error, ierror);
+			if (!r_chunk_pack_create(imagepath, packpath, &ierror)) {
+				g_propagate_prefixed_error(
+						error,
+						ierror,
+						"Failed to create chunk pack for %s: ", image->filename);
 				return FALSE;
 			}
-			tar_extracted_path = g_build_filename(dir, tar_extracted, NULL);
-		}
 
-		gboolean keep = FALSE;
-		g_autoptr(GPtrArray) converted = g_ptr_array_new_with_free_func(g_free);
-		for (gchar **method = image->convert; *method != NULL; method++) {
-			gchar *converted_filename = NULL;
-			if (g_str_equal(*method, "tar-extract")) {
-				converted_filename = g_strdup(tar_extracted);
-			} else if (g_str_equal(*method, "composefs")) {
-#if ENABLE_COMPOSEFS == 1
-				g_debug("converting '%s' to composefs image", tar_extracted_path);
-				converted_filename = convert_composefs(image, dir, tar_extracted_path, fakeroot, &ierror);
-				if (!converted_filename) {
-					g_propagate_error(error, ierror);
-					return FALSE;
-				}
+			g_message("Created chunk-pack for image %s", image->filename);
+
+			store_in_build_cache(image, ".chunk-pack", packpath);
 #else
-				g_set_error(error, R_BUNDLE_ERROR, R_BUNDLE_ERROR_UNSUPPORTED,
-						"Convert method 'composefs' not enabled, recompile with -Dcomposefs=enabled");
-				return FALSE;
+			g_set_error(
+					error,
+					R_BUNDLE_ERROR,
+					R_BUNDLE_ERROR_PAYLOAD,
+					"Adaptive method chunk-pack requires zstd support");
+			return FALSE;
 #endif
-			} else if (g_str_equal(*method, "keep")) {
-				g_debug("keeping input artifact image '%s'", image->filename);
-				keep = TRUE;
-				converted_filename = g_strdup(image->filename);
-			} else {
+		} else if (g_str_equal(*method, "block-hash-prefix")) {
+			/* written from the block-hash-index below */
+			if (!g_strv_contains((const gchar * const *)image->adaptive, "block-hash-index")) {
 				g_set_error(
 						error,
 						R_BUNDLE_ERROR,
 						R_BUNDLE_ERROR_PAYLOAD,
-						"Unsupported convert method: %s", *method);
+						"Adaptive method block-hash-prefix for %s requires block-hash-index", image->filename);
 				return FALSE;
 			}
+		} else if (g_str_equal(*method, "file-index")) {
+			/* Use a filename of bundle/<image-name>.file-index. */
+			g_autofree gchar *indexname = g_strconcat(image->filename, ".file-index", NULL);
+			g_autofree gchar *indexpath = g_build_filename(dir, indexname, NULL);
+			g_autoptr(RaucFileIndex) index = NULL;
 
-			g_assert(converted_filename != NULL);
-			g_ptr_array_add(converted, converted_filename);
-		}
+			if (restore_from_build_cache(image, ".file-index", indexpath))
+				continue;
 
-		if (tar_extracted_path && !g_strv_contains((const gchar * const *)image->convert, "tar-extract")) {
-			if (!rm_tree(tar_extracted_path, &ierror)) {
-				g_propagate_prefixed_error(error, ierror, "Failed to remove files extacted from tar: ");
+			if (!g_pattern_match_simple("*.tar*", image->filename)) {
+				g_set_error(
+						error,
+						R_BUNDLE_ERROR,
+						R_BUNDLE_ERROR_PAYLOAD,
+						"Adaptive method file-index requires a tar archive, but %s is none", image->filename);
 				return FALSE;
 			}
-		}
 
-		if (!keep) {
-			g_autofree gchar *file_path = g_build_filename(dir, image->filename, NULL);
-			g_debug("removing input artifact image '%s' after conversion", image->filename);
-			if (g_unlink(file_path) != 0) {
-				int err = errno;
-				g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
-						"Failed to remove input artifact image after conversion '%s': %s\n",
-						file_path, g_strerror(errno));
+			index = r_file_index_from_tar(imagepath, &ierror);
+			if (!index) {
+				g_propagate_prefixed_error(
+						error,
+						ierror,
+						"Failed to generate file index for %s: ", image->filename);
+				return FALSE;
+			}
+
+			if (!r_file_index_save(index, indexpath, &ierror)) {
+				g_propagate_prefixed_error(
+						error,
+						ierror,
+						"Failed to write file index for %s: ", image->filename);
 				return FALSE;
 			}
+
+			g_message("Created file-index for image %s (%u entries)",
+					image->filename, index->entries->len);
+
+			store_in_build_cache(image, ".file-index", indexpath);
+		} else if (g_str_equal(*method, "ubi-leb")) {
+			/* the image is compared with the UBI volume during installation */
+			g_debug("No adaptive data needed for ubi-leb for image %s", image->filename);
+		} else if (g_str_equal(*method, "adaptive-test-method")) {
+			g_debug("Ignoring adaptive-test-method for image %s", image->filename);
+		} else {
+			g_set_error(
+					error,
+					R_BUNDLE_ERROR,
+					R_BUNDLE_ERROR_PAYLOAD,
+					"Unsupported adaptive method: %s", *method);
+			return FALSE;
 		}
+	}
 
-		g_clear_pointer(&image->converted, g_ptr_array_unref);
-		image->converted = g_steal_pointer(&converted);
+	/* The prefixes are derived from the block-hash-index, independent of
+	 * the order of the methods. */
+	if (g_strv_contains((const gchar * const *)image->adaptive, "block-hash-prefix")) {
+		g_autofree gchar *indexname = g_strconcat(image->filename, ".block-hash-index", NULL);
+		g_autofree gchar *indexpath = g_build_filename(dir, indexname, NULL);
+		g_autofree gchar *prefixname = g_strconcat(image->filename, ".block-hash-prefix", NULL);
+		g_autofree gchar *prefixpath = g_build_filename(dir, prefixname, NULL);
+		g_autoptr(RaucHashIndex) index = NULL;
+
+		index = r_hash_index_open_file("image", indexpath, &ierror);
+		if (!index || !r_hash_index_export_prefixes(index, prefixpath, &ierror)) {
+			g_propagate_prefixed_error(
+					error,
+					ierror,
+					"Failed to write hash prefixes for %s: ", image->filename);
+			return FALSE;
+		}
+
+		g_message("Created block-hash-prefix for image %s", image->filename);
 	}
 
 	return TRUE;
 }
 
-static gboolean output_stream_write_uint64_all(GOutputStream *stream,
-		guint64 data,
-		GCancellable *cancellable,
-		GError **error)
-{
-	gsize bytes_written;
+typedef struct {
+	RaucImage *image;
+	const gchar *dir;
+	gboolean res;
+	GError *error;
+} AdaptiveJob;
 
-	data = GUINT64_TO_BE(data);
-	if (!g_output_stream_write_all(stream, &data, sizeof(data), &bytes_written,
-			cancellable, error))
-		return FALSE;
+static void generate_adaptive_worker(gpointer data, gpointer user_data)
+{
+	AdaptiveJob *job = data;
 
-	g_assert(bytes_written == sizeof(data));
-	return TRUE;
+	job->res = generate_adaptive_image(job->image, job->dir, &job->error);
 }
 
-static gboolean input_stream_read_uint64_all(GInputStream *stream,
-		guint64 *data,
-		GCancellable *cancellable,
-		GError **error)
+/**
+ * Generates the adaptive data for all images.
+ *
+ * The images are processed concurrently by a bounded thread pool. If
+ * generation fails for multiple images, the error of the first one in
+ * manifest order is returned.
+ */
+static gboolean generate_adaptive_data(RaucManifest *manifest, const gchar *dir, GError **error)
 {
-	guint64 tmp;
-	gsize bytes_read;
+	GError *ierror = NULL;
+	g_autofree AdaptiveJob *jobs = NULL;
+	GThreadPool *pool = NULL;
+	guint n_jobs = 0;
+	guint n_threads;
+	gboolean res = TRUE;
 
-	if (!g_input_stream_read_all(stream, &tmp, sizeof(tmp), &bytes_read,
-			cancellable, error))
+	g_return_val_if_fail(manifest, FALSE);
+	g_return_val_if_fail(dir, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	jobs = g_new0(AdaptiveJob, g_list_length(manifest->images));
+	for (GList *elem = manifest->images; elem != NULL; elem = elem->next) {
+		RaucImage *image = elem->data;
+
+		if (!image->adaptive)
+			continue;
+
+		jobs[n_jobs].image = image;
+		jobs[n_jobs].dir = dir;
+		n_jobs++;
+	}
+
+	if (!n_jobs)
+		return TRUE;
+
+	n_threads = MIN(CLAMP(g_get_num_processors(), 1, ADAPTIVE_DATA_MAX_THREADS), n_jobs);
+	pool = g_thread_pool_new(generate_adaptive_worker, NULL, n_threads, FALSE, &ierror);
+	if (!pool) {
+		g_propagate_prefixed_error(error, ierror, "Failed to create adaptive data thread pool: ");
 		return FALSE;
+	}
 
-	g_assert(bytes_read == sizeof(tmp));
-	*data = GUINT64_FROM_BE(tmp);
-	return TRUE;
+	for (guint i = 0; i < n_jobs; i++) {
+		if (!g_thread_pool_push(pool, &jobs[i], &ierror)) {
+			/* fall back to generating in this thread */
+			g_debug("Failed to queue adaptive data job: %s", ierror->message);
+			g_clear_error(&ierror);
+			generate_adaptive_worker(&jobs[i], NULL);
+		}
+	}
+
+	/* wait for all queued jobs to finish */
+	g_thread_pool_free(pool, FALSE, TRUE);
+
+	for (guint i = 0; i < n_jobs; i++) {
+		if (jobs[i].res)
+			continue;
+		if (res) {
+			g_propagate_error(error, jobs[i].error);
+			res = FALSE;
+		} else {
+			g_clear_error(&jobs[i].error);
+		}
+	}
+
+	return res;
 }
 
-static gboolean output_stream_write_bytes_all(GOutputStream *stream,
-		GBytes *bytes,
-		GCancellable *cancellable,
-		GError **error)
+typedef struct {
+	gchar *digest; /* SHA256 digest of the base image */
+	RaucHashIndex *index; /* block-hash-index of the base image */
+} DeltaBase;
+
+static void delta_base_free(DeltaBase *base)
 {
-	const void *buffer;
-	gsize count, bytes_written;
+	if (!base)
+		return;
 
-	buffer = g_bytes_get_data(bytes, &count);
-	return g_output_stream_write_all(stream, buffer, count, &bytes_written,
-			cancellable, error);
+	g_free(base->digest);
+	r_hash_index_free(base->index);
+	g_free(base);
 }
 
-static gboolean input_stream_read_bytes_all(GInputStream *stream,
-		GBytes **bytes,
-		gsize count,
-		GCancellable *cancellable,
-		GError **error)
+static gchar *delta_base_key(const RaucImage *image)
 {
-	g_autofree void *buffer = NULL;
-	gsize bytes_read;
+	return g_strdup_printf("%s.%s", image->slotclass, image->variant ? image->variant : "");
+}
 
-	g_assert_cmpint(count, !=, 0);
+/**
+ * Loads the block-hash-index files of all images in the base bundle for
+ * delta bundles.
+ *
+ * The base bundle is only used to decide which chunks can be omitted, so its
+ * signature is not verified. If it does not match the installed version,
+ * the installation fails because of missing chunks, but never writes wrong
+ * data, as the data from delta images is verified against the index.
+ *
+ * @param basepath path of the base bundle
+ * @param error return location for a GError, or NULL
+ *
+ * @return hash table mapping slot class and variant to DeltaBase, or NULL on error
+ */
+static GHashTable *load_delta_base(const gchar *basepath, GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(RaucBundle) bundle = NULL;
+	g_autoptr(RaucManifest) manifest = NULL;
+	g_autoptr(GHashTable) bases = NULL;
+	g_autofree gchar *tmpdir = NULL;
+	GHashTable *res = NULL;
+	int fd;
 
-	buffer = g_malloc0(count);
+	if (!check_bundle(basepath, &bundle, CHECK_BUNDLE_NO_VERIFY, NULL, &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Failed to open delta base bundle: ");
+		return NULL;
+	}
 
-	if (!g_input_stream_read_all(stream, buffer, count, &bytes_read,
-			cancellable, error)) {
-		return FALSE;
+	if (bundle->manifest) {
+		manifest = g_steal_pointer(&bundle->manifest);
+	} else if (!load_manifest_from_bundle(bundle, &manifest, &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Failed to load delta base manifest: ");
+		return NULL;
 	}
 
-	g_assert(bytes_read == count);
-	*bytes = g_bytes_new_take(g_steal_pointer(&buffer), count);
-	return TRUE;
-}
+	if (manifest->bundle_format == R_MANIFEST_FORMAT_CRYPT) {
+		g_set_error(error, R_BUNDLE_ERROR, R_BUNDLE_ERROR_UNSUPPORTED,
+				"Encrypted delta base bundles are not supported");
+		return NULL;
+	}
 
-static gboolean create_verity(const gchar *bundlename, RaucManifest *manifest, GError **error)
-{
-	g_autoptr(GFile) bundlefile = NULL;
-	g_autoptr(GFileIOStream) bundlestream = NULL;
-	GOutputStream *bundleoutstream = NULL; /* owned by the bundle stream */
-	GError *ierror = NULL;
-	guint64 offset;
-	int bundlefd = -1;
-	guint8 salt[32] = {0};
-	guint8 hash[32] = {0};
-	uint64_t combined_size = 0;
-	guint64 verity_size = 0;
+	tmpdir = g_dir_make_tmp("delta-XXXXXX", &ierror);
+	if (!tmpdir) {
+		g_propagate_prefixed_error(error, ierror, "Failed to create tmp dir: ");
+		return NULL;
+	}
 
-	g_return_val_if_fail(bundlename != NULL, FALSE);
-	g_return_val_if_fail(manifest != NULL, FALSE);
-	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+	bases = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)delta_base_free);
+	fd = g_file_descriptor_based_get_fd(G_FILE_DESCRIPTOR_BASED(bundle->stream));
 
-	bundlefile = g_file_new_for_path(bundlename);
-	bundlestream = g_file_open_readwrite(bundlefile, NULL, &ierror);
-	if (bundlestream == NULL) {
-		g_propagate_prefixed_error(
-				error,
-				ierror,
-				"failed to open bundle for signing: ");
-		return FALSE;
+	for (GList *elem = manifest->images; elem != NULL; elem = elem->next) {
+		RaucImage *image = elem->data;
+		g_autofree gchar *key = NULL;
+		g_autofree gchar *indexname = NULL;
+		g_autofree gchar *destdir = NULL;
+		g_autofree gchar *indexpath = NULL;
+		DeltaBase *base = NULL;
+
+		if (!image->filename || !image->checksum.digest ||
+		    !image->adaptive || !g_strv_contains((const gchar * const *)image->adaptive, "block-hash-index"))
+			continue;
+
+		key = delta_base_key(image);
+		indexname = g_strconcat(image->filename, ".block-hash-index", NULL);
+		destdir = g_build_filename(tmpdir, key, NULL);
+		if (!unsquashfs(fd, destdir, indexname, &ierror)) {
+			g_propagate_prefixed_error(error, ierror, "Failed to extract %s from delta base: ", indexname);
+			goto out;
+		}
+
+		indexpath = g_build_filename(destdir, indexname, NULL);
+		base = g_new0(DeltaBase, 1);
+		base->digest = g_strdup(image->checksum.digest);
+		/* the index is mapped, so it stays valid after removing the file */
+		base->index = r_hash_index_open_file("delta_base", indexpath, &ierror);
+		if (!base->index) {
+			delta_base_free(base);
+			g_propagate_prefixed_error(error, ierror, "Failed to open %s from delta base: ", indexname);
+			goto out;
+		}
+
+		g_hash_table_insert(bases, g_steal_pointer(&key), base);
 	}
 
-	bundleoutstream = g_io_stream_get_output_stream(G_IO_STREAM(bundlestream));
-	bundlefd = g_file_descriptor_based_get_fd(G_FILE_DESCRIPTOR_BASED(bundleoutstream));
+	res = g_steal_pointer(&bases);
 
-	/* check we have a clean manifest */
-	g_assert(manifest->bundle_verity_salt == NULL);
-	g_assert(manifest->bundle_verity_hash == NULL);
-	g_assert(manifest->bundle_verity_size == 0);
+out:
+	if (!rm_tree(tmpdir, &ierror)) {
+		g_warning("Failed to remove delta base tmpdir %s: %s", tmpdir, ierror->message);
+		g_clear_error(&ierror);
+	}
+	return res;
+}
 
-	if (!g_seekable_seek(G_SEEKABLE(bundlestream),
-			0, G_SEEK_END, NULL, &ierror)) {
-		g_propagate_prefixed_error(
-				error,
-				ierror,
-				"failed to seek to end of bundle: ");
+/**
+ * Replaces an image in the workdir with a sparse copy containing only the
+ * chunks which are not contained in the base image.
+ *
+ * The image in the workdir is a hard link to the content directory, so a new
+ * file is created and renamed over it.
+ */
+static gboolean generate_delta_image(RaucImage *image, const gchar *dir, const DeltaBase *base, GError **error)
+{
+	GError *ierror = NULL;
+	g_autofree gchar *imagepath = g_build_filename(dir, image->filename, NULL);
+	g_autofree gchar *indexname = g_strconcat(image->filename, ".block-hash-index", NULL);
+	g_autofree gchar *indexpath = g_build_filename(dir, indexname, NULL);
+	g_autofree gchar *deltapath = g_strconcat(imagepath, ".delta-tmp", NULL);
+	g_autofree guint8 *buf = NULL;
+	g_autoptr(RaucHashIndex) index = NULL;
+	g_auto(filedesc) in_fd = -1;
+	g_auto(filedesc) out_fd = -1;
+	const guint8 (*hashes)[32];
+	guint32 included = 0;
+
+	in_fd = g_open(imagepath, O_RDONLY | O_CLOEXEC);
+	if (in_fd < 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to open image %s: %s", image->filename, g_strerror(err));
 		return FALSE;
 	}
 
-	offset = g_seekable_tell(G_SEEKABLE(bundlestream));
-	g_debug("Payload size: %" G_GUINT64_FORMAT " bytes.", offset);
-	/* dm-verity hash table generation */
-	if (RAND_bytes((unsigned char *)&salt, sizeof(salt)) != 1) {
-		g_set_error(error,
-				R_BUNDLE_ERROR,
-				R_BUNDLE_ERROR_VERITY,
-				"failed to generate verity salt");
+	index = r_hash_index_open("image", in_fd, indexpath, &ierror);
+	if (!index) {
+		g_propagate_prefixed_error(error, ierror, "Failed to open hash index for %s: ", image->filename);
 		return FALSE;
 	}
-	if (offset % 4096 != 0) {
-		g_set_error(error,
-				R_BUNDLE_ERROR,
-				R_BUNDLE_ERROR_VERITY,
-				"squashfs size (%"G_GUINT64_FORMAT ") is not a multiple of 4096 bytes", offset);
+	hashes = g_bytes_get_data(index->hashes, NULL);
+
+	out_fd = g_open(deltapath, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (out_fd < 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to create delta image %s: %s", deltapath, g_strerror(err));
 		return FALSE;
 	}
-	if (offset <= 4096) {
-		g_set_error(error,
-				R_BUNDLE_ERROR,
-				R_BUNDLE_ERROR_VERITY,
-				"squashfs size (%"G_GUINT64_FORMAT ") must be larger than 4096 bytes", offset);
-		return FALSE;
+	if (ftruncate(out_fd, (off_t)index->count * R_HASH_INDEX_CHUNK_SIZE) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to resize delta image %s: %s", deltapath, g_strerror(err));
+		goto fail;
 	}
-	if (r_verity_hash_create(bundlefd, offset/4096, &combined_size, hash, salt) != 0) {
-		g_set_error(error,
-				R_BUNDLE_ERROR,
-				R_BUNDLE_ERROR_VERITY,
-				"failed to generate verity hash tree");
-		return FALSE;
+
+	/* chunks found in the base are left as holes */
+	buf = g_malloc(R_HASH_INDEX_CHUNK_SIZE);
+	for (guint32 c = 0; c < index->count; c++) {
+		off_t offset = (off_t)c * R_HASH_INDEX_CHUNK_SIZE;
+		guint32 number;
+
+		if (r_hash_index_find_chunk(base->index, hashes[c], &number, NULL))
+			continue;
+
+		if (!r_pread_exact(in_fd, buf, R_HASH_INDEX_CHUNK_SIZE, offset, &ierror) ||
+		    !r_pwrite_exact(out_fd, buf, R_HASH_INDEX_CHUNK_SIZE, offset, &ierror)) {
+			g_propagate_prefixed_error(error, ierror, "Failed to create delta image for %s: ", image->filename);
+			goto fail;
+		}
+		included++;
 	}
-	/* for a squashfs <= 4096 bytes, we don't have a hash table */
-	g_assert(combined_size*4096 > (uint64_t)offset);
-	verity_size = combined_size*4096 - offset;
-	g_assert(verity_size % 4096 == 0);
 
-	manifest->bundle_verity_salt = r_hex_encode(salt, sizeof(salt));
-	manifest->bundle_verity_hash = r_hex_encode(hash, sizeof(hash));
-	manifest->bundle_verity_size = verity_size;
+	if (g_rename(deltapath, imagepath) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to replace %s with delta image: %s", image->filename, g_strerror(err));
+		goto fail;
+	}
+
+	r_replace_strdup(&image->delta_base, base->digest);
+
+	g_message("Created delta image for %s (%"G_GUINT32_FORMAT " of %"G_GUINT32_FORMAT " chunks included)",
+			image->filename, included, index->count);
 
 	return TRUE;
+
+fail:
+	g_unlink(deltapath);
+	return FALSE;
 }
 
-static gboolean append_signature_to_bundle(const gchar *bundlename, GBytes *sig, GError **error)
+/**
+ * Converts all images with a block-hash-index to delta images against the
+ * images for the same slot class in the base bundle.
+ */
+static gboolean generate_delta_images(RaucManifest *manifest, const gchar *dir, const gchar *basepath, GError **error)
 {
-	g_autoptr(GFile) bundlefile = NULL;
-	g_autoptr(GFileIOStream) bundlestream = NULL;
-	GOutputStream *bundleoutstream = NULL; /* owned by the bundle stream */
 	GError *ierror = NULL;
-	guint64 offset;
+	g_autoptr(GHashTable) bases = NULL;
 
-	g_return_val_if_fail(bundlename, FALSE);
-	g_return_val_if_fail(sig, FALSE);
+	g_return_val_if_fail(manifest, FALSE);
+	g_return_val_if_fail(dir, FALSE);
+	g_return_val_if_fail(basepath, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
-	bundlefile = g_file_new_for_path(bundlename);
-	bundlestream = g_file_open_readwrite(bundlefile, NULL, &ierror);
-	if (bundlestream == NULL) {
-		g_propagate_prefixed_error(
-				error,
-				ierror,
-				"failed to open bundle for signing: ");
+	bases = load_delta_base(basepath, &ierror);
+	if (!bases) {
+		g_propagate_error(error, ierror);
 		return FALSE;
 	}
 
-	bundleoutstream = g_io_stream_get_output_stream(G_IO_STREAM(bundlestream));
+	for (GList *elem = manifest->images; elem != NULL; elem = elem->next) {
+		RaucImage *image = elem->data;
+		g_autofree gchar *key = NULL;
+		const DeltaBase *base = NULL;
+
+		if (!image->adaptive || !g_strv_contains((const gchar * const *)image->adaptive, "block-hash-index"))
+			continue;
+
+		if (g_strv_contains((const gchar * const *)image->adaptive, "chunk-pack")) {
+			g_set_error(error, R_BUNDLE_ERROR, R_BUNDLE_ERROR_PAYLOAD,
+					"Adaptive method chunk-pack for %s cannot be used with a delta base", image->filename);
+			return FALSE;
+		}
+
+		key = delta_base_key(image);
+		base = g_hash_table_lookup(bases, key);
+		if (!base) {
+			g_message("No block-hash-index for %s in delta base, including complete image", image->filename);
+			continue;
+		}
+
+		if (!generate_delta_image(image, dir, base, &ierror)) {
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static gchar *convert_tar_extract(RaucImage *image, const gchar *dir, const gchar *fakeroot, GError **error)
+{
+	GError *ierror = NULL;
+
+	g_return_val_if_fail(image, NULL);
+	g_return_val_if_fail(dir, NULL);
+	g_return_val_if_fail(error == NULL || *error == NULL, NULL);
+
+	g_autofree gchar *file_path = g_build_filename(dir, image->filename, NULL);
+	g_autofree gchar *converted = g_strdup_printf("%s.extracted", image->filename);
+	g_autofree gchar *converted_path = g_build_filename(dir, converted, NULL);
+
+	if (g_mkdir(converted_path, S_IRWXU)) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"failed to create directory '%s': %s", converted_path, g_strerror(err));
+		return NULL;
+	}
+
+	g_autoptr(GPtrArray) args = g_ptr_array_new_full(10, g_free);
+	r_fakeroot_add_args(args, fakeroot);
+
+	g_ptr_array_add(args, g_strdup("tar"));
+	g_ptr_array_add(args, g_strdup("--numeric-owner"));
+	// TODO add support for --acl --selinux --xattrs via fakeroot or pseudo
+	g_ptr_array_add(args, g_strdup("-xf"));
+	g_ptr_array_add(args, g_strdup(file_path));
+	g_ptr_array_add(args, g_strdup("-C"));
+	g_ptr_array_add(args, g_strdup(converted_path));
+	g_ptr_array_add(args, NULL);
+
+	if (!r_subprocess_runv(args, G_SUBPROCESS_FLAGS_NONE, &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "failed to run tar extract: ");
+		return NULL;
+	}
+
+	return g_steal_pointer(&converted);
+}
+
+#if ENABLE_COMPOSEFS == 1
+static gchar *convert_composefs(RaucImage *image, const gchar *dir, const gchar *tar_extracted_path, const gchar *fakeroot, GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(GPtrArray) args = g_ptr_array_new_full(10, g_free);
+
+	g_return_val_if_fail(image, NULL);
+	g_return_val_if_fail(dir, NULL);
+	g_return_val_if_fail(tar_extracted_path, NULL);
+	g_return_val_if_fail(error == NULL || *error == NULL, NULL);
+
+	g_autofree gchar *converted = g_strdup_printf("%s.cfs", image->filename);
+	g_autofree gchar *converted_path = g_build_filename(dir, converted, NULL);
+	g_autofree gchar *converted_image_path = g_build_filename(converted_path, "image.cfs", NULL);
+	g_autofree gchar *store_path = g_build_filename(dir, ".rauc-cfs-store", NULL);
+
+	/* Create a directory in the bundle so we can keep additional metadata, like
+	 * a signature over the image digest.
+	 */
+	if (g_mkdir(converted_path, S_IRWXU)) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"failed to create directory '%s': %s", converted_path, g_strerror(err));
+		return NULL;
+	}
+
+	if (g_mkdir_with_parents(store_path, S_IRWXU)) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"failed to create directory '%s': %s", store_path, g_strerror(err));
+		return NULL;
+	}
+
+	r_fakeroot_add_args(args, fakeroot);
+
+	g_ptr_array_add(args, g_strdup("mkcomposefs"));
+	g_ptr_array_add(args, g_strdup_printf("--digest-store=%s", store_path));
+	/* TODO mkcomposefs fails to read xattrs from broken symlinks under pseudo. */
+	g_ptr_array_add(args, g_strdup("--skip-xattrs"));
+	g_ptr_array_add(args, g_strdup(tar_extracted_path));
+	g_ptr_array_add(args, g_strdup(converted_image_path));
+	g_ptr_array_add(args, NULL);
+
+	if (!r_subprocess_runv(args, G_SUBPROCESS_FLAGS_NONE, &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "failed to run mkcomposefs: ");
+		return NULL;
+	}
+
+	return g_steal_pointer(&converted);
+}
+#endif
+
+static gboolean convert_images(RaucManifest *manifest, const gchar *dir, const gchar *fakeroot, GError **error)
+{
+	GError *ierror = NULL;
+
+	g_return_val_if_fail(manifest, FALSE);
+	g_return_val_if_fail(dir, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	for (GList *elem = manifest->images; elem != NULL; elem = elem->next) {
+		RaucImage *image = elem->data;
+
+		if (image->converted && image->converted->len == 0) {
+			g_set_error(
+					error,
+					R_BUNDLE_ERROR,
+					R_BUNDLE_ERROR_PAYLOAD,
+					"Manifest already contains converted images for '%s'", image->slotclass);
+			return FALSE;
+		}
+
+		if (!image->convert)
+			continue;
+
+		g_autofree gchar *tar_extracted = NULL;
+		g_autofree gchar *tar_extracted_path = NULL;
+		/* extract tar early if we need it for other outputs */
+		if (g_strv_contains((const gchar * const *)image->convert, "tar-extract") ||
+		    g_strv_contains((const gchar * const *)image->convert, "composefs")) {
+			g_debug("extracting tar artifact image '%s'", image->filename);
+			tar_extracted = convert_tar_extract(image, dir, fakeroot, &ierror);
+			if (!tar_extracted) {
+				g_propagate_error(error, ierror);
+				return FALSE;
+			}
+			tar_extracted_path = g_build_filename(dir, tar_extracted, NULL);
+		}
+
+		/* Use a filename of bundle/<image-name>.extracted.digests, so that
+		 * unchanged files can be reused from the previous version when
+		 * installing. */
+		if (g_strv_contains((const gchar * const *)image->convert, "tar-extract")) {
+			g_autofree gchar *digests_path = g_strconcat(tar_extracted_path, ".digests", NULL);
+
+			if (!r_tree_digests_create(tar_extracted_path, digests_path, &ierror)) {
+				g_propagate_error(error, ierror);
+				return FALSE;
+			}
+		}
+
+		gboolean keep = FALSE;
+		g_autoptr(GPtrArray) converted = g_ptr_array_new_with_free_func(g_free);
+		for (gchar **method = image->convert; *method != NULL; method++) {
+			gchar *converted_filename = NULL;
+			if (g_str_equal(*method, "tar-extract")) {
+				converted_filename = g_strdup(tar_extracted);
+			} else if (g_str_equal(*method, "composefs")) {
+#if ENABLE_COMPOSEFS == 1
+				g_debug("converting '%s' to composefs image", tar_extracted_path);
+				converted_filename = convert_composefs(image, dir, tar_extracted_path, fakeroot, &ierror);
+				if (!converted_filename) {
+					g_propagate_error(error, ierror);
+					return FALSE;
+				}
+#else
+				g_set_error(error, R_BUNDLE_ERROR, R_BUNDLE_ERROR_UNSUPPORTED,
+						"Convert method 'composefs' not enabled, recompile with -Dcomposefs=enabled");
+				return FALSE;
+#endif
+			} else if (g_str_equal(*method, "keep")) {
+				g_debug("keeping input artifact image '%s'", image->filename);
+				keep = TRUE;
+				converted_filename = g_strdup(image->filename);
+			} else {
+				g_set_error(
+						error,
+						R_BUNDLE_ERROR,
+						R_BUNDLE_ERROR_PAYLOAD,
+						"Unsupported convert method: %s", *method);
+				return FALSE;
+			}
+
+			g_assert(converted_filename != NULL);
+			g_ptr_array_add(converted, converted_filename);
+		}
+
+		if (tar_extracted_path && !g_strv_contains((const gchar * const *)image->convert, "tar-extract")) {
+			if (!rm_tree(tar_extracted_path, &ierror)) {
+				g_propagate_prefixed_error(error, ierror, "Failed to remove files extacted from tar: ");
+				return FALSE;
+			}
+		}
+
+		if (!keep) {
+			g_autofree gchar *file_path = g_build_filename(dir, image->filename, NULL);
+			g_debug("removing input artifact image '%s' after conversion", image->filename);
+			if (g_unlink(file_path) != 0) {
+				int err = errno;
+				g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+						"Failed to remove input artifact image after conversion '%s': %s\n",
+						file_path, g_strerror(errno));
+				return FALSE;
+			}
+		}
+
+		g_clear_pointer(&image->converted, g_ptr_array_unref);
+		image->converted = g_steal_pointer(&converted);
+	}
+
+	return TRUE;
+}
+
+static gboolean output_stream_write_uint64_all(GOutputStream *stream,
+		guint64 data,
+		GCancellable *cancellable,
+		GError **error)
+{
+	gsize bytes_written;
+
+	data = GUINT64_TO_BE(data);
+	if (!g_output_stream_write_all(stream, &data, sizeof(data), &bytes_written,
+			cancellable, error))
+		return FALSE;
+
+	g_assert(bytes_written == sizeof(data));
+	return TRUE;
+}
+
+static gboolean input_stream_read_uint64_all(GInputStream *stream,
+		guint64 *data,
+		GCancellable *cancellable,
+		GError **error)
+{
+	guint64 tmp;
+	gsize bytes_read;
+
+	if (!g_input_stream_read_all(stream, &tmp, sizeof(tmp), &bytes_read,
+			cancellable, error))
+		return FALSE;
+
+	g_assert(bytes_read == sizeof(tmp));
+	*data = GUINT64_FROM_BE(tmp);
+	return TRUE;
+}
+
+static gboolean output_stream_write_bytes_all(GOutputStream *stream,
+		GBytes *bytes,
+		GCancellable *cancellable,
+		GError **error)
+{
+	const void *buffer;
+	gsize count, bytes_written;
+
+	buffer = g_bytes_get_data(bytes, &count);
+	return g_output_stream_write_all(stream, buffer, count, &bytes_written,
+			cancellable, error);
+}
+
+static gboolean input_stream_read_bytes_all(GInputStream *stream,
+		GBytes **bytes,
+		gsize count,
+		GCancellable *cancellable,
+		GError **error)
+{
+	g_autofree void *buffer = NULL;
+	gsize bytes_read;
+
+	g_assert_cmpint(count, !=, 0);
+
+	buffer = g_malloc0(count);
+
+	if (!g_input_stream_read_all(stream, buffer, count, &bytes_read,
+			cancellable, error)) {
+		return FALSE;
+	}
+
+	g_assert(bytes_read == count);
+	*bytes = g_bytes_new_take(g_steal_pointer(&buffer), count);
+	return TRUE;
+}
+
+static gboolean check_verity_data_size(guint64 offset, GError **error)
+{
+	if (offset % 4096 != 0) {
+		g_set_error(error,
+				R_BUNDLE_ERROR,
+				R_BUNDLE_ERROR_VERITY,
+				"squashfs size (%"G_GUINT64_FORMAT ") is not a multiple of 4096 bytes", offset);
+		return FALSE;
+	}
+	if (offset <= 4096) {
+		g_set_error(error,
+				R_BUNDLE_ERROR,
+				R_BUNDLE_ERROR_VERITY,
+				"squashfs size (%"G_GUINT64_FORMAT ") must be larger than 4096 bytes", offset);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean create_verity(const gchar *bundlename, RaucManifest *manifest, GError **error)
+{
+	g_autoptr(GFile) bundlefile = NULL;
+	g_autoptr(GFileIOStream) bundlestream = NULL;
+	GOutputStream *bundleoutstream = NULL; /* owned by the bundle stream */
+	GError *ierror = NULL;
+	guint64 offset;
+	int bundlefd = -1;
+	guint8 salt[32] = {0};
+	guint8 hash[32] = {0};
+	uint64_t combined_size = 0;
+	guint64 verity_size = 0;
+
+	g_return_val_if_fail(bundlename != NULL, FALSE);
+	g_return_val_if_fail(manifest != NULL, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	bundlefile = g_file_new_for_path(bundlename);
+	bundlestream = g_file_open_readwrite(bundlefile, NULL, &ierror);
+	if (bundlestream == NULL) {
+		g_propagate_prefixed_error(
+				error,
+				ierror,
+				"failed to open bundle for signing: ");
+		return FALSE;
+	}
+
+	bundleoutstream = g_io_stream_get_output_stream(G_IO_STREAM(bundlestream));
+	bundlefd = g_file_descriptor_based_get_fd(G_FILE_DESCRIPTOR_BASED(bundleoutstream));
+
+	/* check we have a clean manifest */
+	g_assert(manifest->bundle_verity_salt == NULL);
+	g_assert(manifest->bundle_verity_hash == NULL);
+	g_assert(manifest->bundle_verity_size == 0);
+
+	if (!g_seekable_seek(G_SEEKABLE(bundlestream),
+			0, G_SEEK_END, NULL, &ierror)) {
+		g_propagate_prefixed_error(
+				error,
+				ierror,
+				"failed to seek to end of bundle: ");
+		return FALSE;
+	}
+
+	offset = g_seekable_tell(G_SEEKABLE(bundlestream));
+	g_debug("Payload size: %" G_GUINT64_FORMAT " bytes.", offset);
+	/* dm-verity hash table generation */
+	if (RAND_bytes((unsigned char *)&salt, sizeof(salt)) != 1) {
+		g_set_error(error,
+				R_BUNDLE_ERROR,
+				R_BUNDLE_ERROR_VERITY,
+				"failed to generate verity salt");
+		return FALSE;
+	}
+	if (!check_verity_data_size(offset, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+	if (r_verity_hash_create(bundlefd, offset/4096, &combined_size, hash, salt) != 0) {
+		g_set_error(error,
+				R_BUNDLE_ERROR,
+				R_BUNDLE_ERROR_VERITY,
+				"failed to generate verity hash tree");
+		return FALSE;
+	}
+	/* for a squashfs <= 4096 bytes, we don't have a hash table */
+	g_assert(combined_size*4096 > (uint64_t)offset);
+	verity_size = combined_size*4096 - offset;
+	g_assert(verity_size % 4096 == 0);
+
+	manifest->bundle_verity_salt = r_hex_encode(salt, sizeof(salt));
+	manifest->bundle_verity_hash = r_hex_encode(hash, sizeof(hash));
+	manifest->bundle_verity_size = verity_size;
+
+	return TRUE;
+}
+
+/**
+ * Appends a verity hash tree, for which the data blocks were hashed while the
+ * payload was written, instead of reading the payload again as in
+ * create_verity().
+ */
+static gboolean append_verity_tree(const gchar *bundlename, RaucVerityTree *tree, const guint8 *salt, guint64 offset, RaucManifest *manifest, GError **error)
+{
+	g_auto(filedesc) fd = -1;
+	guint8 hash[32] = {0};
+	uint64_t hash_blocks = 0;
+	uint64_t read_blocks = 0;
+
+	g_return_val_if_fail(bundlename != NULL, FALSE);
+	g_return_val_if_fail(tree != NULL, FALSE);
+	g_return_val_if_fail(manifest != NULL, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	/* check we have a clean manifest */
+	g_assert(manifest->bundle_verity_salt == NULL);
+	g_assert(manifest->bundle_verity_hash == NULL);
+	g_assert(manifest->bundle_verity_size == 0);
+
+	fd = g_open(bundlename, O_RDWR | O_CLOEXEC, 0);
+	if (fd < 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"failed to open bundle for verity: %s", g_strerror(err));
+		return FALSE;
+	}
+
+	/* all blocks should have been hashed already, but fill any gaps */
+	if (r_verity_tree_fill(tree, fd, &read_blocks) != 0 ||
+	    r_verity_tree_write(tree, fd, offset, &hash_blocks, hash) != 0) {
+		g_set_error(error,
+				R_BUNDLE_ERROR,
+				R_BUNDLE_ERROR_VERITY,
+				"failed to generate verity hash tree");
+		return FALSE;
+	}
+	if (read_blocks)
+		g_debug("Read %"G_GUINT64_FORMAT " blocks for verity hash tree", read_blocks);
+
+	manifest->bundle_verity_salt = r_hex_encode(salt, 32);
+	manifest->bundle_verity_hash = r_hex_encode(hash, sizeof(hash));
+	manifest->bundle_verity_size = hash_blocks * 4096;
+
+	return TRUE;
+}
+
+static gboolean append_signature_to_bundle(const gchar *bundlename, GBytes *sig, GError **error)
+{
+	g_autoptr(GFile) bundlefile = NULL;
+	g_autoptr(GFileIOStream) bundlestream = NULL;
+	GOutputStream *bundleoutstream = NULL; /* owned by the bundle stream */
+	GError *ierror = NULL;
+	guint64 offset;
+
+	g_return_val_if_fail(bundlename, FALSE);
+	g_return_val_if_fail(sig, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	bundlefile = g_file_new_for_path(bundlename);
+	bundlestream = g_file_open_readwrite(bundlefile, NULL, &ierror);
+	if (bundlestream == NULL) {
+		g_propagate_prefixed_error(
+				error,
+				ierror,
+				"failed to open bundle for signing: ");
+		return FALSE;
+	}
+
+	bundleoutstream = g_io_stream_get_output_stream(G_IO_STREAM(bundlestream));
+
+	if (!g_seekable_seek(G_SEEKABLE(bundlestream),
+			0, G_SEEK_END, NULL, &ierror)) {
+		g_propagate_prefixed_error(
+				error,
+				ierror,
+				"failed to seek to end of bundle: ");
+		return FALSE;
+	}
+
+	offset = g_seekable_tell(G_SEEKABLE(bundlestream));
+	g_debug("Signature offset: %" G_GUINT64_FORMAT " bytes.", offset);
+	if (!output_stream_write_bytes_all(bundleoutstream, sig, NULL, &ierror)) {
+		g_propagate_prefixed_error(
+				error,
+				ierror,
+				"failed to append signature to bundle: ");
+		return FALSE;
+	}
+
+	offset = g_seekable_tell(G_SEEKABLE(bundlestream)) - offset;
+	if (offset > DEFAULT_MAX_BUNDLE_SIGNATURE_SIZE) {
+		g_autofree gchar* formatted_sigsize = g_format_size_full(offset, G_FORMAT_SIZE_IEC_UNITS);
+		g_autofree gchar* formatted_defaultsize = g_format_size_full(DEFAULT_MAX_BUNDLE_SIGNATURE_SIZE, G_FORMAT_SIZE_IEC_UNITS);
+		g_message("Resulting signature size of %s exceeds default of %s. Make sure to set 'max-bundle-signature-size' in your target's system.conf to a sufficiently high value.", formatted_sigsize, formatted_defaultsize);
+	}
+	if (!output_stream_write_uint64_all(bundleoutstream, offset, NULL, &ierror)) {
+		g_propagate_prefixed_error(
+				error,
+				ierror,
+				"failed to append signature size to bundle: ");
+		return FALSE;
+	}
+
+	offset = g_seekable_tell(G_SEEKABLE(bundlestream));
+	g_debug("Bundle size: %" G_GUINT64_FORMAT " bytes.", offset);
+
+	return TRUE;
+}
+
+static GBytes *generate_bundle_signature_with_key(const gchar *bundlename, RaucManifest *manifest, const gchar *certpath, const gchar *keypath, gchar **intermediatepaths, GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(GBytes) sig = NULL;
+
+	g_return_val_if_fail(bundlename, FALSE);
+	g_return_val_if_fail(manifest, FALSE);
+	g_return_val_if_fail(certpath, FALSE);
+	g_return_val_if_fail(keypath, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (manifest->bundle_format == R_MANIFEST_FORMAT_PLAIN) {
+		if (!check_manifest_internal(manifest, &ierror)) {
+			g_propagate_prefixed_error(
+					error,
+					ierror,
+					"cannot sign bundle containing inconsistent manifest: ");
+			return NULL;
+		}
+
+		sig = cms_sign_file(bundlename,
+				certpath,
+				keypath,
+				intermediatepaths,
+				&ierror);
+		if (sig == NULL) {
+			g_propagate_prefixed_error(
+					error,
+					ierror,
+					"failed to sign bundle: ");
+			return NULL;
+		}
+	} else if ((manifest->bundle_format == R_MANIFEST_FORMAT_VERITY) || (manifest->bundle_format == R_MANIFEST_FORMAT_CRYPT)) {
+		if (!check_manifest_external(manifest, &ierror)) {
+			g_propagate_prefixed_error(
+					error,
+					ierror,
+					"cannot sign inconsistent manifest: ");
+			return NULL;
+		}
+
+		sig = cms_sign_manifest(manifest,
+				certpath,
+				keypath,
+				intermediatepaths,
+				&ierror);
+		if (sig == NULL) {
+			g_propagate_prefixed_error(
+					error,
+					ierror,
+					"failed to sign manifest: ");
+			return NULL;
+		}
+	} else {
+		g_error("unsupported bundle format");
+		return NULL;
+	}
+
+	return g_steal_pointer(&sig);
+}
+
+static GBytes *generate_bundle_signature(const gchar *bundlename, RaucManifest *manifest, GError **error)
+{
+	g_assert_nonnull(r_context()->certpath);
+	g_assert_nonnull(r_context()->keypath);
+
+	return generate_bundle_signature_with_key(bundlename, manifest,
+			r_context()->certpath, r_context()->keypath, r_context()->intermediatepaths, error);
+}
+
+static gboolean sign_bundle(const gchar *bundlename, RaucManifest *manifest, GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(GBytes) sig = NULL;
+
+	g_return_val_if_fail(bundlename, FALSE);
+	g_return_val_if_fail(manifest, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	g_assert_nonnull(r_context()->certpath);
+	g_assert_nonnull(r_context()->keypath);
+
+	/* for crypt bundles, the verity data is created while encrypting */
+	if (((manifest->bundle_format == R_MANIFEST_FORMAT_VERITY) || (manifest->bundle_format == R_MANIFEST_FORMAT_CRYPT)) &&
+	    !manifest->bundle_verity_hash) {
+		if (!create_verity(bundlename, manifest, &ierror)) {
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
+	}
+
+	sig = generate_bundle_signature(bundlename, manifest, &ierror);
+	if (!sig) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	if (!append_signature_to_bundle(bundlename, sig, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean encrypt_bundle_payload(const gchar *bundlepath, RaucManifest *manifest, GError **error)
+{
+	gboolean res = FALSE;
+	guint8 key[32] = {0};
+	guint8 salt[32] = {0};
+	g_autoptr(RaucVerityTree) verity = NULL;
+	GStatBuf st = {0};
+	GError *ierror = NULL;
+
+	g_return_val_if_fail(bundlepath, FALSE);
+	g_return_val_if_fail(manifest, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	g_message("Encrypting bundle payload in aes-cbc-plain64 mode");
+
+	/* check we have a clean manifest */
+	g_assert(manifest->bundle_crypt_key == NULL);
+
+	if (RAND_bytes((unsigned char *)&key, sizeof(key)) != 1) {
+		g_set_error(error,
+				R_BUNDLE_ERROR,
+				R_BUNDLE_ERROR_CRYPT,
+				"Failed to generate crypt key");
+		res = FALSE;
+		goto out;
+	}
+
+	if (g_stat(bundlepath, &st) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to stat %s: %s", bundlepath, g_strerror(err));
+		res = FALSE;
+		goto out;
+	}
+	res = check_verity_data_size(st.st_size, &ierror);
+	if (!res) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
+	if (RAND_bytes((unsigned char *)&salt, sizeof(salt)) != 1) {
+		g_set_error(error,
+				R_BUNDLE_ERROR,
+				R_BUNDLE_ERROR_VERITY,
+				"failed to generate verity salt");
+		res = FALSE;
+		goto out;
+	}
+	verity = r_verity_tree_new(st.st_size / 4096, salt);
+	if (!verity) {
+		g_set_error(error,
+				R_BUNDLE_ERROR,
+				R_BUNDLE_ERROR_VERITY,
+				"failed to create verity hash tree");
+		res = FALSE;
+		goto out;
+	}
+
+	/* The payload is encrypted in place, which avoids a second copy of the
+	 * bundle on disk. The verity hash tree is built from the encrypted data
+	 * while it is written, so that the payload is not read again. On errors,
+	 * the incomplete bundle is removed by the caller. */
+	res = r_crypt_encrypt_in_place(bundlepath, key, verity, &ierror);
+	if (!res) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
+
+	manifest->bundle_crypt_key = r_hex_encode(key, sizeof(key));
+
+	res = append_verity_tree(bundlepath, verity, salt, st.st_size, manifest, &ierror);
+	if (!res) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
+
+	/* Uncomment for debugging purpose */
+	//g_message("encrypted image %s with key %s", bundlepath, manifest->bundle_crypt_key);
+
+out:
+	return res;
+}
+
+static gboolean decrypt_bundle_payload(RaucBundle *bundle, GError **error)
+{
+	gboolean res = FALSE;
+	GError *ierror = NULL;
+	g_autofree gchar *tmpdir = NULL;
+	g_autofree guint8 *key = NULL;
+	g_autofree gchar* decpath = NULL;
+	g_autoptr(GFile) decgfile = NULL;
+
+	g_return_val_if_fail(bundle, FALSE);
+	g_return_val_if_fail(bundle->manifest, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	tmpdir = g_dir_make_tmp("rauc-XXXXXX", &ierror);
+	if (tmpdir == NULL) {
+		g_propagate_prefixed_error(error, ierror, "Failed to create tmp dir: ");
+		res = FALSE;
+		goto out;
+	}
+	decpath = g_strconcat(tmpdir, "decrypted.raucb", NULL);
+
+	/* check we have a crypt key set in manifest */
+	g_assert(bundle->manifest->bundle_crypt_key != NULL);
+
+	/* Uncomment for debugging purpose */
+	//g_message("Decrypting with key: %s", manifest->bundle_crypt_key);
+	key = r_hex_decode(bundle->manifest->bundle_crypt_key, 32);
+	g_assert(key);
+
+	res = r_crypt_decrypt(bundle->path, decpath, key, bundle->size - bundle->manifest->bundle_verity_size, &ierror);
+	if (!res) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
+
+	g_message("decrypted image saved as %s", decpath);
+
+	/* let bundle->stream point to decrypted bundle */
+	g_object_unref(bundle->stream);
+	decgfile = g_file_new_for_path(decpath);
+	bundle->stream = G_INPUT_STREAM(g_file_read(decgfile, NULL, error));
+
+out:
+	/* Remove temporary bundle creation directory.
+	 * RAUC will still have access to the decrypted bundle via the opened GFile */
+	if (tmpdir) {
+		g_autoptr(GError) tmperror = NULL;
+		if (!rm_tree(tmpdir, &tmperror)) {
+			g_warning("Failed to remove bundle decryption tmpdir %s: %s", tmpdir, tmperror->message);
+		}
+	}
+
+	return res;
+}
+
+static gboolean check_workdir_content(const gchar *path, GError **error)
+{
+	GError *ierror = NULL;
+	g_autofree gchar *name = g_path_get_basename(path);
+
+	/* It's not clear what absolute or relative symlinks (with slashes)
+	 * in the bundle input should mean, so reject them. If you have a use
+	 * case for this, contact us. */
+	if (g_file_test(path, G_FILE_TEST_IS_SYMLINK)) {
+		g_autofree gchar *link_target = g_file_read_link(path, &ierror);
+		if (!link_target) {
+			g_propagate_prefixed_error(error, ierror,
+					"failed to read symlink in bundle contents (%s): ", name);
+			return FALSE;
+		}
+
+		if (g_path_is_absolute(link_target)) {
+			g_set_error(error, R_BUNDLE_ERROR, R_BUNDLE_ERROR_PAYLOAD,
+					"absolute symlinks are not supported as bundle contents (%s)", name);
+			return FALSE;
+		}
+
+		if (strchr(link_target, '/')) {
+			g_set_error(error, R_BUNDLE_ERROR, R_BUNDLE_ERROR_PAYLOAD,
+					"symlinks containing slashes are not supported as bundle contents (%s)", name);
+			return FALSE;
+		}
+
+		/* Local symlinks in the same directory (containing no slashes) seem
+		 * harmless and can be useful in special cases for backwards
+		 * compatibility, so allow them. */
+
+		return TRUE;
+	}
+
+	/* Directories should not be needed in the bundle input, so reject
+	 * them. If you have a use case for this, contact us. */
+	if (g_file_test(path, G_FILE_TEST_IS_DIR)) {
+		g_set_error(error, R_BUNDLE_ERROR, R_BUNDLE_ERROR_PAYLOAD,
+				"directories are not supported as bundle contents (%s)", name);
+		return FALSE;
+	}
+
+	if (!g_file_test(path, G_FILE_TEST_IS_REGULAR)) {
+		g_set_error(error, R_BUNDLE_ERROR, R_BUNDLE_ERROR_PAYLOAD,
+				"only regular files are supported as bundle contents (%s)", name);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gchar *prepare_workdir(const gchar *contentdir, GError **error)
+{
+	GError *ierror = NULL;
+	g_autofree gchar* workdir = NULL;
+	g_autoptr(GDir) dir = NULL;
+	const gchar *name;
+
+	g_return_val_if_fail(contentdir, NULL);
+	g_return_val_if_fail(error == NULL || *error == NULL, NULL);
+
+	/* This could be simplified with g_canonicalize_file() after bumping the
+	 * glib requirement to 2.58. */
+	if (g_path_is_absolute(contentdir)) {
+		workdir = g_build_filename(contentdir, ".rauc-workdir", NULL);
+	} else {
+		g_autofree gchar* cwd = g_get_current_dir();
+		workdir = g_build_filename(cwd, contentdir, ".rauc-workdir", NULL);
+	}
+
+	if (g_file_test(workdir, G_FILE_TEST_EXISTS)) {
+		if (!rm_tree(workdir, &ierror)) {
+			g_propagate_prefixed_error(error, ierror, "Failed to remove old workdir: ");
+			return NULL;
+		}
+	}
+
+	if (g_mkdir(workdir, 0700) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"failed to create the workdir '%s': %s", workdir, g_strerror(err));
+		return NULL;
+	}
+
+	dir = g_dir_open(contentdir, 0, &ierror);
+	if (!dir) {
+		g_propagate_error(error, ierror);
+		return NULL;
+	}
+
+	while ((name = g_dir_read_name(dir))) {
+		g_autofree gchar *oldpath = NULL;
+		g_autofree gchar *newpath = NULL;
+
+		if (g_strcmp0(name, ".rauc-workdir") == 0)
+			continue;
+
+		oldpath = g_build_filename(contentdir, name, NULL);
+
+		if (!check_workdir_content(oldpath, &ierror)) {
+			g_propagate_error(error, ierror);
+			return NULL;
+		}
+
+		newpath = g_build_filename(workdir, name, NULL);
+
+		if (link(oldpath, newpath) != 0) {
+			int err = errno;
+			g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+					"failed to hard-link file '%s' to workdir: %s", name, g_strerror(err));
+			return NULL;
+		}
+	}
+
+	return g_steal_pointer(&workdir);
+}
+
+static gboolean needs_fakeroot(const RaucManifest *manifest, gboolean *mksquashfs_metadata)
+{
+	g_return_val_if_fail(manifest != NULL, FALSE);
+	g_return_val_if_fail(mksquashfs_metadata != NULL, FALSE);
+
+	*mksquashfs_metadata = FALSE;
+
+	gboolean may_need_fakeroot = FALSE;
+	for (GList *elem = manifest->images; elem != NULL; elem = elem->next) {
+		RaucImage *image = elem->data;
+
+		if (image->convert) {
+			if (g_strv_contains((const gchar * const *)image->convert, "tar-extract")) {
+				/* This produces files with metadata in the bundle itself. */
+				*mksquashfs_metadata = TRUE;
+				may_need_fakeroot = TRUE;
+			}
+			if (g_strv_contains((const gchar * const *)image->convert, "composefs")) {
+				/* The metadata is stored in the cfs image. */
+				may_need_fakeroot = TRUE;
+			}
+		}
+	}
+
+	if (!may_need_fakeroot)
+		return FALSE;
+
+	/* If pseudo is active, we don't need to use fakeroot. */
+	if (check_pseudo_active())
+		return FALSE;
+
+	/* When running as root, we don't need to use fakeroot. */
+	if (geteuid() == 0)
+		return FALSE;
+
+	return TRUE;
+}
+
+static void sort_file_add(GString *sort, const gchar *workdir, const gchar *filename, gint *priority)
+{
+	g_autofree gchar *path = NULL;
+
+	if (!filename)
+		return;
+
+	path = g_build_filename(workdir, filename, NULL);
+	/* directories and names which cannot be represented keep the default order */
+	if (!g_file_test(path, G_FILE_TEST_IS_REGULAR) || strpbrk(path, " \t\n\\"))
+		return;
+
+	g_string_append_printf(sort, "%s %d\n", path, (*priority)--);
+}
+
+gchar *streaming_sort_order(const RaucManifest *manifest, const gchar *workdir)
+{
+	g_autoptr(GString) sort = g_string_new(NULL);
+	gint priority = G_MAXINT16;
+
+	g_return_val_if_fail(manifest, NULL);
+	g_return_val_if_fail(workdir, NULL);
+
+	sort_file_add(sort, workdir, "manifest.raucm", &priority);
+	sort_file_add(sort, workdir, manifest->hook_name, &priority);
+	sort_file_add(sort, workdir, manifest->handler_name, &priority);
+
+	/* the hash prefixes are needed first to plan adaptive updates */
+	for (GList *l = manifest->images; l != NULL; l = l->next) {
+		const RaucImage *image = l->data;
+		g_autofree gchar *prefixname = g_strconcat(image->filename, ".block-hash-prefix", NULL);
+
+		sort_file_add(sort, workdir, prefixname, &priority);
+	}
+
+	for (GList *l = manifest->images; l != NULL; l = l->next) {
+		const RaucImage *image = l->data;
+		g_autofree gchar *indexname = g_strconcat(image->filename, ".block-hash-index", NULL);
 
-	if (!g_seekable_seek(G_SEEKABLE(bundlestream),
-			0, G_SEEK_END, NULL, &ierror)) {
-		g_propagate_prefixed_error(
-				error,
-				ierror,
-				"failed to seek to end of bundle: ");
-		return FALSE;
+		sort_file_add(sort, workdir, indexname, &priority);
 	}
 
-	offset = g_seekable_tell(G_SEEKABLE(bundlestream));
-	g_debug("Signature offset: %" G_GUINT64_FORMAT " bytes.", offset);
-	if (!output_stream_write_bytes_all(bundleoutstream, sig, NULL, &ierror)) {
-		g_propagate_prefixed_error(
-				error,
-				ierror,
-				"failed to append signature to bundle: ");
-		return FALSE;
-	}
+	for (GList *l = manifest->images; l != NULL; l = l->next) {
+		const RaucImage *image = l->data;
+		g_autofree gchar *packname = g_strconcat(image->filename, ".chunk-pack", NULL);
 
-	offset = g_seekable_tell(G_SEEKABLE(bundlestream)) - offset;
-	if (offset > DEFAULT_MAX_BUNDLE_SIGNATURE_SIZE) {
-		g_autofree gchar* formatted_sigsize = g_format_size_full(offset, G_FORMAT_SIZE_IEC_UNITS);
-		g_autofree gchar* formatted_defaultsize = g_format_size_full(DEFAULT_MAX_BUNDLE_SIGNATURE_SIZE, G_FORMAT_SIZE_IEC_UNITS);
-		g_message("Resulting signature size of %s exceeds default of %s. Make sure to set 'max-bundle-signature-size' in your target's system.conf to a sufficiently high value.", formatted_sigsize, formatted_defaultsize);
-	}
-	if (!output_stream_write_uint64_all(bundleoutstream, offset, NULL, &ierror)) {
-		g_propagate_prefixed_error(
-				error,
-				ierror,
-				"failed to append signature size to bundle: ");
-		return FALSE;
+		sort_file_add(sort, workdir, image->filename, &priority);
+		sort_file_add(sort, workdir, packname, &priority);
 	}
 
-	offset = g_seekable_tell(G_SEEKABLE(bundlestream));
-	g_debug("Bundle size: %" G_GUINT64_FORMAT " bytes.", offset);
-
-	return TRUE;
+	return g_string_free(g_steal_pointer(&sort), FALSE);
 }
 
-static GBytes *generate_bundle_signature(const gchar *bundlename, RaucManifest *manifest, GError **error)
+/**
+ * Writes a mksquashfs sort file for the streaming layout.
+ *
+ * See streaming_sort_order() for the resulting order.
+ *
+ * @param manifest manifest of the bundle
+ * @param workdir directory containing the bundle contents
+ * @param error return location for a GError, or NULL
+ *
+ * @return path of the temporary sort file, NULL on error
+ */
+static gchar *write_streaming_sort_file(const RaucManifest *manifest, const gchar *workdir, GError **error)
 {
 	GError *ierror = NULL;
-	g_autoptr(GBytes) sig = NULL;
-
-	g_return_val_if_fail(bundlename, FALSE);
-	g_return_val_if_fail(manifest, FALSE);
-	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
-
-	g_assert_nonnull(r_context()->certpath);
-	g_assert_nonnull(r_context()->keypath);
+	g_autofree gchar *sort = NULL;
+	g_autofree gchar *sortpath = NULL;
+	gint fd;
 
-	if (manifest->bundle_format == R_MANIFEST_FORMAT_PLAIN) {
-		if (!check_manifest_internal(manifest, &ierror)) {
-			g_propagate_prefixed_error(
-					error,
-					ierror,
-					"cannot sign bundle containing inconsistent manifest: ");
-			return NULL;
-		}
+	sort = streaming_sort_order(manifest, workdir);
 
-		sig = cms_sign_file(bundlename,
-				r_context()->certpath,
-				r_context()->keypath,
-				r_context()->intermediatepaths,
-				&ierror);
-		if (sig == NULL) {
-			g_propagate_prefixed_error(
-					error,
-					ierror,
-					"failed to sign bundle: ");
-			return NULL;
-		}
-	} else if ((manifest->bundle_format == R_MANIFEST_FORMAT_VERITY) || (manifest->bundle_format == R_MANIFEST_FORMAT_CRYPT)) {
-		if (!check_manifest_external(manifest, &ierror)) {
-			g_propagate_prefixed_error(
-					error,
-					ierror,
-					"cannot sign inconsistent manifest: ");
-			return NULL;
-		}
+	fd = g_file_open_tmp("rauc-sort-XXXXXX", &sortpath, &ierror);
+	if (fd < 0) {
+		g_propagate_prefixed_error(error, ierror, "Failed to create sort file: ");
+		return NULL;
+	}
+	g_close(fd, NULL);
 
-		sig = cms_sign_manifest(manifest,
-				r_context()->certpath,
-				r_context()->keypath,
-				r_context()->intermediatepaths,
-				&ierror);
-		if (sig == NULL) {
-			g_propagate_prefixed_error(
-					error,
-					ierror,
-					"failed to sign manifest: ");
-			return NULL;
-		}
-	} else {
-		g_error("unsupported bundle format");
+	if (!g_file_set_contents(sortpath, sort, -1, &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Failed to write sort file: ");
+		g_unlink(sortpath);
 		return NULL;
 	}
 
-	return g_steal_pointer(&sig);
+	return g_steal_pointer(&sortpath);
 }
 
-static gboolean sign_bundle(const gchar *bundlename, RaucManifest *manifest, GError **error)
+/**
+ * Builds the unsigned payload of a bundle from a content directory.
+ *
+ * For 'verity' bundles, the verity data is appended later by sign_bundle() or
+ * create_verity(). For 'crypt' bundles, it is appended while encrypting the
+ * payload. The output file is removed on error.
+ */
+static gboolean build_bundle_payload(const gchar *bundlename, const gchar *contentdir, RaucManifest **manifest_out, GError **error)
 {
 	GError *ierror = NULL;
-	g_autoptr(GBytes) sig = NULL;
+	g_autofree gchar* manifestpath = NULL;
+	g_autoptr(RaucManifest) manifest = NULL;
+	g_autofree gchar *workdir = NULL;
+	g_autofree gchar *fakeroot = NULL;
+	g_autofree gchar *sortfile = NULL;
+	gboolean streaming_layout = FALSE;
+	gboolean mksquashfs_metadata = FALSE;
+	gboolean res = FALSE;
 
-	g_return_val_if_fail(bundlename, FALSE);
-	g_return_val_if_fail(manifest, FALSE);
+	g_return_val_if_fail(bundlename != NULL, FALSE);
+	g_return_val_if_fail(contentdir != NULL, FALSE);
+	g_return_val_if_fail(manifest_out != NULL && *manifest_out == NULL, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
-	g_assert_nonnull(r_context()->certpath);
-	g_assert_nonnull(r_context()->keypath);
-
-	if ((manifest->bundle_format == R_MANIFEST_FORMAT_VERITY) || (manifest->bundle_format == R_MANIFEST_FORMAT_CRYPT)) {
-		if (!create_verity(bundlename, manifest, &ierror)) {
-			g_propagate_error(error, ierror);
-			return FALSE;
-		}
+	if (g_file_test(bundlename, G_FILE_TEST_EXISTS)) {
+		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_EXIST, "bundle %s already exists", bundlename);
+		return FALSE;
 	}
 
-	sig = generate_bundle_signature(bundlename, manifest, &ierror);
-	if (!sig) {
-		g_propagate_error(error, ierror);
+	if (g_strcmp0(r_context()->bundle_layout, "streaming") == 0) {
+		streaming_layout = TRUE;
+	} else if (r_context()->bundle_layout && g_strcmp0(r_context()->bundle_layout, "default") != 0) {
+		g_set_error(error, R_BUNDLE_ERROR, R_BUNDLE_ERROR_PAYLOAD,
+				"Unsupported bundle layout '%s'", r_context()->bundle_layout);
 		return FALSE;
 	}
 
-	if (!append_signature_to_bundle(bundlename, sig, &ierror)) {
+	workdir = prepare_workdir(contentdir, &ierror);
+	if (!workdir) {
 		g_propagate_error(error, ierror);
-		return FALSE;
+		goto out;
 	}
 
-	return TRUE;
-}
-
-static gchar* get_random_file_name(void)
-{
-	guint8 rand_bytes[8] = {0};
-
-	if (RAND_bytes((unsigned char *)&rand_bytes, sizeof(rand_bytes)) != 1)
-		g_error("Failed to generate random file name");
+	manifestpath = g_build_filename(workdir, "manifest.raucm", NULL);
+	res = load_manifest_file(manifestpath, &manifest, &ierror);
+	if (!res) {
+		g_propagate_prefixed_error(error, ierror,
+				"Failed to load manifest: ");
+		goto out;
+	}
 
-	return r_hex_encode(rand_bytes, sizeof(rand_bytes));
-}
+	g_print("Creating '%s' format bundle\n", r_manifest_bundle_format_to_str(manifest->bundle_format));
 
-static gboolean encrypt_bundle_payload(const gchar *bundlepath, RaucManifest *manifest, GError **error)
-{
-	gboolean res = FALSE;
-	guint8 key[32] = {0};
-	GError *ierror = NULL;
-	g_autofree gchar* dirname = NULL;
-	g_autofree gchar* tmpfilename = NULL;
-	g_autofree gchar* encpath = NULL;
+	res = check_manifest_input(manifest, &ierror);
+	if (!res) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
 
-	g_return_val_if_fail(bundlepath, FALSE);
-	g_return_val_if_fail(manifest, FALSE);
-	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+	/* print warnings collected while parsing */
+	for (guint i = 0; i < manifest->warnings->len; i++) {
+		g_print("%s\n", (gchar *)g_ptr_array_index(manifest->warnings, i));
+	}
 
-	g_message("Encrypting bundle payload in aes-cbc-plain64 mode");
+	res = check_manifest_create(manifest, &ierror);
+	if (!res) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
 
-	dirname = g_path_get_dirname(bundlepath);
-	tmpfilename = get_random_file_name();
-	encpath = g_build_filename(dirname, tmpfilename, NULL);
+	res = sync_manifest_with_contentdir(manifest, workdir, &ierror);
+	if (!res) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
 
-	/* check we have a clean manifest */
-	g_assert(manifest->bundle_crypt_key == NULL);
+	if (needs_fakeroot(manifest, &mksquashfs_metadata)) {
+		fakeroot = r_fakeroot_init(&ierror);
+		if (!fakeroot) {
+			g_propagate_error(error, ierror);
+			goto out;
+		}
+	}
 
-	if (RAND_bytes((unsigned char *)&key, sizeof(key)) != 1) {
-		g_set_error(error,
-				R_BUNDLE_ERROR,
-				R_BUNDLE_ERROR_CRYPT,
-				"Failed to generate crypt key");
+	if (r_context()->bundle_cache_dir &&
+	    g_mkdir_with_parents(r_context()->bundle_cache_dir, 0755) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to create build cache directory %s: %s", r_context()->bundle_cache_dir, g_strerror(err));
 		res = FALSE;
 		goto out;
 	}
 
-	res = r_crypt_encrypt(bundlepath, encpath, key, &ierror);
+	res = generate_adaptive_data(manifest, workdir, &ierror);
 	if (!res) {
 		g_propagate_error(error, ierror);
 		goto out;
 	}
 
-	manifest->bundle_crypt_key = r_hex_encode(key, sizeof(key));
-
-	/* Uncomment for debugging purpose */
-	//g_message("encrypted image saved as %s with key %s", encpath, manifest->bundle_crypt_key);
+	if (r_context()->bundle_delta_base) {
+		res = generate_delta_images(manifest, workdir, r_context()->bundle_delta_base, &ierror);
+		if (!res) {
+			g_propagate_error(error, ierror);
+			goto out;
+		}
+	}
 
-	if (g_rename(encpath, bundlepath) != 0) {
-		int err = errno;
-		g_set_error(error,
-				G_FILE_ERROR,
-				g_file_error_from_errno(err),
-				"Renaming %s to %s failed, aborting encryption: %s", encpath, bundlepath, g_strerror(err));
-		res = FALSE;
+	res = convert_images(manifest, workdir, fakeroot, &ierror);
+	if (!res) {
+		g_propagate_error(error, ierror);
 		goto out;
 	}
-	g_clear_pointer(&encpath, g_free); /* prevent removal */
 
-out:
-	/* Remove temporary bundle creation directory */
-	if (encpath)
-		if (g_remove(encpath) != 0)
-			g_warning("Failed to remove temporary encryption file %s", encpath);
+	res = save_manifest_file(manifestpath, manifest, &ierror);
+	if (!res) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
 
-	return res;
-}
+	if (streaming_layout) {
+		sortfile = write_streaming_sort_file(manifest, workdir, &ierror);
+		if (!sortfile) {
+			g_propagate_error(error, ierror);
+			res = FALSE;
+			goto out;
+		}
+	}
 
-static gboolean decrypt_bundle_payload(RaucBundle *bundle, GError **error)
-{
-	gboolean res = FALSE;
-	GError *ierror = NULL;
-	g_autofree gchar *tmpdir = NULL;
-	g_autofree guint8 *key = NULL;
-	g_autofree gchar* decpath = NULL;
-	g_autoptr(GFile) decgfile = NULL;
+	res = mksquashfs(bundlename, workdir, mksquashfs_metadata, fakeroot, sortfile, &ierror);
+	if (sortfile)
+		g_unlink(sortfile);
+	if (!res) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
 
-	g_return_val_if_fail(bundle, FALSE);
-	g_return_val_if_fail(bundle->manifest, FALSE);
-	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+	if (manifest->bundle_format == R_MANIFEST_FORMAT_CRYPT) {
+		res = encrypt_bundle_payload(bundlename, manifest, &ierror);
+		if (!res) {
+			g_propagate_error(error, ierror);
+			goto out;
+		}
+	}
 
-	tmpdir = g_dir_make_tmp("rauc-XXXXXX", &ierror);
-	if (tmpdir == NULL) {
-		g_propagate_prefixed_error(error, ierror, "Failed to create tmp dir: ");
+	if (workdir && !rm_tree(workdir, &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Failed to remove workdir: ");
 		res = FALSE;
 		goto out;
 	}
-	decpath = g_strconcat(tmpdir, "decrypted.raucb", NULL);
 
-	/* check we have a crypt key set in manifest */
-	g_assert(bundle->manifest->bundle_crypt_key != NULL);
+	*manifest_out = g_steal_pointer(&manifest);
+	res = TRUE;
+
+out:
+	/* Remove fakeroot env */
+	if (fakeroot) {
+		g_autofree GError *cleanup_error = NULL;
+		if (!r_fakeroot_cleanup(fakeroot, &cleanup_error)) {
+			g_warning("failed to clean up fakeroot environment: %s", cleanup_error->message);
+		}
+	}
+	/* Remove output file on error */
+	if (!res &&
+	    g_file_test(bundlename, G_FILE_TEST_IS_REGULAR))
+		if (g_remove(bundlename) != 0)
+			g_warning("failed to remove %s", bundlename);
+	return res;
+}
+
+gboolean create_bundle(const gchar *bundlename, const gchar *contentdir, GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(RaucManifest) manifest = NULL;
 
-	/* Uncomment for debugging purpose */
-	//g_message("Decrypting with key: %s", manifest->bundle_crypt_key);
-	key = r_hex_decode(bundle->manifest->bundle_crypt_key, 32);
-	g_assert(key);
+	g_return_val_if_fail(bundlename != NULL, FALSE);
+	g_return_val_if_fail(contentdir != NULL, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
-	res = r_crypt_decrypt(bundle->path, decpath, key, bundle->size - bundle->manifest->bundle_verity_size, &ierror);
-	if (!res) {
+	if (!build_bundle_payload(bundlename, contentdir, &manifest, &ierror)) {
 		g_propagate_error(error, ierror);
-		goto out;
+		return FALSE;
 	}
 
-	g_message("decrypted image saved as %s", decpath);
-
-	/* let bundle->stream point to decrypted bundle */
-	g_object_unref(bundle->stream);
-	decgfile = g_file_new_for_path(decpath);
-	bundle->stream = G_INPUT_STREAM(g_file_read(decgfile, NULL, error));
-
-out:
-	/* Remove temporary bundle creation directory.
-	 * RAUC will still have access to the decrypted bundle via the opened GFile */
-	if (tmpdir) {
-		g_autoptr(GError) tmperror = NULL;
-		if (!rm_tree(tmpdir, &tmperror)) {
-			g_warning("Failed to remove bundle decryption tmpdir %s: %s", tmpdir, tmperror->message);
-		}
+	if (!sign_bundle(bundlename, manifest, &ierror)) {
+		g_propagate_error(error, ierror);
+		if (g_remove(bundlename) != 0)
+			g_warning("failed to remove %s", bundlename);
+		return FALSE;
 	}
 
-	return res;
+	return TRUE;
 }
 
-static gboolean check_workdir_content(const gchar *path, GError **error)
+/**
+ * Copies the payload of a bundle (without the signature) to a new file.
+ *
+ * The data is reflinked if the filesystem supports it, otherwise it is copied
+ * with copy_file_range() in the kernel, so the cost of resigning a bundle
+ * does not depend on the payload size on filesystems with reflinks.
+ */
+static gboolean truncate_bundle(const gchar *inpath, const gchar *outpath, goffset size, GError **error)
 {
 	GError *ierror = NULL;
-	g_autofree gchar *name = g_path_get_basename(path);
-
-	/* It's not clear what absolute or relative symlinks (with slashes)
-	 * in the bundle input should mean, so reject them. If you have a use
-	 * case for this, contact us. */
-	if (g_file_test(path, G_FILE_TEST_IS_SYMLINK)) {
-		g_autofree gchar *link_target = g_file_read_link(path, &ierror);
-		if (!link_target) {
-			g_propagate_prefixed_error(error, ierror,
-					"failed to read symlink in bundle contents (%s): ", name);
-			return FALSE;
-		}
-
-		if (g_path_is_absolute(link_target)) {
-			g_set_error(error, R_BUNDLE_ERROR, R_BUNDLE_ERROR_PAYLOAD,
-					"absolute symlinks are not supported as bundle contents (%s)", name);
-			return FALSE;
-		}
+	g_auto(filedesc) in_fd = -1;
+	g_auto(filedesc) out_fd = -1;
 
-		if (strchr(link_target, '/')) {
-			g_set_error(error, R_BUNDLE_ERROR, R_BUNDLE_ERROR_PAYLOAD,
-					"symlinks containing slashes are not supported as bundle contents (%s)", name);
-			return FALSE;
-		}
+	g_return_val_if_fail(inpath != NULL, FALSE);
+	g_return_val_if_fail(outpath != NULL, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
-		/* Local symlinks in the same directory (containing no slashes) seem
-		 * harmless and can be useful in special cases for backwards
-		 * compatibility, so allow them. */
+	in_fd = g_open(inpath, O_RDONLY | O_CLOEXEC, 0);
+	if (in_fd < 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"failed to open bundle for reading: %s", g_strerror(err));
+		return FALSE;
+	}
 
-		return TRUE;
+	out_fd = g_open(outpath, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+	if (out_fd < 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"failed to open bundle for writing: %s", g_strerror(err));
+		return FALSE;
 	}
 
-	/* Directories should not be needed in the bundle input, so reject
-	 * them. If you have a use case for this, contact us. */
-	if (g_file_test(path, G_FILE_TEST_IS_DIR)) {
-		g_set_error(error, R_BUNDLE_ERROR, R_BUNDLE_ERROR_PAYLOAD,
-				"directories are not supported as bundle contents (%s)", name);
+	/* the old signature is copied as well, but is small compared to the payload */
+	if (!r_copy_fd_data(in_fd, out_fd, &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "failed to copy bundle: ");
 		return FALSE;
 	}
 
-	if (!g_file_test(path, G_FILE_TEST_IS_REGULAR)) {
-		g_set_error(error, R_BUNDLE_ERROR, R_BUNDLE_ERROR_PAYLOAD,
-				"only regular files are supported as bundle contents (%s)", name);
+	if (ftruncate(out_fd, size) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"failed to truncate bundle: %s", g_strerror(err));
 		return FALSE;
 	}
 
 	return TRUE;
 }
 
-static gchar *prepare_workdir(const gchar *contentdir, GError **error)
+/* maximum number of bundle payloads which are built concurrently */
+#define BUNDLE_BATCH_MAX_THREADS 4
+
+typedef struct {
+	gchar *certpath;
+	gchar *keypath;
+	gchar **intermediatepaths;
+} BatchSigner;
+
+static void batch_signer_free(BatchSigner *signer)
+{
+	g_free(signer->certpath);
+	g_free(signer->keypath);
+	g_strfreev(signer->intermediatepaths);
+	g_free(signer);
+}
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(BatchSigner, batch_signer_free);
+
+typedef struct {
+	gchar *name;
+	gchar *output;
+	const BatchSigner *signer; /* NULL to use the command line cert and key */
+} BatchBundle;
+
+static void batch_bundle_free(BatchBundle *bundle)
+{
+	g_free(bundle->name);
+	g_free(bundle->output);
+	g_free(bundle);
+}
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(BatchBundle, batch_bundle_free);
+
+/* All bundles built from the same input directory share one payload. */
+typedef struct {
+	gchar *input;
+	GPtrArray *bundles; /* BatchBundle */
+	RaucManifest *manifest;
+	goffset payload_size;
+	gboolean res;
+	GError *error;
+} BatchPayload;
+
+static void batch_payload_free(BatchPayload *payload)
+{
+	g_free(payload->input);
+	g_ptr_array_unref(payload->bundles);
+	g_clear_pointer(&payload->manifest, free_manifest);
+	g_clear_error(&payload->error);
+	g_free(payload);
+}
+
+static BatchSigner *parse_batch_signer(GKeyFile *key_file, const gchar *batchfile, const gchar *group, GError **error)
 {
 	GError *ierror = NULL;
-	g_autofree gchar* workdir = NULL;
-	g_autoptr(GDir) dir = NULL;
-	const gchar *name;
+	g_autoptr(BatchSigner) signer = g_new0(BatchSigner, 1);
+	g_auto(GStrv) intermediates = NULL;
+	gsize n_intermediates = 0;
 
-	g_return_val_if_fail(contentdir, NULL);
-	g_return_val_if_fail(error == NULL || *error == NULL, NULL);
+	signer->certpath = resolve_path_take(batchfile,
+			key_file_consume_string(key_file, group, "cert", &ierror));
+	if (!signer->certpath) {
+		g_propagate_error(error, ierror);
+		return NULL;
+	}
 
-	/* This could be simplified with g_canonicalize_file() after bumping the
-	 * glib requirement to 2.58. */
-	if (g_path_is_absolute(contentdir)) {
-		workdir = g_build_filename(contentdir, ".rauc-workdir", NULL);
-	} else {
-		g_autofree gchar* cwd = g_get_current_dir();
-		workdir = g_build_filename(cwd, contentdir, ".rauc-workdir", NULL);
+	signer->keypath = resolve_path_take(batchfile,
+			key_file_consume_string(key_file, group, "key", &ierror));
+	if (!signer->keypath) {
+		g_propagate_error(error, ierror);
+		return NULL;
 	}
 
-	if (g_file_test(workdir, G_FILE_TEST_EXISTS)) {
-		if (!rm_tree(workdir, &ierror)) {
-			g_propagate_prefixed_error(error, ierror, "Failed to remove old workdir: ");
-			return NULL;
-		}
+	intermediates = g_key_file_get_string_list(key_file, group, "intermediate", &n_intermediates, NULL);
+	if (intermediates) {
+		signer->intermediatepaths = g_new0(gchar *, n_intermediates + 1);
+		for (gsize i = 0; i < n_intermediates; i++)
+			signer->intermediatepaths[i] = resolve_path(batchfile, intermediates[i]);
 	}
+	g_key_file_remove_key(key_file, group, "intermediate", NULL);
 
-	if (g_mkdir(workdir, 0700) != 0) {
-		int err = errno;
-		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
-				"failed to create the workdir '%s': %s", workdir, g_strerror(err));
+	if (!check_remaining_keys(key_file, group, &ierror)) {
+		g_propagate_error(error, ierror);
 		return NULL;
 	}
+	g_key_file_remove_group(key_file, group, NULL);
 
-	dir = g_dir_open(contentdir, 0, &ierror);
-	if (!dir) {
-		g_propagate_error(error, ierror);
+	return g_steal_pointer(&signer);
+}
+
+/**
+ * Parses the batch file into a list of payloads with the bundles built from
+ * them.
+ */
+static GPtrArray *parse_batch_file(const gchar *batchfile, GHashTable *signers, GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(GKeyFile) key_file = g_key_file_new();
+	g_autoptr(GPtrArray) payloads = g_ptr_array_new_with_free_func((GDestroyNotify)batch_payload_free);
+	g_autoptr(GHashTable) inputs = g_hash_table_new(g_str_hash, g_str_equal);
+	g_autoptr(GHashTable) outputs = g_hash_table_new(g_str_hash, g_str_equal);
+	g_auto(GStrv) groups = NULL;
+
+	if (!g_key_file_load_from_file(key_file, batchfile, G_KEY_FILE_NONE, &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Failed to load batch file %s: ", batchfile);
 		return NULL;
 	}
 
-	while ((name = g_dir_read_name(dir))) {
-		g_autofree gchar *oldpath = NULL;
-		g_autofree gchar *newpath = NULL;
+	/* signers are referenced by the bundles, so parse them first */
+	groups = g_key_file_get_groups(key_file, NULL);
+	for (gchar **group = groups; *group; group++) {
+		BatchSigner *signer = NULL;
 
-		if (g_strcmp0(name, ".rauc-workdir") == 0)
+		if (!g_str_has_prefix(*group, "signer."))
 			continue;
 
-		oldpath = g_build_filename(contentdir, name, NULL);
+		signer = parse_batch_signer(key_file, batchfile, *group, &ierror);
+		if (!signer) {
+			g_propagate_error(error, ierror);
+			return NULL;
+		}
+		g_hash_table_insert(signers, g_strdup(*group + strlen("signer.")), signer);
+	}
 
-		if (!check_workdir_content(oldpath, &ierror)) {
+	for (gchar **group = groups; *group; group++) {
+		g_autoptr(BatchBundle) bundle = NULL;
+		g_autofree gchar *input = NULL;
+		g_autofree gchar *signer = NULL;
+		BatchPayload *payload = NULL;
+
+		if (!g_str_has_prefix(*group, "bundle."))
+			continue;
+
+		bundle = g_new0(BatchBundle, 1);
+		bundle->name = g_strdup(*group + strlen("bundle."));
+
+		input = resolve_path_take(batchfile,
+				key_file_consume_string(key_file, *group, "input", &ierror));
+		if (!input) {
 			g_propagate_error(error, ierror);
 			return NULL;
 		}
+		/* strip trailing slash for comparison */
+		if (g_str_has_suffix(input, "/"))
+			input[strlen(input)-1] = '\0';
 
-		newpath = g_build_filename(workdir, name, NULL);
+		bundle->output = resolve_path_take(batchfile,
+				key_file_consume_string(key_file, *group, "output", &ierror));
+		if (!bundle->output) {
+			g_propagate_error(error, ierror);
+			return NULL;
+		}
 
-		if (link(oldpath, newpath) != 0) {
-			int err = errno;
-			g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
-					"failed to hard-link file '%s' to workdir: %s", name, g_strerror(err));
+		if (g_hash_table_contains(outputs, bundle->output)) {
+			g_set_error(error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE,
+					"Output %s of bundle '%s' is used more than once", bundle->output, bundle->name);
 			return NULL;
 		}
+		if (g_file_test(bundle->output, G_FILE_TEST_EXISTS)) {
+			g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_EXIST, "bundle %s already exists", bundle->output);
+			return NULL;
+		}
+
+		signer = key_file_consume_string(key_file, *group, "signer", NULL);
+		if (signer) {
+			bundle->signer = g_hash_table_lookup(signers, signer);
+			if (!bundle->signer) {
+				g_set_error(error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE,
+						"Bundle '%s' refers to unknown signer '%s'", bundle->name, signer);
+				return NULL;
+			}
+		} else if (!r_context()->certpath || !r_context()->keypath) {
+			g_set_error(error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE,
+					"Bundle '%s' has no signer and no cert and key were given", bundle->name);
+			return NULL;
+		}
+
+		if (!check_remaining_keys(key_file, *group, &ierror)) {
+			g_propagate_error(error, ierror);
+			return NULL;
+		}
+		g_key_file_remove_group(key_file, *group, NULL);
+
+		payload = g_hash_table_lookup(inputs, input);
+		if (!payload) {
+			payload = g_new0(BatchPayload, 1);
+			payload->input = g_steal_pointer(&input);
+			payload->bundles = g_ptr_array_new_with_free_func((GDestroyNotify)batch_bundle_free);
+			g_hash_table_insert(inputs, payload->input, payload);
+			g_ptr_array_add(payloads, payload);
+		}
+		g_hash_table_add(outputs, bundle->output);
+		g_ptr_array_add(payload->bundles, g_steal_pointer(&bundle));
 	}
 
-	return g_steal_pointer(&workdir);
+	if (!check_remaining_groups(key_file, &ierror)) {
+		g_propagate_error(error, ierror);
+		return NULL;
+	}
+
+	if (!payloads->len) {
+		g_set_error(error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_GROUP_NOT_FOUND,
+				"No [bundle.<name>] section found in batch file %s", batchfile);
+		return NULL;
+	}
+
+	return g_steal_pointer(&payloads);
 }
 
-static gboolean needs_fakeroot(const RaucManifest *manifest, gboolean *mksquashfs_metadata)
+/**
+ * Builds the payload (including verity data) at the output of the first
+ * bundle. The other bundles are copied from it before signing.
+ */
+static void batch_payload_worker(gpointer data, gpointer user_data)
 {
-	g_return_val_if_fail(manifest != NULL, FALSE);
-	g_return_val_if_fail(mksquashfs_metadata != NULL, FALSE);
-
-	*mksquashfs_metadata = FALSE;
+	BatchPayload *payload = data;
+	const BatchBundle *first = g_ptr_array_index(payload->bundles, 0);
+	GStatBuf st = {0};
 
-	gboolean may_need_fakeroot = FALSE;
-	for (GList *elem = manifest->images; elem != NULL; elem = elem->next) {
-		RaucImage *image = elem->data;
+	/* the progress steps are not shared between threads */
+	r_context_set_progress_muted(TRUE);
 
-		if (image->convert) {
-			if (g_strv_contains((const gchar * const *)image->convert, "tar-extract")) {
-				/* This produces files with metadata in the bundle itself. */
-				*mksquashfs_metadata = TRUE;
-				may_need_fakeroot = TRUE;
-			}
-			if (g_strv_contains((const gchar * const *)image->convert, "composefs")) {
-				/* The metadata is stored in the cfs image. */
-				may_need_fakeroot = TRUE;
-			}
-		}
-	}
+	g_message("Building payload from %s for %u bundle(s)", payload->input, payload->bundles->len);
 
-	if (!may_need_fakeroot)
-		return FALSE;
+	payload->res = build_bundle_payload(first->output, payload->input, &payload->manifest, &payload->error);
+	if (!payload->res)
+		goto out;
 
-	/* If pseudo is active, we don't need to use fakeroot. */
-	if (check_pseudo_active())
-		return FALSE;
+	if (((payload->manifest->bundle_format == R_MANIFEST_FORMAT_VERITY) ||
+	     (payload->manifest->bundle_format == R_MANIFEST_FORMAT_CRYPT)) &&
+	    !payload->manifest->bundle_verity_hash) {
+		payload->res = create_verity(first->output, payload->manifest, &payload->error);
+		if (!payload->res)
+			goto out;
+	}
 
-	/* When running as root, we don't need to use fakeroot. */
-	if (geteuid() == 0)
-		return FALSE;
+	if (g_stat(first->output, &st) != 0) {
+		int err = errno;
+		g_set_error(&payload->error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to stat bundle %s: %s", first->output, g_strerror(err));
+		payload->res = FALSE;
+		goto out;
+	}
+	payload->payload_size = st.st_size;
 
-	return TRUE;
+out:
+	r_context_set_progress_muted(FALSE);
 }
 
-gboolean create_bundle(const gchar *bundlename, const gchar *contentdir, GError **error)
+static gboolean sign_batch_bundle(const BatchPayload *payload, const BatchBundle *bundle, GError **error)
 {
 	GError *ierror = NULL;
-	g_autofree gchar* manifestpath = NULL;
-	g_autoptr(RaucManifest) manifest = NULL;
-	g_autofree gchar *workdir = NULL;
-	g_autofree gchar *fakeroot = NULL;
-	gboolean mksquashfs_metadata = FALSE;
-	gboolean res = FALSE;
-
-	g_return_val_if_fail(bundlename != NULL, FALSE);
-	g_return_val_if_fail(contentdir != NULL, FALSE);
-	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+	g_autoptr(GBytes) sig = NULL;
 
-	if (g_file_test(bundlename, G_FILE_TEST_EXISTS)) {
-		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_EXIST, "bundle %s already exists", bundlename);
+	if (bundle->signer)
+		sig = generate_bundle_signature_with_key(bundle->output, payload->manifest,
+				bundle->signer->certpath, bundle->signer->keypath, bundle->signer->intermediatepaths, &ierror);
+	else
+		sig = generate_bundle_signature(bundle->output, payload->manifest, &ierror);
+	if (!sig) {
+		g_propagate_error(error, ierror);
 		return FALSE;
 	}
 
-	workdir = prepare_workdir(contentdir, &ierror);
-	if (!workdir) {
+	if (!append_signature_to_bundle(bundle->output, sig, &ierror)) {
 		g_propagate_error(error, ierror);
-		goto out;
+		return FALSE;
 	}
 
-	manifestpath = g_build_filename(workdir, "manifest.raucm", NULL);
-	res = load_manifest_file(manifestpath, &manifest, &ierror);
-	if (!res) {
-		g_propagate_prefixed_error(error, ierror,
-				"Failed to load manifest: ");
-		goto out;
-	}
+	g_print("Created bundle '%s' (%s)\n", bundle->name, bundle->output);
 
-	g_print("Creating '%s' format bundle\n", r_manifest_bundle_format_to_str(manifest->bundle_format));
+	return TRUE;
+}
 
-	res = check_manifest_input(manifest, &ierror);
-	if (!res) {
-		g_propagate_error(error, ierror);
-		goto out;
+static gboolean sign_batch_payload(const BatchPayload *payload, GError **error)
+{
+	GError *ierror = NULL;
+	const BatchBundle *first = g_ptr_array_index(payload->bundles, 0);
+
+	/* copy the unsigned payload before the first bundle gets its signature */
+	for (guint i = 1; i < payload->bundles->len; i++) {
+		const BatchBundle *bundle = g_ptr_array_index(payload->bundles, i);
+
+		if (!truncate_bundle(first->output, bundle->output, payload->payload_size, &ierror)) {
+			g_propagate_prefixed_error(error, ierror, "Failed to create bundle '%s': ", bundle->name);
+			return FALSE;
+		}
 	}
 
-	/* print warnings collected while parsing */
-	for (guint i = 0; i < manifest->warnings->len; i++) {
-		g_print("%s\n", (gchar *)g_ptr_array_index(manifest->warnings, i));
-	}
+	for (guint i = 0; i < payload->bundles->len; i++) {
+		const BatchBundle *bundle = g_ptr_array_index(payload->bundles, i);
 
-	res = check_manifest_create(manifest, &ierror);
-	if (!res) {
-		g_propagate_error(error, ierror);
-		goto out;
+		if (!sign_batch_bundle(payload, bundle, &ierror)) {
+			g_propagate_prefixed_error(error, ierror, "Failed to sign bundle '%s': ", bundle->name);
+			return FALSE;
+		}
 	}
 
-	res = sync_manifest_with_contentdir(manifest, workdir, &ierror);
-	if (!res) {
+	return TRUE;
+}
+
+gboolean create_bundle_batch(const gchar *batchfile, GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(GHashTable) signers = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)batch_signer_free);
+	g_autoptr(GPtrArray) payloads = NULL;
+	g_autofree gchar *tmp_cache_dir = NULL;
+	GThreadPool *pool = NULL;
+	guint n_threads;
+	gboolean res = FALSE;
+
+	g_return_val_if_fail(batchfile != NULL, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	payloads = parse_batch_file(batchfile, signers, &ierror);
+	if (!payloads) {
 		g_propagate_error(error, ierror);
-		goto out;
+		return FALSE;
 	}
 
-	if (needs_fakeroot(manifest, &mksquashfs_metadata)) {
-		fakeroot = r_fakeroot_init(&ierror);
-		if (!fakeroot) {
-			g_propagate_error(error, ierror);
-			goto out;
+	/* without an explicit build cache, a temporary one is used to share the
+	 * adaptive data of images used by several inputs */
+	if (!r_context()->bundle_cache_dir) {
+		tmp_cache_dir = g_dir_make_tmp("rauc-batch-cache-XXXXXX", &ierror);
+		if (!tmp_cache_dir) {
+			g_propagate_prefixed_error(error, ierror, "Failed to create build cache directory: ");
+			return FALSE;
 		}
+		r_context_conf()->bundle_cache_dir = tmp_cache_dir;
+		/* apply the change before the workers use r_context() */
+		r_context();
 	}
 
-	res = generate_adaptive_data(manifest, workdir, &ierror);
-	if (!res) {
-		g_propagate_error(error, ierror);
-		goto out;
-	}
+	n_threads = MIN(CLAMP(g_get_num_processors(), 1, BUNDLE_BATCH_MAX_THREADS), payloads->len);
+	g_print("Building %u payload(s) with %u thread(s)\n", payloads->len, n_threads);
 
-	res = convert_images(manifest, workdir, fakeroot, &ierror);
-	if (!res) {
-		g_propagate_error(error, ierror);
+	pool = g_thread_pool_new(batch_payload_worker, NULL, n_threads, FALSE, &ierror);
+	if (!pool) {
+		g_propagate_prefixed_error(error, ierror, "Failed to create bundle batch thread pool: ");
 		goto out;
 	}
 
-	res = save_manifest_file(manifestpath, manifest, &ierror);
-	if (!res) {
-		g_propagate_error(error, ierror);
-		goto out;
+	for (guint i = 0; i < payloads->len; i++) {
+		if (!g_thread_pool_push(pool, g_ptr_array_index(payloads, i), &ierror)) {
+			/* fall back to building in this thread */
+			g_debug("Failed to queue bundle payload job: %s", ierror->message);
+			g_clear_error(&ierror);
+			batch_payload_worker(g_ptr_array_index(payloads, i), NULL);
+		}
 	}
 
-	res = mksquashfs(bundlename, workdir, mksquashfs_metadata, fakeroot, &ierror);
-	if (!res) {
-		g_propagate_error(error, ierror);
-		goto out;
+	/* wait for all queued jobs to finish */
+	g_thread_pool_free(pool, FALSE, TRUE);
+
+	for (guint i = 0; i < payloads->len; i++) {
+		BatchPayload *payload = g_ptr_array_index(payloads, i);
+
+		if (!payload->res) {
+			g_propagate_prefixed_error(error, g_steal_pointer(&payload->error),
+					"Failed to build payload from %s: ", payload->input);
+			goto out;
+		}
 	}
 
-	if (manifest->bundle_format == R_MANIFEST_FORMAT_CRYPT) {
-		res = encrypt_bundle_payload(bundlename, manifest, &ierror);
-		if (!res) {
+	/* all signatures are created sequentially, with each key (and PKCS#11
+	 * session) loaded only once */
+	signature_set_key_cache(TRUE);
+	for (guint i = 0; i < payloads->len; i++) {
+		if (!sign_batch_payload(g_ptr_array_index(payloads, i), &ierror)) {
 			g_propagate_error(error, ierror);
 			goto out;
 		}
 	}
 
-	res = sign_bundle(bundlename, manifest, &ierror);
-	if (!res) {
-		g_propagate_error(error, ierror);
-		goto out;
-	}
+	res = TRUE;
+out:
+	signature_set_key_cache(FALSE);
 
-	if (workdir && !rm_tree(workdir, &ierror)) {
-		g_propagate_prefixed_error(error, ierror, "Failed to remove workdir: ");
-		goto out;
+	if (tmp_cache_dir) {
+		r_context_conf()->bundle_cache_dir = NULL;
+		if (!rm_tree(tmp_cache_dir, &ierror)) {
+			g_warning("Failed to remove temporary build cache: %s", ierror->message);
+			g_clear_error(&ierror);
+		}
 	}
 
-	res = TRUE;
+	/* a batch is only useful as a whole, so remove all outputs on error */
+	for (guint i = 0; !res && i < payloads->len; i++) {
+		BatchPayload *payload = g_ptr_array_index(payloads, i);
 
-out:
-	/* Remove fakeroot env */
-	if (fakeroot) {
-		g_autofree GError *cleanup_error = NULL;
-		if (!r_fakeroot_cleanup(fakeroot, &cleanup_error)) {
-			g_warning("failed to clean up fakeroot environment: %s", cleanup_error->message);
+		for (guint j = 0; j < payload->bundles->len; j++) {
+			const BatchBundle *bundle = g_ptr_array_index(payload->bundles, j);
+
+			if (g_file_test(bundle->output, G_FILE_TEST_IS_REGULAR) &&
+			    g_remove(bundle->output) != 0)
+				g_warning("failed to remove %s", bundle->output);
 		}
 	}
-	/* Remove output file on error */
-	if (!res &&
-	    g_file_test(bundlename, G_FILE_TEST_IS_REGULAR))
-		if (g_remove(bundlename) != 0)
-			g_warning("failed to remove %s", bundlename);
+
 	return res;
 }
 
-static gboolean truncate_bundle(const gchar *inpath, const gchar *outpath, goffset size, GError **error)
+/**
+ * Checks whether the output path refers to the bundle file itself, in which
+ * case the signature is replaced in place.
+ */
+static gboolean is_bundle_file(const RaucBundle *bundle, const gchar *outpath)
 {
-	g_autoptr(GFile) infile = NULL;
-	g_autoptr(GFile) outfile = NULL;
-	g_autoptr(GFileInputStream) instream = NULL;
-	g_autoptr(GFileOutputStream) outstream = NULL;
-	GError *ierror = NULL;
-	gboolean res = FALSE;
-	gssize ssize;
+	GStatBuf outst = {0};
+	struct stat bundlest = {0};
 
-	g_return_val_if_fail(inpath != NULL, FALSE);
-	g_return_val_if_fail(outpath != NULL, FALSE);
-	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+	if (!bundle->stream)
+		return FALSE;
 
-	infile = g_file_new_for_path(inpath);
-	outfile = g_file_new_for_path(outpath);
+	if (g_stat(outpath, &outst) != 0)
+		return FALSE;
 
-	instream = g_file_read(infile, NULL, &ierror);
-	if (instream == NULL) {
-		g_propagate_prefixed_error(
-				error,
-				ierror,
-				"failed to open bundle for reading: ");
+	if (fstat(g_file_descriptor_based_get_fd(G_FILE_DESCRIPTOR_BASED(bundle->stream)), &bundlest) != 0)
 		return FALSE;
+
+	return outst.st_dev == bundlest.st_dev && outst.st_ino == bundlest.st_ino;
+}
+
+/**
+ * Removes the signature of the bundle file in place.
+ *
+ * @param bundle bundle to truncate
+ * @param error return location for a GError, or NULL
+ *
+ * @return the removed signature data (for restore_bundle_signature()) or NULL on error
+ */
+static GBytes *truncate_bundle_in_place(const RaucBundle *bundle, GError **error)
+{
+	GError *ierror = NULL;
+	g_auto(filedesc) fd = -1;
+	g_autofree guint8 *trailer = NULL;
+	struct stat st = {0};
+	gsize len;
+
+	fd = g_open(bundle->path, O_RDWR | O_CLOEXEC, 0);
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"failed to open bundle for writing: %s", g_strerror(err));
+		return NULL;
 	}
-	outstream = g_file_create(outfile, G_FILE_CREATE_NONE, NULL,
-			&ierror);
-	if (outstream == NULL) {
-		g_propagate_prefixed_error(
-				error,
-				ierror,
-				"failed to open bundle for writing: ");
-		return FALSE;
+
+	if (st.st_size < bundle->size) {
+		g_set_error(error, R_BUNDLE_ERROR, R_BUNDLE_ERROR_SIGNATURE,
+				"unexpected signature size in bundle");
+		return NULL;
 	}
 
-	ssize = g_output_stream_splice(
-			(GOutputStream*)outstream,
-			(GInputStream*)instream,
-			G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE,
-			NULL, &ierror);
-	if (ssize == -1) {
-		g_propagate_error(error, ierror);
-		return FALSE;
+	len = st.st_size - bundle->size;
+	trailer = g_malloc(len);
+	if (!r_pread_exact(fd, trailer, len, bundle->size, &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "failed to read signature: ");
+		return NULL;
 	}
 
-	res = g_seekable_truncate(G_SEEKABLE(outstream), size, NULL, &ierror);
-	if (!res) {
-		g_propagate_error(error, ierror);
-		return FALSE;
+	if (ftruncate(fd, bundle->size) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"failed to truncate bundle: %s", g_strerror(err));
+		return NULL;
 	}
 
-	return TRUE;
+	return g_bytes_new_take(g_steal_pointer(&trailer), len);
+}
+
+/**
+ * Restores the signature removed by truncate_bundle_in_place() after an error.
+ */
+static void restore_bundle_signature(const RaucBundle *bundle, GBytes *trailer)
+{
+	GError *ierror = NULL;
+	g_auto(filedesc) fd = -1;
+
+	fd = g_open(bundle->path, O_WRONLY | O_CLOEXEC, 0);
+	if (fd < 0 || ftruncate(fd, bundle->size) != 0) {
+		int err = errno;
+		g_warning("failed to restore signature of %s: %s", bundle->path, g_strerror(err));
+		return;
+	}
+
+	if (!r_pwrite_exact(fd, g_bytes_get_data(trailer, NULL), g_bytes_get_size(trailer), bundle->size, &ierror)) {
+		g_warning("failed to restore signature of %s: %s", bundle->path, ierror->message);
+		g_clear_error(&ierror);
+	}
 }
 
 gboolean resign_bundle(RaucBundle *bundle, const gchar *outpath, GError **error)
@@ -1442,12 +2826,15 @@ gboolean resign_bundle(RaucBundle *bundle, const gchar *outpath, GError **error)
 	GError *ierror = NULL;
 	gboolean res = FALSE;
 	g_autoptr(GBytes) sig = NULL;
+	g_autoptr(GBytes) old_sig = NULL;
+	gboolean in_place;
 
 	g_return_val_if_fail(bundle != NULL, FALSE);
 	g_return_val_if_fail(outpath != NULL, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
-	if (g_file_test(outpath, G_FILE_TEST_EXISTS)) {
+	in_place = is_bundle_file(bundle, outpath);
+	if (!in_place && g_file_test(outpath, G_FILE_TEST_EXISTS)) {
 		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_EXIST, "bundle %s already exists", outpath);
 		return FALSE;
 	}
@@ -1471,6 +2858,38 @@ gboolean resign_bundle(RaucBundle *bundle, const gchar *outpath, GError **error)
 
 	g_print("Resigning '%s' format bundle\n", r_manifest_bundle_format_to_str(manifest->bundle_format));
 
+	if (in_place) {
+		/* the signature of plain bundles covers the file, so it must be truncated first */
+		if (manifest->bundle_format == R_MANIFEST_FORMAT_PLAIN) {
+			g_set_error(error, R_BUNDLE_ERROR, R_BUNDLE_ERROR_UNSUPPORTED,
+					"Resigning 'plain' format bundles in place is not supported");
+			res = FALSE;
+			goto out;
+		}
+
+		/* sign before modifying the bundle, so that it stays intact on errors */
+		sig = generate_bundle_signature(bundle->path, manifest, &ierror);
+		if (!sig) {
+			g_propagate_error(error, ierror);
+			res = FALSE;
+			goto out;
+		}
+
+		old_sig = truncate_bundle_in_place(bundle, &ierror);
+		if (!old_sig) {
+			g_propagate_error(error, ierror);
+			res = FALSE;
+			goto out;
+		}
+
+		res = append_signature_to_bundle(bundle->path, sig, &ierror);
+		if (!res) {
+			g_propagate_error(error, ierror);
+			restore_bundle_signature(bundle, old_sig);
+		}
+		goto out;
+	}
+
 	res = truncate_bundle(bundle->path, outpath, bundle->size, &ierror);
 	if (!res) {
 		g_propagate_error(error, ierror);
@@ -1492,13 +2911,144 @@ gboolean resign_bundle(RaucBundle *bundle, const gchar *outpath, GError **error)
 
 out:
 	/* Remove output file on error */
-	if (!res &&
+	if (!res && !in_place &&
 	    g_file_test(outpath, G_FILE_TEST_IS_REGULAR))
 		if (g_remove(outpath) != 0)
 			g_warning("failed to remove %s", outpath);
 	return res;
 }
 
+/* maximum number of images converted to casync indexes concurrently */
+#define CASYNC_CONVERT_MAX_JOBS 8
+
+typedef struct {
+	RaucImage *image;
+	gchar *imgpath;
+	gchar *idxfile;
+	const gchar *contentdir;
+	const gchar *storepath;
+	gboolean res;
+	GError *error;
+} CasyncJob;
+
+static void casync_convert_worker(gpointer data, gpointer user_data)
+{
+	CasyncJob *job = data;
+	g_autofree gchar *idxpath = g_build_filename(job->contentdir, job->idxfile, NULL);
+	GStatBuf st = {0};
+	gint64 start = g_get_monotonic_time();
+	gdouble seconds;
+
+	if (image_is_archive(job->image)) {
+		g_message("Converting %s to casync directory tree idx %s", job->image->filename, job->idxfile);
+		job->res = casync_make_arch(idxpath, job->imgpath, job->storepath, &job->error);
+	} else {
+		g_message("Converting %s to casync blob idx %s", job->image->filename, job->idxfile);
+		job->res = casync_make_blob(idxpath, job->imgpath, job->storepath, &job->error);
+	}
+	if (!job->res)
+		return;
+
+	seconds = MAX((g_get_monotonic_time() - start) / (gdouble)G_USEC_PER_SEC, 0.001);
+	if (g_stat(job->imgpath, &st) == 0)
+		g_message("Converted %s in %.1fs (%.1f MiB/s)", job->image->filename, seconds,
+				st.st_size / seconds / (1024*1024));
+}
+
+static void casync_job_clear(CasyncJob *job)
+{
+	g_free(job->imgpath);
+	g_free(job->idxfile);
+	g_clear_error(&job->error);
+}
+
+/**
+ * Converts the images to casync indexes.
+ *
+ * The casync processes for the images are run concurrently by a bounded
+ * thread pool. They share the chunk store, as chunks are stored atomically
+ * under their content digest. The manifest is only updated after all
+ * conversions are done, in manifest order, so the result does not depend on
+ * the order in which the jobs finish.
+ */
+static gboolean convert_casync_images(RaucManifest *manifest, const gchar *contentdir, const gchar *storepath, const gchar **ignore_images, GError **error)
+{
+	GError *ierror = NULL;
+	CasyncJob *jobs = NULL;
+	GThreadPool *pool = NULL;
+	guint n_jobs = 0;
+	guint n_threads;
+	gboolean res = TRUE;
+
+	jobs = g_new0(CasyncJob, g_list_length(manifest->images));
+	for (GList *l = manifest->images; l != NULL; l = l->next) {
+		RaucImage *image = l->data;
+
+		if (!image->filename)
+			continue;
+
+		if (ignore_images && g_strv_contains(ignore_images, image->slotclass)) {
+			g_message("Skipping conversion of %s as requested", image->filename);
+			continue;
+		}
+
+		jobs[n_jobs].image = image;
+		jobs[n_jobs].imgpath = g_build_filename(contentdir, image->filename, NULL);
+		jobs[n_jobs].idxfile = g_strconcat(image->filename, image_is_archive(image) ? ".caidx" : ".caibx", NULL);
+		jobs[n_jobs].contentdir = contentdir;
+		jobs[n_jobs].storepath = storepath;
+		n_jobs++;
+	}
+
+	if (!n_jobs)
+		goto out;
+
+	n_threads = MIN(CLAMP(g_get_num_processors(), 1, CASYNC_CONVERT_MAX_JOBS), n_jobs);
+	pool = g_thread_pool_new(casync_convert_worker, NULL, n_threads, FALSE, &ierror);
+	if (!pool) {
+		g_propagate_prefixed_error(error, ierror, "Failed to create conversion thread pool: ");
+		res = FALSE;
+		goto out;
+	}
+
+	for (guint i = 0; i < n_jobs; i++) {
+		if (!g_thread_pool_push(pool, &jobs[i], &ierror)) {
+			/* fall back to converting in this thread */
+			g_debug("Failed to queue conversion job: %s", ierror->message);
+			g_clear_error(&ierror);
+			casync_convert_worker(&jobs[i], NULL);
+		}
+	}
+
+	/* wait for all queued jobs to finish */
+	g_thread_pool_free(pool, FALSE, TRUE);
+
+	for (guint i = 0; i < n_jobs; i++) {
+		if (!jobs[i].res) {
+			/* report the error of the first failed image in manifest order */
+			if (res)
+				g_propagate_error(error, g_steal_pointer(&jobs[i].error));
+			res = FALSE;
+			continue;
+		}
+
+		/* Rewrite manifest filename */
+		g_free(jobs[i].image->filename);
+		jobs[i].image->filename = g_steal_pointer(&jobs[i].idxfile);
+
+		/* Remove original file */
+		if (g_remove(jobs[i].imgpath) != 0) {
+			g_warning("failed to remove %s", jobs[i].imgpath);
+		}
+	}
+
+out:
+	for (guint i = 0; i < n_jobs; i++)
+		casync_job_clear(&jobs[i]);
+	g_free(jobs);
+	return res;
+}
+
 static gboolean convert_to_casync_bundle(RaucBundle *bundle, const gchar *outbundle, const gchar **ignore_images, GError **error)
 {
 	GError *ierror = NULL;
@@ -1555,56 +3105,10 @@ static gboolean convert_to_casync_bundle(RaucBundle *bundle, const gchar *outbun
 	g_clear_pointer(&manifest->bundle_verity_hash, g_free);
 	manifest->bundle_verity_size = 0;
 
-	/* Iterate over each image and convert */
-	for (GList *l = manifest->images; l != NULL; l = l->next) {
-		RaucImage *image = l->data;
-		g_autofree gchar *imgpath = NULL;
-		g_autofree gchar *idxfile = NULL;
-		g_autofree gchar *idxpath = NULL;
-
-		imgpath = g_build_filename(contentdir, image->filename, NULL);
-
-		if (!image->filename)
-			continue;
-
-		if (ignore_images && g_strv_contains(ignore_images, image->slotclass)) {
-			g_message("Skipping conversion of %s as requested", image->filename);
-			continue;
-		}
-
-		if (image_is_archive(image)) {
-			idxfile = g_strconcat(image->filename, ".caidx", NULL);
-			idxpath = g_build_filename(contentdir, idxfile, NULL);
-
-			g_message("Converting %s to casync directory tree idx %s", image->filename, idxfile);
-
-			res = casync_make_arch(idxpath, imgpath, storepath, &ierror);
-			if (!res) {
-				g_propagate_error(error, ierror);
-				goto out;
-			}
-		} else {
-			idxfile = g_strconcat(image->filename, ".caibx", NULL);
-			idxpath = g_build_filename(contentdir, idxfile, NULL);
-
-			g_message("Converting %s to casync blob idx %s", image->filename, idxfile);
-
-			/* Generate index for content */
-			res = casync_make_blob(idxpath, imgpath, storepath, &ierror);
-			if (!res) {
-				g_propagate_error(error, ierror);
-				goto out;
-			}
-		}
-
-		/* Rewrite manifest filename */
-		g_free(image->filename);
-		image->filename = g_steal_pointer(&idxfile);
-
-		/* Remove original file */
-		if (g_remove(imgpath) != 0) {
-			g_warning("failed to remove %s", imgpath);
-		}
+	res = convert_casync_images(manifest, contentdir, storepath, ignore_images, &ierror);
+	if (!res) {
+		g_propagate_error(error, ierror);
+		goto out;
 	}
 
 	/* Rewrite manifest to content/ dir */
@@ -1614,7 +3118,7 @@ static gboolean convert_to_casync_bundle(RaucBundle *bundle, const gchar *outbun
 		goto out;
 	}
 
-	res = mksquashfs(outbundle, contentdir, FALSE, NULL, &ierror);
+	res = mksquashfs(outbundle, contentdir, FALSE, NULL, NULL, &ierror);
 	if (!res) {
 		g_propagate_error(error, ierror);
 		goto out;
@@ -2170,7 +3674,10 @@ static gboolean open_remote_bundle(RaucBundle *bundle, GError **error)
 {
 	gboolean res = FALSE;
 	GError *ierror = NULL;
-	g_autofree void *buffer = NULL;
+	g_autoptr(GBytes) tail_bytes = NULL;
+	const guint8 *tail = NULL;
+	guint64 tail_size;
+	guint64 tail_offset;
 	guint64 sigsize;
 	guint64 offset;
 
@@ -2189,16 +3696,33 @@ static gboolean open_remote_bundle(RaucBundle *bundle, GError **error)
 		goto out;
 	}
 
-	offset = bundle->nbd_srv->data_size - sizeof(sigsize);
+	if (bundle->nbd_srv->tail && g_bytes_get_size(bundle->nbd_srv->tail) >= sizeof(sigsize)) {
+		/* the server already fetched the end of the bundle while
+		 * determining its size */
+		tail_bytes = g_bytes_ref(bundle->nbd_srv->tail);
+		tail_offset = bundle->nbd_srv->tail_offset;
+	} else {
+		guint8 *buffer;
 
-	res = r_nbd_read(bundle->nbd_srv->sock, (guint8*)&sigsize, sizeof(sigsize), offset, &ierror);
-	if (!res) {
-		g_propagate_prefixed_error(
-				error,
-				ierror,
-				"Failed to read signature size from bundle: ");
-		goto out;
+		/* read the end of the bundle, including the signature size */
+		tail_size = MIN(bundle->nbd_srv->data_size, RAUC_NBD_TAIL_SIZE);
+		tail_offset = bundle->nbd_srv->data_size - tail_size;
+		buffer = g_malloc(tail_size);
+		res = r_nbd_read(bundle->nbd_srv->sock, buffer, tail_size, tail_offset, &ierror);
+		if (!res) {
+			g_free(buffer);
+			g_propagate_prefixed_error(
+					error,
+					ierror,
+					"Failed to read signature size from bundle: ");
+			goto out;
+		}
+		tail_bytes = g_bytes_new_take(buffer, tail_size);
 	}
+	tail = g_bytes_get_data(tail_bytes, NULL);
+
+	offset = bundle->nbd_srv->data_size - sizeof(sigsize);
+	memcpy(&sigsize, tail + (offset - tail_offset), sizeof(sigsize));
 	sigsize = GUINT64_FROM_BE(sigsize);
 
 	if (sigsize == 0) {
@@ -2235,16 +3759,23 @@ static gboolean open_remote_bundle(RaucBundle *bundle, GError **error)
 	}
 	bundle->size = offset;
 
-	buffer = g_malloc0(sigsize);
-	res = r_nbd_read(bundle->nbd_srv->sock, buffer, sigsize, offset, &ierror);
-	if (!res) {
-		g_propagate_prefixed_error(
-				error,
-				ierror,
-				"Failed to read signature from bundle: ");
-		goto out;
+	if (offset >= tail_offset) {
+		/* the signature was already read together with its size */
+		bundle->sigdata = g_bytes_new_from_bytes(tail_bytes, offset - tail_offset, sigsize);
+	} else {
+		g_autofree void *buffer = g_malloc0(sigsize);
+
+		g_debug("Signature size (%"G_GUINT64_FORMAT ") exceeds initial read, reading again", sigsize);
+		res = r_nbd_read(bundle->nbd_srv->sock, buffer, sigsize, offset, &ierror);
+		if (!res) {
+			g_propagate_prefixed_error(
+					error,
+					ierror,
+					"Failed to read signature from bundle: ");
+			goto out;
+		}
+		bundle->sigdata = g_bytes_new_take(g_steal_pointer(&buffer), sigsize);
 	}
-	bundle->sigdata = g_bytes_new_take(g_steal_pointer(&buffer), sigsize);
 
 out:
 	return res;
@@ -2290,6 +3821,173 @@ static gboolean check_allowed_bundle_format(RaucManifest *manifest, GError **err
 	return TRUE;
 }
 
+gchar *r_bundle_fd_path(gint fd)
+{
+	return g_strdup_printf("/proc/self/fd/%d", fd);
+}
+
+/**
+ * Reads all data from a pipe or socket into a memfd and seals it against
+ * modification.
+ */
+static gint spool_to_memfd(gint fd, guint64 max_size, GError **error)
+{
+	g_autofree guint8 *buf = g_malloc(64*1024);
+	guint64 size = 0;
+	gint memfd;
+
+	memfd = memfd_create("rauc-bundle", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (memfd < 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to create memfd for bundle: %s", g_strerror(err));
+		return -1;
+	}
+
+	while (TRUE) {
+		ssize_t r = read(fd, buf, 64*1024);
+
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0) {
+			int err = errno;
+			g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+					"Failed to read bundle from file descriptor: %s", g_strerror(err));
+			goto fail;
+		}
+		if (r == 0)
+			break;
+
+		size += r;
+		if (max_size && size > max_size) {
+			g_set_error(error, R_BUNDLE_ERROR, R_BUNDLE_ERROR_PAYLOAD,
+					"Bundle exceeds maximum size of %"G_GUINT64_FORMAT " bytes", max_size);
+			goto fail;
+		}
+
+		if (!r_write_exact(memfd, buf, r, error))
+			goto fail;
+	}
+
+	if (fchmod(memfd, 0400) != 0 ||
+	    fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to seal bundle memfd: %s", g_strerror(err));
+		goto fail;
+	}
+
+	g_message("Received bundle of %"G_GUINT64_FORMAT " bytes", size);
+
+	return memfd;
+
+fail:
+	g_close(memfd, NULL);
+	return -1;
+}
+
+gint r_bundle_open_fd(gint fd, guint64 max_size, GError **error)
+{
+	g_auto(filedesc) spooled_fd = -1;
+	g_autofree gchar *path = NULL;
+	struct stat st = {};
+	gint bundle_fd;
+
+	g_return_val_if_fail(fd >= 0, -1);
+	g_return_val_if_fail(error == NULL || *error == NULL, -1);
+
+	if (fstat(fd, &st) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to fstat bundle file descriptor: %s", g_strerror(err));
+		return -1;
+	}
+
+	if (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode)) {
+		spooled_fd = spool_to_memfd(fd, max_size, error);
+		if (spooled_fd < 0)
+			return -1;
+		fd = spooled_fd;
+	} else if (!S_ISREG(st.st_mode)) {
+		g_set_error(error, R_BUNDLE_ERROR, R_BUNDLE_ERROR_UNSAFE,
+				"Unsupported bundle file descriptor type (mode 0%jo)", (uintmax_t)st.st_mode);
+		return -1;
+	}
+
+	/* Reopen read-only, so that no writable file descriptor of ours
+	 * remains (this is required by the exclusive access check). */
+	path = r_bundle_fd_path(fd);
+	bundle_fd = g_open(path, O_RDONLY | O_CLOEXEC, 0);
+	if (bundle_fd < 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to reopen bundle file descriptor: %s", g_strerror(err));
+		return -1;
+	}
+
+	return bundle_fd;
+}
+
+/* Returns the path to download a remote bundle to.
+ *
+ * With a data directory, the path only depends on the URL, so that an
+ * interrupted download is resumed by the next attempt. Partial downloads of
+ * other URLs are removed. Otherwise, a new temporary directory is created and
+ * returned in download_dir. */
+G_GNUC_UNUSED
+static gchar *prepare_download_path(const gchar *url, gchar **download_dir, GError **error)
+{
+	GError *ierror = NULL;
+	const gchar *data_directory = r_context()->config->data_directory;
+	g_autofree gchar *dir = NULL;
+	g_autofree gchar *filename = NULL;
+	g_autofree gchar *checksum = NULL;
+	g_autoptr(GDir) entries = NULL;
+	const gchar *entry;
+
+	g_return_val_if_fail(download_dir != NULL && *download_dir == NULL, NULL);
+
+	if (!data_directory) {
+		dir = g_dir_make_tmp("rauc-XXXXXX", &ierror);
+		if (dir == NULL) {
+			g_propagate_prefixed_error(error, ierror, "Failed to create tmp dir: ");
+			return NULL;
+		}
+		*download_dir = g_strdup(dir);
+		return g_build_filename(dir, "download.raucb", NULL);
+	}
+
+	dir = g_build_filename(data_directory, "downloads", NULL);
+	if (g_mkdir_with_parents(dir, 0700) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to create download directory %s: %s", dir, g_strerror(err));
+		return NULL;
+	}
+
+	checksum = g_compute_checksum_for_string(G_CHECKSUM_SHA256, url, -1);
+	filename = g_strconcat(checksum, ".raucb", NULL);
+
+	entries = g_dir_open(dir, 0, &ierror);
+	if (entries == NULL) {
+		g_propagate_prefixed_error(error, ierror, "Failed to open download directory: ");
+		return NULL;
+	}
+	while ((entry = g_dir_read_name(entries))) {
+		g_autofree gchar *path = NULL;
+
+		if (g_str_has_prefix(entry, filename))
+			continue;
+
+		path = g_build_filename(dir, entry, NULL);
+		g_debug("Removing stale download %s", path);
+		if (g_remove(path) != 0)
+			g_warning("Failed to remove stale download %s: %s", path, g_strerror(errno));
+	}
+
+	return g_build_filename(dir, filename, NULL);
+}
+
 gboolean check_bundle(const gchar *bundlename, RaucBundle **bundle, CheckBundleParams params, RaucBundleAccessArgs *access_args, GError **error)
 {
 	GError *ierror = NULL;
@@ -2305,7 +4003,10 @@ gboolean check_bundle(const gchar *bundlename, RaucBundle **bundle, CheckBundleP
 	g_return_val_if_fail(!(params & TRUE), FALSE); /* protect against passing TRUE as the params enum */
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
-	r_context_begin_step("check_bundle", "Checking bundle", verify);
+	bundlescheme = g_uri_parse_scheme(bundlename);
+	/* without streaming support, remote bundles are downloaded in a substep */
+	r_context_begin_step("check_bundle", "Checking bundle",
+			verify + (!ENABLE_STREAMING && ENABLE_NETWORK && is_remote_scheme(bundlescheme)));
 
 	if (verify && !r_context()->config->keyring_path && !r_context()->config->keyring_directory) {
 		g_set_error(error, R_BUNDLE_ERROR, R_BUNDLE_ERROR_KEYRING, "No keyring file or directory provided");
@@ -2316,7 +4017,6 @@ gboolean check_bundle(const gchar *bundlename, RaucBundle **bundle, CheckBundleP
 	ibundle->verification_disabled = !verify;
 
 	/* Download Bundle to temporary location if remote URI is given */
-	bundlescheme = g_uri_parse_scheme(bundlename);
 	if (is_remote_scheme(bundlescheme)) {
 #if ENABLE_STREAMING
 		ibundle->path = g_strdup(bundlename);
@@ -2330,8 +4030,10 @@ gboolean check_bundle(const gchar *bundlename, RaucBundle **bundle, CheckBundleP
 			ibundle->nbd_srv->tls_ca = g_strdup(access_args->tls_ca);
 			ibundle->nbd_srv->tls_no_verify = access_args->tls_no_verify;
 			ibundle->nbd_srv->headers = g_strdupv(access_args->http_headers);
+			ibundle->nbd_srv->mirrors = g_strdupv(access_args->mirrors);
 			if (access_args->http_info_headers)
 				ibundle->nbd_srv->info_headers = g_ptr_array_ref(access_args->http_info_headers);
+			ibundle->nbd_srv->rate_limit = access_args->rate_limit;
 		}
 		if (!ibundle->nbd_srv->tls_cert)
 			ibundle->nbd_srv->tls_cert = g_strdup(r_context()->config->streaming_tls_cert);
@@ -2339,26 +4041,35 @@ gboolean check_bundle(const gchar *bundlename, RaucBundle **bundle, CheckBundleP
 			ibundle->nbd_srv->tls_key = g_strdup(r_context()->config->streaming_tls_key);
 		if (!ibundle->nbd_srv->tls_ca)
 			ibundle->nbd_srv->tls_ca = g_strdup(r_context()->config->streaming_tls_ca);
+		ibundle->nbd_srv->cache_dir = g_strdup(r_context()->config->streaming_cache_directory);
+		ibundle->nbd_srv->cache_size = r_context()->config->streaming_cache_size;
+		ibundle->nbd_srv->connections = r_context()->config->streaming_connections;
+		ibundle->nbd_srv->tls_session_cache = g_strdup(r_context()->config->streaming_tls_session_cache);
 		res = r_nbd_start_server(ibundle->nbd_srv, &ierror);
 		if (!res) {
 			g_propagate_prefixed_error(error, ierror, "Failed to stream bundle %s: ", ibundle->path);
 			goto out;
 		}
 #elif ENABLE_NETWORK
-		g_autofree gchar *tmpdir = g_dir_make_tmp("rauc-XXXXXX", &ierror);
-		if (tmpdir == NULL) {
-			g_propagate_prefixed_error(error, ierror, "Failed to create tmp dir: ");
+		ibundle->path = prepare_download_path(bundlename, &ibundle->download_dir, &ierror);
+		if (ibundle->path == NULL) {
+			g_propagate_error(error, ierror);
 			res = FALSE;
 			goto out;
 		}
-
 		ibundle->origpath = g_strdup(bundlename);
-		ibundle->path = g_build_filename(tmpdir, "download.raucb", NULL);
 
 		g_message("Remote URI detected, downloading bundle to %s...", ibundle->path);
-		res = download_file(ibundle->path, ibundle->origpath, r_context()->config->max_bundle_download_size, &ierror);
+		r_context_begin_step("download_bundle", "Downloading bundle", 0);
+		res = download_file_with_mirrors(ibundle->path, ibundle->origpath,
+				access_args ? (const gchar *const *)access_args->mirrors : NULL,
+				r_context()->config->max_bundle_download_size, &ierror);
+		r_context_end_step("download_bundle", res);
 		if (!res) {
 			g_propagate_prefixed_error(error, ierror, "Failed to download bundle %s: ", ibundle->origpath);
+			/* keep a partial download at a stable path for the next attempt */
+			if (!ibundle->download_dir)
+				g_clear_pointer(&ibundle->path, g_free);
 			goto out;
 		}
 		g_debug("Downloaded temp bundle to %s", ibundle->path);
@@ -2451,20 +4162,24 @@ gboolean check_bundle(const gchar *bundlename, RaucBundle **bundle, CheckBundleP
 
 	if (verify) {
 		g_autoptr(CMS_ContentInfo) cms = NULL;
-		g_autoptr(X509_STORE) store = setup_x509_store(NULL, NULL, &ierror);
-		X509_VERIFY_PARAM *param = NULL;
+		g_autoptr(X509_STORE) store = NULL;
 		gboolean trust_env = (params & CHECK_BUNDLE_TRUST_ENV);
+
+		/* the shared store must not be modified */
+		if (params & CHECK_BUNDLE_NO_CHECK_TIME)
+			store = setup_x509_store(NULL, NULL, &ierror);
+		else
+			store = get_cached_x509_store(&ierror);
 		if (!store) {
 			g_propagate_error(error, ierror);
 			res = FALSE;
 			goto out;
 		}
-		param = X509_STORE_get0_param(store);
 
 		g_message("Verifying bundle signature... ");
 
 		if (params & CHECK_BUNDLE_NO_CHECK_TIME)
-			X509_VERIFY_PARAM_set_flags(param, X509_V_FLAG_NO_CHECK_TIME);
+			X509_VERIFY_PARAM_set_flags(X509_STORE_get0_param(store), X509_V_FLAG_NO_CHECK_TIME);
 
 		if (detached) {
 			int fd = g_file_descriptor_based_get_fd(G_FILE_DESCRIPTOR_BASED(ibundle->stream));
@@ -2624,17 +4339,20 @@ gboolean replace_signature(RaucBundle *bundle, const gchar *insig, const gchar *
 	RaucManifest *manifest = NULL; /* alias pointer, not to be freed */
 	g_autoptr(RaucBundle) outbundle = NULL;
 	g_autoptr(GBytes) sig = NULL;
+	g_autoptr(GBytes) old_sig = NULL;
 	gchar* keyringpath = NULL;
 	gchar* keyringdirectory = NULL;
 	GError *ierror = NULL;
 	gboolean res = FALSE;
+	gboolean in_place;
 
 	g_return_val_if_fail(bundle != NULL, FALSE);
 	g_return_val_if_fail(outpath != NULL, FALSE);
 	g_return_val_if_fail(insig != NULL, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
-	if (g_file_test(outpath, G_FILE_TEST_EXISTS)) {
+	in_place = is_bundle_file(bundle, outpath);
+	if (!in_place && g_file_test(outpath, G_FILE_TEST_EXISTS)) {
 		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_EXIST, "bundle %s already exists", outpath);
 		return FALSE;
 	}
@@ -2663,10 +4381,20 @@ gboolean replace_signature(RaucBundle *bundle, const gchar *insig, const gchar *
 		goto out;
 	}
 
-	res = truncate_bundle(bundle->path, outpath, bundle->size, &ierror);
-	if (!res) {
-		g_propagate_error(error, ierror);
-		goto out;
+	if (in_place) {
+		/* the old signature is restored if the new one cannot be verified */
+		old_sig = truncate_bundle_in_place(bundle, &ierror);
+		if (!old_sig) {
+			g_propagate_error(error, ierror);
+			res = FALSE;
+			goto out;
+		}
+	} else {
+		res = truncate_bundle(bundle->path, outpath, bundle->size, &ierror);
+		if (!res) {
+			g_propagate_error(error, ierror);
+			goto out;
+		}
 	}
 
 	res = append_signature_to_bundle(outpath, sig, &ierror);
@@ -2706,9 +4434,11 @@ gboolean replace_signature(RaucBundle *bundle, const gchar *insig, const gchar *
 
 	res = TRUE;
 out:
-	/* Remove output file on error */
-	if (!res &&
-	    g_file_test(outpath, G_FILE_TEST_IS_REGULAR))
+	/* Remove output file or restore the old signature on error */
+	if (!res && old_sig)
+		restore_bundle_signature(bundle, old_sig);
+	else if (!res && !in_place &&
+	         g_file_test(outpath, G_FILE_TEST_IS_REGULAR))
 		if (g_remove(outpath) != 0)
 			g_warning("failed to remove %s", outpath);
 
@@ -2860,11 +4590,80 @@ out:
 	return res;
 }
 
+/* size of the reads for the pre-check of dm devices */
+#define PRE_CHECK_BLOCK_SIZE (1024*1024)
+/* number of threads reading in parallel for the pre-check */
+#define PRE_CHECK_THREADS 4
+
+typedef struct {
+	const gchar *dev;
+	int fd;
+	goffset size;
+
+	GMutex lock; /* protects the fields below */
+	GCond cond;
+	goffset next; /* offset of the next block to read */
+	goffset done; /* bytes read successfully */
+	guint running; /* number of active threads */
+	GError *error; /* first error */
+} PreCheck;
+
+static gpointer pre_check_thread(gpointer data)
+{
+	PreCheck *check = data;
+	g_autofree guint8 *buf = g_malloc(PRE_CHECK_BLOCK_SIZE);
+
+	while (TRUE) {
+		GError *ierror = NULL;
+		goffset offset = 0;
+		gsize len = 0;
+
+		g_mutex_lock(&check->lock);
+		if (check->error || check->next >= check->size) {
+			check->running--;
+			g_cond_signal(&check->cond);
+			g_mutex_unlock(&check->lock);
+			break;
+		}
+		offset = check->next;
+		check->next += PRE_CHECK_BLOCK_SIZE;
+		g_mutex_unlock(&check->lock);
+
+		len = MIN(PRE_CHECK_BLOCK_SIZE, check->size - offset);
+
+		/* let the kernel fetch the block this thread will read next */
+		(void)posix_fadvise(check->fd, offset + PRE_CHECK_BLOCK_SIZE * PRE_CHECK_THREADS,
+				PRE_CHECK_BLOCK_SIZE, POSIX_FADV_WILLNEED);
+
+		if (!r_pread_exact(check->fd, buf, len, offset, &ierror)) {
+			g_prefix_error(&ierror,
+					"Check %s device failed between %"G_GOFFSET_FORMAT " and %"G_GOFFSET_FORMAT " bytes: ",
+					check->dev, offset, offset + (goffset)len);
+		}
+
+		g_mutex_lock(&check->lock);
+		if (ierror && !check->error)
+			check->error = g_steal_pointer(&ierror);
+		else
+			check->done += len;
+		g_cond_signal(&check->cond);
+		g_mutex_unlock(&check->lock);
+
+		g_clear_error(&ierror);
+	}
+
+	return NULL;
+}
+
+/* Reads the whole device using multiple threads with large reads, so that
+ * dm-verity or dm-crypt report corrupted data before the installation
+ * starts. */
 static gboolean read_complete_dm_device(gchar *dev, GError **error)
 {
-	const goffset chunk_size = 65536;
-	g_autofree void* buf = NULL;
-	ssize_t r;
+	PreCheck check = {0};
+	GThread *threads[PRE_CHECK_THREADS] = {0};
+	gint last_percent = 0;
+	gboolean res = FALSE;
 
 	g_return_val_if_fail(dev != NULL, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
@@ -2879,23 +4678,53 @@ static gboolean read_complete_dm_device(gchar *dev, GError **error)
 		return FALSE;
 	}
 
-	buf = g_malloc0(chunk_size);
+	check.dev = dev;
+	check.fd = fd;
+	check.size = lseek(fd, 0, SEEK_END);
+	if (check.size < 0) {
+		int err = errno;
+		g_set_error(error,
+				G_FILE_ERROR,
+				g_file_error_from_errno(err),
+				"Failed to get size of %s: %s", dev, g_strerror(err));
+		return FALSE;
+	}
+	(void)posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	g_mutex_init(&check.lock);
+	g_cond_init(&check.cond);
 
-	for (goffset chunk = 0;; chunk++) {
-		r = pread(fd, buf, chunk_size, chunk*chunk_size);
-		if (r == 0)
-			break;
-		else if (r < 0)	{
-			int err = errno;
-			g_set_error(error,
-					G_FILE_ERROR,
-					g_file_error_from_errno(err),
-					"Check %s device failed between %"G_GOFFSET_FORMAT " and %"G_GOFFSET_FORMAT " bytes with error: %s", dev, chunk*chunk_size, (chunk+1)*chunk_size, g_strerror(err));
-			return FALSE;
-		}
+	g_mutex_lock(&check.lock);
+	for (guint i = 0; i < PRE_CHECK_THREADS; i++) {
+		threads[i] = g_thread_new("pre-check", pre_check_thread, &check);
+		check.running++;
 	}
+	while (check.running) {
+		gint percent = 0;
 
-	return TRUE;
+		g_cond_wait(&check.cond, &check.lock);
+
+		percent = check.size ? check.done * 100 / check.size : 100;
+		if (percent / 10 > last_percent / 10 && !check.error)
+			g_message("Checked %d%% of %s", percent, dev);
+		last_percent = percent;
+	}
+	g_mutex_unlock(&check.lock);
+
+	for (guint i = 0; i < PRE_CHECK_THREADS; i++)
+		g_thread_join(threads[i]);
+
+	if (check.error) {
+		g_propagate_error(error, check.error);
+		res = FALSE;
+	} else {
+		res = TRUE;
+	}
+
+	g_cond_clear(&check.cond);
+	g_mutex_clear(&check.lock);
+
+	return res;
 }
 
 /*
@@ -2929,6 +4758,7 @@ static gboolean prepare_verity(RaucBundle *bundle, gchar *loopname, gchar* mount
 	dm_verity->data_size = bundle->size - bundle->manifest->bundle_verity_size;
 	dm_verity->root_digest = g_strdup(bundle->manifest->bundle_verity_hash);
 	dm_verity->salt = g_strdup(bundle->manifest->bundle_verity_salt);
+	r_dm_set_profile(dm_verity, r_context()->config->dm_profile);
 
 	res = r_dm_setup(dm_verity, &ierror);
 	if (!res) {
@@ -2997,6 +4827,7 @@ static gboolean prepare_crypt(RaucBundle *bundle, gchar *loopname, gchar* mount_
 	dm_verity->data_size = bundle->size - bundle->manifest->bundle_verity_size;
 	dm_verity->root_digest = g_strdup(bundle->manifest->bundle_verity_hash);
 	dm_verity->salt = g_strdup(bundle->manifest->bundle_verity_salt);
+	r_dm_set_profile(dm_verity, r_context()->config->dm_profile);
 
 	res = r_dm_setup(dm_verity, &ierror);
 	if (!res) {
@@ -3008,6 +4839,7 @@ static gboolean prepare_crypt(RaucBundle *bundle, gchar *loopname, gchar* mount_
 	dm_crypt->lower_dev = g_strdup(dm_verity->upper_dev);
 	dm_crypt->data_size = bundle->size - bundle->manifest->bundle_verity_size;
 	dm_crypt->key = g_strdup(bundle->manifest->bundle_crypt_key);
+	r_dm_set_profile(dm_crypt, r_context()->config->dm_profile);
 
 	res = r_dm_setup(dm_crypt, &ierror);
 	if (!res) {
@@ -3054,6 +4886,117 @@ static gboolean prepare_crypt(RaucBundle *bundle, gchar *loopname, gchar* mount_
 	return TRUE;
 }
 
+/* Squashfs superblock fields used for prefetching (little endian) */
+#define SQUASHFS_SUPERBLOCK_SIZE 96
+#define SQUASHFS_BYTES_USED_OFFSET 40
+#define SQUASHFS_INODE_TABLE_OFFSET 64
+
+/* Loads the dm-verity hash tree and the squashfs metadata of a streamed
+ * bundle into the NBD server with a few large parallel requests. Otherwise,
+ * the kernel fetches them with many small dependent reads while mounting the
+ * bundle and walking the directories. Failures are not fatal, as all data is
+ * still read on demand. */
+static void prefetch_bundle_metadata(RaucBundle *bundle)
+{
+	g_autoptr(GError) ierror = NULL;
+	gint sock = bundle->nbd_srv->sock;
+	guint64 verity_size = bundle->manifest->bundle_verity_size;
+	guint64 data_size = bundle->size - verity_size;
+	guint64 remaining = RAUC_NBD_PREFETCH_MAX;
+	RaucNBDRange ranges[2];
+	guint count = 0;
+	guint8 sb[SQUASHFS_SUPERBLOCK_SIZE];
+	guint32 magic;
+	guint64 bytes_used, inode_table_start;
+
+	if (verity_size && verity_size <= remaining) {
+		ranges[count].offset = data_size;
+		ranges[count].size = verity_size;
+		remaining -= verity_size;
+		count++;
+	}
+
+	/* the squashfs of crypt bundles is encrypted */
+	if (bundle->manifest->bundle_format == R_MANIFEST_FORMAT_VERITY && data_size >= 4096) {
+		ranges[count].offset = 0;
+		ranges[count].size = 4096;
+		/* the superblock is needed in any case, so only clamp the budget */
+		remaining -= MIN(remaining, 4096);
+		count++;
+	}
+
+	if (!r_nbd_prefetch(sock, ranges, count, &ierror)) {
+		g_message("Failed to prefetch bundle metadata: %s", ierror->message);
+		return;
+	}
+
+	if (bundle->manifest->bundle_format != R_MANIFEST_FORMAT_VERITY)
+		return;
+
+	/* answered from the prefetched first block */
+	if (!r_nbd_read(sock, sb, sizeof(sb), 0, &ierror)) {
+		g_message("Failed to read squashfs superblock: %s", ierror->message);
+		return;
+	}
+
+	memcpy(&magic, sb, sizeof(magic));
+	memcpy(&bytes_used, sb + SQUASHFS_BYTES_USED_OFFSET, sizeof(bytes_used));
+	memcpy(&inode_table_start, sb + SQUASHFS_INODE_TABLE_OFFSET, sizeof(inode_table_start));
+	magic = GUINT32_FROM_LE(magic);
+	bytes_used = GUINT64_FROM_LE(bytes_used);
+	inode_table_start = GUINT64_FROM_LE(inode_table_start);
+
+	if (magic != SQUASHFS_MAGIC || inode_table_start >= bytes_used || bytes_used > data_size)
+		return;
+
+	/* The inode, directory, fragment, export, id and xattr tables are
+	 * stored after the file data, up to the end of the filesystem. */
+	if (bytes_used - inode_table_start > remaining) {
+		g_message("Not prefetching %"G_GUINT64_FORMAT " bytes of squashfs metadata (too large)",
+				bytes_used - inode_table_start);
+		return;
+	}
+
+	ranges[0].offset = inode_table_start;
+	ranges[0].size = bytes_used - inode_table_start;
+	if (!r_nbd_prefetch(sock, ranges, 1, &ierror)) {
+		g_message("Failed to prefetch squashfs metadata: %s", ierror->message);
+		return;
+	}
+
+	g_debug("Prefetched %"G_GUINT64_FORMAT " bytes of squashfs metadata", ranges[0].size);
+}
+
+/* Hands the connections of the NBD server over to a new NBD device. */
+static gboolean setup_nbd_device(RaucBundle *bundle, GError **error)
+{
+	GError *ierror = NULL;
+
+	g_assert_nonnull(bundle->nbd_srv);
+	g_assert_null(bundle->nbd_dev);
+
+	bundle->nbd_dev = r_nbd_new_device();
+	bundle->nbd_dev->data_size = bundle->size;
+	bundle->nbd_dev->sock = bundle->nbd_srv->sock;
+	bundle->nbd_srv->sock = -1;
+	g_array_append_vals(bundle->nbd_dev->extra_socks,
+			bundle->nbd_srv->extra_socks->data, bundle->nbd_srv->extra_socks->len);
+	g_array_set_size(bundle->nbd_srv->extra_socks, 0);
+	if (!r_nbd_setup_device(bundle->nbd_dev, &ierror)) {
+		/* The setup failed, so the sockets still belong to the nbd_srv. */
+		bundle->nbd_srv->sock = bundle->nbd_dev->sock;
+		bundle->nbd_dev->sock = -1;
+		g_array_append_vals(bundle->nbd_srv->extra_socks,
+				bundle->nbd_dev->extra_socks->data, bundle->nbd_dev->extra_socks->len);
+		g_array_set_size(bundle->nbd_dev->extra_socks, 0);
+		g_clear_pointer(&bundle->nbd_dev, r_nbd_free_device);
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 gboolean mount_bundle(RaucBundle *bundle, GError **error)
 {
 	GError *ierror = NULL;
@@ -3090,15 +5033,10 @@ gboolean mount_bundle(RaucBundle *bundle, GError **error)
 			goto out;
 		}
 	} else if (ENABLE_STREAMING && bundle->nbd_srv) { /* streaming bundle access */
-		bundle->nbd_dev = r_nbd_new_device();
-		bundle->nbd_dev->data_size = bundle->size;
-		bundle->nbd_dev->sock = bundle->nbd_srv->sock;
-		bundle->nbd_srv->sock = -1;
-		res = r_nbd_setup_device(bundle->nbd_dev, &ierror);
+		if (bundle->manifest)
+			prefetch_bundle_metadata(bundle);
+		res = setup_nbd_device(bundle, &ierror);
 		if (!res) {
-			/* The setup failed, so the socket still belongs to the nbd_srv. */
-			bundle->nbd_srv->sock = bundle->nbd_dev->sock;
-			bundle->nbd_dev->sock = -1;
 			g_propagate_error(error, ierror);
 			goto out;
 		}
@@ -3215,24 +5153,155 @@ gboolean umount_bundle(RaucBundle *bundle, GError **error)
 	return TRUE;
 }
 
+static gboolean stage_bundle_payload(const gchar *bundlename, RaucBundleAccessArgs *access_args, GError **error)
+{
+	g_autoptr(RaucBundle) bundle = NULL;
+	g_auto(filedesc) devfd = -1;
+	g_autofree guint8 *root_digest = NULL;
+	g_autofree guint8 *salt = NULL;
+	off_t data_size;
+	gint64 start_time;
+	GError *ierror = NULL;
+
+	if (!ENABLE_STREAMING) {
+		g_set_error(error, R_BUNDLE_ERROR, R_BUNDLE_ERROR_UNSUPPORTED,
+				"Staging requires streaming support");
+		return FALSE;
+	}
+
+	if (!r_context()->config->streaming_cache_directory) {
+		g_set_error(error, R_BUNDLE_ERROR, R_BUNDLE_ERROR_UNSUPPORTED,
+				"Staging requires a streaming cache-directory in the system config");
+		return FALSE;
+	}
+
+	if (!check_bundle(bundlename, &bundle, CHECK_BUNDLE_DEFAULT, access_args, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	if (!bundle->nbd_srv) {
+		g_set_error(error, R_BUNDLE_ERROR, R_BUNDLE_ERROR_UNSUPPORTED,
+				"Only streamed bundles can be staged");
+		return FALSE;
+	}
+
+	/* streaming is only supported for verity and crypt bundles */
+	g_assert_nonnull(bundle->manifest);
+	if (!check_manifest_external(bundle->manifest, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	g_message("Staging bundle payload...");
+	start_time = g_get_monotonic_time();
+
+	if (!setup_nbd_device(bundle, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	devfd = g_open(bundle->nbd_dev->dev, O_RDONLY | O_CLOEXEC, 0);
+	if (devfd < 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to open %s: %s", bundle->nbd_dev->dev, g_strerror(err));
+		return FALSE;
+	}
+
+	/* Reading the full payload and hash tree through the NBD device fills
+	 * the streaming cache, so that a later installation of the same bundle
+	 * does not need to download it again. */
+	root_digest = r_hex_decode(bundle->manifest->bundle_verity_hash, 32);
+	salt = r_hex_decode(bundle->manifest->bundle_verity_salt, 32);
+	data_size = bundle->size - bundle->manifest->bundle_verity_size;
+	g_assert(root_digest);
+	g_assert(salt);
+	g_assert(data_size % 4096 == 0);
+
+	if (r_verity_hash_verify(devfd, data_size/4096, root_digest, salt)) {
+		g_set_error(error, R_BUNDLE_ERROR, R_BUNDLE_ERROR_PAYLOAD,
+				"bundle payload is corrupted");
+		return FALSE;
+	}
+	g_close(devfd, NULL);
+	devfd = -1;
+
+	if (!r_nbd_remove_device(bundle->nbd_dev, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	if (!r_nbd_stop_server(bundle->nbd_srv, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	g_message("Staged %"G_GUINT64_FORMAT " bytes of bundle '%s' in %.1fs",
+			bundle->size, bundlename, (g_get_monotonic_time() - start_time) / 1000000.0);
+
+	return TRUE;
+}
+
+/* Staging runs while the system is in normal operation, so it should only use
+ * otherwise idle CPU and I/O capacity. */
+static const RaucThreadPriority stage_priority = {
+	.nice = 19,
+	.io_class = R_IOPRIO_CLASS_IDLE,
+	.io_level = 0,
+};
+
+gboolean stage_bundle(const gchar *bundlename, RaucBundleAccessArgs *access_args, GError **error)
+{
+	RaucThreadPriority old_priority;
+	GError *ierror = NULL;
+	gboolean res;
+
+	g_return_val_if_fail(bundlename != NULL, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (!r_get_thread_priority(&old_priority, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	/* The NBD server is spawned from this thread and inherits the priority. */
+	if (!r_set_thread_priority(&stage_priority, &ierror)) {
+		g_warning("Staging with normal priority: %s", ierror->message);
+		g_clear_error(&ierror);
+	}
+
+	res = stage_bundle_payload(bundlename, access_args, error);
+
+	if (!r_set_thread_priority(&old_priority, &ierror)) {
+		g_warning("Failed to restore thread priority: %s", ierror->message);
+		g_clear_error(&ierror);
+	}
+
+	return res;
+}
+
 void free_bundle(RaucBundle *bundle)
 {
 	if (!bundle)
 		return;
 
-	/* In case of a temporary download artifact, remove it. */
-	if (bundle->origpath) {
-		g_autofree gchar *tmpdir = g_path_get_dirname(bundle->path);
+	/* In case of a download artifact, remove it. */
+	if (bundle->download_dir) {
+		GError *ierror = NULL;
+		if (!rm_tree(bundle->download_dir, &ierror)) {
+			g_warning("failed to remove download directory %s: %s\n", bundle->download_dir, ierror->message);
+			g_clear_error(&ierror);
+		}
+	} else if (bundle->origpath && bundle->path) {
 		if (g_remove(bundle->path) != 0) {
 			g_warning("failed to remove download artifact %s: %s\n", bundle->path, g_strerror(errno));
 		}
-		if (g_rmdir(tmpdir) != 0) {
-			g_warning("failed to remove download directory %s: %s\n", tmpdir, g_strerror(errno));
-		}
 	}
 
 	g_free(bundle->path);
 	g_free(bundle->origpath);
+	g_free(bundle->download_dir);
 	g_free(bundle->storepath);
 
 	if (ENABLE_STREAMING && bundle->nbd_dev)
@@ -3348,6 +5417,8 @@ void clear_bundle_access_args(RaucBundleAccessArgs *access_args)
 		g_strfreev(access_args->http_headers);
 		g_clear_pointer(&access_args->http_info_headers, g_ptr_array_unref);
 	}
+	/* also used for downloading without streaming support */
+	g_strfreev(access_args->mirrors);
 
 	memset(access_args, 0, sizeof(*access_args));
 }
@@ -0,0 +1,555 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <glib/gstdio.h>
+#include <openssl/evp.h>
+#include <string.h>
+#include <unistd.h>
+#include <zstd.h>
+#if ENABLE_NETWORK
+#include <curl/curl.h>
+#endif
+
+#include "casync.h"
+#include "network.h"
+#include "update_utils.h"
+#include "utils.h"
+
+G_DEFINE_QUARK(r-casync-error-quark, r_casync_error)
+
+/* from casync's caformat.h */
+#define CA_FORMAT_INDEX 0x96824d9c7b129ff9ULL
+#define CA_FORMAT_TABLE 0xe75b9e112f17417dULL
+#define CA_FORMAT_TABLE_TAIL_MARKER 0x4b4f050e5549ecd1ULL
+#define CA_FORMAT_SHA512_256 0x2000000000000000ULL
+
+#define CA_INDEX_HEADER_SIZE 48
+#define CA_TABLE_HEADER_SIZE 16
+#define CA_TABLE_ITEM_SIZE (8 + R_CASYNC_CHUNK_ID_LEN)
+#define CA_TABLE_TAIL_SIZE 40
+
+/* number of chunks processed ahead of the write position */
+#define CASYNC_WINDOW 128
+/* number of parallel connections to a remote chunk store */
+#define CASYNC_CONNECTIONS 4
+/* number of failed requests per chunk before giving up */
+#define CASYNC_RETRIES 3
+
+static guint64 read_le64(const guint8 *data)
+{
+	guint64 value;
+
+	memcpy(&value, data, sizeof(value));
+	return GUINT64_FROM_LE(value);
+}
+
+static guint chunk_id_hash(gconstpointer key)
+{
+	guint value;
+
+	/* chunk IDs are cryptographic hashes already */
+	memcpy(&value, key, sizeof(value));
+	return value;
+}
+
+static gboolean chunk_id_equal(gconstpointer a, gconstpointer b)
+{
+	return memcmp(a, b, R_CASYNC_CHUNK_ID_LEN) == 0;
+}
+
+RCasyncIndex *r_casync_index_load(const gchar *filename, GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(RCasyncIndex) index = NULL;
+	g_autofree guint8 *contents = NULL;
+	gsize len = 0;
+	gsize pos;
+	guint64 end = 0;
+	gboolean tail = FALSE;
+
+	g_return_val_if_fail(filename, NULL);
+	g_return_val_if_fail(error == NULL || *error == NULL, NULL);
+
+	if (!g_file_get_contents(filename, (gchar **)&contents, &len, &ierror)) {
+		g_propagate_error(error, ierror);
+		return NULL;
+	}
+
+	if (len < CA_INDEX_HEADER_SIZE + CA_TABLE_HEADER_SIZE + CA_TABLE_TAIL_SIZE ||
+	    read_le64(contents) != CA_INDEX_HEADER_SIZE ||
+	    read_le64(contents + 8) != CA_FORMAT_INDEX ||
+	    read_le64(contents + CA_INDEX_HEADER_SIZE) != G_MAXUINT64 ||
+	    read_le64(contents + CA_INDEX_HEADER_SIZE + 8) != CA_FORMAT_TABLE) {
+		g_set_error(error, R_CASYNC_ERROR, R_CASYNC_ERROR_INVALID_INDEX,
+				"%s is not a casync blob index", filename);
+		return NULL;
+	}
+
+	index = g_new0(RCasyncIndex, 1);
+	index->feature_flags = read_le64(contents + 16);
+	index->chunk_size_max = read_le64(contents + 40);
+	index->chunks = g_array_sized_new(FALSE, FALSE, sizeof(RCasyncChunk),
+			(len - CA_INDEX_HEADER_SIZE - CA_TABLE_HEADER_SIZE) / CA_TABLE_ITEM_SIZE);
+
+	for (pos = CA_INDEX_HEADER_SIZE + CA_TABLE_HEADER_SIZE; pos + CA_TABLE_ITEM_SIZE <= len; pos += CA_TABLE_ITEM_SIZE) {
+		RCasyncChunk chunk = {0};
+		guint64 item_end = read_le64(contents + pos);
+
+		/* the tail starts with a zero offset */
+		if (item_end == 0) {
+			tail = pos + CA_TABLE_TAIL_SIZE == len &&
+			       read_le64(contents + pos + 32) == CA_FORMAT_TABLE_TAIL_MARKER;
+			break;
+		}
+
+		if (item_end <= end || item_end - end > index->chunk_size_max || item_end - end > G_MAXUINT32) {
+			g_set_error(error, R_CASYNC_ERROR, R_CASYNC_ERROR_INVALID_INDEX,
+					"Invalid chunk size in casync index %s", filename);
+			return NULL;
+		}
+
+		chunk.offset = end;
+		chunk.size = item_end - end;
+		memcpy(chunk.id, contents + pos + 8, R_CASYNC_CHUNK_ID_LEN);
+		g_array_append_val(index->chunks, chunk);
+		end = item_end;
+	}
+
+	if (!tail) {
+		g_set_error(error, R_CASYNC_ERROR, R_CASYNC_ERROR_INVALID_INDEX,
+				"Missing table tail in casync index %s", filename);
+		return NULL;
+	}
+	index->size = end;
+
+	/* the array is not modified anymore, so the keys can point into it */
+	index->lookup = g_hash_table_new(chunk_id_hash, chunk_id_equal);
+	for (guint i = index->chunks->len; i > 0; i--) {
+		RCasyncChunk *chunk = &g_array_index(index->chunks, RCasyncChunk, i - 1);
+		g_hash_table_insert(index->lookup, chunk->id, chunk);
+	}
+
+	return g_steal_pointer(&index);
+}
+
+void r_casync_index_free(RCasyncIndex *index)
+{
+	if (!index)
+		return;
+
+	g_clear_pointer(&index->lookup, g_hash_table_destroy);
+	if (index->chunks)
+		g_array_free(index->chunks, TRUE);
+	g_free(index);
+}
+
+typedef enum {
+	CASYNC_SOURCE_SEED,
+	CASYNC_SOURCE_FILE,
+	CASYNC_SOURCE_DOWNLOAD,
+} CasyncSource;
+
+typedef struct {
+	const RCasyncChunk *chunk;
+	CasyncSource source;
+	guint64 seed_offset;
+	gchar *location; /* path or URL of the compressed chunk */
+	GByteArray *compressed; /* downloaded chunk */
+	guint failures;
+
+	/* results from the worker */
+	gsize fetched_len; /* compressed size */
+	guint8 *data;
+	gboolean seed_mismatch;
+	GError *error;
+	gboolean done;
+
+#if ENABLE_NETWORK
+	CURL *curl;
+	char errbuf[CURL_ERROR_SIZE];
+#endif
+} CasyncJob;
+
+typedef struct {
+	const gchar *store;
+	gboolean remote;
+	int seed_fd;
+	const RCasyncIndex *seed_index;
+	const EVP_MD *md;
+
+	GThreadPool *pool;
+	GAsyncQueue *finished; /* jobs completed by the workers */
+	guint queued; /* jobs in the pool */
+
+#if ENABLE_NETWORK
+	CURLM *multi;
+#endif
+	guint downloading;
+
+	/* statistics */
+	guint seeded;
+	guint fetched;
+	guint64 fetched_bytes;
+} CasyncExtract;
+
+static gboolean verify_chunk(const CasyncExtract *ctx, const RCasyncChunk *chunk, const guint8 *data)
+{
+	guint8 digest[EVP_MAX_MD_SIZE];
+	unsigned int digest_len = 0;
+
+	if (!EVP_Digest(data, chunk->size, digest, &digest_len, ctx->md, NULL))
+		return FALSE;
+
+	return digest_len == R_CASYNC_CHUNK_ID_LEN && memcmp(digest, chunk->id, R_CASYNC_CHUNK_ID_LEN) == 0;
+}
+
+static gboolean decompress_chunk(const CasyncExtract *ctx, CasyncJob *job, const guint8 *src, gsize len, GError **error)
+{
+	size_t res;
+
+	res = ZSTD_decompress(job->data, job->chunk->size, src, len);
+	if (ZSTD_isError(res)) {
+		g_set_error(error, R_CASYNC_ERROR, R_CASYNC_ERROR_CORRUPT_CHUNK,
+				"Failed to decompress chunk %s: %s", job->location, ZSTD_getErrorName(res));
+		return FALSE;
+	}
+
+	if (res != job->chunk->size || !verify_chunk(ctx, job->chunk, job->data)) {
+		g_set_error(error, R_CASYNC_ERROR, R_CASYNC_ERROR_CORRUPT_CHUNK,
+				"Chunk %s does not match its ID", job->location);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Runs in a worker thread. */
+static void process_job(gpointer data, gpointer user_data)
+{
+	CasyncJob *job = data;
+	CasyncExtract *ctx = user_data;
+
+	if (!job->data)
+		job->data = g_malloc(job->chunk->size);
+
+	switch (job->source) {
+		case CASYNC_SOURCE_SEED:
+			if (!r_pread_exact(ctx->seed_fd, job->data, job->chunk->size, job->seed_offset, &job->error))
+				break;
+			/* the seed may have been modified since the index was saved */
+			job->seed_mismatch = !verify_chunk(ctx, job->chunk, job->data);
+			break;
+		case CASYNC_SOURCE_FILE: {
+			g_autofree gchar *contents = NULL;
+			gsize len = 0;
+
+			if (!g_file_get_contents(job->location, &contents, &len, &job->error))
+				break;
+			job->fetched_len = len;
+			decompress_chunk(ctx, job, (const guint8 *)contents, len, &job->error);
+			break;
+		}
+		case CASYNC_SOURCE_DOWNLOAD:
+			job->fetched_len = job->compressed->len;
+			decompress_chunk(ctx, job, job->compressed->data, job->compressed->len, &job->error);
+			g_clear_pointer(&job->compressed, g_byte_array_unref);
+			break;
+		default:
+			g_assert_not_reached();
+	}
+
+	g_async_queue_push(ctx->finished, job);
+}
+
+static void queue_job(CasyncExtract *ctx, CasyncJob *job)
+{
+	ctx->queued++;
+	/* if no new thread can be started, the job is still queued */
+	g_thread_pool_push(ctx->pool, job, NULL);
+}
+
+#if ENABLE_NETWORK
+static size_t download_write_cb(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+	CasyncJob *job = userdata;
+
+	if (job->compressed->len + size*nmemb > ZSTD_compressBound(job->chunk->size))
+		return 0;
+
+	g_byte_array_append(job->compressed, (const guint8 *)ptr, size*nmemb);
+
+	return size*nmemb;
+}
+
+static void start_download(CasyncExtract *ctx, CasyncJob *job)
+{
+	if (!job->curl)
+		job->curl = curl_easy_init();
+	if (!job->curl)
+		g_error("Unable to start libcurl easy session");
+
+	if (job->compressed)
+		g_byte_array_set_size(job->compressed, 0);
+	else
+		job->compressed = g_byte_array_new();
+	job->errbuf[0] = 0;
+
+	curl_easy_setopt(job->curl, CURLOPT_NOSIGNAL, 1L); /* avoid signals for threading */
+	curl_easy_setopt(job->curl, CURLOPT_URL, job->location);
+	curl_easy_setopt(job->curl, CURLOPT_FOLLOWLOCATION, 1L);
+	curl_easy_setopt(job->curl, CURLOPT_MAXREDIRS, 8L);
+	curl_easy_setopt(job->curl, CURLOPT_WRITEFUNCTION, download_write_cb);
+	curl_easy_setopt(job->curl, CURLOPT_WRITEDATA, job);
+	curl_easy_setopt(job->curl, CURLOPT_FAILONERROR, 1L);
+	curl_easy_setopt(job->curl, CURLOPT_ERRORBUFFER, job->errbuf);
+	curl_easy_setopt(job->curl, CURLOPT_NETRC, CURL_NETRC_OPTIONAL);
+	curl_easy_setopt(job->curl, CURLOPT_PRIVATE, job);
+#if LIBCURL_VERSION_NUM >= 0x072f00
+	/* multiplex all requests over few connections if the server allows it */
+	curl_easy_setopt(job->curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+	curl_easy_setopt(job->curl, CURLOPT_PIPEWAIT, 1L);
+#endif
+
+	if (curl_multi_add_handle(ctx->multi, job->curl) != CURLM_OK)
+		g_error("Unexpected error from curl_multi_add_handle");
+	ctx->downloading++;
+}
+
+static gboolean handle_downloads(CasyncExtract *ctx, GError **error)
+{
+	int still_running = 0;
+	int numfds = 0;
+	CURLMsg *msg = NULL;
+	int msgs_in_queue = 0;
+
+	/* poll more often while the workers are busy, as they can't wake us */
+	if (curl_multi_perform(ctx->multi, &still_running) != CURLM_OK ||
+	    curl_multi_wait(ctx->multi, NULL, 0, ctx->queued ? 10 : 1000, &numfds) != CURLM_OK) {
+		g_set_error(error, R_CASYNC_ERROR, R_CASYNC_ERROR_FETCH, "Unexpected error from libcurl multi session");
+		return FALSE;
+	}
+
+	while ((msg = curl_multi_info_read(ctx->multi, &msgs_in_queue))) {
+		CasyncJob *job = NULL;
+
+		if (msg->msg != CURLMSG_DONE)
+			continue;
+
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &job);
+		curl_multi_remove_handle(ctx->multi, job->curl);
+		ctx->downloading--;
+
+		if (msg->data.result == CURLE_OK) {
+			/* the connections are kept by the multi handle */
+			g_clear_pointer(&job->curl, curl_easy_cleanup);
+			queue_job(ctx, job);
+			continue;
+		}
+
+		if (++job->failures > CASYNC_RETRIES) {
+			g_set_error(error, R_CASYNC_ERROR, R_CASYNC_ERROR_FETCH, "Failed to fetch chunk %s: %s",
+					job->location, job->errbuf[0] ? job->errbuf : curl_easy_strerror(msg->data.result));
+			return FALSE;
+		}
+		g_message("Fetching chunk %s failed: %s (retrying)", job->location,
+				job->errbuf[0] ? job->errbuf : curl_easy_strerror(msg->data.result));
+		start_download(ctx, job);
+	}
+
+	return TRUE;
+}
+#endif
+
+static void fetch_chunk(CasyncExtract *ctx, CasyncJob *job)
+{
+	g_autofree gchar *hex = r_hex_encode(job->chunk->id, R_CASYNC_CHUNK_ID_LEN);
+
+	/* chunks are stored in sub-directories named after the first four hex
+	 * digits of their ID */
+	job->location = g_strdup_printf("%s/%.4s/%s.cacnk", ctx->store, hex, hex);
+	ctx->fetched++;
+
+#if ENABLE_NETWORK
+	if (ctx->remote) {
+		job->source = CASYNC_SOURCE_DOWNLOAD;
+		start_download(ctx, job);
+		return;
+	}
+#endif
+
+	job->source = CASYNC_SOURCE_FILE;
+	queue_job(ctx, job);
+}
+
+static void start_job(CasyncExtract *ctx, CasyncJob *job, const RCasyncChunk *chunk)
+{
+	const RCasyncChunk *seed = NULL;
+
+	job->chunk = chunk;
+
+	if (ctx->seed_index && ctx->seed_fd >= 0)
+		seed = g_hash_table_lookup(ctx->seed_index->lookup, chunk->id);
+
+	if (seed && seed->size == chunk->size) {
+		job->source = CASYNC_SOURCE_SEED;
+		job->seed_offset = seed->offset;
+		queue_job(ctx, job);
+		return;
+	}
+
+	fetch_chunk(ctx, job);
+}
+
+/* Collects the jobs completed by the workers. If block is set, waits for at
+ * least one. */
+static gboolean collect_jobs(CasyncExtract *ctx, gboolean block, GError **error)
+{
+	CasyncJob *job = NULL;
+
+	if (block)
+		job = g_async_queue_pop(ctx->finished);
+	else
+		job = g_async_queue_try_pop(ctx->finished);
+
+	for (; job; job = g_async_queue_try_pop(ctx->finished)) {
+		ctx->queued--;
+
+		if (job->error) {
+			g_propagate_error(error, job->error);
+			job->error = NULL;
+			return FALSE;
+		}
+
+		if (job->seed_mismatch) {
+			g_debug("Seed chunk at offset %"G_GUINT64_FORMAT " has changed, fetching it instead", job->seed_offset);
+			job->seed_mismatch = FALSE;
+			fetch_chunk(ctx, job);
+			continue;
+		}
+
+		if (job->source == CASYNC_SOURCE_SEED)
+			ctx->seeded++;
+		else
+			ctx->fetched_bytes += job->fetched_len;
+		job->done = TRUE;
+	}
+
+	return TRUE;
+}
+
+gboolean r_casync_extract_blob(const RCasyncIndex *index, const gchar *store, int seed_fd, const RCasyncIndex *seed_index, int out_fd, GError **error)
+{
+	GError *ierror = NULL;
+	CasyncExtract ctx = {0};
+	g_autofree CasyncJob *jobs = NULL;
+	guint n_chunks;
+	guint next_start = 0;
+	guint next_write = 0;
+	gboolean res = FALSE;
+
+	g_return_val_if_fail(index, FALSE);
+	g_return_val_if_fail(store, FALSE);
+	g_return_val_if_fail(out_fd >= 0, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	ctx.store = store;
+	ctx.remote = g_str_has_prefix(store, "http://") || g_str_has_prefix(store, "https://");
+	ctx.seed_fd = seed_fd;
+	/* the IDs of the seed are only comparable if they use the same hash */
+	if (seed_index && seed_index->feature_flags == index->feature_flags)
+		ctx.seed_index = seed_index;
+	ctx.md = (index->feature_flags & CA_FORMAT_SHA512_256) ? EVP_sha512_256() : EVP_sha256();
+
+	if (ctx.remote && !ENABLE_NETWORK) {
+		g_set_error(error, R_CASYNC_ERROR, R_CASYNC_ERROR_UNSUPPORTED,
+				"Remote chunk store %s requires network support", store);
+		return FALSE;
+	}
+
+#if ENABLE_NETWORK
+	if (ctx.remote) {
+		if (!network_init(error))
+			return FALSE;
+
+		ctx.multi = curl_multi_init();
+		if (!ctx.multi) {
+			g_set_error(error, R_CASYNC_ERROR, R_CASYNC_ERROR_FETCH, "Unable to start libcurl multi session");
+			return FALSE;
+		}
+		curl_multi_setopt(ctx.multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long)CASYNC_CONNECTIONS);
+#if LIBCURL_VERSION_NUM >= 0x072b00
+		curl_multi_setopt(ctx.multi, CURLMOPT_PIPELINING, (long)CURLPIPE_MULTIPLEX);
+#endif
+	}
+#endif
+
+	n_chunks = index->chunks->len;
+	jobs = g_new0(CasyncJob, n_chunks);
+	ctx.finished = g_async_queue_new();
+	ctx.pool = g_thread_pool_new(process_job, &ctx, g_get_num_processors(), FALSE, &ierror);
+	if (!ctx.pool) {
+		g_propagate_prefixed_error(error, ierror, "Failed to start casync workers: ");
+		goto out;
+	}
+
+	while (next_write < n_chunks) {
+		while (next_start < n_chunks && next_start < next_write + CASYNC_WINDOW) {
+			start_job(&ctx, &jobs[next_start], &g_array_index(index->chunks, RCasyncChunk, next_start));
+			next_start++;
+		}
+
+#if ENABLE_NETWORK
+		if (ctx.downloading && !handle_downloads(&ctx, &ierror)) {
+			g_propagate_error(error, ierror);
+			goto out;
+		}
+#endif
+
+		if (!collect_jobs(&ctx, !ctx.downloading && !jobs[next_write].done, &ierror)) {
+			g_propagate_error(error, ierror);
+			goto out;
+		}
+
+		for (; next_write < next_start && jobs[next_write].done; next_write++) {
+			CasyncJob *job = &jobs[next_write];
+
+			if (!r_write_exact(out_fd, job->data, job->chunk->size, &ierror)) {
+				g_propagate_prefixed_error(error, ierror, "Failed to write chunk at offset %"G_GUINT64_FORMAT ": ",
+						job->chunk->offset);
+				goto out;
+			}
+			r_copy_count_written(job->chunk->size);
+			g_clear_pointer(&job->data, g_free);
+		}
+	}
+
+	g_message("Extracted %u chunks: %u from seed, %u (%"G_GUINT64_FORMAT " compressed bytes) from %s",
+			n_chunks, ctx.seeded, ctx.fetched, ctx.fetched_bytes, store);
+
+	res = TRUE;
+
+out:
+	/* wait for running workers, but skip queued jobs */
+	if (ctx.pool)
+		g_thread_pool_free(ctx.pool, TRUE, TRUE);
+	g_async_queue_unref(ctx.finished);
+	for (guint i = 0; i < n_chunks; i++) {
+		CasyncJob *job = &jobs[i];
+
+#if ENABLE_NETWORK
+		if (job->curl) {
+			curl_multi_remove_handle(ctx.multi, job->curl);
+			curl_easy_cleanup(job->curl);
+		}
+#endif
+		g_free(job->location);
+		g_free(job->data);
+		if (job->compressed)
+			g_byte_array_unref(job->compressed);
+		g_clear_error(&job->error);
+	}
+#if ENABLE_NETWORK
+	if (ctx.multi)
+		curl_multi_cleanup(ctx.multi);
+#endif
+	return res;
+}
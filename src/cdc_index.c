@@ -0,0 +1,530 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+
+#include <openssl/evp.h>
+
+#include "cdc_index.h"
+#include "utils.h"
+
+#define SHA256_LEN 32
+
+/* The index file stores the parameters of the chunker followed by the size
+ * and hash of each chunk. In contrast to the block-hash-index, it is created
+ * on the build host, so all fields are little-endian.
+ */
+#define CDC_INDEX_MAGIC "RAUCCDCI"
+#define CDC_INDEX_FORMAT_VERSION 1
+
+typedef struct {
+	guint8 magic[8];
+	guint32 version; /* CDC_INDEX_FORMAT_VERSION */
+	guint32 min_size; /* R_CDC_INDEX_MIN_SIZE */
+	guint32 avg_size; /* R_CDC_INDEX_AVG_SIZE */
+	guint32 max_size; /* R_CDC_INDEX_MAX_SIZE */
+	guint64 count; /* number of chunks */
+} CdcIndexHeader;
+G_STATIC_ASSERT(sizeof(CdcIndexHeader) == 32);
+
+#define CDC_INDEX_ENTRY_SIZE (4 + SHA256_LEN)
+
+/* Normalized chunking (level 2): Before the average size, a cut point needs
+ * more matching bits than after it, which narrows the size distribution.
+ * The top bits are used, as they depend on the whole 64 byte window of the
+ * gear hash. */
+#define CDC_MASK_S (G_MAXUINT64 << (64 - 15))
+#define CDC_MASK_L (G_MAXUINT64 << (64 - 11))
+
+/* amount of data read at once when chunking */
+#define CDC_READ_SIZE (4*1024*1024)
+G_STATIC_ASSERT(CDC_READ_SIZE >= 2 * R_CDC_INDEX_MAX_SIZE);
+
+GQuark r_cdc_index_error_quark(void)
+{
+	return g_quark_from_static_string("r-cdc-index-error-quark");
+}
+
+static guint64 gear[256];
+
+/**
+ * Fills the gear table with fixed pseudo-random values.
+ *
+ * The values must never change, as the chunk boundaries in existing indexes
+ * depend on them.
+ */
+static void init_gear(void)
+{
+	static gsize gear_once = 0;
+
+	if (g_once_init_enter(&gear_once)) {
+		guint64 state = 0x52415543cdc00001ULL;
+
+		for (guint i = 0; i < G_N_ELEMENTS(gear); i++) {
+			/* splitmix64 */
+			guint64 z = (state += 0x9e3779b97f4a7c15ULL);
+			z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+			z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+			gear[i] = z ^ (z >> 31);
+		}
+
+		g_once_init_leave(&gear_once, 1);
+	}
+}
+
+gsize r_cdc_next_chunk(const guint8 *data, gsize len)
+{
+	guint64 hash = 0;
+	gsize normal, n, i;
+
+	g_return_val_if_fail(data || !len, 0);
+
+	init_gear();
+
+	if (len <= R_CDC_INDEX_MIN_SIZE)
+		return len;
+
+	n = MIN(len, R_CDC_INDEX_MAX_SIZE);
+	normal = MIN(n, R_CDC_INDEX_AVG_SIZE);
+
+	/* cut point skipping: the hash only depends on the last 64 bytes, so
+	 * the data before the minimum size does not need to be processed */
+	for (i = R_CDC_INDEX_MIN_SIZE - 64; i < R_CDC_INDEX_MIN_SIZE; i++)
+		hash = (hash << 1) + gear[data[i]];
+
+	for (; i < normal; i++) {
+		hash = (hash << 1) + gear[data[i]];
+		if (!(hash & CDC_MASK_S))
+			return i + 1;
+	}
+
+	for (; i < n; i++) {
+		hash = (hash << 1) + gear[data[i]];
+		if (!(hash & CDC_MASK_L))
+			return i + 1;
+	}
+
+	return n;
+}
+
+static guint chunk_hash_hash(gconstpointer key)
+{
+	guint value;
+
+	/* the keys are SHA256 hashes already */
+	memcpy(&value, key, sizeof(value));
+	return value;
+}
+
+static gboolean chunk_hash_equal(gconstpointer a, gconstpointer b)
+{
+	return memcmp(a, b, SHA256_LEN) == 0;
+}
+
+static void build_lookup(RaucCdcIndex *idx)
+{
+	idx->lookup = g_hash_table_new(chunk_hash_hash, chunk_hash_equal);
+
+	/* The array is not modified anymore, so the keys can point into it.
+	 * Duplicates are chained in order of their offset. */
+	for (guint i = idx->chunks->len; i > 0; i--) {
+		RaucCdcChunk *chunk = &g_array_index(idx->chunks, RaucCdcChunk, i - 1);
+		gpointer first = g_hash_table_lookup(idx->lookup, chunk->hash);
+
+		chunk->next = first ? GPOINTER_TO_UINT(first) - 1 : G_MAXUINT32;
+		g_hash_table_insert(idx->lookup, chunk->hash, GUINT_TO_POINTER(i));
+	}
+}
+
+static gboolean chunk_data(int fd, GArray *chunks, GError **error)
+{
+	g_autofree guint8 *buf = g_malloc(CDC_READ_SIZE);
+	gsize filled = 0;
+	gsize pos = 0;
+	guint64 offset = 0; /* of buf[pos] in the data */
+	gboolean eof = FALSE;
+
+	while (TRUE) {
+		RaucCdcChunk chunk = {0};
+
+		if (!eof && filled - pos < R_CDC_INDEX_MAX_SIZE) {
+			memmove(buf, buf + pos, filled - pos);
+			filled -= pos;
+			pos = 0;
+
+			while (!eof && filled < CDC_READ_SIZE) {
+				ssize_t ret = TEMP_FAILURE_RETRY(pread(fd, buf + filled, CDC_READ_SIZE - filled, offset + filled));
+				if (ret < 0) {
+					int err = errno;
+					g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+							"Failed to read: %s", g_strerror(err));
+					return FALSE;
+				}
+				if (ret == 0)
+					eof = TRUE;
+				filled += ret;
+			}
+		}
+
+		if (pos == filled)
+			break;
+
+		chunk.offset = offset;
+		chunk.size = r_cdc_next_chunk(buf + pos, filled - pos);
+		if (!EVP_Digest(buf + pos, chunk.size, chunk.hash, NULL, EVP_sha256(), NULL)) {
+			g_set_error(error, R_CDC_INDEX_ERROR, R_CDC_INDEX_ERROR_FORMAT, "Failed to hash chunk");
+			return FALSE;
+		}
+		g_array_append_val(chunks, chunk);
+
+		pos += chunk.size;
+		offset += chunk.size;
+	}
+
+	return TRUE;
+}
+
+static gboolean load_index_file(const gchar *filename, GArray *chunks, GError **error)
+{
+	GError *ierror = NULL;
+	g_autofree guint8 *contents = NULL;
+	CdcIndexHeader header;
+	gsize len = 0;
+	guint64 count;
+	guint64 offset = 0;
+
+	if (!g_file_get_contents(filename, (gchar **)&contents, &len, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	if (len < sizeof(header)) {
+		g_set_error(error, R_CDC_INDEX_ERROR, R_CDC_INDEX_ERROR_FORMAT,
+				"Index file %s is too short", filename);
+		return FALSE;
+	}
+	memcpy(&header, contents, sizeof(header));
+	count = GUINT64_FROM_LE(header.count);
+
+	if (memcmp(header.magic, CDC_INDEX_MAGIC, sizeof(header.magic)) != 0 ||
+	    GUINT32_FROM_LE(header.version) != CDC_INDEX_FORMAT_VERSION) {
+		g_set_error(error, R_CDC_INDEX_ERROR, R_CDC_INDEX_ERROR_FORMAT,
+				"%s is not a supported content-defined chunk index", filename);
+		return FALSE;
+	}
+
+	/* indexes with other chunk sizes don't produce matching chunks */
+	if (GUINT32_FROM_LE(header.min_size) != R_CDC_INDEX_MIN_SIZE ||
+	    GUINT32_FROM_LE(header.avg_size) != R_CDC_INDEX_AVG_SIZE ||
+	    GUINT32_FROM_LE(header.max_size) != R_CDC_INDEX_MAX_SIZE) {
+		g_set_error(error, R_CDC_INDEX_ERROR, R_CDC_INDEX_ERROR_FORMAT,
+				"Unsupported chunk size parameters in %s", filename);
+		return FALSE;
+	}
+
+	if (count > (len - sizeof(header)) / CDC_INDEX_ENTRY_SIZE ||
+	    len != sizeof(header) + count * CDC_INDEX_ENTRY_SIZE) {
+		g_set_error(error, R_CDC_INDEX_ERROR, R_CDC_INDEX_ERROR_FORMAT,
+				"Invalid size of index file %s", filename);
+		return FALSE;
+	}
+
+	g_array_set_size(chunks, 0);
+	for (guint64 i = 0; i < count; i++) {
+		const guint8 *entry = contents + sizeof(header) + i * CDC_INDEX_ENTRY_SIZE;
+		RaucCdcChunk chunk = {0};
+		guint32 size;
+
+		memcpy(&size, entry, sizeof(size));
+		chunk.offset = offset;
+		chunk.size = GUINT32_FROM_LE(size);
+		memcpy(chunk.hash, entry + 4, SHA256_LEN);
+
+		if (chunk.size == 0 || chunk.size > R_CDC_INDEX_MAX_SIZE) {
+			g_set_error(error, R_CDC_INDEX_ERROR, R_CDC_INDEX_ERROR_FORMAT,
+					"Invalid chunk size in index file %s", filename);
+			return FALSE;
+		}
+
+		g_array_append_val(chunks, chunk);
+		offset += chunk.size;
+	}
+
+	return TRUE;
+}
+
+RaucCdcIndex *r_cdc_index_open(const gchar *label, int data_fd, const gchar *index_filename, GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(RaucCdcIndex) idx = NULL;
+
+	g_return_val_if_fail(label, NULL);
+	g_return_val_if_fail(data_fd >= 0, NULL);
+	g_return_val_if_fail(error == NULL || *error == NULL, NULL);
+
+	idx = g_new0(RaucCdcIndex, 1);
+	idx->label = g_strdup(label);
+	idx->data_fd = -1;
+	idx->chunks = g_array_new(FALSE, FALSE, sizeof(RaucCdcChunk));
+
+	if (index_filename && g_file_test(index_filename, G_FILE_TEST_EXISTS)) {
+		if (!load_index_file(index_filename, idx->chunks, &ierror)) {
+			g_message("Continuing after failure to load chunk index for %s: %s", label, ierror->message);
+			g_clear_error(&ierror);
+			g_array_set_size(idx->chunks, 0);
+		} else {
+			g_debug("Loaded content-defined chunk index for %s from %s", label, index_filename);
+		}
+	}
+
+	if (!idx->chunks->len) {
+		g_message("Building content-defined chunk index for %s", label);
+		if (!chunk_data(data_fd, idx->chunks, &ierror)) {
+			g_propagate_prefixed_error(error, ierror, "Failed to chunk %s: ", label);
+			return NULL;
+		}
+	}
+
+	build_lookup(idx);
+	idx->match_stats = r_stats_new(idx->label);
+	idx->data_fd = data_fd;
+
+	return g_steal_pointer(&idx);
+}
+
+RaucCdcIndex *r_cdc_index_open_slot(const gchar *label, const RaucSlot *slot, int flags, GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(RaucCdcIndex) idx = NULL;
+	g_autofree gchar *dir = NULL;
+	g_autofree gchar *index_filename = NULL;
+	g_auto(filedesc) data_fd = -1;
+
+	g_return_val_if_fail(label, NULL);
+	g_return_val_if_fail(slot, NULL);
+	g_return_val_if_fail(error == NULL || *error == NULL, NULL);
+
+	data_fd = g_open(slot->device, flags | O_CLOEXEC);
+	if (data_fd < 0) {
+		int err = errno;
+		g_set_error(error,
+				G_FILE_ERROR,
+				g_file_error_from_errno(err),
+				"Failed to open slot device %s: %s", slot->device, g_strerror(err));
+		return NULL;
+	}
+
+	dir = r_slot_get_checksum_data_directory(slot, NULL, &ierror);
+	if (!dir) {
+		g_propagate_error(error, ierror);
+		return NULL;
+	}
+
+	index_filename = g_build_filename(dir, "cdc-hash-index", NULL);
+
+	/* r_cdc_index_open handles missing index file */
+	idx = r_cdc_index_open(label, data_fd, index_filename, &ierror);
+	if (!idx) {
+		g_propagate_error(error, ierror);
+		return NULL;
+	}
+	data_fd = -1; /* belongs to idx now */
+
+	g_debug("opened content-defined chunk index for slot %s as %s", slot->name, label);
+
+	return g_steal_pointer(&idx);
+}
+
+RaucCdcIndex *r_cdc_index_open_image(const gchar *label, const RaucImage *image, GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(RaucCdcIndex) idx = NULL;
+	g_autofree gchar *index_filename = NULL;
+	g_auto(filedesc) data_fd = -1;
+
+	g_return_val_if_fail(label, NULL);
+	g_return_val_if_fail(image, NULL);
+	g_return_val_if_fail(error == NULL || *error == NULL, NULL);
+
+	/* chunking the image would read all of it, which defeats the purpose
+	 * when streaming */
+	index_filename = g_strdup_printf("%s.cdc-hash-index", image->filename);
+	if (!g_file_test(index_filename, G_FILE_TEST_IS_REGULAR)) {
+		g_set_error(error, R_CDC_INDEX_ERROR, R_CDC_INDEX_ERROR_NOT_FOUND,
+				"Missing content-defined chunk index %s", index_filename);
+		return NULL;
+	}
+
+	data_fd = g_open(image->filename, O_RDONLY | O_CLOEXEC);
+	if (data_fd < 0) {
+		int err = errno;
+		g_set_error(error,
+				G_FILE_ERROR,
+				g_file_error_from_errno(err),
+				"Failed to open image file %s: %s", image->filename, g_strerror(err));
+		return NULL;
+	}
+
+	idx = g_new0(RaucCdcIndex, 1);
+	idx->label = g_strdup(label);
+	idx->data_fd = -1;
+	idx->chunks = g_array_new(FALSE, FALSE, sizeof(RaucCdcChunk));
+	if (!load_index_file(index_filename, idx->chunks, &ierror)) {
+		g_propagate_error(error, ierror);
+		return NULL;
+	}
+	build_lookup(idx);
+	idx->match_stats = r_stats_new(idx->label);
+	idx->data_fd = data_fd;
+	data_fd = -1; /* belongs to idx now */
+
+	g_debug("opened content-defined chunk index for image %s with index %s", image->filename, index_filename);
+
+	return g_steal_pointer(&idx);
+}
+
+gboolean r_cdc_index_export(const RaucCdcIndex *idx, const gchar *index_filename, GError **error)
+{
+	g_autoptr(GByteArray) data = NULL;
+	g_autoptr(GBytes) bytes = NULL;
+	CdcIndexHeader header = {0};
+
+	g_return_val_if_fail(idx, FALSE);
+	g_return_val_if_fail(index_filename, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	memcpy(header.magic, CDC_INDEX_MAGIC, sizeof(header.magic));
+	header.version = GUINT32_TO_LE(CDC_INDEX_FORMAT_VERSION);
+	header.min_size = GUINT32_TO_LE(R_CDC_INDEX_MIN_SIZE);
+	header.avg_size = GUINT32_TO_LE(R_CDC_INDEX_AVG_SIZE);
+	header.max_size = GUINT32_TO_LE(R_CDC_INDEX_MAX_SIZE);
+	header.count = GUINT64_TO_LE(idx->chunks->len);
+
+	data = g_byte_array_sized_new(sizeof(header) + idx->chunks->len * CDC_INDEX_ENTRY_SIZE);
+	g_byte_array_append(data, (const guint8 *)&header, sizeof(header));
+	for (guint i = 0; i < idx->chunks->len; i++) {
+		const RaucCdcChunk *chunk = &g_array_index(idx->chunks, RaucCdcChunk, i);
+		guint32 size = GUINT32_TO_LE(chunk->size);
+
+		g_byte_array_append(data, (const guint8 *)&size, sizeof(size));
+		g_byte_array_append(data, chunk->hash, SHA256_LEN);
+	}
+
+	bytes = g_byte_array_free_to_bytes(g_steal_pointer(&data));
+	return write_file(index_filename, bytes, error);
+}
+
+gboolean r_cdc_index_export_slot(const RaucCdcIndex *idx, const RaucSlot *slot, const RaucChecksum *checksum, GError **error)
+{
+	GError *ierror = NULL;
+	g_autofree gchar *dir = NULL;
+	g_autofree gchar *index_filename = NULL;
+
+	g_return_val_if_fail(idx, FALSE);
+	g_return_val_if_fail(slot, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	dir = r_slot_get_checksum_data_directory(slot, checksum, &ierror);
+	if (!dir) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	index_filename = g_build_filename(dir, "cdc-hash-index", NULL);
+
+	return r_cdc_index_export(idx, index_filename, error);
+}
+
+static guint32 first_chunk(const RaucCdcIndex *idx, const guint8 *hash)
+{
+	gpointer first = g_hash_table_lookup(idx->lookup, hash);
+
+	return first ? GPOINTER_TO_UINT(first) - 1 : G_MAXUINT32;
+}
+
+static gboolean verify_chunk(const guint8 *data, guint32 size, const guint8 *hash)
+{
+	guint8 digest[SHA256_LEN];
+
+	if (!EVP_Digest(data, size, digest, NULL, EVP_sha256(), NULL))
+		return FALSE;
+
+	return memcmp(digest, hash, SHA256_LEN) == 0;
+}
+
+gboolean r_cdc_index_get_chunk(const RaucCdcIndex *idx, const guint8 *hash, guint32 size, guint8 *data, GError **error)
+{
+	gboolean found = FALSE;
+
+	g_return_val_if_fail(idx, FALSE);
+	g_return_val_if_fail(hash, FALSE);
+	g_return_val_if_fail(data, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	for (guint32 n = first_chunk(idx, hash); n != G_MAXUINT32;) {
+		const RaucCdcChunk *chunk = &g_array_index(idx->chunks, RaucCdcChunk, n);
+
+		n = chunk->next;
+
+		if (chunk->size != size || chunk->offset < idx->invalid_below)
+			continue;
+
+		/* try the next copy if the data was modified */
+		if (!r_pread_exact(idx->data_fd, data, size, chunk->offset, NULL))
+			continue;
+		if (!idx->skip_hash_check && !verify_chunk(data, size, hash))
+			continue;
+
+		found = TRUE;
+		break;
+	}
+
+	r_stats_add(idx->match_stats, found);
+
+	if (!found) {
+		g_set_error(error,
+				R_CDC_INDEX_ERROR,
+				R_CDC_INDEX_ERROR_NOT_FOUND,
+				"chunk not found in %s", idx->label);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+gboolean r_cdc_index_has_chunk_at(const RaucCdcIndex *idx, const RaucCdcChunk *chunk, guint8 *buf)
+{
+	g_return_val_if_fail(idx, FALSE);
+	g_return_val_if_fail(chunk, FALSE);
+	g_return_val_if_fail(buf, FALSE);
+
+	for (guint32 n = first_chunk(idx, chunk->hash); n != G_MAXUINT32;) {
+		const RaucCdcChunk *old = &g_array_index(idx->chunks, RaucCdcChunk, n);
+
+		n = old->next;
+
+		if (old->offset != chunk->offset || old->size != chunk->size)
+			continue;
+
+		return r_pread_exact(idx->data_fd, buf, chunk->size, chunk->offset, NULL) &&
+		       verify_chunk(buf, chunk->size, chunk->hash);
+	}
+
+	return FALSE;
+}
+
+void r_cdc_index_free(RaucCdcIndex *idx)
+{
+	if (!idx)
+		return;
+
+	g_free(idx->label);
+	if (idx->data_fd >= 0)
+		g_close(idx->data_fd, NULL);
+	g_clear_pointer(&idx->lookup, g_hash_table_destroy);
+	if (idx->chunks)
+		g_array_free(idx->chunks, TRUE);
+	r_stats_free(idx->match_stats);
+	g_free(idx);
+}
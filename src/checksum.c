@@ -2,7 +2,10 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <openssl/evp.h>
+
 #include "checksum.h"
+#include "hash_index.h"
 #include "utils.h"
 
 #define RAUC_DEFAULT_CHECKSUM G_CHECKSUM_SHA256
@@ -16,13 +19,58 @@ G_STATIC_ASSERT(RAUC_DEFAULT_CHECKSUM != 0);
 
 G_DEFINE_QUARK(r-checksum-error-quark, r_checksum_error)
 
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(EVP_MD_CTX, EVP_MD_CTX_free);
+
+/* read size for checksum calculation, a multiple of R_HASH_INDEX_CHUNK_SIZE */
+#define RAUC_CHECKSUM_BUFFER_SIZE (1024*1024)
+G_STATIC_ASSERT(RAUC_CHECKSUM_BUFFER_SIZE % R_HASH_INDEX_CHUNK_SIZE == 0);
+
+static const EVP_MD *get_evp_md(GChecksumType type)
+{
+	switch (type) {
+		case G_CHECKSUM_SHA1:
+			return EVP_sha1();
+		case G_CHECKSUM_SHA256:
+			return EVP_sha256();
+		case G_CHECKSUM_SHA384:
+			return EVP_sha384();
+		case G_CHECKSUM_SHA512:
+			return EVP_sha512();
+		case G_CHECKSUM_MD5:
+			return NULL;
+	}
+
+	return NULL;
+}
+
+/**
+ * Fills the buffer completely, unless the end of the file is reached.
+ *
+ * @return number of bytes read or -1 on error
+ */
+static gssize read_full(int fd, guint8 *buf, gsize size)
+{
+	gsize pos = 0;
+
+	while (pos < size) {
+		gssize r = TEMP_FAILURE_RETRY(read(fd, buf + pos, size - pos));
+		if (r < 0)
+			return -1;
+		if (!r)
+			break;
+		pos += r;
+	}
+
+	return pos;
+}
+
 static gboolean
-update_from_file(GChecksum *ctx, const gchar *filename, goffset *total, GError **error)
+update_from_file(EVP_MD_CTX *ctx, const gchar *filename, goffset *total, GByteArray *chunk_hashes, GError **error)
 {
 	g_auto(filedesc) fd = -1;
+	g_autofree guint8 *buf = NULL;
 	goffset size = 0;
 	gssize r;
-	guchar buf[4096];
 
 	fd = open(filename, O_RDONLY | O_CLOEXEC);
 	if (fd < 0) {
@@ -30,8 +78,11 @@ update_from_file(GChecksum *ctx, const gchar *filename, goffset *total, GError *
 				"Failed to open file %s: %s", filename, strerror(errno));
 		return FALSE;
 	}
+	(void)posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	buf = g_malloc(RAUC_CHECKSUM_BUFFER_SIZE);
 	while (1) {
-		r = read(fd, buf, sizeof(buf));
+		r = read_full(fd, buf, RAUC_CHECKSUM_BUFFER_SIZE);
 		if (r < 0) {
 			g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
 					"Read from %s failed: %s", filename, strerror(errno));
@@ -40,36 +91,95 @@ update_from_file(GChecksum *ctx, const gchar *filename, goffset *total, GError *
 		if (!r)
 			break;
 		size += r;
-		g_checksum_update(ctx, buf, r);
+		if (EVP_DigestUpdate(ctx, buf, r) != 1) {
+			g_set_error(error, R_CHECKSUM_ERROR, R_CHECKSUM_ERROR_FAILED,
+					"Failed to update digest for %s", filename);
+			return FALSE;
+		}
+		if (chunk_hashes) {
+			guint32 count = r / R_HASH_INDEX_CHUNK_SIZE;
+			guint old_len = chunk_hashes->len;
+
+			/* a partial chunk can only occur at the end */
+			g_byte_array_set_size(chunk_hashes, old_len + count * 32);
+			r_hash_index_hash_chunks(buf, count, chunk_hashes->data + old_len);
+		}
+		if (r < RAUC_CHECKSUM_BUFFER_SIZE)
+			break;
 	}
 	*total += size;
 
 	return TRUE;
 }
 
-gboolean compute_checksum(RaucChecksum *checksum, const gchar *filename, GError **error)
+static gboolean
+compute(RaucChecksum *checksum, const gchar *filename, GByteArray *chunk_hashes, GError **error)
 {
-	g_autoptr(GChecksum) ctx = NULL;
+	g_autoptr(EVP_MD_CTX) ctx = NULL;
 	GChecksumType type = checksum->type;
+	const EVP_MD *md = NULL;
+	guint8 digest[EVP_MAX_MD_SIZE];
+	unsigned int digest_len = 0;
 	goffset total = 0;
 
-	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
-
 	if (!type)
 		type = RAUC_DEFAULT_CHECKSUM;
-	ctx = g_checksum_new(type);
 
-	if (!update_from_file(ctx, filename, &total, error))
+	md = get_evp_md(type);
+	if (!md) {
+		g_set_error(error, R_CHECKSUM_ERROR, R_CHECKSUM_ERROR_FAILED,
+				"Unsupported checksum type %d", type);
+		return FALSE;
+	}
+
+	ctx = EVP_MD_CTX_new();
+	if (!ctx || EVP_DigestInit_ex(ctx, md, NULL) != 1) {
+		g_set_error(error, R_CHECKSUM_ERROR, R_CHECKSUM_ERROR_FAILED,
+				"Failed to initialize digest");
+		return FALSE;
+	}
+
+	if (!update_from_file(ctx, filename, &total, chunk_hashes, error))
 		return FALSE;
 
+	if (EVP_DigestFinal_ex(ctx, digest, &digest_len) != 1) {
+		g_set_error(error, R_CHECKSUM_ERROR, R_CHECKSUM_ERROR_FAILED,
+				"Failed to finalize digest for %s", filename);
+		return FALSE;
+	}
+
 	g_clear_pointer(&checksum->digest, g_free);
-	checksum->digest = g_strdup(g_checksum_get_string(ctx));
+	checksum->digest = r_hex_encode(digest, digest_len);
 	checksum->size = total;
 	checksum->type = type;
 
 	return TRUE;
 }
 
+gboolean compute_checksum(RaucChecksum *checksum, const gchar *filename, GError **error)
+{
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	return compute(checksum, filename, NULL, error);
+}
+
+gboolean compute_checksum_with_chunk_hashes(RaucChecksum *checksum, const gchar *filename, GBytes **chunk_hashes, GError **error)
+{
+	g_autoptr(GByteArray) hashes = g_byte_array_new();
+
+	g_return_val_if_fail(chunk_hashes != NULL && *chunk_hashes == NULL, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (!compute(checksum, filename, hashes, error))
+		return FALSE;
+
+	/* hashes are only usable if the file consists of complete chunks */
+	if (checksum->size > 0 && checksum->size % R_HASH_INDEX_CHUNK_SIZE == 0)
+		*chunk_hashes = g_byte_array_free_to_bytes(g_steal_pointer(&hashes));
+
+	return TRUE;
+}
+
 gboolean verify_checksum(const RaucChecksum *checksum, const gchar *filename, GError **error)
 {
 	gboolean res = FALSE;
@@ -0,0 +1,307 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+#include <zstd.h>
+
+#include "chunk_pack.h"
+#include "hash_index.h"
+#include "utils.h"
+
+/* The pack starts with a header and a table of the group offsets, followed
+ * by the compressed groups. It is created on the build host, so all fields
+ * are little-endian.
+ */
+#define CHUNK_PACK_MAGIC "RAUCCPAK"
+#define CHUNK_PACK_FORMAT_VERSION 1
+
+/* Groups are compressed once when creating the bundle, but read on many
+ * devices, so a high level is used. */
+#define CHUNK_PACK_ZSTD_LEVEL 19
+
+#define CHUNK_PACK_GROUP_SIZE (R_CHUNK_PACK_GROUP_CHUNKS * R_HASH_INDEX_CHUNK_SIZE)
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(ZSTD_CCtx, ZSTD_freeCCtx);
+
+typedef struct {
+	guint8 magic[8];
+	guint32 version; /* CHUNK_PACK_FORMAT_VERSION */
+	guint32 chunk_size; /* R_HASH_INDEX_CHUNK_SIZE */
+	guint32 group_chunks; /* R_CHUNK_PACK_GROUP_CHUNKS */
+	guint32 chunk_count; /* number of chunks in the image */
+	guint64 reserved;
+} ChunkPackHeader;
+G_STATIC_ASSERT(sizeof(ChunkPackHeader) == 32);
+
+GQuark r_chunk_pack_error_quark(void)
+{
+	return g_quark_from_static_string("r-chunk-pack-error-quark");
+}
+
+static guint32 group_count(guint32 chunk_count)
+{
+	return (chunk_count + R_CHUNK_PACK_GROUP_CHUNKS - 1) / R_CHUNK_PACK_GROUP_CHUNKS;
+}
+
+static gsize group_size(guint32 chunk_count, guint32 group)
+{
+	guint32 chunks = MIN(R_CHUNK_PACK_GROUP_CHUNKS, chunk_count - group * R_CHUNK_PACK_GROUP_CHUNKS);
+
+	return (gsize)chunks * R_HASH_INDEX_CHUNK_SIZE;
+}
+
+gboolean r_chunk_pack_create(const gchar *imagepath, const gchar *packpath, GError **error)
+{
+	GError *ierror = NULL;
+	g_auto(filedesc) image_fd = -1;
+	g_auto(filedesc) pack_fd = -1;
+	g_autoptr(ZSTD_CCtx) cctx = NULL;
+	g_autofree guint8 *data = NULL;
+	g_autofree guint8 *compressed = NULL;
+	g_autofree guint64 *offsets = NULL;
+	ChunkPackHeader header = {0};
+	struct stat st;
+	guint32 chunk_count, groups;
+	guint64 offset;
+
+	g_return_val_if_fail(imagepath, FALSE);
+	g_return_val_if_fail(packpath, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	image_fd = g_open(imagepath, O_RDONLY | O_CLOEXEC, 0);
+	if (image_fd < 0 || fstat(image_fd, &st) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to open image %s: %s", imagepath, g_strerror(err));
+		return FALSE;
+	}
+
+	if (st.st_size % R_HASH_INDEX_CHUNK_SIZE || st.st_size / R_HASH_INDEX_CHUNK_SIZE > G_MAXUINT32) {
+		g_set_error(error, R_CHUNK_PACK_ERROR, R_CHUNK_PACK_ERROR_FORMAT,
+				"Image size %"G_GUINT64_FORMAT " is not a multiple of %d", (guint64)st.st_size, R_HASH_INDEX_CHUNK_SIZE);
+		return FALSE;
+	}
+	chunk_count = st.st_size / R_HASH_INDEX_CHUNK_SIZE;
+	groups = group_count(chunk_count);
+
+	pack_fd = g_open(packpath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (pack_fd < 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to create chunk pack %s: %s", packpath, g_strerror(err));
+		return FALSE;
+	}
+
+	cctx = ZSTD_createCCtx();
+	if (!cctx)
+		g_error("Failed to allocate zstd compression context");
+	ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, CHUNK_PACK_ZSTD_LEVEL);
+
+	data = g_malloc(CHUNK_PACK_GROUP_SIZE);
+	compressed = g_malloc(ZSTD_compressBound(CHUNK_PACK_GROUP_SIZE));
+	offsets = g_new0(guint64, groups + 1);
+
+	/* the offset table is written after the groups */
+	offset = sizeof(header) + (guint64)(groups + 1) * sizeof(guint64);
+	for (guint32 g = 0; g < groups; g++) {
+		gsize size = group_size(chunk_count, g);
+		size_t len;
+
+		if (!r_pread_exact(image_fd, data, size, (off_t)g * CHUNK_PACK_GROUP_SIZE, &ierror)) {
+			g_propagate_prefixed_error(error, ierror, "Failed to read image %s: ", imagepath);
+			return FALSE;
+		}
+
+		len = ZSTD_compress2(cctx, compressed, ZSTD_compressBound(CHUNK_PACK_GROUP_SIZE), data, size);
+		if (ZSTD_isError(len)) {
+			g_set_error(error, R_CHUNK_PACK_ERROR, R_CHUNK_PACK_ERROR_FORMAT,
+					"Failed to compress chunk group: %s", ZSTD_getErrorName(len));
+			return FALSE;
+		}
+
+		if (!r_pwrite_exact(pack_fd, compressed, len, offset, &ierror)) {
+			g_propagate_prefixed_error(error, ierror, "Failed to write chunk pack %s: ", packpath);
+			return FALSE;
+		}
+
+		offsets[g] = GUINT64_TO_LE(offset);
+		offset += len;
+	}
+	offsets[groups] = GUINT64_TO_LE(offset);
+
+	memcpy(header.magic, CHUNK_PACK_MAGIC, sizeof(header.magic));
+	header.version = GUINT32_TO_LE(CHUNK_PACK_FORMAT_VERSION);
+	header.chunk_size = GUINT32_TO_LE(R_HASH_INDEX_CHUNK_SIZE);
+	header.group_chunks = GUINT32_TO_LE(R_CHUNK_PACK_GROUP_CHUNKS);
+	header.chunk_count = GUINT32_TO_LE(chunk_count);
+
+	if (!r_pwrite_exact(pack_fd, (const guint8 *)&header, sizeof(header), 0, &ierror) ||
+	    !r_pwrite_exact(pack_fd, (const guint8 *)offsets, (groups + 1) * sizeof(guint64), sizeof(header), &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Failed to write chunk pack %s: ", packpath);
+		return FALSE;
+	}
+
+	g_debug("Created chunk pack %s (%"G_GUINT32_FORMAT " groups, %"G_GUINT64_FORMAT " bytes)", packpath, groups, offset);
+
+	return TRUE;
+}
+
+RaucChunkPack *r_chunk_pack_open_image(const RaucImage *image, GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(RaucChunkPack) pack = NULL;
+	g_autofree gchar *packpath = NULL;
+	ChunkPackHeader header;
+	guint32 groups;
+
+	g_return_val_if_fail(image, NULL);
+	g_return_val_if_fail(error == NULL || *error == NULL, NULL);
+
+	packpath = g_strdup_printf("%s.chunk-pack", image->filename);
+
+	pack = g_new0(RaucChunkPack, 1);
+	pack->cached_group = G_MAXUINT32;
+	pack->fd = g_open(packpath, O_RDONLY | O_CLOEXEC, 0);
+	if (pack->fd < 0) {
+		int err = errno;
+		g_set_error(error, R_CHUNK_PACK_ERROR, R_CHUNK_PACK_ERROR_NOT_FOUND,
+				"Failed to open chunk pack %s: %s", packpath, g_strerror(err));
+		return NULL;
+	}
+
+	if (!r_pread_exact(pack->fd, (guint8 *)&header, sizeof(header), 0, &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Failed to read chunk pack %s: ", packpath);
+		return NULL;
+	}
+
+	if (memcmp(header.magic, CHUNK_PACK_MAGIC, sizeof(header.magic)) != 0 ||
+	    GUINT32_FROM_LE(header.version) != CHUNK_PACK_FORMAT_VERSION ||
+	    GUINT32_FROM_LE(header.chunk_size) != R_HASH_INDEX_CHUNK_SIZE ||
+	    GUINT32_FROM_LE(header.group_chunks) != R_CHUNK_PACK_GROUP_CHUNKS) {
+		g_set_error(error, R_CHUNK_PACK_ERROR, R_CHUNK_PACK_ERROR_FORMAT,
+				"%s is not a supported chunk pack", packpath);
+		return NULL;
+	}
+
+	pack->chunk_count = GUINT32_FROM_LE(header.chunk_count);
+	groups = group_count(pack->chunk_count);
+	pack->group_count = groups;
+	pack->offsets = g_new(guint64, groups + 1);
+	if (!r_pread_exact(pack->fd, (guint8 *)pack->offsets, (groups + 1) * sizeof(guint64), sizeof(header), &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Failed to read chunk pack %s: ", packpath);
+		return NULL;
+	}
+
+	for (guint32 g = 0; g <= groups; g++) {
+		pack->offsets[g] = GUINT64_FROM_LE(pack->offsets[g]);
+		if (g && pack->offsets[g] < pack->offsets[g - 1]) {
+			g_set_error(error, R_CHUNK_PACK_ERROR, R_CHUNK_PACK_ERROR_FORMAT,
+					"Invalid offset table in chunk pack %s", packpath);
+			return NULL;
+		}
+	}
+
+	pack->cached_data = g_malloc(CHUNK_PACK_GROUP_SIZE);
+
+	g_debug("Opened chunk pack %s (%"G_GUINT32_FORMAT " chunks)", packpath, pack->chunk_count);
+
+	return g_steal_pointer(&pack);
+}
+
+static gboolean load_group(RaucChunkPack *pack, guint32 group, GError **error)
+{
+	GError *ierror = NULL;
+	g_autofree guint8 *compressed = NULL;
+	gsize len = pack->offsets[group + 1] - pack->offsets[group];
+	gsize size = group_size(pack->chunk_count, group);
+	size_t res;
+
+	if (pack->cached_group == group)
+		return TRUE;
+	pack->cached_group = G_MAXUINT32;
+
+	if (len > ZSTD_compressBound(CHUNK_PACK_GROUP_SIZE)) {
+		g_set_error(error, R_CHUNK_PACK_ERROR, R_CHUNK_PACK_ERROR_CORRUPT,
+				"Invalid size of chunk group %"G_GUINT32_FORMAT, group);
+		return FALSE;
+	}
+
+	compressed = g_malloc(len);
+	if (!r_pread_exact(pack->fd, compressed, len, pack->offsets[group], &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Failed to read chunk group %"G_GUINT32_FORMAT ": ", group);
+		return FALSE;
+	}
+
+	res = ZSTD_decompress(pack->cached_data, size, compressed, len);
+	if (ZSTD_isError(res) || res != size) {
+		g_set_error(error, R_CHUNK_PACK_ERROR, R_CHUNK_PACK_ERROR_CORRUPT,
+				"Failed to decompress chunk group %"G_GUINT32_FORMAT ": %s", group,
+				ZSTD_isError(res) ? ZSTD_getErrorName(res) : "unexpected size");
+		return FALSE;
+	}
+
+	pack->cached_group = group;
+	return TRUE;
+}
+
+gboolean r_chunk_pack_read(RaucChunkPack *pack, guint32 first, guint32 count, guint8 *data, GError **error)
+{
+	GError *ierror = NULL;
+
+	g_return_val_if_fail(pack, FALSE);
+	g_return_val_if_fail(data, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (first > pack->chunk_count || count > pack->chunk_count - first) {
+		g_set_error(error, R_CHUNK_PACK_ERROR, R_CHUNK_PACK_ERROR_NOT_FOUND,
+				"Chunks %"G_GUINT32_FORMAT "+%"G_GUINT32_FORMAT " are outside of the chunk pack", first, count);
+		return FALSE;
+	}
+
+	while (count) {
+		guint32 group = first / R_CHUNK_PACK_GROUP_CHUNKS;
+		guint32 pos = first % R_CHUNK_PACK_GROUP_CHUNKS;
+		guint32 n = MIN(count, R_CHUNK_PACK_GROUP_CHUNKS - pos);
+
+		if (!load_group(pack, group, &ierror)) {
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
+
+		memcpy(data, pack->cached_data + (gsize)pos * R_HASH_INDEX_CHUNK_SIZE, (gsize)n * R_HASH_INDEX_CHUNK_SIZE);
+		data += (gsize)n * R_HASH_INDEX_CHUNK_SIZE;
+		first += n;
+		count -= n;
+	}
+
+	return TRUE;
+}
+
+void r_chunk_pack_get_range(const RaucChunkPack *pack, guint32 first, guint32 count, off_t *offset, off_t *size)
+{
+	guint32 first_group, end_group;
+
+	g_return_if_fail(pack);
+	g_return_if_fail(offset);
+	g_return_if_fail(size);
+
+	first_group = MIN(first / R_CHUNK_PACK_GROUP_CHUNKS, pack->group_count);
+	end_group = MIN(group_count(first + count), pack->group_count);
+
+	*offset = pack->offsets[first_group];
+	*size = pack->offsets[end_group] - pack->offsets[first_group];
+}
+
+void r_chunk_pack_free(RaucChunkPack *pack)
+{
+	if (!pack)
+		return;
+
+	if (pack->fd >= 0)
+		g_close(pack->fd, NULL);
+	g_free(pack->offsets);
+	g_free(pack->cached_data);
+	g_free(pack);
+}
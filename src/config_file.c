@@ -1,4 +1,5 @@
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <string.h>
 
 #include "artifacts.h"
@@ -24,6 +25,8 @@ void default_config(RaucConfig **config)
 	c->max_bundle_download_size = DEFAULT_MAX_BUNDLE_DOWNLOAD_SIZE;
 	c->max_bundle_signature_size = DEFAULT_MAX_BUNDLE_SIGNATURE_SIZE;
 	c->mount_prefix = g_strdup("/mnt/rauc/");
+	c->streaming_connections = 1;
+	c->install_concurrency = 1;
 	/* When installing, we need a system.conf anyway, so this is used only
 	 * for info/convert/extract/...
 	 */
@@ -324,6 +327,16 @@ static gboolean r_event_log_parse_config_sections(GKeyFile *key_file, RaucConfig
 		}
 		logger->maxfiles = (guint) tmp_maxfiles;
 
+		logger->index = g_key_file_get_boolean(key_file, *group, "index", &ierror);
+		if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND)) {
+			logger->index = FALSE;
+			g_clear_error(&ierror);
+		} else if (ierror) {
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
+		g_key_file_remove_key(key_file, *group, "index", NULL);
+
 		if (!check_remaining_keys(key_file, *group, &ierror)) {
 			g_propagate_error(error, ierror);
 			return FALSE;
@@ -508,6 +521,16 @@ static GHashTable *parse_slots(const char *filename, const char *data_directory,
 			g_key_file_remove_key(key_file, groups[i], "force-install-same", NULL);
 			g_key_file_remove_key(key_file, groups[i], "ignore-checksum", NULL);
 
+			slot->check_same_content = g_key_file_get_boolean(key_file, groups[i], "check-same-content", &ierror);
+			if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND)) {
+				slot->check_same_content = FALSE;
+				g_clear_error(&ierror);
+			} else if (ierror) {
+				g_propagate_error(error, ierror);
+				return NULL;
+			}
+			g_key_file_remove_key(key_file, groups[i], "check-same-content", NULL);
+
 			slot->extra_mount_opts = key_file_consume_string(key_file, groups[i], "extra-mount-opts", NULL);
 
 			slot->resize = g_key_file_get_boolean(key_file, groups[i], "resize", &ierror);
@@ -538,6 +561,41 @@ static GHashTable *parse_slots(const char *filename, const char *data_directory,
 				}
 			}
 
+			slot->verify_after_write = g_key_file_get_boolean(key_file, groups[i], "verify-after-write", &ierror);
+			if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND)) {
+				slot->verify_after_write = FALSE;
+				g_clear_error(&ierror);
+			} else if (ierror) {
+				g_propagate_error(error, ierror);
+				return NULL;
+			}
+			g_key_file_remove_key(key_file, groups[i], "verify-after-write", NULL);
+
+			slot->verity_hash = g_key_file_get_boolean(key_file, groups[i], "verity-hash", &ierror);
+			if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND)) {
+				slot->verity_hash = FALSE;
+				g_clear_error(&ierror);
+			} else if (ierror) {
+				g_propagate_error(error, ierror);
+				return NULL;
+			}
+			g_key_file_remove_key(key_file, groups[i], "verity-hash", NULL);
+
+			slot->verity_hash_device = key_file_consume_string(key_file, groups[i], "verity-hash-device", NULL);
+			if (slot->verity_hash_device && !slot->verity_hash) {
+				g_set_error(error, R_CONFIG_ERROR, R_CONFIG_ERROR_INVALID_FORMAT,
+						"verity-hash-device is only valid with verity-hash=true for slot %s", slot->name);
+				return NULL;
+			}
+			/* dm-verity needs a block device with the image written
+			 * as-is, which only the raw handler does */
+			if (slot->verity_hash &&
+			    g_strcmp0(slot->type, "raw") != 0) {
+				g_set_error(error, R_CONFIG_ERROR, R_CONFIG_ERROR_SLOT_TYPE,
+						"verity-hash is not supported for slot type '%s' of slot %s", slot->type, slot->name);
+				return NULL;
+			}
+
 			if (g_strcmp0(slot->type, "boot-emmc") == 0) {
 				slot->size_limit = key_file_consume_binary_suffixed_string(key_file, groups[i],
 						"size-limit", &ierror);
@@ -688,6 +746,124 @@ static GHashTable *parse_artifact_repos(const char *filename, const char *data_d
 	return g_steal_pointer(&repos);
 }
 
+static gboolean parse_io_class(const gchar *value, gint *io_class)
+{
+	if (g_strcmp0(value, "realtime") == 0)
+		*io_class = R_IOPRIO_CLASS_RT;
+	else if (g_strcmp0(value, "best-effort") == 0)
+		*io_class = R_IOPRIO_CLASS_BE;
+	else if (g_strcmp0(value, "idle") == 0)
+		*io_class = R_IOPRIO_CLASS_IDLE;
+	else
+		return FALSE;
+
+	return TRUE;
+}
+
+static GHashTable *parse_install_priorities(GKeyFile *key_file, GError **error)
+{
+	GError *ierror = NULL;
+	gsize group_count;
+
+	g_autoptr(GHashTable) priorities = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, g_free);
+
+	g_auto(GStrv) groups = g_key_file_get_groups(key_file, &group_count);
+	for (gsize i = 0; i < group_count; i++) {
+		g_auto(GStrv) groupsplit = g_strsplit(groups[i], ".", -1);
+		g_autofree RaucInstallPriority *priority = NULL;
+		g_autofree gchar *io_class = NULL;
+
+		/* We treat sections starting with "priority." as install priorities. */
+		if (!g_str_equal(groupsplit[0], "priority"))
+			continue;
+
+		if (g_strv_length(groupsplit) != 2) {
+			g_set_error(
+					error,
+					R_CONFIG_ERROR,
+					R_CONFIG_ERROR_INVALID_FORMAT,
+					"Invalid priority format: %s", groups[i]);
+			return NULL;
+		}
+
+		priority = g_new0(RaucInstallPriority, 1);
+		priority->name = g_intern_string(groupsplit[1]);
+
+		priority->thread.nice = key_file_consume_integer(key_file, groups[i], "nice", &ierror);
+		if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND)) {
+			priority->thread.nice = 0;
+			g_clear_error(&ierror);
+		} else if (ierror) {
+			g_propagate_error(error, ierror);
+			return NULL;
+		}
+		if (priority->thread.nice < -20 || priority->thread.nice > 19) {
+			g_set_error(
+					error,
+					R_CONFIG_ERROR,
+					R_CONFIG_ERROR_INVALID_FORMAT,
+					"Value for \"nice\" in [%s] must be between -20 and 19", groups[i]);
+			return NULL;
+		}
+
+		io_class = key_file_consume_string(key_file, groups[i], "io-class", NULL);
+		if (!io_class) {
+			/* the kernel derives the I/O priority from the nice value */
+			priority->thread.io_class = R_IOPRIO_CLASS_NONE;
+		} else if (!parse_io_class(io_class, &priority->thread.io_class)) {
+			g_set_error(
+					error,
+					R_CONFIG_ERROR,
+					R_CONFIG_ERROR_INVALID_FORMAT,
+					"Unsupported \"io-class\" '%s' in [%s]", io_class, groups[i]);
+			return NULL;
+		}
+
+		priority->thread.io_level = key_file_consume_integer(key_file, groups[i], "io-level", &ierror);
+		if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND)) {
+			priority->thread.io_level = io_class ? 4 : 0;
+			g_clear_error(&ierror);
+		} else if (ierror) {
+			g_propagate_error(error, ierror);
+			return NULL;
+		} else if (!io_class) {
+			g_set_error(
+					error,
+					R_CONFIG_ERROR,
+					R_CONFIG_ERROR_INVALID_FORMAT,
+					"\"io-level\" in [%s] requires \"io-class\"", groups[i]);
+			return NULL;
+		}
+		if (priority->thread.io_level < 0 || priority->thread.io_level > 7) {
+			g_set_error(
+					error,
+					R_CONFIG_ERROR,
+					R_CONFIG_ERROR_INVALID_FORMAT,
+					"Value for \"io-level\" in [%s] must be between 0 and 7", groups[i]);
+			return NULL;
+		}
+
+		priority->rate_limit = key_file_consume_binary_suffixed_string(key_file, groups[i], "rate-limit", &ierror);
+		if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND)) {
+			priority->rate_limit = 0;
+			g_clear_error(&ierror);
+		} else if (ierror) {
+			g_propagate_error(error, ierror);
+			return NULL;
+		}
+
+		if (!check_remaining_keys(key_file, groups[i], &ierror)) {
+			g_propagate_error(error, ierror);
+			return NULL;
+		}
+		g_key_file_remove_group(key_file, groups[i], NULL);
+
+		g_hash_table_insert(priorities, (gchar *)priority->name, g_steal_pointer(&priority));
+	}
+
+	return g_steal_pointer(&priorities);
+}
+
 static gboolean check_unique_slotclasses(RaucConfig *config, GError **error)
 {
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
@@ -710,14 +886,40 @@ static gboolean check_unique_slotclasses(RaucConfig *config, GError **error)
 	return TRUE;
 }
 
+static void get_file_identity(const gchar *filename, guint64 *dev, guint64 *ino, guint64 *size, gint64 *mtime_ns)
+{
+	GStatBuf st;
+
+	/* a zero mtime means unknown */
+	if (g_stat(filename, &st) != 0) {
+		*dev = *ino = *size = 0;
+		*mtime_ns = 0;
+		return;
+	}
+
+	*dev = st.st_dev;
+	*ino = st.st_ino;
+	*size = st.st_size;
+	*mtime_ns = (gint64)st.st_mtim.tv_sec * G_GINT64_CONSTANT(1000000000) + st.st_mtim.tv_nsec;
+}
+
 void r_config_file_modified_check(void)
 {
 	g_autoptr(GError) ierror = NULL;
 	g_autofree gchar *data = NULL;
 	gsize length;
 	g_autofree gchar *new_checksum = NULL;
+	const RaucConfig *config = r_context()->config;
+	guint64 dev, ino, size;
+	gint64 mtime_ns;
 
-	if (!r_context()->config->file_checksum)
+	if (!config->file_checksum)
+		return;
+
+	/* skip reading the file if it was not touched since loading it */
+	get_file_identity(r_context()->configpath, &dev, &ino, &size, &mtime_ns);
+	if (mtime_ns && config->file_mtime_ns == mtime_ns &&
+	    config->file_dev == dev && config->file_ino == ino && config->file_size == size)
 		return;
 
 	if (!g_file_get_contents(r_context()->configpath, &data, &length, &ierror)) {
@@ -745,13 +947,17 @@ gboolean load_config(const gchar *filename, RaucConfig **config, GError **error)
 	g_autofree gchar *variant_data = NULL;
 	g_autofree gchar *version_data = NULL;
 	g_autofree gchar *bundle_formats = NULL;
+	g_autofree gchar *dm_profile = NULL;
 	gsize entries;
 
 	g_return_val_if_fail(filename, FALSE);
 	g_return_val_if_fail(config && *config == NULL, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
-	/* We store checksum for later comparison */
+	/* We store the file identity and checksum for later comparison. The
+	 * identity is taken first, so that concurrent modifications are
+	 * detected later. */
+	get_file_identity(filename, &c->file_dev, &c->file_ino, &c->file_size, &c->file_mtime_ns);
 	if (!g_file_get_contents(filename, &data, &length, &ierror)) {
 		g_propagate_error(error, ierror);
 		return FALSE;
@@ -835,6 +1041,9 @@ gboolean load_config(const gchar *filename, RaucConfig **config, GError **error)
 			g_debug("No grubenv path provided, using /boot/grub/grubenv as default");
 			c->grubenv_path = g_strdup("/boot/grub/grubenv");
 		}
+	} else if (g_strcmp0(c->system_bootloader, "uboot") == 0) {
+		c->uboot_env_config = resolve_path_take(filename,
+				key_file_consume_string(key_file, "system", "uboot-env-config", NULL));
 	} else if (g_strcmp0(c->system_bootloader, "efi") == 0) {
 		c->efi_use_bootnext = g_key_file_get_boolean(key_file, "system", "efi-use-bootnext", &ierror);
 		if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND)) {
@@ -845,6 +1054,8 @@ gboolean load_config(const gchar *filename, RaucConfig **config, GError **error)
 			return FALSE;
 		}
 		g_key_file_remove_key(key_file, "system", "efi-use-bootnext", NULL);
+		c->efivarfs_path = resolve_path_take(filename,
+				key_file_consume_string(key_file, "system", "efivarfs", NULL));
 	} else if (g_strcmp0(c->system_bootloader, "custom") == 0) {
 		c->custom_bootloader_backend = resolve_path_take(filename,
 				key_file_consume_string(key_file, "handlers", "bootloader-custom-backend", NULL));
@@ -856,6 +1067,15 @@ gboolean load_config(const gchar *filename, RaucConfig **config, GError **error)
 					"No custom bootloader backend defined");
 			return FALSE;
 		}
+		c->custom_bootloader_persistent = g_key_file_get_boolean(key_file, "handlers", "bootloader-custom-backend-persistent", &ierror);
+		if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND)) {
+			c->custom_bootloader_persistent = FALSE;
+			g_clear_error(&ierror);
+		} else if (ierror) {
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
+		g_key_file_remove_key(key_file, "handlers", "bootloader-custom-backend-persistent", NULL);
 	}
 
 	c->boot_default_attempts = key_file_consume_integer(key_file, "system", "boot-attempts", &ierror);
@@ -1113,6 +1333,69 @@ gboolean load_config(const gchar *filename, RaucConfig **config, GError **error)
 	}
 	g_key_file_remove_key(key_file, "system", "perform-pre-check", NULL);
 
+	dm_profile = key_file_consume_string(key_file, "system", "dm-profile", &ierror);
+	if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND)) {
+		c->dm_profile = RAUC_DM_PROFILE_AUTO;
+		g_clear_error(&ierror);
+	} else if (ierror) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	} else if (!r_dm_parse_profile(dm_profile, &c->dm_profile)) {
+		g_set_error(
+				error,
+				R_CONFIG_ERROR,
+				R_CONFIG_ERROR_INVALID_FORMAT,
+				"Invalid value '%s' for \"dm-profile\" in [system]", dm_profile);
+		return FALSE;
+	}
+
+	c->write_behind_size = key_file_consume_binary_suffixed_string(key_file, "system", "write-behind-size", &ierror);
+	if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND)) {
+		c->write_behind_size = 0;
+		g_clear_error(&ierror);
+	} else if (ierror) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	c->memory_limit = key_file_consume_binary_suffixed_string(key_file, "system", "memory-limit", &ierror);
+	if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND)) {
+		c->memory_limit = 0;
+		g_clear_error(&ierror);
+	} else if (ierror) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	c->install_concurrency = key_file_consume_integer(key_file, "system", "install-concurrency", &ierror);
+	if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND)) {
+		c->install_concurrency = 1;
+		g_clear_error(&ierror);
+	} else if (ierror) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+	if (c->install_concurrency < 1 || c->install_concurrency > 16) {
+		g_set_error(
+				error,
+				R_CONFIG_ERROR,
+				R_CONFIG_ERROR_INVALID_FORMAT,
+				"Value for \"install-concurrency\" in [system] must be between 1 and 16");
+		return FALSE;
+	}
+
+	c->install_priority = key_file_consume_string(key_file, "system", "install-priority", NULL);
+
+	c->background_hash_index = g_key_file_get_boolean(key_file, "system", "background-hash-index", &ierror);
+	if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND)) {
+		c->background_hash_index = FALSE;
+		g_clear_error(&ierror);
+	} else if (ierror) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+	g_key_file_remove_key(key_file, "system", "background-hash-index", NULL);
+
 	if (!check_remaining_keys(key_file, "system", &ierror)) {
 		g_propagate_error(error, ierror);
 		return FALSE;
@@ -1215,6 +1498,35 @@ gboolean load_config(const gchar *filename, RaucConfig **config, GError **error)
 	c->streaming_tls_cert = key_file_consume_string(key_file, "streaming", "tls-cert", NULL);
 	c->streaming_tls_key = key_file_consume_string(key_file, "streaming", "tls-key", NULL);
 	c->streaming_tls_ca = key_file_consume_string(key_file, "streaming", "tls-ca", NULL);
+	c->streaming_cache_directory = resolve_path_take(filename,
+			key_file_consume_string(key_file, "streaming", "cache-directory", NULL));
+	c->streaming_tls_session_cache = resolve_path_take(filename,
+			key_file_consume_string(key_file, "streaming", "tls-session-cache", NULL));
+	c->streaming_cache_size = key_file_consume_binary_suffixed_string(key_file, "streaming", "cache-size", &ierror);
+	if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND) ||
+	    g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_GROUP_NOT_FOUND)) {
+		g_clear_error(&ierror);
+	} else if (ierror) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+	c->streaming_connections = key_file_consume_integer(key_file, "streaming", "connections", &ierror);
+	if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND) ||
+	    g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_GROUP_NOT_FOUND)) {
+		c->streaming_connections = 1;
+		g_clear_error(&ierror);
+	} else if (ierror) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+	if (c->streaming_connections < 1 || c->streaming_connections > 16) {
+		g_set_error(
+				error,
+				R_CONFIG_ERROR,
+				R_CONFIG_ERROR_INVALID_FORMAT,
+				"Value for \"connections\" in [streaming] must be between 1 and 16");
+		return FALSE;
+	}
 	c->enabled_headers = g_key_file_get_string_list(key_file, "streaming", "send-headers", &entries, &ierror);
 	if (g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND) ||
 	    g_error_matches(ierror, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_GROUP_NOT_FOUND)) {
@@ -1292,6 +1604,21 @@ gboolean load_config(const gchar *filename, RaucConfig **config, GError **error)
 		return FALSE;
 	}
 
+	/* parse [priority.*] sections */
+	c->install_priorities = parse_install_priorities(key_file, &ierror);
+	if (!c->install_priorities) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+	if (c->install_priority && !g_hash_table_contains(c->install_priorities, c->install_priority)) {
+		g_set_error(
+				error,
+				R_CONFIG_ERROR,
+				R_CONFIG_ERROR_INVALID_FORMAT,
+				"No [priority.%s] section for \"install-priority\" in [system]", c->install_priority);
+		return FALSE;
+	}
+
 	if (!check_unique_slotclasses(c, &ierror)) {
 		g_propagate_error(error, ierror);
 		return FALSE;
@@ -1340,6 +1667,8 @@ void free_config(RaucConfig *config)
 	g_free(config->tmp_path);
 	g_free(config->casync_install_args);
 	g_free(config->grubenv_path);
+	g_free(config->uboot_env_config);
+	g_free(config->efivarfs_path);
 	g_free(config->data_directory);
 	g_free(config->statusfile_path);
 	g_free(config->keyring_path);
@@ -1354,6 +1683,8 @@ void free_config(RaucConfig *config)
 	g_free(config->streaming_tls_cert);
 	g_free(config->streaming_tls_key);
 	g_free(config->streaming_tls_ca);
+	g_free(config->streaming_cache_directory);
+	g_free(config->streaming_tls_session_cache);
 	g_strfreev(config->enabled_headers);
 	g_free(config->encryption_key);
 	g_free(config->encryption_cert);
@@ -1362,5 +1693,7 @@ void free_config(RaucConfig *config)
 	g_free(config->custom_bootloader_backend);
 	g_free(config->file_checksum);
 	g_clear_pointer(&config->artifact_repos, g_hash_table_destroy);
+	g_free(config->install_priority);
+	g_clear_pointer(&config->install_priorities, g_hash_table_destroy);
 	g_free(config);
 }
@@ -8,14 +8,17 @@
 #include "context.h"
 #include "event_log.h"
 #include "status_file.h"
-#include "network.h"
 #include "install.h"
-#include "signature.h"
+#include "memory.h"
+#include "trace.h"
 #include "utils.h"
 
 RaucContext *context = NULL;
 gboolean context_configuring = FALSE;
 
+/* set for threads whose progress steps are ignored */
+static GPrivate progress_muted;
+
 static gchar* get_machine_id(void)
 {
 	gchar *contents = NULL;
@@ -500,6 +503,8 @@ gboolean r_context_configure(GError **error)
 		r_replace_strdup(&context->config->encryption_key, context->encryption_key);
 	}
 
+	r_memory_set_limit(context->config->memory_limit);
+
 	/* When no context is required, we can safely assume that we do not
 	 * operate on the target but are used as a (host) tool.
 	 * In this case, skip all the necessary target-related context setup steps
@@ -598,13 +603,17 @@ void r_context_begin_step(const gchar *name, const gchar *description,
 void r_context_begin_step_weighted(const gchar *name, const gchar *description,
 		gint substeps, gint weight)
 {
-	RaucProgressStep *step = g_new0(RaucProgressStep, 1);
+	RaucProgressStep *step = NULL;
 	RaucProgressStep *parent;
 
 	g_return_if_fail(name);
 	g_return_if_fail(description);
 
+	if (g_private_get(&progress_muted))
+		return;
+
 	/* set properties */
+	step = g_new0(RaucProgressStep, 1);
 	step->name = g_strdup(name);
 	step->description = g_strdup(description);
 	step->weight = weight;
@@ -612,6 +621,7 @@ void r_context_begin_step_weighted(const gchar *name, const gchar *description,
 	step->substeps_done = 0;
 	step->percent_done = 0;
 	step->last_explicit_percent = 0;
+	step->start_time = g_get_monotonic_time();
 
 	/* calculate percentage */
 	if (context->progress) {
@@ -639,6 +649,7 @@ void r_context_begin_step_weighted(const gchar *name, const gchar *description,
 
 	/* add step to "stack" */
 	context->progress = g_list_prepend(context->progress, step);
+	R_TRACE2(step_begin, step->name, g_list_length(context->progress));
 
 	r_context_send_progress(FALSE, FALSE);
 }
@@ -681,6 +692,9 @@ void r_context_end_step(const gchar *name, gboolean success)
 
 	g_return_if_fail(name);
 
+	if (g_private_get(&progress_muted))
+		return;
+
 	/* "stack" should never be NULL at this point */
 	g_assert_nonnull(context->progress);
 
@@ -709,6 +723,20 @@ void r_context_end_step(const gchar *name, gboolean success)
 	/* ensure that progress step nesting is done correctly */
 	g_assert_cmpstr(step->name, ==, name);
 
+	if (context->step_report) {
+		g_auto(GVariantDict) dict = G_VARIANT_DICT_INIT(NULL);
+
+		g_variant_dict_insert(&dict, "name", "s", step->name);
+		g_variant_dict_insert(&dict, "description", "s", step->description);
+		g_variant_dict_insert(&dict, "depth", "i", g_list_length(context->progress));
+		g_variant_dict_insert(&dict, "duration", "d",
+				(gdouble)(g_get_monotonic_time() - step->start_time) / G_USEC_PER_SEC);
+		g_variant_dict_insert(&dict, "success", "b", success);
+		g_variant_builder_add_value(context->step_report, g_variant_dict_end(&dict));
+	}
+	R_TRACE4(step_end, step->name, g_list_length(context->progress), success,
+			g_get_monotonic_time() - step->start_time);
+
 	/* increment step count and percentage on parent step */
 	if (g_list_next(context->progress)) {
 		parent = g_list_next(context->progress)->data;
@@ -733,20 +761,16 @@ void r_context_end_step(const gchar *name, gboolean success)
 	r_context_free_progress_step(step);
 }
 
-void r_context_set_step_percentage(const gchar *name, gint custom_percent)
+/* Returns the current step for setting an explicit percentage. */
+static RaucProgressStep *get_explicit_step(const gchar *name)
 {
 	RaucProgressStep *step;
-	RaucProgressStep *parent;
-	gint percent_difference;
-
-	g_return_if_fail(name);
 
 	g_assert_nonnull(context->progress);
 
 	step = context->progress->data;
 	if (!g_list_next(context->progress))
 		g_error("Root step does not support setting percentage");
-	parent = g_list_next(context->progress)->data;
 
 	/* ensure that progress step nesting is done correctly */
 	if (g_strcmp0(step->name, name) != 0)
@@ -756,11 +780,20 @@ void r_context_set_step_percentage(const gchar *name, gint custom_percent)
 	if (step->substeps_total < 0)
 		g_error("Setting percentage on substeps > 0 is not supported");
 
+	return step;
+}
+
+/* Updates the percentage of the current step, returns FALSE if unchanged. */
+static gboolean update_step_percentage(RaucProgressStep *step, gint custom_percent)
+{
+	RaucProgressStep *parent = g_list_next(context->progress)->data;
+	gint percent_difference;
+
 	percent_difference = custom_percent - step->last_explicit_percent;
 
 	/* skip progress update if percentage did not change */
 	if (percent_difference < 1)
-		return;
+		return FALSE;
 
 	step->percent_done = step->percent_total
 	                     * (percent_difference / 100.0f);
@@ -772,11 +805,119 @@ void r_context_set_step_percentage(const gchar *name, gint custom_percent)
 
 	step->last_explicit_percent = custom_percent;
 
+	return TRUE;
+}
+
+void r_context_set_step_percentage(const gchar *name, gint custom_percent)
+{
+	RaucProgressStep *step;
+
+	g_return_if_fail(name);
+
+	if (g_private_get(&progress_muted))
+		return;
+
+	step = get_explicit_step(name);
+
+	if (!update_step_percentage(step, custom_percent))
+		return;
+
 	/* r_context_step_end sends 100% progress step */
 	if (custom_percent != 100)
 		r_context_send_progress(FALSE, FALSE);
 }
 
+/* time constant for smoothing the throughput of byte-based steps */
+#define R_PROGRESS_RATE_TAU 5.0
+/* minimum interval between two throughput samples */
+#define R_PROGRESS_RATE_INTERVAL (G_USEC_PER_SEC / 10)
+
+void r_context_set_step_bytes(const gchar *name, goffset done, goffset total)
+{
+	RaucProgressStep *step;
+	gint64 now = g_get_monotonic_time();
+	gint percent;
+
+	g_return_if_fail(name);
+	g_return_if_fail(total > 0);
+
+	if (g_private_get(&progress_muted))
+		return;
+
+	step = get_explicit_step(name);
+
+	done = CLAMP(done, 0, total);
+	if (!step->rate_time) {
+		step->rate_time = now;
+		step->rate_bytes = done;
+	} else if (now - step->rate_time >= R_PROGRESS_RATE_INTERVAL) {
+		gdouble seconds = (gdouble)(now - step->rate_time) / G_USEC_PER_SEC;
+		gdouble sample = MAX(done - step->rate_bytes, 0) / seconds;
+
+		/* moving average, weighted by the sample interval so that it
+		 * does not depend on how often the progress is updated */
+		if (step->rate > 0)
+			step->rate += (sample - step->rate) * (seconds / (R_PROGRESS_RATE_TAU + seconds));
+		else
+			step->rate = sample;
+		step->rate_time = now;
+		step->rate_bytes = done;
+	}
+	step->bytes_done = done;
+	step->bytes_total = total;
+
+	percent = done * 100 / total;
+	update_step_percentage(step, percent);
+
+	/* r_context_step_end sends 100% progress step */
+	if (percent != 100)
+		r_context_send_progress(FALSE, FALSE);
+}
+
+gboolean r_context_get_progress_bytes(RaucProgressBytes *bytes)
+{
+	g_return_val_if_fail(bytes, FALSE);
+
+	if (!context || g_private_get(&progress_muted))
+		return FALSE;
+
+	for (GList *l = context->progress; l != NULL; l = l->next) {
+		const RaucProgressStep *step = l->data;
+
+		if (!step->bytes_total)
+			continue;
+
+		bytes->step = step->name;
+		bytes->done = step->bytes_done;
+		bytes->total = step->bytes_total;
+		bytes->rate = step->rate;
+		if (step->rate > 0)
+			bytes->eta = (bytes->total - bytes->done) / step->rate;
+		else
+			bytes->eta = -1.0;
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+void r_context_set_progress_muted(gboolean muted)
+{
+	g_private_set(&progress_muted, GINT_TO_POINTER(muted));
+}
+
+gboolean r_context_in_progress_step(const gchar *name)
+{
+	const RaucProgressStep *step;
+
+	if (g_private_get(&progress_muted) || !context || !context->progress)
+		return FALSE;
+
+	step = context->progress->data;
+
+	return !name || g_strcmp0(step->name, name) == 0;
+}
+
 void r_context_free_progress_step(RaucProgressStep *step)
 {
 	if (!step)
@@ -787,6 +928,25 @@ void r_context_free_progress_step(RaucProgressStep *step)
 	g_free(step);
 }
 
+void r_context_begin_step_report(void)
+{
+	g_return_if_fail(context->step_report == NULL);
+
+	context->step_report = g_variant_builder_new(G_VARIANT_TYPE("aa{sv}"));
+}
+
+GVariant *r_context_end_step_report(void)
+{
+	GVariant *report;
+
+	g_return_val_if_fail(context->step_report, NULL);
+
+	report = g_variant_builder_end(context->step_report);
+	g_clear_pointer(&context->step_report, g_variant_builder_unref);
+
+	return report;
+}
+
 void r_context_register_progress_callback(progress_callback progress_cb)
 {
 	g_return_if_fail(progress_cb);
@@ -801,21 +961,11 @@ RaucContext *r_context_conf(void)
 	static gboolean initialized = FALSE;
 
 	if (!initialized) {
-		GError *ierror = NULL;
-
 		// let us handle broken pipes explicitly
 		signal(SIGPIPE, SIG_IGN);
 
-		if (!network_init(&ierror)) {
-			g_warning("%s", ierror->message);
-			g_error_free(ierror);
-			return NULL;
-		}
-		if (!signature_init(&ierror)) {
-			g_warning("%s", ierror->message);
-			g_error_free(ierror);
-			return NULL;
-		}
+		/* curl and OpenSSL are set up on first use by network_init() and
+		 * signature_init() */
 
 		initialized = TRUE;
 	}
@@ -857,6 +1007,8 @@ void r_context_install_info_free(RContextInstallationInfo *info)
 {
 	/* contains only reference to existing bundle instance */
 	info->mounted_bundle = NULL;
+	info->slot_hook_env_bundle = NULL;
+	g_strfreev(info->slot_hook_env);
 	g_free(info);
 }
 
@@ -871,6 +1023,10 @@ void r_context_clean(void)
 		g_clear_pointer(&context->signing_keyringpath, g_free);
 		g_clear_pointer(&context->encryption_key, g_free);
 		g_clear_pointer(&context->mksquashfs_args, g_free);
+		g_clear_pointer(&context->mksquashfs_block_size, g_free);
+		g_clear_pointer(&context->mksquashfs_comp, g_free);
+		g_clear_pointer(&context->bundle_cache_dir, g_free);
+		g_clear_pointer(&context->bundle_delta_base, g_free);
 		g_clear_pointer(&context->casync_args, g_free);
 		g_clear_pointer(&context->recipients, g_strfreev);
 		g_clear_pointer(&context->intermediatepaths, g_strfreev);
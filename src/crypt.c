@@ -1,4 +1,6 @@
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <glib.h>
 #include <glib/gstdio.h>
 #include <openssl/evp.h>
@@ -25,39 +27,40 @@ static void iv_plain64(guint8 *iv, guint iv_size, guint64 sector)
 	memcpy(iv, &iv_val, sizeof(guint64));
 }
 
+/* sectors read and written at once by each thread */
+#define CRYPT_IO_SECTORS 256
+#define CRYPT_MAX_THREADS 8
+
+typedef struct {
+	int infd;
+	int outfd;
+	const uint8_t *key;
+	gboolean encrypt;
+	RaucVerityTree *verity; /* tree to add the output to, or NULL */
+	guint64 start, end; /* range of sectors handled by this job */
+	GError *error;
+} CryptJob;
+
 /*
- * Encrypts or decrypts image to be used with dm-verity in aes-cbc-plain64 mode.
- *
- * Actual operation is chosen by 'encrypt' argument.
- *
- * Meant for internal use only, use r_crypt_encrypt() or r_crypt_decrypt()
- * instead.
- *
- * @param fd input (source) FILE
- * @param out output (encrypted) FILE
- * @param key AES key to use for encryption/decryption
- * @param encrypt whether to encrypt (TRUE) or decrypt (FALSE)
- * @param maxsize limits decryption of input FILE to maxsize bytes.
+ * Encrypts or decrypts a contiguous range of sectors.
  *
- * @return TRUE on success, FALSE on error
+ * As each sector uses its own IV in plain64 mode, the ranges are independent
+ * and can be handled by multiple threads, each with its own cipher context.
  */
-static gboolean encrypt_or_decrypt(FILE *fd, FILE *out, const uint8_t *key, gboolean encrypt, goffset maxsize, GError **error)
+static gpointer crypt_range_thread(gpointer data)
 {
-	/* Allow enough space in output buffer for additional block */
-	unsigned char inbuf[ENC_SEC_SIZE], outbuf[ENC_SEC_SIZE];
+	CryptJob *job = data;
+	g_autofree guint8 *inbuf = g_malloc(CRYPT_IO_SECTORS * ENC_SEC_SIZE);
+	g_autofree guint8 *outbuf = g_malloc(CRYPT_IO_SECTORS * ENC_SEC_SIZE);
 	g_autoptr(EVP_CIPHER_CTX) ctx = NULL;
-	int ret;
 	const EVP_CIPHER *cipher = EVP_aes_256_cbc();
-	guint64 sector_count = 0;
 	guint8 iv[16];
-	goffset donesize = 0;
-
-	g_return_val_if_fail(fd != NULL, FALSE);
-	g_return_val_if_fail(out != NULL, FALSE);
+	guint8 final[16];
+	int ret;
 
 	/* Don't set key or IV right away; we want to check lengths */
 	ctx = EVP_CIPHER_CTX_new();
-	ret = EVP_CipherInit_ex(ctx, cipher, NULL, NULL, NULL, encrypt ? 1 : 0);
+	ret = EVP_CipherInit_ex(ctx, cipher, NULL, NULL, NULL, job->encrypt ? 1 : 0);
 	if (!ret)
 		g_error("Error setting cipher");
 
@@ -68,52 +71,164 @@ static gboolean encrypt_or_decrypt(FILE *fd, FILE *out, const uint8_t *key, gboo
 	g_assert(EVP_CIPHER_CTX_key_length(ctx) == 32);
 	g_assert(EVP_CIPHER_CTX_iv_length(ctx) == 16);
 
-	/* encrypt/decrypt in 4096 byte sectors */
-	for (;;) {
-		int inlen, outlen;
+	/* the key stays the same, so it is only set once */
+	ret = EVP_CipherInit_ex(ctx, NULL, NULL, job->key, NULL, -1);
+	if (!ret)
+		g_error("Error setting key");
 
-		/* plain64 iv mode */
-		iv_plain64(iv, 16, sector_count++);
+	for (guint64 sector = job->start; sector < job->end; sector += CRYPT_IO_SECTORS) {
+		guint64 count = MIN(CRYPT_IO_SECTORS, job->end - sector);
+		gsize size = count * ENC_SEC_SIZE;
+		gsize pos = 0;
 
-		/* set up with key and iv for encryption/decryption */
-		ret = EVP_CipherInit_ex(ctx, NULL, NULL, key, iv, encrypt ? 1 : 0);
-		if (!ret)
-			g_error("Error setting key and iv");
+		while (pos < size) {
+			gssize r = TEMP_FAILURE_RETRY(pread(job->infd, inbuf + pos, size - pos, sector * ENC_SEC_SIZE + pos));
+			if (r < 0) {
+				int err = errno;
+				g_set_error(&job->error, G_FILE_ERROR, g_file_error_from_errno(err),
+						"Failed to read: %s", g_strerror(err));
+				return NULL;
+			} else if (r == 0) {
+				g_set_error(&job->error, R_CRYPT_ERROR, R_CRYPT_ERROR_FAILED, "Unexpected end of file");
+				return NULL;
+			}
+			pos += r;
+		}
 
-		inlen = fread(inbuf, 1, ENC_SEC_SIZE, fd);
-		donesize += inlen;
-		/* image size must be multiple of 4096 */
-		if (inlen <= 0)
-			break;
-		if (inlen < ENC_SEC_SIZE) {
-			g_set_error(error, R_CRYPT_ERROR, R_CRYPT_ERROR_FAILED, "Incomplete read: Input size must be multiple of %d (got only %d bytes)", ENC_SEC_SIZE, inlen);
-			return FALSE;
+		for (guint64 i = 0; i < count; i++) {
+			int outlen;
+
+			/* plain64 iv mode */
+			iv_plain64(iv, 16, sector + i);
+
+			/* set up iv for encryption/decryption */
+			ret = EVP_CipherInit_ex(ctx, NULL, NULL, NULL, iv, -1);
+			if (!ret)
+				g_error("Error setting iv");
+
+			if (!EVP_CipherUpdate(ctx, outbuf + i * ENC_SEC_SIZE, &outlen, inbuf + i * ENC_SEC_SIZE, ENC_SEC_SIZE) ||
+			    outlen != ENC_SEC_SIZE) {
+				g_set_error(&job->error, R_CRYPT_ERROR, R_CRYPT_ERROR_FAILED, "EVP_CipherUpdate() failed");
+				return NULL;
+			}
+
+			if (!EVP_CipherFinal_ex(ctx, final, &outlen)) {
+				g_set_error(&job->error, R_CRYPT_ERROR, R_CRYPT_ERROR_FAILED, "EVP_CipherFinal_ex() failed");
+				return NULL;
+			}
+			/* without padding, no data is left */
+			g_assert(outlen == 0);
 		}
 
-		/* limit decrypt size to maxsize if set */
-		if (maxsize && donesize > maxsize) {
-			return TRUE;
+		/* the jobs handle disjoint ranges, so they can add to the tree concurrently */
+		if (job->verity &&
+		    r_verity_tree_add(job->verity, sector * ENC_SEC_SIZE, outbuf, size) != 0) {
+			g_set_error(&job->error, R_CRYPT_ERROR, R_CRYPT_ERROR_FAILED, "Failed to hash data for verity tree");
+			return NULL;
 		}
 
-		if (!EVP_CipherUpdate(ctx, outbuf, &outlen, inbuf, ENC_SEC_SIZE)) {
-			g_set_error(error, R_CRYPT_ERROR, R_CRYPT_ERROR_FAILED, "EVP_CipherUpdate() failed");
-			return FALSE;
+		pos = 0;
+		while (pos < size) {
+			gssize r = TEMP_FAILURE_RETRY(pwrite(job->outfd, outbuf + pos, size - pos, sector * ENC_SEC_SIZE + pos));
+			if (r < 0) {
+				int err = errno;
+				g_set_error(&job->error, G_FILE_ERROR, g_file_error_from_errno(err),
+						"Failed to write: %s", g_strerror(err));
+				return NULL;
+			}
+			pos += r;
 		}
+	}
 
-		fwrite(outbuf, 1, outlen, out);
+	return NULL;
+}
 
-		if (!EVP_CipherFinal_ex(ctx, outbuf, &outlen)) {
-			g_set_error(error, R_CRYPT_ERROR, R_CRYPT_ERROR_FAILED, "EVP_CipherFinal_ex() failed");
-			return FALSE;
+/*
+ * Encrypts or decrypts image to be used with dm-verity in aes-cbc-plain64 mode.
+ *
+ * Actual operation is chosen by 'encrypt' argument.
+ *
+ * The sectors are split into contiguous ranges which are processed by
+ * multiple threads. The output is identical to sequential processing.
+ *
+ * Meant for internal use only, use r_crypt_encrypt() or r_crypt_decrypt()
+ * instead.
+ *
+ * @param infd input (source) file descriptor
+ * @param outfd output (encrypted) file descriptor
+ * @param key AES key to use for encryption/decryption
+ * @param encrypt whether to encrypt (TRUE) or decrypt (FALSE)
+ * @param maxsize limits decryption of input file to maxsize bytes.
+ * @param verity verity tree to add the output data to, or NULL
+ *
+ * @return TRUE on success, FALSE on error
+ */
+static gboolean encrypt_or_decrypt(int infd, int outfd, const uint8_t *key, gboolean encrypt, goffset maxsize, RaucVerityTree *verity, GError **error)
+{
+	CryptJob jobs[CRYPT_MAX_THREADS] = {0};
+	GThread *threads[CRYPT_MAX_THREADS] = {0};
+	guint64 sectors;
+	guint n_threads;
+	gboolean res = TRUE;
+	off_t size;
+
+	g_return_val_if_fail(infd >= 0, FALSE);
+	g_return_val_if_fail(outfd >= 0, FALSE);
+
+	size = lseek(infd, 0, SEEK_END);
+	if (size < 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to seek to end: %s", g_strerror(err));
+		return FALSE;
+	}
+
+	sectors = size / ENC_SEC_SIZE;
+	/* limit decrypt size to maxsize if set */
+	if (maxsize && (guint64)maxsize / ENC_SEC_SIZE < sectors) {
+		sectors = maxsize / ENC_SEC_SIZE;
+	} else if (size % ENC_SEC_SIZE) {
+		/* image size must be multiple of 4096 */
+		g_set_error(error, R_CRYPT_ERROR, R_CRYPT_ERROR_FAILED, "Incomplete read: Input size must be multiple of %d (got only %d bytes)", ENC_SEC_SIZE, (int)(size % ENC_SEC_SIZE));
+		return FALSE;
+	}
+
+	if (!sectors)
+		return TRUE;
+
+	n_threads = CLAMP(g_get_num_processors(), 1, CRYPT_MAX_THREADS);
+	n_threads = MIN(n_threads, (sectors + CRYPT_IO_SECTORS - 1) / CRYPT_IO_SECTORS);
+
+	for (guint i = 0; i < n_threads; i++) {
+		jobs[i].infd = infd;
+		jobs[i].outfd = outfd;
+		jobs[i].key = key;
+		jobs[i].encrypt = encrypt;
+		jobs[i].verity = verity;
+		jobs[i].start = sectors * i / n_threads;
+		jobs[i].end = sectors * (i + 1) / n_threads;
+		threads[i] = g_thread_new("crypt", crypt_range_thread, &jobs[i]);
+	}
+
+	for (guint i = 0; i < n_threads; i++) {
+		g_thread_join(threads[i]);
+		if (!jobs[i].error)
+			continue;
+		if (res) {
+			g_propagate_error(error, jobs[i].error);
+			res = FALSE;
+		} else {
+			g_clear_error(&jobs[i].error);
 		}
 	}
 
-	return TRUE;
+	return res;
 }
 
 static gboolean r_crypt_encrypt_or_decrypt(const gchar *inpath, const gchar *outpath, const uint8_t *key, gboolean encrypt, goffset maxsize, GError **error)
 {
-	FILE *infile = NULL, *outfile = NULL;
+	g_auto(filedesc) infd = -1;
+	g_auto(filedesc) outfd = -1;
 	GError *ierror = NULL;
 	gboolean res = FALSE;
 
@@ -122,38 +237,30 @@ static gboolean r_crypt_encrypt_or_decrypt(const gchar *inpath, const gchar *out
 	g_return_val_if_fail(key, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
-	infile = g_fopen(inpath, "r");
-	if (!infile) {
+	infd = g_open(inpath, O_RDONLY | O_CLOEXEC, 0);
+	if (infd < 0) {
 		int err = errno;
 		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
 				"Failed opening %s for reading: %s", inpath, g_strerror(err));
-		res = FALSE;
-		goto out;
+		return FALSE;
 	}
 
-	outfile = g_fopen(outpath, "w");
-	if (!outfile) {
+	outfd = g_open(outpath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (outfd < 0) {
 		int err = errno;
 		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
 				"Failed opening temporary file %s for writing: %s", outpath, g_strerror(err));
-		res = FALSE;
-		goto out;
+		return FALSE;
 	}
 
-	res = encrypt_or_decrypt(infile, outfile, key, encrypt, maxsize, &ierror);
+	res = encrypt_or_decrypt(infd, outfd, key, encrypt, maxsize, NULL, &ierror);
 	if (!res) {
 		g_propagate_prefixed_error(error, ierror,
 				"Failed to %s image: ", encrypt ? "encrypt" : "decrypt");
-		goto out;
+		return FALSE;
 	}
 
-	res = TRUE;
-out:
-	if (infile)
-		fclose(infile);
-	if (outfile)
-		fclose(outfile);
-	return res;
+	return TRUE;
 }
 
 gboolean r_crypt_encrypt(const gchar *in, const gchar *out, const guint8 *key, GError **error)
@@ -161,6 +268,32 @@ gboolean r_crypt_encrypt(const gchar *in, const gchar *out, const guint8 *key, G
 	return r_crypt_encrypt_or_decrypt(in, out, key, TRUE, 0, error);
 }
 
+gboolean r_crypt_encrypt_in_place(const gchar *path, const guint8 *key, RaucVerityTree *verity, GError **error)
+{
+	g_auto(filedesc) fd = -1;
+	GError *ierror = NULL;
+
+	g_return_val_if_fail(path, FALSE);
+	g_return_val_if_fail(key, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	fd = g_open(path, O_RDWR | O_CLOEXEC, 0);
+	if (fd < 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed opening %s for encryption: %s", path, g_strerror(err));
+		return FALSE;
+	}
+
+	/* each thread reads a range of sectors before writing it back */
+	if (!encrypt_or_decrypt(fd, fd, key, TRUE, 0, verity, &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Failed to encrypt image: ");
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 gboolean r_crypt_decrypt(const gchar *in, const gchar *out, const guint8 *key, goffset maxsize, GError **error)
 {
 	return r_crypt_encrypt_or_decrypt(in, out, key, FALSE, maxsize, error);
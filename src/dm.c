@@ -4,12 +4,24 @@
 #include <fcntl.h>
 #include <linux/dm-ioctl.h>
 #include <errno.h>
+#include <stdio.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <sys/sysmacros.h>
+#include <openssl/evp.h>
 
 #include "dm.h"
 
+/* minimum hash or cipher throughput (bytes per second) for processing data
+ * in the I/O completion context when the profile is selected automatically */
+#define RAUC_DM_INLINE_MIN_RATE (256*1024*1024)
+/* amount of data processed by the benchmark */
+#define RAUC_DM_BENCHMARK_SIZE (4*1024*1024)
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(EVP_CIPHER_CTX, EVP_CIPHER_CTX_free);
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(EVP_MD_CTX, EVP_MD_CTX_free);
+
 static void dm_set_header(struct dm_ioctl *header, size_t size, guint32 flags, const gchar *uuid)
 {
 	memset(header, 0, sizeof(*header));
@@ -53,6 +65,7 @@ void r_dm_free(RaucDM *dm)
 	g_free(dm->root_digest);
 	g_free(dm->salt);
 	g_free(dm->key);
+	g_strfreev(dm->options);
 	g_free(dm);
 }
 
@@ -68,6 +81,199 @@ static const gchar* dmtype_to_str(RaucDMType dmtype)
 	}
 }
 
+gboolean r_dm_parse_profile(const gchar *str, RaucDMProfile *profile)
+{
+	g_return_val_if_fail(str != NULL, FALSE);
+	g_return_val_if_fail(profile != NULL, FALSE);
+
+	if (g_strcmp0(str, "auto") == 0)
+		*profile = RAUC_DM_PROFILE_AUTO;
+	else if (g_strcmp0(str, "default") == 0)
+		*profile = RAUC_DM_PROFILE_DEFAULT;
+	else if (g_strcmp0(str, "low-latency") == 0)
+		*profile = RAUC_DM_PROFILE_LOW_LATENCY;
+	else if (g_strcmp0(str, "low-cpu") == 0)
+		*profile = RAUC_DM_PROFILE_LOW_CPU;
+	else
+		return FALSE;
+
+	return TRUE;
+}
+
+const gchar *r_dm_profile_to_str(RaucDMProfile profile)
+{
+	switch (profile) {
+		case RAUC_DM_PROFILE_AUTO:
+			return "auto";
+		case RAUC_DM_PROFILE_DEFAULT:
+			return "default";
+		case RAUC_DM_PROFILE_LOW_LATENCY:
+			return "low-latency";
+		case RAUC_DM_PROFILE_LOW_CPU:
+			return "low-cpu";
+		default:
+			return "unknown";
+	}
+}
+
+/* Measures the throughput of the per-block work done by the target, in bytes
+ * per second. */
+/* Uses the same OpenSSL implementation as the crypt benchmark, which (like
+ * the kernel) uses the SHA extensions of the CPU if available. */
+static guint64 benchmark_verity(void)
+{
+	g_autoptr(EVP_MD_CTX) ctx = EVP_MD_CTX_new();
+	g_autofree guint8 *block = g_malloc0(4096);
+	guint8 digest[EVP_MAX_MD_SIZE];
+	guint8 salt[32] = {0};
+	gint64 start, elapsed;
+
+	if (!ctx)
+		return 0;
+
+	start = g_get_monotonic_time();
+	for (guint i = 0; i < RAUC_DM_BENCHMARK_SIZE / 4096; i++) {
+		/* dm-verity hashes the salt followed by the block */
+		block[0] = i;
+		if (EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) != 1 ||
+		    EVP_DigestUpdate(ctx, salt, sizeof(salt)) != 1 ||
+		    EVP_DigestUpdate(ctx, block, 4096) != 1 ||
+		    EVP_DigestFinal_ex(ctx, digest, NULL) != 1)
+			return 0;
+	}
+
+	elapsed = MAX(g_get_monotonic_time() - start, 1);
+	return (guint64)RAUC_DM_BENCHMARK_SIZE * G_USEC_PER_SEC / elapsed;
+}
+
+static guint64 benchmark_crypt(void)
+{
+	g_autoptr(EVP_CIPHER_CTX) ctx = EVP_CIPHER_CTX_new();
+	g_autofree guint8 *in = g_malloc0(4096);
+	g_autofree guint8 *out = g_malloc(4096);
+	guint8 key[32] = {0};
+	guint8 iv[16] = {0};
+	gint64 start, elapsed;
+	int outlen = 0;
+
+	if (!ctx || EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, iv) != 1)
+		return 0;
+	EVP_CIPHER_CTX_set_padding(ctx, 0);
+
+	start = g_get_monotonic_time();
+	for (guint i = 0; i < RAUC_DM_BENCHMARK_SIZE / 4096; i++) {
+		/* a new IV per sector, as with plain64 */
+		memcpy(iv, &i, sizeof(i));
+		if (EVP_DecryptInit_ex(ctx, NULL, NULL, NULL, iv) != 1 ||
+		    EVP_DecryptUpdate(ctx, out, &outlen, in, 4096) != 1)
+			return 0;
+	}
+
+	elapsed = MAX(g_get_monotonic_time() - start, 1);
+	return (guint64)RAUC_DM_BENCHMARK_SIZE * G_USEC_PER_SEC / elapsed;
+}
+
+static RaucDMProfile select_profile(RaucDMType type, guint64 *rate)
+{
+	static gsize verity_rate = 0, crypt_rate = 0;
+	gsize *cached = type == RAUC_DM_VERITY ? &verity_rate : &crypt_rate;
+
+	/* the result is stored +1, so that 0 means not measured yet */
+	if (g_once_init_enter(cached)) {
+		guint64 measured = type == RAUC_DM_VERITY ? benchmark_verity() : benchmark_crypt();
+		g_once_init_leave(cached, measured + 1);
+	}
+
+	*rate = *cached - 1;
+	if (*rate >= RAUC_DM_INLINE_MIN_RATE)
+		return RAUC_DM_PROFILE_LOW_LATENCY;
+	return RAUC_DM_PROFILE_DEFAULT;
+}
+
+void r_dm_set_profile(RaucDM *dm, RaucDMProfile profile)
+{
+	g_autoptr(GPtrArray) options = g_ptr_array_new();
+	guint64 rate = 0;
+
+	g_return_if_fail(dm != NULL);
+
+	if (profile == RAUC_DM_PROFILE_AUTO)
+		profile = select_profile(dm->type, &rate);
+
+	switch (profile) {
+		case RAUC_DM_PROFILE_LOW_CPU:
+			/* only verifies blocks on the first read */
+			if (dm->type == RAUC_DM_VERITY)
+				g_ptr_array_add(options, g_strdup("check_at_most_once"));
+		/* fall through */
+		case RAUC_DM_PROFILE_LOW_LATENCY:
+			if (dm->type == RAUC_DM_VERITY) {
+				g_ptr_array_add(options, g_strdup("try_verify_in_tasklet"));
+			} else if (dm->type == RAUC_DM_CRYPT) {
+				g_ptr_array_add(options, g_strdup("no_read_workqueue"));
+				g_ptr_array_add(options, g_strdup("no_write_workqueue"));
+			}
+			break;
+		default:
+			break;
+	}
+
+	dm->profile = profile;
+	g_clear_pointer(&dm->options, g_strfreev);
+	if (options->len) {
+		g_ptr_array_add(options, NULL);
+		dm->options = (gchar **)g_ptr_array_free(g_steal_pointer(&options), FALSE);
+	}
+
+	if (rate)
+		g_message("Using dm-%s profile '%s' (measured %"G_GUINT64_FORMAT " MiB/s)",
+				dmtype_to_str(dm->type), r_dm_profile_to_str(profile), rate / (1024*1024));
+	else
+		g_message("Using dm-%s profile '%s'", dmtype_to_str(dm->type), r_dm_profile_to_str(profile));
+}
+
+/* Formats the target parameters, with or without the optional ones. Returns
+ * FALSE if they do not fit into the buffer. */
+static gboolean format_params(const RaucDM *dm, gboolean with_options, gchar *params, gsize size)
+{
+	g_autofree gchar *options = NULL;
+	guint count = with_options && dm->options ? g_strv_length(dm->options) : 0;
+	gint ret = 0;
+
+	if (count)
+		options = g_strjoinv(" ", dm->options);
+
+	switch (dm->type) {
+		case RAUC_DM_VERITY: {
+			ret = g_snprintf(params, size,
+					"1 %s %s 4096 4096 %"G_GUINT64_FORMAT " %"G_GUINT64_FORMAT " sha256 %s %s", // version 1 with sha256 hashes
+					dm->lower_dev, dm->lower_dev, // data and hash in the same device
+					dm->data_size / 4096,
+					dm->data_size / 4096, // hash offset is data size
+					dm->root_digest,
+					dm->salt);
+			if (count && ret < (gint)size)
+				ret += g_snprintf(params + ret, size - ret, " %u %s", count, options);
+			break;
+		};
+		case RAUC_DM_CRYPT:
+			/* <cipher> [<key>|:<key_size>:<user|logon>:<key_description>] <iv_offset> <dev_path> <start> */
+			ret = g_snprintf(params, size,
+					"aes-cbc-plain64 %s 0 %s 0 %u sector_size:4096%s%s",
+					dm->key,
+					dm->lower_dev,
+					count + 1,
+					count ? " " : "",
+					count ? options : "");
+			break;
+		default:
+			g_error("unknown dm typ");
+			break;
+	}
+
+	return ret < (gint)size;
+}
+
 static const gchar* dmstatus_by_dmtype(RaucDMType dmtype)
 {
 	switch (dmtype) {
@@ -154,29 +360,7 @@ gboolean r_dm_setup(RaucDM *dm, GError **error)
 	setup.target_spec.length = dm->data_size / 512;
 	g_strlcpy(setup.target_spec.target_type, dmtype_to_str(dm->type), sizeof(setup.target_spec.target_type));
 
-	switch (dm->type) {
-		case RAUC_DM_VERITY: {
-			ret = g_snprintf(setup.params, sizeof(setup.params),
-					"1 %s %s 4096 4096 %"G_GUINT64_FORMAT " %"G_GUINT64_FORMAT " sha256 %s %s", // version 1 with sha256 hashes
-					dm->lower_dev, dm->lower_dev, // data and hash in the same device
-					dm->data_size / 4096,
-					dm->data_size / 4096, // hash offset is data size
-					dm->root_digest,
-					dm->salt) >= (gint)sizeof(setup.params);
-			break;
-		};
-		case RAUC_DM_CRYPT:
-			/* <cipher> [<key>|:<key_size>:<user|logon>:<key_description>] <iv_offset> <dev_path> <start> */
-			ret = g_snprintf(setup.params, sizeof(setup.params),
-					"aes-cbc-plain64 %s 0 %s 0 1 sector_size:4096",
-					dm->key,
-					dm->lower_dev) >= (gint)sizeof(setup.params);
-			break;
-		default:
-			g_error("unknown dm typ");
-			break;
-	}
-	if (ret) {
+	if (!format_params(dm, TRUE, setup.params, sizeof(setup.params))) {
 		g_set_error(error,
 				G_FILE_ERROR,
 				G_FILE_ERROR_FAILED,
@@ -185,7 +369,22 @@ gboolean r_dm_setup(RaucDM *dm, GError **error)
 		goto out_remove_dm;
 	}
 
-	if (ioctl(dmfd, DM_TABLE_LOAD, &setup)) {
+	ret = ioctl(dmfd, DM_TABLE_LOAD, &setup);
+	if (ret && errno == EINVAL && dm->options) {
+		/* older kernels do not support all optional parameters */
+		g_message("Failed to load dm-%s table with profile '%s', retrying without optional parameters",
+				dmtype_to_str(dm->type), r_dm_profile_to_str(dm->profile));
+		dm_set_header(&setup.header, sizeof(setup), DM_READONLY_FLAG, dm->uuid);
+		setup.header.target_count = 1;
+		setup.target_spec.status = 0;
+		setup.target_spec.sector_start = 0;
+		setup.target_spec.length = dm->data_size / 512;
+		g_strlcpy(setup.target_spec.target_type, dmtype_to_str(dm->type), sizeof(setup.target_spec.target_type));
+		if (!format_params(dm, FALSE, setup.params, sizeof(setup.params)))
+			g_error("failed to generate dm parameter string");
+		ret = ioctl(dmfd, DM_TABLE_LOAD, &setup);
+	}
+	if (ret) {
 		int err = errno;
 		g_set_error(error,
 				G_FILE_ERROR,
@@ -337,3 +536,123 @@ out:
 
 	return res;
 }
+
+/*
+ * Checks whether the dm device dev is an active dm-verity target using
+ * lower_dev as its data device.
+ */
+static gboolean dm_is_verity_for(int dmfd, dev_t dev, dev_t lower_dev, guint64 *data_size)
+{
+	struct {
+		struct dm_ioctl header;
+		char data[4096];
+	} status = {0};
+	const struct dm_target_spec *spec;
+	g_auto(GStrv) params = NULL;
+	g_autofree gchar *lower_str = NULL;
+	guint64 block_size, blocks;
+
+	dm_set_header(&status.header, sizeof(status), DM_STATUS_TABLE_FLAG, "");
+	status.header.dev = dev;
+
+	if (ioctl(dmfd, DM_TABLE_STATUS, &status)) {
+		g_debug("Failed to get table of dm device %u:%u: %s", major(dev), minor(dev), g_strerror(errno));
+		return FALSE;
+	}
+
+	if (status.header.flags & (DM_BUFFER_FULL_FLAG | DM_SUSPEND_FLAG))
+		return FALSE;
+	if (status.header.target_count != 1)
+		return FALSE;
+
+	spec = (const struct dm_target_spec *)((const gchar *)&status + status.header.data_start);
+	if (g_strcmp0(spec->target_type, "verity") != 0)
+		return FALSE;
+
+	/* <version> <data_dev> <hash_dev> <data_block_size> <hash_block_size> <num_data_blocks> ... */
+	params = g_strsplit((const gchar *)(spec + 1), " ", 0);
+	if (g_strv_length(params) < 6)
+		return FALSE;
+
+	lower_str = g_strdup_printf("%u:%u", major(lower_dev), minor(lower_dev));
+	if (g_strcmp0(params[1], lower_str) != 0)
+		return FALSE;
+
+	/* corrupted data would be returned instead of an I/O error */
+	if (g_strv_contains((const gchar * const *)params, "ignore_corruption"))
+		return FALSE;
+
+	block_size = g_ascii_strtoull(params[3], NULL, 10);
+	blocks = g_ascii_strtoull(params[5], NULL, 10);
+	if (!block_size || !blocks)
+		return FALSE;
+
+	*data_size = block_size * blocks;
+
+	return TRUE;
+}
+
+gchar *r_dm_find_verity_device(const gchar *lower_dev, guint64 *data_size, GError **error)
+{
+	g_autoptr(GDir) holders = NULL;
+	g_autofree gchar *holders_path = NULL;
+	const gchar *name;
+	struct stat st;
+	gchar *result = NULL;
+	int dmfd = -1;
+
+	g_return_val_if_fail(lower_dev != NULL, NULL);
+	g_return_val_if_fail(data_size != NULL, NULL);
+	g_return_val_if_fail(error == NULL || *error == NULL, NULL);
+
+	if (stat(lower_dev, &st) != 0) {
+		int err = errno;
+		g_set_error(error,
+				G_FILE_ERROR,
+				g_file_error_from_errno(err),
+				"Failed to stat %s: %s", lower_dev, g_strerror(err));
+		return NULL;
+	}
+	if (!S_ISBLK(st.st_mode))
+		return NULL;
+
+	/* devices stacked on top of the lower device */
+	holders_path = g_strdup_printf("/sys/dev/block/%u:%u/holders", major(st.st_rdev), minor(st.st_rdev));
+	holders = g_dir_open(holders_path, 0, NULL);
+	if (!holders)
+		return NULL;
+
+	dmfd = open("/dev/mapper/control", O_RDWR|O_CLOEXEC);
+	if (dmfd < 0) {
+		int err = errno;
+		g_set_error(error,
+				G_FILE_ERROR,
+				g_file_error_from_errno(err),
+				"Failed to open /dev/mapper/control: %s", g_strerror(err));
+		return NULL;
+	}
+
+	while ((name = g_dir_read_name(holders))) {
+		g_autofree gchar *dev_path = NULL;
+		g_autofree gchar *dev_str = NULL;
+		guint maj, min;
+
+		if (!g_str_has_prefix(name, "dm-"))
+			continue;
+
+		dev_path = g_strdup_printf("/sys/class/block/%s/dev", name);
+		if (!g_file_get_contents(dev_path, &dev_str, NULL, NULL))
+			continue;
+		if (sscanf(dev_str, "%u:%u", &maj, &min) != 2)
+			continue;
+
+		if (dm_is_verity_for(dmfd, makedev(maj, min), st.st_rdev, data_size)) {
+			result = g_strdup_printf("/dev/%s", name);
+			break;
+		}
+	}
+
+	g_close(dmfd, NULL);
+
+	return result;
+}
@@ -19,17 +19,24 @@ GQuark r_emmc_error_quark(void)
 	return g_quark_from_static_string("r_emmc_error_quark");
 }
 
+static void r_emmc_read_extcsd_cmd(struct mmc_ioc_cmd *cmd, guint8 extcsd[512])
+{
+	memset(cmd, 0, sizeof(*cmd));
+
+	cmd->write_flag = 0;
+	cmd->opcode = MMC_SEND_EXT_CSD;
+	cmd->arg = 0;
+	cmd->flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
+	cmd->blksz = 512;
+	cmd->blocks = 1;
+	mmc_ioc_cmd_set_data(*cmd, extcsd);
+}
+
 static int r_emmc_read_extcsd(int fd, guint8 extcsd[512])
 {
-	struct mmc_ioc_cmd cmd = {};
+	struct mmc_ioc_cmd cmd;
 
-	cmd.write_flag = 0;
-	cmd.opcode = MMC_SEND_EXT_CSD;
-	cmd.arg = 0;
-	cmd.flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
-	cmd.blksz = 512;
-	cmd.blocks = 1;
-	mmc_ioc_cmd_set_data(cmd, extcsd);
+	r_emmc_read_extcsd_cmd(&cmd, extcsd);
 
 	return ioctl(fd, MMC_IOC_CMD, &cmd);
 }
@@ -86,21 +93,42 @@ gboolean r_emmc_read_bootpart(const gchar *device, gint *bootpart_active, GError
 	g_return_val_if_reached(FALSE);
 }
 
+static void r_emmc_write_extcsd_cmd(struct mmc_ioc_cmd *cmd, guint8 index, guint8 value)
+{
+	memset(cmd, 0, sizeof(*cmd));
+
+	cmd->write_flag = 1;
+	cmd->opcode = MMC_SWITCH;
+	cmd->arg = (MMC_SWITCH_MODE_WRITE_BYTE << 24) | (index << 16) |
+	           (value << 8) | EXT_CSD_CMD_SET_NORMAL;
+	cmd->flags = MMC_RSP_SPI_R1B | MMC_RSP_R1B | MMC_CMD_AC;
+}
+
 static gint r_emmc_write_extcsd(int fd, guint8 index, guint8 value)
 {
 	struct mmc_ioc_cmd cmd;
 
-	memset(&cmd, 0, sizeof(cmd));
-
-	cmd.write_flag = 1;
-	cmd.opcode = MMC_SWITCH;
-	cmd.arg = (MMC_SWITCH_MODE_WRITE_BYTE << 24) | (index << 16) |
-	          (value << 8) | EXT_CSD_CMD_SET_NORMAL;
-	cmd.flags = MMC_RSP_SPI_R1B | MMC_RSP_R1B | MMC_CMD_AC;
+	r_emmc_write_extcsd_cmd(&cmd, index, value);
 
 	return ioctl(fd, MMC_IOC_CMD, &cmd);
 }
 
+#ifdef MMC_IOC_MULTI_CMD
+/* Writes an EXT_CSD register and reads back EXT_CSD with a single ioctl, so
+ * that no other command is sent to the card in between. */
+static gint r_emmc_write_extcsd_readback(int fd, guint8 index, guint8 value, guint8 extcsd[512])
+{
+	g_autofree struct mmc_ioc_multi_cmd *multi = NULL;
+
+	multi = g_malloc0(sizeof(*multi) + 2 * sizeof(struct mmc_ioc_cmd));
+	multi->num_of_cmds = 2;
+	r_emmc_write_extcsd_cmd(&multi->cmds[0], index, value);
+	r_emmc_read_extcsd_cmd(&multi->cmds[1], extcsd);
+
+	return ioctl(fd, MMC_IOC_MULTI_CMD, multi);
+}
+#endif
+
 gboolean r_emmc_write_bootpart(const gchar *device, gint bootpart_active, GError **error)
 {
 	g_auto(filedesc) fd = -1;
@@ -137,6 +165,25 @@ gboolean r_emmc_write_bootpart(const gchar *device, gint bootpart_active, GError
 	else if (bootpart_active == 1)
 		value |= 0x10;
 
+#ifdef MMC_IOC_MULTI_CMD
+	if (r_emmc_write_extcsd_readback(fd, EXT_CSD_PART_CONFIG, value, extcsd) == 0) {
+		/* bits [2:0] (PARTITION_ACCESS) are changed by the kernel */
+		if ((extcsd[EXT_CSD_PART_CONFIG] & 0x78) != value) {
+			g_set_error(error, R_EMMC_ERROR, R_EMMC_ERROR_FAILED,
+					"extcsd register %d is 0x%02x after writing 0x%02x in %s",
+					EXT_CSD_PART_CONFIG, extcsd[EXT_CSD_PART_CONFIG], value, device);
+			return FALSE;
+		}
+		return TRUE;
+	} else if (errno != ENOTTY && errno != EINVAL) {
+		g_set_error(error, R_EMMC_ERROR, R_EMMC_ERROR_IOCTL,
+				"Could not write 0x%02x to extcsd register %d in %s",
+				value, EXT_CSD_PART_CONFIG, device);
+		return FALSE;
+	}
+	/* fall back to single commands if not supported by the kernel */
+#endif
+
 	if (r_emmc_write_extcsd(fd, EXT_CSD_PART_CONFIG, value)) {
 		g_set_error(error, R_EMMC_ERROR, R_EMMC_ERROR_IOCTL,
 				"Could not write 0x%02x to extcsd register %d in %s",
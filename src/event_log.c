@@ -1,13 +1,22 @@
 #include <errno.h>
+#include <fcntl.h>
 #include <glib.h>
 #include <gio/gio.h>
+#include <gio/gunixoutputstream.h>
 #include <glib/gstdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #if ENABLE_JSON
 #include <json-glib/json-glib.h>
 #endif
 
 #include "context.h"
 #include "event_log.h"
+#include "utils.h"
+
+/* serializes writing to the loggers, as events can be logged from multiple threads */
+static GMutex event_log_lock;
 
 static const gchar *supported_event_types[] = {
 	"all",
@@ -16,6 +25,7 @@ static const gchar *supported_event_types[] = {
 	R_EVENT_LOG_TYPE_INSTALL,
 	R_EVENT_LOG_TYPE_SERVICE,
 	R_EVENT_LOG_TYPE_WRITE_SLOT,
+	R_EVENT_LOG_TYPE_PERFORMANCE,
 	NULL
 };
 
@@ -67,6 +77,7 @@ void r_event_log_free_logger(REventLogger *logger)
 	g_clear_pointer(&logger->name, g_free);
 	g_clear_pointer(&logger->filename, g_free);
 	g_clear_pointer(&logger->logstream, g_object_unref);
+	g_clear_pointer(&logger->indexstream, g_object_unref);
 	g_clear_pointer(&logger->events, g_strfreev);
 
 	g_free(logger);
@@ -221,6 +232,132 @@ static gchar *event_log_format_fields_readable(GLogLevelFlags log_level,
 	return g_string_free(gstring, FALSE);
 }
 
+/**
+ * Parses a UUID string (with or without dashes) into 16 bytes.
+ *
+ * @return TRUE if the string was a valid UUID, FALSE otherwise
+ */
+static gboolean parse_uuid(const gchar *str, guint8 *uuid)
+{
+	guint n = 0;
+
+	for (const gchar *c = str; *c; c++) {
+		gint high, low;
+
+		if (*c == '-')
+			continue;
+
+		high = g_ascii_xdigit_value(c[0]);
+		low = c[1] ? g_ascii_xdigit_value(c[1]) : -1;
+		if (high < 0 || low < 0 || n >= 16)
+			return FALSE;
+
+		uuid[n++] = (high << 4) | low;
+		c++;
+	}
+
+	return n == 16;
+}
+
+static gchar *get_index_filename(const gchar *log_filename)
+{
+	return g_strdup_printf("%s.idx", log_filename);
+}
+
+/**
+ * Opens the index file for appending.
+ *
+ * A partially written entry (from an interrupted write) is truncated, so
+ * that new entries are aligned again.
+ */
+static gboolean open_index_stream(REventLogger *logger, GError **error)
+{
+	g_autofree gchar *index_filename = get_index_filename(logger->filename);
+	g_auto(filedesc) fd = -1;
+	struct stat st;
+
+	fd = g_open(index_filename, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to open index file %s: %s", index_filename, g_strerror(err));
+		return FALSE;
+	}
+
+	if (fstat(fd, &st) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to stat index file %s: %s", index_filename, g_strerror(err));
+		return FALSE;
+	}
+
+	if (st.st_size % sizeof(REventLogIndexEntry) &&
+	    ftruncate(fd, st.st_size - st.st_size % sizeof(REventLogIndexEntry)) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to truncate index file %s: %s", index_filename, g_strerror(err));
+		return FALSE;
+	}
+
+	logger->indexstream = g_unix_output_stream_new(fd, TRUE);
+	fd = -1;
+
+	return TRUE;
+}
+
+/**
+ * Appends the index entry for an event written at 'offset'.
+ *
+ * Failing to update the index only disables the index, as the event itself
+ * was already logged.
+ */
+static void event_log_write_index(REventLogger *logger, const GLogField *fields, gsize n_fields, goffset offset, gsize length)
+{
+	g_autoptr(GError) ierror = NULL;
+	REventLogIndexEntry entry = {0};
+
+	if (!logger->indexstream)
+		return;
+
+	entry.timestamp = GUINT64_TO_BE(g_get_real_time() / G_USEC_PER_SEC);
+	entry.offset = GUINT64_TO_BE(offset);
+	entry.length = GUINT32_TO_BE(length);
+
+	for (gsize i = 0; i < n_fields; i++) {
+		if (g_strcmp0(fields[i].key, "RAUC_EVENT_TYPE") == 0)
+			memcpy(entry.type, fields[i].value, MIN(strlen(fields[i].value), sizeof(entry.type)));
+		else if (g_strcmp0(fields[i].key, "TRANSACTION_ID") == 0)
+			parse_uuid(fields[i].value, entry.transaction_id);
+		else if (g_strcmp0(fields[i].key, "BOOT_ID") == 0)
+			parse_uuid(fields[i].value, entry.boot_id);
+	}
+
+	if (!g_output_stream_write_all(logger->indexstream, &entry, sizeof(entry), NULL, NULL, &ierror)) {
+		g_warning("Failed to write index for log file '%s': %s", logger->filename, ierror->message);
+		g_warning("Disabling index for logger '%s'", logger->name);
+		g_clear_pointer(&logger->indexstream, g_object_unref);
+	}
+}
+
+/**
+ * Renames the index file belonging to a log file, if it exists.
+ */
+static gboolean rename_index_file(const gchar *from_log, const gchar *to_log, GError **error)
+{
+	g_autofree gchar *from_index = get_index_filename(from_log);
+	g_autofree gchar *to_index = get_index_filename(to_log);
+
+	if (g_rename(from_index, to_index) == -1) {
+		int err = errno;
+		if (err == ENOENT)
+			return TRUE;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err), "Failed to rotate index file: %s", g_strerror(err));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 /**
  * Rotates log files.
  *
@@ -256,8 +393,9 @@ static gboolean rotate_logfiles(REventLogger* logger, goffset next_len, GError *
 	if (logger->filesize + next_len <= logger->maxsize)
 		return TRUE;
 
-	/* Close open stream */
+	/* Close open streams */
 	g_clear_pointer(&logger->logstream, g_object_unref);
+	g_clear_pointer(&logger->indexstream, g_object_unref);
 
 	/* iterate through the list of potentially existing rotation files and move
 	 * all (existing ones) but the last one. This will override (and thus drop)
@@ -278,6 +416,9 @@ static gboolean rotate_logfiles(REventLogger* logger, goffset next_len, GError *
 				return FALSE;
 			}
 		}
+
+		if (logger->index && !rename_index_file(from_file, to_file, error))
+			return FALSE;
 	}
 
 	/* rotate current log file as next .1 file */
@@ -287,6 +428,8 @@ static gboolean rotate_logfiles(REventLogger* logger, goffset next_len, GError *
 		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err), "Failed to rotate log file: %s", g_strerror(err));
 		return FALSE;
 	}
+	if (logger->index && !rename_index_file(logger->filename, rotfile, error))
+		return FALSE;
 
 	/* re-open log file */
 	logfile = g_file_new_for_path(logger->filename);
@@ -297,6 +440,12 @@ static gboolean rotate_logfiles(REventLogger* logger, goffset next_len, GError *
 	}
 	logger->filesize = 0;
 
+	if (logger->index && !open_index_stream(logger, &ierror)) {
+		g_warning("%s", ierror->message);
+		g_warning("Disabling index for logger '%s'", logger->name);
+		g_clear_error(&ierror);
+	}
+
 	return TRUE;
 }
 
@@ -354,6 +503,8 @@ static void event_log_writer_file(REventLogger* logger, const GLogField *fields,
 		return;
 	}
 
+	event_log_write_index(logger, fields, n_fields, logger->filesize, written);
+
 	logger->filesize += written;
 }
 
@@ -386,6 +537,8 @@ GLogWriterOutput r_event_log_writer(GLogLevelFlags log_level, const GLogField *f
 		}
 	}
 
+	g_mutex_lock(&event_log_lock);
+
 	/* iterate over registered event loggers */
 	for (GList *l = r_context()->config->loggers; l != NULL; l = l->next) {
 		REventLogger* logger = l->data;
@@ -402,6 +555,8 @@ GLogWriterOutput r_event_log_writer(GLogLevelFlags log_level, const GLogField *f
 		logger->writer(logger, fields, n_fields);
 	}
 
+	g_mutex_unlock(&event_log_lock);
+
 	return G_LOG_WRITER_HANDLED;
 }
 
@@ -432,7 +587,139 @@ void r_event_log_setup_logger(REventLogger *logger)
 
 	logger->filesize = g_seekable_tell(G_SEEKABLE(logger->logstream));
 
+	if (logger->index && !open_index_stream(logger, &ierror)) {
+		g_warning("%s", ierror->message);
+		g_warning("Disabling index for logger '%s'", logger->name);
+		g_clear_error(&ierror);
+	}
+
 	logger->configured = TRUE;
 
 	return;
 }
+
+typedef struct {
+	const REventLogQuery *query;
+	guint8 transaction_id[16];
+	guint8 boot_id[16];
+} EventLogMatcher;
+
+static gboolean event_log_entry_matches(const EventLogMatcher *matcher, const REventLogIndexEntry *entry)
+{
+	const REventLogQuery *query = matcher->query;
+
+	if (query->type && strncmp(entry->type, query->type, sizeof(entry->type)) != 0)
+		return FALSE;
+	if (query->transaction_id && memcmp(entry->transaction_id, matcher->transaction_id, sizeof(entry->transaction_id)) != 0)
+		return FALSE;
+	if (query->boot_id && memcmp(entry->boot_id, matcher->boot_id, sizeof(entry->boot_id)) != 0)
+		return FALSE;
+
+	return TRUE;
+}
+
+/**
+ * Adds the matching events from a single log file to 'results'.
+ */
+static gboolean event_log_query_file(const gchar *log_filename, const EventLogMatcher *matcher, GPtrArray *results, GError **error)
+{
+	GError *ierror = NULL;
+	g_autofree gchar *index_filename = get_index_filename(log_filename);
+	g_autoptr(GMappedFile) index = NULL;
+	g_auto(filedesc) log_fd = -1;
+	const REventLogIndexEntry *entries;
+	gsize count, lower, upper;
+
+	if (!g_file_test(index_filename, G_FILE_TEST_EXISTS))
+		return TRUE;
+
+	index = g_mapped_file_new(index_filename, FALSE, &ierror);
+	if (!index) {
+		g_propagate_prefixed_error(error, ierror, "Failed to open index file: ");
+		return FALSE;
+	}
+	entries = (const REventLogIndexEntry *)g_mapped_file_get_contents(index);
+	count = g_mapped_file_get_length(index) / sizeof(REventLogIndexEntry);
+
+	/* find the first entry in the time range */
+	lower = 0;
+	upper = count;
+	while (lower < upper) {
+		gsize middle = lower + (upper - lower) / 2;
+
+		if ((gint64)GUINT64_FROM_BE(entries[middle].timestamp) < matcher->query->since)
+			lower = middle + 1;
+		else
+			upper = middle;
+	}
+
+	for (gsize i = lower; i < count; i++) {
+		const REventLogIndexEntry *entry = &entries[i];
+		guint32 length = GUINT32_FROM_BE(entry->length);
+		g_autofree gchar *event = NULL;
+
+		if (matcher->query->until && (gint64)GUINT64_FROM_BE(entry->timestamp) > matcher->query->until)
+			break;
+
+		if (!event_log_entry_matches(matcher, entry))
+			continue;
+
+		if (log_fd < 0) {
+			log_fd = g_open(log_filename, O_RDONLY | O_CLOEXEC, 0);
+			if (log_fd < 0) {
+				int err = errno;
+				g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+						"Failed to open log file %s: %s", log_filename, g_strerror(err));
+				return FALSE;
+			}
+		}
+
+		event = g_malloc0(length + 1);
+		if (!r_pread_exact(log_fd, (guint8 *)event, length, GUINT64_FROM_BE(entry->offset), &ierror)) {
+			g_propagate_prefixed_error(error, ierror, "Failed to read event from %s: ", log_filename);
+			return FALSE;
+		}
+		g_strchomp(event);
+
+		g_ptr_array_add(results, g_steal_pointer(&event));
+	}
+
+	return TRUE;
+}
+
+GPtrArray *r_event_log_query(const REventLogger *logger, const REventLogQuery *query, GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(GPtrArray) results = g_ptr_array_new_with_free_func(g_free);
+	EventLogMatcher matcher = {0};
+
+	g_return_val_if_fail(logger, NULL);
+	g_return_val_if_fail(query, NULL);
+	g_return_val_if_fail(error == NULL || *error == NULL, NULL);
+
+	matcher.query = query;
+	if (query->transaction_id && !parse_uuid(query->transaction_id, matcher.transaction_id)) {
+		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Invalid transaction ID '%s'", query->transaction_id);
+		return NULL;
+	}
+	if (query->boot_id && !parse_uuid(query->boot_id, matcher.boot_id)) {
+		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "Invalid boot ID '%s'", query->boot_id);
+		return NULL;
+	}
+
+	/* search from the oldest rotation file to the current log file */
+	for (guint file_num = MAX(logger->maxfiles, 1) - 1; file_num > 0; file_num--) {
+		g_autofree gchar *rotfile = g_strdup_printf("%s.%u", logger->filename, file_num);
+
+		if (!event_log_query_file(rotfile, &matcher, results, &ierror)) {
+			g_propagate_error(error, ierror);
+			return NULL;
+		}
+	}
+	if (!event_log_query_file(logger->filename, &matcher, results, &ierror)) {
+		g_propagate_error(error, ierror);
+		return NULL;
+	}
+
+	return g_steal_pointer(&results);
+}
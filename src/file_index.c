@@ -0,0 +1,900 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#include <gio/gio.h>
+
+#include "file_index.h"
+#include "utils.h"
+
+/* The index file is a text file starting with a header line, followed by
+ * one line per entry with tab-separated fields:
+ *
+ *   type mode uid gid mtime size digest xattrs link name
+ *
+ * The mode is octal, digest, xattrs and link are empty if not applicable.
+ * Link and name are escaped with g_strescape(), so they contain no tabs or
+ * newlines.
+ */
+#define FILE_INDEX_HEADER "rauc-file-index 2"
+#define FILE_INDEX_FIELDS 10
+
+#define TAR_BLOCK_SIZE 512
+/* limit for the data of GNU long name and pax extended headers */
+#define TAR_MAX_META_SIZE (1024*1024)
+/* amount of file data read at once for hashing */
+#define TAR_READ_SIZE (64*1024)
+/* pax records for extended attributes, as written by GNU tar --xattrs */
+#define PAX_XATTR_PREFIX "SCHILY.xattr."
+
+GQuark r_file_index_error_quark(void)
+{
+	return g_quark_from_static_string("r-file-index-error-quark");
+}
+
+static void r_file_entry_free(RaucFileEntry *entry)
+{
+	if (!entry)
+		return;
+
+	g_free(entry->name);
+	g_free(entry->path);
+	g_free(entry->digest);
+	g_free(entry->xattrs);
+	g_free(entry->link);
+	g_free(entry);
+}
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(RaucFileEntry, r_file_entry_free);
+
+void r_file_index_free(RaucFileIndex *index)
+{
+	if (!index)
+		return;
+
+	g_hash_table_destroy(index->by_path);
+	g_ptr_array_free(index->entries, TRUE);
+	g_free(index);
+}
+
+void r_file_index_diff_free(RaucFileIndexDiff *diff)
+{
+	if (!diff)
+		return;
+
+	g_ptr_array_free(diff->removed, TRUE);
+	g_ptr_array_free(diff->changed, TRUE);
+	g_ptr_array_free(diff->updated, TRUE);
+	g_ptr_array_free(diff->kept, TRUE);
+	g_free(diff);
+}
+
+static RaucFileIndex *file_index_new(void)
+{
+	RaucFileIndex *index = g_new0(RaucFileIndex, 1);
+
+	index->entries = g_ptr_array_new_with_free_func((GDestroyNotify)r_file_entry_free);
+	index->by_path = g_hash_table_new(g_str_hash, g_str_equal);
+
+	return index;
+}
+
+/**
+ * Returns the member name without leading './' and '/' or trailing '/'.
+ */
+static gchar *normalize_path(const gchar *name)
+{
+	gsize len;
+
+	while (TRUE) {
+		if (g_str_has_prefix(name, "./"))
+			name += 2;
+		else if (name[0] == '/')
+			name++;
+		else
+			break;
+	}
+
+	len = strlen(name);
+	while (len && name[len - 1] == '/')
+		len--;
+	if (len == 1 && name[0] == '.')
+		len = 0;
+
+	return g_strndup(name, len);
+}
+
+/**
+ * Adds an entry to the index. If the archive contains the same path again,
+ * the later entry replaces the earlier one, as it does during extraction.
+ */
+static void file_index_add(RaucFileIndex *index, RaucFileEntry *entry)
+{
+	RaucFileEntry *previous = g_hash_table_lookup(index->by_path, entry->path);
+
+	if (previous) {
+		g_hash_table_remove(index->by_path, previous->path);
+		g_ptr_array_remove(index->entries, previous);
+	}
+
+	g_ptr_array_add(index->entries, entry);
+	g_hash_table_insert(index->by_path, entry->path, entry);
+}
+
+static gboolean read_exact(GInputStream *in, guint8 *buf, gsize len, GError **error)
+{
+	gsize read = 0;
+
+	if (!g_input_stream_read_all(in, buf, len, &read, NULL, error))
+		return FALSE;
+
+	if (read != len) {
+		g_set_error(error, R_FILE_INDEX_ERROR, R_FILE_INDEX_ERROR_FORMAT,
+				"Unexpected end of tar archive");
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean skip_bytes(GInputStream *in, guint64 count, GError **error)
+{
+	while (count) {
+		gssize skipped = g_input_stream_skip(in, MIN(count, G_MAXSSIZE), NULL, error);
+		if (skipped < 0)
+			return FALSE;
+		if (skipped == 0) {
+			g_set_error(error, R_FILE_INDEX_ERROR, R_FILE_INDEX_ERROR_FORMAT,
+					"Unexpected end of tar archive");
+			return FALSE;
+		}
+		count -= skipped;
+	}
+
+	return TRUE;
+}
+
+/* skips the padding after size bytes of data up to the next header */
+static gboolean skip_padding(GInputStream *in, guint64 size, GError **error)
+{
+	return skip_bytes(in, (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE, error);
+}
+
+/* skips data and padding up to the next header */
+static gboolean skip_data(GInputStream *in, guint64 size, GError **error)
+{
+	return skip_bytes(in, size, error) && skip_padding(in, size, error);
+}
+
+/* reads the data of a metadata entry, such as a GNU long name */
+static gchar *read_meta_data(GInputStream *in, guint64 size, GError **error)
+{
+	g_autofree gchar *data = NULL;
+
+	if (size > TAR_MAX_META_SIZE) {
+		g_set_error(error, R_FILE_INDEX_ERROR, R_FILE_INDEX_ERROR_FORMAT,
+				"Tar metadata entry too large (%"G_GUINT64_FORMAT " bytes)", size);
+		return NULL;
+	}
+
+	data = g_malloc0(size + 1);
+	if (!read_exact(in, (guint8 *)data, size, error) || !skip_padding(in, size, error))
+		return NULL;
+
+	return g_steal_pointer(&data);
+}
+
+/**
+ * Parses a numeric header field, which is either octal or (for large
+ * values in GNU archives) base-256.
+ */
+static gboolean parse_number(const guint8 *field, gsize len, guint64 *value)
+{
+	guint64 v = 0;
+	gsize i = 0;
+
+	if (field[0] & 0x80) {
+		/* negative values are not used for the supported fields */
+		if (field[0] & 0x40)
+			return FALSE;
+		v = field[0] & 0x3f;
+		for (i = 1; i < len; i++) {
+			if (v >> 56)
+				return FALSE;
+			v = (v << 8) | field[i];
+		}
+		*value = v;
+		return TRUE;
+	}
+
+	while (i < len && field[i] == ' ')
+		i++;
+	for (; i < len && field[i] >= '0' && field[i] <= '7'; i++) {
+		if (v >> 61)
+			return FALSE;
+		v = (v << 3) | (field[i] - '0');
+	}
+	if (i < len && field[i] != ' ' && field[i] != '\0')
+		return FALSE;
+
+	*value = v;
+	return TRUE;
+}
+
+static gboolean header_is_zero(const guint8 *header)
+{
+	for (gsize i = 0; i < TAR_BLOCK_SIZE; i++) {
+		if (header[i])
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean check_header_checksum(const guint8 *header)
+{
+	guint64 expected = 0;
+	guint64 sum = 0;
+
+	if (!parse_number(header + 148, 8, &expected))
+		return FALSE;
+
+	/* the checksum field itself counts as spaces */
+	for (gsize i = 0; i < TAR_BLOCK_SIZE; i++)
+		sum += (i >= 148 && i < 156) ? ' ' : header[i];
+
+	return sum == expected;
+}
+
+/**
+ * Parses the records of a pax extended header ("<len> <key>=<value>\n")
+ * into a table of the keys used for the index.
+ *
+ * The values of extended attributes may contain any bytes, so they are
+ * stored hex-encoded.
+ */
+static GHashTable *parse_pax(const gchar *data, gsize size, GError **error)
+{
+	g_autoptr(GHashTable) pax = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	gsize pos = 0;
+
+	while (pos < size && data[pos]) {
+		const gchar *record = data + pos;
+		const gchar *eq;
+		gchar *end = NULL;
+		gchar *key, *value;
+		gsize value_len;
+		guint64 len = g_ascii_strtoull(record, &end, 10);
+
+		if (end == record || *end != ' ' || len > size - pos ||
+		    (guint64)(end - record) + 2 > len || record[len - 1] != '\n') {
+			g_set_error(error, R_FILE_INDEX_ERROR, R_FILE_INDEX_ERROR_FORMAT,
+					"Invalid pax extended header");
+			return NULL;
+		}
+
+		eq = memchr(end + 1, '=', record + len - (end + 1));
+		if (!eq) {
+			g_set_error(error, R_FILE_INDEX_ERROR, R_FILE_INDEX_ERROR_FORMAT,
+					"Invalid pax extended header record");
+			return NULL;
+		}
+
+		key = g_strndup(end + 1, eq - (end + 1));
+		value_len = record + len - 1 - (eq + 1);
+		if (g_str_has_prefix(key, PAX_XATTR_PREFIX) && value_len)
+			value = r_hex_encode((const guint8 *)eq + 1, value_len);
+		else
+			value = g_strndup(eq + 1, value_len);
+		g_hash_table_replace(pax, key, value);
+		pos += len;
+	}
+
+	return g_steal_pointer(&pax);
+}
+
+/* applies a numeric pax override, ignoring any fractional part */
+static gboolean pax_number(GHashTable *pax, const gchar *key, guint64 *value)
+{
+	const gchar *str = pax ? g_hash_table_lookup(pax, key) : NULL;
+	gchar *end = NULL;
+	guint64 v;
+
+	if (!str)
+		return TRUE;
+
+	v = g_ascii_strtoull(str, &end, 10);
+	if (end == str || (*end != '\0' && *end != '.'))
+		return FALSE;
+
+	*value = v;
+	return TRUE;
+}
+
+static gint compare_strings(gconstpointer a, gconstpointer b)
+{
+	return strcmp(*(const gchar **)a, *(const gchar **)b);
+}
+
+/* Returns a digest over all extended attributes, or NULL if there are none. */
+static gchar *pax_xattrs_digest(GHashTable *pax)
+{
+	g_autoptr(GPtrArray) keys = g_ptr_array_new();
+	g_autoptr(GChecksum) checksum = NULL;
+	GHashTableIter iter;
+	gpointer key;
+
+	if (!pax)
+		return NULL;
+
+	g_hash_table_iter_init(&iter, pax);
+	while (g_hash_table_iter_next(&iter, &key, NULL)) {
+		if (g_str_has_prefix(key, PAX_XATTR_PREFIX))
+			g_ptr_array_add(keys, key);
+	}
+	if (!keys->len)
+		return NULL;
+
+	/* the order of the records doesn't matter */
+	g_ptr_array_sort(keys, compare_strings);
+	checksum = g_checksum_new(G_CHECKSUM_SHA256);
+	for (guint i = 0; i < keys->len; i++) {
+		const gchar *name = g_ptr_array_index(keys, i);
+		const gchar *value = g_hash_table_lookup(pax, name);
+
+		g_checksum_update(checksum, (const guchar *)name, strlen(name));
+		g_checksum_update(checksum, (const guchar *)"=", 1);
+		g_checksum_update(checksum, (const guchar *)value, strlen(value));
+		g_checksum_update(checksum, (const guchar *)"\n", 1);
+	}
+
+	return g_strdup(g_checksum_get_string(checksum));
+}
+
+static gboolean hash_data(GInputStream *in, guint64 size, gchar **digest, GError **error)
+{
+	g_autoptr(GChecksum) checksum = g_checksum_new(G_CHECKSUM_SHA256);
+	g_autofree guint8 *buf = g_malloc(TAR_READ_SIZE);
+	guint64 remaining = size;
+
+	while (remaining) {
+		gsize len = MIN(remaining, TAR_READ_SIZE);
+
+		if (!read_exact(in, buf, len, error))
+			return FALSE;
+		g_checksum_update(checksum, buf, len);
+		remaining -= len;
+	}
+
+	if (!skip_padding(in, size, error))
+		return FALSE;
+
+	*digest = g_strdup(g_checksum_get_string(checksum));
+	return TRUE;
+}
+
+static gboolean read_tar(GInputStream *in, RaucFileIndex *index, GError **error)
+{
+	GError *ierror = NULL;
+	g_autofree gchar *long_name = NULL;
+	g_autofree gchar *long_link = NULL;
+	g_autoptr(GHashTable) pax = NULL;
+	guint8 header[TAR_BLOCK_SIZE];
+
+	while (TRUE) {
+		g_autoptr(RaucFileEntry) entry = NULL;
+		g_autofree gchar *name = NULL;
+		guint64 size = 0, mode = 0, uid = 0, gid = 0, mtime = 0;
+		gsize read = 0;
+		gchar type;
+
+		if (!g_input_stream_read_all(in, header, sizeof(header), &read, NULL, error))
+			return FALSE;
+		/* tolerate archives without the end-of-archive blocks */
+		if (read == 0)
+			break;
+		if (read != sizeof(header)) {
+			g_set_error(error, R_FILE_INDEX_ERROR, R_FILE_INDEX_ERROR_FORMAT,
+					"Unexpected end of tar archive");
+			return FALSE;
+		}
+		if (header_is_zero(header))
+			break;
+
+		if (!check_header_checksum(header) ||
+		    !parse_number(header + 124, 12, &size) ||
+		    !parse_number(header + 100, 8, &mode) ||
+		    !parse_number(header + 108, 8, &uid) ||
+		    !parse_number(header + 116, 8, &gid) ||
+		    !parse_number(header + 136, 12, &mtime)) {
+			g_set_error(error, R_FILE_INDEX_ERROR, R_FILE_INDEX_ERROR_FORMAT,
+					"Invalid tar header");
+			return FALSE;
+		}
+
+		type = header[156];
+		switch (type) {
+			case 'L':
+				g_free(long_name);
+				long_name = read_meta_data(in, size, error);
+				if (!long_name)
+					return FALSE;
+				continue;
+			case 'K':
+				g_free(long_link);
+				long_link = read_meta_data(in, size, error);
+				if (!long_link)
+					return FALSE;
+				continue;
+			case 'x': {
+				g_autofree gchar *data = read_meta_data(in, size, error);
+				if (!data)
+					return FALSE;
+				g_clear_pointer(&pax, g_hash_table_destroy);
+				pax = parse_pax(data, size, error);
+				if (!pax)
+					return FALSE;
+				continue;
+			}
+			case 'g':
+				if (!skip_data(in, size, error))
+					return FALSE;
+				continue;
+			case '\0':
+			case '7':
+				type = R_FILE_ENTRY_REGULAR;
+				break;
+			case R_FILE_ENTRY_REGULAR:
+			case R_FILE_ENTRY_HARDLINK:
+			case R_FILE_ENTRY_SYMLINK:
+			case R_FILE_ENTRY_CHARDEV:
+			case R_FILE_ENTRY_BLOCKDEV:
+			case R_FILE_ENTRY_DIRECTORY:
+			case R_FILE_ENTRY_FIFO:
+				break;
+			default:
+				g_set_error(error, R_FILE_INDEX_ERROR, R_FILE_INDEX_ERROR_UNSUPPORTED,
+						"Unsupported tar entry type '%c'", type);
+				return FALSE;
+		}
+
+		if (!pax_number(pax, "size", &size) ||
+		    !pax_number(pax, "uid", &uid) ||
+		    !pax_number(pax, "gid", &gid) ||
+		    !pax_number(pax, "mtime", &mtime)) {
+			g_set_error(error, R_FILE_INDEX_ERROR, R_FILE_INDEX_ERROR_FORMAT,
+					"Invalid number in pax extended header");
+			return FALSE;
+		}
+
+		entry = g_new0(RaucFileEntry, 1);
+		entry->type = type;
+		entry->mode = mode & 07777;
+		entry->uid = uid;
+		entry->gid = gid;
+		entry->mtime = mtime;
+		entry->xattrs = pax_xattrs_digest(pax);
+
+		if (pax && g_hash_table_lookup(pax, "path")) {
+			entry->name = g_strdup(g_hash_table_lookup(pax, "path"));
+		} else if (long_name) {
+			entry->name = g_steal_pointer(&long_name);
+		} else {
+			name = g_strndup((const gchar *)header, 100);
+			/* POSIX ustar archives may split long names */
+			if (memcmp(header + 257, "ustar\0", 6) == 0 && header[345]) {
+				g_autofree gchar *prefix = g_strndup((const gchar *)header + 345, 155);
+				entry->name = g_strconcat(prefix, "/", name, NULL);
+			} else {
+				entry->name = g_steal_pointer(&name);
+			}
+		}
+		entry->path = normalize_path(entry->name);
+
+		/* pre-POSIX archives mark directories only by a trailing '/' */
+		if (type == R_FILE_ENTRY_REGULAR && g_str_has_suffix(entry->name, "/")) {
+			type = R_FILE_ENTRY_DIRECTORY;
+			entry->type = type;
+		}
+
+		if (type == R_FILE_ENTRY_HARDLINK || type == R_FILE_ENTRY_SYMLINK) {
+			if (pax && g_hash_table_lookup(pax, "linkpath"))
+				entry->link = g_strdup(g_hash_table_lookup(pax, "linkpath"));
+			else if (long_link)
+				entry->link = g_steal_pointer(&long_link);
+			else
+				entry->link = g_strndup((const gchar *)header + 157, 100);
+			/* hard links refer to other members */
+			if (type == R_FILE_ENTRY_HARDLINK) {
+				gchar *path = normalize_path(entry->link);
+				g_free(entry->link);
+				entry->link = path;
+			}
+		} else if (type == R_FILE_ENTRY_CHARDEV || type == R_FILE_ENTRY_BLOCKDEV) {
+			guint64 major = 0, minor = 0;
+
+			if (!parse_number(header + 329, 8, &major) || !parse_number(header + 337, 8, &minor)) {
+				g_set_error(error, R_FILE_INDEX_ERROR, R_FILE_INDEX_ERROR_FORMAT,
+						"Invalid device numbers for %s", entry->name);
+				return FALSE;
+			}
+			entry->link = g_strdup_printf("%"G_GUINT64_FORMAT ",%"G_GUINT64_FORMAT, major, minor);
+		}
+
+		g_clear_pointer(&long_name, g_free);
+		g_clear_pointer(&long_link, g_free);
+		g_clear_pointer(&pax, g_hash_table_destroy);
+
+		if (type == R_FILE_ENTRY_REGULAR) {
+			entry->size = size;
+			if (!hash_data(in, size, &entry->digest, &ierror)) {
+				g_propagate_prefixed_error(error, ierror, "Failed to read %s: ", entry->name);
+				return FALSE;
+			}
+		} else if (!skip_data(in, size, error)) {
+			return FALSE;
+		}
+
+		file_index_add(index, g_steal_pointer(&entry));
+	}
+
+	return TRUE;
+}
+
+static const struct {
+	const gchar *suffix;
+	const gchar *command;
+} decompressors[] = {
+	{".gz", "gzip"},
+	{".tgz", "gzip"},
+	{".taz", "gzip"},
+	{".Z", "gzip"},
+	{".taZ", "gzip"},
+	{".bz2", "bzip2"},
+	{".tbz", "bzip2"},
+	{".tbz2", "bzip2"},
+	{".tz2", "bzip2"},
+	{".lz", "lzip"},
+	{".lzma", "lzma"},
+	{".tlz", "lzma"},
+	{".lzo", "lzop"},
+	{".xz", "xz"},
+	{".txz", "xz"},
+	{".zst", "zstd"},
+	{".tzst", "zstd"},
+};
+
+RaucFileIndex *r_file_index_from_tar(const gchar *filename, GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(RaucFileIndex) index = file_index_new();
+	g_autoptr(GSubprocess) sproc = NULL;
+	g_autoptr(GInputStream) in = NULL;
+	const gchar *command = NULL;
+
+	g_return_val_if_fail(filename, NULL);
+	g_return_val_if_fail(error == NULL || *error == NULL, NULL);
+
+	for (gsize i = 0; i < G_N_ELEMENTS(decompressors); i++) {
+		if (g_str_has_suffix(filename, decompressors[i].suffix)) {
+			command = decompressors[i].command;
+			break;
+		}
+	}
+
+	if (command) {
+		sproc = r_subprocess_new(G_SUBPROCESS_FLAGS_STDOUT_PIPE, &ierror, command, "-dc", filename, NULL);
+		if (!sproc) {
+			g_propagate_prefixed_error(error, ierror, "Failed to start %s: ", command);
+			return NULL;
+		}
+		in = g_object_ref(g_subprocess_get_stdout_pipe(sproc));
+	} else {
+		g_autoptr(GFile) file = g_file_new_for_path(filename);
+
+		in = G_INPUT_STREAM(g_file_read(file, NULL, &ierror));
+		if (!in) {
+			g_propagate_prefixed_error(error, ierror, "Failed to open %s: ", filename);
+			return NULL;
+		}
+	}
+
+	if (!read_tar(in, index, &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Failed to index %s: ", filename);
+		if (sproc)
+			g_subprocess_force_exit(sproc);
+		return NULL;
+	}
+
+	if (sproc) {
+		/* consume the padding after the end-of-archive blocks */
+		while (TRUE) {
+			gssize skipped = g_input_stream_skip(in, TAR_READ_SIZE, NULL, &ierror);
+			if (skipped < 0) {
+				g_propagate_prefixed_error(error, ierror, "Failed to read %s: ", filename);
+				return NULL;
+			}
+			if (!skipped)
+				break;
+		}
+
+		if (!g_subprocess_wait_check(sproc, NULL, &ierror)) {
+			g_propagate_prefixed_error(error, ierror, "Failed to decompress %s: ", filename);
+			return NULL;
+		}
+	}
+
+	return g_steal_pointer(&index);
+}
+
+static gboolean parse_field(const gchar *str, guint64 max, guint base, guint64 *value)
+{
+	return g_ascii_string_to_unsigned(str, base, 0, max, value, NULL);
+}
+
+static RaucFileEntry *parse_entry(const gchar *line, GError **error)
+{
+	g_auto(GStrv) fields = g_strsplit(line, "\t", -1);
+	g_autoptr(RaucFileEntry) entry = NULL;
+	guint64 mode, uid, gid, mtime, size;
+
+	if (g_strv_length(fields) != FILE_INDEX_FIELDS || strlen(fields[0]) != 1 ||
+	    !strchr("0123456", fields[0][0]) ||
+	    !parse_field(fields[1], 07777, 8, &mode) ||
+	    !parse_field(fields[2], G_MAXUINT32, 10, &uid) ||
+	    !parse_field(fields[3], G_MAXUINT32, 10, &gid) ||
+	    !parse_field(fields[4], G_MAXINT64, 10, &mtime) ||
+	    !parse_field(fields[5], G_MAXINT64, 10, &size) ||
+	    !fields[9][0]) {
+		g_set_error(error, R_FILE_INDEX_ERROR, R_FILE_INDEX_ERROR_FORMAT,
+				"Invalid file index entry: %s", line);
+		return NULL;
+	}
+
+	entry = g_new0(RaucFileEntry, 1);
+	entry->type = fields[0][0];
+	entry->mode = mode;
+	entry->uid = uid;
+	entry->gid = gid;
+	entry->mtime = mtime;
+	entry->size = size;
+	entry->digest = fields[6][0] ? g_strdup(fields[6]) : NULL;
+	entry->xattrs = fields[7][0] ? g_strdup(fields[7]) : NULL;
+	entry->link = fields[8][0] ? g_strcompress(fields[8]) : NULL;
+	entry->name = g_strcompress(fields[9]);
+	entry->path = normalize_path(entry->name);
+
+	/* only the archive root has an empty path */
+	if ((entry->type == R_FILE_ENTRY_REGULAR) != (entry->digest != NULL) ||
+	    (!entry->path[0] && entry->type != R_FILE_ENTRY_DIRECTORY)) {
+		g_set_error(error, R_FILE_INDEX_ERROR, R_FILE_INDEX_ERROR_FORMAT,
+				"Invalid file index entry: %s", line);
+		return NULL;
+	}
+
+	return g_steal_pointer(&entry);
+}
+
+RaucFileIndex *r_file_index_load(const gchar *filename, GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(RaucFileIndex) index = file_index_new();
+	g_autofree gchar *contents = NULL;
+	g_auto(GStrv) lines = NULL;
+
+	g_return_val_if_fail(filename, NULL);
+	g_return_val_if_fail(error == NULL || *error == NULL, NULL);
+
+	if (!g_file_get_contents(filename, &contents, NULL, &ierror)) {
+		g_propagate_error(error, ierror);
+		return NULL;
+	}
+
+	lines = g_strsplit(contents, "\n", -1);
+	if (g_strcmp0(lines[0], FILE_INDEX_HEADER) != 0) {
+		g_set_error(error, R_FILE_INDEX_ERROR, R_FILE_INDEX_ERROR_FORMAT,
+				"Unsupported file index format in %s", filename);
+		return NULL;
+	}
+
+	for (guint i = 1; lines[i]; i++) {
+		RaucFileEntry *entry = NULL;
+
+		if (!lines[i][0])
+			continue;
+
+		entry = parse_entry(lines[i], &ierror);
+		if (!entry) {
+			g_propagate_prefixed_error(error, ierror, "Failed to load %s: ", filename);
+			return NULL;
+		}
+		file_index_add(index, entry);
+	}
+
+	return g_steal_pointer(&index);
+}
+
+gboolean r_file_index_save(const RaucFileIndex *index, const gchar *filename, GError **error)
+{
+	g_autoptr(GString) contents = g_string_new(FILE_INDEX_HEADER "\n");
+
+	g_return_val_if_fail(index, FALSE);
+	g_return_val_if_fail(filename, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	for (guint i = 0; i < index->entries->len; i++) {
+		const RaucFileEntry *entry = g_ptr_array_index(index->entries, i);
+		g_autofree gchar *link = entry->link ? g_strescape(entry->link, NULL) : g_strdup("");
+		g_autofree gchar *name = g_strescape(entry->name, NULL);
+
+		g_string_append_printf(contents, "%c\t%o\t%"G_GUINT32_FORMAT "\t%"G_GUINT32_FORMAT "\t%"G_GINT64_FORMAT "\t%"G_GOFFSET_FORMAT "\t%s\t%s\t%s\t%s\n",
+				entry->type, entry->mode, entry->uid, entry->gid, entry->mtime, entry->size,
+				entry->digest ? entry->digest : "", entry->xattrs ? entry->xattrs : "", link, name);
+	}
+
+	return g_file_set_contents(filename, contents->str, contents->len, error);
+}
+
+/* extended attributes are compared here, as they can only be restored by
+ * extracting the entry */
+static gboolean content_equal(const RaucFileEntry *a, const RaucFileEntry *b)
+{
+	return a->type == b->type &&
+	       a->size == b->size &&
+	       g_strcmp0(a->digest, b->digest) == 0 &&
+	       g_strcmp0(a->xattrs, b->xattrs) == 0 &&
+	       g_strcmp0(a->link, b->link) == 0;
+}
+
+static gboolean metadata_equal(const RaucFileEntry *a, const RaucFileEntry *b)
+{
+	/* hard links share the metadata of their target */
+	if (a->type == R_FILE_ENTRY_HARDLINK)
+		return TRUE;
+
+	return a->mode == b->mode &&
+	       a->uid == b->uid &&
+	       a->gid == b->gid &&
+	       a->mtime == b->mtime;
+}
+
+static gint compare_path_descending(gconstpointer a, gconstpointer b)
+{
+	const RaucFileEntry *entry_a = *(const RaucFileEntry **)a;
+	const RaucFileEntry *entry_b = *(const RaucFileEntry **)b;
+
+	return strcmp(entry_b->path, entry_a->path);
+}
+
+RaucFileIndexDiff *r_file_index_diff(const RaucFileIndex *old, const RaucFileIndex *new)
+{
+	RaucFileIndexDiff *diff = g_new0(RaucFileIndexDiff, 1);
+	g_autoptr(GHashTable) changed_paths = g_hash_table_new(g_str_hash, g_str_equal);
+
+	g_return_val_if_fail(old, NULL);
+	g_return_val_if_fail(new, NULL);
+
+	diff->removed = g_ptr_array_new();
+	diff->changed = g_ptr_array_new();
+	diff->updated = g_ptr_array_new();
+	diff->kept = g_ptr_array_new();
+
+	for (guint i = 0; i < old->entries->len; i++) {
+		RaucFileEntry *entry = g_ptr_array_index(old->entries, i);
+		const RaucFileEntry *new_entry = g_hash_table_lookup(new->by_path, entry->path);
+
+		/* the archive root is the slot's mount point */
+		if (!entry->path[0])
+			continue;
+
+		if (!new_entry || new_entry->type != entry->type)
+			g_ptr_array_add(diff->removed, entry);
+	}
+	/* a directory can only be removed after its contents */
+	g_ptr_array_sort(diff->removed, compare_path_descending);
+
+	/* hard links always follow their target in an archive */
+	for (guint i = 0; i < new->entries->len; i++) {
+		RaucFileEntry *entry = g_ptr_array_index(new->entries, i);
+		RaucFileEntry *old_entry = g_hash_table_lookup(old->by_path, entry->path);
+
+		if (!old_entry || !content_equal(old_entry, entry) ||
+		    (entry->type == R_FILE_ENTRY_HARDLINK && g_hash_table_contains(changed_paths, entry->link))) {
+			g_ptr_array_add(diff->changed, entry);
+			g_hash_table_add(changed_paths, entry->path);
+			if (entry->type == R_FILE_ENTRY_REGULAR)
+				diff->changed_size += entry->size;
+			continue;
+		}
+
+		g_ptr_array_add(diff->kept, old_entry);
+		if (!metadata_equal(old_entry, entry))
+			g_ptr_array_add(diff->updated, entry);
+	}
+
+	return diff;
+}
+
+gboolean r_file_entry_check(const RaucFileEntry *entry, const gchar *root, GError **error)
+{
+	g_autofree gchar *path = NULL;
+	struct stat st;
+	gboolean type_ok = FALSE;
+
+	g_return_val_if_fail(entry, FALSE);
+	g_return_val_if_fail(root, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	path = g_build_filename(root, entry->path, NULL);
+	if (lstat(path, &st) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to check %s: %s", entry->path, g_strerror(err));
+		return FALSE;
+	}
+
+	switch (entry->type) {
+		case R_FILE_ENTRY_REGULAR:
+			type_ok = S_ISREG(st.st_mode);
+			break;
+		case R_FILE_ENTRY_HARDLINK:
+			type_ok = !S_ISDIR(st.st_mode);
+			break;
+		case R_FILE_ENTRY_SYMLINK:
+			type_ok = S_ISLNK(st.st_mode);
+			break;
+		case R_FILE_ENTRY_CHARDEV:
+			type_ok = S_ISCHR(st.st_mode);
+			break;
+		case R_FILE_ENTRY_BLOCKDEV:
+			type_ok = S_ISBLK(st.st_mode);
+			break;
+		case R_FILE_ENTRY_DIRECTORY:
+			type_ok = S_ISDIR(st.st_mode);
+			break;
+		case R_FILE_ENTRY_FIFO:
+			type_ok = S_ISFIFO(st.st_mode);
+			break;
+	}
+	if (!type_ok) {
+		g_set_error(error, R_FILE_INDEX_ERROR, R_FILE_INDEX_ERROR_FAILED,
+				"%s has an unexpected type", entry->path);
+		return FALSE;
+	}
+
+	if (entry->type == R_FILE_ENTRY_REGULAR) {
+		/* vfat stores modification times with a resolution of two seconds */
+		if (st.st_size != entry->size || ABS((gint64)st.st_mtime - entry->mtime) > 2) {
+			g_set_error(error, R_FILE_INDEX_ERROR, R_FILE_INDEX_ERROR_FAILED,
+					"%s was modified", entry->path);
+			return FALSE;
+		}
+	} else if (entry->type == R_FILE_ENTRY_HARDLINK) {
+		g_autofree gchar *target = g_build_filename(root, entry->link, NULL);
+		struct stat target_st;
+
+		if (lstat(target, &target_st) != 0 || target_st.st_dev != st.st_dev || target_st.st_ino != st.st_ino) {
+			g_set_error(error, R_FILE_INDEX_ERROR, R_FILE_INDEX_ERROR_FAILED,
+					"%s is no longer linked to %s", entry->path, entry->link);
+			return FALSE;
+		}
+	} else if (entry->type == R_FILE_ENTRY_SYMLINK) {
+		g_autofree gchar *target = g_file_read_link(path, NULL);
+
+		if (g_strcmp0(target, entry->link) != 0) {
+			g_set_error(error, R_FILE_INDEX_ERROR, R_FILE_INDEX_ERROR_FAILED,
+					"%s points to a different target", entry->path);
+			return FALSE;
+		}
+	} else if (entry->type == R_FILE_ENTRY_CHARDEV || entry->type == R_FILE_ENTRY_BLOCKDEV) {
+		g_autofree gchar *devno = g_strdup_printf("%u,%u", major(st.st_rdev), minor(st.st_rdev));
+
+		if (g_strcmp0(devno, entry->link) != 0) {
+			g_set_error(error, R_FILE_INDEX_ERROR, R_FILE_INDEX_ERROR_FAILED,
+					"%s has different device numbers", entry->path);
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
@@ -1,10 +1,12 @@
 #include <glib/gstdio.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <libfdisk/libfdisk.h>
 
 #include "gpt.h"
 #include "update_handler.h"
+#include "utils.h"
 
 /* partition entry in GPT partition table, the system boots from */
 #define BOOT_PARTITION_ENTRY		0
@@ -190,102 +192,123 @@ out:
 	return res;
 }
 
-gboolean r_gpt_switch_get_inactive_partition(const gchar *device,
-		struct boot_switch_partition *partition,
+struct _RGptSwitch {
+	gchar *device;
+	struct fdisk_context *cxt;
+	/* primary GPT header as read by r_gpt_switch_open() */
+	guint8 *header;
+	gulong sector_size;
+	struct boot_switch_partition inactive;
+};
+
+static guint8 *read_header(struct fdisk_context *cxt, GError **error)
+{
+	gulong sector_size = fdisk_get_sector_size(cxt);
+	g_autofree guint8 *header = g_malloc(sector_size);
+
+	if (!r_pread_exact(fdisk_get_devfd(cxt), header, sector_size, sector_size, error))
+		return NULL;
+
+	return g_steal_pointer(&header);
+}
+
+RGptSwitch *r_gpt_switch_open(const gchar *device,
 		guint64 region_start, guint64 region_size,
 		GError **error)
 {
-	gboolean res = FALSE;
+	g_autoptr(RGptSwitch) sw = NULL;
 	GError *ierror = NULL;
-	gulong sector_size;
-	struct fdisk_context *cxt = NULL;
 	struct fdisk_partition *pa = NULL;
+	fdisk_sector_t boot_start;
 
-	g_return_val_if_fail(device, FALSE);
-	g_return_val_if_fail(partition, FALSE);
-	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+	g_return_val_if_fail(device, NULL);
+	g_return_val_if_fail(error == NULL || *error == NULL, NULL);
 
-	cxt = get_context();
+	sw = g_new0(RGptSwitch, 1);
+	sw->device = g_strdup(device);
+	sw->cxt = get_context();
 
-	if (fdisk_assign_device(cxt, device, 1)) {
+	if (fdisk_assign_device(sw->cxt, device, 0)) {
 		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED,
 				"Failed to open %s with libfdisk", device);
-		goto out_cxt;
+		/* nothing to deassign */
+		g_clear_pointer(&sw->cxt, fdisk_unref_context);
+		return NULL;
 	}
 
-	if (!check_gpt(cxt, &ierror)) {
+	if (!check_gpt(sw->cxt, &ierror)) {
 		g_propagate_error(error, ierror);
-		goto out_deassign;
+		return NULL;
 	}
 
-	if (!check_region(cxt, region_start, region_size, &ierror)) {
+	if (!check_region(sw->cxt, region_start, region_size, &ierror)) {
 		g_propagate_error(error, ierror);
-		goto out_deassign;
+		return NULL;
 	}
 
-	if (fdisk_get_partition(cxt, BOOT_PARTITION_ENTRY, &pa) != 0) {
+	sw->header = read_header(sw->cxt, &ierror);
+	if (!sw->header) {
+		g_propagate_prefixed_error(error, ierror, "Failed to read GPT header: ");
+		return NULL;
+	}
+
+	if (fdisk_get_partition(sw->cxt, BOOT_PARTITION_ENTRY, &pa) != 0) {
 		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED,
 				"No boot partition found in entry %d",
 				BOOT_PARTITION_ENTRY);
-		goto out_deassign;
+		return NULL;
 	}
+	boot_start = fdisk_partition_get_start(pa);
+	fdisk_unref_partition(pa);
 
-	sector_size = fdisk_get_sector_size(cxt);
-	if ((region_start / sector_size) ==
-	    fdisk_partition_get_start(pa)) {
-		partition->start = region_start + region_size / 2;
-	} else if (((region_start + region_size / 2) / sector_size) ==
-	           fdisk_partition_get_start(pa)) {
-		partition->start = region_start;
+	sw->sector_size = fdisk_get_sector_size(sw->cxt);
+	if ((region_start / sw->sector_size) == boot_start) {
+		sw->inactive.start = region_start + region_size / 2;
+	} else if (((region_start + region_size / 2) / sw->sector_size) == boot_start) {
+		sw->inactive.start = region_start;
 	} else {
 		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED,
 				"Boot partition's start address does not match "
 				"region configuration");
-		goto out_unref_part;
+		return NULL;
 	}
-	partition->size = region_size / 2;
+	sw->inactive.size = region_size / 2;
 
-	res = TRUE;
+	return g_steal_pointer(&sw);
+}
 
-out_unref_part:
-	fdisk_unref_partition(pa);
-out_deassign:
-	fdisk_deassign_device(cxt, 0);
-out_cxt:
-	fdisk_unref_context(cxt);
+const struct boot_switch_partition *r_gpt_switch_get_inactive(const RGptSwitch *sw)
+{
+	g_return_val_if_fail(sw, NULL);
 
-	return res;
+	return &sw->inactive;
 }
 
-gboolean r_gpt_switch_set_boot_partition(const gchar *device,
-		const struct boot_switch_partition *partition,
-		GError **error)
+gboolean r_gpt_switch_activate(RGptSwitch *sw, GError **error)
 {
 	gboolean res = FALSE;
 	GError *ierror = NULL;
-	gulong sector_size;
-	struct fdisk_context *cxt = NULL;
+	g_autofree guint8 *header = NULL;
 	struct fdisk_label *lb = NULL;
 	struct fdisk_partition *pa = NULL;
 
-	g_return_val_if_fail(device, FALSE);
-	g_return_val_if_fail(partition, FALSE);
+	g_return_val_if_fail(sw, FALSE);
+	g_return_val_if_fail(sw->cxt, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
-	cxt = get_context();
-
-	if (fdisk_assign_device(cxt, device, 0)) {
-		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED,
-				"Failed to open %s with libfdisk", device);
-		goto out_cxt;
+	/* the cached table must not have been changed (e.g. by a hook) */
+	header = read_header(sw->cxt, &ierror);
+	if (!header) {
+		g_propagate_prefixed_error(error, ierror, "Failed to read GPT header: ");
+		return FALSE;
 	}
-
-	if (!check_gpt(cxt, &ierror)) {
-		g_propagate_error(error, ierror);
-		goto out_deassign;
+	if (memcmp(header, sw->header, sw->sector_size) != 0) {
+		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED,
+				"GPT on %s was changed during the update", sw->device);
+		return FALSE;
 	}
 
-	lb = fdisk_get_label(cxt, NULL);
+	lb = fdisk_get_label(sw->cxt, NULL);
 	if (!lb)
 		g_error("%s: Failed to get libfdisk label\n", G_STRLOC);
 
@@ -293,45 +316,44 @@ gboolean r_gpt_switch_set_boot_partition(const gchar *device,
 	 * is safe against crashes. */
 	if (fdisk_label_is_changed(lb) == 1) {
 		g_message("GPT is inconsistent, repairing...\n");
-		if (fdisk_write_disklabel(cxt) != 0) {
+		if (fdisk_write_disklabel(sw->cxt) != 0) {
 			g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED,
 					"Could not repair GPT");
-			goto out_deassign;
+			return FALSE;
 		}
 		g_message("GPT repaired\n");
 	}
-	if (fdisk_verify_disklabel(cxt) != 0) {
+	if (fdisk_verify_disklabel(sw->cxt) != 0) {
 		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED,
 				"Old GPT failed to verify");
-		goto out_deassign;
+		return FALSE;
 	}
 
-	if (fdisk_get_partition(cxt, BOOT_PARTITION_ENTRY, &pa) != 0) {
+	if (fdisk_get_partition(sw->cxt, BOOT_PARTITION_ENTRY, &pa) != 0) {
 		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED,
 				"No boot partition found in entry %d",
 				BOOT_PARTITION_ENTRY);
-		goto out_deassign;
+		return FALSE;
 	}
 
-	sector_size = fdisk_get_sector_size(cxt);
 	fdisk_reset_partition(pa); /* only change the location */
-	fdisk_partition_set_start(pa, partition->start / sector_size);
-	fdisk_partition_set_size(pa, partition->size / sector_size);
+	fdisk_partition_set_start(pa, sw->inactive.start / sw->sector_size);
+	fdisk_partition_set_size(pa, sw->inactive.size / sw->sector_size);
 
-	if (fdisk_set_partition(cxt, BOOT_PARTITION_ENTRY, pa) != 0) {
+	if (fdisk_set_partition(sw->cxt, BOOT_PARTITION_ENTRY, pa) != 0) {
 		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED,
 				"Could not update boot partition");
 		goto out_unref_part;
 	}
 
-	if (fdisk_verify_disklabel(cxt) != 0) {
+	if (fdisk_verify_disklabel(sw->cxt) != 0) {
 		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED,
 				"New GPT failed to verify");
 		goto out_unref_part;
 	}
 	/* As we made sure that we have two copies above, we are sure to always
 	 * have at least one valid copy at any point during the update. */
-	if (fdisk_write_disklabel(cxt) != 0) {
+	if (fdisk_write_disklabel(sw->cxt) != 0) {
 		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED,
 				"Could not write new GPT");
 		goto out_unref_part;
@@ -341,10 +363,27 @@ gboolean r_gpt_switch_set_boot_partition(const gchar *device,
 
 out_unref_part:
 	fdisk_unref_partition(pa);
-out_deassign:
-	fdisk_deassign_device(cxt, 0);
-out_cxt:
-	fdisk_unref_context(cxt);
+
+	if (res) {
+		/* syncs and re-reads the partition table once */
+		fdisk_deassign_device(sw->cxt, 0);
+		g_clear_pointer(&sw->cxt, fdisk_unref_context);
+	}
 
 	return res;
 }
+
+void r_gpt_switch_free(RGptSwitch *sw)
+{
+	if (!sw)
+		return;
+
+	if (sw->cxt) {
+		/* nothing was written, so skip the re-read */
+		fdisk_deassign_device(sw->cxt, 1);
+		fdisk_unref_context(sw->cxt);
+	}
+	g_free(sw->header);
+	g_free(sw->device);
+	g_free(sw);
+}
@@ -1,21 +1,134 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <gio/gio.h>
 #include <glib/gstdio.h>
 
 #include <openssl/evp.h>
 
 #include "hash_index.h"
+#include "memory.h"
+#include "trace.h"
 #include "utils.h"
 
 #define SHA256_LEN 32
 
+/* Hash index files only contain the plain array of chunk hashes, so that
+ * they can be used by all versions of RAUC. For slot indexes, the lookup
+ * table is stored in a separate file next to it (with the suffix '.lookup'),
+ * followed by a footer.
+ *
+ * The footer identifies the hash index file it belongs to by its inode, size
+ * and modification time, so a lookup table is ignored after the hash index
+ * has been replaced (for example by an older version of RAUC).
+ *
+ * The lookup table and footer are stored in native byte order, as the files
+ * are only used on the system which created them. Files from a system with
+ * different byte order are detected by the version field and ignored.
+ */
+#define HASH_INDEX_LOOKUP_SUFFIX ".lookup"
+#define HASH_INDEX_FOOTER_MAGIC "RAUCBHIF"
+#define HASH_INDEX_FORMAT_VERSION 3
+
+typedef struct {
+	guint8 magic[8];
+	guint32 version; /* HASH_INDEX_FORMAT_VERSION */
+	guint32 chunk_size; /* R_HASH_INDEX_CHUNK_SIZE */
+	guint32 count; /* number of chunk hashes */
+	guint32 bucket_bits; /* number of bucket bits of the lookup table */
+	guint64 index_ino; /* inode of the hash index file */
+	guint64 index_size; /* size of the hash index file */
+	gint64 index_mtime_ns; /* modification time of the hash index file */
+	guint64 checksum; /* FNV-1a over the lookup table and previous fields */
+} HashIndexFooter;
+G_STATIC_ASSERT(sizeof(HashIndexFooter) == 56);
+
 GQuark r_hash_index_error_quark(void)
 {
 	return g_quark_from_static_string("r-hash-index-error-quark");
 }
 
+/* per-thread digest context, reused for all chunks hashed by that thread */
+static GPrivate hash_mdctx = G_PRIVATE_INIT((GDestroyNotify)EVP_MD_CTX_free);
+
+/**
+ * Returns the SHA256 digest implementation.
+ *
+ * With OpenSSL 3.0, the implementation is fetched explicitly once, to avoid
+ * the implicit fetch on each EVP_DigestInit_ex() call.
+ */
+static const EVP_MD *get_sha256_md(void)
+{
+#if OPENSSL_VERSION_NUMBER < 0x30000000L
+	return EVP_sha256();
+#else
+	static gsize md_once = 0;
+	static EVP_MD *md = NULL;
+
+	if (g_once_init_enter(&md_once)) {
+		md = EVP_MD_fetch(NULL, "SHA256", NULL);
+		if (!md)
+			g_error("failed to fetch OpenSSL SHA256 digest");
+		g_once_init_leave(&md_once, 1);
+	}
+
+	return md;
+#endif
+}
+
+/**
+ * Returns the digest context for the calling thread, creating it on first use.
+ */
+static EVP_MD_CTX *get_hash_mdctx(void)
+{
+	EVP_MD_CTX *mdctx = g_private_get(&hash_mdctx);
+
+	if (!mdctx) {
+		mdctx = EVP_MD_CTX_new();
+		if (!mdctx)
+			g_error("failed to allocate OpenSSL EVP digest context");
+		g_private_set(&hash_mdctx, mdctx);
+	}
+
+	return mdctx;
+}
+
+void r_hash_index_hash_chunks(const guint8 *data, guint32 count, guint8 *hashes)
+{
+	const EVP_MD *md = get_sha256_md();
+	EVP_MD_CTX *mdctx = get_hash_mdctx();
+
+	g_return_if_fail(data);
+	g_return_if_fail(hashes);
+
+	for (guint32 i = 0; i < count; i++) {
+		unsigned int tmp_size = 0;
+
+		/* zero chunks are common in sparse images */
+		if (r_buffer_is_zero(&data[(gsize)i * R_HASH_INDEX_CHUNK_SIZE], R_HASH_INDEX_CHUNK_SIZE)) {
+			memcpy(&hashes[(gsize)i * SHA256_LEN], R_HASH_INDEX_ZERO_CHUNK, SHA256_LEN);
+			continue;
+		}
+
+		/* reinitializing with the same digest does not reallocate */
+		if (EVP_DigestInit_ex(mdctx, md, NULL) != 1) {
+			g_error("failed to initialize OpenSSL EVP digest");
+		}
+
+		if (EVP_DigestUpdate(mdctx, &data[(gsize)i * R_HASH_INDEX_CHUNK_SIZE], R_HASH_INDEX_CHUNK_SIZE) != 1) {
+			g_error("failed to update OpenSSL EVP digest");
+		}
+
+		if (EVP_DigestFinal_ex(mdctx, &hashes[(gsize)i * SHA256_LEN], &tmp_size) != 1) {
+			g_error("failed to finalize OpenSSL EVP digest");
+		}
+
+		g_assert(tmp_size == SHA256_LEN);
+	}
+}
+
 /**
  * Hash a single chunk using OpenSSL's SHA256.
  *
@@ -23,38 +136,72 @@ GQuark r_hash_index_error_quark(void)
  */
 static void hash_chunk(RaucHashIndexChunk *chunk)
 {
-	EVP_MD_CTX *mdctx;
-	uint8_t tmp[EVP_MAX_MD_SIZE];
-	unsigned int tmp_size = 0;
+	G_STATIC_ASSERT(sizeof(chunk->data) == R_HASH_INDEX_CHUNK_SIZE);
+	G_STATIC_ASSERT(sizeof(chunk->hash) == SHA256_LEN);
 
-	mdctx = EVP_MD_CTX_new();
-	if (EVP_DigestInit(mdctx, EVP_sha256()) != 1) {
-		g_error("failed to initialize OpenSSL EVP digest");
-	}
+	r_hash_index_hash_chunks(chunk->data, 1, chunk->hash);
+}
 
-	if (EVP_DigestUpdate(mdctx, chunk->data, sizeof(chunk->data)) != 1) {
-		g_error("failed to update OpenSSL EVP digest");
-	}
+/* number of chunks read from the data file at once (1 MiB) */
+#define HASH_FILE_BLOCK_CHUNKS 256
+/* upper limit for the number of hashing threads */
+#define HASH_FILE_MAX_THREADS 16
 
-	if (EVP_DigestFinal(mdctx, tmp, &tmp_size) != 1) {
-		g_error("failed to finalize OpenSSL EVP digest");
-	}
+typedef struct {
+	guint8 *data; /* HASH_FILE_BLOCK_CHUNKS chunks */
+	guint32 first; /* number of the first chunk in this block */
+	guint32 count; /* number of valid chunks in this block */
+} HashFileBlock;
+
+typedef struct {
+	guint8 *hashes; /* output hash array */
+	GAsyncQueue *free_blocks; /* blocks available for reading */
+} HashFileContext;
+
+/**
+ * Thread pool worker hashing all chunks contained in a single block.
+ *
+ * Each block covers a distinct range of the output array, so no locking is
+ * needed for the hashes. After hashing, the block is returned to the free
+ * queue for reuse by the reader.
+ */
+static void hash_file_worker(gpointer data, gpointer user_data)
+{
+	HashFileBlock *block = data;
+	HashFileContext *ctx = user_data;
+
+	r_hash_index_hash_chunks(block->data, block->count,
+			&ctx->hashes[(gsize)block->first * SHA256_LEN]);
 
-	g_assert(tmp_size == sizeof(chunk->hash));
+	g_async_queue_push(ctx->free_blocks, block);
+}
 
-	memcpy(chunk->hash, tmp, sizeof(chunk->hash));
+static void hash_file_block_free(HashFileBlock *block)
+{
+	if (!block)
+		return;
 
-	EVP_MD_CTX_free(mdctx);
+	g_free(block->data);
+	g_free(block);
 }
 
 /**
  * Build array of chunk hashes using SHA256.
+ *
+ * The data is read sequentially in large blocks by the calling thread, while
+ * the hashing is distributed over a pool of worker threads. A fixed ring of
+ * blocks limits the memory used for data which is read but not yet hashed.
  */
 static GBytes *hash_file(int data_fd, guint32 count, GError **error)
 {
 	GError *ierror = NULL;
 	g_autoptr(GByteArray) hashes = g_byte_array_set_size(g_byte_array_new(), ((guint)count)*SHA256_LEN);
-	g_autofree RaucHashIndexChunk *chunk = g_new0(RaucHashIndexChunk, 1);
+	g_autoptr(GPtrArray) blocks = NULL;
+	g_autoptr(GAsyncQueue) free_blocks = NULL;
+	HashFileContext ctx = {0};
+	GThreadPool *pool = NULL;
+	guint n_threads;
+	gboolean res = FALSE;
 
 	g_return_val_if_fail(data_fd >= 0, NULL);
 	g_return_val_if_fail(count > 0, NULL);
@@ -69,8 +216,38 @@ static GBytes *hash_file(int data_fd, guint32 count, GError **error)
 		return NULL;
 	}
 
-	for (guint32 i = 0; i < count; i++) {
-		if (!r_read_exact(data_fd, chunk->data, sizeof(chunk->data), &ierror)) {
+	n_threads = CLAMP(g_get_num_processors(), 1, HASH_FILE_MAX_THREADS);
+	/* don't start more threads than we have blocks to hash */
+	n_threads = MIN(n_threads, (count + HASH_FILE_BLOCK_CHUNKS - 1) / HASH_FILE_BLOCK_CHUNKS);
+
+	/* two blocks per thread allow reading the next one while hashing */
+	free_blocks = g_async_queue_new();
+	blocks = g_ptr_array_new_with_free_func((GDestroyNotify)hash_file_block_free);
+	for (guint i = 0; i < n_threads * 2; i++) {
+		HashFileBlock *block = g_new0(HashFileBlock, 1);
+		block->data = g_malloc((gsize)HASH_FILE_BLOCK_CHUNKS * R_HASH_INDEX_CHUNK_SIZE);
+		g_ptr_array_add(blocks, block);
+		g_async_queue_push(free_blocks, block);
+	}
+
+	ctx.hashes = hashes->data;
+	ctx.free_blocks = free_blocks;
+
+	pool = g_thread_pool_new(hash_file_worker, &ctx, n_threads, FALSE, &ierror);
+	if (!pool) {
+		g_propagate_prefixed_error(error, ierror, "failed to create hashing thread pool: ");
+		return NULL;
+	}
+
+	g_debug("hashing %"G_GUINT32_FORMAT " chunks using %u threads", count, n_threads);
+
+	for (guint32 pos = 0; pos < count;) {
+		HashFileBlock *block = g_async_queue_pop(free_blocks);
+
+		block->first = pos;
+		block->count = MIN(count - pos, HASH_FILE_BLOCK_CHUNKS);
+
+		if (!r_read_exact(data_fd, block->data, (gsize)block->count * R_HASH_INDEX_CHUNK_SIZE, &ierror)) {
 			if (ierror) {
 				g_propagate_error(error, ierror);
 			} else {
@@ -79,72 +256,420 @@ static GBytes *hash_file(int data_fd, guint32 count, GError **error)
 						R_HASH_INDEX_ERROR_SIZE,
 						"image/partition ended unexpectedly");
 			}
-			return NULL;
+			goto out;
+		}
+
+		pos += block->count;
+
+		if (!g_thread_pool_push(pool, block, &ierror)) {
+			g_propagate_prefixed_error(error, ierror, "failed to queue chunks for hashing: ");
+			goto out;
 		}
-		hash_chunk(chunk);
-		memcpy(&hashes->data[i*SHA256_LEN], chunk->hash, SHA256_LEN);
 	}
 
+	res = TRUE;
+
+out:
+	/* wait for all pending blocks to be hashed before freeing them */
+	g_thread_pool_free(pool, FALSE, TRUE);
+
+	if (!res)
+		return NULL;
+
 	return g_byte_array_free_to_bytes(g_steal_pointer(&hashes));
 }
 
 /**
- * Compare integers in the same way memcmp() compares memory.
+ * Returns the first 8 bytes of a hash as a big-endian integer.
+ *
+ * This preserves the memcmp() order of the hash prefix.
  */
-static gint intcmp(guint32 a, guint32 b)
+static inline guint64 hash_prefix(const guint8 *hash)
 {
-	if (a < b)
-		return -1;
-	if (a > b)
-		return 1;
-	return 0;
+	guint64 prefix;
+
+	memcpy(&prefix, hash, sizeof(prefix));
+
+	return GUINT64_FROM_BE(prefix);
 }
 
 /**
- * Compare two hash pointers in an index table.
- *
- * This first compares the chunk hashes and then the position in the file.
+ * Returns the bucket number for a hash, which is given by the first 'bits'
+ * bits of the hash.
  */
-static gint lookup_compare_sort(gconstpointer a, gconstpointer b, gpointer hashes)
+static inline guint32 hash_bucket(guint64 prefix, guint bits)
 {
-	const guint32 *_a = a;
-	const guint32 *_b = b;
-	guint8 *_hashes = hashes;
-	const guint8 *a_hash = _hashes + *_a * SHA256_LEN;
-	const guint8 *b_hash = _hashes + *_b * SHA256_LEN;
-	int res;
+	return prefix >> (64 - bits);
+}
 
-	res = memcmp(a_hash, b_hash, SHA256_LEN);
-	if (res)
-		return res;
+/**
+ * Returns the 32 hash bits following the bucket bits.
+ */
+static inline guint32 hash_tag(guint64 prefix, guint bits)
+{
+	return (prefix << bits) >> 32;
+}
 
-	/* sort identical hashes by chunk number */
-	return intcmp(*_a, *_b);
+/**
+ * Select the number of bucket bits for a given chunk count.
+ *
+ * This results in one or two entries per bucket on average, limited to 2^16
+ * buckets.
+ */
+static guint get_bucket_bits(guint32 count)
+{
+	return CLAMP(g_bit_storage(count) - 1, 1, 16);
 }
 
 /**
- * Build sorted lookup table for finding chunk positions using binary search.
+ * Build the bucketed lookup table for finding chunk positions.
  *
- * Uses qsort_r to create a sorted array of all hashes. Identical hashes are
- * sorted by chunk number to improve locality and cache reuse.
+ * The table consists of a directory with the first entry number for each
+ * bucket (plus one final entry), followed by the entries sorted by hash
+ * prefix and chunk number. Each entry contains the 32 hash bits following
+ * the bucket bits inline, so most lookups only need to access the full hash
+ * when there is a match.
+ *
+ * The entries are sorted using a stable LSD radix sort, first by the tag
+ * and then by the bucket. As the initial order is by chunk number, identical
+ * hashes stay sorted by chunk number to improve locality and cache reuse.
  */
-static guint32 *build_lookup(GBytes *hashes)
+static GBytes *build_lookup(GBytes *hashes, guint bits)
 {
-	guint32 *lookup = NULL;
+	const guint8(*_hashes)[SHA256_LEN] = NULL;
 	guint32 count;
+	guint32 n_buckets;
+	gsize dir_size;
+	guint32 *buckets = NULL;
+	RaucHashIndexEntry *entries = NULL;
+	g_autofree RaucHashIndexEntry *src = NULL;
+	g_autofree RaucHashIndexEntry *dst = NULL;
+	g_autofree guint16 *chunk_buckets = NULL;
 
 	g_return_val_if_fail(hashes != NULL, NULL);
+	g_return_val_if_fail(bits >= 1 && bits <= 16, NULL);
 
+	_hashes = g_bytes_get_data(hashes, NULL);
 	count = g_bytes_get_size(hashes) / SHA256_LEN;
-	lookup = g_new(guint32, count);
+	n_buckets = 1U << bits;
+
+	src = g_new(RaucHashIndexEntry, count);
+	dst = g_new(RaucHashIndexEntry, count);
+	chunk_buckets = g_new(guint16, count);
 
+	/* sequential pass over the hashes to extract the keys */
 	for (guint32 i = 0; i < count; i++) {
-		lookup[i] = i;
+		guint64 prefix = hash_prefix(_hashes[i]);
+
+		src[i].tag = hash_tag(prefix, bits);
+		src[i].chunk = i;
+		chunk_buckets[i] = hash_bucket(prefix, bits);
+	}
+
+	/* sort by tag, one byte per pass */
+	for (guint shift = 0; shift < 32; shift += 8) {
+		guint32 histogram[256] = {0};
+		guint32 pos = 0;
+
+		for (guint32 i = 0; i < count; i++)
+			histogram[(src[i].tag >> shift) & 0xff]++;
+
+		/* skip passes which would not change the order */
+		if (!count || histogram[(src[0].tag >> shift) & 0xff] == count)
+			continue;
+
+		for (guint d = 0; d < 256; d++) {
+			guint32 tmp = histogram[d];
+			histogram[d] = pos;
+			pos += tmp;
+		}
+
+		for (guint32 i = 0; i < count; i++)
+			dst[histogram[(src[i].tag >> shift) & 0xff]++] = src[i];
+
+		{
+			RaucHashIndexEntry *tmp = src;
+			src = dst;
+			dst = tmp;
+		}
+	}
+
+	/* final pass by bucket, directly into the lookup table */
+	dir_size = ((gsize)n_buckets + 1) * sizeof(guint32);
+	buckets = g_malloc0(dir_size + (gsize)count * sizeof(RaucHashIndexEntry));
+	entries = (RaucHashIndexEntry *)&buckets[n_buckets + 1];
+
+	for (guint32 i = 0; i < count; i++)
+		buckets[chunk_buckets[i] + 1]++;
+	for (guint32 b = 0; b < n_buckets; b++)
+		buckets[b + 1] += buckets[b];
+
+	{
+		g_autofree guint32 *pos = g_new(guint32, n_buckets);
+
+		memcpy(pos, buckets, n_buckets * sizeof(guint32));
+		for (guint32 i = 0; i < count; i++)
+			entries[pos[chunk_buckets[src[i].chunk]]++] = src[i];
+	}
+
+	return g_bytes_new_take(buckets, dir_size + (gsize)count * sizeof(RaucHashIndexEntry));
+}
+
+/**
+ * Set up the directory and entry pointers from lookup data.
+ */
+static void hash_index_set_lookup(RaucHashIndex *idx, GBytes *lookup_data, guint bits)
+{
+	const guint32 *data = g_bytes_get_data(lookup_data, NULL);
+
+	idx->lookup_data = lookup_data;
+	idx->bucket_bits = bits;
+	idx->buckets = data;
+	idx->lookup = (const RaucHashIndexEntry *)&data[(1U << bits) + 1];
+}
+
+/**
+ * Returns the size of the lookup table for the given parameters.
+ */
+static gsize get_lookup_size(guint32 count, guint bits)
+{
+	return ((gsize)(1U << bits) + 1) * sizeof(guint32) + (gsize)count * sizeof(RaucHashIndexEntry);
+}
+
+#define FNV1A_64_INIT 0xcbf29ce484222325ULL
+#define FNV1A_64_PRIME 0x100000001b3ULL
+
+static guint64 fnv1a_64(guint64 hash, const guint8 *data, gsize len)
+{
+	for (gsize i = 0; i < len; i++) {
+		hash ^= data[i];
+		hash *= FNV1A_64_PRIME;
+	}
+
+	return hash;
+}
+
+static guint64 footer_checksum(const HashIndexFooter *footer, const guint8 *lookup, gsize lookup_size)
+{
+	guint64 hash = FNV1A_64_INIT;
+
+	hash = fnv1a_64(hash, lookup, lookup_size);
+	hash = fnv1a_64(hash, (const guint8 *)footer, G_STRUCT_OFFSET(HashIndexFooter, checksum));
+
+	return hash;
+}
+
+static void footer_set_index_stat(HashIndexFooter *footer, const struct stat *st)
+{
+	footer->index_ino = st->st_ino;
+	footer->index_size = st->st_size;
+	footer->index_mtime_ns = (gint64)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+/**
+ * Check whether a mapped lookup table file is usable for a hash index file.
+ *
+ * Besides the footer fields and checksum, this verifies that the bucket
+ * directory is consistent and all entries refer to valid chunks, so that a
+ * damaged file cannot cause out-of-bounds accesses.
+ *
+ * @param data mapped file contents
+ * @param size size of the mapped file
+ * @param index_st stat of the hash index file
+ * @param footer return location for the footer
+ *
+ * @return TRUE if the file uses the current format version, belongs to the
+ *         hash index file and is valid
+ */
+static gboolean parse_footer(const guint8 *data, gsize size, const struct stat *index_st, HashIndexFooter *footer)
+{
+	const guint32 *buckets = NULL;
+	const RaucHashIndexEntry *entries = NULL;
+	HashIndexFooter expected = {0};
+	guint32 n_buckets;
+	gsize lookup_size;
+
+	if (size < sizeof(*footer))
+		goto invalid;
+
+	memcpy(footer, data + size - sizeof(*footer), sizeof(*footer));
+
+	if (memcmp(footer->magic, HASH_INDEX_FOOTER_MAGIC, sizeof(footer->magic)) != 0)
+		goto invalid;
+
+	if (footer->version != HASH_INDEX_FORMAT_VERSION) {
+		g_info("ignoring lookup table in hash index with unsupported version %"G_GUINT32_FORMAT, footer->version);
+		return FALSE;
+	}
+
+	footer_set_index_stat(&expected, index_st);
+	if (footer->index_ino != expected.index_ino ||
+	    footer->index_size != expected.index_size ||
+	    footer->index_mtime_ns != expected.index_mtime_ns) {
+		g_info("ignoring lookup table for a different hash index file");
+		return FALSE;
+	}
+
+	if (footer->chunk_size != R_HASH_INDEX_CHUNK_SIZE ||
+	    footer->bucket_bits < 1 || footer->bucket_bits > 16 ||
+	    footer->count == 0 ||
+	    footer->index_size != (guint64)footer->count * SHA256_LEN)
+		goto invalid;
+
+	lookup_size = get_lookup_size(footer->count, footer->bucket_bits);
+	if (size != lookup_size + sizeof(*footer))
+		goto invalid;
+
+	if (footer_checksum(footer, data, lookup_size) != footer->checksum)
+		goto invalid;
+
+	buckets = (const guint32 *)(const void *)data;
+	n_buckets = 1U << footer->bucket_bits;
+	entries = (const RaucHashIndexEntry *)&buckets[n_buckets + 1];
+
+	if (buckets[0] != 0 || buckets[n_buckets] != footer->count)
+		goto invalid;
+	for (guint32 b = 0; b < n_buckets; b++) {
+		if (buckets[b] > buckets[b + 1])
+			goto invalid;
+	}
+	for (guint32 i = 0; i < footer->count; i++) {
+		if (entries[i].chunk >= footer->count)
+			goto invalid;
+	}
+
+	return TRUE;
+
+invalid:
+	g_warning("ignoring invalid lookup table in hash index");
+	return FALSE;
+}
+
+/**
+ * Use the stored lookup table of a hash index file, if there is a valid one
+ * covering exactly the used hashes.
+ */
+static void load_stored_lookup(RaucHashIndex *idx, const gchar *hashes_filename)
+{
+	g_autofree gchar *lookup_filename = g_strconcat(hashes_filename, HASH_INDEX_LOOKUP_SUFFIX, NULL);
+	g_autoptr(GMappedFile) mapped_file = NULL;
+	g_autoptr(GBytes) mapped_bytes = NULL;
+	HashIndexFooter footer = {0};
+	struct stat st;
+
+	if (!g_file_test(lookup_filename, G_FILE_TEST_IS_REGULAR))
+		return;
+
+	if (stat(hashes_filename, &st) != 0)
+		return;
+
+	mapped_file = g_mapped_file_new(lookup_filename, FALSE, NULL);
+	if (!mapped_file)
+		return;
+
+	if (!parse_footer((const guint8 *)g_mapped_file_get_contents(mapped_file),
+			g_mapped_file_get_length(mapped_file), &st, &footer))
+		return;
+
+	if (footer.count != idx->count)
+		return;
+
+	mapped_bytes = g_mapped_file_get_bytes(mapped_file);
+	hash_index_set_lookup(idx,
+			g_bytes_new_from_bytes(mapped_bytes, 0, get_lookup_size(footer.count, footer.bucket_bits)),
+			footer.bucket_bits);
+	g_debug("using stored lookup table for %s", idx->label);
+}
+
+/**
+ * Write a file to the given path, replacing it atomically.
+ */
+static gboolean write_file_parts(const gchar *filename, const guint8 **parts, const gsize *sizes, guint n_parts, GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(GFile) file = g_file_new_for_path(filename);
+	g_autoptr(GFileOutputStream) stream = NULL;
+
+	stream = g_file_replace(file, NULL, FALSE, G_FILE_CREATE_REPLACE_DESTINATION, NULL, &ierror);
+	if (!stream) {
+		g_propagate_prefixed_error(error, ierror, "Failed to create %s: ", filename);
+		return FALSE;
+	}
+
+	for (guint i = 0; i < n_parts; i++) {
+		if (!g_output_stream_write_all(G_OUTPUT_STREAM(stream), parts[i], sizes[i], NULL, NULL, &ierror)) {
+			g_propagate_prefixed_error(error, ierror, "Failed to write %s: ", filename);
+			return FALSE;
+		}
+	}
+
+	if (!g_output_stream_close(G_OUTPUT_STREAM(stream), NULL, &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Failed to close %s: ", filename);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Write a hash index file and its lookup table file.
+ *
+ * Both files are replaced atomically. As the lookup table refers to the hash
+ * index file by its inode, a crash between both writes only results in an
+ * ignored lookup table.
+ */
+static gboolean write_index_file(const RaucHashIndex *idx, const gchar *filename, GError **error)
+{
+	GError *ierror = NULL;
+	g_autofree gchar *lookup_filename = NULL;
+	HashIndexFooter footer = {0};
+	const guint8 *parts[2];
+	gsize sizes[2];
+	gsize hashes_size;
+	gsize lookup_size;
+	struct stat st;
+
+	g_return_val_if_fail(idx, FALSE);
+	g_return_val_if_fail(filename, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	parts[0] = g_bytes_get_data(idx->hashes, &hashes_size);
+	sizes[0] = hashes_size;
+	if (!write_file_parts(filename, parts, sizes, 1, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	if (stat(filename, &st) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to stat %s: %s", filename, g_strerror(err));
+		return FALSE;
 	}
 
-	qsort_r(lookup, count, sizeof(guint32), lookup_compare_sort, (void*)g_bytes_get_data(hashes, NULL));
+	parts[0] = g_bytes_get_data(idx->lookup_data, &lookup_size);
+	sizes[0] = lookup_size;
+
+	/* the lookup table always covers all hashes */
+	g_assert(lookup_size == get_lookup_size(hashes_size / SHA256_LEN, idx->bucket_bits));
 
-	return lookup;
+	memcpy(footer.magic, HASH_INDEX_FOOTER_MAGIC, sizeof(footer.magic));
+	footer.version = HASH_INDEX_FORMAT_VERSION;
+	footer.chunk_size = R_HASH_INDEX_CHUNK_SIZE;
+	footer.count = hashes_size / SHA256_LEN;
+	footer.bucket_bits = idx->bucket_bits;
+	footer_set_index_stat(&footer, &st);
+	footer.checksum = footer_checksum(&footer, parts[0], lookup_size);
+	parts[1] = (const guint8 *)&footer;
+	sizes[1] = sizeof(footer);
+
+	lookup_filename = g_strconcat(filename, HASH_INDEX_LOOKUP_SUFFIX, NULL);
+	if (!write_file_parts(lookup_filename, parts, sizes, 2, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	return TRUE;
 }
 
 /**
@@ -211,19 +736,44 @@ static guint32 get_chunk_count(int data_fd, GError **error)
 	return size / 4096;
 }
 
+/**
+ * Reserves memory for data of the index which is kept in memory.
+ */
+static gboolean hash_index_reserve(RaucHashIndex *idx, guint64 size, GError **error)
+{
+	if (!r_memory_reserve(size, idx->label)) {
+		g_set_error(error,
+				R_HASH_INDEX_ERROR,
+				R_HASH_INDEX_ERROR_MEMORY,
+				"hash index for %s exceeds memory limit", idx->label);
+		return FALSE;
+	}
+
+	idx->reserved_memory += size;
+	return TRUE;
+}
+
 /**
  * Build the lookup table and initialize the hash index with default values.
  */
-static void hash_index_prepare(RaucHashIndex *idx)
+static gboolean hash_index_prepare(RaucHashIndex *idx, GError **error)
 {
-	/* prepare sorted lookup array */
-	idx->lookup = build_lookup(idx->hashes);
+	/* prepare bucketed lookup table, unless shared with another index */
+	if (!idx->lookup_data) {
+		guint bits = get_bucket_bits(idx->count);
+
+		if (!hash_index_reserve(idx, get_lookup_size(idx->count, bits), error))
+			return FALSE;
+		hash_index_set_lookup(idx, build_lookup(idx->hashes, bits), bits);
+	}
 
 	/* everything is valid by default */
 	idx->invalid_below = 0;
 	idx->invalid_from = G_MAXUINT32;
 
 	idx->match_stats = r_stats_new(idx->label);
+
+	return TRUE;
 }
 
 RaucHashIndex *r_hash_index_open(const gchar *label, int data_fd, const gchar *hashes_filename, GError **error)
@@ -247,6 +797,7 @@ RaucHashIndex *r_hash_index_open(const gchar *label, int data_fd, const gchar *h
 	/* load or calculate chunk hashes */
 	if (hashes_filename && g_file_test(hashes_filename, G_FILE_TEST_IS_REGULAR)) {
 		g_autoptr(GMappedFile) mapped_file = g_mapped_file_new(hashes_filename, FALSE, &ierror);
+		g_autoptr(GBytes) mapped_bytes = NULL;
 		gsize mapped_size;
 
 		if (!mapped_file) {
@@ -268,49 +819,150 @@ RaucHashIndex *r_hash_index_open(const gchar *label, int data_fd, const gchar *h
 			idx->count = mapped_size / SHA256_LEN;
 		}
 
-		idx->hashes = g_mapped_file_get_bytes(mapped_file);
+		/* ignore hashes beyond the end of the data */
+		mapped_bytes = g_mapped_file_get_bytes(mapped_file);
+		idx->hashes = g_bytes_new_from_bytes(mapped_bytes, 0, (gsize)idx->count * SHA256_LEN);
+
+		load_stored_lookup(idx, hashes_filename);
 	}
 
 	if (!idx->hashes) {
 		g_message("Building new hash index for %s with %"G_GUINT32_FORMAT " chunks", label, idx->count);
+		if (!hash_index_reserve(idx, (guint64)idx->count * SHA256_LEN, &ierror)) {
+			g_propagate_error(error, ierror);
+			return NULL;
+		}
 		idx->hashes = hash_file(data_fd, idx->count, &ierror);
 		if (!idx->hashes) {
 			g_propagate_error(error, ierror);
 			return NULL;
 		}
+		idx->hashes_calculated = TRUE;
 	}
 
-	hash_index_prepare(idx);
+	if (!hash_index_prepare(idx, &ierror)) {
+		g_propagate_error(error, ierror);
+		return NULL;
+	}
 
 	return g_steal_pointer(&idx);
 }
 
-RaucHashIndex *r_hash_index_reuse(const gchar *label, const RaucHashIndex *idx, int new_data_fd, GError **error)
+RaucHashIndex *r_hash_index_open_file(const gchar *label, const gchar *hashes_filename, GError **error)
 {
 	GError *ierror = NULL;
-	g_autoptr(RaucHashIndex) new_idx = g_new0(RaucHashIndex, 1);
+	g_autoptr(RaucHashIndex) idx = g_new0(RaucHashIndex, 1);
+	g_autoptr(GMappedFile) mapped_file = NULL;
+	g_autoptr(GBytes) mapped_bytes = NULL;
+	gsize mapped_size;
 
 	g_return_val_if_fail(label, NULL);
-	g_return_val_if_fail(idx, FALSE);
-	g_return_val_if_fail(new_data_fd >= 0, NULL);
+	g_return_val_if_fail(hashes_filename, NULL);
 	g_return_val_if_fail(error == NULL || *error == NULL, NULL);
 
-	new_idx->label = g_strdup_printf("%s (reusing %s)", label, idx->label);
-	new_idx->data_fd = new_data_fd;
+	idx->label = g_strdup(label);
+	idx->data_fd = -1;
 
-	new_idx->count = get_chunk_count(new_data_fd, &ierror);
-	if (!new_idx->count) {
+	mapped_file = g_mapped_file_new(hashes_filename, FALSE, &ierror);
+	if (!mapped_file) {
 		g_propagate_error(error, ierror);
 		return NULL;
 	}
-	if (new_idx->count > idx->count) {
-		new_idx->count = idx->count;
+	mapped_size = g_mapped_file_get_length(mapped_file);
+	mapped_bytes = g_mapped_file_get_bytes(mapped_file);
+
+	idx->count = mapped_size / SHA256_LEN;
+	if (!idx->count) {
+		g_set_error(error,
+				R_HASH_INDEX_ERROR,
+				R_HASH_INDEX_ERROR_SIZE,
+				"invalid hash index file %s", hashes_filename);
+		return NULL;
 	}
+	idx->hashes = g_bytes_new_from_bytes(mapped_bytes, 0, (gsize)idx->count * SHA256_LEN);
 
-	/* use a subsection of the original hashes */
-	new_idx->hashes = g_bytes_new_from_bytes(idx->hashes, 0, new_idx->count * SHA256_LEN);
+	load_stored_lookup(idx, hashes_filename);
 
-	hash_index_prepare(new_idx);
+	if (!hash_index_prepare(idx, &ierror)) {
+		g_propagate_error(error, ierror);
+		return NULL;
+	}
+
+	return g_steal_pointer(&idx);
+}
+
+RaucHashIndex *r_hash_index_new_from_hashes(const gchar *label, int data_fd, GBytes *hashes, GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(RaucHashIndex) idx = g_new0(RaucHashIndex, 1);
+
+	g_return_val_if_fail(label, NULL);
+	g_return_val_if_fail(data_fd >= 0, NULL);
+	g_return_val_if_fail(hashes, NULL);
+	g_return_val_if_fail(error == NULL || *error == NULL, NULL);
+
+	idx->label = g_strdup(label);
+	idx->data_fd = dup(data_fd);
+
+	idx->count = get_chunk_count(data_fd, &ierror);
+	if (!idx->count) {
+		g_propagate_error(error, ierror);
+		return NULL;
+	}
+
+	if (g_bytes_get_size(hashes) != (gsize)idx->count * SHA256_LEN) {
+		g_set_error(error,
+				R_HASH_INDEX_ERROR,
+				R_HASH_INDEX_ERROR_SIZE,
+				"precalculated hashes (%"G_GSIZE_FORMAT " bytes) do not match data size (%"G_GUINT32_FORMAT " chunks)",
+				g_bytes_get_size(hashes), idx->count);
+		return NULL;
+	}
+
+	idx->hashes = g_bytes_ref(hashes);
+	idx->hashes_calculated = TRUE;
+
+	if (!hash_index_prepare(idx, &ierror)) {
+		g_propagate_error(error, ierror);
+		return NULL;
+	}
+
+	return g_steal_pointer(&idx);
+}
+
+RaucHashIndex *r_hash_index_reuse(const gchar *label, const RaucHashIndex *idx, int new_data_fd, GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(RaucHashIndex) new_idx = g_new0(RaucHashIndex, 1);
+
+	g_return_val_if_fail(label, NULL);
+	g_return_val_if_fail(idx, FALSE);
+	g_return_val_if_fail(new_data_fd >= 0, NULL);
+	g_return_val_if_fail(error == NULL || *error == NULL, NULL);
+
+	new_idx->label = g_strdup_printf("%s (reusing %s)", label, idx->label);
+	new_idx->data_fd = new_data_fd;
+
+	new_idx->count = get_chunk_count(new_data_fd, &ierror);
+	if (!new_idx->count) {
+		g_propagate_error(error, ierror);
+		return NULL;
+	}
+	if (new_idx->count > idx->count) {
+		new_idx->count = idx->count;
+	}
+
+	/* use a subsection of the original hashes */
+	new_idx->hashes = g_bytes_new_from_bytes(idx->hashes, 0, new_idx->count * SHA256_LEN);
+
+	/* the lookup table can be shared if it covers exactly the same chunks */
+	if (g_bytes_get_size(idx->hashes) == g_bytes_get_size(new_idx->hashes))
+		hash_index_set_lookup(new_idx, g_bytes_ref(idx->lookup_data), idx->bucket_bits);
+
+	if (!hash_index_prepare(new_idx, &ierror)) {
+		g_propagate_error(error, ierror);
+		return NULL;
+	}
 
 	return g_steal_pointer(&new_idx);
 }
@@ -391,6 +1043,171 @@ RaucHashIndex *r_hash_index_open_image(const gchar *label, const RaucImage *imag
 	return g_steal_pointer(&idx);
 }
 
+/**
+ * Checks whether an index contains a hash with the given prefix.
+ *
+ * The valid range of the index is ignored, as this is only used to decide
+ * which full hashes are needed.
+ */
+static gboolean has_hash_prefix(const RaucHashIndex *idx, const guint8 *prefix)
+{
+	const guint8(*hashes)[SHA256_LEN] = g_bytes_get_data(idx->hashes, NULL);
+	guint64 value = hash_prefix(prefix);
+	guint32 bucket = hash_bucket(value, idx->bucket_bits);
+	guint32 tag = hash_tag(value, idx->bucket_bits);
+	guint32 left = idx->buckets[bucket];
+	guint32 right = idx->buckets[bucket + 1];
+
+	while (left < right) {
+		guint32 middle = left + (right - left) / 2;
+		if (idx->lookup[middle].tag < tag)
+			left = middle + 1;
+		else
+			right = middle;
+	}
+
+	for (guint32 i = left; i < idx->buckets[bucket + 1] && idx->lookup[i].tag == tag; i++) {
+		if (memcmp(hashes[idx->lookup[i].chunk], prefix, R_HASH_INDEX_PREFIX_LEN) == 0)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/**
+ * Fills in a hash for a chunk which cannot be reused.
+ *
+ * The prefix is kept, so that the lookup table is distributed as usual. The
+ * remaining bytes are zero except for the chunk number, which cannot occur
+ * in a real SHA256 hash in practice.
+ */
+static void set_placeholder_hash(guint8 *hash, const guint8 *prefix, guint32 number)
+{
+	guint32 number_be = GUINT32_TO_BE(number);
+
+	memset(hash, 0, SHA256_LEN);
+	memcpy(hash, prefix, R_HASH_INDEX_PREFIX_LEN);
+	memcpy(&hash[SHA256_LEN - sizeof(number_be)], &number_be, sizeof(number_be));
+}
+
+/* number of full hashes read at once by r_hash_index_open_prefixes() */
+#define HASH_PAGE_CHUNKS (R_HASH_INDEX_CHUNK_SIZE / SHA256_LEN)
+
+RaucHashIndex *r_hash_index_open_prefixes(const gchar *label, int data_fd, const gchar *prefix_filename, const gchar *hashes_filename, const GPtrArray *candidates, GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(RaucHashIndex) idx = g_new0(RaucHashIndex, 1);
+	g_autoptr(GMappedFile) prefix_file = NULL;
+	const guint8(*prefixes)[R_HASH_INDEX_PREFIX_LEN];
+	g_autofree guint8 (*hashes)[SHA256_LEN] = NULL;
+	g_auto(filedesc) hashes_fd = -1;
+	guint32 resolved = 0;
+
+	g_return_val_if_fail(label, NULL);
+	g_return_val_if_fail(data_fd >= 0, NULL);
+	g_return_val_if_fail(prefix_filename, NULL);
+	g_return_val_if_fail(hashes_filename, NULL);
+	g_return_val_if_fail(candidates, NULL);
+	g_return_val_if_fail(error == NULL || *error == NULL, NULL);
+
+	idx->label = g_strdup(label);
+	idx->data_fd = dup(data_fd);
+
+	idx->count = get_chunk_count(data_fd, &ierror);
+	if (!idx->count) {
+		g_propagate_error(error, ierror);
+		return NULL;
+	}
+
+	prefix_file = g_mapped_file_new(prefix_filename, FALSE, &ierror);
+	if (!prefix_file) {
+		g_propagate_error(error, ierror);
+		return NULL;
+	}
+	if (g_mapped_file_get_length(prefix_file) != (gsize)idx->count * R_HASH_INDEX_PREFIX_LEN) {
+		g_set_error(error,
+				R_HASH_INDEX_ERROR,
+				R_HASH_INDEX_ERROR_SIZE,
+				"hash prefix file %s does not match data size (%"G_GUINT32_FORMAT " chunks)",
+				prefix_filename, idx->count);
+		return NULL;
+	}
+	prefixes = (const guint8(*)[R_HASH_INDEX_PREFIX_LEN])g_mapped_file_get_contents(prefix_file);
+
+	hashes_fd = g_open(hashes_filename, O_RDONLY | O_CLOEXEC);
+	if (hashes_fd < 0) {
+		int err = errno;
+		g_set_error(error,
+				G_FILE_ERROR,
+				g_file_error_from_errno(err),
+				"Failed to open hash index file %s: %s", hashes_filename, g_strerror(err));
+		return NULL;
+	}
+
+	if (!hash_index_reserve(idx, (guint64)idx->count * SHA256_LEN, &ierror)) {
+		g_propagate_error(error, ierror);
+		return NULL;
+	}
+	hashes = g_malloc((gsize)idx->count * SHA256_LEN);
+
+	for (guint32 first = 0; first < idx->count; first += HASH_PAGE_CHUNKS) {
+		guint32 n = MIN(HASH_PAGE_CHUNKS, idx->count - first);
+		gboolean needed = FALSE;
+
+		for (guint32 i = 0; i < n && !needed; i++) {
+			const guint8 *prefix = prefixes[first + i];
+
+			needed = memcmp(prefix, R_HASH_INDEX_ZERO_CHUNK, R_HASH_INDEX_PREFIX_LEN) == 0;
+			for (guint s = 0; s < candidates->len && !needed; s++)
+				needed = has_hash_prefix(g_ptr_array_index(candidates, s), prefix);
+		}
+
+		if (!needed) {
+			for (guint32 i = 0; i < n; i++)
+				set_placeholder_hash(hashes[first + i], prefixes[first + i], first + i);
+			idx->hashes_incomplete = TRUE;
+			continue;
+		}
+
+		if (!r_pread_exact(hashes_fd, hashes[first], (gsize)n * SHA256_LEN, (off_t)first * SHA256_LEN, &ierror)) {
+			if (ierror) {
+				g_propagate_prefixed_error(error, ierror, "Failed to read hash index file %s: ", hashes_filename);
+			} else {
+				g_set_error(error,
+						R_HASH_INDEX_ERROR,
+						R_HASH_INDEX_ERROR_SIZE,
+						"hash index file %s ended unexpectedly", hashes_filename);
+			}
+			return NULL;
+		}
+
+		/* the full hashes are authoritative, the prefixes only select the pages */
+		for (guint32 i = 0; i < n; i++) {
+			if (memcmp(hashes[first + i], prefixes[first + i], R_HASH_INDEX_PREFIX_LEN) != 0) {
+				g_set_error(error,
+						R_HASH_INDEX_ERROR,
+						R_HASH_INDEX_ERROR_MODIFIED,
+						"hash prefix file %s does not match %s at chunk %"G_GUINT32_FORMAT,
+						prefix_filename, hashes_filename, first + i);
+				return NULL;
+			}
+		}
+		resolved += n;
+	}
+
+	g_message("Loaded %"G_GUINT32_FORMAT " of %"G_GUINT32_FORMAT " full hashes for %s (using hash prefixes)",
+			resolved, idx->count, label);
+
+	idx->hashes = g_bytes_new_take(g_steal_pointer(&hashes), (gsize)idx->count * SHA256_LEN);
+
+	if (!hash_index_prepare(idx, &ierror)) {
+		g_propagate_error(error, ierror);
+		return NULL;
+	}
+
+	return g_steal_pointer(&idx);
+}
+
 gboolean r_hash_index_export(const RaucHashIndex *idx, const gchar *hashes_filename, GError **error)
 {
 	g_return_val_if_fail(idx, FALSE);
@@ -400,6 +1217,25 @@ gboolean r_hash_index_export(const RaucHashIndex *idx, const gchar *hashes_filen
 	return write_file(hashes_filename, idx->hashes, error);
 }
 
+gboolean r_hash_index_export_prefixes(const RaucHashIndex *idx, const gchar *prefix_filename, GError **error)
+{
+	const guint8(*hashes)[SHA256_LEN];
+	g_autoptr(GBytes) prefixes = NULL;
+	guint8 *data;
+
+	g_return_val_if_fail(idx, FALSE);
+	g_return_val_if_fail(prefix_filename, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	hashes = g_bytes_get_data(idx->hashes, NULL);
+	data = g_malloc((gsize)idx->count * R_HASH_INDEX_PREFIX_LEN);
+	for (guint32 i = 0; i < idx->count; i++)
+		memcpy(&data[(gsize)i * R_HASH_INDEX_PREFIX_LEN], hashes[i], R_HASH_INDEX_PREFIX_LEN);
+	prefixes = g_bytes_new_take(data, (gsize)idx->count * R_HASH_INDEX_PREFIX_LEN);
+
+	return write_file(prefix_filename, prefixes, error);
+}
+
 gboolean r_hash_index_export_slot(const RaucHashIndex *idx, const RaucSlot *slot, const RaucChecksum *checksum, GError **error)
 {
 	GError *ierror = NULL;
@@ -418,105 +1254,406 @@ gboolean r_hash_index_export_slot(const RaucHashIndex *idx, const RaucSlot *slot
 
 	index_filename = g_build_filename(dir, "block-hash-index", NULL);
 
-	return write_file(index_filename, idx->hashes, error);
+	/* include the lookup table, so it doesn't need to be rebuilt on the next update */
+	return write_index_file(idx, index_filename, error);
 }
 
-gboolean r_hash_index_get_chunk(const RaucHashIndex *idx, const guint8 *hash, RaucHashIndexChunk *chunk, GError **error)
+/* Header of the partial hash file written by r_hash_index_build_slot(),
+ * followed by the hashes of the first 'done' chunks. It is only used to
+ * continue an interrupted run on the same system, so native byte order is
+ * used. */
+#define PARTIAL_MAGIC "RHIPART1"
+typedef struct {
+	gchar magic[8];
+	guint32 count; /* chunks in the slot */
+	guint32 done; /* chunks hashed so far */
+	/* SHA-256 of the content of the first 'done' chunks, if the slot
+	 * checksum was unknown */
+	guint8 digest[SHA256_LEN];
+} PartialHeader;
+G_STATIC_ASSERT(sizeof(PartialHeader) == 48);
+
+/* Returns the digest of the data added to ctx so far, without finalizing
+ * it. */
+static void get_intermediate_digest(GChecksum *ctx, guint8 *digest)
+{
+	g_autoptr(GChecksum) copy = g_checksum_copy(ctx);
+	gsize len = SHA256_LEN;
+
+	g_checksum_get_digest(copy, digest, &len);
+}
+
+/* Resets the partial file to an empty one for count chunks. */
+static gboolean reset_partial_file(int fd, PartialHeader *header, guint32 count, GError **error)
+{
+	memset(header, 0, sizeof(*header));
+	memcpy(header->magic, PARTIAL_MAGIC, sizeof(header->magic));
+	header->count = count;
+
+	if (ftruncate(fd, 0) != 0) {
+		int err = errno;
+		g_set_error(error,
+				G_FILE_ERROR,
+				g_file_error_from_errno(err),
+				"Failed to truncate: %s", g_strerror(err));
+		return FALSE;
+	}
+
+	return r_pwrite_exact(fd, (const guint8 *)header, sizeof(*header), 0, error);
+}
+
+/* Reads the header of the partial file and drops any hashes beyond the
+ * recorded progress. The file is reset if it doesn't match the slot. */
+static gboolean open_partial_file(int fd, PartialHeader *header, guint32 count, GError **error)
 {
 	GError *ierror = NULL;
-	gboolean ret = FALSE;
-	const guint8(*hashes)[SHA256_LEN];
-	guint32 left, middle, right;
-	gboolean found = FALSE;
-	off_t offset;
+	off_t size;
 
-	g_return_val_if_fail(idx, FALSE);
-	g_return_val_if_fail(idx->hashes, FALSE);
-	g_return_val_if_fail(idx->count > 0, FALSE);
-	g_return_val_if_fail(hash, FALSE);
-	g_return_val_if_fail(chunk, FALSE);
+	size = lseek(fd, 0, SEEK_END);
+	if (size < 0) {
+		int err = errno;
+		g_set_error(error,
+				G_FILE_ERROR,
+				g_file_error_from_errno(err),
+				"Failed to seek: %s", g_strerror(err));
+		return FALSE;
+	}
+
+	if (size < (off_t)sizeof(*header) ||
+	    !r_pread_exact(fd, (guint8 *)header, sizeof(*header), 0, &ierror) ||
+	    memcmp(header->magic, PARTIAL_MAGIC, sizeof(header->magic)) != 0 ||
+	    header->count != count ||
+	    header->done > count ||
+	    size < (off_t)sizeof(*header) + (off_t)header->done * SHA256_LEN) {
+		if (ierror) {
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
+		if (size)
+			g_message("Discarding partial hash index, as it does not match the slot");
+		return reset_partial_file(fd, header, count, error);
+	}
+
+	if (ftruncate(fd, (off_t)sizeof(*header) + (off_t)header->done * SHA256_LEN) != 0) {
+		int err = errno;
+		g_set_error(error,
+				G_FILE_ERROR,
+				g_file_error_from_errno(err),
+				"Failed to truncate: %s", g_strerror(err));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+gboolean r_hash_index_build_slot(const RaucSlot *slot, RaucChecksum *checksum, GCancellable *cancellable, GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(RaucHashIndex) idx = NULL;
+	g_autoptr(GChecksum) ctx = NULL;
+	g_autoptr(GBytes) contents_bytes = NULL;
+	g_autoptr(GBytes) hashes = NULL;
+	g_autofree guint8 *data = NULL;
+	g_autofree guint8 *block_hashes = NULL;
+	g_autofree gchar *partial_dir = NULL;
+	g_autofree gchar *partial_filename = NULL;
+	g_autofree gchar *dir = NULL;
+	g_autofree gchar *index_filename = NULL;
+	gchar *contents = NULL;
+	gsize contents_size = 0;
+	g_auto(filedesc) data_fd = -1;
+	g_auto(filedesc) partial_fd = -1;
+	PartialHeader header;
+	guint32 count;
+
+	g_return_val_if_fail(slot, FALSE);
+	g_return_val_if_fail(slot->data_directory, FALSE);
+	g_return_val_if_fail(checksum, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
-	hashes = g_bytes_get_data(idx->hashes, NULL);
+	data_fd = g_open(slot->device, O_RDONLY | O_CLOEXEC);
+	if (data_fd < 0) {
+		int err = errno;
+		g_set_error(error,
+				G_FILE_ERROR,
+				g_file_error_from_errno(err),
+				"Failed to open slot device %s: %s", slot->device, g_strerror(err));
+		return FALSE;
+	}
 
-	/* use a binary search over the sorted chunk hash indices */
-	left = 0;
-	right = idx->count - 1;
-	middle = 0;
-	while (left <= right) {
-		int cmp;
-		middle = left + (right - left) / 2;
-		cmp = memcmp(hashes[idx->lookup[middle]], hash, SHA256_LEN);
-		if (cmp == 0) {
-			found = TRUE;
-			break;
-		} else if (cmp < 0) {
-			left = middle + 1;
-		} else if (middle > 0) {
-			right = middle - 1;
-		} else {
-			break; /* not found */
+	count = get_chunk_count(data_fd, &ierror);
+	if (!count) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	/* The partial file is kept in the data directory of the current slot
+	 * content, so it is removed together with it when the slot is updated. */
+	partial_dir = r_slot_get_checksum_data_directory(slot, checksum, &ierror);
+	if (!partial_dir) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+	partial_filename = g_build_filename(partial_dir, "block-hash-index.partial", NULL);
+
+	partial_fd = g_open(partial_filename, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (partial_fd < 0) {
+		int err = errno;
+		g_set_error(error,
+				G_FILE_ERROR,
+				g_file_error_from_errno(err),
+				"Failed to open %s: %s", partial_filename, g_strerror(err));
+		return FALSE;
+	}
+
+	/* continue after the last recorded hash of an interrupted run */
+	if (!open_partial_file(partial_fd, &header, count, &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Failed to prepare %s: ", partial_filename);
+		return FALSE;
+	}
+
+	if (header.done)
+		g_message("Continuing hash index for slot %s at chunk %"G_GUINT32_FORMAT " of %"G_GUINT32_FORMAT, slot->name, header.done, count);
+	else
+		g_message("Building hash index for slot %s with %"G_GUINT32_FORMAT " chunks", slot->name, count);
+
+	/* Without a known checksum, the hashes would be stored for 'unknown'
+	 * content. Calculate it in the same pass, which requires reading the
+	 * already indexed range again when continuing. This is also used to
+	 * check that the content has not changed since the interrupted run. */
+	if (!checksum->digest)
+		ctx = g_checksum_new(G_CHECKSUM_SHA256);
+
+	data = g_malloc((gsize)HASH_FILE_BLOCK_CHUNKS * R_HASH_INDEX_CHUNK_SIZE);
+	block_hashes = g_malloc((gsize)HASH_FILE_BLOCK_CHUNKS * SHA256_LEN);
+
+	for (guint32 pos = ctx ? 0 : header.done; pos < count;) {
+		guint32 n = MIN(count - pos, HASH_FILE_BLOCK_CHUNKS);
+		guint32 skip = header.done > pos ? MIN(header.done - pos, n) : 0;
+
+		if (g_cancellable_set_error_if_cancelled(cancellable, error))
+			return FALSE;
+
+		if (!r_pread_exact(data_fd, data, (gsize)n * R_HASH_INDEX_CHUNK_SIZE, (off_t)pos * R_HASH_INDEX_CHUNK_SIZE, &ierror)) {
+			if (ierror) {
+				g_propagate_error(error, ierror);
+			} else {
+				g_set_error(error,
+						R_HASH_INDEX_ERROR,
+						R_HASH_INDEX_ERROR_SIZE,
+						"partition ended unexpectedly");
+			}
+			return FALSE;
+		}
+
+		/* The slot may be written as soon as we are cancelled, so data
+		 * read afterwards must not be stored. */
+		if (g_cancellable_set_error_if_cancelled(cancellable, error))
+			return FALSE;
+
+		if (ctx) {
+			guint8 digest[SHA256_LEN];
+
+			/* only the checksum is updated up to the block where
+			 * the previous run stopped */
+			g_checksum_update(ctx, data, (gsize)skip * R_HASH_INDEX_CHUNK_SIZE);
+			if (skip && pos + skip == header.done) {
+				get_intermediate_digest(ctx, digest);
+				if (memcmp(digest, header.digest, SHA256_LEN) != 0) {
+					g_message("Discarding partial hash index for slot %s, as its content changed", slot->name);
+					if (!reset_partial_file(partial_fd, &header, count, &ierror)) {
+						g_propagate_prefixed_error(error, ierror, "Failed to reset %s: ", partial_filename);
+						return FALSE;
+					}
+					g_checksum_reset(ctx);
+					pos = 0;
+					continue;
+				}
+			}
+			g_checksum_update(ctx, data + (gsize)skip * R_HASH_INDEX_CHUNK_SIZE, (gsize)(n - skip) * R_HASH_INDEX_CHUNK_SIZE);
+		}
+
+		if (skip < n) {
+			r_hash_index_hash_chunks(data + (gsize)skip * R_HASH_INDEX_CHUNK_SIZE, n - skip, block_hashes);
+			if (!r_pwrite_exact(partial_fd, block_hashes, (gsize)(n - skip) * SHA256_LEN,
+					(off_t)sizeof(header) + (off_t)header.done * SHA256_LEN, &ierror)) {
+				g_propagate_prefixed_error(error, ierror, "Failed to write %s: ", partial_filename);
+				return FALSE;
+			}
+
+			/* record the progress only after the hashes */
+			header.done = pos + n;
+			if (ctx)
+				get_intermediate_digest(ctx, header.digest);
+			if (!r_pwrite_exact(partial_fd, (const guint8 *)&header, sizeof(header), 0, &ierror)) {
+				g_propagate_prefixed_error(error, ierror, "Failed to write %s: ", partial_filename);
+				return FALSE;
+			}
 		}
+
+		pos += n;
 	}
-	if (!found) {
+
+	if (!g_file_get_contents(partial_filename, &contents, &contents_size, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+	contents_bytes = g_bytes_new_take(contents, contents_size);
+	if (contents_size != sizeof(header) + (gsize)count * SHA256_LEN) {
 		g_set_error(error,
 				R_HASH_INDEX_ERROR,
-				R_HASH_INDEX_ERROR_NOT_FOUND,
-				"hash not found in index");
-		ret = FALSE;
-		goto out;
+				R_HASH_INDEX_ERROR_SIZE,
+				"Unexpected size of %s", partial_filename);
+		return FALSE;
 	}
+	hashes = g_bytes_new_from_bytes(contents_bytes, sizeof(header), (gsize)count * SHA256_LEN);
 
-	//g_debug("found middle=%u/%u", middle, idx->lookup[middle]);
+	idx = r_hash_index_new_from_hashes(slot->name, data_fd, hashes, &ierror);
+	if (!idx) {
+		g_propagate_prefixed_error(error, ierror, "Failed to build hash index for slot %s: ", slot->name);
+		return FALSE;
+	}
 
-	/* find the first chunk with this hash (to make it deterministic) */
-	for (guint32 i = middle; i > 0; i--) {
-		guint32 next = idx->lookup[i-1];
+	if (ctx) {
+		checksum->type = G_CHECKSUM_SHA256;
+		checksum->digest = g_strdup(g_checksum_get_string(ctx));
+		checksum->size = (goffset)count * R_HASH_INDEX_CHUNK_SIZE;
+	}
 
-		if (memcmp(hashes[next], hash, SHA256_LEN) != 0) {
-			middle = i;
-			break;
-		}
+	dir = r_slot_get_checksum_data_directory(slot, checksum, &ierror);
+	if (!dir) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+	index_filename = g_build_filename(dir, "block-hash-index", NULL);
+
+	if (!write_index_file(idx, index_filename, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
 	}
-	//g_debug("first middle=%u/%u", middle, idx->lookup[middle]);
 
-	/* find the first chunk with this hash in the valid range */
-	found = FALSE;
-	for (guint32 i = middle; i < idx->count; i++) {
-		guint32 curr = idx->lookup[i];
+	if (g_unlink(partial_filename) != 0)
+		g_debug("Failed to remove %s: %s", partial_filename, g_strerror(errno));
 
-		if (memcmp(hashes[curr], hash, SHA256_LEN) != 0)
+	g_message("Stored hash index for slot %s in %s", slot->name, dir);
+
+	return TRUE;
+}
+
+static gboolean find_chunk(const RaucHashIndex *idx, const guint8 *hash, guint32 *number, GError **error)
+{
+	const guint8(*hashes)[SHA256_LEN];
+	guint64 prefix;
+	guint32 bucket, tag;
+	guint32 left, right;
+	guint32 found_chunk = 0;
+	gboolean matched = FALSE;
+	gboolean found = FALSE;
+
+	hashes = g_bytes_get_data(idx->hashes, NULL);
+
+	prefix = hash_prefix(hash);
+	bucket = hash_bucket(prefix, idx->bucket_bits);
+	tag = hash_tag(prefix, idx->bucket_bits);
+
+	/* find the first entry with this tag in the bucket */
+	left = idx->buckets[bucket];
+	right = idx->buckets[bucket + 1];
+	while (left < right) {
+		guint32 middle = left + (right - left) / 2;
+		if (idx->lookup[middle].tag < tag)
+			left = middle + 1;
+		else
+			right = middle;
+	}
+
+	/* Entries with the same tag are sorted by chunk number, so the first one
+	 * with a matching hash in the valid range is used (to make it
+	 * deterministic). Entries with a different hash but the same tag are
+	 * skipped. */
+	for (guint32 i = left; i < idx->buckets[bucket + 1]; i++) {
+		guint32 curr = idx->lookup[i].chunk;
+
+		if (idx->lookup[i].tag != tag)
 			break;
 
+		if (memcmp(hashes[curr], hash, SHA256_LEN) != 0)
+			continue;
+
+		matched = TRUE;
+
 		if (curr >= idx->invalid_from) {
 			/* only invalid chunks remaining */
 			break;
 		} else if (curr < idx->invalid_below) {
-			if (i < idx->count - 1) {
-				/* keep looking for a chunk in the valid range */
-				continue;
-			} else {
-				/* at the end of the index */
-				break;
-			}
+			/* keep looking for a chunk in the valid range */
+			continue;
 		} else {
 			/* in valid range */
 			found = TRUE;
-			middle = i;
+			found_chunk = curr;
 			break;
 		}
 	}
+	if (!matched) {
+		g_set_error(error,
+				R_HASH_INDEX_ERROR,
+				R_HASH_INDEX_ERROR_NOT_FOUND,
+				"hash not found in index");
+		return FALSE;
+	}
 	if (!found) {
 		g_set_error(error,
 				R_HASH_INDEX_ERROR,
 				R_HASH_INDEX_ERROR_NOT_FOUND,
 				"hash not in valid region [%"G_GUINT32_FORMAT "..%"G_GUINT32_FORMAT ")",
 				idx->invalid_below, idx->invalid_from);
+		return FALSE;
+	}
+
+	*number = found_chunk;
+	return TRUE;
+}
+
+gboolean r_hash_index_find_chunk(const RaucHashIndex *idx, const guint8 *hash, guint32 *number, GError **error)
+{
+	gboolean ret;
+
+	g_return_val_if_fail(idx, FALSE);
+	g_return_val_if_fail(idx->hashes, FALSE);
+	g_return_val_if_fail(idx->lookup, FALSE);
+	g_return_val_if_fail(idx->count > 0, FALSE);
+	g_return_val_if_fail(hash, FALSE);
+	g_return_val_if_fail(number, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	ret = find_chunk(idx, hash, number, error);
+	r_stats_add(idx->match_stats, ret);
+
+	return ret;
+}
+
+gboolean r_hash_index_get_chunk(const RaucHashIndex *idx, const guint8 *hash, RaucHashIndexChunk *chunk, GError **error)
+{
+	GError *ierror = NULL;
+	gboolean ret = FALSE;
+	guint32 found_chunk = 0;
+	off_t offset;
+
+	g_return_val_if_fail(idx, FALSE);
+	g_return_val_if_fail(idx->hashes, FALSE);
+	g_return_val_if_fail(idx->lookup, FALSE);
+	g_return_val_if_fail(idx->count > 0, FALSE);
+	g_return_val_if_fail(hash, FALSE);
+	g_return_val_if_fail(chunk, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (!find_chunk(idx, hash, &found_chunk, error)) {
 		ret = FALSE;
 		goto out;
 	}
 
-	offset = ((off_t)(idx->lookup[middle])) * sizeof(chunk->data);
+	offset = ((off_t)found_chunk) * sizeof(chunk->data);
 	if (!r_pread_exact(idx->data_fd, chunk->data, sizeof(chunk->data), offset, &ierror)) {
 		if (ierror) {
 			g_propagate_error(error, ierror);
@@ -540,16 +1677,394 @@ gboolean r_hash_index_get_chunk(const RaucHashIndex *idx, const guint8 *hash, Ra
 			ret = FALSE;
 			goto out;
 		}
+	} else {
+		memcpy(chunk->hash, hash, SHA256_LEN);
 	}
 
+	chunk->number = found_chunk;
 	ret = TRUE;
 
 out:
 	r_stats_add(idx->match_stats, ret);
+	R_TRACE3(chunk_lookup, idx->label, ret, found_chunk);
 
 	return ret;
 }
 
+gboolean r_hash_index_has_chunk_at(const RaucHashIndex *idx, guint32 number, const guint8 *hash, GError **error)
+{
+	GError *ierror = NULL;
+	const guint8(*hashes)[SHA256_LEN];
+	g_autofree RaucHashIndexChunk *chunk = NULL;
+
+	g_return_val_if_fail(idx, FALSE);
+	g_return_val_if_fail(idx->hashes, FALSE);
+	g_return_val_if_fail(hash, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (number >= idx->count || number < idx->invalid_below || number >= idx->invalid_from) {
+		g_set_error(error,
+				R_HASH_INDEX_ERROR,
+				R_HASH_INDEX_ERROR_NOT_FOUND,
+				"chunk %"G_GUINT32_FORMAT " not in valid region", number);
+		return FALSE;
+	}
+
+	hashes = g_bytes_get_data(idx->hashes, NULL);
+	if (memcmp(hashes[number], hash, SHA256_LEN) != 0) {
+		g_set_error(error,
+				R_HASH_INDEX_ERROR,
+				R_HASH_INDEX_ERROR_NOT_FOUND,
+				"chunk %"G_GUINT32_FORMAT " has a different hash", number);
+		return FALSE;
+	}
+
+	if (idx->hashes_calculated || idx->skip_hash_check)
+		return TRUE;
+
+	/* the index was loaded from a file, so check the actual data */
+	chunk = g_new0(RaucHashIndexChunk, 1);
+	if (!r_pread_exact(idx->data_fd, chunk->data, sizeof(chunk->data), ((off_t)number) * sizeof(chunk->data), &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	hash_chunk(chunk);
+	if (memcmp(chunk->hash, hash, SHA256_LEN) != 0) {
+		g_set_error(error,
+				R_HASH_INDEX_ERROR,
+				R_HASH_INDEX_ERROR_MODIFIED,
+				"data chunk hash differs from index");
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+guint32 r_hash_index_count_chunks_at(const RaucHashIndex *idx, guint32 first, guint32 count, const guint8 (*hashes)[32], GError **error)
+{
+	const guint8(*idx_hashes)[SHA256_LEN];
+	g_autofree guint8 *data = NULL;
+	guint8 data_hashes[R_HASH_INDEX_CHECK_BLOCK_CHUNKS][SHA256_LEN];
+	guint32 matching = 0;
+
+	g_return_val_if_fail(idx, 0);
+	g_return_val_if_fail(idx->hashes, 0);
+	g_return_val_if_fail(hashes, 0);
+	g_return_val_if_fail(error == NULL || *error == NULL, 0);
+
+	if (first >= idx->count || first < idx->invalid_below || first >= idx->invalid_from)
+		return 0;
+	count = MIN(count, MIN(idx->count, idx->invalid_from) - first);
+
+	/* compare the index first, to avoid reading data which would not match */
+	idx_hashes = g_bytes_get_data(idx->hashes, NULL);
+	while (matching < count && memcmp(idx_hashes[first + matching], hashes[matching], SHA256_LEN) == 0)
+		matching++;
+
+	if (idx->hashes_calculated || idx->skip_hash_check || !matching)
+		return matching;
+
+	/* the index was loaded from a file, so check the actual data */
+	data = g_malloc((gsize)R_HASH_INDEX_CHECK_BLOCK_CHUNKS * R_HASH_INDEX_CHUNK_SIZE);
+	for (guint32 done = 0; done < matching;) {
+		guint32 n = MIN(matching - done, R_HASH_INDEX_CHECK_BLOCK_CHUNKS);
+
+		if (!r_pread_exact(idx->data_fd, data, (gsize)n * R_HASH_INDEX_CHUNK_SIZE,
+				((off_t)first + done) * R_HASH_INDEX_CHUNK_SIZE, error))
+			return done;
+
+		r_hash_index_hash_chunks(data, n, &data_hashes[0][0]);
+		for (guint32 i = 0; i < n; i++) {
+			if (memcmp(data_hashes[i], hashes[done + i], SHA256_LEN) != 0)
+				return done + i;
+		}
+
+		done += n;
+	}
+
+	return matching;
+}
+
+static gint compare_set_entries(gconstpointer a, gconstpointer b)
+{
+	const RaucHashIndexSetEntry *x = a;
+	const RaucHashIndexSetEntry *y = b;
+
+	if (x->prefix != y->prefix)
+		return x->prefix < y->prefix ? -1 : 1;
+	if (x->source != y->source)
+		return x->source < y->source ? -1 : 1;
+	if (x->chunk != y->chunk)
+		return x->chunk < y->chunk ? -1 : 1;
+	return 0;
+}
+
+RaucHashIndexSet *r_hash_index_set_new(GPtrArray *sources, GError **error)
+{
+	g_autoptr(RaucHashIndexSet) set = g_new0(RaucHashIndexSet, 1);
+	guint64 total = 0;
+	guint64 size;
+	guint32 n_buckets;
+	guint32 pos = 0;
+
+	g_return_val_if_fail(sources, NULL);
+	g_return_val_if_fail(error == NULL || *error == NULL, NULL);
+
+	for (guint s = 0; s < sources->len; s++) {
+		const RaucHashIndex *idx = g_ptr_array_index(sources, s);
+		total += idx->count;
+	}
+	if (total > G_MAXUINT32) {
+		g_set_error(error,
+				R_HASH_INDEX_ERROR,
+				R_HASH_INDEX_ERROR_SIZE,
+				"too many chunks (%"G_GUINT64_FORMAT ") for merged hash index", total);
+		return NULL;
+	}
+
+	set->n_sources = sources->len;
+	set->count = total;
+	set->bucket_bits = get_bucket_bits(set->count);
+	n_buckets = 1U << set->bucket_bits;
+
+	size = total * sizeof(RaucHashIndexSetEntry) + ((guint64)n_buckets + 1) * sizeof(guint32);
+	if (!r_memory_reserve(size, "merged hash index")) {
+		g_set_error(error,
+				R_HASH_INDEX_ERROR,
+				R_HASH_INDEX_ERROR_MEMORY,
+				"merged hash index exceeds memory limit");
+		return NULL;
+	}
+	set->reserved_memory = size;
+
+	set->sources = g_new0(const RaucHashIndex *, set->n_sources);
+	set->hashes = g_new0(const guint8 *, set->n_sources);
+	set->entries = g_new(RaucHashIndexSetEntry, set->count);
+	set->buckets = g_new0(guint32, n_buckets + 1);
+
+	for (guint s = 0; s < sources->len; s++) {
+		const RaucHashIndex *idx = g_ptr_array_index(sources, s);
+
+		set->sources[s] = idx;
+		set->hashes[s] = g_bytes_get_data(idx->hashes, NULL);
+
+		for (guint32 c = 0; c < idx->count; c++) {
+			RaucHashIndexSetEntry *entry = &set->entries[pos++];
+
+			entry->prefix = hash_prefix(&set->hashes[s][(gsize)c * SHA256_LEN]);
+			entry->source = s;
+			entry->chunk = c;
+		}
+	}
+
+	/* Entries with the same hash are sorted by source and chunk, so the
+	 * first valid one is the same as when searching the sources in order. */
+	qsort(set->entries, set->count, sizeof(RaucHashIndexSetEntry), compare_set_entries);
+
+	for (guint32 i = 0; i < set->count; i++)
+		set->buckets[hash_bucket(set->entries[i].prefix, set->bucket_bits) + 1]++;
+	for (guint32 b = 0; b < n_buckets; b++)
+		set->buckets[b + 1] += set->buckets[b];
+
+	return g_steal_pointer(&set);
+}
+
+gboolean r_hash_index_set_find(const RaucHashIndexSet *set, const guint8 *hash, guint *source, guint32 *number)
+{
+	guint64 prefix;
+	guint32 bucket;
+	guint32 left, right;
+
+	g_return_val_if_fail(set, FALSE);
+	g_return_val_if_fail(hash, FALSE);
+	g_return_val_if_fail(source, FALSE);
+	g_return_val_if_fail(number, FALSE);
+
+	prefix = hash_prefix(hash);
+	bucket = hash_bucket(prefix, set->bucket_bits);
+
+	/* find the first entry with this prefix in the bucket */
+	left = set->buckets[bucket];
+	right = set->buckets[bucket + 1];
+	while (left < right) {
+		guint32 middle = left + (right - left) / 2;
+		if (set->entries[middle].prefix < prefix)
+			left = middle + 1;
+		else
+			right = middle;
+	}
+
+	for (guint32 i = left; i < set->buckets[bucket + 1]; i++) {
+		const RaucHashIndexSetEntry *entry = &set->entries[i];
+		const RaucHashIndex *idx;
+
+		if (entry->prefix != prefix)
+			break;
+
+		idx = set->sources[entry->source];
+		if (entry->chunk < idx->invalid_below || entry->chunk >= idx->invalid_from)
+			continue;
+		if (memcmp(&set->hashes[entry->source][(gsize)entry->chunk * SHA256_LEN], hash, SHA256_LEN) != 0)
+			continue;
+
+		/* account for the sources which would have been searched before */
+		for (guint s = 0; s < entry->source; s++)
+			r_stats_add(set->sources[s]->match_stats, FALSE);
+		r_stats_add(idx->match_stats, TRUE);
+
+		*source = entry->source;
+		*number = entry->chunk;
+		return TRUE;
+	}
+
+	for (guint s = 0; s < set->n_sources; s++)
+		r_stats_add(set->sources[s]->match_stats, FALSE);
+
+	return FALSE;
+}
+
+void r_hash_index_set_free(RaucHashIndexSet *set)
+{
+	if (!set)
+		return;
+
+	g_free(set->sources);
+	g_free(set->hashes);
+	g_free(set->entries);
+	g_free(set->buckets);
+	r_memory_release(set->reserved_memory);
+	g_free(set);
+}
+
+typedef struct {
+	int fd;
+	const guint8 *hashes; /* expected hashes */
+	guint32 count; /* number of chunks */
+	gint next_block; /* next block to be verified (atomic) */
+	gint n_blocks;
+	gint failed; /* set after setting error (atomic) */
+	GMutex lock; /* protects mismatches and error */
+	GArray *mismatches;
+	GError *error;
+} VerifyDataContext;
+
+/**
+ * Thread verifying blocks of HASH_FILE_BLOCK_CHUNKS chunks.
+ *
+ * Each thread reads the next unclaimed block with its own pread(), so that
+ * several reads are in flight at the same time. The buffer is page-aligned,
+ * as required for O_DIRECT.
+ */
+static gpointer verify_data_thread(gpointer data)
+{
+	VerifyDataContext *ctx = data;
+	const gsize block_size = (gsize)HASH_FILE_BLOCK_CHUNKS * R_HASH_INDEX_CHUNK_SIZE;
+	g_autofree guint8 *hashes = g_malloc((gsize)HASH_FILE_BLOCK_CHUNKS * SHA256_LEN);
+	GError *ierror = NULL;
+	void *buf = NULL;
+
+	if (posix_memalign(&buf, R_HASH_INDEX_CHUNK_SIZE, block_size) != 0) {
+		g_mutex_lock(&ctx->lock);
+		if (!ctx->error)
+			g_set_error(&ctx->error, R_HASH_INDEX_ERROR, R_HASH_INDEX_ERROR_MEMORY,
+					"failed to allocate read buffer");
+		g_mutex_unlock(&ctx->lock);
+		g_atomic_int_set(&ctx->failed, TRUE);
+		return NULL;
+	}
+
+	while (!g_atomic_int_get(&ctx->failed)) {
+		gint block = g_atomic_int_add(&ctx->next_block, 1);
+		guint32 first, count;
+
+		if (block >= ctx->n_blocks)
+			break;
+
+		first = (guint32)block * HASH_FILE_BLOCK_CHUNKS;
+		count = MIN(ctx->count - first, HASH_FILE_BLOCK_CHUNKS);
+
+		if (!r_pread_exact(ctx->fd, buf, (gsize)count * R_HASH_INDEX_CHUNK_SIZE,
+				(off_t)first * R_HASH_INDEX_CHUNK_SIZE, &ierror)) {
+			g_mutex_lock(&ctx->lock);
+			if (!ctx->error)
+				g_propagate_prefixed_error(&ctx->error, ierror,
+						"failed to read chunk %"G_GUINT32_FORMAT ": ", first);
+			else
+				g_clear_error(&ierror);
+			g_mutex_unlock(&ctx->lock);
+			g_atomic_int_set(&ctx->failed, TRUE);
+			break;
+		}
+
+		r_hash_index_hash_chunks(buf, count, hashes);
+
+		for (guint32 i = 0; i < count; i++) {
+			guint32 number = first + i;
+
+			if (memcmp(&hashes[(gsize)i * SHA256_LEN], &ctx->hashes[(gsize)number * SHA256_LEN], SHA256_LEN) == 0)
+				continue;
+
+			g_mutex_lock(&ctx->lock);
+			g_array_append_val(ctx->mismatches, number);
+			g_mutex_unlock(&ctx->lock);
+		}
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static gint compare_chunk_numbers(gconstpointer a, gconstpointer b)
+{
+	guint32 x = *(const guint32 *)a;
+	guint32 y = *(const guint32 *)b;
+
+	return (x > y) - (x < y);
+}
+
+gboolean r_hash_index_verify_data(const RaucHashIndex *idx, int fd, GArray **mismatches, GError **error)
+{
+	VerifyDataContext ctx = {0};
+	GThread *threads[HASH_FILE_MAX_THREADS] = {0};
+	guint n_threads;
+
+	g_return_val_if_fail(idx, FALSE);
+	g_return_val_if_fail(fd >= 0, FALSE);
+	g_return_val_if_fail(mismatches && *mismatches == NULL, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	ctx.fd = fd;
+	ctx.hashes = g_bytes_get_data(idx->hashes, NULL);
+	ctx.count = idx->count;
+	ctx.n_blocks = (idx->count + HASH_FILE_BLOCK_CHUNKS - 1) / HASH_FILE_BLOCK_CHUNKS;
+	ctx.mismatches = g_array_new(FALSE, FALSE, sizeof(guint32));
+	g_mutex_init(&ctx.lock);
+
+	n_threads = CLAMP(g_get_num_processors(), 1, HASH_FILE_MAX_THREADS);
+	n_threads = MIN(n_threads, (guint)ctx.n_blocks);
+
+	g_debug("verifying %"G_GUINT32_FORMAT " chunks of %s using %u threads", idx->count, idx->label, n_threads);
+
+	for (guint i = 0; i < n_threads; i++)
+		threads[i] = g_thread_new("verify", verify_data_thread, &ctx);
+	for (guint i = 0; i < n_threads; i++)
+		g_thread_join(threads[i]);
+
+	g_mutex_clear(&ctx.lock);
+
+	if (ctx.error) {
+		g_propagate_error(error, ctx.error);
+		g_array_unref(ctx.mismatches);
+		return FALSE;
+	}
+
+	g_array_sort(ctx.mismatches, compare_chunk_numbers);
+	*mismatches = ctx.mismatches;
+
+	return TRUE;
+}
+
 void r_hash_index_free(RaucHashIndex *idx)
 {
 	if (!idx)
@@ -557,10 +2072,12 @@ void r_hash_index_free(RaucHashIndex *idx)
 
 	g_free(idx->label);
 
-	g_close(idx->data_fd, NULL);
+	if (idx->data_fd >= 0)
+		g_close(idx->data_fd, NULL);
 
 	g_bytes_unref(idx->hashes);
-	g_free(idx->lookup);
+	g_clear_pointer(&idx->lookup_data, g_bytes_unref);
+	r_memory_release(idx->reserved_memory);
 
 	r_stats_free(idx->match_stats);
 
@@ -6,6 +6,7 @@
 #include <gio/gunixoutputstream.h>
 #include <glib.h>
 #include <glib/gstdio.h>
+#include <openssl/rand.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/ioctl.h>
@@ -17,17 +18,22 @@
 #include "bundle.h"
 #include "context.h"
 #include "event_log.h"
+#include "hash_index.h"
 #include "install.h"
 #include "manifest.h"
 #include "mark.h"
+#include "memory.h"
 #include "mount.h"
 #include "service.h"
 #include "shell.h"
 #include "signature.h"
 #include "slot.h"
+#include "stats.h"
 #include "status_file.h"
 #include "update_handler.h"
+#include "update_utils.h"
 #include "utils.h"
+#include "verity_hash.h"
 
 /* All exit codes of hook script above this mean 'rejected' */
 #define INSTALL_HOOK_REJECT_CODE 10
@@ -60,15 +66,23 @@ static void install_args_update(RaucInstallArgs *args, const gchar *msg, ...)
 
 static gchar *resolve_loop_device(const gchar *devicepath, GError **error)
 {
-	g_autoptr(GRegex) regex = NULL;
+	static GRegex *regex = NULL;
 	g_autoptr(GMatchInfo) match_info = NULL;
 	g_autofree gchar *devicename = NULL;
 	g_autofree gchar *syspath = NULL;
 	gchar *content = NULL;
 	GError *ierror = NULL;
 
-	regex = g_regex_new("/dev/(loop\\d+)(p\\d+)?", 0, 0, NULL);
-	g_assert_nonnull(regex);
+	/* most mounts are not backed by loop devices */
+	if (!strstr(devicepath, "/dev/loop"))
+		return g_strdup(devicepath);
+
+	/* compiled once, as this is called for each mount entry */
+	if (g_once_init_enter(&regex)) {
+		GRegex *tmp = g_regex_new("/dev/(loop\\d+)(p\\d+)?", G_REGEX_OPTIMIZE, 0, NULL);
+		g_assert_nonnull(tmp);
+		g_once_init_leave(&regex, tmp);
+	}
 
 	g_regex_match(regex, devicepath, 0, &match_info);
 	if (!g_match_info_matches(match_info))
@@ -155,6 +169,10 @@ gboolean determine_slot_states(GError **error)
 
 	g_assert_nonnull(r_context()->config);
 
+	/* the states can't change while the config is loaded */
+	if (r_context()->config->slot_states_determined)
+		return TRUE;
+
 	if (r_context()->config->slots == NULL) {
 		g_set_error_literal(
 				error,
@@ -248,10 +266,29 @@ gboolean determine_slot_states(GError **error)
 
 gboolean determine_boot_states(GError **error)
 {
+	g_autoptr(GPtrArray) boot_slots = g_ptr_array_new();
+	g_autofree gboolean *good = NULL;
+	g_autoptr(GError) multi_error = NULL;
 	GHashTableIter iter;
 	RaucSlot *slot;
 	gboolean had_errors = FALSE;
 
+	g_hash_table_iter_init(&iter, r_context()->config->slots);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer*) &slot)) {
+		if (slot->bootname)
+			g_ptr_array_add(boot_slots, slot);
+	}
+
+	/* query all slots at once if supported by the bootloader */
+	good = g_new0(gboolean, boot_slots->len + 1);
+	if (boot_slots->len && r_boot_get_states(boot_slots, good, &multi_error)) {
+		for (guint i = 0; i < boot_slots->len; i++)
+			((RaucSlot *)boot_slots->pdata[i])->boot_good = good[i];
+		return TRUE;
+	}
+	if (multi_error && !g_error_matches(multi_error, R_BOOTCHOOSER_ERROR, R_BOOTCHOOSER_ERROR_NOT_SUPPORTED))
+		g_debug("Failed to get all boot states at once: %s", multi_error->message);
+
 	/* get boot state */
 	g_hash_table_iter_init(&iter, r_context()->config->slots);
 	while (g_hash_table_iter_next(&iter, NULL, (gpointer*) &slot)) {
@@ -775,7 +812,9 @@ static gboolean launch_and_wait_handler(RaucInstallArgs *args, gchar *handler_na
 	g_autoptr(GPtrArray) args_array = NULL;
 	GInputStream *instream = NULL;
 	g_autoptr(GDataInputStream) datainstream = NULL;
+	g_autofree gchar *label = NULL;
 	gchar *outline;
+	gint64 start;
 
 	g_return_val_if_fail(args, FALSE);
 	g_return_val_if_fail(handler_name, FALSE);
@@ -793,6 +832,7 @@ static gboolean launch_and_wait_handler(RaucInstallArgs *args, gchar *handler_na
 	}
 	g_ptr_array_add(args_array, NULL);
 
+	start = g_get_monotonic_time();
 	handleproc = r_subprocess_launcher_spawnv(
 			handlelaunch, args_array, &ierror);
 	if (handleproc == NULL) {
@@ -817,6 +857,8 @@ static gboolean launch_and_wait_handler(RaucInstallArgs *args, gchar *handler_na
 	} while (outline);
 
 	res = g_subprocess_wait_check(handleproc, NULL, &ierror);
+	label = g_strdup_printf("handler %s [s]", handler_name);
+	r_stats_report_add(label, (gdouble)(g_get_monotonic_time() - start) / G_USEC_PER_SEC);
 	if (!res) {
 		g_propagate_error(error, ierror);
 		goto out;
@@ -839,6 +881,8 @@ static gboolean run_bundle_hook(RaucManifest *manifest, gchar* bundledir, const
 	gboolean res = FALSE;
 	gchar *outline = NULL;
 	g_autofree gchar *hookreturnmsg = NULL;
+	g_autofree gchar *label = NULL;
+	gint64 start;
 
 	g_assert_nonnull(manifest->hook_name);
 
@@ -860,6 +904,7 @@ static gboolean run_bundle_hook(RaucManifest *manifest, gchar* bundledir, const
 	r_shell_from_manifest_meta(shell_vars, manifest);
 	r_subprocess_launcher_setenv_ptr_array(launcher, shell_vars, TRUE);
 
+	start = g_get_monotonic_time();
 	sproc = g_subprocess_launcher_spawn(
 			launcher, &ierror,
 			hook_name,
@@ -886,6 +931,8 @@ static gboolean run_bundle_hook(RaucManifest *manifest, gchar* bundledir, const
 	} while (outline);
 
 	res = g_subprocess_wait_check(sproc, NULL, &ierror);
+	label = g_strdup_printf("bundle hook %s [s]", hook_cmd);
+	r_stats_report_add(label, (gdouble)(g_get_monotonic_time() - start) / G_USEC_PER_SEC);
 	if (!res) {
 		/* Subprocess exited with code 1 */
 		if ((ierror->domain == G_SPAWN_EXIT_ERROR) && (ierror->code >= INSTALL_HOOK_REJECT_CODE)) {
@@ -1054,6 +1101,9 @@ skip_filename_checks:
 static void update_slot_status(RaucSlotStatus *slot_state, const gchar* status, const RaucManifest *manifest, const RImageInstallPlan *plan, const RaucInstallArgs *args)
 {
 	g_autoptr(GDateTime) now = NULL;
+	/* set by run_slot_handler(), or kept from the last install for skipped slots */
+	g_autofree gchar *verity_root_hash = g_steal_pointer(&slot_state->verity_root_hash);
+	g_autofree gchar *verity_salt = g_steal_pointer(&slot_state->verity_salt);
 
 	r_slot_clear_status(slot_state);
 
@@ -1071,13 +1121,111 @@ static void update_slot_status(RaucSlotStatus *slot_state, const gchar* status,
 	slot_state->installed_txn = g_strdup(args->transaction);
 	slot_state->installed_timestamp = g_date_time_format(now, "%Y-%m-%dT%H:%M:%SZ");
 	slot_state->installed_count++;
+	if (g_strcmp0(status, "ok") == 0) {
+		slot_state->verity_root_hash = g_steal_pointer(&verity_root_hash);
+		slot_state->verity_salt = g_steal_pointer(&verity_salt);
+	}
 }
 
-static gboolean handle_slot_install_plan(const RaucManifest *manifest, const RImageInstallPlan *plan, RaucInstallArgs *args, const char *hook_name, GError **error)
+/**
+ * Compares the content of the target slot with the image using the image's
+ * block-hash-index.
+ *
+ * The slot's stored hash index is used if available, otherwise it is
+ * calculated from the slot device. In both cases, the data is verified.
+ *
+ * @return TRUE if the slot already contains the image, FALSE otherwise
+ */
+static gboolean slot_has_image_content(const RImageInstallPlan *plan, GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(RaucHashIndex) image_idx = NULL;
+	g_autoptr(RaucHashIndex) slot_idx = NULL;
+	const guint8 *hashes = NULL;
+
+	image_idx = r_hash_index_open_image("image", plan->image, &ierror);
+	if (!image_idx) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	if (plan->target_slot->data_directory) {
+		slot_idx = r_hash_index_open_slot("slot", plan->target_slot, O_RDONLY, &ierror);
+	} else {
+		g_auto(filedesc) data_fd = g_open(plan->target_slot->device, O_RDONLY | O_CLOEXEC);
+
+		if (data_fd < 0) {
+			int err = errno;
+			g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+					"Failed to open slot device %s: %s", plan->target_slot->device, g_strerror(err));
+			return FALSE;
+		}
+		slot_idx = r_hash_index_open("slot", data_fd, NULL, &ierror);
+	}
+	if (!slot_idx) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	hashes = g_bytes_get_data(image_idx->hashes, NULL);
+	for (guint32 i = 0; i < image_idx->count; i++) {
+		if (!r_hash_index_has_chunk_at(slot_idx, i, hashes + (gsize)i * 32, &ierror)) {
+			g_debug("Slot %s differs from image %s: %s", plan->target_slot->name, plan->image->filename, ierror->message);
+			g_clear_error(&ierror);
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/**
+ * Returns whether the slot of a plan can be skipped as it already contains
+ * the image.
+ */
+static gboolean slot_is_up_to_date(const RImageInstallPlan *plan)
+{
+	GError *ierror = NULL;
+	const RaucSlotStatus *slot_state = plan->target_slot->status;
+
+	if (plan->target_slot->install_same)
+		return FALSE;
+
+	if (g_strcmp0(slot_state->status, "ok") == 0 && g_strcmp0(plan->image->checksum.digest, slot_state->checksum.digest) == 0)
+		return TRUE;
+
+	if (!plan->target_slot->check_same_content)
+		return FALSE;
+
+	if (!plan->image->adaptive || !g_strv_contains((const gchar * const *)plan->image->adaptive, "block-hash-index"))
+		return FALSE;
+
+	g_message("Comparing content of slot %s with image '%s'", plan->target_slot->name, plan->image->filename);
+	if (!slot_has_image_content(plan, &ierror)) {
+		if (ierror) {
+			g_warning("Failed to compare slot content, installing anyway: %s", ierror->message);
+			g_clear_error(&ierror);
+		}
+		return FALSE;
+	}
+
+	g_message("Slot %s already contains image '%s'", plan->target_slot->name, plan->image->filename);
+	return TRUE;
+}
+
+/**
+ * Checks the target slot of a plan and marks it as being updated.
+ *
+ * If the slot already contains the image (and install-same is disabled),
+ * only its status is updated and skip is set to TRUE.
+ */
+static gboolean prepare_slot_install_plan(const RaucManifest *manifest, const RImageInstallPlan *plan, RaucInstallArgs *args, gboolean *skip, GError **error)
 {
 	GError *ierror = NULL;
 	RaucSlotStatus *slot_state = NULL;
 
+	*skip = FALSE;
+
 	install_args_update(args, "Checking slot %s", plan->target_slot->name);
 
 	r_context_begin_step_weighted_formatted("check_slot", 0, 1, "Checking slot %s%s%s%s",
@@ -1099,7 +1247,7 @@ static gboolean handle_slot_install_plan(const RaucManifest *manifest, const RIm
 	}
 
 	/* if explicitly enabled, skip update of up-to-date slots */
-	if (!plan->target_slot->install_same && g_strcmp0(slot_state->status, "ok") == 0 && g_strcmp0(plan->image->checksum.digest, slot_state->checksum.digest) == 0) {
+	if (slot_is_up_to_date(plan)) {
 		install_args_update(args, "Skipping update for correct image '%s'", plan->image->filename);
 		g_message("Skipping update for correct image '%s'", plan->image->filename);
 		r_context_end_step("check_slot", TRUE);
@@ -1119,6 +1267,7 @@ static gboolean handle_slot_install_plan(const RaucManifest *manifest, const RIm
 		r_context_end_step("skip_image", TRUE);
 
 		install_args_update(args, "Updating slot %s done", plan->target_slot->name);
+		*skip = TRUE;
 		return TRUE;
 	}
 
@@ -1162,14 +1311,262 @@ static gboolean handle_slot_install_plan(const RaucManifest *manifest, const RIm
 			g_message("Updating %s with %s", plan->target_slot->device, plan->image->filename);
 	}
 
-	r_context_begin_step_weighted_formatted("copy_image", 0, 9, "Copying image to %s", plan->target_slot->name);
+	return TRUE;
+}
+
+/* verify-after-write compares the slot with the image's block-hash-index */
+static gboolean image_supports_verify(const RaucImage *image)
+{
+	return image->adaptive && g_strv_contains((const gchar * const *)image->adaptive, "block-hash-index");
+}
+
+/* maximum number of mismatching ranges logged by verify_written_slot() */
+#define VERIFY_MAX_LOGGED_RANGES 16
+
+/**
+ * Reads back the written slot and compares it with the image's
+ * block-hash-index.
+ *
+ * The slot is read with O_DIRECT (if supported), so that the data is read
+ * from the device instead of the page cache.
+ */
+static gboolean verify_written_slot(const RImageInstallPlan *plan, GError **error)
+{
+	GError *ierror = NULL;
+	RaucSlot *slot = plan->target_slot;
+	g_autoptr(RaucHashIndex) image_idx = NULL;
+	g_autoptr(GArray) mismatches = NULL;
+	g_auto(filedesc) data_fd = -1;
+	gint64 start = g_get_monotonic_time();
+	guint ranges = 0;
+
+	image_idx = r_hash_index_open_image("image", plan->image, &ierror);
+	if (!image_idx) {
+		g_propagate_prefixed_error(error, ierror, "Failed to open image hash index for verification: ");
+		return FALSE;
+	}
+
+	data_fd = g_open(slot->device, O_RDONLY | O_CLOEXEC | O_DIRECT, 0);
+	if (data_fd < 0 && errno == EINVAL) {
+		g_debug("O_DIRECT not supported for %s, reading via page cache", slot->device);
+		data_fd = g_open(slot->device, O_RDONLY | O_CLOEXEC, 0);
+	}
+	if (data_fd < 0) {
+		int err = errno;
+		g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
+				"Failed to open slot device %s: %s", slot->device, g_strerror(err));
+		return FALSE;
+	}
+
+	g_message("Verifying written data of slot %s", slot->name);
+	if (!r_hash_index_verify_data(image_idx, data_fd, &mismatches, &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Failed to verify slot %s: ", slot->name);
+		return FALSE;
+	}
+
+	if (!mismatches->len) {
+		g_message("Verified slot %s in %.1f seconds", slot->name,
+				(gdouble)(g_get_monotonic_time() - start) / G_USEC_PER_SEC);
+		return TRUE;
+	}
+
+	/* report consecutive mismatching chunks as ranges */
+	for (guint i = 0; i < mismatches->len;) {
+		guint32 first = g_array_index(mismatches, guint32, i);
+		guint32 end = first + 1;
+
+		for (i++; i < mismatches->len && g_array_index(mismatches, guint32, i) == end; i++)
+			end++;
+
+		if (ranges++ < VERIFY_MAX_LOGGED_RANGES)
+			g_warning("Slot %s differs from image at offset %"G_GUINT64_FORMAT " (%"G_GUINT64_FORMAT " bytes)",
+					slot->name, (guint64)first * R_HASH_INDEX_CHUNK_SIZE,
+					(guint64)(end - first) * R_HASH_INDEX_CHUNK_SIZE);
+	}
+	if (ranges > VERIFY_MAX_LOGGED_RANGES)
+		g_warning("Slot %s has %u more differing ranges", slot->name, ranges - VERIFY_MAX_LOGGED_RANGES);
+
+	g_set_error(error, R_INSTALL_ERROR, R_INSTALL_ERROR_FAILED,
+			"Verification of slot %s failed: %u chunks in %u ranges differ, first at offset %"G_GUINT64_FORMAT,
+			slot->name, mismatches->len, ranges,
+			(guint64)g_array_index(mismatches, guint32, 0) * R_HASH_INDEX_CHUNK_SIZE);
+	return FALSE;
+}
+
+/**
+ * Writes the dm-verity hash tree for the data written to a slot.
+ *
+ * Data which was not hashed while it was written (for example by install
+ * hooks or copies without userspace buffers) is read from the slot first.
+ */
+static gboolean write_slot_verity_tree(const RImageInstallPlan *plan, RaucVerityTree *verity, const guint8 *salt, GError **error)
+{
+	RaucSlot *slot = plan->target_slot;
+	g_auto(filedesc) data_fd = -1;
+	g_auto(filedesc) hash_fd = -1;
+	guint64 hash_offset = 0;
+	guint64 read_blocks = 0;
+	guint64 hash_blocks = 0;
+	guint8 root_hash[32];
+
+	data_fd = g_open(slot->device, (slot->verity_hash_device ? O_RDONLY : O_RDWR) | O_CLOEXEC, 0);
+	if (data_fd < 0) {
+		int err = errno;
+		g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
+				"Failed to open slot device %s: %s", slot->device, g_strerror(err));
+		return FALSE;
+	}
+
+	if (r_verity_tree_fill(verity, data_fd, &read_blocks) != 0) {
+		g_set_error(error, R_INSTALL_ERROR, R_INSTALL_ERROR_FAILED,
+				"Failed to read slot %s for verity hash tree", slot->name);
+		return FALSE;
+	}
+	if (read_blocks)
+		g_message("Read %"G_GUINT64_FORMAT " blocks of slot %s for verity hash tree", read_blocks, slot->name);
+
+	if (slot->verity_hash_device) {
+		hash_fd = g_open(slot->verity_hash_device, O_RDWR | O_CLOEXEC, 0);
+		if (hash_fd < 0) {
+			int err = errno;
+			g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
+					"Failed to open verity hash device %s: %s", slot->verity_hash_device, g_strerror(err));
+			return FALSE;
+		}
+	} else {
+		/* the hash tree directly follows the data */
+		hash_fd = data_fd;
+		data_fd = -1;
+		hash_offset = plan->image->checksum.size;
+	}
+
+	if (r_verity_tree_write(verity, hash_fd, hash_offset, &hash_blocks, root_hash) != 0) {
+		g_set_error(error, R_INSTALL_ERROR, R_INSTALL_ERROR_FAILED,
+				"Failed to write verity hash tree for slot %s", slot->name);
+		return FALSE;
+	}
+
+	if (fsync(hash_fd) != 0) {
+		int err = errno;
+		g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
+				"Failed to sync verity hash tree: %s", g_strerror(err));
+		return FALSE;
+	}
+
+	g_message("Wrote verity hash tree of %"G_GUINT64_FORMAT " blocks for slot %s", hash_blocks, slot->name);
+
+	slot->status->verity_root_hash = r_hex_encode(root_hash, sizeof(root_hash));
+	slot->status->verity_salt = r_hex_encode(salt, 32);
+
+	return TRUE;
+}
+
+/**
+ * Runs the slot handler of a plan.
+ *
+ * For slots with 'verify-after-write' enabled, the written data is read back
+ * and compared afterwards. For slots with 'verity-hash' enabled, the data is
+ * hashed while it is written and the dm-verity hash tree is written
+ * afterwards.
+ *
+ * The amount of data the handler wrote through the copy helpers is stored in
+ * written, which stays -1 for handlers that don't use them.
+ */
+static gboolean run_slot_handler(const RImageInstallPlan *plan, const gchar *hook_name, goffset *written, GError **error)
+{
+	RaucSlotStatus *slot_state = plan->target_slot->status;
+	g_autoptr(RaucVerityTree) verity = NULL;
+	guint8 salt[32];
+	gboolean res;
+
+	*written = -1;
+	g_clear_pointer(&slot_state->verity_root_hash, g_free);
+	g_clear_pointer(&slot_state->verity_salt, g_free);
+
+	/* check before writing, so that the slot is not left unverified */
+	if (plan->target_slot->verify_after_write && !image_supports_verify(plan->image)) {
+		g_set_error(error, R_INSTALL_ERROR, R_INSTALL_ERROR_FAILED,
+				"verify-after-write for slot %s requires image %s to use the adaptive mode 'block-hash-index'",
+				plan->target_slot->name, plan->image->filename);
+		return FALSE;
+	}
+
+	/* The slot is verified after the handler, so it must not be modified
+	 * after the image was written. A pre-install hook runs before that. */
+	if (plan->target_slot->verify_after_write &&
+	    (plan->image->hooks.install || plan->image->hooks.post_install || plan->target_slot->resize)) {
+		g_set_error(error, R_INSTALL_ERROR, R_INSTALL_ERROR_FAILED,
+				"verify-after-write for slot %s cannot be combined with an install or post-install hook or resize",
+				plan->target_slot->name);
+		return FALSE;
+	}
+
+	if (plan->target_slot->verity_hash) {
+		/* The hash tree is written after image->checksum.size bytes, so
+		 * the image must be copied as-is, without any later changes to
+		 * the slot. */
+		if (!r_update_handler_is_raw_copy(plan->slot_handler, plan->image, plan->target_slot) ||
+		    plan->target_slot->resize) {
+			g_set_error(error, R_INSTALL_ERROR, R_INSTALL_ERROR_FAILED,
+					"verity-hash for slot %s requires image %s to be copied as-is (without hooks, adaptive, casync or delta updates and resize)",
+					plan->target_slot->name, plan->image->filename);
+			return FALSE;
+		}
+
+		if (plan->image->checksum.size <= 0 || plan->image->checksum.size % 4096) {
+			g_set_error(error, R_INSTALL_ERROR, R_INSTALL_ERROR_FAILED,
+					"Image size of %s is not a multiple of 4096 bytes as required for verity-hash", plan->image->filename);
+			return FALSE;
+		}
+
+		if (RAND_bytes((unsigned char *)&salt, sizeof(salt)) != 1) {
+			g_set_error(error, R_INSTALL_ERROR, R_INSTALL_ERROR_FAILED,
+					"Failed to generate verity salt");
+			return FALSE;
+		}
+
+		verity = r_verity_tree_new(plan->image->checksum.size / 4096, salt);
+		if (!verity) {
+			g_set_error(error, R_INSTALL_ERROR, R_INSTALL_ERROR_FAILED,
+					"Failed to create verity hash tree");
+			return FALSE;
+		}
+	}
 
-	if (!plan->slot_handler(plan->image, plan->target_slot, hook_name, &ierror)) {
+	r_copy_set_verity_tree(verity);
+	r_copy_set_written_counter(written);
+	res = plan->slot_handler(plan->image, plan->target_slot, hook_name, error);
+	r_copy_set_written_counter(NULL);
+	r_copy_set_verity_tree(NULL);
+	if (!res)
+		return FALSE;
+
+	if (plan->target_slot->verify_after_write && !verify_written_slot(plan, error))
+		return FALSE;
+
+	if (verity)
+		return write_slot_verity_tree(plan, verity, salt, error);
+
+	return TRUE;
+}
+
+/**
+ * Records the result of the slot handler in the slot status.
+ *
+ * Takes ownership of handler_error. The number of bytes written by the
+ * handler is reported if known (written >= 0).
+ */
+static gboolean finish_slot_install_plan(const RaucManifest *manifest, const RImageInstallPlan *plan, RaucInstallArgs *args, gboolean handler_res, GError *handler_error, goffset written, GError **error)
+{
+	GError *ierror = NULL;
+	g_autofree gchar *label = NULL;
+	RaucSlotStatus *slot_state = plan->target_slot->status;
+
+	if (!handler_res) {
 		g_autoptr(GError) ierror_status = NULL;
 
-		g_propagate_prefixed_error(error, ierror,
+		g_propagate_prefixed_error(error, handler_error,
 				"Failed updating slot %s: ", plan->target_slot->name);
-		r_context_end_step("copy_image", FALSE);
 
 		g_message("Updating slot %s status", plan->target_slot->name);
 		update_slot_status(slot_state, "failed", manifest, plan, args);
@@ -1180,7 +1577,12 @@ static gboolean handle_slot_install_plan(const RaucManifest *manifest, const RIm
 		return FALSE;
 	}
 
-	r_context_end_step("copy_image", TRUE);
+	if (written >= 0) {
+		label = g_strdup_printf("written bytes of %s", plan->target_slot->name);
+		r_stats_report_add(label, written);
+	} else {
+		g_debug("Handler for slot %s did not report the written bytes", plan->target_slot->name);
+	}
 
 	g_message("Updating slot %s status", plan->target_slot->name);
 	update_slot_status(slot_state, "ok", manifest, plan, args);
@@ -1193,6 +1595,528 @@ static gboolean handle_slot_install_plan(const RaucManifest *manifest, const RIm
 	return TRUE;
 }
 
+static gboolean handle_slot_install_plan(const RaucManifest *manifest, const RImageInstallPlan *plan, RaucInstallArgs *args, const char *hook_name, GError **error)
+{
+	GError *ierror = NULL;
+	gboolean skip = FALSE;
+	goffset written;
+	gboolean res;
+
+	if (!prepare_slot_install_plan(manifest, plan, args, &skip, error))
+		return FALSE;
+	if (skip)
+		return TRUE;
+
+	/* the 'pending' status must be persisted before touching the slot */
+	if (!r_slot_status_commit(&ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Error while writing status file: ");
+		return FALSE;
+	}
+
+	r_context_begin_step_weighted_formatted("copy_image", 0, 9, "Copying image to %s", plan->target_slot->name);
+
+	res = run_slot_handler(plan, hook_name, &written, &ierror);
+	r_context_end_step("copy_image", res);
+
+	return finish_slot_install_plan(manifest, plan, args, res, ierror, written, error);
+}
+
+/**
+ * Returns whether a plan may be installed concurrently with others.
+ *
+ * Hooks may depend on the order given by the manifest, so images with hooks
+ * are always installed on their own.
+ */
+static gboolean plan_allows_concurrency(const RImageInstallPlan *plan)
+{
+	if (!plan->target_slot)
+		return FALSE;
+
+	if (plan->image->hooks.pre_install || plan->image->hooks.install || plan->image->hooks.post_install)
+		return FALSE;
+
+	return TRUE;
+}
+
+static gboolean slot_is_ancestor(const RaucSlot *ancestor, const RaucSlot *slot)
+{
+	for (const RaucSlot *iter = slot->parent; iter; iter = iter->parent) {
+		if (iter == ancestor)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+static gboolean plans_conflict(const RImageInstallPlan *a, const RImageInstallPlan *b)
+{
+	if (g_strcmp0(a->target_slot->device, b->target_slot->device) == 0)
+		return TRUE;
+
+	if (slot_is_ancestor(a->target_slot, b->target_slot) || slot_is_ancestor(b->target_slot, a->target_slot))
+		return TRUE;
+
+	return FALSE;
+}
+
+/**
+ * Collects the consecutive plans starting at 'start' which can be installed
+ * concurrently.
+ *
+ * @return newly allocated array of (borrowed) plans, may be empty
+ */
+static GPtrArray *collect_concurrent_plans(GPtrArray *install_plans, guint start)
+{
+	GPtrArray *batch = g_ptr_array_new();
+
+	for (guint i = start; i < install_plans->len; i++) {
+		const RImageInstallPlan *plan = g_ptr_array_index(install_plans, i);
+
+		if (!plan_allows_concurrency(plan))
+			break;
+
+		for (guint j = 0; j < batch->len; j++) {
+			if (plans_conflict(g_ptr_array_index(batch, j), plan))
+				return batch;
+		}
+
+		g_ptr_array_add(batch, (gpointer)plan);
+	}
+
+	return batch;
+}
+
+/**
+ * Returns whether a plan's image can be written together with the same image
+ * for other slots, see install_slot_plans_fan_out().
+ */
+static gboolean plan_allows_fan_out(const RImageInstallPlan *plan)
+{
+	if (!plan_allows_concurrency(plan))
+		return FALSE;
+
+	/* the hash tree is salted per slot, so it is built by the slot handler */
+	if (plan->target_slot->verity_hash)
+		return FALSE;
+
+	/* leave reporting the missing index to the slot handler */
+	if (plan->target_slot->verify_after_write && !image_supports_verify(plan->image))
+		return FALSE;
+
+	return r_update_handler_is_raw_copy(plan->slot_handler, plan->image, plan->target_slot);
+}
+
+static gboolean plans_share_image(const RImageInstallPlan *a, const RImageInstallPlan *b)
+{
+	return g_strcmp0(a->image->filename, b->image->filename) == 0 &&
+	       g_strcmp0(a->image->checksum.digest, b->image->checksum.digest) == 0;
+}
+
+/**
+ * Collects the consecutive plans starting at 'start' which write the same
+ * image and can share reading it.
+ *
+ * @return newly allocated array of (borrowed) plans, may be empty
+ */
+static GPtrArray *collect_fan_out_plans(GPtrArray *install_plans, guint start)
+{
+	GPtrArray *group = g_ptr_array_new();
+
+	for (guint i = start; i < install_plans->len; i++) {
+		const RImageInstallPlan *plan = g_ptr_array_index(install_plans, i);
+
+		if (!plan_allows_fan_out(plan))
+			break;
+
+		if (group->len && !plans_share_image(g_ptr_array_index(group, 0), plan))
+			break;
+
+		for (guint j = 0; j < group->len; j++) {
+			if (plans_conflict(g_ptr_array_index(group, j), plan))
+				return group;
+		}
+
+		g_ptr_array_add(group, (gpointer)plan);
+	}
+
+	return group;
+}
+
+/**
+ * Installs the same image to multiple slots, reading it only once.
+ *
+ * As for concurrent installation, the slots are checked and their status is
+ * updated from this thread in manifest order. The image is read once and
+ * each block is written to all slot devices concurrently. The result is
+ * tracked for each slot, so that a failing device doesn't prevent the other
+ * slots from being updated, although the first failure is still returned.
+ */
+static gboolean install_slot_plans_fan_out(const RaucManifest *manifest, GPtrArray *plans, RaucInstallArgs *args, GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(GPtrArray) targets = g_ptr_array_new();
+	g_autoptr(GPtrArray) slots = g_ptr_array_new();
+	g_autofree GError **slot_errors = NULL;
+	g_autofree goffset *slot_written = NULL;
+	RaucImage *image = NULL;
+	gboolean res = TRUE;
+
+	for (guint i = 0; i < plans->len; i++) {
+		const RImageInstallPlan *plan = g_ptr_array_index(plans, i);
+		gboolean skip = FALSE;
+
+		if (!prepare_slot_install_plan(manifest, plan, args, &skip, &ierror)) {
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
+		if (skip)
+			continue;
+
+		g_clear_pointer(&plan->target_slot->status->verity_root_hash, g_free);
+		g_clear_pointer(&plan->target_slot->status->verity_salt, g_free);
+		g_ptr_array_add(targets, (gpointer)plan);
+		g_ptr_array_add(slots, plan->target_slot);
+	}
+
+	if (!targets->len)
+		return TRUE;
+
+	/* persist the 'pending' status of all slots with a single write */
+	if (!r_slot_status_commit(&ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Error while writing status file: ");
+		return FALSE;
+	}
+
+	image = ((const RImageInstallPlan *)g_ptr_array_index(targets, 0))->image;
+	slot_errors = g_new0(GError *, targets->len);
+
+	g_message("Writing %s to %u slots, reading it once", image->filename, targets->len);
+
+	r_context_begin_step_weighted_formatted("copy_image", 0, 9 * targets->len, "Copying image to %u slots", targets->len);
+
+	slot_written = g_new(goffset, targets->len);
+	for (guint i = 0; i < targets->len; i++)
+		slot_written[i] = -1;
+
+	if (!r_write_image_to_devs(image, slots, slot_errors, slot_written, &ierror)) {
+		/* keep the errors of slots which failed before reading */
+		for (guint i = 0; i < targets->len; i++) {
+			if (!slot_errors[i])
+				slot_errors[i] = g_error_copy(ierror);
+		}
+		g_clear_error(&ierror);
+	}
+
+	for (guint i = 0; i < targets->len; i++) {
+		const RImageInstallPlan *plan = g_ptr_array_index(targets, i);
+
+		if (!slot_errors[i] && plan->target_slot->verify_after_write)
+			verify_written_slot(plan, &slot_errors[i]);
+		res = res && !slot_errors[i];
+	}
+
+	r_context_end_step("copy_image", res);
+
+	/* record the results in manifest order, reporting the first error */
+	res = TRUE;
+	for (guint i = 0; i < targets->len; i++) {
+		const RImageInstallPlan *plan = g_ptr_array_index(targets, i);
+
+		if (finish_slot_install_plan(manifest, plan, args, !slot_errors[i], g_steal_pointer(&slot_errors[i]), slot_written[i], &ierror))
+			continue;
+
+		if (res) {
+			g_propagate_error(error, ierror);
+			res = FALSE;
+		} else {
+			g_warning("%s", ierror->message);
+			g_clear_error(&ierror);
+		}
+	}
+
+	return res;
+}
+
+typedef struct {
+	const RImageInstallPlan *plan;
+	const gchar *hook_name;
+	GAsyncQueue *done; /* receives the job when the handler returned */
+	RaucCopyProgress progress;
+	gboolean res;
+	GError *error;
+	goffset written; /* see run_slot_handler() */
+} SlotInstallJob;
+
+typedef struct {
+	gchar *device; /* physical device, see r_slot_get_physical_device() */
+	GPtrArray *jobs; /* borrowed SlotInstallJobs, in manifest order */
+	RaucStats *throughput; /* MiB/s per installed image */
+} DeviceInstallGroup;
+
+static void device_install_group_free(gpointer data)
+{
+	DeviceInstallGroup *group = data;
+
+	g_free(group->device);
+	g_ptr_array_free(group->jobs, TRUE);
+	r_stats_free(group->throughput);
+	g_free(group);
+}
+
+static void slot_install_job_run(SlotInstallJob *job, RaucStats *throughput)
+{
+	const RImageInstallPlan *plan = job->plan;
+	gint64 start = g_get_monotonic_time();
+	gdouble seconds;
+
+	r_copy_image_progress_redirect(&job->progress);
+	job->res = run_slot_handler(plan, job->hook_name, &job->written, &job->error);
+	r_copy_image_progress_redirect(NULL);
+
+	seconds = (gdouble)(g_get_monotonic_time() - start) / G_USEC_PER_SEC;
+	if (job->res && plan->image->checksum.size > 0 && seconds > 0)
+		r_stats_add(throughput, plan->image->checksum.size / seconds / (1024 * 1024));
+
+	g_mutex_lock(&job->progress.lock);
+	job->progress.total = MAX(job->progress.total, plan->image->checksum.size);
+	job->progress.done = job->progress.total;
+	g_mutex_unlock(&job->progress.lock);
+	g_async_queue_push(job->done, job);
+}
+
+/* Returns the install priority selected for the installation, or NULL. */
+static const RaucInstallPriority *find_install_priority(const RaucInstallArgs *args)
+{
+	const gchar *name = args->priority ? args->priority : r_context()->config->install_priority;
+
+	if (!name)
+		return NULL;
+
+	return g_hash_table_lookup(r_context()->config->install_priorities, name);
+}
+
+/* installs the images for one physical device one after another */
+static void device_install_worker(gpointer data, gpointer user_data)
+{
+	DeviceInstallGroup *group = data;
+	const RaucInstallPriority *priority = user_data;
+	RaucThreadPriority old_priority;
+	gboolean restore = FALSE;
+
+	/* pool threads are shared, so the priority is only set for this group */
+	if (priority) {
+		GError *ierror = NULL;
+
+		restore = r_get_thread_priority(&old_priority, &ierror) &&
+		          r_set_thread_priority(&priority->thread, &ierror);
+		if (ierror) {
+			g_warning("Failed to set install priority for %s: %s", group->device, ierror->message);
+			g_clear_error(&ierror);
+		}
+	}
+
+	for (guint i = 0; i < group->jobs->len; i++)
+		slot_install_job_run(g_ptr_array_index(group->jobs, i), group->throughput);
+
+	if (restore && !r_set_thread_priority(&old_priority, NULL))
+		g_warning("Failed to restore thread priority");
+}
+
+/**
+ * Installs multiple independent slot plans concurrently.
+ *
+ * Checking the slots and updating their status is done from this thread in
+ * manifest order, only the slot handlers run in a thread pool bounded by the
+ * 'install-concurrency' option. To avoid contention on the storage, the
+ * plans are grouped by their physical device: groups are installed in
+ * parallel, while the plans within a group are installed one after another.
+ * Meanwhile, the progress of all handlers is combined into a single step.
+ */
+static gboolean install_slot_plans_concurrently(const RaucManifest *manifest, GPtrArray *plans, RaucInstallArgs *args, const gchar *hook_name, GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(GAsyncQueue) done = g_async_queue_new();
+	g_autofree SlotInstallJob *jobs = NULL;
+	g_autoptr(GPtrArray) groups = g_ptr_array_new_with_free_func(device_install_group_free);
+	GThreadPool *pool = NULL;
+	guint n_jobs = 0;
+	guint finished = 0;
+	gboolean res = TRUE;
+
+	jobs = g_new0(SlotInstallJob, plans->len);
+	for (guint i = 0; i < plans->len; i++) {
+		const RImageInstallPlan *plan = g_ptr_array_index(plans, i);
+		g_autofree gchar *device = NULL;
+		DeviceInstallGroup *group = NULL;
+		gboolean skip = FALSE;
+
+		if (!prepare_slot_install_plan(manifest, plan, args, &skip, &ierror)) {
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
+		if (skip)
+			continue;
+
+		jobs[n_jobs].plan = plan;
+		jobs[n_jobs].hook_name = hook_name;
+		jobs[n_jobs].done = done;
+		g_mutex_init(&jobs[n_jobs].progress.lock);
+
+		device = r_slot_get_physical_device(plan->target_slot);
+		for (guint j = 0; j < groups->len; j++) {
+			DeviceInstallGroup *iter = g_ptr_array_index(groups, j);
+
+			if (g_strcmp0(iter->device, device) == 0) {
+				group = iter;
+				break;
+			}
+		}
+		if (!group) {
+			g_autofree gchar *label = g_strdup_printf("install throughput [MiB/s] of %s", device);
+
+			group = g_new0(DeviceInstallGroup, 1);
+			group->device = g_steal_pointer(&device);
+			group->jobs = g_ptr_array_new();
+			group->throughput = r_stats_new(label);
+			g_ptr_array_add(groups, group);
+		}
+		g_ptr_array_add(group->jobs, &jobs[n_jobs]);
+		n_jobs++;
+	}
+
+	if (!n_jobs)
+		return TRUE;
+
+	/* persist the 'pending' status of all slots with a single write */
+	if (!r_slot_status_commit(&ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Error while writing status file: ");
+		return FALSE;
+	}
+
+	g_message("Installing %u images to %u devices concurrently", n_jobs, groups->len);
+
+	r_context_begin_step_weighted_formatted("copy_images", 0, 9 * n_jobs, "Copying %u images concurrently", n_jobs);
+
+	pool = g_thread_pool_new(device_install_worker, (gpointer)find_install_priority(args), MIN((guint)r_context()->config->install_concurrency, groups->len), FALSE, &ierror);
+	if (!pool) {
+		g_propagate_prefixed_error(error, ierror, "Failed to create installation thread pool: ");
+		r_context_end_step("copy_images", FALSE);
+		return FALSE;
+	}
+
+	for (guint i = 0; i < groups->len; i++) {
+		DeviceInstallGroup *group = g_ptr_array_index(groups, i);
+
+		if (!g_thread_pool_push(pool, group, &ierror)) {
+			/* fall back to installing in this thread */
+			g_debug("Failed to queue installation to %s: %s", group->device, ierror->message);
+			g_clear_error(&ierror);
+			device_install_worker(group, NULL);
+		}
+	}
+
+	/* combine the handlers' progress until all of them returned */
+	while (finished < n_jobs) {
+		goffset bytes_done = 0;
+		goffset bytes_total = 0;
+
+		if (g_async_queue_timeout_pop(done, R_COPY_PROGRESS_INTERVAL))
+			finished++;
+
+		for (guint i = 0; i < n_jobs; i++) {
+			/* handlers which don't report progress count with the image size */
+			g_mutex_lock(&jobs[i].progress.lock);
+			bytes_done += jobs[i].progress.done;
+			bytes_total += MAX(jobs[i].progress.total, jobs[i].plan->image->checksum.size);
+			g_mutex_unlock(&jobs[i].progress.lock);
+		}
+		if (bytes_total > 0)
+			r_context_set_step_bytes("copy_images", bytes_done, bytes_total);
+	}
+
+	g_thread_pool_free(pool, FALSE, TRUE);
+
+	for (guint i = 0; i < groups->len; i++) {
+		DeviceInstallGroup *group = g_ptr_array_index(groups, i);
+
+		r_stats_show(group->throughput, NULL);
+	}
+
+	for (guint i = 0; i < n_jobs; i++) {
+		res = res && jobs[i].res;
+		g_mutex_clear(&jobs[i].progress.lock);
+	}
+	r_context_end_step("copy_images", res);
+
+	/* record the results in manifest order, reporting the first error */
+	res = TRUE;
+	for (guint i = 0; i < n_jobs; i++) {
+		if (finish_slot_install_plan(manifest, jobs[i].plan, args, jobs[i].res, g_steal_pointer(&jobs[i].error), jobs[i].written, &ierror))
+			continue;
+
+		if (res) {
+			g_propagate_error(error, ierror);
+			res = FALSE;
+		} else {
+			g_warning("%s", ierror->message);
+			g_clear_error(&ierror);
+		}
+	}
+
+	return res;
+}
+
+/* Installs the plans in manifest order, batching plans which can be
+ * installed concurrently and sharing the reads of images written to multiple
+ * slots. */
+static gboolean install_plans_in_order(const RaucManifest *manifest, GPtrArray *install_plans, RaucInstallArgs *args, const gchar *hook_name, GError **error)
+{
+	GError *ierror = NULL;
+
+	for (guint i = 0; i < install_plans->len; i++) {
+		const RImageInstallPlan *plan = g_ptr_array_index(install_plans, i);
+
+		if (r_context()->config->install_concurrency > 1) {
+			g_autoptr(GPtrArray) group = collect_fan_out_plans(install_plans, i);
+			g_autoptr(GPtrArray) batch = NULL;
+
+			if (group->len > 1) {
+				if (!install_slot_plans_fan_out(manifest, group, args, &ierror)) {
+					g_propagate_error(error, ierror);
+					return FALSE;
+				}
+				i += group->len - 1;
+				continue;
+			}
+
+			batch = collect_concurrent_plans(install_plans, i);
+
+			if (batch->len > 1) {
+				if (!install_slot_plans_concurrently(manifest, batch, args, hook_name, &ierror)) {
+					g_propagate_error(error, ierror);
+					return FALSE;
+				}
+				i += batch->len - 1;
+				continue;
+			}
+		}
+
+		if (plan->target_slot) {
+			if (!handle_slot_install_plan(manifest, plan, args, hook_name, &ierror)) {
+				g_propagate_error(error, ierror);
+				return FALSE;
+			}
+		} else if (plan->target_repo) {
+			if (!handle_artifact_install_plan(manifest, plan, args, hook_name, &ierror)) {
+				g_propagate_error(error, ierror);
+				return FALSE;
+			}
+		}
+	}
+
+	return TRUE;
+}
+
 /* For each installation plan list, there should be one slot that we need to
  * mark bad and active for the bootloader.
  * In cases where we have only images for slots that are not part of the
@@ -1232,6 +2156,7 @@ static RaucSlot* get_boot_mark_slot(const GPtrArray *install_plans)
 #define MESSAGE_ID_INSTALLATION_SUCCEEDED "0163db5468ac4237b090d28490c301ed"
 #define MESSAGE_ID_INSTALLATION_FAILED    "c48141f7fd49443aafff862b4809168f"
 #define MESSAGE_ID_INSTALLATION_REJECTED  "60bea7e4fea549ccad68af457308b13a"
+#define MESSAGE_ID_INSTALLATION_PERFORMANCE "bf19b740df74417f89409c57d2c28882"
 
 static void log_event_installation_started(RaucInstallArgs *args)
 {
@@ -1289,6 +2214,62 @@ static void log_event_installation_done(RaucInstallArgs *args, RaucManifest *man
 	g_log_structured_array(G_LOG_LEVEL_MESSAGE, fields, G_N_ELEMENTS(fields));
 }
 
+/**
+ * Logs the performance report of an installation.
+ *
+ * The report is stored as the text form of an 'a{sv}' GVariant in the
+ * PERFORMANCE_REPORT field, containing the durations of all progress steps
+ * ('steps'), the statistics collected during the installation ('stats') and
+ * the peak memory usage ('peak-rss' and 'peak-reserved').
+ *
+ * @param args RaucInstallArgs
+ * @param steps report from r_context_end_step_report()
+ * @param stats report from r_stats_report_end()
+ */
+static void log_event_installation_performance(RaucInstallArgs *args, GVariant *steps, GVariant *stats)
+{
+	g_auto(GVariantDict) dict = G_VARIANT_DICT_INIT(NULL);
+	g_autoptr(GVariant) report = NULL;
+	g_autofree gchar *report_text = NULL;
+	g_autofree gchar *formatted = NULL;
+	g_autofree gchar *peak_rss = NULL;
+	gdouble duration = 0.0;
+	GVariantIter iter;
+	GVariant *step;
+
+	g_return_if_fail(args);
+	g_return_if_fail(steps);
+	g_return_if_fail(stats);
+
+	/* the root step is the last one to complete */
+	g_variant_iter_init(&iter, steps);
+	while ((step = g_variant_iter_next_value(&iter))) {
+		gint depth = 0;
+
+		if (g_variant_lookup(step, "depth", "i", &depth) && depth == 1)
+			g_variant_lookup(step, "duration", "d", &duration);
+		g_variant_unref(step);
+	}
+
+	g_variant_dict_insert_value(&dict, "steps", steps);
+	g_variant_dict_insert_value(&dict, "stats", stats);
+	g_variant_dict_insert(&dict, "peak-rss", "t", r_memory_get_peak_rss());
+	g_variant_dict_insert(&dict, "peak-reserved", "t", r_memory_get_reserved_peak(FALSE));
+	report = g_variant_ref_sink(g_variant_dict_end(&dict));
+	report_text = g_variant_print(report, FALSE);
+
+	peak_rss = g_format_size_full(r_memory_get_peak_rss(), G_FORMAT_SIZE_IEC_UNITS);
+	formatted = g_strdup_printf("Installation %.8s took %.3fs (peak memory usage %s)", args->transaction, duration, peak_rss);
+
+	g_log_structured(R_EVENT_LOG_DOMAIN, G_LOG_LEVEL_MESSAGE,
+			"RAUC_EVENT_TYPE", R_EVENT_LOG_TYPE_PERFORMANCE,
+			"MESSAGE_ID", MESSAGE_ID_INSTALLATION_PERFORMANCE,
+			"TRANSACTION_ID", args->transaction,
+			"PERFORMANCE_REPORT", report_text,
+			"MESSAGE", "%s", formatted
+			);
+}
+
 static gboolean remove_old_artifacts(const RaucManifest *manifest, RArtifactRepo *repo, GError **error)
 {
 	GError *ierror = NULL;
@@ -1409,6 +2390,8 @@ static gboolean launch_and_wait_default_handler(RaucInstallArgs *args, gchar* bu
 {
 	g_autofree gchar *hook_name = NULL;
 	GError *ierror = NULL;
+	g_autoptr(GError) ierror_status = NULL;
+	gboolean res;
 	g_autoptr(GPtrArray) install_plans = NULL;
 	RaucSlot *boot_mark_slot = NULL;
 
@@ -1442,23 +2425,23 @@ static gboolean launch_and_wait_default_handler(RaucInstallArgs *args, gchar* bu
 	r_context_begin_step_weighted("update_slots", "Updating slots", install_plans->len * 10, 6);
 	install_args_update(args, "Updating slots...");
 
-	for (guint i = 0; i < install_plans->len; i++) {
-		const RImageInstallPlan *plan = g_ptr_array_index(install_plans, i);
-
-		if (plan->target_slot) {
-			if (!handle_slot_install_plan(manifest, plan, args, hook_name, &ierror)) {
-				g_propagate_error(error, ierror);
-				r_context_end_step("update_slots", FALSE);
-				return FALSE;
-			}
-		} else if (plan->target_repo) {
-			if (!handle_artifact_install_plan(manifest, plan, args, hook_name, &ierror)) {
-				g_propagate_error(error, ierror);
-				r_context_end_step("update_slots", FALSE);
-				return FALSE;
-			}
+	/* Coalesce the status updates of all slots, only writing the status
+	 * file before a slot is touched and when done. */
+	r_slot_status_begin_batch();
+	res = install_plans_in_order(manifest, install_plans, args, hook_name, &ierror);
+	if (!r_slot_status_end_batch(&ierror_status)) {
+		if (res) {
+			g_propagate_prefixed_error(&ierror, g_steal_pointer(&ierror_status), "Error while writing status file: ");
+			res = FALSE;
+		} else {
+			g_warning("Error while writing status file: %s", ierror_status->message);
 		}
 	}
+	if (!res) {
+		g_propagate_error(error, ierror);
+		r_context_end_step("update_slots", FALSE);
+		return FALSE;
+	}
 
 	/* Remove unused artifacts if we were successful so far. */
 	if (!r_artifacts_prune(&ierror)) {
@@ -1494,6 +2477,8 @@ gboolean do_install_bundle(RaucInstallArgs *args, GError **error)
 	g_autoptr(RaucBundle) bundle = NULL;
 	g_autoptr(GHashTable) target_group = NULL;
 	g_auto(GStrv) handler_env = NULL;
+	g_auto(filedesc) bundle_fd = -1;
+	g_autofree gchar *bundle_fd_path = NULL;
 
 	g_assert_nonnull(bundlefile);
 	g_assert_null(r_context()->install_info->mounted_bundle);
@@ -1502,6 +2487,10 @@ gboolean do_install_bundle(RaucInstallArgs *args, GError **error)
 	if (!args->transaction)
 		args->transaction = g_uuid_string_random();
 
+	r_context_begin_step_report();
+	r_stats_report_begin();
+	r_memory_reset_peak();
+
 	r_context_begin_step("do_install_bundle", "Installing", 10);
 
 	log_event_installation_started(args);
@@ -1519,6 +2508,19 @@ gboolean do_install_bundle(RaucInstallArgs *args, GError **error)
 
 	args->access_args.http_info_headers = assemble_info_headers(args->transaction);
 
+	if (args->bundle_fd >= 0) {
+		bundle_fd = r_bundle_open_fd(args->bundle_fd, r_context()->config->max_bundle_download_size, &ierror);
+		g_close(args->bundle_fd, NULL);
+		args->bundle_fd = -1;
+		if (bundle_fd < 0) {
+			g_propagate_prefixed_error(error, ierror, "Failed to receive bundle: ");
+			res = FALSE;
+			goto out;
+		}
+		bundle_fd_path = r_bundle_fd_path(bundle_fd);
+		bundlefile = bundle_fd_path;
+	}
+
 	res = check_bundle(bundlefile, &bundle, CHECK_BUNDLE_DEFAULT, &args->access_args, &ierror);
 	if (!res) {
 		g_propagate_error(error, ierror);
@@ -1634,15 +2636,48 @@ umount:
 		umount_bundle(bundle, NULL);
 	}
 	r_context()->install_info->mounted_bundle = NULL;
+	g_clear_pointer(&r_context()->install_info->slot_hook_env, g_strfreev);
+	r_context()->install_info->slot_hook_env_bundle = NULL;
 
 out:
 	log_event_installation_done(args, bundle ? bundle->manifest : NULL, error ? *error : NULL);
 
 	r_context_end_step("do_install_bundle", res);
 
+	log_event_installation_performance(args, r_context_end_step_report(), r_stats_report_end());
+
 	return res;
 }
 
+/* Applies the install priority to the calling (installation) thread. */
+static gboolean apply_install_priority(RaucInstallArgs *args, GError **error)
+{
+	const RaucInstallPriority *priority = find_install_priority(args);
+	GError *ierror = NULL;
+
+	if (!priority) {
+		if (args->priority) {
+			g_set_error(error, R_INSTALL_ERROR, R_INSTALL_ERROR_REJECTED,
+					"Unknown install priority '%s'", args->priority);
+			return FALSE;
+		}
+		return TRUE;
+	}
+
+	g_message("Using install priority '%s'", priority->name);
+
+	/* Subprocesses such as the NBD server and handlers inherit this. */
+	if (!r_set_thread_priority(&priority->thread, &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Failed to apply install priority '%s': ", priority->name);
+		return FALSE;
+	}
+
+	r_copy_set_rate_limit(priority->rate_limit);
+	args->access_args.rate_limit = priority->rate_limit;
+
+	return TRUE;
+}
+
 static gboolean install_done(gpointer data)
 {
 	RaucInstallArgs *args = data;
@@ -1666,7 +2701,9 @@ static gpointer install_thread(gpointer data)
 	g_debug("thread started for %s", args->name);
 	install_args_update(args, "started");
 
-	result = !do_install_bundle(args, &ierror);
+	result = !(apply_install_priority(args, &ierror) &&
+	           do_install_bundle(args, &ierror));
+	r_copy_set_rate_limit(0);
 
 	if (result != 0) {
 		g_warning("%s", ierror->message);
@@ -1692,6 +2729,7 @@ RaucInstallArgs *install_args_new(void)
 	g_mutex_init(&args->status_mutex);
 	g_queue_init(&args->status_messages);
 	args->status_result = -2;
+	args->bundle_fd = -1;
 
 	return args;
 }
@@ -1699,11 +2737,14 @@ RaucInstallArgs *install_args_new(void)
 void install_args_free(RaucInstallArgs *args)
 {
 	g_free(args->name);
+	if (args->bundle_fd >= 0)
+		g_close(args->bundle_fd, NULL);
 	g_free(args->transaction);
 	g_mutex_clear(&args->status_mutex);
 	g_assert_cmpint(args->status_result, >=, 0);
 	g_assert_true(g_queue_is_empty(&args->status_messages));
 	g_free(args->require_manifest_hash);
+	g_free(args->priority);
 	clear_bundle_access_args(&args->access_args);
 	g_free(args);
 }
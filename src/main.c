@@ -46,6 +46,13 @@ gchar *certpath = NULL;
 gchar **intermediate = NULL;
 gchar *signing_keyring = NULL;
 gchar *mksquashfs_args = NULL;
+gint mksquashfs_processors = 0;
+gchar *mksquashfs_block_size = NULL;
+gchar *mksquashfs_comp = NULL;
+gchar *bundle_cache_dir = NULL;
+gchar *bundle_delta_base = NULL;
+gchar *bundle_layout = NULL;
+gchar *bundle_batch = NULL;
 gchar *casync_args = NULL;
 gchar **convert_ignore_images = NULL;
 gchar **recipients = NULL;
@@ -53,7 +60,13 @@ gchar *handler_args = NULL;
 gchar *bootslot = NULL;
 gchar *installation_txn = NULL;
 gchar *require_manifest_hash = NULL;
+gchar *install_priority = NULL;
 gboolean utf8_supported = FALSE;
+gchar *event_log_type = NULL;
+gchar *event_log_transaction = NULL;
+gchar *event_log_boot_id = NULL;
+gchar *event_log_since = NULL;
+gchar *event_log_until = NULL;
 RaucBundleAccessArgs access_args = {0};
 
 static gchar* make_progress_line(gint percentage)
@@ -107,6 +120,25 @@ static gboolean install_cleanup(gpointer data)
 	return G_SOURCE_REMOVE;
 }
 
+/* Formats the throughput and remaining time of a step as a suffix for the
+ * progress message, or an empty string if the rate is not known yet. */
+static gchar *format_progress_rate(gdouble rate, gdouble eta)
+{
+	g_autofree gchar *rate_str = NULL;
+	guint64 seconds;
+
+	if (rate <= 0)
+		return g_strdup("");
+
+	rate_str = g_format_size((guint64) rate);
+	if (eta < 0)
+		return g_strdup_printf(" (%s/s)", rate_str);
+
+	seconds = (guint64) eta;
+	return g_strdup_printf(" (%s/s, %"G_GUINT64_FORMAT ":%02"G_GUINT64_FORMAT " left)",
+			rate_str, seconds / 60, seconds % 60);
+}
+
 static void on_installer_changed(GDBusProxy *proxy, GVariant *changed,
 		const gchar* const *invalidated,
 		gpointer data)
@@ -128,6 +160,18 @@ static void on_installer_changed(GDBusProxy *proxy, GVariant *changed,
 	if (g_variant_lookup(changed, "Operation", "&s", &message)) {
 		g_queue_push_tail(&args->status_messages, g_strdup(message));
 	} else if (g_variant_lookup(changed, "Progress", "(i&si)", &percentage, &message, &depth)) {
+		g_autoptr(GVariant) bytes = NULL;
+		g_autofree gchar *rate = NULL;
+		gdouble bytes_rate = 0, bytes_eta = -1;
+
+		/* ProgressBytes is usually updated in the same signal */
+		bytes = g_variant_lookup_value(changed, "ProgressBytes", G_VARIANT_TYPE_VARDICT);
+		if (bytes) {
+			g_variant_lookup(bytes, "rate", "d", &bytes_rate);
+			g_variant_lookup(bytes, "eta", "d", &bytes_eta);
+		}
+		rate = format_progress_rate(bytes_rate, bytes_eta);
+
 		if (install_progressbar && isatty(STDOUT_FILENO)) {
 			g_autofree gchar *progress = make_progress_line(percentage);
 			/* This does:
@@ -136,9 +180,9 @@ static void on_installer_changed(GDBusProxy *proxy, GVariant *changed,
 			 * - print 2 lines
 			 * - move to previous line
 			 */
-			g_queue_push_tail(&args->status_messages, g_strdup_printf("\r\033[F\033[J%3"G_GINT32_FORMAT "%% %s\n%s", percentage, message, progress));
+			g_queue_push_tail(&args->status_messages, g_strdup_printf("\r\033[F\033[J%3"G_GINT32_FORMAT "%% %s%s\n%s", percentage, message, rate, progress));
 		} else {
-			g_queue_push_tail(&args->status_messages, g_strdup_printf("%3"G_GINT32_FORMAT "%% %s", percentage, message));
+			g_queue_push_tail(&args->status_messages, g_strdup_printf("%3"G_GINT32_FORMAT "%% %s%s", percentage, message, rate));
 		}
 	} else if (g_variant_lookup(changed, "LastError", "&s", &message) && message[0] != '\0') {
 		g_queue_push_tail(&args->status_messages, g_strdup_printf("%sLastError: %s", isatty(STDOUT_FILENO) ? "\033[J" : "", message));
@@ -212,7 +256,13 @@ static void print_progress_callback(gint percentage,
 		const gchar *message,
 		gint nesting_depth)
 {
-	g_print("%3"G_GINT32_FORMAT "%% %s\n", percentage, message);
+	RaucProgressBytes bytes = {0};
+	g_autofree gchar *rate = NULL;
+
+	if (r_context_get_progress_bytes(&bytes))
+		rate = format_progress_rate(bytes.rate, bytes.eta);
+
+	g_print("%3"G_GINT32_FORMAT "%% %s%s\n", percentage, message, rate ? rate : "");
 }
 
 static gboolean on_sigint(gpointer user_data)
@@ -266,6 +316,7 @@ static gboolean install_start(int argc, char **argv)
 	args->ignore_version_limit = install_ignore_version_limit;
 	args->transaction = installation_txn;
 	args->require_manifest_hash = require_manifest_hash;
+	args->priority = install_priority;
 	if (access_args.tls_cert)
 		args->access_args.tls_cert = g_strdup(access_args.tls_cert);
 	if (access_args.tls_key)
@@ -276,6 +327,8 @@ static gboolean install_start(int argc, char **argv)
 		args->access_args.tls_no_verify = access_args.tls_no_verify;
 	if (access_args.http_headers)
 		args->access_args.http_headers = g_strdupv(access_args.http_headers);
+	if (access_args.mirrors)
+		args->access_args.mirrors = g_strdupv(access_args.mirrors);
 
 	r_loop = g_main_loop_new(NULL, FALSE);
 	if (ENABLE_SERVICE) {
@@ -289,6 +342,8 @@ static gboolean install_start(int argc, char **argv)
 			g_variant_dict_insert(&dict, "transaction-id", "s", args->transaction);
 		if (args->require_manifest_hash)
 			g_variant_dict_insert(&dict, "require-manifest-hash", "s", args->require_manifest_hash);
+		if (args->priority)
+			g_variant_dict_insert(&dict, "priority", "s", args->priority);
 		if (args->access_args.tls_cert)
 			g_variant_dict_insert(&dict, "tls-cert", "s", args->access_args.tls_cert);
 		if (args->access_args.tls_key)
@@ -299,6 +354,8 @@ static gboolean install_start(int argc, char **argv)
 			g_variant_dict_insert(&dict, "tls-no-verify", "b", args->access_args.tls_no_verify);
 		if (args->access_args.http_headers)
 			g_variant_dict_insert(&dict, "http-headers", "^as", args->access_args.http_headers);
+		if (args->access_args.mirrors)
+			g_variant_dict_insert(&dict, "mirrors", "^as", args->access_args.mirrors);
 
 		installer = r_installer_proxy_new_for_bus_sync(bus_type,
 				G_DBUS_PROXY_FLAGS_GET_INVALIDATED_PROPERTIES,
@@ -376,6 +433,91 @@ out:
 	return TRUE;
 }
 
+static gboolean stage_start(int argc, char **argv)
+{
+	GBusType bus_type = (!g_strcmp0(g_getenv("DBUS_STARTER_BUS_TYPE"), "session"))
+	                    ? G_BUS_TYPE_SESSION : G_BUS_TYPE_SYSTEM;
+	g_autoptr(RInstaller) installer = NULL;
+	GError *error = NULL;
+	g_autofree gchar *bundlelocation = NULL;
+
+	g_debug("stage started");
+
+	r_exit_status = 1;
+
+	if (argc < 3) {
+		g_printerr("A bundle URL must be provided\n");
+		goto out;
+	}
+
+	if (argc > 3) {
+		g_printerr("Excess argument: %s\n", argv[3]);
+		goto out;
+	}
+
+	bundlelocation = resolve_bundle_path(argv[2]);
+	if (bundlelocation == NULL)
+		goto out;
+	g_debug("input bundle: %s", bundlelocation);
+
+	if (ENABLE_SERVICE) {
+		g_auto(GVariantDict) dict = G_VARIANT_DICT_INIT(NULL);
+
+		if (access_args.tls_cert)
+			g_variant_dict_insert(&dict, "tls-cert", "s", access_args.tls_cert);
+		if (access_args.tls_key)
+			g_variant_dict_insert(&dict, "tls-key", "s", access_args.tls_key);
+		if (access_args.tls_ca)
+			g_variant_dict_insert(&dict, "tls-ca", "s", access_args.tls_ca);
+		if (access_args.tls_no_verify)
+			g_variant_dict_insert(&dict, "tls-no-verify", "b", access_args.tls_no_verify);
+		if (access_args.http_headers)
+			g_variant_dict_insert(&dict, "http-headers", "^as", access_args.http_headers);
+		if (access_args.mirrors)
+			g_variant_dict_insert(&dict, "mirrors", "^as", access_args.mirrors);
+
+		installer = r_installer_proxy_new_for_bus_sync(bus_type,
+				G_DBUS_PROXY_FLAGS_GET_INVALIDATED_PROPERTIES,
+				"de.pengutronix.rauc", "/", NULL, &error);
+		if (installer == NULL) {
+			g_printerr("Error creating proxy: %s\n", error->message);
+			g_error_free(error);
+			goto out;
+		}
+		/* the reply is sent when the download is finished */
+		g_dbus_proxy_set_default_timeout(G_DBUS_PROXY(installer), G_MAXINT);
+
+		g_debug("Trying to contact rauc service");
+		if (!r_installer_call_stage_bundle_sync(
+				installer,
+				bundlelocation,
+				g_variant_dict_end(&dict), /* floating, no unref needed */
+				NULL,
+				&error)) {
+			if (g_dbus_error_is_remote_error(error))
+				g_dbus_error_strip_remote_error(error);
+			g_printerr("Staging `%s` failed: %s\n", bundlelocation, error->message);
+			g_error_free(error);
+			goto out;
+		}
+	} else {
+		g_assert(access_args.http_info_headers == NULL);
+		access_args.http_info_headers = assemble_info_headers(NULL);
+
+		if (!stage_bundle(bundlelocation, &access_args, &error)) {
+			g_printerr("Staging `%s` failed: %s\n", bundlelocation, error->message);
+			g_error_free(error);
+			goto out;
+		}
+	}
+
+	g_print("Staging `%s` succeeded\n", bundlelocation);
+	r_exit_status = 0;
+
+out:
+	return TRUE;
+}
+
 G_GNUC_UNUSED
 static gboolean bundle_start(int argc, char **argv)
 {
@@ -385,6 +527,21 @@ static gboolean bundle_start(int argc, char **argv)
 	g_autofree gchar *outdir = NULL;
 	g_debug("bundle start");
 
+	if (bundle_batch) {
+		if (argc > 2) {
+			g_printerr("Excess argument: %s\n", argv[2]);
+			r_exit_status = 1;
+			goto out;
+		}
+
+		if (!create_bundle_batch(bundle_batch, &ierror)) {
+			g_printerr("Failed to create bundles: %s\n", ierror->message);
+			g_clear_error(&ierror);
+			r_exit_status = 1;
+		}
+		goto out;
+	}
+
 	if (argc < 3) {
 		g_printerr("An input directory name must be provided\n");
 		r_exit_status = 1;
@@ -1453,6 +1610,11 @@ static void r_string_append_slot(GString *text, RaucSlot *slot, RaucStatusPrint
 			g_string_append_printf(text, "\n              timestamp=%s", slot_state->activated_timestamp);
 			g_string_append_printf(text, "\n              count=%u", slot_state->activated_count);
 		}
+		if (slot_state->verity_root_hash) {
+			g_string_append_printf(text, "\n          verity:");
+			g_string_append_printf(text, "\n              root-hash=%s", slot_state->verity_root_hash);
+			g_string_append_printf(text, "\n              salt=%s", slot_state->verity_salt);
+		}
 		if (slot_state->status)
 			g_string_append_printf(text, "\n          status=%s", slot_state->status);
 	}
@@ -1656,6 +1818,8 @@ static gchar* r_status_formatter_shell(RaucStatusPrint *status)
 			r_ptr_array_add_printf(entries, "RAUC_SLOT_STATUS_INSTALLED_COUNT_%d=%u", slotcnt, slot_state->installed_count);
 			r_ptr_array_add_printf(entries, "RAUC_SLOT_STATUS_ACTIVATED_TIMESTAMP_%d=%s", slotcnt, slot_state->activated_timestamp ?: "");
 			r_ptr_array_add_printf(entries, "RAUC_SLOT_STATUS_ACTIVATED_COUNT_%d=%u", slotcnt, slot_state->activated_count);
+			r_ptr_array_add_printf(entries, "RAUC_SLOT_STATUS_VERITY_ROOT_HASH_%d=%s", slotcnt, slot_state->verity_root_hash ?: "");
+			r_ptr_array_add_printf(entries, "RAUC_SLOT_STATUS_VERITY_SALT_%d=%s", slotcnt, slot_state->verity_salt ?: "");
 			r_ptr_array_add_printf(entries, "RAUC_SLOT_STATUS_STATUS_%d=%s", slotcnt, slot_state->status ?: "");
 		}
 	}
@@ -1841,6 +2005,15 @@ static gchar* r_status_formatter_json(RaucStatusPrint *status, gboolean pretty)
 				json_builder_add_int_value(builder, slot_state->activated_count);
 				json_builder_end_object(builder);       /* activated */
 			}
+			if (slot_state->verity_root_hash) {
+				json_builder_set_member_name(builder, "verity");
+				json_builder_begin_object(builder);     /* verity */
+				json_builder_set_member_name(builder, "root-hash");
+				json_builder_add_string_value(builder, slot_state->verity_root_hash);
+				json_builder_set_member_name(builder, "salt");
+				json_builder_add_string_value(builder, slot_state->verity_salt);
+				json_builder_end_object(builder);       /* verity */
+			}
 			if (slot_state->status) {
 				json_builder_set_member_name(builder, "status");
 				json_builder_add_string_value(builder, slot_state->status);
@@ -1890,6 +2063,8 @@ static RaucSlotStatus* r_variant_get_slot_state(GVariant *vardict)
 	g_variant_dict_lookup(&dict, "installed.count", "u", &slot_state->installed_count);
 	g_variant_dict_lookup(&dict, "activated.timestamp", "s", &slot_state->activated_timestamp);
 	g_variant_dict_lookup(&dict, "activated.count", "u", &slot_state->activated_count);
+	g_variant_dict_lookup(&dict, "verity.root-hash", "s", &slot_state->verity_root_hash);
+	g_variant_dict_lookup(&dict, "verity.salt", "s", &slot_state->verity_salt);
 
 	return slot_state;
 }
@@ -2135,7 +2310,11 @@ static gboolean status_start(int argc, char **argv)
 			r_exit_status = 1;
 			return TRUE;
 		}
+	}
 
+	/* the remaining status information is only needed for printing, not
+	 * for the mark-* subcommands */
+	if (argc < 3 && !ENABLE_SERVICE) {
 		res = determine_boot_states(&ierror);
 		if (!res) {
 			g_printerr("Failed to determine boot states: %s\n", ierror->message);
@@ -2171,7 +2350,7 @@ static gboolean status_start(int argc, char **argv)
 		status_print->bootslot = g_strdup(r_context()->bootslot);
 		status_print->slots = g_hash_table_ref(r_context()->config->slots);
 		status_print->artifacts = r_artifacts_to_dict();
-	} else {
+	} else if (argc < 3) {
 		if (!retrieve_status_via_dbus(&status_print, &ierror)) {
 			g_printerr("Error retrieving slot status via D-Bus: %s\n",
 					ierror->message);
@@ -2462,6 +2641,82 @@ out:
 	return FALSE;
 }
 
+static gboolean parse_event_log_time(const gchar *str, gint64 *time)
+{
+	g_autoptr(GTimeZone) utc = g_time_zone_new_utc();
+	g_autoptr(GDateTime) datetime = NULL;
+
+	datetime = g_date_time_new_from_iso8601(str, utc);
+	if (!datetime)
+		return FALSE;
+
+	*time = g_date_time_to_unix(datetime);
+	return TRUE;
+}
+
+static gboolean event_log_start(int argc, char **argv)
+{
+	g_autoptr(GError) ierror = NULL;
+	g_autoptr(GPtrArray) events = NULL;
+	REventLogQuery query = {0};
+	REventLogger *logger = NULL;
+
+	if (argc < 3) {
+		g_printerr("A logger name must be provided\n");
+		goto out;
+	}
+
+	if (argc > 3) {
+		g_printerr("Excess argument: %s\n", argv[3]);
+		goto out;
+	}
+
+	for (GList *l = r_context()->config->loggers; l != NULL; l = l->next) {
+		REventLogger *iter = l->data;
+
+		if (g_strcmp0(iter->name, argv[2]) == 0) {
+			logger = iter;
+			break;
+		}
+	}
+	if (!logger) {
+		g_printerr("No logger '%s' configured\n", argv[2]);
+		goto out;
+	}
+	if (!logger->index) {
+		g_printerr("Logger '%s' has no index enabled\n", argv[2]);
+		goto out;
+	}
+
+	query.type = event_log_type;
+	query.transaction_id = event_log_transaction;
+	query.boot_id = event_log_boot_id;
+	if (event_log_since && !parse_event_log_time(event_log_since, &query.since)) {
+		g_printerr("Invalid time for --since: %s\n", event_log_since);
+		goto out;
+	}
+	if (event_log_until && !parse_event_log_time(event_log_until, &query.until)) {
+		g_printerr("Invalid time for --until: %s\n", event_log_until);
+		goto out;
+	}
+
+	events = r_event_log_query(logger, &query, &ierror);
+	if (!events) {
+		g_printerr("Failed to query event log: %s\n", ierror->message);
+		goto out;
+	}
+
+	for (guint i = 0; i < events->len; i++)
+		g_print("%s\n", (const gchar *)g_ptr_array_index(events, i));
+
+	r_exit_status = 0;
+	return TRUE;
+
+out:
+	r_exit_status = 1;
+	return TRUE;
+}
+
 static gboolean unknown_start(int argc, char **argv)
 {
 	g_debug("unknown start");
@@ -2472,6 +2727,7 @@ static gboolean unknown_start(int argc, char **argv)
 typedef enum  {
 	UNKNOWN = 0,
 	INSTALL,
+	STAGE,
 	BUNDLE,
 	RESIGN,
 	REPLACE_SIG,
@@ -2484,6 +2740,7 @@ typedef enum  {
 	WRITE_SLOT,
 	SERVICE,
 	MOUNT,
+	EVENT_LOG,
 } RaucCommandType;
 
 typedef struct {
@@ -2502,6 +2759,7 @@ static GOptionEntry entries_install[] = {
 	{"ignore-version-limit", '\0', 0, G_OPTION_ARG_NONE, &install_ignore_version_limit, "disable version check", NULL},
 	{"transaction-id", '\0', 0, G_OPTION_ARG_STRING, &installation_txn, "custom transaction id", "UUID"},
 	{"require-manifest-hash", '\0', 0, G_OPTION_ARG_STRING, &require_manifest_hash, "require a specific manifest hash", "HASH"},
+	{"priority", '\0', 0, G_OPTION_ARG_STRING, &install_priority, "use the install priority from this [priority.<NAME>] section", "NAME"},
 #if ENABLE_SERVICE == 1
 	{"progress", '\0', 0, G_OPTION_ARG_NONE, &install_progressbar, "show progress bar", NULL},
 #else
@@ -2514,6 +2772,13 @@ static GOptionEntry entries_install[] = {
 static GOptionEntry entries_bundle[] = {
 	{"signing-keyring", '\0', 0, G_OPTION_ARG_FILENAME, &signing_keyring, "verification keyring file", "PEMFILE"},
 	{"mksquashfs-args", '\0', 0, G_OPTION_ARG_STRING, &mksquashfs_args, "mksquashfs extra args", "ARGS"},
+	{"mksquashfs-processors", '\0', 0, G_OPTION_ARG_INT, &mksquashfs_processors, "number of processors used by mksquashfs", "N"},
+	{"mksquashfs-block-size", '\0', 0, G_OPTION_ARG_STRING, &mksquashfs_block_size, "squashfs block size", "SIZE"},
+	{"mksquashfs-comp", '\0', 0, G_OPTION_ARG_STRING, &mksquashfs_comp, "squashfs compressor and optional compression level", "COMP[:LEVEL]"},
+	{"cache-dir", '\0', 0, G_OPTION_ARG_FILENAME, &bundle_cache_dir, "reuse adaptive data of unchanged images from this directory", "DIR"},
+	{"delta-base", '\0', 0, G_OPTION_ARG_FILENAME, &bundle_delta_base, "only include chunks missing from the images in this bundle", "BUNDLE"},
+	{"layout", '\0', 0, G_OPTION_ARG_STRING, &bundle_layout, "order of the payload contents (default or streaming)", "LAYOUT"},
+	{"batch", '\0', 0, G_OPTION_ARG_FILENAME, &bundle_batch, "create all bundles described in this batch file", "BATCHFILE"},
 	{0}
 };
 
@@ -2536,6 +2801,9 @@ static GOptionEntry entries_convert[] = {
 	{"no-verify", '\0', 0, G_OPTION_ARG_NONE, &verification_disabled, "disable bundle verification", NULL},
 	{"signing-keyring", '\0', 0, G_OPTION_ARG_FILENAME, &signing_keyring, "verification keyring file", "PEMFILE"},
 	{"mksquashfs-args", '\0', 0, G_OPTION_ARG_STRING, &mksquashfs_args, "mksquashfs extra args", "ARGS"},
+	{"mksquashfs-processors", '\0', 0, G_OPTION_ARG_INT, &mksquashfs_processors, "number of processors used by mksquashfs", "N"},
+	{"mksquashfs-block-size", '\0', 0, G_OPTION_ARG_STRING, &mksquashfs_block_size, "squashfs block size", "SIZE"},
+	{"mksquashfs-comp", '\0', 0, G_OPTION_ARG_STRING, &mksquashfs_comp, "squashfs compressor and optional compression level", "COMP[:LEVEL]"},
 	{"casync-args", '\0', 0, G_OPTION_ARG_STRING, &casync_args, "casync extra args", "ARGS"},
 	{"ignore-image", '\0', 0, G_OPTION_ARG_STRING_ARRAY, &convert_ignore_images, "ignore image during conversion", "SLOTCLASS"},
 	{0}
@@ -2572,6 +2840,15 @@ static GOptionEntry entries_status[] = {
 	{0}
 };
 
+static GOptionEntry entries_event_log[] = {
+	{"type", '\0', 0, G_OPTION_ARG_STRING, &event_log_type, "only show events of this type", "TYPE"},
+	{"transaction-id", '\0', 0, G_OPTION_ARG_STRING, &event_log_transaction, "only show events of this transaction", "UUID"},
+	{"boot-id", '\0', 0, G_OPTION_ARG_STRING, &event_log_boot_id, "only show events of this boot", "UUID"},
+	{"since", '\0', 0, G_OPTION_ARG_STRING, &event_log_since, "only show events logged at or after this time", "ISO8601"},
+	{"until", '\0', 0, G_OPTION_ARG_STRING, &event_log_until, "only show events logged at or before this time", "ISO8601"},
+	{0}
+};
+
 static GOptionEntry entries_service[] = {
 	{"handler-args", '\0', 0, G_OPTION_ARG_STRING, &handler_args, "extra arguments for full custom handler", "ARGS"},
 	{"override-boot-slot", '\0', 0, G_OPTION_ARG_STRING, &bootslot, "override auto-detection of booted slot", "BOOTNAME"},
@@ -2591,6 +2868,7 @@ static GOptionEntry entries_bundle_access[] = {
 	{"tls-ca", '\0', 0, G_OPTION_ARG_FILENAME, &access_args.tls_ca, "TLS CA file", "PEMFILE"},
 	{"tls-no-verify", '\0', 0, G_OPTION_ARG_NONE, &access_args.tls_no_verify, "do not verify TLS server certificate", NULL},
 	{"http-header", 'H', 0, G_OPTION_ARG_STRING_ARRAY, &access_args.http_headers, "HTTP request header (multiple uses supported)", "'HEADER: VALUE'"},
+	{"mirror", '\0', 0, G_OPTION_ARG_STRING_ARRAY, &access_args.mirrors, "additional URL of the same bundle (multiple uses supported)", "URL"},
 	{0}
 };
 
@@ -2600,6 +2878,7 @@ static GOptionEntry entries_encryption[] = {
 };
 
 static GOptionGroup *install_group;
+static GOptionGroup *stage_group;
 static GOptionGroup *bundle_group;
 static GOptionGroup *resign_group;
 static GOptionGroup *replace_group;
@@ -2610,6 +2889,7 @@ static GOptionGroup *extract_group;
 static GOptionGroup *info_group;
 static GOptionGroup *status_group;
 static GOptionGroup *service_group;
+static GOptionGroup *event_log_group;
 
 static void create_option_groups(void)
 {
@@ -2618,6 +2898,10 @@ static void create_option_groups(void)
 	if (ENABLE_STREAMING)
 		g_option_group_add_entries(install_group, entries_bundle_access);
 
+	stage_group = g_option_group_new("stage", "Stage options:", "help dummy", NULL, NULL);
+	if (ENABLE_STREAMING)
+		g_option_group_add_entries(stage_group, entries_bundle_access);
+
 	if (ENABLE_CREATE) {
 		bundle_group = g_option_group_new("bundle", "Bundle options:", "help dummy", NULL, NULL);
 		g_option_group_add_entries(bundle_group, entries_bundle);
@@ -2654,6 +2938,9 @@ static void create_option_groups(void)
 
 	service_group = g_option_group_new("service", "Service options:", "help dummy", NULL, NULL);
 	g_option_group_add_entries(service_group, entries_service);
+
+	event_log_group = g_option_group_new("event-log", "Event log options:", "help dummy", NULL, NULL);
+	g_option_group_add_entries(event_log_group, entries_event_log);
 }
 
 // Callback function to handle the repeated -C option
@@ -2684,11 +2971,15 @@ static gboolean collect_config_values(const gchar *option_name, const gchar *val
 	return TRUE;
 }
 
+/* monotonic time at process start, for the startup breakdown in debug mode */
+static gint64 startup_time = 0;
+
 static void cmdline_handler(int argc, char **argv)
 {
 	gboolean help = FALSE, debug = FALSE, version = FALSE;
 	g_autofree gchar *confpath = NULL, *keyring = NULL, *mount = NULL;
 	char *cmdarg = NULL;
+	gint64 config_time = 0;
 	g_autoptr(GOptionContext) context = NULL;
 	GOptionEntry entries[] = {
 		{"conf", 'c', 0, G_OPTION_ARG_FILENAME, &confpath, "config file", "FILENAME"},
@@ -2715,8 +3006,11 @@ static void cmdline_handler(int argc, char **argv)
 		{INSTALL, "install", "install <BUNDLE>",
 		 "Install a bundle",
 		 install_start, install_group, R_CONTEXT_CONFIG_MODE_REQUIRED, FALSE},
+		{STAGE, "stage", "stage <BUNDLE>",
+		 "Download and verify a bundle for a later installation",
+		 stage_start, stage_group, R_CONTEXT_CONFIG_MODE_REQUIRED, FALSE},
 #if ENABLE_CREATE == 1
-		{BUNDLE, "bundle", "bundle <INPUTDIR> <BUNDLENAME>",
+		{BUNDLE, "bundle", "bundle <INPUTDIR> <BUNDLENAME> | bundle --batch=<BATCHFILE>",
 		 "Create a bundle from a content directory",
 		 bundle_start, bundle_group, R_CONTEXT_CONFIG_MODE_NONE, FALSE},
 		{RESIGN, "resign", "resign <INBUNDLE> <OUTBUNDLE>",
@@ -2759,6 +3053,9 @@ static void cmdline_handler(int argc, char **argv)
 		{MOUNT, "mount", "mount <BUNDLENAME>",
 		 "Mount a bundle (for development purposes)",
 		 mount_start, NULL, R_CONTEXT_CONFIG_MODE_REQUIRED, TRUE},
+		{EVENT_LOG, "event-log", "event-log <LOGGER>",
+		 "Show events from an indexed event logger",
+		 event_log_start, event_log_group, R_CONTEXT_CONFIG_MODE_REQUIRED, TRUE},
 		{0}
 	};
 	RaucCommand *rc;
@@ -2789,9 +3086,11 @@ static void cmdline_handler(int argc, char **argv)
 			"  service                 Start RAUC service\n"
 #endif
 			"  install                 Install a bundle\n"
+			"  stage                   Download a bundle for a later installation\n"
 			"  status                  Show status\n"
 			"  mount                   Mount a bundle\n"
 			"  write-slot              Write image to slot and bypass all update logic\n"
+			"  event-log               Show events from an indexed event logger\n"
 			"\n"
 			"Environment variables:\n"
 			"  RAUC_KEY_PASSPHRASE     Passphrase to use for accessing key files (signing only)\n"
@@ -2895,6 +3194,7 @@ static void cmdline_handler(int argc, char **argv)
 		if (ENABLE_SERVICE) {
 			/* these commands are handled by the service and need no client config */
 			if (rcommand->type == INSTALL ||
+			    rcommand->type == STAGE ||
 			    rcommand->type == STATUS)
 				r_context_conf()->configmode = R_CONTEXT_CONFIG_MODE_NONE;
 		}
@@ -2916,6 +3216,18 @@ static void cmdline_handler(int argc, char **argv)
 			r_context_conf()->signing_keyringpath = signing_keyring;
 		if (mksquashfs_args)
 			r_context_conf()->mksquashfs_args = mksquashfs_args;
+		if (mksquashfs_processors)
+			r_context_conf()->mksquashfs_processors = mksquashfs_processors;
+		if (mksquashfs_block_size)
+			r_context_conf()->mksquashfs_block_size = mksquashfs_block_size;
+		if (mksquashfs_comp)
+			r_context_conf()->mksquashfs_comp = mksquashfs_comp;
+		if (bundle_cache_dir)
+			r_context_conf()->bundle_cache_dir = bundle_cache_dir;
+		if (bundle_delta_base)
+			r_context_conf()->bundle_delta_base = bundle_delta_base;
+		if (bundle_layout)
+			r_context_conf()->bundle_layout = bundle_layout;
 		if (casync_args)
 			r_context_conf()->casync_args = casync_args;
 		if (recipients)
@@ -2944,6 +3256,7 @@ static void cmdline_handler(int argc, char **argv)
 		return;
 	}
 
+	config_time = g_get_monotonic_time();
 	if (!r_context_configure(&error)) {
 		g_printerr("Failed to initialize context: %s\n", error->message);
 		g_clear_error(&error);
@@ -2951,6 +3264,11 @@ static void cmdline_handler(int argc, char **argv)
 		return;
 	}
 
+	g_debug("Startup took %.1f ms (%.1f ms for option parsing, %.1f ms for context setup)",
+			(g_get_monotonic_time() - startup_time) / 1000.0,
+			(config_time - startup_time) / 1000.0,
+			(g_get_monotonic_time() - config_time) / 1000.0);
+
 	/* real commands are handled here */
 	if (rcommand->cmd_handler) {
 		rcommand->cmd_handler(argc, argv);
@@ -2966,6 +3284,8 @@ int main(int argc, char **argv)
 {
 	GLogLevelFlags fatal_mask;
 
+	startup_time = g_get_monotonic_time();
+
 #if GLIB_CHECK_VERSION(2, 68, 0)
 	/* To use this function, without bumping the maximum GLib allowed version,
 	 * we temporarily disable the deprecation warnings */
@@ -2991,8 +3311,10 @@ int main(int argc, char **argv)
 
 	if (ENABLE_STREAMING && g_getenv("RAUC_NBD_SERVER")) {
 		g_autoptr(GError) ierror = NULL;
+		/* the value is the number of sockets passed starting at RAUC_SOCKET_FD */
+		guint connections = MAX(1, g_ascii_strtoull(g_getenv("RAUC_NBD_SERVER"), NULL, 10));
 		pthread_setname_np(pthread_self(), "rauc-nbd");
-		if (r_nbd_run_server(RAUC_SOCKET_FD, &ierror)) {
+		if (r_nbd_run_server(RAUC_SOCKET_FD, connections, &ierror)) {
 			return 0;
 		} else {
 			if (ierror) {
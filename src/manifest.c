@@ -105,6 +105,14 @@ static gboolean parse_image(GKeyFile *key_file, const gchar *group, RaucImage **
 	iimage->adaptive = g_key_file_get_string_list(key_file, group, "adaptive", NULL, NULL);
 	g_key_file_remove_key(key_file, group, "adaptive", NULL);
 
+	iimage->delta_base = key_file_consume_string(key_file, group, "delta-base", NULL);
+	if (iimage->delta_base &&
+	    !(iimage->adaptive && g_strv_contains((const gchar * const *)iimage->adaptive, "block-hash-index"))) {
+		g_set_error(error, R_MANIFEST_ERROR, R_MANIFEST_CHECK_ERROR,
+				"Image with 'delta-base' requires the adaptive method 'block-hash-index' in group '[%s]'", group);
+		goto out;
+	}
+
 	iimage->convert = g_key_file_get_string_list(key_file, group, "convert", NULL, NULL);
 	g_key_file_remove_key(key_file, group, "convert", NULL);
 
@@ -929,6 +937,9 @@ static GKeyFile *prepare_manifest(const RaucManifest *mf)
 			g_key_file_set_string_list(key_file, group, "adaptive",
 					(const gchar * const *)image->adaptive, g_strv_length(image->adaptive));
 
+		if (image->delta_base)
+			g_key_file_set_string(key_file, group, "delta-base", image->delta_base);
+
 		if (image->convert)
 			g_key_file_set_string_list(key_file, group, "convert",
 					(const gchar * const *)image->convert, g_strv_length(image->convert));
@@ -1086,6 +1097,9 @@ GVariant* r_manifest_to_dict(const RaucManifest *manifest)
 		if (img->adaptive)
 			g_variant_builder_add(&builder, "{sv}", "adaptive", g_variant_new_strv((const gchar * const*)(img->adaptive), -1));
 
+		if (img->delta_base)
+			g_variant_builder_add(&builder, "{sv}", "delta-base", g_variant_new_string(img->delta_base));
+
 		if (img->convert)
 			g_variant_builder_add(&builder, "{sv}", "convert", g_variant_new_strv((const gchar * const*)(img->convert), -1));
 		if (img->converted)
@@ -1172,8 +1186,10 @@ void r_free_image(gpointer data)
 	g_free(image->checksum.digest);
 	g_free(image->filename);
 	g_strfreev(image->adaptive);
+	g_free(image->delta_base);
 	g_strfreev(image->convert);
 	g_clear_pointer(&image->converted, g_ptr_array_unref);
+	g_clear_pointer(&image->chunk_hashes, g_bytes_unref);
 	g_free(image);
 }
 
@@ -1200,10 +1216,42 @@ void free_manifest(RaucManifest *manifest)
 	g_free(manifest);
 }
 
+/* maximum number of images checksummed concurrently */
+#define UPDATE_CHECKSUMS_MAX_THREADS 8
+
+typedef struct {
+	RaucImage *image;
+	gchar *filename;
+	gboolean res;
+	GError *error;
+} ChecksumJob;
+
+/**
+ * Thread pool worker updating the checksum of a single image.
+ *
+ * Each job only modifies its own image, so no locking is needed.
+ */
+static void update_checksum_worker(gpointer data, gpointer user_data)
+{
+	ChecksumJob *job = data;
+	RaucImage *image = job->image;
+
+	/* calculate the hashes for the block-hash-index in the same pass */
+	if (image->adaptive && g_strv_contains((const gchar * const *)image->adaptive, "block-hash-index")) {
+		g_clear_pointer(&image->chunk_hashes, g_bytes_unref);
+		job->res = compute_checksum_with_chunk_hashes(&image->checksum, job->filename, &image->chunk_hashes, &job->error);
+	} else {
+		job->res = compute_checksum(&image->checksum, job->filename, &job->error);
+	}
+}
+
 /**
  * Updates checksums for images listed in the manifest and found in
  * the bundle directory.
  *
+ * The images are checksummed concurrently by a bounded thread pool. Errors
+ * are reported in manifest order afterwards.
+ *
  * @param manifest pointer to the manifest
  * @param dir Directory with the bundle content
  * @param error return location for a GError, or NULL
@@ -1213,16 +1261,19 @@ void free_manifest(RaucManifest *manifest)
 static gboolean update_manifest_checksums(RaucManifest *manifest, const gchar *dir, GError **error)
 {
 	GError *ierror = NULL;
-	gboolean res = TRUE;
+	g_autofree ChecksumJob *jobs = NULL;
+	GThreadPool *pool = NULL;
+	guint n_jobs = 0;
+	guint n_threads;
 	gboolean had_errors = FALSE;
 
 	g_return_val_if_fail(manifest, FALSE);
 	g_return_val_if_fail(dir, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
+	jobs = g_new0(ChecksumJob, g_list_length(manifest->images));
 	for (GList *elem = manifest->images; elem != NULL; elem = elem->next) {
 		RaucImage *image = elem->data;
-		g_autofree gchar *filename = NULL;
 
 		/* If no filename is set (valid for 'install' hook) explicitly set size to -1 */
 		if (!image->filename) {
@@ -1230,22 +1281,51 @@ static gboolean update_manifest_checksums(RaucManifest *manifest, const gchar *d
 			continue;
 		}
 
-		filename = g_build_filename(dir, image->filename, NULL);
-		res = compute_checksum(&image->checksum, filename, &ierror);
-		if (!res) {
-			g_warning("Failed updating checksum: %s", ierror->message);
+		jobs[n_jobs].image = image;
+		jobs[n_jobs].filename = g_build_filename(dir, image->filename, NULL);
+		n_jobs++;
+	}
+
+	if (!n_jobs)
+		return TRUE;
+
+	n_threads = MIN(CLAMP(g_get_num_processors(), 1, UPDATE_CHECKSUMS_MAX_THREADS), n_jobs);
+	pool = g_thread_pool_new(update_checksum_worker, NULL, n_threads, FALSE, &ierror);
+	if (!pool) {
+		g_propagate_prefixed_error(error, ierror, "Failed to create checksum thread pool: ");
+		had_errors = TRUE;
+		goto out;
+	}
+
+	for (guint i = 0; i < n_jobs; i++) {
+		if (!g_thread_pool_push(pool, &jobs[i], &ierror)) {
+			/* fall back to checksumming in this thread */
+			g_debug("Failed to queue checksum job: %s", ierror->message);
 			g_clear_error(&ierror);
+			update_checksum_worker(&jobs[i], NULL);
+		}
+	}
+
+	/* wait for all queued jobs to finish */
+	g_thread_pool_free(pool, FALSE, TRUE);
+
+	for (guint i = 0; i < n_jobs; i++) {
+		if (!jobs[i].res) {
+			g_warning("Failed updating checksum: %s", jobs[i].error->message);
 			had_errors = TRUE;
-			break;
 		}
 	}
 
-	if (had_errors) {
-		res = FALSE;
+	if (had_errors)
 		g_set_error(error, R_MANIFEST_ERROR, R_MANIFEST_ERROR_CHECKSUM, "Failed updating all checksums");
+
+out:
+	for (guint i = 0; i < n_jobs; i++) {
+		g_free(jobs[i].filename);
+		g_clear_error(&jobs[i].error);
 	}
 
-	return res;
+	return !had_errors;
 }
 
 gboolean sync_manifest_with_contentdir(RaucManifest *manifest, const gchar *dir, GError **error)
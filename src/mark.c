@@ -129,25 +129,17 @@ static void r_event_log_mark_bad(RaucSlot *slot)
 			);
 }
 
-gboolean r_mark_active(RaucSlot *slot, GError **error)
+/* Records the activation of a slot in the event log and the slot status,
+ * after the bootloader was changed. */
+static void record_mark_active(RaucSlot *slot)
 {
 	RaucSlotStatus *slot_state;
 	GError *ierror = NULL;
 	g_autoptr(GDateTime) now = NULL;
 
-	g_return_val_if_fail(slot, FALSE);
-	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
-
 	r_slot_status_load(slot);
 	slot_state = slot->status;
 
-	if (!r_boot_set_primary(slot, &ierror)) {
-		g_set_error(error, R_INSTALL_ERROR, R_INSTALL_ERROR_MARK_BOOTABLE,
-				"failed to activate slot %s: %s", slot->name, ierror->message);
-		g_error_free(ierror);
-		return FALSE;
-	}
-
 	r_event_log_mark_active(slot);
 
 	g_free(slot_state->activated_timestamp);
@@ -159,17 +151,26 @@ gboolean r_mark_active(RaucSlot *slot, GError **error)
 		g_message("Error while writing status file: %s", ierror->message);
 		g_error_free(ierror);
 	}
+}
+
+static gboolean boot_mark_active(RaucSlot *slot, GError **error)
+{
+	GError *ierror = NULL;
+
+	if (!r_boot_set_primary(slot, &ierror)) {
+		g_set_error(error, R_INSTALL_ERROR, R_INSTALL_ERROR_MARK_BOOTABLE,
+				"failed to activate slot %s: %s", slot->name, ierror->message);
+		g_error_free(ierror);
+		return FALSE;
+	}
 
 	return TRUE;
 }
 
-gboolean r_mark_good(RaucSlot *slot, GError **error)
+static gboolean boot_mark_good(RaucSlot *slot, GError **error)
 {
 	GError *ierror = NULL;
 
-	g_return_val_if_fail(slot, FALSE);
-	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
-
 	if (!r_boot_set_state(slot, TRUE, &ierror)) {
 		g_set_error(error, R_INSTALL_ERROR, R_INSTALL_ERROR_MARK_BOOTABLE,
 				"Failed marking slot %s as good:  %s", slot->name, ierror->message);
@@ -177,18 +178,13 @@ gboolean r_mark_good(RaucSlot *slot, GError **error)
 		return FALSE;
 	}
 
-	r_event_log_mark_good(slot);
-
 	return TRUE;
 }
 
-gboolean r_mark_bad(RaucSlot *slot, GError **error)
+static gboolean boot_mark_bad(RaucSlot *slot, GError **error)
 {
 	GError *ierror = NULL;
 
-	g_return_val_if_fail(slot, FALSE);
-	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
-
 	if (!r_boot_set_state(slot, FALSE, &ierror)) {
 		g_set_error(error, R_INSTALL_ERROR, R_INSTALL_ERROR_MARK_BOOTABLE,
 				"Failed marking slot %s as bad:  %s", slot->name, ierror->message);
@@ -196,13 +192,71 @@ gboolean r_mark_bad(RaucSlot *slot, GError **error)
 		return FALSE;
 	}
 
+	return TRUE;
+}
+
+gboolean r_mark_active(RaucSlot *slot, GError **error)
+{
+	g_return_val_if_fail(slot, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (!boot_mark_active(slot, error))
+		return FALSE;
+
+	record_mark_active(slot);
+
+	return TRUE;
+}
+
+gboolean r_mark_good(RaucSlot *slot, GError **error)
+{
+	g_return_val_if_fail(slot, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (!boot_mark_good(slot, error))
+		return FALSE;
+
+	r_event_log_mark_good(slot);
+
+	return TRUE;
+}
+
+gboolean r_mark_bad(RaucSlot *slot, GError **error)
+{
+	g_return_val_if_fail(slot, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (!boot_mark_bad(slot, error))
+		return FALSE;
+
 	r_event_log_mark_bad(slot);
 
 	return TRUE;
 }
 
-gboolean mark_run(const gchar *state,
+typedef enum {
+	MARKED_ACTIVE,
+	MARKED_GOOD,
+	MARKED_BAD,
+} MarkedState;
+
+typedef struct {
+	RaucSlot *slot;
+	MarkedState state;
+} MarkedSlot;
+
+static void add_marked_slot(GArray *marked, RaucSlot *slot, MarkedState state)
+{
+	MarkedSlot entry = {slot, state};
+
+	g_array_append_val(marked, entry);
+}
+
+/* Only changes the bootloader state, the slots are recorded in 'marked' to
+ * update their status after the changes were committed. */
+static gboolean mark_slots(const gchar *state,
 		const gchar *slot_identifier,
+		GArray *marked,
 		gchar **slot_name,
 		gchar **message)
 {
@@ -225,16 +279,17 @@ gboolean mark_run(const gchar *state,
 		}
 		RaucSlot *slot = (RaucSlot*)g_list_first(slots)->data;
 
-		if (!r_mark_good(slot, &ierror)) {
+		if (!boot_mark_good(slot, &ierror)) {
 			*message = g_strdup(ierror->message);
 			return FALSE;
 		}
+		add_marked_slot(marked, slot, MARKED_GOOD);
 
 		if (r_context()->config->prevent_late_fallback
 		    && g_strcmp0(slot_identifier, "booted") == 0) {
 			g_autofree gchar *mark_bad_message = NULL;
 
-			if (!mark_run("bad", "other", NULL, &mark_bad_message)) {
+			if (!mark_slots("bad", "other", marked, NULL, &mark_bad_message)) {
 				*message = g_strdup(mark_bad_message);
 				return FALSE;
 			}
@@ -242,10 +297,11 @@ gboolean mark_run(const gchar *state,
 	} else if (g_strcmp0(state, "bad") == 0) {
 		for (GList *l = slots; l != NULL; l = l->next) {
 			RaucSlot *slot = l->data;
-			if (!r_mark_bad(slot, &ierror)) {
+			if (!boot_mark_bad(slot, &ierror)) {
 				*message = g_strdup(ierror->message);
 				return FALSE;
 			}
+			add_marked_slot(marked, slot, MARKED_BAD);
 		}
 	} else if (g_strcmp0(state, "active") == 0) {
 		if (g_list_length(slots) > 1) {
@@ -254,10 +310,11 @@ gboolean mark_run(const gchar *state,
 		}
 		RaucSlot *slot = (RaucSlot*)g_list_first(slots)->data;
 
-		if (!r_mark_active(slot, &ierror)) {
+		if (!boot_mark_active(slot, &ierror)) {
 			*message = g_strdup(ierror->message);
 			return FALSE;
 		}
+		add_marked_slot(marked, slot, MARKED_ACTIVE);
 	} else {
 		*message = g_strdup_printf("unknown subcommand %s", state);
 		return FALSE;
@@ -279,3 +336,49 @@ gboolean mark_run(const gchar *state,
 
 	return TRUE;
 }
+
+gboolean mark_run(const gchar *state,
+		const gchar *slot_identifier,
+		gchar **slot_name,
+		gchar **message)
+{
+	g_autoptr(GError) ierror = NULL;
+	g_autoptr(GArray) marked = g_array_new(FALSE, FALSE, sizeof(MarkedSlot));
+
+	g_assert(message != NULL && *message == NULL);
+
+	/* apply all bootloader changes of this operation at once */
+	r_boot_begin();
+
+	if (!mark_slots(state, slot_identifier, marked, slot_name, message)) {
+		r_boot_abort();
+		return FALSE;
+	}
+
+	/* the slot status and event log must not claim unapplied changes */
+	if (!r_boot_commit(&ierror)) {
+		g_free(*message);
+		*message = g_strdup(ierror->message);
+		if (slot_name)
+			g_clear_pointer(slot_name, g_free);
+		return FALSE;
+	}
+
+	for (guint i = 0; i < marked->len; i++) {
+		const MarkedSlot *entry = &g_array_index(marked, MarkedSlot, i);
+
+		switch (entry->state) {
+			case MARKED_ACTIVE:
+				record_mark_active(entry->slot);
+				break;
+			case MARKED_GOOD:
+				r_event_log_mark_good(entry->slot);
+				break;
+			case MARKED_BAD:
+				r_event_log_mark_bad(entry->slot);
+				break;
+		}
+	}
+
+	return TRUE;
+}
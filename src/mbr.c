@@ -1,6 +1,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <glib/gstdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <sys/mount.h>
@@ -129,7 +130,7 @@ static gboolean read_mbr(gint fd, struct mbr *mbr, GError **error)
 	g_return_val_if_fail(mbr, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
-	if (read(fd, mbr, sizeof(*mbr)) != sizeof(*mbr)) {
+	if (pread(fd, mbr, sizeof(*mbr), 0) != sizeof(*mbr)) {
 		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED,
 				"Read: %s", g_strerror(errno));
 		return FALSE;
@@ -220,21 +221,17 @@ static void get_chs(struct mbr_chs_entry *chs, guint32 lba,
 	chs->sector |= (lba >> 2) & 0xC0;
 }
 
-static gboolean get_raw_partition_entry(gint fd,
+static gboolean get_raw_partition_entry(guint sector_size, guint8 heads, guint8 sectors,
 		struct mbr_tbl_entry *raw_entry,
 		const struct boot_switch_partition *partition, GError **error)
 {
 	gboolean res = FALSE;
 	guint32 start, size;
-	guint sector_size;
-	guint8 heads, sectors;
 
 	g_return_val_if_fail(raw_entry, FALSE);
 	g_return_val_if_fail(partition, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
-	sector_size = get_sectorsize(fd);
-
 	if (partition->start % sector_size || partition->size % sector_size) {
 		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED,
 				"Partition start address or size is not a multiple"
@@ -248,8 +245,6 @@ static gboolean get_raw_partition_entry(gint fd,
 	raw_entry->partition_start_le = GUINT32_TO_LE(start);
 	raw_entry->partition_size_le = GUINT32_TO_LE(size);
 
-	get_hd_geometry(fd, &heads, &sectors);
-
 	get_chs(&raw_entry->chs_start, start, heads, sectors);
 
 	get_chs(&raw_entry->chs_end, start + size - 1, heads, sectors);
@@ -259,136 +254,145 @@ out:
 	return res;
 }
 
-gboolean r_mbr_switch_get_inactive_partition(const gchar *device,
-		struct boot_switch_partition *partition,
+struct _RMbrSwitch {
+	gchar *device;
+	gint fd;
+	/* MBR as read by r_mbr_switch_open() */
+	struct mbr mbr;
+	guint sector_size;
+	guint8 heads;
+	guint8 sectors;
+	struct boot_switch_partition inactive;
+};
+
+RMbrSwitch *r_mbr_switch_open(const gchar *device,
 		guint64 region_start, guint64 region_size,
 		GError **error)
 {
-	gboolean res = FALSE;
-	struct mbr mbr;
+	g_autoptr(RMbrSwitch) sw = NULL;
 	GError *ierror = NULL;
 	struct mbr_tbl_entry *boot_part;
-	guint sector_size;
-	gint fd;
 
-	g_return_val_if_fail(device, FALSE);
-	g_return_val_if_fail(partition, FALSE);
-	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+	g_return_val_if_fail(device, NULL);
+	g_return_val_if_fail(error == NULL || *error == NULL, NULL);
 
-	fd = g_open(device, O_RDONLY);
+	sw = g_new0(RMbrSwitch, 1);
+	sw->device = g_strdup(device);
+	sw->fd = g_open(device, O_RDWR | O_CLOEXEC, 0);
+	if (sw->fd == -1) {
+		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED,
+				"Opening device failed: %s",
+				g_strerror(errno));
+		return NULL;
+	}
 
-	sector_size = get_sectorsize(fd);
+	sw->sector_size = get_sectorsize(sw->fd);
 
-	res = validate_region(fd, region_start, region_size, sector_size, &ierror);
-	if (!res) {
+	if (!validate_region(sw->fd, region_start, region_size, sw->sector_size, &ierror)) {
 		g_propagate_error(error, ierror);
-		goto out;
+		return NULL;
 	}
 
-	res = read_mbr(fd, &mbr, &ierror);
-	if (!res) {
+	if (!read_mbr(sw->fd, &sw->mbr, &ierror)) {
 		g_propagate_prefixed_error(error, ierror,
 				"Failed to read MBR:");
-		goto out;
+		return NULL;
 	}
 
 	/* check if region overlaps with any partition */
-	res = is_region_free(region_start, region_size, mbr.partition_table,
-			sector_size, &ierror);
-	if (!res) {
+	if (!is_region_free(region_start, region_size, sw->mbr.partition_table,
+			sw->sector_size, &ierror)) {
 		g_propagate_error(error, ierror);
-		goto out;
+		return NULL;
 	}
-	res = FALSE;
 
-	boot_part = &mbr.partition_table[BOOT_PARTITION_ENTRY];
+	boot_part = &sw->mbr.partition_table[BOOT_PARTITION_ENTRY];
 
 	if (GUINT32_FROM_LE(boot_part->partition_start_le) == 0) {
 		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED,
 				"No boot partition found in entry %d",
 				BOOT_PARTITION_ENTRY);
-		goto out;
+		return NULL;
 	}
 
-	if ((region_start / sector_size) ==
+	if ((region_start / sw->sector_size) ==
 	    (guint64)GUINT32_FROM_LE(boot_part->partition_start_le)) {
-		partition->start = region_start + region_size / 2;
-	} else if (((region_start + region_size / 2) / sector_size) ==
+		sw->inactive.start = region_start + region_size / 2;
+	} else if (((region_start + region_size / 2) / sw->sector_size) ==
 	           (guint64)GUINT32_FROM_LE(boot_part->partition_start_le)) {
-		partition->start = region_start;
+		sw->inactive.start = region_start;
 	} else {
 		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED,
 				"Boot partition's start address does not match "
 				"region configuration");
-		goto out;
+		return NULL;
 	}
-	partition->size = region_size / 2;
+	sw->inactive.size = region_size / 2;
 
-	res = TRUE;
-out:
-	if (fd >= 0)
-		g_close(fd, NULL);
+	get_hd_geometry(sw->fd, &sw->heads, &sw->sectors);
 
-	return res;
+	return g_steal_pointer(&sw);
 }
 
-gboolean r_mbr_switch_set_boot_partition(const gchar *device,
-		const struct boot_switch_partition *partition,
-		GError **error)
+const struct boot_switch_partition *r_mbr_switch_get_inactive(const RMbrSwitch *sw)
+{
+	g_return_val_if_fail(sw, NULL);
+
+	return &sw->inactive;
+}
+
+gboolean r_mbr_switch_activate(RMbrSwitch *sw, GError **error)
 {
-	gboolean res = FALSE;
 	struct mbr mbr;
-	struct mbr_tbl_entry *boot_part;
 	GError *ierror = NULL;
-	gint fd;
 
-	g_return_val_if_fail(device, FALSE);
-	g_return_val_if_fail(partition, FALSE);
+	g_return_val_if_fail(sw, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
-	fd = g_open(device, O_RDWR);
-	if (fd == -1) {
-		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED,
-				"Opening device failed: %s",
-				g_strerror(errno));
-		goto out;
-	}
-
-	res = read_mbr(fd, &mbr, &ierror);
-	if (!res) {
+	/* the cached MBR must not have been changed (e.g. by a hook) */
+	if (!read_mbr(sw->fd, &mbr, &ierror)) {
 		g_propagate_prefixed_error(error, ierror,
 				"Failed to read MBR:");
-		goto out;
+		return FALSE;
+	}
+	if (memcmp(&mbr, &sw->mbr, sizeof(mbr)) != 0) {
+		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED,
+				"MBR on %s was changed during the update", sw->device);
+		return FALSE;
 	}
 
-	boot_part = &mbr.partition_table[BOOT_PARTITION_ENTRY];
-
-	res = get_raw_partition_entry(fd, boot_part, partition, &ierror);
-	if (!res) {
+	if (!get_raw_partition_entry(sw->sector_size, sw->heads, sw->sectors,
+			&mbr.partition_table[BOOT_PARTITION_ENTRY], &sw->inactive, &ierror)) {
 		g_propagate_prefixed_error(error, ierror,
 				"Failed to create new partition entry:");
-		goto out;
+		return FALSE;
 	}
 
-	if (lseek(fd, 0, SEEK_SET) != 0) {
-		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED,
-				"Failed to seek to position 0");
-		res = FALSE;
-		goto out;
+	if (!r_pwrite_exact(sw->fd, (const guint8 *)&mbr, sizeof(mbr), 0, &ierror)) {
+		g_propagate_prefixed_error(error, ierror,
+				"Could not write new MBR: ");
+		return FALSE;
 	}
 
-	if (write(fd, &mbr, sizeof(mbr)) != sizeof(mbr)) {
+	if (fsync(sw->fd) == -1) {
 		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED,
-				"Could not write new MBR: %s",
+				"Syncing new MBR failed: %s",
 				g_strerror(errno));
-		res = FALSE;
-		goto out;
+		return FALSE;
 	}
 
-	res = TRUE;
-out:
-	if (fd >= 0)
-		g_close(fd, NULL);
+	sw->mbr = mbr;
 
-	return res;
+	return TRUE;
+}
+
+void r_mbr_switch_free(RMbrSwitch *sw)
+{
+	if (!sw)
+		return;
+
+	if (sw->fd >= 0)
+		g_close(sw->fd, NULL);
+	g_free(sw->device);
+	g_free(sw);
 }
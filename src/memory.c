@@ -0,0 +1,108 @@
+#include <fcntl.h>
+#include <glib/gstdio.h>
+#include <string.h>
+
+#include "memory.h"
+#include "utils.h"
+
+/* protects all budget counters */
+static GMutex memory_lock;
+static guint64 memory_limit = 0;
+static guint64 memory_reserved = 0;
+static guint64 memory_peak = 0;
+
+void r_memory_set_limit(guint64 limit)
+{
+	g_mutex_lock(&memory_lock);
+	memory_limit = limit;
+	g_mutex_unlock(&memory_lock);
+}
+
+guint64 r_memory_get_limit(void)
+{
+	guint64 limit;
+
+	g_mutex_lock(&memory_lock);
+	limit = memory_limit;
+	g_mutex_unlock(&memory_lock);
+
+	return limit;
+}
+
+gboolean r_memory_reserve(guint64 size, const gchar *what)
+{
+	gboolean res = TRUE;
+	guint64 reserved;
+
+	g_return_val_if_fail(what, FALSE);
+
+	g_mutex_lock(&memory_lock);
+	reserved = memory_reserved;
+	if (memory_limit && (size > memory_limit || memory_reserved > memory_limit - size)) {
+		res = FALSE;
+	} else {
+		memory_reserved += size;
+		memory_peak = MAX(memory_peak, memory_reserved);
+	}
+	g_mutex_unlock(&memory_lock);
+
+	if (!res) {
+		g_autofree gchar *size_str = g_format_size_full(size, G_FORMAT_SIZE_IEC_UNITS);
+		g_autofree gchar *reserved_str = g_format_size_full(reserved, G_FORMAT_SIZE_IEC_UNITS);
+		g_message("Memory limit reached for %s (%s requested, %s already reserved)", what, size_str, reserved_str);
+	}
+
+	return res;
+}
+
+void r_memory_release(guint64 size)
+{
+	g_mutex_lock(&memory_lock);
+	g_warn_if_fail(size <= memory_reserved);
+	memory_reserved -= MIN(size, memory_reserved);
+	g_mutex_unlock(&memory_lock);
+}
+
+guint64 r_memory_get_reserved_peak(gboolean reset)
+{
+	guint64 peak;
+
+	g_mutex_lock(&memory_lock);
+	peak = memory_peak;
+	if (reset)
+		memory_peak = memory_reserved;
+	g_mutex_unlock(&memory_lock);
+
+	return peak;
+}
+
+void r_memory_reset_peak(void)
+{
+	g_auto(filedesc) fd = -1;
+
+	(void)r_memory_get_reserved_peak(TRUE);
+
+	/* '5' resets the peak RSS (since Linux 4.0), ignore failures. This
+	 * can't use g_file_set_contents(), which replaces the file via a
+	 * temporary one. */
+	fd = g_open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC, 0);
+	if (fd < 0)
+		return;
+	(void)r_write_exact(fd, (const guint8 *)"5", 1, NULL);
+}
+
+guint64 r_memory_get_peak_rss(void)
+{
+	g_autofree gchar *contents = NULL;
+	const gchar *line;
+
+	if (!g_file_get_contents("/proc/self/status", &contents, NULL, NULL))
+		return 0;
+
+	line = strstr(contents, "\nVmHWM:");
+	if (!line)
+		return 0;
+
+	/* the value is given in kB */
+	return g_ascii_strtoull(line + strlen("\nVmHWM:"), NULL, 10) * 1024;
+}
@@ -14,6 +14,25 @@
 #ifndef LOOP_SET_BLOCK_SIZE
 #define LOOP_SET_BLOCK_SIZE 0x4C09
 #endif
+#ifndef LOOP_SET_DIRECT_IO
+#define LOOP_SET_DIRECT_IO 0x4C08
+#endif
+#ifndef LO_FLAGS_DIRECT_IO
+#define LO_FLAGS_DIRECT_IO 16
+#endif
+/* LOOP_CONFIGURE was added in Linux 5.8 */
+#ifndef LOOP_CONFIGURE
+#define LOOP_CONFIGURE 0x4C0A
+struct loop_config {
+	__u32 fd;
+	__u32 block_size;
+	struct loop_info64 info;
+	__u64 __reserved[8];
+};
+#endif
+
+/* logical block size of bundle loop devices, matching the verity data block size */
+#define LOOP_BLOCK_SIZE 4096
 
 gboolean r_mount_bundle(const gchar *source, const gchar *mountpoint, GError **error)
 {
@@ -111,6 +130,9 @@ gboolean r_setup_loop(gint fd, gint *loopfd_out, gchar **loopname_out, goffset s
 	gint loopfd = -1, looprc;
 	guint tries;
 	struct loop_info64 loopinfo = {0};
+	struct loop_config loopconfig = {0};
+	gboolean configured = FALSE;
+	static gboolean configure_unsupported = FALSE;
 
 	g_return_val_if_fail(fd >= 0, FALSE);
 	g_return_val_if_fail(loopfd_out != NULL, FALSE);
@@ -165,6 +187,40 @@ gboolean r_setup_loop(gint fd, gint *loopfd_out, gchar **loopname_out, goffset s
 			goto out;
 		}
 
+		/* Configure everything at once if supported. Direct I/O avoids
+		 * caching the bundle both for the file and the loop device. */
+		if (!configure_unsupported) {
+			loopconfig.fd = fd;
+			loopconfig.block_size = LOOP_BLOCK_SIZE;
+			loopconfig.info.lo_sizelimit = size;
+			loopconfig.info.lo_flags = LO_FLAGS_READ_ONLY | LO_FLAGS_AUTOCLEAR | LO_FLAGS_DIRECT_IO;
+
+			looprc = ioctl(loopfd, LOOP_CONFIGURE, &loopconfig);
+			if (looprc < 0 && errno == EINVAL) {
+				/* older kernels reject direct I/O if the backing
+				 * file does not support it */
+				loopconfig.info.lo_flags &= ~LO_FLAGS_DIRECT_IO;
+				looprc = ioctl(loopfd, LOOP_CONFIGURE, &loopconfig);
+			}
+			if (looprc == 0) {
+				configured = TRUE;
+				break; /* claimed a loop dev */
+			} else if (errno == EBUSY) {
+				continue; /* retry */
+			} else if (errno == EINVAL || errno == ENOTTY) {
+				g_debug("LOOP_CONFIGURE not supported, using LOOP_SET_FD: %s", g_strerror(errno));
+				configure_unsupported = TRUE;
+			} else {
+				int err = errno;
+				g_set_error(error,
+						G_FILE_ERROR,
+						g_file_error_from_errno(err),
+						"Failed to configure loop device: %s", g_strerror(err));
+				res = FALSE;
+				goto out;
+			}
+		}
+
 		looprc = ioctl(loopfd, LOOP_SET_FD, fd);
 		if (looprc < 0) {
 			int err = errno;
@@ -191,6 +247,9 @@ gboolean r_setup_loop(gint fd, gint *loopfd_out, gchar **loopname_out, goffset s
 		goto out;
 	}
 
+	if (configured)
+		goto configured;
+
 	loopinfo.lo_sizelimit = size;
 	loopinfo.lo_flags = LO_FLAGS_READ_ONLY | LO_FLAGS_AUTOCLEAR;
 
@@ -209,14 +268,23 @@ gboolean r_setup_loop(gint fd, gint *loopfd_out, gchar **loopname_out, goffset s
 	}
 
 	do {
-		looprc = ioctl(loopfd, LOOP_SET_BLOCK_SIZE, 4096);
+		looprc = ioctl(loopfd, LOOP_SET_BLOCK_SIZE, LOOP_BLOCK_SIZE);
 	} while (looprc < 0 && errno == EAGAIN);
 	if (looprc < 0) {
-		g_warning("Failed to set loop device block size to 4096: %s, continuing",
-				g_strerror(errno));
+		g_warning("Failed to set loop device block size to %d: %s, continuing",
+				LOOP_BLOCK_SIZE, g_strerror(errno));
 	}
 
-	g_message("Configured loop device '%s' for %" G_GOFFSET_FORMAT " bytes", loopname, size);
+	/* only an optimization, so ignore errors */
+	if (ioctl(loopfd, LOOP_SET_DIRECT_IO, 1) < 0)
+		g_debug("Failed to enable direct I/O for loop device: %s", g_strerror(errno));
+
+configured:
+	/* the kernel silently disables direct I/O if the backing file does not support it */
+	if (ioctl(loopfd, LOOP_GET_STATUS64, &loopinfo) == 0 && (loopinfo.lo_flags & LO_FLAGS_DIRECT_IO))
+		g_message("Configured loop device '%s' for %" G_GOFFSET_FORMAT " bytes (direct I/O)", loopname, size);
+	else
+		g_message("Configured loop device '%s' for %" G_GOFFSET_FORMAT " bytes", loopname, size);
 
 	*loopfd_out = loopfd;
 	loopfd = -1;
@@ -0,0 +1,324 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <glib/gstdio.h>
+#include <mtd/mtd-user.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mtd.h"
+#include "update_utils.h"
+#include "utils.h"
+
+GQuark r_mtd_error_quark(void)
+{
+	return g_quark_from_static_string("r_mtd_error_quark");
+}
+
+typedef struct {
+	const gchar *device;
+	int fd;
+	struct mtd_info_user info;
+	/* buffer for reading the current content of an erase block */
+	guint8 *current;
+	RMtdWriteStats stats;
+} RMtd;
+
+static gboolean mtd_open(RMtd *mtd, const gchar *device, GError **error)
+{
+	mtd->device = device;
+	mtd->fd = g_open(device, O_RDWR | O_CLOEXEC, 0);
+	if (mtd->fd < 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to open %s: %s", device, g_strerror(err));
+		return FALSE;
+	}
+
+	if (ioctl(mtd->fd, MEMGETINFO, &mtd->info) < 0) {
+		int err = errno;
+		g_set_error(error, R_MTD_ERROR, R_MTD_ERROR_IOCTL,
+				"Failed to get MTD info for %s: %s", device, g_strerror(err));
+		return FALSE;
+	}
+
+	if (mtd->info.erasesize == 0 || mtd->info.writesize == 0 ||
+	    mtd->info.erasesize % mtd->info.writesize != 0 ||
+	    mtd->info.size % mtd->info.erasesize != 0) {
+		g_set_error(error, R_MTD_ERROR, R_MTD_ERROR_FAILED,
+				"Unsupported geometry of %s (size %u, erase size %u, write size %u)",
+				device, mtd->info.size, mtd->info.erasesize, mtd->info.writesize);
+		return FALSE;
+	}
+
+	mtd->current = g_malloc(mtd->info.erasesize);
+
+	return TRUE;
+}
+
+static void mtd_close(RMtd *mtd)
+{
+	if (mtd->fd >= 0)
+		g_close(mtd->fd, NULL);
+	mtd->fd = -1;
+	g_clear_pointer(&mtd->current, g_free);
+}
+
+static gboolean mtd_block_is_bad(RMtd *mtd, guint32 offset, gboolean *bad, GError **error)
+{
+	__kernel_loff_t loff = offset;
+	int ret;
+
+	ret = ioctl(mtd->fd, MEMGETBADBLOCK, &loff);
+	if (ret < 0) {
+		int err = errno;
+		/* devices without bad block support (NOR) may not implement this */
+		if (err == EOPNOTSUPP) {
+			*bad = FALSE;
+			return TRUE;
+		}
+		g_set_error(error, R_MTD_ERROR, R_MTD_ERROR_IOCTL,
+				"Failed to get bad block status at 0x%08x on %s: %s",
+				offset, mtd->device, g_strerror(err));
+		return FALSE;
+	}
+
+	*bad = ret > 0;
+	return TRUE;
+}
+
+static gboolean block_is_erased(const guint8 *data, gsize len)
+{
+	return data[0] == 0xFF && memcmp(data, data + 1, len - 1) == 0;
+}
+
+/* Reads the current content of the erase block, returns FALSE if it could not
+ * be read (e.g. due to uncorrectable ECC errors). */
+static gboolean mtd_read_current(RMtd *mtd, guint32 offset)
+{
+	g_autoptr(GError) ierror = NULL;
+
+	if (!r_pread_exact(mtd->fd, mtd->current, mtd->info.erasesize, offset, &ierror)) {
+		g_debug("Failed to read erase block at 0x%08x on %s: %s",
+				offset, mtd->device, ierror->message);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean mtd_erase_block(RMtd *mtd, guint32 offset, GError **error)
+{
+	struct erase_info_user erase = {
+		.start = offset,
+		.length = mtd->info.erasesize,
+	};
+
+	if (ioctl(mtd->fd, MEMERASE, &erase) < 0) {
+		int err = errno;
+		g_set_error(error, R_MTD_ERROR, R_MTD_ERROR_IOCTL,
+				"Failed to erase block at 0x%08x on %s: %s",
+				offset, mtd->device, g_strerror(err));
+		return FALSE;
+	}
+	mtd->stats.erased++;
+
+	return TRUE;
+}
+
+/* Brings one erase block to the expected content, the first 'len' bytes (a
+ * multiple of the write size) are written, the rest is left erased. */
+static gboolean mtd_update_block(RMtd *mtd, guint32 offset, const guint8 *expected, gsize len, GError **error)
+{
+	GError *ierror = NULL;
+	gboolean readable;
+
+	readable = mtd_read_current(mtd, offset);
+	if (readable && memcmp(mtd->current, expected, mtd->info.erasesize) == 0) {
+		mtd->stats.unchanged++;
+		return TRUE;
+	}
+
+	/* On NAND, pages must be programmed only once after erasing, but pages
+	 * programmed with 0xFF data can't be told apart from erased ones. Only
+	 * bit-writeable flash (NOR) can be written without erasing first. */
+	if (!readable || !(mtd->info.flags & MTD_BIT_WRITEABLE) ||
+	    !block_is_erased(mtd->current, mtd->info.erasesize)) {
+		if (!mtd_erase_block(mtd, offset, error))
+			return FALSE;
+	}
+
+	if (!len)
+		return TRUE;
+
+	if (!r_pwrite_exact(mtd->fd, expected, len, offset, &ierror)) {
+		g_propagate_prefixed_error(error, ierror,
+				"Failed to write block at 0x%08x on %s: ", offset, mtd->device);
+		return FALSE;
+	}
+	mtd->stats.written++;
+	r_copy_count_written(len);
+
+	if (!r_pread_exact(mtd->fd, mtd->current, len, offset, &ierror)) {
+		g_propagate_prefixed_error(error, ierror,
+				"Failed to read back block at 0x%08x on %s: ", offset, mtd->device);
+		return FALSE;
+	}
+	if (memcmp(mtd->current, expected, len) != 0) {
+		g_set_error(error, R_MTD_ERROR, R_MTD_ERROR_VERIFY,
+				"Verification of block at 0x%08x on %s failed", offset, mtd->device);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+gboolean r_mtd_write_image(const gchar *device, const gchar *image, RMtdWriteStats *stats, GError **error)
+{
+	RMtd mtd = {.fd = -1};
+	GError *ierror = NULL;
+	g_auto(filedesc) image_fd = -1;
+	g_autofree guint8 *expected = NULL;
+	struct stat st;
+	guint64 remaining, usable = 0;
+	gboolean res = FALSE;
+
+	g_return_val_if_fail(device, FALSE);
+	g_return_val_if_fail(image, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	image_fd = g_open(image, O_RDONLY | O_CLOEXEC, 0);
+	if (image_fd < 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to open %s: %s", image, g_strerror(err));
+		goto out;
+	}
+	if (fstat(image_fd, &st) < 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to stat %s: %s", image, g_strerror(err));
+		goto out;
+	}
+
+	if (!mtd_open(&mtd, device, &ierror)) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
+
+	/* check the size before modifying anything */
+	for (guint32 offset = 0; offset < mtd.info.size; offset += mtd.info.erasesize) {
+		gboolean bad;
+
+		if (!mtd_block_is_bad(&mtd, offset, &bad, &ierror)) {
+			g_propagate_error(error, ierror);
+			goto out;
+		}
+		if (!bad)
+			usable += mtd.info.erasesize;
+	}
+	if ((guint64)st.st_size > usable) {
+		g_set_error(error, R_MTD_ERROR, R_MTD_ERROR_NO_SPACE,
+				"Image size %"G_GUINT64_FORMAT " exceeds the usable size %"G_GUINT64_FORMAT " of %s",
+				(guint64)st.st_size, usable, device);
+		goto out;
+	}
+
+	expected = g_malloc(mtd.info.erasesize);
+	remaining = st.st_size;
+	for (guint32 offset = 0; offset < mtd.info.size; offset += mtd.info.erasesize) {
+		gsize len = MIN(remaining, mtd.info.erasesize);
+		gsize write_len;
+		gboolean bad;
+
+		if (!mtd_block_is_bad(&mtd, offset, &bad, &ierror)) {
+			g_propagate_error(error, ierror);
+			goto out;
+		}
+		if (bad) {
+			g_debug("Skipping bad block at 0x%08x on %s", offset, device);
+			mtd.stats.bad++;
+			continue;
+		}
+
+		if (len && !r_read_exact(image_fd, expected, len, &ierror)) {
+			g_propagate_prefixed_error(error, ierror,
+					"Failed to read %s: ", image);
+			goto out;
+		}
+		memset(expected + len, 0xFF, mtd.info.erasesize - len);
+		remaining -= len;
+
+		/* pad the last page only */
+		write_len = (len + mtd.info.writesize - 1) / mtd.info.writesize * mtd.info.writesize;
+
+		if (!mtd_update_block(&mtd, offset, expected, write_len, &ierror)) {
+			g_propagate_error(error, ierror);
+			goto out;
+		}
+	}
+
+	g_message("Wrote %u, erased %u and skipped %u unchanged and %u bad erase blocks on %s",
+			mtd.stats.written, mtd.stats.erased, mtd.stats.unchanged, mtd.stats.bad, device);
+
+	if (stats)
+		*stats = mtd.stats;
+
+	res = TRUE;
+
+out:
+	mtd_close(&mtd);
+	return res;
+}
+
+gboolean r_mtd_erase(const gchar *device, RMtdWriteStats *stats, GError **error)
+{
+	RMtd mtd = {.fd = -1};
+	GError *ierror = NULL;
+	gboolean res = FALSE;
+
+	g_return_val_if_fail(device, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (!mtd_open(&mtd, device, &ierror)) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
+
+	for (guint32 offset = 0; offset < mtd.info.size; offset += mtd.info.erasesize) {
+		gboolean bad;
+
+		if (!mtd_block_is_bad(&mtd, offset, &bad, &ierror)) {
+			g_propagate_error(error, ierror);
+			goto out;
+		}
+		if (bad) {
+			mtd.stats.bad++;
+			continue;
+		}
+
+		/* As in mtd_update_block(), a NAND page programmed with 0xFF
+		 * data is not erased, so only skip blocks on NOR flash. */
+		if ((mtd.info.flags & MTD_BIT_WRITEABLE) &&
+		    mtd_read_current(&mtd, offset) &&
+		    block_is_erased(mtd.current, mtd.info.erasesize)) {
+			mtd.stats.unchanged++;
+			continue;
+		}
+
+		if (!mtd_erase_block(&mtd, offset, &ierror)) {
+			g_propagate_error(error, ierror);
+			goto out;
+		}
+	}
+
+	if (stats)
+		*stats = mtd.stats;
+
+	res = TRUE;
+
+out:
+	mtd_close(&mtd);
+	return res;
+}
@@ -6,9 +6,12 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
+#include <poll.h>
 #include <pwd.h>
+#include <sys/file.h>
 #include <sys/ioctl.h>
 #include <sys/prctl.h>
+#include <sys/stat.h>
 #include <sys/sysmacros.h>
 
 #include <glib.h>
@@ -26,11 +29,14 @@
 
 #include "context.h"
 #include "nbd.h"
+#include "network.h"
 #include "stats.h"
+#include "trace.h"
 #include "utils.h"
 
 /* these are only used before passing the socket to the kernel */
 #define RAUC_NBD_CMD_CONFIGURE 0x1000
+#define RAUC_NBD_CMD_PREFETCH 0x1001
 #define RAUC_NBD_HANDLE "\x89\xce\x48\x24\x0c\xe4\x82\xce"
 
 GQuark
@@ -44,10 +50,18 @@ RaucNBDDevice *r_nbd_new_device(void)
 	RaucNBDDevice *nbd_dev = g_malloc0(sizeof(RaucNBDDevice));
 
 	nbd_dev->sock = -1;
+	nbd_dev->extra_socks = g_array_new(FALSE, FALSE, sizeof(gint));
 
 	return nbd_dev;
 }
 
+static void close_extra_socks(GArray *socks)
+{
+	for (guint i = 0; i < socks->len; i++)
+		g_close(g_array_index(socks, gint, i), NULL);
+	g_array_set_size(socks, 0);
+}
+
 void r_nbd_free_device(RaucNBDDevice *nbd_dev)
 {
 	g_return_if_fail(nbd_dev);
@@ -59,6 +73,8 @@ void r_nbd_free_device(RaucNBDDevice *nbd_dev)
 		}
 	}
 
+	close_extra_socks(nbd_dev->extra_socks);
+	g_array_unref(nbd_dev->extra_socks);
 	g_free(nbd_dev);
 }
 
@@ -67,6 +83,8 @@ RaucNBDServer *r_nbd_new_server(void)
 	RaucNBDServer *nbd_srv = g_malloc0(sizeof(RaucNBDServer));
 
 	nbd_srv->sock = -1;
+	nbd_srv->extra_socks = g_array_new(FALSE, FALSE, sizeof(gint));
+	nbd_srv->connections = 1;
 
 	return nbd_srv;
 }
@@ -86,10 +104,16 @@ void r_nbd_free_server(RaucNBDServer *nbd_srv)
 	g_free(nbd_srv->tls_cert);
 	g_free(nbd_srv->tls_key);
 	g_free(nbd_srv->tls_ca);
+	g_free(nbd_srv->cache_dir);
+	g_free(nbd_srv->tls_session_cache);
+	g_strfreev(nbd_srv->mirrors);
 	g_strfreev(nbd_srv->headers);
 	g_clear_pointer(&nbd_srv->info_headers, g_ptr_array_unref);
 	g_free(nbd_srv->effective_url);
 	g_free(nbd_srv->etag);
+	g_clear_pointer(&nbd_srv->tail, g_bytes_unref);
+	close_extra_socks(nbd_srv->extra_socks);
+	g_array_unref(nbd_srv->extra_socks);
 	g_free(nbd_srv);
 }
 
@@ -190,6 +214,14 @@ gboolean r_nbd_setup_device(RaucNBDDevice *nbd_dev, GError **error)
 		g_error("failed to allocate nested NBD_SOCK_ITEM netlink message");
 	NLA_PUT_U32(msg, NBD_SOCK_FD, nbd_dev->sock);
 	nla_nest_end(msg, attr_item);
+	/* the kernel distributes the requests over all sockets */
+	for (guint i = 0; i < nbd_dev->extra_socks->len; i++) {
+		attr_item = nla_nest_start(msg, NBD_SOCK_ITEM);
+		if (!attr_item)
+			g_error("failed to allocate nested NBD_SOCK_ITEM netlink message");
+		NLA_PUT_U32(msg, NBD_SOCK_FD, g_array_index(nbd_dev->extra_socks, gint, i));
+		nla_nest_end(msg, attr_item);
+	}
 	nla_nest_end(msg, attr_sockets);
 
 	nl_socket_modify_cb(nl, NL_CB_VALID, NL_CB_CUSTOM, netlink_connect_cb, nbd_dev);
@@ -262,6 +294,7 @@ gboolean r_nbd_remove_device(RaucNBDDevice *nbd_dev, GError **error)
 	/* maybe reuse the socket to get final statistics/error message? */
 	g_close(nbd_dev->sock, NULL);
 	nbd_dev->sock = -1;
+	close_extra_socks(nbd_dev->extra_socks);
 	g_clear_pointer(&nbd_dev->dev, g_free);
 
 	res = TRUE;
@@ -279,6 +312,115 @@ out:
 	return res;
 }
 
+/* Reads which are at most this far apart are combined into one HTTP request,
+ * as transferring the data in between is cheaper than another round trip. */
+#define RAUC_NBD_MERGE_GAP (64*1024)
+/* maximum size of a combined HTTP request */
+#define RAUC_NBD_MERGE_MAX (4*1024*1024)
+/* maximum number of requests read from the client before starting them */
+#define RAUC_NBD_MAX_PENDING 64
+/* limits for the adaptive number of concurrent HTTP range requests */
+#define RAUC_NBD_WINDOW_INITIAL 4
+#define RAUC_NBD_WINDOW_MAX RAUC_NBD_MAX_PENDING
+/* limits for the adaptive maximum size of merged ranges */
+#define RAUC_NBD_MERGE_MIN (128*1024)
+#define RAUC_NBD_MERGE_INITIAL (1024*1024)
+/* time to first byte above the lowest observed one which indicates queuing */
+#define RAUC_NBD_QUEUE_DELAY 0.010
+/* attempts for a single request without any progress */
+#define RAUC_NBD_RETRIES 5
+/* retries for all requests handled by one server (i.e. one installation) */
+#define RAUC_NBD_RETRY_BUDGET 200
+/* exponential backoff between retries */
+#define RAUC_NBD_RETRY_DELAY_MIN (250 * G_TIME_SPAN_MILLISECOND)
+#define RAUC_NBD_RETRY_DELAY_MAX (30 * G_TIME_SPAN_SECOND)
+/* maximum number of idle read buffers kept for reuse */
+#define RAUC_NBD_IDLE_BUFFERS 8
+/* maximum number of idle curl easy handles kept for reuse */
+#define RAUC_NBD_IDLE_EASY RAUC_NBD_MAX_PENDING
+
+/* consecutive failed requests after which a mirror is no longer used */
+#define RAUC_NBD_MIRROR_FAILURES 3
+/* weight of a new sample in the smoothed mirror throughput */
+#define RAUC_NBD_MIRROR_RATE_WEIGHT 0.25
+
+/* size of the blocks stored in the block cache */
+#define RAUC_NBD_CACHE_BLOCK (64*1024)
+/* number of newly cached blocks after which the cache map is written */
+#define RAUC_NBD_CACHE_SYNC_BLOCKS 256
+
+/* Persistent cache for downloaded bundle data.
+ *
+ * Each bundle (identified by URL, ETag, Last-Modified and size) has a sparse
+ * data file and a bitmap of valid blocks. The bitmap is only written after
+ * the data has been synced, so a block is never marked as valid before its
+ * data is stored.
+ *
+ * The data file is locked with flock() while in use, so that concurrent
+ * servers neither share nor evict it.
+ */
+typedef struct {
+	gchar *data_path;
+	gchar *map_path;
+	int data_fd;
+	guint64 data_size;
+	guint8 *map; /* one bit per block */
+	gsize map_size;
+	guint64 cached_blocks;
+	guint64 max_blocks; /* limit for this bundle */
+	guint unsynced_blocks;
+} RaucNBDCache;
+
+struct RaucNBDContext;
+static void start_workers(struct RaucNBDContext *ctx);
+
+/* A server providing the bundle. The first one is the configured URL, the
+ * others are the additional mirrors which passed the consistency checks. */
+typedef struct {
+	gchar *url;
+	gboolean healthy;
+	guint failures; /* consecutive failed requests */
+	guint active; /* running requests */
+	double rate; /* smoothed throughput in bytes per second */
+} RaucNBDMirror;
+
+typedef struct {
+	guint8 *data;
+	gsize size;
+} RaucNBDBuffer;
+
+/* A range downloaded by a prefetch request, kept until the server exits. */
+typedef struct {
+	guint64 from;
+	guint64 len;
+	guint8 *data;
+} RaucNBDPinned;
+
+/* State shared by the threads serving the individual connections. */
+struct RaucNBDShared {
+	gint first_extra_sock;
+	guint extra_socks;
+	GPtrArray *workers; /* GThread for each additional connection */
+
+	CURLSH *share;
+	GMutex share_locks[CURL_LOCK_DATA_LAST];
+
+	GMutex lock; /* protects the fields below */
+	RaucNBDCache *cache;
+	guint64 downloaded;
+
+	RaucTokenBucket rate_limit; /* for all downloads */
+
+	gint retry_budget; /* remaining retries (atomic) */
+
+	gchar *tls_session_cache; /* file for persisting the TLS sessions */
+
+	GPtrArray *mirrors; /* RaucNBDMirror, set before the workers start */
+
+	GArray *pinned; /* RaucNBDPinned from prefetch requests */
+	guint64 pinned_size;
+};
+
 struct RaucNBDContext {
 	gint sock;
 
@@ -291,12 +433,31 @@ struct RaucNBDContext {
 	gboolean tls_no_verify;
 	struct curl_slist *headers_slist;
 	struct curl_slist *initial_headers_slist;
+	gchar **headers; /* for configuring additional connections */
+	gchar *cache_dir;
+	guint64 cache_size;
+	gchar *cache_url; /* URL as configured (before redirects) */
+	gchar **mirror_urls; /* additional URLs of the same bundle */
 
 	/* runtime state */
+	struct RaucNBDShared *shared;
 	CURLM *multi;
+	GPtrArray *idle_easy; /* configured easy handles for read requests */
+	GArray *idle_buffers; /* RaucNBDBuffer for read requests */
+	GQueue retries; /* failed transfers ordered by their retry time */
 	gboolean done;
 
+	/* flow control for read requests */
+	GQueue queued_reads; /* merged reads waiting for a free slot in the window */
+	guint active_reads; /* number of running HTTP range requests */
+	guint window; /* maximum number of running HTTP range requests */
+	guint window_acks; /* successful requests since the window was changed */
+	guint64 merge_max; /* maximum size of a merged range */
+	double min_starttransfer; /* lowest observed time to first byte */
+
 	/* statistics */
+	RaucStats *read_size; /* NBD read requests from the kernel */
+	RaucStats *cache_hits;
 	RaucStats *dl_size, *dl_speed, *namelookup, *connect, *starttransfer, *total;
 };
 
@@ -310,27 +471,372 @@ struct RaucNBDTransfer {
 	struct nbd_request request;
 	struct nbd_reply reply;
 	gboolean done;
-	guint errors;
+	guint errors; /* failed attempts since the last progress */
+	curl_off_t resume_pos; /* buffer_pos at the start of the last attempt */
+	gint64 retry_at; /* monotonic time for the next attempt */
 
 	guint8 *buffer;
 	curl_off_t buffer_size;
+	gsize buffer_alloc; /* allocated size if taken from the buffer pool */
 	curl_off_t buffer_pos;
 
+	/* read request (covering all merged reads) */
+	guint64 range_from;
+	guint64 range_len;
+	GPtrArray *merged; /* additional reads answered from this request */
+	RaucNBDMirror *mirror; /* server used for the current attempt */
+
 	/* configure request */
+	gboolean probe_prefix; /* range "0-3" instead of the bundle tail */
 	guint64 content_size;
 	guint64 current_time; /* date header from server */
 	guint64 modified_time; /* last-modified header from server */
 	gchar *etag;
 };
 
+static gboolean cache_block_valid(const RaucNBDCache *cache, guint64 block)
+{
+	return cache->map[block / 8] & (1 << (block % 8));
+}
+
+/* Writes the map after syncing the data. */
+static gboolean cache_sync(RaucNBDCache *cache, GError **error)
+{
+	if (!cache->unsynced_blocks)
+		return TRUE;
+
+	if (fdatasync(cache->data_fd) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"failed to sync cache data: %s", g_strerror(err));
+		return FALSE;
+	}
+
+	if (!g_file_set_contents(cache->map_path, (const gchar *)cache->map, cache->map_size, error))
+		return FALSE;
+
+	cache->unsynced_blocks = 0;
+
+	return TRUE;
+}
+
+static void cache_free(RaucNBDCache *cache)
+{
+	g_autoptr(GError) ierror = NULL;
+
+	if (!cache)
+		return;
+
+	if (cache->data_fd >= 0) {
+		if (!cache_sync(cache, &ierror))
+			g_message("nbd server failed to write cache map: %s", ierror->message);
+		g_close(cache->data_fd, NULL);
+	}
+
+	g_free(cache->data_path);
+	g_free(cache->map_path);
+	g_free(cache->map);
+	g_free(cache);
+}
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(RaucNBDCache, cache_free);
+
+typedef struct {
+	gchar *name; /* without suffix */
+	gint64 mtime;
+	guint64 size;
+} RaucNBDCacheEntry;
+
+static void clear_cache_entry(gpointer data)
+{
+	RaucNBDCacheEntry *entry = data;
+
+	g_free(entry->name);
+}
+
+static gint compare_cache_entry_mtime(gconstpointer a, gconstpointer b)
+{
+	const RaucNBDCacheEntry *entry_a = a;
+	const RaucNBDCacheEntry *entry_b = b;
+
+	if (entry_a->mtime < entry_b->mtime)
+		return -1;
+	if (entry_a->mtime > entry_b->mtime)
+		return 1;
+	return 0;
+}
+
+/* Removes the least recently used data of other bundles until the current
+ * bundle would fit and returns the space available for it. */
+static guint64 cache_evict(const gchar *dir, const gchar *current, guint64 max_size, guint64 needed)
+{
+	g_autoptr(GDir) gdir = NULL;
+	g_autoptr(GArray) entries = g_array_new(FALSE, FALSE, sizeof(RaucNBDCacheEntry));
+	const gchar *name = NULL;
+	guint64 used = 0;
+
+	g_array_set_clear_func(entries, clear_cache_entry);
+
+	gdir = g_dir_open(dir, 0, NULL);
+	if (!gdir)
+		return 0;
+
+	while ((name = g_dir_read_name(gdir))) {
+		g_autofree gchar *path = NULL;
+		RaucNBDCacheEntry entry = {0};
+		GStatBuf st;
+
+		if (!g_str_has_suffix(name, ".data") || g_str_equal(name, current))
+			continue;
+
+		path = g_build_filename(dir, name, NULL);
+		if (g_stat(path, &st) != 0)
+			continue;
+
+		entry.name = g_strndup(name, strlen(name) - strlen(".data"));
+		entry.mtime = st.st_mtime;
+		entry.size = (guint64)st.st_blocks * 512;
+		used += entry.size;
+		g_array_append_val(entries, entry);
+	}
+
+	g_array_sort(entries, compare_cache_entry_mtime);
+
+	for (guint i = 0; i < entries->len && used + needed > max_size; i++) {
+		RaucNBDCacheEntry *entry = &g_array_index(entries, RaucNBDCacheEntry, i);
+		g_autofree gchar *data_name = g_strconcat(entry->name, ".data", NULL);
+		g_autofree gchar *map_name = g_strconcat(entry->name, ".map", NULL);
+		g_autofree gchar *data_path = g_build_filename(dir, data_name, NULL);
+		g_autofree gchar *map_path = g_build_filename(dir, map_name, NULL);
+
+		int fd;
+
+		/* skip data which is in use by another server */
+		fd = g_open(data_path, O_RDONLY | O_CLOEXEC, 0);
+		if (fd < 0)
+			continue;
+		if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+			g_debug("nbd server not evicting %s from cache: in use", data_path);
+			g_close(fd, NULL);
+			continue;
+		}
+
+		g_debug("nbd server evicting %s from cache", data_path);
+		/* remove the map first, so that the data is not used anymore */
+		g_unlink(map_path);
+		if (g_unlink(data_path) == 0)
+			used -= entry->size;
+		g_close(fd, NULL);
+	}
+
+	return used < max_size ? max_size - used : 0;
+}
+
+/* Opens (or creates) the cache for a bundle.
+ *
+ * The bundle is identified by the URL, the ETag and Last-Modified headers
+ * and the size, so changed bundles use a different cache. */
+static RaucNBDCache *cache_open(const gchar *dir, guint64 max_size, const gchar *url, const gchar *etag, guint64 modified_time, guint64 data_size, GError **error)
+{
+	g_autoptr(RaucNBDCache) cache = g_new0(RaucNBDCache, 1);
+	g_autofree gchar *id = NULL;
+	g_autofree gchar *key = NULL;
+	g_autofree gchar *data_name = NULL;
+	g_autofree gchar *map_name = NULL;
+	g_autofree gchar *map_data = NULL;
+	gsize map_len = 0;
+	guint64 blocks;
+	struct stat st, path_st;
+
+	cache->data_fd = -1;
+	cache->data_size = data_size;
+	blocks = (data_size + RAUC_NBD_CACHE_BLOCK - 1) / RAUC_NBD_CACHE_BLOCK;
+	cache->map_size = (blocks + 7) / 8;
+
+	id = g_strdup_printf("%s\n%s\n%"G_GUINT64_FORMAT "\n%"G_GUINT64_FORMAT,
+			url, etag ? etag : "", modified_time, data_size);
+	key = g_compute_checksum_for_string(G_CHECKSUM_SHA256, id, -1);
+	data_name = g_strconcat(key, ".data", NULL);
+	map_name = g_strconcat(key, ".map", NULL);
+	cache->data_path = g_build_filename(dir, data_name, NULL);
+	cache->map_path = g_build_filename(dir, map_name, NULL);
+
+	if (g_mkdir_with_parents(dir, 0700) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"failed to create cache directory %s: %s", dir, g_strerror(err));
+		return NULL;
+	}
+
+	cache->data_fd = g_open(cache->data_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (cache->data_fd < 0 || fstat(cache->data_fd, &st) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"failed to open %s: %s", cache->data_path, g_strerror(err));
+		return NULL;
+	}
+
+	if (flock(cache->data_fd, LOCK_EX | LOCK_NB) != 0) {
+		int err = errno;
+		if (err == EWOULDBLOCK) {
+			g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_EXIST,
+					"%s is in use by another process", cache->data_path);
+		} else {
+			g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+					"failed to lock %s: %s", cache->data_path, g_strerror(err));
+		}
+		return NULL;
+	}
+
+	/* the file may have been evicted between opening and locking it */
+	if (g_stat(cache->data_path, &path_st) != 0 ||
+	    path_st.st_dev != st.st_dev || path_st.st_ino != st.st_ino) {
+		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_NOENT,
+				"%s was removed concurrently", cache->data_path);
+		return NULL;
+	}
+
+	if ((guint64)st.st_size == data_size &&
+	    g_file_get_contents(cache->map_path, &map_data, &map_len, NULL) &&
+	    map_len == cache->map_size) {
+		cache->map = (guint8 *)g_steal_pointer(&map_data);
+	} else {
+		/* no usable map, so start over */
+		g_unlink(cache->map_path);
+		cache->map = g_malloc0(cache->map_size);
+		if (ftruncate(cache->data_fd, 0) != 0) {
+			int err = errno;
+			g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+					"failed to truncate %s: %s", cache->data_path, g_strerror(err));
+			return NULL;
+		}
+	}
+
+	/* the data file is sparse */
+	if (ftruncate(cache->data_fd, data_size) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"failed to resize %s: %s", cache->data_path, g_strerror(err));
+		return NULL;
+	}
+
+	/* mark as recently used */
+	(void)futimens(cache->data_fd, NULL);
+
+	for (guint64 b = 0; b < blocks; b++)
+		if (cache_block_valid(cache, b))
+			cache->cached_blocks++;
+
+	if (max_size)
+		cache->max_blocks = cache_evict(dir, data_name, max_size, data_size) / RAUC_NBD_CACHE_BLOCK;
+	else
+		cache->max_blocks = G_MAXUINT64;
+
+	return g_steal_pointer(&cache);
+}
+
+/* Reads a range from the cache, if all blocks are available. */
+static gboolean cache_read(RaucNBDCache *cache, guint64 from, guint32 len, guint8 *data)
+{
+	if (!len || from + len > cache->data_size)
+		return FALSE;
+
+	for (guint64 b = from / RAUC_NBD_CACHE_BLOCK; b <= (from + len - 1) / RAUC_NBD_CACHE_BLOCK; b++)
+		if (!cache_block_valid(cache, b))
+			return FALSE;
+
+	return r_pread_exact(cache->data_fd, data, len, from, NULL);
+}
+
+/* Stores all complete blocks within a downloaded range. */
+static gboolean cache_store(RaucNBDCache *cache, guint64 from, const guint8 *data, guint64 len, GError **error)
+{
+	guint64 end = from + len;
+
+	for (guint64 b = (from + RAUC_NBD_CACHE_BLOCK - 1) / RAUC_NBD_CACHE_BLOCK;
+	     b * RAUC_NBD_CACHE_BLOCK < end; b++) {
+		guint64 start = b * RAUC_NBD_CACHE_BLOCK;
+		guint64 block_end = MIN(start + RAUC_NBD_CACHE_BLOCK, cache->data_size);
+
+		if (block_end > end)
+			break;
+		if (cache_block_valid(cache, b))
+			continue;
+		if (cache->cached_blocks >= cache->max_blocks)
+			break;
+
+		if (!r_pwrite_exact(cache->data_fd, data + (start - from), block_end - start, start, error))
+			return FALSE;
+
+		cache->map[b / 8] |= 1 << (b % 8);
+		cache->cached_blocks++;
+		cache->unsynced_blocks++;
+	}
+
+	if (cache->unsynced_blocks >= RAUC_NBD_CACHE_SYNC_BLOCKS)
+		return cache_sync(cache, error);
+
+	return TRUE;
+}
+
+/* Takes a buffer of at least size bytes from the pool or allocates a new one,
+ * to avoid the mmap/munmap and page faults for each large malloc. */
+static void take_buffer(struct RaucNBDTransfer *xfer, gsize size)
+{
+	GArray *idle = xfer->ctx->idle_buffers;
+
+	g_assert_null(xfer->buffer);
+
+	for (guint i = 0; i < idle->len; i++) {
+		RaucNBDBuffer *buf = &g_array_index(idle, RaucNBDBuffer, i);
+
+		if (buf->size >= size) {
+			xfer->buffer = buf->data;
+			xfer->buffer_alloc = buf->size;
+			g_array_remove_index_fast(idle, i);
+			return;
+		}
+	}
+
+	/* round up, so that the buffer can be reused for similar sizes */
+	xfer->buffer_alloc = size + (RAUC_NBD_CACHE_BLOCK - size % RAUC_NBD_CACHE_BLOCK) % RAUC_NBD_CACHE_BLOCK;
+	xfer->buffer = g_malloc(xfer->buffer_alloc);
+}
+
+static void release_buffer(struct RaucNBDTransfer *xfer)
+{
+	GArray *idle = xfer->ctx->idle_buffers;
+
+	if (!xfer->buffer)
+		return;
+
+	if (xfer->buffer_alloc && idle->len < RAUC_NBD_IDLE_BUFFERS) {
+		RaucNBDBuffer buf = {
+			.data = xfer->buffer,
+			.size = xfer->buffer_alloc,
+		};
+		g_array_append_val(idle, buf);
+	} else {
+		g_free(xfer->buffer);
+	}
+	xfer->buffer = NULL;
+	xfer->buffer_alloc = 0;
+}
+
 static void free_transfer(struct RaucNBDTransfer *xfer)
 {
-	g_clear_pointer(&xfer->buffer, g_free);
+	release_buffer(xfer);
 	g_clear_pointer(&xfer->etag, g_free);
+	g_clear_pointer(&xfer->merged, g_ptr_array_unref);
 
 	g_free(xfer);
 }
 
+/* Returns TRUE for requests which download a range into the buffer. */
+static gboolean is_range_request(const struct RaucNBDTransfer *xfer)
+{
+	return xfer->request.type == NBD_CMD_READ || xfer->request.type == RAUC_NBD_CMD_PREFETCH;
+}
+
 static size_t write_cb(char *ptr, size_t size, size_t nmemb, void *userdata)
 {
 	struct RaucNBDTransfer *xfer = userdata;
@@ -345,6 +851,10 @@ static size_t write_cb(char *ptr, size_t size, size_t nmemb, void *userdata)
 	memcpy(xfer->buffer + xfer->buffer_pos, ptr, nmemb);
 	xfer->buffer_pos += nmemb;
 
+	/* Sleeping here stalls the other transfers of this connection as well,
+	 * which is intended, as the limit applies to all of them. */
+	r_token_bucket_consume(&xfer->ctx->shared->rate_limit, nmemb);
+
 	return nmemb;
 }
 
@@ -369,6 +879,8 @@ static size_t header_cb(char *buffer, size_t size, size_t nitems, void *userdata
 		g_auto(GStrv) h_range = NULL;
 		gchar *endptr = NULL;
 		guint64 range_size = 0;
+		guint64 range_from = 0;
+		guint64 range_last = 0;
 
 		h_elements = g_strsplit(h_pair[1], " ", 2);
 		if (g_strv_length(h_elements) != 2) {
@@ -382,7 +894,8 @@ static size_t header_cb(char *buffer, size_t size, size_t nitems, void *userdata
 			return 0;
 		}
 
-		if (!g_str_equal(h_range[0], "0-3") || g_str_equal(h_range[1], "*")) {
+		if (g_str_equal(h_range[1], "*") ||
+		    (xfer->probe_prefix && !g_str_equal(h_range[0], "0-3"))) {
 			g_message("invalid content-range value");
 			return 0;
 		}
@@ -394,7 +907,32 @@ static size_t header_cb(char *buffer, size_t size, size_t nitems, void *userdata
 			return 0;
 		}
 
+		if (xfer->probe_prefix) {
+			xfer->content_size = range_size;
+			xfer->range_from = 0;
+			xfer->range_len = 4;
+
+			g_message("nbd server received total size %"G_GUINT64_FORMAT, range_size);
+			return nitems;
+		}
+
+		/* the suffix range must end at the end of the bundle */
+		errno = 0;
+		range_from = g_ascii_strtoull(h_range[0], &endptr, 10);
+		if (errno != 0 || endptr[0] != '-') {
+			g_message("failed to parse content-range start");
+			return 0;
+		}
+		range_last = g_ascii_strtoull(endptr + 1, &endptr, 10);
+		if (errno != 0 || endptr[0] != '\0' || range_from > range_last ||
+		    range_last + 1 != range_size) {
+			g_message("invalid content-range value");
+			return 0;
+		}
+
 		xfer->content_size = range_size;
+		xfer->range_from = range_from;
+		xfer->range_len = range_size - range_from;
 
 		g_message("nbd server received total size %"G_GUINT64_FORMAT, range_size);
 	} else if (g_str_equal(h_name, "date")) {
@@ -418,57 +956,86 @@ static size_t header_cb(char *buffer, size_t size, size_t nitems, void *userdata
 	return nitems;
 }
 
-static void prepare_curl(struct RaucNBDTransfer *xfer)
+/* Creates an easy handle with the options which are the same for all
+ * requests. */
+static CURL *new_curl(struct RaucNBDContext *ctx)
 {
 	CURLcode code = 0;
 	CURLcode tunnel_code = 0;
-	g_assert_null(xfer->easy);
+	CURLcode http2_code = 0;
+	CURL *easy = curl_easy_init();
 
-	xfer->easy = curl_easy_init();
-	if (!xfer->easy)
+	if (!easy)
 		g_error("unexpected error from curl_easy_init in %s", G_STRFUNC);
 
-	code |= curl_easy_setopt(xfer->easy, CURLOPT_ERRORBUFFER, xfer->errbuf);
+	code |= curl_easy_setopt(easy, CURLOPT_SHARE, ctx->shared->share);
 
 	if (g_getenv("RAUC_CURL_VERBOSE"))
-		code |= curl_easy_setopt(xfer->easy, CURLOPT_VERBOSE, 1L);
-
-	code |= curl_easy_setopt(xfer->easy, CURLOPT_URL, xfer->ctx->url);
-	if (xfer->ctx->tls_cert)
-		code |= curl_easy_setopt(xfer->easy, CURLOPT_SSLCERT, xfer->ctx->tls_cert);
-	if (xfer->ctx->tls_key)
-		code |= curl_easy_setopt(xfer->easy, CURLOPT_SSLKEY, xfer->ctx->tls_key);
-	if (xfer->ctx->tls_ca) {
-		code |= curl_easy_setopt(xfer->easy, CURLOPT_CAINFO, xfer->ctx->tls_ca);
-		code |= curl_easy_setopt(xfer->easy, CURLOPT_CAPATH, NULL);
+		code |= curl_easy_setopt(easy, CURLOPT_VERBOSE, 1L);
+
+	code |= curl_easy_setopt(easy, CURLOPT_URL, ctx->url);
+	if (ctx->tls_cert)
+		code |= curl_easy_setopt(easy, CURLOPT_SSLCERT, ctx->tls_cert);
+	if (ctx->tls_key)
+		code |= curl_easy_setopt(easy, CURLOPT_SSLKEY, ctx->tls_key);
+	if (ctx->tls_ca) {
+		code |= curl_easy_setopt(easy, CURLOPT_CAINFO, ctx->tls_ca);
+		code |= curl_easy_setopt(easy, CURLOPT_CAPATH, NULL);
 	}
 
-	if (xfer->ctx->tls_no_verify)
-		code |= curl_easy_setopt(xfer->easy, CURLOPT_SSL_VERIFYPEER, 0L);
-	if (xfer->ctx->headers_slist)
-		code |= curl_easy_setopt(xfer->easy, CURLOPT_HTTPHEADER, xfer->ctx->headers_slist);
+	if (ctx->tls_no_verify)
+		code |= curl_easy_setopt(easy, CURLOPT_SSL_VERIFYPEER, 0L);
+	if (ctx->headers_slist)
+		code |= curl_easy_setopt(easy, CURLOPT_HTTPHEADER, ctx->headers_slist);
 
-	code |= curl_easy_setopt(xfer->easy, CURLOPT_FOLLOWLOCATION, 1L);
-	code |= curl_easy_setopt(xfer->easy, CURLOPT_MAXREDIRS, 8L);
-	code |= curl_easy_setopt(xfer->easy, CURLOPT_REDIR_PROTOCOLS, CURLPROTO_HTTP | CURLPROTO_HTTPS);
-	code |= curl_easy_setopt(xfer->easy, CURLOPT_UNRESTRICTED_AUTH, 1L); /* send authentication to redirect targets as well */
+	code |= curl_easy_setopt(easy, CURLOPT_FOLLOWLOCATION, 1L);
+	code |= curl_easy_setopt(easy, CURLOPT_MAXREDIRS, 8L);
+	code |= curl_easy_setopt(easy, CURLOPT_REDIR_PROTOCOLS, CURLPROTO_HTTP | CURLPROTO_HTTPS);
+	code |= curl_easy_setopt(easy, CURLOPT_UNRESTRICTED_AUTH, 1L); /* send authentication to redirect targets as well */
 
-	code |= curl_easy_setopt(xfer->easy, CURLOPT_NOSIGNAL, 1L); /* avoid signals for threading */
-	code |= curl_easy_setopt(xfer->easy, CURLOPT_FAILONERROR, 1L);
-	code |= curl_easy_setopt(xfer->easy, CURLOPT_NETRC, CURL_NETRC_OPTIONAL);
+	code |= curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L); /* avoid signals for threading */
+	code |= curl_easy_setopt(easy, CURLOPT_FAILONERROR, 1L);
+	code |= curl_easy_setopt(easy, CURLOPT_NETRC, CURL_NETRC_OPTIONAL);
 
 	/* use a shorter timeout instead of the 5 minute default */
-	code |= curl_easy_setopt(xfer->easy, CURLOPT_CONNECTTIMEOUT, 20L);
+	code |= curl_easy_setopt(easy, CURLOPT_CONNECTTIMEOUT, 20L);
 
 	/* a proxy may be configured using .netrc */
-	tunnel_code = curl_easy_setopt(xfer->easy, CURLOPT_HTTPPROXYTUNNEL, 1L);
+	tunnel_code = curl_easy_setopt(easy, CURLOPT_HTTPPROXYTUNNEL, 1L);
 	if (tunnel_code == CURLE_UNKNOWN_OPTION) {
 		g_debug("no proxy support available in libcurl (failed to set CURLOPT_HTTPPROXYTUNNEL)");
 	} else {
 		code |= tunnel_code;
 	}
-	code |= curl_easy_setopt(xfer->easy, CURLOPT_SUPPRESS_CONNECT_HEADERS, 1L);
+	code |= curl_easy_setopt(easy, CURLOPT_SUPPRESS_CONNECT_HEADERS, 1L);
+
+	/* Prefer HTTP/2 and wait for the connection to be established instead
+	 * of opening new ones, so that all requests are multiplexed over a
+	 * single TLS connection. */
+	http2_code = curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+	if (http2_code != CURLE_OK) {
+		g_debug("no HTTP/2 support available in libcurl (failed to set CURLOPT_HTTP_VERSION)");
+	}
+	code |= curl_easy_setopt(easy, CURLOPT_PIPEWAIT, 1L);
+
+	if (code)
+		g_error("unexpected error from curl_easy_setopt in %s", G_STRFUNC);
+
+	return easy;
+}
+
+static void prepare_curl(struct RaucNBDTransfer *xfer)
+{
+	CURLcode code = 0;
+	g_assert_null(xfer->easy);
 
+	/* Reused handles are already configured and keep their connections. */
+	if (xfer->ctx->idle_easy->len)
+		xfer->easy = g_ptr_array_steal_index(xfer->ctx->idle_easy, xfer->ctx->idle_easy->len - 1);
+	else
+		xfer->easy = new_curl(xfer->ctx);
+
+	code |= curl_easy_setopt(xfer->easy, CURLOPT_ERRORBUFFER, xfer->errbuf);
 	code |= curl_easy_setopt(xfer->easy, CURLOPT_PRIVATE, xfer);
 
 	if (code)
@@ -517,29 +1084,363 @@ static void collect_curl_stats(struct RaucNBDContext *ctx, struct RaucNBDTransfe
 	}
 }
 
+static void free_mirror(RaucNBDMirror *mirror)
+{
+	g_free(mirror->url);
+	g_free(mirror);
+}
+
+/* Selects the mirror for the next request, based on the expected time until
+ * it would be answered. This spreads the requests across the mirrors
+ * according to their throughput and avoids mirrors which just failed. */
+static RaucNBDMirror *select_mirror(struct RaucNBDShared *shared)
+{
+	RaucNBDMirror *best = NULL;
+	double best_cost = 0;
+
+	if (!shared->mirrors || shared->mirrors->len < 2)
+		return NULL;
+
+	g_mutex_lock(&shared->lock);
+	for (guint i = 0; i < shared->mirrors->len; i++) {
+		RaucNBDMirror *mirror = g_ptr_array_index(shared->mirrors, i);
+		double cost;
+
+		if (!mirror->healthy)
+			continue;
+
+		cost = (mirror->active + 1) * (mirror->failures + 1) / MAX(mirror->rate, 1.0);
+		if (!best || cost < best_cost) {
+			best = mirror;
+			best_cost = cost;
+		}
+	}
+	/* all failed, so try them again in the configured order */
+	if (!best) {
+		for (guint i = 0; i < shared->mirrors->len; i++) {
+			RaucNBDMirror *mirror = g_ptr_array_index(shared->mirrors, i);
+			mirror->healthy = TRUE;
+			mirror->failures = 0;
+		}
+		best = g_ptr_array_index(shared->mirrors, 0);
+	}
+	best->active++;
+	g_mutex_unlock(&shared->lock);
+
+	return best;
+}
+
+/* Returns TRUE if another mirror than the given one is usable. Must be called
+ * with the lock held. */
+static gboolean have_other_mirror(struct RaucNBDShared *shared, const RaucNBDMirror *mirror)
+{
+	for (guint i = 0; i < shared->mirrors->len; i++) {
+		const RaucNBDMirror *other = g_ptr_array_index(shared->mirrors, i);
+
+		if (other != mirror && other->healthy)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/* Records the result of a request to a mirror. Failing mirrors are disabled
+ * as long as another one is available, so that an installation continues
+ * with the remaining mirrors. A 404 response disables the mirror
+ * immediately. Returns TRUE if the request should be retried on another
+ * mirror. */
+static gboolean finish_mirror_request(struct RaucNBDShared *shared, struct RaucNBDTransfer *xfer, gboolean success, long response_code)
+{
+	RaucNBDMirror *mirror = xfer->mirror;
+	gboolean failover = FALSE;
+	curl_off_t size = 0;
+	double total = 0;
+
+	if (!mirror)
+		return FALSE;
+	xfer->mirror = NULL;
+
+	if (success &&
+	    curl_easy_getinfo(xfer->easy, CURLINFO_SIZE_DOWNLOAD_T, &size) == CURLE_OK &&
+	    curl_easy_getinfo(xfer->easy, CURLINFO_TOTAL_TIME, &total) == CURLE_OK &&
+	    total > 0) {
+		double sample = size / total;
+
+		g_mutex_lock(&shared->lock);
+		mirror->rate += (sample - mirror->rate) * RAUC_NBD_MIRROR_RATE_WEIGHT;
+		mirror->failures = 0;
+		mirror->active--;
+		g_mutex_unlock(&shared->lock);
+		return FALSE;
+	}
+
+	g_mutex_lock(&shared->lock);
+	mirror->active--;
+	if (!success) {
+		mirror->failures++;
+		if (mirror->healthy && have_other_mirror(shared, mirror)) {
+			if (response_code == 404 || mirror->failures >= RAUC_NBD_MIRROR_FAILURES) {
+				g_message("nbd server disabling mirror %s after %u failed requests", mirror->url, mirror->failures);
+				mirror->healthy = FALSE;
+			}
+			failover = TRUE;
+		}
+	}
+	g_mutex_unlock(&shared->lock);
+
+	return failover;
+}
+
 static void start_read(struct RaucNBDContext *ctx, struct RaucNBDTransfer *xfer)
 {
 	CURLcode code = 0;
 	CURLMcode mcode = 0;
 	g_autofree gchar *range = NULL;
 
-	xfer->buffer = g_malloc(xfer->request.len);
-	xfer->buffer_size = xfer->request.len;
-	xfer->buffer_pos = 0;
+	g_assert_cmpuint(xfer->range_len, >=, xfer->request.len);
+
+	/* On retries, the data received so far is kept and only the missing
+	 * part is requested. */
+	if (!xfer->buffer) {
+		take_buffer(xfer, xfer->range_len);
+		xfer->buffer_size = xfer->range_len;
+		xfer->buffer_pos = 0;
+	}
+	g_assert_cmpint(xfer->buffer_pos, <, xfer->buffer_size);
 
 	prepare_curl(xfer);
+	xfer->mirror = select_mirror(ctx->shared);
+	if (xfer->mirror)
+		code |= curl_easy_setopt(xfer->easy, CURLOPT_URL, xfer->mirror->url);
 	code |= curl_easy_setopt(xfer->easy, CURLOPT_WRITEFUNCTION, write_cb);
 	code |= curl_easy_setopt(xfer->easy, CURLOPT_WRITEDATA, xfer);
 	range = g_strdup_printf("%"G_GUINT64_FORMAT "-%"G_GUINT64_FORMAT,
-			(guint64)xfer->request.from,
-			(guint64)xfer->request.from + xfer->request.len - 1);
+			xfer->range_from + xfer->buffer_pos,
+			xfer->range_from + xfer->range_len - 1);
 	code |= curl_easy_setopt(xfer->easy, CURLOPT_RANGE, range);
 	if (code)
 		g_error("unexpected error from curl_easy_setopt in %s", G_STRFUNC);
 
-	mcode = curl_multi_add_handle(ctx->multi, xfer->easy);
-	if (mcode != CURLM_OK)
-		g_error("unexpected error from curl_multi_add_handle in %s", G_STRFUNC);
+	mcode = curl_multi_add_handle(ctx->multi, xfer->easy);
+	if (mcode != CURLM_OK)
+		g_error("unexpected error from curl_multi_add_handle in %s", G_STRFUNC);
+}
+
+static gint compare_read_offset(gconstpointer a, gconstpointer b)
+{
+	const struct RaucNBDTransfer *xfer_a = *(struct RaucNBDTransfer *const *)a;
+	const struct RaucNBDTransfer *xfer_b = *(struct RaucNBDTransfer *const *)b;
+
+	if (xfer_a->request.from < xfer_b->request.from)
+		return -1;
+	if (xfer_a->request.from > xfer_b->request.from)
+		return 1;
+	return 0;
+}
+
+/* Sends the reply for a single read, with data from the (possibly larger)
+ * range buffer starting at range_from. */
+static void send_read_reply(struct RaucNBDContext *ctx, struct RaucNBDTransfer *xfer, const guint8 *range_buffer, guint64 range_from)
+{
+	struct iovec iov[2] = {
+		{
+			.iov_base = &xfer->reply,
+			.iov_len = sizeof(xfer->reply),
+		},
+	};
+	int iovcnt = 1;
+
+	/* send header and body with a single syscall */
+	if (xfer->reply.error == 0) {
+		iov[1].iov_base = (guint8 *)range_buffer + (xfer->request.from - range_from);
+		iov[1].iov_len = xfer->request.len;
+		iovcnt = 2;
+	}
+
+	if (!r_writev_exact(ctx->sock, iov, iovcnt, NULL))
+		g_error("failed to send nbd read reply");
+}
+
+/* Starts the HTTP request for a (merged) read. */
+static void start_range_read(struct RaucNBDContext *ctx, struct RaucNBDTransfer *xfer)
+{
+	/* Extend the range to complete cache blocks, so they can be stored. */
+	if (g_atomic_pointer_get(&ctx->shared->cache)) {
+		guint64 from = xfer->range_from - xfer->range_from % RAUC_NBD_CACHE_BLOCK;
+		guint64 end = xfer->range_from + xfer->range_len;
+		guint64 aligned_end = MIN(end + (RAUC_NBD_CACHE_BLOCK - end % RAUC_NBD_CACHE_BLOCK) % RAUC_NBD_CACHE_BLOCK,
+				ctx->data_size);
+
+		xfer->range_from = from;
+		xfer->range_len = MAX(end, aligned_end) - from;
+	}
+
+	start_read(ctx, xfer);
+}
+
+/* Replies to a read from a prefetched range, if it contains all data. The
+ * pinned data is not freed while the server is running, so it can be sent
+ * without holding the lock. */
+static gboolean read_from_pinned(struct RaucNBDContext *ctx, struct RaucNBDTransfer *xfer)
+{
+	const guint8 *data = NULL;
+	guint64 from = 0;
+
+	g_mutex_lock(&ctx->shared->lock);
+	for (guint i = 0; i < ctx->shared->pinned->len; i++) {
+		const RaucNBDPinned *pinned = &g_array_index(ctx->shared->pinned, RaucNBDPinned, i);
+
+		if (xfer->request.from >= pinned->from &&
+		    xfer->request.from + xfer->request.len <= pinned->from + pinned->len) {
+			data = pinned->data;
+			from = pinned->from;
+			break;
+		}
+	}
+	g_mutex_unlock(&ctx->shared->lock);
+	if (!data)
+		return FALSE;
+
+	send_read_reply(ctx, xfer, data, from);
+	r_stats_add(ctx->cache_hits, xfer->request.len);
+	free_transfer(xfer);
+
+	return TRUE;
+}
+
+/* Replies to a read from the prefetched ranges or the cache, if all data is
+ * available. */
+static gboolean read_from_cache(struct RaucNBDContext *ctx, struct RaucNBDTransfer *xfer)
+{
+	gboolean found = FALSE;
+
+	if (read_from_pinned(ctx, xfer))
+		return TRUE;
+
+	if (!g_atomic_pointer_get(&ctx->shared->cache))
+		return FALSE;
+
+	take_buffer(xfer, xfer->request.len);
+	g_mutex_lock(&ctx->shared->lock);
+	if (ctx->shared->cache)
+		found = cache_read(ctx->shared->cache, xfer->request.from, xfer->request.len, xfer->buffer);
+	g_mutex_unlock(&ctx->shared->lock);
+	if (!found) {
+		release_buffer(xfer);
+		return FALSE;
+	}
+
+	send_read_reply(ctx, xfer, xfer->buffer, xfer->request.from);
+	r_stats_add(ctx->cache_hits, xfer->request.len);
+	free_transfer(xfer);
+
+	return TRUE;
+}
+
+/* Starts queued reads as long as the window allows. */
+static void start_queued_reads(struct RaucNBDContext *ctx)
+{
+	while (ctx->active_reads < ctx->window && !g_queue_is_empty(&ctx->queued_reads)) {
+		start_range_read(ctx, g_queue_pop_head(&ctx->queued_reads));
+		ctx->active_reads++;
+	}
+}
+
+/* Adapts the window and range size to the network, similar to delay based
+ * TCP congestion control: The window grows by one request per window of
+ * successful requests, as long as the time to first byte does not increase
+ * (which indicates queuing at the server or on the link). Failures halve
+ * window and range size. Ranges grow while the latency dominates the transfer
+ * time and shrink again once the bandwidth does, so that the kernel does not
+ * wait for the end of long ranges. */
+static void adapt_flow_control(struct RaucNBDContext *ctx, struct RaucNBDTransfer *xfer, gboolean success)
+{
+	double starttransfer = 0;
+	double total = 0;
+	guint old_window = ctx->window;
+	guint64 old_merge_max = ctx->merge_max;
+
+	if (!success) {
+		ctx->window = MAX(1, ctx->window / 2);
+		ctx->merge_max = MAX(RAUC_NBD_MERGE_MIN, ctx->merge_max / 2);
+		ctx->window_acks = 0;
+		goto out;
+	}
+
+	if (curl_easy_getinfo(xfer->easy, CURLINFO_STARTTRANSFER_TIME, &starttransfer) != CURLE_OK ||
+	    curl_easy_getinfo(xfer->easy, CURLINFO_TOTAL_TIME, &total) != CURLE_OK)
+		return;
+
+	if (ctx->min_starttransfer == 0 || starttransfer < ctx->min_starttransfer)
+		ctx->min_starttransfer = starttransfer;
+
+	if (starttransfer > 2 * ctx->min_starttransfer + RAUC_NBD_QUEUE_DELAY) {
+		if (ctx->window > 1)
+			ctx->window--;
+		ctx->window_acks = 0;
+	} else if (++ctx->window_acks >= ctx->window) {
+		if (ctx->window < RAUC_NBD_WINDOW_MAX)
+			ctx->window++;
+		ctx->window_acks = 0;
+	}
+
+	/* only full ranges tell us something about the bandwidth */
+	if (xfer->range_len < ctx->merge_max / 2)
+		goto out;
+
+	if (total - starttransfer < starttransfer)
+		ctx->merge_max = MIN(RAUC_NBD_MERGE_MAX, ctx->merge_max * 2);
+	else if (total - starttransfer > 4 * starttransfer)
+		ctx->merge_max = MAX(RAUC_NBD_MERGE_MIN, ctx->merge_max / 2);
+
+out:
+	if (ctx->window != old_window || ctx->merge_max != old_merge_max)
+		g_debug("nbd server flow control: window %u, max range %"G_GUINT64_FORMAT " bytes",
+				ctx->window, ctx->merge_max);
+}
+
+/* Starts the queued reads, combining nearby ones into a single HTTP request.
+ * Reads available in the cache are answered directly.
+ * The pending array is emptied. */
+static void start_pending_reads(struct RaucNBDContext *ctx, GPtrArray *pending)
+{
+	struct RaucNBDTransfer *leader = NULL;
+
+	g_ptr_array_sort(pending, compare_read_offset);
+
+	for (guint i = 0; i < pending->len; i++) {
+		struct RaucNBDTransfer *xfer = g_ptr_array_index(pending, i);
+		guint64 end = xfer->request.from + xfer->request.len;
+
+		if (read_from_cache(ctx, xfer))
+			continue;
+
+		if (leader) {
+			guint64 leader_end = leader->range_from + leader->range_len;
+			guint64 merged_end = MAX(end, leader_end);
+
+			if (xfer->request.from <= leader_end + RAUC_NBD_MERGE_GAP &&
+			    merged_end - leader->range_from <= ctx->merge_max) {
+				leader->range_len = merged_end - leader->range_from;
+				if (!leader->merged)
+					leader->merged = g_ptr_array_new_with_free_func((GDestroyNotify)free_transfer);
+				g_ptr_array_add(leader->merged, xfer);
+				continue;
+			}
+
+			g_queue_push_tail(&ctx->queued_reads, leader);
+		}
+
+		leader = xfer;
+		leader->range_from = xfer->request.from;
+		leader->range_len = xfer->request.len;
+	}
+	if (leader)
+		g_queue_push_tail(&ctx->queued_reads, leader);
+
+	g_ptr_array_set_size(pending, 0);
+
+	start_queued_reads(ctx);
 }
 
 /* Appends Gstrv elements to curl_slist (strings are copied).
@@ -578,8 +1479,8 @@ static void start_configure(struct RaucNBDContext *ctx, struct RaucNBDTransfer *
 		g_autofree guint8 *data = g_malloc(xfer->request.len);
 		g_autoptr(GVariant) v = NULL;
 		g_auto(GVariantDict) dict = G_VARIANT_DICT_INIT(NULL);
-		g_auto(GStrv) headers = NULL; /* array of strings such as 'Foo: bar' */
 		g_auto(GStrv) info_headers = NULL; /* array of strings such as 'Foo: bar' */
+		guint64 rate_limit = 0;
 
 		res = r_read_exact(ctx->sock, (guint8*)data, xfer->request.len, NULL);
 		g_assert_true(res);
@@ -600,13 +1501,26 @@ static void start_configure(struct RaucNBDContext *ctx, struct RaucNBDTransfer *
 		g_variant_dict_lookup(&dict, "key", "s", &ctx->tls_key);
 		g_variant_dict_lookup(&dict, "ca", "s", &ctx->tls_ca);
 		g_variant_dict_lookup(&dict, "no-verify", "b", &ctx->tls_no_verify);
-		g_variant_dict_lookup(&dict, "headers", "^as", &headers);
+		g_variant_dict_lookup(&dict, "headers", "^as", &ctx->headers);
 		g_variant_dict_lookup(&dict, "info-headers", "^as", &info_headers);
+		g_variant_dict_lookup(&dict, "cache-dir", "s", &ctx->cache_dir);
+		g_variant_dict_lookup(&dict, "cache-size", "t", &ctx->cache_size);
+		g_variant_dict_lookup(&dict, "mirrors", "^as", &ctx->mirror_urls);
+		if (g_variant_dict_lookup(&dict, "tls-session-cache", "s", &ctx->shared->tls_session_cache)) {
+			g_autoptr(GError) ierror = NULL;
+
+			/* resume TLS sessions from previous runs */
+			if (!r_network_load_tls_sessions(ctx->shared->share, ctx->shared->tls_session_cache, &ierror))
+				g_message("nbd server: %s", ierror->message);
+		}
+		if (g_variant_dict_lookup(&dict, "rate-limit", "t", &rate_limit))
+			r_token_bucket_set_rate(&ctx->shared->rate_limit, rate_limit);
 		g_assert_nonnull(ctx->url);
+		ctx->cache_url = g_strdup(ctx->url);
 
-		if (headers) {
-			ctx->headers_slist = gstrv_add_to_slist(NULL, headers);
-			ctx->initial_headers_slist = gstrv_add_to_slist(NULL, headers);
+		if (ctx->headers) {
+			ctx->headers_slist = gstrv_add_to_slist(NULL, ctx->headers);
+			ctx->initial_headers_slist = gstrv_add_to_slist(NULL, ctx->headers);
 		}
 		if (info_headers) {
 			ctx->initial_headers_slist = gstrv_add_to_slist(ctx->initial_headers_slist, info_headers);
@@ -625,15 +1539,27 @@ static void start_configure(struct RaucNBDContext *ctx, struct RaucNBDTransfer *
 	code |= curl_easy_setopt(xfer->easy, CURLOPT_HEADERDATA, xfer);
 	code |= curl_easy_setopt(xfer->easy, CURLOPT_WRITEFUNCTION, write_cb);
 	code |= curl_easy_setopt(xfer->easy, CURLOPT_WRITEDATA, xfer);
-	/* we could try a HEAD request, but prefer to check if range requests work */
-	code |= curl_easy_setopt(xfer->easy, CURLOPT_RANGE, "0-3"); /* get the "sqsh" magic */
+	/* Instead of a HEAD request, fetch the end of the bundle with a suffix
+	 * range request. This checks that range requests work, returns the
+	 * bundle size in the Content-Range header and contains the signature
+	 * of typical bundles, which the client would read next. For servers
+	 * which don't support suffix ranges, only the "sqsh" magic is read. */
+	if (xfer->probe_prefix) {
+		code |= curl_easy_setopt(xfer->easy, CURLOPT_RANGE, "0-3");
+		xfer->buffer_size = 4;
+	} else {
+		code |= curl_easy_setopt(xfer->easy, CURLOPT_RANGE, "-" G_STRINGIFY(RAUC_NBD_TAIL_SIZE));
+		xfer->buffer_size = RAUC_NBD_TAIL_SIZE;
+	}
 
 	if (code)
 		g_error("unexpected error from curl_easy_setopt in %s", G_STRFUNC);
 
-	xfer->buffer = g_malloc(4);
-	xfer->buffer_size = 4;
+	xfer->buffer = g_malloc(xfer->buffer_size);
 	xfer->buffer_pos = 0;
+	xfer->content_size = 0;
+	xfer->range_from = 0;
+	xfer->range_len = 0;
 
 	g_debug("nbd server sending initial range request to HTTP server");
 
@@ -642,10 +1568,31 @@ static void start_configure(struct RaucNBDContext *ctx, struct RaucNBDTransfer *
 		g_error("unexpected error from curl_multi_add_handle in %s", G_STRFUNC);
 }
 
+static void start_prefetch(struct RaucNBDContext *ctx, struct RaucNBDTransfer *xfer)
+{
+	if (!xfer->request.len || xfer->request.len > RAUC_NBD_PREFETCH_MAX ||
+	    xfer->request.from + xfer->request.len > ctx->data_size) {
+		g_message("nbd server rejecting prefetch of %"G_GUINT32_FORMAT " bytes at %"G_GUINT64_FORMAT,
+				xfer->request.len, (guint64)xfer->request.from);
+		xfer->reply.error = GUINT32_TO_BE(22); /* NBD_EINVAL */
+		if (!r_write_exact(ctx->sock, (guint8*)&xfer->reply, sizeof(xfer->reply), NULL))
+			g_error("failed to send nbd prefetch reply");
+		free_transfer(xfer); /* not queued via curl_multi_add_handle */
+		return;
+	}
+
+	xfer->range_from = xfer->request.from;
+	xfer->range_len = xfer->request.len;
+	start_read(ctx, xfer);
+}
+
 static void start_request(struct RaucNBDContext *ctx, struct RaucNBDTransfer *xfer)
 {
+	R_TRACE3(nbd_request_start, xfer->request.type, xfer->request.from, xfer->request.len);
+
 	switch (xfer->request.type) {
 		case NBD_CMD_READ: {
+			r_stats_add(ctx->read_size, xfer->request.len);
 			start_read(ctx, xfer);
 			break;
 		}
@@ -659,6 +1606,10 @@ static void start_request(struct RaucNBDContext *ctx, struct RaucNBDTransfer *xf
 			start_configure(ctx, xfer);
 			break;
 		}
+		case RAUC_NBD_CMD_PREFETCH: {
+			start_prefetch(ctx, xfer);
+			break;
+		}
 		default: {
 			g_error("nbd server received bad request type");
 			break;
@@ -666,17 +1617,10 @@ static void start_request(struct RaucNBDContext *ctx, struct RaucNBDTransfer *xf
 	}
 }
 
-static gboolean finish_read(struct RaucNBDContext *ctx, struct RaucNBDTransfer *xfer)
+/* If the reply is considered error-free so far, checks that the response
+ * code is actually 206 and that the complete range was received. */
+static void check_range_response(struct RaucNBDTransfer *xfer)
 {
-	gboolean res = FALSE;
-
-	if (!xfer->done) { /* retry */
-		res = TRUE;
-		goto out;
-	}
-
-	/* If reply is considered error-free so far, check that response_code
-	 * is actually 206 */
 	if (xfer->reply.error == 0) {
 		long response_code = 0;
 		CURLcode code = curl_easy_getinfo(xfer->easy, CURLINFO_RESPONSE_CODE, &response_code);
@@ -689,25 +1633,198 @@ static gboolean finish_read(struct RaucNBDContext *ctx, struct RaucNBDTransfer *
 		}
 	}
 
-	if (!r_write_exact(ctx->sock, (guint8*)&xfer->reply, sizeof(xfer->reply), NULL))
-		g_error("failed to send nbd read reply header");
-	if (xfer->reply.error == 0) {
-		if (xfer->buffer_size != xfer->buffer_pos)
-			g_error("incomplete data received from server");
+	if (xfer->reply.error == 0 && xfer->buffer_size != xfer->buffer_pos)
+		g_error("incomplete data received from server");
+}
+
+/* Must be called with the shared lock held. */
+static void store_in_cache(struct RaucNBDShared *shared, guint64 from, const guint8 *data, guint64 len)
+{
+	g_autoptr(GError) ierror = NULL;
+
+	if (shared->cache && !cache_store(shared->cache, from, data, len, &ierror)) {
+		g_message("nbd server disabling block cache: %s", ierror->message);
+		g_clear_pointer(&shared->cache, cache_free);
+	}
+}
+
+static gboolean finish_read(struct RaucNBDContext *ctx, struct RaucNBDTransfer *xfer)
+{
+	gboolean res = FALSE;
 
-		if (!r_write_exact(ctx->sock, xfer->buffer, xfer->buffer_size, NULL))
-			g_error("failed to send nbd read reply body");
+	if (!xfer->done) /* retry, keeping the received data */
+		return TRUE;
+
+	check_range_response(xfer);
+
+	send_read_reply(ctx, xfer, xfer->buffer, xfer->range_from);
+	if (xfer->merged) {
+		for (guint i = 0; i < xfer->merged->len; i++) {
+			struct RaucNBDTransfer *merged = g_ptr_array_index(xfer->merged, i);
+			merged->reply.error = xfer->reply.error;
+			send_read_reply(ctx, merged, xfer->buffer, xfer->range_from);
+		}
+	}
+
+	if (xfer->reply.error == 0 && g_atomic_pointer_get(&ctx->shared->cache)) {
+		g_mutex_lock(&ctx->shared->lock);
+		store_in_cache(ctx->shared, xfer->range_from, xfer->buffer, xfer->range_len);
+		g_mutex_unlock(&ctx->shared->lock);
 	}
 
 	collect_curl_stats(ctx, xfer);
 
 	res = TRUE;
 out:
-	g_clear_pointer(&xfer->buffer, g_free);
+	release_buffer(xfer);
 
 	return res;
 }
 
+/* Keeps the downloaded range in memory and replies with the header only. */
+static gboolean finish_prefetch(struct RaucNBDContext *ctx, struct RaucNBDTransfer *xfer)
+{
+	struct RaucNBDShared *shared = ctx->shared;
+
+	if (!xfer->done) /* retry, keeping the received data */
+		return TRUE;
+
+	check_range_response(xfer);
+
+	if (xfer->reply.error == 0) {
+		g_mutex_lock(&shared->lock);
+		if (shared->pinned_size + xfer->range_len <= RAUC_NBD_PREFETCH_MAX) {
+			RaucNBDPinned pinned = {
+				.from = xfer->range_from,
+				.len = xfer->range_len,
+				.data = g_steal_pointer(&xfer->buffer),
+			};
+
+			xfer->buffer_alloc = 0;
+			store_in_cache(shared, pinned.from, pinned.data, pinned.len);
+			g_array_append_val(shared->pinned, pinned);
+			shared->pinned_size += pinned.len;
+		} else {
+			g_message("nbd server prefetch limit of %d bytes reached", RAUC_NBD_PREFETCH_MAX);
+			xfer->reply.error = GUINT32_TO_BE(28); /* NBD_ENOSPC */
+		}
+		g_mutex_unlock(&shared->lock);
+	}
+
+	if (!r_write_exact(ctx->sock, (guint8*)&xfer->reply, sizeof(xfer->reply), NULL))
+		g_error("failed to send nbd prefetch reply");
+
+	collect_curl_stats(ctx, xfer);
+	release_buffer(xfer);
+
+	return TRUE;
+}
+
+/* Estimates the throughput of a server from the time to first byte of a
+ * small request, assuming that typical requests are latency bound. */
+static double estimate_mirror_rate(CURL *easy)
+{
+	double starttransfer = 0;
+
+	if (curl_easy_getinfo(easy, CURLINFO_STARTTRANSFER_TIME, &starttransfer) != CURLE_OK ||
+	    starttransfer <= 0)
+		return 1.0;
+
+	return RAUC_NBD_MERGE_INITIAL / starttransfer;
+}
+
+/* Checks the additional mirrors in parallel by requesting the last byte of
+ * the bundle. Mirrors are only used if they support range requests and
+ * serve the same bundle as the configured URL (same size and, if both
+ * servers send them, the same ETag and Last-Modified time). */
+static void probe_mirrors(struct RaucNBDContext *ctx, struct RaucNBDTransfer *primary)
+{
+	g_autoptr(GPtrArray) probes = g_ptr_array_new();
+	CURLM *multi = NULL;
+	int still_running = 0;
+	RaucNBDMirror *mirror = NULL;
+
+	mirror = g_new0(RaucNBDMirror, 1);
+	mirror->url = g_strdup(ctx->url);
+	mirror->healthy = TRUE;
+	mirror->rate = estimate_mirror_rate(primary->easy);
+	ctx->shared->mirrors = g_ptr_array_new_with_free_func((GDestroyNotify)free_mirror);
+	g_ptr_array_add(ctx->shared->mirrors, mirror);
+
+	if (!ctx->mirror_urls || !ctx->mirror_urls[0])
+		return;
+
+	multi = curl_multi_init();
+	if (!multi)
+		g_error("unexpected error from curl_multi_init in %s", G_STRFUNC);
+
+	for (gchar **url = ctx->mirror_urls; *url; url++) {
+		struct RaucNBDTransfer *xfer = g_new0(struct RaucNBDTransfer, 1);
+		CURLcode code = 0;
+
+		xfer->ctx = ctx;
+		xfer->easy = new_curl(ctx);
+		xfer->buffer = g_malloc(1);
+		xfer->buffer_size = 1;
+		code |= curl_easy_setopt(xfer->easy, CURLOPT_URL, *url);
+		code |= curl_easy_setopt(xfer->easy, CURLOPT_ERRORBUFFER, xfer->errbuf);
+		code |= curl_easy_setopt(xfer->easy, CURLOPT_HEADERFUNCTION, header_cb);
+		code |= curl_easy_setopt(xfer->easy, CURLOPT_HEADERDATA, xfer);
+		code |= curl_easy_setopt(xfer->easy, CURLOPT_WRITEFUNCTION, write_cb);
+		code |= curl_easy_setopt(xfer->easy, CURLOPT_WRITEDATA, xfer);
+		code |= curl_easy_setopt(xfer->easy, CURLOPT_RANGE, "-1");
+		code |= curl_easy_setopt(xfer->easy, CURLOPT_TIMEOUT, 30L);
+		if (code)
+			g_error("unexpected error from curl_easy_setopt in %s", G_STRFUNC);
+		if (curl_multi_add_handle(multi, xfer->easy) != CURLM_OK)
+			g_error("unexpected error from curl_multi_add_handle in %s", G_STRFUNC);
+		g_ptr_array_add(probes, xfer);
+	}
+
+	do {
+		if (curl_multi_perform(multi, &still_running) != CURLM_OK)
+			g_error("unexpected error from curl_multi_perform in %s", G_STRFUNC);
+		if (still_running && curl_multi_wait(multi, NULL, 0, 1000, NULL) != CURLM_OK)
+			g_error("unexpected error from curl_multi_wait in %s", G_STRFUNC);
+	} while (still_running);
+
+	for (guint i = 0; i < probes->len; i++) {
+		struct RaucNBDTransfer *xfer = g_ptr_array_index(probes, i);
+		const gchar *url = ctx->mirror_urls[i];
+		const char *effective_url = NULL;
+		long response_code = 0;
+
+		curl_easy_getinfo(xfer->easy, CURLINFO_RESPONSE_CODE, &response_code);
+		if (response_code != 206 || xfer->buffer_pos != 1) {
+			g_message("nbd server not using mirror %s: range request failed (HTTP %ld) %s", url, response_code, xfer->errbuf);
+		} else if (xfer->content_size != primary->content_size) {
+			g_message("nbd server not using mirror %s: size %"G_GUINT64_FORMAT " differs from %"G_GUINT64_FORMAT,
+					url, xfer->content_size, primary->content_size);
+		} else if (xfer->etag && primary->etag && !g_str_equal(xfer->etag, primary->etag)) {
+			g_message("nbd server not using mirror %s: ETag %s differs from %s", url, xfer->etag, primary->etag);
+		} else if (xfer->modified_time && primary->modified_time && xfer->modified_time != primary->modified_time) {
+			g_message("nbd server not using mirror %s: Last-Modified time differs", url);
+		} else {
+			mirror = g_new0(RaucNBDMirror, 1);
+			if (curl_easy_getinfo(xfer->easy, CURLINFO_EFFECTIVE_URL, &effective_url) == CURLE_OK && effective_url)
+				mirror->url = g_strdup(effective_url);
+			else
+				mirror->url = g_strdup(url);
+			mirror->healthy = TRUE;
+			mirror->rate = estimate_mirror_rate(xfer->easy);
+			g_message("nbd server using mirror %s (estimated %.0f bytes/s)", mirror->url, mirror->rate);
+			g_ptr_array_add(ctx->shared->mirrors, mirror);
+		}
+
+		curl_multi_remove_handle(multi, xfer->easy);
+		curl_easy_cleanup(xfer->easy);
+		xfer->easy = NULL;
+		free_transfer(xfer);
+	}
+
+	curl_multi_cleanup(multi);
+}
+
 static gboolean finish_configure(struct RaucNBDContext *ctx, struct RaucNBDTransfer *xfer)
 {
 	gboolean res = FALSE;
@@ -755,7 +1872,7 @@ static gboolean finish_configure(struct RaucNBDContext *ctx, struct RaucNBDTrans
 		goto reply;
 	}
 
-	if (xfer->buffer_size != xfer->buffer_pos) {
+	if (!xfer->content_size || (guint64)xfer->buffer_pos != xfer->range_len) {
 		g_variant_dict_insert(&dict, "error", "s", "incomplete HTTP response");
 		res = FALSE;
 		goto reply;
@@ -785,6 +1902,36 @@ static gboolean finish_configure(struct RaucNBDContext *ctx, struct RaucNBDTrans
 
 	collect_curl_stats(ctx, xfer);
 
+	if (!ctx->shared->mirrors)
+		probe_mirrors(ctx, xfer);
+
+	if (ctx->cache_dir && !ctx->shared->cache) {
+		g_autoptr(GError) ierror = NULL;
+
+		if (!xfer->etag && !xfer->modified_time) {
+			g_message("nbd server not using block cache: neither ETag nor Last-Modified received");
+		} else if (!xfer->content_size) {
+			g_message("nbd server not using block cache: unknown bundle size");
+		} else {
+			RaucNBDCache *cache = cache_open(ctx->cache_dir, ctx->cache_size, ctx->cache_url,
+					xfer->etag, xfer->modified_time, xfer->content_size, &ierror);
+			if (cache) {
+				g_message("nbd server using block cache %s (%"G_GUINT64_FORMAT " bytes available)",
+						cache->data_path, cache->cached_blocks * RAUC_NBD_CACHE_BLOCK);
+				g_mutex_lock(&ctx->shared->lock);
+				ctx->shared->cache = cache;
+				if (!xfer->probe_prefix &&
+				    !cache_store(cache, xfer->range_from, xfer->buffer, xfer->range_len, &ierror)) {
+					g_message("nbd server failed to store bundle tail in block cache: %s", ierror->message);
+					g_clear_error(&ierror);
+				}
+				g_mutex_unlock(&ctx->shared->lock);
+			} else {
+				g_message("nbd server not using block cache: %s", ierror->message);
+			}
+		}
+	}
+
 	res = TRUE;
 
 reply:
@@ -804,6 +1951,12 @@ reply:
 		g_variant_dict_insert(&dict, "modified-time", "t", xfer->modified_time);
 	if (xfer->etag)
 		g_variant_dict_insert(&dict, "etag", "s", xfer->etag);
+	if (res && !xfer->probe_prefix) {
+		/* the client reads the signature from this */
+		g_variant_dict_insert(&dict, "tail-offset", "t", xfer->range_from);
+		g_variant_dict_insert_value(&dict, "tail",
+				g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE, xfer->buffer, xfer->range_len, 1));
+	}
 
 	v = g_variant_dict_end(&dict);
 	reply_size = g_variant_get_size(v);
@@ -813,8 +1966,11 @@ reply:
 	if (!r_write_exact(ctx->sock, g_variant_get_data(v), g_variant_get_size(v), NULL))
 		g_error("failed to send nbd config reply body");
 
+	if (res)
+		start_workers(ctx);
+
 out:
-	g_clear_pointer(&xfer->buffer, g_free);
+	release_buffer(xfer);
 
 	return res;
 }
@@ -832,104 +1988,273 @@ static gboolean finish_request(struct RaucNBDContext *ctx, struct RaucNBDTransfe
 			res = finish_configure(ctx, xfer);
 			break;
 		}
+		case RAUC_NBD_CMD_PREFETCH: {
+			res = finish_prefetch(ctx, xfer);
+			break;
+		}
 		default: {
 			g_message("bad request type");
 			break;
 		}
 	}
 
+	R_TRACE4(nbd_request_finish, xfer->request.type, xfer->request.from, xfer->request.len, res);
+
 	if (xfer->easy) {
 		curl_multi_remove_handle(ctx->multi, xfer->easy);
-		curl_easy_cleanup(xfer->easy);
+		/* The configure request uses different options and a URL
+		 * which may be redirected, so only range request handles are
+		 * kept. */
+		if (is_range_request(xfer) && ctx->idle_easy->len < RAUC_NBD_IDLE_EASY) {
+			g_ptr_array_add(ctx->idle_easy, xfer->easy);
+		} else {
+			curl_easy_cleanup(xfer->easy);
+		}
 		xfer->easy = NULL;
 	}
 
 	return res;
 }
 
-gboolean r_nbd_run_server(gint sock, GError **error)
+static void share_lock_cb(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr)
 {
-	GError *ierror = NULL;
-	gboolean res = FALSE;
-	struct RaucNBDContext ctx = {0};
-	struct curl_waitfd waitfd = {0};
+	struct RaucNBDShared *shared = userptr;
 
-	g_return_val_if_fail(sock >= 0, FALSE);
-	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+	g_mutex_lock(&shared->share_locks[data]);
+}
 
-	if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) == -1) {
-		g_set_error(
-				error,
-				G_FILE_ERROR, g_file_error_from_errno(errno),
-				"failed to enable NO_NEW_PRIVS: %s", strerror(errno));
+static void share_unlock_cb(CURL *handle, curl_lock_data data, void *userptr)
+{
+	struct RaucNBDShared *shared = userptr;
+
+	g_mutex_unlock(&shared->share_locks[data]);
+}
+
+static void init_context(struct RaucNBDContext *ctx, gint sock, struct RaucNBDShared *shared)
+{
+	ctx->sock = sock;
+	ctx->shared = shared;
+
+	ctx->read_size = r_stats_new("nbd read size");
+	ctx->cache_hits = r_stats_new("nbd cache hits");
+	ctx->dl_size = r_stats_new("nbd dl_size");
+	ctx->dl_speed = r_stats_new("nbd dl_speed");
+	ctx->namelookup = r_stats_new("nbd namelookup");
+	ctx->connect = r_stats_new("nbd connect");
+	ctx->starttransfer = r_stats_new("nbd starttransfer");
+	ctx->total = r_stats_new("nbd total");
+
+	ctx->multi = curl_multi_init();
+	if (!ctx->multi)
+		g_error("unexpected error from curl_multi_init in %s", G_STRFUNC);
+	if (curl_multi_setopt(ctx->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX) != CURLM_OK)
+		g_error("unexpected error from curl_multi_setopt in %s", G_STRFUNC);
+	ctx->idle_easy = g_ptr_array_new_with_free_func((GDestroyNotify)curl_easy_cleanup);
+	ctx->idle_buffers = g_array_new(FALSE, FALSE, sizeof(RaucNBDBuffer));
+
+	g_queue_init(&ctx->queued_reads);
+	g_queue_init(&ctx->retries);
+	ctx->window = RAUC_NBD_WINDOW_INITIAL;
+	ctx->merge_max = RAUC_NBD_MERGE_INITIAL;
+}
+
+static void clear_context(struct RaucNBDContext *ctx)
+{
+	r_stats_show(ctx->read_size, NULL);
+	r_stats_show(ctx->cache_hits, NULL);
+	r_stats_show(ctx->dl_size, NULL);
+	r_stats_show(ctx->dl_speed, NULL);
+	r_stats_show(ctx->namelookup, NULL);
+	r_stats_show(ctx->connect, NULL);
+	r_stats_show(ctx->starttransfer, NULL);
+	r_stats_show(ctx->total, NULL);
+	g_message("nbd server flow control: final window %u, max range %"G_GUINT64_FORMAT " bytes",
+			ctx->window, ctx->merge_max);
+
+	g_mutex_lock(&ctx->shared->lock);
+	ctx->shared->downloaded += ctx->dl_size->sum;
+	g_mutex_unlock(&ctx->shared->lock);
+
+	g_clear_pointer(&ctx->url, g_free);
+	g_clear_pointer(&ctx->tls_cert, g_free);
+	g_clear_pointer(&ctx->tls_key, g_free);
+	g_clear_pointer(&ctx->tls_ca, g_free);
+	g_clear_pointer(&ctx->headers, g_strfreev);
+	g_clear_pointer(&ctx->cache_dir, g_free);
+	g_clear_pointer(&ctx->cache_url, g_free);
+	g_clear_pointer(&ctx->mirror_urls, g_strfreev);
+	g_clear_pointer(&ctx->read_size, r_stats_free);
+	g_clear_pointer(&ctx->cache_hits, r_stats_free);
+	g_clear_pointer(&ctx->dl_size, r_stats_free);
+	g_clear_pointer(&ctx->dl_speed, r_stats_free);
+	g_clear_pointer(&ctx->namelookup, r_stats_free);
+	g_clear_pointer(&ctx->connect, r_stats_free);
+	g_clear_pointer(&ctx->starttransfer, r_stats_free);
+	g_clear_pointer(&ctx->total, r_stats_free);
+	g_queue_clear_full(&ctx->queued_reads, (GDestroyNotify)free_transfer);
+	g_queue_clear_full(&ctx->retries, (GDestroyNotify)free_transfer);
+	g_clear_pointer(&ctx->idle_easy, g_ptr_array_unref);
+	for (guint i = 0; i < ctx->idle_buffers->len; i++)
+		g_free(g_array_index(ctx->idle_buffers, RaucNBDBuffer, i).data);
+	g_clear_pointer(&ctx->idle_buffers, g_array_unref);
+	g_clear_pointer(&ctx->multi, curl_multi_cleanup);
+	g_clear_pointer(&ctx->headers_slist, curl_slist_free_all);
+	g_clear_pointer(&ctx->initial_headers_slist, curl_slist_free_all);
+}
+
+/* Decides whether a failed transfer may be retried. A read which received
+ * more data since the last attempt starts with a fresh per-request limit, but
+ * all retries count against the budget for the whole installation. */
+static gboolean consume_retry(struct RaucNBDContext *ctx, struct RaucNBDTransfer *xfer)
+{
+	if (is_range_request(xfer)) {
+		if (xfer->buffer_pos > xfer->resume_pos)
+			xfer->errors = 0;
+		xfer->resume_pos = xfer->buffer_pos;
+	}
+
+	if (xfer->errors >= RAUC_NBD_RETRIES)
+		return FALSE;
+
+	if (g_atomic_int_add(&ctx->shared->retry_budget, -1) <= 0) {
+		g_message("nbd server retry budget of %d exhausted", RAUC_NBD_RETRY_BUDGET);
 		return FALSE;
 	}
 
-	// let us handle broken pipes explicitly
-	signal(SIGPIPE, SIG_IGN);
+	xfer->errors++;
+	return TRUE;
+}
 
-	g_message("nbd server running as UID %d, GID %d", getuid(), getgid());
+static gint compare_retry_at(gconstpointer a, gconstpointer b, gpointer user_data)
+{
+	const struct RaucNBDTransfer *xfer_a = a;
+	const struct RaucNBDTransfer *xfer_b = b;
+
+	if (xfer_a->retry_at < xfer_b->retry_at)
+		return -1;
+	if (xfer_a->retry_at > xfer_b->retry_at)
+		return 1;
+	return 0;
+}
+
+/* Queues a transfer for a retry after a jittered exponential backoff. */
+static void schedule_retry(struct RaucNBDContext *ctx, struct RaucNBDTransfer *xfer)
+{
+	gint64 delay = RAUC_NBD_RETRY_DELAY_MIN << MIN(xfer->errors - 1, 16);
+
+	delay = MIN(delay, RAUC_NBD_RETRY_DELAY_MAX);
+	/* randomize the upper half to avoid retrying all requests at once */
+	delay = delay / 2 + g_random_int_range(0, (gint32)(delay / 2 + 1));
+	xfer->retry_at = g_get_monotonic_time() + delay;
+
+	g_queue_insert_sorted(&ctx->retries, xfer, compare_retry_at, NULL);
+}
+
+static void start_due_retries(struct RaucNBDContext *ctx)
+{
+	gint64 now = g_get_monotonic_time();
+
+	while (!g_queue_is_empty(&ctx->retries)) {
+		struct RaucNBDTransfer *xfer = g_queue_peek_head(&ctx->retries);
 
-	ctx.dl_size = r_stats_new("nbd dl_size");
-	ctx.dl_speed = r_stats_new("nbd dl_speed");
-	ctx.namelookup = r_stats_new("nbd namelookup");
-	ctx.connect = r_stats_new("nbd connect");
-	ctx.starttransfer = r_stats_new("nbd starttransfer");
-	ctx.total = r_stats_new("nbd total");
+		if (xfer->retry_at > now)
+			break;
+
+		start_request(ctx, g_queue_pop_head(&ctx->retries));
+	}
+}
 
-	ctx.sock = sock;
-	ctx.multi = curl_multi_init();
+/* Handles requests from one socket until the client disconnects. */
+static gboolean serve(struct RaucNBDContext *ctx, GError **error)
+{
+	GError *ierror = NULL;
+	gboolean res = FALSE;
+	struct curl_waitfd waitfd = {0};
 
-	waitfd.fd = sock;
+	waitfd.fd = ctx->sock;
 	waitfd.events = CURL_WAIT_POLLIN;
 
-	while (!ctx.done) {
+	while (!ctx->done) {
 		int numfds = 0;
 		int still_running = 0;
-		CURLMcode mcode = curl_multi_wait(ctx.multi, &waitfd, 1, 1000, &numfds);
+		int timeout_ms = 1000;
+		CURLMcode mcode = 0;
+
+		if (!g_queue_is_empty(&ctx->retries)) {
+			struct RaucNBDTransfer *next = g_queue_peek_head(&ctx->retries);
+			gint64 wait = next->retry_at - g_get_monotonic_time();
+
+			timeout_ms = CLAMP(wait / G_TIME_SPAN_MILLISECOND, 0, timeout_ms);
+		}
+
+		mcode = curl_multi_wait(ctx->multi, &waitfd, 1, timeout_ms, &numfds);
 		if (mcode != CURLM_OK)
 			g_error("unexpected error from curl_multi_wait in %s", G_STRFUNC);
 
-		if ((numfds > 0) && (waitfd.revents & CURL_WAIT_POLLIN)) { /* new event from the client */
-			struct RaucNBDTransfer *xfer = g_malloc0(sizeof(struct RaucNBDTransfer));
-			xfer->ctx = &ctx;
+		if ((numfds > 0) && (waitfd.revents & CURL_WAIT_POLLIN)) { /* new events from the client */
+			g_autoptr(GPtrArray) pending_reads = g_ptr_array_new();
+			struct pollfd pollfd = {
+				.fd = ctx->sock,
+				.events = POLLIN,
+			};
+
+			/* Collect all requests which are already available, so that
+			 * nearby reads can be combined. */
+			do {
+				struct RaucNBDTransfer *xfer = g_malloc0(sizeof(struct RaucNBDTransfer));
+				xfer->ctx = ctx;
+
+				res = r_read_exact(ctx->sock, (guint8*)&xfer->request, sizeof(xfer->request), &ierror);
+				if (!res) {
+					free_transfer(xfer);
+					g_ptr_array_set_free_func(pending_reads, (GDestroyNotify)free_transfer);
+					if (!ierror) { /* disconnected */
+						ctx->done = TRUE;
+						break;
+					} else {
+						g_propagate_prefixed_error(
+								error,
+								ierror,
+								"failed to read request from client: ");
+						return FALSE;
+					}
+				}
 
-			res = r_read_exact(sock, (guint8*)&xfer->request, sizeof(xfer->request), &ierror);
-			if (!res) {
-				if (!ierror) { /* disconnected */
-					ctx.done = TRUE;
-					break;
+				g_assert(xfer->request.magic == GUINT32_TO_BE(NBD_REQUEST_MAGIC));
+				xfer->request.type = GUINT32_FROM_BE(xfer->request.type);
+				xfer->request.from = GUINT64_FROM_BE(xfer->request.from);
+				xfer->request.len = GUINT32_FROM_BE(xfer->request.len);
+				//g_message("type 0x%x: from 0x%llx+0x%x", xfer->request.type, xfer->request.from, xfer->request.len);
+
+				xfer->reply.magic = GUINT32_TO_BE(NBD_REPLY_MAGIC);
+				memcpy(xfer->reply.handle, xfer->request.handle, sizeof(xfer->reply.handle));
+
+				if (xfer->request.type == NBD_CMD_READ) {
+					g_ptr_array_add(pending_reads, xfer);
 				} else {
-					g_propagate_prefixed_error(
-							error,
-							ierror,
-							"failed to read request from client: ");
-					res = FALSE;
-					goto out;
+					/* keep earlier reads before other commands */
+					start_pending_reads(ctx, pending_reads);
+					start_request(ctx, xfer);
 				}
-			}
-
-			g_assert(xfer->request.magic == GUINT32_TO_BE(NBD_REQUEST_MAGIC));
-			xfer->request.type = GUINT32_FROM_BE(xfer->request.type);
-			xfer->request.from = GUINT64_FROM_BE(xfer->request.from);
-			xfer->request.len = GUINT32_FROM_BE(xfer->request.len);
-			//g_message("type 0x%x: from 0x%llx+0x%x", xfer->request.type, xfer->request.from, xfer->request.len);
+			} while (!ctx->done && pending_reads->len < RAUC_NBD_MAX_PENDING &&
+			         poll(&pollfd, 1, 0) > 0 && (pollfd.revents & POLLIN));
 
-			xfer->reply.magic = GUINT32_TO_BE(NBD_REPLY_MAGIC);
-			memcpy(xfer->reply.handle, xfer->request.handle, sizeof(xfer->reply.handle));
+			if (ctx->done)
+				break;
 
-			start_request(&ctx, xfer);
+			start_pending_reads(ctx, pending_reads);
 		}
 
-		mcode = curl_multi_perform(ctx.multi, &still_running);
+		mcode = curl_multi_perform(ctx->multi, &still_running);
 		g_assert(mcode == CURLM_OK);
 
 		while (1) {
 			CURLcode code = 0;
 			long response_code = 0;
+			gboolean failover = FALSE;
 			int msgs_in_queue = 0;
 			struct RaucNBDTransfer *xfer = NULL;
-			struct CURLMsg *msg = curl_multi_info_read(ctx.multi, &msgs_in_queue);
+			struct CURLMsg *msg = curl_multi_info_read(ctx->multi, &msgs_in_queue);
 			if (!msg)
 				break;
 
@@ -945,70 +2270,211 @@ gboolean r_nbd_run_server(gint sock, GError **error)
 			if (code != CURLE_OK)
 				g_error("unexpected error from curl_easy_getinfo in %s", G_STRFUNC);
 
-			if (msg->data.result == CURLE_OK) {
+			if (is_range_request(xfer))
+				failover = finish_mirror_request(ctx->shared, xfer, msg->data.result == CURLE_OK, response_code);
+
+			if (xfer->request.type == RAUC_NBD_CMD_CONFIGURE && !xfer->probe_prefix &&
+			    (response_code == 200 || response_code == 416)) {
+				/* The server ignored or rejected the suffix range,
+				 * so try a regular range request instead. */
+				g_message("nbd server: suffix range request not supported (HTTP %ld), retrying with regular range", response_code);
+				xfer->probe_prefix = TRUE;
+				xfer->errors = 1; /* minimal retry delay */
+			} else if (msg->data.result == CURLE_OK) {
 				g_debug("request done");
 				xfer->reply.error = 0;
 				xfer->done = TRUE;
-			} else if (response_code == 404) {
+			} else if (response_code == 404 && !failover) {
 				g_message("request failed (not found)");
 				xfer->reply.error = GUINT32_TO_BE(5); /* NBD_EIO */
 				xfer->done = TRUE;
-			} else if (xfer->errors >= 5) {
-				g_message("request failed (no more retries)");
+			} else if (is_range_request(xfer) && xfer->buffer &&
+			           xfer->buffer_pos == xfer->buffer_size) {
+				g_message("request failed after receiving all data: %s (using the data)", xfer->errbuf);
+				xfer->reply.error = 0;
+				xfer->done = TRUE;
+			} else if (!consume_retry(ctx, xfer)) {
+				g_message("request failed: %s (no more retries)", xfer->errbuf);
 				xfer->reply.error = GUINT32_TO_BE(5); /* NBD_EIO */
 				xfer->done = TRUE;
 			} else {
-				xfer->errors++;
-				g_message("request failed: %s (retrying %d/5)", xfer->errbuf, xfer->errors);
+				g_message("request failed: %s (retrying %u/%d%s)", xfer->errbuf, xfer->errors, RAUC_NBD_RETRIES,
+						xfer->buffer_pos ? ", resuming" : "");
 			}
 
-			res = finish_request(&ctx, xfer);
+			if (xfer->request.type == NBD_CMD_READ)
+				adapt_flow_control(ctx, xfer, msg->data.result == CURLE_OK || response_code == 404);
+
+			res = finish_request(ctx, xfer);
 			if (!res) {
 				g_set_error(
 						error,
 						R_NBD_ERROR, R_NBD_ERROR_SHUTDOWN,
 						"finish_request failed, shutting down");
 				free_transfer(xfer);
-				goto out;
+				return FALSE;
 			}
 
 			if (xfer->done) {
+				if (xfer->request.type == NBD_CMD_READ)
+					ctx->active_reads--;
 				free_transfer(xfer);
 			} else {
-				/* retry */
-				sleep(1);
-				start_request(&ctx, xfer);
+				schedule_retry(ctx, xfer);
 			}
 		}
+
+		start_due_retries(ctx);
+		start_queued_reads(ctx);
 	}
 
-	res = TRUE;
-out:
-	r_stats_show(ctx.dl_size, NULL);
-	r_stats_show(ctx.dl_speed, NULL);
-	r_stats_show(ctx.namelookup, NULL);
-	r_stats_show(ctx.connect, NULL);
-	r_stats_show(ctx.starttransfer, NULL);
-	r_stats_show(ctx.total, NULL);
+	return TRUE;
+}
+
+static gpointer worker_thread(gpointer data)
+{
+	struct RaucNBDContext *ctx = data;
+	g_autoptr(GError) ierror = NULL;
+
+	if (!serve(ctx, &ierror))
+		g_message("nbd server connection %d failed: %s", ctx->sock, ierror ? ierror->message : "unknown error");
+
+	clear_context(ctx);
+	g_free(ctx);
+
+	return NULL;
+}
+
+/* Starts the threads for the additional connections, using the configuration
+ * received on the first one. */
+static void start_workers(struct RaucNBDContext *ctx)
+{
+	struct RaucNBDShared *shared = ctx->shared;
+
+	if (shared->workers)
+		return;
+
+	shared->workers = g_ptr_array_new();
+
+	for (guint i = 0; i < shared->extra_socks; i++) {
+		struct RaucNBDContext *worker = g_new0(struct RaucNBDContext, 1);
+
+		init_context(worker, shared->first_extra_sock + i, shared);
+		worker->data_size = ctx->data_size;
+		worker->url = g_strdup(ctx->url);
+		worker->tls_cert = g_strdup(ctx->tls_cert);
+		worker->tls_key = g_strdup(ctx->tls_key);
+		worker->tls_ca = g_strdup(ctx->tls_ca);
+		worker->tls_no_verify = ctx->tls_no_verify;
+		if (ctx->headers)
+			worker->headers_slist = gstrv_add_to_slist(NULL, ctx->headers);
+
+		g_ptr_array_add(shared->workers, g_thread_new("rauc-nbd", worker_thread, worker));
+	}
+
+	if (shared->extra_socks)
+		g_message("nbd server using %u connections", shared->extra_socks + 1);
+}
+
+static void clear_pinned(gpointer data)
+{
+	RaucNBDPinned *pinned = data;
+
+	g_free(pinned->data);
+}
+
+gboolean r_nbd_run_server(gint sock, guint connections, GError **error)
+{
+	gboolean res = FALSE;
+	struct RaucNBDShared shared = {0};
+	struct RaucNBDContext ctx = {0};
+	CURLSHcode scode = 0;
+
+	g_return_val_if_fail(sock >= 0, FALSE);
+	g_return_val_if_fail(connections >= 1, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) == -1) {
+		g_set_error(
+				error,
+				G_FILE_ERROR, g_file_error_from_errno(errno),
+				"failed to enable NO_NEW_PRIVS: %s", strerror(errno));
+		return FALSE;
+	}
+
+	// let us handle broken pipes explicitly
+	signal(SIGPIPE, SIG_IGN);
+
+	g_message("nbd server running as UID %d, GID %d", getuid(), getgid());
+
+	g_mutex_init(&shared.lock);
+	for (guint i = 0; i < G_N_ELEMENTS(shared.share_locks); i++)
+		g_mutex_init(&shared.share_locks[i]);
+	shared.first_extra_sock = sock + 1;
+	shared.extra_socks = connections - 1;
+	shared.retry_budget = RAUC_NBD_RETRY_BUDGET;
+	r_token_bucket_init(&shared.rate_limit, 0);
+	shared.pinned = g_array_new(FALSE, FALSE, sizeof(RaucNBDPinned));
+	g_array_set_clear_func(shared.pinned, clear_pinned);
+
+	/* Share DNS and TLS session caches between the connections, so that
+	 * TLS sessions can be resumed. The connection cache can't be shared
+	 * between threads safely. */
+	shared.share = curl_share_init();
+	if (!shared.share)
+		g_error("unexpected error from curl_share_init in %s", G_STRFUNC);
+	scode |= curl_share_setopt(shared.share, CURLSHOPT_LOCKFUNC, share_lock_cb);
+	scode |= curl_share_setopt(shared.share, CURLSHOPT_UNLOCKFUNC, share_unlock_cb);
+	scode |= curl_share_setopt(shared.share, CURLSHOPT_USERDATA, &shared);
+	scode |= curl_share_setopt(shared.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	scode |= curl_share_setopt(shared.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+	if (scode)
+		g_error("unexpected error from curl_share_setopt in %s", G_STRFUNC);
+
+	init_context(&ctx, sock, &shared);
+
+	res = serve(&ctx, error);
+
+	/* The other connections end when the client closes their sockets. */
+	if (shared.workers) {
+		for (guint i = 0; i < shared.workers->len; i++)
+			g_thread_join(g_ptr_array_index(shared.workers, i));
+		g_clear_pointer(&shared.workers, g_ptr_array_unref);
+	}
+
+	clear_context(&ctx);
+	g_clear_pointer(&shared.cache, cache_free);
+	if (shared.pinned->len)
+		g_message("nbd server kept %u prefetched ranges with %"G_GUINT64_FORMAT " bytes",
+				shared.pinned->len, shared.pinned_size);
+	g_clear_pointer(&shared.pinned, g_array_unref);
+	if (shared.mirrors) {
+		for (guint i = 0; i < shared.mirrors->len; i++) {
+			const RaucNBDMirror *mirror = g_ptr_array_index(shared.mirrors, i);
+			g_message("nbd server mirror %s: %s, %.0f bytes/s", mirror->url,
+					mirror->healthy ? "healthy" : "disabled", mirror->rate);
+		}
+		g_clear_pointer(&shared.mirrors, g_ptr_array_unref);
+	}
+	r_token_bucket_clear(&shared.rate_limit);
 
 	if (ctx.data_size) {
-		double percent_dl = ctx.dl_size->sum * 100.0 / (double)ctx.data_size;
+		double percent_dl = shared.downloaded * 100.0 / (double)ctx.data_size;
 		g_message("downloaded %.1f%% of the full bundle", percent_dl);
 	}
 
-	g_clear_pointer(&ctx.url, g_free);
-	g_clear_pointer(&ctx.tls_cert, g_free);
-	g_clear_pointer(&ctx.tls_key, g_free);
-	g_clear_pointer(&ctx.tls_ca, g_free);
-	g_clear_pointer(&ctx.dl_size, r_stats_free);
-	g_clear_pointer(&ctx.dl_speed, r_stats_free);
-	g_clear_pointer(&ctx.namelookup, r_stats_free);
-	g_clear_pointer(&ctx.connect, r_stats_free);
-	g_clear_pointer(&ctx.starttransfer, r_stats_free);
-	g_clear_pointer(&ctx.total, r_stats_free);
-	curl_multi_cleanup(ctx.multi);
-	g_clear_pointer(&ctx.headers_slist, curl_slist_free_all);
-	g_clear_pointer(&ctx.initial_headers_slist, curl_slist_free_all);
+	if (shared.tls_session_cache) {
+		g_autoptr(GError) ierror = NULL;
+
+		if (!r_network_save_tls_sessions(shared.share, shared.tls_session_cache, &ierror))
+			g_message("nbd server: %s", ierror->message);
+		g_free(shared.tls_session_cache);
+	}
+
+	curl_share_cleanup(shared.share);
+	for (guint i = 0; i < G_N_ELEMENTS(shared.share_locks); i++)
+		g_mutex_clear(&shared.share_locks[i]);
+	g_mutex_clear(&shared.lock);
 	g_message("nbd server exiting");
 	return res;
 }
@@ -1019,7 +2485,7 @@ static gpointer nbd_server_thread(gpointer data)
 {
 	g_autofree gint *sockp = data;
 	g_message("started thread %d", *sockp);
-	r_nbd_run_server(*sockp, NULL);
+	r_nbd_run_server(*sockp, 1, NULL);
 	return NULL;
 }
 
@@ -1031,6 +2497,7 @@ static gboolean nbd_configure(RaucNBDServer *nbd_srv, GError **error)
 	g_autofree guint8 *reply_data = NULL;
 	g_autofree guint8 *reply_error = NULL;
 	g_autoptr(GVariant) v = NULL;
+	g_autoptr(GVariant) tail = NULL;
 	g_auto(GVariantDict) dict = G_VARIANT_DICT_INIT(NULL);
 
 	g_return_val_if_fail(nbd_srv != NULL, FALSE);
@@ -1051,6 +2518,16 @@ static gboolean nbd_configure(RaucNBDServer *nbd_srv, GError **error)
 	if (nbd_srv->info_headers)
 		g_variant_dict_insert(&dict, "info-headers", "@as",
 				g_variant_new_strv((const gchar **)nbd_srv->info_headers->pdata, nbd_srv->info_headers->len));
+	if (nbd_srv->cache_dir) {
+		g_variant_dict_insert(&dict, "cache-dir", "s", nbd_srv->cache_dir);
+		g_variant_dict_insert(&dict, "cache-size", "t", nbd_srv->cache_size);
+	}
+	if (nbd_srv->rate_limit)
+		g_variant_dict_insert(&dict, "rate-limit", "t", nbd_srv->rate_limit);
+	if (nbd_srv->tls_session_cache)
+		g_variant_dict_insert(&dict, "tls-session-cache", "s", nbd_srv->tls_session_cache);
+	if (nbd_srv->mirrors)
+		g_variant_dict_insert(&dict, "mirrors", "^as", nbd_srv->mirrors);
 	v = g_variant_dict_end(&dict);
 	{
 		g_autofree gchar *tmp = g_variant_print(v, TRUE);
@@ -1151,6 +2628,14 @@ static gboolean nbd_configure(RaucNBDServer *nbd_srv, GError **error)
 	}
 	g_variant_dict_lookup(&dict, "etag", "s", &nbd_srv->etag);
 
+	tail = g_variant_dict_lookup_value(&dict, "tail", G_VARIANT_TYPE_BYTESTRING);
+	if (tail && g_variant_dict_lookup(&dict, "tail-offset", "t", &nbd_srv->tail_offset) &&
+	    nbd_srv->tail_offset + g_variant_get_size(tail) == nbd_srv->data_size) {
+		g_clear_pointer(&nbd_srv->tail, g_bytes_unref);
+		nbd_srv->tail = g_variant_get_data_as_bytes(tail);
+		g_debug("received %"G_GSIZE_FORMAT " bytes from the end of the bundle", g_bytes_get_size(nbd_srv->tail));
+	}
+
 	return TRUE;
 }
 
@@ -1270,8 +2755,10 @@ gboolean r_nbd_start_server(RaucNBDServer *nbd_srv, GError **error)
 	GError *ierror = NULL;
 	gboolean res = FALSE;
 	gint sockets[2] = {-1, -1};
+	g_autoptr(GArray) server_socks = g_array_new(FALSE, FALSE, sizeof(gint));
 
 	g_return_val_if_fail(nbd_srv != NULL, FALSE);
+	g_return_val_if_fail(nbd_srv->connections >= 1, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
 	g_message("starting the nbd server");
@@ -1286,9 +2773,26 @@ gboolean r_nbd_start_server(RaucNBDServer *nbd_srv, GError **error)
 		goto out;
 	}
 
+	for (guint i = 1; i < nbd_srv->connections; i++) {
+		gint extra[2] = {-1, -1};
+
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, extra) < 0) {
+			g_set_error(
+					error,
+					G_IO_ERROR, g_io_error_from_errno(errno),
+					"failed to create unix socket pair: %s",
+					g_strerror(errno));
+			res = FALSE;
+			goto out;
+		}
+		g_array_append_val(server_socks, extra[0]);
+		g_array_append_val(nbd_srv->extra_socks, extra[1]);
+	}
+
 	if (1) { /* subprocess */
 		g_auto(child_setup_args) child_args = {0};
 		g_autofree gchar *executable = NULL;
+		g_autofree gchar *connections = NULL;
 		g_autoptr(GSubprocessLauncher) launcher = NULL;
 		g_autoptr(GPtrArray) args = g_ptr_array_new_full(3, g_free);
 
@@ -1310,8 +2814,12 @@ gboolean r_nbd_start_server(RaucNBDServer *nbd_srv, GError **error)
 
 		launcher = g_subprocess_launcher_new(G_SUBPROCESS_FLAGS_NONE);
 		g_subprocess_launcher_set_child_setup(launcher, nbd_server_child_setup, &child_args, NULL);
-		g_subprocess_launcher_setenv(launcher, "RAUC_NBD_SERVER", "", TRUE);
+		connections = g_strdup_printf("%u", nbd_srv->connections);
+		g_subprocess_launcher_setenv(launcher, "RAUC_NBD_SERVER", connections, TRUE);
 		g_subprocess_launcher_take_fd(launcher, sockets[0], RAUC_SOCKET_FD);
+		for (guint i = 0; i < server_socks->len; i++)
+			g_subprocess_launcher_take_fd(launcher, g_array_index(server_socks, gint, i), RAUC_SOCKET_FD + 1 + i);
+		g_array_set_size(server_socks, 0); /* GSubprocessLauncher takes ownership */
 
 		nbd_srv->sproc = r_subprocess_launcher_spawnv(launcher, args, &ierror);
 		if (nbd_srv->sproc == NULL) {
@@ -1348,6 +2856,9 @@ out:
 		g_close(sockets[0], NULL);
 	if (sockets[1] >= 0)
 		g_close(sockets[1], NULL);
+	close_extra_socks(server_socks);
+	if (!res)
+		close_extra_socks(nbd_srv->extra_socks);
 	return res;
 }
 
@@ -1380,6 +2891,8 @@ gboolean r_nbd_stop_server(RaucNBDServer *nbd_srv, GError **error)
 		g_close(nbd_srv->sock, NULL);
 		nbd_srv->sock = -1;
 	}
+	/* the server threads for additional connections exit on EOF */
+	close_extra_socks(nbd_srv->extra_socks);
 
 	res = g_subprocess_wait_check(nbd_srv->sproc, NULL, &ierror);
 	if (!res) {
@@ -1435,3 +2948,50 @@ gboolean r_nbd_read(gint sock, guint8 *data, size_t size, off_t offset, GError *
 
 	return TRUE;
 }
+
+gboolean r_nbd_prefetch(gint sock, const RaucNBDRange *ranges, guint count, GError **error)
+{
+	guint failed = 0;
+
+	g_return_val_if_fail(sock >= 0, FALSE);
+	g_return_val_if_fail(ranges || count == 0, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	/* send all requests first, so that the server handles them in parallel */
+	for (guint i = 0; i < count; i++) {
+		struct nbd_request request = {0};
+
+		request.magic = GUINT32_TO_BE(NBD_REQUEST_MAGIC);
+		request.type = GUINT32_TO_BE(RAUC_NBD_CMD_PREFETCH);
+		request.from = GUINT64_TO_BE(ranges[i].offset);
+		request.len = GUINT32_TO_BE(ranges[i].size);
+		memcpy(request.handle, RAUC_NBD_HANDLE, sizeof(request.handle));
+
+		if (!r_write_exact(sock, (guint8*)&request, sizeof(request), NULL))
+			g_error("failed to send nbd prefetch request header");
+	}
+
+	for (guint i = 0; i < count; i++) {
+		struct nbd_reply reply = {0};
+
+		if (!r_read_exact(sock, (guint8*)&reply, sizeof(reply), NULL))
+			g_error("failed to receive nbd prefetch reply header");
+
+		if (reply.magic != GUINT32_TO_BE(NBD_REPLY_MAGIC))
+			g_error("invalid nbd reply magic");
+		if (memcmp(reply.handle, RAUC_NBD_HANDLE, sizeof(reply.handle)) != 0)
+			g_error("invalid nbd reply handle");
+		if (reply.error != GUINT32_TO_BE(0))
+			failed++;
+	}
+
+	if (failed) {
+		g_set_error(
+				error,
+				R_NBD_ERROR, R_NBD_ERROR_READ,
+				"failed to prefetch %u of %u ranges from remote server", failed, count);
+		return FALSE;
+	}
+
+	return TRUE;
+}
@@ -1,12 +1,17 @@
 #include <curl/curl.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <gio/gio.h>
 #include <glib/gstdio.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include "context.h"
 #include "network.h"
+#include "utils.h"
 
 /* We need to make sure that we can support large bundles. */
 G_STATIC_ASSERT(sizeof(curl_off_t) == 8);
@@ -20,15 +25,84 @@ typedef struct {
 	curl_off_t limit;
 
 	gchar *err;
+	gint64 last_progress;
 } RaucTransfer;
 
+/* upper limit for keeping TLS sessions in the session cache file */
+#define TLS_SESSION_MAX_AGE (24 * 60 * 60)
+
+/* minimum interval between two progress updates of a download */
+#define DOWNLOAD_PROGRESS_INTERVAL (G_USEC_PER_SEC / 10)
+
+/* size of the ranges downloaded in parallel */
+#define DOWNLOAD_CHUNK_SIZE (4*1024*1024)
+/* number of concurrent range requests */
+#define DOWNLOAD_CONNECTIONS 4
+/* number of failed range requests before giving up */
+#define DOWNLOAD_RETRIES 5
+/* consecutive failed range requests after which a mirror is no longer used */
+#define DOWNLOAD_MIRROR_FAILURES 3
+/* weight of a new sample in the smoothed mirror throughput */
+#define DOWNLOAD_MIRROR_RATE_WEIGHT 0.25
+
+/* A server providing the file. The first one is the requested URL. */
+typedef struct {
+	gchar *url; /* after redirects */
+	gboolean healthy;
+	guint failures; /* consecutive failed requests */
+	guint active; /* running requests */
+	double rate; /* smoothed throughput in bytes per second */
+} RaucDownloadMirror;
+
+typedef struct {
+	const gchar *url; /* as requested by the caller */
+	gchar *effective_url; /* after redirects */
+	int fd;
+	gchar *state_path;
+
+	/* information from the server */
+	curl_off_t size;
+	gboolean accept_ranges;
+	gchar *etag;
+	gchar *last_modified;
+	double latency; /* time to first byte of the probe */
+
+	/* RaucDownloadMirror for segmented downloads */
+	GPtrArray *mirrors;
+
+	/* progress */
+	guint chunks;
+	gchar *done; /* '1' for each completed chunk, '0' otherwise */
+	gint64 last_progress;
+} RaucSegmentedDownload;
+
+typedef struct {
+	RaucSegmentedDownload *dl;
+	CURL *curl;
+	RaucDownloadMirror *mirror;
+	guint chunk;
+	curl_off_t offset;
+	curl_off_t len;
+	curl_off_t pos;
+	char errbuf[CURL_ERROR_SIZE];
+} RaucSegment;
+
 gboolean network_init(GError **error)
 {
-	CURLcode res;
+	static gsize initialized = 0;
+	static CURLcode res = CURLE_OK;
 
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
-	res = curl_global_init(CURL_GLOBAL_ALL);
+	if (g_once_init_enter(&initialized)) {
+		gint64 start = g_get_monotonic_time();
+
+		res = curl_global_init(CURL_GLOBAL_ALL);
+		g_debug("curl initialization took %.1f ms", (g_get_monotonic_time() - start) / 1000.0);
+
+		g_once_init_leave(&initialized, 1);
+	}
+
 	if (res != CURLE_OK) {
 		g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Initializing curl failed: %s", curl_easy_strerror(res));
 		return FALSE;
@@ -37,6 +111,310 @@ gboolean network_init(GError **error)
 	return TRUE;
 }
 
+static GMutex share_locks[CURL_LOCK_DATA_LAST];
+
+static void share_lock_cb(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr)
+{
+	g_mutex_lock(&share_locks[data]);
+}
+
+static void share_unlock_cb(CURL *handle, curl_lock_data data, void *userptr)
+{
+	g_mutex_unlock(&share_locks[data]);
+}
+
+CURLSH *r_network_get_share(void)
+{
+	static gsize initialized = 0;
+	static CURLSH *share = NULL;
+
+	if (g_once_init_enter(&initialized)) {
+		CURLSHcode scode = 0;
+
+		/* As in the streaming server, the connection cache is not
+		 * shared, as transfers may run in different threads. */
+		share = curl_share_init();
+		if (!share)
+			g_error("unexpected error from curl_share_init in %s", G_STRFUNC);
+		scode |= curl_share_setopt(share, CURLSHOPT_LOCKFUNC, share_lock_cb);
+		scode |= curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, share_unlock_cb);
+		scode |= curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+		scode |= curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+		if (scode)
+			g_error("unexpected error from curl_share_setopt in %s", G_STRFUNC);
+
+		g_once_init_leave(&initialized, 1);
+	}
+
+	return share;
+}
+
+gchar *r_network_tls_session_path(const gchar *path)
+{
+	uid_t uid = geteuid();
+
+	g_return_val_if_fail(path, NULL);
+
+	/* The sandboxed streaming server must not share the file with the
+	 * privileged process, so each user gets its own file. */
+	if (uid == 0)
+		return g_strdup(path);
+
+	return g_strdup_printf("%s.%u", path, (guint)uid);
+}
+
+#ifdef CURL_VERSION_SSLS_EXPORT
+static gboolean have_ssls_export(void)
+{
+	const curl_version_info_data *info = curl_version_info(CURLVERSION_NOW);
+
+	return (info->features & CURL_VERSION_SSLS_EXPORT) != 0;
+}
+
+/* Loads the session cache file, unless it could have been written by someone
+ * else. Sets *trusted to FALSE if the file is missing or must be ignored. */
+static gboolean load_tls_session_file(GKeyFile *key_file, const gchar *path, gboolean *trusted, GError **error)
+{
+	g_autoptr(GMappedFile) mapped = NULL;
+	GError *ierror = NULL;
+	struct stat st;
+	int fd;
+
+	*trusted = FALSE;
+
+	fd = g_open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW, 0);
+	if (fd < 0) {
+		int err = errno;
+		if (err == ENOENT)
+			return TRUE;
+		if (err == ELOOP) {
+			g_message("Ignoring TLS session cache %s, as it is a symlink", path);
+			return TRUE;
+		}
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to open TLS session cache %s: %s", path, g_strerror(err));
+		return FALSE;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		int err = errno;
+		g_close(fd, NULL);
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to stat TLS session cache %s: %s", path, g_strerror(err));
+		return FALSE;
+	}
+
+	/* Importing a session written by a less privileged process would let it
+	 * choose which server sessions we resume. */
+	if (!S_ISREG(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+		g_message("Ignoring TLS session cache %s, as it is not a regular file owned and only writable by uid %u",
+				path, (guint)geteuid());
+		g_close(fd, NULL);
+		return TRUE;
+	}
+
+	mapped = g_mapped_file_new_from_fd(fd, FALSE, &ierror);
+	g_close(fd, NULL);
+	if (!mapped) {
+		g_propagate_prefixed_error(error, ierror, "Failed to read TLS session cache %s: ", path);
+		return FALSE;
+	}
+
+	if (g_mapped_file_get_length(mapped) == 0)
+		return TRUE;
+
+	if (!g_key_file_load_from_data(key_file, g_mapped_file_get_contents(mapped),
+			g_mapped_file_get_length(mapped), G_KEY_FILE_NONE, &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Failed to parse TLS session cache %s: ", path);
+		return FALSE;
+	}
+
+	*trusted = TRUE;
+	return TRUE;
+}
+
+gboolean r_network_load_tls_sessions(CURLSH *share, const gchar *path, GError **error)
+{
+	g_autoptr(GKeyFile) key_file = g_key_file_new();
+	g_autofree gchar *own_path = NULL;
+	g_auto(GStrv) groups = NULL;
+	CURL *easy = NULL;
+	gint64 now = g_get_real_time() / G_USEC_PER_SEC;
+	guint imported = 0;
+	gboolean trusted = FALSE;
+
+	g_return_val_if_fail(share, FALSE);
+	g_return_val_if_fail(path, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	own_path = r_network_tls_session_path(path);
+
+	if (!load_tls_session_file(key_file, own_path, &trusted, error))
+		return FALSE;
+	if (!trusted)
+		return TRUE;
+
+	if (!have_ssls_export()) {
+		g_debug("libcurl does not support exporting TLS sessions, not using %s", own_path);
+		return TRUE;
+	}
+
+	easy = curl_easy_init();
+	if (!easy)
+		g_error("unexpected error from curl_easy_init in %s", G_STRFUNC);
+	if (curl_easy_setopt(easy, CURLOPT_SHARE, share) != CURLE_OK)
+		g_error("unexpected error from curl_easy_setopt in %s", G_STRFUNC);
+
+	groups = g_key_file_get_groups(key_file, NULL);
+	for (gchar **group = groups; *group; group++) {
+		g_autofree gchar *session_key = NULL;
+		g_autofree gchar *hmac_str = NULL;
+		g_autofree gchar *data_str = NULL;
+		g_autofree guchar *hmac = NULL;
+		g_autofree guchar *data = NULL;
+		gsize hmac_len = 0, data_len = 0;
+		gint64 valid_until;
+		CURLcode code;
+
+		valid_until = g_key_file_get_int64(key_file, *group, "valid-until", NULL);
+		if (valid_until <= now)
+			continue;
+
+		session_key = g_key_file_get_string(key_file, *group, "key", NULL);
+		hmac_str = g_key_file_get_string(key_file, *group, "hmac", NULL);
+		data_str = g_key_file_get_string(key_file, *group, "data", NULL);
+		if (!data_str || (!session_key && !hmac_str))
+			continue;
+
+		if (hmac_str)
+			hmac = g_base64_decode(hmac_str, &hmac_len);
+		data = g_base64_decode(data_str, &data_len);
+
+		code = curl_easy_ssls_import(easy, session_key, hmac, hmac_len, data, data_len);
+		if (code != CURLE_OK) {
+			g_debug("Failed to import TLS session %s: %s", *group, curl_easy_strerror(code));
+			continue;
+		}
+		imported++;
+	}
+
+	curl_easy_cleanup(easy);
+
+	g_debug("Imported %u TLS sessions from %s", imported, own_path);
+
+	return TRUE;
+}
+
+typedef struct {
+	GKeyFile *key_file;
+	guint count;
+} RaucTlsSessionExport;
+
+static CURLcode export_tls_session_cb(CURL *handle, void *userptr, const char *session_key,
+		const unsigned char *shmac, size_t shmac_len,
+		const unsigned char *sdata, size_t sdata_len,
+		curl_off_t valid_until, int ietf_tls_id, const char *alpn, size_t earlydata_max)
+{
+	RaucTlsSessionExport *export = userptr;
+	gint64 max_valid = g_get_real_time() / G_USEC_PER_SEC + TLS_SESSION_MAX_AGE;
+	g_autofree gchar *group = g_strdup_printf("session.%u", export->count++);
+	g_autofree gchar *data_str = g_base64_encode(sdata, sdata_len);
+
+	/* limit how long a session ticket is kept on disk */
+	if (valid_until <= 0 || valid_until > max_valid)
+		valid_until = max_valid;
+
+	if (session_key)
+		g_key_file_set_string(export->key_file, group, "key", session_key);
+	if (shmac && shmac_len) {
+		g_autofree gchar *hmac_str = g_base64_encode(shmac, shmac_len);
+		g_key_file_set_string(export->key_file, group, "hmac", hmac_str);
+	}
+	g_key_file_set_string(export->key_file, group, "data", data_str);
+	g_key_file_set_int64(export->key_file, group, "valid-until", valid_until);
+
+	return CURLE_OK;
+}
+
+gboolean r_network_save_tls_sessions(CURLSH *share, const gchar *path, GError **error)
+{
+	g_autoptr(GKeyFile) key_file = g_key_file_new();
+	RaucTlsSessionExport export = {
+		.key_file = key_file,
+	};
+	g_autofree gchar *data = NULL;
+	g_autofree gchar *own_path = NULL;
+	g_autofree gchar *tmp_path = NULL;
+	gsize length = 0;
+	CURL *easy = NULL;
+	CURLcode code;
+	int fd;
+
+	g_return_val_if_fail(share, FALSE);
+	g_return_val_if_fail(path, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (!have_ssls_export())
+		return TRUE;
+
+	easy = curl_easy_init();
+	if (!easy)
+		g_error("unexpected error from curl_easy_init in %s", G_STRFUNC);
+	if (curl_easy_setopt(easy, CURLOPT_SHARE, share) != CURLE_OK)
+		g_error("unexpected error from curl_easy_setopt in %s", G_STRFUNC);
+	code = curl_easy_ssls_export(easy, export_tls_session_cb, &export);
+	curl_easy_cleanup(easy);
+	if (code != CURLE_OK) {
+		g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+				"Failed to export TLS sessions: %s", curl_easy_strerror(code));
+		return FALSE;
+	}
+
+	data = g_key_file_to_data(key_file, &length, NULL);
+
+	/* The session tickets allow resuming the TLS session, so the file must
+	 * only be readable by us. As it is replaced by rename, it is always owned
+	 * by the current user. */
+	own_path = r_network_tls_session_path(path);
+	tmp_path = g_strconcat(own_path, ".XXXXXX", NULL);
+	fd = g_mkstemp_full(tmp_path, O_RDWR | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		int err = errno;
+		g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
+				"Failed to create TLS session cache: %s", g_strerror(err));
+		return FALSE;
+	}
+	if (!r_write_exact(fd, (const guint8 *)data, length, error)) {
+		g_close(fd, NULL);
+		g_unlink(tmp_path);
+		return FALSE;
+	}
+	g_close(fd, NULL);
+	if (g_rename(tmp_path, own_path) < 0) {
+		int err = errno;
+		g_unlink(tmp_path);
+		g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
+				"Failed to write TLS session cache: %s", g_strerror(err));
+		return FALSE;
+	}
+
+	g_debug("Exported %u TLS sessions to %s", export.count, own_path);
+
+	return TRUE;
+}
+#else
+gboolean r_network_load_tls_sessions(CURLSH *share, const gchar *path, GError **error)
+{
+	g_debug("libcurl too old for exporting TLS sessions, not using %s", path);
+	return TRUE;
+}
+
+gboolean r_network_save_tls_sessions(CURLSH *share, const gchar *path, GError **error)
+{
+	return TRUE;
+}
+#endif
+
 static size_t write_cb(char *ptr, size_t size, size_t nmemb, void *userdata)
 {
 	RaucTransfer *xfer = userdata;
@@ -56,11 +434,30 @@ static size_t write_cb(char *ptr, size_t size, size_t nmemb, void *userdata)
 	return res;
 }
 
+/* Updates the byte progress of the 'download_bundle' step, if the download
+ * runs within it. */
+static void download_progress(gint64 *last_update, goffset done, goffset total)
+{
+	gint64 now;
+
+	if (total <= 0 || !r_context_in_progress_step("download_bundle"))
+		return;
+
+	now = g_get_monotonic_time();
+	if (done < total && now - *last_update < DOWNLOAD_PROGRESS_INTERVAL)
+		return;
+	*last_update = now;
+
+	r_context_set_step_bytes("download_bundle", done, total);
+}
+
 static int xfer_cb(void *clientp, curl_off_t dltotal, curl_off_t dlnow,
 		curl_off_t ultotal, curl_off_t ulnow)
 {
 	RaucTransfer *xfer = clientp;
 
+	download_progress(&xfer->last_progress, dlnow, dltotal);
+
 	/* check transfer limit */
 	if (xfer->limit) {
 		if ((dlnow > xfer->limit)
@@ -90,6 +487,7 @@ static gboolean transfer(RaucTransfer *xfer, GError **error)
 	}
 
 	curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
+	curl_easy_setopt(curl, CURLOPT_SHARE, r_network_get_share());
 	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L); /* avoid signals for threading */
 	curl_easy_setopt(curl, CURLOPT_URL, xfer->url);
 	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
@@ -138,34 +536,585 @@ out:
 	return res;
 }
 
+static size_t probe_header_cb(char *buffer, size_t size, size_t nitems, void *userdata)
+{
+	RaucSegmentedDownload *dl = userdata;
+	g_autofree gchar *header = g_strstrip(g_strndup(buffer, size * nitems));
+	g_auto(GStrv) h = NULL;
+
+	/* a new response starts (for example after a redirect) */
+	if (g_str_has_prefix(header, "HTTP/")) {
+		dl->accept_ranges = FALSE;
+		g_clear_pointer(&dl->etag, g_free);
+		g_clear_pointer(&dl->last_modified, g_free);
+		return size * nitems;
+	}
+
+	h = g_strsplit(header, ":", 2);
+	if (g_strv_length(h) != 2)
+		return size * nitems;
+	g_strstrip(h[0]);
+	g_strstrip(h[1]);
+
+	if (g_ascii_strcasecmp(h[0], "accept-ranges") == 0) {
+		dl->accept_ranges = g_ascii_strcasecmp(h[1], "bytes") == 0;
+	} else if (g_ascii_strcasecmp(h[0], "etag") == 0) {
+		g_free(dl->etag);
+		dl->etag = g_strdup(h[1]);
+	} else if (g_ascii_strcasecmp(h[0], "last-modified") == 0) {
+		g_free(dl->last_modified);
+		dl->last_modified = g_strdup(h[1]);
+	}
+
+	return size * nitems;
+}
+
+/* Requests only the headers to find out whether the file can be downloaded in
+ * parallel ranges. Errors are ignored here, as the normal download reports
+ * them properly. */
+static void probe_download(RaucSegmentedDownload *dl)
+{
+	CURL *curl = curl_easy_init();
+	const char *effective_url = NULL;
+	long response_code = 0;
+	CURLcode r;
+
+	if (curl == NULL)
+		return;
+
+	curl_easy_setopt(curl, CURLOPT_SHARE, r_network_get_share());
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L); /* avoid signals for threading */
+	curl_easy_setopt(curl, CURLOPT_URL, dl->url);
+	curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+	curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 8L);
+	curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+	curl_easy_setopt(curl, CURLOPT_NETRC, CURL_NETRC_OPTIONAL);
+	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, probe_header_cb);
+	curl_easy_setopt(curl, CURLOPT_HEADERDATA, dl);
+
+	r = curl_easy_perform(curl);
+	if (r != CURLE_OK) {
+		g_debug("Failed to probe %s: %s", dl->url, curl_easy_strerror(r));
+		goto out;
+	}
+
+	if (curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code) != CURLE_OK ||
+	    response_code != 200)
+		goto out;
+	if (curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &dl->size) != CURLE_OK)
+		dl->size = -1;
+	if (curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &effective_url) == CURLE_OK && effective_url)
+		dl->effective_url = g_strdup(effective_url);
+	if (curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME, &dl->latency) != CURLE_OK)
+		dl->latency = 0;
+
+out:
+	curl_easy_cleanup(curl);
+}
+
+static RaucDownloadMirror *new_mirror(const gchar *url, double latency)
+{
+	RaucDownloadMirror *mirror = g_new0(RaucDownloadMirror, 1);
+
+	mirror->url = g_strdup(url);
+	mirror->healthy = TRUE;
+	/* until data was received, assume that chunks are latency bound */
+	mirror->rate = latency > 0 ? DOWNLOAD_CHUNK_SIZE / latency : 1.0;
+
+	return mirror;
+}
+
+static void free_mirror(RaucDownloadMirror *mirror)
+{
+	g_free(mirror->url);
+	g_free(mirror);
+}
+
+/* Probes the additional mirrors and adds those which serve the same file
+ * (same size and, if both servers send them, the same ETag and Last-Modified
+ * header) with range support. */
+static void probe_mirrors(RaucSegmentedDownload *dl, const gchar *const *mirror_urls)
+{
+	dl->mirrors = g_ptr_array_new_with_free_func((GDestroyNotify)free_mirror);
+	g_ptr_array_add(dl->mirrors, new_mirror(dl->effective_url, dl->latency));
+
+	if (!mirror_urls)
+		return;
+
+	for (const gchar *const *url = mirror_urls; *url; url++) {
+		RaucSegmentedDownload probe = {
+			.url = *url,
+			.size = -1,
+		};
+
+		probe_download(&probe);
+		if (!probe.accept_ranges || !probe.effective_url) {
+			g_message("Not using mirror %s: range requests not supported", *url);
+		} else if (probe.size != dl->size) {
+			g_message("Not using mirror %s: size %"G_GINT64_FORMAT " differs from %"G_GINT64_FORMAT,
+					*url, (gint64)probe.size, (gint64)dl->size);
+		} else if (probe.etag && dl->etag && !g_str_equal(probe.etag, dl->etag)) {
+			g_message("Not using mirror %s: ETag %s differs from %s", *url, probe.etag, dl->etag);
+		} else if (probe.last_modified && dl->last_modified && !g_str_equal(probe.last_modified, dl->last_modified)) {
+			g_message("Not using mirror %s: Last-Modified %s differs from %s", *url, probe.last_modified, dl->last_modified);
+		} else {
+			g_message("Using mirror %s", probe.effective_url);
+			g_ptr_array_add(dl->mirrors, new_mirror(probe.effective_url, probe.latency));
+		}
+
+		g_free(probe.effective_url);
+		g_free(probe.etag);
+		g_free(probe.last_modified);
+	}
+}
+
+/* Selects the mirror for the next chunk, based on the expected time until
+ * it would be answered, so that chunks are spread across the mirrors
+ * according to their throughput. */
+static RaucDownloadMirror *select_mirror(RaucSegmentedDownload *dl)
+{
+	RaucDownloadMirror *best = NULL;
+	double best_cost = 0;
+
+	for (guint i = 0; i < dl->mirrors->len; i++) {
+		RaucDownloadMirror *mirror = g_ptr_array_index(dl->mirrors, i);
+		double cost;
+
+		if (!mirror->healthy)
+			continue;
+
+		cost = (mirror->active + 1) * (mirror->failures + 1) / MAX(mirror->rate, 1.0);
+		if (!best || cost < best_cost) {
+			best = mirror;
+			best_cost = cost;
+		}
+	}
+	/* the last healthy mirror is never disabled */
+	g_assert_nonnull(best);
+
+	best->active++;
+	return best;
+}
+
+/* Records the result of a range request. A failing mirror is disabled as
+ * long as another one is available. Returns TRUE if the failure was handled
+ * by switching to another mirror. */
+static gboolean finish_mirror_request(RaucSegmentedDownload *dl, RaucSegment *seg, gboolean success, long response_code)
+{
+	RaucDownloadMirror *mirror = seg->mirror;
+	gboolean have_other = FALSE;
+	curl_off_t size = 0;
+	double total = 0;
+
+	seg->mirror = NULL;
+	mirror->active--;
+
+	if (success) {
+		if (curl_easy_getinfo(seg->curl, CURLINFO_SIZE_DOWNLOAD_T, &size) == CURLE_OK &&
+		    curl_easy_getinfo(seg->curl, CURLINFO_TOTAL_TIME, &total) == CURLE_OK &&
+		    total > 0)
+			mirror->rate += (size / total - mirror->rate) * DOWNLOAD_MIRROR_RATE_WEIGHT;
+		mirror->failures = 0;
+		return FALSE;
+	}
+
+	for (guint i = 0; i < dl->mirrors->len; i++) {
+		const RaucDownloadMirror *other = g_ptr_array_index(dl->mirrors, i);
+
+		if (other != mirror && other->healthy)
+			have_other = TRUE;
+	}
+	if (!have_other)
+		return FALSE;
+
+	mirror->failures++;
+	if (response_code == 404 || response_code == 200 || mirror->failures >= DOWNLOAD_MIRROR_FAILURES) {
+		g_message("Disabling mirror %s after %u failed requests", mirror->url, mirror->failures);
+		mirror->healthy = FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean save_download_state(RaucSegmentedDownload *dl, GError **error)
+{
+	g_autoptr(GKeyFile) key_file = g_key_file_new();
+
+	/* the state must not claim data which isn't on disk yet */
+	if (fdatasync(dl->fd) < 0) {
+		int err = errno;
+		g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
+				"Failed to sync download: %s", g_strerror(err));
+		return FALSE;
+	}
+
+	g_key_file_set_string(key_file, "download", "url", dl->url);
+	g_key_file_set_int64(key_file, "download", "size", dl->size);
+	if (dl->etag)
+		g_key_file_set_string(key_file, "download", "etag", dl->etag);
+	if (dl->last_modified)
+		g_key_file_set_string(key_file, "download", "last-modified", dl->last_modified);
+	g_key_file_set_integer(key_file, "download", "chunk-size", DOWNLOAD_CHUNK_SIZE);
+	g_key_file_set_string(key_file, "download", "done", dl->done);
+
+	return g_key_file_save_to_file(key_file, dl->state_path, error);
+}
+
+/* Restores the progress of an interrupted download, if the state file matches
+ * the file on the server. */
+static gboolean load_download_state(RaucSegmentedDownload *dl)
+{
+	g_autoptr(GKeyFile) key_file = g_key_file_new();
+	g_autofree gchar *url = NULL;
+	g_autofree gchar *etag = NULL;
+	g_autofree gchar *last_modified = NULL;
+	g_autofree gchar *done = NULL;
+
+	if (!g_key_file_load_from_file(key_file, dl->state_path, G_KEY_FILE_NONE, NULL))
+		return FALSE;
+
+	url = g_key_file_get_string(key_file, "download", "url", NULL);
+	etag = g_key_file_get_string(key_file, "download", "etag", NULL);
+	last_modified = g_key_file_get_string(key_file, "download", "last-modified", NULL);
+	done = g_key_file_get_string(key_file, "download", "done", NULL);
+
+	if (g_strcmp0(url, dl->url) != 0 ||
+	    g_key_file_get_int64(key_file, "download", "size", NULL) != dl->size ||
+	    g_key_file_get_integer(key_file, "download", "chunk-size", NULL) != DOWNLOAD_CHUNK_SIZE ||
+	    g_strcmp0(etag, dl->etag) != 0 ||
+	    g_strcmp0(last_modified, dl->last_modified) != 0 ||
+	    !done || strlen(done) != dl->chunks)
+		return FALSE;
+
+	memcpy(dl->done, done, dl->chunks);
+
+	return TRUE;
+}
+
+static size_t segment_write_cb(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+	RaucSegment *seg = userdata;
+
+	if ((guint64)(seg->pos + size*nmemb) > (guint64)seg->len)
+		return 0;
+
+	if (!r_pwrite_exact(seg->dl->fd, (guint8 *)ptr, size*nmemb, seg->offset + seg->pos, NULL))
+		return 0;
+	seg->pos += size*nmemb;
+
+	return size*nmemb;
+}
+
+static void start_segment(CURLM *multi, RaucSegment *seg, RaucSegmentedDownload *dl, guint chunk)
+{
+	g_autofree gchar *range = NULL;
+
+	seg->dl = dl;
+	seg->chunk = chunk;
+	seg->offset = (curl_off_t)chunk * DOWNLOAD_CHUNK_SIZE;
+	seg->len = MIN(DOWNLOAD_CHUNK_SIZE, dl->size - seg->offset);
+	seg->pos = 0;
+	seg->errbuf[0] = 0;
+
+	if (!seg->curl)
+		seg->curl = curl_easy_init();
+	if (!seg->curl)
+		g_error("Unable to start libcurl easy session");
+	seg->mirror = select_mirror(dl);
+
+	range = g_strdup_printf("%"G_GINT64_FORMAT "-%"G_GINT64_FORMAT,
+			(gint64)seg->offset, (gint64)(seg->offset + seg->len - 1));
+
+	curl_easy_setopt(seg->curl, CURLOPT_SHARE, r_network_get_share());
+	curl_easy_setopt(seg->curl, CURLOPT_NOSIGNAL, 1L); /* avoid signals for threading */
+	curl_easy_setopt(seg->curl, CURLOPT_URL, seg->mirror->url);
+	curl_easy_setopt(seg->curl, CURLOPT_FOLLOWLOCATION, 1L);
+	curl_easy_setopt(seg->curl, CURLOPT_MAXREDIRS, 8L);
+	curl_easy_setopt(seg->curl, CURLOPT_RANGE, range);
+	curl_easy_setopt(seg->curl, CURLOPT_WRITEFUNCTION, segment_write_cb);
+	curl_easy_setopt(seg->curl, CURLOPT_WRITEDATA, seg);
+	curl_easy_setopt(seg->curl, CURLOPT_FAILONERROR, 1L);
+	curl_easy_setopt(seg->curl, CURLOPT_ERRORBUFFER, seg->errbuf);
+	curl_easy_setopt(seg->curl, CURLOPT_NETRC, CURL_NETRC_OPTIONAL);
+	curl_easy_setopt(seg->curl, CURLOPT_PRIVATE, seg);
+
+	if (curl_multi_add_handle(multi, seg->curl) != CURLM_OK)
+		g_error("Unexpected error from curl_multi_add_handle");
+}
+
+/* Returns the chunk to download at the given position. The last chunk is
+ * requested first, as it contains the signature and manifest of a bundle,
+ * followed by the other chunks in order. Nothing is verified before the
+ * download is complete, this only lets the state file record the signature
+ * and manifest early. */
+static guint chunk_at(const RaucSegmentedDownload *dl, guint position)
+{
+	return position == 0 ? dl->chunks - 1 : position - 1;
+}
+
+static guint chunk_position(const RaucSegmentedDownload *dl, guint chunk)
+{
+	return chunk == dl->chunks - 1 ? 0 : chunk + 1;
+}
+
+/* Returns the number of bytes downloaded, including the running requests. */
+static goffset segmented_bytes_done(const RaucSegmentedDownload *dl, const RaucSegment *segments)
+{
+	goffset done = 0;
+
+	for (guint chunk = 0; chunk < dl->chunks; chunk++) {
+		if (dl->done[chunk] == '1')
+			done += MIN(DOWNLOAD_CHUNK_SIZE, dl->size - (goffset)chunk * DOWNLOAD_CHUNK_SIZE);
+	}
+
+	for (guint i = 0; i < DOWNLOAD_CONNECTIONS; i++) {
+		if (segments[i].dl && dl->done[segments[i].chunk] != '1')
+			done += segments[i].pos;
+	}
+
+	return done;
+}
+
+/* Downloads all missing chunks with DOWNLOAD_CONNECTIONS parallel range
+ * requests, recording the progress in the state file after each chunk. */
+static gboolean download_segments(RaucSegmentedDownload *dl, GError **error)
+{
+	CURLM *multi = NULL;
+	RaucSegment segments[DOWNLOAD_CONNECTIONS] = {0};
+	RaucSegment *idle[DOWNLOAD_CONNECTIONS];
+	g_autofree gboolean *running = g_new0(gboolean, dl->chunks);
+	guint n_idle = DOWNLOAD_CONNECTIONS;
+	guint next = 0;
+	guint failures = 0;
+	gboolean res = FALSE;
+
+	multi = curl_multi_init();
+	if (multi == NULL) {
+		g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Unable to start libcurl multi session");
+		return FALSE;
+	}
+
+	for (guint i = 0; i < DOWNLOAD_CONNECTIONS; i++)
+		idle[i] = &segments[i];
+
+	while (TRUE) {
+		int still_running = 0;
+		int numfds = 0;
+		CURLMsg *msg = NULL;
+		int msgs_in_queue = 0;
+
+		while (n_idle && next < dl->chunks) {
+			guint chunk = chunk_at(dl, next++);
+
+			if (dl->done[chunk] == '1' || running[chunk])
+				continue;
+			running[chunk] = TRUE;
+			start_segment(multi, idle[--n_idle], dl, chunk);
+		}
+
+		if (n_idle == DOWNLOAD_CONNECTIONS)
+			break; /* all chunks done */
+
+		if (curl_multi_perform(multi, &still_running) != CURLM_OK ||
+		    curl_multi_wait(multi, NULL, 0, 1000, &numfds) != CURLM_OK) {
+			g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Unexpected error from libcurl multi session");
+			goto out;
+		}
+
+		download_progress(&dl->last_progress, segmented_bytes_done(dl, segments), dl->size);
+
+		while ((msg = curl_multi_info_read(multi, &msgs_in_queue))) {
+			RaucSegment *seg = NULL;
+			long response_code = 0;
+			gboolean success = FALSE;
+
+			if (msg->msg != CURLMSG_DONE)
+				continue;
+
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &seg);
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &response_code);
+			curl_multi_remove_handle(multi, seg->curl);
+			idle[n_idle++] = seg;
+			running[seg->chunk] = FALSE;
+
+			success = msg->data.result == CURLE_OK && response_code == 206 && seg->pos == seg->len;
+			if (finish_mirror_request(dl, seg, success, response_code)) {
+				g_message("Range request for chunk %u failed: %s (retrying on another mirror)", seg->chunk,
+						seg->errbuf[0] ? seg->errbuf : curl_easy_strerror(msg->data.result));
+				next = MIN(next, chunk_position(dl, seg->chunk));
+				continue;
+			}
+
+			if (success) {
+				dl->done[seg->chunk] = '1';
+				if (!save_download_state(dl, error))
+					goto out;
+				continue;
+			}
+
+			if (response_code == 200) {
+				g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+						"Server ignored range request");
+				goto out;
+			}
+
+			if (++failures > DOWNLOAD_RETRIES) {
+				g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Transfer failed: %s",
+						seg->errbuf[0] ? seg->errbuf : curl_easy_strerror(msg->data.result));
+				goto out;
+			}
+			g_message("Range request for chunk %u failed: %s (retrying)", seg->chunk,
+					seg->errbuf[0] ? seg->errbuf : curl_easy_strerror(msg->data.result));
+			/* start over with the first missing chunk, skipping those
+			 * which are still running */
+			next = MIN(next, chunk_position(dl, seg->chunk));
+		}
+	}
+
+	res = TRUE;
+
+out:
+	for (guint i = 0; i < DOWNLOAD_CONNECTIONS; i++) {
+		if (segments[i].curl) {
+			curl_multi_remove_handle(multi, segments[i].curl);
+			curl_easy_cleanup(segments[i].curl);
+		}
+	}
+	curl_multi_cleanup(multi);
+	return res;
+}
+
 gboolean download_file(const gchar *target, const gchar *url, goffset limit, GError **error)
+{
+	return download_file_with_mirrors(target, url, NULL, limit, error);
+}
+
+gboolean download_file_with_mirrors(const gchar *target, const gchar *url, const gchar *const *mirrors, goffset limit, GError **error)
 {
 	RaucTransfer xfer = {0};
+	RaucSegmentedDownload dl = {0};
+	gboolean resumable = FALSE;
 	gboolean res = FALSE;
 	GError *ierror = NULL;
+	static gsize sessions_loaded = 0;
+	const gchar *tls_session_cache = r_context()->config ? r_context()->config->streaming_tls_session_cache : NULL;
 
 	g_return_val_if_fail(target, FALSE);
 	g_return_val_if_fail(url, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
+	if (!network_init(error))
+		return FALSE;
+
+	if (tls_session_cache && g_once_init_enter(&sessions_loaded)) {
+		if (!r_network_load_tls_sessions(r_network_get_share(), tls_session_cache, &ierror)) {
+			g_message("%s", ierror->message);
+			g_clear_error(&ierror);
+		}
+		g_once_init_leave(&sessions_loaded, 1);
+	}
+
 	xfer.url = url;
 	xfer.limit = limit;
 
-	/* TODO: resume incomplete downloads */
+	dl.url = url;
+	dl.size = -1;
+	dl.state_path = g_strconcat(target, ".state", NULL);
+
+	/* An existing target is only reused together with its state file,
+	 * otherwise it is left over from an earlier download and replaced. */
+	if (g_file_test(dl.state_path, G_FILE_TEST_IS_REGULAR) &&
+	    g_file_test(target, G_FILE_TEST_IS_REGULAR)) {
+		dl.fd = g_open(target, O_RDWR | O_CLOEXEC, 0);
+		resumable = TRUE;
+	} else {
+		dl.fd = g_open(target, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	}
+	if (dl.fd < 0) {
+		g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed opening target file");
+		goto out;
+	}
 
-	xfer.dl = fopen(target, "wbx");
+	probe_download(&dl);
+
+	if (limit && dl.size > limit) {
+		g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Transfer failed: Maximum bundle download size exceeded. Download aborted.");
+		goto out;
+	}
+
+	if (dl.accept_ranges && dl.effective_url && dl.size >= 2 * DOWNLOAD_CHUNK_SIZE) {
+		dl.chunks = (dl.size + DOWNLOAD_CHUNK_SIZE - 1) / DOWNLOAD_CHUNK_SIZE;
+		dl.done = g_malloc(dl.chunks + 1);
+		memset(dl.done, '0', dl.chunks);
+		dl.done[dl.chunks] = '\0';
+
+		/* only resume if we can detect changes on the server */
+		if (resumable && (dl.etag || dl.last_modified) && load_download_state(&dl)) {
+			g_message("Resuming download of %s", url);
+		} else if (ftruncate(dl.fd, 0) < 0 || ftruncate(dl.fd, dl.size) < 0) {
+			int err = errno;
+			g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
+					"Failed to allocate target file: %s", g_strerror(err));
+			goto out;
+		}
+
+		probe_mirrors(&dl, mirrors);
+
+		res = download_segments(&dl, &ierror);
+		if (res) {
+			g_unlink(dl.state_path);
+			goto out;
+		} else if (!g_error_matches(ierror, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED)) {
+			g_propagate_error(error, ierror);
+			goto out;
+		}
+
+		g_message("%s, falling back to a single request", ierror->message);
+		g_clear_error(&ierror);
+	}
+
+	/* fall back to a single request */
+	g_unlink(dl.state_path);
+	if (ftruncate(dl.fd, 0) < 0) {
+		int err = errno;
+		g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
+				"Failed to truncate target file: %s", g_strerror(err));
+		goto out;
+	}
+	xfer.dl = fdopen(dl.fd, "wb");
 	if (xfer.dl == NULL) {
 		g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed opening target file");
 		goto out;
 	}
+	dl.fd = -1; /* owned by xfer.dl */
 
 	res = transfer(&xfer, &ierror);
+	/* without range requests, the download restarts from the next mirror */
+	for (const gchar *const *mirror = mirrors; !res && mirror && *mirror; mirror++) {
+		g_message("Download from %s failed: %s (trying mirror %s)", xfer.url, ierror->message, *mirror);
+		g_clear_error(&ierror);
+		if (fflush(xfer.dl) != 0 || ftruncate(fileno(xfer.dl), 0) < 0) {
+			int err = errno;
+			g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
+					"Failed to truncate target file: %s", g_strerror(err));
+			goto out;
+		}
+		rewind(xfer.dl);
+		xfer.url = *mirror;
+		xfer.pos = 0;
+		res = transfer(&xfer, &ierror);
+	}
 	if (!res) {
 		g_propagate_error(error, ierror);
 		goto out;
 	}
 
 out:
+	if (tls_session_cache && !r_network_save_tls_sessions(r_network_get_share(), tls_session_cache, &ierror)) {
+		g_message("%s", ierror->message);
+		g_clear_error(&ierror);
+	}
 	if (xfer.dl) {
 		if (fclose(xfer.dl)) {
 			int err = errno;
@@ -173,6 +1122,14 @@ out:
 		}
 		xfer.dl = NULL;
 	}
+	if (dl.fd >= 0)
+		g_close(dl.fd, NULL);
+	g_free(dl.effective_url);
+	g_free(dl.state_path);
+	g_free(dl.etag);
+	g_free(dl.last_modified);
+	g_free(dl.done);
+	g_clear_pointer(&dl.mirrors, g_ptr_array_unref);
 
 	return res;
 }
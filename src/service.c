@@ -1,4 +1,6 @@
 #include <gio/gio.h>
+#include <gio/gunixfdlist.h>
+#include <gio/gunixmounts.h>
 #include <glib-unix.h>
 #include <glib.h>
 #include <stdio.h>
@@ -8,17 +10,117 @@
 #include "bootchooser.h"
 #include "config_file.h"
 #include "context.h"
+#include "hash_index.h"
 #include "install.h"
 #include "mark.h"
 #include "rauc-installer-generated.h"
 #include "service.h"
+#include "stats.h"
 #include "status_file.h"
 #include "utils.h"
 
+/* minimum interval between updates of the Statistics property */
+#define R_SERVICE_STATISTICS_INTERVAL (1 * G_USEC_PER_SEC)
+
 GMainLoop *service_loop = NULL;
 RInstaller *r_installer = NULL;
 guint r_bus_name_id = 0;
 
+/* latency statistics per D-Bus method name, included in the Statistics
+ * property but kept out of the installation report */
+static GHashTable *request_latency = NULL;
+/* protects request_latency, as the progress callback reads it from the
+ * installation thread */
+static GMutex request_latency_lock;
+
+/* state captured when an installation starts, returned by the read-only
+ * methods while it is running */
+static GVariant *snapshot_slot_status = NULL;
+static GVariant *snapshot_artifact_status = NULL;
+static gchar *snapshot_primary = NULL;
+
+/* set while a bundle is staged, as it uses the same streaming cache files as
+ * an installation */
+static gboolean staging = FALSE;
+
+/* set while slot hash indexes are built in the background */
+static GCancellable *hash_index_cancellable = NULL;
+/* set if the background hash index generation should be (re)started when
+ * the service is idle again */
+static gboolean hash_index_pending = FALSE;
+
+/* slot status returned by GetSlotStatus, rebuilt when it may have changed */
+static GVariant *slot_status_cache = NULL;
+/* set if slot_status_cache needs to be rebuilt */
+static gboolean slot_status_stale = TRUE;
+/* set if the slot status must be loaded from the status file again */
+static gboolean slot_status_reload = FALSE;
+static guint slot_status_refresh_id = 0;
+static GFileMonitor *status_file_monitor = NULL;
+static GUnixMountMonitor *mount_monitor = NULL;
+
+static void take_status_snapshot(void);
+static void clear_status_snapshot(void);
+static gboolean refresh_slot_status(GError **error);
+static void invalidate_slot_status(void);
+static void start_hash_index_generation(void);
+static void stop_hash_index_generation(void);
+
+/*
+ * Returns the value for the Statistics property, consisting of the live
+ * statistics and the D-Bus request latencies.
+ */
+static GVariant *get_statistics(void)
+{
+	g_auto(GVariantBuilder) builder = G_VARIANT_BUILDER_INIT(G_VARIANT_TYPE("a{sv}"));
+	g_autoptr(GVariant) live = g_variant_ref_sink(r_stats_get_live());
+	GVariantIter iter;
+	GHashTableIter latency_iter;
+	const gchar *key;
+	GVariant *value;
+	RaucStats *stats;
+
+	g_variant_iter_init(&iter, live);
+	while (g_variant_iter_loop(&iter, "{&sv}", &key, &value))
+		g_variant_builder_add(&builder, "{sv}", key, value);
+
+	g_mutex_lock(&request_latency_lock);
+	if (request_latency) {
+		g_hash_table_iter_init(&latency_iter, request_latency);
+		while (g_hash_table_iter_next(&latency_iter, NULL, (gpointer *)&stats))
+			g_variant_builder_add(&builder, "{sv}", stats->label, r_stats_to_variant(stats));
+	}
+	g_mutex_unlock(&request_latency_lock);
+
+	return g_variant_builder_end(&builder);
+}
+
+/*
+ * Records the time since start_time (from g_get_monotonic_time()) for the
+ * method. Must be called from the main thread.
+ */
+static void record_request_latency(const gchar *method, gint64 start_time)
+{
+	RaucStats *stats;
+
+	g_mutex_lock(&request_latency_lock);
+	if (!request_latency)
+		request_latency = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)r_stats_free);
+
+	stats = g_hash_table_lookup(request_latency, method);
+	if (!stats) {
+		g_autofree gchar *label = g_strdup_printf("dbus %s latency", method);
+		stats = r_stats_new_unlisted(label);
+		g_hash_table_insert(request_latency, g_strdup(method), stats);
+	}
+	g_mutex_unlock(&request_latency_lock);
+
+	r_stats_add(stats, (g_get_monotonic_time() - start_time) / (gdouble)G_USEC_PER_SEC);
+
+	if (r_installer)
+		r_installer_set_statistics(r_installer, get_statistics());
+}
+
 static gboolean service_install_notify(gpointer data)
 {
 	RaucInstallArgs *args = data;
@@ -48,8 +150,14 @@ static gboolean service_install_cleanup(gpointer data)
 	g_dbus_interface_skeleton_flush(G_DBUS_INTERFACE_SKELETON(r_installer));
 	g_mutex_unlock(&args->status_mutex);
 
+	clear_status_snapshot();
+	invalidate_slot_status();
+
 	install_args_free(args);
 
+	if (hash_index_pending)
+		start_hash_index_generation();
+
 	return G_SOURCE_REMOVE;
 }
 
@@ -73,12 +181,19 @@ static void convert_dict_to_bundle_access_args(
 		g_variant_dict_remove(dict, "tls-no-verify");
 	if (g_variant_dict_lookup(dict, "http-headers", "^as", &access_args->http_headers))
 		g_variant_dict_remove(dict, "http-headers");
+	if (g_variant_dict_lookup(dict, "mirrors", "^as", &access_args->mirrors))
+		g_variant_dict_remove(dict, "mirrors");
 }
 
-static gboolean r_on_handle_install_bundle(
+/*
+ * Starts an installation of the bundle at source or (if bundle_fd is not -1)
+ * passed as a file descriptor. Takes ownership of bundle_fd.
+ */
+static gboolean start_install_bundle(
 		RInstaller *interface,
 		GDBusMethodInvocation *invocation,
 		const gchar *source,
+		gint bundle_fd,
 		GVariant *arg_args)
 {
 	RaucInstallArgs *args = install_args_new();
@@ -91,7 +206,7 @@ static gboolean r_on_handle_install_bundle(
 
 	g_print("input bundle: %s\n", source);
 
-	res = !r_context_get_busy();
+	res = !r_context_get_busy() && !staging;
 	if (!res) {
 		message = g_strdup("Already processing a different method");
 		args->status_result = 1;
@@ -99,6 +214,9 @@ static gboolean r_on_handle_install_bundle(
 	}
 
 	args->name = g_strdup(source);
+	/* the bundle is received by the install thread */
+	args->bundle_fd = bundle_fd;
+	bundle_fd = -1;
 	args->notify = service_install_notify;
 	args->cleanup = service_install_cleanup;
 
@@ -114,6 +232,9 @@ static gboolean r_on_handle_install_bundle(
 	if (g_variant_dict_lookup(&dict, "require-manifest-hash", "s", &args->require_manifest_hash))
 		g_variant_dict_remove(&dict, "require-manifest-hash");
 
+	if (g_variant_dict_lookup(&dict, "priority", "s", &args->priority))
+		g_variant_dict_remove(&dict, "priority");
+
 	convert_dict_to_bundle_access_args(&dict, &args->access_args);
 
 	/* Check for unhandled keys */
@@ -129,10 +250,14 @@ static gboolean r_on_handle_install_bundle(
 
 	r_config_file_modified_check();
 
+	stop_hash_index_generation();
+	take_status_snapshot();
+
 	r_installer_set_operation(r_installer, "installing");
 	g_dbus_interface_skeleton_flush(G_DBUS_INTERFACE_SKELETON(r_installer));
 	res = install_run(args);
 	if (!res) {
+		clear_status_snapshot();
 		message = g_strdup("Failed to launch install thread");
 		args->status_result = 1;
 		goto out;
@@ -140,6 +265,8 @@ static gboolean r_on_handle_install_bundle(
 	args = NULL;
 
 out:
+	if (bundle_fd >= 0)
+		g_close(bundle_fd, NULL);
 	g_clear_pointer(&args, install_args_free);
 	if (res) {
 		r_installer_complete_install(interface, invocation);
@@ -154,6 +281,40 @@ out:
 	return TRUE;
 }
 
+static gboolean r_on_handle_install_bundle(
+		RInstaller *interface,
+		GDBusMethodInvocation *invocation,
+		const gchar *source,
+		GVariant *arg_args)
+{
+	return start_install_bundle(interface, invocation, source, -1, arg_args);
+}
+
+static gboolean r_on_handle_install_bundle_fd(
+		RInstaller *interface,
+		GDBusMethodInvocation *invocation,
+		GUnixFDList *fd_list,
+		GVariant *arg_fd,
+		GVariant *arg_args)
+{
+	g_autoptr(GError) ierror = NULL;
+	gint bundle_fd = -1;
+
+	if (fd_list)
+		bundle_fd = g_unix_fd_list_get(fd_list, g_variant_get_handle(arg_fd), &ierror);
+	else
+		g_set_error(&ierror, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "No file descriptor passed");
+	if (bundle_fd < 0) {
+		g_dbus_method_invocation_return_error(invocation,
+				G_IO_ERROR,
+				G_IO_ERROR_FAILED_HANDLED,
+				"Invalid bundle file descriptor: %s", ierror->message);
+		return TRUE;
+	}
+
+	return start_install_bundle(interface, invocation, "file descriptor", bundle_fd, arg_args);
+}
+
 static gboolean r_on_handle_install(RInstaller *interface,
 		GDBusMethodInvocation  *invocation,
 		const gchar *arg_source)
@@ -162,98 +323,428 @@ static gboolean r_on_handle_install(RInstaller *interface,
 	return r_on_handle_install_bundle(interface, invocation, arg_source, NULL);
 }
 
+typedef struct {
+	gchar *bundle;
+	RaucBundleAccessArgs access_args;
+	gboolean legacy; /* reply for the deprecated 'Info' method */
+	gint64 start_time;
+} InspectBundleData;
+
+static void inspect_bundle_data_free(InspectBundleData *data)
+{
+	g_free(data->bundle);
+	clear_bundle_access_args(&data->access_args);
+	g_free(data);
+}
+
+/*
+ * Checks the bundle and loads its manifest in a worker thread.
+ *
+ * This only reads the configuration and does not report progress, so it can
+ * run concurrently with an installation.
+ */
+static void inspect_bundle_thread(GTask *task, gpointer source_object, gpointer task_data, GCancellable *cancellable)
+{
+	InspectBundleData *data = task_data;
+	g_autoptr(RaucBundle) bundle = NULL;
+	RaucManifest *manifest = NULL;
+	GError *ierror = NULL;
+
+	r_context_set_progress_muted(TRUE);
+
+	if (!check_bundle(data->bundle, &bundle, CHECK_BUNDLE_DEFAULT, &data->access_args, &ierror)) {
+		g_task_return_error(task, ierror);
+		goto out;
+	}
+
+	if (bundle->manifest) {
+		manifest = g_steal_pointer(&bundle->manifest);
+	} else if (!load_manifest_from_bundle(bundle, &manifest, &ierror)) {
+		g_task_return_error(task, ierror);
+		goto out;
+	}
+
+	g_task_return_pointer(task, manifest, (GDestroyNotify)free_manifest);
+
+out:
+	r_context_set_progress_muted(FALSE);
+}
+
+static void inspect_bundle_done(GObject *source_object, GAsyncResult *result, gpointer user_data)
+{
+	GDBusMethodInvocation *invocation = user_data;
+	InspectBundleData *data = g_task_get_task_data(G_TASK(result));
+	g_autoptr(RaucManifest) manifest = NULL;
+	GError *ierror = NULL;
+
+	manifest = g_task_propagate_pointer(G_TASK(result), &ierror);
+	if (!manifest) {
+		g_dbus_method_invocation_return_error(invocation,
+				G_IO_ERROR,
+				G_IO_ERROR_FAILED_HANDLED,
+				"%s", ierror->message);
+		g_clear_error(&ierror);
+	} else if (!data->legacy) {
+		r_installer_complete_inspect_bundle(
+				r_installer,
+				invocation,
+				r_manifest_to_dict(manifest));
+	} else {
+		r_installer_complete_info(
+				r_installer,
+				invocation,
+				manifest->update_compatible,
+				manifest->update_version ? manifest->update_version : "");
+	}
+
+	record_request_latency(data->legacy ? "Info" : "InspectBundle", data->start_time);
+}
+
 static gboolean r_on_handle_inspect_bundle(RInstaller *interface,
 		GDBusMethodInvocation  *invocation,
 		const gchar *arg_bundle, GVariant *arg_args)
 {
-	g_auto(RaucBundleAccessArgs) access_args = {0};
 	g_auto(GVariantDict) dict = G_VARIANT_DICT_INIT(arg_args);
 	g_autoptr(GVariant) remaining = NULL;
+	g_autoptr(GTask) task = NULL;
+	InspectBundleData *data = g_new0(InspectBundleData, 1);
 	GVariantIter iter;
 	gchar *key;
-	g_autoptr(RaucManifest) manifest = NULL;
-	g_autoptr(RaucBundle) bundle = NULL;
-	g_autofree gchar *message = NULL;
-	GError *error = NULL;
-	gboolean res = TRUE;
 
 	g_print("bundle: %s\n", arg_bundle);
 
-	res = !r_context_get_busy();
-	if (!res) {
-		message = g_strdup("already processing a different method");
-		goto out;
-	}
+	data->bundle = g_strdup(arg_bundle);
+	data->legacy = !arg_args;
+	data->start_time = g_get_monotonic_time();
 
-	convert_dict_to_bundle_access_args(&dict, &access_args);
+	convert_dict_to_bundle_access_args(&dict, &data->access_args);
 
 	/* Check for unhandled keys */
 	remaining = g_variant_dict_end(&dict);
 	g_variant_iter_init(&iter, remaining);
 	while (g_variant_iter_next(&iter, "{sv}", &key, NULL)) {
-		message = g_strdup_printf("Unsupported key: %s", key);
+		g_dbus_method_invocation_return_error(invocation,
+				G_IO_ERROR,
+				G_IO_ERROR_FAILED_HANDLED,
+				"Unsupported key: %s", key);
 		g_free(key);
-		res = FALSE;
-		goto out;
+		inspect_bundle_data_free(data);
+		return TRUE;
 	}
 
-	g_assert(access_args.http_info_headers == NULL);
-	access_args.http_info_headers = assemble_info_headers(NULL);
+	g_assert(data->access_args.http_info_headers == NULL);
+	data->access_args.http_info_headers = assemble_info_headers(NULL);
 
-	res = check_bundle(arg_bundle, &bundle, CHECK_BUNDLE_DEFAULT, &access_args, &error);
-	if (!res) {
-		message = g_strdup(error->message);
-		g_clear_error(&error);
-		goto out;
-	}
+	/* The bundle is checked in a worker thread, so that this is possible
+	 * during an installation and does not block other requests. */
+	task = g_task_new(NULL, NULL, inspect_bundle_done, invocation);
+	g_task_set_task_data(task, data, (GDestroyNotify)inspect_bundle_data_free);
+	g_task_run_in_thread(task, inspect_bundle_thread);
 
-	if (bundle->manifest) {
-		manifest = g_steal_pointer(&bundle->manifest);
+	return TRUE;
+}
+
+static gboolean r_on_handle_info(RInstaller *interface,
+		GDBusMethodInvocation  *invocation,
+		const gchar *arg_bundle)
+{
+	g_message("Using deprecated 'Info' D-Bus Method (replaced by 'InspectBundle')");
+	return r_on_handle_inspect_bundle(interface, invocation, arg_bundle, NULL);
+}
+
+typedef struct {
+	gchar *bundle;
+	RaucBundleAccessArgs access_args;
+	gint64 start_time;
+} StageBundleData;
+
+static void stage_bundle_data_free(StageBundleData *data)
+{
+	g_free(data->bundle);
+	clear_bundle_access_args(&data->access_args);
+	g_free(data);
+}
+
+static void stage_bundle_thread(GTask *task, gpointer source_object, gpointer task_data, GCancellable *cancellable)
+{
+	StageBundleData *data = task_data;
+	GError *ierror = NULL;
+
+	r_context_set_progress_muted(TRUE);
+
+	if (stage_bundle(data->bundle, &data->access_args, &ierror))
+		g_task_return_boolean(task, TRUE);
+	else
+		g_task_return_error(task, ierror);
+
+	r_context_set_progress_muted(FALSE);
+}
+
+static void stage_bundle_done(GObject *source_object, GAsyncResult *result, gpointer user_data)
+{
+	GDBusMethodInvocation *invocation = user_data;
+	StageBundleData *data = g_task_get_task_data(G_TASK(result));
+	GError *ierror = NULL;
+
+	staging = FALSE;
+
+	if (!g_task_propagate_boolean(G_TASK(result), &ierror)) {
+		g_message("staging `%s` failed: %s", data->bundle, ierror->message);
+		g_dbus_method_invocation_return_error(invocation,
+				G_IO_ERROR,
+				G_IO_ERROR_FAILED_HANDLED,
+				"%s", ierror->message);
+		g_clear_error(&ierror);
 	} else {
-		res = load_manifest_from_bundle(bundle, &manifest, &error);
-		if (!res) {
-			message = g_strdup(error->message);
-			g_clear_error(&error);
-			goto out;
-		}
+		g_message("staging `%s` succeeded", data->bundle);
+		r_installer_complete_stage_bundle(r_installer, invocation);
 	}
 
-out:
-	if (!res) {
+	record_request_latency("StageBundle", data->start_time);
+}
+
+static gboolean r_on_handle_stage_bundle(RInstaller *interface,
+		GDBusMethodInvocation  *invocation,
+		const gchar *arg_bundle, GVariant *arg_args)
+{
+	g_auto(GVariantDict) dict = G_VARIANT_DICT_INIT(arg_args);
+	g_autoptr(GVariant) remaining = NULL;
+	g_autoptr(GTask) task = NULL;
+	StageBundleData *data = NULL;
+	GVariantIter iter;
+	gchar *key;
+
+	g_print("stage bundle: %s\n", arg_bundle);
+
+	if (r_context_get_busy() || staging) {
 		g_dbus_method_invocation_return_error(invocation,
 				G_IO_ERROR,
 				G_IO_ERROR_FAILED_HANDLED,
-				"%s", message);
+				"Already processing a different method");
 		return TRUE;
 	}
 
-	if (arg_args) {
-		GVariant *info_variant;
+	data = g_new0(StageBundleData, 1);
+	data->bundle = g_strdup(arg_bundle);
+	data->start_time = g_get_monotonic_time();
 
-		info_variant = r_manifest_to_dict(manifest);
+	convert_dict_to_bundle_access_args(&dict, &data->access_args);
 
-		r_installer_complete_inspect_bundle(
-				interface,
-				invocation,
-				info_variant);
-	} else {
-		/* arg_args unset means legacy API */
-		r_installer_complete_info(
-				interface,
-				invocation,
-				manifest->update_compatible,
-				manifest->update_version ? manifest->update_version : "");
+	/* Check for unhandled keys */
+	remaining = g_variant_dict_end(&dict);
+	g_variant_iter_init(&iter, remaining);
+	while (g_variant_iter_next(&iter, "{sv}", &key, NULL)) {
+		g_dbus_method_invocation_return_error(invocation,
+				G_IO_ERROR,
+				G_IO_ERROR_FAILED_HANDLED,
+				"Unsupported key: %s", key);
+		g_free(key);
+		stage_bundle_data_free(data);
+		return TRUE;
 	}
 
+	g_assert(data->access_args.http_info_headers == NULL);
+	data->access_args.http_info_headers = assemble_info_headers(NULL);
+
+	r_config_file_modified_check();
+
+	/* Staging takes as long as the download, so it runs in a worker thread
+	 * and the reply is sent when it is finished. */
+	staging = TRUE;
+	task = g_task_new(NULL, NULL, stage_bundle_done, invocation);
+	g_task_set_task_data(task, data, (GDestroyNotify)stage_bundle_data_free);
+	g_task_run_in_thread(task, stage_bundle_thread);
+
 	return TRUE;
 }
 
-static gboolean r_on_handle_info(RInstaller *interface,
-		GDBusMethodInvocation  *invocation,
-		const gchar *arg_bundle)
+typedef struct {
+	RaucSlot *slot;
+	/* copy of the slot status checksum, or without digest if unknown */
+	RaucChecksum checksum;
+	/* whether the calculated checksum should be stored in the slot status */
+	gboolean update_status;
+} HashIndexJob;
+
+static void hash_index_job_free(HashIndexJob *job)
 {
-	g_message("Using deprecated 'Info' D-Bus Method (replaced by 'InspectBundle')");
-	return r_on_handle_inspect_bundle(interface, invocation, arg_bundle, NULL);
+	g_free(job->checksum.digest);
+	g_free(job);
+}
+
+/* the hash indexes are built while the system is otherwise idle */
+static const RaucThreadPriority hash_index_priority = {
+	.nice = 19,
+	.io_class = R_IOPRIO_CLASS_IDLE,
+	.io_level = 7,
+};
+
+static void hash_index_thread(GTask *task, gpointer source_object,
+		gpointer task_data, GCancellable *cancellable)
+{
+	GPtrArray *jobs = task_data;
+	RaucThreadPriority old_priority = {0};
+	gboolean restore_priority;
+
+	/* the GTask thread pool is shared, so restore the priority when done */
+	restore_priority = r_get_thread_priority(&old_priority, NULL);
+	if (!r_set_thread_priority(&hash_index_priority, NULL))
+		g_message("Failed to lower priority for building hash indexes");
+
+	for (guint i = 0; i < jobs->len; i++) {
+		HashIndexJob *job = g_ptr_array_index(jobs, i);
+		g_autoptr(GError) ierror = NULL;
+
+		if (!r_hash_index_build_slot(job->slot, &job->checksum, cancellable, &ierror)) {
+			if (g_error_matches(ierror, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+				g_message("Building hash index for slot %s interrupted", job->slot->name);
+				break;
+			}
+			g_message("Failed to build hash index for slot %s: %s", job->slot->name, ierror->message);
+			/* don't store a checksum without matching index */
+			g_clear_pointer(&job->checksum.digest, g_free);
+		}
+	}
+
+	if (restore_priority && !r_set_thread_priority(&old_priority, NULL))
+		g_message("Failed to restore thread priority");
+
+	g_task_return_boolean(task, TRUE);
+}
+
+static void hash_index_done(GObject *source_object, GAsyncResult *result, gpointer user_data)
+{
+	GPtrArray *jobs = g_task_get_task_data(G_TASK(result));
+	gboolean cancelled = g_cancellable_is_cancelled(hash_index_cancellable);
+
+	g_clear_object(&hash_index_cancellable);
+
+	/* An installation may be running or may have modified the slots, so
+	 * the checksums are only recorded if we were not interrupted. */
+	for (guint i = 0; i < jobs->len && !cancelled; i++) {
+		HashIndexJob *job = g_ptr_array_index(jobs, i);
+		RaucSlotStatus *slot_state = job->slot->status;
+		g_autoptr(GError) ierror = NULL;
+
+		if (!job->update_status || !job->checksum.digest)
+			continue;
+		if (!slot_state || slot_state->checksum.digest)
+			continue;
+
+		slot_state->checksum.type = job->checksum.type;
+		slot_state->checksum.digest = g_strdup(job->checksum.digest);
+		slot_state->checksum.size = job->checksum.size;
+
+		if (!r_slot_status_save(job->slot, &ierror))
+			g_message("Failed to save checksum for slot %s: %s", job->slot->name, ierror->message);
+		invalidate_slot_status();
+	}
+
+	if (cancelled) {
+		hash_index_pending = TRUE;
+		if (!r_context_get_busy())
+			start_hash_index_generation();
+	}
+}
+
+/*
+ * Returns whether a slot needs a hash index to be built in the background.
+ */
+static gboolean slot_needs_hash_index(RaucSlot *slot)
+{
+	g_autoptr(GError) ierror = NULL;
+	g_autofree gchar *dir = NULL;
+	g_autofree gchar *index_filename = NULL;
+
+	/* only these types are updated using the block-hash-index */
+	if (!slot->data_directory || !g_strv_contains((const gchar * const[]){"raw", "ext4", "vfat", NULL}, slot->type))
+		return FALSE;
+
+	r_slot_status_load(slot);
+
+	/* The slot content is only known to be complete and unchanged after
+	 * a successful installation (or if it has no status at all). */
+	if (slot->status->status && g_strcmp0(slot->status->status, "ok") != 0)
+		return FALSE;
+
+	/* without checksum, we need to calculate it if possible */
+	if (!slot->status->checksum.digest &&
+	    g_strcmp0(r_context()->config->statusfile_path, "per-slot") != 0)
+		return TRUE;
+
+	dir = r_slot_get_checksum_data_directory(slot, NULL, &ierror);
+	if (!dir) {
+		g_message("Not building hash index for slot %s: %s", slot->name, ierror->message);
+		return FALSE;
+	}
+	index_filename = g_build_filename(dir, "block-hash-index", NULL);
+
+	return !g_file_test(index_filename, G_FILE_TEST_IS_REGULAR);
+}
+
+/*
+ * Starts building missing slot hash indexes in a background thread, so the
+ * next adaptive installation doesn't need to calculate them first.
+ */
+static void start_hash_index_generation(void)
+{
+	g_autoptr(GPtrArray) jobs = NULL;
+	g_autoptr(GTask) task = NULL;
+	GHashTableIter iter;
+	RaucSlot *slot;
+
+	if (!r_context()->config->background_hash_index)
+		return;
+
+	if (hash_index_cancellable)
+		return;
+
+	if (r_context_get_busy()) {
+		hash_index_pending = TRUE;
+		return;
+	}
+	hash_index_pending = FALSE;
+
+	jobs = g_ptr_array_new_with_free_func((GDestroyNotify)hash_index_job_free);
+	g_hash_table_iter_init(&iter, r_context()->config->slots);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer*) &slot)) {
+		HashIndexJob *job;
+
+		if (!slot_needs_hash_index(slot))
+			continue;
+
+		job = g_new0(HashIndexJob, 1);
+		job->slot = slot;
+		job->checksum.type = slot->status->checksum.type;
+		job->checksum.digest = g_strdup(slot->status->checksum.digest);
+		job->checksum.size = slot->status->checksum.size;
+		job->update_status = !job->checksum.digest;
+		g_ptr_array_add(jobs, job);
+	}
+
+	if (!jobs->len)
+		return;
+
+	g_message("Building hash indexes for %u slots in the background", jobs->len);
+
+	hash_index_cancellable = g_cancellable_new();
+	task = g_task_new(NULL, hash_index_cancellable, hash_index_done, NULL);
+	g_task_set_task_data(task, g_steal_pointer(&jobs), (GDestroyNotify)g_ptr_array_unref);
+	g_task_run_in_thread(task, hash_index_thread);
+}
+
+/*
+ * Interrupts the background hash index generation before the slots are
+ * modified. It is continued after the installation.
+ */
+static void stop_hash_index_generation(void)
+{
+	if (!hash_index_cancellable)
+		return;
+
+	g_message("Interrupting background hash index generation");
+	g_cancellable_cancel(hash_index_cancellable);
+	hash_index_pending = TRUE;
 }
 
 static gboolean r_on_handle_mark(RInstaller *interface,
@@ -272,6 +763,12 @@ static gboolean r_on_handle_mark(RInstaller *interface,
 	}
 
 	res = mark_run(arg_state, arg_slot_identifier, &slot_name, &message);
+	invalidate_slot_status();
+
+	/* the booted system is known to be good now, so it's a good time to
+	 * prepare for the next adaptive update */
+	if (res && g_str_equal(arg_state, "good"))
+		start_hash_index_generation();
 
 out:
 	if (res) {
@@ -356,6 +853,11 @@ static GVariant* convert_slot_status_to_dict(RaucSlot *slot)
 		g_variant_dict_insert(&dict, "activated.count", "u", slot_state->activated_count);
 	}
 
+	if (slot_state->verity_root_hash) {
+		g_variant_dict_insert(&dict, "verity.root-hash", "s", slot_state->verity_root_hash);
+		g_variant_dict_insert(&dict, "verity.salt", "s", slot_state->verity_salt);
+	}
+
 	return g_variant_dict_end(&dict);
 }
 
@@ -412,33 +914,278 @@ static GVariant* create_slotstatus_array(GError **error)
 	return slot_status_array;
 }
 
-static gboolean r_on_handle_get_slot_status(RInstaller *interface,
-		GDBusMethodInvocation  *invocation)
+/*
+ * Captures the state returned by the read-only methods before an
+ * installation starts.
+ *
+ * The installation thread modifies the slot and artifact status, so these
+ * methods return the state from before the installation while it is running.
+ */
+static void take_status_snapshot(void)
 {
-	GVariant *slotstatus;
 	GError *ierror = NULL;
-	gboolean res;
+	RaucSlot *primary = NULL;
 
-	res = !r_context_get_busy();
+	clear_status_snapshot();
 
-	if (!res) {
-		g_dbus_method_invocation_return_error(invocation,
-				G_IO_ERROR,
-				G_IO_ERROR_FAILED_HANDLED,
-				"already processing a different method");
+	/* this is also the state SlotStatusChanged compares with afterwards */
+	if (slot_status_stale && !refresh_slot_status(&ierror)) {
+		g_message("Failed to capture slot status: %s", ierror->message);
+		g_clear_error(&ierror);
+	}
+	if (slot_status_cache)
+		snapshot_slot_status = g_variant_ref(slot_status_cache);
+
+	snapshot_artifact_status = r_artifacts_to_dict();
+	if (snapshot_artifact_status)
+		g_variant_ref_sink(snapshot_artifact_status);
+
+	primary = r_boot_get_primary(&ierror);
+	if (primary) {
+		snapshot_primary = g_strdup(primary->name);
+	} else {
+		g_debug("Failed to capture primary slot: %s", ierror->message);
+		g_clear_error(&ierror);
+	}
+}
+
+static void clear_status_snapshot(void)
+{
+	g_clear_pointer(&snapshot_slot_status, g_variant_unref);
+	g_clear_pointer(&snapshot_artifact_status, g_variant_unref);
+	g_clear_pointer(&snapshot_primary, g_free);
+}
+
+/*
+ * Returns the (slotname, dict) tuple for a slot from a slot status array, or
+ * NULL if it is not contained.
+ */
+static GVariant *find_slot_status(GVariant *slot_status_array, const gchar *name)
+{
+	GVariantIter iter;
+	GVariant *tuple;
+
+	g_variant_iter_init(&iter, slot_status_array);
+	while ((tuple = g_variant_iter_next_value(&iter))) {
+		const gchar *tuple_name = NULL;
+
+		g_variant_get_child(tuple, 0, "&s", &tuple_name);
+		if (g_str_equal(tuple_name, name))
+			return tuple;
+		g_variant_unref(tuple);
+	}
+
+	return NULL;
+}
+
+/*
+ * Returns the tuples of new_status which differ from old_status, or NULL if
+ * nothing changed.
+ */
+static GVariant *get_changed_slot_status(GVariant *old_status, GVariant *new_status)
+{
+	GVariantBuilder builder;
+	GVariantIter iter;
+	GVariant *tuple;
+	gboolean changed = FALSE;
+
+	g_variant_builder_init(&builder, G_VARIANT_TYPE("a(sa{sv})"));
+
+	g_variant_iter_init(&iter, new_status);
+	while ((tuple = g_variant_iter_next_value(&iter))) {
+		g_autoptr(GVariant) new_tuple = tuple;
+		g_autoptr(GVariant) old_tuple = NULL;
+		const gchar *name = NULL;
+
+		g_variant_get_child(new_tuple, 0, "&s", &name);
+		old_tuple = find_slot_status(old_status, name);
+		if (old_tuple && g_variant_equal(old_tuple, new_tuple))
+			continue;
+
+		g_variant_builder_add_value(&builder, new_tuple);
+		changed = TRUE;
+	}
+
+	if (!changed) {
+		g_variant_builder_clear(&builder);
+		return NULL;
+	}
+
+	return g_variant_builder_end(&builder);
+}
+
+/*
+ * Rebuilds the cached slot status and emits SlotStatusChanged for the slots
+ * which differ from the previously cached state.
+ *
+ * Must not be called during an installation, as the installation thread
+ * modifies the slot status.
+ */
+static gboolean refresh_slot_status(GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(GVariant) old_status = NULL;
+	GVariant *new_status = NULL;
+	GVariant *changed = NULL;
+
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	g_assert_false(r_context_get_busy());
+
+	if (slot_status_reload) {
+		GHashTableIter iter;
+		RaucSlot *slot;
+
+		g_hash_table_iter_init(&iter, r_context()->config->slots);
+		while (g_hash_table_iter_next(&iter, NULL, (gpointer*) &slot))
+			g_clear_pointer(&slot->status, r_slot_free_status);
+		slot_status_reload = FALSE;
+	}
+
+	new_status = create_slotstatus_array(&ierror);
+	if (!new_status) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	old_status = g_steal_pointer(&slot_status_cache);
+	slot_status_cache = g_variant_ref_sink(new_status);
+	slot_status_stale = FALSE;
+
+	/* the first state is only the reference for later changes */
+	if (!old_status)
 		return TRUE;
+
+	changed = get_changed_slot_status(old_status, slot_status_cache);
+	if (changed) {
+		g_debug("Slot status changed for %"G_GSIZE_FORMAT " slots", g_variant_n_children(changed));
+		r_installer_emit_slot_status_changed(r_installer, changed);
+	}
+
+	return TRUE;
+}
+
+static gboolean slot_status_refresh_cb(gpointer user_data)
+{
+	GError *ierror = NULL;
+
+	slot_status_refresh_id = 0;
+
+	/* invalidated again when the installation is done */
+	if (r_context_get_busy() || !slot_status_stale)
+		return G_SOURCE_REMOVE;
+
+	if (!refresh_slot_status(&ierror)) {
+		g_message("Failed to update slot status: %s", ierror->message);
+		g_clear_error(&ierror);
+	}
+
+	return G_SOURCE_REMOVE;
+}
+
+/*
+ * Marks the cached slot status as outdated and rebuilds it when the main
+ * loop is idle, so that SlotStatusChanged is emitted without waiting for the
+ * next GetSlotStatus call.
+ */
+static void invalidate_slot_status(void)
+{
+	slot_status_stale = TRUE;
+
+	if (!slot_status_refresh_id)
+		slot_status_refresh_id = g_idle_add(slot_status_refresh_cb, NULL);
+}
+
+static void on_status_file_changed(GFileMonitor *monitor, GFile *file,
+		GFile *other_file, GFileMonitorEvent event_type, gpointer user_data)
+{
+	if (event_type == G_FILE_MONITOR_EVENT_ATTRIBUTE_CHANGED ||
+	    event_type == G_FILE_MONITOR_EVENT_CHANGED)
+		return;
+
+	slot_status_reload = TRUE;
+	invalidate_slot_status();
+}
+
+static void on_mounts_changed(GUnixMountMonitor *monitor, gpointer user_data)
+{
+	invalidate_slot_status();
+}
+
+/*
+ * Watches the sources of the slot status which can change outside of the
+ * service: the shared status file and the mount points.
+ *
+ * The status and boot state changed by the service itself (by installing or
+ * marking slots) invalidate the cache directly. Boot states changed by other
+ * tools and per-slot status files are not watched (see the GetSlotStatus
+ * documentation).
+ */
+static void watch_slot_status(void)
+{
+	const gchar *statusfile_path = r_context()->config->statusfile_path;
+	GError *ierror = NULL;
+
+	if (statusfile_path && g_strcmp0(statusfile_path, "per-slot") != 0) {
+		g_autoptr(GFile) file = g_file_new_for_path(statusfile_path);
+
+		status_file_monitor = g_file_monitor_file(file, G_FILE_MONITOR_WATCH_MOVES, NULL, &ierror);
+		if (status_file_monitor) {
+			g_signal_connect(status_file_monitor, "changed",
+					G_CALLBACK(on_status_file_changed), NULL);
+		} else {
+			g_message("Failed to watch status file %s: %s", statusfile_path, ierror->message);
+			g_clear_error(&ierror);
+		}
+	}
+
+	mount_monitor = g_unix_mount_monitor_get();
+	g_signal_connect(mount_monitor, "mounts-changed",
+			G_CALLBACK(on_mounts_changed), NULL);
+
+	invalidate_slot_status();
+}
+
+static void unwatch_slot_status(void)
+{
+	g_clear_object(&status_file_monitor);
+	if (mount_monitor)
+		g_signal_handlers_disconnect_by_func(mount_monitor, on_mounts_changed, NULL);
+	g_clear_object(&mount_monitor);
+	g_clear_handle_id(&slot_status_refresh_id, g_source_remove);
+	g_clear_pointer(&slot_status_cache, g_variant_unref);
+	slot_status_stale = TRUE;
+}
+
+static gboolean r_on_handle_get_slot_status(RInstaller *interface,
+		GDBusMethodInvocation  *invocation)
+{
+	GError *ierror = NULL;
+	gint64 start_time = g_get_monotonic_time();
+
+	if (r_context_get_busy()) {
+		if (!snapshot_slot_status) {
+			g_dbus_method_invocation_return_error(invocation,
+					G_IO_ERROR,
+					G_IO_ERROR_FAILED_HANDLED,
+					"slot status not available during installation");
+			return TRUE;
+		}
+		r_installer_complete_get_slot_status(interface, invocation, snapshot_slot_status);
+		goto out;
 	}
 
 	r_config_file_modified_check();
 
-	slotstatus = create_slotstatus_array(&ierror);
-	if (!slotstatus) {
+	if (slot_status_stale && !refresh_slot_status(&ierror)) {
 		g_dbus_method_invocation_return_gerror(invocation, ierror);
 		return TRUE;
 	}
 
-	r_installer_complete_get_slot_status(interface, invocation, slotstatus);
+	r_installer_complete_get_slot_status(interface, invocation, slot_status_cache);
 
+out:
+	record_request_latency("GetSlotStatus", start_time);
 	return TRUE;
 }
 
@@ -447,16 +1194,18 @@ static gboolean r_on_handle_get_artifact_status(RInstaller *interface,
 {
 	GVariant *artifactstatus;
 	GError *ierror = NULL;
-	gboolean res;
-
-	res = !r_context_get_busy();
+	gint64 start_time = g_get_monotonic_time();
 
-	if (!res) {
-		g_dbus_method_invocation_return_error(invocation,
-				G_IO_ERROR,
-				G_IO_ERROR_FAILED_HANDLED,
-				"already processing a different method");
-		return TRUE;
+	if (r_context_get_busy()) {
+		if (!snapshot_artifact_status) {
+			g_dbus_method_invocation_return_error(invocation,
+					G_IO_ERROR,
+					G_IO_ERROR_FAILED_HANDLED,
+					"artifact status not available during installation");
+			return TRUE;
+		}
+		r_installer_complete_get_artifact_status(interface, invocation, snapshot_artifact_status);
+		goto out;
 	}
 
 	artifactstatus = r_artifacts_to_dict();
@@ -467,6 +1216,8 @@ static gboolean r_on_handle_get_artifact_status(RInstaller *interface,
 
 	r_installer_complete_get_artifact_status(interface, invocation, artifactstatus);
 
+out:
+	record_request_latency("GetArtifactStatus", start_time);
 	return TRUE;
 }
 
@@ -475,13 +1226,18 @@ static gboolean r_on_handle_get_primary(RInstaller *interface,
 {
 	GError *ierror = NULL;
 	RaucSlot *primary = NULL;
+	gint64 start_time = g_get_monotonic_time();
 
 	if (r_context_get_busy()) {
-		g_dbus_method_invocation_return_error(invocation,
-				G_IO_ERROR,
-				G_IO_ERROR_FAILED_HANDLED,
-				"already processing a different method");
-		return TRUE;
+		if (!snapshot_primary) {
+			g_dbus_method_invocation_return_error(invocation,
+					G_IO_ERROR,
+					G_IO_ERROR_FAILED_HANDLED,
+					"primary slot not available during installation");
+			return TRUE;
+		}
+		r_installer_complete_get_primary(interface, invocation, snapshot_primary);
+		goto out;
 	}
 
 	primary = r_boot_get_primary(&ierror);
@@ -497,6 +1253,8 @@ static gboolean r_on_handle_get_primary(RInstaller *interface,
 
 	r_installer_complete_get_primary(interface, invocation, primary->name);
 
+out:
+	record_request_latency("GetPrimary", start_time);
 	return TRUE;
 }
 
@@ -518,8 +1276,12 @@ static gboolean auto_install(const gchar *source)
 	args->notify = service_install_notify;
 	args->cleanup = service_install_cleanup;
 
+	stop_hash_index_generation();
+	take_status_snapshot();
+
 	res = install_run(args);
 	if (!res) {
+		clear_status_snapshot();
 		goto out;
 	}
 	args = NULL;
@@ -540,10 +1302,30 @@ static void send_progress_callback(gint percentage,
 		const gchar *message,
 		gint nesting_depth)
 {
+	static gint64 last_statistics = 0;
 	GVariant *progress_update_tuple;
+	g_auto(GVariantDict) dict = G_VARIANT_DICT_INIT(NULL);
+	RaucProgressBytes bytes = {0};
+	gint64 now = g_get_monotonic_time();
 
 	progress_update_tuple = g_variant_new("(isi)", percentage, message, nesting_depth);
 
+	if (r_context_get_progress_bytes(&bytes)) {
+		g_variant_dict_insert(&dict, "step", "s", bytes.step);
+		g_variant_dict_insert(&dict, "bytes-done", "t", (guint64)bytes.done);
+		g_variant_dict_insert(&dict, "bytes-total", "t", (guint64)bytes.total);
+		g_variant_dict_insert(&dict, "rate", "d", bytes.rate);
+		if (bytes.eta >= 0)
+			g_variant_dict_insert(&dict, "eta", "d", bytes.eta);
+	}
+	r_installer_set_progress_bytes(r_installer, g_variant_dict_end(&dict));
+
+	/* limit the rate of statistics updates */
+	if (now - last_statistics >= R_SERVICE_STATISTICS_INTERVAL) {
+		r_installer_set_statistics(r_installer, get_statistics());
+		last_statistics = now;
+	}
+
 	r_installer_set_progress(r_installer, progress_update_tuple);
 	g_dbus_interface_skeleton_flush(G_DBUS_INTERFACE_SKELETON(r_installer));
 }
@@ -564,6 +1346,14 @@ static void r_on_bus_acquired(GDBusConnection *connection,
 			G_CALLBACK(r_on_handle_install_bundle),
 			NULL);
 
+	g_signal_connect(r_installer, "handle-install-bundle-fd",
+			G_CALLBACK(r_on_handle_install_bundle_fd),
+			NULL);
+
+	g_signal_connect(r_installer, "handle-stage-bundle",
+			G_CALLBACK(r_on_handle_stage_bundle),
+			NULL);
+
 	g_signal_connect(r_installer, "handle-info",
 			G_CALLBACK(r_on_handle_info),
 			NULL);
@@ -592,6 +1382,8 @@ static void r_on_bus_acquired(GDBusConnection *connection,
 
 	// Set initial Operation status to "idle"
 	r_installer_set_operation(r_installer, "idle");
+	r_installer_set_statistics(r_installer, get_statistics());
+	r_installer_set_progress_bytes(r_installer, g_variant_new("a{sv}", NULL));
 
 	if (!g_dbus_interface_skeleton_export(G_DBUS_INTERFACE_SKELETON(r_installer),
 			connection,
@@ -604,6 +1396,8 @@ static void r_on_bus_acquired(GDBusConnection *connection,
 	r_installer_set_compatible(r_installer, r_context()->config->system_compatible);
 	r_installer_set_variant(r_installer, r_context()->config->system_variant);
 	r_installer_set_boot_slot(r_installer, r_context()->bootslot);
+
+	watch_slot_status();
 }
 
 static void r_on_name_acquired(GDBusConnection *connection,
@@ -669,13 +1463,20 @@ gboolean r_service_run(void)
 
 	g_main_loop_run(service_loop);
 
+	stop_hash_index_generation();
+
 	if (r_bus_name_id)
 		g_bus_unown_name(r_bus_name_id);
 
 	g_main_loop_unref(service_loop);
 	service_loop = NULL;
 
+	unwatch_slot_status();
 	g_clear_pointer(&r_installer, g_object_unref);
+	clear_status_snapshot();
+	g_mutex_lock(&request_latency_lock);
+	g_clear_pointer(&request_latency, g_hash_table_destroy);
+	g_mutex_unlock(&request_latency_lock);
 
 	return service_return;
 }
@@ -9,7 +9,10 @@
 #include <openssl/engine.h>
 #endif
 #include <openssl/x509.h>
+#include <fcntl.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "context.h"
 #include "signature.h"
@@ -91,12 +94,10 @@ static int check_purpose_code_sign(const X509_PURPOSE *xp, const X509 *const_x,
 	return 1;
 }
 
-gboolean signature_init(GError **error)
+static gboolean signature_init_once(GError **error)
 {
 	int ret, id;
 
-	g_return_val_if_fail(error == FALSE || *error == NULL, FALSE);
-
 	ret = OPENSSL_init_crypto(OPENSSL_INIT_LOAD_CONFIG | OPENSSL_INIT_LOAD_CRYPTO_STRINGS, NULL);
 	if (!ret) {
 		g_set_error(
@@ -129,14 +130,51 @@ gboolean signature_init(GError **error)
 	return TRUE;
 }
 
+gboolean signature_init(GError **error)
+{
+	static gsize initialized = 0;
+	static gboolean result = FALSE;
+	static gchar *failure = NULL;
+
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (g_once_init_enter(&initialized)) {
+		GError *ierror = NULL;
+		gint64 start = g_get_monotonic_time();
+
+		result = signature_init_once(&ierror);
+		if (!result) {
+			failure = g_strdup(ierror->message);
+			g_error_free(ierror);
+		}
+		g_debug("OpenSSL initialization took %.1f ms", (g_get_monotonic_time() - start) / 1000.0);
+
+		g_once_init_leave(&initialized, 1);
+	}
+
+	if (!result) {
+		g_set_error_literal(error, R_SIGNATURE_ERROR, R_SIGNATURE_ERROR_CRYPTOINIT_FAILED, failure);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 #if ENABLE_OPENSSL_PKCS11_ENGINE
+/* The engine is initialized once and kept, so that all keys and certificates
+ * are loaded within the same PKCS#11 session. */
 static ENGINE *get_pkcs11_engine(GError **error)
 {
+	static GMutex engine_lock;
 	static ENGINE *e = NULL;
+	g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&engine_lock);
 	const gchar *env;
 
 	g_return_val_if_fail(error == NULL || *error == NULL, NULL);
 
+	if (e)
+		return e;
+
 	ENGINE_load_builtin_engines();
 
 	e = ENGINE_by_id("pkcs11");
@@ -269,14 +307,58 @@ out:
 	return res;
 }
 
+/* keys and certificates by name, only used while the key cache is enabled */
+static GMutex key_cache_lock;
+static GHashTable *key_cache = NULL;
+static GHashTable *cert_cache = NULL;
+
+void signature_set_key_cache(gboolean enabled)
+{
+	g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&key_cache_lock);
+
+	g_clear_pointer(&key_cache, g_hash_table_destroy);
+	g_clear_pointer(&cert_cache, g_hash_table_destroy);
+
+	if (!enabled)
+		return;
+
+	key_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)EVP_PKEY_free);
+	cert_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)X509_free);
+}
+
 static EVP_PKEY *load_key(const gchar *name, GError **error)
 {
+	EVP_PKEY *res = NULL;
+
 	g_return_val_if_fail(name != NULL, NULL);
 
+	/* the OpenSSL config may set up providers or engines for keys */
+	if (!signature_init(error))
+		return NULL;
+
+	g_mutex_lock(&key_cache_lock);
+	if (key_cache) {
+		res = g_hash_table_lookup(key_cache, name);
+		if (res)
+			EVP_PKEY_up_ref(res);
+	}
+	g_mutex_unlock(&key_cache_lock);
+	if (res)
+		return res;
+
 	if (g_str_has_prefix(name, "pkcs11:"))
-		return load_key_pkcs11(name, error);
+		res = load_key_pkcs11(name, error);
 	else
-		return load_key_file(name, error);
+		res = load_key_file(name, error);
+
+	g_mutex_lock(&key_cache_lock);
+	if (res && key_cache && !g_hash_table_contains(key_cache, name)) {
+		EVP_PKEY_up_ref(res);
+		g_hash_table_insert(key_cache, g_strdup(name), res);
+	}
+	g_mutex_unlock(&key_cache_lock);
+
+	return res;
 }
 
 static X509 *load_cert_file(const gchar *certfile, GError **error)
@@ -322,6 +404,9 @@ static STACK_OF(X509) *load_certs_from_file(const gchar *certfile, GError **erro
 	g_return_val_if_fail(certfile != NULL, NULL);
 	g_return_val_if_fail(error == NULL || *error == NULL, NULL);
 
+	if (!signature_init(error))
+		return NULL;
+
 	cert_bio = BIO_new_file(certfile, "r");
 	if (cert_bio == NULL) {
 		g_set_error(
@@ -411,12 +496,36 @@ out:
 
 static X509 *load_cert(const gchar *name, GError **error)
 {
+	X509 *res = NULL;
+
 	g_return_val_if_fail(name != NULL, NULL);
 
+	if (!signature_init(error))
+		return NULL;
+
+	g_mutex_lock(&key_cache_lock);
+	if (cert_cache) {
+		res = g_hash_table_lookup(cert_cache, name);
+		if (res)
+			X509_up_ref(res);
+	}
+	g_mutex_unlock(&key_cache_lock);
+	if (res)
+		return res;
+
 	if (g_str_has_prefix(name, "pkcs11:"))
-		return load_cert_pkcs11(name, error);
+		res = load_cert_pkcs11(name, error);
 	else
-		return load_cert_file(name, error);
+		res = load_cert_file(name, error);
+
+	g_mutex_lock(&key_cache_lock);
+	if (res && cert_cache && !g_hash_table_contains(cert_cache, name)) {
+		X509_up_ref(res);
+		g_hash_table_insert(cert_cache, g_strdup(name), res);
+	}
+	g_mutex_unlock(&key_cache_lock);
+
+	return res;
 }
 
 static GBytes *bytes_from_bio(BIO *bio)
@@ -504,6 +613,10 @@ X509_STORE* setup_x509_store(const gchar *capath, const gchar *cadir, GError **e
 	if (cadir)
 		load_cadir = strlen(cadir) ? cadir : NULL;
 
+	/* the 'codesign-rauc' purpose is registered during initialization */
+	if (!signature_init(error))
+		return NULL;
+
 	if (!(store = X509_STORE_new())) {
 		g_set_error_literal(
 				error,
@@ -547,6 +660,112 @@ X509_STORE* setup_x509_store(const gchar *capath, const gchar *cadir, GError **e
 	return g_steal_pointer(&store);
 }
 
+/* default X509_STORE shared by get_cached_x509_store() callers */
+static GMutex x509_store_cache_lock;
+static X509_STORE *x509_store_cache = NULL;
+static gchar *x509_store_cache_key = NULL;
+
+static gint strcmp0_p(gconstpointer a, gconstpointer b)
+{
+	const gchar *str1 = *((gchar **) a);
+	const gchar *str2 = *((gchar **) b);
+
+	return g_strcmp0(str1, str2);
+}
+
+static void append_file_state(GString *key, const gchar *path)
+{
+	struct stat st;
+
+	if (stat(path, &st) == -1) {
+		g_string_append_printf(key, "%s:-;", path);
+		return;
+	}
+
+	g_string_append_printf(key, "%s:%ju:%ju:%jd:%jd.%09ld;", path,
+			(uintmax_t)st.st_dev, (uintmax_t)st.st_ino, (intmax_t)st.st_size,
+			(intmax_t)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+}
+
+/*
+ * Describes the configuration and the state of all keyring files, so that
+ * any modification (including replacing files) invalidates the cached store.
+ */
+static gchar *get_x509_store_cache_key(void)
+{
+	const RaucConfig *config = r_context()->config;
+	GString *key = g_string_new(NULL);
+
+	g_string_append_printf(key, "crl=%d;partial=%d;purpose=%s;",
+			config->keyring_check_crl, config->keyring_allow_partial_chain,
+			config->keyring_check_purpose ? config->keyring_check_purpose : "");
+
+	if (config->keyring_path)
+		append_file_state(key, config->keyring_path);
+
+	if (config->keyring_directory) {
+		g_autoptr(GDir) dir = g_dir_open(config->keyring_directory, 0, NULL);
+		g_autoptr(GPtrArray) names = g_ptr_array_new();
+		const gchar *name;
+
+		append_file_state(key, config->keyring_directory);
+
+		if (dir) {
+			while ((name = g_dir_read_name(dir)))
+				g_ptr_array_add(names, (gpointer)name);
+			g_ptr_array_sort(names, strcmp0_p);
+
+			for (guint i = 0; i < names->len; i++) {
+				g_autofree gchar *path = g_build_filename(config->keyring_directory, names->pdata[i], NULL);
+				append_file_state(key, path);
+			}
+		}
+	}
+
+	return g_string_free(key, FALSE);
+}
+
+X509_STORE* get_cached_x509_store(GError **error)
+{
+	GError *ierror = NULL;
+	g_autofree gchar *key = NULL;
+	X509_STORE *store = NULL;
+
+	g_return_val_if_fail(error == NULL || *error == NULL, NULL);
+
+	/* the verification time is set on the store in this case */
+	if (r_context()->config->use_bundle_signing_time)
+		return setup_x509_store(NULL, NULL, error);
+
+	key = get_x509_store_cache_key();
+
+	g_mutex_lock(&x509_store_cache_lock);
+
+	if (x509_store_cache && g_strcmp0(key, x509_store_cache_key) == 0) {
+		g_debug("Reusing cached keyring");
+	} else {
+		store = setup_x509_store(NULL, NULL, &ierror);
+		if (!store) {
+			g_mutex_unlock(&x509_store_cache_lock);
+			g_propagate_error(error, ierror);
+			return NULL;
+		}
+
+		g_debug("Loaded keyring into cache");
+		g_clear_pointer(&x509_store_cache, X509_STORE_free);
+		g_free(x509_store_cache_key);
+		x509_store_cache = store;
+		x509_store_cache_key = g_steal_pointer(&key);
+	}
+
+	store = x509_store_cache;
+	X509_STORE_up_ref(store);
+
+	g_mutex_unlock(&x509_store_cache_lock);
+
+	return store;
+}
+
 GBytes *cms_sign(GBytes *content, gboolean detached, const gchar *certfile, const gchar *keyfile, gchar **interfiles, GError **error)
 {
 	GError *ierror = NULL;
@@ -1323,11 +1542,14 @@ out:
 	return res;
 }
 
-gboolean cms_verify_bytes(GBytes *content, GBytes *sig, X509_STORE *store, CMS_ContentInfo **cms, GBytes **manifest, GError **error)
+/*
+ * Verifies a signature, with the detached content provided as a BIO, which is
+ * not freed.
+ */
+static gboolean cms_verify_bio(BIO *incontent, GBytes *sig, X509_STORE *store, CMS_ContentInfo **cms, GBytes **manifest, GError **error)
 {
 	GError *ierror = NULL;
 	g_autoptr(CMS_ContentInfo) icms = NULL;
-	BIO *incontent = NULL;
 	BIO *insig = bytes_as_bio(sig);
 	BIO *outcontent = BIO_new(BIO_s_mem());
 	g_autofree gchar *signers_string = NULL;
@@ -1357,7 +1579,7 @@ gboolean cms_verify_bytes(GBytes *content, GBytes *sig, X509_STORE *store, CMS_C
 
 	detached = CMS_is_detached(icms);
 	if (detached) {
-		if (content == NULL) {
+		if (incontent == NULL) {
 			/* we have a detached signature but no content to verify */
 			g_set_error(
 					error,
@@ -1375,9 +1597,8 @@ gboolean cms_verify_bytes(GBytes *content, GBytes *sig, X509_STORE *store, CMS_C
 					"unexpected manifest output location for detached signature");
 			goto out;
 		}
-		incontent = bytes_as_bio(content);
 	} else {
-		if (content != NULL) {
+		if (incontent != NULL) {
 			/* we have an inline signature but some content to verify */
 			g_set_error(
 					error,
@@ -1472,13 +1693,32 @@ gboolean cms_verify_bytes(GBytes *content, GBytes *sig, X509_STORE *store, CMS_C
 	res = TRUE;
 out:
 	ERR_print_errors_fp(stdout);
-	BIO_free_all(incontent);
 	BIO_free_all(insig);
 	BIO_free_all(outcontent);
 	r_context_end_step("cms_verify", res);
 	return res;
 }
 
+gboolean cms_verify_bytes(GBytes *content, GBytes *sig, X509_STORE *store, CMS_ContentInfo **cms, GBytes **manifest, GError **error)
+{
+	BIO *incontent = NULL;
+	gboolean res;
+
+	g_return_val_if_fail(sig != NULL, FALSE);
+	g_return_val_if_fail(store != NULL, FALSE);
+	g_return_val_if_fail(cms == NULL || *cms == NULL, FALSE);
+	g_return_val_if_fail(manifest == NULL || *manifest == NULL, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (content)
+		incontent = bytes_as_bio(content);
+
+	res = cms_verify_bio(incontent, sig, store, cms, manifest, error);
+
+	BIO_free_all(incontent);
+	return res;
+}
+
 GBytes *cms_sign_file(const gchar *filename, const gchar *certfile, const gchar *keyfile, gchar **interfiles, GError **error)
 {
 	GError *ierror = NULL;
@@ -1538,11 +1778,128 @@ out:
 	return sig;
 }
 
+/* size of the reads used to stream the content for detached signatures */
+#define FD_RANGE_BIO_BUFFER_SIZE (1024 * 1024)
+
+/*
+ * A read-only BIO which provides a range of a file, read using large aligned
+ * pread() calls into a bounded buffer.
+ */
+typedef struct {
+	int fd;
+	goffset offset; /* file offset of the buffer */
+	goffset limit; /* end of the range */
+	guint8 *buf;
+	gsize buf_len; /* number of valid bytes in the buffer */
+	gsize buf_pos; /* number of bytes already returned from the buffer */
+	int err; /* errno of a failed read, or 0 */
+} FdRangeBioData;
+
+static int fd_range_bio_read(BIO *bio, char *out, int outl)
+{
+	FdRangeBioData *data = BIO_get_data(bio);
+	gsize len;
+
+	if (outl <= 0)
+		return 0;
+
+	if (data->buf_pos == data->buf_len) {
+		ssize_t ret;
+
+		/* drop data which was already hashed from the page cache */
+		if (data->buf_len)
+			(void)posix_fadvise(data->fd, data->offset, data->buf_len, POSIX_FADV_DONTNEED);
+
+		data->offset += data->buf_len;
+		data->buf_len = 0;
+		data->buf_pos = 0;
+
+		if (data->offset >= data->limit)
+			return 0;
+
+		do {
+			ret = pread(data->fd, data->buf, MIN(FD_RANGE_BIO_BUFFER_SIZE, data->limit - data->offset), data->offset);
+		} while (ret == -1 && errno == EINTR);
+		if (ret <= 0) {
+			data->err = ret ? errno : EIO;
+			return -1;
+		}
+		data->buf_len = ret;
+	}
+
+	len = MIN((gsize)outl, data->buf_len - data->buf_pos);
+	memcpy(out, data->buf + data->buf_pos, len);
+	data->buf_pos += len;
+
+	return len;
+}
+
+static long fd_range_bio_ctrl(BIO *bio, int cmd, long num, void *ptr)
+{
+	FdRangeBioData *data = BIO_get_data(bio);
+
+	switch (cmd) {
+		case BIO_CTRL_EOF:
+			return data->offset + (goffset)data->buf_pos >= data->limit;
+		case BIO_CTRL_PENDING:
+			return data->buf_len - data->buf_pos;
+		case BIO_CTRL_FLUSH:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+static int fd_range_bio_destroy(BIO *bio)
+{
+	FdRangeBioData *data = BIO_get_data(bio);
+
+	if (data) {
+		g_free(data->buf);
+		g_free(data);
+		BIO_set_data(bio, NULL);
+	}
+
+	return 1;
+}
+
+static BIO *fd_range_bio_new(int fd, goffset limit)
+{
+	static gsize method_once = 0;
+	static BIO_METHOD *method = NULL;
+	FdRangeBioData *data;
+	BIO *bio;
+
+	if (g_once_init_enter(&method_once)) {
+		method = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK, "rauc fd range");
+		if (!method ||
+		    !BIO_meth_set_read(method, fd_range_bio_read) ||
+		    !BIO_meth_set_ctrl(method, fd_range_bio_ctrl) ||
+		    !BIO_meth_set_destroy(method, fd_range_bio_destroy))
+			g_error("fd_range_bio_new: failed to create BIO method");
+		g_once_init_leave(&method_once, 1);
+	}
+
+	bio = BIO_new(method);
+	if (!bio)
+		g_error("fd_range_bio_new: BIO_new() failed");
+
+	data = g_new0(FdRangeBioData, 1);
+	data->fd = fd;
+	data->limit = limit;
+	data->buf = g_malloc(FD_RANGE_BIO_BUFFER_SIZE);
+	BIO_set_data(bio, data);
+	BIO_set_init(bio, 1);
+
+	return bio;
+}
+
 gboolean cms_verify_fd(gint fd, GBytes *sig, goffset limit, X509_STORE *store, CMS_ContentInfo **cms, GError **error)
 {
 	GError *ierror = NULL;
-	g_autoptr(GMappedFile) file = NULL;
-	g_autoptr(GBytes) content = NULL;
+	BIO *incontent = NULL;
+	FdRangeBioData *data;
+	struct stat st;
 	gboolean res = FALSE;
 
 	g_return_val_if_fail(fd >= 0, FALSE);
@@ -1551,41 +1908,45 @@ gboolean cms_verify_fd(gint fd, GBytes *sig, goffset limit, X509_STORE *store, C
 	g_return_val_if_fail(cms == NULL || *cms == NULL, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
-	file = g_mapped_file_new_from_fd(fd, FALSE, &ierror);
-	if (file == NULL) {
-		g_propagate_error(error, ierror);
+	if (fstat(fd, &st) == -1) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to stat bundle: %s", g_strerror(err));
 		goto out;
 	}
-	content = g_mapped_file_get_bytes(file);
 
-	/* On 32 bit systems, G_MAXSIZE will be only 32 bit (unsigned) while
-	 * 'limit' is 64 bit (signed). Thus we must take care of not passing
-	 * 'limit' values exceeding G_MAXSIZE to g_bytes_new_from_bytes.
-	 * However, mmapping for large limit values will cause problems,
-	 * anyway.
-	 */
-	if ((guint64)limit > (guint64)G_MAXSIZE) {
+	if (!limit)
+		limit = st.st_size;
+	if (limit > st.st_size) {
 		g_set_error(
 				error,
 				R_SIGNATURE_ERROR,
 				R_SIGNATURE_ERROR_PARSE,
-				"Bundle size exceeds maximum size!");
+				"Bundle size exceeds file size!");
 		goto out;
 	}
 
-	if (limit) {
-		GBytes *tmp = g_bytes_new_from_bytes(content, 0, limit);
-		g_bytes_unref(content);
-		content = tmp;
-	}
+	/* The content is streamed instead of being mapped, so this works for
+	 * bundles larger than the address space (on 32 bit systems) and
+	 * doesn't keep the whole file in the page cache. */
+	(void)posix_fadvise(fd, 0, limit, POSIX_FADV_SEQUENTIAL);
+	incontent = fd_range_bio_new(fd, limit);
+	data = BIO_get_data(incontent);
 
-	res = cms_verify_bytes(content, sig, store, cms, NULL, &ierror);
+	res = cms_verify_bio(incontent, sig, store, cms, NULL, &ierror);
 	if (!res) {
-		g_propagate_error(error, ierror);
+		if (data->err) {
+			g_clear_error(&ierror);
+			g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(data->err),
+					"Failed to read bundle for signature verification: %s", g_strerror(data->err));
+		} else {
+			g_propagate_error(error, ierror);
+		}
 		goto out;
 	}
 
 out:
+	BIO_free_all(incontent);
 	return res;
 }
 
@@ -1,5 +1,10 @@
 #include <errno.h>
+#include <glib/gstdio.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 
 #include "slot.h"
 
@@ -21,6 +26,7 @@ void r_slot_free(gpointer value)
 	g_strfreev(slot->extra_mkfs_opts);
 	g_free(slot->bootname);
 	g_free(slot->extra_mount_opts);
+	g_free(slot->verity_hash_device);
 	g_free(slot->parent_name);
 	g_free(slot->mount_point);
 	g_free(slot->ext_mount_point);
@@ -45,6 +51,8 @@ void r_slot_clear_status(RaucSlotStatus *slotstatus)
 	g_clear_pointer(&slotstatus->installed_txn, g_free);
 	g_clear_pointer(&slotstatus->installed_timestamp, g_free);
 	g_clear_pointer(&slotstatus->activated_timestamp, g_free);
+	g_clear_pointer(&slotstatus->verity_root_hash, g_free);
+	g_clear_pointer(&slotstatus->verity_salt, g_free);
 }
 
 void r_slot_free_status(RaucSlotStatus *slotstatus)
@@ -179,6 +187,55 @@ RaucSlot* r_slot_get_parent_root(RaucSlot *slot)
 	return base;
 }
 
+/**
+ * Returns the sysfs directory of a device number, or NULL.
+ */
+static gchar *get_sysfs_device_dir(gboolean block, dev_t dev)
+{
+	g_autofree gchar *link = g_strdup_printf("/sys/dev/%s/%u:%u", block ? "block" : "char", major(dev), minor(dev));
+
+	return realpath(link, NULL);
+}
+
+gchar *r_slot_get_physical_device(const RaucSlot *slot)
+{
+	g_autofree gchar *sysdir = NULL;
+	g_autofree gchar *basename = NULL;
+	GStatBuf st;
+
+	g_return_val_if_fail(slot, NULL);
+	g_return_val_if_fail(slot->device, NULL);
+
+	if (g_stat(slot->device, &st) != 0)
+		return g_strdup(slot->device);
+
+	if (S_ISBLK(st.st_mode))
+		sysdir = get_sysfs_device_dir(TRUE, st.st_rdev);
+	else if (S_ISCHR(st.st_mode))
+		sysdir = get_sysfs_device_dir(FALSE, st.st_rdev);
+	else
+		sysdir = get_sysfs_device_dir(TRUE, st.st_dev);
+
+	if (!sysdir)
+		return g_strdup(slot->device);
+
+	basename = g_path_get_basename(sysdir);
+
+	/* partitions are represented as children of their disk */
+	if (!S_ISCHR(st.st_mode)) {
+		g_autofree gchar *partition = g_build_filename(sysdir, "partition", NULL);
+
+		if (g_file_test(partition, G_FILE_TEST_EXISTS))
+			return g_path_get_dirname(sysdir);
+	}
+
+	/* UBI volumes (ubiX_Y) are children of their UBI device (ubiX) */
+	if (S_ISCHR(st.st_mode) && g_str_has_prefix(basename, "ubi") && strchr(basename, '_'))
+		return g_path_get_dirname(sysdir);
+
+	return g_steal_pointer(&sysdir);
+}
+
 gchar *r_slot_get_checksum_data_directory(const RaucSlot *slot, const RaucChecksum *checksum, GError **error)
 {
 	const gchar *hex_digest = NULL;
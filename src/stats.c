@@ -3,13 +3,44 @@
 gboolean test_stats_enabled = FALSE;
 GList *test_stats_queue = NULL;
 
-RaucStats *r_stats_new(const gchar *label)
+/* all RaucStats which were not freed yet, for r_stats_get_live() */
+static GMutex live_stats_lock;
+static GList *live_stats = NULL;
+/* freed RaucStats merged by label, between r_stats_report_begin() and
+ * r_stats_report_end() (also protected by live_stats_lock) */
+static GHashTable *report_stats = NULL;
+
+static void stats_destroy(RaucStats *stats);
+
+static RaucStats *stats_alloc(const gchar *label)
 {
 	RaucStats *stats = g_new0(RaucStats, 1);
 
 	stats->label = g_strdup(label);
 	stats->min = G_MAXDOUBLE;
 	stats->max = G_MINDOUBLE;
+	stats->histogram = r_histogram_new(label);
+	g_mutex_init(&stats->lock);
+
+	return stats;
+}
+
+RaucStats *r_stats_new(const gchar *label)
+{
+	RaucStats *stats = stats_alloc(label);
+
+	g_mutex_lock(&live_stats_lock);
+	live_stats = g_list_append(live_stats, stats);
+	g_mutex_unlock(&live_stats_lock);
+
+	return stats;
+}
+
+RaucStats *r_stats_new_unlisted(const gchar *label)
+{
+	RaucStats *stats = stats_alloc(label);
+
+	stats->unlisted = TRUE;
 
 	return stats;
 }
@@ -18,6 +49,8 @@ void r_stats_add(RaucStats *stats, gdouble value)
 {
 	g_return_if_fail(stats);
 
+	g_mutex_lock(&stats->lock);
+
 	stats->values[stats->next] = value;
 	stats->next = (stats->next + 1) % 64;
 	stats->count++;
@@ -28,6 +61,127 @@ void r_stats_add(RaucStats *stats, gdouble value)
 		stats->min = value;
 	if (value > stats->max)
 		stats->max = value;
+
+	g_mutex_unlock(&stats->lock);
+
+	r_histogram_add(stats->histogram, value);
+}
+
+GVariant *r_stats_to_variant(RaucStats *stats)
+{
+	g_auto(GVariantDict) dict = G_VARIANT_DICT_INIT(NULL);
+
+	g_return_val_if_fail(stats, NULL);
+
+	g_mutex_lock(&stats->lock);
+	g_variant_dict_insert(&dict, "count", "t", stats->count);
+	if (stats->count) {
+		g_variant_dict_insert(&dict, "sum", "d", stats->sum);
+		g_variant_dict_insert(&dict, "min", "d", stats->min);
+		g_variant_dict_insert(&dict, "max", "d", stats->max);
+		g_variant_dict_insert(&dict, "avg", "d", r_stats_get_avg(stats));
+	}
+	g_mutex_unlock(&stats->lock);
+
+	if (r_histogram_get_count(stats->histogram)) {
+		g_variant_dict_insert(&dict, "p50", "d", r_histogram_get_percentile(stats->histogram, 50));
+		g_variant_dict_insert(&dict, "p90", "d", r_histogram_get_percentile(stats->histogram, 90));
+		g_variant_dict_insert(&dict, "p99", "d", r_histogram_get_percentile(stats->histogram, 99));
+	}
+
+	return g_variant_dict_end(&dict);
+}
+
+GVariant *r_stats_get_live(void)
+{
+	g_auto(GVariantBuilder) builder = G_VARIANT_BUILDER_INIT(G_VARIANT_TYPE("a{sv}"));
+	g_autoptr(GHashTable) labels = g_hash_table_new(g_str_hash, g_str_equal);
+
+	g_mutex_lock(&live_stats_lock);
+	for (GList *l = live_stats; l != NULL; l = l->next) {
+		RaucStats *stats = l->data;
+		g_autofree gchar *key = NULL;
+		guint n = GPOINTER_TO_UINT(g_hash_table_lookup(labels, stats->label)) + 1;
+
+		g_hash_table_insert(labels, stats->label, GUINT_TO_POINTER(n));
+		if (n > 1)
+			key = g_strdup_printf("%s #%u", stats->label, n);
+		else
+			key = g_strdup(stats->label);
+
+		g_variant_builder_add(&builder, "{sv}", key, r_stats_to_variant(stats));
+	}
+	g_mutex_unlock(&live_stats_lock);
+
+	return g_variant_builder_end(&builder);
+}
+
+/* Adds the values of src to dest, except for the recent values. */
+static void stats_merge(RaucStats *dest, RaucStats *src)
+{
+	g_mutex_lock(&src->lock);
+	dest->count += src->count;
+	dest->sum += src->sum;
+	dest->min = MIN(dest->min, src->min);
+	dest->max = MAX(dest->max, src->max);
+	g_mutex_unlock(&src->lock);
+
+	r_histogram_merge(dest->histogram, src->histogram);
+}
+
+/* Returns the entry for label in report_stats, with live_stats_lock held. */
+static RaucStats *report_stats_lookup(const gchar *label)
+{
+	RaucStats *stats = g_hash_table_lookup(report_stats, label);
+
+	if (!stats) {
+		stats = stats_alloc(label);
+		g_hash_table_insert(report_stats, stats->label, stats);
+	}
+
+	return stats;
+}
+
+void r_stats_report_add(const gchar *label, gdouble value)
+{
+	g_return_if_fail(label);
+
+	g_mutex_lock(&live_stats_lock);
+	if (report_stats)
+		r_stats_add(report_stats_lookup(label), value);
+	g_mutex_unlock(&live_stats_lock);
+}
+
+void r_stats_report_begin(void)
+{
+	g_mutex_lock(&live_stats_lock);
+	g_warn_if_fail(report_stats == NULL);
+	if (!report_stats)
+		report_stats = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)stats_destroy);
+	g_mutex_unlock(&live_stats_lock);
+}
+
+GVariant *r_stats_report_end(void)
+{
+	g_auto(GVariantBuilder) builder = G_VARIANT_BUILDER_INIT(G_VARIANT_TYPE("a{sv}"));
+	g_autoptr(GHashTable) collected = NULL;
+	g_autoptr(GList) labels = NULL;
+
+	g_mutex_lock(&live_stats_lock);
+	collected = g_steal_pointer(&report_stats);
+	g_mutex_unlock(&live_stats_lock);
+
+	if (!collected)
+		return g_variant_builder_end(&builder);
+
+	labels = g_list_sort(g_hash_table_get_keys(collected), (GCompareFunc)g_strcmp0);
+	for (GList *l = labels; l != NULL; l = l->next) {
+		RaucStats *stats = g_hash_table_lookup(collected, l->data);
+
+		g_variant_builder_add(&builder, "{sv}", stats->label, r_stats_to_variant(stats));
+	}
+
+	return g_variant_builder_end(&builder);
 }
 
 gdouble r_stats_get_avg(const RaucStats *stats)
@@ -63,6 +217,8 @@ void r_stats_show(const RaucStats *stats, const gchar *prefix)
 {
 	g_autofree gchar *prefix_label = NULL;
 	g_autoptr(GString) msg = g_string_sized_new(128);
+	g_autoptr(GVariant) histogram = NULL;
+	g_autofree gchar *histogram_text = NULL;
 
 	g_return_if_fail(stats);
 
@@ -78,6 +234,14 @@ void r_stats_show(const RaucStats *stats, const gchar *prefix)
 	g_string_append_printf(msg, " sum=%.3f min=%.3f max=%.3f avg=%.3f",
 			stats->sum, stats->min, stats->max, r_stats_get_avg(stats));
 	g_string_append_printf(msg, " recent-avg=%.3f", r_stats_get_recent_avg(stats));
+	g_string_append_printf(msg, " p50=%.3f p90=%.3f p99=%.3f",
+			r_histogram_get_percentile(stats->histogram, 50),
+			r_histogram_get_percentile(stats->histogram, 90),
+			r_histogram_get_percentile(stats->histogram, 99));
+
+	histogram = g_variant_ref_sink(r_histogram_serialize(stats->histogram));
+	histogram_text = g_variant_print(histogram, FALSE);
+	g_debug("%s histogram: %s", prefix_label, histogram_text);
 
 out:
 	g_message("%s", msg->str);
@@ -88,17 +252,215 @@ void r_stats_free(RaucStats *stats)
 	if (!stats)
 		return;
 
+	if (!stats->unlisted) {
+		g_mutex_lock(&live_stats_lock);
+		live_stats = g_list_remove(live_stats, stats);
+		if (report_stats && stats->label)
+			stats_merge(report_stats_lookup(stats->label), stats);
+		g_mutex_unlock(&live_stats_lock);
+	}
+
 	if (test_stats_enabled) {
 		/* collect in test_stats_queue instead of freeing */
 		test_stats_queue = g_list_append(test_stats_queue, stats);
 		return;
 	}
 
+	stats_destroy(stats);
+}
+
+static void stats_destroy(RaucStats *stats)
+{
 	g_free(stats->label);
+	r_histogram_free(stats->histogram);
+	g_mutex_clear(&stats->lock);
 
 	g_free(stats);
 }
 
+typedef union {
+	gdouble d;
+	guint64 u;
+} RDoubleBits;
+
+/* Maps a value to its bucket by using the exponent and the highest mantissa
+ * bits of its IEEE 754 representation directly. */
+static gint histogram_bucket(gdouble value)
+{
+	RDoubleBits bits = {.d = value};
+	gint exp;
+
+	/* also catches NaN */
+	if (!(value > 0.0))
+		return 0;
+
+	exp = (gint)((bits.u >> 52) & 0x7ff) - 1023;
+	if (exp < R_HISTOGRAM_MIN_EXP)
+		return 0;
+	if (exp >= R_HISTOGRAM_MAX_EXP)
+		return R_HISTOGRAM_BUCKETS - 1;
+
+	return 1 + ((exp - R_HISTOGRAM_MIN_EXP) << R_HISTOGRAM_SUB_BITS) +
+	       (gint)((bits.u >> (52 - R_HISTOGRAM_SUB_BITS)) & ((1 << R_HISTOGRAM_SUB_BITS) - 1));
+}
+
+static gdouble histogram_bucket_lower(gint bucket)
+{
+	RDoubleBits bits;
+	gint exp, sub;
+
+	if (bucket <= 0)
+		return 0.0;
+
+	bucket -= 1;
+	exp = (bucket >> R_HISTOGRAM_SUB_BITS) + R_HISTOGRAM_MIN_EXP;
+	sub = bucket & ((1 << R_HISTOGRAM_SUB_BITS) - 1);
+	bits.u = ((guint64)(exp + 1023) << 52) | ((guint64)sub << (52 - R_HISTOGRAM_SUB_BITS));
+
+	return bits.d;
+}
+
+static gdouble histogram_bucket_upper(gint bucket)
+{
+	if (bucket >= R_HISTOGRAM_BUCKETS - 1)
+		return G_MAXDOUBLE;
+
+	return histogram_bucket_lower(bucket + 1);
+}
+
+static void atomic_int_min(gint *atomic, gint value)
+{
+	gint old = g_atomic_int_get(atomic);
+
+	while (value < old && !g_atomic_int_compare_and_exchange(atomic, old, value))
+		old = g_atomic_int_get(atomic);
+}
+
+static void atomic_int_max(gint *atomic, gint value)
+{
+	gint old = g_atomic_int_get(atomic);
+
+	while (value > old && !g_atomic_int_compare_and_exchange(atomic, old, value))
+		old = g_atomic_int_get(atomic);
+}
+
+RaucHistogram *r_histogram_new(const gchar *label)
+{
+	RaucHistogram *hist = g_new0(RaucHistogram, 1);
+
+	hist->label = g_strdup(label);
+	hist->min_bucket = G_MAXINT;
+	hist->max_bucket = -1;
+
+	return hist;
+}
+
+void r_histogram_add(RaucHistogram *hist, gdouble value)
+{
+	gint bucket;
+
+	g_return_if_fail(hist);
+
+	bucket = histogram_bucket(value);
+
+	g_atomic_int_inc(&hist->buckets[bucket]);
+	atomic_int_min(&hist->min_bucket, bucket);
+	atomic_int_max(&hist->max_bucket, bucket);
+	g_atomic_int_inc(&hist->count);
+}
+
+void r_histogram_merge(RaucHistogram *dest, const RaucHistogram *src)
+{
+	gint max_bucket;
+
+	g_return_if_fail(dest);
+	g_return_if_fail(src);
+
+	max_bucket = g_atomic_int_get(&src->max_bucket);
+	for (gint i = g_atomic_int_get(&src->min_bucket); i <= max_bucket; i++) {
+		gint count = g_atomic_int_get(&src->buckets[i]);
+
+		if (!count)
+			continue;
+
+		g_atomic_int_add(&dest->buckets[i], count);
+		g_atomic_int_add(&dest->count, count);
+	}
+
+	if (max_bucket >= 0) {
+		atomic_int_min(&dest->min_bucket, g_atomic_int_get(&src->min_bucket));
+		atomic_int_max(&dest->max_bucket, max_bucket);
+	}
+}
+
+guint64 r_histogram_get_count(const RaucHistogram *hist)
+{
+	g_return_val_if_fail(hist, 0);
+
+	return (guint)g_atomic_int_get(&hist->count);
+}
+
+gdouble r_histogram_get_percentile(const RaucHistogram *hist, gdouble percentile)
+{
+	guint64 count, rank, seen = 0;
+	gdouble exact_rank;
+	gint max_bucket;
+
+	g_return_val_if_fail(hist, 0.0);
+	g_return_val_if_fail(percentile >= 0.0 && percentile <= 100.0, 0.0);
+
+	count = r_histogram_get_count(hist);
+	if (!count)
+		return 0.0;
+
+	/* rank of the value (starting at 1), rounded up */
+	exact_rank = percentile / 100.0 * count;
+	rank = (guint64)exact_rank;
+	if (rank < exact_rank)
+		rank++;
+	rank = CLAMP(rank, 1, count);
+
+	max_bucket = g_atomic_int_get(&hist->max_bucket);
+	for (gint i = g_atomic_int_get(&hist->min_bucket); i <= max_bucket; i++) {
+		seen += (guint)g_atomic_int_get(&hist->buckets[i]);
+		if (seen >= rank)
+			return i == R_HISTOGRAM_BUCKETS - 1 ? histogram_bucket_lower(i) : histogram_bucket_upper(i);
+	}
+
+	/* values were added concurrently */
+	return max_bucket == R_HISTOGRAM_BUCKETS - 1 ? histogram_bucket_lower(max_bucket) : histogram_bucket_upper(max_bucket);
+}
+
+GVariant *r_histogram_serialize(const RaucHistogram *hist)
+{
+	g_auto(GVariantBuilder) builder = G_VARIANT_BUILDER_INIT(G_VARIANT_TYPE("a(ddu)"));
+	gint max_bucket;
+
+	g_return_val_if_fail(hist, NULL);
+
+	max_bucket = g_atomic_int_get(&hist->max_bucket);
+	for (gint i = g_atomic_int_get(&hist->min_bucket); i <= max_bucket; i++) {
+		gint count = g_atomic_int_get(&hist->buckets[i]);
+
+		if (!count)
+			continue;
+
+		g_variant_builder_add(&builder, "(ddu)",
+				histogram_bucket_lower(i), histogram_bucket_upper(i), (guint32)count);
+	}
+
+	return g_variant_new("(sa(ddu))", hist->label ? hist->label : "", &builder);
+}
+
+void r_histogram_free(RaucHistogram *hist)
+{
+	if (!hist)
+		return;
+
+	g_free(hist->label);
+	g_free(hist);
+}
+
 void r_test_stats_start(void)
 {
 	g_assert_false(test_stats_enabled);
@@ -64,6 +64,9 @@ static void status_file_get_slot_status(GKeyFile *key_file, const gchar *group,
 		count = 0;
 	}
 	slotstatus->activated_count = count;
+
+	slotstatus->verity_root_hash = key_file_consume_string(key_file, group, "verity.root-hash", NULL);
+	slotstatus->verity_salt = key_file_consume_string(key_file, group, "verity.salt", NULL);
 }
 
 static void status_file_set_string_or_remove_key(GKeyFile *key_file, const gchar *group, const gchar *key, gchar *string)
@@ -117,6 +120,9 @@ static void status_file_set_slot_status(GKeyFile *key_file, const gchar *group,
 		g_key_file_remove_key(key_file, group, "activated.count", NULL);
 	}
 
+	status_file_set_string_or_remove_key(key_file, group, "verity.root-hash", slotstatus->verity_root_hash);
+	status_file_set_string_or_remove_key(key_file, group, "verity.salt", slotstatus->verity_salt);
+
 	return;
 }
 
@@ -295,22 +301,26 @@ static gboolean save_slot_status_locally(RaucSlot *dest_slot, GError **error)
 	return TRUE;
 }
 
+/* Cached content of the shared status file while a batch is active (see
+ * r_slot_status_begin_batch()). Outside of a batch, the cache only lives for
+ * a single update. */
+static struct {
+	GKeyFile *key_file;
+	gchar *data; /* serialized content as last loaded or written */
+	gboolean dirty; /* whether key_file was modified since loading or writing */
+	guint depth; /* nesting level of r_slot_status_begin_batch() */
+} status_cache;
+
 /**
- * Returns a new GKeyFile optionally pre-populated form a (shared) key file.
+ * Loads the shared status file.
  *
- * With keep_prefix, one can define groups to keep in the returned GKeyFile.
- * All other groups will be removed and can be newly populated.
- *
- * @param path Path to key file
- * @param keep_prefix prefix for groups to keep when loading the file
- * @param error Return location for a GError, or NULL
+ * A broken status file is moved away, so that it can be re-created.
  *
- * @return newly-allocated GKeyFile or NULL on error
+ * @return newly-allocated GKeyFile
  */
-static GKeyFile* key_file_init_from_shared_status_file(const gchar *keep_prefix, GError **error)
+static GKeyFile* load_shared_status_file(void)
 {
 	g_autoptr(GKeyFile) key_file = NULL;
-	g_auto(GStrv) groups = NULL;
 	GError *ierror = NULL;
 
 	key_file = g_key_file_new();
@@ -334,25 +344,130 @@ static GKeyFile* key_file_init_from_shared_status_file(const gchar *keep_prefix,
 		}
 	}
 
-	groups = g_key_file_get_groups(key_file, NULL);
+	return g_steal_pointer(&key_file);
+}
+
+/**
+ * Returns the (cached) shared status file for modification.
+ *
+ * With remove_prefix, one can define groups to remove from the returned
+ * GKeyFile, so that they can be newly populated. All other groups are kept.
+ *
+ * The returned GKeyFile is owned by the cache and must be passed to
+ * status_file_release() after modification.
+ *
+ * @param remove_prefix prefix for groups to remove
+ * @param error Return location for a GError, or NULL
+ *
+ * @return GKeyFile owned by the cache or NULL on error
+ */
+static GKeyFile* status_file_acquire(const gchar *remove_prefix, GError **error)
+{
+	g_auto(GStrv) groups = NULL;
+	GError *ierror = NULL;
+
+	if (!status_cache.key_file) {
+		status_cache.key_file = load_shared_status_file();
+		status_cache.data = g_key_file_to_data(status_cache.key_file, NULL, NULL);
+		status_cache.dirty = FALSE;
+	}
+
+	groups = g_key_file_get_groups(status_cache.key_file, NULL);
 	for (gchar **group = groups; *group != NULL; group++) {
-		if (!g_str_has_prefix(*group, keep_prefix))
+		if (!g_str_has_prefix(*group, remove_prefix))
 			continue;
 
-		if (!g_key_file_remove_group(key_file, *group, &ierror)) {
+		if (!g_key_file_remove_group(status_cache.key_file, *group, &ierror)) {
 			g_propagate_error(error, ierror);
 			return NULL;
 		}
 	}
 
-	return g_steal_pointer(&key_file);
+	status_cache.dirty = TRUE;
+
+	return status_cache.key_file;
+}
+
+/* Writes the cached status file if its content has changed. */
+static gboolean status_file_flush(GError **error)
+{
+	g_autofree gchar *data = NULL;
+	gsize length = 0;
+
+	if (!status_cache.key_file || !status_cache.dirty)
+		return TRUE;
+
+	data = g_key_file_to_data(status_cache.key_file, &length, NULL);
+	if (g_strcmp0(data, status_cache.data) == 0) {
+		g_debug("Status file unchanged, skipping write");
+		status_cache.dirty = FALSE;
+		return TRUE;
+	}
+
+	if (!r_file_set_contents_durable(r_context()->config->statusfile_path, data, length, error))
+		return FALSE;
+
+	g_free(status_cache.data);
+	status_cache.data = g_steal_pointer(&data);
+	status_cache.dirty = FALSE;
+
+	return TRUE;
+}
+
+static void status_file_drop_cache(void)
+{
+	g_clear_pointer(&status_cache.key_file, g_key_file_free);
+	g_clear_pointer(&status_cache.data, g_free);
+	status_cache.dirty = FALSE;
+}
+
+/* Writes the status file after modification unless a batch is active. */
+static gboolean status_file_release(GError **error)
+{
+	gboolean res;
+
+	if (status_cache.depth)
+		return TRUE;
+
+	res = status_file_flush(error);
+	status_file_drop_cache();
+
+	return res;
+}
+
+void r_slot_status_begin_batch(void)
+{
+	status_cache.depth++;
+}
+
+gboolean r_slot_status_commit(GError **error)
+{
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	return status_file_flush(error);
+}
+
+gboolean r_slot_status_end_batch(GError **error)
+{
+	gboolean res;
+
+	g_return_val_if_fail(status_cache.depth > 0, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (--status_cache.depth)
+		return TRUE;
+
+	res = status_file_flush(error);
+	status_file_drop_cache();
+
+	return res;
 }
 
 /* Updates slot status information in status file while leaving system status
  * information untouched */
 static gboolean save_slot_status_globally(GError **error)
 {
-	g_autoptr(GKeyFile) key_file = NULL;
+	GKeyFile *key_file = NULL;
 	GError *ierror = NULL;
 	GHashTableIter iter;
 	RaucSlot *slot;
@@ -362,7 +477,7 @@ static gboolean save_slot_status_globally(GError **error)
 
 	g_debug("Saving global slot status");
 
-	key_file = key_file_init_from_shared_status_file(RAUC_SLOT_PREFIX ".", &ierror);
+	key_file = status_file_acquire(RAUC_SLOT_PREFIX ".", &ierror);
 	if (!key_file) {
 		g_propagate_error(error, ierror);
 		return FALSE;
@@ -380,7 +495,7 @@ static gboolean save_slot_status_globally(GError **error)
 		status_file_set_slot_status(key_file, group, slot->status);
 	}
 
-	if (!g_key_file_save_to_file(key_file, r_context()->config->statusfile_path, &ierror)) {
+	if (!status_file_release(&ierror)) {
 		g_propagate_error(error, ierror);
 		return FALSE;
 	}
@@ -424,7 +539,7 @@ gboolean r_system_status_load(const gchar *filename, RSystemStatus *status, GErr
 
 gboolean r_system_status_save(GError **error)
 {
-	g_autoptr(GKeyFile) key_file = NULL;
+	GKeyFile *key_file = NULL;
 	GError *ierror = NULL;
 
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
@@ -435,7 +550,7 @@ gboolean r_system_status_save(GError **error)
 		return TRUE;
 	}
 
-	key_file = key_file_init_from_shared_status_file("system", &ierror);
+	key_file = status_file_acquire("system", &ierror);
 	if (!key_file) {
 		g_propagate_error(error, ierror);
 		return FALSE;
@@ -443,7 +558,7 @@ gboolean r_system_status_save(GError **error)
 
 	g_key_file_set_string(key_file, "system", "boot-id", r_context()->system_status->boot_id);
 
-	if (!g_key_file_save_to_file(key_file, r_context()->config->statusfile_path, &ierror)) {
+	if (!status_file_release(&ierror)) {
 		g_propagate_error(error, ierror);
 		return FALSE;
 	}
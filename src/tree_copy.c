@@ -0,0 +1,813 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "checksum.h"
+#include "tree_copy.h"
+#include "utils.h"
+
+/* maximum number of threads copying file contents */
+#define TREE_COPY_MAX_THREADS 4
+
+typedef struct {
+	gchar *path; /* relative to the root of the tree */
+	gchar *link_target; /* first path of the same inode for hardlinks, or NULL */
+	struct stat st;
+} TreeCopyEntry;
+
+typedef struct {
+	int src_root_fd;
+	int dst_root_fd;
+	int ref_root_fd; /* previous version of the tree, or -1 */
+	GHashTable *unchanged; /* paths which can be reused from the previous version */
+	GPtrArray *dirs; /* parents before their children, starting with the root */
+	GPtrArray *files; /* regular files to be copied by the workers */
+	GPtrArray *links; /* additional hardlinks, created after all files */
+	GHashTable *inodes; /* "dev:ino" for files with multiple links to their first path */
+
+	/* files reused from the previous version */
+	gint reused_links;
+	gint reused_clones;
+
+	/* set by the first failing worker */
+	GMutex lock;
+	gint failed;
+	GError *error;
+} TreeCopyContext;
+
+static void tree_copy_entry_free(TreeCopyEntry *entry)
+{
+	if (!entry)
+		return;
+
+	g_free(entry->path);
+	g_free(entry->link_target);
+	g_free(entry);
+}
+
+static TreeCopyEntry *tree_copy_entry_new(const gchar *path, const struct stat *st)
+{
+	TreeCopyEntry *entry = g_new0(TreeCopyEntry, 1);
+
+	entry->path = g_strdup(path);
+	entry->st = *st;
+
+	return entry;
+}
+
+static void set_errno_error(GError **error, int err, const gchar *action, const gchar *path)
+{
+	g_set_error(error,
+			G_FILE_ERROR,
+			g_file_error_from_errno(err),
+			"Failed to %s '%s': %s", action, path, g_strerror(err));
+}
+
+/*
+ * Copies all extended attributes which can be set by this process.
+ *
+ * As with 'cp -a', attributes which are not supported by the destination or
+ * require additional privileges (such as 'trusted.*' or SELinux labels) are
+ * skipped.
+ */
+static gboolean copy_xattrs(int src_fd, int dst_fd, const gchar *path, GError **error)
+{
+	g_autofree gchar *names = NULL;
+	ssize_t names_len;
+
+	names_len = flistxattr(src_fd, NULL, 0);
+	if (names_len < 0) {
+		int err = errno;
+		if (err == ENOTSUP)
+			return TRUE;
+		set_errno_error(error, err, "list extended attributes of", path);
+		return FALSE;
+	}
+	if (names_len == 0)
+		return TRUE;
+
+	names = g_malloc(names_len);
+	names_len = flistxattr(src_fd, names, names_len);
+	if (names_len < 0) {
+		set_errno_error(error, errno, "list extended attributes of", path);
+		return FALSE;
+	}
+
+	for (const gchar *name = names; name < names + names_len; name += strlen(name) + 1) {
+		g_autofree guint8 *value = NULL;
+		ssize_t value_len;
+
+		value_len = fgetxattr(src_fd, name, NULL, 0);
+		if (value_len < 0) {
+			set_errno_error(error, errno, "read extended attributes of", path);
+			return FALSE;
+		}
+
+		value = g_malloc(MAX(value_len, 1));
+		value_len = fgetxattr(src_fd, name, value, value_len);
+		if (value_len < 0) {
+			set_errno_error(error, errno, "read extended attributes of", path);
+			return FALSE;
+		}
+
+		if (fsetxattr(dst_fd, name, value, value_len, 0) == -1) {
+			int err = errno;
+			if (err == ENOTSUP || err == EPERM) {
+				g_debug("Skipping extended attribute '%s' of '%s': %s", name, path, g_strerror(err));
+				continue;
+			}
+			set_errno_error(error, err, "set extended attributes of", path);
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/*
+ * Applies ownership, permissions, extended attributes and timestamps.
+ *
+ * Ownership is only preserved if permitted (i.e. when running as root), as
+ * with 'cp -a'. The mode is set after the ownership, as chown() may clear the
+ * setuid and setgid bits.
+ */
+static gboolean apply_metadata(int src_fd, int dst_fd, const TreeCopyEntry *entry, GError **error)
+{
+	GError *ierror = NULL;
+	const struct timespec times[2] = {entry->st.st_atim, entry->st.st_mtim};
+
+	if (fchown(dst_fd, entry->st.st_uid, entry->st.st_gid) == -1 && errno != EPERM) {
+		set_errno_error(error, errno, "change owner of", entry->path);
+		return FALSE;
+	}
+
+	if (fchmod(dst_fd, entry->st.st_mode & 07777) == -1) {
+		set_errno_error(error, errno, "change mode of", entry->path);
+		return FALSE;
+	}
+
+	if (!copy_xattrs(src_fd, dst_fd, entry->path, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	if (futimens(dst_fd, times) == -1) {
+		set_errno_error(error, errno, "set timestamps of", entry->path);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Applies metadata to entries which can't be opened (symlinks and special
+ * files) without following them.
+ */
+static gboolean apply_metadata_at(int dst_dir_fd, const gchar *name, const TreeCopyEntry *entry, GError **error)
+{
+	const struct timespec times[2] = {entry->st.st_atim, entry->st.st_mtim};
+
+	if (fchownat(dst_dir_fd, name, entry->st.st_uid, entry->st.st_gid, AT_SYMLINK_NOFOLLOW) == -1 && errno != EPERM) {
+		set_errno_error(error, errno, "change owner of", entry->path);
+		return FALSE;
+	}
+
+	/* symlinks have no mode of their own */
+	if (!S_ISLNK(entry->st.st_mode) && fchmodat(dst_dir_fd, name, entry->st.st_mode & 07777, 0) == -1) {
+		set_errno_error(error, errno, "change mode of", entry->path);
+		return FALSE;
+	}
+
+	if (utimensat(dst_dir_fd, name, times, AT_SYMLINK_NOFOLLOW) == -1) {
+		set_errno_error(error, errno, "set timestamps of", entry->path);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Reads the value of an extended attribute. Returns NULL if it doesn't exist
+ * or can't be read.
+ */
+static GBytes *read_xattr(int fd, const gchar *name)
+{
+	g_autofree guint8 *value = NULL;
+	ssize_t value_len;
+
+	value_len = fgetxattr(fd, name, NULL, 0);
+	if (value_len < 0)
+		return NULL;
+
+	value = g_malloc(MAX(value_len, 1));
+	value_len = fgetxattr(fd, name, value, value_len);
+	if (value_len < 0)
+		return NULL;
+
+	return g_bytes_new_take(g_steal_pointer(&value), value_len);
+}
+
+static gint compare_names(gconstpointer a, gconstpointer b)
+{
+	return g_strcmp0(*(const gchar * const *)a, *(const gchar * const *)b);
+}
+
+/*
+ * Lists the names of all extended attributes, sorted. Returns NULL if they
+ * can't be listed. Filesystems without support have none.
+ */
+static GPtrArray *list_xattrs(int fd)
+{
+	g_autoptr(GPtrArray) list = g_ptr_array_new_with_free_func(g_free);
+	g_autofree gchar *names = NULL;
+	ssize_t names_len;
+
+	names_len = flistxattr(fd, NULL, 0);
+	if (names_len < 0 && errno != ENOTSUP)
+		return NULL;
+	if (names_len <= 0)
+		return g_steal_pointer(&list);
+
+	names = g_malloc(names_len);
+	names_len = flistxattr(fd, names, names_len);
+	if (names_len < 0)
+		return NULL;
+
+	for (const gchar *name = names; name < names + names_len; name += strlen(name) + 1)
+		g_ptr_array_add(list, g_strdup(name));
+	g_ptr_array_sort(list, compare_names);
+
+	return g_steal_pointer(&list);
+}
+
+/*
+ * Compares the extended attributes of two files. Errors are treated as a
+ * difference, so that the file is not shared.
+ */
+static gboolean same_xattrs(int a_fd, int b_fd)
+{
+	g_autoptr(GPtrArray) a_names = list_xattrs(a_fd);
+	g_autoptr(GPtrArray) b_names = list_xattrs(b_fd);
+
+	if (!a_names || !b_names || a_names->len != b_names->len)
+		return FALSE;
+
+	for (guint i = 0; i < a_names->len; i++) {
+		const gchar *name = g_ptr_array_index(a_names, i);
+		g_autoptr(GBytes) a_value = NULL;
+		g_autoptr(GBytes) b_value = NULL;
+
+		if (!g_str_equal(name, g_ptr_array_index(b_names, i)))
+			return FALSE;
+
+		a_value = read_xattr(a_fd, name);
+		b_value = read_xattr(b_fd, name);
+		if (!a_value || !b_value || !g_bytes_equal(a_value, b_value))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Checks whether a file can be shared with the previous version, which
+ * requires the ownership, mode, timestamps and extended attributes to match.
+ */
+static gboolean same_file_metadata(int a_fd, const struct stat *a, int b_fd, const struct stat *b)
+{
+	return a->st_mode == b->st_mode &&
+	       a->st_uid == b->st_uid &&
+	       a->st_gid == b->st_gid &&
+	       a->st_size == b->st_size &&
+	       a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+	       a->st_mtim.tv_nsec == b->st_mtim.tv_nsec &&
+	       same_xattrs(a_fd, b_fd);
+}
+
+/*
+ * Opens the file from the previous version of the tree, if its contents are
+ * known to be unchanged.
+ */
+static int open_ref_file(const TreeCopyContext *ctx, const TreeCopyEntry *entry, struct stat *st)
+{
+	int ref_fd;
+
+	if (ctx->ref_root_fd < 0 || !g_hash_table_contains(ctx->unchanged, entry->path))
+		return -1;
+
+	ref_fd = openat(ctx->ref_root_fd, entry->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (ref_fd == -1) {
+		g_debug("Failed to open unchanged file '%s' in previous version: %s", entry->path, g_strerror(errno));
+		return -1;
+	}
+
+	if (fstat(ref_fd, st) == -1 || !S_ISREG(st->st_mode) || st->st_size != entry->st.st_size) {
+		close(ref_fd);
+		return -1;
+	}
+
+	return ref_fd;
+}
+
+static gboolean copy_file_entry(TreeCopyContext *ctx, const TreeCopyEntry *entry, GError **error)
+{
+	GError *ierror = NULL;
+	g_auto(filedesc) in_fd = -1;
+	g_auto(filedesc) out_fd = -1;
+	g_auto(filedesc) ref_fd = -1;
+	struct stat ref_st;
+
+	in_fd = openat(ctx->src_root_fd, entry->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (in_fd == -1) {
+		set_errno_error(error, errno, "open", entry->path);
+		return FALSE;
+	}
+
+	/* an unchanged file with identical metadata can be shared with the previous version */
+	ref_fd = open_ref_file(ctx, entry, &ref_st);
+	if (ref_fd >= 0 && same_file_metadata(ref_fd, &ref_st, in_fd, &entry->st)) {
+		if (linkat(ctx->ref_root_fd, entry->path, ctx->dst_root_fd, entry->path, 0) == 0) {
+			g_atomic_int_inc(&ctx->reused_links);
+			return TRUE;
+		}
+		g_debug("Failed to link unchanged file '%s': %s", entry->path, g_strerror(errno));
+	}
+
+	out_fd = openat(ctx->dst_root_fd, entry->path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if (out_fd == -1) {
+		set_errno_error(error, errno, "create", entry->path);
+		return FALSE;
+	}
+
+	/* an unchanged file on the same filesystem can at least share the data */
+	if (entry->st.st_size > 0 && ref_fd >= 0 && ioctl(out_fd, FICLONE, ref_fd) == 0) {
+		g_atomic_int_inc(&ctx->reused_clones);
+		return apply_metadata(in_fd, out_fd, entry, error);
+	}
+
+	/* reserve the space up front, unless the data can be shared */
+	if (entry->st.st_size > 0 && ioctl(out_fd, FICLONE, in_fd) == -1) {
+		if (fallocate(out_fd, FALLOC_FL_KEEP_SIZE, 0, entry->st.st_size) == -1) {
+			int err = errno;
+			if (err != EOPNOTSUPP && err != ENOSYS) {
+				set_errno_error(error, err, "allocate space for", entry->path);
+				return FALSE;
+			}
+		}
+
+		if (!r_copy_fd_data(in_fd, out_fd, &ierror)) {
+			g_propagate_prefixed_error(error, ierror, "Failed to copy '%s': ", entry->path);
+			return FALSE;
+		}
+	}
+
+	return apply_metadata(in_fd, out_fd, entry, error);
+}
+
+static void tree_copy_worker(gpointer data, gpointer user_data)
+{
+	TreeCopyEntry *entry = data;
+	TreeCopyContext *ctx = user_data;
+	GError *ierror = NULL;
+
+	/* stop copying after the first error */
+	if (g_atomic_int_get(&ctx->failed))
+		return;
+
+	if (copy_file_entry(ctx, entry, &ierror))
+		return;
+
+	g_mutex_lock(&ctx->lock);
+	if (!ctx->error)
+		ctx->error = g_steal_pointer(&ierror);
+	g_mutex_unlock(&ctx->lock);
+	g_clear_error(&ierror);
+	g_atomic_int_set(&ctx->failed, 1);
+}
+
+static gboolean walk_dir(TreeCopyContext *ctx, int src_dir_fd, int dst_dir_fd, const gchar *dir_path, GError **error)
+{
+	GError *ierror = NULL;
+	DIR *dir = NULL;
+	struct dirent *dirent;
+	int fd;
+	gboolean res = FALSE;
+
+	/* fdopendir() takes ownership of the fd */
+	fd = openat(src_dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1 || !(dir = fdopendir(fd))) {
+		set_errno_error(error, errno, "open directory", dir_path);
+		if (fd != -1)
+			close(fd);
+		return FALSE;
+	}
+
+	while (TRUE) {
+		g_autofree gchar *path = NULL;
+		g_autofree gchar *key = NULL;
+		TreeCopyEntry *entry = NULL;
+		const gchar *first;
+		gboolean applied;
+		struct stat st;
+
+		errno = 0;
+		dirent = readdir(dir);
+		if (!dirent) {
+			if (errno) {
+				set_errno_error(error, errno, "read directory", dir_path);
+				goto out;
+			}
+			break;
+		}
+
+		if (g_strcmp0(dirent->d_name, ".") == 0 || g_strcmp0(dirent->d_name, "..") == 0)
+			continue;
+
+		/* paths are relative to the root, without a leading "./" */
+		if (g_str_equal(dir_path, "."))
+			path = g_strdup(dirent->d_name);
+		else
+			path = g_build_filename(dir_path, dirent->d_name, NULL);
+		if (fstatat(src_dir_fd, dirent->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+			set_errno_error(error, errno, "stat", path);
+			goto out;
+		}
+
+		switch (st.st_mode & S_IFMT) {
+			case S_IFDIR: {
+				g_auto(filedesc) src_child_fd = -1;
+				g_auto(filedesc) dst_child_fd = -1;
+
+				/* the final mode is set after the contents were copied */
+				if (mkdirat(dst_dir_fd, dirent->d_name, 0700) == -1) {
+					set_errno_error(error, errno, "create directory", path);
+					goto out;
+				}
+				g_ptr_array_add(ctx->dirs, tree_copy_entry_new(path, &st));
+
+				src_child_fd = openat(src_dir_fd, dirent->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+				if (src_child_fd == -1) {
+					set_errno_error(error, errno, "open directory", path);
+					goto out;
+				}
+				dst_child_fd = openat(dst_dir_fd, dirent->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+				if (dst_child_fd == -1) {
+					set_errno_error(error, errno, "open directory", path);
+					goto out;
+				}
+
+				if (!walk_dir(ctx, src_child_fd, dst_child_fd, path, &ierror)) {
+					g_propagate_error(error, ierror);
+					goto out;
+				}
+				break;
+			}
+			case S_IFREG: {
+				entry = tree_copy_entry_new(path, &st);
+
+				if (st.st_nlink > 1) {
+					key = g_strdup_printf("%ju:%ju", (uintmax_t)st.st_dev, (uintmax_t)st.st_ino);
+					first = g_hash_table_lookup(ctx->inodes, key);
+					if (first) {
+						entry->link_target = g_strdup(first);
+						g_ptr_array_add(ctx->links, entry);
+						break;
+					}
+					g_hash_table_insert(ctx->inodes, g_steal_pointer(&key), g_strdup(path));
+				}
+
+				g_ptr_array_add(ctx->files, entry);
+				break;
+			}
+			case S_IFLNK: {
+				g_autofree gchar *target = g_malloc(st.st_size + 1);
+				ssize_t len;
+
+				len = readlinkat(src_dir_fd, dirent->d_name, target, st.st_size + 1);
+				if (len < 0 || len > st.st_size) {
+					set_errno_error(error, len < 0 ? errno : EOVERFLOW, "read symlink", path);
+					goto out;
+				}
+				target[len] = '\0';
+
+				if (symlinkat(target, dst_dir_fd, dirent->d_name) == -1) {
+					set_errno_error(error, errno, "create symlink", path);
+					goto out;
+				}
+
+				entry = tree_copy_entry_new(path, &st);
+				applied = apply_metadata_at(dst_dir_fd, dirent->d_name, entry, &ierror);
+				tree_copy_entry_free(entry);
+				if (!applied) {
+					g_propagate_error(error, ierror);
+					goto out;
+				}
+				break;
+			}
+			case S_IFCHR:
+			case S_IFBLK:
+			case S_IFIFO:
+			case S_IFSOCK: {
+				if (mknodat(dst_dir_fd, dirent->d_name, st.st_mode, st.st_rdev) == -1) {
+					set_errno_error(error, errno, "create special file", path);
+					goto out;
+				}
+
+				entry = tree_copy_entry_new(path, &st);
+				applied = apply_metadata_at(dst_dir_fd, dirent->d_name, entry, &ierror);
+				tree_copy_entry_free(entry);
+				if (!applied) {
+					g_propagate_error(error, ierror);
+					goto out;
+				}
+				break;
+			}
+			default: {
+				g_set_error(error,
+						G_FILE_ERROR,
+						G_FILE_ERROR_FAILED,
+						"Unsupported file type of '%s'", path);
+				goto out;
+			}
+		}
+	}
+
+	res = TRUE;
+
+out:
+	closedir(dir);
+	return res;
+}
+
+/*
+ * Creates the additional hardlinks and applies the directory metadata.
+ *
+ * The directories are processed children first, so that creating entries
+ * doesn't change the timestamps of already finished directories.
+ */
+static gboolean finish_tree(TreeCopyContext *ctx, GError **error)
+{
+	GError *ierror = NULL;
+
+	for (guint i = 0; i < ctx->links->len; i++) {
+		const TreeCopyEntry *entry = ctx->links->pdata[i];
+
+		if (linkat(ctx->dst_root_fd, entry->link_target, ctx->dst_root_fd, entry->path, 0) == -1) {
+			set_errno_error(error, errno, "create hardlink", entry->path);
+			return FALSE;
+		}
+	}
+
+	for (guint i = ctx->dirs->len; i > 0; i--) {
+		const TreeCopyEntry *entry = ctx->dirs->pdata[i - 1];
+		g_auto(filedesc) src_fd = -1;
+		g_auto(filedesc) dst_fd = -1;
+
+		src_fd = openat(ctx->src_root_fd, entry->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (src_fd == -1) {
+			set_errno_error(error, errno, "open directory", entry->path);
+			return FALSE;
+		}
+		dst_fd = openat(ctx->dst_root_fd, entry->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (dst_fd == -1) {
+			set_errno_error(error, errno, "open directory", entry->path);
+			return FALSE;
+		}
+
+		if (!apply_metadata(src_fd, dst_fd, entry, &ierror)) {
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+gboolean r_tree_copy(const gchar *src, const gchar *dst, const gchar *ref, GHashTable *unchanged, GError **error)
+{
+	GError *ierror = NULL;
+	g_auto(filedesc) src_root_fd = -1;
+	g_auto(filedesc) dst_root_fd = -1;
+	g_auto(filedesc) ref_root_fd = -1;
+	g_autoptr(GPtrArray) dirs = g_ptr_array_new_with_free_func((GDestroyNotify)tree_copy_entry_free);
+	g_autoptr(GPtrArray) files = g_ptr_array_new_with_free_func((GDestroyNotify)tree_copy_entry_free);
+	g_autoptr(GPtrArray) links = g_ptr_array_new_with_free_func((GDestroyNotify)tree_copy_entry_free);
+	g_autoptr(GHashTable) inodes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	TreeCopyContext ctx = {0};
+	GThreadPool *pool = NULL;
+	struct stat st;
+	guint n_threads;
+	gboolean res = FALSE;
+
+	g_return_val_if_fail(src, FALSE);
+	g_return_val_if_fail(dst, FALSE);
+	g_return_val_if_fail(!ref == !unchanged, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	src_root_fd = g_open(src, O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0);
+	if (src_root_fd == -1 || fstat(src_root_fd, &st) == -1) {
+		set_errno_error(error, errno, "open directory", src);
+		return FALSE;
+	}
+
+	if (g_mkdir(dst, 0700) == -1) {
+		set_errno_error(error, errno, "create directory", dst);
+		return FALSE;
+	}
+	dst_root_fd = g_open(dst, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC, 0);
+	if (dst_root_fd == -1) {
+		set_errno_error(error, errno, "open directory", dst);
+		return FALSE;
+	}
+
+	if (ref) {
+		ref_root_fd = g_open(ref, O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0);
+		if (ref_root_fd == -1)
+			g_message("Failed to open previous version '%s', copying all files: %s", ref, g_strerror(errno));
+	}
+
+	ctx.src_root_fd = src_root_fd;
+	ctx.dst_root_fd = dst_root_fd;
+	ctx.ref_root_fd = ref_root_fd;
+	ctx.unchanged = unchanged;
+	ctx.dirs = dirs;
+	ctx.files = files;
+	ctx.links = links;
+	ctx.inodes = inodes;
+	g_mutex_init(&ctx.lock);
+
+	/* the root directory is finished last */
+	g_ptr_array_add(dirs, tree_copy_entry_new(".", &st));
+
+	if (!walk_dir(&ctx, src_root_fd, dst_root_fd, ".", &ierror)) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
+
+	if (files->len) {
+		n_threads = MIN(CLAMP(g_get_num_processors(), 1, TREE_COPY_MAX_THREADS), files->len);
+		pool = g_thread_pool_new(tree_copy_worker, &ctx, n_threads, FALSE, &ierror);
+		if (!pool) {
+			g_propagate_prefixed_error(error, ierror, "Failed to create copy thread pool: ");
+			goto out;
+		}
+
+		for (guint i = 0; i < files->len; i++) {
+			if (!g_thread_pool_push(pool, files->pdata[i], &ierror)) {
+				/* fall back to copying in this thread */
+				g_debug("Failed to queue file copy: %s", ierror->message);
+				g_clear_error(&ierror);
+				tree_copy_worker(files->pdata[i], &ctx);
+			}
+		}
+
+		/* wait for all queued files to be copied */
+		g_thread_pool_free(pool, FALSE, TRUE);
+
+		if (ctx.error) {
+			g_propagate_error(error, g_steal_pointer(&ctx.error));
+			goto out;
+		}
+	}
+
+	if (!finish_tree(&ctx, &ierror)) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
+
+	g_debug("Copied tree '%s' to '%s' (%u directories, %u files, %u hardlinks)",
+			src, dst, dirs->len, files->len, links->len);
+	if (ref_root_fd >= 0)
+		g_message("Reused %d unchanged files from '%s' (%d linked, %d cloned)",
+				ctx.reused_links + ctx.reused_clones, ref, ctx.reused_links, ctx.reused_clones);
+
+	res = TRUE;
+
+out:
+	g_mutex_clear(&ctx.lock);
+	return res;
+}
+
+static gboolean collect_digests(GHashTable *digests, const gchar *root, const gchar *dir_path, GError **error)
+{
+	GError *ierror = NULL;
+	g_autofree gchar *full_dir = g_build_filename(root, dir_path, NULL);
+	g_autoptr(GDir) dir = NULL;
+	const gchar *name;
+
+	dir = g_dir_open(full_dir, 0, &ierror);
+	if (!dir) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	while ((name = g_dir_read_name(dir))) {
+		g_autofree gchar *path = g_build_filename(dir_path, name, NULL);
+		g_autofree gchar *full_path = g_build_filename(root, path, NULL);
+		RaucChecksum checksum = {.type = G_CHECKSUM_SHA256};
+		struct stat st;
+
+		if (g_lstat(full_path, &st) == -1) {
+			set_errno_error(error, errno, "stat", full_path);
+			return FALSE;
+		}
+
+		if (S_ISDIR(st.st_mode)) {
+			if (!collect_digests(digests, root, path, &ierror)) {
+				g_propagate_error(error, ierror);
+				return FALSE;
+			}
+			continue;
+		}
+
+		if (!S_ISREG(st.st_mode))
+			continue;
+
+		if (!compute_checksum(&checksum, full_path, &ierror)) {
+			/* such files are simply not reused during installation */
+			if (g_error_matches(ierror, G_FILE_ERROR, G_FILE_ERROR_ACCES)) {
+				g_debug("Skipping digest of unreadable file '%s'", path);
+				g_clear_error(&ierror);
+				continue;
+			}
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
+
+		g_hash_table_insert(digests, g_steal_pointer(&path), checksum.digest);
+	}
+
+	return TRUE;
+}
+
+gboolean r_tree_digests_create(const gchar *root, const gchar *filename, GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(GHashTable) digests = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	g_autoptr(GList) paths = NULL;
+	g_autoptr(GVariant) variant = NULL;
+	g_auto(GVariantBuilder) builder = G_VARIANT_BUILDER_INIT(G_VARIANT_TYPE("a{ss}"));
+
+	g_return_val_if_fail(root, FALSE);
+	g_return_val_if_fail(filename, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (!collect_digests(digests, root, "", &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Failed to calculate file digests: ");
+		return FALSE;
+	}
+
+	/* sort the paths for reproducible output */
+	paths = g_list_sort(g_hash_table_get_keys(digests), (GCompareFunc)g_strcmp0);
+	for (GList *l = paths; l != NULL; l = l->next)
+		g_variant_builder_add(&builder, "{ss}", l->data, g_hash_table_lookup(digests, l->data));
+	variant = g_variant_ref_sink(g_variant_builder_end(&builder));
+
+	if (!g_file_set_contents(filename, g_variant_get_data(variant), g_variant_get_size(variant), &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	g_debug("Wrote digests of %u files to '%s'", g_hash_table_size(digests), filename);
+
+	return TRUE;
+}
+
+GHashTable *r_tree_digests_load(const gchar *filename, GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(GHashTable) digests = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	g_autoptr(GMappedFile) mapped = NULL;
+	g_autoptr(GBytes) data = NULL;
+	g_autoptr(GVariant) variant = NULL;
+	GVariantIter iter;
+	gchar *path, *digest;
+
+	g_return_val_if_fail(filename, NULL);
+	g_return_val_if_fail(error == NULL || *error == NULL, NULL);
+
+	mapped = g_mapped_file_new(filename, FALSE, &ierror);
+	if (!mapped) {
+		g_propagate_error(error, ierror);
+		return NULL;
+	}
+	data = g_mapped_file_get_bytes(mapped);
+
+	variant = g_variant_ref_sink(g_variant_new_from_bytes(G_VARIANT_TYPE("a{ss}"), data, FALSE));
+
+	g_variant_iter_init(&iter, variant);
+	while (g_variant_iter_next(&iter, "{ss}", &path, &digest))
+		g_hash_table_insert(digests, path, digest);
+
+	return g_steal_pointer(&digests);
+}
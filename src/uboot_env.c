@@ -0,0 +1,380 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+
+#include "uboot_env.h"
+#include "utils.h"
+
+G_DEFINE_QUARK(r-uboot-env-error-quark, r_uboot_env_error)
+
+/* upper limit to avoid huge allocations for a broken config */
+#define UBOOT_ENV_MAX_SIZE (16*1024*1024)
+
+typedef struct {
+	gchar *device;
+	guint64 offset;
+	gsize size;
+} UbootEnvLocation;
+
+struct _RUbootEnv {
+	UbootEnvLocation locations[2];
+	guint n_locations; /* 2 for a redundant environment */
+	guint current; /* index of the location which was read */
+	guint8 flags; /* flags counter of the current copy (redundant only) */
+	GPtrArray *vars; /* 'key=value' strings in environment order */
+	gboolean modified;
+};
+
+guint32 r_uboot_env_crc32(const guint8 *data, gsize len)
+{
+	static guint32 *table = NULL;
+	guint32 crc = 0xffffffff;
+
+	if (g_once_init_enter(&table)) {
+		guint32 *tmp = g_new(guint32, 256);
+
+		for (guint32 i = 0; i < 256; i++) {
+			guint32 c = i;
+			for (guint j = 0; j < 8; j++)
+				c = (c & 1) ? (0xedb88320 ^ (c >> 1)) : (c >> 1);
+			tmp[i] = c;
+		}
+		g_once_init_leave(&table, tmp);
+	}
+
+	for (gsize i = 0; i < len; i++)
+		crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+
+	return crc ^ 0xffffffff;
+}
+
+static gsize header_size(const RUbootEnv *env)
+{
+	/* CRC32, followed by the flags byte for a redundant environment */
+	return (env->n_locations == 2) ? 5 : 4;
+}
+
+static gboolean parse_config(RUbootEnv *env, const gchar *config_path, GError **error)
+{
+	g_autofree gchar *contents = NULL;
+	g_auto(GStrv) lines = NULL;
+	GError *ierror = NULL;
+
+	if (!g_file_get_contents(config_path, &contents, NULL, &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Failed to read U-Boot environment config: ");
+		return FALSE;
+	}
+
+	lines = g_strsplit(contents, "\n", -1);
+	for (gchar **line = lines; *line; line++) {
+		g_autoptr(GPtrArray) fields = g_ptr_array_new();
+		g_auto(GStrv) tokens = NULL;
+		UbootEnvLocation *location;
+		gchar *end = NULL;
+		guint64 size;
+
+		g_strstrip(*line);
+		if ((*line)[0] == '\0' || (*line)[0] == '#')
+			continue;
+
+		tokens = g_strsplit_set(*line, " \t", -1);
+		for (gchar **token = tokens; *token; token++) {
+			if ((*token)[0] != '\0')
+				g_ptr_array_add(fields, *token);
+		}
+
+		if (fields->len < 3) {
+			g_set_error(error, R_UBOOT_ENV_ERROR, R_UBOOT_ENV_ERROR_CONFIG,
+					"Invalid line '%s' in %s", *line, config_path);
+			return FALSE;
+		}
+
+		if (env->n_locations == G_N_ELEMENTS(env->locations)) {
+			g_set_error(error, R_UBOOT_ENV_ERROR, R_UBOOT_ENV_ERROR_CONFIG,
+					"More than two environment locations in %s", config_path);
+			return FALSE;
+		}
+
+		if (g_str_has_prefix(fields->pdata[0], "/dev/mtd") ||
+		    g_str_has_prefix(fields->pdata[0], "/dev/ubi")) {
+			g_set_error(error, R_UBOOT_ENV_ERROR, R_UBOOT_ENV_ERROR_NOT_SUPPORTED,
+					"Environment on %s is not supported, only block devices and files can be used",
+					(const gchar *)fields->pdata[0]);
+			return FALSE;
+		}
+
+		location = &env->locations[env->n_locations];
+
+		/* negative offsets (from the end of the device) are not supported */
+		location->offset = g_ascii_strtoull(fields->pdata[1], &end, 0);
+		if (*end != '\0' || ((const gchar *)fields->pdata[1])[0] == '-') {
+			g_set_error(error, R_UBOOT_ENV_ERROR, R_UBOOT_ENV_ERROR_CONFIG,
+					"Invalid offset '%s' in %s", (const gchar *)fields->pdata[1], config_path);
+			return FALSE;
+		}
+
+		size = g_ascii_strtoull(fields->pdata[2], &end, 0);
+		if (*end != '\0' || size <= 5 || size > UBOOT_ENV_MAX_SIZE) {
+			g_set_error(error, R_UBOOT_ENV_ERROR, R_UBOOT_ENV_ERROR_CONFIG,
+					"Invalid size '%s' in %s", (const gchar *)fields->pdata[2], config_path);
+			return FALSE;
+		}
+		location->size = size;
+		location->device = g_strdup(fields->pdata[0]);
+
+		env->n_locations++;
+	}
+
+	if (env->n_locations == 0) {
+		g_set_error(error, R_UBOOT_ENV_ERROR, R_UBOOT_ENV_ERROR_CONFIG,
+				"No environment location in %s", config_path);
+		return FALSE;
+	}
+
+	if (env->n_locations == 2 && env->locations[0].size != env->locations[1].size) {
+		g_set_error(error, R_UBOOT_ENV_ERROR, R_UBOOT_ENV_ERROR_CONFIG,
+				"Redundant environments in %s differ in size", config_path);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Reads one copy of the environment, returns NULL if the CRC is invalid. */
+static guint8 *read_copy(const RUbootEnv *env, guint idx, GError **error)
+{
+	const UbootEnvLocation *location = &env->locations[idx];
+	g_autofree guint8 *data = g_malloc(location->size);
+	g_auto(filedesc) fd = -1;
+	GError *ierror = NULL;
+	guint32 crc;
+
+	fd = g_open(location->device, O_RDONLY | O_CLOEXEC, 0);
+	if (fd < 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to open %s: %s", location->device, g_strerror(err));
+		return NULL;
+	}
+
+	if (!r_pread_exact(fd, data, location->size, location->offset, &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Failed to read environment from %s: ", location->device);
+		return NULL;
+	}
+
+	memcpy(&crc, data, sizeof(crc));
+	if (GUINT32_FROM_LE(crc) != r_uboot_env_crc32(data + header_size(env), location->size - header_size(env))) {
+		g_message("Bad CRC for U-Boot environment at %s:0x%"G_GINT64_MODIFIER "x",
+				location->device, location->offset);
+		return NULL;
+	}
+
+	return g_steal_pointer(&data);
+}
+
+/* Returns TRUE if flags counter a is newer than b, handling the wrap-around. */
+static gboolean flags_newer(guint8 a, guint8 b)
+{
+	if (a == 0 && b == 255)
+		return TRUE;
+	if (a == 255 && b == 0)
+		return FALSE;
+	return a > b;
+}
+
+RUbootEnv *r_uboot_env_open(const gchar *config_path, GError **error)
+{
+	g_autoptr(RUbootEnv) env = g_new0(RUbootEnv, 1);
+	guint8 *copies[2] = {NULL, NULL};
+	const guint8 *data;
+	gsize data_size;
+	GError *ierror = NULL;
+
+	g_return_val_if_fail(config_path, NULL);
+	g_return_val_if_fail(error == NULL || *error == NULL, NULL);
+
+	env->vars = g_ptr_array_new_with_free_func(g_free);
+
+	if (!parse_config(env, config_path, error))
+		return NULL;
+
+	for (guint i = 0; i < env->n_locations; i++) {
+		copies[i] = read_copy(env, i, &ierror);
+		if (ierror) {
+			g_propagate_error(error, ierror);
+			g_free(copies[0]);
+			return NULL;
+		}
+	}
+	if (!copies[0] && !copies[1]) {
+		g_set_error(error, R_UBOOT_ENV_ERROR, R_UBOOT_ENV_ERROR_INVALID,
+				"No valid U-Boot environment found");
+		return NULL;
+	}
+
+	if (!copies[0])
+		env->current = 1;
+	else if (copies[1] && flags_newer(copies[1][4], copies[0][4]))
+		env->current = 1;
+	else
+		env->current = 0;
+
+	data = copies[env->current];
+	if (env->n_locations == 2)
+		env->flags = data[4];
+
+	/* Parse the NUL-separated 'key=value' entries, which end with an empty string. */
+	data_size = env->locations[env->current].size - header_size(env);
+	data += header_size(env);
+	for (gsize pos = 0; pos < data_size && data[pos] != '\0';) {
+		gsize len = strnlen((const gchar *)data + pos, data_size - pos);
+
+		g_ptr_array_add(env->vars, g_strndup((const gchar *)data + pos, len));
+		pos += len + 1;
+	}
+
+	g_free(copies[0]);
+	g_free(copies[1]);
+
+	return g_steal_pointer(&env);
+}
+
+static gint find_var(const RUbootEnv *env, const gchar *key)
+{
+	gsize key_len = strlen(key);
+
+	for (guint i = 0; i < env->vars->len; i++) {
+		const gchar *var = g_ptr_array_index(env->vars, i);
+
+		if (strncmp(var, key, key_len) == 0 && var[key_len] == '=')
+			return i;
+	}
+
+	return -1;
+}
+
+const gchar *r_uboot_env_get(const RUbootEnv *env, const gchar *key, GError **error)
+{
+	gint idx;
+
+	g_return_val_if_fail(env, NULL);
+	g_return_val_if_fail(key, NULL);
+	g_return_val_if_fail(error == NULL || *error == NULL, NULL);
+
+	idx = find_var(env, key);
+	if (idx < 0) {
+		g_set_error(error, R_UBOOT_ENV_ERROR, R_UBOOT_ENV_ERROR_NOT_FOUND,
+				"Variable '%s' not found in U-Boot environment", key);
+		return NULL;
+	}
+
+	return (const gchar *)g_ptr_array_index(env->vars, idx) + strlen(key) + 1;
+}
+
+void r_uboot_env_set(RUbootEnv *env, const gchar *key, const gchar *value)
+{
+	gint idx;
+
+	g_return_if_fail(env);
+	g_return_if_fail(key && *key && !strchr(key, '='));
+	g_return_if_fail(value);
+
+	idx = find_var(env, key);
+	if (idx < 0) {
+		g_ptr_array_add(env->vars, g_strdup_printf("%s=%s", key, value));
+	} else {
+		gchar **var = (gchar **)&g_ptr_array_index(env->vars, idx);
+
+		if (g_strcmp0(*var + strlen(key) + 1, value) == 0)
+			return;
+		g_free(*var);
+		*var = g_strdup_printf("%s=%s", key, value);
+	}
+
+	env->modified = TRUE;
+}
+
+gboolean r_uboot_env_commit(RUbootEnv *env, GError **error)
+{
+	g_autofree guint8 *data = NULL;
+	const UbootEnvLocation *location;
+	g_auto(filedesc) fd = -1;
+	GError *ierror = NULL;
+	guint target;
+	guint8 flags;
+	gsize pos;
+	guint32 crc;
+
+	g_return_val_if_fail(env, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (!env->modified)
+		return TRUE;
+
+	/* keep the current copy intact until the other one is written */
+	target = (env->n_locations == 2) ? !env->current : 0;
+	flags = env->flags + 1;
+	location = &env->locations[target];
+
+	/* unused space is filled with zeros, which also terminates the list */
+	data = g_malloc0(location->size);
+	pos = header_size(env);
+	for (guint i = 0; i < env->vars->len; i++) {
+		const gchar *var = g_ptr_array_index(env->vars, i);
+		gsize len = strlen(var) + 1;
+
+		/* leave room for the final terminator */
+		if (len >= location->size - pos) {
+			g_set_error(error, R_UBOOT_ENV_ERROR, R_UBOOT_ENV_ERROR_TOO_LARGE,
+					"U-Boot environment exceeds size of %"G_GSIZE_FORMAT " bytes", location->size);
+			return FALSE;
+		}
+		memcpy(data + pos, var, len);
+		pos += len;
+	}
+
+	if (env->n_locations == 2)
+		data[4] = flags;
+	crc = GUINT32_TO_LE(r_uboot_env_crc32(data + header_size(env), location->size - header_size(env)));
+	memcpy(data, &crc, sizeof(crc));
+
+	fd = g_open(location->device, O_WRONLY | O_CLOEXEC, 0);
+	if (fd < 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to open %s: %s", location->device, g_strerror(err));
+		return FALSE;
+	}
+
+	if (!r_pwrite_exact(fd, data, location->size, location->offset, &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Failed to write environment to %s: ", location->device);
+		return FALSE;
+	}
+
+	if (fsync(fd) < 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to sync %s: %s", location->device, g_strerror(err));
+		return FALSE;
+	}
+
+	env->current = target;
+	env->flags = flags;
+	env->modified = FALSE;
+
+	return TRUE;
+}
+
+void r_uboot_env_free(RUbootEnv *env)
+{
+	if (!env)
+		return;
+
+	for (guint i = 0; i < G_N_ELEMENTS(env->locations); i++)
+		g_free(env->locations[i].device);
+	if (env->vars)
+		g_ptr_array_unref(env->vars);
+	g_free(env);
+}
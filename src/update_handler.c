@@ -8,24 +8,34 @@
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
+#include <unistd.h>
 
+#include "casync.h"
+#include "cdc_index.h"
+#include "chunk_pack.h"
 #include "context.h"
+#include "dm.h"
 #include "mount.h"
+#include "mtd.h"
 #include "signature.h"
 #include "update_handler.h"
 #include "update_utils.h"
 #include "emmc.h"
+#include "file_index.h"
 #include "mbr.h"
 #include "gpt.h"
 #include "utils.h"
 #include "hash_index.h"
+#include "stats.h"
+#include "trace.h"
 
 #define R_SLOT_HOOK_PRE_INSTALL "slot-pre-install"
 #define R_SLOT_HOOK_POST_INSTALL "slot-post-install"
 #define R_SLOT_HOOK_INSTALL "slot-install"
 
-#define CLEAR_BLOCK_SIZE 1024
+#define CLEAR_BLOCK_SIZE (1024*1024)
 
 GQuark r_update_error_quark(void)
 {
@@ -93,57 +103,103 @@ static gboolean check_image_size(int fd, const RaucSlot *slot, const RaucImage *
 	return TRUE;
 }
 
+/* fsync() which records the time spent in the performance report */
+static int timed_fsync(int fd)
+{
+	gint64 start = g_get_monotonic_time();
+	int ret = fsync(fd);
+	int err = errno;
+
+	r_stats_report_add("fsync time [s]", (gdouble)(g_get_monotonic_time() - start) / G_USEC_PER_SEC);
+	errno = err;
+
+	return ret;
+}
+
 #if ENABLE_EMMC_BOOT_SUPPORT == 1
-static gboolean clear_slot(RaucSlot *slot, GError **error)
+/* Clears the slot device behind the image.
+ *
+ * The area from 'start' up to the slot's size-limit (or the end of the
+ * device) is overwritten with zeros, so that the image area itself is only
+ * written once by the subsequent copy.
+ */
+static gboolean clear_slot_tail(int fd, const RaucSlot *slot, guint64 start, GError **error)
 {
 	GError *ierror = NULL;
-	static gchar zerobuf[CLEAR_BLOCK_SIZE] = {};
-	g_autoptr(GOutputStream) outstream = NULL;
-	gint write_count = 0;
-	guint64 total_written = 0;
+	g_autofree guint8 *zerobuf = NULL;
+	guint64 end;
+	goffset dev_size;
 
-	outstream = G_OUTPUT_STREAM(r_unix_output_stream_open_device(slot->device, NULL, &ierror));
-	if (outstream == NULL) {
+	dev_size = get_device_size(fd, &ierror);
+	if (ierror) {
 		g_propagate_error(error, ierror);
 		return FALSE;
 	}
 
-	while (write_count != -1) {
-		/* cap writes to slot->size_limit if set */
-		gsize write_size = CLEAR_BLOCK_SIZE;
-		if (slot->size_limit > 0 &&
-		    total_written + write_size > slot->size_limit)
-			write_size = slot->size_limit - total_written;
+	end = dev_size;
+	if (slot->size_limit > 0 && slot->size_limit < end)
+		end = slot->size_limit;
 
-		write_count = g_output_stream_write(outstream, zerobuf, write_size, NULL,
-				&ierror);
-		/*
-		 * G_IO_ERROR_NO_SPACE is expected here, because the block
-		 * device is cleared completely
-		 */
-		if (write_count == -1) {
-			if (g_error_matches(ierror, G_IO_ERROR, G_IO_ERROR_NO_SPACE)) {
-				g_clear_error(&ierror);
-				break;
-			} else {
-				g_propagate_prefixed_error(error, ierror,
-						"failed clearing block device: ");
-				return FALSE;
-			}
+	zerobuf = g_malloc0(CLEAR_BLOCK_SIZE);
+	for (guint64 pos = start; pos < end;) {
+		gsize write_size = MIN(CLEAR_BLOCK_SIZE, end - pos);
+
+		if (!r_pwrite_exact(fd, zerobuf, write_size, pos, &ierror)) {
+			g_propagate_prefixed_error(error, ierror,
+					"failed clearing block device: ");
+			return FALSE;
 		}
+		r_copy_count_written(write_size);
+		pos += write_size;
+	}
 
-		total_written += write_count;
-		if (slot->size_limit > 0 && total_written >= slot->size_limit)
-			break;
+	if (end > start)
+		g_debug("Cleared %"G_GUINT64_FORMAT " bytes after the image on %s", end - start, slot->device);
+
+	return TRUE;
+}
+
+/* Reads back the written image range and compares it with the image digest.
+ *
+ * The cached pages are dropped first, so that the data is actually read from
+ * the device.
+ */
+static gboolean verify_written_image(const gchar *device, const RaucImage *image, GError **error)
+{
+	g_autoptr(GChecksum) ctx = NULL;
+	g_autofree guint8 *buf = NULL;
+	g_auto(filedesc) fd = -1;
+	GError *ierror = NULL;
+
+	g_return_val_if_fail(image->checksum.digest, FALSE);
+
+	fd = g_open(device, O_RDONLY | O_CLOEXEC, 0);
+	if (fd == -1) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to open %s for verification: %s", device, g_strerror(err));
+		return FALSE;
 	}
 
-	if (slot->size_limit > 0)
-		g_message("Cleared first %"G_GOFFSET_FORMAT " bytes on %s", total_written, slot->device);
-	else
-		g_debug("Cleared %"G_GOFFSET_FORMAT " bytes on %s", total_written, slot->device);
+	(void)posix_fadvise(fd, 0, image->checksum.size, POSIX_FADV_DONTNEED);
 
-	if (!g_output_stream_close(outstream, NULL, &ierror)) {
-		g_propagate_error(error, ierror);
+	ctx = g_checksum_new(image->checksum.type);
+	buf = g_malloc(CLEAR_BLOCK_SIZE);
+	for (goffset pos = 0; pos < image->checksum.size;) {
+		gsize read_size = MIN(CLEAR_BLOCK_SIZE, image->checksum.size - pos);
+
+		if (!r_pread_exact(fd, buf, read_size, pos, &ierror)) {
+			g_propagate_prefixed_error(error, ierror,
+					"Failed to read back %s: ", device);
+			return FALSE;
+		}
+		g_checksum_update(ctx, buf, read_size);
+		pos += read_size;
+	}
+
+	if (g_strcmp0(g_checksum_get_string(ctx), image->checksum.digest) != 0) {
+		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED,
+				"Verification of %s failed: written data does not match the image digest", device);
 		return FALSE;
 	}
 
@@ -201,6 +257,7 @@ static gboolean clear_boot_switch_partition(const gchar *device,
 			break;
 
 		clear_count += tmp_count;
+		r_copy_count_written(tmp_count);
 	}
 
 	if (clear_count != dest_partition->size) {
@@ -233,6 +290,232 @@ static gboolean ubifs_ioctl(RaucImage *image, int fd, GError **error)
 	return TRUE;
 }
 
+/* target size of each write to a UBI volume, rounded down to complete LEBs */
+#define UBI_COPY_SIZE (4*1024*1024)
+
+/**
+ * Reads a numeric or string attribute of an open UBI volume from sysfs.
+ *
+ * The volume is found via /sys/dev/char/<major>:<minor>, so the device node
+ * name does not matter.
+ */
+static gchar *get_ubi_volume_attr(int fd, const gchar *name, GError **error)
+{
+	struct stat st;
+	g_autofree gchar *path = NULL;
+	gchar *contents = NULL;
+
+	if (fstat(fd, &st) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to stat UBI volume: %s", g_strerror(err));
+		return NULL;
+	}
+	if (!S_ISCHR(st.st_mode)) {
+		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED,
+				"Not a UBI volume character device");
+		return NULL;
+	}
+
+	path = g_strdup_printf("/sys/dev/char/%u:%u/%s", major(st.st_rdev), minor(st.st_rdev), name);
+	if (!g_file_get_contents(path, &contents, NULL, error))
+		return NULL;
+
+	return g_strstrip(contents);
+}
+
+static gboolean get_ubi_volume_int(int fd, const gchar *name, gint64 *value, GError **error)
+{
+	g_autofree gchar *contents = NULL;
+	gchar *end = NULL;
+
+	contents = get_ubi_volume_attr(fd, name, error);
+	if (!contents)
+		return FALSE;
+
+	*value = g_ascii_strtoll(contents, &end, 10);
+	if (end == contents || *end != '\0' || *value <= 0) {
+		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED,
+				"Invalid UBI volume attribute %s: '%s'", name, contents);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Copies the image to a UBI volume after UBI_IOCVOLUP.
+ *
+ * UBI collects the written data into LEB-sized buffers before writing them to
+ * flash, so writes which cover complete LEBs avoid partial copies in the
+ * kernel.
+ */
+static gboolean copy_raw_image_to_ubivol(RaucImage *image, int out_fd, GError **error)
+{
+	GError *ierror = NULL;
+	g_auto(filedesc) in_fd = -1;
+	gint64 leb_size = 0;
+	gsize block_size;
+
+	if (!get_ubi_volume_int(out_fd, "usable_eb_size", &leb_size, &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Failed to get LEB size: ");
+		return FALSE;
+	}
+	block_size = MAX(UBI_COPY_SIZE / leb_size, 1) * leb_size;
+	g_debug("Writing UBI volume in blocks of %"G_GSIZE_FORMAT " bytes (LEB size %"G_GINT64_FORMAT ")", block_size, leb_size);
+
+	in_fd = g_open(image->filename, O_RDONLY | O_CLOEXEC, 0);
+	if (in_fd < 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to open file for reading: %s", g_strerror(err));
+		return FALSE;
+	}
+
+	return r_copy_fd_with_block_size(in_fd, out_fd, image->checksum.size, block_size, error);
+}
+
+/**
+ * Updates only the LEBs of a dynamic UBI volume which differ from the image.
+ *
+ * Each LEB of the image (padded with 0xFF like a volume update does) is
+ * compared with the current content of the volume. Differing LEBs are
+ * replaced using atomic LEB change (UBI_IOCEBCH), so unchanged LEBs are
+ * neither erased nor written. LEBs after the end of the image are unmapped,
+ * which results in the same volume content as a full UBI_IOCVOLUP.
+ *
+ * Static volumes do not support LEB changes and return
+ * R_UPDATE_ERROR_UNSUPPORTED_ADAPTIVE_MODE.
+ */
+static gboolean copy_changed_ubi_lebs(RaucImage *image, RaucSlot *dest_slot, GError **error)
+{
+	GError *ierror = NULL;
+	g_auto(filedesc) vol_fd = -1;
+	g_auto(filedesc) in_fd = -1;
+	g_autofree gchar *type = NULL;
+	g_autofree guint8 *new_leb = NULL;
+	g_autofree guint8 *old_leb = NULL;
+	gint64 leb_size = 0;
+	gint64 reserved_lebs = 0;
+	goffset size = image->checksum.size;
+	gint32 leb_count;
+	guint changed = 0;
+	guint unmapped = 0;
+	gint64 last_progress = 0;
+
+	vol_fd = g_open(dest_slot->device, O_RDWR | O_CLOEXEC, 0);
+	if (vol_fd < 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to open UBI volume %s: %s", dest_slot->device, g_strerror(err));
+		return FALSE;
+	}
+
+	type = get_ubi_volume_attr(vol_fd, "type", &ierror);
+	if (!type) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+	if (!g_str_equal(type, "dynamic")) {
+		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_UNSUPPORTED_ADAPTIVE_MODE,
+				"Adaptive method 'ubi-leb' requires a dynamic UBI volume (%s is %s)", dest_slot->device, type);
+		return FALSE;
+	}
+
+	if (!get_ubi_volume_int(vol_fd, "usable_eb_size", &leb_size, &ierror) ||
+	    !get_ubi_volume_int(vol_fd, "reserved_ebs", &reserved_lebs, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	if (size > leb_size * reserved_lebs) {
+		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED,
+				"Image size %"G_GOFFSET_FORMAT " exceeds UBI volume size %"G_GINT64_FORMAT,
+				size, leb_size * reserved_lebs);
+		return FALSE;
+	}
+	leb_count = (size + leb_size - 1) / leb_size;
+
+	in_fd = g_open(image->filename, O_RDONLY | O_CLOEXEC, 0);
+	if (in_fd < 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to open file for reading: %s", g_strerror(err));
+		return FALSE;
+	}
+
+	new_leb = g_malloc(leb_size);
+	old_leb = g_malloc(leb_size);
+
+	for (gint32 lnum = 0; lnum < leb_count; lnum++) {
+		goffset offset = (goffset)lnum * leb_size;
+		gsize len = MIN(leb_size, size - offset);
+		struct ubi_leb_change_req req = {
+			.lnum = lnum,
+			.bytes = len,
+			.dtype = UBI_UNKNOWN,
+		};
+
+		if (!r_pread_exact(in_fd, new_leb, len, offset, &ierror)) {
+			g_propagate_prefixed_error(error, ierror, "Failed to read image: ");
+			return FALSE;
+		}
+		memset(new_leb + len, 0xff, leb_size - len);
+
+		/* unmapped LEBs read as 0xFF */
+		if (!r_pread_exact(vol_fd, old_leb, leb_size, offset, &ierror)) {
+			g_propagate_prefixed_error(error, ierror, "Failed to read LEB %d: ", lnum);
+			return FALSE;
+		}
+
+		if (memcmp(new_leb, old_leb, leb_size) != 0) {
+			if (ioctl(vol_fd, UBI_IOCEBCH, &req) == -1) {
+				int err = errno;
+				g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+						"Failed to start change of LEB %d: %s", lnum, g_strerror(err));
+				return FALSE;
+			}
+			if (!r_write_exact(vol_fd, new_leb, len, &ierror)) {
+				g_propagate_prefixed_error(error, ierror, "Failed to write LEB %d: ", lnum);
+				return FALSE;
+			}
+			changed++;
+			r_copy_count_written(len);
+			r_copy_throttle(len);
+		}
+
+		r_copy_image_progress(&last_progress, offset + len, size);
+	}
+
+	for (gint32 lnum = leb_count; lnum < reserved_lebs; lnum++) {
+		int mapped = ioctl(vol_fd, UBI_IOCEBISMAP, &lnum);
+
+		if (mapped == -1) {
+			int err = errno;
+			g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+					"Failed to check mapping of LEB %d: %s", lnum, g_strerror(err));
+			return FALSE;
+		}
+		if (!mapped)
+			continue;
+
+		if (ioctl(vol_fd, UBI_IOCEBUNMAP, &lnum) == -1) {
+			int err = errno;
+			g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+					"Failed to unmap LEB %d: %s", lnum, g_strerror(err));
+			return FALSE;
+		}
+		unmapped++;
+	}
+
+	g_message("Changed %u of %d LEBs in %s (%u unmapped)", changed, leb_count, dest_slot->device, unmapped);
+
+	return TRUE;
+}
+
+/* requested pipe size for splicing, limited by /proc/sys/fs/pipe-max-size */
+#define SPLICE_PIPE_SIZE (1024*1024)
+
 static gboolean splice_with_progress(GUnixInputStream *image_stream,
 		GUnixOutputStream *out_stream, GError **error)
 {
@@ -241,6 +524,8 @@ static gboolean splice_with_progress(GUnixInputStream *image_stream,
 	struct stat stat = {};
 	ssize_t out_size = 0;
 	goffset sum_size = 0;
+	gint64 last_progress = 0;
+	int pipe_size;
 
 	if (fstat(in_fd, &stat)) {
 		int err = errno;
@@ -251,9 +536,16 @@ static gboolean splice_with_progress(GUnixInputStream *image_stream,
 		return FALSE;
 	}
 
+	/* a larger pipe reduces the number of splice calls and context switches */
+	pipe_size = fcntl(out_fd, F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+	if (pipe_size < 0)
+		pipe_size = fcntl(out_fd, F_GETPIPE_SZ);
+	if (pipe_size <= 0)
+		pipe_size = SPLICE_PIPE_SIZE;
+
 	do {
-		/* Splice in 1M blocks */
-		out_size = splice(in_fd, NULL, out_fd, NULL, 1UL*1024*1024, 0);
+		/* splice up to the pipe capacity per call */
+		out_size = splice(in_fd, NULL, out_fd, NULL, pipe_size, SPLICE_F_MORE);
 		if (out_size == -1) {
 			int err = errno;
 			g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
@@ -263,9 +555,8 @@ static gboolean splice_with_progress(GUnixInputStream *image_stream,
 
 		sum_size += out_size;
 
-		/* emit progress info (but only when in progress context) */
-		if (r_context()->progress)
-			r_context_set_step_percentage("copy_image", sum_size * 100 / stat.st_size);
+		r_copy_image_progress(&last_progress, sum_size, stat.st_size);
+		r_copy_throttle(out_size);
 	} while (out_size);
 
 	return TRUE;
@@ -387,7 +678,7 @@ static gboolean copy_raw_image(RaucImage *image, GUnixOutputStream *outstream, g
 	if (len_header_last) {
 		gsize bytes;
 
-		if (fsync(out_fd) == -1) {
+		if (timed_fsync(out_fd) == -1) {
 			g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED, "Syncing content to disk failed: %s", strerror(errno));
 			return FALSE;
 		}
@@ -402,6 +693,7 @@ static gboolean copy_raw_image(RaucImage *image, GUnixOutputStream *outstream, g
 					"Failed to write header: ");
 			return FALSE;
 		}
+		r_copy_count_written(bytes);
 	}
 
 	if (!g_input_stream_close(instream, NULL, &ierror)) {
@@ -410,7 +702,7 @@ static gboolean copy_raw_image(RaucImage *image, GUnixOutputStream *outstream, g
 	}
 
 	/* flush to block device before closing to assure content is written to disk */
-	if (fsync(out_fd) == -1) {
+	if (timed_fsync(out_fd) == -1) {
 		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED, "Syncing content to disk failed: %s", strerror(errno));
 		return FALSE;
 	}
@@ -493,6 +785,10 @@ static gboolean casync_extract(RaucImage *image, gchar *dest, int out_fd, const
 	/* Desync doesn't have the --seed-output option */
 	if (!r_context()->config->use_desync)
 		g_ptr_array_add(args, g_strdup("--seed-output=no"));
+	/* The seed slot may have changed since its index was saved (e.g. by
+	 * mounting it), so let desync fetch invalid chunks instead */
+	else if (seed)
+		g_ptr_array_add(args, g_strdup("--skip-invalid-seeds"));
 
 	if (r_context()->config->casync_install_args != NULL) {
 		if (!g_shell_parse_argv(r_context()->config->casync_install_args, NULL, &casync_argvp, &ierror)) {
@@ -574,7 +870,174 @@ static RaucSlot *get_active_slot_class_member(gchar *slotclass)
 	return NULL;
 }
 
-static gboolean casync_extract_image(RaucImage *image, gchar *dest, int out_fd, GError **error)
+#define CASYNC_SEED_INDEX_NAME "casync-blob-index"
+
+/* Returns the path of the saved blob index which describes the current
+ * content of the slot, or NULL if there is none. */
+static gchar *get_casync_seed_index(const RaucSlot *slot)
+{
+	GError *ierror = NULL;
+	g_autofree gchar *dir = NULL;
+	g_autofree gchar *path = NULL;
+
+	dir = r_slot_get_checksum_data_directory(slot, NULL, &ierror);
+	if (!dir) {
+		if (ierror) {
+			g_warning("Not using a casync seed index: %s", ierror->message);
+			g_clear_error(&ierror);
+		}
+		return NULL;
+	}
+
+	path = g_build_filename(dir, CASYNC_SEED_INDEX_NAME, NULL);
+	if (!g_file_test(path, G_FILE_TEST_IS_REGULAR))
+		return NULL;
+
+	return g_steal_pointer(&path);
+}
+
+/* Saves the blob index of the image in the data directory of the slot, so
+ * that the next update can use it as seed index instead of chunking the
+ * whole slot again. */
+static void save_casync_seed_index(const RaucImage *image, const RaucSlot *slot)
+{
+	GError *ierror = NULL;
+	g_autofree gchar *dir = NULL;
+	g_autofree gchar *path = NULL;
+	g_autoptr(GFile) src = NULL;
+	g_autoptr(GFile) dst = NULL;
+
+	dir = r_slot_get_checksum_data_directory(slot, &image->checksum, &ierror);
+	if (!dir) {
+		if (ierror) {
+			g_warning("Continuing after failure to save casync seed index: %s", ierror->message);
+			g_clear_error(&ierror);
+		}
+		return;
+	}
+
+	path = g_build_filename(dir, CASYNC_SEED_INDEX_NAME, NULL);
+	src = g_file_new_for_path(image->filename);
+	dst = g_file_new_for_path(path);
+	if (!g_file_copy(src, dst, G_FILE_COPY_OVERWRITE, NULL, NULL, NULL, &ierror)) {
+		g_warning("Continuing after failure to save casync seed index: %s", ierror->message);
+		g_clear_error(&ierror);
+		return;
+	}
+
+	g_debug("Saved casync seed index for %s", slot->name);
+}
+
+#if ENABLE_CASYNC_NATIVE == 1
+/* Extracts a blob index without the external casync tool.
+ *
+ * Returns R_CASYNC_ERROR_UNSUPPORTED if the external tool should be used
+ * instead. */
+static gboolean casync_native_extract_image(RaucImage *image, gchar *dest, int out_fd, GError **error)
+{
+	GError *ierror = NULL;
+	RaucSlot *seedslot = NULL;
+	g_autoptr(RCasyncIndex) index = NULL;
+	g_autoptr(RCasyncIndex) seed_index = NULL;
+	g_autofree gchar *seed_index_path = NULL;
+	g_autofree gchar *casync = NULL;
+	g_auto(filedesc) seed_fd = -1;
+	g_auto(filedesc) dest_fd = -1;
+
+	index = r_casync_index_load(image->filename, &ierror);
+	if (!index) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	seedslot = get_active_slot_class_member(image->slotclass);
+	if (seedslot)
+		seed_index_path = get_casync_seed_index(seedslot);
+	if (seed_index_path) {
+		seed_index = r_casync_index_load(seed_index_path, &ierror);
+		if (!seed_index) {
+			g_warning("Ignoring invalid casync seed index: %s", ierror->message);
+			g_clear_error(&ierror);
+		}
+	}
+
+	/* without a seed index, casync can still index the seed slot itself */
+	casync = g_find_program_in_path("casync");
+	if (seedslot && !seed_index && casync) {
+		g_set_error(error, R_CASYNC_ERROR, R_CASYNC_ERROR_UNSUPPORTED,
+				"No casync seed index available for %s", seedslot->name);
+		return FALSE;
+	}
+
+	if (seed_index) {
+		seed_fd = g_open(seedslot->device, O_RDONLY | O_CLOEXEC, 0);
+		if (seed_fd < 0) {
+			g_message("Cannot use %s as seed: %s", seedslot->device, g_strerror(errno));
+			g_clear_pointer(&seed_index, r_casync_index_free);
+		} else {
+			g_debug("Using casync seed index of %s", seedslot->name);
+		}
+	} else {
+		g_message("No casync seed index available for %s", image->slotclass);
+	}
+
+	if (out_fd < 0) {
+		dest_fd = g_open(dest, O_WRONLY | O_CLOEXEC, 0);
+		if (dest_fd < 0) {
+			int err = errno;
+			g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+					"Failed to open %s: %s", dest, g_strerror(err));
+			return FALSE;
+		}
+		out_fd = dest_fd;
+	}
+
+	if (!r_casync_extract_blob(index, r_context()->install_info->mounted_bundle->storepath, seed_fd, seed_index, out_fd, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+#endif
+
+/* Prepares a seed for desync from the saved blob index of the seed slot.
+ * desync expects the seed data next to the index, with the same name minus
+ * the .caibx suffix, so both are linked into a temporary directory.
+ *
+ * Returns the path of the linked index, or NULL if no seed index is
+ * available. */
+static gchar *prepare_desync_seed_index(const RaucSlot *seedslot, gchar **seed_dir)
+{
+	g_autofree gchar *seed_index_path = NULL;
+	g_autofree gchar *dir = NULL;
+	g_autofree gchar *data_link = NULL;
+	g_autofree gchar *index_link = NULL;
+
+	seed_index_path = get_casync_seed_index(seedslot);
+	if (!seed_index_path)
+		return NULL;
+
+	dir = g_dir_make_tmp("rauc-desync-seed-XXXXXX", NULL);
+	if (!dir) {
+		g_message("Failed to create directory for desync seed index");
+		return NULL;
+	}
+
+	data_link = g_build_filename(dir, "seed", NULL);
+	index_link = g_build_filename(dir, "seed.caibx", NULL);
+	if (symlink(seedslot->device, data_link) != 0 ||
+	    symlink(seed_index_path, index_link) != 0) {
+		g_message("Failed to link desync seed index: %s", g_strerror(errno));
+		rm_tree(dir, NULL);
+		return NULL;
+	}
+
+	*seed_dir = g_steal_pointer(&dir);
+	return g_steal_pointer(&index_link);
+}
+
+static gboolean casync_extract_image(RaucImage *image, gchar *dest, int out_fd, const RaucSlot *dest_slot, GError **error)
 {
 	GError *ierror = NULL;
 	gboolean res = FALSE;
@@ -582,14 +1045,42 @@ static gboolean casync_extract_image(RaucImage *image, gchar *dest, int out_fd,
 	g_autofree gchar *seed = NULL;
 	gchar *store = NULL;
 	gchar *tmpdir = NULL;
+	g_autofree gchar *desync_seed_dir = NULL;
 	gboolean seed_mounted = FALSE;
 
 	g_assert_nonnull(r_context()->install_info);
 	g_assert_nonnull(r_context()->install_info->mounted_bundle);
 	g_assert_nonnull(r_context()->install_info->mounted_bundle->storepath);
 
+#if ENABLE_CASYNC_NATIVE == 1
+	/* the external tool is still used for directory tree archives and when
+	 * it was explicitly configured */
+	if (g_str_has_suffix(image->filename, ".caibx") &&
+	    !r_context()->config->use_desync && !r_context()->config->casync_install_args) {
+		if (casync_native_extract_image(image, dest, out_fd, &ierror)) {
+			if (dest_slot)
+				save_casync_seed_index(image, dest_slot);
+			return TRUE;
+		}
+		if (!g_error_matches(ierror, R_CASYNC_ERROR, R_CASYNC_ERROR_UNSUPPORTED)) {
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
+		g_message("%s, falling back to casync", ierror->message);
+		g_clear_error(&ierror);
+	}
+#endif
+
 	if (r_context()->config->use_desync) {
-		/* TODO: do something clever to locate and/or generate the seed index file */
+		/* desync cannot chunk a seed blob itself, but can use the index
+		 * saved by the previous update */
+		seedslot = get_active_slot_class_member(image->slotclass);
+		if (seedslot && g_str_has_suffix(image->filename, ".caibx"))
+			seed = prepare_desync_seed_index(seedslot, &desync_seed_dir);
+		if (seed)
+			g_debug("Adding as desync seed index: %s", seed);
+		else
+			g_message("No desync seed index available for %s", image->slotclass);
 		goto extract;
 	}
 
@@ -650,9 +1141,15 @@ extract:
 		goto unmount_out;
 	}
 
+	if (dest_slot && g_str_has_suffix(image->filename, ".caibx"))
+		save_casync_seed_index(image, dest_slot);
+
 	res = TRUE;
 
 unmount_out:
+	if (desync_seed_dir)
+		rm_tree(desync_seed_dir, NULL);
+
 	/* Cleanup seed */
 	if (seed_mounted) {
 		g_message("Unmounting seed slot %s", seedslot->device);
@@ -712,25 +1209,1019 @@ out:
 	return res;
 }
 
-static gboolean copy_block_hash_index_image_to_dev(RaucImage *image, RaucSlot *slot, GError **error)
-{
-	GError *ierror = NULL;
-	gboolean res = FALSE;
-	g_autoptr(RaucHashIndex) tmp = NULL;
-	g_autoptr(GPtrArray) sources = NULL;
-	const RaucSlot *seedslot = NULL;
-	const guint8(*chunk_hashes)[32];
-	guint32 chunk_count;
-	g_autofree RaucHashIndexChunk *chunk = NULL;
-	off_t offset = 0;
-	int target_fd = -1;
-	g_autoptr(RaucStats) zero_stats = NULL;
+/* number of chunks collected into a single write */
+#define CHUNK_WRITER_EXTENT_CHUNKS 256
+/* number of extent buffers (limits the amount of data queued for writing) */
+#define CHUNK_WRITER_BUFFERS 4
 
-	g_return_val_if_fail(image, FALSE);
-	g_return_val_if_fail(slot, FALSE);
-	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+typedef struct {
+	guint8 *data; /* CHUNK_WRITER_EXTENT_CHUNKS chunks */
+	guint32 first; /* number of the first chunk */
+	guint32 count; /* number of chunks */
+} ChunkWriterExtent;
 
-	zero_stats = r_stats_new("zero chunk");
+/**
+ * Writes chunks to the target in a separate thread.
+ *
+ * Consecutive chunks are collected into extents, which are then written by
+ * the writer thread while the next chunks are located and read. This overlaps
+ * reading and hashing with writing and replaces the individual 4 kiB writes
+ * with larger ones.
+ *
+ * On block devices, extents are also split at the boundaries of the preferred
+ * write size (such as the erase block size), so that a single extent doesn't
+ * partially rewrite two erase blocks.
+ */
+typedef struct {
+	int fd;
+	guint32 align_chunks; /* extents end at multiples of this, 0 if unaligned */
+	guint32 align_base; /* partition offset in chunks modulo align_chunks */
+	RaucVerityTree *verity; /* tree to add the written chunks to, or NULL */
+	GThread *thread;
+	GPtrArray *extents; /* all allocated extents */
+	GAsyncQueue *free_extents;
+	GAsyncQueue *queued_extents;
+	ChunkWriterExtent *current; /* extent being filled (main thread only) */
+	guint32 queued_end; /* end of the last queued extent (main thread only) */
+	gint completed_end; /* end of the last written extent (atomic) */
+	gint failed; /* set by the writer thread after setting error (atomic) */
+	GError *error; /* first error in the writer thread */
+	goffset written; /* bytes written by the writer thread */
+} ChunkWriter;
+
+/* sentinel to stop the writer thread */
+static ChunkWriterExtent chunk_writer_stop;
+
+static void chunk_writer_extent_free(ChunkWriterExtent *extent)
+{
+	if (!extent)
+		return;
+
+	g_free(extent->data);
+	g_free(extent);
+}
+
+/**
+ * Write an extent, skipping chunks which already contain the same data.
+ *
+ * This has the same effect as r_pwrite_lazy() for each chunk, but reads and
+ * writes larger ranges.
+ */
+static gboolean chunk_writer_write_extent(int fd, const ChunkWriterExtent *extent, guint8 *read_data, goffset *written, GError **error)
+{
+	const gsize chunk_size = R_HASH_INDEX_CHUNK_SIZE;
+	off_t offset = (off_t)extent->first * chunk_size;
+	GError *ierror = NULL;
+	guint32 start = 0;
+
+	if (!r_pread_exact(fd, read_data, extent->count * chunk_size, offset, &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Failed to read existing data: ");
+		return FALSE;
+	}
+
+	while (start < extent->count) {
+		guint32 end;
+
+		/* skip unchanged chunks */
+		if (memcmp(&extent->data[start * chunk_size], &read_data[start * chunk_size], chunk_size) == 0) {
+			start++;
+			continue;
+		}
+
+		/* collect changed chunks */
+		end = start + 1;
+		while (end < extent->count &&
+		       memcmp(&extent->data[end * chunk_size], &read_data[end * chunk_size], chunk_size) != 0)
+			end++;
+
+		R_TRACE2(chunk_write, extent->first + start, end - start);
+		if (!r_pwrite_exact(fd, &extent->data[start * chunk_size], (end - start) * chunk_size,
+				offset + (off_t)start * chunk_size, error))
+			return FALSE;
+		*written += (goffset)(end - start) * chunk_size;
+		r_copy_throttle((end - start) * chunk_size);
+
+		start = end;
+	}
+
+	return TRUE;
+}
+
+static gpointer chunk_writer_thread(gpointer data)
+{
+	ChunkWriter *writer = data;
+	g_autofree guint8 *read_data = g_malloc(CHUNK_WRITER_EXTENT_CHUNKS * R_HASH_INDEX_CHUNK_SIZE);
+
+	while (TRUE) {
+		ChunkWriterExtent *extent = g_async_queue_pop(writer->queued_extents);
+
+		if (extent == &chunk_writer_stop)
+			break;
+
+		/* after a failure, only return the buffers */
+		if (!g_atomic_int_get(&writer->failed)) {
+			if (!chunk_writer_write_extent(writer->fd, extent, read_data, &writer->written, &writer->error)) {
+				g_atomic_int_set(&writer->failed, TRUE);
+			} else if (writer->verity &&
+			           r_verity_tree_add(writer->verity, (guint64)extent->first * R_HASH_INDEX_CHUNK_SIZE,
+					   extent->data, (gsize)extent->count * R_HASH_INDEX_CHUNK_SIZE) != 0) {
+				g_set_error_literal(&writer->error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED,
+						"Failed to hash data for verity tree");
+				g_atomic_int_set(&writer->failed, TRUE);
+			} else {
+				g_atomic_int_set(&writer->completed_end, extent->first + extent->count);
+			}
+		}
+
+		g_async_queue_push(writer->free_extents, extent);
+	}
+
+	return NULL;
+}
+
+/**
+ * Determines where extents should be split from the topology of the target.
+ */
+static void chunk_writer_setup_alignment(ChunkWriter *writer)
+{
+	RaucBlockTopology topology;
+	g_autofree gchar *description = NULL;
+	guint32 write_chunks;
+
+	if (!r_block_topology_probe(writer->fd, &topology))
+		return;
+
+	description = r_block_topology_to_string(&topology);
+	g_message("Target topology: %s", description);
+
+	if (topology.offset % R_HASH_INDEX_CHUNK_SIZE || topology.write_size % R_HASH_INDEX_CHUNK_SIZE)
+		return;
+
+	write_chunks = topology.write_size / R_HASH_INDEX_CHUNK_SIZE;
+	if (write_chunks <= CHUNK_WRITER_EXTENT_CHUNKS)
+		writer->align_chunks = (CHUNK_WRITER_EXTENT_CHUNKS / write_chunks) * write_chunks;
+	else if (write_chunks % CHUNK_WRITER_EXTENT_CHUNKS == 0)
+		writer->align_chunks = CHUNK_WRITER_EXTENT_CHUNKS;
+	else
+		return;
+
+	writer->align_base = (topology.offset / R_HASH_INDEX_CHUNK_SIZE) % writer->align_chunks;
+}
+
+static ChunkWriter *chunk_writer_new(int fd, GError **error)
+{
+	GError *ierror = NULL;
+	ChunkWriter *writer = g_new0(ChunkWriter, 1);
+
+	writer->fd = fd;
+	chunk_writer_setup_alignment(writer);
+	/* the writer thread doesn't inherit the thread-local tree */
+	writer->verity = r_copy_get_verity_tree();
+	writer->extents = g_ptr_array_new_with_free_func((GDestroyNotify)chunk_writer_extent_free);
+	writer->free_extents = g_async_queue_new();
+	writer->queued_extents = g_async_queue_new();
+
+	for (guint i = 0; i < CHUNK_WRITER_BUFFERS; i++) {
+		ChunkWriterExtent *extent = g_new0(ChunkWriterExtent, 1);
+		extent->data = g_malloc(CHUNK_WRITER_EXTENT_CHUNKS * R_HASH_INDEX_CHUNK_SIZE);
+		g_ptr_array_add(writer->extents, extent);
+		g_async_queue_push(writer->free_extents, extent);
+	}
+
+	writer->thread = g_thread_try_new("chunk-writer", chunk_writer_thread, writer, &ierror);
+	if (!writer->thread) {
+		g_propagate_prefixed_error(error, ierror, "Failed to start writer thread: ");
+		g_ptr_array_unref(writer->extents);
+		g_async_queue_unref(writer->free_extents);
+		g_async_queue_unref(writer->queued_extents);
+		g_free(writer);
+		return NULL;
+	}
+
+	return writer;
+}
+
+/**
+ * Stops the writer thread after all queued extents have been processed.
+ */
+static void chunk_writer_stop_thread(ChunkWriter *writer)
+{
+	if (!writer->thread)
+		return;
+
+	g_async_queue_push(writer->queued_extents, &chunk_writer_stop);
+	g_thread_join(writer->thread);
+	writer->thread = NULL;
+	r_copy_count_written(writer->written);
+}
+
+static gboolean chunk_writer_check(ChunkWriter *writer, GError **error)
+{
+	if (g_atomic_int_get(&writer->failed)) {
+		g_set_error_literal(error, writer->error->domain, writer->error->code, writer->error->message);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void chunk_writer_queue_current(ChunkWriter *writer)
+{
+	if (!writer->current)
+		return;
+
+	writer->queued_end = writer->current->first + writer->current->count;
+	g_async_queue_push(writer->queued_extents, g_steal_pointer(&writer->current));
+}
+
+/**
+ * Add a chunk to be written at the given chunk number.
+ *
+ * The data is copied, so the buffer can be reused immediately.
+ */
+static gboolean chunk_writer_add(ChunkWriter *writer, guint32 number, const guint8 *data, GError **error)
+{
+	ChunkWriterExtent *extent = writer->current;
+
+	if (!chunk_writer_check(writer, error))
+		return FALSE;
+
+	if (extent && (extent->first + extent->count != number || extent->count == CHUNK_WRITER_EXTENT_CHUNKS ||
+	               (writer->align_chunks && ((guint64)writer->align_base + number) % writer->align_chunks == 0))) {
+		chunk_writer_queue_current(writer);
+		extent = NULL;
+	}
+
+	if (!extent) {
+		/* blocks if all buffers are queued */
+		extent = g_async_queue_pop(writer->free_extents);
+		extent->first = number;
+		extent->count = 0;
+		writer->current = extent;
+	}
+
+	memcpy(&extent->data[(gsize)extent->count * R_HASH_INDEX_CHUNK_SIZE], data, R_HASH_INDEX_CHUNK_SIZE);
+	extent->count++;
+
+	return TRUE;
+}
+
+/**
+ * Returns the number of the first chunk which may not have been written yet.
+ *
+ * @param writer ChunkWriter
+ * @param next number of the next chunk to be processed
+ */
+static guint32 chunk_writer_get_completed(ChunkWriter *writer, guint32 next)
+{
+	guint32 completed_end = g_atomic_int_get(&writer->completed_end);
+
+	/* if nothing is pending, all chunks before the next one are on the target */
+	if (!writer->current && completed_end == writer->queued_end)
+		return next;
+
+	return completed_end;
+}
+
+/**
+ * Waits until all chunks added so far have been written.
+ */
+static void chunk_writer_sync(ChunkWriter *writer)
+{
+	ChunkWriterExtent *extents[CHUNK_WRITER_BUFFERS];
+
+	chunk_writer_queue_current(writer);
+
+	/* each buffer is returned to the free queue once it was written */
+	for (guint i = 0; i < CHUNK_WRITER_BUFFERS; i++)
+		extents[i] = g_async_queue_pop(writer->free_extents);
+	for (guint i = 0; i < CHUNK_WRITER_BUFFERS; i++)
+		g_async_queue_push(writer->free_extents, extents[i]);
+}
+
+/**
+ * Writes all remaining chunks and stops the writer thread.
+ */
+static gboolean chunk_writer_finish(ChunkWriter *writer, GError **error)
+{
+	chunk_writer_queue_current(writer);
+	chunk_writer_stop_thread(writer);
+
+	return chunk_writer_check(writer, error);
+}
+
+static void chunk_writer_free(ChunkWriter *writer)
+{
+	if (!writer)
+		return;
+
+	/* the current extent is dropped, as we only get here without finish on errors */
+	if (writer->current)
+		g_async_queue_push(writer->free_extents, g_steal_pointer(&writer->current));
+	chunk_writer_stop_thread(writer);
+
+	g_ptr_array_unref(writer->extents);
+	g_async_queue_unref(writer->free_extents);
+	g_async_queue_unref(writer->queued_extents);
+	g_clear_error(&writer->error);
+	g_free(writer);
+}
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(ChunkWriter, chunk_writer_free);
+
+typedef enum {
+	ADAPTIVE_EXTENT_IN_PLACE,
+	ADAPTIVE_EXTENT_ZERO,
+	ADAPTIVE_EXTENT_COPY,
+} AdaptiveExtentType;
+
+/**
+ * A run of target chunks which are produced in the same way.
+ *
+ * For copies, the chunks are read from consecutive positions in one source.
+ */
+typedef struct {
+	AdaptiveExtentType type;
+	guint source; /* index in the sources array (copies only) */
+	guint32 first; /* first target chunk */
+	guint32 count; /* number of chunks */
+	guint32 number; /* first chunk in the source (copies only) */
+} AdaptiveExtent;
+
+/* amount of data (in chunks) to prefetch ahead of the copy position */
+#define ADAPTIVE_PREFETCH_CHUNKS 4096
+/* maximum size of a single prefetch request (in chunks) */
+#define ADAPTIVE_PREFETCH_REQUEST_CHUNKS 256
+/* number of concurrent prefetch requests */
+#define ADAPTIVE_PREFETCH_THREADS 4
+
+typedef struct {
+	int fd;
+	off_t offset;
+	off_t size;
+} AdaptivePrefetch;
+
+/**
+ * State for executing an adaptive update plan.
+ */
+typedef struct {
+	const GArray *plan;
+	GPtrArray *sources;
+	ChunkWriter *writer;
+	const guint8 (*chunk_hashes)[32];
+	guint32 chunk_count;
+	RaucHashIndexChunk *chunk; /* for single chunks */
+	guint8 *data; /* CHUNK_WRITER_EXTENT_CHUNKS chunks */
+	guint8 (*hashes)[32]; /* CHUNK_WRITER_EXTENT_CHUNKS hashes */
+	RaucStats *in_place_stats;
+	RaucStats *zero_stats;
+	RaucStats *zero_range_stats; /* bytes zeroed without writing data */
+	int target_fd;
+	RaucChunkPack *pack; /* compressed data of the source image (optional) */
+	gboolean zero_range_unsupported; /* set after the first failed attempt */
+
+	/* prefetching of data from the bundle and the active slot */
+	GThreadPool *prefetch_pool;
+	guint prefetch_extent; /* next extent to prefetch */
+	guint32 prefetch_pos; /* next chunk in that extent */
+	guint64 prefetched; /* chunks requested so far */
+	guint64 copied; /* prefetchable chunks copied so far */
+
+	gint64 last_progress; /* time of the last progress update */
+
+	/* progress recorded for resuming an interrupted write */
+	gchar *checkpoint_path; /* NULL if disabled */
+	guint32 checkpointed; /* chunks recorded in the last checkpoint */
+	guint32 resume_chunks; /* chunks written by an interrupted attempt */
+} AdaptiveCopy;
+
+/* interval (in chunks) for recording the progress of an adaptive write */
+#define ADAPTIVE_CHECKPOINT_CHUNKS 16384
+
+/**
+ * Returns the number of chunks recorded by an interrupted write of the same
+ * image to this slot, or 0 if there is none.
+ */
+static guint32 load_write_checkpoint(const gchar *path, guint32 chunk_count)
+{
+	g_autoptr(GKeyFile) key_file = g_key_file_new();
+	guint64 chunks;
+
+	if (!g_key_file_load_from_file(key_file, path, G_KEY_FILE_NONE, NULL))
+		return 0;
+
+	chunks = g_key_file_get_uint64(key_file, "checkpoint", "chunks", NULL);
+	if (g_key_file_get_uint64(key_file, "checkpoint", "chunk-size", NULL) != R_HASH_INDEX_CHUNK_SIZE)
+		return 0;
+
+	return MIN(chunks, chunk_count);
+}
+
+/**
+ * Records the number of chunks written so far.
+ *
+ * The target is not synced for this, as the chunks before the checkpoint are
+ * verified against the hash index before they are reused.
+ */
+static void save_write_checkpoint(AdaptiveCopy *copy, guint32 chunks)
+{
+	g_autoptr(GKeyFile) key_file = g_key_file_new();
+	g_autoptr(GError) ierror = NULL;
+
+	if (!copy->checkpoint_path || chunks <= copy->checkpointed)
+		return;
+
+	g_key_file_set_uint64(key_file, "checkpoint", "chunks", chunks);
+	g_key_file_set_uint64(key_file, "checkpoint", "chunk-size", R_HASH_INDEX_CHUNK_SIZE);
+
+	if (!g_key_file_save_to_file(key_file, copy->checkpoint_path, &ierror)) {
+		g_message("Disabling write checkpoints: %s", ierror->message);
+		g_clear_pointer(&copy->checkpoint_path, g_free);
+		return;
+	}
+
+	copy->checkpointed = chunks;
+}
+
+static void plan_add_chunk(GArray *plan, AdaptiveExtentType type, guint source, guint32 c, guint32 number)
+{
+	AdaptiveExtent extent = {
+		.type = type,
+		.source = source,
+		.first = c,
+		.count = 1,
+		.number = number,
+	};
+
+	if (plan->len) {
+		AdaptiveExtent *last = &g_array_index(plan, AdaptiveExtent, plan->len - 1);
+
+		if (last->type == type && last->first + last->count == c &&
+		    (type != ADAPTIVE_EXTENT_COPY ||
+		     (last->source == source && last->number + last->count == number))) {
+			last->count++;
+			return;
+		}
+	}
+
+	g_array_append_val(plan, extent);
+}
+
+/**
+ * Resolves all chunks of the new image to their sources before writing.
+ *
+ * This simulates the changing limits during the copy: When chunk c is
+ * written, the chunks before it may already be overwritten in the old target
+ * slot, but the ones written from the new image can be reused instead.
+ *
+ * Consecutive chunks which come from consecutive positions in the same
+ * source are collected into a single extent.
+ *
+ * The first resume_chunks chunks are expected to be in place already, as
+ * they were written by an interrupted attempt.
+ *
+ * @return GArray of AdaptiveExtent, NULL on error
+ */
+static GArray *plan_adaptive_copy(GPtrArray *sources, const guint8 (*chunk_hashes)[32], guint32 chunk_count, guint32 resume_chunks, GError **error)
+{
+	RaucHashIndex *target_written = g_ptr_array_index(sources, 0);
+	RaucHashIndex *target_old = g_ptr_array_index(sources, 1);
+	const guint8(*old_hashes)[32] = g_bytes_get_data(target_old->hashes, NULL);
+	g_autoptr(GArray) plan = g_array_new(FALSE, FALSE, sizeof(AdaptiveExtent));
+	g_autoptr(RaucHashIndexSet) set = NULL;
+	GError *ierror = NULL;
+
+	/* search all sources at once, falling back to one search per source */
+	set = r_hash_index_set_new(sources, &ierror);
+	if (!set) {
+		g_message("Searching hash indexes separately: %s", ierror->message);
+		g_clear_error(&ierror);
+	}
+
+	for (guint32 c = 0; c < chunk_count; c++) {
+		gboolean found = FALSE;
+		guint source;
+		guint32 number;
+
+		target_written->invalid_from = c;
+		target_old->invalid_below = c;
+
+		/* Chunks which are already in place are verified when executing
+		 * the plan. This includes the chunks written by an interrupted
+		 * attempt, which the old index does not know about. */
+		if (c < target_old->count && c < target_old->invalid_from &&
+		    (c < resume_chunks || memcmp(old_hashes[c], chunk_hashes[c], 32) == 0)) {
+			plan_add_chunk(plan, ADAPTIVE_EXTENT_IN_PLACE, 0, c, c);
+			continue;
+		}
+
+		if (memcmp(chunk_hashes[c], R_HASH_INDEX_ZERO_CHUNK, 32) == 0) {
+			plan_add_chunk(plan, ADAPTIVE_EXTENT_ZERO, 0, c, 0);
+			continue;
+		}
+
+		if (set) {
+			found = r_hash_index_set_find(set, chunk_hashes[c], &source, &number);
+		} else {
+			for (source = 0; source < sources->len; source++) {
+				if (r_hash_index_find_chunk(g_ptr_array_index(sources, source), chunk_hashes[c], &number, NULL)) {
+					found = TRUE;
+					break;
+				}
+			}
+		}
+
+		if (found) {
+			plan_add_chunk(plan, ADAPTIVE_EXTENT_COPY, source, c, number);
+		} else {
+			g_autofree gchar *hash = r_hex_encode(chunk_hashes[c], sizeof(chunk_hashes[c]));
+			g_set_error(error,
+					R_HASH_INDEX_ERROR,
+					R_HASH_INDEX_ERROR_NOT_FOUND,
+					"no chunk with required hash [%s] found", hash);
+			g_clear_pointer(&plan, g_array_unref);
+			break;
+		}
+	}
+
+	/* Restore the limits for the actual copy. */
+	target_written->invalid_from = 0;
+	target_old->invalid_below = 0;
+
+	return g_steal_pointer(&plan);
+}
+
+static void log_adaptive_plan(const GArray *plan, GPtrArray *sources, const RaucImage *image)
+{
+	g_autoptr(GString) summary = g_string_new(NULL);
+	g_autofree guint64 *copy_chunks = g_new0(guint64, sources->len);
+	guint64 in_place_chunks = 0;
+	guint64 zero_chunks = 0;
+
+	for (guint i = 0; i < plan->len; i++) {
+		const AdaptiveExtent *extent = &g_array_index(plan, AdaptiveExtent, i);
+
+		switch (extent->type) {
+			case ADAPTIVE_EXTENT_IN_PLACE:
+				in_place_chunks += extent->count;
+				break;
+			case ADAPTIVE_EXTENT_ZERO:
+				zero_chunks += extent->count;
+				break;
+			case ADAPTIVE_EXTENT_COPY:
+				copy_chunks[extent->source] += extent->count;
+				break;
+		}
+	}
+
+	g_string_append_printf(summary, "%"G_GUINT64_FORMAT " bytes in place, %"G_GUINT64_FORMAT " bytes zero",
+			in_place_chunks * R_HASH_INDEX_CHUNK_SIZE, zero_chunks * R_HASH_INDEX_CHUNK_SIZE);
+	for (guint s = 0; s < sources->len; s++) {
+		const RaucHashIndex *source = g_ptr_array_index(sources, s);
+		g_string_append_printf(summary, ", %"G_GUINT64_FORMAT " bytes from %s",
+				copy_chunks[s] * R_HASH_INDEX_CHUNK_SIZE, source->label);
+	}
+
+	g_message("Adaptive update plan for %s (%u extents): %s", image->filename, plan->len, summary->str);
+}
+
+static void adaptive_prefetch_worker(gpointer data, gpointer user_data)
+{
+	g_autofree AdaptivePrefetch *prefetch = data;
+
+	/* This populates the page cache, which may block until the data is
+	 * read, so it is done in separate threads. For streaming, this results
+	 * in larger and concurrent NBD (and HTTP) requests. */
+	(void)posix_fadvise(prefetch->fd, prefetch->offset, prefetch->size, POSIX_FADV_WILLNEED);
+}
+
+static gboolean adaptive_copy_is_prefetchable(const AdaptiveExtent *extent)
+{
+	/* Only prefetch from sources other than the target slot (which is
+	 * modified while copying). */
+	return extent->type == ADAPTIVE_EXTENT_COPY && extent->source >= 2;
+}
+
+/**
+ * Returns whether the data for an extent is read from the chunk pack instead
+ * of the uncompressed image in the bundle.
+ */
+static gboolean adaptive_copy_uses_pack(const AdaptiveCopy *copy, const AdaptiveExtent *extent)
+{
+	return copy->pack && extent->type == ADAPTIVE_EXTENT_COPY && extent->source == copy->sources->len - 1;
+}
+
+static void stop_prefetch_pool(GThreadPool *pool)
+{
+	/* drop pending requests, but wait for running ones */
+	g_thread_pool_free(pool, TRUE, TRUE);
+}
+
+/**
+ * Requests data for upcoming copies, so that it is already available when
+ * it is needed.
+ */
+static void adaptive_copy_prefetch(AdaptiveCopy *copy)
+{
+	if (!copy->prefetch_pool)
+		return;
+
+	while (copy->prefetch_extent < copy->plan->len &&
+	       copy->prefetched < copy->copied + ADAPTIVE_PREFETCH_CHUNKS) {
+		const AdaptiveExtent *extent = &g_array_index(copy->plan, AdaptiveExtent, copy->prefetch_extent);
+		const RaucHashIndex *source = NULL;
+		AdaptivePrefetch *prefetch = NULL;
+		guint32 n;
+
+		if (!adaptive_copy_is_prefetchable(extent) || copy->prefetch_pos >= extent->count) {
+			copy->prefetch_extent++;
+			copy->prefetch_pos = 0;
+			continue;
+		}
+
+		source = g_ptr_array_index(copy->sources, extent->source);
+		n = MIN(extent->count - copy->prefetch_pos, ADAPTIVE_PREFETCH_REQUEST_CHUNKS);
+
+		prefetch = g_new0(AdaptivePrefetch, 1);
+		prefetch->fd = source->data_fd;
+		prefetch->offset = (off_t)(extent->number + copy->prefetch_pos) * R_HASH_INDEX_CHUNK_SIZE;
+		prefetch->size = (off_t)n * R_HASH_INDEX_CHUNK_SIZE;
+#if ENABLE_CASYNC_NATIVE == 1
+		if (adaptive_copy_uses_pack(copy, extent)) {
+			prefetch->fd = copy->pack->fd;
+			r_chunk_pack_get_range(copy->pack, extent->number + copy->prefetch_pos, n,
+					&prefetch->offset, &prefetch->size);
+		}
+#endif
+		if (!g_thread_pool_push(copy->prefetch_pool, prefetch, NULL))
+			g_free(prefetch);
+
+		copy->prefetch_pos += n;
+		copy->prefetched += n;
+	}
+}
+
+static void adaptive_copy_progress(AdaptiveCopy *copy, guint32 end)
+{
+	r_copy_image_progress(&copy->last_progress, (goffset)end * R_HASH_INDEX_CHUNK_SIZE,
+			(goffset)copy->chunk_count * R_HASH_INDEX_CHUNK_SIZE);
+
+	if (end >= copy->checkpointed + ADAPTIVE_CHECKPOINT_CHUNKS)
+		save_write_checkpoint(copy, chunk_writer_get_completed(copy->writer, end));
+}
+
+/**
+ * Locates and queues a single chunk, using the limits for its position.
+ *
+ * This is used when the data for a planned extent turns out to be
+ * unavailable (for example, if a stored index was outdated).
+ */
+static gboolean adaptive_copy_chunk(AdaptiveCopy *copy, guint32 c, GError **error)
+{
+	RaucHashIndex *target_written = g_ptr_array_index(copy->sources, 0);
+	RaucHashIndex *target_old = g_ptr_array_index(copy->sources, 1);
+	const guint8 *hash = copy->chunk_hashes[c];
+	g_autofree gchar *hex = NULL;
+
+	if (memcmp(hash, R_HASH_INDEX_ZERO_CHUNK, 32) == 0) {
+		memset(copy->chunk->data, 0, sizeof(copy->chunk->data));
+		r_stats_add(copy->zero_stats, 1);
+		return chunk_writer_add(copy->writer, c, copy->chunk->data, error);
+	}
+
+	/* Written chunks can only be reused from the target after the writer
+	 * thread has completed them. */
+	target_written->invalid_from = chunk_writer_get_completed(copy->writer, c);
+	target_old->invalid_below = c;
+
+	for (guint s = 0; s < copy->sources->len; s++) {
+		const RaucHashIndex *source = g_ptr_array_index(copy->sources, s);
+
+		if (r_hash_index_get_chunk(source, hash, copy->chunk, NULL))
+			return chunk_writer_add(copy->writer, c, copy->chunk->data, error);
+	}
+
+	hex = r_hex_encode(hash, 32);
+	g_set_error(error,
+			R_HASH_INDEX_ERROR,
+			R_HASH_INDEX_ERROR_NOT_FOUND,
+			"no chunk with required hash [%s] found", hex);
+	return FALSE;
+}
+
+/**
+ * Counts the consecutive chunks written by an interrupted attempt which are
+ * in place. The index of the target doesn't know about these chunks, so the
+ * data is always verified.
+ */
+static guint32 adaptive_copy_count_resumed(AdaptiveCopy *copy, guint32 c, guint32 count)
+{
+	g_autofree guint8 *data = NULL;
+	guint8 hashes[R_HASH_INDEX_CHECK_BLOCK_CHUNKS][32];
+	guint32 n;
+
+	if (c >= copy->resume_chunks)
+		return 0;
+
+	n = MIN(MIN(count, copy->resume_chunks - c), R_HASH_INDEX_CHECK_BLOCK_CHUNKS);
+	data = g_malloc((gsize)n * R_HASH_INDEX_CHUNK_SIZE);
+	if (!r_pread_exact(copy->target_fd, data, (gsize)n * R_HASH_INDEX_CHUNK_SIZE,
+			(off_t)c * R_HASH_INDEX_CHUNK_SIZE, NULL))
+		return 0;
+
+	r_hash_index_hash_chunks(data, n, &hashes[0][0]);
+	for (guint32 i = 0; i < n; i++) {
+		if (memcmp(hashes[i], copy->chunk_hashes[c + i], 32) != 0)
+			return i;
+	}
+
+	return n;
+}
+
+/**
+ * Skips the chunks of an extent which are in place and copies the others.
+ *
+ * Unchanged regions are verified in blocks of R_HASH_INDEX_CHECK_BLOCK_CHUNKS
+ * chunks, so only the blocks containing changes are handled per chunk.
+ */
+static gboolean adaptive_copy_in_place(AdaptiveCopy *copy, const AdaptiveExtent *extent, GError **error)
+{
+	RaucHashIndex *target_old = g_ptr_array_index(copy->sources, 1);
+	guint32 end = extent->first + extent->count;
+	guint32 c = extent->first;
+
+	while (c < end) {
+		guint32 count = MIN(end - c, R_HASH_INDEX_CHECK_BLOCK_CHUNKS);
+		guint32 n;
+
+		target_old->invalid_below = c;
+
+		n = adaptive_copy_count_resumed(copy, c, count);
+		if (!n)
+			n = r_hash_index_count_chunks_at(target_old, c, count, &copy->chunk_hashes[c], NULL);
+
+		if (n) {
+			for (guint32 i = 0; i < n; i++)
+				r_stats_add(copy->in_place_stats, 1);
+			c += n;
+		} else {
+			if (!adaptive_copy_chunk(copy, c, error))
+				return FALSE;
+			c++;
+		}
+
+		adaptive_copy_progress(copy, c);
+	}
+
+	return TRUE;
+}
+
+static gboolean adaptive_copy_zero(AdaptiveCopy *copy, const AdaptiveExtent *extent, GError **error)
+{
+	GError *ierror = NULL;
+	const off_t chunk_size = R_HASH_INDEX_CHUNK_SIZE;
+
+	/* Zero the whole run at once if the target supports it. The writer
+	 * thread only accesses other chunks, so no synchronization is needed. */
+	if (!copy->zero_range_unsupported) {
+		if (r_zero_range(copy->target_fd, (off_t)extent->first * chunk_size,
+				(off_t)extent->count * chunk_size, &ierror)) {
+			for (guint32 i = 0; i < extent->count; i++)
+				r_stats_add(copy->zero_stats, 1);
+			r_stats_add(copy->zero_range_stats, (gdouble)extent->count * chunk_size);
+
+			adaptive_copy_progress(copy, extent->first + extent->count);
+			return TRUE;
+		}
+
+		if (!g_error_matches(ierror, R_UTILS_ERROR, R_UTILS_ERROR_NOT_SUPPORTED)) {
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
+
+		g_debug("Writing zero chunks instead: %s", ierror->message);
+		g_clear_error(&ierror);
+		copy->zero_range_unsupported = TRUE;
+	}
+
+	memset(copy->chunk->data, 0, sizeof(copy->chunk->data));
+
+	for (guint32 c = extent->first; c < extent->first + extent->count; c++) {
+		if (!chunk_writer_add(copy->writer, c, copy->chunk->data, error))
+			return FALSE;
+		r_stats_add(copy->zero_stats, 1);
+
+		adaptive_copy_progress(copy, c + 1);
+	}
+
+	return TRUE;
+}
+
+/**
+ * Copies an extent from a source with large reads and verifies the data.
+ *
+ * Chunks which don't match (or can't be read) are located individually.
+ */
+static gboolean adaptive_copy_extent(AdaptiveCopy *copy, const AdaptiveExtent *extent, GError **error)
+{
+	const RaucHashIndex *source = g_ptr_array_index(copy->sources, extent->source);
+	const gsize chunk_size = R_HASH_INDEX_CHUNK_SIZE;
+	guint32 pos = 0;
+
+	while (pos < extent->count) {
+		GError *ierror = NULL;
+		guint32 src = extent->number + pos;
+		guint32 n = MIN(extent->count - pos, CHUNK_WRITER_EXTENT_CHUNKS);
+		gboolean data_valid = TRUE;
+		/* the pack is not covered by the index, so its data is always checked */
+		gboolean check_hashes = !source->skip_hash_check || adaptive_copy_uses_pack(copy, extent);
+
+		if (extent->source == 0) {
+			/* Chunks reused from the target must be written
+			 * before they are read, which may not be the case
+			 * for ranges overlapping the current extent. */
+			n = MIN(n, extent->first - extent->number);
+			if (chunk_writer_get_completed(copy->writer, extent->first + pos) < src + n)
+				chunk_writer_sync(copy->writer);
+		}
+
+		if (adaptive_copy_is_prefetchable(extent)) {
+			copy->copied += n;
+			adaptive_copy_prefetch(copy);
+		}
+
+		if (adaptive_copy_uses_pack(copy, extent)) {
+#if ENABLE_CASYNC_NATIVE == 1
+			if (!r_chunk_pack_read(copy->pack, src, n, copy->data, &ierror)) {
+				g_debug("Failed to read %"G_GUINT32_FORMAT " chunks at %"G_GUINT32_FORMAT " from chunk pack: %s",
+						n, src, ierror->message);
+				g_clear_error(&ierror);
+				data_valid = FALSE;
+			}
+#else
+			g_assert_not_reached();
+#endif
+		} else if (!r_pread_exact(source->data_fd, copy->data, n * chunk_size, (off_t)src * chunk_size, &ierror)) {
+			g_debug("Failed to read %"G_GUINT32_FORMAT " chunks at %"G_GUINT32_FORMAT " from %s: %s",
+					n, src, source->label, ierror ? ierror->message : "unexpected end of data");
+			g_clear_error(&ierror);
+			data_valid = FALSE;
+		}
+
+		if (data_valid && check_hashes)
+			r_hash_index_hash_chunks(copy->data, n, &copy->hashes[0][0]);
+
+		for (guint32 i = 0; i < n; i++) {
+			guint32 c = extent->first + pos + i;
+
+			if (!data_valid ||
+			    (check_hashes && memcmp(copy->hashes[i], copy->chunk_hashes[c], 32) != 0)) {
+				if (!adaptive_copy_chunk(copy, c, error))
+					return FALSE;
+				continue;
+			}
+
+			if (!chunk_writer_add(copy->writer, c, &copy->data[i * chunk_size], error))
+				return FALSE;
+		}
+
+		pos += n;
+		adaptive_copy_progress(copy, extent->first + pos);
+	}
+
+	return TRUE;
+}
+
+/* number of chunks checked before trusting the index of a verity-protected seed slot */
+#define VERITY_SEED_SAMPLES 64
+
+/**
+ * Reads the seed slot through its dm-verity device, if it has one.
+ *
+ * The kernel authenticates all data read from the verity device, so the
+ * chunks don't need to be hashed again in user space. As the stored index
+ * could still be outdated, a sample of chunks spread over the slot is checked
+ * against it first.
+ *
+ * Only the range covered by the verity device is used as seed.
+ */
+static void use_verity_for_seed(RaucHashIndex *idx, const RaucSlot *slot)
+{
+	g_autoptr(GError) ierror = NULL;
+	g_autofree gchar *verity_dev = NULL;
+	const guint8 (*hashes)[32] = NULL;
+	guint64 data_size = 0;
+	guint32 count;
+	int fd;
+
+	verity_dev = r_dm_find_verity_device(slot->device, &data_size, &ierror);
+	if (!verity_dev) {
+		if (ierror)
+			g_debug("Failed to check for dm-verity on %s: %s", slot->device, ierror->message);
+		return;
+	}
+
+	count = MIN(idx->count, data_size / R_HASH_INDEX_CHUNK_SIZE);
+	if (!count)
+		return;
+
+	hashes = g_bytes_get_data(idx->hashes, NULL);
+	for (guint i = 0; i < VERITY_SEED_SAMPLES; i++) {
+		guint32 c = (guint64)i * count / VERITY_SEED_SAMPLES;
+
+		if (!r_hash_index_has_chunk_at(idx, c, hashes[c], &ierror)) {
+			g_message("Not skipping hash check for seed slot %s: chunk %"G_GUINT32_FORMAT ": %s",
+					slot->name, c, ierror ? ierror->message : "unexpected end of data");
+			return;
+		}
+	}
+
+	fd = g_open(verity_dev, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		g_message("Failed to open dm-verity device %s: %s", verity_dev, g_strerror(errno));
+		return;
+	}
+
+	g_close(idx->data_fd, NULL);
+	idx->data_fd = fd;
+	idx->invalid_from = count;
+	idx->skip_hash_check = TRUE;
+
+	g_message("Reading seed slot %s through dm-verity device %s without hash check", slot->name, verity_dev);
+}
+
+/**
+ * Opens the hash index of the source image.
+ *
+ * When streaming a bundle with a block-hash-prefix file, only the full hashes
+ * of chunks which may be found in the local candidates are loaded. Delta
+ * images are always checked against the full index, so they need all hashes.
+ */
+static RaucHashIndex *open_source_image_index(const RaucImage *image, const GPtrArray *candidates, GError **error)
+{
+	GError *ierror = NULL;
+	const RaucBundle *bundle = r_context()->install_info->mounted_bundle;
+	g_autofree gchar *prefix_filename = NULL;
+	g_autofree gchar *index_filename = NULL;
+	g_auto(filedesc) data_fd = -1;
+	RaucHashIndex *idx = NULL;
+
+	if (!bundle || !bundle->nbd_dev || image->delta_base ||
+	    !g_strv_contains((const gchar * const *)image->adaptive, "block-hash-prefix"))
+		return r_hash_index_open_image("source_image", image, error);
+
+	data_fd = g_open(image->filename, O_RDONLY | O_CLOEXEC);
+	if (data_fd < 0) {
+		int err = errno;
+		g_set_error(error,
+				G_FILE_ERROR,
+				g_file_error_from_errno(err),
+				"Failed to open image file %s: %s", image->filename, g_strerror(err));
+		return NULL;
+	}
+
+	prefix_filename = g_strdup_printf("%s.block-hash-prefix", image->filename);
+	index_filename = g_strdup_printf("%s.block-hash-index", image->filename);
+
+	idx = r_hash_index_open_prefixes("source_image", data_fd, prefix_filename, index_filename, candidates, &ierror);
+	if (!idx) {
+		g_message("Loading full hash index for %s: %s", image->filename, ierror->message);
+		g_clear_error(&ierror);
+		return r_hash_index_open_image("source_image", image, error);
+	}
+
+	return idx;
+}
+
+static gboolean copy_block_hash_index_image_to_dev(RaucImage *image, RaucSlot *slot, GError **error)
+{
+	GError *ierror = NULL;
+	gboolean res = FALSE;
+	g_autoptr(RaucHashIndex) tmp = NULL;
+	g_autoptr(GPtrArray) sources = NULL;
+	g_autoptr(ChunkWriter) writer = NULL;
+	const RaucSlot *seedslot = NULL;
+	const guint8(*chunk_hashes)[32];
+	guint32 chunk_count;
+	g_autofree RaucHashIndexChunk *chunk = NULL;
+	g_autofree guint8 *extent_data = NULL;
+	g_autofree guint8 (*extent_hashes)[32] = NULL;
+	g_autoptr(GArray) plan = NULL;
+	AdaptiveCopy copy = {0};
+	off_t offset = 0;
+	int target_fd = -1;
+	g_autoptr(RaucStats) in_place_stats = NULL;
+	g_autoptr(RaucStats) zero_stats = NULL;
+	g_autoptr(RaucStats) zero_range_stats = NULL;
+	RaucChunkPack *pack = NULL;
+	guint32 resume_chunks = 0;
+
+	g_return_val_if_fail(image, FALSE);
+	g_return_val_if_fail(slot, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	zero_stats = r_stats_new("zero chunk");
+	zero_range_stats = r_stats_new("zeroed bytes");
+	in_place_stats = r_stats_new("in-place chunk");
 
 	sources = g_ptr_array_new_with_free_func((GDestroyNotify)r_hash_index_free);
 
@@ -754,27 +2245,51 @@ static gboolean copy_block_hash_index_image_to_dev(RaucImage *image, RaucSlot *s
 	seedslot = get_active_slot_class_member(image->slotclass);
 	if (seedslot) {
 		tmp = r_hash_index_open_slot("active_slot", seedslot, O_RDONLY, &ierror);
-		if (!tmp) {
+		if (tmp) {
+			use_verity_for_seed(tmp, seedslot);
+			g_ptr_array_add(sources, g_steal_pointer(&tmp));
+		} else if (g_error_matches(ierror, R_HASH_INDEX_ERROR, R_HASH_INDEX_ERROR_MEMORY)) {
+			/* the active slot is optional, so continue with less memory */
+			g_message("Not using active slot %s as seed: %s", seedslot->name, ierror->message);
+			g_clear_error(&ierror);
+		} else {
 			g_propagate_prefixed_error(error, ierror, "failed to open active slot hash index for %s: ", seedslot->name);
 			res = FALSE;
 			goto out;
 		}
-		g_ptr_array_add(sources, g_steal_pointer(&tmp));
 	} else {
 		g_message("No active slot available to use as seed for %s", image->slotclass);
 	}
 
 	/* Open and append source image. */
-	tmp = r_hash_index_open_image("source_image", image, &ierror);
+	tmp = open_source_image_index(image, sources, &ierror);
 	if (!tmp) {
 		g_propagate_prefixed_error(error, ierror, "failed to open source image hash index for %s: ", image->filename);
 		res = FALSE;
 		goto out;
 	}
-	/* The bundle data is read-only and authenticated. */
-	tmp->skip_hash_check = TRUE;
+	/* The bundle data is read-only and authenticated. Delta images contain
+	 * holes instead of the chunks from the base image, so they must be
+	 * checked. */
+	tmp->skip_hash_check = !image->delta_base;
 	g_ptr_array_add(sources, g_steal_pointer(&tmp));
 
+#if ENABLE_CASYNC_NATIVE == 1
+	/* Missing chunks are read from the compressed pack if available. */
+	if (g_strv_contains((const gchar * const *)image->adaptive, "chunk-pack")) {
+		const RaucHashIndex *source = g_ptr_array_index(sources, sources->len - 1);
+
+		pack = r_chunk_pack_open_image(image, &ierror);
+		if (!pack) {
+			g_message("Reading uncompressed image data: %s", ierror->message);
+			g_clear_error(&ierror);
+		} else if (pack->chunk_count != source->count) {
+			g_message("Reading uncompressed image data: chunk pack does not match %s", image->filename);
+			g_clear_pointer(&pack, r_chunk_pack_free);
+		}
+	}
+#endif
+
 	/* Open source index and target fd for lower range (reuse written chunks). */
 	tmp = r_hash_index_reuse("target_slot_written",
 			g_ptr_array_index(sources, sources->len - 1),
@@ -819,67 +2334,86 @@ static gboolean copy_block_hash_index_image_to_dev(RaucImage *image, RaucSlot *s
 
 	/* Temporary data storage */
 	chunk = g_new0(RaucHashIndexChunk, 1);
+	extent_data = g_malloc(CHUNK_WRITER_EXTENT_CHUNKS * R_HASH_INDEX_CHUNK_SIZE);
+	extent_hashes = g_malloc(CHUNK_WRITER_EXTENT_CHUNKS * sizeof(*extent_hashes));
 
-	/* Iterate over chunks in source image */
-	for (guint32 c = 0; c < chunk_count; c++) {
-		gboolean found = FALSE;
+	writer = chunk_writer_new(target_fd, &ierror);
+	if (!writer) {
+		g_propagate_error(error, ierror);
+		res = FALSE;
+		goto out;
+	}
 
-		if (memcmp(chunk_hashes[c], R_HASH_INDEX_ZERO_CHUNK, 32) == 0) {
-			/* Generate zero chunk */
-			memset(chunk->data, 0, sizeof(chunk->data));
-			found = TRUE;
-			r_stats_add(zero_stats, 1);
-		} else {
-			/* Iterate over indices and call get chunk */
-			for (guint s = 0; s < sources->len; s++) {
-				const RaucHashIndex *source = g_ptr_array_index(sources, s);
-				if (r_hash_index_get_chunk(source, chunk_hashes[c], chunk, &ierror)) {
-					//g_autofree gchar *hash = r_hex_encode(chunk_hashes[c], sizeof(chunk_hashes[c]));
-					//g_debug("found chunk %"G_GUINT32_FORMAT" [%s] in index %u [%s]", c, hash, s, source->label);
-					found = TRUE;
-					break;
-				} else {
-					//g_autofree gchar *hash = r_hex_encode(chunk_hashes[c], sizeof(chunk_hashes[c]));
-					//g_debug("no chunk %"G_GUINT32_FORMAT" [%s] in index %u [%s]: %s", c, hash, s, source->label, ierror->message);
-					g_clear_error(&ierror);
-				}
-			}
+	/* Continue after the part written by an interrupted attempt. */
+	{
+		g_autofree gchar *dir = r_slot_get_checksum_data_directory(slot, &image->checksum, &ierror);
+
+		if (dir) {
+			copy.checkpoint_path = g_build_filename(dir, "write-checkpoint", NULL);
+			resume_chunks = load_write_checkpoint(copy.checkpoint_path, chunk_count);
+			copy.checkpointed = resume_chunks;
+			copy.resume_chunks = resume_chunks;
+			if (resume_chunks)
+				g_message("Resuming interrupted write of %s after %"G_GUINT64_FORMAT " bytes (verifying written data)",
+						image->filename, (guint64)resume_chunks * R_HASH_INDEX_CHUNK_SIZE);
+		} else if (ierror) {
+			g_message("Not recording write checkpoints: %s", ierror->message);
+			g_clear_error(&ierror);
 		}
+	}
 
-		if (!found) {
-			g_autofree gchar *hash = r_hex_encode(chunk_hashes[c], sizeof(chunk_hashes[c]));
-			g_set_error(error,
-					R_HASH_INDEX_ERROR,
-					R_HASH_INDEX_ERROR_NOT_FOUND,
-					"no chunk with required hash [%s] found", hash);
-			res = FALSE;
-			goto out;
+	/* Resolve all chunks first, so that they can be copied in larger extents */
+	plan = plan_adaptive_copy(sources, chunk_hashes, chunk_count, resume_chunks, &ierror);
+	if (!plan) {
+		g_propagate_error(error, ierror);
+		res = FALSE;
+		goto out;
+	}
+	log_adaptive_plan(plan, sources, image);
+
+	copy.plan = plan;
+	copy.sources = sources;
+	copy.writer = writer;
+	copy.chunk_hashes = chunk_hashes;
+	copy.chunk_count = chunk_count;
+	copy.chunk = chunk;
+	copy.data = extent_data;
+	copy.hashes = extent_hashes;
+	copy.in_place_stats = in_place_stats;
+	copy.zero_stats = zero_stats;
+	copy.zero_range_stats = zero_range_stats;
+	copy.target_fd = target_fd;
+	copy.pack = pack;
+	/* prefetching is only an optimization, so continue without it on errors */
+	copy.prefetch_pool = g_thread_pool_new(adaptive_prefetch_worker, NULL, ADAPTIVE_PREFETCH_THREADS, FALSE, NULL);
+	adaptive_copy_prefetch(&copy);
+
+	for (guint i = 0; i < plan->len; i++) {
+		const AdaptiveExtent *extent = &g_array_index(plan, AdaptiveExtent, i);
+
+		switch (extent->type) {
+			case ADAPTIVE_EXTENT_IN_PLACE:
+				res = adaptive_copy_in_place(&copy, extent, &ierror);
+				break;
+			case ADAPTIVE_EXTENT_ZERO:
+				res = adaptive_copy_zero(&copy, extent, &ierror);
+				break;
+			case ADAPTIVE_EXTENT_COPY:
+				res = adaptive_copy_extent(&copy, extent, &ierror);
+				break;
 		}
-
-		/* Write chunk to target
-		 *
-		 * We could potentially avoid a chunk write if  r_hash_index_get_chunk
-		 * would report where the chunk was found. If it was found on the target
-		 * in the correct location, we could skip the write.
-		 */
-		offset = (off_t)c * sizeof(chunk->data);
-		if (!r_pwrite_lazy(target_fd, chunk->data, sizeof(chunk->data), offset, &ierror)) {
+		if (!res) {
 			g_propagate_error(error, ierror);
-			res = FALSE;
 			goto out;
 		}
+	}
 
-		/* Update limits */
-		{
-			RaucHashIndex *target_written = g_ptr_array_index(sources, 0);
-			RaucHashIndex *target_old = g_ptr_array_index(sources, 1);
-			target_written->invalid_from = c+1;
-			target_old->invalid_below = c;
-		}
-
-		/* emit progress info (but only when in progress context) */
-		if (r_context()->progress)
-			r_context_set_step_percentage("copy_image", (c + 1) * 100 / chunk_count);
+	/* Wait until all chunks are written */
+	g_clear_pointer(&copy.prefetch_pool, stop_prefetch_pool);
+	if (!chunk_writer_finish(writer, &ierror)) {
+		g_propagate_error(error, ierror);
+		res = FALSE;
+		goto out;
 	}
 
 	/* Seek after the written data so this behaves similar to the simpler write helpers */
@@ -891,21 +2425,29 @@ static gboolean copy_block_hash_index_image_to_dev(RaucImage *image, RaucSlot *s
 	}
 
 	/* Flush to block device before closing to assure content is written to disk */
-	if (fsync(target_fd) == -1) {
+	if (timed_fsync(target_fd) == -1) {
 		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED, "Syncing content to slot failed: %s", strerror(errno));
 		res = FALSE;
 		goto out;
 	}
 
+	if (copy.checkpoint_path)
+		g_unlink(copy.checkpoint_path);
+	g_clear_pointer(&copy.checkpoint_path, g_free);
+
 	/* Write new index to slot data dir. */
 	{
 		const RaucHashIndex *source = g_ptr_array_index(sources, sources->len-1);
-		if (!r_hash_index_export_slot(source, slot, &image->checksum, &ierror)) {
+		if (source->hashes_incomplete) {
+			g_message("Not storing hash index for slot %s, as only part of the image index was loaded", slot->name);
+		} else if (!r_hash_index_export_slot(source, slot, &image->checksum, &ierror)) {
 			g_warning("Continuing after failure to write new hash index: %s", ierror->message);
 		}
 	}
 
+	r_stats_show(in_place_stats, "access stats for");
 	r_stats_show(zero_stats, "access stats for");
+	r_stats_show(zero_range_stats, "access stats for");
 	for (guint s = 0; s < sources->len; s++) {
 		const RaucHashIndex *source = g_ptr_array_index(sources, s);
 		r_stats_show(source->match_stats, "access stats for");
@@ -914,10 +2456,165 @@ static gboolean copy_block_hash_index_image_to_dev(RaucImage *image, RaucSlot *s
 	res = TRUE;
 
 out:
+	/* The prefetch threads must be stopped before closing the sources. */
+	g_clear_pointer(&copy.prefetch_pool, stop_prefetch_pool);
+	/* record the progress for a retry after errors (for example network
+	 * failures while streaming) */
+	if (copy.checkpoint_path && copy.writer)
+		save_write_checkpoint(&copy, chunk_writer_get_completed(copy.writer, copy.writer->queued_end));
+	g_free(copy.checkpoint_path);
+#if ENABLE_CASYNC_NATIVE == 1
+	g_clear_pointer(&pack, r_chunk_pack_free);
+#endif
 	/* We let the hash index close the file and use dup for the target slot, to simplify cleanup */
 	return res;
 }
 
+/**
+ * Writes an image using its content-defined chunk index.
+ *
+ * The chunks are written in order. Each one is looked up in the old content
+ * of the target slot (in place or in the part not overwritten yet), in the
+ * active slot and finally in the image in the bundle.
+ */
+static gboolean copy_cdc_hash_index_image_to_dev(RaucImage *image, RaucSlot *slot, GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(RaucCdcIndex) tmp = NULL;
+	g_autoptr(GPtrArray) sources = NULL;
+	const RaucSlot *seedslot = NULL;
+	RaucCdcIndex *target_old = NULL;
+	const RaucCdcIndex *image_idx = NULL;
+	g_autofree guint8 *data = NULL;
+	g_autoptr(RaucStats) in_place_stats = NULL;
+	gint64 last_progress = 0;
+	guint64 image_size = 0;
+	off_t offset = 0;
+
+	g_return_val_if_fail(image, FALSE);
+	g_return_val_if_fail(slot, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	in_place_stats = r_stats_new("in-place chunk");
+
+	sources = g_ptr_array_new_with_free_func((GDestroyNotify)r_cdc_index_free);
+
+	/* Compared to open_slot_device, we need O_RDWR. */
+	tmp = r_cdc_index_open_slot("target_slot", slot, O_RDWR | O_EXCL, &ierror);
+	if (!tmp) {
+		g_propagate_prefixed_error(error, ierror, "failed to open target slot chunk index for %s: ", slot->name);
+		return FALSE;
+	}
+	if (!check_image_size(tmp->data_fd, slot, image, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+	g_ptr_array_add(sources, g_steal_pointer(&tmp));
+
+	seedslot = get_active_slot_class_member(image->slotclass);
+	if (seedslot) {
+		tmp = r_cdc_index_open_slot("active_slot", seedslot, O_RDONLY, &ierror);
+		if (!tmp) {
+			g_propagate_prefixed_error(error, ierror, "failed to open active slot chunk index for %s: ", seedslot->name);
+			return FALSE;
+		}
+		g_ptr_array_add(sources, g_steal_pointer(&tmp));
+	} else {
+		g_message("No active slot available to use as seed for %s", image->slotclass);
+	}
+
+	tmp = r_cdc_index_open_image("source_image", image, &ierror);
+	if (!tmp) {
+		g_propagate_prefixed_error(error, ierror, "failed to open source image chunk index for %s: ", image->filename);
+		return FALSE;
+	}
+	/* The bundle data is read-only and authenticated. */
+	tmp->skip_hash_check = TRUE;
+	g_ptr_array_add(sources, g_steal_pointer(&tmp));
+
+	/* Now we have a GPtrArray of RaucCdcIndices:
+	 *
+	 * 0: target slot with corresponding old index
+	 * 1: active slot with corresponding index (optional)
+	 * len-1: source image with corresponding index
+	 */
+	target_old = g_ptr_array_index(sources, 0);
+	image_idx = g_ptr_array_index(sources, sources->len - 1);
+	if (image_idx->chunks->len) {
+		const RaucCdcChunk *last = &g_array_index(image_idx->chunks, RaucCdcChunk, image_idx->chunks->len - 1);
+		image_size = last->offset + last->size;
+	}
+
+	data = g_malloc(R_CDC_INDEX_MAX_SIZE);
+
+	for (guint i = 0; i < image_idx->chunks->len; i++) {
+		const RaucCdcChunk *chunk = &g_array_index(image_idx->chunks, RaucCdcChunk, i);
+		gboolean found = FALSE;
+
+		/* Everything before this chunk was overwritten already. */
+		target_old->invalid_below = chunk->offset;
+
+		if (r_cdc_index_has_chunk_at(target_old, chunk, data)) {
+			r_stats_add(in_place_stats, 1);
+			r_copy_image_progress(&last_progress, chunk->offset + chunk->size, image_size);
+			continue;
+		}
+		r_stats_add(in_place_stats, 0);
+
+		for (guint s = 0; s < sources->len; s++) {
+			if (r_cdc_index_get_chunk(g_ptr_array_index(sources, s), chunk->hash, chunk->size, data, NULL)) {
+				found = TRUE;
+				break;
+			}
+		}
+
+		if (!found) {
+			g_autofree gchar *hash = r_hex_encode(chunk->hash, sizeof(chunk->hash));
+			g_set_error(error,
+					R_CDC_INDEX_ERROR,
+					R_CDC_INDEX_ERROR_NOT_FOUND,
+					"no chunk with required hash [%s] found", hash);
+			return FALSE;
+		}
+
+		if (!r_pwrite_exact(target_old->data_fd, data, chunk->size, chunk->offset, &ierror)) {
+			g_propagate_prefixed_error(error, ierror, "Failed to write chunk at offset %"G_GUINT64_FORMAT ": ", chunk->offset);
+			return FALSE;
+		}
+		r_copy_count_written(chunk->size);
+		r_copy_throttle(chunk->size);
+
+		r_copy_image_progress(&last_progress, chunk->offset + chunk->size, image_size);
+	}
+
+	/* Seek after the written data so this behaves similar to the simpler write helpers */
+	offset = image_size;
+	if (lseek(target_old->data_fd, offset, SEEK_SET) != offset) {
+		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED, "Failed to seek to end of image: %s", g_strerror(errno));
+		return FALSE;
+	}
+
+	/* Flush to block device before closing to assure content is written to disk */
+	if (timed_fsync(target_old->data_fd) == -1) {
+		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED, "Syncing content to slot failed: %s", strerror(errno));
+		return FALSE;
+	}
+
+	/* Write new index to slot data dir. */
+	if (!r_cdc_index_export_slot(image_idx, slot, &image->checksum, &ierror)) {
+		g_warning("Continuing after failure to write new chunk index: %s", ierror->message);
+		g_clear_error(&ierror);
+	}
+
+	r_stats_show(in_place_stats, "access stats for");
+	for (guint s = 0; s < sources->len; s++) {
+		const RaucCdcIndex *source = g_ptr_array_index(sources, s);
+		r_stats_show(source->match_stats, "access stats for");
+	}
+
+	return TRUE;
+}
+
 static gboolean copy_adaptive_image_to_dev(RaucImage *image, RaucSlot *slot, GError **error)
 {
 	GError *ierror = NULL;
@@ -927,10 +2624,25 @@ static gboolean copy_adaptive_image_to_dev(RaucImage *image, RaucSlot *slot, GEr
 	g_return_val_if_fail(slot, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
-	if (g_strv_contains((const gchar * const*)image->adaptive, "block-hash-index")) {
-		g_info("Selected adaptive update method 'block-hash-index'");
+	/* use the first supported method */
+	for (gchar **method = image->adaptive; *method != NULL; method++) {
+		gboolean res;
+
+		/* only the block-hash-index can restore chunks omitted from delta images */
+		if (image->delta_base && !g_str_equal(*method, "block-hash-index"))
+			continue;
+
+		if (g_str_equal(*method, "block-hash-index")) {
+			g_info("Selected adaptive update method 'block-hash-index'");
+			res = copy_block_hash_index_image_to_dev(image, slot, &ierror);
+		} else if (g_str_equal(*method, "cdc-hash-index")) {
+			g_info("Selected adaptive update method 'cdc-hash-index'");
+			res = copy_cdc_hash_index_image_to_dev(image, slot, &ierror);
+		} else {
+			continue;
+		}
 
-		if (!copy_block_hash_index_image_to_dev(image, slot, &ierror)) {
+		if (!res) {
 			g_propagate_error(error, ierror);
 			return FALSE;
 		}
@@ -952,13 +2664,28 @@ static gboolean write_image_to_dev(RaucImage *image, RaucSlot *slot, GError **er
 		g_message("Extracting %s to %s", image->filename, slot->device);
 
 		/* Extract caibx to device */
-		if (!casync_extract_image(image, slot->device, -1, &ierror)) {
+		if (!casync_extract_image(image, slot->device, -1, slot, &ierror)) {
 			g_propagate_error(error, ierror);
 			return FALSE;
 		}
 		return TRUE;
 	}
 
+	/* Delta images cannot be copied, as they are incomplete */
+	if (image->delta_base) {
+		if (!slot->data_directory) {
+			g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_UNSUPPORTED_ADAPTIVE_MODE,
+					"Installing delta image %s requires 'data-directory'", image->filename);
+			return FALSE;
+		}
+
+		if (!copy_adaptive_image_to_dev(image, slot, &ierror)) {
+			g_propagate_prefixed_error(error, ierror, "Failed to install delta image %s: ", image->filename);
+			return FALSE;
+		}
+		return TRUE;
+	}
+
 	/* Try adaptive mode */
 	if (image->adaptive) {
 		if (!slot->data_directory) {
@@ -1037,11 +2764,14 @@ out:
 	return res;
 }
 
-static gboolean ext4_format_slot(RaucSlot *dest_slot, GError **error)
+/* Formats the slot. If root is set, the filesystem is populated from this
+ * directory or (with e2fsprogs 1.47.1 or newer built with libarchive) tar
+ * archive, without mounting it. */
+static gboolean ext4_format_slot(RaucSlot *dest_slot, const gchar *root, GError **error)
 {
 	GError *ierror = NULL;
 	gboolean res = FALSE;
-	g_autoptr(GPtrArray) args = g_ptr_array_new_full(6, g_free);
+	g_autoptr(GPtrArray) args = g_ptr_array_new_full(8, g_free);
 
 	g_ptr_array_add(args, g_strdup("mkfs.ext4"));
 	g_ptr_array_add(args, g_strdup("-F"));
@@ -1050,6 +2780,10 @@ static gboolean ext4_format_slot(RaucSlot *dest_slot, GError **error)
 		g_ptr_array_add(args, g_strdup(dest_slot->name));
 	}
 	g_ptr_array_add(args, g_strdup("-I256"));
+	if (root) {
+		g_ptr_array_add(args, g_strdup("-d"));
+		g_ptr_array_add(args, g_strdup(root));
+	}
 	r_ptr_array_addv(args, dest_slot->extra_mkfs_opts, TRUE);
 	g_ptr_array_add(args, g_strdup(dest_slot->device));
 	g_ptr_array_add(args, NULL);
@@ -1137,101 +2871,6 @@ out:
 	return res;
 }
 
-static gboolean nor_write_slot(const gchar *image, const gchar *device, GError **error)
-{
-	GError *ierror = NULL;
-	gboolean res = FALSE;
-	g_autoptr(GPtrArray) args = g_ptr_array_new_full(5, g_free);
-
-	g_ptr_array_add(args, g_strdup("flashcp"));
-	g_ptr_array_add(args, g_strdup(image));
-	g_ptr_array_add(args, g_strdup(device));
-	g_ptr_array_add(args, NULL);
-
-	res = r_subprocess_runv(args, G_SUBPROCESS_FLAGS_NONE, &ierror);
-	if (!res) {
-		g_propagate_prefixed_error(
-				error,
-				ierror,
-				"failed to run flashcp: ");
-		goto out;
-	}
-
-out:
-	return res;
-}
-
-static gboolean flash_format_slot(const gchar *device, GError **error)
-{
-	GError *ierror = NULL;
-	gboolean res = FALSE;
-	g_autoptr(GPtrArray) args = g_ptr_array_new_full(5, g_free);
-
-	g_ptr_array_add(args, g_strdup("flash_erase"));
-	g_ptr_array_add(args, g_strdup("--quiet"));
-	g_ptr_array_add(args, g_strdup(device));
-	g_ptr_array_add(args, g_strdup("0"));
-	g_ptr_array_add(args, g_strdup("0"));
-	g_ptr_array_add(args, NULL);
-
-	res = r_subprocess_runv(args, G_SUBPROCESS_FLAGS_NONE, &ierror);
-	if (!res) {
-		g_propagate_prefixed_error(
-				error,
-				ierror,
-				"failed to run flash_erase: ");
-		goto out;
-	}
-
-out:
-	return res;
-}
-
-static gboolean nand_write_slot(const gchar *image, const gchar *device, GError **error)
-{
-	g_autoptr(GSubprocess) sproc = NULL;
-	GError *ierror = NULL;
-	gboolean res = FALSE;
-	g_autoptr(GPtrArray) args = g_ptr_array_new_full(5, g_free);
-
-	g_ptr_array_add(args, g_strdup("nandwrite"));
-	g_ptr_array_add(args, g_strdup("--pad"));
-	g_ptr_array_add(args, g_strdup("--quiet"));
-	g_ptr_array_add(args, g_strdup(device));
-	g_ptr_array_add(args, g_strdup("-"));
-	g_ptr_array_add(args, NULL);
-
-	sproc = r_subprocess_newv(args, G_SUBPROCESS_FLAGS_STDIN_PIPE, &ierror);
-	if (sproc == NULL) {
-		g_propagate_prefixed_error(
-				error,
-				ierror,
-				"failed to start nandwrite: ");
-		goto out;
-	}
-
-	res = splice_file_to_process_stdin(image, sproc, &ierror);
-	if (!res) {
-		g_propagate_prefixed_error(
-				error,
-				ierror,
-				"failed to splice data to nandwrite: ");
-		goto out;
-	}
-
-	res = g_subprocess_wait_check(sproc, NULL, &ierror);
-	if (!res) {
-		g_propagate_prefixed_error(
-				error,
-				ierror,
-				"failed to run nandwrite: ");
-		goto out;
-	}
-
-out:
-	return res;
-}
-
 struct suffix_tar_flag {
 	const char *suffix;
 	const char *tar_flag;
@@ -1271,12 +2910,14 @@ static const gchar *suffix_to_tar_flag(const gchar *filename)
 	return NULL;
 }
 
-static gboolean untar_image(RaucImage *image, gchar *dest, GError **error)
+/* With xattrs set, all extended attributes from the archive are restored,
+ * as done by mkfs.ext4 -d. This needs GNU tar. */
+static gboolean untar_image(RaucImage *image, gchar *dest, gboolean xattrs, GError **error)
 {
 	g_autoptr(GSubprocess) sproc = NULL;
 	GError *ierror = NULL;
 	gboolean res = FALSE;
-	g_autoptr(GPtrArray) args = g_ptr_array_new_full(5, g_free);
+	g_autoptr(GPtrArray) args = g_ptr_array_new_full(9, g_free);
 
 	g_ptr_array_add(args, g_strdup("tar"));
 	g_ptr_array_add(args, g_strdup("xf"));
@@ -1284,6 +2925,10 @@ static gboolean untar_image(RaucImage *image, gchar *dest, GError **error)
 	g_ptr_array_add(args, g_strdup("-C"));
 	g_ptr_array_add(args, g_strdup(dest));
 	g_ptr_array_add(args, g_strdup("--numeric-owner"));
+	if (xattrs) {
+		g_ptr_array_add(args, g_strdup("--xattrs"));
+		g_ptr_array_add(args, g_strdup("--xattrs-include=*"));
+	}
 	g_ptr_array_add(args, g_strdup(suffix_to_tar_flag(image->filename)));
 	g_ptr_array_add(args, NULL);
 
@@ -1318,14 +2963,341 @@ out:
 	return res;
 }
 
-static gboolean unpack_archive(RaucImage *image, gchar *dest, GError **error)
+static gboolean unpack_archive(RaucImage *image, gchar *dest, gboolean xattrs, GError **error)
 {
 	if (g_str_has_suffix(image->filename, ".caidx"))
-		return casync_extract_image(image, dest, -1, error);
+		return casync_extract_image(image, dest, -1, NULL, error);
 	else if (g_str_has_suffix(image->filename, ".catar"))
-		return casync_extract_image(image, dest, -1, error);
+		return casync_extract_image(image, dest, -1, NULL, error);
 	else
-		return untar_image(image, dest, error);
+		return untar_image(image, dest, xattrs, error);
+}
+
+#define FILE_INDEX_NAME "file-index"
+
+static gboolean image_uses_file_index(const RaucImage *image)
+{
+	return image->adaptive && g_strv_contains((const gchar * const *)image->adaptive, "file-index");
+}
+
+/**
+ * Takes the file index describing the current content of the slot out of
+ * its data directory.
+ *
+ * The index is removed before the slot is modified in any way, so that it is
+ * only available again after an installation succeeded (see
+ * save_file_index()). This way, an interrupted installation never leaves an
+ * index which doesn't match the slot.
+ *
+ * @return the index, or NULL if there is none or it is invalid
+ */
+static RaucFileIndex *take_slot_file_index(const RaucSlot *slot, GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(RaucFileIndex) index = NULL;
+	g_autofree gchar *dir = NULL;
+	g_autofree gchar *path = NULL;
+
+	dir = r_slot_get_checksum_data_directory(slot, NULL, &ierror);
+	if (!dir) {
+		g_propagate_error(error, ierror);
+		return NULL;
+	}
+
+	path = g_build_filename(dir, FILE_INDEX_NAME, NULL);
+	if (!g_file_test(path, G_FILE_TEST_IS_REGULAR)) {
+		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED,
+				"No file index for the current content of slot %s", slot->name);
+		return NULL;
+	}
+
+	index = r_file_index_load(path, &ierror);
+
+	if (g_unlink(path) != 0) {
+		int err = errno;
+		g_clear_error(&ierror);
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to remove file index %s: %s", path, g_strerror(err));
+		return NULL;
+	}
+
+	if (!index) {
+		g_propagate_error(error, ierror);
+		return NULL;
+	}
+
+	return g_steal_pointer(&index);
+}
+
+/* Saves the file index of the image in the data directory of the slot, so
+ * that the next update only needs to apply the differences. */
+static void save_file_index(const RaucImage *image, const RaucSlot *slot)
+{
+	GError *ierror = NULL;
+	g_autofree gchar *dir = NULL;
+	g_autofree gchar *src_path = NULL;
+	g_autofree gchar *path = NULL;
+	g_autoptr(GFile) src = NULL;
+	g_autoptr(GFile) dst = NULL;
+
+	if (!image_uses_file_index(image) || !slot->data_directory)
+		return;
+
+	dir = r_slot_get_checksum_data_directory(slot, &image->checksum, &ierror);
+	if (!dir) {
+		g_warning("Continuing after failure to save file index: %s", ierror->message);
+		g_clear_error(&ierror);
+		return;
+	}
+
+	src_path = g_strconcat(image->filename, ".file-index", NULL);
+	path = g_build_filename(dir, FILE_INDEX_NAME, NULL);
+	src = g_file_new_for_path(src_path);
+	dst = g_file_new_for_path(path);
+	if (!g_file_copy(src, dst, G_FILE_COPY_OVERWRITE, NULL, NULL, NULL, &ierror)) {
+		g_warning("Continuing after failure to save file index: %s", ierror->message);
+		g_clear_error(&ierror);
+		return;
+	}
+
+	g_debug("Saved file index for %s", slot->name);
+}
+
+/* Extracts only the given entries of a tar archive, restoring extended
+ * attributes as for untar_image(). */
+static gboolean untar_entries(RaucImage *image, const GPtrArray *entries, const gchar *dest, gboolean xattrs, GError **error)
+{
+	g_autoptr(GSubprocess) sproc = NULL;
+	g_autoptr(GString) names = g_string_new(NULL);
+	g_autoptr(GBytes) input = NULL;
+	GError *ierror = NULL;
+	g_autoptr(GPtrArray) args = g_ptr_array_new_full(16, g_free);
+
+	/* the names are passed NUL-separated on stdin, without interpretation */
+	for (guint i = 0; i < entries->len; i++) {
+		const RaucFileEntry *entry = g_ptr_array_index(entries, i);
+
+		g_string_append_len(names, entry->name, strlen(entry->name) + 1);
+	}
+	input = g_string_free_to_bytes(g_steal_pointer(&names));
+
+	g_ptr_array_add(args, g_strdup("tar"));
+	g_ptr_array_add(args, g_strdup("xf"));
+	g_ptr_array_add(args, g_strdup(image->filename));
+	g_ptr_array_add(args, g_strdup("-C"));
+	g_ptr_array_add(args, g_strdup(dest));
+	g_ptr_array_add(args, g_strdup("--numeric-owner"));
+	g_ptr_array_add(args, g_strdup("--no-recursion"));
+	g_ptr_array_add(args, g_strdup("--no-wildcards"));
+	g_ptr_array_add(args, g_strdup("--null"));
+	g_ptr_array_add(args, g_strdup("--verbatim-files-from"));
+	g_ptr_array_add(args, g_strdup("-T"));
+	g_ptr_array_add(args, g_strdup("-"));
+	if (xattrs) {
+		g_ptr_array_add(args, g_strdup("--xattrs"));
+		g_ptr_array_add(args, g_strdup("--xattrs-include=*"));
+	}
+	g_ptr_array_add(args, g_strdup(suffix_to_tar_flag(image->filename)));
+	g_ptr_array_add(args, NULL);
+
+	sproc = r_subprocess_newv(args, G_SUBPROCESS_FLAGS_STDIN_PIPE, &ierror);
+	if (sproc == NULL) {
+		g_propagate_prefixed_error(error, ierror, "failed to start tar extract: ");
+		return FALSE;
+	}
+
+	if (!g_subprocess_communicate(sproc, input, NULL, NULL, NULL, &ierror) ||
+	    !g_subprocess_wait_check(sproc, NULL, &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "failed to run tar extract: ");
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Sets the ownership, permissions and modification time of an entry. */
+static gboolean update_file_metadata(const RaucFileEntry *entry, const gchar *root, GError **error)
+{
+	g_autofree gchar *path = g_build_filename(root, entry->path, NULL);
+	struct timespec times[2] = {{0, UTIME_OMIT}, {entry->mtime, 0}};
+
+	/* chown() may clear the set-user-ID bit, so chmod() comes afterwards */
+	if (lchown(path, entry->uid, entry->gid) != 0 ||
+	    (entry->type != R_FILE_ENTRY_SYMLINK && chmod(path, entry->mode) != 0) ||
+	    utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to update metadata of %s: %s", entry->path, g_strerror(err));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean apply_file_index_diff(RaucImage *image, const RaucFileIndexDiff *diff, const gchar *root, gboolean xattrs, GError **error)
+{
+	GError *ierror = NULL;
+	g_autofree gchar *changed_size = g_format_size(diff->changed_size);
+
+	/* the slot must still contain what the old index describes */
+	for (guint i = 0; i < diff->kept->len; i++) {
+		if (!r_file_entry_check(g_ptr_array_index(diff->kept, i), root, &ierror)) {
+			g_propagate_prefixed_error(error, ierror, "Slot content differs from file index: ");
+			return FALSE;
+		}
+	}
+
+	g_message("Updating files in place: %u removed, %u changed (%s), %u with changed metadata, %u unchanged",
+			diff->removed->len, diff->changed->len, changed_size, diff->updated->len,
+			diff->kept->len - diff->updated->len);
+
+	for (guint i = 0; i < diff->removed->len; i++) {
+		const RaucFileEntry *entry = g_ptr_array_index(diff->removed, i);
+		g_autofree gchar *path = g_build_filename(root, entry->path, NULL);
+		int ret = (entry->type == R_FILE_ENTRY_DIRECTORY) ? rmdir(path) : unlink(path);
+
+		if (ret != 0 && errno != ENOENT) {
+			int err = errno;
+			g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+					"Failed to remove %s: %s", entry->path, g_strerror(err));
+			return FALSE;
+		}
+	}
+
+	if (diff->changed->len && !untar_entries(image, diff->changed, root, xattrs, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	/* after extracting, as this changes the modification time of directories */
+	for (guint i = 0; i < diff->updated->len; i++) {
+		if (!update_file_metadata(g_ptr_array_index(diff->updated, i), root, &ierror)) {
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/**
+ * Updates an archive-based slot in place, by applying only the differences
+ * between the file index of the current slot content and the one of the
+ * image.
+ *
+ * This requires the adaptive method 'file-index' and a data directory, in
+ * which the index is kept after each successful installation. Before
+ * modifying anything, all unchanged entries are checked (see
+ * r_file_entry_check()). With xattrs set, extended attributes of the changed
+ * entries are restored, as done by unpack_archive().
+ *
+ * If an error is returned, the slot may have been modified partially, so
+ * that it must be formatted and the complete archive extracted. If FALSE is
+ * returned without an error, the in-place update was not attempted.
+ *
+ * On success, the slot is left mounted.
+ */
+static gboolean update_archive_in_place(RaucImage *image, RaucSlot *dest_slot, gboolean xattrs, GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(RaucFileIndex) old_index = NULL;
+	g_autoptr(RaucFileIndex) new_index = NULL;
+	g_autoptr(RaucFileIndexDiff) diff = NULL;
+	g_autofree gchar *new_index_path = NULL;
+
+	if (!dest_slot->data_directory) {
+		if (image_uses_file_index(image))
+			g_message("Ignoring adaptive method 'file-index' since 'data-directory' is not configured");
+		return FALSE;
+	}
+
+	/* done for all archives, as the slot is going to change */
+	old_index = take_slot_file_index(dest_slot, &ierror);
+	if (!image_uses_file_index(image)) {
+		g_clear_error(&ierror);
+		return FALSE;
+	}
+	if (!old_index) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	if (g_str_has_suffix(image->filename, ".caidx") || g_str_has_suffix(image->filename, ".catar")) {
+		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_UNSUPPORTED_ADAPTIVE_MODE,
+				"Adaptive method 'file-index' is only supported for tar archives");
+		return FALSE;
+	}
+
+	new_index_path = g_strconcat(image->filename, ".file-index", NULL);
+	new_index = r_file_index_load(new_index_path, &ierror);
+	if (!new_index) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	diff = r_file_index_diff(old_index, new_index);
+
+	g_message("Mounting %s slot %s", dest_slot->type, dest_slot->device);
+	if (!r_mount_slot(dest_slot, &ierror)) {
+		g_propagate_error(error, ierror);
+		return FALSE;
+	}
+
+	if (!apply_file_index_diff(image, diff, dest_slot->mount_point, xattrs, &ierror)) {
+		g_propagate_error(error, ierror);
+		if (!r_umount_slot(dest_slot, &ierror)) {
+			g_warning("Ignoring umount error after previous error: %s", ierror->message);
+			g_clear_error(&ierror);
+		}
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static GMutex slot_hook_env_lock;
+
+/**
+ * Returns the part of the slot hook environment which does not depend on the
+ * slot.
+ *
+ * While a bundle is mounted, this is only built once and cached in the
+ * installation info, as calculating the SPKI hashes of the signer chain is
+ * relatively expensive.
+ *
+ * @return a newly allocated environment, based on the current one
+ */
+static gchar **get_slot_hook_environment(void)
+{
+	g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&slot_hook_env_lock);
+	RContextInstallationInfo *info = r_context()->install_info;
+	RaucBundle *bundle = info->mounted_bundle;
+	gchar **envp;
+
+	if (bundle && info->slot_hook_env && info->slot_hook_env_bundle == bundle)
+		return g_strdupv(info->slot_hook_env);
+
+	envp = g_get_environ();
+	envp = g_environ_setenv(envp, "RAUC_SYSTEM_COMPATIBLE", r_context()->config->system_compatible ?: "", TRUE);
+	envp = g_environ_setenv(envp, "RAUC_SYSTEM_VARIANT", r_context()->config->system_variant ?: "", TRUE);
+	envp = g_environ_setenv(envp, "RAUC_MOUNT_PREFIX", r_context()->config->mount_prefix, TRUE);
+
+	if (!bundle)
+		return envp;
+
+	{
+		g_auto(GStrv) hashes = get_pubkey_hashes(bundle->verified_chain);
+		g_autofree gchar *string = g_strjoinv(" ", hashes);
+
+		envp = g_environ_setenv(envp, "RAUC_BUNDLE_SPKI_HASHES", string, TRUE);
+		envp = g_environ_setenv(envp, "RAUC_BUNDLE_MOUNT_POINT", bundle->mount_point, TRUE);
+	}
+
+	g_strfreev(info->slot_hook_env);
+	info->slot_hook_env = g_strdupv(envp);
+	info->slot_hook_env_bundle = bundle;
+
+	return envp;
 }
 
 /**
@@ -1345,9 +3317,11 @@ static gboolean run_slot_hook_extra_env(const gchar *hook_name, const gchar *hoo
 	g_autoptr(GSubprocessLauncher) launcher = NULL;
 	g_autoptr(GSubprocess) sproc = NULL;
 	g_autofree gchar* image_size = NULL;
+	g_autofree gchar *label = NULL;
+	g_auto(GStrv) envp = NULL;
 	GError *ierror = NULL;
 	gboolean res = FALSE;
-	RaucBundle *bundle;
+	gint64 start;
 
 	g_return_val_if_fail(hook_name, FALSE);
 	g_return_val_if_fail(hook_cmd, FALSE);
@@ -1360,8 +3334,8 @@ static gboolean run_slot_hook_extra_env(const gchar *hook_name, const gchar *hoo
 
 	launcher = g_subprocess_launcher_new(G_SUBPROCESS_FLAGS_NONE);
 
-	g_subprocess_launcher_setenv(launcher, "RAUC_SYSTEM_COMPATIBLE", r_context()->config->system_compatible ?: "", TRUE);
-	g_subprocess_launcher_setenv(launcher, "RAUC_SYSTEM_VARIANT", r_context()->config->system_variant ?: "", TRUE);
+	envp = get_slot_hook_environment();
+	g_subprocess_launcher_set_environ(launcher, envp);
 
 	g_subprocess_launcher_setenv(launcher, "RAUC_SLOT_NAME", slot->name, TRUE);
 	g_subprocess_launcher_setenv(launcher, "RAUC_SLOT_STATE", r_slot_slotstate_to_str(slot->state), TRUE);
@@ -1386,17 +3360,6 @@ static gboolean run_slot_hook_extra_env(const gchar *hook_name, const gchar *hoo
 		g_subprocess_launcher_setenv(launcher, "RAUC_IMAGE_DIGEST", image->checksum.digest ? image->checksum.digest : "", TRUE);
 		g_subprocess_launcher_setenv(launcher, "RAUC_IMAGE_CLASS", image->slotclass, TRUE);
 	}
-	g_subprocess_launcher_setenv(launcher, "RAUC_MOUNT_PREFIX", r_context()->config->mount_prefix, TRUE);
-
-	bundle = r_context()->install_info->mounted_bundle;
-	if (bundle) {
-		g_auto(GStrv) hashes = get_pubkey_hashes(bundle->verified_chain);
-		g_autofree gchar *string = g_strjoinv(" ", hashes);
-
-		g_subprocess_launcher_setenv(launcher, "RAUC_BUNDLE_SPKI_HASHES", string, TRUE);
-
-		g_subprocess_launcher_setenv(launcher, "RAUC_BUNDLE_MOUNT_POINT", bundle->mount_point, TRUE);
-	}
 
 	if (variables) {
 		GHashTableIter iter;
@@ -1407,10 +3370,11 @@ static gboolean run_slot_hook_extra_env(const gchar *hook_name, const gchar *hoo
 		   subprocess environment */
 		g_hash_table_iter_init(&iter, variables);
 		while (g_hash_table_iter_next(&iter, (gpointer*) &key, (gpointer*) &value)) {
-			g_subprocess_launcher_setenv(launcher, g_strdup(key), g_strdup(value), TRUE);
+			g_subprocess_launcher_setenv(launcher, key, value, TRUE);
 		}
 	}
 
+	start = g_get_monotonic_time();
 	sproc = g_subprocess_launcher_spawn(
 			launcher, &ierror,
 			hook_name,
@@ -1425,6 +3389,8 @@ static gboolean run_slot_hook_extra_env(const gchar *hook_name, const gchar *hoo
 	}
 
 	res = g_subprocess_wait_check(sproc, NULL, &ierror);
+	label = g_strdup_printf("slot hook %s of %s [s]", hook_cmd, slot->name);
+	r_stats_report_add(label, (gdouble)(g_get_monotonic_time() - start) / G_USEC_PER_SEC);
 	if (!res) {
 		g_propagate_prefixed_error(
 				error,
@@ -1501,6 +3467,7 @@ static gboolean img_to_ubivol_handler(RaucImage *image, RaucSlot *dest_slot, con
 	g_autoptr(GUnixOutputStream) outstream = NULL;
 	GError *ierror = NULL;
 	int out_fd;
+	gboolean changed_lebs = FALSE;
 	gboolean res = FALSE;
 
 	/* run slot pre install hook if enabled */
@@ -1512,44 +3479,62 @@ static gboolean img_to_ubivol_handler(RaucImage *image, RaucSlot *dest_slot, con
 		}
 	}
 
-	/* open */
-	g_message("opening slot device %s", dest_slot->device);
-	outstream = r_unix_output_stream_open_device(dest_slot->device, &out_fd, &ierror);
-	if (outstream == NULL) {
-		res = FALSE;
-		g_propagate_error(error, ierror);
-		goto out;
-	}
-
-	/* ubifs ioctl */
-	res = ubifs_ioctl(image, out_fd, &ierror);
-	if (!res) {
-		g_propagate_error(error, ierror);
-		goto out;
+	/* try to change only differing LEBs */
+	if (image->adaptive && !g_str_has_suffix(image->filename, ".caibx") &&
+	    g_strv_contains((const gchar * const *)image->adaptive, "ubi-leb")) {
+		g_info("Selected adaptive update method 'ubi-leb'");
+		changed_lebs = copy_changed_ubi_lebs(image, dest_slot, &ierror);
+		if (!changed_lebs) {
+			if (g_error_matches(ierror, R_UPDATE_ERROR, R_UPDATE_ERROR_UNSUPPORTED_ADAPTIVE_MODE)) {
+				g_info("%s", ierror->message);
+			} else {
+				g_warning("Continuing after adaptive mode error: %s", ierror->message);
+			}
+			g_clear_error(&ierror);
+			/* Continue with full volume update */
+		}
 	}
 
-	/* Handle casync index file */
-	if (g_str_has_suffix(image->filename, ".caibx")) {
-		g_message("Extracting %s to %s", image->filename, dest_slot->device);
-
-		res = casync_extract_image(image, NULL, out_fd, &ierror);
-		if (!res) {
+	if (!changed_lebs) {
+		/* open */
+		g_message("opening slot device %s", dest_slot->device);
+		outstream = r_unix_output_stream_open_device(dest_slot->device, &out_fd, &ierror);
+		if (outstream == NULL) {
+			res = FALSE;
 			g_propagate_error(error, ierror);
 			goto out;
 		}
-	} else {
-		/* copy */
-		res = copy_raw_image(image, outstream, 0, &ierror);
+
+		/* ubifs ioctl */
+		res = ubifs_ioctl(image, out_fd, &ierror);
 		if (!res) {
 			g_propagate_error(error, ierror);
 			goto out;
 		}
-	}
 
-	res = g_output_stream_close(G_OUTPUT_STREAM(outstream), NULL, &ierror);
-	if (!res) {
-		g_propagate_error(error, ierror);
-		return FALSE;
+		/* Handle casync index file */
+		if (g_str_has_suffix(image->filename, ".caibx")) {
+			g_message("Extracting %s to %s", image->filename, dest_slot->device);
+
+			res = casync_extract_image(image, NULL, out_fd, dest_slot, &ierror);
+			if (!res) {
+				g_propagate_error(error, ierror);
+				goto out;
+			}
+		} else {
+			/* copy in complete LEBs */
+			res = copy_raw_image_to_ubivol(image, out_fd, &ierror);
+			if (!res) {
+				g_propagate_error(error, ierror);
+				goto out;
+			}
+		}
+
+		res = g_output_stream_close(G_OUTPUT_STREAM(outstream), NULL, &ierror);
+		if (!res) {
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
 	}
 
 	/* run slot post install hook if enabled */
@@ -1601,14 +3586,14 @@ static gboolean img_to_ubifs_handler(RaucImage *image, RaucSlot *dest_slot, cons
 	if (g_str_has_suffix(image->filename, ".caibx")) {
 		g_message("Extracting %s to %s", image->filename, dest_slot->device);
 
-		res = casync_extract_image(image, NULL, out_fd, &ierror);
+		res = casync_extract_image(image, NULL, out_fd, dest_slot, &ierror);
 		if (!res) {
 			g_propagate_error(error, ierror);
 			goto out;
 		}
 	} else {
-		/* copy */
-		res = copy_raw_image(image, outstream, 0, &ierror);
+		/* copy in complete LEBs */
+		res = copy_raw_image_to_ubivol(image, out_fd, &ierror);
 		if (!res) {
 			g_propagate_error(error, ierror);
 			goto out;
@@ -1638,6 +3623,7 @@ static gboolean archive_to_ubifs_handler(RaucImage *image, RaucSlot *dest_slot,
 {
 	GError *ierror = NULL;
 	gboolean res = FALSE;
+	gboolean in_place = FALSE;
 
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
@@ -1650,28 +3636,39 @@ static gboolean archive_to_ubifs_handler(RaucImage *image, RaucSlot *dest_slot,
 		}
 	}
 
-	/* format ubi volume */
-	g_message("Formatting ubifs slot %s", dest_slot->device);
-	res = ubifs_format_slot(dest_slot, &ierror);
-	if (!res) {
-		g_propagate_error(error, ierror);
-		goto out;
+	/* apply only the differences to the slot content, if possible */
+	in_place = update_archive_in_place(image, dest_slot, FALSE, &ierror);
+	if (in_place) {
+		res = TRUE;
+	} else if (ierror) {
+		g_message("Falling back to full installation: %s", ierror->message);
+		g_clear_error(&ierror);
 	}
 
-	/* mount ubi volume */
-	g_message("Mounting ubifs slot %s", dest_slot->device);
-	res = r_mount_slot(dest_slot, &ierror);
-	if (!res) {
-		g_propagate_error(error, ierror);
-		goto out;
-	}
+	if (!in_place) {
+		/* format ubi volume */
+		g_message("Formatting ubifs slot %s", dest_slot->device);
+		res = ubifs_format_slot(dest_slot, &ierror);
+		if (!res) {
+			g_propagate_error(error, ierror);
+			goto out;
+		}
 
-	/* extract tar into mounted ubi volume */
-	g_message("Extracting %s to %s", image->filename, dest_slot->mount_point);
-	res = unpack_archive(image, dest_slot->mount_point, &ierror);
-	if (!res) {
-		g_propagate_error(error, ierror);
-		goto unmount_out;
+		/* mount ubi volume */
+		g_message("Mounting ubifs slot %s", dest_slot->device);
+		res = r_mount_slot(dest_slot, &ierror);
+		if (!res) {
+			g_propagate_error(error, ierror);
+			goto out;
+		}
+
+		/* extract tar into mounted ubi volume */
+		g_message("Extracting %s to %s", image->filename, dest_slot->mount_point);
+		res = unpack_archive(image, dest_slot->mount_point, FALSE, &ierror);
+		if (!res) {
+			g_propagate_error(error, ierror);
+			goto unmount_out;
+		}
 	}
 
 	/* run slot post install hook if enabled */
@@ -1699,6 +3696,8 @@ unmount_out:
 	}
 
 out:
+	if (res)
+		save_file_index(image, dest_slot);
 	return res;
 }
 
@@ -1720,7 +3719,7 @@ static gboolean archive_to_jffs2_handler(RaucImage *image, RaucSlot *dest_slot,
 
 	/* erase */
 	g_message("Erasing slot mtd device %s", dest_slot->device);
-	res = flash_format_slot(dest_slot->device, &ierror);
+	res = r_mtd_erase(dest_slot->device, NULL, &ierror);
 	if (!res) {
 		g_propagate_error(error, ierror);
 		goto out;
@@ -1736,7 +3735,7 @@ static gboolean archive_to_jffs2_handler(RaucImage *image, RaucSlot *dest_slot,
 
 	/* extract tar into mounted jffs2 volume */
 	g_message("Extracting %s to %s", image->filename, dest_slot->mount_point);
-	res = unpack_archive(image, dest_slot->mount_point, &ierror);
+	res = unpack_archive(image, dest_slot->mount_point, FALSE, &ierror);
 	if (!res) {
 		g_propagate_error(error, ierror);
 		goto unmount_out;
@@ -1774,6 +3773,8 @@ static gboolean archive_to_ext4_handler(RaucImage *image, RaucSlot *dest_slot, c
 {
 	GError *ierror = NULL;
 	gboolean res = FALSE;
+	gboolean populated = FALSE;
+	gboolean in_place = FALSE;
 
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
@@ -1786,28 +3787,61 @@ static gboolean archive_to_ext4_handler(RaucImage *image, RaucSlot *dest_slot, c
 		}
 	}
 
+	/* apply only the differences to the slot content, if possible */
+	in_place = update_archive_in_place(image, dest_slot, TRUE, &ierror);
+	if (in_place) {
+		res = TRUE;
+	} else if (ierror) {
+		g_message("Falling back to full installation: %s", ierror->message);
+		g_clear_error(&ierror);
+	}
+
+	/* Build the filesystem directly from tar archives, which avoids
+	 * creating each file through the kernel and writes the device
+	 * sequentially. mkfs.ext4 keeps the numeric owners and xattrs from the
+	 * archive. Older e2fsprogs only support directories for -d, so fall
+	 * back to extracting the archive into the mounted filesystem, with the
+	 * same label, owners and xattrs. */
+	if (!in_place && !g_str_has_suffix(image->filename, ".caidx") && !g_str_has_suffix(image->filename, ".catar")) {
+		g_message("Building ext4 slot %s from %s", dest_slot->device, image->filename);
+		populated = ext4_format_slot(dest_slot, image->filename, &ierror);
+		if (!populated) {
+			g_message("Failed to build ext4 filesystem from archive, extracting it instead: %s", ierror->message);
+			g_clear_error(&ierror);
+		} else if (!(hook_name && image->hooks.post_install)) {
+			res = TRUE;
+			goto out;
+		}
+	}
+
 	/* format ext4 volume */
-	g_message("Formatting ext4 slot %s", dest_slot->device);
-	res = ext4_format_slot(dest_slot, &ierror);
-	if (!res) {
-		g_propagate_error(error, ierror);
-		goto out;
+	if (!populated && !in_place) {
+		g_message("Formatting ext4 slot %s", dest_slot->device);
+		res = ext4_format_slot(dest_slot, NULL, &ierror);
+		if (!res) {
+			g_propagate_error(error, ierror);
+			goto out;
+		}
 	}
 
-	/* mount ext4 volume */
-	g_message("Mounting ext4 slot %s", dest_slot->device);
-	res = r_mount_slot(dest_slot, &ierror);
-	if (!res) {
-		g_propagate_error(error, ierror);
-		goto out;
+	if (!in_place) {
+		/* mount ext4 volume */
+		g_message("Mounting ext4 slot %s", dest_slot->device);
+		res = r_mount_slot(dest_slot, &ierror);
+		if (!res) {
+			g_propagate_error(error, ierror);
+			goto out;
+		}
 	}
 
 	/* extract tar into mounted ext4 volume */
-	g_message("Extracting %s to %s", image->filename, dest_slot->mount_point);
-	res = unpack_archive(image, dest_slot->mount_point, &ierror);
-	if (!res) {
-		g_propagate_error(error, ierror);
-		goto unmount_out;
+	if (!populated && !in_place) {
+		g_message("Extracting %s to %s", image->filename, dest_slot->mount_point);
+		res = unpack_archive(image, dest_slot->mount_point, TRUE, &ierror);
+		if (!res) {
+			g_propagate_error(error, ierror);
+			goto unmount_out;
+		}
 	}
 
 	/* run slot post install hook if enabled */
@@ -1835,6 +3869,8 @@ unmount_out:
 	}
 
 out:
+	if (res)
+		save_file_index(image, dest_slot);
 	return res;
 }
 
@@ -1842,6 +3878,7 @@ static gboolean archive_to_vfat_handler(RaucImage *image, RaucSlot *dest_slot, c
 {
 	GError *ierror = NULL;
 	gboolean res = FALSE;
+	gboolean in_place = FALSE;
 
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
@@ -1854,28 +3891,39 @@ static gboolean archive_to_vfat_handler(RaucImage *image, RaucSlot *dest_slot, c
 		}
 	}
 
-	/* format vfat volume */
-	g_message("Formatting vfat slot %s", dest_slot->device);
-	res = vfat_format_slot(dest_slot, &ierror);
-	if (!res) {
-		g_propagate_error(error, ierror);
-		goto out;
+	/* apply only the differences to the slot content, if possible */
+	in_place = update_archive_in_place(image, dest_slot, FALSE, &ierror);
+	if (in_place) {
+		res = TRUE;
+	} else if (ierror) {
+		g_message("Falling back to full installation: %s", ierror->message);
+		g_clear_error(&ierror);
 	}
 
-	/* mount vfat volume */
-	g_message("Mounting vfat slot %s", dest_slot->device);
-	res = r_mount_slot(dest_slot, &ierror);
-	if (!res) {
-		g_propagate_error(error, ierror);
-		goto out;
-	}
+	if (!in_place) {
+		/* format vfat volume */
+		g_message("Formatting vfat slot %s", dest_slot->device);
+		res = vfat_format_slot(dest_slot, &ierror);
+		if (!res) {
+			g_propagate_error(error, ierror);
+			goto out;
+		}
 
-	/* extract tar into mounted vfat volume */
-	g_message("Extracting %s to %s", image->filename, dest_slot->mount_point);
-	res = unpack_archive(image, dest_slot->mount_point, &ierror);
-	if (!res) {
-		g_propagate_error(error, ierror);
-		goto unmount_out;
+		/* mount vfat volume */
+		g_message("Mounting vfat slot %s", dest_slot->device);
+		res = r_mount_slot(dest_slot, &ierror);
+		if (!res) {
+			g_propagate_error(error, ierror);
+			goto out;
+		}
+
+		/* extract tar into mounted vfat volume */
+		g_message("Extracting %s to %s", image->filename, dest_slot->mount_point);
+		res = unpack_archive(image, dest_slot->mount_point, FALSE, &ierror);
+		if (!res) {
+			g_propagate_error(error, ierror);
+			goto unmount_out;
+		}
 	}
 
 	/* run slot post install hook if enabled */
@@ -1903,6 +3951,8 @@ unmount_out:
 	}
 
 out:
+	if (res)
+		save_file_index(image, dest_slot);
 	return res;
 }
 
@@ -1918,16 +3968,9 @@ static gboolean img_to_nor_handler(RaucImage *image, RaucSlot *dest_slot, const
 		}
 	}
 
-	/* erase */
-	g_message("erasing slot device %s", dest_slot->device);
-	if (!flash_format_slot(dest_slot->device, &ierror)) {
-		g_propagate_error(error, ierror);
-		return FALSE;
-	}
-
-	/* write */
+	/* erase and write only the changed erase blocks */
 	g_message("writing slot device %s", dest_slot->device);
-	if (!nor_write_slot(image->filename, dest_slot->device, &ierror)) {
+	if (!r_mtd_write_image(dest_slot->device, image->filename, NULL, &ierror)) {
 		g_propagate_error(error, ierror);
 		return FALSE;
 	}
@@ -1955,16 +3998,9 @@ static gboolean img_to_nand_handler(RaucImage *image, RaucSlot *dest_slot, const
 		}
 	}
 
-	/* erase */
-	g_message("erasing slot device %s", dest_slot->device);
-	if (!flash_format_slot(dest_slot->device, &ierror)) {
-		g_propagate_error(error, ierror);
-		return FALSE;
-	}
-
-	/* write */
+	/* erase and write only the changed erase blocks */
 	g_message("writing slot device %s", dest_slot->device);
-	if (!nand_write_slot(image->filename, dest_slot->device, &ierror)) {
+	if (!r_mtd_write_image(dest_slot->device, image->filename, NULL, &ierror)) {
 		g_propagate_error(error, ierror);
 		return FALSE;
 	}
@@ -2024,14 +4060,16 @@ static gboolean img_to_boot_mbr_switch_handler(RaucImage *image, RaucSlot *dest_
 	GError *ierror = NULL;
 	struct boot_switch_partition dest_partition;
 	g_autoptr(GHashTable) vars = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	g_autoptr(RMbrSwitch) sw = NULL;
 
-	res = r_mbr_switch_get_inactive_partition(dest_slot->device,
-			&dest_partition, dest_slot->region_start,
+	sw = r_mbr_switch_open(dest_slot->device, dest_slot->region_start,
 			dest_slot->region_size, &ierror);
-	if (!res) {
+	if (!sw) {
 		g_propagate_error(error, ierror);
+		res = FALSE;
 		goto out;
 	}
+	dest_partition = *r_mbr_switch_get_inactive(sw);
 
 	if (dest_partition.start == dest_slot->region_start)
 		inactive_half = 0;
@@ -2097,7 +4135,7 @@ static gboolean img_to_boot_mbr_switch_handler(RaucImage *image, RaucSlot *dest_
 
 	g_message("Setting %s half of boot partition region active in MBR", inactive_half == 0 ? "first" : "second");
 
-	res = r_mbr_switch_set_boot_partition(dest_slot->device, &dest_partition, &ierror);
+	res = r_mbr_switch_activate(sw, &ierror);
 	if (!res) {
 		g_propagate_error(error, ierror);
 		goto out;
@@ -2117,14 +4155,16 @@ static gboolean img_to_boot_gpt_switch_handler(RaucImage *image, RaucSlot *dest_
 	GError *ierror = NULL;
 	struct boot_switch_partition dest_partition;
 	g_autoptr(GHashTable) vars = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	g_autoptr(RGptSwitch) sw = NULL;
 
-	res = r_gpt_switch_get_inactive_partition(dest_slot->device,
-			&dest_partition, dest_slot->region_start,
+	sw = r_gpt_switch_open(dest_slot->device, dest_slot->region_start,
 			dest_slot->region_size, &ierror);
-	if (!res) {
+	if (!sw) {
 		g_propagate_error(error, ierror);
+		res = FALSE;
 		goto out;
 	}
+	dest_partition = *r_gpt_switch_get_inactive(sw);
 
 	if (dest_partition.start == dest_slot->region_start)
 		inactive_half = 0;
@@ -2190,7 +4230,7 @@ static gboolean img_to_boot_gpt_switch_handler(RaucImage *image, RaucSlot *dest_
 
 	g_message("Setting %s half of boot partition region active in GPT", inactive_half == 0 ? "first" : "second");
 
-	res = r_gpt_switch_set_boot_partition(dest_slot->device, &dest_partition, &ierror);
+	res = r_gpt_switch_activate(sw, &ierror);
 	if (!res) {
 		g_propagate_error(error, ierror);
 		goto out;
@@ -2277,14 +4317,6 @@ static gboolean img_to_boot_emmc_handler(RaucImage *image, RaucSlot *dest_slot,
 		}
 	}
 
-	/* clear block device partition */
-	g_message("Clearing slot device %s", part_slot->device);
-	res = clear_slot(part_slot, &ierror);
-	if (!res) {
-		g_propagate_error(error, ierror);
-		goto out;
-	}
-
 	/* open */
 	g_message("Opening slot device partition %s", part_slot->device);
 	outstream = r_unix_output_stream_open_device(part_slot->device, &out_fd, &ierror);
@@ -2301,6 +4333,15 @@ static gboolean img_to_boot_emmc_handler(RaucImage *image, RaucSlot *dest_slot,
 		goto out;
 	}
 
+	/* clear the remaining block device partition, the image area is
+	 * overwritten by the copy and synced together with it */
+	g_message("Clearing slot device %s", part_slot->device);
+	res = clear_slot_tail(out_fd, part_slot, image->checksum.size, &ierror);
+	if (!res) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
+
 	/* copy */
 	g_message("Copying image to slot device partition %s",
 			part_slot->device);
@@ -2316,6 +4357,13 @@ static gboolean img_to_boot_emmc_handler(RaucImage *image, RaucSlot *dest_slot,
 		goto out;
 	}
 
+	/* verify */
+	res = verify_written_image(part_slot->device, image, &ierror);
+	if (!res) {
+		g_propagate_error(error, ierror);
+		goto out;
+	}
+
 	/* run slot post install hook if enabled */
 	if (hook_name && image->hooks.post_install) {
 		res = run_slot_hook_extra_env(
@@ -2385,63 +4433,52 @@ out:
 }
 #endif
 
+/* size of the reads when checking whether an area is clear (1 MiB) */
+#define CLEAR_CHECK_BLOCK_SIZE (1024*1024)
+
 static gboolean check_if_area_is_clear(const gchar *device, guint64 start, gsize size, gboolean *clear, GError **error)
 {
-	gboolean res = FALSE;
-	g_autofree guchar *read_buf = NULL;
-	gint read_size = 512;
-	gint fd;
+	GError *ierror = NULL;
+	g_autofree guint8 *read_buf = NULL;
+	g_auto(filedesc) fd = -1;
 
 	g_return_val_if_fail(device, FALSE);
 	g_return_val_if_fail(clear, FALSE);
 	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
 
-	read_buf = g_malloc0(read_size);
-
-	fd = g_open(device, O_RDONLY);
+	fd = g_open(device, O_RDONLY | O_CLOEXEC, 0);
 	if (fd == -1) {
 		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED,
 				"Opening device failed: %s",
 				g_strerror(errno));
-		goto out;
+		return FALSE;
 	}
 
-	if (lseek(fd, start, SEEK_SET) != (off_t) start) {
-		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED,
-				"Failed to set file to position %"G_GUINT64_FORMAT ": %s",
-				start, g_strerror(errno));
-		goto out;
-	}
+	(void)posix_fadvise(fd, start, size, POSIX_FADV_SEQUENTIAL);
 
-	*clear = TRUE;
+	read_buf = g_malloc(MIN(size, CLEAR_CHECK_BLOCK_SIZE));
 
-	while (size && *clear) {
-		gint read_count = 0;
+	*clear = TRUE;
 
-		if (size < (gsize) read_size)
-			read_size = size;
+	/* stop at the first block with data */
+	for (gsize pos = 0; pos < size;) {
+		gsize read_size = MIN(size - pos, CLEAR_CHECK_BLOCK_SIZE);
 
-		read_count = read(fd, read_buf, read_size);
-		if (read_count < 0)
-			goto out;
+		if (!r_pread_exact(fd, read_buf, read_size, start + pos, &ierror)) {
+			g_propagate_prefixed_error(error, ierror,
+					"Failed to read at position %"G_GUINT64_FORMAT ": ", start + pos);
+			return FALSE;
+		}
 
-		for (gint i = 0; i < read_count; i++) {
-			if ((read_buf[i] != 0x00) && (read_buf[i] != 0xFF)) {
-				*clear = FALSE;
-				break;
-			}
+		if (!r_buffer_is_erased(read_buf, read_size)) {
+			*clear = FALSE;
+			break;
 		}
 
-		size -= read_count;
+		pos += read_size;
 	}
 
-	res = TRUE;
-
-out:
-	if (fd >= 0)
-		g_close(fd, NULL);
-
-	return res;
+	return TRUE;
 }
 
 static gboolean img_to_boot_raw_fallback_handler(RaucImage *image, RaucSlot *dest_slot, const gchar *hook_name, GError **error)
@@ -2696,6 +4733,128 @@ img_to_slot_handler get_update_handler(RaucImage *mfimage, RaucSlot *dest_slot,
 		goto out;
 	}
 
+	/* Delta images can only be reconstructed by the block-hash-index method. */
+	if (mfimage->delta_base && handler != img_to_raw_handler && handler != img_to_fs_handler) {
+		g_set_error(error, R_UPDATE_ERROR, R_UPDATE_ERROR_NO_HANDLER, "Delta image %s cannot be installed to slot type %s",
+				mfimage->filename, dest);
+		handler = NULL;
+		goto out;
+	}
+
 out:
 	return handler;
 }
+
+gboolean r_update_handler_is_raw_copy(img_to_slot_handler handler, const RaucImage *image, const RaucSlot *slot)
+{
+	g_return_val_if_fail(image, FALSE);
+	g_return_val_if_fail(slot, FALSE);
+
+	if (handler != img_to_raw_handler)
+		return FALSE;
+
+	if (image->hooks.pre_install || image->hooks.post_install)
+		return FALSE;
+
+	if (g_str_has_suffix(image->filename, ".caibx") || image->delta_base)
+		return FALSE;
+
+	/* adaptive updates read most data from the slots instead of the image */
+	if (image->adaptive && slot->data_directory)
+		return FALSE;
+
+	return TRUE;
+}
+
+gboolean r_write_image_to_devs(RaucImage *image, GPtrArray *slots, GError **slot_errors, goffset *slot_written, GError **error)
+{
+	GError *ierror = NULL;
+	g_autoptr(GPtrArray) outstreams = g_ptr_array_new_with_free_func(g_object_unref);
+	g_autofree int *out_fds = NULL;
+	g_autofree guint *out_slots = NULL;
+	g_autofree GError **out_errors = NULL;
+	g_autofree goffset *out_written = NULL;
+	g_auto(filedesc) in_fd = -1;
+	goffset read_size;
+
+	g_return_val_if_fail(image, FALSE);
+	g_return_val_if_fail(slots && slots->len > 0, FALSE);
+	g_return_val_if_fail(slot_errors, FALSE);
+	g_return_val_if_fail(slot_written, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	/* the n-th opened device belongs to slot out_slots[n] */
+	out_fds = g_new0(int, slots->len);
+	out_slots = g_new0(guint, slots->len);
+	out_errors = g_new0(GError *, slots->len);
+	out_written = g_new0(goffset, slots->len);
+
+	for (guint i = 0; i < slots->len; i++) {
+		RaucSlot *slot = g_ptr_array_index(slots, i);
+		g_autoptr(GUnixOutputStream) outstream = NULL;
+		int fd = -1;
+
+		g_message("opening slot device %s", slot->device);
+		outstream = r_unix_output_stream_open_device(slot->device, &fd, &slot_errors[i]);
+		if (outstream == NULL)
+			continue;
+
+		if (!check_image_size(fd, slot, image, &slot_errors[i]))
+			continue;
+
+		out_fds[outstreams->len] = fd;
+		out_slots[outstreams->len] = i;
+		g_ptr_array_add(outstreams, g_steal_pointer(&outstream));
+	}
+
+	if (!outstreams->len)
+		return TRUE;
+
+	in_fd = g_open(image->filename, O_RDONLY);
+	if (in_fd < 0) {
+		int err = errno;
+		g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
+				"Failed to open file for reading: %s", g_strerror(err));
+		return FALSE;
+	}
+
+	g_message("writing data to %u devices", outstreams->len);
+	if (!r_copy_fd_fan_out(in_fd, out_fds, outstreams->len, image->checksum.size, out_errors, out_written, &ierror)) {
+		for (guint n = 0; n < outstreams->len; n++)
+			g_clear_error(&out_errors[n]);
+		g_propagate_prefixed_error(error, ierror, "Failed to copy data: ");
+		return FALSE;
+	}
+
+	/* reading stops early only if all devices failed */
+	read_size = lseek(in_fd, 0, SEEK_CUR);
+
+	for (guint n = 0; n < outstreams->len; n++) {
+		GOutputStream *outstream = g_ptr_array_index(outstreams, n);
+		GError **slot_error = &slot_errors[out_slots[n]];
+
+		slot_written[out_slots[n]] = out_written[n];
+
+		if (out_errors[n]) {
+			g_propagate_prefixed_error(slot_error, out_errors[n], "Failed to copy data: ");
+			continue;
+		}
+
+		if (read_size != (goffset)image->checksum.size) {
+			g_set_error(slot_error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED,
+					"Written size (%"G_GOFFSET_FORMAT ") != image size (%"G_GOFFSET_FORMAT ")", read_size, image->checksum.size);
+			continue;
+		}
+
+		/* flush to block device before closing to assure content is written to disk */
+		if (timed_fsync(out_fds[n]) == -1) {
+			int err = errno;
+			g_set_error(slot_error, R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED, "Syncing content to disk failed: %s", g_strerror(err));
+			continue;
+		}
+
+		(void)g_output_stream_close(outstream, NULL, slot_error);
+	}
+
+	return TRUE;
+}
@@ -1,15 +1,19 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <gio/gio.h>
+#include <gio/gfiledescriptorbased.h>
 #include <glib.h>
 #include <glib/gstdio.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "update_handler.h"
 #include "update_utils.h"
 #include "context.h"
+#include "utils.h"
+#include "verity_hash.h"
 
 static GUnixOutputStream* open_unix_output_stream(const gchar *filename, int flags, int mode, int *fd, GError **error)
 {
@@ -85,14 +89,700 @@ GUnixInputStream* r_open_unix_input_stream(const gchar *filename, int *fd, GErro
 	return instream;
 }
 
+/* size of each copy buffer and maximum length of a single copy_file_range() call */
+#define COPY_BLOCK_SIZE (4*1024*1024)
+
+typedef struct {
+	int fd;
+	goffset start; /* file offset at which the copy started */
+	goffset size; /* window size, 0 if disabled */
+	goffset submitted; /* number of bytes for which writeback was started */
+} RaucWriteBehind;
+
+static void write_behind_init(RaucWriteBehind *wb, int fd)
+{
+	wb->fd = fd;
+	wb->size = r_context()->config ? r_context()->config->write_behind_size : 0;
+	wb->submitted = 0;
+	if (!wb->size)
+		return;
+
+	wb->start = lseek(fd, 0, SEEK_CUR);
+	if (wb->start < 0)
+		wb->size = 0;
+}
+
+/**
+ * Starts writeback for each complete window written so far.
+ *
+ * Before that, the previous window is waited for and dropped from the page
+ * cache, so that at most two windows of dirty data are pending. The final
+ * fsync() is still needed for durability.
+ */
+static void write_behind_update(RaucWriteBehind *wb, goffset written)
+{
+	while (wb->size && written - wb->submitted >= wb->size) {
+		goffset offset = wb->start + wb->submitted;
+
+		if (wb->submitted >= wb->size) {
+			goffset prev = offset - wb->size;
+
+			if (sync_file_range(wb->fd, prev, wb->size,
+					SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) == 0)
+				(void)posix_fadvise(wb->fd, prev, wb->size, POSIX_FADV_DONTNEED);
+		}
+
+		if (sync_file_range(wb->fd, offset, wb->size, SYNC_FILE_RANGE_WRITE) != 0) {
+			int err = errno;
+			g_debug("Disabling write-behind: sync_file_range failed: %s", g_strerror(err));
+			wb->size = 0;
+			break;
+		}
+		wb->submitted += wb->size;
+	}
+}
+
+/**
+ * Drops data which was already copied from the page cache of the source.
+ */
+static void drop_source_cache(gboolean enabled, int in_fd, goffset offset, goffset len)
+{
+	if (enabled && offset >= 0)
+		(void)posix_fadvise(in_fd, offset, len, POSIX_FADV_DONTNEED);
+}
+
+/* the GMutex in a static bucket needs no initialization */
+static RaucTokenBucket copy_rate_limit;
+
+void r_copy_set_rate_limit(guint64 rate)
+{
+	r_token_bucket_set_rate(&copy_rate_limit, rate);
+}
+
+void r_copy_throttle(gsize len)
+{
+	r_token_bucket_consume(&copy_rate_limit, len);
+}
+
+static GPrivate copy_progress_sink;
+
+void r_copy_image_progress_redirect(RaucCopyProgress *progress)
+{
+	g_private_set(&copy_progress_sink, progress);
+}
+
+void r_copy_image_progress(gint64 *last_update, goffset done, goffset total)
+{
+	RaucCopyProgress *sink = g_private_get(&copy_progress_sink);
+	gint64 now;
+
+	g_return_if_fail(last_update);
+
+	if (total <= 0)
+		return;
+
+	/* worker threads must not touch the progress context */
+	if (sink) {
+		g_mutex_lock(&sink->lock);
+		sink->done = MIN(done, total);
+		sink->total = total;
+		g_mutex_unlock(&sink->lock);
+		return;
+	}
+
+	/* emit progress info (but only when in progress context) */
+	if (!r_context_in_progress_step(NULL))
+		return;
+
+	now = g_get_monotonic_time();
+	if (done < total && now - *last_update < R_COPY_PROGRESS_INTERVAL)
+		return;
+	*last_update = now;
+
+	r_context_set_step_bytes("copy_image", done, total);
+}
+
+static GPrivate copy_verity_tree;
+
+void r_copy_set_verity_tree(RaucVerityTree *tree)
+{
+	g_private_set(&copy_verity_tree, tree);
+}
+
+RaucVerityTree *r_copy_get_verity_tree(void)
+{
+	return g_private_get(&copy_verity_tree);
+}
+
+static GPrivate copy_written_counter;
+
+void r_copy_set_written_counter(goffset *counter)
+{
+	g_private_set(&copy_written_counter, counter);
+}
+
+void r_copy_count_written(goffset len)
+{
+	goffset *counter = g_private_get(&copy_written_counter);
+
+	if (!counter)
+		return;
+
+	*counter = MAX(*counter, 0) + len;
+}
+
+/**
+ * Returns the file descriptor of an unbuffered stream, or -1.
+ */
+static int get_stream_fd(gpointer stream)
+{
+	if (G_IS_FILE_DESCRIPTOR_BASED(stream))
+		return g_file_descriptor_based_get_fd(G_FILE_DESCRIPTOR_BASED(stream));
+	if (G_IS_UNIX_INPUT_STREAM(stream))
+		return g_unix_input_stream_get_fd(G_UNIX_INPUT_STREAM(stream));
+	if (G_IS_UNIX_OUTPUT_STREAM(stream))
+		return g_unix_output_stream_get_fd(G_UNIX_OUTPUT_STREAM(stream));
+
+	return -1;
+}
+
+/**
+ * Copies using copy_file_range(), so that the data doesn't pass through
+ * userspace and the filesystem can use reflinks.
+ *
+ * If copy_file_range() is not supported for the given file descriptors (for
+ * example for block devices or across filesystems on older kernels), nothing
+ * is copied and 'handled' is set to FALSE.
+ */
+static gboolean copy_fd_range(int in_fd, int out_fd, goffset size, gboolean *handled, GError **error)
+{
+	RaucWriteBehind wb = {0};
+	goffset in_start = lseek(in_fd, 0, SEEK_CUR);
+	goffset sum_size = 0;
+	gint64 last_progress = 0;
+
+	*handled = FALSE;
+	write_behind_init(&wb, out_fd);
+
+	while (TRUE) {
+		ssize_t ret = TEMP_FAILURE_RETRY(copy_file_range(in_fd, NULL, out_fd, NULL, COPY_BLOCK_SIZE, 0));
+		if (ret < 0) {
+			int err = errno;
+			if (!sum_size && (err == EXDEV || err == EINVAL || err == ENOSYS || err == EOPNOTSUPP || err == EBADF))
+				return TRUE;
+			g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
+					"copy_file_range failed: %s", g_strerror(err));
+			*handled = TRUE;
+			return FALSE;
+		}
+		if (!ret) {
+			/* some special files report no data, so fall back to reading them */
+			if (!sum_size)
+				return TRUE;
+			break;
+		}
+		*handled = TRUE;
+
+		drop_source_cache(wb.size > 0, in_fd, in_start + sum_size, ret);
+		sum_size += ret;
+		r_copy_count_written(ret);
+		write_behind_update(&wb, sum_size);
+		r_copy_image_progress(&last_progress, sum_size, size);
+		r_copy_throttle(ret);
+	}
+
+	return TRUE;
+}
+
+typedef struct {
+	guint8 *data;
+	gsize len; /* 0 signals the end of the data */
+	gboolean zero; /* data contains only zeros */
+	gint users; /* writers which still need the buffer */
+} CopyBuffer;
+
+typedef struct {
+	int out_fd;
+	goffset out_start; /* offset of the first byte in the target */
+	RaucWriteBehind wb;
+	GAsyncQueue *full; /* buffers to be written */
+	GAsyncQueue *empty; /* buffers available for reading */
+	gboolean zero_unsupported; /* set after the first failed attempt */
+	goffset zeroed; /* bytes zeroed without writing data */
+	goffset written; /* bytes written as data */
+	gint failed;
+	GError *error;
+} CopyWriter;
+
+/**
+ * Zeroes the next buffer in the target without writing the data, if
+ * possible. Returns FALSE if the data must be written instead.
+ */
+static gboolean copy_writer_zero(CopyWriter *writer, CopyBuffer *buffer, goffset written)
+{
+	g_autoptr(GError) ierror = NULL;
+	goffset offset = writer->out_start + written;
+
+	/* BLKZEROOUT requires sector alignment */
+	if (writer->zero_unsupported || writer->out_start < 0 || offset % 4096 || buffer->len % 4096)
+		return FALSE;
+
+	if (!r_zero_range(writer->out_fd, offset, buffer->len, &ierror)) {
+		g_debug("Writing zeros instead of zeroing range: %s", ierror->message);
+		writer->zero_unsupported = TRUE;
+		return FALSE;
+	}
+
+	if (lseek(writer->out_fd, buffer->len, SEEK_CUR) < 0) {
+		/* the range was zeroed, but the position is unknown now */
+		int err = errno;
+		g_set_error(&writer->error, G_IO_ERROR, g_io_error_from_errno(err),
+				"Failed to skip zeroed range: %s", g_strerror(err));
+		g_atomic_int_set(&writer->failed, TRUE);
+		return TRUE;
+	}
+
+	writer->zeroed += buffer->len;
+	return TRUE;
+}
+
+/* passes a buffer to the given writers */
+static void copy_buffer_submit(CopyWriter *writers, guint n_writers, CopyBuffer *buffer)
+{
+	g_atomic_int_set(&buffer->users, n_writers);
+	for (guint i = 0; i < n_writers; i++)
+		g_async_queue_push(writers[i].full, buffer);
+}
+
+/* returns the buffer for reading once all writers are done with it */
+static void copy_writer_release(CopyWriter *writer, CopyBuffer *buffer)
+{
+	if (g_atomic_int_dec_and_test(&buffer->users))
+		g_async_queue_push(writer->empty, buffer);
+}
+
+static gpointer copy_writer_thread(gpointer data)
+{
+	CopyWriter *writer = data;
+	goffset written = 0;
+
+	while (TRUE) {
+		CopyBuffer *buffer = g_async_queue_pop(writer->full);
+
+		if (!buffer->len) {
+			copy_writer_release(writer, buffer);
+			break;
+		}
+
+		if (!g_atomic_int_get(&writer->failed)) {
+			if (buffer->zero && copy_writer_zero(writer, buffer, written)) {
+				written += buffer->len;
+				write_behind_update(&writer->wb, written);
+			} else if (r_write_exact(writer->out_fd, buffer->data, buffer->len, &writer->error)) {
+				written += buffer->len;
+				writer->written += buffer->len;
+				write_behind_update(&writer->wb, written);
+			} else {
+				g_atomic_int_set(&writer->failed, TRUE);
+			}
+		}
+
+		copy_writer_release(writer, buffer);
+	}
+
+	return NULL;
+}
+
+/**
+ * Checks if the next len bytes of the input are in a hole, so that they don't
+ * need to be read. The file position is left unchanged.
+ */
+static gboolean input_is_hole(int in_fd, goffset pos, gsize len)
+{
+	goffset data = lseek(in_fd, pos, SEEK_DATA);
+	int err = errno;
+
+	if (lseek(in_fd, pos, SEEK_SET) != pos)
+		return FALSE;
+
+	/* ENXIO means that only a hole follows up to the end of the file */
+	if (data < 0)
+		return err == ENXIO;
+
+	return data >= pos + (goffset)len;
+}
+
+/**
+ * Copies using large buffers, with reading and writing in separate threads.
+ *
+ * Two buffers are used alternately, so that reading the next block (which
+ * may include decompression by squashfs) overlaps with writing the previous
+ * one to the target device.
+ *
+ * If sparse is set, holes in the input (found with SEEK_DATA) are not read
+ * and blocks containing only zeros (such as sparse blocks in squashfs, which
+ * does not report holes) are not written. Instead, the corresponding range
+ * of the target is zeroed using BLKZEROOUT or by punching a hole. This falls
+ * back to writing the zeros if the target doesn't support it.
+ *
+ * If the target is a block device, the block size is rounded up to the
+ * preferred write size (optimal I/O size, erase block or discard granularity)
+ * and the first block is shortened if needed, so that all following writes
+ * start on a boundary of the underlying device. This matters if the image
+ * doesn't start at the beginning of the slot (e.g. after a skipped header).
+ */
+static gboolean copy_fd_buffered(int in_fd, int out_fd, goffset size, gsize block_size, gboolean sparse, GError **error)
+{
+	CopyBuffer buffers[2] = {0};
+	CopyWriter writer = {0};
+	GThread *thread = NULL;
+	RaucVerityTree *verity = r_copy_get_verity_tree();
+	goffset in_start = lseek(in_fd, 0, SEEK_CUR);
+	goffset out_start = lseek(out_fd, 0, SEEK_CUR);
+	goffset sum_size = 0;
+	gint64 last_progress = 0;
+	gboolean drop_source;
+	gboolean read_failed = FALSE;
+	gboolean res = FALSE;
+	struct stat in_st = {0};
+	goffset in_end = -1;
+	RaucBlockTopology topology;
+	gsize next_len = block_size;
+
+	/* holes can only be found in regular files */
+	if (sparse && in_start >= 0 && fstat(in_fd, &in_st) == 0 && S_ISREG(in_st.st_mode))
+		in_end = in_st.st_size;
+
+	if (out_start >= 0 && r_block_topology_probe(out_fd, &topology)) {
+		g_autofree gchar *description = r_block_topology_to_string(&topology);
+		guint64 first_len;
+
+		if (block_size % topology.write_size)
+			block_size = (block_size / topology.write_size + 1) * topology.write_size;
+		first_len = r_block_topology_to_boundary(&topology, out_start);
+		if (first_len)
+			next_len = first_len;
+		else
+			next_len = block_size;
+
+		g_message("Writing in blocks of %"G_GSIZE_FORMAT " bytes, %s", block_size, description);
+	}
+
+	writer.out_fd = out_fd;
+	writer.out_start = out_start;
+	write_behind_init(&writer.wb, out_fd);
+	/* the writer thread may disable write-behind for the target later */
+	drop_source = writer.wb.size > 0;
+	writer.full = g_async_queue_new();
+	writer.empty = g_async_queue_new();
+	for (guint i = 0; i < G_N_ELEMENTS(buffers); i++) {
+		buffers[i].data = g_malloc(block_size);
+		g_async_queue_push(writer.empty, &buffers[i]);
+	}
+
+	thread = g_thread_new("copy-writer", copy_writer_thread, &writer);
+
+	while (TRUE) {
+		CopyBuffer *buffer = g_async_queue_pop(writer.empty);
+		gsize pos = 0;
+
+		if (g_atomic_int_get(&writer.failed)) {
+			buffer->len = 0;
+			copy_buffer_submit(&writer, 1, buffer);
+			break;
+		}
+
+		buffer->zero = FALSE;
+		if (in_end > in_start + sum_size) {
+			gsize len = MIN((goffset)next_len, in_end - (in_start + sum_size));
+
+			if (input_is_hole(in_fd, in_start + sum_size, len) &&
+			    lseek(in_fd, len, SEEK_CUR) >= 0) {
+				memset(buffer->data, 0, len);
+				buffer->zero = TRUE;
+				pos = len;
+			}
+		}
+
+		while (pos < next_len && !buffer->zero) {
+			ssize_t ret = TEMP_FAILURE_RETRY(read(in_fd, buffer->data + pos, next_len - pos));
+			if (ret < 0) {
+				int err = errno;
+				g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
+						"Failed to read: %s", g_strerror(err));
+				read_failed = TRUE;
+				buffer->len = 0;
+				copy_buffer_submit(&writer, 1, buffer);
+				goto out;
+			}
+			if (!ret)
+				break;
+			pos += ret;
+		}
+
+		buffer->len = pos;
+		if (sparse && !buffer->zero)
+			buffer->zero = r_buffer_is_zero(buffer->data, pos);
+		copy_buffer_submit(&writer, 1, buffer);
+		if (!pos) {
+			res = TRUE;
+			break;
+		}
+
+		/* the writer only reads the buffer, so it can be hashed meanwhile */
+		if (verity && out_start >= 0 &&
+		    r_verity_tree_add(verity, out_start + sum_size, buffer->data, pos) != 0) {
+			g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+					"Failed to hash data for verity tree");
+			read_failed = TRUE;
+			buffer = g_async_queue_pop(writer.empty);
+			buffer->len = 0;
+			copy_buffer_submit(&writer, 1, buffer);
+			goto out;
+		}
+
+		drop_source_cache(drop_source, in_fd, in_start + sum_size, pos);
+		sum_size += pos;
+		next_len = block_size;
+		r_copy_image_progress(&last_progress, sum_size, size);
+		r_copy_throttle(pos);
+	}
+
+out:
+	g_thread_join(thread);
+	r_copy_count_written(writer.written);
+
+	if (writer.zeroed) {
+		g_autofree gchar *zeroed = g_format_size(writer.zeroed);
+		g_autofree gchar *total = g_format_size(sum_size);
+		g_message("Zeroed %s of %s without writing data", zeroed, total);
+	}
+
+	if (writer.error) {
+		if (!read_failed)
+			g_propagate_error(error, writer.error);
+		else
+			g_clear_error(&writer.error);
+		res = FALSE;
+	}
+
+	g_async_queue_unref(writer.empty);
+	g_async_queue_unref(writer.full);
+	for (guint i = 0; i < G_N_ELEMENTS(buffers); i++)
+		g_free(buffers[i].data);
+
+	return res;
+}
+
+gboolean r_copy_fd_with_block_size(int in_fd, int out_fd, goffset size, gsize block_size, GError **error)
+{
+	g_return_val_if_fail(in_fd >= 0, FALSE);
+	g_return_val_if_fail(out_fd >= 0, FALSE);
+	g_return_val_if_fail(size >= 0, FALSE);
+	g_return_val_if_fail(block_size > 0, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (size == 0)
+		return TRUE;
+
+	return copy_fd_buffered(in_fd, out_fd, size, block_size, FALSE, error);
+}
+
+/* number of buffers shared by the writers of a fan-out copy */
+#define FAN_OUT_BUFFERS 4
+
+static guint64 gcd_u64(guint64 a, guint64 b)
+{
+	while (b) {
+		guint64 t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/* Returns the length of the first block, so that the following ones start on
+ * a boundary of every target with a probed topology, or 0 if all targets are
+ * aligned already or no common boundary exists. As all boundaries repeat
+ * after 'align' bytes, it is enough to check the boundaries of one target
+ * within that range. */
+static gsize fan_out_first_len(const CopyWriter *writers, const RaucBlockTopology *topologies, guint n_out, guint64 align)
+{
+	const RaucBlockTopology *first = NULL;
+	guint64 len;
+
+	for (guint i = 0; i < n_out && !first; i++) {
+		if (topologies[i].write_size)
+			first = &topologies[i];
+	}
+	if (!first)
+		return 0;
+
+	for (len = r_block_topology_to_boundary(first, writers[first - topologies].out_start);
+	     len < align; len += first->write_size) {
+		gboolean aligned = TRUE;
+
+		for (guint i = 0; i < n_out && aligned; i++) {
+			if (topologies[i].write_size &&
+			    r_block_topology_to_boundary(&topologies[i], writers[i].out_start + len))
+				aligned = FALSE;
+		}
+		if (aligned)
+			return len;
+	}
+
+	g_message("Targets have no common write boundary, not aligning the first block");
+	return 0;
+}
+
+gboolean r_copy_fd_fan_out(int in_fd, const int *out_fds, guint n_out, goffset size, GError **out_errors, goffset *out_written, GError **error)
+{
+	CopyBuffer buffers[FAN_OUT_BUFFERS] = {0};
+	g_autofree CopyWriter *writers = NULL;
+	g_autofree GThread **threads = NULL;
+	g_autofree RaucBlockTopology *topologies = NULL;
+	GAsyncQueue *empty = NULL;
+	goffset in_start;
+	goffset sum_size = 0;
+	gint64 last_progress = 0;
+	gsize block_size = COPY_BLOCK_SIZE;
+	gsize next_len;
+	guint64 align = 1;
+	gboolean drop_source = FALSE;
+	gboolean res = FALSE;
+
+	g_return_val_if_fail(in_fd >= 0, FALSE);
+	g_return_val_if_fail(out_fds, FALSE);
+	g_return_val_if_fail(n_out > 0, FALSE);
+	g_return_val_if_fail(out_errors, FALSE);
+	g_return_val_if_fail(out_written, FALSE);
+	g_return_val_if_fail(size >= 0, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	in_start = lseek(in_fd, 0, SEEK_CUR);
+	writers = g_new0(CopyWriter, n_out);
+	threads = g_new0(GThread *, n_out);
+	topologies = g_new0(RaucBlockTopology, n_out);
+	empty = g_async_queue_new();
+
+	for (guint i = 0; i < n_out; i++) {
+		guint64 lcm;
+
+		writers[i].out_fd = out_fds[i];
+		writers[i].out_start = lseek(out_fds[i], 0, SEEK_CUR);
+		if (writers[i].out_start < 0 || !r_block_topology_probe(out_fds[i], &topologies[i]))
+			continue;
+
+		/* blocks must be a multiple of all write sizes, which are not
+		 * necessarily powers of two */
+		lcm = align / gcd_u64(align, topologies[i].write_size) * topologies[i].write_size;
+		if (lcm > R_BLOCK_WRITE_SIZE_MAX) {
+			g_message("Not aligning writes to target %u, as its write size %"G_GUINT32_FORMAT " doesn't fit the others",
+					i, topologies[i].write_size);
+			topologies[i].write_size = 0;
+			continue;
+		}
+		align = lcm;
+	}
+
+	if (block_size % align)
+		block_size = (block_size / align + 1) * align;
+	/* the targets may start anywhere in their devices (e.g. partitions
+	 * or images after a skipped header) */
+	next_len = fan_out_first_len(writers, topologies, n_out, align);
+	if (!next_len)
+		next_len = block_size;
+
+	for (guint i = 0; i < G_N_ELEMENTS(buffers); i++) {
+		buffers[i].data = g_malloc(block_size);
+		g_async_queue_push(empty, &buffers[i]);
+	}
+
+	for (guint i = 0; i < n_out; i++) {
+		write_behind_init(&writers[i].wb, out_fds[i]);
+		drop_source = drop_source || writers[i].wb.size > 0;
+		writers[i].full = g_async_queue_new();
+		writers[i].empty = empty;
+		threads[i] = g_thread_new("copy-writer", copy_writer_thread, &writers[i]);
+	}
+
+	g_message("Writing to %u targets in blocks of %"G_GSIZE_FORMAT " bytes (first block %"G_GSIZE_FORMAT " bytes)",
+			n_out, block_size, next_len);
+
+	while (TRUE) {
+		CopyBuffer *buffer = g_async_queue_pop(empty);
+		guint active = 0;
+		gsize pos = 0;
+
+		for (guint i = 0; i < n_out; i++) {
+			if (!g_atomic_int_get(&writers[i].failed))
+				active++;
+		}
+
+		/* reading on is pointless once all targets failed */
+		if (!active) {
+			buffer->len = 0;
+			copy_buffer_submit(writers, n_out, buffer);
+			res = TRUE;
+			break;
+		}
+
+		while (pos < next_len) {
+			ssize_t ret = TEMP_FAILURE_RETRY(read(in_fd, buffer->data + pos, next_len - pos));
+			if (ret < 0) {
+				int err = errno;
+				g_set_error(error, G_IO_ERROR, g_io_error_from_errno(err),
+						"Failed to read: %s", g_strerror(err));
+				buffer->len = 0;
+				copy_buffer_submit(writers, n_out, buffer);
+				goto out;
+			}
+			if (!ret)
+				break;
+			pos += ret;
+		}
+
+		buffer->len = pos;
+		buffer->zero = r_buffer_is_zero(buffer->data, pos);
+		copy_buffer_submit(writers, n_out, buffer);
+		if (!pos) {
+			res = TRUE;
+			break;
+		}
+
+		drop_source_cache(drop_source, in_fd, in_start + sum_size, pos);
+		sum_size += pos;
+		next_len = block_size;
+		r_copy_image_progress(&last_progress, sum_size, size);
+		/* the rate limit applies to the data written */
+		r_copy_throttle(pos * active);
+	}
+
+out:
+	for (guint i = 0; i < n_out; i++) {
+		g_thread_join(threads[i]);
+		out_errors[i] = g_steal_pointer(&writers[i].error);
+		out_written[i] = writers[i].written;
+		g_async_queue_unref(writers[i].full);
+	}
+
+	g_async_queue_unref(empty);
+	for (guint i = 0; i < G_N_ELEMENTS(buffers); i++)
+		g_free(buffers[i].data);
+
+	return res;
+}
+
 gboolean r_copy_stream_with_progress(GInputStream *in_stream, GOutputStream *out_stream,
 		goffset size, GError **error)
 {
 	GError *ierror = NULL;
 	gsize out_size = 0;
 	goffset sum_size = 0;
+	gint64 last_progress = 0;
 	gchar buffer[8192];
 	gssize in_size;
+	int in_fd, out_fd;
 
 	g_return_val_if_fail(in_stream, FALSE);
 	g_return_val_if_fail(out_stream, FALSE);
@@ -103,6 +793,24 @@ gboolean r_copy_stream_with_progress(GInputStream *in_stream, GOutputStream *out
 	if (size == 0)
 		return TRUE;
 
+	/* use the file descriptors directly if both streams are unbuffered */
+	in_fd = get_stream_fd(in_stream);
+	out_fd = get_stream_fd(out_stream);
+	if (in_fd >= 0 && out_fd >= 0) {
+		gboolean handled = FALSE;
+
+		/* copy_file_range() doesn't pass the data through userspace for hashing */
+		if (r_copy_get_verity_tree())
+			return copy_fd_buffered(in_fd, out_fd, size, COPY_BLOCK_SIZE, TRUE, error);
+
+		if (!copy_fd_range(in_fd, out_fd, size, &handled, error))
+			return FALSE;
+		if (handled)
+			return TRUE;
+
+		return copy_fd_buffered(in_fd, out_fd, size, COPY_BLOCK_SIZE, TRUE, error);
+	}
+
 	do {
 		gboolean ret;
 
@@ -120,10 +828,10 @@ gboolean r_copy_stream_with_progress(GInputStream *in_stream, GOutputStream *out
 		}
 
 		sum_size += out_size;
+		r_copy_count_written(out_size);
 
-		/* emit progress info (but only when in progress context) */
-		if (r_context()->progress)
-			r_context_set_step_percentage("copy_image", sum_size * 100 / size);
+		r_copy_image_progress(&last_progress, sum_size, size);
+		r_copy_throttle(out_size);
 	} while (out_size);
 
 	return TRUE;
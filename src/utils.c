@@ -9,8 +9,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
 #include <unistd.h>
 
+#include "trace.h"
 #include "utils.h"
 
 GQuark r_utils_error_quark(void)
@@ -51,11 +56,14 @@ gboolean r_subprocess_runv(GPtrArray *args, GSubprocessFlags flags, GError **err
 		g_propagate_error(error, ierror);
 		return FALSE;
 	}
+	R_TRACE2(subprocess_spawn, g_ptr_array_index(args, 0), g_subprocess_get_identifier(sproc));
 
 	if (!g_subprocess_wait_check(sproc, NULL, &ierror)) {
+		R_TRACE2(subprocess_exit, g_ptr_array_index(args, 0), g_subprocess_get_status(sproc));
 		g_propagate_error(error, ierror);
 		return FALSE;
 	}
+	R_TRACE2(subprocess_exit, g_ptr_array_index(args, 0), 0);
 
 	return TRUE;
 }
@@ -204,6 +212,66 @@ gboolean copy_file(const gchar *srcprefix, const gchar *srcfile,
 	return res;
 }
 
+/* maximum length of a single copy_file_range() call and size of the fallback buffer */
+#define COPY_FD_DATA_BLOCK_SIZE (1024*1024)
+
+gboolean r_copy_fd_data(int in_fd, int out_fd, GError **error)
+{
+	GError *ierror = NULL;
+	g_autofree guint8 *buffer = NULL;
+	goffset copied = 0;
+
+	g_return_val_if_fail(in_fd >= 0, FALSE);
+	g_return_val_if_fail(out_fd >= 0, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	/* share the extents if the filesystem supports reflinks */
+	if (ioctl(out_fd, FICLONE, in_fd) == 0)
+		return TRUE;
+
+	while (TRUE) {
+		ssize_t ret = TEMP_FAILURE_RETRY(copy_file_range(in_fd, NULL, out_fd, NULL, COPY_FD_DATA_BLOCK_SIZE, 0));
+		if (ret < 0) {
+			int err = errno;
+			if (!copied && (err == EXDEV || err == EINVAL || err == ENOSYS || err == EOPNOTSUPP || err == EBADF))
+				break;
+			g_set_error(error,
+					G_FILE_ERROR,
+					g_file_error_from_errno(err),
+					"copy_file_range failed: %s", g_strerror(err));
+			return FALSE;
+		}
+		if (!ret) {
+			/* some special files report no data, so fall back to reading them */
+			if (!copied)
+				break;
+			return TRUE;
+		}
+		copied += ret;
+	}
+
+	buffer = g_malloc(COPY_FD_DATA_BLOCK_SIZE);
+	while (TRUE) {
+		ssize_t ret = TEMP_FAILURE_RETRY(read(in_fd, buffer, COPY_FD_DATA_BLOCK_SIZE));
+		if (ret < 0) {
+			int err = errno;
+			g_set_error(error,
+					G_FILE_ERROR,
+					g_file_error_from_errno(err),
+					"Failed to read: %s", g_strerror(err));
+			return FALSE;
+		}
+		if (!ret)
+			break;
+		if (!r_write_exact(out_fd, buffer, ret, &ierror)) {
+			g_propagate_error(error, ierror);
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
 static int rm_tree_cb(const char *fpath, const struct stat *sb,
 		int typeflag, struct FTW *ftwbuf)
 {
@@ -607,6 +675,42 @@ gboolean r_write_exact(const int fd, const guint8 *data, size_t size, GError **e
 	return TRUE;
 }
 
+gboolean r_writev_exact(const int fd, struct iovec *iov, int iovcnt, GError **error)
+{
+	g_return_val_if_fail(iov != NULL || iovcnt == 0, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	while (iovcnt > 0) {
+		ssize_t ret = TEMP_FAILURE_RETRY(writev(fd, iov, iovcnt));
+		size_t written = 0;
+
+		if (ret < 0) {
+			int err = errno;
+			g_set_error(error,
+					G_FILE_ERROR,
+					g_file_error_from_errno(err),
+					"Failed to write: %s", g_strerror(err));
+			return FALSE;
+		}
+
+		/* skip the completely written buffers */
+		written = ret;
+		while (iovcnt > 0 && written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (guint8 *)iov->iov_base + written;
+			iov->iov_len -= written;
+		} else {
+			g_assert(written == 0);
+		}
+	}
+
+	return TRUE;
+}
+
 gboolean r_pread_exact(const int fd, guint8 *data, size_t size, off_t offset, GError **error)
 {
 	size_t pos = 0;
@@ -684,6 +788,124 @@ gboolean r_pwrite_lazy(const int fd, const guint8 *data, size_t size, off_t offs
 	return r_pwrite_exact(fd, data, size, offset, error);
 }
 
+static inline guint64 load_word(const guint8 *data)
+{
+	guint64 word;
+
+	/* compiled to a single (unaligned) load */
+	memcpy(&word, data, sizeof(word));
+
+	return word;
+}
+
+#define ZERO_CHECK_BLOCK 64
+
+gboolean r_buffer_is_zero(const guint8 *data, gsize len)
+{
+	gsize i = 0;
+
+	g_return_val_if_fail(data || len == 0, FALSE);
+
+	for (; i + ZERO_CHECK_BLOCK <= len; i += ZERO_CHECK_BLOCK) {
+		guint64 acc = 0;
+
+		for (gsize j = 0; j < ZERO_CHECK_BLOCK; j += sizeof(guint64))
+			acc |= load_word(&data[i + j]);
+		if (acc)
+			return FALSE;
+	}
+
+	for (; i < len; i++) {
+		if (data[i])
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+gboolean r_buffer_is_erased(const guint8 *data, gsize len)
+{
+	const guint64 lsb = 0x0101010101010101ULL;
+	gsize i = 0;
+
+	g_return_val_if_fail(data || len == 0, FALSE);
+
+	for (; i + ZERO_CHECK_BLOCK <= len; i += ZERO_CHECK_BLOCK) {
+		guint64 acc = 0;
+
+		for (gsize j = 0; j < ZERO_CHECK_BLOCK; j += sizeof(guint64)) {
+			guint64 word = load_word(&data[i + j]);
+
+			/* expanding the lowest bit of each byte to the whole byte
+			 * only reproduces bytes which are 0x00 or 0xFF */
+			acc |= word ^ ((word & lsb) * 0xFF);
+		}
+		if (acc)
+			return FALSE;
+	}
+
+	for (; i < len; i++) {
+		if (data[i] != 0x00 && data[i] != 0xFF)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+gboolean r_zero_range(const int fd, off_t offset, off_t size, GError **error)
+{
+	struct stat st;
+	int ret;
+
+	g_return_val_if_fail(offset >= 0, FALSE);
+	g_return_val_if_fail(size >= 0, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	if (fstat(fd, &st) != 0) {
+		int err = errno;
+		g_set_error(error,
+				G_FILE_ERROR,
+				g_file_error_from_errno(err),
+				"Failed to stat: %s", g_strerror(err));
+		return FALSE;
+	}
+
+	if (S_ISBLK(st.st_mode)) {
+		guint64 range[2] = {offset, size};
+		ret = ioctl(fd, BLKZEROOUT, &range);
+	} else if (S_ISREG(st.st_mode)) {
+		ret = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size);
+		/* punching a hole never extends the file, so a range at the end
+		 * would otherwise be missing */
+		if (ret == 0 && offset + size > st.st_size)
+			ret = ftruncate(fd, offset + size);
+	} else {
+		g_set_error(error,
+				R_UTILS_ERROR,
+				R_UTILS_ERROR_NOT_SUPPORTED,
+				"Zeroing ranges is not supported for this file type");
+		return FALSE;
+	}
+
+	if (ret != 0) {
+		int err = errno;
+		if (err == EOPNOTSUPP || err == ENOTTY || err == EINVAL || err == ENOSYS) {
+			g_set_error(error,
+					R_UTILS_ERROR,
+					R_UTILS_ERROR_NOT_SUPPORTED,
+					"Zeroing ranges is not supported: %s", g_strerror(err));
+		} else {
+			g_set_error(error,
+					G_FILE_ERROR,
+					g_file_error_from_errno(err),
+					"Failed to zero range: %s", g_strerror(err));
+		}
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 guint get_sectorsize(gint fd)
 {
 	guint sector_size;
@@ -721,6 +943,93 @@ goffset get_device_size(gint fd, GError **error)
 	return size;
 }
 
+/**
+ * Reads an unsigned integer attribute from sysfs, returning 0 if it doesn't
+ * exist or is invalid.
+ */
+static guint64 read_sysfs_u64(const gchar *dir, const gchar *name)
+{
+	g_autofree gchar *path = g_build_filename(dir, name, NULL);
+	g_autofree gchar *contents = NULL;
+	gchar *end = NULL;
+	guint64 value;
+
+	if (!g_file_get_contents(path, &contents, NULL, NULL))
+		return 0;
+
+	g_strstrip(contents);
+	value = g_ascii_strtoull(contents, &end, 10);
+	if (end == contents || *end != '\0')
+		return 0;
+
+	return value;
+}
+
+gboolean r_block_topology_probe(gint fd, RaucBlockTopology *topology)
+{
+	g_autofree gchar *dev_dir = NULL;
+	g_autofree gchar *disk_dir = NULL;
+	g_autofree gchar *partition = NULL;
+	struct stat st;
+
+	g_return_val_if_fail(topology, FALSE);
+
+	memset(topology, 0, sizeof(*topology));
+
+	if (fstat(fd, &st) != 0 || !S_ISBLK(st.st_mode))
+		return FALSE;
+
+	topology->logical_block_size = get_sectorsize(fd);
+
+	dev_dir = g_strdup_printf("/sys/dev/block/%u:%u", major(st.st_rdev), minor(st.st_rdev));
+	partition = g_build_filename(dev_dir, "partition", NULL);
+	if (g_file_test(partition, G_FILE_TEST_EXISTS)) {
+		/* 'start' is always in units of 512 bytes */
+		topology->offset = read_sysfs_u64(dev_dir, "start") * 512;
+		disk_dir = g_build_filename(dev_dir, "..", NULL);
+	} else {
+		disk_dir = g_strdup(dev_dir);
+	}
+
+	topology->minimum_io_size = read_sysfs_u64(disk_dir, "queue/minimum_io_size");
+	topology->optimal_io_size = read_sysfs_u64(disk_dir, "queue/optimal_io_size");
+	topology->discard_granularity = read_sysfs_u64(disk_dir, "queue/discard_granularity");
+	topology->erase_size = read_sysfs_u64(disk_dir, "device/preferred_erase_size");
+
+	topology->write_size = MAX(topology->optimal_io_size, topology->erase_size);
+	topology->write_size = MAX(topology->write_size, topology->discard_granularity);
+	topology->write_size = MIN(topology->write_size, R_BLOCK_WRITE_SIZE_MAX);
+	topology->write_size = MAX(topology->write_size, topology->minimum_io_size);
+	topology->write_size = MAX(topology->write_size, topology->logical_block_size);
+
+	return TRUE;
+}
+
+guint64 r_block_topology_to_boundary(const RaucBlockTopology *topology, guint64 offset)
+{
+	guint64 rest;
+
+	g_return_val_if_fail(topology, 0);
+
+	if (!topology->write_size)
+		return 0;
+
+	rest = (topology->offset + offset) % topology->write_size;
+
+	return rest ? topology->write_size - rest : 0;
+}
+
+gchar *r_block_topology_to_string(const RaucBlockTopology *topology)
+{
+	g_return_val_if_fail(topology, NULL);
+
+	return g_strdup_printf("write size %"G_GUINT32_FORMAT " (optimal I/O %"G_GUINT32_FORMAT
+			", minimum I/O %"G_GUINT32_FORMAT ", erase size %"G_GUINT32_FORMAT
+			", discard granularity %"G_GUINT32_FORMAT ", offset %"G_GUINT64_FORMAT ")",
+			topology->write_size, topology->optimal_io_size, topology->minimum_io_size,
+			topology->erase_size, topology->discard_granularity, topology->offset);
+}
+
 void r_replace_strdup(gchar **dst, const gchar *src)
 {
 	g_free(*dst);
@@ -822,6 +1131,71 @@ gboolean r_syncfs(const gchar *path, GError **error)
 	return TRUE;
 }
 
+gboolean r_file_set_contents_durable(const gchar *filename, const gchar *contents, gsize length, GError **error)
+{
+	GError *ierror = NULL;
+	g_autofree gchar *dirname = NULL;
+	g_autofree gchar *tmp_name = NULL;
+	g_auto(filedesc) fd = -1;
+	g_auto(filedesc) dir_fd = -1;
+
+	g_return_val_if_fail(filename != NULL, FALSE);
+	g_return_val_if_fail(contents != NULL || length == 0, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	dirname = g_path_get_dirname(filename);
+	tmp_name = g_strdup_printf("%s.XXXXXX", filename);
+	fd = g_mkstemp_full(tmp_name, O_WRONLY | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		int err = errno;
+		g_set_error(error,
+				G_FILE_ERROR,
+				g_file_error_from_errno(err),
+				"Failed to create temporary file for %s: %s", filename, g_strerror(err));
+		return FALSE;
+	}
+
+	if (!r_write_exact(fd, (const guint8 *)contents, length, &ierror)) {
+		g_propagate_prefixed_error(error, ierror, "Failed to write %s: ", tmp_name);
+		goto out_unlink;
+	}
+
+	if (fsync(fd) == -1) {
+		int err = errno;
+		g_set_error(error,
+				G_FILE_ERROR,
+				g_file_error_from_errno(err),
+				"Failed to sync %s: %s", tmp_name, g_strerror(err));
+		goto out_unlink;
+	}
+
+	if (g_rename(tmp_name, filename) == -1) {
+		int err = errno;
+		g_set_error(error,
+				G_FILE_ERROR,
+				g_file_error_from_errno(err),
+				"Failed to rename %s to %s: %s", tmp_name, filename, g_strerror(err));
+		goto out_unlink;
+	}
+
+	/* make the rename itself durable */
+	dir_fd = g_open(dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0);
+	if (dir_fd == -1 || fsync(dir_fd) == -1) {
+		int err = errno;
+		g_set_error(error,
+				G_FILE_ERROR,
+				g_file_error_from_errno(err),
+				"Failed to sync directory %s: %s", dirname, g_strerror(err));
+		return FALSE;
+	}
+
+	return TRUE;
+
+out_unlink:
+	g_unlink(tmp_name);
+	return FALSE;
+}
+
 gchar* r_fakeroot_init(GError **error)
 {
 	GError *ierror = NULL;
@@ -1113,3 +1487,121 @@ gchar *r_regex_match_simple(const gchar *pattern, const gchar *string)
 
 	return NULL;
 }
+
+/* see linux/ioprio.h, which is not available on older systems */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_PRIO_MASK ((1 << IOPRIO_CLASS_SHIFT) - 1)
+#define IOPRIO_WHO_PROCESS 1
+
+gboolean r_get_thread_priority(RaucThreadPriority *priority, GError **error)
+{
+	int ioprio;
+
+	g_return_val_if_fail(priority, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	/* getpriority() can legitimately return -1 */
+	errno = 0;
+	priority->nice = getpriority(PRIO_PROCESS, 0);
+	if (priority->nice == -1 && errno) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to get CPU priority: %s", g_strerror(err));
+		return FALSE;
+	}
+
+	ioprio = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+	if (ioprio < 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to get I/O priority: %s", g_strerror(err));
+		return FALSE;
+	}
+	priority->io_class = ioprio >> IOPRIO_CLASS_SHIFT;
+	priority->io_level = ioprio & IOPRIO_PRIO_MASK;
+
+	return TRUE;
+}
+
+gboolean r_set_thread_priority(const RaucThreadPriority *priority, GError **error)
+{
+	int ioprio;
+
+	g_return_val_if_fail(priority, FALSE);
+	g_return_val_if_fail(error == NULL || *error == NULL, FALSE);
+
+	/* On Linux, both priorities apply to the calling thread only. */
+	if (setpriority(PRIO_PROCESS, 0, priority->nice) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to set CPU priority to %d: %s", priority->nice, g_strerror(err));
+		return FALSE;
+	}
+
+	ioprio = (priority->io_class << IOPRIO_CLASS_SHIFT) | (priority->io_level & IOPRIO_PRIO_MASK);
+	if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio) != 0) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+				"Failed to set I/O priority: %s", g_strerror(err));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+void r_token_bucket_init(RaucTokenBucket *bucket, guint64 rate)
+{
+	g_return_if_fail(bucket);
+
+	g_mutex_init(&bucket->lock);
+	bucket->rate = rate;
+	bucket->tokens = rate;
+	bucket->last_refill = g_get_monotonic_time();
+}
+
+void r_token_bucket_set_rate(RaucTokenBucket *bucket, guint64 rate)
+{
+	g_return_if_fail(bucket);
+
+	g_mutex_lock(&bucket->lock);
+	bucket->rate = rate;
+	bucket->tokens = rate;
+	bucket->last_refill = g_get_monotonic_time();
+	g_mutex_unlock(&bucket->lock);
+}
+
+void r_token_bucket_consume(RaucTokenBucket *bucket, guint64 bytes)
+{
+	gint64 now;
+	gint64 wait = 0;
+
+	g_return_if_fail(bucket);
+
+	g_mutex_lock(&bucket->lock);
+	if (!bucket->rate) {
+		g_mutex_unlock(&bucket->lock);
+		return;
+	}
+
+	now = g_get_monotonic_time();
+	bucket->tokens += (gdouble)bucket->rate * (now - bucket->last_refill) / G_USEC_PER_SEC;
+	bucket->tokens = MIN(bucket->tokens, (gdouble)bucket->rate);
+	bucket->last_refill = now;
+
+	/* Take the tokens right away, so that concurrent callers queue up
+	 * behind this one instead of all waiting for the same refill. */
+	bucket->tokens -= bytes;
+	if (bucket->tokens < 0)
+		wait = -bucket->tokens * G_USEC_PER_SEC / bucket->rate;
+	g_mutex_unlock(&bucket->lock);
+
+	if (wait > 0)
+		g_usleep(wait);
+}
+
+void r_token_bucket_clear(RaucTokenBucket *bucket)
+{
+	g_return_if_fail(bucket);
+
+	g_mutex_clear(&bucket->lock);
+}
@@ -19,11 +19,13 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <unistd.h>
 #include <glib.h>
 
 #include <openssl/bio.h>
@@ -34,6 +36,10 @@
 #include "verity_hash.h"
 
 #define VERITY_MAX_LEVELS	63
+/* number of blocks read at once when creating a hash level */
+#define VERITY_READ_BLOCKS	256
+/* upper limit for the threads used to create a hash level */
+#define VERITY_MAX_THREADS	16
 
 const size_t data_block_size = 4096;
 const size_t hash_block_size = 4096;
@@ -270,6 +276,192 @@ static int create_or_verify(FILE *rd, FILE *wr,
 	return 0;
 }
 
+typedef struct {
+	int fd;
+	uint64_t data_block; /* first block of the level's input */
+	uint64_t start, end; /* range of input blocks handled by this job */
+	uint8_t *digests; /* output for the whole level */
+	const uint8_t *salt;
+	int r;
+} VerityLevelJob;
+
+static int pread_full(int fd, uint8_t *buf, size_t size, uint64_t offset)
+{
+	size_t pos = 0;
+
+	while (pos < size) {
+		ssize_t ret = TEMP_FAILURE_RETRY(pread(fd, buf + pos, size - pos, offset + pos));
+		if (ret <= 0)
+			return -EIO;
+		pos += ret;
+	}
+	return 0;
+}
+
+static int pwrite_full(int fd, const uint8_t *buf, size_t size, uint64_t offset)
+{
+	size_t pos = 0;
+
+	while (pos < size) {
+		ssize_t ret = TEMP_FAILURE_RETRY(pwrite(fd, buf + pos, size - pos, offset + pos));
+		if (ret <= 0)
+			return -EIO;
+		pos += ret;
+	}
+	return 0;
+}
+
+/*
+ * Prepares a digest context which has already hashed the salt.
+ *
+ * The salt is the same for all blocks, so it is hashed only once and the
+ * context is copied for each block.
+ */
+static EVP_MD_CTX *salted_ctx_new(const uint8_t *salt)
+{
+	EVP_MD_CTX *salted = EVP_MD_CTX_new();
+
+	if (!salted)
+		return NULL;
+
+	if (EVP_DigestInit(salted, EVP_sha256()) != 1 ||
+	    EVP_DigestUpdate(salted, salt, salt_size) != 1) {
+		EVP_MD_CTX_free(salted);
+		return NULL;
+	}
+
+	return salted;
+}
+
+static int hash_blocks(EVP_MD_CTX *salted, EVP_MD_CTX *mdctx,
+		const uint8_t *data, uint64_t count, uint8_t *digests)
+{
+	for (uint64_t i = 0; i < count; i++) {
+		unsigned int tmp_size = 0;
+
+		if (EVP_MD_CTX_copy_ex(mdctx, salted) != 1 ||
+		    EVP_DigestUpdate(mdctx, data + i * data_block_size, data_block_size) != 1 ||
+		    EVP_DigestFinal(mdctx, digests + i * digest_size, &tmp_size) != 1)
+			return -EINVAL;
+		g_assert(tmp_size == digest_size);
+	}
+
+	return 0;
+}
+
+static gpointer create_level_thread(gpointer data)
+{
+	VerityLevelJob *job = data;
+	g_autofree uint8_t *buf = g_malloc(VERITY_READ_BLOCKS * data_block_size);
+	EVP_MD_CTX *salted = salted_ctx_new(job->salt);
+	EVP_MD_CTX *mdctx = EVP_MD_CTX_new();
+
+	if (!salted || !mdctx) {
+		job->r = -EINVAL;
+		goto out;
+	}
+
+	for (uint64_t block = job->start; block < job->end; block += VERITY_READ_BLOCKS) {
+		uint64_t count = MIN(VERITY_READ_BLOCKS, job->end - block);
+
+		job->r = pread_full(job->fd, buf, count * data_block_size,
+				(job->data_block + block) * data_block_size);
+		if (job->r)
+			goto out;
+
+		job->r = hash_blocks(salted, mdctx, buf, count, job->digests + block * digest_size);
+		if (job->r)
+			goto out;
+	}
+
+out:
+	EVP_MD_CTX_free(mdctx);
+	EVP_MD_CTX_free(salted);
+	return NULL;
+}
+
+/*
+ * Creates or verifies one level of the hash tree.
+ *
+ * The blocks are hashed by multiple threads, each handling a contiguous range
+ * with large reads. As the digests of version 1 have no padding, the level is
+ * assembled in memory and written at once, resulting in the same layout as
+ * create_or_verify(). For verification, the stored level (including the
+ * zeroed spare area) is compared with the calculated one.
+ */
+static int create_or_verify_level(int fd,
+		uint64_t data_block,
+		uint64_t hash_block,
+		uint64_t blocks,
+		int verify,
+		const uint8_t *salt)
+{
+	size_t hash_per_block = 1 << get_bits_down(hash_block_size / digest_size);
+	uint64_t blocks_to_write = (blocks + hash_per_block - 1) / hash_per_block;
+	uint64_t level_size;
+	VerityLevelJob jobs[VERITY_MAX_THREADS] = {0};
+	GThread *threads[VERITY_MAX_THREADS] = {0};
+	g_autofree uint8_t *digests = NULL;
+	guint n_threads;
+	int r = 0;
+
+	g_assert((1U << get_bits_up(digest_size)) == digest_size);
+
+	if (uint64_mult_overflow(&level_size, blocks_to_write, hash_block_size) ||
+	    level_size > G_MAXSIZE) {
+		g_message("Hash level size overflow.");
+		return -EINVAL;
+	}
+	digests = g_malloc0(level_size);
+
+	n_threads = CLAMP(g_get_num_processors(), 1, VERITY_MAX_THREADS);
+	n_threads = MIN(n_threads, (blocks + VERITY_READ_BLOCKS - 1) / VERITY_READ_BLOCKS);
+
+	for (guint i = 0; i < n_threads; i++) {
+		jobs[i].fd = fd;
+		jobs[i].data_block = data_block;
+		jobs[i].start = blocks * i / n_threads;
+		jobs[i].end = blocks * (i + 1) / n_threads;
+		jobs[i].digests = digests;
+		jobs[i].salt = salt;
+		threads[i] = g_thread_new("verity", create_level_thread, &jobs[i]);
+	}
+
+	for (guint i = 0; i < n_threads; i++) {
+		g_thread_join(threads[i]);
+		if (jobs[i].r && !r)
+			r = jobs[i].r;
+	}
+	if (r)
+		return r;
+
+	if (verify) {
+		g_autofree uint8_t *stored = g_malloc(level_size);
+
+		r = pread_full(fd, stored, level_size, hash_block * hash_block_size);
+		if (r)
+			return r;
+
+		if (memcmp(stored, digests, level_size)) {
+			uint64_t i = 0;
+
+			while (i < blocks && !memcmp(stored + i * digest_size, digests + i * digest_size, digest_size))
+				i++;
+			if (i < blocks)
+				g_message("Verification failed at position %" PRIu64 ".",
+						(data_block + i) * data_block_size);
+			else
+				g_message("Spare area is not zeroed in hash block %" PRIu64 ".",
+						hash_block + blocks / hash_per_block);
+			return -EPERM;
+		}
+
+		return 0;
+	}
+
+	return pwrite_full(fd, digests, level_size, hash_block * hash_block_size);
+}
+
 /*
  * Verifies or creates a dm-verity hash (tree)
  *
@@ -294,7 +486,8 @@ static int verity_create_or_verify_hash(
 	uint64_t hash_position = data_blocks;
 	uint8_t calculated_digest[digest_size];
 	FILE *data_file = NULL;
-	FILE *hash_file = NULL, *hash_file_2;
+	FILE *hash_file = NULL;
+	int level_fd = -1;
 	uint64_t hash_level_block[VERITY_MAX_LEVELS];
 	uint64_t hash_level_size[VERITY_MAX_LEVELS];
 	uint64_t data_device_size = 0, hash_device_size = 0;
@@ -349,34 +542,29 @@ static int verity_create_or_verify_hash(
 
 	memset(calculated_digest, 0, digest_size);
 
+	level_fd = open(file, (verify ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+	if (level_fd < 0) {
+		g_message("Cannot open file %s.",
+				file);
+		r = -EIO;
+		goto out;
+	}
+
 	for (i = 0; i < levels; i++) {
-		if (!i) {
-			r = create_or_verify(data_file, hash_file,
-					0,
-					hash_level_block[i],
-					data_blocks, verify,
-					calculated_digest, salt);
-			if (r)
-				goto out;
-		} else {
-			hash_file_2 = fopen(file, "r");
-			if (!hash_file_2) {
-				g_message("Cannot open device %s.",
-						file);
-				r = -EIO;
-				goto out;
-			}
-			r = create_or_verify(hash_file_2, hash_file,
-					hash_level_block[i - 1],
-					hash_level_block[i],
-					hash_level_size[i - 1], verify,
-					calculated_digest, salt);
-			fclose(hash_file_2);
-			if (r)
-				goto out;
-		}
+		if (!i)
+			r = create_or_verify_level(level_fd, 0, hash_level_block[i],
+					data_blocks, verify, salt);
+		else
+			r = create_or_verify_level(level_fd, hash_level_block[i - 1], hash_level_block[i],
+					hash_level_size[i - 1], verify, salt);
+		if (r)
+			break;
 	}
 
+	close(level_fd);
+	if (r)
+		goto out;
+
 	if (levels)
 		r = create_or_verify(hash_file, NULL,
 				hash_level_block[levels - 1],
@@ -436,3 +624,218 @@ int r_verity_hash_verify(
 {
 	return verity_create_or_verify_hash(1, fd, data_blocks, NULL, root_hash, salt);
 }
+
+struct _RaucVerityTree {
+	uint64_t data_blocks;
+	uint8_t salt[32];
+	uint8_t *digests; /* level 0, padded to full hash blocks */
+	uint8_t *hashed; /* one flag per data block */
+};
+
+/* The flags are counted instead of maintaining a counter, so that
+ * r_verity_tree_add() doesn't modify shared state. */
+static uint64_t count_missing(const RaucVerityTree *tree)
+{
+	uint64_t missing = 0;
+
+	for (uint64_t i = 0; i < tree->data_blocks; i++)
+		missing += !tree->hashed[i];
+
+	return missing;
+}
+
+RaucVerityTree *r_verity_tree_new(uint64_t data_blocks, const uint8_t *salt)
+{
+	RaucVerityTree *tree = NULL;
+	uint64_t hash_position = 0;
+	uint64_t hash_level_size[VERITY_MAX_LEVELS];
+	uint64_t level_size;
+	int levels;
+
+	g_return_val_if_fail(data_blocks > 0, NULL);
+	g_return_val_if_fail(salt, NULL);
+
+	if (hash_levels(data_blocks, &hash_position, &levels, NULL, &hash_level_size[0]))
+		return NULL;
+
+	/* the first level contains one digest per data block */
+	level_size = levels ? hash_level_size[0] * hash_block_size : digest_size;
+	if (level_size > G_MAXSIZE || data_blocks > G_MAXSIZE)
+		return NULL;
+
+	tree = g_new0(RaucVerityTree, 1);
+	tree->data_blocks = data_blocks;
+	memcpy(tree->salt, salt, salt_size);
+	tree->digests = g_malloc0(level_size);
+	tree->hashed = g_malloc0(data_blocks);
+
+	return tree;
+}
+
+int r_verity_tree_add(RaucVerityTree *tree, uint64_t offset, const uint8_t *data, size_t size)
+{
+	EVP_MD_CTX *salted = NULL;
+	EVP_MD_CTX *mdctx = NULL;
+	uint64_t block;
+	uint64_t count;
+	int r;
+
+	g_return_val_if_fail(tree, -EINVAL);
+	g_return_val_if_fail(data || !size, -EINVAL);
+
+	/* unaligned data is left for r_verity_tree_fill() */
+	if (offset % data_block_size)
+		return 0;
+
+	block = offset / data_block_size;
+	if (block >= tree->data_blocks)
+		return 0;
+	count = MIN(size / data_block_size, tree->data_blocks - block);
+	if (!count)
+		return 0;
+
+	/* separate contexts allow concurrent calls for different blocks */
+	salted = salted_ctx_new(tree->salt);
+	mdctx = EVP_MD_CTX_new();
+	if (!salted || !mdctx) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	r = hash_blocks(salted, mdctx, data, count, tree->digests + block * digest_size);
+	if (r)
+		goto out;
+
+	memset(tree->hashed + block, 1, count);
+
+out:
+	EVP_MD_CTX_free(mdctx);
+	EVP_MD_CTX_free(salted);
+	return r;
+}
+
+int r_verity_tree_fill(RaucVerityTree *tree, int fd, uint64_t *read_blocks)
+{
+	g_autofree uint8_t *buf = NULL;
+	uint64_t block = 0;
+	uint64_t missing;
+	int r;
+
+	g_return_val_if_fail(tree, -EINVAL);
+
+	missing = count_missing(tree);
+	if (read_blocks)
+		*read_blocks = missing;
+	if (!missing)
+		return 0;
+
+	buf = g_malloc(VERITY_READ_BLOCKS * data_block_size);
+
+	while (block < tree->data_blocks) {
+		uint64_t count = 0;
+
+		if (tree->hashed[block]) {
+			block++;
+			continue;
+		}
+
+		/* read consecutive missing blocks at once */
+		while (count < VERITY_READ_BLOCKS && block + count < tree->data_blocks &&
+		       !tree->hashed[block + count])
+			count++;
+
+		r = pread_full(fd, buf, count * data_block_size, block * data_block_size);
+		if (r)
+			return r;
+
+		r = r_verity_tree_add(tree, block * data_block_size, buf, count * data_block_size);
+		if (r)
+			return r;
+
+		block += count;
+	}
+
+	return 0;
+}
+
+int r_verity_tree_write(RaucVerityTree *tree, int fd, uint64_t hash_offset,
+		uint64_t *hash_blocks_out, uint8_t *root_hash)
+{
+	uint64_t hash_position = 0;
+	uint64_t hash_level_block[VERITY_MAX_LEVELS];
+	uint64_t hash_level_size[VERITY_MAX_LEVELS];
+	uint8_t *levels_data[VERITY_MAX_LEVELS] = {0};
+	EVP_MD_CTX *salted = NULL;
+	EVP_MD_CTX *mdctx = NULL;
+	uint64_t missing;
+	int levels;
+	int r = 0;
+
+	g_return_val_if_fail(tree, -EINVAL);
+	g_return_val_if_fail(root_hash, -EINVAL);
+
+	missing = count_missing(tree);
+	if (missing) {
+		g_message("Verity tree is missing %" PRIu64 " data blocks.", missing);
+		return -EINVAL;
+	}
+
+	if (hash_levels(tree->data_blocks, &hash_position, &levels,
+			&hash_level_block[0], &hash_level_size[0])) {
+		g_message("Hash area overflow.");
+		return -EINVAL;
+	}
+	if (hash_blocks_out)
+		*hash_blocks_out = hash_position;
+
+	/* a single data block is its own root */
+	if (!levels) {
+		memcpy(root_hash, tree->digests, digest_size);
+		return 0;
+	}
+
+	salted = salted_ctx_new(tree->salt);
+	mdctx = EVP_MD_CTX_new();
+	if (!salted || !mdctx) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	/* the upper levels are small, so they are calculated in memory */
+	levels_data[0] = tree->digests;
+	for (int i = 1; i < levels; i++) {
+		levels_data[i] = g_malloc0(hash_level_size[i] * hash_block_size);
+		r = hash_blocks(salted, mdctx, levels_data[i - 1],
+				hash_level_size[i - 1], levels_data[i]);
+		if (r)
+			goto out;
+	}
+
+	for (int i = 0; i < levels; i++) {
+		r = pwrite_full(fd, levels_data[i], hash_level_size[i] * hash_block_size,
+				hash_offset + hash_level_block[i] * hash_block_size);
+		if (r) {
+			g_message("Input/output error while writing hash area.");
+			goto out;
+		}
+	}
+
+	r = hash_blocks(salted, mdctx, levels_data[levels - 1], 1, root_hash);
+
+out:
+	for (int i = 1; i < levels; i++)
+		g_free(levels_data[i]);
+	EVP_MD_CTX_free(mdctx);
+	EVP_MD_CTX_free(salted);
+	return r;
+}
+
+void r_verity_tree_free(RaucVerityTree *tree)
+{
+	if (!tree)
+		return;
+
+	g_free(tree->hashed);
+	g_free(tree->digests);
+	g_free(tree);
+}
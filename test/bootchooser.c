@@ -1,9 +1,14 @@
 #include <stdio.h>
+#include <string.h>
 #include <locale.h>
 #include <glib.h>
+#include <glib/gstdio.h>
 
 #include <bootchooser.h>
 #include <context.h>
+#include <mark.h>
+#include <status_file.h>
+#include <uboot_env.h>
 #include <utils.h>
 
 #include "common.h"
@@ -122,6 +127,17 @@ bootstate.system1.priority=10\n\
 	g_assert_false(good);
 	g_assert_true(r_boot_get_state(rootfs1, &good, NULL));
 	g_assert_true(good);
+	/* check both states can be obtained at once */
+	{
+		g_autoptr(GPtrArray) slots = g_ptr_array_new();
+		gboolean states[2] = {TRUE, FALSE};
+
+		g_ptr_array_add(slots, rootfs0);
+		g_ptr_array_add(slots, rootfs1);
+		g_assert_true(r_boot_get_states(slots, states, NULL));
+		g_assert_false(states[0]);
+		g_assert_true(states[1]);
+	}
 	/* check rootfs.1 is considered as primary */
 	primary = r_boot_get_primary(NULL);
 	g_assert_nonnull(primary);
@@ -588,6 +604,103 @@ ORDER=B A\n\
 "));
 }
 
+static void bootchooser_grub_transaction(BootchooserFixture *fixture,
+		gconstpointer user_data)
+{
+	RaucSlot *rootfs0 = NULL;
+	RaucSlot *rootfs1 = NULL;
+	gboolean good;
+	GError *error = NULL;
+
+	const gchar *cfg_file = "\
+[system]\n\
+compatible=FooCorp Super BarBazzer\n\
+bootloader=grub\n\
+grubenv=grubenv.test\n\
+mountprefix=/mnt/myrauc/\n\
+\n\
+[keyring]\n\
+path=/etc/rauc/keyring/\n\
+\n\
+[slot.rootfs.0]\n\
+device=/dev/rootfs-0\n\
+type=ext4\n\
+bootname=A\n\
+\n\
+[slot.rootfs.1]\n\
+device=/dev/rootfs-1\n\
+type=ext4\n\
+bootname=B\n";
+
+	gchar* pathname = write_tmp_file(fixture->tmpdir, "grub.conf", cfg_file, NULL);
+	g_assert_nonnull(pathname);
+
+	g_clear_pointer(&r_context_conf()->configpath, g_free);
+	r_context_conf()->configpath = pathname;
+	r_context();
+
+	rootfs0 = find_config_slot_by_name(r_context()->config, "rootfs.0");
+	g_assert_nonnull(rootfs0);
+	rootfs1 = find_config_slot_by_name(r_context()->config, "rootfs.1");
+	g_assert_nonnull(rootfs1);
+
+	test_grub_initialize_state("\
+A_TRY=0\n\
+B_TRY=0\n\
+A_OK=1\n\
+B_OK=0\n\
+ORDER=A B\n\
+");
+
+	/* changes are collected, but visible to reads */
+	r_boot_begin();
+	g_assert_true(r_boot_in_transaction());
+	g_assert_true(r_boot_set_state(rootfs0, FALSE, &error));
+	g_assert_no_error(error);
+	g_assert_true(r_boot_set_primary(rootfs1, &error));
+	g_assert_no_error(error);
+	g_assert_true(r_boot_get_state(rootfs0, &good, &error));
+	g_assert_false(good);
+	g_assert_true(r_boot_get_state(rootfs1, &good, &error));
+	g_assert_true(good);
+	g_assert_true(test_grub_post_state("\
+A_TRY=0\n\
+B_TRY=0\n\
+A_OK=1\n\
+B_OK=0\n\
+ORDER=A B\n\
+"));
+
+	/* and written together */
+	g_assert_true(r_boot_commit(&error));
+	g_assert_no_error(error);
+	g_assert_false(r_boot_in_transaction());
+	g_assert_true(test_grub_post_state("\
+A_TRY=0\n\
+B_TRY=0\n\
+A_OK=0\n\
+B_OK=1\n\
+ORDER=B A\n\
+"));
+
+	/* aborted changes are discarded */
+	r_boot_begin();
+	g_assert_true(r_boot_set_state(rootfs1, FALSE, &error));
+	g_assert_no_error(error);
+	r_boot_abort();
+	g_assert_false(r_boot_in_transaction());
+	g_assert_true(r_boot_get_state(rootfs1, &good, &error));
+	g_assert_no_error(error);
+	g_assert_true(good);
+	g_assert_true(test_grub_post_state("\
+A_TRY=0\n\
+B_TRY=0\n\
+A_OK=0\n\
+B_OK=1\n\
+ORDER=B A\n\
+"));
+}
+
 /* Write content to state storage for uboot fw_setenv / fw_printenv RAUC mock
  * tools. Content should be similar to:
  * "\
@@ -626,6 +739,81 @@ static gboolean test_uboot_post_state(const BootchooserFixture *fixture, const g
 	return TRUE;
 }
 
+/* A slot is only recorded as activated if the bootloader change was
+ * applied. */
+static void bootchooser_grub_mark_commit(BootchooserFixture *fixture,
+		gconstpointer user_data)
+{
+	RaucSlot *rootfs1 = NULL;
+	g_autofree gchar *cfg_file = NULL;
+	g_autofree gchar *statusfile = g_build_filename(fixture->tmpdir, "central.raucs", NULL);
+	g_autofree gchar *message = NULL;
+	g_autofree gchar *slot_name = NULL;
+
+	cfg_file = g_strdup_printf("\
+[system]\n\
+compatible=FooCorp Super BarBazzer\n\
+bootloader=grub\n\
+grubenv=grubenv.test\n\
+statusfile=%s\n\
+mountprefix=/mnt/myrauc/\n\
+\n\
+[keyring]\n\
+path=/etc/rauc/keyring/\n\
+\n\
+[slot.rootfs.0]\n\
+device=/dev/rootfs-0\n\
+type=ext4\n\
+bootname=A\n\
+\n\
+[slot.rootfs.1]\n\
+device=/dev/rootfs-1\n\
+type=ext4\n\
+bootname=B\n", statusfile);
+
+	gchar* pathname = write_tmp_file(fixture->tmpdir, "grub.conf", cfg_file, NULL);
+	g_assert_nonnull(pathname);
+
+	g_clear_pointer(&r_context_conf()->configpath, g_free);
+	r_context_conf()->configpath = pathname;
+	r_context();
+
+	rootfs1 = find_config_slot_by_name(r_context()->config, "rootfs.1");
+	g_assert_nonnull(rootfs1);
+
+	/* the mock grub-editenv fails without an environment file */
+	g_assert_cmpint(g_unlink(r_context()->config->grubenv_path), ==, 0);
+	g_assert_false(mark_run("active", "rootfs.1", &slot_name, &message));
+	g_assert_nonnull(message);
+	g_assert_null(slot_name);
+	g_clear_pointer(&message, g_free);
+
+	g_assert_false(g_file_test(statusfile, G_FILE_TEST_EXISTS));
+	r_slot_status_load(rootfs1);
+	g_assert_cmpuint(rootfs1->status->activated_count, ==, 0);
+	g_assert_null(rootfs1->status->activated_timestamp);
+
+	test_grub_initialize_state("\
+A_TRY=0\n\
+B_TRY=0\n\
+A_OK=1\n\
+B_OK=0\n\
+ORDER=A B\n\
+");
+	g_assert_true(mark_run("active", "rootfs.1", &slot_name, &message));
+	g_assert_cmpstr(slot_name, ==, "rootfs.1");
+	g_assert_cmpuint(rootfs1->status->activated_count, ==, 1);
+	g_assert_nonnull(rootfs1->status->activated_timestamp);
+	g_assert_true(g_file_test(statusfile, G_FILE_TEST_IS_REGULAR));
+	g_assert_true(test_grub_post_state("\
+A_TRY=0\n\
+B_TRY=0\n\
+A_OK=1\n\
+B_OK=1\n\
+ORDER=B A\n\
+"));
+}
+
 static void bootchooser_uboot(BootchooserFixture *fixture,
 		gconstpointer user_data)
 {
@@ -762,6 +950,86 @@ BOOT_B_LEFT=3\n\
 "));
 }
 
+static void bootchooser_uboot_native(BootchooserFixture *fixture,
+		gconstpointer user_data)
+{
+	const gchar vars[] = "BOOT_ORDER=A B\0BOOT_A_LEFT=3\0BOOT_B_LEFT=0\0";
+	g_autofree gchar *envpath = g_build_filename(fixture->tmpdir, "uboot.env", NULL);
+	g_autofree gchar *env_config_content = NULL;
+	g_autofree gchar *env_config = NULL;
+	g_autofree gchar *cfg_file = NULL;
+	g_autofree guint8 *data = g_malloc0(0x1000);
+	g_autoptr(RUbootEnv) env = NULL;
+	g_autoptr(GError) error = NULL;
+	RaucSlot *rootfs0 = NULL;
+	RaucSlot *rootfs1 = NULL;
+	RaucSlot *primary = NULL;
+	guint32 crc;
+	gboolean good;
+
+	/* single environment with a CRC32 header */
+	memcpy(data + 4, vars, sizeof(vars));
+	crc = GUINT32_TO_LE(r_uboot_env_crc32(data + 4, 0x1000 - 4));
+	memcpy(data, &crc, sizeof(crc));
+	g_assert_true(g_file_set_contents(envpath, (const gchar *)data, 0x1000, NULL));
+
+	env_config_content = g_strdup_printf("%s 0x0 0x1000\n", envpath);
+	env_config = write_tmp_file(fixture->tmpdir, "fw_env.config", env_config_content, NULL);
+
+	cfg_file = g_strdup_printf("\
+[system]\n\
+compatible=FooCorp Super BarBazzer\n\
+bootloader=uboot\n\
+uboot-env-config=%s\n\
+mountprefix=/mnt/myrauc/\n\
+\n\
+[keyring]\n\
+path=/etc/rauc/keyring/\n\
+\n\
+[slot.rootfs.0]\n\
+device=/dev/rootfs-0\n\
+type=ext4\n\
+bootname=A\n\
+\n\
+[slot.rootfs.1]\n\
+device=/dev/rootfs-1\n\
+type=ext4\n\
+bootname=B\n", env_config);
+
+	gchar* pathname = write_tmp_file(fixture->tmpdir, "uboot.conf", cfg_file, NULL);
+	g_assert_nonnull(pathname);
+
+	/* make sure the fw_printenv/fw_setenv mocks are not used */
+	g_unsetenv("UBOOT_STATE_PATH");
+
+	g_clear_pointer(&r_context_conf()->configpath, g_free);
+	r_context_conf()->configpath = pathname;
+	r_context();
+
+	rootfs0 = find_config_slot_by_name(r_context()->config, "rootfs.0");
+	g_assert_nonnull(rootfs0);
+	rootfs1 = find_config_slot_by_name(r_context()->config, "rootfs.1");
+	g_assert_nonnull(rootfs1);
+
+	g_assert_true(r_boot_get_state(rootfs0, &good, NULL));
+	g_assert_true(good);
+	g_assert_true(r_boot_get_state(rootfs1, &good, NULL));
+	g_assert_false(good);
+	primary = r_boot_get_primary(NULL);
+	g_assert_true(primary == rootfs0);
+
+	g_assert_true(r_boot_set_primary(rootfs1, NULL));
+	g_assert_true(r_boot_set_state(rootfs0, FALSE, NULL));
+
+	env = r_uboot_env_open(env_config, &error);
+	g_assert_no_error(error);
+	g_assert_nonnull(env);
+	g_assert_cmpstr(r_uboot_env_get(env, "BOOT_ORDER", &error), ==, "B");
+	g_assert_cmpstr(r_uboot_env_get(env, "BOOT_A_LEFT", &error), ==, "0");
+	g_assert_cmpstr(r_uboot_env_get(env, "BOOT_B_LEFT", &error), ==, "3");
+	g_assert_no_error(error);
+}
+
 static void bootchooser_uboot_asymmetric(BootchooserFixture *fixture,
 		gconstpointer user_data)
 {
@@ -1008,6 +1276,142 @@ static gboolean test_custom_post_state(const BootchooserFixture *fixture, const
 	return TRUE;
 }
 
+static void test_efivar_write(const gchar *efivarfs, const gchar *name, const guint8 *data, gsize len)
+{
+	g_autofree gchar *path = g_strdup_printf("%s/%s-8be4df61-93ca-11d2-aa0d-00e098032b8c", efivarfs, name);
+	g_autoptr(GByteArray) contents = g_byte_array_new();
+	const guint8 attributes[] = {0x07, 0x00, 0x00, 0x00};
+
+	g_byte_array_append(contents, attributes, sizeof(attributes));
+	g_byte_array_append(contents, data, len);
+	g_assert_true(g_file_set_contents(path, (const gchar *)contents->data, contents->len, NULL));
+}
+
+static GBytes *test_efivar_read(const gchar *efivarfs, const gchar *name)
+{
+	g_autofree gchar *path = g_strdup_printf("%s/%s-8be4df61-93ca-11d2-aa0d-00e098032b8c", efivarfs, name);
+	gchar *contents = NULL;
+	gsize len = 0;
+
+	g_assert_true(g_file_get_contents(path, &contents, &len, NULL));
+	g_assert_cmpuint(len, >=, 4);
+
+	return g_bytes_new_take(contents, len);
+}
+
+static void test_efivar_write_bootentry(const gchar *efivarfs, const gchar *num, const gchar *description)
+{
+	g_autofree gchar *name = g_strdup_printf("Boot%s", num);
+	g_autofree gunichar2 *utf16 = NULL;
+	g_autoptr(GByteArray) data = g_byte_array_new();
+	const guint8 header[] = {0x01, 0x00, 0x00, 0x00, 0x00, 0x00};
+	glong chars = 0;
+
+	utf16 = g_utf8_to_utf16(description, -1, NULL, &chars, NULL);
+	g_byte_array_append(data, header, sizeof(header));
+	for (glong i = 0; i <= chars; i++) {
+		const guint8 c[] = {utf16[i] & 0xff, utf16[i] >> 8};
+		g_byte_array_append(data, c, sizeof(c));
+	}
+
+	test_efivar_write(efivarfs, name, data->data, data->len);
+}
+
+static void bootchooser_efi_native(BootchooserFixture *fixture,
+		gconstpointer user_data)
+{
+	const guint8 bootorder[] = {0x01, 0x00, 0x02, 0x00, 0x03, 0x00, 0x00, 0x00};
+	const guint8 bootcurrent[] = {0x02, 0x00};
+	g_autofree gchar *efivarfs = g_build_filename(fixture->tmpdir, "efivars", NULL);
+	g_autofree gchar *cfg_file = NULL;
+	g_autoptr(GBytes) value = NULL;
+	const gchar *bootname = NULL;
+	RaucSlot *rootfs0 = NULL;
+	RaucSlot *rootfs1 = NULL;
+	RaucSlot *primary = NULL;
+	GError *error = NULL;
+	gboolean good;
+
+	g_assert_cmpint(g_mkdir(efivarfs, 0755), ==, 0);
+	test_efivar_write(efivarfs, "BootOrder", bootorder, sizeof(bootorder));
+	test_efivar_write(efivarfs, "BootCurrent", bootcurrent, sizeof(bootcurrent));
+	test_efivar_write_bootentry(efivarfs, "0000", "invalid");
+	test_efivar_write_bootentry(efivarfs, "0001", "system0");
+	test_efivar_write_bootentry(efivarfs, "0002", "system1");
+	test_efivar_write_bootentry(efivarfs, "0003", "recovery");
+
+	cfg_file = g_strdup_printf("\
+[system]\n\
+compatible=FooCorp Super BarBazzer\n\
+bootloader=efi\n\
+efivarfs=%s\n\
+mountprefix=/mnt/myrauc/\n\
+\n\
+[keyring]\n\
+path=/etc/rauc/keyring/\n\
+\n\
+[slot.rootfs.0]\n\
+device=/dev/rootfs-0\n\
+type=ext4\n\
+bootname=system0\n\
+\n\
+[slot.rootfs.1]\n\
+device=/dev/rootfs-1\n\
+type=ext4\n\
+bootname=system1\n", efivarfs);
+
+	gchar* pathname = write_tmp_file(fixture->tmpdir, "efi.conf", cfg_file, NULL);
+	g_assert_nonnull(pathname);
+
+	g_clear_pointer(&r_context_conf()->configpath, g_free);
+	r_context_conf()->configpath = pathname;
+	r_context();
+
+	rootfs0 = find_config_slot_by_name(r_context()->config, "rootfs.0");
+	g_assert_nonnull(rootfs0);
+	rootfs1 = find_config_slot_by_name(r_context()->config, "rootfs.1");
+	g_assert_nonnull(rootfs1);
+
+	g_assert_true(r_boot_get_state(rootfs0, &good, &error));
+	g_assert_no_error(error);
+	g_assert_true(good);
+	primary = r_boot_get_primary(&error);
+	g_assert_no_error(error);
+	g_assert_true(primary == rootfs0);
+
+	bootname = r_boot_get_current_bootname(r_context()->config, "", &error);
+	g_assert_no_error(error);
+	g_assert_cmpstr(bootname, ==, "system1");
+
+	/* marking bad removes the entry from BootOrder */
+	g_assert_true(r_boot_set_state(rootfs0, FALSE, &error));
+	g_assert_no_error(error);
+	value = test_efivar_read(efivarfs, "BootOrder");
+	g_assert_cmpmem(g_bytes_get_data(value, NULL), g_bytes_get_size(value),
+			"\x07\x00\x00\x00\x02\x00\x03\x00\x00\x00", 10);
+	g_clear_pointer(&value, g_bytes_unref);
+	g_assert_true(r_boot_get_state(rootfs0, &good, &error));
+	g_assert_false(good);
+
+	/* marking good prepends it again */
+	g_assert_true(r_boot_set_state(rootfs0, TRUE, &error));
+	g_assert_no_error(error);
+	value = test_efivar_read(efivarfs, "BootOrder");
+	g_assert_cmpmem(g_bytes_get_data(value, NULL), g_bytes_get_size(value),
+			"\x07\x00\x00\x00\x01\x00\x02\x00\x03\x00\x00\x00", 12);
+	g_clear_pointer(&value, g_bytes_unref);
+
+	/* marking primary sets BootNext */
+	g_assert_true(r_boot_set_primary(rootfs1, &error));
+	g_assert_no_error(error);
+	value = test_efivar_read(efivarfs, "BootNext");
+	g_assert_cmpmem(g_bytes_get_data(value, NULL), g_bytes_get_size(value),
+			"\x07\x00\x00\x00\x02\x00", 6);
+	primary = r_boot_get_primary(&error);
+	g_assert_no_error(error);
+	g_assert_true(primary == rootfs1);
+}
+
 static void bootchooser_custom(BootchooserFixture *fixture,
 		gconstpointer user_data)
 {
@@ -1191,6 +1595,95 @@ STATE_B=bad\n\
 	g_clear_error(&error);
 }
 
+static void bootchooser_custom_persistent(BootchooserFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autofree gchar *log_path = g_build_filename(fixture->tmpdir, "custom-test-state.log", NULL);
+	g_autofree gchar *log = NULL;
+	g_autoptr(GPtrArray) slots = g_ptr_array_new();
+	RaucSlot *rootfs0 = NULL;
+	RaucSlot *rootfs1 = NULL;
+	RaucSlot *primary = NULL;
+	gboolean states[2] = {FALSE, FALSE};
+	gboolean good;
+	GError *error = NULL;
+	gboolean res;
+
+	const gchar *cfg_file = "\
+[system]\n\
+compatible=FooCorp Super BarBazzer\n\
+bootloader=custom\n\
+mountprefix=/mnt/myrauc/\n\
+\n\
+[handlers]\n\
+bootloader-custom-backend=custom-bootloader-script\n\
+bootloader-custom-backend-persistent=true\n\
+\n\
+[keyring]\n\
+path=/etc/rauc/keyring/\n\
+\n\
+[slot.rootfs.0]\n\
+device=/dev/rootfs-0\n\
+type=ext4\n\
+bootname=A\n\
+\n\
+[slot.rootfs.1]\n\
+device=/dev/rootfs-1\n\
+type=ext4\n\
+bootname=B\n";
+
+	gchar* pathname = write_tmp_file(fixture->tmpdir, "custom.conf", cfg_file, NULL);
+	g_assert_nonnull(pathname);
+
+	g_clear_pointer(&r_context_conf()->configpath, g_free);
+	r_context_conf()->configpath = pathname;
+	r_context();
+
+	rootfs0 = find_config_slot_by_device(r_context()->config, "/dev/rootfs-0");
+	g_assert_nonnull(rootfs0);
+	rootfs1 = find_config_slot_by_device(r_context()->config, "/dev/rootfs-1");
+	g_assert_nonnull(rootfs1);
+
+	test_custom_initialize_state(fixture, "\
+PRIMARY=A\n\
+STATE_A=good\n\
+STATE_B=bad\n\
+");
+
+	/* both states are obtained with one batch */
+	g_ptr_array_add(slots, rootfs0);
+	g_ptr_array_add(slots, rootfs1);
+	res = r_boot_get_states(slots, states, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+	g_assert_true(states[0]);
+	g_assert_false(states[1]);
+
+	res = r_boot_set_state(rootfs1, TRUE, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+	res = r_boot_get_state(rootfs1, &good, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+	g_assert_true(good);
+
+	res = r_boot_set_primary(rootfs1, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+	primary = r_boot_get_primary(&error);
+	g_assert_no_error(error);
+	g_assert(primary == rootfs1);
+	g_assert_true(test_custom_post_state(fixture, "\
+PRIMARY=B\n\
+STATE_A=good\n\
+STATE_B=good\n\
+"));
+
+	/* the backend was only started once */
+	g_assert_true(g_file_get_contents(log_path, &log, NULL, NULL));
+	g_assert_cmpstr(log, ==, "serve\n");
+}
+
 int main(int argc, char *argv[])
 {
 	gchar *path;
@@ -1220,6 +1713,14 @@ int main(int argc, char *argv[])
 			bootchooser_fixture_set_up, bootchooser_grub,
 			bootchooser_fixture_tear_down);
 
+	g_test_add("/bootchooser/grub-transaction", BootchooserFixture, NULL,
+			bootchooser_fixture_set_up, bootchooser_grub_transaction,
+			bootchooser_fixture_tear_down);
+
+	g_test_add("/bootchooser/grub-mark-commit", BootchooserFixture, NULL,
+			bootchooser_fixture_set_up, bootchooser_grub_mark_commit,
+			bootchooser_fixture_tear_down);
+
 	g_test_add("/bootchooser/uboot", BootchooserFixture, NULL,
 			bootchooser_fixture_set_up, bootchooser_uboot,
 			bootchooser_fixture_tear_down);
@@ -1232,13 +1733,25 @@ int main(int argc, char *argv[])
 			bootchooser_fixture_set_up, bootchooser_uboot_asymmetric,
 			bootchooser_fixture_tear_down);
 
+	g_test_add("/bootchooser/uboot-native", BootchooserFixture, NULL,
+			bootchooser_fixture_set_up, bootchooser_uboot_native,
+			bootchooser_fixture_tear_down);
+
 	g_test_add("/bootchooser/efi", BootchooserFixture, NULL,
 			bootchooser_fixture_set_up, bootchooser_efi,
 			bootchooser_fixture_tear_down);
 
+	g_test_add("/bootchooser/efi-native", BootchooserFixture, NULL,
+			bootchooser_fixture_set_up, bootchooser_efi_native,
+			bootchooser_fixture_tear_down);
+
 	g_test_add("/bootchooser/custom", BootchooserFixture, NULL,
 			custom_bootchooser_fixture_set_up, bootchooser_custom,
 			bootchooser_fixture_tear_down);
 
+	g_test_add("/bootchooser/custom-persistent", BootchooserFixture, NULL,
+			custom_bootchooser_fixture_set_up, bootchooser_custom_persistent,
+			bootchooser_fixture_tear_down);
+
 	return g_test_run();
 }
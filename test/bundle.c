@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <string.h>
 #include <locale.h>
 #include <glib.h>
 #include <glib/gstdio.h>
@@ -791,6 +792,147 @@ static void bundle_test_resign(BundleFixture *fixture,
 	replace_strdup(&context->signing_keyringpath, NULL);
 }
 
+/* Test resigning a bundle in place, which is not possible for 'plain' bundles */
+static void bundle_test_resign_in_place(BundleFixture *fixture,
+		gconstpointer user_data)
+{
+	BundleData *data = (BundleData*)user_data;
+	g_autofree gchar *before = NULL;
+	g_autofree gchar *after = NULL;
+	g_autoptr(RaucBundle) bundle = NULL;
+	g_autoptr(GError) ierror = NULL;
+	gsize before_len = 0, after_len = 0;
+	gboolean res = FALSE;
+
+	g_assert_true(g_file_get_contents(fixture->bundlename, &before, &before_len, NULL));
+
+	replace_strdup(&r_context()->config->keyring_path, "test/openssl-ca/dev-only-ca.pem");
+	res = check_bundle(fixture->bundlename, &bundle, CHECK_BUNDLE_DEFAULT, NULL, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	/* Use 'rel' key pair for resigning */
+	replace_strdup(&context->certpath, "test/openssl-ca/rel/release-1.cert.pem");
+	replace_strdup(&context->keypath, "test/openssl-ca/rel/private/release-1.pem");
+	replace_strdup(&context->signing_keyringpath, "test/openssl-ca/rel-ca.pem");
+
+	res = resign_bundle(bundle, fixture->bundlename, &ierror);
+	g_clear_pointer(&bundle, free_bundle);
+
+	if (data->manifest_test_options.format == R_MANIFEST_FORMAT_PLAIN) {
+		g_assert_error(ierror, R_BUNDLE_ERROR, R_BUNDLE_ERROR_UNSUPPORTED);
+		g_clear_error(&ierror);
+		g_assert_false(res);
+
+		/* the bundle is left untouched */
+		g_assert_true(g_file_get_contents(fixture->bundlename, &after, &after_len, NULL));
+		g_assert_cmpmem(after, after_len, before, before_len);
+	} else {
+		g_assert_no_error(ierror);
+		g_assert_true(res);
+
+		/* only the signature was replaced */
+		res = check_bundle(fixture->bundlename, &bundle, CHECK_BUNDLE_DEFAULT, NULL, &ierror);
+		g_assert_error(ierror, R_SIGNATURE_ERROR, R_SIGNATURE_ERROR_INVALID);
+		g_clear_error(&ierror);
+		g_assert_false(res);
+		g_clear_pointer(&bundle, free_bundle);
+
+		replace_strdup(&r_context()->config->keyring_path, "test/openssl-ca/rel-ca.pem");
+		res = check_bundle(fixture->bundlename, &bundle, CHECK_BUNDLE_DEFAULT, NULL, &ierror);
+		g_assert_no_error(ierror);
+		g_assert_true(res);
+	}
+
+	// hacky restore of original signing_keyringpath
+	replace_strdup(&context->signing_keyringpath, NULL);
+}
+
+/* Test replacing the signature in place, which restores the old signature if
+ * the new one cannot be verified */
+static void bundle_test_replace_signature_in_place(BundleFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autofree gchar *resignbundle = NULL;
+	g_autofree gchar *sigpath = NULL;
+	g_autofree gchar *before = NULL;
+	g_autofree gchar *after = NULL;
+	g_autoptr(RaucBundle) bundle = NULL;
+	g_autoptr(GError) ierror = NULL;
+	gsize before_len = 0, after_len = 0;
+	gboolean res = FALSE;
+
+	resignbundle = g_build_filename(fixture->tmpdir, "resigned-bundle.raucb", NULL);
+	sigpath = g_build_filename(fixture->tmpdir, "bundle.sig", NULL);
+
+	/* Create a 'rel' signature for the bundle */
+	replace_strdup(&r_context()->config->keyring_path, "test/openssl-ca/dev-only-ca.pem");
+	res = check_bundle(fixture->bundlename, &bundle, CHECK_BUNDLE_TRUST_ENV, NULL, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	replace_strdup(&context->certpath, "test/openssl-ca/rel/release-1.cert.pem");
+	replace_strdup(&context->keypath, "test/openssl-ca/rel/private/release-1.pem");
+	replace_strdup(&context->signing_keyringpath, "test/openssl-ca/rel-ca.pem");
+
+	res = resign_bundle(bundle, resignbundle, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	g_clear_pointer(&bundle, free_bundle);
+
+	replace_strdup(&r_context()->config->keyring_path, "test/openssl-ca/rel-ca.pem");
+	res = check_bundle(resignbundle, &bundle, CHECK_BUNDLE_TRUST_ENV, NULL, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	res = extract_signature(bundle, sigpath, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	g_clear_pointer(&bundle, free_bundle);
+
+	/* The new signature can't be verified with the 'dev' keyring, so the
+	 * old one is restored */
+	g_assert_true(g_file_get_contents(fixture->bundlename, &before, &before_len, NULL));
+	replace_strdup(&r_context()->config->keyring_path, "test/openssl-ca/dev-only-ca.pem");
+	replace_strdup(&context->signing_keyringpath, "test/openssl-ca/dev-only-ca.pem");
+	res = check_bundle(fixture->bundlename, &bundle, CHECK_BUNDLE_TRUST_ENV, NULL, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	res = replace_signature(bundle, sigpath, fixture->bundlename, CHECK_BUNDLE_TRUST_ENV, &ierror);
+	g_assert_error(ierror, R_SIGNATURE_ERROR, R_SIGNATURE_ERROR_INVALID);
+	g_clear_error(&ierror);
+	g_assert_false(res);
+	g_clear_pointer(&bundle, free_bundle);
+
+	g_assert_true(g_file_get_contents(fixture->bundlename, &after, &after_len, NULL));
+	g_assert_cmpmem(after, after_len, before, before_len);
+	res = check_bundle(fixture->bundlename, &bundle, CHECK_BUNDLE_TRUST_ENV, NULL, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	/* With the 'rel' keyring, the signature is replaced */
+	replace_strdup(&context->signing_keyringpath, "test/openssl-ca/rel-ca.pem");
+	res = replace_signature(bundle, sigpath, fixture->bundlename, CHECK_BUNDLE_TRUST_ENV, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	g_clear_pointer(&bundle, free_bundle);
+
+	res = check_bundle(fixture->bundlename, &bundle, CHECK_BUNDLE_TRUST_ENV, NULL, &ierror);
+	g_assert_error(ierror, R_SIGNATURE_ERROR, R_SIGNATURE_ERROR_INVALID);
+	g_clear_error(&ierror);
+	g_assert_false(res);
+	g_clear_pointer(&bundle, free_bundle);
+
+	replace_strdup(&r_context()->config->keyring_path, "test/openssl-ca/rel-ca.pem");
+	res = check_bundle(fixture->bundlename, &bundle, CHECK_BUNDLE_TRUST_ENV, NULL, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	// hacky restore of original signing_keyringpath
+	replace_strdup(&context->signing_keyringpath, NULL);
+}
+
 static void bundle_test_wrong_capath(BundleFixture *fixture,
 		gconstpointer user_data)
 {
@@ -976,6 +1118,138 @@ static void bundle_test_purpose_codesign(BundleFixture *fixture,
 	replace_strdup(&r_context()->config->keyring_check_purpose, NULL);
 }
 
+static void bundle_test_batch(BundleFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autofree gchar *batchfile = NULL;
+	g_autofree gchar *contents = NULL;
+	g_autofree gchar *cachedir = NULL;
+	g_autofree gchar *certpath = resolve_path(NULL, "test/openssl-ca/dev/autobuilder-1.cert.pem");
+	g_autofree gchar *keypath = resolve_path(NULL, "test/openssl-ca/dev/private/autobuilder-1.pem");
+	g_autofree gchar *output1 = g_build_filename(fixture->tmpdir, "batch-1.raucb", NULL);
+	g_autofree gchar *output2 = g_build_filename(fixture->tmpdir, "batch-2.raucb", NULL);
+	g_autoptr(RaucBundle) bundle = NULL;
+	g_autoptr(GError) ierror = NULL;
+	gboolean res = FALSE;
+
+	/* both bundles share the same payload, one is signed with the
+	 * command line key, the other one with a signer from the batch file */
+	contents = g_strdup_printf(
+			"[signer.release]\n"
+			"cert=%s\n"
+			"key=%s\n"
+			"\n"
+			"[bundle.default]\n"
+			"input=%s\n"
+			"output=batch-1.raucb\n"
+			"\n"
+			"[bundle.release]\n"
+			"input=%s/\n"
+			"output=batch-2.raucb\n"
+			"signer=release\n",
+			certpath, keypath, fixture->contentdir, fixture->contentdir);
+	batchfile = write_tmp_file(fixture->tmpdir, "batch.conf", contents, NULL);
+	g_assert_nonnull(batchfile);
+
+	cachedir = g_build_filename(fixture->tmpdir, "cache", NULL);
+	r_context_conf()->bundle_cache_dir = cachedir;
+	r_context();
+
+	r_context()->config->keyring_check_crl = FALSE;
+	g_test_expect_message(G_LOG_DOMAIN, G_LOG_LEVEL_WARNING,
+			"Detected CRL but CRL checking is disabled!");
+	g_test_expect_message(G_LOG_DOMAIN, G_LOG_LEVEL_WARNING,
+			"Detected CRL but CRL checking is disabled!");
+	res = create_bundle_batch(batchfile, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	r_context()->config->keyring_check_crl = TRUE;
+
+	r_context_conf()->bundle_cache_dir = NULL;
+	r_context();
+
+	res = check_bundle(output1, &bundle, CHECK_BUNDLE_DEFAULT, NULL, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	g_clear_pointer(&bundle, free_bundle);
+
+	res = check_bundle(output2, &bundle, CHECK_BUNDLE_DEFAULT, NULL, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	g_clear_pointer(&bundle, free_bundle);
+
+	/* existing outputs are not overwritten */
+	res = create_bundle_batch(batchfile, &ierror);
+	g_assert_error(ierror, G_FILE_ERROR, G_FILE_ERROR_EXIST);
+	g_assert_false(res);
+	g_assert_true(g_file_test(output1, G_FILE_TEST_IS_REGULAR));
+}
+
+/* Returns the offset of the first block of a file in the bundle payload. The
+ * random test images are stored uncompressed by mksquashfs. */
+static gsize find_file_data(GBytes *bundle, const gchar *contentdir, const gchar *filename)
+{
+	g_autofree gchar *path = g_build_filename(contentdir, filename, NULL);
+	g_autofree gchar *data = NULL;
+	gsize bundle_len = 0;
+	const guint8 *bundle_data = g_bytes_get_data(bundle, &bundle_len);
+	const guint8 *found;
+	gsize len = 0;
+
+	g_assert_true(g_file_get_contents(path, &data, &len, NULL));
+	g_assert_cmpuint(len, >=, 4096);
+	found = memmem(bundle_data, bundle_len, data, 4096);
+	g_assert_nonnull(found);
+
+	return found - bundle_data;
+}
+
+static void bundle_test_streaming_layout(BundleFixture *fixture,
+		gconstpointer user_data)
+{
+	ManifestTestOptions options = {
+		.slots = TRUE,
+		.format = R_MANIFEST_FORMAT_VERITY,
+	};
+	g_autoptr(RaucManifest) manifest = NULL;
+	g_autoptr(GBytes) bundle = NULL;
+	g_autofree gchar *manifestpath = NULL;
+	g_autofree gchar *sort = NULL;
+	g_autofree gchar *expected = NULL;
+	GError *ierror = NULL;
+	gboolean res;
+
+	fixture->contentdir = g_build_filename(fixture->tmpdir, "content", NULL);
+	fixture->bundlename = g_build_filename(fixture->tmpdir, "bundle.raucb", NULL);
+	test_create_content(fixture->contentdir, &options);
+
+	/* the manifest first, then the images in manifest order */
+	manifestpath = g_build_filename(fixture->contentdir, "manifest.raucm", NULL);
+	res = load_manifest_file(manifestpath, &manifest, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	sort = streaming_sort_order(manifest, fixture->contentdir);
+	expected = g_strdup_printf("%1$s/manifest.raucm 32767\n"
+			"%1$s/rootfs.ext4 32766\n"
+			"%1$s/appfs.ext4 32765\n", fixture->contentdir);
+	g_assert_cmpstr(sort, ==, expected);
+
+	replace_strdup(&r_context()->bundle_layout, "streaming");
+	r_context()->config->keyring_check_crl = FALSE;
+	g_test_expect_message(G_LOG_DOMAIN, G_LOG_LEVEL_WARNING,
+			"Detected CRL but CRL checking is disabled!");
+	test_create_bundle(fixture->contentdir, fixture->bundlename);
+	r_context()->config->keyring_check_crl = TRUE;
+	replace_strdup(&r_context()->bundle_layout, NULL);
+
+	/* mksquashfs would store appfs.ext4 first (alphabetical order) */
+	bundle = read_file(fixture->bundlename, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_nonnull(bundle);
+	g_assert_cmpuint(find_file_data(bundle, fixture->contentdir, "rootfs.ext4"), <,
+			find_file_data(bundle, fixture->contentdir, "appfs.ext4"));
+}
+
 int main(int argc, char *argv[])
 {
 	g_autoptr(GPtrArray) ptrs = g_ptr_array_new_with_free_func(g_free);
@@ -1033,11 +1307,26 @@ int main(int argc, char *argv[])
 				bundle_fixture_set_up_bundle, bundle_test_replace_signature,
 				bundle_fixture_tear_down);
 
+		g_test_add(dup_test_printf(ptrs, "/bundle/resign_in_place/%s", format_name),
+				BundleFixture, bundle_data,
+				bundle_fixture_set_up_bundle, bundle_test_resign_in_place,
+				bundle_fixture_tear_down);
+
+		g_test_add(dup_test_printf(ptrs, "/bundle/replace_signature_in_place/%s", format_name),
+				BundleFixture, bundle_data,
+				bundle_fixture_set_up_bundle, bundle_test_replace_signature_in_place,
+				bundle_fixture_tear_down);
+
 		g_test_add(dup_test_printf(ptrs, "/bundle/wrong_capath/%s", format_name),
 				BundleFixture, bundle_data,
 				bundle_fixture_set_up_bundle, bundle_test_wrong_capath,
 				bundle_fixture_tear_down);
 
+		g_test_add(dup_test_printf(ptrs, "/bundle/batch/%s", format_name),
+				BundleFixture, bundle_data,
+				bundle_fixture_set_up_bundle, bundle_test_batch,
+				bundle_fixture_tear_down);
+
 		g_test_add(dup_test_printf(ptrs, "/bundle/verify_no_crl_warn/%s", format_name),
 				BundleFixture, bundle_data,
 				bundle_fixture_set_up_bundle, bundle_test_verify_no_crl_warn,
@@ -1264,5 +1553,10 @@ int main(int argc, char *argv[])
 			bundle_fixture_set_up_bundle, bundle_test_create_mount,
 			bundle_fixture_tear_down);
 
+	g_test_add("/bundle/streaming-layout",
+			BundleFixture, NULL,
+			bundle_fixture_set_up, bundle_test_streaming_layout,
+			bundle_fixture_tear_down);
+
 	return g_test_run();
 }
@@ -0,0 +1,247 @@
+#include <locale.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <fcntl.h>
+#include <openssl/evp.h>
+#include <zstd.h>
+
+#include "casync.h"
+#include "utils.h"
+
+#include "common.h"
+
+#define CHUNK_SIZE 4096
+
+typedef struct {
+	gchar *tmpdir;
+	gchar *store;
+} Fixture;
+
+static void fixture_set_up(Fixture *fixture,
+		gconstpointer user_data)
+{
+	fixture->tmpdir = g_dir_make_tmp("rauc-XXXXXX", NULL);
+	g_assert_nonnull(fixture->tmpdir);
+	g_test_message("casync tmpdir: %s\n", fixture->tmpdir);
+
+	fixture->store = g_build_filename(fixture->tmpdir, "store", NULL);
+	g_assert_cmpint(g_mkdir(fixture->store, 0777), ==, 0);
+}
+
+static void fixture_tear_down(Fixture *fixture,
+		gconstpointer user_data)
+{
+	g_assert_true(rm_tree(fixture->tmpdir, NULL));
+	g_free(fixture->store);
+	g_free(fixture->tmpdir);
+}
+
+static void append_le64(GByteArray *array, guint64 value)
+{
+	value = GUINT64_TO_LE(value);
+	g_byte_array_append(array, (const guint8 *)&value, sizeof(value));
+}
+
+/* Writes a blob index with fixed size chunks for the given file and, if
+ * store is set, stores the compressed chunks. */
+static gchar *create_index(const gchar *tmpdir, const gchar *store, const gchar *data_filename, const gchar *index_name)
+{
+	g_autoptr(GByteArray) index = g_byte_array_new();
+	g_autofree gchar *contents = NULL;
+	gchar *index_filename = NULL;
+	gsize len = 0;
+
+	g_assert_true(g_file_get_contents(data_filename, &contents, &len, NULL));
+	g_assert_cmpuint(len % CHUNK_SIZE, ==, 0);
+
+	/* index header (SHA-256) */
+	append_le64(index, 48);
+	append_le64(index, 0x96824d9c7b129ff9ULL);
+	append_le64(index, 0);
+	append_le64(index, CHUNK_SIZE);
+	append_le64(index, CHUNK_SIZE);
+	append_le64(index, CHUNK_SIZE);
+	/* table header */
+	append_le64(index, G_MAXUINT64);
+	append_le64(index, 0xe75b9e112f17417dULL);
+
+	for (gsize offset = 0; offset < len; offset += CHUNK_SIZE) {
+		guint8 digest[EVP_MAX_MD_SIZE];
+		unsigned int digest_len = 0;
+
+		g_assert_true(EVP_Digest(contents + offset, CHUNK_SIZE, digest, &digest_len, EVP_sha256(), NULL));
+		append_le64(index, offset + CHUNK_SIZE);
+		g_byte_array_append(index, digest, R_CASYNC_CHUNK_ID_LEN);
+
+		if (store) {
+			g_autofree gchar *hex = r_hex_encode(digest, R_CASYNC_CHUNK_ID_LEN);
+			g_autofree gchar *prefix = g_strndup(hex, 4);
+			g_autofree gchar *dir = g_build_filename(store, prefix, NULL);
+			g_autofree gchar *chunk_name = g_strdup_printf("%s.cacnk", hex);
+			g_autofree gchar *chunk_filename = g_build_filename(dir, chunk_name, NULL);
+			g_autofree guint8 *compressed = g_malloc(ZSTD_compressBound(CHUNK_SIZE));
+			size_t compressed_len;
+
+			compressed_len = ZSTD_compress(compressed, ZSTD_compressBound(CHUNK_SIZE), contents + offset, CHUNK_SIZE, 3);
+			g_assert_false(ZSTD_isError(compressed_len));
+			g_assert_cmpint(g_mkdir_with_parents(dir, 0777), ==, 0);
+			g_assert_true(g_file_set_contents(chunk_filename, (const gchar *)compressed, compressed_len, NULL));
+		}
+	}
+
+	/* table tail */
+	append_le64(index, 0);
+	append_le64(index, 0);
+	append_le64(index, 48);
+	append_le64(index, 16 + (len / CHUNK_SIZE + 1) * 40);
+	append_le64(index, 0x4b4f050e5549ecd1ULL);
+
+	index_filename = g_build_filename(tmpdir, index_name, NULL);
+	g_assert_true(g_file_set_contents(index_filename, (const gchar *)index->data, index->len, NULL));
+
+	return index_filename;
+}
+
+static void test_index_load(Fixture *fixture, gconstpointer user_data)
+{
+	g_autoptr(GError) error = NULL;
+	g_autoptr(RCasyncIndex) index = NULL;
+	g_autofree gchar *data_filename = NULL;
+	g_autofree gchar *index_filename = NULL;
+	g_autofree gchar *invalid_filename = NULL;
+	RCasyncChunk *chunk = NULL;
+
+	data_filename = write_random_file(fixture->tmpdir, "data.img", 16*CHUNK_SIZE, 0x4b1d5eed);
+	g_assert_nonnull(data_filename);
+	index_filename = create_index(fixture->tmpdir, NULL, data_filename, "data.caibx");
+
+	index = r_casync_index_load(index_filename, &error);
+	g_assert_no_error(error);
+	g_assert_nonnull(index);
+	g_assert_cmpuint(index->size, ==, 16*CHUNK_SIZE);
+	g_assert_cmpuint(index->chunks->len, ==, 16);
+
+	chunk = &g_array_index(index->chunks, RCasyncChunk, 3);
+	g_assert_cmpuint(chunk->offset, ==, 3*CHUNK_SIZE);
+	g_assert_cmpuint(chunk->size, ==, CHUNK_SIZE);
+	g_assert_true(g_hash_table_lookup(index->lookup, chunk->id) == chunk);
+
+	/* a truncated index has no tail */
+	invalid_filename = g_build_filename(fixture->tmpdir, "invalid.caibx", NULL);
+	{
+		g_autofree gchar *contents = NULL;
+		gsize len = 0;
+
+		g_assert_true(g_file_get_contents(index_filename, &contents, &len, NULL));
+		g_assert_true(g_file_set_contents(invalid_filename, contents, len - 40, NULL));
+	}
+	g_clear_pointer(&index, r_casync_index_free);
+	index = r_casync_index_load(invalid_filename, &error);
+	g_assert_error(error, R_CASYNC_ERROR, R_CASYNC_ERROR_INVALID_INDEX);
+	g_assert_null(index);
+}
+
+static void test_extract(Fixture *fixture, gconstpointer user_data)
+{
+	g_autoptr(GError) error = NULL;
+	g_autoptr(RCasyncIndex) index = NULL;
+	g_autoptr(RCasyncIndex) seed_index = NULL;
+	g_autofree gchar *data_filename = NULL;
+	g_autofree gchar *index_filename = NULL;
+	g_autofree gchar *seed_filename = NULL;
+	g_autofree gchar *seed_index_filename = NULL;
+	g_autofree gchar *out_filename = NULL;
+	g_autofree gchar *data = NULL;
+	g_autofree gchar *out = NULL;
+	gsize data_len = 0, out_len = 0;
+	gboolean res = FALSE;
+	int seed_fd = -1;
+	int out_fd = -1;
+
+	data_filename = write_random_file(fixture->tmpdir, "data.img", 64*CHUNK_SIZE, 0x4b1d5eed);
+	g_assert_nonnull(data_filename);
+	index_filename = create_index(fixture->tmpdir, fixture->store, data_filename, "data.caibx");
+	index = r_casync_index_load(index_filename, &error);
+	g_assert_no_error(error);
+
+	/* the seed contains the first half of the image */
+	seed_filename = write_random_file(fixture->tmpdir, "seed.img", 64*CHUNK_SIZE, 0x12345678);
+	g_assert_nonnull(seed_filename);
+	g_assert_true(g_file_get_contents(data_filename, &data, &data_len, NULL));
+	{
+		g_autofree gchar *seed = NULL;
+		gsize seed_len = 0;
+
+		g_assert_true(g_file_get_contents(seed_filename, &seed, &seed_len, NULL));
+		memcpy(seed + 32*CHUNK_SIZE, data, 32*CHUNK_SIZE);
+		g_assert_true(g_file_set_contents(seed_filename, seed, seed_len, NULL));
+	}
+	seed_index_filename = create_index(fixture->tmpdir, NULL, seed_filename, "seed.caibx");
+	seed_index = r_casync_index_load(seed_index_filename, &error);
+	g_assert_no_error(error);
+
+	/* remove the seeded chunks from the store to ensure they are not fetched */
+	for (guint i = 0; i < 32; i++) {
+		RCasyncChunk *chunk = &g_array_index(index->chunks, RCasyncChunk, i);
+		g_autofree gchar *hex = r_hex_encode(chunk->id, R_CASYNC_CHUNK_ID_LEN);
+		g_autofree gchar *chunk_name = g_strdup_printf("%.4s/%s.cacnk", hex, hex);
+		g_autofree gchar *chunk_filename = g_build_filename(fixture->store, chunk_name, NULL);
+
+		g_unlink(chunk_filename);
+	}
+
+	seed_fd = g_open(seed_filename, O_RDONLY|O_CLOEXEC, 0);
+	g_assert_cmpint(seed_fd, >=, 0);
+	out_filename = g_build_filename(fixture->tmpdir, "out.img", NULL);
+	out_fd = g_open(out_filename, O_WRONLY|O_CREAT|O_CLOEXEC, 0666);
+	g_assert_cmpint(out_fd, >=, 0);
+
+	res = r_casync_extract_blob(index, fixture->store, seed_fd, seed_index, out_fd, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+	g_close(seed_fd, NULL);
+	g_close(out_fd, NULL);
+
+	g_assert_true(g_file_get_contents(out_filename, &out, &out_len, NULL));
+	g_assert_cmpmem(data, data_len, out, out_len);
+}
+
+static void test_extract_missing_chunk(Fixture *fixture, gconstpointer user_data)
+{
+	g_autoptr(GError) error = NULL;
+	g_autoptr(RCasyncIndex) index = NULL;
+	g_autofree gchar *data_filename = NULL;
+	g_autofree gchar *index_filename = NULL;
+	g_autofree gchar *out_filename = NULL;
+	gboolean res = FALSE;
+	int out_fd = -1;
+
+	data_filename = write_random_file(fixture->tmpdir, "data.img", 8*CHUNK_SIZE, 0x4b1d5eed);
+	g_assert_nonnull(data_filename);
+	/* no seed and an empty store */
+	index_filename = create_index(fixture->tmpdir, NULL, data_filename, "data.caibx");
+	index = r_casync_index_load(index_filename, &error);
+	g_assert_no_error(error);
+
+	out_filename = g_build_filename(fixture->tmpdir, "out.img", NULL);
+	out_fd = g_open(out_filename, O_WRONLY|O_CREAT|O_CLOEXEC, 0666);
+	g_assert_cmpint(out_fd, >=, 0);
+
+	res = r_casync_extract_blob(index, fixture->store, -1, NULL, out_fd, &error);
+	g_assert_error(error, G_FILE_ERROR, G_FILE_ERROR_NOENT);
+	g_assert_false(res);
+	g_close(out_fd, NULL);
+}
+
+int main(int argc, char *argv[])
+{
+	setlocale(LC_ALL, "C");
+
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add("/casync/index-load", Fixture, NULL, fixture_set_up, test_index_load, fixture_tear_down);
+	g_test_add("/casync/extract", Fixture, NULL, fixture_set_up, test_extract, fixture_tear_down);
+	g_test_add("/casync/extract-missing-chunk", Fixture, NULL, fixture_set_up, test_extract_missing_chunk, fixture_tear_down);
+
+	return g_test_run();
+}
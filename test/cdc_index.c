@@ -0,0 +1,154 @@
+#include <locale.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <fcntl.h>
+
+#include "cdc_index.h"
+#include "utils.h"
+
+#include "common.h"
+
+typedef struct {
+	gchar *tmpdir;
+} Fixture;
+
+static void fixture_set_up(Fixture *fixture,
+		gconstpointer user_data)
+{
+	fixture->tmpdir = g_dir_make_tmp("rauc-XXXXXX", NULL);
+	g_assert_nonnull(fixture->tmpdir);
+	g_test_message("cdc_index tmpdir: %s\n", fixture->tmpdir);
+}
+
+static void fixture_tear_down(Fixture *fixture,
+		gconstpointer user_data)
+{
+	g_assert_true(rm_tree(fixture->tmpdir, NULL));
+	g_free(fixture->tmpdir);
+}
+
+static RaucCdcIndex *open_file(const gchar *filename, const gchar *index_filename)
+{
+	g_autoptr(GError) error = NULL;
+	RaucCdcIndex *index = NULL;
+	int datafd;
+
+	datafd = g_open(filename, O_RDONLY|O_CLOEXEC, 0);
+	g_assert_cmpint(datafd, >, 0);
+
+	index = r_cdc_index_open("test", datafd, index_filename, &error);
+	g_assert_no_error(error);
+	g_assert_nonnull(index);
+
+	return index;
+}
+
+static void test_chunk_sizes(Fixture *fixture, gconstpointer user_data)
+{
+	g_autofree gchar *filename = NULL;
+	g_autoptr(RaucCdcIndex) index = NULL;
+	guint64 offset = 0;
+
+	filename = write_random_file(fixture->tmpdir, "data.img", 1024*1024, 0x2abff992);
+	g_assert_nonnull(filename);
+
+	index = open_file(filename, NULL);
+	/* 1 MiB with an average chunk size of about 8 KiB */
+	g_assert_cmpuint(index->chunks->len, >, 64);
+	g_assert_cmpuint(index->chunks->len, <, 512);
+
+	for (guint i = 0; i < index->chunks->len; i++) {
+		const RaucCdcChunk *chunk = &g_array_index(index->chunks, RaucCdcChunk, i);
+
+		g_assert_cmpuint(chunk->offset, ==, offset);
+		g_assert_cmpuint(chunk->size, <=, R_CDC_INDEX_MAX_SIZE);
+		if (i + 1 < index->chunks->len)
+			g_assert_cmpuint(chunk->size, >=, R_CDC_INDEX_MIN_SIZE);
+		offset += chunk->size;
+	}
+	g_assert_cmpuint(offset, ==, 1024*1024);
+}
+
+static void test_shifted(Fixture *fixture, gconstpointer user_data)
+{
+	g_autofree gchar *filename = NULL;
+	g_autofree gchar *shifted_filename = NULL;
+	g_autofree gchar *contents = NULL;
+	g_autofree gchar *shifted = NULL;
+	g_autoptr(RaucCdcIndex) index = NULL;
+	g_autoptr(RaucCdcIndex) shifted_index = NULL;
+	g_autofree guint8 *data = g_malloc(R_CDC_INDEX_MAX_SIZE);
+	gsize len = 0;
+	guint found = 0;
+
+	filename = write_random_file(fixture->tmpdir, "data.img", 1024*1024, 0x2abff992);
+	g_assert_nonnull(filename);
+	g_assert_true(g_file_get_contents(filename, &contents, &len, NULL));
+
+	/* insert 100 bytes at the start, which breaks all 4 KiB blocks */
+	shifted = g_malloc0(len + 100);
+	memcpy(shifted + 100, contents, len);
+	shifted_filename = g_build_filename(fixture->tmpdir, "shifted.img", NULL);
+	g_assert_true(g_file_set_contents(shifted_filename, shifted, len + 100, NULL));
+
+	index = open_file(filename, NULL);
+	shifted_index = open_file(shifted_filename, NULL);
+
+	/* all chunks except the first one are found at the new position */
+	for (guint i = 0; i < shifted_index->chunks->len; i++) {
+		const RaucCdcChunk *chunk = &g_array_index(shifted_index->chunks, RaucCdcChunk, i);
+
+		if (r_cdc_index_get_chunk(index, chunk->hash, chunk->size, data, NULL)) {
+			g_assert_cmpmem(data, chunk->size, shifted + chunk->offset, chunk->size);
+			found++;
+		}
+	}
+	g_assert_cmpuint(found, >=, shifted_index->chunks->len - 2);
+}
+
+static void test_export(Fixture *fixture, gconstpointer user_data)
+{
+	g_autoptr(GError) error = NULL;
+	g_autofree gchar *filename = NULL;
+	g_autofree gchar *index_filename = NULL;
+	g_autoptr(RaucCdcIndex) index = NULL;
+	g_autoptr(RaucCdcIndex) loaded = NULL;
+	g_autofree guint8 *data = g_malloc(R_CDC_INDEX_MAX_SIZE);
+	const RaucCdcChunk *chunk = NULL;
+	gboolean res = FALSE;
+
+	filename = write_random_file(fixture->tmpdir, "data.img", 256*1024, 0x2abff992);
+	g_assert_nonnull(filename);
+	index_filename = g_build_filename(fixture->tmpdir, "data.img.cdc-hash-index", NULL);
+
+	index = open_file(filename, NULL);
+	res = r_cdc_index_export(index, index_filename, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+
+	loaded = open_file(filename, index_filename);
+	g_assert_cmpuint(loaded->chunks->len, ==, index->chunks->len);
+	g_assert_cmpmem(loaded->chunks->data, loaded->chunks->len * sizeof(RaucCdcChunk),
+			index->chunks->data, index->chunks->len * sizeof(RaucCdcChunk));
+
+	/* chunks before the valid range are not used */
+	chunk = &g_array_index(loaded->chunks, RaucCdcChunk, 2);
+	g_assert_true(r_cdc_index_has_chunk_at(loaded, chunk, data));
+	loaded->invalid_below = chunk->offset + 1;
+	res = r_cdc_index_get_chunk(loaded, chunk->hash, chunk->size, data, &error);
+	g_assert_error(error, R_CDC_INDEX_ERROR, R_CDC_INDEX_ERROR_NOT_FOUND);
+	g_assert_false(res);
+}
+
+int main(int argc, char *argv[])
+{
+	setlocale(LC_ALL, "C");
+
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add("/cdc_index/chunk-sizes", Fixture, NULL, fixture_set_up, test_chunk_sizes, fixture_tear_down);
+	g_test_add("/cdc_index/shifted", Fixture, NULL, fixture_set_up, test_shifted, fixture_tear_down);
+	g_test_add("/cdc_index/export", Fixture, NULL, fixture_set_up, test_export, fixture_tear_down);
+
+	return g_test_run();
+}
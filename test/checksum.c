@@ -2,6 +2,7 @@
 #include <locale.h>
 
 #include "checksum.h"
+#include "hash_index.h"
 
 #define TEST_DIGEST_FAIL "fa1lbad73aed1b4642cd726cad727b63fff2824ad68cedd7ffb73c7cbd890479"
 #define TEST_DIGEST_GOOD "c35020473aed1b4642cd726cad727b63fff2824ad68cedd7ffb73c7cbd890479"
@@ -64,6 +65,62 @@ static void checksum_test1(void)
 	g_assert(checksum.size == 0);
 }
 
+static void checksum_test_types(void)
+{
+	const GChecksumType types[] = {G_CHECKSUM_SHA1, G_CHECKSUM_SHA256, G_CHECKSUM_SHA384, G_CHECKSUM_SHA512};
+	g_autofree gchar *contents = NULL;
+	gsize length = 0;
+	GError *error = NULL;
+
+	g_assert_true(g_file_get_contents("test/install-content/appfs.img", &contents, &length, &error));
+	g_assert_no_error(error);
+
+	/* the digests must match the GLib implementation */
+	for (guint i = 0; i < G_N_ELEMENTS(types); i++) {
+		RaucChecksum checksum = {.type = types[i]};
+		g_autofree gchar *expected = g_compute_checksum_for_data(types[i], (const guchar *)contents, length);
+
+		g_assert_true(compute_checksum(&checksum, "test/install-content/appfs.img", &error));
+		g_assert_no_error(error);
+		g_assert_cmpstr(checksum.digest, ==, expected);
+		g_assert_cmpint(checksum.size, ==, length);
+		g_free(checksum.digest);
+	}
+}
+
+static void checksum_test_chunk_hashes(void)
+{
+	RaucChecksum checksum = {};
+	g_autoptr(GBytes) hashes = NULL;
+	g_autofree gchar *contents = NULL;
+	g_autofree guint8 *expected = NULL;
+	gsize length = 0;
+	GError *error = NULL;
+
+	g_assert_true(g_file_get_contents("test/install-content/appfs.img", &contents, &length, &error));
+	g_assert_no_error(error);
+	g_assert_cmpint(length % R_HASH_INDEX_CHUNK_SIZE, ==, 0);
+
+	expected = g_malloc(length / R_HASH_INDEX_CHUNK_SIZE * 32);
+	r_hash_index_hash_chunks((const guint8 *)contents, length / R_HASH_INDEX_CHUNK_SIZE, expected);
+
+	g_assert_true(compute_checksum_with_chunk_hashes(&checksum, "test/install-content/appfs.img", &hashes, &error));
+	g_assert_no_error(error);
+	g_assert_cmpstr(checksum.digest, ==, TEST_DIGEST_GOOD);
+	g_assert_cmpint(checksum.size, ==, 32768);
+	g_assert_nonnull(hashes);
+	g_assert_cmpmem(g_bytes_get_data(hashes, NULL), g_bytes_get_size(hashes), expected, length / R_HASH_INDEX_CHUNK_SIZE * 32);
+	g_clear_pointer(&checksum.digest, g_free);
+	g_clear_pointer(&hashes, g_bytes_unref);
+
+	/* no chunk hashes for files with partial chunks */
+	g_assert_true(compute_checksum_with_chunk_hashes(&checksum, "test/manifest.raucm", &hashes, &error));
+	g_assert_no_error(error);
+	g_assert_nonnull(checksum.digest);
+	g_assert_null(hashes);
+	g_clear_pointer(&checksum.digest, g_free);
+}
+
 int main(int argc, char *argv[])
 {
 	setlocale(LC_ALL, "C");
@@ -73,6 +130,8 @@ int main(int argc, char *argv[])
 	g_test_init(&argc, &argv, NULL);
 
 	g_test_add_func("/checksum/test1", checksum_test1);
+	g_test_add_func("/checksum/types", checksum_test_types);
+	g_test_add_func("/checksum/chunk-hashes", checksum_test_chunk_hashes);
 
 	return g_test_run();
 }
@@ -0,0 +1,94 @@
+#include <locale.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "chunk_pack.h"
+#include "hash_index.h"
+#include "manifest.h"
+#include "utils.h"
+
+#include "common.h"
+
+typedef struct {
+	gchar *tmpdir;
+} Fixture;
+
+static void fixture_set_up(Fixture *fixture,
+		gconstpointer user_data)
+{
+	fixture->tmpdir = g_dir_make_tmp("rauc-XXXXXX", NULL);
+	g_assert_nonnull(fixture->tmpdir);
+	g_test_message("chunk_pack tmpdir: %s\n", fixture->tmpdir);
+}
+
+static void fixture_tear_down(Fixture *fixture,
+		gconstpointer user_data)
+{
+	g_assert_true(rm_tree(fixture->tmpdir, NULL));
+	g_free(fixture->tmpdir);
+}
+
+static void test_read(Fixture *fixture, gconstpointer user_data)
+{
+	g_autoptr(GError) error = NULL;
+	g_autoptr(RaucImage) image = r_new_image();
+	g_autoptr(RaucChunkPack) pack = NULL;
+	g_autofree gchar *contents = NULL;
+	g_autofree gchar *packpath = NULL;
+	g_autofree guint8 *data = NULL;
+	const guint32 chunk_count = 50; /* the last group is incomplete */
+	const gsize chunk_size = R_HASH_INDEX_CHUNK_SIZE;
+	off_t offset = 0, size = 0;
+	gboolean res = FALSE;
+
+	/* compressible data: random chunks interleaved with zero chunks */
+	image->filename = write_random_file(fixture->tmpdir, "image.img", chunk_count * chunk_size, 0x2abff992);
+	g_assert_nonnull(image->filename);
+	g_assert_true(g_file_get_contents(image->filename, &contents, NULL, NULL));
+	for (guint32 i = 0; i < chunk_count; i += 2)
+		memset(contents + i * chunk_size, 0, chunk_size);
+	g_assert_true(g_file_set_contents(image->filename, contents, chunk_count * chunk_size, NULL));
+
+	packpath = g_strconcat(image->filename, ".chunk-pack", NULL);
+	res = r_chunk_pack_create(image->filename, packpath, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+
+	pack = r_chunk_pack_open_image(image, &error);
+	g_assert_no_error(error);
+	g_assert_nonnull(pack);
+	g_assert_cmpuint(pack->chunk_count, ==, chunk_count);
+	g_assert_cmpuint(pack->group_count, ==, 4);
+
+	/* across a group boundary */
+	data = g_malloc(20 * chunk_size);
+	res = r_chunk_pack_read(pack, 10, 20, data, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+	g_assert_cmpmem(data, 20 * chunk_size, contents + 10 * chunk_size, 20 * chunk_size);
+
+	/* the incomplete last group */
+	res = r_chunk_pack_read(pack, 48, 2, data, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+	g_assert_cmpmem(data, 2 * chunk_size, contents + 48 * chunk_size, 2 * chunk_size);
+
+	res = r_chunk_pack_read(pack, 49, 2, data, &error);
+	g_assert_error(error, R_CHUNK_PACK_ERROR, R_CHUNK_PACK_ERROR_NOT_FOUND);
+	g_assert_false(res);
+
+	r_chunk_pack_get_range(pack, 0, chunk_count, &offset, &size);
+	g_assert_cmpint(offset, ==, pack->offsets[0]);
+	g_assert_cmpint(size, <, (off_t)(chunk_count * chunk_size * 3 / 4));
+}
+
+int main(int argc, char *argv[])
+{
+	setlocale(LC_ALL, "C");
+
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add("/chunk_pack/read", Fixture, NULL, fixture_set_up, test_read, fixture_tear_down);
+
+	return g_test_run();
+}
@@ -4,6 +4,7 @@
 
 #include <config_file.h>
 #include <context.h>
+#include <event_log.h>
 
 #include "common.h"
 #include "utils.h"
@@ -92,6 +93,7 @@ device=/dev/appfs-0\n\
 type=ext4\n\
 parent=rootfs.0\n\
 install-same=false\n\
+check-same-content=true\n\
 \n\
 [slot.appfs.1]\n\
 description=Application filesystem partition 1\n\
@@ -172,6 +174,7 @@ type=trees\n\
 	g_assert_null(slot->extra_mkfs_opts);
 	g_assert_false(slot->readonly);
 	g_assert_false(slot->install_same);
+	g_assert_true(slot->check_same_content);
 	g_assert_nonnull(slot->parent);
 	g_assert(find_config_slot_by_name(config, "appfs.0") == slot);
 
@@ -1367,6 +1370,202 @@ send-headers=transaction-id;invalid-key";
 	g_assert_null(config);
 }
 
+static void config_file_streaming_connections(ConfigFileFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autoptr(RaucConfig) config = NULL;
+	g_autoptr(GError) ierror = NULL;
+	gboolean res;
+	g_autofree gchar* pathname = NULL;
+
+	const gchar *cfg_file = "\
+[system]\n\
+compatible=FooCorp Super BarBazzer\n\
+bootloader=barebox\n\
+\n\
+[streaming]\n\
+connections=4";
+
+	const gchar *cfg_file_invalid = "\
+[system]\n\
+compatible=FooCorp Super BarBazzer\n\
+bootloader=barebox\n\
+\n\
+[streaming]\n\
+connections=0";
+
+	pathname = write_tmp_file(fixture->tmpdir, "connections.conf", cfg_file, NULL);
+	g_assert_nonnull(pathname);
+
+	res = load_config(pathname, &config, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	g_assert_nonnull(config);
+	g_assert_cmpint(config->streaming_connections, ==, 4);
+	g_clear_pointer(&config, free_config);
+	g_clear_pointer(&pathname, g_free);
+
+	pathname = write_tmp_file(fixture->tmpdir, "connections_invalid.conf", cfg_file_invalid, NULL);
+	g_assert_nonnull(pathname);
+
+	res = load_config(pathname, &config, &ierror);
+	g_assert_error(ierror, R_CONFIG_ERROR, R_CONFIG_ERROR_INVALID_FORMAT);
+	g_assert_false(res);
+	g_assert_null(config);
+}
+
+static void config_file_write_behind_size(ConfigFileFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autoptr(RaucConfig) config = NULL;
+	g_autoptr(GError) ierror = NULL;
+	gboolean res;
+	g_autofree gchar* pathname = NULL;
+
+	const gchar *cfg_file = "\
+[system]\n\
+compatible=FooCorp Super BarBazzer\n\
+bootloader=barebox\n\
+write-behind-size=32M";
+
+	pathname = write_tmp_file(fixture->tmpdir, "write_behind.conf", cfg_file, NULL);
+	g_assert_nonnull(pathname);
+
+	res = load_config(pathname, &config, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	g_assert_nonnull(config);
+	g_assert_cmpuint(config->write_behind_size, ==, 32 * 1024 * 1024);
+}
+
+static void config_file_memory_limit(ConfigFileFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autoptr(RaucConfig) config = NULL;
+	g_autoptr(GError) ierror = NULL;
+	gboolean res;
+	g_autofree gchar* pathname = NULL;
+
+	const gchar *cfg_file = "\
+[system]\n\
+compatible=FooCorp Super BarBazzer\n\
+bootloader=barebox\n\
+memory-limit=16M";
+
+	pathname = write_tmp_file(fixture->tmpdir, "memory_limit.conf", cfg_file, NULL);
+	g_assert_nonnull(pathname);
+
+	res = load_config(pathname, &config, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	g_assert_nonnull(config);
+	g_assert_cmpuint(config->memory_limit, ==, 16 * 1024 * 1024);
+}
+
+static void config_file_install_concurrency(ConfigFileFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autoptr(RaucConfig) config = NULL;
+	g_autoptr(GError) ierror = NULL;
+	gboolean res;
+	g_autofree gchar* pathname = NULL;
+
+	const gchar *cfg_file = "\
+[system]\n\
+compatible=FooCorp Super BarBazzer\n\
+bootloader=barebox\n\
+install-concurrency=3";
+
+	const gchar *cfg_file_invalid = "\
+[system]\n\
+compatible=FooCorp Super BarBazzer\n\
+bootloader=barebox\n\
+install-concurrency=0";
+
+	pathname = write_tmp_file(fixture->tmpdir, "install_concurrency.conf", cfg_file, NULL);
+	g_assert_nonnull(pathname);
+
+	res = load_config(pathname, &config, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	g_assert_nonnull(config);
+	g_assert_cmpint(config->install_concurrency, ==, 3);
+	g_clear_pointer(&config, free_config);
+	g_clear_pointer(&pathname, g_free);
+
+	pathname = write_tmp_file(fixture->tmpdir, "install_concurrency_invalid.conf", cfg_file_invalid, NULL);
+	g_assert_nonnull(pathname);
+
+	res = load_config(pathname, &config, &ierror);
+	g_assert_error(ierror, R_CONFIG_ERROR, R_CONFIG_ERROR_INVALID_FORMAT);
+	g_assert_false(res);
+	g_assert_null(config);
+}
+
+static void config_file_install_priority(ConfigFileFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autoptr(RaucConfig) config = NULL;
+	g_autoptr(GError) ierror = NULL;
+	const RaucInstallPriority *priority = NULL;
+	gboolean res;
+	g_autofree gchar* pathname = NULL;
+
+	const gchar *cfg_file = "\
+[system]\n\
+compatible=FooCorp Super BarBazzer\n\
+bootloader=barebox\n\
+install-priority=day\n\
+\n\
+[priority.day]\n\
+nice=10\n\
+io-class=idle\n\
+rate-limit=8M\n\
+\n\
+[priority.night]\n\
+io-class=best-effort\n\
+io-level=0";
+
+	const gchar *cfg_file_missing = "\
+[system]\n\
+compatible=FooCorp Super BarBazzer\n\
+bootloader=barebox\n\
+install-priority=day";
+
+	pathname = write_tmp_file(fixture->tmpdir, "install_priority.conf", cfg_file, NULL);
+	g_assert_nonnull(pathname);
+
+	res = load_config(pathname, &config, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	g_assert_nonnull(config);
+	g_assert_cmpstr(config->install_priority, ==, "day");
+	g_assert_cmpuint(g_hash_table_size(config->install_priorities), ==, 2);
+
+	priority = g_hash_table_lookup(config->install_priorities, "day");
+	g_assert_nonnull(priority);
+	g_assert_cmpint(priority->thread.nice, ==, 10);
+	g_assert_cmpint(priority->thread.io_class, ==, R_IOPRIO_CLASS_IDLE);
+	g_assert_cmpuint(priority->rate_limit, ==, 8*1024*1024);
+
+	priority = g_hash_table_lookup(config->install_priorities, "night");
+	g_assert_nonnull(priority);
+	g_assert_cmpint(priority->thread.nice, ==, 0);
+	g_assert_cmpint(priority->thread.io_class, ==, R_IOPRIO_CLASS_BE);
+	g_assert_cmpint(priority->thread.io_level, ==, 0);
+	g_assert_cmpuint(priority->rate_limit, ==, 0);
+	g_clear_pointer(&config, free_config);
+	g_clear_pointer(&pathname, g_free);
+
+	pathname = write_tmp_file(fixture->tmpdir, "install_priority_missing.conf", cfg_file_missing, NULL);
+	g_assert_nonnull(pathname);
+
+	res = load_config(pathname, &config, &ierror);
+	g_assert_error(ierror, R_CONFIG_ERROR, R_CONFIG_ERROR_INVALID_FORMAT);
+	g_assert_false(res);
+	g_assert_null(config);
+}
+
 /* A logger must at least have a 'filename' set.
  * Test that an empty logger causes a failure */
 static void config_file_logger_empty(ConfigFileFixture *fixture,
@@ -1469,7 +1668,9 @@ events=boot;install\n\
 format=readable\n\
 max-size=1M\n\
 max-files=8\n\
+index=true\n\
 ";
+	REventLogger *logger = NULL;
 
 	pathname = write_tmp_file(fixture->tmpdir, "logger.conf", cfg_file, NULL);
 	g_assert_nonnull(pathname);
@@ -1478,6 +1679,11 @@ max-files=8\n\
 	g_assert_no_error(ierror);
 	g_assert_true(res);
 	g_assert_nonnull(config);
+
+	g_assert_cmpuint(g_list_length(config->loggers), ==, 1);
+	logger = config->loggers->data;
+	g_assert_cmpuint(logger->maxfiles, ==, 8);
+	g_assert_true(logger->index);
 }
 
 /* Test providing an invalid event type */
@@ -1735,6 +1941,21 @@ int main(int argc, char *argv[])
 	g_test_add("/config-file/send-headers-invalid-value", ConfigFileFixture, NULL,
 			config_file_fixture_set_up, config_file_send_headers_invalid_item,
 			config_file_fixture_tear_down);
+	g_test_add("/config-file/write-behind-size", ConfigFileFixture, NULL,
+			config_file_fixture_set_up, config_file_write_behind_size,
+			config_file_fixture_tear_down);
+	g_test_add("/config-file/memory-limit", ConfigFileFixture, NULL,
+			config_file_fixture_set_up, config_file_memory_limit,
+			config_file_fixture_tear_down);
+	g_test_add("/config-file/install-concurrency", ConfigFileFixture, NULL,
+			config_file_fixture_set_up, config_file_install_concurrency,
+			config_file_fixture_tear_down);
+	g_test_add("/config-file/install-priority", ConfigFileFixture, NULL,
+			config_file_fixture_set_up, config_file_install_priority,
+			config_file_fixture_tear_down);
+	g_test_add("/config-file/streaming-connections", ConfigFileFixture, NULL,
+			config_file_fixture_set_up, config_file_streaming_connections,
+			config_file_fixture_tear_down);
 	g_test_add("/config-file/logger/empty", ConfigFileFixture, NULL,
 			config_file_fixture_set_up, config_file_logger_empty,
 			config_file_fixture_tear_down);
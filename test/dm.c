@@ -242,6 +242,34 @@ static void dm_verity_simple_test(void)
 	g_close(fd, NULL);
 }
 
+static void dm_profile_test(void)
+{
+	g_autoptr(RaucDM) dm_verity = r_dm_new_verity();
+	g_autoptr(RaucDM) dm_crypt = r_dm_new_crypt();
+	RaucDMProfile profile;
+
+	g_assert_true(r_dm_parse_profile("low-latency", &profile));
+	g_assert_cmpint(profile, ==, RAUC_DM_PROFILE_LOW_LATENCY);
+	g_assert_cmpstr(r_dm_profile_to_str(profile), ==, "low-latency");
+	g_assert_false(r_dm_parse_profile("fast", &profile));
+
+	r_dm_set_profile(dm_verity, RAUC_DM_PROFILE_DEFAULT);
+	g_assert_null(dm_verity->options);
+
+	r_dm_set_profile(dm_verity, RAUC_DM_PROFILE_LOW_CPU);
+	g_assert_true(g_strv_contains((const gchar * const *)dm_verity->options, "check_at_most_once"));
+	g_assert_true(g_strv_contains((const gchar * const *)dm_verity->options, "try_verify_in_tasklet"));
+
+	r_dm_set_profile(dm_crypt, RAUC_DM_PROFILE_LOW_CPU);
+	g_assert_cmpuint(g_strv_length(dm_crypt->options), ==, 2);
+	g_assert_true(g_strv_contains((const gchar * const *)dm_crypt->options, "no_read_workqueue"));
+
+	/* the benchmark selects one of the fixed profiles */
+	r_dm_set_profile(dm_crypt, RAUC_DM_PROFILE_AUTO);
+	g_assert_cmpint(dm_crypt->profile, !=, RAUC_DM_PROFILE_AUTO);
+	g_assert_cmpint(dm_crypt->profile, !=, RAUC_DM_PROFILE_LOW_CPU);
+}
+
 static void verity_hash_test(void)
 {
 	int ret, bundlefd;
@@ -298,6 +326,69 @@ static void crypt_encrypt_test(DMFixture *fixture,
 	g_close(fd_comp, NULL);
 }
 
+/* builds the tree incrementally and compares it with r_verity_hash_create() */
+static void verity_tree_test(DMFixture *fixture,
+		gconstpointer user_data)
+{
+	const DMData *dm_data = user_data;
+	g_autoptr(GBytes) data = NULL;
+	g_autoptr(GBytes) expected = NULL;
+	g_autoptr(GBytes) created = NULL;
+	g_autoptr(RaucVerityTree) tree = NULL;
+	g_autofree gchar *filename = NULL;
+	g_autofree gchar *tree_filename = NULL;
+	g_autofree guint8 *salt = random_bytes(32, 0xd6368505);
+	guint8 root_hash[32] = {0};
+	guint8 tree_root_hash[32] = {0};
+	const guint8 *buf;
+	uint64_t combined_size, hash_blocks, read_blocks;
+	int ret, fd;
+
+	filename = write_random_file(fixture->tmpdir, "data", 4096*dm_data->data_size, 0x0fdfc761);
+	g_assert_nonnull(filename);
+	data = read_file(filename, NULL);
+	g_assert_nonnull(data);
+	buf = g_bytes_get_data(data, NULL);
+
+	tree_filename = g_build_filename(fixture->tmpdir, "tree", NULL);
+	g_assert_true(g_file_set_contents(tree_filename, (const gchar *)buf, 4096*dm_data->data_size, NULL));
+
+	/* reference */
+	fd = g_open(filename, O_RDWR);
+	g_assert_cmpint(fd, >, 0);
+	ret = r_verity_hash_create(fd, dm_data->data_size, &combined_size, root_hash, salt);
+	g_assert_cmpint(ret, ==, 0);
+	g_close(fd, NULL);
+
+	/* add every other block (and an unaligned range which is ignored) */
+	tree = r_verity_tree_new(dm_data->data_size, salt);
+	g_assert_nonnull(tree);
+	for (uint64_t i = 0; i < dm_data->data_size; i += 2) {
+		ret = r_verity_tree_add(tree, i * 4096, buf + i * 4096, 4096);
+		g_assert_cmpint(ret, ==, 0);
+	}
+	ret = r_verity_tree_add(tree, 512, buf + 512, 4096);
+	g_assert_cmpint(ret, ==, 0);
+
+	fd = g_open(tree_filename, O_RDWR);
+	g_assert_cmpint(fd, >, 0);
+	ret = r_verity_tree_fill(tree, fd, &read_blocks);
+	g_assert_cmpint(ret, ==, 0);
+	g_assert_cmpuint(read_blocks, ==, dm_data->data_size / 2);
+	ret = r_verity_tree_write(tree, fd, 4096*dm_data->data_size, &hash_blocks, tree_root_hash);
+	g_assert_cmpint(ret, ==, 0);
+	g_close(fd, NULL);
+
+	g_assert_cmpuint(dm_data->data_size + hash_blocks, ==, combined_size);
+	g_assert_cmpmem(tree_root_hash, 32, root_hash, 32);
+
+	expected = read_file(filename, NULL);
+	created = read_file(tree_filename, NULL);
+	g_assert_nonnull(expected);
+	g_assert_nonnull(created);
+	g_assert_true(g_bytes_equal(expected, created));
+}
+
 /* Tests decrypting the known encrypted payload 'dummy.encrypted' with
  * r_crypt_decrypt() by comparing the result against the known scheme of the
  * source data.
@@ -338,6 +429,86 @@ static void crypt_decrypt_test(DMFixture *fixture,
 	g_close(fd, NULL);
 }
 
+/* Tests encrypting and decrypting a payload large enough to be processed by
+ * multiple threads, including the decryption size limit.
+ */
+static void crypt_roundtrip_test(DMFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autofree guint8 *key = r_hex_decode("761305cf2de9a8ff1708eac74676c606630425b22bb8212e5e2314e3e61e8ab5", 32);
+	g_autofree gchar *plain = g_build_filename(fixture->tmpdir, "plain", NULL);
+	g_autofree gchar *encrypted = g_build_filename(fixture->tmpdir, "encrypted", NULL);
+	g_autofree gchar *decrypted = g_build_filename(fixture->tmpdir, "decrypted", NULL);
+	g_autofree gchar *reference = g_build_filename(fixture->tmpdir, "reference", NULL);
+	g_autofree gchar *data = NULL;
+	g_autofree gchar *encdata = NULL;
+	g_autofree gchar *decdata = NULL;
+	g_autofree guint8 *salt = random_bytes(32, 0xd6368505);
+	g_autoptr(RaucVerityTree) tree = NULL;
+	guint8 root_hash[32] = {0};
+	guint8 tree_root_hash[32] = {0};
+	uint64_t combined_size, hash_blocks, read_blocks;
+	const gsize size = 1027 * 4096;
+	gsize len = 0;
+	GError *error = NULL;
+	int fd;
+
+	data = g_malloc(size);
+	for (gsize i = 0; i < size; i += sizeof(guint32)) {
+		guint32 val = g_random_int();
+		memcpy(data + i, &val, sizeof(val));
+	}
+	g_assert_true(g_file_set_contents(plain, data, size, &error));
+	g_assert_no_error(error);
+
+	g_assert_true(r_crypt_encrypt(plain, encrypted, key, &error));
+	g_assert_no_error(error);
+	g_assert_true(g_file_get_contents(encrypted, &encdata, &len, &error));
+	g_assert_no_error(error);
+	g_assert_cmpuint(len, ==, size);
+	g_assert_true(memcmp(data, encdata, 4096) != 0);
+
+	/* encrypting in place gives the same result */
+	tree = r_verity_tree_new(size / 4096, salt);
+	g_assert_nonnull(tree);
+	g_assert_true(r_crypt_encrypt_in_place(plain, key, tree, &error));
+	g_assert_no_error(error);
+	g_assert_true(g_file_get_contents(plain, &decdata, &len, &error));
+	g_assert_no_error(error);
+	g_assert_cmpmem(decdata, len, encdata, size);
+	g_clear_pointer(&decdata, g_free);
+
+	/* the verity tree built while encrypting matches the one built from the file */
+	g_assert_true(g_file_set_contents(reference, encdata, size, &error));
+	g_assert_no_error(error);
+	fd = g_open(reference, O_RDWR);
+	g_assert_cmpint(fd, >, 0);
+	g_assert_cmpint(r_verity_hash_create(fd, size / 4096, &combined_size, root_hash, salt), ==, 0);
+	g_close(fd, NULL);
+	fd = g_open(plain, O_RDWR);
+	g_assert_cmpint(fd, >, 0);
+	g_assert_cmpint(r_verity_tree_fill(tree, fd, &read_blocks), ==, 0);
+	g_assert_cmpuint(read_blocks, ==, 0);
+	g_assert_cmpint(r_verity_tree_write(tree, fd, size, &hash_blocks, tree_root_hash), ==, 0);
+	g_close(fd, NULL);
+	g_assert_cmpuint(size / 4096 + hash_blocks, ==, combined_size);
+	g_assert_cmpmem(tree_root_hash, 32, root_hash, 32);
+
+	g_assert_true(r_crypt_decrypt(encrypted, decrypted, key, 0, &error));
+	g_assert_no_error(error);
+	g_assert_true(g_file_get_contents(decrypted, &decdata, &len, &error));
+	g_assert_no_error(error);
+	g_assert_cmpmem(decdata, len, data, size);
+	g_clear_pointer(&decdata, g_free);
+
+	/* partial sectors beyond the limit are not decrypted */
+	g_assert_true(r_crypt_decrypt(encrypted, decrypted, key, 1000 * 4096 + 100, &error));
+	g_assert_no_error(error);
+	g_assert_true(g_file_get_contents(decrypted, &decdata, &len, &error));
+	g_assert_no_error(error);
+	g_assert_cmpmem(decdata, len, data, 1000 * 4096);
+}
+
 static void verity_hash_create(DMFixture *fixture,
 		gconstpointer user_data)
 {
@@ -514,30 +685,35 @@ int main(int argc, char *argv[])
 
 	g_test_add_func("/dm/verity_simple", dm_verity_simple_test);
 	g_test_add_func("/dm/verity_hash", verity_hash_test);
+	g_test_add_func("/dm/profile", dm_profile_test);
 
 	dm_data = &(DMData) {
 		.data_size = 1,
 		.combined_size = 1,
 	};
 	g_test_add("/dm/create_1", DMFixture, dm_data, dm_fixture_set_up, verity_hash_create, dm_fixture_tear_down);
+	g_test_add("/dm/tree_1", DMFixture, dm_data, dm_fixture_set_up, verity_tree_test, dm_fixture_tear_down);
 
 	dm_data = &(DMData) {
 		.data_size = 2,
 		.combined_size = 2+1,
 	};
 	g_test_add("/dm/create_2", DMFixture, dm_data, dm_fixture_set_up, verity_hash_create, dm_fixture_tear_down);
+	g_test_add("/dm/tree_2", DMFixture, dm_data, dm_fixture_set_up, verity_tree_test, dm_fixture_tear_down);
 
 	dm_data = &(DMData) {
 		.data_size = 128,
 		.combined_size = 128+1,
 	};
 	g_test_add("/dm/create_128", DMFixture, dm_data, dm_fixture_set_up, verity_hash_create, dm_fixture_tear_down);
+	g_test_add("/dm/tree_128", DMFixture, dm_data, dm_fixture_set_up, verity_tree_test, dm_fixture_tear_down);
 
 	dm_data = &(DMData) {
 		.data_size = 257,
 		.combined_size = 257+3+1,
 	};
 	g_test_add("/dm/create_257", DMFixture, dm_data, dm_fixture_set_up, verity_hash_create, dm_fixture_tear_down);
+	g_test_add("/dm/tree_257", DMFixture, dm_data, dm_fixture_set_up, verity_tree_test, dm_fixture_tear_down);
 
 	valid_key = TRUE;
 	g_test_add("/dm/crypt_decrypt/valid_key", DMFixture, &valid_key, dm_fixture_set_up, crypt_decrypt_test, dm_fixture_tear_down);
@@ -549,6 +725,8 @@ int main(int argc, char *argv[])
 	valid_key = FALSE;
 	g_test_add("/dm/crypt_encrypt/invalid_key", DMFixture, &valid_key, dm_fixture_set_up, crypt_encrypt_test, dm_fixture_tear_down);
 
+	g_test_add("/dm/crypt_roundtrip", DMFixture, NULL, dm_fixture_set_up, crypt_roundtrip_test, dm_fixture_tear_down);
+
 	g_test_add("/dm/crypt_create", DMFixture, NULL, dm_fixture_set_up, crypt_create, dm_fixture_tear_down);
 
 	return g_test_run();
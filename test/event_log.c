@@ -363,6 +363,146 @@ static void event_log_test_log_filtering(EventLogFixture *fixture,
 	g_assert_nonnull(strstr(contents, "Example second mark message"));
 }
 
+/* Test writing an index for a logger and querying events using it */
+static void event_log_test_log_index(EventLogFixture *fixture,
+		gconstpointer user_data)
+{
+	REventLogger *logger = NULL;
+	GLogField fields[] = {
+		{"MESSAGE", "Installation started", -1},
+		{"PRIORITY", r_event_log_level_to_priority(G_LOG_LEVEL_INFO), -1},
+		{"MESSAGE_ID", "b05410e8-9e45-4d55-a2eb-ba1e8f6f0493", -1},
+		{"GLIB_DOMAIN", R_EVENT_LOG_DOMAIN, -1},
+		{"RAUC_EVENT_TYPE", "install", -1},
+		{"TRANSACTION_ID", "2d6a4b31-1bd4-49f1-a3ad-0c61bc9e8e7e", -1},
+	};
+	REventLogQuery query = {0};
+	g_autoptr(GPtrArray) events = NULL;
+	g_autoptr(GError) ierror = NULL;
+	g_autofree gchar *index_filename = NULL;
+
+	logger = g_new0(REventLogger, 1);
+	logger->name = g_strdup("testlogger");
+	logger->filename = g_build_filename(fixture->tmpdir, "testfile.log", NULL);
+	logger->format = R_EVENT_LOGFMT_READABLE_SHORT;
+	logger->maxfiles = 3;
+	logger->index = TRUE;
+	logger->events = g_malloc(2 * sizeof(gchar *));
+	logger->events[0] = g_strdup("all");
+	logger->events[1] = NULL;
+
+	r_event_log_setup_logger(logger);
+	g_assert_nonnull(logger->indexstream);
+	/* must be configured */
+	r_context()->config->loggers = g_list_append(r_context()->config->loggers, logger);
+
+	r_event_log_message("mark", "Example mark message");
+	g_log_structured_array(G_LOG_LEVEL_INFO, fields, G_N_ELEMENTS(fields));
+	r_event_log_message("boot", "Example boot message");
+
+	index_filename = g_strdup_printf("%s.idx", logger->filename);
+	g_assert_true(g_file_test(index_filename, G_FILE_TEST_IS_REGULAR));
+
+	/* all events */
+	events = r_event_log_query(logger, &query, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_nonnull(events);
+	g_assert_cmpuint(events->len, ==, 3);
+	g_assert_nonnull(strstr(g_ptr_array_index(events, 0), "Example mark message"));
+	g_assert_nonnull(strstr(g_ptr_array_index(events, 1), "Installation started"));
+	g_assert_nonnull(strstr(g_ptr_array_index(events, 2), "Example boot message"));
+	g_clear_pointer(&events, g_ptr_array_unref);
+
+	/* by type */
+	query.type = "boot";
+	events = r_event_log_query(logger, &query, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_cmpuint(events->len, ==, 1);
+	g_assert_nonnull(strstr(g_ptr_array_index(events, 0), "Example boot message"));
+	g_clear_pointer(&events, g_ptr_array_unref);
+
+	/* by transaction ID */
+	query.type = NULL;
+	query.transaction_id = "2d6a4b31-1bd4-49f1-a3ad-0c61bc9e8e7e";
+	events = r_event_log_query(logger, &query, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_cmpuint(events->len, ==, 1);
+	g_assert_nonnull(strstr(g_ptr_array_index(events, 0), "Installation started"));
+	g_clear_pointer(&events, g_ptr_array_unref);
+
+	/* by time range */
+	query.transaction_id = NULL;
+	query.since = g_get_real_time() / G_USEC_PER_SEC + 3600;
+	events = r_event_log_query(logger, &query, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_cmpuint(events->len, ==, 0);
+	g_clear_pointer(&events, g_ptr_array_unref);
+
+	query.since = 0;
+	query.until = 1;
+	events = r_event_log_query(logger, &query, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_cmpuint(events->len, ==, 0);
+	g_clear_pointer(&events, g_ptr_array_unref);
+
+	/* invalid ID */
+	query.until = 0;
+	query.boot_id = "invalid";
+	events = r_event_log_query(logger, &query, &ierror);
+	g_assert_error(ierror, G_FILE_ERROR, G_FILE_ERROR_INVAL);
+	g_assert_null(events);
+}
+
+#define CONCURRENT_THREADS 4
+#define CONCURRENT_MESSAGES 100
+
+static gpointer log_concurrent_thread(gpointer data)
+{
+	for (guint i = 0; i < CONCURRENT_MESSAGES; i++)
+		r_event_log_message("mark", "Concurrent message %u", i);
+
+	return NULL;
+}
+
+/* Test that events logged from multiple threads are written completely */
+static void event_log_test_log_concurrent(EventLogFixture *fixture,
+		gconstpointer user_data)
+{
+	REventLogger *logger = NULL;
+	GThread *threads[CONCURRENT_THREADS];
+	g_autofree gchar *contents = NULL;
+	g_auto(GStrv) lines = NULL;
+	guint count = 0;
+
+	logger = g_new0(REventLogger, 1);
+	logger->name = g_strdup("testlogger");
+	logger->filename = g_build_filename(fixture->tmpdir, "testfile.log", NULL);
+	logger->format = R_EVENT_LOGFMT_READABLE_SHORT;
+	logger->events = g_malloc(2 * sizeof(gchar *));
+	logger->events[0] = g_strdup("all");
+	logger->events[1] = NULL;
+
+	r_event_log_setup_logger(logger);
+	/* must be configured */
+	r_context()->config->loggers = g_list_append(r_context()->config->loggers, logger);
+
+	for (guint i = 0; i < CONCURRENT_THREADS; i++)
+		threads[i] = g_thread_new("event-log-test", log_concurrent_thread, NULL);
+	for (guint i = 0; i < CONCURRENT_THREADS; i++)
+		g_thread_join(threads[i]);
+
+	g_assert_true(g_file_get_contents(logger->filename, &contents, NULL, NULL));
+	lines = g_strsplit(contents, "\n", -1);
+	for (guint i = 0; lines[i]; i++) {
+		if (lines[i][0] == '\0')
+			continue;
+		g_assert_nonnull(strstr(lines[i], "Concurrent message "));
+		count++;
+	}
+	g_assert_cmpuint(count, ==, CONCURRENT_THREADS * CONCURRENT_MESSAGES);
+	g_assert_cmpint(logger->filesize, ==, strlen(contents));
+}
+
 int main(int argc, char *argv[])
 {
 	RotationTestConfig *rot_test_conf;
@@ -426,6 +566,12 @@ int main(int argc, char *argv[])
 	g_test_add("/event-log/structured/filtering", EventLogFixture, NULL,
 			event_log_fixture_set_up, event_log_test_log_filtering,
 			config_file_fixture_tear_down);
+	g_test_add("/event-log/structured/index", EventLogFixture, NULL,
+			event_log_fixture_set_up, event_log_test_log_index,
+			config_file_fixture_tear_down);
+	g_test_add("/event-log/structured/concurrent", EventLogFixture, NULL,
+			event_log_fixture_set_up, event_log_test_log_concurrent,
+			config_file_fixture_tear_down);
 
 	return g_test_run();
 }
@@ -0,0 +1,404 @@
+#include <locale.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include "file_index.h"
+#include "utils.h"
+
+#include "common.h"
+
+typedef struct {
+	gchar *tmpdir;
+	gchar *srcdir;
+} Fixture;
+
+static void fixture_set_up(Fixture *fixture,
+		gconstpointer user_data)
+{
+	fixture->tmpdir = g_dir_make_tmp("rauc-XXXXXX", NULL);
+	g_assert_nonnull(fixture->tmpdir);
+	g_test_message("file_index tmpdir: %s\n", fixture->tmpdir);
+
+	fixture->srcdir = g_build_filename(fixture->tmpdir, "src", NULL);
+	g_assert_cmpint(g_mkdir(fixture->srcdir, 0755), ==, 0);
+}
+
+static void fixture_tear_down(Fixture *fixture,
+		gconstpointer user_data)
+{
+	g_assert_true(rm_tree(fixture->tmpdir, NULL));
+	g_free(fixture->srcdir);
+	g_free(fixture->tmpdir);
+}
+
+/* Writes in place, so that existing hard links are kept. */
+static void write_src_file(Fixture *fixture, const gchar *name, const gchar *content)
+{
+	g_autofree gchar *path = g_build_filename(fixture->srcdir, name, NULL);
+	FILE *file = g_fopen(path, "w");
+
+	g_assert_nonnull(file);
+	g_assert_cmpint(fputs(content, file), >=, 0);
+	g_assert_cmpint(fclose(file), ==, 0);
+}
+
+static void run_command(const gchar * const *argv)
+{
+	g_autoptr(GError) error = NULL;
+	g_autoptr(GSubprocess) sproc = NULL;
+	gboolean res;
+
+	sproc = g_subprocess_newv(argv, G_SUBPROCESS_FLAGS_NONE, &error);
+	g_assert_no_error(error);
+
+	res = g_subprocess_wait_check(sproc, NULL, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+}
+
+/* Creates a small tree with a regular file, a subdirectory, a symlink and
+ * a hard link. */
+static void create_src_tree(Fixture *fixture)
+{
+	g_autofree gchar *sub = g_build_filename(fixture->srcdir, "sub", NULL);
+	g_autofree gchar *symlink_path = g_build_filename(fixture->srcdir, "symlink", NULL);
+	g_autofree gchar *file = g_build_filename(fixture->srcdir, "file", NULL);
+	g_autofree gchar *hardlink = g_build_filename(fixture->srcdir, "hardlink", NULL);
+
+	write_src_file(fixture, "file", "content of file\n");
+	g_assert_cmpint(g_mkdir(sub, 0755), ==, 0);
+	write_src_file(fixture, "sub/nested", "nested content\n");
+	write_src_file(fixture, "sub/obsolete", "obsolete\n");
+	g_assert_cmpint(symlink("sub/nested", symlink_path), ==, 0);
+	g_assert_cmpint(link(file, hardlink), ==, 0);
+}
+
+static gchar *tar_src_tree(Fixture *fixture, const gchar *name)
+{
+	g_autofree gchar *path = g_build_filename(fixture->tmpdir, name, NULL);
+
+	run_command((const gchar *[]){"tar", "cf", path, "--sort=name", "-C", fixture->srcdir, ".", NULL});
+
+	return g_steal_pointer(&path);
+}
+
+static void test_from_tar(Fixture *fixture, gconstpointer user_data)
+{
+	g_autoptr(GError) error = NULL;
+	g_autoptr(RaucFileIndex) index = NULL;
+	g_autofree gchar *archive = NULL;
+	g_autofree gchar *digest = NULL;
+	const RaucFileEntry *entry;
+
+	create_src_tree(fixture);
+	archive = tar_src_tree(fixture, "image.tar");
+
+	index = r_file_index_from_tar(archive, &error);
+	g_assert_no_error(error);
+	g_assert_nonnull(index);
+
+	/* ., file, hardlink, sub, sub/nested, sub/obsolete, symlink */
+	g_assert_cmpuint(index->entries->len, ==, 7);
+
+	entry = g_hash_table_lookup(index->by_path, "");
+	g_assert_nonnull(entry);
+	g_assert_cmpint(entry->type, ==, R_FILE_ENTRY_DIRECTORY);
+
+	entry = g_hash_table_lookup(index->by_path, "file");
+	g_assert_nonnull(entry);
+	g_assert_cmpint(entry->type, ==, R_FILE_ENTRY_REGULAR);
+	g_assert_cmpstr(entry->name, ==, "./file");
+	g_assert_cmpint(entry->size, ==, 16);
+	digest = g_compute_checksum_for_string(G_CHECKSUM_SHA256, "content of file\n", -1);
+	g_assert_cmpstr(entry->digest, ==, digest);
+
+	entry = g_hash_table_lookup(index->by_path, "hardlink");
+	g_assert_nonnull(entry);
+	g_assert_cmpint(entry->type, ==, R_FILE_ENTRY_HARDLINK);
+	g_assert_cmpstr(entry->link, ==, "file");
+
+	entry = g_hash_table_lookup(index->by_path, "sub");
+	g_assert_nonnull(entry);
+	g_assert_cmpint(entry->type, ==, R_FILE_ENTRY_DIRECTORY);
+	g_assert_cmpuint(entry->mode, ==, 0755);
+
+	entry = g_hash_table_lookup(index->by_path, "symlink");
+	g_assert_nonnull(entry);
+	g_assert_cmpint(entry->type, ==, R_FILE_ENTRY_SYMLINK);
+	g_assert_cmpstr(entry->link, ==, "sub/nested");
+	g_assert_null(entry->digest);
+}
+
+static void test_from_tar_compressed(Fixture *fixture, gconstpointer user_data)
+{
+	g_autoptr(GError) error = NULL;
+	g_autoptr(RaucFileIndex) index = NULL;
+	g_autoptr(RaucFileIndex) compressed_index = NULL;
+	g_autofree gchar *archive = NULL;
+	g_autofree gchar *compressed = NULL;
+
+	create_src_tree(fixture);
+	archive = tar_src_tree(fixture, "image.tar");
+	compressed = g_strconcat(archive, ".gz", NULL);
+	run_command((const gchar *[]){"gzip", "-k", archive, NULL});
+
+	index = r_file_index_from_tar(archive, &error);
+	g_assert_no_error(error);
+	compressed_index = r_file_index_from_tar(compressed, &error);
+	g_assert_no_error(error);
+	g_assert_nonnull(compressed_index);
+
+	g_assert_cmpuint(compressed_index->entries->len, ==, index->entries->len);
+}
+
+static void test_from_tar_invalid(Fixture *fixture, gconstpointer user_data)
+{
+	g_autoptr(GError) error = NULL;
+	g_autoptr(RaucFileIndex) index = NULL;
+	g_autofree gchar *path = NULL;
+
+	path = write_random_file(fixture->tmpdir, "random.tar", 4096, 0x6b2e4d01);
+	g_assert_nonnull(path);
+
+	index = r_file_index_from_tar(path, &error);
+	g_assert_error(error, R_FILE_INDEX_ERROR, R_FILE_INDEX_ERROR_FORMAT);
+	g_assert_null(index);
+}
+
+static void test_save_load(Fixture *fixture, gconstpointer user_data)
+{
+	g_autoptr(GError) error = NULL;
+	g_autoptr(RaucFileIndex) index = NULL;
+	g_autoptr(RaucFileIndex) loaded = NULL;
+	g_autofree gchar *archive = NULL;
+	g_autofree gchar *path = NULL;
+	gboolean res;
+
+	create_src_tree(fixture);
+	/* names which need escaping in the index file */
+	write_src_file(fixture, "tab\tand\nnewline", "special\n");
+	archive = tar_src_tree(fixture, "image.tar");
+	path = g_build_filename(fixture->tmpdir, "image.tar.file-index", NULL);
+
+	index = r_file_index_from_tar(archive, &error);
+	g_assert_no_error(error);
+
+	res = r_file_index_save(index, path, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+
+	loaded = r_file_index_load(path, &error);
+	g_assert_no_error(error);
+	g_assert_nonnull(loaded);
+
+	g_assert_cmpuint(loaded->entries->len, ==, index->entries->len);
+	for (guint i = 0; i < index->entries->len; i++) {
+		const RaucFileEntry *a = g_ptr_array_index(index->entries, i);
+		const RaucFileEntry *b = g_ptr_array_index(loaded->entries, i);
+
+		g_assert_cmpstr(a->name, ==, b->name);
+		g_assert_cmpstr(a->path, ==, b->path);
+		g_assert_cmpint(a->type, ==, b->type);
+		g_assert_cmpuint(a->mode, ==, b->mode);
+		g_assert_cmpuint(a->uid, ==, b->uid);
+		g_assert_cmpuint(a->gid, ==, b->gid);
+		g_assert_cmpint(a->mtime, ==, b->mtime);
+		g_assert_cmpint(a->size, ==, b->size);
+		g_assert_cmpstr(a->digest, ==, b->digest);
+		g_assert_cmpstr(a->link, ==, b->link);
+	}
+	g_assert_nonnull(g_hash_table_lookup(loaded->by_path, "tab\tand\nnewline"));
+
+	/* other format versions are rejected */
+	g_assert_true(g_file_set_contents(path, "rauc-file-index 1\n", -1, NULL));
+	g_clear_pointer(&loaded, r_file_index_free);
+	loaded = r_file_index_load(path, &error);
+	g_assert_error(error, R_FILE_INDEX_ERROR, R_FILE_INDEX_ERROR_FORMAT);
+	g_assert_null(loaded);
+}
+
+static gboolean diff_contains(const GPtrArray *entries, const gchar *path)
+{
+	for (guint i = 0; i < entries->len; i++) {
+		const RaucFileEntry *entry = g_ptr_array_index(entries, i);
+
+		if (g_str_equal(entry->path, path))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+static void test_diff(Fixture *fixture, gconstpointer user_data)
+{
+	g_autoptr(GError) error = NULL;
+	g_autoptr(RaucFileIndex) old = NULL;
+	g_autoptr(RaucFileIndex) new = NULL;
+	g_autoptr(RaucFileIndexDiff) diff = NULL;
+	g_autofree gchar *old_archive = NULL;
+	g_autofree gchar *new_archive = NULL;
+	g_autofree gchar *nested = g_build_filename(fixture->srcdir, "sub/nested", NULL);
+	g_autofree gchar *obsolete = g_build_filename(fixture->srcdir, "sub/obsolete", NULL);
+
+	create_src_tree(fixture);
+	old_archive = tar_src_tree(fixture, "old.tar");
+
+	/* change content (also changing the hard link), mode, remove and add */
+	write_src_file(fixture, "file", "new content of file\n");
+	g_assert_cmpint(g_chmod(nested, 0600), ==, 0);
+	g_assert_cmpint(g_unlink(obsolete), ==, 0);
+	write_src_file(fixture, "added", "added\n");
+	new_archive = tar_src_tree(fixture, "new.tar");
+
+	old = r_file_index_from_tar(old_archive, &error);
+	g_assert_no_error(error);
+	new = r_file_index_from_tar(new_archive, &error);
+	g_assert_no_error(error);
+
+	diff = r_file_index_diff(old, new);
+	g_assert_nonnull(diff);
+
+	g_assert_cmpuint(diff->removed->len, ==, 1);
+	g_assert_true(diff_contains(diff->removed, "sub/obsolete"));
+
+	g_assert_cmpuint(diff->changed->len, ==, 3);
+	g_assert_true(diff_contains(diff->changed, "file"));
+	g_assert_true(diff_contains(diff->changed, "hardlink"));
+	g_assert_true(diff_contains(diff->changed, "added"));
+	g_assert_cmpint(diff->changed_size, ==, 26);
+
+	g_assert_true(diff_contains(diff->updated, "sub/nested"));
+	g_assert_true(diff_contains(diff->kept, "sub/nested"));
+	g_assert_true(diff_contains(diff->kept, "symlink"));
+	g_assert_false(diff_contains(diff->kept, "file"));
+	/* ., sub, sub/nested, symlink */
+	g_assert_cmpuint(diff->kept->len, ==, 4);
+}
+
+static void test_xattrs(Fixture *fixture, gconstpointer user_data)
+{
+	g_autoptr(GError) error = NULL;
+	g_autoptr(RaucFileIndex) old = NULL;
+	g_autoptr(RaucFileIndex) new = NULL;
+	g_autoptr(RaucFileIndex) loaded = NULL;
+	g_autoptr(RaucFileIndexDiff) diff = NULL;
+	g_autofree gchar *old_archive = g_build_filename(fixture->tmpdir, "old.tar", NULL);
+	g_autofree gchar *new_archive = g_build_filename(fixture->tmpdir, "new.tar", NULL);
+	g_autofree gchar *path = g_build_filename(fixture->tmpdir, "old.tar.file-index", NULL);
+	g_autofree gchar *file = g_build_filename(fixture->srcdir, "file", NULL);
+	const RaucFileEntry *entry;
+	gboolean res;
+
+	create_src_tree(fixture);
+	if (setxattr(file, "user.rauc", "one", 3, 0) != 0) {
+		g_test_skip("user xattrs not supported");
+		return;
+	}
+	run_command((const gchar *[]){"tar", "cf", old_archive, "--sort=name", "--xattrs", "--xattrs-include=*",
+	                              "-C", fixture->srcdir, ".", NULL});
+	g_assert_cmpint(setxattr(file, "user.rauc", "two", 3, 0), ==, 0);
+	run_command((const gchar *[]){"tar", "cf", new_archive, "--sort=name", "--xattrs", "--xattrs-include=*",
+	                              "-C", fixture->srcdir, ".", NULL});
+
+	old = r_file_index_from_tar(old_archive, &error);
+	g_assert_no_error(error);
+	new = r_file_index_from_tar(new_archive, &error);
+	g_assert_no_error(error);
+
+	entry = g_hash_table_lookup(old->by_path, "file");
+	g_assert_nonnull(entry);
+	g_assert_nonnull(entry->xattrs);
+	entry = g_hash_table_lookup(old->by_path, "sub/nested");
+	g_assert_nonnull(entry);
+	g_assert_null(entry->xattrs);
+
+	/* the digest is kept in the index file */
+	res = r_file_index_save(old, path, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+	loaded = r_file_index_load(path, &error);
+	g_assert_no_error(error);
+	g_assert_cmpstr(((const RaucFileEntry *)g_hash_table_lookup(loaded->by_path, "file"))->xattrs, ==,
+			((const RaucFileEntry *)g_hash_table_lookup(old->by_path, "file"))->xattrs);
+
+	/* different attributes can only be restored by extracting the file */
+	diff = r_file_index_diff(loaded, new);
+	g_assert_nonnull(diff);
+	g_assert_cmpuint(diff->removed->len, ==, 0);
+	g_assert_true(diff_contains(diff->changed, "file"));
+	g_assert_true(diff_contains(diff->changed, "hardlink"));
+	g_assert_false(diff_contains(diff->kept, "file"));
+	g_assert_true(diff_contains(diff->kept, "sub/nested"));
+}
+
+static void test_entry_check(Fixture *fixture, gconstpointer user_data)
+{
+	g_autoptr(GError) error = NULL;
+	g_autoptr(RaucFileIndex) index = NULL;
+	g_autofree gchar *archive = NULL;
+	g_autofree gchar *dest = g_build_filename(fixture->tmpdir, "dest", NULL);
+	g_autofree gchar *nested = g_build_filename(dest, "sub/nested", NULL);
+	g_autofree gchar *symlink_path = g_build_filename(dest, "symlink", NULL);
+	const RaucFileEntry *entry;
+	gboolean res;
+
+	create_src_tree(fixture);
+	archive = tar_src_tree(fixture, "image.tar");
+	g_assert_cmpint(g_mkdir(dest, 0755), ==, 0);
+
+	run_command((const gchar *[]){"tar", "xf", archive, "-C", dest, NULL});
+
+	index = r_file_index_from_tar(archive, &error);
+	g_assert_no_error(error);
+
+	for (guint i = 0; i < index->entries->len; i++) {
+		entry = g_ptr_array_index(index->entries, i);
+		res = r_file_entry_check(entry, dest, &error);
+		g_assert_no_error(error);
+		g_assert_true(res);
+	}
+
+	/* a different size is detected without reading the content */
+	g_assert_true(g_file_set_contents(nested, "modified nested content\n", -1, NULL));
+	entry = g_hash_table_lookup(index->by_path, "sub/nested");
+	res = r_file_entry_check(entry, dest, &error);
+	g_assert_error(error, R_FILE_INDEX_ERROR, R_FILE_INDEX_ERROR_FAILED);
+	g_assert_false(res);
+	g_clear_error(&error);
+
+	/* a replaced symlink target */
+	g_assert_cmpint(g_unlink(symlink_path), ==, 0);
+	g_assert_cmpint(symlink("file", symlink_path), ==, 0);
+	entry = g_hash_table_lookup(index->by_path, "symlink");
+	res = r_file_entry_check(entry, dest, &error);
+	g_assert_error(error, R_FILE_INDEX_ERROR, R_FILE_INDEX_ERROR_FAILED);
+	g_assert_false(res);
+	g_clear_error(&error);
+
+	/* a missing file */
+	g_assert_cmpint(g_unlink(nested), ==, 0);
+	entry = g_hash_table_lookup(index->by_path, "sub/nested");
+	res = r_file_entry_check(entry, dest, &error);
+	g_assert_error(error, G_FILE_ERROR, G_FILE_ERROR_NOENT);
+	g_assert_false(res);
+}
+
+int main(int argc, char *argv[])
+{
+	setlocale(LC_ALL, "C");
+
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add("/file_index/from-tar", Fixture, NULL, fixture_set_up, test_from_tar, fixture_tear_down);
+	g_test_add("/file_index/from-tar-compressed", Fixture, NULL, fixture_set_up, test_from_tar_compressed, fixture_tear_down);
+	g_test_add("/file_index/from-tar-invalid", Fixture, NULL, fixture_set_up, test_from_tar_invalid, fixture_tear_down);
+	g_test_add("/file_index/save-load", Fixture, NULL, fixture_set_up, test_save_load, fixture_tear_down);
+	g_test_add("/file_index/diff", Fixture, NULL, fixture_set_up, test_diff, fixture_tear_down);
+	g_test_add("/file_index/xattrs", Fixture, NULL, fixture_set_up, test_xattrs, fixture_tear_down);
+	g_test_add("/file_index/entry-check", Fixture, NULL, fixture_set_up, test_entry_check, fixture_tear_down);
+
+	return g_test_run();
+}
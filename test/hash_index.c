@@ -4,8 +4,10 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include "hash_index.h"
+#include "slot.h"
 #include "stats.h"
 #include "utils.h"
 
@@ -282,6 +284,593 @@ static void test_ranges(Fixture *fixture, gconstpointer user_data)
 	g_clear_pointer(&hash, g_free);
 }
 
+/* Tests looking up chunk numbers without reading the data */
+static void test_find_chunk(Fixture *fixture, gconstpointer user_data)
+{
+	g_autoptr(GError) error = NULL;
+	g_autoptr(RaucHashIndex) index = NULL;
+	g_autofree RaucHashIndexChunk *chunk = g_new0(RaucHashIndexChunk, 1);
+	g_autofree gchar *data_filename = NULL;
+	g_autofree guint8 *hash = NULL;
+	gboolean res = FALSE;
+	int templatefd = -1, datafd = -1;
+	guint32 number = 0;
+
+	templatefd = g_open("test/dummy.verity", O_RDONLY|O_CLOEXEC, 0);
+	g_assert_cmpint(templatefd, >, 0);
+
+	data_filename = write_random_file(fixture->tmpdir, "data.img", 4096*64, 0xf56ce6bf);
+	g_assert_nonnull(data_filename);
+
+	datafd = g_open(data_filename, O_RDWR|O_CLOEXEC, 0);
+	g_assert_cmpint(datafd, >, 0);
+
+	// force chunks 0 and 16 to ad7facb2586fc6e966c004d7d1d16b024f5805ff7cb47c7a85dabd8b48892ca7
+	g_assert_true(r_pread_exact(templatefd, chunk->data, 4096, 0*4096, NULL));
+	g_assert_true(r_pwrite_exact(datafd, chunk->data, 4096, 0*4096, NULL));
+	g_assert_true(r_pwrite_exact(datafd, chunk->data, 4096, 16*4096, NULL));
+	g_assert_true(g_close(templatefd, NULL));
+
+	index = r_hash_index_open("test", datafd, NULL, &error);
+	g_assert_no_error(error);
+	g_assert_nonnull(index);
+
+	// overwrite chunk 0, which is not noticed without reading the data
+	memset(chunk->data, 0xff, 4096);
+	g_assert_true(r_pwrite_exact(datafd, chunk->data, 4096, 0*4096, NULL));
+
+	hash = r_hex_decode("ad7facb2586fc6e966c004d7d1d16b024f5805ff7cb47c7a85dabd8b48892ca7", 32);
+	res = r_hash_index_find_chunk(index, hash, &number, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+	g_assert_cmpuint(number, ==, 0);
+
+	// the second copy is used when the first one is excluded
+	index->invalid_below = 1;
+	res = r_hash_index_find_chunk(index, hash, &number, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+	g_assert_cmpuint(number, ==, 16);
+
+	// nothing in range
+	index->invalid_from = 16;
+	res = r_hash_index_find_chunk(index, hash, &number, &error);
+	g_assert_error(error, R_HASH_INDEX_ERROR, R_HASH_INDEX_ERROR_NOT_FOUND);
+	g_assert_false(res);
+	g_clear_error(&error);
+
+	// get_chunk uses the same selection
+	index->invalid_from = G_MAXUINT32;
+	res = r_hash_index_get_chunk(index, hash, chunk, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+	g_assert_cmpuint(chunk->number, ==, 16);
+}
+
+/* Tests that the merged lookup selects the same chunks as searching each
+ * source in order */
+static void test_index_set(Fixture *fixture, gconstpointer user_data)
+{
+	g_autoptr(GError) error = NULL;
+	g_autoptr(GPtrArray) sources = g_ptr_array_new_with_free_func((GDestroyNotify)r_hash_index_free);
+	g_autoptr(RaucHashIndexSet) set = NULL;
+	g_autofree gchar *first_filename = NULL;
+	g_autofree gchar *second_filename = NULL;
+	g_autofree guint8 *data = g_malloc(4096);
+	RaucHashIndex *first, *second;
+	const guint8 (*hashes)[32];
+	g_autofree guint8 *missing = NULL;
+	gboolean res = FALSE;
+	guint source = 0;
+	guint32 number = 0;
+	int datafd = -1;
+
+	first_filename = write_random_file(fixture->tmpdir, "first.img", 4096*64, 0xf56ce6bf);
+	second_filename = write_random_file(fixture->tmpdir, "second.img", 4096*32, 0x2abff992);
+
+	// chunk 20 of the first source is also chunk 3 and 7 of the second one
+	datafd = g_open(first_filename, O_RDONLY|O_CLOEXEC, 0);
+	g_assert_cmpint(datafd, >, 0);
+	g_assert_true(r_pread_exact(datafd, data, 4096, 20*4096, NULL));
+	g_assert_true(g_close(datafd, NULL));
+	datafd = g_open(second_filename, O_RDWR|O_CLOEXEC, 0);
+	g_assert_cmpint(datafd, >, 0);
+	g_assert_true(r_pwrite_exact(datafd, data, 4096, 3*4096, NULL));
+	g_assert_true(r_pwrite_exact(datafd, data, 4096, 7*4096, NULL));
+	g_assert_true(g_close(datafd, NULL));
+
+	datafd = g_open(first_filename, O_RDONLY|O_CLOEXEC, 0);
+	first = r_hash_index_open("first", datafd, NULL, &error);
+	g_assert_no_error(error);
+	g_assert_true(g_close(datafd, NULL));
+	g_ptr_array_add(sources, first);
+
+	datafd = g_open(second_filename, O_RDONLY|O_CLOEXEC, 0);
+	second = r_hash_index_open("second", datafd, NULL, &error);
+	g_assert_no_error(error);
+	g_assert_true(g_close(datafd, NULL));
+	g_ptr_array_add(sources, second);
+
+	set = r_hash_index_set_new(sources, &error);
+	g_assert_no_error(error);
+	g_assert_nonnull(set);
+	g_assert_cmpuint(set->count, ==, 96);
+
+	hashes = g_bytes_get_data(first->hashes, NULL);
+
+	// the first source is preferred
+	res = r_hash_index_set_find(set, hashes[20], &source, &number);
+	g_assert_true(res);
+	g_assert_cmpuint(source, ==, 0);
+	g_assert_cmpuint(number, ==, 20);
+
+	// the valid ranges are checked on each lookup
+	first->invalid_from = 20;
+	res = r_hash_index_set_find(set, hashes[20], &source, &number);
+	g_assert_true(res);
+	g_assert_cmpuint(source, ==, 1);
+	g_assert_cmpuint(number, ==, 3);
+
+	second->invalid_below = 4;
+	res = r_hash_index_set_find(set, hashes[20], &source, &number);
+	g_assert_true(res);
+	g_assert_cmpuint(source, ==, 1);
+	g_assert_cmpuint(number, ==, 7);
+
+	second->invalid_from = 7;
+	res = r_hash_index_set_find(set, hashes[20], &source, &number);
+	g_assert_false(res);
+
+	// all other chunks are found at their position
+	first->invalid_from = G_MAXUINT32;
+	for (guint32 c = 0; c < first->count; c++) {
+		res = r_hash_index_set_find(set, hashes[c], &source, &number);
+		g_assert_true(res);
+		g_assert_cmpuint(source, ==, 0);
+		g_assert_cmpuint(number, ==, c);
+	}
+
+	missing = r_hex_decode("ad7facb2586fc6e966c004d7d1d16b024f5805ff7cb47c7a85dabd8b48892ca7", 32);
+	res = r_hash_index_set_find(set, missing, &source, &number);
+	g_assert_false(res);
+}
+
+/* Tests batched hashing of multiple chunks with a reused digest context */
+static void test_hash_chunks(Fixture *fixture, gconstpointer user_data)
+{
+	g_autofree guint8 *data = g_malloc0(4096*3);
+	guint8 hashes[32*3] = {0};
+	g_autofree guint8 *hash = NULL;
+
+	// only the middle chunk contains non-zero data
+	data[4096+3] = 1;
+
+	r_hash_index_hash_chunks(data, 3, hashes);
+
+	g_assert_cmpmem(&hashes[0*32], 32, R_HASH_INDEX_ZERO_CHUNK, 32);
+	g_assert_cmpmem(&hashes[2*32], 32, R_HASH_INDEX_ZERO_CHUNK, 32);
+	g_assert_true(memcmp(&hashes[1*32], R_HASH_INDEX_ZERO_CHUNK, 32) != 0);
+
+	// zero chunks are not hashed, so check the constant separately
+	{
+		g_autoptr(GChecksum) checksum = g_checksum_new(G_CHECKSUM_SHA256);
+		guint8 digest[32];
+		gsize digest_len = sizeof(digest);
+
+		g_checksum_update(checksum, data, 4096);
+		g_checksum_get_digest(checksum, digest, &digest_len);
+		g_assert_cmpmem(digest, digest_len, R_HASH_INDEX_ZERO_CHUNK, 32);
+	}
+
+	// hashing a single chunk must produce the same result
+	hash = g_malloc0(32);
+	r_hash_index_hash_chunks(&data[4096], 1, hash);
+	g_assert_cmpmem(&hashes[1*32], 32, hash, 32);
+}
+
+/* Tests that the parallel hashing produces the same hashes as hashing each
+ * chunk individually, using a size which spans multiple read blocks and ends
+ * with a partial block */
+static void test_parallel(Fixture *fixture, gconstpointer user_data)
+{
+	g_autoptr(GError) error = NULL;
+	g_autoptr(RaucHashIndex) index = NULL;
+	g_autofree guint8 *data = NULL;
+	g_autofree gchar *data_filename = NULL;
+	const guint8 *hashes = NULL;
+	guint32 count = 256*3+17;
+	gsize size = 0;
+	int datafd = -1;
+
+	data_filename = write_random_file(fixture->tmpdir, "data.img", 4096*count, 0x3c1a5e77);
+	g_assert_nonnull(data_filename);
+
+	g_assert_true(g_file_get_contents(data_filename, (gchar **)&data, &size, NULL));
+	g_assert_cmpuint(size, ==, 4096*count);
+
+	datafd = g_open(data_filename, O_RDONLY|O_CLOEXEC, 0);
+	g_assert_cmpint(datafd, >, 0);
+
+	index = r_hash_index_open("test", datafd, NULL, &error);
+	g_assert_no_error(error);
+	g_assert_nonnull(index);
+	g_assert_true(g_close(datafd, NULL));
+
+	g_assert_cmpuint(index->count, ==, count);
+	g_assert_cmpuint(g_bytes_get_size(index->hashes), ==, 32*count);
+	hashes = g_bytes_get_data(index->hashes, NULL);
+
+	for (guint32 i = 0; i < count; i++) {
+		g_autoptr(GChecksum) checksum = g_checksum_new(G_CHECKSUM_SHA256);
+		guint8 digest[32];
+		gsize digest_len = sizeof(digest);
+
+		g_checksum_update(checksum, &data[(gsize)i*4096], 4096);
+		g_checksum_get_digest(checksum, digest, &digest_len);
+		g_assert_cmpmem(digest, 32, &hashes[(gsize)i*32], 32);
+	}
+}
+
+/* Tests that the slot hash index is stored as a plain hash array with the
+ * lookup table in a separate file, and is loaded without rebuilding the
+ * lookup */
+static void test_stored_lookup(Fixture *fixture, gconstpointer user_data)
+{
+	g_autoptr(GError) error = NULL;
+	g_autoptr(RaucHashIndex) index = NULL;
+	g_autoptr(RaucHashIndex) stored = NULL;
+	g_autoptr(RaucSlot) slot = g_new0(RaucSlot, 1);
+	g_autofree RaucHashIndexChunk *chunk = g_new0(RaucHashIndexChunk, 1);
+	g_autofree gchar *index_filename = NULL;
+	g_autofree gchar *lookup_filename = NULL;
+	g_autofree gchar *contents = NULL;
+	g_autofree gchar *lookup_contents = NULL;
+	g_autofree guint8 *hash = NULL;
+	g_autofree guint8 (*expected)[32] = NULL;
+	RaucChecksum checksum = {
+		.type = G_CHECKSUM_SHA256,
+		.digest = (gchar *)"0123456789abcdef",
+	};
+	gsize size = 0;
+	gboolean res = FALSE;
+	int datafd = -1;
+	guint32 tmp_u32 = 0;
+
+	datafd = g_open("test/dummy.verity", O_RDONLY|O_CLOEXEC, 0);
+	g_assert_cmpint(datafd, >, 0);
+
+	index = r_hash_index_open("test", datafd, NULL, &error);
+	g_assert_no_error(error);
+	g_assert_nonnull(index);
+
+	slot->name = g_strdup("rootfs.0");
+	slot->data_directory = g_strdup(fixture->tmpdir);
+
+	res = r_hash_index_export_slot(index, slot, &checksum, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+
+	index_filename = g_build_filename(fixture->tmpdir, "hash-0123456789abcdef", "block-hash-index", NULL);
+	g_assert_true(g_file_get_contents(index_filename, &contents, &size, NULL));
+
+	// the index file only contains the plain hashes, as used by older versions
+	g_assert_cmpmem(contents, size, g_bytes_get_data(index->hashes, NULL), 132*32);
+
+	lookup_filename = g_strconcat(index_filename, ".lookup", NULL);
+	g_assert_true(g_file_test(lookup_filename, G_FILE_TEST_IS_REGULAR));
+
+	stored = r_hash_index_open("stored", datafd, index_filename, &error);
+	g_assert_no_error(error);
+	g_assert_nonnull(stored);
+	g_assert_true(g_close(datafd, NULL));
+
+	g_assert_cmpuint(stored->count, ==, 132);
+	g_assert_cmpuint(stored->bucket_bits, ==, index->bucket_bits);
+	g_assert_cmpmem(g_bytes_get_data(stored->lookup_data, NULL), g_bytes_get_size(stored->lookup_data),
+			g_bytes_get_data(index->lookup_data, NULL), g_bytes_get_size(index->lookup_data));
+
+	// chunk 64
+	hash = r_hex_decode("8dbe6bea5b329593e33668434e9ff515f49215dd88d1e923ef3e04d9b25fa2f1", 32);
+	res = r_hash_index_get_chunk(stored, hash, chunk, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+	g_assert_cmpuint(chunk->number, ==, 64);
+	memcpy(&tmp_u32, chunk->data, sizeof(tmp_u32));
+	g_assert_cmphex(64, ==, GUINT32_FROM_BE(tmp_u32));
+
+	// the stored index is verified against the data
+	g_assert_false(stored->hashes_calculated);
+	res = r_hash_index_has_chunk_at(stored, 64, hash, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+	res = r_hash_index_has_chunk_at(stored, 63, hash, &error);
+	g_assert_error(error, R_HASH_INDEX_ERROR, R_HASH_INDEX_ERROR_NOT_FOUND);
+	g_assert_false(res);
+	g_clear_error(&error);
+	res = r_hash_index_has_chunk_at(stored, 132, hash, &error);
+	g_assert_error(error, R_HASH_INDEX_ERROR, R_HASH_INDEX_ERROR_NOT_FOUND);
+	g_assert_false(res);
+	g_clear_error(&error);
+	g_clear_pointer(&hash, g_free);
+
+	// ranges are verified in blocks, stopping at the first mismatch
+	expected = g_malloc(132*32);
+	memcpy(expected, g_bytes_get_data(index->hashes, NULL), 132*32);
+	g_assert_cmpuint(r_hash_index_count_chunks_at(stored, 0, 132, expected, &error), ==, 132);
+	g_assert_no_error(error);
+	g_assert_cmpuint(r_hash_index_count_chunks_at(stored, 10, 200, &expected[10], &error), ==, 122);
+	g_assert_no_error(error);
+	expected[100][0] ^= 0xff;
+	g_assert_cmpuint(r_hash_index_count_chunks_at(stored, 0, 132, expected, &error), ==, 100);
+	g_assert_no_error(error);
+	g_assert_cmpuint(r_hash_index_count_chunks_at(stored, 100, 32, &expected[100], &error), ==, 0);
+	g_assert_no_error(error);
+	g_assert_cmpuint(r_hash_index_count_chunks_at(stored, 132, 1, expected, &error), ==, 0);
+	g_assert_no_error(error);
+
+	// a damaged lookup table is ignored
+	g_clear_pointer(&stored, r_hash_index_free);
+	g_assert_true(g_file_get_contents(lookup_filename, &lookup_contents, &size, NULL));
+	lookup_contents[4] ^= 0xff;
+	g_assert_true(g_file_set_contents(lookup_filename, lookup_contents, size, NULL));
+
+	datafd = g_open("test/dummy.verity", O_RDONLY|O_CLOEXEC, 0);
+	g_assert_cmpint(datafd, >, 0);
+	g_test_expect_message(G_LOG_DOMAIN, G_LOG_LEVEL_INFO, "using existing hash index for stored from *");
+	g_test_expect_message(G_LOG_DOMAIN, G_LOG_LEVEL_WARNING, "ignoring invalid lookup table in hash index");
+	stored = r_hash_index_open("stored", datafd, index_filename, &error);
+	g_test_assert_expected_messages();
+	g_assert_no_error(error);
+	g_assert_nonnull(stored);
+	g_assert_true(g_close(datafd, NULL));
+	g_assert_cmpuint(stored->count, ==, 132);
+	g_assert_cmpmem(g_bytes_get_data(stored->lookup_data, NULL), g_bytes_get_size(stored->lookup_data),
+			g_bytes_get_data(index->lookup_data, NULL), g_bytes_get_size(index->lookup_data));
+
+	// a lookup table is ignored after the index file was replaced (by an older version)
+	g_clear_pointer(&stored, r_hash_index_free);
+	res = r_hash_index_export_slot(index, slot, &checksum, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+	g_assert_true(g_file_set_contents(index_filename, contents, 132*32, NULL));
+
+	datafd = g_open("test/dummy.verity", O_RDONLY|O_CLOEXEC, 0);
+	g_assert_cmpint(datafd, >, 0);
+	g_test_expect_message(G_LOG_DOMAIN, G_LOG_LEVEL_INFO, "using existing hash index for stored from *");
+	g_test_expect_message(G_LOG_DOMAIN, G_LOG_LEVEL_INFO, "ignoring lookup table for a different hash index file");
+	stored = r_hash_index_open("stored", datafd, index_filename, &error);
+	g_test_assert_expected_messages();
+	g_assert_no_error(error);
+	g_assert_nonnull(stored);
+	g_assert_true(g_close(datafd, NULL));
+	g_assert_cmpuint(stored->count, ==, 132);
+	g_assert_cmpmem(g_bytes_get_data(stored->lookup_data, NULL), g_bytes_get_size(stored->lookup_data),
+			g_bytes_get_data(index->lookup_data, NULL), g_bytes_get_size(index->lookup_data));
+}
+
+/* Writes a partial hash file as left by an interrupted
+ * r_hash_index_build_slot() run: a header with the magic, the number of
+ * chunks in the slot, the number of hashed chunks and the SHA-256 of their
+ * content, followed by the hashes (and possibly an incomplete one). */
+static void write_partial_file(const gchar *filename, guint32 count, guint32 done,
+		const guint8 *digest, const guint8 *hashes, gsize hashes_size)
+{
+	g_autoptr(GByteArray) contents = g_byte_array_new();
+	guint8 zero_digest[32] = {0};
+
+	g_byte_array_append(contents, (const guint8 *)"RHIPART1", 8);
+	g_byte_array_append(contents, (const guint8 *)&count, sizeof(count));
+	g_byte_array_append(contents, (const guint8 *)&done, sizeof(done));
+	g_byte_array_append(contents, digest ? digest : zero_digest, 32);
+	g_byte_array_append(contents, hashes, hashes_size);
+
+	g_assert_true(g_file_set_contents(filename, (const gchar *)contents->data, contents->len, NULL));
+}
+
+/* Builds the index for the slot with an unknown checksum and checks that the
+ * result matches the expected index. */
+static void check_build_slot(const RaucSlot *slot, const RaucHashIndex *index, const gchar *digest)
+{
+	g_autoptr(GError) error = NULL;
+	g_autoptr(RaucHashIndex) stored = NULL;
+	g_autofree gchar *partial_filename = NULL;
+	g_autofree gchar *index_filename = NULL;
+	RaucChecksum checksum = {0};
+	gboolean res = FALSE;
+	int datafd = -1;
+
+	res = r_hash_index_build_slot(slot, &checksum, NULL, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+	g_assert_cmpstr(checksum.digest, ==, digest);
+	g_assert_cmpint(checksum.size, ==, 2*1024*1024);
+
+	partial_filename = g_build_filename(slot->data_directory, "hash-unknown", "block-hash-index.partial", NULL);
+	g_assert_false(g_file_test(partial_filename, G_FILE_TEST_EXISTS));
+
+	index_filename = g_build_filename(slot->data_directory, "hash-unknown", "block-hash-index", NULL);
+	g_assert_false(g_file_test(index_filename, G_FILE_TEST_EXISTS));
+	g_clear_pointer(&index_filename, g_free);
+	index_filename = g_strdup_printf("%s/hash-%s/block-hash-index", slot->data_directory, digest);
+
+	datafd = g_open(slot->device, O_RDONLY|O_CLOEXEC, 0);
+	g_assert_cmpint(datafd, >, 0);
+	stored = r_hash_index_open("stored", datafd, index_filename, &error);
+	g_assert_no_error(error);
+	g_assert_nonnull(stored);
+	g_assert_true(g_close(datafd, NULL));
+	g_assert_false(stored->hashes_calculated);
+	g_assert_cmpuint(stored->count, ==, 512);
+	g_assert_cmpmem(g_bytes_get_data(stored->hashes, NULL), g_bytes_get_size(stored->hashes),
+			g_bytes_get_data(index->hashes, NULL), g_bytes_get_size(index->hashes));
+
+	g_free(checksum.digest);
+}
+
+/* Tests building a slot index in increments, continuing an interrupted run
+ * and calculating the unknown slot checksum */
+static void test_build_slot(Fixture *fixture, gconstpointer user_data)
+{
+	g_autoptr(GError) error = NULL;
+	g_autoptr(RaucHashIndex) index = NULL;
+	g_autoptr(RaucSlot) slot = g_new0(RaucSlot, 1);
+	g_autoptr(GCancellable) cancellable = g_cancellable_new();
+	g_autoptr(GChecksum) ctx = NULL;
+	g_autofree gchar *filename = NULL;
+	g_autofree gchar *contents = NULL;
+	g_autofree gchar *digest = NULL;
+	g_autofree gchar *partial_filename = NULL;
+	g_autofree guint8 *zero_hashes = g_malloc0(256*32);
+	guint8 first_digest[32];
+	gsize first_digest_len = sizeof(first_digest);
+	RaucChecksum checksum = {0};
+	gsize size = 0;
+	gboolean res = FALSE;
+	int datafd = -1;
+
+	/* two blocks of 256 chunks */
+	filename = write_random_file(fixture->tmpdir, "slot.img", 2*1024*1024, 0x2abff992);
+	g_assert_nonnull(filename);
+	g_assert_true(g_file_get_contents(filename, &contents, &size, NULL));
+	digest = g_compute_checksum_for_data(G_CHECKSUM_SHA256, (const guchar *)contents, size);
+	ctx = g_checksum_new(G_CHECKSUM_SHA256);
+	g_checksum_update(ctx, (const guchar *)contents, 1024*1024);
+	g_checksum_get_digest(ctx, first_digest, &first_digest_len);
+
+	datafd = g_open(filename, O_RDONLY|O_CLOEXEC, 0);
+	g_assert_cmpint(datafd, >, 0);
+	index = r_hash_index_open("test", datafd, NULL, &error);
+	g_assert_no_error(error);
+	g_assert_nonnull(index);
+	g_assert_true(g_close(datafd, NULL));
+
+	slot->name = g_strdup("rootfs.0");
+	slot->device = g_strdup(filename);
+	slot->data_directory = g_build_filename(fixture->tmpdir, "data", NULL);
+
+	// no checksum is returned when cancelled
+	g_cancellable_cancel(cancellable);
+	res = r_hash_index_build_slot(slot, &checksum, cancellable, &error);
+	g_assert_error(error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+	g_assert_false(res);
+	g_clear_error(&error);
+	g_assert_null(checksum.digest);
+
+	// simulate an interrupted run with an incomplete last hash
+	partial_filename = g_build_filename(slot->data_directory, "hash-unknown", "block-hash-index.partial", NULL);
+	write_partial_file(partial_filename, 512, 256, first_digest,
+			g_bytes_get_data(index->hashes, NULL), 256*32 + 5);
+	check_build_slot(slot, index, digest);
+
+	// stale hashes are discarded if the slot content has changed since
+	write_partial_file(partial_filename, 512, 256, NULL, zero_hashes, 256*32);
+	check_build_slot(slot, index, digest);
+
+	// or if the slot size has changed
+	write_partial_file(partial_filename, 256, 256, first_digest, zero_hashes, 256*32);
+	check_build_slot(slot, index, digest);
+
+	// or if the file is from an older version without a header
+	g_assert_true(g_file_set_contents(partial_filename, (const gchar *)zero_hashes, 256*32, NULL));
+	check_build_slot(slot, index, digest);
+}
+
+/* Tests comparing data with an index and reporting the differing chunks, as
+ * used for verify-after-write */
+static void test_verify_data(Fixture *fixture, gconstpointer user_data)
+{
+	g_autoptr(GError) error = NULL;
+	g_autoptr(RaucHashIndex) index = NULL;
+	g_autoptr(GArray) mismatches = NULL;
+	g_autofree gchar *filename = NULL;
+	g_autofree guint8 *data = g_malloc0(4096);
+	gboolean res = FALSE;
+	int datafd = -1;
+
+	/* more than one block of 256 chunks */
+	filename = write_random_file(fixture->tmpdir, "data.img", 4096*1000, 0xf56ce6bf);
+	g_assert_nonnull(filename);
+
+	datafd = g_open(filename, O_RDWR|O_CLOEXEC, 0);
+	g_assert_cmpint(datafd, >, 0);
+	index = r_hash_index_open("data", datafd, NULL, &error);
+	g_assert_no_error(error);
+	g_assert_nonnull(index);
+
+	res = r_hash_index_verify_data(index, datafd, &mismatches, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+	g_assert_cmpuint(mismatches->len, ==, 0);
+	g_clear_pointer(&mismatches, g_array_unref);
+
+	/* modify chunks in different blocks */
+	g_assert_true(r_pwrite_exact(datafd, data, 4096, 999*4096, NULL));
+	g_assert_true(r_pwrite_exact(datafd, data, 4096, 3*4096, NULL));
+	g_assert_true(r_pwrite_exact(datafd, data, 4096, 300*4096, NULL));
+
+	res = r_hash_index_verify_data(index, datafd, &mismatches, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+	g_assert_cmpuint(mismatches->len, ==, 3);
+	g_assert_cmpuint(g_array_index(mismatches, guint32, 0), ==, 3);
+	g_assert_cmpuint(g_array_index(mismatches, guint32, 1), ==, 300);
+	g_assert_cmpuint(g_array_index(mismatches, guint32, 2), ==, 999);
+	g_clear_pointer(&mismatches, g_array_unref);
+
+	/* truncated data */
+	g_assert_cmpint(ftruncate(datafd, 4096*500), ==, 0);
+	res = r_hash_index_verify_data(index, datafd, &mismatches, &error);
+	g_assert_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED);
+	g_assert_false(res);
+	g_assert_null(mismatches);
+
+	g_assert_true(g_close(datafd, NULL));
+}
+
+/* Tests opening a stored hash index without the indexed data, as used for
+ * delta bundles */
+static void test_open_file(Fixture *fixture, gconstpointer user_data)
+{
+	g_autoptr(GError) error = NULL;
+	g_autoptr(RaucHashIndex) index = NULL;
+	g_autoptr(RaucHashIndex) stored = NULL;
+	g_autofree gchar *hashes_filename = NULL;
+	g_autofree guint8 *hash = NULL;
+	gboolean res = FALSE;
+	int datafd = -1;
+	guint32 number = 0;
+
+	datafd = g_open("test/dummy.verity", O_RDONLY|O_CLOEXEC, 0);
+	g_assert_cmpint(datafd, >, 0);
+
+	index = r_hash_index_open("test", datafd, NULL, &error);
+	g_assert_no_error(error);
+	g_assert_nonnull(index);
+
+	hashes_filename = g_build_filename(fixture->tmpdir, "hashes", NULL);
+	res = r_hash_index_export(index, hashes_filename, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+
+	stored = r_hash_index_open_file("stored", hashes_filename, &error);
+	g_assert_no_error(error);
+	g_assert_nonnull(stored);
+	g_assert_cmpint(stored->data_fd, ==, -1);
+	g_assert_cmpuint(stored->count, ==, 132);
+
+	// chunk 0
+	hash = r_hex_decode("ad7facb2586fc6e966c004d7d1d16b024f5805ff7cb47c7a85dabd8b48892ca7", 32);
+	res = r_hash_index_find_chunk(stored, hash, &number, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+	g_assert_cmpuint(number, ==, 0);
+
+	g_clear_pointer(&stored, r_hash_index_free);
+	stored = r_hash_index_open_file("stored", "test/dummy.verity.missing", &error);
+	g_assert_error(error, G_FILE_ERROR, G_FILE_ERROR_NOENT);
+	g_assert_null(stored);
+}
+
 /* Tests error handling when opening hash index for a file size that is not a
  * multiple of 4096 */
 static void test_invalid_size(Fixture *fixture, gconstpointer user_data)
@@ -302,6 +891,103 @@ static void test_invalid_size(Fixture *fixture, gconstpointer user_data)
 	g_assert_null(index);
 }
 
+/* Tests loading only the full hashes needed for chunks with a local match */
+static void test_open_prefixes(Fixture *fixture, gconstpointer user_data)
+{
+	g_autoptr(GError) error = NULL;
+	g_autoptr(RaucHashIndex) image = NULL;
+	g_autoptr(RaucHashIndex) partial = NULL;
+	g_autoptr(GPtrArray) candidates = g_ptr_array_new_with_free_func((GDestroyNotify)r_hash_index_free);
+	g_autofree RaucHashIndexChunk *chunk = g_new0(RaucHashIndexChunk, 1);
+	g_autofree gchar *image_filename = NULL;
+	g_autofree gchar *local_filename = NULL;
+	g_autofree gchar *index_filename = NULL;
+	g_autofree gchar *prefix_filename = NULL;
+	const guint8(*hashes)[32];
+	const guint8(*partial_hashes)[32];
+	RaucHashIndex *local = NULL;
+	guint32 number = 0;
+	gboolean res = FALSE;
+	int imagefd = -1, localfd = -1;
+
+	image_filename = write_random_file(fixture->tmpdir, "image.img", 4096*256, 0x1b3a4c5d);
+	g_assert_nonnull(image_filename);
+	local_filename = write_random_file(fixture->tmpdir, "local.img", 4096*64, 0x6e7f8091);
+	g_assert_nonnull(local_filename);
+
+	imagefd = g_open(image_filename, O_RDONLY|O_CLOEXEC, 0);
+	g_assert_cmpint(imagefd, >, 0);
+	localfd = g_open(local_filename, O_RDWR|O_CLOEXEC, 0);
+	g_assert_cmpint(localfd, >, 0);
+
+	// only chunk 200 of the image is available locally
+	g_assert_true(r_pread_exact(imagefd, chunk->data, 4096, 200*4096, NULL));
+	g_assert_cmpint(lseek(localfd, 10*4096, SEEK_SET), ==, 10*4096);
+	g_assert_true(r_write_exact(localfd, chunk->data, 4096, NULL));
+
+	image = r_hash_index_open("image", imagefd, NULL, &error);
+	g_assert_no_error(error);
+	g_assert_nonnull(image);
+
+	index_filename = g_build_filename(fixture->tmpdir, "image.img.block-hash-index", NULL);
+	res = r_hash_index_export(image, index_filename, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+	prefix_filename = g_build_filename(fixture->tmpdir, "image.img.block-hash-prefix", NULL);
+	res = r_hash_index_export_prefixes(image, prefix_filename, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+
+	local = r_hash_index_open("local", localfd, NULL, &error);
+	g_assert_no_error(error);
+	g_assert_nonnull(local);
+	g_assert_true(g_close(localfd, NULL));
+	g_ptr_array_add(candidates, local);
+
+	partial = r_hash_index_open_prefixes("partial", imagefd, prefix_filename, index_filename, candidates, &error);
+	g_assert_no_error(error);
+	g_assert_nonnull(partial);
+	g_assert_true(g_close(imagefd, NULL));
+
+	g_assert_cmpuint(partial->count, ==, 256);
+	g_assert_true(partial->hashes_incomplete);
+
+	// the page with chunk 200 is loaded completely
+	hashes = g_bytes_get_data(image->hashes, NULL);
+	partial_hashes = g_bytes_get_data(partial->hashes, NULL);
+	g_assert_cmpmem(&partial_hashes[128], 128*32, &hashes[128], 128*32);
+
+	// the first page only has placeholders with the same prefixes
+	for (guint32 i = 0; i < 128; i++) {
+		g_assert_cmpmem(partial_hashes[i], R_HASH_INDEX_PREFIX_LEN, hashes[i], R_HASH_INDEX_PREFIX_LEN);
+		g_assert_true(memcmp(partial_hashes[i], hashes[i], 32) != 0);
+	}
+
+	// chunks can be found by their full hash only if they were loaded
+	res = r_hash_index_find_chunk(partial, hashes[200], &number, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+	g_assert_cmpuint(number, ==, 200);
+	res = r_hash_index_find_chunk(local, hashes[200], &number, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+	g_assert_cmpuint(number, ==, 10);
+	res = r_hash_index_find_chunk(partial, hashes[5], &number, &error);
+	g_assert_error(error, R_HASH_INDEX_ERROR, R_HASH_INDEX_ERROR_NOT_FOUND);
+	g_assert_false(res);
+	g_clear_error(&error);
+
+	// a prefix file for different data is rejected
+	g_assert_true(g_file_set_contents(prefix_filename, "\0", 1, NULL));
+	imagefd = g_open(image_filename, O_RDONLY|O_CLOEXEC, 0);
+	g_assert_cmpint(imagefd, >, 0);
+	g_clear_pointer(&partial, r_hash_index_free);
+	partial = r_hash_index_open_prefixes("partial", imagefd, prefix_filename, index_filename, candidates, &error);
+	g_assert_error(error, R_HASH_INDEX_ERROR, R_HASH_INDEX_ERROR_SIZE);
+	g_assert_null(partial);
+	g_assert_true(g_close(imagefd, NULL));
+}
+
 int main(int argc, char *argv[])
 {
 	setlocale(LC_ALL, "C");
@@ -310,7 +996,16 @@ int main(int argc, char *argv[])
 
 	g_test_add("/hash_index/basic", Fixture, NULL, fixture_set_up, test_basic, fixture_tear_down);
 	g_test_add("/hash_index/ranges", Fixture, NULL, fixture_set_up, test_ranges, fixture_tear_down);
+	g_test_add("/hash_index/find-chunk", Fixture, NULL, fixture_set_up, test_find_chunk, fixture_tear_down);
+	g_test_add("/hash_index/index-set", Fixture, NULL, fixture_set_up, test_index_set, fixture_tear_down);
+	g_test_add("/hash_index/hash-chunks", Fixture, NULL, fixture_set_up, test_hash_chunks, fixture_tear_down);
+	g_test_add("/hash_index/parallel", Fixture, NULL, fixture_set_up, test_parallel, fixture_tear_down);
+	g_test_add("/hash_index/stored-lookup", Fixture, NULL, fixture_set_up, test_stored_lookup, fixture_tear_down);
+	g_test_add("/hash_index/build-slot", Fixture, NULL, fixture_set_up, test_build_slot, fixture_tear_down);
+	g_test_add("/hash_index/verify-data", Fixture, NULL, fixture_set_up, test_verify_data, fixture_tear_down);
+	g_test_add("/hash_index/open-file", Fixture, NULL, fixture_set_up, test_open_file, fixture_tear_down);
 	g_test_add("/hash_index/invalid-size", Fixture, NULL, fixture_set_up, test_invalid_size, fixture_tear_down);
+	g_test_add("/hash_index/open-prefixes", Fixture, NULL, fixture_set_up, test_open_prefixes, fixture_tear_down);
 
 	return g_test_run();
 }
@@ -1,13 +1,20 @@
+#include <fcntl.h>
 #include <stdio.h>
 #include <locale.h>
+#include <string.h>
 #include <glib.h>
 #include <glib/gstdio.h>
 #include <gio/gio.h>
 
+#include "config.h"
+#include <bundle.h>
+#include <chunk_pack.h>
 #include <context.h>
 #include <install.h>
 #include <manifest.h>
 #include <mount.h>
+#include <utils.h>
+#include <verity_hash.h>
 
 #include "install_fixtures.h"
 #include "common.h"
@@ -196,6 +203,431 @@ filename=rootfs.ext4";
 	fixture_helper_set_up_bundle(fixture->tmpdir, manifest_file, &data->manifest_test_options);
 }
 
+/* The target slot already contains the image, but its status doesn't record
+ * it. */
+static void install_fixture_set_up_check_same_content(InstallFixture *fixture,
+		gconstpointer user_data)
+{
+	InstallData *data = (InstallData*) user_data;
+	g_autofree gchar *configpath = NULL;
+	const gchar *cfg_file = "\
+[system]\n\
+compatible=Test Config\n\
+bootloader=grub\n\
+grubenv=grubenv.test\n\
+statusfile=central.raucs\n\
+\n\
+[keyring]\n\
+path=openssl-ca/dev-ca.pem\n\
+check-crl=true\n\
+\n\
+[slot.rootfs.0]\n\
+device=images/rootfs-0\n\
+type=ext4\n\
+bootname=system0\n\
+install-same=false\n\
+check-same-content=true\n\
+\n\
+[slot.rootfs.1]\n\
+device=images/rootfs-1\n\
+type=ext4\n\
+bootname=system1\n\
+install-same=false\n\
+check-same-content=true\n\
+";
+	const gchar *manifest_file = "\
+[update]\n\
+compatible=Test Config\n\
+\n\
+[image.rootfs]\n\
+filename=rootfs.ext4\n\
+adaptive=block-hash-index";
+
+	fixture->tmpdir = g_dir_make_tmp("rauc-XXXXXX", NULL);
+
+	/* needs to run as root */
+	if (!test_running_as_root())
+		return;
+
+	configpath = write_tmp_file(fixture->tmpdir, "same-content.conf", cfg_file, NULL);
+	g_assert_nonnull(configpath);
+	fixture_helper_set_up_system(fixture->tmpdir, configpath, NULL);
+	fixture_helper_set_up_bundle(fixture->tmpdir, manifest_file, &data->manifest_test_options);
+
+	/* as after factory provisioning */
+	g_assert_true(test_copy_file(fixture->tmpdir, "content/rootfs.ext4", fixture->tmpdir, "images/rootfs-1"));
+}
+
+#if ENABLE_CASYNC_NATIVE == 1
+static void install_fixture_set_up_chunk_pack(InstallFixture *fixture,
+		gconstpointer user_data)
+{
+	InstallData *data = (InstallData*) user_data;
+	g_autofree gchar *configpath = NULL;
+	const gchar *cfg_file = "\
+[system]\n\
+compatible=Test Config\n\
+bootloader=grub\n\
+grubenv=grubenv.test\n\
+\n\
+[keyring]\n\
+path=openssl-ca/dev-ca.pem\n\
+check-crl=true\n\
+\n\
+[slot.rootfs.0]\n\
+device=images/rootfs-0\n\
+type=ext4\n\
+bootname=system0\n\
+\n\
+[slot.rootfs.1]\n\
+device=images/rootfs-1\n\
+type=ext4\n\
+bootname=system1\n\
+";
+	const gchar *manifest_file = "\
+[update]\n\
+compatible=Test Config\n\
+\n\
+[image.rootfs]\n\
+filename=rootfs.ext4\n\
+adaptive=block-hash-index;chunk-pack";
+
+	fixture->tmpdir = g_dir_make_tmp("rauc-XXXXXX", NULL);
+
+	/* needs to run as root */
+	if (!test_running_as_root())
+		return;
+
+	configpath = write_tmp_file(fixture->tmpdir, "chunk-pack.conf", cfg_file, NULL);
+	g_assert_nonnull(configpath);
+	fixture_helper_set_up_system(fixture->tmpdir, configpath, NULL);
+	fixture_helper_set_up_bundle(fixture->tmpdir, manifest_file, &data->manifest_test_options);
+}
+#endif
+
+#define VERITY_IMAGE_BLOCKS 64
+
+/*
+ * Creates a bundle with a plain and one with an adaptive image for raw slots
+ * with verity-hash enabled. The slot devices have room for the hash tree
+ * after the image.
+ */
+static void install_fixture_set_up_verity(InstallFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autofree gchar *configpath = NULL;
+	g_autofree gchar *contentdir = NULL;
+	g_autofree gchar *bundlepath = NULL;
+	g_autofree gchar *path = NULL;
+	g_autoptr(GError) ierror = NULL;
+	gboolean res;
+	const gchar *cfg_file = "\
+[system]\n\
+compatible=Test Config\n\
+bootloader=grub\n\
+grubenv=grubenv.test\n\
+data-directory=data\n\
+\n\
+[keyring]\n\
+path=openssl-ca/dev-ca.pem\n\
+check-crl=true\n\
+\n\
+[slot.rootfs.0]\n\
+device=images/verity-0\n\
+type=raw\n\
+bootname=system0\n\
+verity-hash=true\n\
+\n\
+[slot.rootfs.1]\n\
+device=images/verity-1\n\
+type=raw\n\
+bootname=system1\n\
+verity-hash=true\n\
+";
+	const gchar *manifest_file = "\
+[update]\n\
+compatible=Test Config\n\
+\n\
+[image.rootfs]\n\
+filename=rootfs.img\n";
+	const gchar *adaptive_manifest_file = "\
+[update]\n\
+compatible=Test Config\n\
+\n\
+[image.rootfs]\n\
+filename=rootfs.img\n\
+adaptive=block-hash-index\n";
+
+	fixture->tmpdir = g_dir_make_tmp("rauc-XXXXXX", NULL);
+
+	/* needs to run as root */
+	if (!test_running_as_root())
+		return;
+
+	configpath = write_tmp_file(fixture->tmpdir, "verity.conf", cfg_file, NULL);
+	g_assert_nonnull(configpath);
+	fixture_helper_set_up_system(fixture->tmpdir, configpath, NULL);
+	g_assert(test_mkdir_relative(fixture->tmpdir, "data", 0777) == 0);
+	g_assert(test_prepare_dummy_file(fixture->tmpdir, "images/verity-0",
+			2 * VERITY_IMAGE_BLOCKS * 4096, "/dev/zero") == 0);
+	g_assert(test_prepare_dummy_file(fixture->tmpdir, "images/verity-1",
+			2 * VERITY_IMAGE_BLOCKS * 4096, "/dev/zero") == 0);
+
+	contentdir = g_build_filename(fixture->tmpdir, "content", NULL);
+	g_assert_cmpint(g_mkdir(contentdir, 0777), ==, 0);
+	path = write_random_file(contentdir, "rootfs.img", VERITY_IMAGE_BLOCKS * 4096, 0x3c1a7e55);
+	g_assert_nonnull(path);
+	g_clear_pointer(&path, g_free);
+
+	path = write_tmp_file(contentdir, "manifest.raucm", manifest_file, NULL);
+	g_assert_nonnull(path);
+	g_clear_pointer(&path, g_free);
+	bundlepath = g_build_filename(fixture->tmpdir, "bundle.raucb", NULL);
+	res = create_bundle(bundlepath, contentdir, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	g_clear_pointer(&bundlepath, g_free);
+
+	path = write_tmp_file(contentdir, "manifest.raucm", adaptive_manifest_file, NULL);
+	g_assert_nonnull(path);
+	bundlepath = g_build_filename(fixture->tmpdir, "adaptive.raucb", NULL);
+	res = create_bundle(bundlepath, contentdir, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+}
+
+#define DELTA_IMAGE_SIZE (256 * 4096)
+#define DELTA_IMAGE_SEED 0x6de17a5e
+/* chunks of the new image which differ from the base */
+static const guint32 delta_changed_chunks[] = {10, 200};
+
+/*
+ * Creates a base bundle and a delta bundle against it. The active slot
+ * rootfs.0 contains the base image.
+ */
+static void install_fixture_set_up_delta(InstallFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autofree gchar *configpath = NULL;
+	g_autofree gchar *basedir = NULL;
+	g_autofree gchar *contentdir = NULL;
+	g_autofree gchar *basebundle = NULL;
+	g_autofree gchar *bundlepath = NULL;
+	g_autofree gchar *path = NULL;
+	g_autofree guint8 *data = NULL;
+	g_autoptr(GError) ierror = NULL;
+	gboolean res;
+	const gchar *cfg_file = "\
+[system]\n\
+compatible=Test Config\n\
+bootloader=grub\n\
+grubenv=grubenv.test\n\
+data-directory=data\n\
+\n\
+[keyring]\n\
+path=openssl-ca/dev-ca.pem\n\
+check-crl=true\n\
+\n\
+[slot.rootfs.0]\n\
+device=images/delta-0\n\
+type=raw\n\
+bootname=system0\n\
+\n\
+[slot.rootfs.1]\n\
+device=images/delta-1\n\
+type=raw\n\
+bootname=system1\n\
+";
+	const gchar *manifest_file = "\
+[update]\n\
+compatible=Test Config\n\
+\n\
+[image.rootfs]\n\
+filename=rootfs.img\n\
+adaptive=block-hash-index";
+
+	fixture->tmpdir = g_dir_make_tmp("rauc-XXXXXX", NULL);
+
+	/* needs to run as root */
+	if (!test_running_as_root())
+		return;
+
+	configpath = write_tmp_file(fixture->tmpdir, "delta.conf", cfg_file, NULL);
+	g_assert_nonnull(configpath);
+	fixture_helper_set_up_system(fixture->tmpdir, configpath, NULL);
+	g_assert(test_mkdir_relative(fixture->tmpdir, "data", 0777) == 0);
+
+	/* the base version, installed in the active slot */
+	data = random_bytes(DELTA_IMAGE_SIZE, DELTA_IMAGE_SEED);
+	path = g_build_filename(fixture->tmpdir, "images/delta-0", NULL);
+	g_assert_true(g_file_set_contents(path, (const gchar *)data, DELTA_IMAGE_SIZE, NULL));
+	g_clear_pointer(&path, g_free);
+	g_assert(test_prepare_dummy_file(fixture->tmpdir, "images/delta-1",
+			DELTA_IMAGE_SIZE, "/dev/zero") == 0);
+
+	basedir = g_build_filename(fixture->tmpdir, "content-base", NULL);
+	g_assert_cmpint(g_mkdir(basedir, 0777), ==, 0);
+	path = g_build_filename(basedir, "rootfs.img", NULL);
+	g_assert_true(g_file_set_contents(path, (const gchar *)data, DELTA_IMAGE_SIZE, NULL));
+	g_clear_pointer(&path, g_free);
+	path = write_tmp_file(basedir, "manifest.raucm", manifest_file, NULL);
+	g_assert_nonnull(path);
+	g_clear_pointer(&path, g_free);
+	basebundle = g_build_filename(fixture->tmpdir, "base.raucb", NULL);
+	res = create_bundle(basebundle, basedir, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	/* the new version, only differing in a few chunks */
+	for (guint i = 0; i < G_N_ELEMENTS(delta_changed_chunks); i++)
+		data[delta_changed_chunks[i] * 4096 + 17] ^= 0x5a;
+	contentdir = g_build_filename(fixture->tmpdir, "content", NULL);
+	path = g_build_filename(contentdir, "rootfs.img", NULL);
+	g_assert_true(g_file_set_contents(path, (const gchar *)data, DELTA_IMAGE_SIZE, NULL));
+	g_clear_pointer(&path, g_free);
+	path = write_tmp_file(contentdir, "manifest.raucm", manifest_file, NULL);
+	g_assert_nonnull(path);
+
+	replace_strdup(&r_context_conf()->bundle_delta_base, basebundle);
+	r_context();
+	bundlepath = g_build_filename(fixture->tmpdir, "bundle.raucb", NULL);
+	res = create_bundle(bundlepath, contentdir, &ierror);
+	replace_strdup(&r_context_conf()->bundle_delta_base, NULL);
+	r_context();
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+}
+
+/* rootfs and appfs are related, while the data slot is independent of both */
+static void install_fixture_set_up_bundle_concurrent(InstallFixture *fixture,
+		gconstpointer user_data)
+{
+	InstallData *data = (InstallData*) user_data;
+	g_autofree gchar *configpath = NULL;
+	const gchar *cfg_file = "\
+[system]\n\
+compatible=Test Config\n\
+bootloader=grub\n\
+grubenv=grubenv.test\n\
+install-concurrency=2\n\
+\n\
+[keyring]\n\
+path=openssl-ca/dev-ca.pem\n\
+check-crl=true\n\
+\n\
+[slot.rootfs.0]\n\
+device=images/rootfs-0\n\
+type=ext4\n\
+bootname=system0\n\
+\n\
+[slot.rootfs.1]\n\
+device=images/rootfs-1\n\
+type=ext4\n\
+bootname=system1\n\
+\n\
+[slot.appfs.0]\n\
+device=images/appfs-0\n\
+type=ext4\n\
+parent=rootfs.0\n\
+\n\
+[slot.appfs.1]\n\
+device=images/appfs-1\n\
+type=ext4\n\
+parent=rootfs.1\n\
+\n\
+[slot.data.0]\n\
+device=images/data-0\n\
+type=ext4\n\
+";
+	const gchar *manifest_file = "\
+[update]\n\
+compatible=Test Config\n\
+\n\
+[image.rootfs]\n\
+filename=rootfs.ext4\n\
+\n\
+[image.appfs]\n\
+filename=appfs.ext4\n\
+\n\
+[image.data]\n\
+filename=bootloader.ext4";
+
+	fixture->tmpdir = g_dir_make_tmp("rauc-XXXXXX", NULL);
+
+	/* needs to run as root */
+	if (!test_running_as_root())
+		return;
+
+	configpath = write_tmp_file(fixture->tmpdir, "concurrent.conf", cfg_file, NULL);
+	g_assert_nonnull(configpath);
+	fixture_helper_set_up_system(fixture->tmpdir, configpath, NULL);
+
+	g_assert(test_prepare_dummy_file(fixture->tmpdir, "images/data-0",
+			SLOT_SIZE, "/dev/zero") == 0);
+	g_assert_true(test_make_filesystem(fixture->tmpdir, "images/data-0"));
+	test_make_slot_user_writable(fixture->tmpdir, "images/data-0");
+
+	fixture_helper_set_up_bundle(fixture->tmpdir, manifest_file, &data->manifest_test_options);
+}
+
+/* rootfs and data are independent raw slots, written from the same image */
+static void install_fixture_set_up_bundle_fan_out(InstallFixture *fixture,
+		gconstpointer user_data)
+{
+	InstallData *data = (InstallData*) user_data;
+	g_autofree gchar *configpath = NULL;
+	const gchar *cfg_file = "\
+[system]\n\
+compatible=Test Config\n\
+bootloader=grub\n\
+grubenv=grubenv.test\n\
+install-concurrency=2\n\
+\n\
+[keyring]\n\
+path=openssl-ca/dev-ca.pem\n\
+check-crl=true\n\
+\n\
+[slot.rootfs.0]\n\
+device=images/rootfs-0\n\
+type=raw\n\
+bootname=system0\n\
+\n\
+[slot.rootfs.1]\n\
+device=images/rootfs-1\n\
+type=raw\n\
+bootname=system1\n\
+\n\
+[slot.data.0]\n\
+device=images/data-0\n\
+type=raw\n\
+";
+	const gchar *manifest_file = "\
+[update]\n\
+compatible=Test Config\n\
+\n\
+[image.rootfs]\n\
+filename=rootfs.ext4\n\
+\n\
+[image.data]\n\
+filename=rootfs.ext4";
+
+	fixture->tmpdir = g_dir_make_tmp("rauc-XXXXXX", NULL);
+
+	/* needs to run as root */
+	if (!test_running_as_root())
+		return;
+
+	configpath = write_tmp_file(fixture->tmpdir, "fan-out.conf", cfg_file, NULL);
+	g_assert_nonnull(configpath);
+	fixture_helper_set_up_system(fixture->tmpdir, configpath, NULL);
+
+	g_assert(test_prepare_dummy_file(fixture->tmpdir, "images/data-0",
+			SLOT_SIZE, "/dev/zero") == 0);
+	test_make_slot_user_writable(fixture->tmpdir, "images/data-0");
+
+	fixture_helper_set_up_bundle(fixture->tmpdir, manifest_file, &data->manifest_test_options);
+}
+
 static void install_fixture_set_up_system_conf(InstallFixture *fixture,
 		gconstpointer user_data)
 {
@@ -1080,6 +1512,16 @@ static gboolean install_args_find_message(RaucInstallArgs *args, const gchar *ne
 	return g_queue_find_custom(&args->status_messages, needle, find_str_custom) != NULL;
 }
 
+/* Returns the position of the status message, which must exist. */
+static guint install_args_message_index(RaucInstallArgs *args, const gchar *needle)
+{
+	GList *link = g_queue_find_custom(&args->status_messages, needle, find_str_custom);
+
+	g_assert_nonnull(link);
+
+	return g_queue_link_index(&args->status_messages, link);
+}
+
 static void install_test_bundle(InstallFixture *fixture,
 		gconstpointer user_data)
 {
@@ -1191,22 +1633,537 @@ static void install_test_bundle_thread(InstallFixture *fixture,
 	g_clear_pointer(&r_loop, g_main_loop_unref);
 }
 
-static void install_test_bundle_hook_install_check(InstallFixture *fixture,
-		gconstpointer user_data)
+static void check_same_content(InstallFixture *fixture, gboolean modified)
 {
-	g_autofree gchar *bundlepath = NULL;
-	g_autofree gchar *mountdir = NULL;
+	g_autofree gchar *mountprefix = NULL;
+	g_autofree gchar *imagepath = NULL;
+	g_autofree gchar *slotpath = NULL;
+	g_autofree gchar *image = NULL;
+	g_autofree gchar *slot = NULL;
+	gsize image_size = 0, slot_size = 0;
 	RaucInstallArgs *args;
 	g_autoptr(GError) ierror = NULL;
+	gboolean res;
 
 	/* needs to run as root */
 	if (!test_running_as_root())
 		return;
 
-	/* Set mount path to current temp dir */
-	mountdir = g_build_filename(fixture->tmpdir, "mount", NULL);
-	g_assert_nonnull(mountdir);
-	replace_strdup(&r_context_conf()->mountprefix, mountdir);
+	imagepath = g_build_filename(fixture->tmpdir, "content/rootfs.ext4", NULL);
+	slotpath = g_build_filename(fixture->tmpdir, "images/rootfs-1", NULL);
+	if (modified)
+		flip_bits_filename(slotpath, 4096 * 100, 0xff);
+
+	mountprefix = g_build_filename(fixture->tmpdir, "mount", NULL);
+	replace_strdup(&r_context_conf()->mountprefix, mountprefix);
+	r_context();
+
+	res = determine_slot_states(&ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	args = install_args_new();
+	args->name = g_build_filename(fixture->tmpdir, "bundle.raucb", NULL);
+	args->notify = install_notify;
+	args->cleanup = install_cleanup;
+	res = do_install_bundle(args, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	g_assert_true(install_args_find_message(args, "Updating slot rootfs.1 done"));
+	g_assert_true(install_args_find_message(args, "Skipping update for correct image 'rootfs.ext4'") != modified);
+
+	/* in both cases, the slot contains the image now */
+	g_assert_true(g_file_get_contents(imagepath, &image, &image_size, NULL));
+	g_assert_true(g_file_get_contents(slotpath, &slot, &slot_size, NULL));
+	g_assert_cmpmem(slot, slot_size, image, image_size);
+
+	args->status_result = 0;
+	args->cleanup(args);
+}
+
+static void install_test_check_same_content(InstallFixture *fixture,
+		gconstpointer user_data)
+{
+	check_same_content(fixture, FALSE);
+}
+
+static void install_test_check_same_content_modified(InstallFixture *fixture,
+		gconstpointer user_data)
+{
+	check_same_content(fixture, TRUE);
+}
+
+#if ENABLE_CASYNC_NATIVE == 1
+/*
+ * Recreates the bundle with a chunk pack which doesn't match the image, by
+ * placing it in the build cache.
+ */
+static void replace_chunk_pack(InstallFixture *fixture)
+{
+	g_autofree gchar *contentdir = g_build_filename(fixture->tmpdir, "content", NULL);
+	g_autofree gchar *imagepath = g_build_filename(contentdir, "rootfs.ext4", NULL);
+	g_autofree gchar *bundlepath = g_build_filename(fixture->tmpdir, "bundle.raucb", NULL);
+	g_autofree gchar *cachedir = g_build_filename(fixture->tmpdir, "cache", NULL);
+	g_autofree gchar *otherpath = g_build_filename(fixture->tmpdir, "other.img", NULL);
+	g_autofree gchar *packname = NULL;
+	g_autofree gchar *packpath = NULL;
+	g_autofree gchar *digest = NULL;
+	g_autofree gchar *image = NULL;
+	g_autoptr(GError) ierror = NULL;
+	gsize image_size = 0;
+	gboolean res;
+
+	g_assert_true(g_file_get_contents(imagepath, &image, &image_size, NULL));
+	digest = g_compute_checksum_for_data(G_CHECKSUM_SHA256, (const guchar *)image, image_size);
+
+	/* every chunk of the pack differs from the image */
+	memset(image, 0xaa, image_size);
+	g_assert_true(g_file_set_contents(otherpath, image, image_size, NULL));
+
+	g_assert_cmpint(g_mkdir(cachedir, 0755), ==, 0);
+	packname = g_strdup_printf("%s.chunk-pack-%s", digest, PACKAGE_VERSION);
+	packpath = g_build_filename(cachedir, packname, NULL);
+	res = r_chunk_pack_create(otherpath, packpath, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	replace_strdup(&r_context_conf()->bundle_cache_dir, cachedir);
+	r_context();
+	g_assert_cmpint(g_unlink(bundlepath), ==, 0);
+	res = create_bundle(bundlepath, contentdir, &ierror);
+	replace_strdup(&r_context_conf()->bundle_cache_dir, NULL);
+	r_context();
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+}
+
+static void check_chunk_pack(InstallFixture *fixture, gboolean mismatch)
+{
+	g_autofree gchar *mountprefix = NULL;
+	g_autofree gchar *imagepath = NULL;
+	g_autofree gchar *slotpath = NULL;
+	g_autofree gchar *image = NULL;
+	g_autofree gchar *slot = NULL;
+	gsize image_size = 0, slot_size = 0;
+	RaucInstallArgs *args;
+	g_autoptr(GError) ierror = NULL;
+	gboolean res;
+
+	/* needs to run as root */
+	if (!test_running_as_root())
+		return;
+
+	if (mismatch)
+		replace_chunk_pack(fixture);
+
+	imagepath = g_build_filename(fixture->tmpdir, "content/rootfs.ext4", NULL);
+	slotpath = g_build_filename(fixture->tmpdir, "images/rootfs-1", NULL);
+
+	mountprefix = g_build_filename(fixture->tmpdir, "mount", NULL);
+	replace_strdup(&r_context_conf()->mountprefix, mountprefix);
+	r_context();
+
+	res = determine_slot_states(&ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	args = install_args_new();
+	args->name = g_build_filename(fixture->tmpdir, "bundle.raucb", NULL);
+	args->notify = install_notify;
+	args->cleanup = install_cleanup;
+	res = do_install_bundle(args, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	g_assert_true(install_args_find_message(args, "Updating slot rootfs.1 done"));
+
+	/* chunks not matching the index are read from the image instead */
+	g_assert_true(g_file_get_contents(imagepath, &image, &image_size, NULL));
+	g_assert_true(g_file_get_contents(slotpath, &slot, &slot_size, NULL));
+	g_assert_cmpmem(slot, slot_size, image, image_size);
+
+	args->status_result = 0;
+	args->cleanup(args);
+}
+
+static void install_test_chunk_pack(InstallFixture *fixture,
+		gconstpointer user_data)
+{
+	check_chunk_pack(fixture, FALSE);
+}
+
+static void install_test_chunk_pack_mismatch(InstallFixture *fixture,
+		gconstpointer user_data)
+{
+	check_chunk_pack(fixture, TRUE);
+}
+#endif
+
+/* Only the chunks missing from the base are contained in a delta bundle. */
+static void install_test_delta_bundle(InstallFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autofree gchar *bundlepath = NULL;
+	g_autofree gchar *outputdir = NULL;
+	g_autofree gchar *path = NULL;
+	g_autofree gchar *base_digest = NULL;
+	g_autofree gchar *contents = NULL;
+	g_autofree guint8 *data = NULL;
+	g_autoptr(RaucBundle) bundle = NULL;
+	g_autoptr(RaucManifest) manifest = NULL;
+	g_autoptr(GError) ierror = NULL;
+	RaucImage *image;
+	gsize size = 0;
+	gboolean res;
+
+	/* needs to run as root */
+	if (!test_running_as_root())
+		return;
+
+	data = random_bytes(DELTA_IMAGE_SIZE, DELTA_IMAGE_SEED);
+	base_digest = g_compute_checksum_for_data(G_CHECKSUM_SHA256, data, DELTA_IMAGE_SIZE);
+	for (guint i = 0; i < G_N_ELEMENTS(delta_changed_chunks); i++)
+		data[delta_changed_chunks[i] * 4096 + 17] ^= 0x5a;
+
+	bundlepath = g_build_filename(fixture->tmpdir, "bundle.raucb", NULL);
+	res = check_bundle(bundlepath, &bundle, CHECK_BUNDLE_DEFAULT, NULL, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	res = load_manifest_from_bundle(bundle, &manifest, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	image = manifest->images->data;
+	g_assert_cmpstr(image->delta_base, ==, base_digest);
+
+	outputdir = g_build_filename(fixture->tmpdir, "output", NULL);
+	res = extract_bundle(bundle, outputdir, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	/* the image keeps its size, chunks found in the base are zero */
+	path = g_build_filename(outputdir, "rootfs.img", NULL);
+	g_assert_true(g_file_get_contents(path, &contents, &size, NULL));
+	g_assert_cmpuint(size, ==, DELTA_IMAGE_SIZE);
+	for (guint32 c = 0; c < DELTA_IMAGE_SIZE / 4096; c++) {
+		const gchar *chunk = contents + c * 4096;
+		gboolean changed = FALSE;
+
+		for (guint i = 0; i < G_N_ELEMENTS(delta_changed_chunks); i++)
+			changed = changed || delta_changed_chunks[i] == c;
+
+		if (changed)
+			g_assert_cmpmem(chunk, 4096, data + c * 4096, 4096);
+		else
+			g_assert_true(r_buffer_is_zero((const guint8 *)chunk, 4096));
+	}
+}
+
+static void check_delta_install(InstallFixture *fixture, gboolean base_installed)
+{
+	g_autofree gchar *mountprefix = NULL;
+	g_autofree gchar *slotpath = NULL;
+	g_autofree gchar *slot = NULL;
+	g_autofree guint8 *data = NULL;
+	gsize slot_size = 0;
+	RaucInstallArgs *args;
+	g_autoptr(GError) ierror = NULL;
+	gboolean res;
+
+	/* needs to run as root */
+	if (!test_running_as_root())
+		return;
+
+	data = random_bytes(DELTA_IMAGE_SIZE, DELTA_IMAGE_SEED);
+	for (guint i = 0; i < G_N_ELEMENTS(delta_changed_chunks); i++)
+		data[delta_changed_chunks[i] * 4096 + 17] ^= 0x5a;
+
+	/* replace the base version in the active slot */
+	if (!base_installed) {
+		g_autofree gchar *other = write_random_file(fixture->tmpdir, "images/delta-0",
+				DELTA_IMAGE_SIZE, DELTA_IMAGE_SEED + 1);
+		g_assert_nonnull(other);
+	}
+
+	mountprefix = g_build_filename(fixture->tmpdir, "mount", NULL);
+	replace_strdup(&r_context_conf()->mountprefix, mountprefix);
+	r_context();
+
+	res = determine_slot_states(&ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	args = install_args_new();
+	args->name = g_build_filename(fixture->tmpdir, "bundle.raucb", NULL);
+	args->notify = install_notify;
+	args->cleanup = install_cleanup;
+	res = do_install_bundle(args, &ierror);
+
+	if (base_installed) {
+		g_assert_no_error(ierror);
+		g_assert_true(res);
+		g_assert_true(install_args_find_message(args, "Updating slot rootfs.1 done"));
+
+		slotpath = g_build_filename(fixture->tmpdir, "images/delta-1", NULL);
+		g_assert_true(g_file_get_contents(slotpath, &slot, &slot_size, NULL));
+		g_assert_cmpmem(slot, slot_size, data, DELTA_IMAGE_SIZE);
+	} else {
+		/* there is no fallback to a full copy */
+		g_assert_nonnull(ierror);
+		g_assert_false(res);
+		g_assert_nonnull(strstr(ierror->message, "Failed to install delta image rootfs.img"));
+	}
+
+	args->status_result = 0;
+	args->cleanup(args);
+}
+
+static void install_test_delta(InstallFixture *fixture,
+		gconstpointer user_data)
+{
+	check_delta_install(fixture, TRUE);
+}
+
+static void install_test_delta_missing_base(InstallFixture *fixture,
+		gconstpointer user_data)
+{
+	check_delta_install(fixture, FALSE);
+}
+
+/*
+ * Installs the bundle into rootfs.1 with verity-hash enabled. For the plain
+ * image, the hash tree written after the image must match the root hash in
+ * the slot status. Adaptive updates are rejected, as they don't copy the
+ * image as-is.
+ */
+static void check_verity_install(InstallFixture *fixture, const gchar *bundle, gboolean adaptive)
+{
+	g_autofree gchar *mountprefix = NULL;
+	g_autofree gchar *slotpath = NULL;
+	g_autofree guint8 *root_hash = NULL;
+	g_autofree guint8 *salt = NULL;
+	g_auto(filedesc) fd = -1;
+	RaucSlot *slot;
+	RaucInstallArgs *args;
+	g_autoptr(GError) ierror = NULL;
+	gboolean res;
+
+	/* needs to run as root */
+	if (!test_running_as_root())
+		return;
+
+	mountprefix = g_build_filename(fixture->tmpdir, "mount", NULL);
+	replace_strdup(&r_context_conf()->mountprefix, mountprefix);
+	r_context();
+
+	res = determine_slot_states(&ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	args = install_args_new();
+	args->name = g_build_filename(fixture->tmpdir, bundle, NULL);
+	args->notify = install_notify;
+	args->cleanup = install_cleanup;
+	res = do_install_bundle(args, &ierror);
+
+	slot = g_hash_table_lookup(r_context()->config->slots, "rootfs.1");
+	g_assert_nonnull(slot);
+
+	if (adaptive) {
+		g_assert_nonnull(ierror);
+		g_assert_false(res);
+		g_assert_nonnull(strstr(ierror->message, "verity-hash for slot rootfs.1 requires image rootfs.img to be copied as-is"));
+		g_assert_true(!slot->status || !slot->status->verity_root_hash);
+		goto out;
+	}
+
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	g_assert_true(install_args_find_message(args, "Updating slot rootfs.1 done"));
+
+	g_assert_nonnull(slot->status->verity_root_hash);
+	g_assert_nonnull(slot->status->verity_salt);
+	root_hash = r_hex_decode(slot->status->verity_root_hash, 32);
+	salt = r_hex_decode(slot->status->verity_salt, 32);
+	g_assert_nonnull(root_hash);
+	g_assert_nonnull(salt);
+
+	slotpath = g_build_filename(fixture->tmpdir, "images/verity-1", NULL);
+	fd = g_open(slotpath, O_RDONLY | O_CLOEXEC, 0);
+	g_assert_cmpint(fd, >=, 0);
+	g_assert_cmpint(r_verity_hash_verify(fd, VERITY_IMAGE_BLOCKS, root_hash, salt), ==, 0);
+
+out:
+	args->status_result = 0;
+	args->cleanup(args);
+}
+
+static void install_test_verity(InstallFixture *fixture,
+		gconstpointer user_data)
+{
+	check_verity_install(fixture, "bundle.raucb", FALSE);
+}
+
+static void install_test_verity_adaptive(InstallFixture *fixture,
+		gconstpointer user_data)
+{
+	check_verity_install(fixture, "adaptive.raucb", TRUE);
+}
+
+static RaucInstallArgs *install_concurrent_bundle(InstallFixture *fixture, GError **error)
+{
+	g_autofree gchar *mountprefix = NULL;
+	RaucInstallArgs *args;
+
+	mountprefix = g_build_filename(fixture->tmpdir, "mount", NULL);
+	replace_strdup(&r_context_conf()->mountprefix, mountprefix);
+	r_context();
+
+	g_assert_true(determine_slot_states(NULL));
+
+	args = install_args_new();
+	args->name = g_build_filename(fixture->tmpdir, "bundle.raucb", NULL);
+	args->notify = install_notify;
+	args->cleanup = install_cleanup;
+	do_install_bundle(args, error);
+
+	return args;
+}
+
+static void install_test_bundle_concurrent(InstallFixture *fixture,
+		gconstpointer user_data)
+{
+	RaucInstallArgs *args;
+	g_autoptr(GError) ierror = NULL;
+
+	/* needs to run as root */
+	if (!test_running_as_root())
+		return;
+
+	g_assert_cmpint(r_context()->config->install_concurrency, ==, 2);
+
+	args = install_concurrent_bundle(fixture, &ierror);
+	g_assert_no_error(ierror);
+
+	/* appfs.1 is a child of rootfs.1, so it is only installed afterwards */
+	g_assert_cmpuint(install_args_message_index(args, "Updating slot rootfs.1 done"), <,
+			install_args_message_index(args, "Checking slot appfs.1"));
+	/* appfs.1 and data.0 are checked before either of them is written */
+	g_assert_cmpuint(install_args_message_index(args, "Checking slot data.0"), <,
+			install_args_message_index(args, "Updating slot appfs.1 done"));
+	/* the results are recorded in manifest order */
+	g_assert_cmpuint(install_args_message_index(args, "Updating slot appfs.1 done"), <,
+			install_args_message_index(args, "Updating slot data.0 done"));
+
+	args->status_result = 0;
+	args->cleanup(args);
+}
+
+static void install_test_bundle_concurrent_error(InstallFixture *fixture,
+		gconstpointer user_data)
+{
+	RaucInstallArgs *args;
+	g_autoptr(GError) ierror = NULL;
+
+	/* needs to run as root */
+	if (!test_running_as_root())
+		return;
+
+	/* writing to the data slot fails */
+	g_assert_cmpint(test_remove(fixture->tmpdir, "images/data-0"), ==, 0);
+
+	args = install_concurrent_bundle(fixture, &ierror);
+	g_assert_nonnull(ierror);
+	g_assert_true(g_str_has_prefix(ierror->message, "Failed updating slot data.0: "));
+
+	/* the concurrently installed slot is not affected */
+	g_assert_true(install_args_find_message(args, "Updating slot appfs.1 done"));
+	g_assert_false(install_args_find_message(args, "Updating slot data.0 done"));
+
+	args->status_result = 0;
+	args->cleanup(args);
+}
+
+/* Checks that the device of a slot starts with the image. */
+static void assert_slot_has_image(InstallFixture *fixture, const gchar *device)
+{
+	g_autofree gchar *imagepath = g_build_filename(fixture->tmpdir, "content/rootfs.ext4", NULL);
+	g_autofree gchar *devicepath = g_build_filename(fixture->tmpdir, device, NULL);
+	g_autofree gchar *image = NULL;
+	g_autofree gchar *contents = NULL;
+	gsize image_len, contents_len;
+
+	g_assert_true(g_file_get_contents(imagepath, &image, &image_len, NULL));
+	g_assert_true(g_file_get_contents(devicepath, &contents, &contents_len, NULL));
+	g_assert_cmpuint(contents_len, >=, image_len);
+	g_assert_cmpmem(contents, image_len, image, image_len);
+}
+
+static void install_test_bundle_fan_out(InstallFixture *fixture,
+		gconstpointer user_data)
+{
+	RaucInstallArgs *args;
+	g_autoptr(GError) ierror = NULL;
+
+	/* needs to run as root */
+	if (!test_running_as_root())
+		return;
+
+	args = install_concurrent_bundle(fixture, &ierror);
+	g_assert_no_error(ierror);
+
+	g_assert_true(install_args_find_message(args, "Updating slot rootfs.1 done"));
+	g_assert_true(install_args_find_message(args, "Updating slot data.0 done"));
+	assert_slot_has_image(fixture, "images/rootfs-1");
+	assert_slot_has_image(fixture, "images/data-0");
+
+	args->status_result = 0;
+	args->cleanup(args);
+}
+
+static void install_test_bundle_fan_out_error(InstallFixture *fixture,
+		gconstpointer user_data)
+{
+	RaucInstallArgs *args;
+	g_autoptr(GError) ierror = NULL;
+
+	/* needs to run as root */
+	if (!test_running_as_root())
+		return;
+
+	/* opening the data slot fails, before the image is read */
+	g_assert_cmpint(test_remove(fixture->tmpdir, "images/data-0"), ==, 0);
+
+	args = install_concurrent_bundle(fixture, &ierror);
+	g_assert_nonnull(ierror);
+	g_assert_true(g_str_has_prefix(ierror->message, "Failed updating slot data.0: "));
+
+	/* the slot sharing the image is still written */
+	g_assert_true(install_args_find_message(args, "Updating slot rootfs.1 done"));
+	g_assert_false(install_args_find_message(args, "Updating slot data.0 done"));
+	assert_slot_has_image(fixture, "images/rootfs-1");
+
+	args->status_result = 0;
+	args->cleanup(args);
+}
+
+static void install_test_bundle_hook_install_check(InstallFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autofree gchar *bundlepath = NULL;
+	g_autofree gchar *mountdir = NULL;
+	RaucInstallArgs *args;
+	g_autoptr(GError) ierror = NULL;
+
+	/* needs to run as root */
+	if (!test_running_as_root())
+		return;
+
+	/* Set mount path to current temp dir */
+	mountdir = g_build_filename(fixture->tmpdir, "mount", NULL);
+	g_assert_nonnull(mountdir);
+	replace_strdup(&r_context_conf()->mountprefix, mountdir);
 	r_context();
 
 	bundlepath = g_build_filename(fixture->tmpdir, "bundle.raucb", NULL);
@@ -1627,6 +2584,73 @@ int main(int argc, char *argv[])
 			install_fixture_set_up_bundle_adaptive, install_test_bundle,
 			install_fixture_tear_down);
 
+	g_test_add("/install/check-same-content/same",
+			InstallFixture, install_data,
+			install_fixture_set_up_check_same_content, install_test_check_same_content,
+			install_fixture_tear_down);
+
+	g_test_add("/install/check-same-content/modified",
+			InstallFixture, install_data,
+			install_fixture_set_up_check_same_content, install_test_check_same_content_modified,
+			install_fixture_tear_down);
+
+#if ENABLE_CASYNC_NATIVE == 1
+	g_test_add("/install/chunk-pack",
+			InstallFixture, install_data,
+			install_fixture_set_up_chunk_pack, install_test_chunk_pack,
+			install_fixture_tear_down);
+
+	g_test_add("/install/chunk-pack/mismatch",
+			InstallFixture, install_data,
+			install_fixture_set_up_chunk_pack, install_test_chunk_pack_mismatch,
+			install_fixture_tear_down);
+#endif
+
+	g_test_add("/install/delta/bundle",
+			InstallFixture, install_data,
+			install_fixture_set_up_delta, install_test_delta_bundle,
+			install_fixture_tear_down);
+
+	g_test_add("/install/delta",
+			InstallFixture, install_data,
+			install_fixture_set_up_delta, install_test_delta,
+			install_fixture_tear_down);
+
+	g_test_add("/install/delta/missing-base",
+			InstallFixture, install_data,
+			install_fixture_set_up_delta, install_test_delta_missing_base,
+			install_fixture_tear_down);
+
+	g_test_add("/install/verity-hash",
+			InstallFixture, install_data,
+			install_fixture_set_up_verity, install_test_verity,
+			install_fixture_tear_down);
+
+	g_test_add("/install/verity-hash/adaptive",
+			InstallFixture, install_data,
+			install_fixture_set_up_verity, install_test_verity_adaptive,
+			install_fixture_tear_down);
+
+	g_test_add("/install/concurrent",
+			InstallFixture, install_data,
+			install_fixture_set_up_bundle_concurrent, install_test_bundle_concurrent,
+			install_fixture_tear_down);
+
+	g_test_add("/install/concurrent-error",
+			InstallFixture, install_data,
+			install_fixture_set_up_bundle_concurrent, install_test_bundle_concurrent_error,
+			install_fixture_tear_down);
+
+	g_test_add("/install/fan-out",
+			InstallFixture, install_data,
+			install_fixture_set_up_bundle_fan_out, install_test_bundle_fan_out,
+			install_fixture_tear_down);
+
+	g_test_add("/install/fan-out-error",
+			InstallFixture, install_data,
+			install_fixture_set_up_bundle_fan_out, install_test_bundle_fan_out_error,
+			install_fixture_tear_down);
+
 	g_test_add("/install/slot-skipping",
 			InstallFixture, install_data,
 			install_fixture_set_up_slot_skipping, install_test_bundle_twice,
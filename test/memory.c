@@ -0,0 +1,61 @@
+#include <locale.h>
+#include <glib.h>
+
+#include "memory.h"
+
+static void test_unlimited(void)
+{
+	r_memory_set_limit(0);
+	(void)r_memory_get_reserved_peak(TRUE);
+
+	g_assert_true(r_memory_reserve(G_MAXUINT64 / 2, "test"));
+	g_assert_cmpuint(r_memory_get_reserved_peak(FALSE), ==, G_MAXUINT64 / 2);
+	r_memory_release(G_MAXUINT64 / 2);
+	g_assert_cmpuint(r_memory_get_reserved_peak(TRUE), ==, G_MAXUINT64 / 2);
+	g_assert_cmpuint(r_memory_get_reserved_peak(FALSE), ==, 0);
+}
+
+static void test_limit(void)
+{
+	r_memory_set_limit(1000);
+	g_assert_cmpuint(r_memory_get_limit(), ==, 1000);
+	(void)r_memory_get_reserved_peak(TRUE);
+
+	g_assert_true(r_memory_reserve(600, "first"));
+	g_assert_false(r_memory_reserve(401, "second"));
+	g_assert_false(r_memory_reserve(G_MAXUINT64, "huge"));
+	g_assert_true(r_memory_reserve(400, "second"));
+	g_assert_false(r_memory_reserve(1, "third"));
+
+	r_memory_release(600);
+	g_assert_true(r_memory_reserve(1, "third"));
+	r_memory_release(401);
+
+	g_assert_cmpuint(r_memory_get_reserved_peak(FALSE), ==, 1000);
+
+	r_memory_set_limit(0);
+}
+
+static void test_peak_rss(void)
+{
+	/* only available on Linux with procfs */
+	if (!g_file_test("/proc/self/status", G_FILE_TEST_EXISTS)) {
+		g_test_skip("/proc/self/status not available");
+		return;
+	}
+
+	g_assert_cmpuint(r_memory_get_peak_rss(), >, 0);
+}
+
+int main(int argc, char *argv[])
+{
+	setlocale(LC_ALL, "C");
+
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/memory/unlimited", test_unlimited);
+	g_test_add_func("/memory/limit", test_limit);
+	g_test_add_func("/memory/peak-rss", test_peak_rss);
+
+	return g_test_run();
+}
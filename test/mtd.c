@@ -0,0 +1,121 @@
+#include <fcntl.h>
+#include <locale.h>
+#include <mtd/mtd-user.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "mtd.h"
+#include "utils.h"
+
+#include "common.h"
+
+static void test_write_image(gconstpointer user_data)
+{
+	const gchar *env = user_data;
+	const gchar *device = g_getenv(env);
+	g_autofree gchar *tmpdir = NULL;
+	g_autofree gchar *image = NULL;
+	g_autofree guint8 *data = NULL;
+	g_autofree guint8 *contents = NULL;
+	g_auto(filedesc) fd = -1;
+	g_autoptr(GError) error = NULL;
+	struct mtd_info_user info;
+	RMtdWriteStats stats;
+	gsize size;
+	gboolean res;
+
+	if (!device) {
+		g_test_message("no MTD device for testing found (define %s)", env);
+		g_test_skip("MTD device undefined");
+		return;
+	}
+
+	fd = g_open(device, O_RDWR, 0);
+	g_assert_cmpint(fd, >=, 0);
+	g_assert_cmpint(ioctl(fd, MEMGETINFO, &info), ==, 0);
+
+	/* two and a half erase blocks */
+	size = info.erasesize * 2 + info.erasesize / 2;
+	tmpdir = g_dir_make_tmp("rauc-mtd-XXXXXX", NULL);
+	g_assert_nonnull(tmpdir);
+	image = write_random_file(tmpdir, "image.img", size, 0x3a91c0de);
+	g_assert_nonnull(image);
+
+	res = r_mtd_erase(device, NULL, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+
+	/* everything is written to the erased device */
+	res = r_mtd_write_image(device, image, &stats, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+	g_assert_cmpuint(stats.written, ==, 3);
+	/* only NOR flash can be written without erasing it again */
+	if (info.flags & MTD_BIT_WRITEABLE)
+		g_assert_cmpuint(stats.erased, ==, 0);
+	else
+		g_assert_cmpuint(stats.erased, ==, 3);
+
+	data = random_bytes(size, 0x3a91c0de);
+	contents = g_malloc(info.erasesize * 3);
+	g_assert_true(r_pread_exact(fd, contents, info.erasesize * 3, 0, NULL));
+	g_assert_cmpmem(contents, size, data, size);
+	for (gsize i = size; i < info.erasesize * 3; i++)
+		g_assert_cmphex(contents[i], ==, 0xFF);
+
+	/* nothing is changed when writing the same image again */
+	res = r_mtd_write_image(device, image, &stats, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+	g_assert_cmpuint(stats.written, ==, 0);
+	g_assert_cmpuint(stats.erased, ==, 0);
+	g_assert_cmpuint(stats.unchanged + stats.bad, ==, info.size / info.erasesize);
+
+	/* only the modified erase block is rewritten */
+	data[info.erasesize + 17] ^= 0x5a;
+	g_assert_true(g_file_set_contents(image, (const gchar *)data, size, NULL));
+	res = r_mtd_write_image(device, image, &stats, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+	g_assert_cmpuint(stats.written, ==, 1);
+	g_assert_cmpuint(stats.erased, ==, 1);
+
+	/* erasing again only skips erased blocks on NOR flash */
+	res = r_mtd_erase(device, &stats, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+	g_assert_cmpuint(stats.erased + stats.unchanged + stats.bad, ==, info.size / info.erasesize);
+	res = r_mtd_erase(device, &stats, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+	if (info.flags & MTD_BIT_WRITEABLE) {
+		g_assert_cmpuint(stats.erased, ==, 0);
+	} else {
+		g_assert_cmpuint(stats.erased, ==, info.size / info.erasesize - stats.bad);
+		g_assert_cmpuint(stats.unchanged, ==, 0);
+	}
+
+	/* an image larger than the device is rejected */
+	g_clear_pointer(&image, g_free);
+	image = write_random_file(tmpdir, "large.img", info.size + 1, 0x3a91c0de);
+	res = r_mtd_write_image(device, image, &stats, &error);
+	g_assert_error(error, R_MTD_ERROR, R_MTD_ERROR_NO_SPACE);
+	g_assert_false(res);
+
+	g_assert_true(rm_tree(tmpdir, NULL));
+}
+
+int main(int argc, char *argv[])
+{
+	setlocale(LC_ALL, "C");
+
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_data_func("/mtd/write_image/nor", "RAUC_TEST_MTD_NOR", test_write_image);
+
+	g_test_add_data_func("/mtd/write_image/nand", "RAUC_TEST_MTD_NAND", test_write_image);
+
+	return g_test_run();
+}
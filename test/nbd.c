@@ -1,5 +1,7 @@
 #include <stdio.h>
+#include <fcntl.h>
 #include <locale.h>
+#include <sys/file.h>
 #include <glib.h>
 #include <glib/gstdio.h>
 #include <gio/gio.h>
@@ -7,6 +9,7 @@
 #include <bundle.h>
 #include <context.h>
 #include <manifest.h>
+#include <network.h>
 #include <signature.h>
 #include <utils.h>
 #include <nbd.h>
@@ -22,6 +25,7 @@ typedef struct {
 	RaucBundleAccessArgs access_args;
 
 	gboolean needs_backend;
+	gboolean no_suffix_range;
 
 	GQuark err_domain;
 	gint err_code;
@@ -38,6 +42,17 @@ static gboolean have_http_server(void)
 	return TRUE;
 }
 
+static gboolean have_http_backend(void)
+{
+	if (!g_getenv("RAUC_TEST_HTTP_BACKEND")) {
+		g_test_message("no aiohttp backend for testing found (define RAUC_TEST_HTTP_BACKEND)");
+		g_test_skip("RAUC_TEST_HTTP_BACKEND undefined");
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 static void nbd_fixture_set_up(NBDFixture *fixture, gconstpointer user_data)
 {
 	fixture->tmpdir = g_dir_make_tmp("rauc-XXXXXX", NULL);
@@ -64,6 +79,9 @@ static void test_direct_read(NBDFixture *fixture, gconstpointer user_data)
 	if (!have_http_server())
 		return;
 
+	if (data->needs_backend && !have_http_backend())
+		return;
+
 	nbd_srv = r_nbd_new_server();
 	nbd_srv->url = g_strdup(data->bundle_url);
 	nbd_srv->tls_cert = g_strdup(data->access_args.tls_cert);
@@ -82,10 +100,256 @@ static void test_direct_read(NBDFixture *fixture, gconstpointer user_data)
 		return;
 	}
 
+	/* without suffix range support, the bundle tail is not prefetched */
+	if (data->no_suffix_range)
+		g_assert_null(nbd_srv->tail);
+	else
+		g_assert_nonnull(nbd_srv->tail);
+
+	res = r_nbd_read(nbd_srv->sock, (guint8*)&magic, sizeof(magic), 0, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	g_assert_cmphex(magic, ==, GUINT32_TO_LE(0x73717368));
+}
+
+static void test_block_cache(NBDFixture *fixture, gconstpointer user_data)
+{
+	g_autoptr(RaucNBDServer) nbd_srv = NULL;
+	g_autoptr(GError) ierror = NULL;
+	g_autofree gchar *cache_dir = NULL;
+	g_autoptr(GDir) dir = NULL;
+	g_autofree gchar *data_path = NULL;
+	const gchar *name = NULL;
+	FILE *fp = NULL;
+	guint data_files = 0, map_files = 0;
+	gboolean res = FALSE;
+	guint32 magic = 0;
+
+	if (!have_http_server())
+		return;
+
+	cache_dir = g_build_filename(fixture->tmpdir, "cache", NULL);
+
+	for (guint i = 0; i < 2; i++) {
+		nbd_srv = r_nbd_new_server();
+		nbd_srv->url = g_strdup("http://127.0.0.1/test/good-verity-bundle.raucb");
+		nbd_srv->cache_dir = g_strdup(cache_dir);
+		nbd_srv->cache_size = 1024*1024;
+
+		res = r_nbd_start_server(nbd_srv, &ierror);
+		g_assert_no_error(ierror);
+		g_assert_true(res);
+
+		/* the second read is answered from the (modified) cache */
+		magic = 0;
+		res = r_nbd_read(nbd_srv->sock, (guint8*)&magic, sizeof(magic), 0, &ierror);
+		g_assert_no_error(ierror);
+		g_assert_true(res);
+		g_assert_cmphex(magic, ==, GUINT32_TO_LE(i ? 0x68737173 : 0x73717368));
+
+		/* stopping the server writes the cache map */
+		g_clear_pointer(&nbd_srv, r_nbd_free_server);
+
+		if (i)
+			break;
+
+		/* modify the cached data, so that a cache hit is visible */
+		g_clear_pointer(&data_path, g_free);
+		dir = g_dir_open(cache_dir, 0, &ierror);
+		g_assert_no_error(ierror);
+		while ((name = g_dir_read_name(dir))) {
+			if (g_str_has_suffix(name, ".data"))
+				data_path = g_build_filename(cache_dir, name, NULL);
+		}
+		g_clear_pointer(&dir, g_dir_close);
+		g_assert_nonnull(data_path);
+
+		fp = fopen(data_path, "r+");
+		g_assert_nonnull(fp);
+		magic = GUINT32_TO_LE(0x68737173);
+		g_assert_cmpuint(fwrite(&magic, sizeof(magic), 1, fp), ==, 1);
+		g_assert_cmpint(fclose(fp), ==, 0);
+	}
+
+	dir = g_dir_open(cache_dir, 0, &ierror);
+	g_assert_no_error(ierror);
+	while ((name = g_dir_read_name(dir))) {
+		if (g_str_has_suffix(name, ".data"))
+			data_files++;
+		else if (g_str_has_suffix(name, ".map"))
+			map_files++;
+	}
+	g_assert_cmpuint(data_files, ==, 1);
+	g_assert_cmpuint(map_files, ==, 1);
+}
+
+static void test_block_cache_locked(NBDFixture *fixture, gconstpointer user_data)
+{
+	g_autoptr(RaucNBDServer) nbd_srv = NULL;
+	g_autoptr(GError) ierror = NULL;
+	g_autofree gchar *cache_dir = NULL;
+	g_autofree gchar *locked_path = NULL;
+	g_autofree gchar *unlocked_path = NULL;
+	int locked_fd, unlocked_fd;
+	gboolean res = FALSE;
+	guint32 magic = 0;
+
+	if (!have_http_server())
+		return;
+
+	cache_dir = g_build_filename(fixture->tmpdir, "cache", NULL);
+	g_assert_cmpint(g_mkdir_with_parents(cache_dir, 0700), ==, 0);
+	locked_path = g_build_filename(cache_dir, "locked.data", NULL);
+	unlocked_path = g_build_filename(cache_dir, "unlocked.data", NULL);
+
+	/* data of two other bundles fills the cache, one of them is in use */
+	locked_fd = g_open(locked_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	g_assert_cmpint(locked_fd, >=, 0);
+	g_assert_cmpint(posix_fallocate(locked_fd, 0, 1024*1024), ==, 0);
+	g_assert_cmpint(flock(locked_fd, LOCK_EX), ==, 0);
+	unlocked_fd = g_open(unlocked_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	g_assert_cmpint(unlocked_fd, >=, 0);
+	g_assert_cmpint(posix_fallocate(unlocked_fd, 0, 1024*1024), ==, 0);
+	g_close(unlocked_fd, NULL);
+
+	nbd_srv = r_nbd_new_server();
+	nbd_srv->url = g_strdup("http://127.0.0.1/test/good-verity-bundle.raucb");
+	nbd_srv->cache_dir = g_strdup(cache_dir);
+	nbd_srv->cache_size = 1536*1024;
+
+	res = r_nbd_start_server(nbd_srv, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	res = r_nbd_read(nbd_srv->sock, (guint8*)&magic, sizeof(magic), 0, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	g_assert_cmphex(magic, ==, GUINT32_TO_LE(0x73717368));
+
+	g_clear_pointer(&nbd_srv, r_nbd_free_server);
+	g_close(locked_fd, NULL);
+
+	/* only the unused data was evicted */
+	g_assert_true(g_file_test(locked_path, G_FILE_TEST_EXISTS));
+	g_assert_false(g_file_test(unlocked_path, G_FILE_TEST_EXISTS));
+}
+
+/* Returns the requests served by the mirror routes of the backend since the
+ * last call, as "<mirror> <first>-<last>" lines. */
+static gchar **get_mirror_summary(const gchar *tmpdir)
+{
+	g_autofree gchar *target = g_build_filename(tmpdir, "summary", NULL);
+	g_autofree gchar *summary = NULL;
+	GError *ierror = NULL;
+	gboolean res;
+
+	res = download_file(target, "http://127.0.0.1/backend/mirror-summary", 0, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	g_assert_true(g_file_get_contents(target, &summary, NULL, &ierror));
+	g_assert_no_error(ierror);
+	g_assert_cmpint(g_unlink(target), ==, 0);
+
+	return g_strsplit(g_strchomp(summary), "\n", -1);
+}
+
+static guint count_lines_with_prefix(gchar **lines, const gchar *prefix)
+{
+	guint count = 0;
+
+	for (gchar **line = lines; *line; line++) {
+		if (g_str_has_prefix(*line, prefix))
+			count++;
+	}
+
+	return count;
+}
+
+static void test_mirrors(NBDFixture *fixture, gconstpointer user_data)
+{
+	g_autoptr(RaucNBDServer) nbd_srv = NULL;
+	g_autoptr(GError) ierror = NULL;
+	g_autofree guint8 *data = NULL;
+	g_auto(GStrv) summary = NULL;
+	gboolean res = FALSE;
+	guint32 magic = 0;
+
+	if (!have_http_server() || !have_http_backend())
+		return;
+
+	g_strfreev(get_mirror_summary(fixture->tmpdir));
+
+	nbd_srv = r_nbd_new_server();
+	/* the configured server is slow, so the reads go to the fast mirror */
+	nbd_srv->url = g_strdup("http://127.0.0.1/backend/mirror/slow/good-verity-bundle.raucb");
+	/* the first mirror serves a different bundle and is not used */
+	nbd_srv->mirrors = g_strsplit("http://127.0.0.1/backend/mirror/other/good-crypt-bundle-unencrypted.raucb "
+			"http://127.0.0.1/backend/mirror/fast/good-verity-bundle.raucb", " ", -1);
+
+	res = r_nbd_start_server(nbd_srv, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	res = r_nbd_read(nbd_srv->sock, (guint8*)&magic, sizeof(magic), 0, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	g_assert_cmphex(magic, ==, GUINT32_TO_LE(0x73717368));
+
+	data = g_malloc(1024);
+	for (guint i = 0; i < 8; i++) {
+		res = r_nbd_read(nbd_srv->sock, data, 1024, i * 1024, &ierror);
+		g_assert_no_error(ierror);
+		g_assert_true(res);
+	}
+
+	g_clear_pointer(&nbd_srv, r_nbd_free_server);
+
+	summary = get_mirror_summary(fixture->tmpdir);
+	/* only the last byte was requested to check the mismatching mirror */
+	g_assert_cmpuint(count_lines_with_prefix(summary, "other "), ==, 1);
+	g_assert_cmpuint(count_lines_with_prefix(summary, "other 75745-75745"), ==, 1);
+	/* the fast mirror was probed and then served the reads */
+	g_assert_cmpuint(count_lines_with_prefix(summary, "fast 26505-26505"), ==, 1);
+	g_assert_cmpuint(count_lines_with_prefix(summary, "fast 0-"), >=, 1);
+	g_assert_cmpuint(count_lines_with_prefix(summary, "slow 0-"), ==, 0);
+}
+
+static void test_prefetch(NBDFixture *fixture, gconstpointer user_data)
+{
+	g_autoptr(RaucNBDServer) nbd_srv = NULL;
+	g_autoptr(GError) ierror = NULL;
+	gboolean res = FALSE;
+	guint32 magic = 0;
+	RaucNBDRange ranges[] = {
+		{ .offset = 0, .size = 4096 },
+		{ .offset = 8192, .size = 65536 },
+	};
+	RaucNBDRange invalid = { .offset = G_MAXUINT32, .size = 4096 };
+
+	if (!have_http_server())
+		return;
+
+	nbd_srv = r_nbd_new_server();
+	nbd_srv->url = g_strdup("http://127.0.0.1/test/good-verity-bundle.raucb");
+
+	res = r_nbd_start_server(nbd_srv, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	res = r_nbd_prefetch(nbd_srv->sock, ranges, G_N_ELEMENTS(ranges), &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	/* answered from the prefetched range */
 	res = r_nbd_read(nbd_srv->sock, (guint8*)&magic, sizeof(magic), 0, &ierror);
 	g_assert_no_error(ierror);
 	g_assert_true(res);
 	g_assert_cmphex(magic, ==, GUINT32_TO_LE(0x73717368));
+
+	/* ranges beyond the end of the bundle are rejected */
+	res = r_nbd_prefetch(nbd_srv->sock, &invalid, 1, &ierror);
+	g_assert_error(ierror, R_NBD_ERROR, R_NBD_ERROR_READ);
+	g_assert_false(res);
 }
 
 static void test_check_invalid_bundle(NBDFixture *fixture, gconstpointer user_data)
@@ -263,6 +527,47 @@ int main(int argc, char *argv[])
 			nbd_fixture_set_up, test_direct_read,
 			nbd_fixture_tear_down);
 
+	/* servers without suffix range support */
+	nbd_data = dup_test_data(ptrs, (&(NBDData) {
+		.bundle_url = "http://127.0.0.1/backend/no-suffix-range.raucb",
+		.needs_backend = TRUE,
+		.no_suffix_range = TRUE,
+	}));
+	g_test_add("/nbd/direct_read/no-suffix-range",
+			NBDFixture, nbd_data,
+			nbd_fixture_set_up, test_direct_read,
+			nbd_fixture_tear_down);
+
+	nbd_data = dup_test_data(ptrs, (&(NBDData) {
+		.bundle_url = "http://127.0.0.1/backend/suffix-range-416.raucb",
+		.needs_backend = TRUE,
+		.no_suffix_range = TRUE,
+	}));
+	g_test_add("/nbd/direct_read/suffix-range-416",
+			NBDFixture, nbd_data,
+			nbd_fixture_set_up, test_direct_read,
+			nbd_fixture_tear_down);
+
+	g_test_add("/nbd/direct_read/block-cache",
+			NBDFixture, NULL,
+			nbd_fixture_set_up, test_block_cache,
+			nbd_fixture_tear_down);
+
+	g_test_add("/nbd/direct_read/block-cache-locked",
+			NBDFixture, NULL,
+			nbd_fixture_set_up, test_block_cache_locked,
+			nbd_fixture_tear_down);
+
+	g_test_add("/nbd/direct_read/mirrors",
+			NBDFixture, NULL,
+			nbd_fixture_set_up, test_mirrors,
+			nbd_fixture_tear_down);
+
+	g_test_add("/nbd/direct_read/prefetch",
+			NBDFixture, NULL,
+			nbd_fixture_set_up, test_prefetch,
+			nbd_fixture_tear_down);
+
 	/* 204 handling */
 	nbd_data = dup_test_data(ptrs, (&(NBDData) {
 		.bundle_url = "http://127.0.0.1/code/204",
@@ -2,9 +2,12 @@
 #include <gio/gio.h>
 #include <glib.h>
 #include <glib/gstdio.h>
+#include <string.h>
+#include <unistd.h>
 
 #include <context.h>
 #include <utils.h>
+#include "common.h"
 #include "network.h"
 
 typedef struct {
@@ -62,6 +65,351 @@ static void test_download_file(NetworkFixture *fixture,
 	g_assert_cmpint(g_unlink(target), ==, 0);
 }
 
+#define LARGE_SIZE (9*1024*1024 + 123)
+
+static gboolean have_http_backend(void)
+{
+	if (!g_getenv("RAUC_TEST_HTTP_BACKEND")) {
+		g_test_message("no aiohttp backend for testing found (define RAUC_TEST_HTTP_BACKEND)");
+		g_test_skip("RAUC_TEST_HTTP_BACKEND undefined");
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void assert_large_file(const gchar *filename)
+{
+	g_autofree gchar *contents = NULL;
+	gsize length = 0;
+	GError *ierror = NULL;
+
+	g_assert_true(g_file_get_contents(filename, &contents, &length, &ierror));
+	g_assert_no_error(ierror);
+	g_assert_cmpuint(length, ==, LARGE_SIZE);
+	for (gsize i = 0; i < length; i++) {
+		if ((guint8)contents[i] != i % 251)
+			g_error("unexpected data at offset %"G_GSIZE_FORMAT, i);
+	}
+}
+
+/* Returns the requests served by the backend since the last call, using the
+ * given summary route. */
+static gchar *get_summary(const gchar *tmpdir, const gchar *name)
+{
+	g_autofree gchar *target = g_build_filename(tmpdir, "summary", NULL);
+	g_autofree gchar *url = g_strdup_printf("http://127.0.0.1/backend/%s", name);
+	gchar *summary = NULL;
+	GError *ierror = NULL;
+	gboolean res;
+
+	res = download_file(target, url, 0, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	g_assert_true(g_file_get_contents(target, &summary, NULL, &ierror));
+	g_assert_no_error(ierror);
+	g_assert_cmpint(g_unlink(target), ==, 0);
+
+	return summary;
+}
+
+static void test_download_segmented(NetworkFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autofree gchar *target = NULL;
+	g_autofree gchar *state = NULL;
+	g_autofree gchar *summary = NULL;
+	GError *ierror = NULL;
+	gboolean res;
+
+	if (!have_http_backend())
+		return;
+
+	target = g_build_filename(fixture->tmpdir, "target", NULL);
+	state = g_strconcat(target, ".state", NULL);
+	g_free(get_summary(fixture->tmpdir, "large-summary"));
+
+	/* each chunk is requested once */
+	res = download_file(target, "http://127.0.0.1/backend/large.bin", 0, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	assert_large_file(target);
+	g_assert_false(g_file_test(state, G_FILE_TEST_EXISTS));
+	g_assert_cmpint(g_unlink(target), ==, 0);
+	summary = get_summary(fixture->tmpdir, "large-summary");
+	g_assert_cmpstr(summary, ==,
+			"large 0-4194303\n"
+			"large 4194304-8388607\n"
+			"large 8388608-9437306\n");
+	g_clear_pointer(&summary, g_free);
+
+	/* only the failed chunk is requested again, not the running ones */
+	res = download_file(target, "http://127.0.0.1/backend/flaky.bin", 0, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	assert_large_file(target);
+	g_assert_cmpint(g_unlink(target), ==, 0);
+	summary = get_summary(fixture->tmpdir, "large-summary");
+	g_assert_cmpstr(summary, ==,
+			"flaky 0-4194303\n"
+			"flaky 4194304-8388607\n"
+			"flaky 8388608-9437306\n"
+			"flaky failed\n");
+	g_clear_pointer(&summary, g_free);
+
+	/* a server which ignores the range requests is read in one request */
+	res = download_file(target, "http://127.0.0.1/backend/norange.bin", 0, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	assert_large_file(target);
+	g_assert_false(g_file_test(state, G_FILE_TEST_EXISTS));
+	g_assert_cmpint(g_unlink(target), ==, 0);
+}
+
+/* Writes the state of an interrupted download of large.bin, with the chunks
+ * marked in done already present in the target. */
+static void write_partial_download(const gchar *target, const gchar *state, const gchar *done)
+{
+	g_autofree guint8 *data = g_malloc(LARGE_SIZE);
+	g_autofree gchar *contents = NULL;
+	GError *ierror = NULL;
+	gboolean res;
+
+	for (gsize i = 0; i < LARGE_SIZE; i++)
+		data[i] = i % 251;
+	for (gsize chunk = 0; done[chunk]; chunk++) {
+		gsize offset = chunk * 4*1024*1024;
+
+		if (done[chunk] == '0')
+			memset(data + offset, 0, MIN(4*1024*1024, LARGE_SIZE - offset));
+	}
+	res = g_file_set_contents(target, (const gchar *)data, LARGE_SIZE, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	contents = g_strdup_printf("[download]\n"
+			"url=http://127.0.0.1/backend/large.bin\n"
+			"size=%d\n"
+			"etag=\"large\"\n"
+			"chunk-size=%d\n"
+			"done=%s\n", LARGE_SIZE, 4*1024*1024, done);
+	res = g_file_set_contents(state, contents, -1, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+}
+
+static void test_download_resume(NetworkFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autofree gchar *target = NULL;
+	g_autofree gchar *state = NULL;
+	g_autofree gchar *summary = NULL;
+	GError *ierror = NULL;
+	gboolean res;
+
+	if (!have_http_backend())
+		return;
+
+	target = g_build_filename(fixture->tmpdir, "target", NULL);
+	state = g_strconcat(target, ".state", NULL);
+	g_free(get_summary(fixture->tmpdir, "large-summary"));
+
+	/* only the missing chunk is requested */
+	write_partial_download(target, state, "101");
+	res = download_file(target, "http://127.0.0.1/backend/large.bin", 0, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	assert_large_file(target);
+	g_assert_false(g_file_test(state, G_FILE_TEST_EXISTS));
+	summary = get_summary(fixture->tmpdir, "large-summary");
+	g_assert_cmpstr(summary, ==,
+			"large 4194304-8388607\n");
+	g_clear_pointer(&summary, g_free);
+
+	/* a completed target without a state file is replaced */
+	res = download_file(target, "http://127.0.0.1/backend/large.bin", 0, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	assert_large_file(target);
+	g_free(get_summary(fixture->tmpdir, "large-summary"));
+
+	/* a state file without its target is ignored */
+	write_partial_download(target, state, "111");
+	g_assert_cmpint(g_unlink(target), ==, 0);
+	res = download_file(target, "http://127.0.0.1/backend/large.bin", 0, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	assert_large_file(target);
+	g_assert_false(g_file_test(state, G_FILE_TEST_EXISTS));
+	summary = get_summary(fixture->tmpdir, "large-summary");
+	g_assert_cmpstr(summary, ==,
+			"large 0-4194303\n"
+			"large 4194304-8388607\n"
+			"large 8388608-9437306\n");
+	g_clear_pointer(&summary, g_free);
+
+	/* a state file for another URL is ignored */
+	write_partial_download(target, state, "101");
+	res = download_file(target, "http://127.0.0.1/backend/flaky.bin", 0, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	assert_large_file(target);
+	g_assert_false(g_file_test(state, G_FILE_TEST_EXISTS));
+	g_assert_cmpint(g_unlink(target), ==, 0);
+}
+
+static void test_download_mirrors(NetworkFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autofree gchar *target = NULL;
+	g_autofree gchar *summary = NULL;
+	const gchar *mirrors[] = {
+		/* serves a different file and is not used */
+		"http://127.0.0.1/backend/mirror/other/good-verity-bundle.raucb",
+		"http://127.0.0.1/backend/mirror/fast/large.bin",
+		NULL,
+	};
+	const gchar *other_only[] = {
+		mirrors[0],
+		NULL,
+	};
+	GError *ierror = NULL;
+	gboolean res;
+
+	if (!have_http_backend())
+		return;
+
+	target = g_build_filename(fixture->tmpdir, "target", NULL);
+	g_free(get_summary(fixture->tmpdir, "mirror-summary"));
+
+	/* the configured server is slow, so all chunks are fetched from the
+	 * fast mirror */
+	res = download_file_with_mirrors(target, "http://127.0.0.1/backend/mirror/slow/large.bin",
+			mirrors, 0, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	assert_large_file(target);
+	g_assert_cmpint(g_unlink(target), ==, 0);
+	summary = get_summary(fixture->tmpdir, "mirror-summary");
+	g_assert_cmpstr(summary, ==,
+			"fast 0-4194303\n"
+			"fast 4194304-8388607\n"
+			"fast 8388608-9437306\n"
+			"fast head\n"
+			"other head\n"
+			"slow head\n");
+	g_clear_pointer(&summary, g_free);
+
+	/* without a matching mirror, everything is fetched from the configured
+	 * server */
+	res = download_file_with_mirrors(target, "http://127.0.0.1/backend/mirror/slow/large.bin",
+			other_only, 0, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	assert_large_file(target);
+	g_assert_cmpint(g_unlink(target), ==, 0);
+	summary = get_summary(fixture->tmpdir, "mirror-summary");
+	g_assert_cmpstr(summary, ==,
+			"other head\n"
+			"slow 0-4194303\n"
+			"slow 4194304-8388607\n"
+			"slow 8388608-9437306\n"
+			"slow head\n");
+}
+
+/* Writes an (expired) session cache file with the given mode. */
+static void write_session_file(const gchar *path, int mode)
+{
+	GError *ierror = NULL;
+	gboolean res;
+
+	res = g_file_set_contents(path,
+			"[session.0]\ndata=AAAA\nkey=example.com:443\nvalid-until=1\n",
+			-1, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	g_assert_cmpint(g_chmod(path, mode), ==, 0);
+}
+
+static void load_session_file(const gchar *path, gboolean ignored)
+{
+	CURLSH *share = curl_share_init();
+	GError *ierror = NULL;
+	gboolean res;
+
+	g_assert_nonnull(share);
+	if (ignored)
+		g_test_expect_message(G_LOG_DOMAIN, G_LOG_LEVEL_MESSAGE, "Ignoring TLS session cache *");
+	res = r_network_load_tls_sessions(share, path, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	g_test_assert_expected_messages();
+	curl_share_cleanup(share);
+}
+
+static void test_tls_session_path(NetworkFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autofree gchar *path = g_build_filename(fixture->tmpdir, "sessions", NULL);
+	g_autofree gchar *own_path = NULL;
+	g_autofree gchar *expected = NULL;
+
+	own_path = r_network_tls_session_path(path);
+	if (geteuid() == 0)
+		expected = g_strdup(path);
+	else
+		expected = g_strdup_printf("%s.%u", path, (guint)geteuid());
+	g_assert_cmpstr(own_path, ==, expected);
+
+	/* a missing file is not an error */
+	load_session_file(path, FALSE);
+
+	/* an own file is used */
+	write_session_file(own_path, 0600);
+	load_session_file(path, FALSE);
+
+	/* a file others could have written is ignored */
+	write_session_file(own_path, 0622);
+	load_session_file(path, TRUE);
+
+	/* a symlink is not followed */
+	g_assert_cmpint(g_unlink(own_path), ==, 0);
+	g_assert_cmpint(symlink("/dev/null", own_path), ==, 0);
+	load_session_file(path, TRUE);
+}
+
+#define SANDBOX_UID 65534
+
+static void test_tls_session_sandbox(NetworkFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autofree gchar *path = g_build_filename(fixture->tmpdir, "sessions", NULL);
+	g_autofree gchar *sandbox_path = NULL;
+
+	if (!test_running_as_root())
+		return;
+
+	/* the directory is writable by the sandbox, as documented */
+	g_assert_cmpint(g_chmod(fixture->tmpdir, 0777), ==, 0);
+
+	write_session_file(path, 0600);
+	load_session_file(path, FALSE);
+
+	/* the sandbox uses and can read its own file */
+	g_assert_cmpint(seteuid(SANDBOX_UID), ==, 0);
+	sandbox_path = r_network_tls_session_path(path);
+	g_assert_cmpstr(sandbox_path, !=, path);
+	write_session_file(sandbox_path, 0600);
+	load_session_file(path, FALSE);
+
+	/* the sandbox replaces the file of the privileged process */
+	write_session_file(path, 0600);
+	g_assert_cmpint(seteuid(0), ==, 0);
+
+	/* which is then ignored by root */
+	load_session_file(path, TRUE);
+}
+
 int main(int argc, char *argv[])
 {
 	setlocale(LC_ALL, "C");
@@ -77,5 +425,25 @@ int main(int argc, char *argv[])
 			network_fixture_set_up, test_download_file,
 			network_fixture_tear_down);
 
+	g_test_add("/network/download_segmented", NetworkFixture, NULL,
+			network_fixture_set_up, test_download_segmented,
+			network_fixture_tear_down);
+
+	g_test_add("/network/download_resume", NetworkFixture, NULL,
+			network_fixture_set_up, test_download_resume,
+			network_fixture_tear_down);
+
+	g_test_add("/network/download_mirrors", NetworkFixture, NULL,
+			network_fixture_set_up, test_download_mirrors,
+			network_fixture_tear_down);
+
+	g_test_add("/network/tls_session_path", NetworkFixture, NULL,
+			network_fixture_set_up, test_tls_session_path,
+			network_fixture_tear_down);
+
+	g_test_add("/network/tls_session_sandbox", NetworkFixture, NULL,
+			network_fixture_set_up, test_tls_session_sandbox,
+			network_fixture_tear_down);
+
 	return g_test_run();
 }
@@ -1,6 +1,7 @@
 #!/usr/bin/python3
 
 import argparse
+import asyncio
 import json
 import os
 import socket
@@ -60,6 +61,145 @@ async def token_get(request):
         return web.FileResponse(path="test/good-verity-bundle.raucb")
 
 
+# large enough for segmented downloads (three chunks of 4 MiB)
+LARGE_SIZE = 9 * 1024 * 1024 + 123
+
+
+def large_response(request, name, *, ranges=True):
+    data = request.app["rauc"]["large"]
+    headers = {"Accept-Ranges": "bytes", "ETag": '"large"'}
+
+    if request.method == "HEAD":
+        return web.Response(body=data, headers=headers)
+
+    if not ranges:
+        # only claim range support in the HEAD response (also keeps nginx from
+        # answering the range request itself)
+        headers["Accept-Ranges"] = "none"
+        return web.Response(body=data, headers=headers)
+
+    if not request.http_range or request.http_range.start is None:
+        return web.Response(body=data, headers=headers)
+
+    start = request.http_range.start
+    stop = min(request.http_range.stop or len(data), len(data))
+    request.app["rauc"]["large_requests"].append(f"{name} {start}-{stop - 1}")
+    headers["Content-Range"] = f"bytes {start}-{stop - 1}/{len(data)}"
+    return web.Response(status=206, body=data[start:stop], headers=headers)
+
+
+@routes.get("/large.bin")
+async def large_get(request):
+    return large_response(request, "large")
+
+
+@routes.get("/flaky.bin")
+async def flaky_get(request):
+    # the first request for the last chunk fails
+    if request.http_range and request.http_range.start == 8 * 1024 * 1024 and not request.app["rauc"]["flaky_failed"]:
+        request.app["rauc"]["flaky_failed"] = True
+        request.app["rauc"]["large_requests"].append("flaky failed")
+        raise web.HTTPInternalServerError()
+    return large_response(request, "flaky")
+
+
+@routes.get("/norange.bin")
+async def norange_get(request):
+    return large_response(request, "norange", ranges=False)
+
+
+def no_suffix_response(request, *, suffix_status):
+    with open("test/good-verity-bundle.raucb", "rb") as f:
+        data = f.read()
+    # keep nginx from answering the range request itself
+    headers = {"Accept-Ranges": "none"}
+
+    if request.method == "HEAD" or request.http_range.start is None:
+        return web.Response(body=data, headers=headers)
+
+    # suffix ranges are ignored or rejected, like by some servers
+    if request.http_range.start < 0:
+        if suffix_status == 416:
+            raise web.HTTPRequestRangeNotSatisfiable(headers={"Content-Range": f"bytes */{len(data)}"})
+        return web.Response(body=data, headers=headers)
+
+    start = request.http_range.start
+    stop = min(request.http_range.stop or len(data), len(data))
+    headers["Content-Range"] = f"bytes {start}-{stop - 1}/{len(data)}"
+    return web.Response(status=206, body=data[start:stop], headers=headers)
+
+
+@routes.get("/no-suffix-range.raucb")
+async def no_suffix_range_get(request):
+    return no_suffix_response(request, suffix_status=200)
+
+
+@routes.get("/suffix-range-416.raucb")
+async def suffix_range_416_get(request):
+    return no_suffix_response(request, suffix_status=416)
+
+
+# files which can be served by the mirror routes
+MIRROR_FILES = ["good-verity-bundle.raucb", "good-crypt-bundle-unencrypted.raucb", "large.bin"]
+
+
+@routes.get("/mirror/{name}/{file}")
+async def mirror_get(request):
+    name = request.match_info["name"]
+    file = request.match_info["file"]
+    if file not in MIRROR_FILES:
+        raise web.HTTPNotFound()
+    if file == "large.bin":
+        data = request.app["rauc"]["large"]
+    else:
+        with open(f"test/{file}", "rb") as f:
+            data = f.read()
+    headers = {"Accept-Ranges": "bytes", "ETag": f'"{file}"'}
+
+    # the slow mirror has a high latency, so that it is not selected for
+    # range requests if another mirror is available
+    if name == "slow":
+        await asyncio.sleep(0.5)
+
+    if request.method == "HEAD":
+        request.app["rauc"]["mirror_requests"].append(f"{name} head")
+        return web.Response(body=data, headers=headers)
+
+    if request.http_range.start is None:
+        request.app["rauc"]["mirror_requests"].append(f"{name} full")
+        return web.Response(body=data, headers=headers)
+
+    if request.http_range.start < 0:
+        # suffix range
+        start = max(len(data) + request.http_range.start, 0)
+        stop = len(data)
+    else:
+        start = request.http_range.start
+        stop = min(request.http_range.stop or len(data), len(data))
+    request.app["rauc"]["mirror_requests"].append(f"{name} {start}-{stop - 1}")
+    headers["Content-Range"] = f"bytes {start}-{stop - 1}/{len(data)}"
+    return web.Response(status=206, body=data[start:stop], headers=headers)
+
+
+@routes.get("/mirror-summary")
+async def mirror_summary_get(request):
+    if request.method == "HEAD":
+        return web.Response()
+    lines = request.app["rauc"]["mirror_requests"]
+    request.app["rauc"]["mirror_requests"] = []
+    return web.Response(text="".join(f"{line}\n" for line in sorted(lines)))
+
+
+@routes.get("/large-summary")
+async def large_summary_get(request):
+    if request.method == "HEAD":
+        return web.Response()
+    lines = request.app["rauc"]["large_requests"]
+    request.app["rauc"]["large_requests"] = []
+    request.app["rauc"]["flaky_failed"] = False
+    return web.Response(text="".join(f"{line}\n" for line in sorted(lines)))
+
+
 def reset_summary(request):
     request.app["rauc"]["summary"] = {
         "first_request_headers": {},
@@ -99,8 +239,8 @@ async def get_handler(request):
         summary["second_request_headers"] = dict(request.headers)
 
     if request.http_range:
-        start = str(request.http_range.start) or ""
-        end = str(request.http_range.stop) or ""
+        start = "" if request.http_range.start is None else str(request.http_range.start)
+        end = "" if request.http_range.stop is None else str(request.http_range.stop)
         summary["range_requests"].append(f"{start}:{end}")
 
     return web.FileResponse(config["file_path"])
@@ -134,6 +274,10 @@ if __name__ == "__main__":
     app = web.Application()
     app["rauc"] = {
         "sporadic_counter": -1,
+        "large": bytes(i % 251 for i in range(LARGE_SIZE)),
+        "large_requests": [],
+        "flaky_failed": False,
+        "mirror_requests": [],
     }
     app.add_routes(routes)
     web.run_app(app, **app_args)
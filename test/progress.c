@@ -122,6 +122,72 @@ static void progress_test_explicit_percentage(void)
 	g_assert_cmpint(callback_counter, ==, 9);
 }
 
+static void progress_test_step_bytes(void)
+{
+	RaucProgressBytes bytes = {0};
+
+	/* reset global state */
+	callback_counter = 0;
+	last_percentage = 0;
+
+	r_context_begin_step("test_1", "testing step 1", 1);
+	g_assert_false(r_context_get_progress_bytes(&bytes));
+
+	r_context_begin_step("test_1.1", "testing step 1.1", 0);
+	r_context_set_step_bytes("test_1.1", 1024, 4096);
+	g_assert_cmpint(last_percentage, ==, 25);
+
+	g_assert_true(r_context_get_progress_bytes(&bytes));
+	g_assert_cmpstr(bytes.step, ==, "test_1.1");
+	g_assert_cmpint(bytes.done, ==, 1024);
+	g_assert_cmpint(bytes.total, ==, 4096);
+	/* no rate and ETA after the first sample */
+	g_assert_cmpfloat(bytes.rate, ==, 0.0);
+	g_assert_cmpfloat(bytes.eta, <, 0.0);
+
+	g_usleep(G_USEC_PER_SEC / 5);
+	r_context_set_step_bytes("test_1.1", 3072, 4096);
+	g_assert_cmpint(last_percentage, ==, 75);
+
+	g_assert_true(r_context_get_progress_bytes(&bytes));
+	g_assert_cmpint(bytes.done, ==, 3072);
+	g_assert_cmpfloat(bytes.rate, >, 0.0);
+	g_assert_cmpfloat(bytes.eta, >=, 0.0);
+
+	r_context_end_step("test_1.1", TRUE);
+	g_assert_false(r_context_get_progress_bytes(&bytes));
+	r_context_end_step("test_1", TRUE);
+	g_assert_cmpint(last_percentage, ==, 100);
+}
+
+static gpointer muted_step_thread(gpointer data)
+{
+	r_context_set_progress_muted(TRUE);
+
+	return GINT_TO_POINTER(r_context_in_progress_step(NULL));
+}
+
+static void progress_test_in_step(void)
+{
+	GThread *thread;
+
+	g_assert_false(r_context_in_progress_step(NULL));
+
+	r_context_begin_step("test_1", "testing step 1", 1);
+	r_context_begin_step("test_1.1", "testing step 1.1", 0);
+	g_assert_true(r_context_in_progress_step(NULL));
+	g_assert_true(r_context_in_progress_step("test_1.1"));
+	g_assert_false(r_context_in_progress_step("test_1"));
+
+	/* muted threads don't see the steps of others */
+	thread = g_thread_new("muted", muted_step_thread, NULL);
+	g_assert_false(GPOINTER_TO_INT(g_thread_join(thread)));
+
+	r_context_end_step("test_1.1", TRUE);
+	r_context_end_step("test_1", TRUE);
+	g_assert_false(r_context_in_progress_step(NULL));
+}
+
 static void progress_test_weighted_steps(void)
 {
 	/* reset global state */
@@ -162,6 +228,58 @@ static void progress_test_weighted_steps(void)
 	g_assert_cmpint(callback_counter, ==, 13);
 }
 
+static void progress_test_step_report(void)
+{
+	g_autoptr(GVariant) report = NULL;
+	g_autoptr(GVariant) step = NULL;
+	const gchar *name = NULL, *description = NULL;
+	gint depth = 0;
+	gdouble duration = -1.0;
+	gboolean success = FALSE;
+
+	callback_counter = 0;
+	last_percentage = 0;
+
+	r_context_begin_step_report();
+
+	r_context_begin_step("test_1", "testing step 1", 2);
+	r_context_begin_step("test_1.1", "testing step 1.1", 0);
+	g_usleep(1000);
+	r_context_end_step("test_1.1", TRUE);
+	r_context_begin_step("test_1.2", "testing step 1.2", 0);
+	r_context_end_step("test_1.2", FALSE);
+	r_context_end_step("test_1", FALSE);
+
+	report = g_variant_ref_sink(r_context_end_step_report());
+	g_assert_null(r_context()->step_report);
+	g_assert_true(g_variant_is_of_type(report, G_VARIANT_TYPE("aa{sv}")));
+	g_assert_cmpuint(g_variant_n_children(report), ==, 3);
+
+	/* steps are listed in the order they ended */
+	step = g_variant_get_child_value(report, 0);
+	g_assert_true(g_variant_lookup(step, "name", "&s", &name));
+	g_assert_cmpstr(name, ==, "test_1.1");
+	g_assert_true(g_variant_lookup(step, "description", "&s", &description));
+	g_assert_cmpstr(description, ==, "testing step 1.1");
+	g_assert_true(g_variant_lookup(step, "depth", "i", &depth));
+	g_assert_cmpint(depth, ==, 2);
+	g_assert_true(g_variant_lookup(step, "duration", "d", &duration));
+	g_assert_cmpfloat(duration, >=, 0.001);
+	g_assert_true(g_variant_lookup(step, "success", "b", &success));
+	g_assert_true(success);
+	g_clear_pointer(&step, g_variant_unref);
+
+	step = g_variant_get_child_value(report, 2);
+	g_assert_true(g_variant_lookup(step, "name", "&s", &name));
+	g_assert_cmpstr(name, ==, "test_1");
+	g_assert_true(g_variant_lookup(step, "depth", "i", &depth));
+	g_assert_cmpint(depth, ==, 1);
+	g_assert_true(g_variant_lookup(step, "duration", "d", &duration));
+	g_assert_cmpfloat(duration, >=, 0.001);
+	g_assert_true(g_variant_lookup(step, "success", "b", &success));
+	g_assert_false(success);
+}
+
 int main(int argc, char *argv[])
 {
 	setlocale(LC_ALL, "C");
@@ -179,7 +297,10 @@ int main(int argc, char *argv[])
 	g_test_add_func("/progress/test_nesting", progress_test_nesting);
 	g_test_add_func("/progress/test_unsuccessful_substep", progress_test_unsuccessful_substep);
 	g_test_add_func("/progress/test_explicit_percentage", progress_test_explicit_percentage);
+	g_test_add_func("/progress/test_step_bytes", progress_test_step_bytes);
+	g_test_add_func("/progress/test_in_step", progress_test_in_step);
 	g_test_add_func("/progress/test_weighted_steps", progress_test_weighted_steps);
+	g_test_add_func("/progress/test_step_report", progress_test_step_report);
 
 	return g_test_run();
 }
@@ -3,6 +3,8 @@
 #include <glib.h>
 #include <glib/gstdio.h>
 #include <gio/gio.h>
+#include <gio/gunixfdlist.h>
+#include <glib-unix.h>
 
 #include <bundle.h>
 #include <context.h>
@@ -23,6 +25,7 @@ typedef struct {
 
 GMainLoop *testloop = NULL;
 RInstaller *installer = NULL;
+static gint pipe_write_fd = -1;
 
 static void service_fixture_set_up(ServiceFixture *fixture, gconstpointer user_data)
 {
@@ -127,6 +130,16 @@ static void on_installer_completed_failed(GDBusProxy *proxy, gint result,
 	g_main_loop_quit(testloop);
 }
 
+static void on_installer_slot_status_changed(GDBusProxy *proxy, GVariant *slot_status_array,
+		gpointer data)
+{
+	GVariant **changed = data;
+
+	g_assert_null(*changed);
+	*changed = g_variant_ref(slot_status_array);
+	g_main_loop_quit(testloop);
+}
+
 static void assert_progress(GVariant *progress, gint32 percentage, const gchar *message, gint32 depth)
 {
 	gint32 comp_percentage, comp_depth;
@@ -150,7 +163,20 @@ static void assert_progress(GVariant *progress, gint32 percentage, const gchar *
 	g_variant_unref(gv);
 }
 
-static void service_test_install(ServiceFixture *fixture, gconstpointer user_data, gboolean deprecated)
+static gpointer pipe_bundle_thread(gpointer data)
+{
+	g_autofree gchar *bundlepath = data;
+	g_autofree gchar *contents = NULL;
+	gsize length = 0;
+
+	g_assert_true(g_file_get_contents(bundlepath, &contents, &length, NULL));
+	g_assert_true(r_write_exact(pipe_write_fd, (guint8 *)contents, length, NULL));
+	g_close(pipe_write_fd, NULL);
+
+	return NULL;
+}
+
+static void service_test_install(ServiceFixture *fixture, gconstpointer user_data, const gchar *method)
 {
 	g_autoptr(GQueue) args = g_queue_new();
 	const gchar *operation = NULL, *last_error = NULL;
@@ -159,6 +185,9 @@ static void service_test_install(ServiceFixture *fixture, gconstpointer user_dat
 	const gchar *variant = NULL;
 	const gchar *bootslot = NULL;
 	g_autofree gchar *bundlepath = NULL;
+	g_autoptr(GVariant) changed = NULL;
+	g_autoptr(GVariant) rootfs_status = NULL;
+	const gchar *status = NULL;
 	GError *error = NULL;
 	gboolean ret = FALSE;
 
@@ -211,6 +240,8 @@ static void service_test_install(ServiceFixture *fixture, gconstpointer user_dat
 			G_CALLBACK(on_installer_changed), args), !=, 0);
 	g_assert_cmpint(g_signal_connect(installer, "completed",
 			G_CALLBACK(on_installer_completed), NULL), !=, 0);
+	g_assert_cmpint(g_signal_connect(installer, "slot-status-changed",
+			G_CALLBACK(on_installer_slot_status_changed), &changed), !=, 0);
 
 	/* initial operation must be 'idle', initial last_error must be empty */
 	operation = r_installer_get_operation(installer);
@@ -234,12 +265,34 @@ static void service_test_install(ServiceFixture *fixture, gconstpointer user_dat
 	g_assert_nonnull(bundlepath);
 
 	/* Actually install bundle */
-	if (deprecated) {
+	if (g_strcmp0(method, "Install") == 0) {
 		ret = r_installer_call_install_sync(
 				installer,
 				bundlepath,
 				NULL,
 				&error);
+	} else if (g_strcmp0(method, "InstallBundleFd") == 0) {
+		g_auto(GVariantDict) dict = G_VARIANT_DICT_INIT(NULL);
+		g_autoptr(GUnixFDList) fd_list = g_unix_fd_list_new();
+		g_autoptr(GThread) writer = NULL;
+		gint fds[2];
+
+		/* pass the bundle through a pipe, so that it needs to be received completely */
+		g_assert_true(g_unix_open_pipe(fds, FD_CLOEXEC, NULL));
+		g_assert_cmpint(g_unix_fd_list_append(fd_list, fds[0], NULL), ==, 0);
+		g_close(fds[0], NULL);
+		pipe_write_fd = fds[1];
+		writer = g_thread_new("pipe-writer", pipe_bundle_thread, g_strdup(bundlepath));
+
+		ret = r_installer_call_install_bundle_fd_sync(
+				installer,
+				g_variant_new_handle(0),
+				g_variant_dict_end(&dict), /* floating, no unref needed */
+				fd_list,
+				NULL,
+				NULL,
+				&error);
+		g_thread_join(g_steal_pointer(&writer));
 	} else {
 		g_auto(GVariantDict) dict = G_VARIANT_DICT_INIT(NULL);
 		ret = r_installer_call_install_bundle_sync(
@@ -254,6 +307,22 @@ static void service_test_install(ServiceFixture *fixture, gconstpointer user_dat
 
 	g_main_loop_run(testloop);
 
+	/* the status of the installed slots is pushed after completion */
+	if (!changed)
+		g_main_loop_run(testloop);
+	g_assert_nonnull(changed);
+	for (gsize i = 0; i < g_variant_n_children(changed); i++) {
+		g_autoptr(GVariant) tuple = g_variant_get_child_value(changed, i);
+		const gchar *name = NULL;
+
+		g_variant_get_child(tuple, 0, "&s", &name);
+		if (g_strcmp0(name, "rootfs.1") == 0)
+			rootfs_status = g_variant_get_child_value(tuple, 1);
+	}
+	g_assert_nonnull(rootfs_status);
+	g_assert_true(g_variant_lookup(rootfs_status, "status", "&s", &status));
+	g_assert_cmpstr(status, ==, "ok");
+
 	g_clear_object(&installer);
 
 	g_assert_cmpuint(args->length, ==, 0);
@@ -261,7 +330,12 @@ static void service_test_install(ServiceFixture *fixture, gconstpointer user_dat
 
 static void service_test_install_bundle(ServiceFixture *fixture, gconstpointer user_data)
 {
-	service_test_install(fixture, user_data, FALSE);
+	service_test_install(fixture, user_data, "InstallBundle");
+}
+
+static void service_test_install_bundle_fd(ServiceFixture *fixture, gconstpointer user_data)
+{
+	service_test_install(fixture, user_data, "InstallBundleFd");
 }
 
 static void service_test_install_api(ServiceFixture *fixture, gconstpointer user_data)
@@ -340,7 +414,7 @@ static void service_test_install_api(ServiceFixture *fixture, gconstpointer user
 
 static void service_test_install_deprecated(ServiceFixture *fixture, gconstpointer user_data)
 {
-	service_test_install(fixture, user_data, TRUE);
+	service_test_install(fixture, user_data, "Install");
 }
 
 static void service_test_info(ServiceFixture *fixture, gconstpointer user_data, gboolean deprecated)
@@ -416,6 +490,83 @@ static void service_test_info_deprecated(ServiceFixture *fixture, gconstpointer
 	service_test_info(fixture, user_data, TRUE);
 }
 
+static void inspect_bundle_done(GObject *source_object, GAsyncResult *result, gpointer user_data)
+{
+	guint *pending = user_data;
+	g_autoptr(GVariant) info = NULL;
+	GError *error = NULL;
+
+	g_assert_true(r_installer_call_inspect_bundle_finish(installer, &info, result, &error));
+	g_assert_no_error(error);
+	g_assert_nonnull(info);
+
+	(*pending)--;
+}
+
+static void service_test_info_latency(ServiceFixture *fixture, gconstpointer user_data)
+{
+	GError *error = NULL;
+	g_autofree gchar *bundlepath = NULL;
+	g_autoptr(GVariant) statistics = NULL;
+	g_autoptr(GVariant) values = NULL;
+	guint pending = 2;
+	guint64 count;
+
+	if (!ENABLE_SERVICE) {
+		g_test_skip("Test requires RAUC being configured with \"-Dservice=true\".");
+		return;
+	}
+
+	/* needs to run as root */
+	if (!test_running_as_root())
+		return;
+
+	bundlepath = g_build_filename(fixture->tmpdir, "good-bundle.raucb", NULL);
+	g_assert_true(test_copy_file("test", "good-bundle.raucb", fixture->tmpdir, "good-bundle.raucb"));
+
+	installer = r_installer_proxy_new_for_bus_sync(G_BUS_TYPE_SESSION,
+			G_DBUS_PROXY_FLAGS_NONE,
+			"de.pengutronix.rauc",
+			"/",
+			NULL,
+			&error);
+	g_assert_no_error(error);
+	g_assert_nonnull(installer);
+
+	/* two concurrent calls, each handled by its own GTask in the service */
+	for (guint i = 0; i < 2; i++) {
+		g_auto(GVariantDict) dict = G_VARIANT_DICT_INIT(NULL);
+
+		r_installer_call_inspect_bundle(installer,
+				bundlepath,
+				g_variant_dict_end(&dict), /* floating, no unref needed */
+				NULL,
+				inspect_bundle_done,
+				&pending);
+	}
+	while (pending)
+		g_main_context_iteration(NULL, TRUE);
+
+	/* the property change may arrive after the second reply */
+	for (guint i = 0; i < 100; i++) {
+		g_clear_pointer(&values, g_variant_unref);
+		g_clear_pointer(&statistics, g_variant_unref);
+		statistics = r_installer_dup_statistics(installer);
+		g_assert_nonnull(statistics);
+		values = g_variant_lookup_value(statistics, "dbus InspectBundle latency", G_VARIANT_TYPE_VARDICT);
+		if (values && g_variant_lookup(values, "count", "t", &count) && count == 2)
+			break;
+		g_main_context_iteration(NULL, FALSE);
+		g_usleep(10000);
+	}
+	g_assert_nonnull(values);
+	g_assert_true(g_variant_lookup(values, "count", "t", &count));
+	g_assert_cmpuint(count, ==, 2);
+	g_assert_true(g_variant_lookup(values, "p99", "d", NULL));
+
+	g_clear_object(&installer);
+}
+
 static void service_test_slot_status(ServiceFixture *fixture, gconstpointer user_data)
 {
 	GError *error = NULL;
@@ -468,6 +619,10 @@ int main(int argc, char *argv[])
 			service_install_fixture_set_up, service_test_install_bundle,
 			service_fixture_tear_down);
 
+	g_test_add("/service/install-bundle-fd", ServiceFixture, NULL,
+			service_install_fixture_set_up, service_test_install_bundle_fd,
+			service_fixture_tear_down);
+
 	g_test_add("/service/install-deprecated", ServiceFixture, NULL,
 			service_install_fixture_set_up, service_test_install_deprecated,
 			service_fixture_tear_down);
@@ -484,6 +639,10 @@ int main(int argc, char *argv[])
 			service_fixture_set_up, service_test_info_deprecated,
 			service_fixture_tear_down);
 
+	g_test_add("/service/info-latency", ServiceFixture, NULL,
+			service_fixture_set_up, service_test_info_latency,
+			service_fixture_tear_down);
+
 	g_test_add("/service/slot-status", ServiceFixture, NULL,
 			service_fixture_set_up, service_test_slot_status,
 			service_fixture_tear_down);
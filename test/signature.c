@@ -335,6 +335,59 @@ static void signature_verify_file(SignatureFixture *fixture,
 	g_clear_error(&fixture->error);
 }
 
+static void signature_verify_file_streamed(SignatureFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autofree gchar *tmpdir = g_dir_make_tmp("rauc-XXXXXX", NULL);
+	g_autofree gchar *path = g_build_filename(tmpdir, "content", NULL);
+	g_autoptr(GBytes) content = NULL;
+	g_autoptr(GByteArray) file = g_byte_array_new();
+	gsize size = 3 * 1024 * 1024 + 123;
+	gboolean res;
+	gint fd;
+
+	g_assert_nonnull(tmpdir);
+
+	/* content spanning multiple reads, followed by unsigned data */
+	g_byte_array_set_size(file, size);
+	for (gsize i = 0; i < size; i++)
+		file->data[i] = i % 251;
+	content = g_bytes_new(file->data, size);
+	g_byte_array_append(file, (const guint8 *)"trailer", 7);
+	g_assert_true(g_file_set_contents(path, (const gchar *)file->data, file->len, NULL));
+
+	fixture->sig = cms_sign(content,
+			TRUE,
+			"test/openssl-ca/rel/release-1.cert.pem",
+			"test/openssl-ca/rel/private/release-1.pem",
+			NULL,
+			&fixture->error);
+	g_assert_no_error(fixture->error);
+	g_assert_nonnull(fixture->sig);
+
+	fd = g_open(path, O_RDONLY|O_CLOEXEC, 0);
+	g_assert_cmpint(fd, >=, 0);
+	res = cms_verify_fd(fd, fixture->sig, size, fixture->store, &fixture->cms, &fixture->error);
+	g_assert_no_error(fixture->error);
+	g_assert_true(res);
+	g_clear_pointer(&fixture->cms, CMS_ContentInfo_free);
+
+	/* including the trailer must fail */
+	res = cms_verify_fd(fd, fixture->sig, 0, fixture->store, &fixture->cms, &fixture->error);
+	g_assert_error(fixture->error, R_SIGNATURE_ERROR, R_SIGNATURE_ERROR_INVALID);
+	g_assert_false(res);
+	g_clear_error(&fixture->error);
+
+	/* a limit beyond the end of the file must fail */
+	res = cms_verify_fd(fd, fixture->sig, file->len + 1, fixture->store, &fixture->cms, &fixture->error);
+	g_assert_error(fixture->error, R_SIGNATURE_ERROR, R_SIGNATURE_ERROR_PARSE);
+	g_assert_false(res);
+	g_clear_error(&fixture->error);
+	g_close(fd, NULL);
+
+	g_assert_true(rm_tree(tmpdir, NULL));
+}
+
 static void signature_loopback_detached(SignatureFixture *fixture,
 		gconstpointer user_data)
 {
@@ -866,6 +919,55 @@ static void signature_cmsverify_pathdir_path(SignatureFixture *fixture,
 	g_assert_nonnull(fixture->cms);
 }
 
+static void signature_cached_store(SignatureFixture *fixture, gconstpointer user_data)
+{
+	g_autofree gchar *tmpdir = g_dir_make_tmp("rauc-XXXXXX", NULL);
+	g_autofree gchar *keyring = g_build_filename(tmpdir, "keyring.pem", NULL);
+	g_autofree gchar *contents = NULL;
+	gchar *old_keyring_path = r_context()->config->keyring_path;
+	gchar *old_keyring_directory = r_context()->config->keyring_directory;
+	X509_STORE *store_a = NULL, *store_b = NULL, *store_c = NULL;
+	gboolean res;
+
+	g_assert_nonnull(tmpdir);
+	g_assert_true(g_file_get_contents("test/openssl-ca/dev-ca.pem", &contents, NULL, NULL));
+	g_assert_true(g_file_set_contents(keyring, contents, -1, NULL));
+
+	r_context()->config->keyring_path = keyring;
+	r_context()->config->keyring_directory = NULL;
+
+	/* unchanged keyring is reused */
+	store_a = get_cached_x509_store(&fixture->error);
+	g_assert_no_error(fixture->error);
+	g_assert_nonnull(store_a);
+	store_b = get_cached_x509_store(&fixture->error);
+	g_assert_no_error(fixture->error);
+	g_assert_true(store_a == store_b);
+
+	/* replaced keyring is loaded again */
+	g_assert_true(g_file_set_contents(keyring, contents, -1, NULL));
+	store_c = get_cached_x509_store(&fixture->error);
+	g_assert_no_error(fixture->error);
+	g_assert_nonnull(store_c);
+	g_assert_true(store_c != store_a);
+
+	/* the new store is usable for verification */
+	fixture->sig = read_file("test/openssl-ca/manifest-r1.sig", NULL);
+	g_assert_nonnull(fixture->sig);
+	res = cms_verify_bytes(fixture->content, fixture->sig, store_c, &fixture->cms, NULL, &fixture->error);
+	g_assert_no_error(fixture->error);
+	g_assert_true(res);
+
+	X509_STORE_free(store_a);
+	X509_STORE_free(store_b);
+	X509_STORE_free(store_c);
+
+	r_context()->config->keyring_path = old_keyring_path;
+	r_context()->config->keyring_directory = old_keyring_directory;
+
+	g_assert_true(rm_tree(tmpdir, NULL));
+}
+
 int main(int argc, char *argv[])
 {
 	setlocale(LC_ALL, "C");
@@ -886,6 +988,7 @@ int main(int argc, char *argv[])
 	g_test_add("/signature/verify_valid", SignatureFixture, NULL, signature_set_up, signature_verify_valid, signature_tear_down);
 	g_test_add("/signature/verify_invalid", SignatureFixture, NULL, signature_set_up, signature_verify_invalid, signature_tear_down);
 	g_test_add("/signature/verify_file", SignatureFixture, NULL, signature_set_up, signature_verify_file, signature_tear_down);
+	g_test_add("/signature/verify_file_streamed", SignatureFixture, NULL, signature_set_up, signature_verify_file_streamed, signature_tear_down);
 	g_test_add("/signature/loopback_detached", SignatureFixture, NULL, signature_set_up, signature_loopback_detached, signature_tear_down);
 	g_test_add("/signature/loopback_inline", SignatureFixture, NULL, signature_set_up, signature_loopback_inline, signature_tear_down);
 	g_test_add("/signature/get_cert_chain", SignatureFixture, NULL, signature_set_up, signature_get_cert_chain, signature_tear_down);
@@ -901,6 +1004,7 @@ int main(int argc, char *argv[])
 	g_test_add("/signature/cmsverify_dir_single_fail", SignatureFixture, NULL, signature_set_up, signature_cmsverify_dir_single_fail, signature_tear_down);
 	g_test_add("/signature/cmsverify_pathdir_dir", SignatureFixture, NULL, signature_set_up, signature_cmsverify_pathdir_dir, signature_tear_down);
 	g_test_add("/signature/cmsverify_pathdir_path", SignatureFixture, NULL, signature_set_up, signature_cmsverify_pathdir_path, signature_tear_down);
+	g_test_add("/signature/cached_store", SignatureFixture, NULL, signature_set_up, signature_cached_store, signature_tear_down);
 
 	return g_test_run();
 }
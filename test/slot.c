@@ -164,6 +164,28 @@ static void test_slot_get_root_classes(void)
 	g_assert_false(string_array_contains(root_classes, "appfs"));
 }
 
+static void test_slot_get_physical_device(void)
+{
+	RaucSlot slot = {0};
+	g_autofree gchar *physical = NULL;
+
+	/* unresolvable devices are returned as-is */
+	slot.device = (gchar*)"/nonexistent/device";
+	physical = r_slot_get_physical_device(&slot);
+	g_assert_cmpstr(physical, ==, "/nonexistent/device");
+	g_clear_pointer(&physical, g_free);
+
+	if (!g_file_test("/sys/dev/char/1:3", G_FILE_TEST_EXISTS)) {
+		g_test_skip("sysfs not available");
+		return;
+	}
+
+	/* character devices without a parent resolve to their own sysfs directory */
+	slot.device = (gchar*)"/dev/null";
+	physical = r_slot_get_physical_device(&slot);
+	g_assert_cmpstr(physical, ==, "/sys/devices/virtual/mem/null");
+}
+
 int main(int argc, char *argv[])
 {
 	setlocale(LC_ALL, "C");
@@ -175,6 +197,7 @@ int main(int argc, char *argv[])
 	g_test_add_func("/slot/get-all-children", test_slot_get_all_children);
 	g_test_add_func("/slot/get-all-of-class", test_slot_get_all_of_class);
 	g_test_add_func("/slot/get-root-classes", test_slot_get_root_classes);
+	g_test_add_func("/slot/get-physical-device", test_slot_get_physical_device);
 
 	return g_test_run();
 }
@@ -1,5 +1,6 @@
 #include <locale.h>
 #include <glib.h>
+#include <gio/gio.h>
 
 #include "stats.h"
 
@@ -59,6 +60,275 @@ static void test_queue(void)
 	r_test_stats_stop();
 }
 
+static void test_live(void)
+{
+	g_autoptr(RaucStats) first = r_stats_new("live");
+	g_autoptr(RaucStats) second = r_stats_new("live");
+	g_autoptr(GVariant) live = NULL;
+	g_autoptr(GVariant) values = NULL;
+	guint64 count;
+	gdouble avg;
+
+	r_stats_add(first, 1.0);
+	r_stats_add(first, 3.0);
+
+	live = g_variant_ref_sink(r_stats_get_live());
+	g_assert_true(g_variant_is_of_type(live, G_VARIANT_TYPE("a{sv}")));
+
+	values = g_variant_lookup_value(live, "live", G_VARIANT_TYPE_VARDICT);
+	g_assert_nonnull(values);
+	g_assert_true(g_variant_lookup(values, "count", "t", &count));
+	g_assert_cmpuint(count, ==, 2);
+	g_assert_true(g_variant_lookup(values, "avg", "d", &avg));
+	g_assert_cmpfloat(avg, ==, 2.0);
+	g_assert_true(g_variant_lookup(values, "p50", "d", NULL));
+	g_clear_pointer(&values, g_variant_unref);
+
+	/* duplicate labels are numbered, empty stats only have a count */
+	values = g_variant_lookup_value(live, "live #2", G_VARIANT_TYPE_VARDICT);
+	g_assert_nonnull(values);
+	g_assert_true(g_variant_lookup(values, "count", "t", &count));
+	g_assert_cmpuint(count, ==, 0);
+	g_assert_false(g_variant_lookup(values, "avg", "d", NULL));
+	g_clear_pointer(&values, g_variant_unref);
+
+	/* freed stats are removed */
+	g_clear_pointer(&second, r_stats_free);
+	g_clear_pointer(&live, g_variant_unref);
+	live = g_variant_ref_sink(r_stats_get_live());
+	g_assert_false(g_variant_lookup(live, "live #2", "@a{sv}", NULL));
+}
+
+static void test_report(void)
+{
+	g_autoptr(GVariant) report = NULL;
+	g_autoptr(GVariant) values = NULL;
+	RaucStats *stats = NULL;
+	guint64 count;
+	gdouble sum, max;
+
+	/* not collected without an active report */
+	stats = r_stats_new("before");
+	r_stats_add(stats, 1.0);
+	r_stats_free(stats);
+	r_stats_report_add("before", 1.0);
+
+	r_stats_report_begin();
+
+	/* stats with the same label are merged */
+	stats = r_stats_new("merged");
+	r_stats_add(stats, 1.0);
+	r_stats_add(stats, 2.0);
+	r_stats_free(stats);
+	stats = r_stats_new("merged");
+	r_stats_add(stats, 4.0);
+	r_stats_free(stats);
+	r_stats_report_add("merged", 8.0);
+
+	/* live stats are not part of the report */
+	stats = r_stats_new("live");
+	r_stats_add(stats, 1.0);
+
+	report = g_variant_ref_sink(r_stats_report_end());
+	r_stats_free(stats);
+
+	g_assert_cmpuint(g_variant_n_children(report), ==, 1);
+	values = g_variant_lookup_value(report, "merged", G_VARIANT_TYPE_VARDICT);
+	g_assert_nonnull(values);
+	g_assert_true(g_variant_lookup(values, "count", "t", &count));
+	g_assert_cmpuint(count, ==, 4);
+	g_assert_true(g_variant_lookup(values, "sum", "d", &sum));
+	g_assert_cmpfloat(sum, ==, 15.0);
+	g_assert_true(g_variant_lookup(values, "max", "d", &max));
+	g_assert_cmpfloat(max, ==, 8.0);
+	g_assert_true(g_variant_lookup(values, "p99", "d", NULL));
+}
+
+static void latency_task_thread(GTask *task, gpointer source_object, gpointer task_data, GCancellable *cancellable)
+{
+	RaucStats *latency = task_data;
+	g_autoptr(RaucStats) stats = r_stats_new("install");
+
+	for (guint i = 0; i < 1000; i++) {
+		r_stats_add(latency, 0.001);
+		r_stats_add(stats, 1.0);
+	}
+
+	g_task_return_boolean(task, TRUE);
+}
+
+static void latency_task_done(GObject *source_object, GAsyncResult *result, gpointer user_data)
+{
+	guint *pending = user_data;
+
+	g_assert_true(g_task_propagate_boolean(G_TASK(result), NULL));
+	(*pending)--;
+}
+
+static void test_unlisted(void)
+{
+	g_autoptr(RaucStats) latency = r_stats_new_unlisted("dbus latency");
+	g_autoptr(GVariant) live = NULL;
+	g_autoptr(GVariant) report = NULL;
+	g_autoptr(GVariant) values = NULL;
+	RaucStats *freed = NULL;
+	guint pending = 2;
+	guint64 count;
+
+	r_stats_report_begin();
+
+	/* two concurrent calls, each recording its latency while other
+	 * statistics are collected for the report */
+	for (guint i = 0; i < 2; i++) {
+		g_autoptr(GTask) task = g_task_new(NULL, NULL, latency_task_done, &pending);
+
+		g_task_set_task_data(task, latency, NULL);
+		g_task_run_in_thread(task, latency_task_thread);
+	}
+	while (pending)
+		g_main_context_iteration(NULL, TRUE);
+
+	live = g_variant_ref_sink(r_stats_get_live());
+	g_assert_false(g_variant_lookup(live, "dbus latency", "@a{sv}", NULL));
+
+	/* not merged into the report when freed */
+	freed = r_stats_new_unlisted("dbus latency");
+	r_stats_add(freed, 0.001);
+	r_stats_free(freed);
+
+	report = g_variant_ref_sink(r_stats_report_end());
+	g_assert_false(g_variant_lookup(report, "dbus latency", "@a{sv}", NULL));
+	values = g_variant_lookup_value(report, "install", G_VARIANT_TYPE_VARDICT);
+	g_assert_nonnull(values);
+	g_assert_true(g_variant_lookup(values, "count", "t", &count));
+	g_assert_cmpuint(count, ==, 2000);
+	g_clear_pointer(&values, g_variant_unref);
+
+	values = g_variant_ref_sink(r_stats_to_variant(latency));
+	g_assert_true(g_variant_lookup(values, "count", "t", &count));
+	g_assert_cmpuint(count, ==, 2000);
+	g_assert_true(g_variant_lookup(values, "p99", "d", NULL));
+}
+
+static void test_histogram(void)
+{
+	g_autoptr(RaucHistogram) hist = NULL;
+	gdouble value;
+
+	hist = r_histogram_new("test");
+	g_assert_nonnull(hist);
+	g_assert_cmpuint(r_histogram_get_count(hist), ==, 0);
+	g_assert_cmpfloat(r_histogram_get_percentile(hist, 50), ==, 0.0);
+
+	for (guint i = 1; i <= 1000; i++)
+		r_histogram_add(hist, i);
+	g_assert_cmpuint(r_histogram_get_count(hist), ==, 1000);
+
+	/* percentiles are the upper bucket bound, at most 1/16 above */
+	value = r_histogram_get_percentile(hist, 50);
+	g_assert_cmpfloat(value, >=, 500.0);
+	g_assert_cmpfloat(value, <=, 500.0 * 17 / 16);
+	value = r_histogram_get_percentile(hist, 99);
+	g_assert_cmpfloat(value, >=, 990.0);
+	g_assert_cmpfloat(value, <=, 990.0 * 17 / 16);
+	value = r_histogram_get_percentile(hist, 0);
+	g_assert_cmpfloat(value, >=, 1.0);
+	g_assert_cmpfloat(value, <=, 17.0 / 16);
+	value = r_histogram_get_percentile(hist, 100);
+	g_assert_cmpfloat(value, >=, 1000.0);
+	g_assert_cmpfloat(value, <=, 1000.0 * 17 / 16);
+
+	/* exact powers of two are the lower bound of their bucket */
+	g_clear_pointer(&hist, r_histogram_free);
+	hist = r_histogram_new("test");
+	r_histogram_add(hist, 4096.0);
+	g_assert_cmpfloat(r_histogram_get_percentile(hist, 50), ==, 4096.0 * 17 / 16);
+
+	/* out of range values */
+	g_clear_pointer(&hist, r_histogram_free);
+	hist = r_histogram_new("test");
+	r_histogram_add(hist, 0.0);
+	r_histogram_add(hist, -1.0);
+	r_histogram_add(hist, 1e-9);
+	g_assert_cmpfloat(r_histogram_get_percentile(hist, 100), <=, 1e-6);
+	r_histogram_add(hist, 1e20);
+	g_assert_cmpfloat(r_histogram_get_percentile(hist, 100), >=, 1e13);
+	g_assert_cmpuint(r_histogram_get_count(hist), ==, 4);
+}
+
+static gpointer histogram_thread(gpointer data)
+{
+	RaucHistogram *hist = data;
+
+	for (guint i = 0; i < 10000; i++)
+		r_histogram_add(hist, i % 100);
+
+	return NULL;
+}
+
+static void test_histogram_threads(void)
+{
+	g_autoptr(RaucHistogram) hist = r_histogram_new("shared");
+	g_autoptr(RaucHistogram) merged = r_histogram_new("merged");
+	RaucHistogram *local[4];
+	GThread *threads[4];
+
+	for (guint i = 0; i < G_N_ELEMENTS(threads); i++)
+		threads[i] = g_thread_new("histogram", histogram_thread, hist);
+	for (guint i = 0; i < G_N_ELEMENTS(threads); i++)
+		g_thread_join(threads[i]);
+
+	g_assert_cmpuint(r_histogram_get_count(hist), ==, 40000);
+
+	/* per-thread histograms yield the same result when merged */
+	for (guint i = 0; i < G_N_ELEMENTS(threads); i++) {
+		local[i] = r_histogram_new("local");
+		threads[i] = g_thread_new("histogram", histogram_thread, local[i]);
+	}
+	for (guint i = 0; i < G_N_ELEMENTS(threads); i++) {
+		g_thread_join(threads[i]);
+		r_histogram_merge(merged, local[i]);
+		r_histogram_free(local[i]);
+	}
+
+	g_assert_cmpuint(r_histogram_get_count(merged), ==, 40000);
+	for (guint p = 0; p <= 100; p += 10)
+		g_assert_cmpfloat(r_histogram_get_percentile(merged, p), ==, r_histogram_get_percentile(hist, p));
+}
+
+static void test_histogram_serialize(void)
+{
+	g_autoptr(RaucHistogram) hist = r_histogram_new("test");
+	g_autoptr(GVariant) serialized = NULL;
+	g_autoptr(GVariant) parsed = NULL;
+	g_autoptr(GVariantIter) iter = NULL;
+	g_autofree gchar *text = NULL;
+	const gchar *label = NULL;
+	gdouble lower, upper;
+	guint32 count;
+
+	r_histogram_add(hist, 1.0);
+	r_histogram_add(hist, 1.0);
+	r_histogram_add(hist, 3.0);
+
+	serialized = g_variant_ref_sink(r_histogram_serialize(hist));
+	text = g_variant_print(serialized, FALSE);
+	g_assert_cmpstr(text, ==, "('test', [(1.0, 1.0625, 2), (3.0, 3.125, 1)])");
+
+	parsed = g_variant_parse(G_VARIANT_TYPE("(sa(ddu))"), text, NULL, NULL, NULL);
+	g_assert_nonnull(parsed);
+	g_variant_get(parsed, "(&sa(ddu))", &label, &iter);
+	g_assert_cmpstr(label, ==, "test");
+	g_assert_true(g_variant_iter_next(iter, "(ddu)", &lower, &upper, &count));
+	g_assert_cmpfloat(lower, ==, 1.0);
+	g_assert_cmpfloat(upper, ==, 1.0625);
+	g_assert_cmpuint(count, ==, 2);
+	g_assert_true(g_variant_iter_next(iter, "(ddu)", &lower, &upper, &count));
+	g_assert_cmpfloat(lower, ==, 3.0);
+	g_assert_cmpuint(count, ==, 1);
+	g_assert_false(g_variant_iter_next(iter, "(ddu)", &lower, &upper, &count));
+}
+
 int main(int argc, char *argv[])
 {
 	setlocale(LC_ALL, "C");
@@ -69,6 +339,12 @@ int main(int argc, char *argv[])
 
 	g_test_add_func("/stats/basic", test_basic);
 	g_test_add_func("/stats/queue", test_queue);
+	g_test_add_func("/stats/live", test_live);
+	g_test_add_func("/stats/report", test_report);
+	g_test_add_func("/stats/unlisted", test_unlisted);
+	g_test_add_func("/stats/histogram", test_histogram);
+	g_test_add_func("/stats/histogram/threads", test_histogram_threads);
+	g_test_add_func("/stats/histogram/serialize", test_histogram_serialize);
 
 	return g_test_run();
 }
@@ -1,4 +1,5 @@
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <locale.h>
 
 #include "common.h"
@@ -367,6 +368,97 @@ boot-id=e02a2afe-cf45-4d50-a3f3-c223ca0f480a\n\
 	g_assert_true(g_strv_contains((const gchar * const *)groups, "slot.rootfs.0"));
 }
 
+/* Saves slot status in a batch, which is only written at commit points */
+static void status_file_test_save_slot_status_batch(StatusFileFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autofree gchar* pathname = NULL;
+	g_autofree gchar* contents = NULL;
+	g_autofree gchar* value = NULL;
+	RaucSlot *slot = NULL;
+	GError *ierror = NULL;
+	gboolean res;
+	g_autoptr(GKeyFile) keyfile = NULL;
+	GStatBuf st_before = {0}, st_after = {0};
+
+	const gchar *status_file = "\
+[system]\n\
+boot-id=e02a2afe-cf45-4d50-a3f3-c223ca0f480a\n\
+";
+	pathname = write_tmp_file(fixture->tmpdir, "batch.raucs", status_file, NULL);
+	g_assert_nonnull(pathname);
+
+	replace_strdup(&r_context()->config->statusfile_path, pathname);
+
+	slot = g_hash_table_lookup(r_context()->config->slots, "rootfs.0");
+	slot->status = g_new0(RaucSlotStatus, 1);
+
+	r_slot_status_begin_batch();
+
+	/* updates are only kept in memory */
+	replace_strdup(&slot->status->status, "pending");
+	res = r_slot_status_save(slot, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	res = g_file_get_contents(pathname, &contents, NULL, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	g_assert_cmpstr(contents, ==, status_file);
+	g_clear_pointer(&contents, g_free);
+
+	/* a commit point writes the status file */
+	res = r_slot_status_commit(&ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	keyfile = g_key_file_new();
+	res = g_key_file_load_from_file(keyfile, pathname, G_KEY_FILE_NONE, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	value = g_key_file_get_string(keyfile, "slot.rootfs.0", "status", NULL);
+	g_assert_cmpstr(value, ==, "pending");
+	g_clear_pointer(&value, g_free);
+	value = g_key_file_get_string(keyfile, "system", "boot-id", NULL);
+	g_assert_cmpstr(value, ==, "e02a2afe-cf45-4d50-a3f3-c223ca0f480a");
+	g_clear_pointer(&value, g_free);
+
+	/* committing unchanged content does not rewrite the file */
+	g_assert_cmpint(g_stat(pathname, &st_before), ==, 0);
+	res = r_slot_status_save(slot, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	res = r_slot_status_commit(&ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	g_assert_cmpint(g_stat(pathname, &st_after), ==, 0);
+	g_assert_cmpuint(st_before.st_ino, ==, st_after.st_ino);
+
+	/* multiple updates are coalesced until the end of the batch */
+	replace_strdup(&slot->status->status, "update");
+	res = r_slot_status_save(slot, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	replace_strdup(&slot->status->status, "ok");
+	res = r_slot_status_save(slot, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	g_assert_cmpint(g_stat(pathname, &st_after), ==, 0);
+	g_assert_cmpuint(st_before.st_ino, ==, st_after.st_ino);
+
+	res = r_slot_status_end_batch(&ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+
+	g_clear_pointer(&keyfile, g_key_file_free);
+	keyfile = g_key_file_new();
+	res = g_key_file_load_from_file(keyfile, pathname, G_KEY_FILE_NONE, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(res);
+	value = g_key_file_get_string(keyfile, "slot.rootfs.0", "status", NULL);
+	g_assert_cmpstr(value, ==, "ok");
+}
+
 #define DIGEST_INITIAL "9a0218f0dbfed28d5b35e441668952100128d7bdec667f3f0e1f7cbbff6d11e7"
 #define DIGEST_OTHER "20ea715f2807da0cccda2a4874898a55b38bdf0473fc2fdcab0d28fdbc96b770"
 #define DIGEST_UPDATED "839127aa5fcd9e5f988934e2d727fb14feb5cec9435dd2548bf1a778ba44549a"
@@ -536,6 +628,10 @@ int main(int argc, char *argv[])
 			status_file_fixture_set_up_global,
 			status_file_test_save_slot_status_existing_system_status,
 			status_file_fixture_tear_down);
+	g_test_add("/status-file/combined/save-slot-status-batch", StatusFileFixture, NULL,
+			status_file_fixture_set_up_global,
+			status_file_test_save_slot_status_batch,
+			status_file_fixture_tear_down);
 
 	g_test_add("/datadir/installation", StatusFileFixture, NULL,
 			status_file_fixture_set_up_datadir,
@@ -219,6 +219,7 @@ def test_bundle_convert_tree(tmp_path, bundle):
         assert (extracted / "tree-a.tar.extracted/file").is_file()
         with open(extracted / "tree-a.tar.extracted/file", "rb") as f:
             assert f.read() == data_a
+        assert (extracted / "tree-a.tar.extracted.digests").is_file()
 
 
 def test_bundle_convert_tree_keep(tmp_path, bundle):
@@ -644,3 +645,9 @@ def test_composefs_install(rauc_dbus_service_with_system_composefs, tmp_path):
     artifact_path = repo.path / "artifact-1"
     assert not artifact_path.exists()
     assert not Path("/run/rauc/artifacts/composefs/artifact-1").exists()
+
+    # only the objects of artifact-2 are kept
+    assert len(list((repo.path / ".rauc-cfs-store").glob("*/*"))) == 3
+
+    # the object index is written together with the repo
+    assert (repo.path / ".rauc-cfs-index").is_file()
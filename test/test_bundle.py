@@ -66,6 +66,39 @@ def test_bundle_mksquashfs_extra_args(tmp_path):
     assert exitcode == 0
 
 
+def test_bundle_mksquashfs_tuning(tmp_path):
+    shutil.copytree("install-content", tmp_path / "install-content")
+
+    out, err, exitcode = run(
+        f"rauc \
+            --cert openssl-ca/dev/autobuilder-1.cert.pem \
+            --key openssl-ca/dev/private/autobuilder-1.pem \
+            bundle \
+            --mksquashfs-processors=2 \
+            --mksquashfs-block-size=64K \
+            --mksquashfs-comp=gzip:6 \
+            {tmp_path}/install-content {tmp_path}/out.raucb"
+    )
+
+    assert exitcode == 0
+    assert os.path.exists(f"{tmp_path}/out.raucb")
+
+    out, err, exitcode = run(f"rauc -c test.conf info {tmp_path}/out.raucb")
+    assert exitcode == 0
+
+    out, err, exitcode = run(
+        f"rauc \
+            --cert openssl-ca/dev/autobuilder-1.cert.pem \
+            --key openssl-ca/dev/private/autobuilder-1.pem \
+            bundle \
+            --mksquashfs-comp=gzip:fast \
+            {tmp_path}/install-content {tmp_path}/out2.raucb"
+    )
+
+    assert exitcode == 1
+    assert "Invalid mksquashfs compression level" in err
+
+
 def test_bundle_pkcs11_key1(tmp_path, pkcs11):
     "A bundle signed with autobuilder-1 key must verify against keyring"
 
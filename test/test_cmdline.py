@@ -41,6 +41,7 @@ test_cmd_array_missing = [
     "rauc replace-signature",
     "rauc replace-signature input",
     "rauc replace-signature input output",
+    "rauc -c test.conf event-log",
 ]
 
 
@@ -58,6 +59,7 @@ test_cmd_array_excess = [
     "rauc bundle indir outbundle excess",
     "rauc resign inbundle outbundle excess",
     "rauc replace-signature inbundle insig outbundle excess",
+    "rauc -c test.conf event-log logger excess",
 ]
 
 
@@ -84,6 +86,7 @@ test_cmd_array_help = [
     "rauc bundle",
     "rauc resign",
     "rauc replace-signature",
+    "rauc event-log",
 ]
 
 
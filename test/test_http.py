@@ -1,11 +1,12 @@
 import json
+import os
 import uuid
 from pathlib import Path
 
 import pytest
 from dasbus.typing import get_native, get_variant
 
-from conftest import have_json, have_service
+from conftest import have_json, have_service, have_streaming, root
 from helper import run
 
 
@@ -102,7 +103,8 @@ def test_info_headers(create_system_files, system, http_server, api):
         assert info["update"]["compatible"] == "Test Config"
 
     summary = http_server.get_summary()
-    assert summary["requests"] == 3
+    # the signature is contained in the initial suffix range request
+    assert summary["requests"] == 1
 
     first_headers = summary["first_request_headers"]
     assert first_headers.pop("User-Agent").startswith("rauc/")
@@ -114,22 +116,49 @@ def test_info_headers(create_system_files, system, http_server, api):
     assert is_uptime(first_headers.pop("RAUC-Uptime"))
     prune_standard_headers(first_headers)
     assert first_headers == {
-        "Range": "bytes=0-3",
+        "Range": "bytes=-65536",
         "Test-Header": "Test-Value",
         "RAUC-Serial": "1234",
         "RAUC-System-Version": "1.0.0",
         "RAUC-Variant": "test-variant-x",
     }
 
-    second_headers = summary["second_request_headers"]
-    prune_standard_headers(second_headers)
-    assert second_headers == {
-        "Range": "bytes=26498-26505",
-        "Test-Header": "Test-Value",
-    }
+    assert summary["second_request_headers"] == {}
 
     assert summary["range_requests"] == [
-        "0:4",  # magic
-        "26498:26506",  # CMS size
-        "24576:26498",  # CMS data
+        "-65536:",  # bundle size, CMS size and data
     ]
+
+
+@root
+@have_streaming
+def test_stage(create_system_files, system, http_server, tmp_path):
+    """Test if an installation reuses the data downloaded by staging."""
+    if not have_service():
+        pytest.skip("Missing service")
+
+    cache_dir = tmp_path / "cache"
+    cache_dir.mkdir()
+    os.chmod(cache_dir, 0o777)
+
+    system.prepare_minimal_config()
+    system.config["streaming"] = {
+        "cache-directory": str(cache_dir),
+    }
+    system.write_config()
+    http_server.setup(
+        file_path="good-verity-bundle.raucb",
+    )
+
+    with system.running_service("A"):
+        out, err, exitcode = run(f"rauc stage {http_server.url}")
+        assert exitcode == 0
+        assert "succeeded" in out
+        stage_summary = http_server.get_summary()
+
+        out, err, exitcode = run(f"rauc install {http_server.url}")
+        assert exitcode == 0
+        install_summary = http_server.get_summary()
+
+    assert os.path.getsize(tmp_path / "images/rootfs-1") > 0
+    assert install_summary["requests"] < stage_summary["requests"]
@@ -0,0 +1,259 @@
+#include <fcntl.h>
+#include <locale.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include "tree_copy.h"
+#include "utils.h"
+
+static void test_copy_tree(void)
+{
+	g_autofree gchar *tmpdir = g_dir_make_tmp("rauc-XXXXXX", NULL);
+	g_autofree gchar *src = g_build_filename(tmpdir, "src", NULL);
+	g_autofree gchar *dst = g_build_filename(tmpdir, "dst", NULL);
+	g_autofree gchar *path = NULL;
+	g_autofree gchar *contents = NULL;
+	g_autofree gchar *target = NULL;
+	g_autoptr(GError) error = NULL;
+	struct stat st_a = {}, st_b = {};
+	const struct timespec times[2] = {{.tv_sec = 1000000000}, {.tv_sec = 1000000000}};
+	gboolean res;
+
+	g_assert_nonnull(tmpdir);
+
+	/* build source tree */
+	g_assert_cmpint(g_mkdir(src, 0755), ==, 0);
+	path = g_build_filename(src, "sub", NULL);
+	g_assert_cmpint(g_mkdir(path, 0750), ==, 0);
+	g_clear_pointer(&path, g_free);
+
+	path = g_build_filename(src, "sub/file", NULL);
+	g_assert_true(g_file_set_contents(path, "content", -1, NULL));
+	g_assert_cmpint(g_chmod(path, 0640), ==, 0);
+	g_assert_cmpint(utimensat(AT_FDCWD, path, times, 0), ==, 0);
+	g_clear_pointer(&path, g_free);
+
+	path = g_build_filename(src, "empty", NULL);
+	g_assert_true(g_file_set_contents(path, "", -1, NULL));
+	g_clear_pointer(&path, g_free);
+
+	{
+		g_auto(filedesc) src_fd = g_open(src, O_RDONLY | O_DIRECTORY, 0);
+
+		g_assert_cmpint(src_fd, >=, 0);
+		g_assert_cmpint(linkat(src_fd, "sub/file", src_fd, "hardlink", 0), ==, 0);
+		g_assert_cmpint(symlinkat("sub/file", src_fd, "symlink"), ==, 0);
+	}
+
+	path = g_build_filename(src, "sub", NULL);
+	g_assert_cmpint(utimensat(AT_FDCWD, path, times, 0), ==, 0);
+	g_clear_pointer(&path, g_free);
+
+	/* copy */
+	res = r_tree_copy(src, dst, NULL, NULL, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+
+	/* regular file with metadata */
+	path = g_build_filename(dst, "sub/file", NULL);
+	g_assert_true(g_file_get_contents(path, &contents, NULL, NULL));
+	g_assert_cmpstr(contents, ==, "content");
+	g_assert_cmpint(g_lstat(path, &st_a), ==, 0);
+	g_assert_cmpint(st_a.st_mode & 07777, ==, 0640);
+	g_assert_cmpint(st_a.st_mtim.tv_sec, ==, 1000000000);
+	g_clear_pointer(&path, g_free);
+	g_clear_pointer(&contents, g_free);
+
+	path = g_build_filename(dst, "empty", NULL);
+	g_assert_true(g_file_get_contents(path, &contents, NULL, NULL));
+	g_assert_cmpstr(contents, ==, "");
+	g_clear_pointer(&path, g_free);
+
+	/* hardlink refers to the same inode */
+	path = g_build_filename(dst, "hardlink", NULL);
+	g_assert_cmpint(g_lstat(path, &st_b), ==, 0);
+	g_assert_cmpuint(st_a.st_ino, ==, st_b.st_ino);
+	g_assert_cmpuint(st_b.st_nlink, ==, 2);
+	g_clear_pointer(&path, g_free);
+
+	/* symlink is kept as a symlink */
+	path = g_build_filename(dst, "symlink", NULL);
+	target = g_file_read_link(path, NULL);
+	g_assert_cmpstr(target, ==, "sub/file");
+	g_clear_pointer(&path, g_free);
+
+	/* directory metadata is applied after its contents */
+	path = g_build_filename(dst, "sub", NULL);
+	g_assert_cmpint(g_lstat(path, &st_a), ==, 0);
+	g_assert_cmpint(st_a.st_mode & 07777, ==, 0750);
+	g_assert_cmpint(st_a.st_mtim.tv_sec, ==, 1000000000);
+	g_clear_pointer(&path, g_free);
+
+	/* the destination must not exist */
+	res = r_tree_copy(src, dst, NULL, NULL, &error);
+	g_assert_error(error, G_FILE_ERROR, G_FILE_ERROR_EXIST);
+	g_assert_false(res);
+
+	g_assert_true(rm_tree(tmpdir, NULL));
+}
+
+/*
+ * Creates a version of the tree. Returns FALSE if the extended attribute of
+ * 'sub/xattr' could not be set, as the filesystem doesn't support it.
+ */
+static gboolean create_version(const gchar *root, const gchar *changed_content, mode_t mode, const gchar *xattr)
+{
+	const struct timespec times[2] = {{.tv_sec = 1000000000}, {.tv_sec = 1000000000}};
+	struct {
+		const gchar *name;
+		const gchar *content;
+		mode_t mode;
+	} files[] = {
+		{"sub/same", "content", 0644},
+		{"sub/mode", "content", mode},
+		{"sub/xattr", "content", 0644},
+		{"changed", changed_content, 0644},
+	};
+	g_autofree gchar *path = g_build_filename(root, "sub", NULL);
+
+	g_assert_cmpint(g_mkdir_with_parents(path, 0755), ==, 0);
+	g_clear_pointer(&path, g_free);
+
+	for (guint i = 0; i < G_N_ELEMENTS(files); i++) {
+		path = g_build_filename(root, files[i].name, NULL);
+		g_assert_true(g_file_set_contents(path, files[i].content, -1, NULL));
+		g_assert_cmpint(g_chmod(path, files[i].mode), ==, 0);
+		g_assert_cmpint(utimensat(AT_FDCWD, path, times, 0), ==, 0);
+		g_clear_pointer(&path, g_free);
+	}
+
+	/* setting the attribute must not change the modification time */
+	path = g_build_filename(root, "sub/xattr", NULL);
+	if (setxattr(path, "user.rauc-test", xattr, strlen(xattr), 0) == -1)
+		return FALSE;
+	g_assert_cmpint(utimensat(AT_FDCWD, path, times, 0), ==, 0);
+
+	return TRUE;
+}
+
+static void test_copy_tree_reuse(void)
+{
+	g_autofree gchar *tmpdir = g_dir_make_tmp("rauc-XXXXXX", NULL);
+	g_autofree gchar *ref = g_build_filename(tmpdir, "ref", NULL);
+	g_autofree gchar *ref_digests = g_build_filename(tmpdir, "ref.digests", NULL);
+	g_autofree gchar *src = g_build_filename(tmpdir, "src", NULL);
+	g_autofree gchar *src_digests = g_build_filename(tmpdir, "src.digests", NULL);
+	g_autofree gchar *dst = g_build_filename(tmpdir, "dst", NULL);
+	g_autofree gchar *path = NULL;
+	g_autofree gchar *contents = NULL;
+	g_autoptr(GHashTable) digests = NULL;
+	g_autoptr(GHashTable) previous_digests = NULL;
+	g_autoptr(GHashTable) unchanged = g_hash_table_new(g_str_hash, g_str_equal);
+	g_autoptr(GError) error = NULL;
+	struct stat st_ref = {}, st_dst = {};
+	GHashTableIter iter;
+	const gchar *key, *value;
+	gchar xattr[16] = {0};
+	gboolean have_xattrs;
+	gboolean res;
+
+	g_assert_nonnull(tmpdir);
+
+	/* build previous and new version of the tree */
+	have_xattrs = create_version(ref, "old", 0644, "old");
+	have_xattrs = create_version(src, "new", 0600, "new") && have_xattrs;
+
+	/* compare the digests */
+	res = r_tree_digests_create(ref, ref_digests, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+	res = r_tree_digests_create(src, src_digests, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+
+	previous_digests = r_tree_digests_load(ref_digests, &error);
+	g_assert_no_error(error);
+	g_assert_nonnull(previous_digests);
+	digests = r_tree_digests_load(src_digests, &error);
+	g_assert_no_error(error);
+	g_assert_nonnull(digests);
+	g_assert_cmpuint(g_hash_table_size(digests), ==, 4);
+
+	g_hash_table_iter_init(&iter, digests);
+	while (g_hash_table_iter_next(&iter, (gpointer*)&key, (gpointer*)&value)) {
+		if (g_strcmp0(value, g_hash_table_lookup(previous_digests, key)) == 0)
+			g_hash_table_add(unchanged, (gpointer)key);
+	}
+	g_assert_cmpuint(g_hash_table_size(unchanged), ==, 3);
+	g_assert_true(g_hash_table_contains(unchanged, "sub/same"));
+	g_assert_true(g_hash_table_contains(unchanged, "sub/mode"));
+	g_assert_true(g_hash_table_contains(unchanged, "sub/xattr"));
+
+	/* copy */
+	res = r_tree_copy(src, dst, ref, unchanged, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+
+	/* unchanged file with the same metadata is hardlinked */
+	path = g_build_filename(ref, "sub/same", NULL);
+	g_assert_cmpint(g_lstat(path, &st_ref), ==, 0);
+	g_clear_pointer(&path, g_free);
+	path = g_build_filename(dst, "sub/same", NULL);
+	g_assert_cmpint(g_lstat(path, &st_dst), ==, 0);
+	g_assert_cmpuint(st_ref.st_ino, ==, st_dst.st_ino);
+	g_clear_pointer(&path, g_free);
+
+	/* unchanged file with different metadata is a separate file */
+	path = g_build_filename(ref, "sub/mode", NULL);
+	g_assert_cmpint(g_lstat(path, &st_ref), ==, 0);
+	g_assert_cmpint(st_ref.st_mode & 07777, ==, 0644);
+	g_clear_pointer(&path, g_free);
+	path = g_build_filename(dst, "sub/mode", NULL);
+	g_assert_cmpint(g_lstat(path, &st_dst), ==, 0);
+	g_assert_cmpuint(st_ref.st_ino, !=, st_dst.st_ino);
+	g_assert_cmpint(st_dst.st_mode & 07777, ==, 0600);
+	g_assert_true(g_file_get_contents(path, &contents, NULL, NULL));
+	g_assert_cmpstr(contents, ==, "content");
+	g_clear_pointer(&path, g_free);
+	g_clear_pointer(&contents, g_free);
+
+	/* unchanged file with different extended attributes is a separate file */
+	if (have_xattrs) {
+		path = g_build_filename(ref, "sub/xattr", NULL);
+		g_assert_cmpint(g_lstat(path, &st_ref), ==, 0);
+		g_clear_pointer(&path, g_free);
+		path = g_build_filename(dst, "sub/xattr", NULL);
+		g_assert_cmpint(g_lstat(path, &st_dst), ==, 0);
+		g_assert_cmpuint(st_ref.st_ino, !=, st_dst.st_ino);
+		g_assert_cmpint(getxattr(path, "user.rauc-test", xattr, sizeof(xattr) - 1), ==, 3);
+		g_assert_cmpstr(xattr, ==, "new");
+		g_clear_pointer(&path, g_free);
+	} else {
+		g_test_message("Extended attributes not supported, skipping their check");
+	}
+
+	/* changed file is copied from the source */
+	path = g_build_filename(dst, "changed", NULL);
+	g_assert_true(g_file_get_contents(path, &contents, NULL, NULL));
+	g_assert_cmpstr(contents, ==, "new");
+	g_clear_pointer(&path, g_free);
+
+	g_assert_true(rm_tree(tmpdir, NULL));
+}
+
+int main(int argc, char *argv[])
+{
+	setlocale(LC_ALL, "C");
+
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/tree_copy/copy_tree", test_copy_tree);
+
+	g_test_add_func("/tree_copy/copy_tree_reuse", test_copy_tree_reuse);
+
+	return g_test_run();
+}
@@ -0,0 +1,260 @@
+#include <fcntl.h>
+#include <locale.h>
+#include <string.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "uboot_env.h"
+#include "utils.h"
+
+#include "common.h"
+
+#define ENV_SIZE 0x1000
+
+typedef struct {
+	gchar *tmpdir;
+	gchar *envpath;
+} UbootEnvFixture;
+
+static void uboot_env_fixture_set_up(UbootEnvFixture *fixture, gconstpointer user_data)
+{
+	fixture->tmpdir = g_dir_make_tmp("rauc-uboot-env-XXXXXX", NULL);
+	g_assert_nonnull(fixture->tmpdir);
+	fixture->envpath = g_build_filename(fixture->tmpdir, "env", NULL);
+}
+
+static void uboot_env_fixture_tear_down(UbootEnvFixture *fixture, gconstpointer user_data)
+{
+	g_assert_true(rm_tree(fixture->tmpdir, NULL));
+	g_free(fixture->envpath);
+	g_free(fixture->tmpdir);
+}
+
+/* Writes an environment copy with the given NUL-separated variables. */
+static void write_env_copy(const gchar *path, goffset offset, gboolean redundant, guint8 flags, const gchar *vars, gsize vars_len)
+{
+	g_autofree guint8 *data = g_malloc0(ENV_SIZE);
+	gsize header = redundant ? 5 : 4;
+	g_auto(filedesc) fd = -1;
+	guint32 crc;
+
+	memcpy(data + header, vars, vars_len);
+	if (redundant)
+		data[4] = flags;
+	crc = GUINT32_TO_LE(r_uboot_env_crc32(data + header, ENV_SIZE - header));
+	memcpy(data, &crc, sizeof(crc));
+
+	fd = g_open(path, O_WRONLY | O_CREAT, 0644);
+	g_assert_cmpint(fd, >=, 0);
+	g_assert_true(r_pwrite_exact(fd, data, ENV_SIZE, offset, NULL));
+}
+
+static gchar *write_env_config(const UbootEnvFixture *fixture, gboolean redundant)
+{
+	g_autofree gchar *config = NULL;
+
+	if (redundant)
+		config = g_strdup_printf("# comment\n%s 0x0 0x%x\n%s\t0x%x 0x%x 0x1000\n",
+				fixture->envpath, ENV_SIZE, fixture->envpath, ENV_SIZE, ENV_SIZE);
+	else
+		config = g_strdup_printf("%s 0 %d\n", fixture->envpath, ENV_SIZE);
+
+	return write_tmp_file(fixture->tmpdir, "fw_env.config", config, NULL);
+}
+
+static void test_crc32(void)
+{
+	/* standard check value for CRC-32 */
+	g_assert_cmphex(r_uboot_env_crc32((const guint8 *)"123456789", 9), ==, 0xcbf43926);
+}
+
+static void test_single(UbootEnvFixture *fixture, gconstpointer user_data)
+{
+	const gchar vars[] = "BOOT_ORDER=A B\0BOOT_A_LEFT=3\0";
+	g_autofree gchar *config = write_env_config(fixture, FALSE);
+	g_autoptr(RUbootEnv) env = NULL;
+	g_autoptr(GError) error = NULL;
+	gboolean res;
+
+	write_env_copy(fixture->envpath, 0, FALSE, 0, vars, sizeof(vars));
+
+	env = r_uboot_env_open(config, &error);
+	g_assert_no_error(error);
+	g_assert_nonnull(env);
+
+	g_assert_cmpstr(r_uboot_env_get(env, "BOOT_ORDER", &error), ==, "A B");
+	g_assert_no_error(error);
+	g_assert_cmpstr(r_uboot_env_get(env, "BOOT_A_LEFT", &error), ==, "3");
+	g_assert_no_error(error);
+	g_assert_null(r_uboot_env_get(env, "BOOT", &error));
+	g_assert_error(error, R_UBOOT_ENV_ERROR, R_UBOOT_ENV_ERROR_NOT_FOUND);
+	g_clear_error(&error);
+
+	r_uboot_env_set(env, "BOOT_ORDER", "B A");
+	r_uboot_env_set(env, "BOOT_B_LEFT", "2");
+	res = r_uboot_env_commit(env, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+	g_clear_pointer(&env, r_uboot_env_free);
+
+	env = r_uboot_env_open(config, &error);
+	g_assert_no_error(error);
+	g_assert_nonnull(env);
+	g_assert_cmpstr(r_uboot_env_get(env, "BOOT_ORDER", &error), ==, "B A");
+	g_assert_cmpstr(r_uboot_env_get(env, "BOOT_A_LEFT", &error), ==, "3");
+	g_assert_cmpstr(r_uboot_env_get(env, "BOOT_B_LEFT", &error), ==, "2");
+	g_assert_no_error(error);
+}
+
+static void test_redundant(UbootEnvFixture *fixture, gconstpointer user_data)
+{
+	const gchar vars_old[] = "BOOT_ORDER=A B\0";
+	const gchar vars_new[] = "BOOT_ORDER=B A\0";
+	g_autofree gchar *config = write_env_config(fixture, TRUE);
+	g_autoptr(RUbootEnv) env = NULL;
+	g_autoptr(GError) error = NULL;
+	g_autofree gchar *contents = NULL;
+	gsize length;
+	gboolean res;
+
+	/* the second copy is newer */
+	write_env_copy(fixture->envpath, 0, TRUE, 4, vars_old, sizeof(vars_old));
+	write_env_copy(fixture->envpath, ENV_SIZE, TRUE, 5, vars_new, sizeof(vars_new));
+
+	env = r_uboot_env_open(config, &error);
+	g_assert_no_error(error);
+	g_assert_nonnull(env);
+	g_assert_cmpstr(r_uboot_env_get(env, "BOOT_ORDER", &error), ==, "B A");
+
+	/* the first copy is overwritten with the next flags value */
+	r_uboot_env_set(env, "BOOT_ORDER", "A");
+	res = r_uboot_env_commit(env, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+	g_clear_pointer(&env, r_uboot_env_free);
+
+	g_assert_true(g_file_get_contents(fixture->envpath, &contents, &length, NULL));
+	g_assert_cmpuint(length, ==, 2 * ENV_SIZE);
+	g_assert_cmpuint((guint8)contents[4], ==, 6);
+	g_assert_cmpstr(contents + 5, ==, "BOOT_ORDER=A");
+	g_assert_cmpstr(contents + ENV_SIZE + 5, ==, "BOOT_ORDER=B A");
+
+	env = r_uboot_env_open(config, &error);
+	g_assert_no_error(error);
+	g_assert_cmpstr(r_uboot_env_get(env, "BOOT_ORDER", &error), ==, "A");
+	g_clear_pointer(&env, r_uboot_env_free);
+
+	/* the flags counter wraps around */
+	write_env_copy(fixture->envpath, 0, TRUE, 255, vars_old, sizeof(vars_old));
+	write_env_copy(fixture->envpath, ENV_SIZE, TRUE, 0, vars_new, sizeof(vars_new));
+
+	env = r_uboot_env_open(config, &error);
+	g_assert_no_error(error);
+	g_assert_cmpstr(r_uboot_env_get(env, "BOOT_ORDER", &error), ==, "B A");
+	g_clear_pointer(&env, r_uboot_env_free);
+
+	/* a copy with a bad CRC is ignored */
+	write_env_copy(fixture->envpath, 0, TRUE, 1, vars_old, sizeof(vars_old));
+	write_env_copy(fixture->envpath, ENV_SIZE, TRUE, 2, vars_new, sizeof(vars_new));
+	{
+		g_auto(filedesc) fd = g_open(fixture->envpath, O_WRONLY, 0);
+		g_assert_cmpint(fd, >=, 0);
+		g_assert_true(r_pwrite_exact(fd, (const guint8 *)"X", 1, ENV_SIZE + 5, NULL));
+	}
+
+	env = r_uboot_env_open(config, &error);
+	g_assert_no_error(error);
+	g_assert_cmpstr(r_uboot_env_get(env, "BOOT_ORDER", &error), ==, "A B");
+	g_clear_pointer(&env, r_uboot_env_free);
+
+	/* no valid copy */
+	{
+		g_auto(filedesc) fd = g_open(fixture->envpath, O_WRONLY, 0);
+		g_assert_cmpint(fd, >=, 0);
+		g_assert_true(r_pwrite_exact(fd, (const guint8 *)"X", 1, 5, NULL));
+	}
+
+	env = r_uboot_env_open(config, &error);
+	g_assert_error(error, R_UBOOT_ENV_ERROR, R_UBOOT_ENV_ERROR_INVALID);
+	g_assert_null(env);
+}
+
+static void test_too_large(UbootEnvFixture *fixture, gconstpointer user_data)
+{
+	const gchar vars[] = "BOOT_ORDER=A B\0";
+	g_autofree gchar *config = write_env_config(fixture, FALSE);
+	g_autofree gchar *value = g_strnfill(ENV_SIZE, 'x');
+	g_autoptr(RUbootEnv) env = NULL;
+	g_autoptr(GError) error = NULL;
+	gboolean res;
+
+	write_env_copy(fixture->envpath, 0, FALSE, 0, vars, sizeof(vars));
+
+	env = r_uboot_env_open(config, &error);
+	g_assert_no_error(error);
+
+	r_uboot_env_set(env, "LARGE", value);
+	res = r_uboot_env_commit(env, &error);
+	g_assert_error(error, R_UBOOT_ENV_ERROR, R_UBOOT_ENV_ERROR_TOO_LARGE);
+	g_assert_false(res);
+}
+
+static void test_config_errors(UbootEnvFixture *fixture, gconstpointer user_data)
+{
+	g_autofree gchar *config = NULL;
+	g_autoptr(RUbootEnv) env = NULL;
+	g_autoptr(GError) error = NULL;
+
+	config = write_tmp_file(fixture->tmpdir, "fw_env.config", "/dev/mtd1 0x0 0x4000 0x10000\n", NULL);
+	env = r_uboot_env_open(config, &error);
+	g_assert_error(error, R_UBOOT_ENV_ERROR, R_UBOOT_ENV_ERROR_NOT_SUPPORTED);
+	g_assert_null(env);
+	g_clear_error(&error);
+	g_clear_pointer(&config, g_free);
+
+	config = write_tmp_file(fixture->tmpdir, "fw_env.config", "/dev/mmcblk0 0x0\n", NULL);
+	env = r_uboot_env_open(config, &error);
+	g_assert_error(error, R_UBOOT_ENV_ERROR, R_UBOOT_ENV_ERROR_CONFIG);
+	g_assert_null(env);
+	g_clear_error(&error);
+	g_clear_pointer(&config, g_free);
+
+	config = write_tmp_file(fixture->tmpdir, "fw_env.config", "/dev/mmcblk0 -0x4000 0x4000\n", NULL);
+	env = r_uboot_env_open(config, &error);
+	g_assert_error(error, R_UBOOT_ENV_ERROR, R_UBOOT_ENV_ERROR_CONFIG);
+	g_assert_null(env);
+	g_clear_error(&error);
+	g_clear_pointer(&config, g_free);
+
+	config = write_tmp_file(fixture->tmpdir, "fw_env.config", "# empty\n", NULL);
+	env = r_uboot_env_open(config, &error);
+	g_assert_error(error, R_UBOOT_ENV_ERROR, R_UBOOT_ENV_ERROR_CONFIG);
+	g_assert_null(env);
+}
+
+int main(int argc, char *argv[])
+{
+	setlocale(LC_ALL, "C");
+
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/uboot_env/crc32", test_crc32);
+
+	g_test_add("/uboot_env/single", UbootEnvFixture, NULL,
+			uboot_env_fixture_set_up, test_single,
+			uboot_env_fixture_tear_down);
+
+	g_test_add("/uboot_env/redundant", UbootEnvFixture, NULL,
+			uboot_env_fixture_set_up, test_redundant,
+			uboot_env_fixture_tear_down);
+
+	g_test_add("/uboot_env/too_large", UbootEnvFixture, NULL,
+			uboot_env_fixture_set_up, test_too_large,
+			uboot_env_fixture_tear_down);
+
+	g_test_add("/uboot_env/config_errors", UbootEnvFixture, NULL,
+			uboot_env_fixture_set_up, test_config_errors,
+			uboot_env_fixture_tear_down);
+
+	return g_test_run();
+}
@@ -1,12 +1,19 @@
 #include <locale.h>
+#include <string.h>
 #include <glib.h>
 #include <gio/gio.h>
 #include <glib/gstdio.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
 
 #include "update_handler.h"
+#include "update_utils.h"
 #include "manifest.h"
 #include "common.h"
 #include "context.h"
+#include "file_index.h"
+#include "hash_index.h"
 #include "mount.h"
 #include "utils.h"
 #include "stats.h"
@@ -28,6 +35,8 @@ typedef enum {
 	TEST_UPDATE_HANDLER_HOOK_FAIL                                     = BIT(8),
 	TEST_UPDATE_HANDLER_INCR_BLOCK_HASH_IDX                           = BIT(9),
 	TEST_UPDATE_HANDLER_IMAGE_TOO_LARGE                               = BIT(10),
+	TEST_UPDATE_HANDLER_NO_MKFS_ARCHIVE                               = BIT(11),
+	TEST_UPDATE_HANDLER_FILE_INDEX                                    = BIT(12),
 } TestUpdateHandlerParams;
 
 typedef struct {
@@ -42,6 +51,153 @@ typedef struct {
 	gint err_code;
 } UpdateHandlerTestPair;
 
+/* Test copying with and without access to the file descriptors.
+ */
+static void test_copy_stream(UpdateHandlerFixture *fixture, gconstpointer user_data)
+{
+	g_autofree gchar *srcpath = g_build_filename(fixture->tmpdir, "copy-src", NULL);
+	g_autofree gchar *dstpath = g_build_filename(fixture->tmpdir, "copy-dst", NULL);
+	g_autoptr(GUnixInputStream) instream = NULL;
+	g_autoptr(GUnixOutputStream) outstream = NULL;
+	g_autoptr(GOutputStream) memstream = NULL;
+	g_autofree gchar *data = NULL;
+	g_autofree gchar *copied = NULL;
+	const gsize size = 9 * 1024 * 1024 + 123;
+	gsize len = 0;
+	GError *error = NULL;
+
+	data = g_malloc(size);
+	for (gsize i = 0; i < size; i++)
+		data[i] = g_random_int_range(0, 256);
+	/* a zero block, which may be zeroed in the target instead of written */
+	memset(data + 4 * 1024 * 1024, 0, 4 * 1024 * 1024);
+	g_assert_true(g_file_set_contents(srcpath, data, size, &error));
+	g_assert_no_error(error);
+
+	/* file to file */
+	instream = r_open_unix_input_stream(srcpath, NULL, &error);
+	g_assert_no_error(error);
+	outstream = r_unix_output_stream_create_file(dstpath, NULL, &error);
+	g_assert_no_error(error);
+	g_assert_true(r_copy_stream_with_progress(G_INPUT_STREAM(instream), G_OUTPUT_STREAM(outstream), size, &error));
+	g_assert_no_error(error);
+	g_assert_true(g_output_stream_close(G_OUTPUT_STREAM(outstream), NULL, &error));
+	g_assert_no_error(error);
+
+	g_assert_true(g_file_get_contents(dstpath, &copied, &len, &error));
+	g_assert_no_error(error);
+	g_assert_cmpmem(copied, len, data, size);
+	g_clear_pointer(&copied, g_free);
+	g_clear_object(&instream);
+
+	/* file to generic stream */
+	instream = r_open_unix_input_stream(srcpath, NULL, &error);
+	g_assert_no_error(error);
+	memstream = g_memory_output_stream_new_resizable();
+	g_assert_true(r_copy_stream_with_progress(G_INPUT_STREAM(instream), memstream, size, &error));
+	g_assert_no_error(error);
+	g_assert_true(g_output_stream_close(memstream, NULL, &error));
+	g_assert_no_error(error);
+	g_assert_cmpmem(g_memory_output_stream_get_data(G_MEMORY_OUTPUT_STREAM(memstream)),
+			g_memory_output_stream_get_data_size(G_MEMORY_OUTPUT_STREAM(memstream)),
+			data, size);
+	g_clear_object(&instream);
+	g_clear_object(&outstream);
+	g_assert(g_remove(dstpath) == 0);
+
+	/* a zero block at the end must still result in the full size */
+	memset(data + 4 * 1024 * 1024, 0, size - 4 * 1024 * 1024);
+	g_assert_true(g_file_set_contents(srcpath, data, 8 * 1024 * 1024, &error));
+	g_assert_no_error(error);
+	instream = r_open_unix_input_stream(srcpath, NULL, &error);
+	g_assert_no_error(error);
+	outstream = r_unix_output_stream_create_file(dstpath, NULL, &error);
+	g_assert_no_error(error);
+	g_assert_true(r_copy_stream_with_progress(G_INPUT_STREAM(instream), G_OUTPUT_STREAM(outstream), 8 * 1024 * 1024, &error));
+	g_assert_no_error(error);
+	g_assert_true(g_output_stream_close(G_OUTPUT_STREAM(outstream), NULL, &error));
+	g_assert_no_error(error);
+
+	g_assert_true(g_file_get_contents(dstpath, &copied, &len, &error));
+	g_assert_no_error(error);
+	g_assert_cmpmem(copied, len, data, 8 * 1024 * 1024);
+
+	g_assert(g_remove(srcpath) == 0);
+	g_assert(g_remove(dstpath) == 0);
+}
+
+/* Test writing one image to multiple slots, where one of them can't be
+ * opened. The other slots must be written nevertheless.
+ */
+static void test_write_image_to_devs(UpdateHandlerFixture *fixture, gconstpointer user_data)
+{
+	g_autofree gchar *imagepath = g_build_filename(fixture->tmpdir, "fan-out.img", NULL);
+	g_autoptr(RaucImage) image = NULL;
+	g_autoptr(GPtrArray) slots = g_ptr_array_new_with_free_func((GDestroyNotify)r_slot_free);
+	g_autofree gchar *data = NULL;
+	GError *slot_errors[3] = {NULL};
+	goffset slot_written[3] = {-1, -1, -1};
+	const gsize size = 9 * 1024 * 1024 + 4096;
+	GError *error = NULL;
+
+	data = g_malloc(size);
+	for (gsize i = 0; i < size; i++)
+		data[i] = g_random_int_range(0, 256);
+	/* a zero block, which may be zeroed in the targets instead of written */
+	memset(data + 4 * 1024 * 1024, 0, 4 * 1024 * 1024);
+	g_assert_true(g_file_set_contents(imagepath, data, size, &error));
+	g_assert_no_error(error);
+
+	image = r_new_image();
+	image->slotclass = g_strdup("rootfs");
+	image->filename = g_strdup(imagepath);
+	image->checksum.size = size;
+
+	for (guint i = 0; i < G_N_ELEMENTS(slot_errors); i++) {
+		RaucSlot *slot = g_new0(RaucSlot, 1);
+		g_autofree gchar *name = g_strdup_printf("rootfs.%u", i);
+
+		slot->name = g_intern_string(name);
+		slot->sclass = g_intern_string("rootfs");
+		slot->type = g_strdup("raw");
+		if (i == 1) {
+			slot->device = g_build_filename(fixture->tmpdir, "missing", "rootfs-1", NULL);
+		} else {
+			slot->device = g_strdup_printf("%s/rootfs-%u", fixture->tmpdir, i);
+			g_assert_true(g_file_set_contents(slot->device, "", 0, &error));
+			g_assert_no_error(error);
+		}
+		g_ptr_array_add(slots, slot);
+	}
+
+	g_assert_true(r_write_image_to_devs(image, slots, slot_errors, slot_written, &error));
+	g_assert_no_error(error);
+
+	g_assert_no_error(slot_errors[0]);
+	g_assert_error(slot_errors[1], R_UPDATE_ERROR, R_UPDATE_ERROR_FAILED);
+	g_assert_no_error(slot_errors[2]);
+	g_clear_error(&slot_errors[1]);
+	/* the zero range is only written as data if it can't be zeroed */
+	for (guint i = 0; i < G_N_ELEMENTS(slot_written); i += 2) {
+		g_assert_cmpint(slot_written[i], >=, size - 4 * 1024 * 1024);
+		g_assert_cmpint(slot_written[i], <=, size);
+	}
+	g_assert_cmpint(slot_written[1], ==, -1);
+
+	for (guint i = 0; i < G_N_ELEMENTS(slot_errors); i += 2) {
+		RaucSlot *slot = g_ptr_array_index(slots, i);
+		g_autofree gchar *written = NULL;
+		gsize len = 0;
+
+		g_assert_true(g_file_get_contents(slot->device, &written, &len, &error));
+		g_assert_no_error(error);
+		g_assert_cmpmem(written, len, data, size);
+		g_assert(g_remove(slot->device) == 0);
+	}
+
+	g_assert(g_remove(imagepath) == 0);
+}
+
 /* Test update_handler/get_handler/<combination>:
  *
  * Allows to test several source image / slot type combinations to either have
@@ -147,7 +303,7 @@ static void update_handler_fixture_tear_down(UpdateHandlerFixture *fixture,
 	if (!(test_pair->params & TEST_UPDATE_HANDLER_NO_TARGET_DEV)) {
 		g_assert(test_remove(fixture->tmpdir, "rootfs-0") == 0);
 	}
-	if (test_pair->params & TEST_UPDATE_HANDLER_INCR_BLOCK_HASH_IDX) {
+	if (test_pair->params & (TEST_UPDATE_HANDLER_INCR_BLOCK_HASH_IDX | TEST_UPDATE_HANDLER_FILE_INDEX)) {
 		test_rm_tree(fixture->tmpdir, "rootfs-0-datadir");
 	}
 	g_assert(test_rmdir(fixture->tmpdir, "") == 0);
@@ -508,6 +664,8 @@ no_image:
 		RaucStats *stats;
 		guint64 count_zero = 0;
 		guint64 sum_zero = 0;
+		guint64 sum_zeroed_bytes = 0;
+		guint64 sum_in_place = 0;
 		guint64 count_target_written = 0;
 		guint64 sum_target_written = 0;
 		guint64 count_target = 0;
@@ -515,6 +673,12 @@ no_image:
 		guint64 count_source = 0;
 		guint64 sum_source = 0;
 
+		stats = r_test_stats_next();
+		g_assert_nonnull(stats);
+		g_assert_cmpstr(stats->label, ==, "zeroed bytes");
+		sum_zeroed_bytes = stats->sum;
+		r_stats_free(stats);
+
 		stats = r_test_stats_next();
 		g_assert_nonnull(stats);
 		g_assert_cmpstr(stats->label, ==, "zero chunk");
@@ -522,6 +686,12 @@ no_image:
 		sum_zero = stats->sum;
 		r_stats_free(stats);
 
+		stats = r_test_stats_next();
+		g_assert_nonnull(stats);
+		g_assert_cmpstr(stats->label, ==, "in-place chunk");
+		sum_in_place = stats->sum;
+		r_stats_free(stats);
+
 		stats = r_test_stats_next();
 		g_assert_nonnull(stats);
 		g_assert_cmpstr(stats->label, ==, "target_slot_written (reusing source_image)");;
@@ -543,16 +713,21 @@ no_image:
 		sum_source = stats->sum;
 		r_stats_free(stats);
 
-		/* all non-zero chunks must result in a lookup in target_slot_written */
-		g_assert_cmpint(count_zero + count_target_written, ==, IMAGE_SIZE/4096);
+		/* all chunks not in place and non-zero must result in a lookup in target_slot_written */
+		g_assert_cmpint(sum_in_place + count_zero + count_target_written, ==, IMAGE_SIZE/4096);
+
+		/* zero ranges can only be used for zero chunks */
+		g_assert_cmpint(sum_zeroed_bytes % 4096, ==, 0);
+		g_assert_cmpint(sum_zeroed_bytes / 4096, <=, sum_zero);
 
 		/* sum of all found chunks must equal total number of chunks */
-		g_assert_cmpint(sum_zero + sum_target_written + sum_target + sum_source, ==, IMAGE_SIZE/4096);
+		g_assert_cmpint(sum_in_place + sum_zero + sum_target_written + sum_target + sum_source, ==, IMAGE_SIZE/4096);
 
 		if (g_strcmp0(test_pair->imagetype, "img") == 0) {
 			/* for random data it is *very* unlikely:
 			 * - to find zero chunks
 			 * - to find reusable chunks */
+			g_assert_cmpint(sum_in_place, ==, 0);
 			g_assert_cmpint(sum_zero, ==, 0);
 			g_assert_cmpint(sum_target_written, ==, 0);
 			g_assert_cmpint(sum_target, ==, 0);
@@ -562,7 +737,8 @@ no_image:
 			 * used mkfs configuration. We use minimal values here
 			 * that have proven to be valid on all test systems.
 			 */
-			g_assert_cmpint(sum_zero, >=, IMAGE_SIZE/4096 - 37);
+			/* the slot is initially zeroed, so most zero chunks are already in place */
+			g_assert_cmpint(sum_in_place + sum_zero, >=, IMAGE_SIZE/4096 - 37);
 			g_assert_cmpint(sum_target_written, >=, 0);
 			g_assert_cmpint(sum_target, ==, 0);
 			g_assert_cmpint(sum_source, <=, 37);
@@ -607,8 +783,453 @@ out:
 	r_slot_free(targetslot);
 }
 
+/* An interrupted adaptive write must continue after the recorded checkpoint,
+ * even if the stored index of the slot does not know about the new data. */
+static void test_update_handler_resume(UpdateHandlerFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autofree gchar *slotpath = NULL;
+	g_autofree gchar *imagepath = NULL;
+	g_autofree gchar *datadir = NULL;
+	g_autofree gchar *checkpoint = NULL;
+	g_autofree gchar *image_data = NULL;
+	g_autofree gchar *slot_data = NULL;
+	g_autofree guint8 *old_hashes = NULL;
+	gsize image_len, slot_len;
+	RaucImage *image;
+	RaucSlot *targetslot;
+	img_to_slot_handler handler;
+	RaucStats *stats;
+	guint64 sum_in_place = 0;
+	GError *ierror = NULL;
+
+	/* needs to run as root */
+	if (!test_running_as_root())
+		return;
+
+	slotpath = g_build_filename(fixture->tmpdir, "rootfs-0", NULL);
+	imagepath = write_random_file(fixture->tmpdir, "image.img", IMAGE_SIZE, 0x2abff992);
+	g_assert_nonnull(imagepath);
+
+	/* the first half of the image was written by an interrupted attempt */
+	g_assert_true(g_file_get_contents(imagepath, &image_data, &image_len, NULL));
+	g_assert_cmpuint(image_len, ==, IMAGE_SIZE);
+	{
+		g_autofree gchar *partial = g_malloc0(SLOT_SIZE);
+		memcpy(partial, image_data, IMAGE_SIZE/2);
+		g_assert_true(g_file_set_contents(slotpath, partial, SLOT_SIZE, NULL));
+	}
+
+	/* the stored index still describes the zeroed slot */
+	datadir = g_build_filename(fixture->tmpdir, "rootfs-0-datadir", NULL);
+	{
+		g_autofree gchar *dir = g_build_filename(datadir, "hash-unknown", NULL);
+		g_autofree gchar *path = g_build_filename(dir, "block-hash-index", NULL);
+
+		old_hashes = g_malloc((SLOT_SIZE/4096) * 32);
+		for (guint i = 0; i < SLOT_SIZE/4096; i++)
+			memcpy(old_hashes + i * 32, R_HASH_INDEX_ZERO_CHUNK, 32);
+		g_assert(g_mkdir_with_parents(dir, 0700) == 0);
+		g_assert_true(g_file_set_contents(path, (gchar *)old_hashes, (SLOT_SIZE/4096) * 32, NULL));
+	}
+	{
+		g_autofree gchar *dir = g_build_filename(datadir, "hash-0xdeadbeef", NULL);
+		g_autofree gchar *content = g_strdup_printf("[checkpoint]\nchunks=%d\nchunk-size=4096\n", IMAGE_SIZE/4096/2);
+
+		checkpoint = g_build_filename(dir, "write-checkpoint", NULL);
+		g_assert(g_mkdir_with_parents(dir, 0700) == 0);
+		g_assert_true(g_file_set_contents(checkpoint, content, -1, NULL));
+	}
+
+	image = r_new_image();
+	image->slotclass = g_strdup("rootfs");
+	image->filename = g_strdup(imagepath);
+	image->checksum.size = IMAGE_SIZE;
+	image->checksum.digest = g_strdup("0xdeadbeef");
+	image->adaptive = g_strsplit("block-hash-index", " ", 0);
+
+	targetslot = g_new0(RaucSlot, 1);
+	targetslot->name = g_intern_string("rootfs.0");
+	targetslot->sclass = g_intern_string("rootfs");
+	targetslot->device = g_strdup(slotpath);
+	targetslot->type = g_strdup("raw");
+	targetslot->state = ST_INACTIVE;
+	targetslot->data_directory = g_strdup(datadir);
+
+	handler = get_update_handler(image, targetslot, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_nonnull(handler);
+
+	r_test_stats_start();
+	g_assert_true(handler(image, targetslot, NULL, &ierror));
+	g_assert_no_error(ierror);
+	r_test_stats_stop();
+
+	while ((stats = r_test_stats_next())) {
+		if (g_strcmp0(stats->label, "in-place chunk") == 0)
+			sum_in_place = stats->sum;
+		r_stats_free(stats);
+	}
+
+	/* only the chunks before the checkpoint were reused */
+	g_assert_cmpuint(sum_in_place, ==, IMAGE_SIZE/4096/2);
+	g_assert_false(g_file_test(checkpoint, G_FILE_TEST_EXISTS));
+
+	g_assert_true(g_file_get_contents(slotpath, &slot_data, &slot_len, NULL));
+	g_assert_cmpuint(slot_len, ==, SLOT_SIZE);
+	g_assert_cmpmem(slot_data, IMAGE_SIZE, image_data, IMAGE_SIZE);
+
+	g_assert(g_remove(imagepath) == 0);
+
+	r_free_image(image);
+	r_slot_free(targetslot);
+}
+
+/* Both ways of building an ext4 slot from a tar archive (mkfs.ext4 -d and
+ * extracting into the mounted filesystem) must result in the same owners,
+ * modes, xattrs and label. */
+static void test_archive_to_ext4_metadata(UpdateHandlerFixture *fixture,
+		gconstpointer user_data)
+{
+	UpdateHandlerTestPair *test_pair = (UpdateHandlerTestPair*) user_data;
+	g_autofree gchar *slotpath = NULL;
+	g_autofree gchar *contentpath = NULL;
+	g_autofree gchar *imagepath = NULL;
+	g_autofree gchar *mountprefix = NULL;
+	g_autofree gchar *old_path = NULL;
+	g_autofree gchar *label = NULL;
+	RaucImage *image;
+	RaucSlot *targetslot;
+	img_to_slot_handler handler;
+	GError *ierror = NULL;
+	struct stat st;
+	gchar value[16] = {0};
+
+	/* needs to run as root */
+	if (!test_running_as_root())
+		return;
+
+	slotpath = g_build_filename(fixture->tmpdir, "rootfs-0", NULL);
+
+	/* a directory and a file with owners, modes and an xattr */
+	contentpath = g_build_filename(fixture->tmpdir, "content", NULL);
+	{
+		g_autofree gchar *dir = g_build_filename(contentpath, "etc", NULL);
+		g_autofree gchar *file = g_build_filename(dir, "data", NULL);
+
+		g_assert_cmpint(g_mkdir_with_parents(dir, 0755), ==, 0);
+		g_assert_true(g_file_set_contents(file, "data", -1, NULL));
+		g_assert_cmpint(chown(dir, 1000, 1001), ==, 0);
+		g_assert_cmpint(g_chmod(dir, 0750), ==, 0);
+		g_assert_cmpint(chown(file, 1234, 5678), ==, 0);
+		g_assert_cmpint(g_chmod(file, 0640), ==, 0);
+		g_assert_cmpint(setxattr(file, "trusted.rauc", "test", 4, 0), ==, 0);
+	}
+	imagepath = g_build_filename(fixture->tmpdir, "image.tar", NULL);
+	{
+		const gchar *args[] = {"tar", "--xattrs", "--xattrs-include=*", "--numeric-owner",
+			"-cf", imagepath, "-C", contentpath, ".", NULL};
+		gint status = 0;
+
+		g_assert_true(g_spawn_sync(NULL, (gchar **)args, NULL, G_SPAWN_SEARCH_PATH,
+				NULL, NULL, NULL, NULL, &status, &ierror));
+		g_assert_no_error(ierror);
+		g_assert_true(g_spawn_check_exit_status(status, &ierror));
+		g_assert_no_error(ierror);
+	}
+
+	/* let mkfs.ext4 fail if it should populate the filesystem */
+	if (test_pair->params & TEST_UPDATE_HANDLER_NO_MKFS_ARCHIVE) {
+		g_autofree gchar *bindir = g_build_filename(fixture->tmpdir, "bin", NULL);
+		g_autofree gchar *wrapper = g_build_filename(bindir, "mkfs.ext4", NULL);
+		g_autofree gchar *mkfs = g_find_program_in_path("mkfs.ext4");
+		g_autofree gchar *script = NULL;
+		g_autofree gchar *new_path = NULL;
+
+		g_assert_nonnull(mkfs);
+		script = g_strdup_printf("#!/bin/sh
+"
+				"for arg in \"$@\"; do [ \"$arg\" = \"-d\" ] && exit 1; done
+"
+				"exec %s \"$@\"
+", mkfs);
+		g_assert_cmpint(g_mkdir(bindir, 0755), ==, 0);
+		g_assert_true(g_file_set_contents(wrapper, script, -1, NULL));
+		g_assert_cmpint(g_chmod(wrapper, 0755), ==, 0);
+
+		old_path = g_strdup(g_getenv("PATH"));
+		new_path = g_strdup_printf("%s:%s", bindir, old_path);
+		g_assert_true(g_setenv("PATH", new_path, TRUE));
+	}
+
+	image = r_new_image();
+	image->slotclass = g_strdup("rootfs");
+	image->filename = g_strdup(imagepath);
+	image->checksum.size = get_file_size(imagepath, NULL);
+	image->checksum.digest = g_strdup("0xdeadbeef");
+
+	targetslot = g_new0(RaucSlot, 1);
+	targetslot->name = g_intern_string("rootfs.0");
+	targetslot->sclass = g_intern_string("rootfs");
+	targetslot->device = g_strdup(slotpath);
+	targetslot->type = g_strdup("ext4");
+	targetslot->state = ST_INACTIVE;
+
+	mountprefix = g_build_filename(fixture->tmpdir, "testmount", NULL);
+	replace_strdup(&r_context_conf()->mountprefix, mountprefix);
+	r_context();
+	g_assert(g_mkdir(mountprefix, 0777) == 0);
+
+	handler = get_update_handler(image, targetslot, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_nonnull(handler);
+
+	g_assert_true(handler(image, targetslot, NULL, &ierror));
+	g_assert_no_error(ierror);
+
+	if (old_path)
+		g_assert_true(g_setenv("PATH", old_path, TRUE));
+
+	g_assert(test_mount(slotpath, mountprefix));
+	{
+		g_autofree gchar *dir = g_build_filename(mountprefix, "etc", NULL);
+		g_autofree gchar *file = g_build_filename(dir, "data", NULL);
+
+		g_assert_cmpint(lstat(dir, &st), ==, 0);
+		g_assert_cmpuint(st.st_uid, ==, 1000);
+		g_assert_cmpuint(st.st_gid, ==, 1001);
+		g_assert_cmpuint(st.st_mode & 07777, ==, 0750);
+
+		g_assert_cmpint(lstat(file, &st), ==, 0);
+		g_assert_cmpuint(st.st_uid, ==, 1234);
+		g_assert_cmpuint(st.st_gid, ==, 5678);
+		g_assert_cmpuint(st.st_mode & 07777, ==, 0640);
+		g_assert_cmpint(getxattr(file, "trusted.rauc", value, sizeof(value) - 1), ==, 4);
+		g_assert_cmpstr(value, ==, "test");
+	}
+	g_assert(r_umount(slotpath, NULL));
+
+	{
+		g_autofree gchar *cmd = g_strdup_printf("e2label %s", slotpath);
+
+		g_assert_true(g_spawn_command_line_sync(cmd, &label, NULL, NULL, &ierror));
+		g_assert_no_error(ierror);
+		g_assert_cmpstr(g_strchomp(label), ==, "rootfs.0");
+	}
+
+	r_free_image(image);
+	r_slot_free(targetslot);
+
+	g_assert_cmpint(test_remove(fixture->tmpdir, "image.tar"), ==, 0);
+	g_assert_true(test_rm_tree(fixture->tmpdir, "content"));
+	g_assert_true(test_rm_tree(fixture->tmpdir, "testmount"));
+	if (test_pair->params & TEST_UPDATE_HANDLER_NO_MKFS_ARCHIVE)
+		g_assert_true(test_rm_tree(fixture->tmpdir, "bin"));
+}
+
+static void write_content_file(const gchar *dir, const gchar *name, const gchar *content)
+{
+	g_autofree gchar *path = write_tmp_file(dir, name, content, NULL);
+
+	g_assert_nonnull(path);
+}
+
+/* Creates a tar archive of the content directory and its file index, as
+ * done when creating a bundle with adaptive=file-index. */
+static RaucImage *create_indexed_archive(UpdateHandlerFixture *fixture, const gchar *name, const gchar *digest)
+{
+	g_autofree gchar *contentpath = g_build_filename(fixture->tmpdir, "content", NULL);
+	g_autofree gchar *imagepath = g_build_filename(fixture->tmpdir, name, NULL);
+	g_autofree gchar *indexpath = g_strconcat(imagepath, ".file-index", NULL);
+	g_autoptr(RaucFileIndex) index = NULL;
+	GError *ierror = NULL;
+	RaucImage *image;
+	const gchar *args[] = {"tar", "--xattrs", "--xattrs-include=*", "--numeric-owner",
+		"-cf", imagepath, "-C", contentpath, ".", NULL};
+	gint status = 0;
+
+	g_assert_true(g_spawn_sync(NULL, (gchar **)args, NULL, G_SPAWN_SEARCH_PATH,
+			NULL, NULL, NULL, NULL, &status, &ierror));
+	g_assert_no_error(ierror);
+	g_assert_true(g_spawn_check_exit_status(status, &ierror));
+	g_assert_no_error(ierror);
+
+	index = r_file_index_from_tar(imagepath, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_true(r_file_index_save(index, indexpath, &ierror));
+	g_assert_no_error(ierror);
+
+	image = r_new_image();
+	image->slotclass = g_strdup("rootfs");
+	image->filename = g_strdup(imagepath);
+	image->checksum.size = get_file_size(imagepath, NULL);
+	image->checksum.digest = g_strdup(digest);
+	image->adaptive = g_strsplit("file-index", " ", 0);
+
+	return image;
+}
+
+/* Installs an image with the ext4 archive handler and records its digest as
+ * the current slot content. */
+static void install_indexed_archive(RaucImage *image, RaucSlot *targetslot)
+{
+	img_to_slot_handler handler;
+	GError *ierror = NULL;
+
+	handler = get_update_handler(image, targetslot, &ierror);
+	g_assert_no_error(ierror);
+	g_assert_nonnull(handler);
+
+	g_assert_true(handler(image, targetslot, NULL, &ierror));
+	g_assert_no_error(ierror);
+
+	r_replace_strdup(&targetslot->status->checksum.digest, image->checksum.digest);
+}
+
+static gboolean datadir_has_index(UpdateHandlerFixture *fixture, const gchar *digest)
+{
+	g_autofree gchar *path = g_strdup_printf("%s/rootfs-0-datadir/hash-%s/file-index", fixture->tmpdir, digest);
+
+	return g_file_test(path, G_FILE_TEST_IS_REGULAR);
+}
+
+/* An archive installed with adaptive=file-index is updated in place by the
+ * next installation, unless the slot content doesn't match the index. */
+static void test_archive_in_place(UpdateHandlerFixture *fixture,
+		gconstpointer user_data)
+{
+	g_autofree gchar *slotpath = NULL;
+	g_autofree gchar *contentpath = NULL;
+	g_autofree gchar *mountprefix = NULL;
+	g_autofree gchar *checkpath = NULL;
+	g_autofree gchar *contents = NULL;
+	RaucImage *image;
+	RaucSlot *targetslot;
+	gchar value[16] = {0};
+
+	/* needs to run as root */
+	if (!test_running_as_root())
+		return;
+
+	slotpath = g_build_filename(fixture->tmpdir, "rootfs-0", NULL);
+	contentpath = g_build_filename(fixture->tmpdir, "content", NULL);
+	checkpath = g_build_filename(fixture->tmpdir, "check", NULL);
+	mountprefix = g_build_filename(fixture->tmpdir, "testmount", NULL);
+	g_assert_cmpint(g_mkdir(checkpath, 0755), ==, 0);
+	g_assert_cmpint(g_mkdir(mountprefix, 0777), ==, 0);
+	replace_strdup(&r_context_conf()->mountprefix, mountprefix);
+	r_context();
+
+	g_assert_cmpint(g_mkdir(contentpath, 0755), ==, 0);
+	write_content_file(contentpath, "kept", "kept\n");
+	write_content_file(contentpath, "changed", "old\n");
+	write_content_file(contentpath, "removed", "removed\n");
+	write_content_file(contentpath, "xattr", "xattr\n");
+	{
+		g_autofree gchar *file = g_build_filename(contentpath, "xattr", NULL);
+		g_assert_cmpint(setxattr(file, "trusted.rauc", "one", 3, 0), ==, 0);
+	}
+
+	targetslot = g_new0(RaucSlot, 1);
+	targetslot->name = g_intern_string("rootfs.0");
+	targetslot->sclass = g_intern_string("rootfs");
+	targetslot->device = g_strdup(slotpath);
+	targetslot->type = g_strdup("ext4");
+	targetslot->state = ST_INACTIVE;
+	targetslot->data_directory = g_build_filename(fixture->tmpdir, "rootfs-0-datadir", NULL);
+	targetslot->status = g_new0(RaucSlotStatus, 1);
+
+	/* without an index of the slot content, the full archive is installed */
+	image = create_indexed_archive(fixture, "v1.tar", "1111");
+	install_indexed_archive(image, targetslot);
+	g_clear_pointer(&image, r_free_image);
+	g_assert_true(datadir_has_index(fixture, "1111"));
+
+	/* a file which is not part of the archive is only kept by an in-place update */
+	g_assert(test_mount(slotpath, checkpath));
+	write_content_file(checkpath, "local", "local\n");
+	g_assert(r_umount(slotpath, NULL));
+
+	write_content_file(contentpath, "changed", "new content\n");
+	g_assert_cmpint(test_remove(contentpath, "removed"), ==, 0);
+	write_content_file(contentpath, "added", "added\n");
+	{
+		g_autofree gchar *file = g_build_filename(contentpath, "xattr", NULL);
+		g_assert_cmpint(setxattr(file, "trusted.rauc", "two", 3, 0), ==, 0);
+	}
+
+	image = create_indexed_archive(fixture, "v2.tar", "2222");
+	install_indexed_archive(image, targetslot);
+	g_clear_pointer(&image, r_free_image);
+	g_assert_false(datadir_has_index(fixture, "1111"));
+	g_assert_true(datadir_has_index(fixture, "2222"));
+
+	g_assert(test_mount(slotpath, checkpath));
+	{
+		g_autofree gchar *local = g_build_filename(checkpath, "local", NULL);
+		g_autofree gchar *changed = g_build_filename(checkpath, "changed", NULL);
+		g_autofree gchar *removed = g_build_filename(checkpath, "removed", NULL);
+		g_autofree gchar *added = g_build_filename(checkpath, "added", NULL);
+		g_autofree gchar *xattr = g_build_filename(checkpath, "xattr", NULL);
+
+		g_assert_true(g_file_test(local, G_FILE_TEST_IS_REGULAR));
+		g_assert_true(g_file_get_contents(changed, &contents, NULL, NULL));
+		g_assert_cmpstr(contents, ==, "new content\n");
+		g_clear_pointer(&contents, g_free);
+		g_assert_false(g_file_test(removed, G_FILE_TEST_EXISTS));
+		g_assert_true(g_file_test(added, G_FILE_TEST_IS_REGULAR));
+		g_assert_cmpint(getxattr(xattr, "trusted.rauc", value, sizeof(value) - 1), ==, 3);
+		g_assert_cmpstr(value, ==, "two");
+	}
+
+	/* a kept file which was modified on the slot causes a full installation */
+	{
+		g_autofree gchar *kept = g_build_filename(checkpath, "kept", NULL);
+		g_assert_true(g_file_set_contents(kept, "modified on the slot\n", -1, NULL));
+	}
+	g_assert(r_umount(slotpath, NULL));
+
+	write_content_file(contentpath, "changed", "newer content\n");
+	image = create_indexed_archive(fixture, "v3.tar", "3333");
+	install_indexed_archive(image, targetslot);
+	g_clear_pointer(&image, r_free_image);
+	g_assert_false(datadir_has_index(fixture, "2222"));
+	g_assert_true(datadir_has_index(fixture, "3333"));
+
+	g_assert(test_mount(slotpath, checkpath));
+	{
+		g_autofree gchar *local = g_build_filename(checkpath, "local", NULL);
+		g_autofree gchar *kept = g_build_filename(checkpath, "kept", NULL);
+
+		g_assert_false(g_file_test(local, G_FILE_TEST_EXISTS));
+		g_assert_true(g_file_get_contents(kept, &contents, NULL, NULL));
+		g_assert_cmpstr(contents, ==, "kept\n");
+	}
+	g_assert(r_umount(slotpath, NULL));
+
+	r_slot_free(targetslot);
+
+	for (guint i = 1; i <= 3; i++) {
+		g_autofree gchar *name = g_strdup_printf("v%u.tar", i);
+		g_autofree gchar *indexname = g_strdup_printf("v%u.tar.file-index", i);
+
+		g_assert_cmpint(test_remove(fixture->tmpdir, name), ==, 0);
+		g_assert_cmpint(test_remove(fixture->tmpdir, indexname), ==, 0);
+	}
+	g_assert_true(test_rm_tree(fixture->tmpdir, "content"));
+	g_assert_cmpint(test_rmdir(fixture->tmpdir, "check"), ==, 0);
+	g_assert_true(test_rm_tree(fixture->tmpdir, "testmount"));
+}
+
 int main(int argc, char *argv[])
 {
+	UpdateHandlerTestPair resume_pair = {"raw", "img", TEST_UPDATE_HANDLER_INCR_BLOCK_HASH_IDX, 0, 0};
+	UpdateHandlerTestPair copy_stream_pair = {"raw", "img", TEST_UPDATE_HANDLER_NO_TARGET_DEV, 0, 0};
+	UpdateHandlerTestPair ext4_archive_pairs[] = {
+		{"ext4", "tar", TEST_UPDATE_HANDLER_DEFAULT, 0, 0},
+		{"ext4", "tar", TEST_UPDATE_HANDLER_NO_MKFS_ARCHIVE, 0, 0},
+		{"ext4", "tar", TEST_UPDATE_HANDLER_FILE_INDEX, 0, 0},
+	};
 	UpdateHandlerTestPair testpair_matrix[] = {
 		{"ext4", "tar", TEST_UPDATE_HANDLER_DEFAULT, 0, 0},
 		{"ext4", "ext4", TEST_UPDATE_HANDLER_DEFAULT, 0, 0},
@@ -1133,5 +1754,47 @@ int main(int argc, char *argv[])
 			test_update_handler,
 			update_handler_fixture_tear_down);
 
+	g_test_add("/update_handler/copy_stream",
+			UpdateHandlerFixture,
+			&copy_stream_pair,
+			update_handler_fixture_set_up,
+			test_copy_stream,
+			update_handler_fixture_tear_down);
+
+	g_test_add("/update_handler/write_image_to_devs",
+			UpdateHandlerFixture,
+			&copy_stream_pair,
+			update_handler_fixture_set_up,
+			test_write_image_to_devs,
+			update_handler_fixture_tear_down);
+
+	g_test_add("/update_handler/adaptive/resume",
+			UpdateHandlerFixture,
+			&resume_pair,
+			update_handler_fixture_set_up,
+			test_update_handler_resume,
+			update_handler_fixture_tear_down);
+
+	g_test_add("/update_handler/archive_to_ext4/mkfs",
+			UpdateHandlerFixture,
+			&ext4_archive_pairs[0],
+			update_handler_fixture_set_up,
+			test_archive_to_ext4_metadata,
+			update_handler_fixture_tear_down);
+
+	g_test_add("/update_handler/archive_to_ext4/extract",
+			UpdateHandlerFixture,
+			&ext4_archive_pairs[1],
+			update_handler_fixture_set_up,
+			test_archive_to_ext4_metadata,
+			update_handler_fixture_tear_down);
+
+	g_test_add("/update_handler/archive_to_ext4/in_place",
+			UpdateHandlerFixture,
+			&ext4_archive_pairs[2],
+			update_handler_fixture_set_up,
+			test_archive_in_place,
+			update_handler_fixture_tear_down);
+
 	return g_test_run();
 }
@@ -4,6 +4,7 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <string.h>
 
 #include "utils.h"
 
@@ -83,6 +84,128 @@ static void get_device_size_test(void)
 		g_close(fd, NULL);
 }
 
+static void zero_range_test(void)
+{
+	g_autofree gchar *tmpdir = g_dir_make_tmp("rauc-XXXXXX", NULL);
+	g_autofree gchar *filename = g_build_filename(tmpdir, "data.img", NULL);
+	g_autoptr(GError) error = NULL;
+	g_autofree guint8 *data = g_malloc(3*4096);
+	g_autofree guint8 *zero = g_malloc0(4096);
+	struct stat st = {};
+	gboolean res = FALSE;
+	int fd = -1;
+
+	memset(data, 0xff, 3*4096);
+	fd = g_open(filename, O_RDWR|O_CREAT|O_CLOEXEC, 0600);
+	g_assert_cmpint(fd, >=, 0);
+	g_assert_true(r_pwrite_exact(fd, data, 3*4096, 0, NULL));
+
+	res = r_zero_range(fd, 4096, 4096, &error);
+	if (!res && g_error_matches(error, R_UTILS_ERROR, R_UTILS_ERROR_NOT_SUPPORTED)) {
+		g_test_skip("hole punching not supported by tmp filesystem");
+		goto out;
+	}
+	g_assert_no_error(error);
+	g_assert_true(res);
+
+	/* only the middle chunk is zeroed and the size is unchanged */
+	g_assert_true(r_pread_exact(fd, data, 3*4096, 0, NULL));
+	g_assert_cmphex(data[4096-1], ==, 0xff);
+	g_assert_cmpmem(&data[4096], 4096, zero, 4096);
+	g_assert_cmphex(data[2*4096], ==, 0xff);
+	g_assert_cmpint(fstat(fd, &st), ==, 0);
+	g_assert_cmpint(st.st_size, ==, 3*4096);
+
+	/* a range after the end extends the file */
+	res = r_zero_range(fd, 3*4096, 2*4096, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+	g_assert_cmpint(fstat(fd, &st), ==, 0);
+	g_assert_cmpint(st.st_size, ==, 5*4096);
+	g_assert_true(r_pread_exact(fd, data, 4096, 4*4096, NULL));
+	g_assert_cmpmem(data, 4096, zero, 4096);
+
+out:
+	g_assert_true(g_close(fd, NULL));
+	g_assert_cmpint(g_remove(filename), ==, 0);
+	g_assert_cmpint(g_rmdir(tmpdir), ==, 0);
+}
+
+static void file_set_contents_durable_test(void)
+{
+	g_autofree gchar *tmpdir = g_dir_make_tmp("rauc-XXXXXX", NULL);
+	g_autoptr(GError) error = NULL;
+	g_autofree gchar *name = g_build_filename(tmpdir, "file", NULL);
+	g_autofree gchar *name_bad = g_build_filename(tmpdir, "missing/file", NULL);
+	g_autofree gchar *contents = NULL;
+	g_autoptr(GDir) dir = NULL;
+	gboolean res = FALSE;
+
+	/* test invalid name */
+	res = r_file_set_contents_durable(name_bad, "data", 4, &error);
+	g_assert_false(res);
+	g_assert_error(error, G_FILE_ERROR, G_FILE_ERROR_NOENT);
+	g_clear_error(&error);
+
+	/* test new file */
+	res = r_file_set_contents_durable(name, "first", 5, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+	g_assert_true(g_file_get_contents(name, &contents, NULL, NULL));
+	g_assert_cmpstr(contents, ==, "first");
+	g_clear_pointer(&contents, g_free);
+
+	/* test replacing existing file */
+	res = r_file_set_contents_durable(name, "second", 6, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+	g_assert_true(g_file_get_contents(name, &contents, NULL, NULL));
+	g_assert_cmpstr(contents, ==, "second");
+
+	/* no temporary files are left behind */
+	dir = g_dir_open(tmpdir, 0, NULL);
+	g_assert_nonnull(dir);
+	g_assert_cmpstr(g_dir_read_name(dir), ==, "file");
+	g_assert_null(g_dir_read_name(dir));
+
+	g_assert_true(rm_tree(tmpdir, NULL));
+}
+
+static void copy_fd_data_test(void)
+{
+	g_autofree gchar *tmpdir = g_dir_make_tmp("rauc-XXXXXX", NULL);
+	g_autoptr(GError) error = NULL;
+	g_autofree gchar *src_name = g_build_filename(tmpdir, "src", NULL);
+	g_autofree gchar *dst_name = g_build_filename(tmpdir, "dst", NULL);
+	g_autofree gchar *src_data = NULL;
+	g_autofree gchar *dst_data = NULL;
+	gsize src_len = 3 * 1024 * 1024 + 17;
+	gsize dst_len = 0;
+	g_auto(filedesc) in_fd = -1;
+	g_auto(filedesc) out_fd = -1;
+	gboolean res = FALSE;
+
+	/* larger than a single copy block and not aligned */
+	src_data = g_malloc(src_len);
+	for (gsize i = 0; i < src_len; i++)
+		src_data[i] = i % 251;
+	g_assert_true(g_file_set_contents(src_name, src_data, src_len, NULL));
+
+	in_fd = g_open(src_name, O_RDONLY | O_CLOEXEC, 0);
+	g_assert_cmpint(in_fd, >=, 0);
+	out_fd = g_open(dst_name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	g_assert_cmpint(out_fd, >=, 0);
+
+	res = r_copy_fd_data(in_fd, out_fd, &error);
+	g_assert_no_error(error);
+	g_assert_true(res);
+
+	g_assert_true(g_file_get_contents(dst_name, &dst_data, &dst_len, NULL));
+	g_assert_cmpmem(dst_data, dst_len, src_data, src_len);
+
+	g_assert_true(rm_tree(tmpdir, NULL));
+}
+
 static void update_symlink_test(void)
 {
 	g_autofree gchar *tmpdir = g_dir_make_tmp("rauc-XXXXXX", NULL);
@@ -518,6 +641,69 @@ static void regex_match_test(void)
 	g_assert_null(tmp);
 }
 
+static void buffer_is_zero_test(void)
+{
+	g_autofree guint8 *buf = g_malloc0(4096 + 1);
+
+	g_assert_true(r_buffer_is_zero(buf, 0));
+	g_assert_true(r_buffer_is_zero(buf, 4096 + 1));
+	g_assert_true(r_buffer_is_erased(buf, 4096 + 1));
+
+	/* non-zero data is found in the blocks and in the unaligned tail */
+	for (gsize pos = 0; pos <= 4096; pos += 1021) {
+		buf[pos] = 0x01;
+		g_assert_false(r_buffer_is_zero(buf, 4096 + 1));
+		g_assert_false(r_buffer_is_erased(buf, 4096 + 1));
+		/* only the data before pos is checked */
+		g_assert_true(r_buffer_is_zero(buf, pos));
+
+		buf[pos] = 0xFF;
+		g_assert_false(r_buffer_is_zero(buf, 4096 + 1));
+		g_assert_true(r_buffer_is_erased(buf, 4096 + 1));
+
+		buf[pos] = 0xFE;
+		g_assert_false(r_buffer_is_erased(buf, 4096 + 1));
+		buf[pos] = 0x7F;
+		g_assert_false(r_buffer_is_erased(buf, 4096 + 1));
+
+		buf[pos] = 0x00;
+	}
+
+	/* unaligned start */
+	memset(buf, 0xFF, 4096 + 1);
+	g_assert_true(r_buffer_is_erased(buf + 3, 4096 - 3));
+	buf[4000] = 0x80;
+	g_assert_false(r_buffer_is_erased(buf + 3, 4096 - 3));
+}
+
+static void block_topology_test(void)
+{
+	RaucBlockTopology topology = {0};
+	g_autofree gchar *tmpdir = NULL;
+	g_autofree gchar *filename = NULL;
+	int fd;
+
+	/* regular files have no block topology */
+	tmpdir = g_dir_make_tmp("rauc-XXXXXX", NULL);
+	g_assert_nonnull(tmpdir);
+	filename = g_build_filename(tmpdir, "file", NULL);
+	fd = g_open(filename, O_RDWR | O_CREAT, 0644);
+	g_assert_cmpint(fd, >=, 0);
+	g_assert_false(r_block_topology_probe(fd, &topology));
+	g_assert_cmpuint(topology.write_size, ==, 0);
+	g_assert_cmpuint(r_block_topology_to_boundary(&topology, 1234), ==, 0);
+	g_close(fd, NULL);
+	g_assert_cmpint(g_unlink(filename), ==, 0);
+	g_assert_cmpint(g_rmdir(tmpdir), ==, 0);
+
+	/* boundaries are relative to the whole device */
+	topology.write_size = 4*1024*1024;
+	topology.offset = 1024*1024;
+	g_assert_cmpuint(r_block_topology_to_boundary(&topology, 0), ==, 3*1024*1024);
+	g_assert_cmpuint(r_block_topology_to_boundary(&topology, 3*1024*1024), ==, 0);
+	g_assert_cmpuint(r_block_topology_to_boundary(&topology, 3*1024*1024 + 512), ==, 4*1024*1024 - 512);
+}
+
 int main(int argc, char *argv[])
 {
 	setlocale(LC_ALL, "C");
@@ -529,7 +715,10 @@ int main(int argc, char *argv[])
 	g_test_add_func("/utils/whitespace_removed", whitespace_removed_test);
 	g_test_add_func("/utils/get_sectorsize", get_sectorsize_test);
 	g_test_add_func("/utils/get_device_size", get_device_size_test);
+	g_test_add_func("/utils/zero_range", zero_range_test);
 	g_test_add_func("/utils/update_symlink", update_symlink_test);
+	g_test_add_func("/utils/file_set_contents_durable", file_set_contents_durable_test);
+	g_test_add_func("/utils/copy_fd_data", copy_fd_data_test);
 	g_test_add_func("/utils/fakeroot", fakeroot_test);
 	g_test_add_func("/utils/bytes_unref_to_string", test_bytes_unref_to_string);
 	g_test_add_func("/utils/environ", environ_test);
@@ -537,6 +726,8 @@ int main(int argc, char *argv[])
 	g_test_add_func("/utils/semver_less_equal_test", semver_less_equal_test);
 	g_test_add_func("/utils/format_duration", format_duration_test);
 	g_test_add_func("/utils/regex_match", regex_match_test);
+	g_test_add_func("/utils/buffer_is_zero", buffer_is_zero_test);
+	g_test_add_func("/utils/block_topology", block_topology_test);
 
 	return g_test_run();
 }